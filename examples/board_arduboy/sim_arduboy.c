@@ -246,10 +246,12 @@ void key_release(unsigned char key, int x, int y)
 void
 displayCB (void)
 {
-	const uint8_t seg_remap_default = ssd1306_get_flag (
-			&app_s.ssd1306, SSD1306_FLAG_SEGMENT_REMAP_0);
-	const uint8_t seg_comscan_default = ssd1306_get_flag (
-			&app_s.ssd1306, SSD1306_FLAG_COM_SCAN_NORMAL);
+	// from the frame, the ssd1306 itself belongs to the AVR thread
+	const uint16_t flags = ssd1306_gl_flags();
+	const uint8_t seg_remap_default =
+			(flags >> SSD1306_FLAG_SEGMENT_REMAP_0) & 1;
+	const uint8_t seg_comscan_default =
+			(flags >> SSD1306_FLAG_COM_SCAN_NORMAL) & 1;
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -278,7 +280,8 @@ void timerCB(int i)
 {
 	// restart timer
 	glutTimerFunc(1000/GL_FRAME_PERIOD_US, timerCB, 0);
-	glutPostRedisplay();
+	if (ssd1306_gl_acquire())
+		glutPostRedisplay();
 }
 
 #else
@@ -288,7 +291,8 @@ static avr_cycle_count_t schedule_render(
 			avr_cycle_count_t when,
 			void *param)
 {
-	glutPostRedisplay();
+	if (ssd1306_gl_acquire())
+		glutPostRedisplay();
 	app_s.yield = true;
 	return avr->cycle + avr_usec_to_cycles(avr, GL_FRAME_PERIOD_US);
 }
@@ -325,7 +329,6 @@ int
 main (int argc, char *argv[])
 {
 	char boot_path[1024] = "ATmegaBOOT_168_atmega328.ihex";
-	uint32_t boot_base, boot_size;
 
 	int debug = 0;
 	int verbose = 0;
@@ -351,14 +354,14 @@ main (int argc, char *argv[])
 	}
 	app_s.avr = avr;
 
-	uint8_t * boot = read_ihex_file(boot_path, &boot_size, &boot_base);
-	if (!boot) {
+	avr_init (avr);
+
+	ihex_image_t boot = { .data = avr->flash, .size = avr->flashend + 1 };
+	if (read_ihex_image(boot_path, &boot, 1) <= 0) {
 		fprintf(stderr, "%s: Unable to load %s\n", argv[0], boot_path);
 		exit(1);
 	}
-	printf("hex image 0x%05x: %d bytes\n", boot_base, boot_size);
-
-	avr_init (avr);
+	printf("hex image 0x%05x: %d bytes\n", boot.start, boot.end - boot.start);
 
 	/*
 	BTN_A is wired to INT6 which apparently defaults to level triggered.
@@ -370,9 +373,7 @@ main (int argc, char *argv[])
 	*/
 	avr_extint_set_strict_lvl_trig(avr, EXTINT_IRQ_OUT_INT6, 0);
 
-	memcpy(avr->flash + boot_base, boot, boot_size);
-	free(boot);
-	avr->pc = boot_base;
+	avr->pc = boot.start;
 	/* end of flash, remember we are writing /code/ */
 	avr->codeend = avr->flashend;
 	avr->log = 1 + verbose;
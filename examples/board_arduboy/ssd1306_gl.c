@@ -27,12 +27,30 @@
 #endif
 
 #include "ssd1306_gl.h"
+#include "frame_swap.h"
 
 static float pixel_size = 1.0;
 static uint8_t luma_pixmap[SSD1306_VIRT_COLUMNS*SSD1306_VIRT_PAGES*8];
 
-void update_lumamap(ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t luma_inc)
+/* what the simulation hands to the renderer, which may be another thread */
+typedef struct luma_frame_t {
+	uint16_t flags;
+	uint8_t contrast;
+	uint8_t luma[SSD1306_VIRT_COLUMNS*SSD1306_VIRT_PAGES*8];
+} luma_frame_t;
+
+static frame_swap_t luma_frames;
+
+static bool luma_settled;
+
+int update_lumamap(ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t luma_inc)
 {
+	/* once every pixel is fully on or off, only a VRAM change moves it */
+	if (luma_settled && !ssd1306_get_flag(ssd1306, SSD1306_FLAG_DIRTY))
+		return 0;
+	ssd1306_set_flag(ssd1306, SSD1306_FLAG_DIRTY, 0);
+
+	int changed = 0;
 	uint8_t *column_ptr = luma_pixmap;
 	for (int p = 0; p < SSD1306_VIRT_PAGES; p++) {
 		for (int c = 0; c < SSD1306_VIRT_COLUMNS; c++) {
@@ -49,6 +67,7 @@ void update_lumamap(ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t
 				} else if (luma > 255) {
 					luma = 255;
 				}
+				changed |= column_ptr[px_idx] != luma;
 				column_ptr[px_idx] = luma;
 				px_col >>= 1;
 			}
@@ -56,6 +75,30 @@ void update_lumamap(ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t
 		}
 		column_ptr += SSD1306_VIRT_COLUMNS*7;
 	}
+	luma_settled = !changed;
+
+	/* the display state is part of the frame, it changes it too */
+	luma_frame_t *f = frame_swap_back(&luma_frames);
+	changed |= f->flags != ssd1306->flags ||
+			f->contrast != ssd1306->contrast_register;
+	if (changed) {
+		f->flags = ssd1306->flags;
+		f->contrast = ssd1306->contrast_register;
+		memcpy(f->luma, luma_pixmap, sizeof(f->luma));
+		frame_swap_publish(&luma_frames);
+	}
+	return changed;
+}
+
+int ssd1306_gl_acquire(void)
+{
+	return frame_swap_acquire(&luma_frames) != NULL;
+}
+
+uint16_t ssd1306_gl_flags(void)
+{
+	const luma_frame_t *f = frame_swap_front(&luma_frames);
+	return f->flags;
 }
 
 static inline void gl_set_bg_colour_(uint8_t invert, float opacity)
@@ -84,15 +127,16 @@ static float contrast_to_opacity_(uint8_t contrast)
 
 void ssd1306_gl_render(ssd1306_t *ssd1306)
 {
-	if (!ssd1306_get_flag(ssd1306, SSD1306_FLAG_DISPLAY_ON)) {
+	const luma_frame_t *f = frame_swap_front(&luma_frames);
+	if (!(f->flags & (1 << SSD1306_FLAG_DISPLAY_ON))) {
 		return;
 	}
 
 	glEnable (GL_BLEND);
 	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	
-	float opacity = contrast_to_opacity_(ssd1306->contrast_register);
-	int invert = ssd1306_get_flag (ssd1306, SSD1306_FLAG_DISPLAY_INVERTED);
+	float opacity = contrast_to_opacity_(f->contrast);
+	int invert = (f->flags >> SSD1306_FLAG_DISPLAY_INVERTED) & 1;
 	gl_set_bg_colour_(invert, opacity);
 
 	glTranslatef (0, 0, 0);
@@ -103,7 +147,7 @@ void ssd1306_gl_render(ssd1306_t *ssd1306)
 	glVertex2f (ssd1306->columns*pixel_size, 0);
 	glVertex2f (ssd1306->columns*pixel_size, ssd1306->rows*pixel_size);
 	
-	uint8_t *px_ptr = luma_pixmap;
+	const uint8_t *px_ptr = f->luma;
 	float v_ofs = 0;
 	while (v_ofs < ssd1306->rows*pixel_size) {
 		float h_ofs = 0;
@@ -126,4 +170,6 @@ void ssd1306_gl_init(float pix_size)
 {
 	pixel_size = pix_size;
 	memset(luma_pixmap, 0, sizeof(*luma_pixmap));
+	luma_settled = false;
+	frame_swap_init(&luma_frames, sizeof(luma_frame_t));
 }
@@ -19,6 +19,11 @@
 
 #include <ssd1306_virt.h>
 
-void update_lumamap(ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t luma_inc);
+/* returns non zero if the pixmap changed, and was published */
+int update_lumamap(ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t luma_inc);
+/* takes the last frame published, returns non zero if it's a new one */
+int ssd1306_gl_acquire(void);
+/* the SSD1306_FLAG_* of the frame being rendered */
+uint16_t ssd1306_gl_flags(void);
 void ssd1306_gl_render(ssd1306_t *ssd1306);
 void ssd1306_gl_init(float pix_size);
@@ -48,6 +48,7 @@ avr_t * avr = NULL;
 avr_vcd_t vcd_file;
 ac_input_t ac_input;
 hd44780_t hd44780;
+frame_swap_t hd44780_frames;
 
 int color = 0;
 uint32_t colors[][4] = {
@@ -167,26 +168,21 @@ main(
 	        AVR_IOCTL_IOPORT_GETIRQ('D'), 2));
 
 	hd44780_init(avr, &hd44780, 20, 4);
+	// the display is drawn from the GL thread
+	frame_swap_init(&hd44780_frames, sizeof(hd44780_frame_t));
+	hd44780_set_frames(&hd44780, &hd44780_frames);
 
-	/* Connect Data Lines to Port B, 0-3 */
-	/* These are bidirectional too */
-	for (int i = 0; i < 4; i++) {
-		avr_irq_t * iavr = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i);
-		avr_irq_t * ilcd = hd44780.irq + IRQ_HD44780_D4 + i;
-		// AVR -> LCD
-		avr_connect_irq(iavr, ilcd);
-		// LCD -> AVR
-		avr_connect_irq(ilcd, iavr);
-	}
-	avr_connect_irq(
-			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4),
-			hd44780.irq + IRQ_HD44780_RS);
-	avr_connect_irq(
-			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 5),
-			hd44780.irq + IRQ_HD44780_E);
+	/*
+	 * Port B is wired the way IRQ_HD44780_ALL expects, D4-D7 on 0-3, then
+	 * RS, E and RW, so the whole port goes to the LCD in one IRQ
+	 */
 	avr_connect_irq(
-			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 6),
-			hd44780.irq + IRQ_HD44780_RW);
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN_ALL),
+			hd44780.irq + IRQ_HD44780_ALL);
+	/* The data lines are bidirectional, LCD -> AVR */
+	for (int i = 0; i < 4; i++)
+		avr_connect_irq(hd44780.irq + IRQ_HD44780_D4 + i,
+				avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i));
 
 
 	avr_vcd_init(avr, "gtkwave_output.vcd", &vcd_file, 10 /* usec */);
@@ -105,7 +105,8 @@ timerCB (int i)
 {
 	// restart timer
 	glutTimerFunc (1000 / 64, timerCB, 0);
-	glutPostRedisplay ();
+	if (ssd1306_get_flag (&ssd1306, SSD1306_FLAG_DIRTY))
+		glutPostRedisplay ();
 }
 
 int
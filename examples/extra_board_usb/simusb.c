@@ -114,18 +114,15 @@ int main(int argc, char *argv[])
 	// new one
 	{
 		char path[1024];
-		uint32_t base, size;
 		snprintf(path, sizeof(path), "%s/../%s", pwd, "at90usb162_cdc_loopback.hex");
 
-		uint8_t * boot = read_ihex_file(path, &size, &base);
-		if (!boot) {
+		ihex_image_t boot = { .data = avr->flash, .size = avr->flashend + 1 };
+		if (read_ihex_image(path, &boot, 1) <= 0) {
 			fprintf(stderr, "%s: Unable to load %s\n", argv[0], path);
 			exit(1);
 		}
-		printf("Bootloader %04x: %d\n", base, size);
-		memcpy(avr->flash + base, boot, size);
-		free(boot);
-		avr->pc = base;
+		printf("Bootloader %04x: %d\n", boot.start, boot.end - boot.start);
+		avr->pc = boot.start;
 		avr->codeend = avr->flashend;
 	}
 
@@ -30,31 +30,31 @@
 #include "sim_avr.h"
 #include "button.h"
 
-static avr_cycle_count_t
-button_auto_release(
-		avr_t * avr,
-		avr_cycle_count_t when,
-		void * param)
+static int
+button_body(
+		avr_coro_t * c)
 {
-	button_t * b = (button_t *)param;
+	button_t * b = (button_t *)c->param;
+
+	AVR_CORO_BEGIN(c);
+	avr_raise_irq(b->irq + IRQ_BUTTON_OUT, 0);// press
+	AVR_CORO_WAIT_USEC(c, b->duration_usec);
 	avr_raise_irq(b->irq + IRQ_BUTTON_OUT, 1);
 	printf("button_auto_release\n");
-	return 0;
+	AVR_CORO_END(c);
 }
 
 /*
- * button press. set the "pin" to zerok and register a timer
- * that will reset it in a few usecs
+ * button press. set the "pin" to zero, and back to one in a few usecs;
+ * pressing it again before then starts over
  */
 void
 button_press(
 		button_t * b,
 		uint32_t duration_usec)
 {
-	avr_cycle_timer_cancel(b->avr, button_auto_release, b);
-	avr_raise_irq(b->irq + IRQ_BUTTON_OUT, 0);// press
-	// register the auto-release
-	avr_cycle_timer_register_usec(b->avr, duration_usec, button_auto_release, b);
+	b->duration_usec = duration_usec;
+	avr_coro_start(&b->coro);
 }
 
 void
@@ -65,5 +65,6 @@ button_init(
 {
 	b->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_BUTTON_COUNT, &name);
 	b->avr = avr;
+	avr_coro_init(avr, &b->coro, button_body, b);
 }
 
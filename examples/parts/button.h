@@ -29,6 +29,7 @@
 #define __BUTTON_H__
 
 #include "sim_irq.h"
+#include "sim_coro.h"
 
 enum {
 	IRQ_BUTTON_OUT = 0,
@@ -39,6 +40,8 @@ typedef struct button_t {
 	avr_irq_t * irq;	// output irq
 	struct avr_t * avr;
 	uint8_t value;
+	uint32_t duration_usec;	// of the press going on
+	avr_coro_t coro;
 } button_t;
 
 void
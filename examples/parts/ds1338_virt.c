@@ -32,6 +32,9 @@
 #include "ds1338_virt.h"
 #include "sim_time.h"
 
+static void
+ds1338_virt_square_wave_arm(ds1338_virt_t *p);
+
 
 /*
  * Increment the ds1338 register address.
@@ -39,7 +42,7 @@
 static void
 ds1338_virt_incr_addr(ds1338_virt_t * const p)
 {
-	if (p->reg_addr < sizeof(p->nvram)) {
+	if (p->reg_addr < DS1338_VIRT_NVRAM_SIZE - 1) {
 		p->reg_addr++;
 	} else {
 		// TODO Check if this wraps, or if it just stops incrementing
@@ -51,7 +54,7 @@ ds1338_virt_incr_addr(ds1338_virt_t * const p)
  * Update the system behaviour after a control register is written to.
  */
 static void
-ds1338_virt_update(const ds1338_virt_t * const p)
+ds1338_virt_update(ds1338_virt_t * const p)
 {
 	// The address of the register which was just updated
 	switch (p->reg_addr)
@@ -62,11 +65,13 @@ ds1338_virt_update(const ds1338_virt_t * const p)
 			} else {
 				printf("DS1338 clock stopped\n");
 			}
+			ds1338_virt_square_wave_arm(p);
 			break;
 		case DS1338_VIRT_CONTROL:
 			printf("DS1338 control register updated\n");
 			// TODO: Check if changing the prescaler resets the clock counter
 			// and if so do it here?
+			ds1338_virt_square_wave_arm(p);
 			break;
 		default:
 			// No control register updated
@@ -278,34 +283,42 @@ ds1338_print_time(ds1338_virt_t *p)
 		        hours, minutes, seconds, day, date, month, year, pm);
 }
 
-static avr_cycle_count_t
-ds1338_virt_clock_tick(struct avr_t * avr,
-                       avr_cycle_count_t when,
-                       ds1338_virt_t *p)
+/*
+ * The counter isn't ticked by a timer, it's brought up to date from the
+ * cycle count whenever it's looked at: registers read or written, and the
+ * square wave edges. 'rtc' counts half periods of the crystal, the time
+ * registers tick when it wraps.
+ */
+static void
+ds1338_virt_clock_sync(ds1338_virt_t *p)
 {
-	avr_cycle_count_t next_tick = when + avr_usec_to_cycles(avr, DS1338_CLK_PERIOD_US / 2);
+	avr_t * avr = p->avr;
+	avr_cycle_count_t tick = avr_usec_to_cycles(avr, DS1338_CLK_PERIOD_US / 2);
 
-	if (!ds1338_get_flag(p->nvram[DS1338_VIRT_SECONDS], DS1338_VIRT_CH)) {
-		// Oscillator is enabled. Note that this counter is allowed to wrap.
-		p->rtc++;
-	} else {
-		// Avoid a condition match below with the clock switched off
-		return next_tick;
-	}
+	if (!tick || avr->cycle < p->rtc_cycle + tick)
+		return;
+	avr_cycle_count_t ticks = (avr->cycle - p->rtc_cycle) / tick;
+	p->rtc_cycle += ticks * tick;
 
-	/*
-	 * Update the time
-	 */
-	if (p->rtc == 0) {
-		// 1 second has passed
+	// the oscillator is stopped, the crystal keeps its phase
+	if (ds1338_get_flag(p->nvram[DS1338_VIRT_SECONDS], DS1338_VIRT_CH))
+		return;
+	// Note that this counter is allowed to wrap.
+	avr_cycle_count_t seconds = (p->rtc + ticks) >> 16;
+	p->rtc += ticks;
+	if (!seconds)
+		return;
+	avr_store_touch(&p->store, 0, DS1338_VIRT_NVRAM_SIZE);
+	while (seconds--)
 		ds1338_virt_tick_time(p);
-                if (p->verbose)
-			ds1338_print_time(p);
-	}
+	if (p->verbose)
+		ds1338_print_time(p);
+}
 
-	/*
-	 * Deal with the square wave output
-	 */
+// crystal ticks between two edges of the square wave
+static uint32_t
+ds1338_virt_square_wave_ticks(ds1338_virt_t *p)
+{
 	uint8_t prescaler_mode = ds1338_get_flag(p->nvram[DS1338_VIRT_CONTROL],
 	                                         DS1338_VIRT_RS0)
 	                      + (ds1338_get_flag(p->nvram[DS1338_VIRT_CONTROL],
@@ -314,27 +327,52 @@ ds1338_virt_clock_tick(struct avr_t * avr,
 	switch (prescaler_mode)
 	{
 		case DS1338_VIRT_PRESCALER_DIV_32768:
-			if ((p->rtc + 1) % DS1338_CLK_FREQ == 0) {
-				ds1338_virt_cycle_square_wave(p);
-			}
-			break;
+			return DS1338_CLK_FREQ;
 		case DS1338_VIRT_PRESCALER_DIV_8:
-			if ((p->rtc + 1) % (DS1338_CLK_FREQ / 8) == 0)
-				ds1338_virt_cycle_square_wave(p);
-			break;
+			return DS1338_CLK_FREQ / 8;
 		case DS1338_VIRT_PRESCALER_DIV_4:
-			if ((p->rtc + 1) % (DS1338_CLK_FREQ / 4) == 0)
-				ds1338_virt_cycle_square_wave(p);
-			break;
-		case DS1338_VIRT_PRESCALER_OFF:
-			ds1338_virt_cycle_square_wave(p);
-			break;
+			return DS1338_CLK_FREQ / 4;
 		default:
-			printf("DS1338 ERROR: PRESCALER MODE INVALID\n");
-			break;
+			return 1;
 	}
+}
+
+static avr_cycle_count_t
+ds1338_virt_square_wave_tick(struct avr_t * avr,
+                             avr_cycle_count_t when,
+                             void * param)
+{
+	ds1338_virt_t *p = (ds1338_virt_t *)param;
+
+	ds1338_virt_clock_sync(p);
+	ds1338_virt_cycle_square_wave(p);
+	return when + ds1338_virt_square_wave_ticks(p) *
+			avr_usec_to_cycles(avr, DS1338_CLK_PERIOD_US / 2);
+}
+
+/*
+ * The square wave needs a timer, but only if it's enabled, the oscillator
+ * runs, and something is connected to the pin
+ */
+static void
+ds1338_virt_square_wave_arm(ds1338_virt_t *p)
+{
+	avr_t * avr = p->avr;
+	avr_cycle_count_t tick = avr_usec_to_cycles(avr, DS1338_CLK_PERIOD_US / 2);
 
-	return next_tick;
+	avr_cycle_timer_cancel(avr, ds1338_virt_square_wave_tick, p);
+	if (!tick || !p->irq[DS1338_SQW_IRQ_OUT].hook ||
+			!ds1338_get_flag(p->nvram[DS1338_VIRT_CONTROL], DS1338_VIRT_SQWE) ||
+			ds1338_get_flag(p->nvram[DS1338_VIRT_SECONDS], DS1338_VIRT_CH))
+		return;
+	ds1338_virt_clock_sync(p);
+	// it toggles on the tick that takes 'rtc' to a multiple of the period, less one
+	uint32_t period = ds1338_virt_square_wave_ticks(p);
+	uint32_t ticks = (period - 1 - p->rtc % period) % period;
+	if (!ticks)
+		ticks = period;
+	avr_cycle_timer_register(avr, p->rtc_cycle + ticks * tick - avr->cycle,
+	                         ds1338_virt_square_wave_tick, p);
 }
 
 static void
@@ -342,15 +380,7 @@ ds1338_virt_clock_xtal_init(struct avr_t * avr,
                             ds1338_virt_t *p)
 {
 	p->rtc = 0;
-
-	/*
-	 * Set a timer for half the clock period to allow reconstruction
-	 * of the square wave output at the maximum possible frequency.
-	 */
-	avr_cycle_timer_register_usec(avr,
-	                              DS1338_CLK_PERIOD_US / 2,
-	                              (void *) ds1338_virt_clock_tick,
-	                              p);
+	p->rtc_cycle = avr->cycle;
 
 	printf("DS1338 clock crystal period %duS or %d cycles\n",
 			DS1338_CLK_PERIOD_US,
@@ -416,10 +446,12 @@ ds1338_virt_in_hook(struct avr_irq_t * irq,
 					avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
 			// Write to the selected register (see p13. DS1388 datasheet for details)
 			if (p->reg_selected) {
+				// the time written replaces whatever elapsed until now
+				ds1338_virt_clock_sync(p);
 				if (p->verbose)
 					printf("DS1338 set register 0x%02x to 0x%02x\n", 
 						p->reg_addr, v.u.twi.data);
-				p->nvram[p->reg_addr] = v.u.twi.data;
+				avr_store_write(&p->store, p->reg_addr, v.u.twi.data);
 				ds1338_virt_update(p);
 				ds1338_virt_incr_addr(p);
 			// No register selected so select one
@@ -432,6 +464,7 @@ ds1338_virt_in_hook(struct avr_irq_t * irq,
 		}
 		// Read transaction
 		if (v.u.twi.msg & TWI_COND_READ) {
+			ds1338_virt_clock_sync(p);
 			if (p->verbose)
 				printf("DS1338 READ data at 0x%02x: 0x%02x\n",
 					p->reg_addr, p->nvram[p->reg_addr]);
@@ -452,24 +485,45 @@ static const char * _ds1338_irq_names[DS1338_IRQ_COUNT] = {
 /*
  * Initialise the DS1388 virtual part. This should be called before anything else.
  */
-void
-ds1338_virt_init(struct avr_t * avr,
-                 ds1338_virt_t * p)
+int
+ds1338_virt_init_store(struct avr_t * avr,
+                       ds1338_virt_t * p,
+                       int kind,
+                       const char * name)
 {
 	memset(p, 0, sizeof(*p));
-	memset(p->nvram, 0x00, sizeof(p->nvram));
-	// Default for day counter. Strangely it runs from 1-7.
-	p->nvram[DS1338_VIRT_DAY] = 1;
+	if (avr_store_init(avr, &p->store, kind, name, DS1338_VIRT_NVRAM_SIZE, 0))
+		return -1;
+	p->nvram = p->store.data;
+	if (p->store.created) {
+		// Default for day counter. Strangely it runs from 1-7.
+		p->nvram[DS1338_VIRT_DAY] = 1;
+		// Start with the oscillator disabled, the "battery" was never connected
+		p->nvram[DS1338_VIRT_SECONDS] |=  (1 << DS1338_VIRT_CH);
+	}
 
 	p->avr = avr;
 
 	p->irq = avr_alloc_irq(&avr->irq_pool, 0, DS1338_IRQ_COUNT, _ds1338_irq_names);
 	avr_irq_register_notify(p->irq + TWI_IRQ_OUTPUT, ds1338_virt_in_hook, p);
 
-	// Start with the oscillator disabled, at least until there is some "battery backup"
-	p->nvram[DS1338_VIRT_SECONDS] |=  (1 << DS1338_VIRT_CH);
-
 	ds1338_virt_clock_xtal_init(avr, p);
+	return 0;
+}
+
+void
+ds1338_virt_init(struct avr_t * avr,
+                 ds1338_virt_t * p)
+{
+	ds1338_virt_init_store(avr, p, AVR_STORE_HEAP, NULL);
+}
+
+void
+ds1338_virt_free(ds1338_virt_t * p)
+{
+	avr_cycle_timer_cancel(p->avr, ds1338_virt_square_wave_tick, p);
+	avr_store_free(&p->store);
+	p->nvram = NULL;
 }
 
 /*
@@ -497,5 +551,6 @@ ds1338_virt_attach_square_wave_output(ds1338_virt_t * p,
 	avr_connect_irq(
 		p->irq + DS1338_SQW_IRQ_OUT,
 	        avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ(wiring->port), wiring->pin));
+	ds1338_virt_square_wave_arm(p);
 }
 
@@ -40,6 +40,7 @@
 
 #include "sim_irq.h"
 #include "sim_avr.h"
+#include "sim_store.h"
 #include "avr_ioport.h"
 
 // TWI address is fixed
@@ -58,6 +59,9 @@
 #define DS1338_VIRT_YEAR		0x06
 #define DS1338_VIRT_CONTROL		0x07
 
+// The time registers, the control register, and the RAM
+#define DS1338_VIRT_NVRAM_SIZE		64
+
 /*
  * Seconds register flag - oscillator is enabled when
  * this is set to zero. Undefined on startup.
@@ -155,8 +159,10 @@ typedef struct ds1338_virt_t {
 	uint8_t selected;		// selected address
 	uint8_t reg_selected;		// register selected for write
 	uint8_t reg_addr;		// register pointer
-	uint8_t nvram[64];		// battery backed up NVRAM
+	uint8_t * nvram;		// battery backed up NVRAM, in 'store'
+	avr_store_t store;
 	uint16_t rtc;			// RTC counter
+	avr_cycle_count_t rtc_cycle;	// cycle 'rtc' is up to date with
 	uint8_t square_wave;
 } ds1338_virt_t;
 
@@ -164,6 +170,21 @@ void
 ds1338_virt_init(struct avr_t * avr,
                  ds1338_virt_t * p);
 
+/*
+ * Same, with the NVRAM in a store of 'kind' (AVR_STORE_*) called 'name',
+ * for the battery backup: an existing file or segment keeps the time it
+ * was left with. Returns 0, or -1.
+ */
+int
+ds1338_virt_init_store(struct avr_t * avr,
+                       ds1338_virt_t * p,
+                       int kind,
+                       const char * name);
+
+// releases the NVRAM, flushing it to its file if it has one
+void
+ds1338_virt_free(ds1338_virt_t * p);
+
 /*
  * Attach the ds1307 to the AVR's TWI master code,
  * pass AVR_IOCTL_TWI_GETIRQ(0) for example as i2c_irq_base
@@ -0,0 +1,72 @@
+/*
+	frame_swap.c
+
+	A triple buffer, to hand frames from the simulation thread to a
+	display thread without locking either of them.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_swap.h"
+
+int
+frame_swap_init(
+		frame_swap_t * f,
+		size_t size)
+{
+	memset(f, 0, sizeof(*f));
+	f->mem = calloc(3, size);
+	if (!f->mem)
+		return -1;
+	for (int i = 0; i < 3; i++)
+		f->buf[i] = f->mem + i * size;
+	f->size = size;
+	f->back = 0;
+	f->front = 1;
+	f->spare = 2;
+	return 0;
+}
+
+void
+frame_swap_free(
+		frame_swap_t * f)
+{
+	free(f->mem);
+	memset(f, 0, sizeof(*f));
+}
+
+void
+frame_swap_publish(
+		frame_swap_t * f)
+{
+	uint32_t old = __atomic_exchange_n(&f->spare,
+			f->back | FRAME_SWAP_FRESH, __ATOMIC_ACQ_REL);
+	f->back = old & 3;
+}
+
+const void *
+frame_swap_acquire(
+		frame_swap_t * f)
+{
+	if (!(__atomic_load_n(&f->spare, __ATOMIC_ACQUIRE) & FRAME_SWAP_FRESH))
+		return NULL;
+	uint32_t old = __atomic_exchange_n(&f->spare, f->front, __ATOMIC_ACQ_REL);
+	f->front = old & 3;
+	return f->buf[f->front];
+}
@@ -0,0 +1,86 @@
+/*
+	frame_swap.h
+
+	A triple buffer, to hand frames from the simulation thread to a
+	display thread without locking either of them.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_SWAP_H__
+#define __FRAME_SWAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The producer fills the 'back' buffer and publishes it, which swaps it
+ * with the spare one; the consumer takes the spare one if it's newer than
+ * its 'front' buffer. Each side only ever touches its own buffer, and the
+ * swaps are a single atomic exchange, so the producer never waits, and the
+ * consumer never sees a frame being written. Frames published faster than
+ * they are taken are dropped, only the last one is kept.
+ */
+typedef struct frame_swap_t {
+	uint8_t *	mem;		// the three of them
+	uint8_t *	buf[3];
+	size_t		size;		// of each frame
+	uint32_t	spare;		// index of the spare buffer, | FRAME_SWAP_FRESH
+	uint8_t		back;		// the producer's
+	uint8_t		front;		// the consumer's
+} frame_swap_t;
+
+#define FRAME_SWAP_FRESH	4
+
+// allocates the three buffers of 'size' bytes, cleared. Returns 0, or -1
+int
+frame_swap_init(
+		frame_swap_t * f,
+		size_t size);
+
+void
+frame_swap_free(
+		frame_swap_t * f);
+
+// the frame the producer fills
+static inline void *
+frame_swap_back(
+		frame_swap_t * f)
+{
+	return f->buf[f->back];
+}
+
+// makes the back frame the latest one, and gets a new back frame
+void
+frame_swap_publish(
+		frame_swap_t * f);
+
+/*
+ * Returns the latest frame if one was published since the last call, or
+ * NULL if nothing changed; frame_swap_front() returns it again.
+ */
+const void *
+frame_swap_acquire(
+		frame_swap_t * f);
+
+static inline const void *
+frame_swap_front(
+		frame_swap_t * f)
+{
+	return f->buf[f->front];
+}
+
+#endif /* __FRAME_SWAP_H__ */
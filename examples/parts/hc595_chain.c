@@ -0,0 +1,122 @@
+/*
+	hc595_chain.c
+
+	Any number of daisy chained 74HC595, as one wide shift register.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "hc595_chain.h"
+
+/*
+ * The byte replaces the oldest one, which was in the last chip
+ */
+static void
+hc595_chain_spi_in_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t *)param;
+	uint8_t out = p->value[p->head];
+
+	p->value[p->head] = value;
+	if (++p->head == p->count)
+		p->head = 0;
+	avr_raise_irq(p->irq + IRQ_HC595_CHAIN_SPI_BYTE_OUT, out);
+}
+
+static void
+hc595_chain_latch_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t *)param;
+
+	if (!irq->value || value)	// falling edge
+		return;
+	// chip 0 has the last byte in, just before 'head'
+	for (int i = 0, r = p->head; i < p->count; i++) {
+		r = r ? r - 1 : p->count - 1;
+		p->latch[i] = p->value[r];
+	}
+	if (p->latched)
+		p->latched(p->param, p->latch, p->count);
+	uint32_t v = 0;
+	for (int i = 0; i < 4 && i < p->count; i++)
+		v |= p->latch[i] << (i * 8);
+	avr_raise_irq(p->irq + IRQ_HC595_CHAIN_OUT, v);
+}
+
+static void
+hc595_chain_reset_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t *)param;
+
+	if (irq->value && !value) {	// falling edge
+		memset(p->value, 0, p->count);
+		memset(p->latch, 0, p->count);
+	}
+}
+
+static const char * irq_names[IRQ_HC595_CHAIN_COUNT] = {
+		[IRQ_HC595_CHAIN_SPI_BYTE_IN] = "8<hc595_chain.in",
+		[IRQ_HC595_CHAIN_SPI_BYTE_OUT] = "8>hc595_chain.chain",
+		[IRQ_HC595_CHAIN_IN_LATCH] = "<hc595_chain.latch",
+		[IRQ_HC595_CHAIN_IN_RESET] = "<hc595_chain.reset",
+		[IRQ_HC595_CHAIN_OUT] = "32>hc595_chain.out",
+};
+
+int
+hc595_chain_init(
+		struct avr_t * avr,
+		hc595_chain_t * p,
+		int count)
+{
+	memset(p, 0, sizeof(*p));
+	if (count <= 0)
+		return -1;
+	p->value = calloc(2, count);
+	if (!p->value)
+		return -1;
+	p->latch = p->value + count;
+	p->count = count;
+
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_HC595_CHAIN_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_SPI_BYTE_IN,
+			hc595_chain_spi_in_hook, p);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_IN_LATCH,
+			hc595_chain_latch_hook, p);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_IN_RESET,
+			hc595_chain_reset_hook, p);
+	return 0;
+}
+
+void
+hc595_chain_free(
+		hc595_chain_t * p)
+{
+	free(p->value);
+	p->value = p->latch = NULL;
+	p->count = 0;
+}
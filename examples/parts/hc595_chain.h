@@ -0,0 +1,69 @@
+/*
+	hc595_chain.h
+
+	Any number of daisy chained 74HC595, as one wide shift register.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HC595_CHAIN_H__
+#define __HC595_CHAIN_H__
+
+#include "sim_irq.h"
+
+/*
+ * Same pins as hc595, but for 'count' chips: a byte from the SPI goes
+ * in chip 0, and the byte that was in each chip moves to the next one,
+ * without going through an IRQ per chip. The shift register is a ring
+ * of bytes, so a byte costs the same whatever the length of the chain,
+ * and a latch is one copy of it.
+ *
+ * On the LATCH falling edge, 'latched' is called with the outputs of all
+ * the chips, latch[0] being chip 0, and IRQ_HC595_CHAIN_OUT is raised
+ * with those of the first four, as hc595 does.
+ */
+enum {
+	IRQ_HC595_CHAIN_SPI_BYTE_IN = 0,
+	IRQ_HC595_CHAIN_SPI_BYTE_OUT,	// what falls off the last chip
+	IRQ_HC595_CHAIN_IN_LATCH,
+	IRQ_HC595_CHAIN_IN_RESET,
+	IRQ_HC595_CHAIN_OUT,
+	IRQ_HC595_CHAIN_COUNT
+};
+
+typedef struct hc595_chain_t {
+	avr_irq_t *	irq;
+	int			count;		// of chips
+	uint8_t *	value;		// the shift register, a ring of 'count' bytes
+	int			head;		// where the next byte goes, the oldest one
+	uint8_t *	latch;		// the outputs, of chip 0 to count - 1
+
+	void (*latched)(void * param, const uint8_t * latch, int count);
+	void *		param;
+} hc595_chain_t;
+
+// 'count' chips. Returns 0, or -1
+int
+hc595_chain_init(
+		struct avr_t * avr,
+		hc595_chain_t * p,
+		int count);
+
+void
+hc595_chain_free(
+		hc595_chain_t * p);
+
+#endif /* __HC595_CHAIN_H__ */
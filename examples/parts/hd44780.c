@@ -42,12 +42,34 @@ hd44780_print(
 }
 
 
+static void
+_hd44780_dirty(
+		hd44780_t *b)
+{
+	hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
+	if (b->frames) {
+		hd44780_frame_t * f = frame_swap_back(b->frames);
+		memcpy(f->vram, b->vram, sizeof(f->vram));
+		f->flags = b->flags;
+		frame_swap_publish(b->frames);
+	}
+}
+
+void
+hd44780_set_frames(
+		hd44780_t *b,
+		frame_swap_t * frames)
+{
+	b->frames = frames;
+	_hd44780_dirty(b);
+}
+
 static void
 _hd44780_reset_cursor(
 		hd44780_t *b)
 {
 	b->cursor = 0;
-	hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
+	_hd44780_dirty(b);
 	avr_raise_irq(b->irq + IRQ_HD44780_ADDR, b->cursor);
 }
 
@@ -56,7 +78,7 @@ _hd44780_clear_screen(
 		hd44780_t *b)
 {
 	memset(b->vram, ' ', 80);
-	hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
+	_hd44780_dirty(b);
 	avr_raise_irq(b->irq + IRQ_HD44780_ADDR, b->cursor);
 }
 
@@ -74,6 +96,10 @@ _hd44780_busy_timer(
 {
 	hd44780_t *b = (hd44780_t *) param;
 //	printf("%s called\n", __FUNCTION__);
+	// a command came since it was set, wait for that one instead
+	if (hd44780_get_flag(b, HD44780_FLAG_BUSY) && when < b->busy_until)
+		return b->busy_until;
+	b->busy_timer = 0;
 	hd44780_set_flag(b, HD44780_FLAG_BUSY, 0);
 	avr_raise_irq(b->irq + IRQ_HD44780_BUSY, 0);
 	return 0;
@@ -93,7 +119,7 @@ hd44780_kick_cursor(
 			b->cursor--;
 		else if (b->cursor > 80)
 			b->cursor--;
-		hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
+		_hd44780_dirty(b);
 		avr_raise_irq(b->irq + IRQ_HD44780_ADDR, b->cursor);
 	}
 }
@@ -107,13 +133,13 @@ hd44780_write_data(
 {
 	uint32_t delay = 37; // uS
 	b->vram[b->cursor] = b->datapins;
-	printf("hd44780_write_data %02x\n", b->datapins);
+//	printf("hd44780_write_data %02x\n", b->datapins);
 	if (hd44780_get_flag(b, HD44780_FLAG_S_C)) {	// display shift ?
 		// TODO display shift
 	} else {
 		hd44780_kick_cursor(b);
 	}
-	hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
+	_hd44780_dirty(b);
 	return delay;
 }
 
@@ -130,7 +156,7 @@ hd44780_write_command(
 		if (b->datapins & (1 << top))
 			break;
 		else top--;
-	printf("hd44780_write_command %02x\n", b->datapins);
+//	printf("hd44780_write_command %02x\n", b->datapins);
 
 	switch (top) {
 		// Set	DDRAM address
@@ -162,7 +188,7 @@ hd44780_write_command(
 			hd44780_set_flag(b, HD44780_FLAG_D, b->datapins & 4);
 			hd44780_set_flag(b, HD44780_FLAG_C, b->datapins & 2);
 			hd44780_set_flag(b, HD44780_FLAG_B, b->datapins & 1);
-			hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
+			_hd44780_dirty(b);
 			break;
 		// Entry mode set
 		case 2:		// 0 0 0 0 0 1 I/D S
@@ -251,11 +277,12 @@ hd44780_process_read(
 			b->readpins |= busy ? 0x80 : 0;
 
 		//	if (busy) printf("Good boy, guy's reading status byte\n");
-			// now that we're read the busy flag, clear it and clear
-			// the timer too
-			hd44780_set_flag(b, HD44780_FLAG_BUSY, 0);
-			avr_raise_irq(b->irq + IRQ_HD44780_BUSY, 0);
-			avr_cycle_timer_cancel(b->avr, _hd44780_busy_timer, b);
+			// now that we're read the busy flag, clear it; the timer
+			// will find it clear, and stop
+			if (busy) {
+				hd44780_set_flag(b, HD44780_FLAG_BUSY, 0);
+				avr_raise_irq(b->irq + IRQ_HD44780_BUSY, 0);
+			}
 		}
 		avr_raise_irq(b->irq + IRQ_HD44780_DATA_OUT, b->readpins);
 
@@ -297,17 +324,28 @@ _hd44780_process_e_pinchange(
 	else										// write
 		delay = hd44780_process_write(b);
 
+	/*
+	 * One timer covers the busy time of successive commands, it is only
+	 * registered if it's not already pending, and moves itself along
+	 */
 	if (delay) {
-		hd44780_set_flag(b, HD44780_FLAG_BUSY, 1);
-		avr_raise_irq(b->irq + IRQ_HD44780_BUSY, 1);
-		avr_cycle_timer_register_usec(b->avr, delay,
-			_hd44780_busy_timer, b);
+		b->busy_until = b->avr->cycle + avr_usec_to_cycles(b->avr, delay);
+		if (!hd44780_set_flag(b, HD44780_FLAG_BUSY, 1))
+			avr_raise_irq(b->irq + IRQ_HD44780_BUSY, 1);
+		if (!b->busy_timer) {
+			b->busy_timer = 1;
+			avr_cycle_timer_register_usec(b->avr, delay,
+				_hd44780_busy_timer, b);
+		}
 	}
 //	b->oldstate = b->pinstate;
 	hd44780_set_flag(b, HD44780_FLAG_REENTRANT, 0);
 	return 0;
 }
 
+#define HD44780_ALL_MASK ((0xf << IRQ_HD44780_D4) | (1 << IRQ_HD44780_RS) | \
+		(1 << IRQ_HD44780_E) | (1 << IRQ_HD44780_RW))
+
 static void
 hd44780_pin_changed_hook(
 		struct avr_irq_t * irq,
@@ -319,18 +357,6 @@ hd44780_pin_changed_hook(
 	uint16_t old = b->pinstate;
 
 	switch (irq->irq) {
-		/*
-		 * Update all the pins in one go by calling ourselves
-		 * This is a shortcut for firmware that respects the conventions
-		 */
-		case IRQ_HD44780_ALL:
-			for (int i = 0; i < 4; i++)
-				hd44780_pin_changed_hook(b->irq + IRQ_HD44780_D4 + i,
-						((value >> i) & 1), param);
-			hd44780_pin_changed_hook(b->irq + IRQ_HD44780_RS, (value >> 4), param);
-			hd44780_pin_changed_hook(b->irq + IRQ_HD44780_E, (value >> 5), param);
-			hd44780_pin_changed_hook(b->irq + IRQ_HD44780_RW, (value >> 6), param);
-			return; // job already done!
 		case IRQ_HD44780_D0 ... IRQ_HD44780_D7:
 			// don't update these pins in read mode
 			if (hd44780_get_flag(b, HD44780_FLAG_REENTRANT))
@@ -345,6 +371,32 @@ hd44780_pin_changed_hook(
 		avr_cycle_timer_register(b->avr, 1, _hd44780_process_e_pinchange, b);
 }
 
+/*
+ * All the pins in one go, RW:E:RS:D7:D6:D5:D4 from bit 6 to bit 0, as
+ * from the PIN_ALL IRQ of a port wired that way. Nothing happens until E
+ * rises, and then all the other pins are already there.
+ */
+static void
+hd44780_all_pins_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void *param)
+{
+	hd44780_t *b = (hd44780_t *) param;
+
+	// it's us, driving the data pins for a read
+	if (hd44780_get_flag(b, HD44780_FLAG_REENTRANT))
+		return;
+	uint16_t old = b->pinstate;
+	b->pinstate = (old & ~HD44780_ALL_MASK) |
+			((value & 0xf) << IRQ_HD44780_D4) |
+			(((value >> 4) & 1) << IRQ_HD44780_RS) |
+			(((value >> 5) & 1) << IRQ_HD44780_E) |
+			(((value >> 6) & 1) << IRQ_HD44780_RW);
+	if (!(old & (1 << IRQ_HD44780_E)) && (b->pinstate & (1 << IRQ_HD44780_E)))
+		_hd44780_process_e_pinchange(b->avr, b->avr->cycle, b);
+}
+
 static const char * irq_names[IRQ_HD44780_COUNT] = {
 	[IRQ_HD44780_ALL] = "7=hd44780.pins",
 	[IRQ_HD44780_RS] = "<hd44780.RS",
@@ -380,7 +432,8 @@ hd44780_init(
 	 * Register callbacks on all our IRQs
 	 */
 	b->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_HD44780_COUNT, irq_names);
-	for (int i = 0; i < IRQ_HD44780_INPUT_COUNT; i++)
+	avr_irq_register_notify(b->irq + IRQ_HD44780_ALL, hd44780_all_pins_hook, b);
+	for (int i = IRQ_HD44780_ALL + 1; i < IRQ_HD44780_INPUT_COUNT; i++)
 		avr_irq_register_notify(b->irq + i, hd44780_pin_changed_hook, b);
 
 	_hd44780_reset_cursor(b);
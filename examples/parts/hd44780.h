@@ -48,10 +48,17 @@
 #ifndef __HD44780_H__
 #define __HD44780_H__
 
+#include "sim_avr_types.h"
 #include "sim_irq.h"
+#include "frame_swap.h"
 
 enum {
-    IRQ_HD44780_ALL = 0,	// Only if (msb) RW:E:RS:D7:D6:D5:D4 (lsb)  configured
+    /*
+     * Only if (msb) RW:E:RS:D7:D6:D5:D4 (lsb) configured; the PIN_ALL IRQ
+     * of a port wired that way can be connected here, instead of the pins
+     * one by one, then the part only does something when E rises
+     */
+    IRQ_HD44780_ALL = 0,
     IRQ_HD44780_RS,
     IRQ_HD44780_RW,
     IRQ_HD44780_E,
@@ -91,6 +98,15 @@ enum {
 };
 
 
+/*
+ * What is published in 'frames' each time the display changes
+ */
+typedef struct hd44780_frame_t
+{
+	uint8_t  vram[80 + 64];
+	uint16_t flags;
+} hd44780_frame_t;
+
 typedef struct hd44780_t
 {
 	avr_irq_t * irq;
@@ -106,6 +122,10 @@ typedef struct hd44780_t
 	uint8_t  readpins;
 
 	uint16_t flags;				// LCD flags ( HD44780_FLAG_*)
+	avr_cycle_count_t busy_until;	// of the last command
+	uint8_t	busy_timer;			// the timer clearing BUSY is pending
+	// if set, of hd44780_frame_t, for another thread to display
+	frame_swap_t * frames;
 } hd44780_t;
 
 void
@@ -114,6 +134,15 @@ hd44780_init(
 		struct hd44780_t * b,
 		int width,
 		int height );
+/*
+ * Publishes the content of the display in 'frames', initialized for
+ * hd44780_frame_t, now then each time it changes; hd44780_gl_draw() then
+ * draws from there, and can run in another thread than the AVR.
+ */
+void
+hd44780_set_frames(
+		struct hd44780_t *b,
+		frame_swap_t * frames);
 void
 hd44780_print(
 		struct hd44780_t *b);
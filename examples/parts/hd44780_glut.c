@@ -139,12 +139,19 @@ hd44780_gl_draw(
 	        + (lines - 1) + border, 0);
 	glEnd();
 
+	// from the last frame published, if the part runs in another thread
+	const uint8_t * vram = b->vram;
+	if (b->frames) {
+		frame_swap_acquire(b->frames);
+		vram = ((const hd44780_frame_t *)frame_swap_front(b->frames))->vram;
+	}
+
 	glColor3f(1.0f, 1.0f, 1.0f);
 	const uint8_t offset[] = { 0, 0x40, 0x20, 0x60 };
 	for (int v = 0 ; v < b->h; v++) {
 		glPushMatrix();
 		for (int i = 0; i < b->w; i++) {
-			glputchar(b->vram[offset[v] + i], character, text, shadow);
+			glputchar(vram[offset[v] + i], character, text, shadow);
 			glTranslatef(6, 0, 0);
 		}
 		glPopMatrix();
@@ -27,6 +27,85 @@
 #include "avr_twi.h"
 #include "i2c_eeprom.h"
 
+// a START or STOP ends the current transaction
+static void
+i2c_eeprom_stop(
+		void * param)
+{
+	i2c_eeprom_t * p = (i2c_eeprom_t*)param;
+
+	if (p->selected && p->verbose)
+		printf("eeprom received stop\n");
+	p->selected = 0;
+	p->index = 0;
+	p->reg_addr = 0;
+}
+
+static int
+i2c_eeprom_start(
+		void * param,
+		uint8_t addr)
+{
+	i2c_eeprom_t * p = (i2c_eeprom_t*)param;
+
+	p->selected = 0;
+	p->index = 0;
+	if ((p->addr_base & ~p->addr_mask) != (addr & ~p->addr_mask))
+		return 0;
+	// it's us !
+	if (p->verbose)
+		printf("eeprom received start\n");
+	p->selected = addr;
+	return 1;
+}
+
+/*
+ * This is a write transaction, first receive as many address bytes
+ * as we need, then set the address register, then start
+ * writing data,
+ */
+static int
+i2c_eeprom_write(
+		void * param,
+		uint8_t data)
+{
+	i2c_eeprom_t * p = (i2c_eeprom_t*)param;
+
+	// address size is how many bytes we use for address register
+	int addr_size = p->size > 256 ? 2 : 1;
+	if (p->index < addr_size) {
+		p->reg_addr |= (data << (p->index * 8));
+		if (p->index == addr_size-1) {
+			// add the slave address, if relevant
+			p->reg_addr += ((p->selected & 1) - p->addr_base) << 7;
+			if (p->verbose)
+				printf("eeprom set address to 0x%04x\n", p->reg_addr);
+		}
+	} else {
+		if (p->verbose)
+			printf("eeprom WRITE data 0x%04x: %02x\n", p->reg_addr, data);
+		avr_store_write(&p->store, p->reg_addr++, data);
+	}
+	p->reg_addr &= (p->size -1);
+	p->index++;
+	return 1;
+}
+
+// It's a read transaction, just send the next byte back to the master
+static uint8_t
+i2c_eeprom_read(
+		void * param)
+{
+	i2c_eeprom_t * p = (i2c_eeprom_t*)param;
+
+	if (p->verbose)
+		printf("eeprom READ data 0x%04x: %02x\n", p->reg_addr, p->ee[p->reg_addr]);
+	uint8_t data = p->ee[p->reg_addr++];
+	p->reg_addr &= (p->size -1);
+	p->index++;
+	return data;
+}
+
 /*
  * called when a RESET signal is sent
  */
@@ -43,74 +122,31 @@ i2c_eeprom_in_hook(
 	/*
 	 * If we receive a STOP, check it was meant to us, and reset the transaction
 	 */
-	if (v.u.twi.msg & TWI_COND_STOP) {
-		if (p->selected) {
-			// it was us !
-			if (p->verbose)
-				printf("eeprom received stop\n");
-		}
-		p->selected = 0;
-		p->index = 0;
-		p->reg_addr = 0;
-	}
+	if (v.u.twi.msg & TWI_COND_STOP)
+		i2c_eeprom_stop(p);
 	/*
 	 * if we receive a start, reset status, check if the slave address is
 	 * meant to be us, and if so reply with an ACK bit
 	 */
 	if (v.u.twi.msg & TWI_COND_START) {
-		p->selected = 0;
-		p->index = 0;
-		if ((p->addr_base & ~p->addr_mask) == (v.u.twi.addr & ~p->addr_mask)) {
-			// it's us !
-			if (p->verbose)
-				printf("eeprom received start\n");
-			p->selected = v.u.twi.addr;
+		if (i2c_eeprom_start(p, v.u.twi.addr))
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
-		}
 	}
 	/*
 	 * If it's a data transaction, first check it is meant to be us (we
 	 * received the correct address and are selected)
 	 */
 	if (p->selected) {
-		/*
-		 * This is a write transaction, first receive as many address bytes
-		 * as we need, then set the address register, then start
-		 * writing data,
-		 */
 		if (v.u.twi.msg & TWI_COND_WRITE) {
-			// address size is how many bytes we use for address register
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
-			int addr_size = p->size > 256 ? 2 : 1;
-			if (p->index < addr_size) {
-				p->reg_addr |= (v.u.twi.data << (p->index * 8));
-				if (p->index == addr_size-1) {
-					// add the slave address, if relevant
-					p->reg_addr += ((p->selected & 1) - p->addr_base) << 7;
-					if (p->verbose)
-						printf("eeprom set address to 0x%04x\n", p->reg_addr);
-				}
-			} else {
-				if (p->verbose)
-					printf("eeprom WRITE data 0x%04x: %02x\n", p->reg_addr, v.u.twi.data);
-				p->ee[p->reg_addr++] = v.u.twi.data;
-			}
-			p->reg_addr &= (p->size -1);
-			p->index++;
+			i2c_eeprom_write(p, v.u.twi.data);
 		}
-		/*
-		 * It's a read transaction, just send the next byte back to the master
-		 */
 		if (v.u.twi.msg & TWI_COND_READ) {
-			if (p->verbose)
-				printf("eeprom READ data 0x%04x: %02x\n", p->reg_addr, p->ee[p->reg_addr]);
-			uint8_t data = p->ee[p->reg_addr++];
+			uint8_t data = i2c_eeprom_read(p);
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_READ, p->selected, data));
-			p->reg_addr &= (p->size -1);
-			p->index++;
 		}
 	}
 }
@@ -120,29 +156,59 @@ static const char * _ee_irq_names[2] = {
 		[TWI_IRQ_OUTPUT] = "32<eeprom.in",
 };
 
-void
-i2c_eeprom_init(
+int
+i2c_eeprom_init_store(
 		struct avr_t * avr,
 		i2c_eeprom_t * p,
 		uint8_t addr,
 		uint8_t mask,
-		uint8_t * data,
+		int kind,
+		const char * name,
 		size_t size)
 {
 	memset(p, 0, sizeof(*p));
-	memset(p->ee, 0xff, sizeof(p->ee));
 
 	p->addr_base = addr;
 	p->addr_mask = mask;
 
+	// the address register wraps on a power of two
+	if (size > 65536)
+		size = 65536;
+	while (size & (size - 1))
+		size &= size - 1;
+	if (avr_store_init(avr, &p->store, kind, name, size, 0xff))
+		return -1;
+	p->ee = p->store.data;
+	p->size = size;
+
 	p->irq = avr_alloc_irq(&avr->irq_pool, 0, 2, _ee_irq_names);
 	avr_irq_register_notify(p->irq + TWI_IRQ_OUTPUT, i2c_eeprom_in_hook, p);
+	return 0;
+}
 
-	p->size = size > sizeof(p->ee) ? sizeof(p->ee) : size;
+void
+i2c_eeprom_init(
+		struct avr_t * avr,
+		i2c_eeprom_t * p,
+		uint8_t addr,
+		uint8_t mask,
+		uint8_t * data,
+		size_t size)
+{
+	if (i2c_eeprom_init_store(avr, p, addr, mask, AVR_STORE_HEAP, NULL, size))
+		return;
 	if (data)
 		memcpy(p->ee, data, p->size);
 }
 
+void
+i2c_eeprom_free(
+		i2c_eeprom_t * p)
+{
+	avr_store_free(&p->store);
+	p->ee = NULL;
+}
+
 void
 i2c_eeprom_attach(
 		struct avr_t * avr,
@@ -157,3 +223,21 @@ i2c_eeprom_attach(
 		avr_io_getirq(avr, i2c_irq_base, TWI_IRQ_OUTPUT),
 		p->irq + TWI_IRQ_OUTPUT );
 }
+
+int
+i2c_eeprom_attach_slave(
+		struct avr_t * avr,
+		i2c_eeprom_t * p,
+		char twi )
+{
+	p->slave = (avr_twi_slave_t) {
+		.addr = p->addr_base,
+		.mask = p->addr_mask,
+		.start = i2c_eeprom_start,
+		.write = i2c_eeprom_write,
+		.read = i2c_eeprom_read,
+		.stop = i2c_eeprom_stop,
+		.param = p,
+	};
+	return avr_ioctl(avr, AVR_IOCTL_TWI_ADD_SLAVE(twi), &p->slave);
+}
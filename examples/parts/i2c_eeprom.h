@@ -24,9 +24,11 @@
 #define __I2C_EEPROM_H___
 
 #include "sim_irq.h"
+#include "sim_store.h"
+#include "avr_twi.h"
 
 /*
- * This is a generic i2c eeprom; it can be up to 4096 bytes, and can work
+ * This is a generic i2c eeprom; it can be up to 65536 bytes, and can work
  * in two modes :
  * 1) ONE slave address, and either one or two bytes sent on i2c to specify
  *    the byte to read/write.
@@ -38,6 +40,9 @@
  *    <i2c address; x low bits used as byte offset> <byte offset LSB> [<data>]
  *
  * these two modes seem to cover many eeproms
+ *
+ * The content is an avr_store_t, on the heap unless i2c_eeprom_init_store()
+ * is used; 'ee' points to it.
  */
 typedef struct i2c_eeprom_t {
 	avr_irq_t *	irq;		// irq list
@@ -50,7 +55,9 @@ typedef struct i2c_eeprom_t {
 
 	uint16_t reg_addr;		// read/write address register
 	int size;				// also implies the address size, one or two byte
-	uint8_t ee[4096];
+	uint8_t * ee;
+	avr_store_t store;
+	avr_twi_slave_t slave;	// see i2c_eeprom_attach_slave()
 } i2c_eeprom_t;
 
 /*
@@ -77,6 +84,23 @@ i2c_eeprom_init(
 		uint8_t mask,
 		uint8_t * data,
 		size_t size);
+/*
+ * Same, with the content in a store of 'kind' (AVR_STORE_*) called 'name';
+ * an existing file or segment keeps its content. Returns 0, or -1.
+ */
+int
+i2c_eeprom_init_store(
+		struct avr_t * avr,
+		i2c_eeprom_t * p,
+		uint8_t addr,
+		uint8_t mask,
+		int kind,
+		const char * name,
+		size_t size);
+// releases the content, flushing it to its file if it has one
+void
+i2c_eeprom_free(
+		i2c_eeprom_t * p);
 
 /*
  * Attach the eeprom to the AVR's TWI master code,
@@ -87,5 +111,14 @@ i2c_eeprom_attach(
 		struct avr_t * avr,
 		i2c_eeprom_t * p,
 		uint32_t i2c_irq_base );
+/*
+ * Or register it as a slave of TWI 'twi' (0 for the first one): the master
+ * calls it directly, without the irqs. Returns 0, or -1.
+ */
+int
+i2c_eeprom_attach_slave(
+		struct avr_t * avr,
+		i2c_eeprom_t * p,
+		char twi );
 
 #endif /* __I2C_EEPROM_H___ */
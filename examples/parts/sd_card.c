@@ -0,0 +1,387 @@
+/*
+	sd_card.c
+
+	An SDHC card in SPI mode, backed by a memory mapped image file.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_card.h"
+
+#define SD_BLOCK	512
+
+enum {
+	R1_IDLE			= (1 << 0),
+	R1_ILLEGAL		= (1 << 2),
+	R1_PARAMETER	= (1 << 6),
+};
+
+enum {
+	SD_CMD = 0,		// waiting for, or receiving, a command
+	SD_READ_DATA,	// the token was sent, the block follows
+	SD_READ_CRC,
+	SD_READ_CRC2,
+	SD_READ_NEXT,	// of CMD18, unless a CMD12 comes
+	SD_WRITE_TOKEN,	// of CMD24, or CMD25 if 'multi'
+	SD_WRITE_CRC,
+	SD_WRITE_CRC2,
+	SD_MULTI = 0x100,
+};
+
+static uint8_t
+sd_card_crc7(
+		const uint8_t * buf,
+		int len)
+{
+	uint8_t crc = 0;
+	for (int i = 0; i < len; i++)
+		for (int b = 7; b >= 0; b--) {
+			int bit = ((buf[i] >> b) ^ (crc >> 6)) & 1;
+			crc = ((crc << 1) & 0x7f) ^ (bit ? 0x09 : 0);
+		}
+	return (crc << 1) | 1;
+}
+
+static uint16_t
+sd_card_crc16(
+		const uint8_t * buf,
+		int len)
+{
+	uint16_t crc = 0;
+	for (int i = 0; i < len; i++) {
+		crc ^= buf[i] << 8;
+		for (int b = 0; b < 8; b++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static void
+sd_card_reply(
+		sd_card_t * p,
+		int len)
+{
+	p->slave.reply = p->resp;
+	p->slave.reply_size = len;
+}
+
+// a response, and a 16 bytes register in a data block
+static void
+sd_card_reply_register(
+		sd_card_t * p,
+		uint8_t r1,
+		const uint8_t * reg)
+{
+	p->resp[0] = r1;
+	p->resp[1] = 0xff;
+	p->resp[2] = 0xfe;
+	memcpy(p->resp + 3, reg, 16);
+	uint16_t crc = sd_card_crc16(reg, 16);
+	p->resp[19] = crc >> 8;
+	p->resp[20] = crc;
+	sd_card_reply(p, 21);
+}
+
+static void
+sd_card_command(
+		sd_card_t * p)
+{
+	uint8_t cmd = p->cmd[0] & 0x3f;
+	uint32_t arg = (p->cmd[1] << 24) | (p->cmd[2] << 16) |
+			(p->cmd[3] << 8) | p->cmd[4];
+	uint8_t r1 = p->idle ? R1_IDLE : 0;
+	int app = p->app;
+
+	p->app = 0;
+	p->state = SD_CMD;
+	p->resp[0] = r1;
+	sd_card_reply(p, 1);
+	if (app) {
+		switch (cmd) {
+			case 41:
+				p->idle = 0;
+				p->resp[0] = 0;
+				return;
+			case 23:
+				return;
+		}
+	}
+	switch (cmd) {
+		case 0:
+			p->idle = 1;
+			p->resp[0] = R1_IDLE;
+			break;
+		case 1:
+			p->idle = 0;
+			p->resp[0] = 0;
+			break;
+		case 8:
+			p->resp[1] = 0;
+			p->resp[2] = 0;
+			p->resp[3] = 0x01;		// 2.7-3.6V
+			p->resp[4] = arg;
+			sd_card_reply(p, 5);
+			break;
+		case 9:
+			sd_card_reply_register(p, r1, p->csd);
+			break;
+		case 10:
+			sd_card_reply_register(p, r1, p->cid);
+			break;
+		case 12:	// after a stuff byte
+			p->resp[0] = 0xff;
+			p->resp[1] = r1;
+			sd_card_reply(p, 2);
+			break;
+		case 13:
+			p->resp[1] = 0;
+			sd_card_reply(p, 2);
+			break;
+		case 16:
+		case 59:
+			break;
+		case 17:
+		case 18:
+		case 24:
+		case 25:
+			if (arg >= p->blocks) {
+				p->resp[0] = r1 | R1_PARAMETER;
+				break;
+			}
+			p->block = arg;
+			if (cmd == 17 || cmd == 18) {
+				p->resp[1] = 0xff;
+				p->resp[2] = 0xfe;
+				sd_card_reply(p, 3);
+				p->state = SD_READ_DATA;
+			} else
+				p->state = SD_WRITE_TOKEN;
+			if (cmd == 18 || cmd == 25)
+				p->state |= SD_MULTI;
+			break;
+		case 32:
+			p->erase_start = arg;
+			break;
+		case 33:
+			p->erase_end = arg;
+			break;
+		case 38:
+			if (p->erase_start > p->erase_end || p->erase_end >= p->blocks) {
+				p->resp[0] = r1 | R1_PARAMETER;
+				break;
+			}
+			avr_store_touch(&p->store, (uint64_t)p->erase_start * SD_BLOCK,
+					(uint64_t)(p->erase_end - p->erase_start + 1) * SD_BLOCK);
+			memset(p->data + (uint64_t)p->erase_start * SD_BLOCK, 0xff,
+					(uint64_t)(p->erase_end - p->erase_start + 1) * SD_BLOCK);
+			p->resp[1] = 0;		// busy
+			sd_card_reply(p, 2);
+			break;
+		case 55:
+			p->app = 1;
+			break;
+		case 58:	// OCR, powered up, high capacity
+			p->resp[1] = (p->idle ? 0 : 0x80) | 0x40;
+			p->resp[2] = 0xff;
+			p->resp[3] = 0x80;
+			p->resp[4] = 0;
+			sd_card_reply(p, 5);
+			break;
+		default:
+			p->resp[0] = r1 | R1_ILLEGAL;
+			break;
+	}
+}
+
+static uint8_t
+sd_card_transfer(
+		void * param,
+		uint8_t data)
+{
+	sd_card_t * p = (sd_card_t *)param;
+	uint8_t * block = p->data + (uint64_t)p->block * SD_BLOCK;
+	int multi = p->state & SD_MULTI;
+
+	// a command can come while waiting for a token
+	if ((data & 0xc0) == 0x40 && !p->cmd_len &&
+			((p->state & ~SD_MULTI) == SD_READ_NEXT ||
+			(p->state & ~SD_MULTI) == SD_WRITE_TOKEN))
+		p->state = SD_CMD;
+
+	switch (p->state & ~SD_MULTI) {
+		case SD_CMD:
+			if (!p->cmd_len && (data & 0xc0) != 0x40)
+				break;
+			p->cmd[p->cmd_len++] = data;
+			if (p->cmd_len == sizeof(p->cmd)) {
+				p->cmd_len = 0;
+				sd_card_command(p);
+			}
+			break;
+		case SD_READ_DATA:
+			p->crc = sd_card_crc16(block, SD_BLOCK);
+			p->slave.reply = block + 1;
+			p->slave.reply_size = SD_BLOCK - 1;
+			p->state = SD_READ_CRC | multi;
+			return block[0];
+		case SD_READ_CRC:
+			p->state = SD_READ_CRC2 | multi;
+			return p->crc >> 8;
+		case SD_READ_CRC2:
+			p->state = multi ? SD_READ_NEXT | multi : SD_CMD;
+			return p->crc;
+		case SD_READ_NEXT:
+			if (++p->block >= p->blocks) {
+				p->state = SD_CMD;
+				return 0x08;	// out of range error token
+			}
+			p->state = SD_READ_DATA | multi;
+			return 0xfe;
+		case SD_WRITE_TOKEN:
+			if (data == 0xfd && multi) {	// stop tran, and busy
+				p->state = SD_CMD;
+				p->resp[0] = 0;
+				sd_card_reply(p, 1);
+			} else if (data == (multi ? 0xfc : 0xfe)) {
+				if (p->block >= p->blocks) {
+					p->state = SD_CMD;
+					break;
+				}
+				avr_store_touch(&p->store, (uint64_t)p->block * SD_BLOCK, SD_BLOCK);
+				p->slave.sink = block;
+				p->slave.sink_size = SD_BLOCK;
+				p->state = SD_WRITE_CRC | multi;
+			}
+			break;
+		case SD_WRITE_CRC:
+			p->state = SD_WRITE_CRC2 | multi;
+			break;
+		case SD_WRITE_CRC2:
+			// accepted, then busy for a byte
+			p->resp[0] = 0x05;
+			p->resp[1] = 0;
+			sd_card_reply(p, 2);
+			p->block++;
+			p->state = multi ? SD_WRITE_TOKEN | multi : SD_CMD;
+			break;
+	}
+	return 0xff;
+}
+
+// deselecting the card ends the transfer, or the command, under way
+static void
+sd_card_select(
+		void * param,
+		int selected)
+{
+	sd_card_t * p = (sd_card_t *)param;
+
+	if (selected)
+		return;
+	p->state = SD_CMD;
+	p->cmd_len = 0;
+	p->slave.reply_size = p->slave.sink_size = 0;
+}
+
+int
+sd_card_init_store(
+		struct avr_t * avr,
+		sd_card_t * p,
+		int kind,
+		const char * name,
+		uint64_t size)
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->idle = 1;
+
+	size &= ~((512ull << 10) - 1);
+	if (avr_store_init(avr, &p->store, kind, name, size, 0))
+		return -1;
+	// a store that came with its own size
+	size = p->store.size & ~((512ull << 10) - 1);
+	if (!size || size / SD_BLOCK > 0xffffffffull) {
+		fprintf(stderr, "%s: %s can't be a card of %llu bytes\n", __func__,
+				name ? name : "heap", (unsigned long long)size);
+		avr_store_free(&p->store);
+		return -1;
+	}
+	p->data = p->store.data;
+	p->size = size;
+	p->blocks = size / SD_BLOCK;
+
+	// CSD version 2.0, 25MHz, 512 bytes blocks, and the size
+	static const uint8_t csd[16] = {
+			0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00, 0x00,
+			0x00, 0x00, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x00 };
+	uint32_t c_size = (size >> 19) - 1;
+	memcpy(p->csd, csd, sizeof(csd));
+	p->csd[7] = (c_size >> 16) & 0x3f;
+	p->csd[8] = c_size >> 8;
+	p->csd[9] = c_size;
+	p->csd[15] = sd_card_crc7(p->csd, 15);
+	static const uint8_t cid[16] = {
+			0x00, 'S', 'A', 'S', 'I', 'M', 'A', 'V',
+			0x10, 0x00, 0x00, 0x00, 0x01, 0x01, 0x1a, 0x00 };
+	memcpy(p->cid, cid, sizeof(cid));
+	p->cid[15] = sd_card_crc7(p->cid, 15);
+
+	p->slave = (avr_spi_slave_t) {
+		.transfer = sd_card_transfer,
+		.select = sd_card_select,
+		.param = p,
+	};
+	return 0;
+}
+
+int
+sd_card_init(
+		struct avr_t * avr,
+		sd_card_t * p,
+		const char * filename,
+		uint64_t size)
+{
+	return sd_card_init_store(avr, p, AVR_STORE_FILE, filename, size);
+}
+
+int
+sd_card_attach(
+		sd_card_t * p,
+		char spi,
+		char port,
+		uint8_t pin)
+{
+	p->spi = spi;
+	p->slave.port = port;
+	p->slave.pin = pin;
+	return avr_ioctl(p->avr, AVR_IOCTL_SPI_ADD_SLAVE(spi), &p->slave);
+}
+
+void
+sd_card_stop(
+		sd_card_t * p)
+{
+	if (!p->data)
+		return;
+	if (p->slave.cs)
+		avr_ioctl(p->avr, AVR_IOCTL_SPI_DEL_SLAVE(p->spi), &p->slave);
+	avr_store_free(&p->store);
+	p->data = NULL;
+}
@@ -0,0 +1,97 @@
+/*
+	sd_card.h
+
+	An SDHC card in SPI mode, backed by a memory mapped image file.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SD_CARD_H___
+#define __SD_CARD_H___
+
+#include "sim_avr.h"
+#include "sim_store.h"
+#include "avr_spi.h"
+
+/*
+ * The card answers the commands the usual SPI mode drivers use: CMD0,
+ * CMD8, CMD55/ACMD41 (and CMD1), CMD58, CMD9/CMD10, CMD12, CMD13, CMD16,
+ * CMD17/CMD18, CMD24/CMD25, CMD32/CMD33/CMD38, CMD59 and ACMD23. It is
+ * block addressed; the CRCs are never checked, but the ones it sends are
+ * right.
+ *
+ * The image is a file mapped shared: the blocks the firmware writes are
+ * in the file as soon as they are received, and only the ones used are
+ * ever read, so the size of the image doesn't matter. The blocks are sent
+ * and received in bulk, straight from and to the mapping.
+ */
+typedef struct sd_card_t {
+	struct avr_t *	avr;
+	avr_spi_slave_t	slave;
+	char			spi;		// the bus it's on
+	uint8_t *		data;		// in 'store'
+	uint64_t		size;		// a multiple of 512KB
+	avr_store_t		store;
+	uint32_t		blocks;
+	uint8_t			csd[16], cid[16];
+
+	uint8_t			idle, app;
+	int				state;
+	uint8_t			cmd[6];
+	int				cmd_len;
+	uint32_t		block;		// being read or written
+	uint32_t		erase_start, erase_end;
+	uint16_t		crc;		// of the block being sent
+	uint8_t			resp[24];	// the current response
+} sd_card_t;
+
+/*
+ * Maps the image 'filename', creating it if it doesn't exist. 'size' is
+ * the size of the card, the file is extended if it's shorter; 0 uses the
+ * size of the file. Returns 0, or -1.
+ */
+int
+sd_card_init(
+		struct avr_t * avr,
+		sd_card_t * p,
+		const char * filename,
+		uint64_t size);
+/*
+ * Same, with the image in a store of 'kind' (AVR_STORE_*), 'name'; a
+ * private mapping lets instances share an image, see sim_store.h
+ */
+int
+sd_card_init_store(
+		struct avr_t * avr,
+		sd_card_t * p,
+		int kind,
+		const char * name,
+		uint64_t size);
+
+// puts the card on SPI bus 'spi', selected by 'port', 'pin'. Returns 0, or -1
+int
+sd_card_attach(
+		sd_card_t * p,
+		char spi,
+		char port,
+		uint8_t pin);
+
+// flushes the image, and unmaps it, or frees the store
+void
+sd_card_stop(
+		sd_card_t * p);
+
+#endif /* __SD_CARD_H___ */
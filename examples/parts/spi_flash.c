@@ -0,0 +1,269 @@
+/*
+	spi_flash.c
+
+	A W25Qxx style SPI NOR flash, backed by a memory mapped file.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "spi_flash.h"
+#include "sim_time.h"
+
+enum {
+	FLASH_BUSY	= (1 << 0),
+	FLASH_WEL	= (1 << 1),
+};
+
+static int
+spi_flash_busy(
+		spi_flash_t * p)
+{
+	return p->avr->cycle < p->busy_until;
+}
+
+// a program or an erase, which ends the write enable
+static void
+spi_flash_done(
+		spi_flash_t * p,
+		uint32_t usec)
+{
+	p->status &= ~FLASH_WEL;
+	p->busy_until = p->avr->cycle + avr_usec_to_cycles(p->avr, usec);
+}
+
+static void
+spi_flash_erase(
+		spi_flash_t * p,
+		uint64_t size)
+{
+	uint64_t addr = p->addr & (p->size - 1) & ~(size - 1);
+	if (size > p->size)
+		size = p->size;
+	avr_store_touch(&p->store, addr, size);
+	memset(p->data + addr, 0xff, size);
+	spi_flash_done(p, p->erase_usec);
+}
+
+/*
+ * The writes happen once the chip is deselected, if the whole command,
+ * and its address, were received
+ */
+static void
+spi_flash_select(
+		void * param,
+		int selected)
+{
+	spi_flash_t * p = (spi_flash_t *)param;
+	int complete = p->index > (p->addr4 ? 4 : 3);
+
+	if (selected)
+		return;
+	if (p->status & FLASH_WEL) {
+		switch (p->cmd) {
+			case 0x02: {	// page program, bits can only be cleared
+				if (p->page_count < 0)
+					break;
+				uint64_t addr = (p->addr & (p->size - 1)) & ~0xff;
+				uint8_t * d = p->data + addr;
+				avr_store_touch(&p->store, addr, 256);
+				for (int i = 0; i < 256; i++)
+					d[i] &= p->page[i];
+				spi_flash_done(p, p->program_usec);
+			}	break;
+			case 0x20:
+				if (complete)
+					spi_flash_erase(p, 4096);
+				break;
+			case 0x52:
+				if (complete)
+					spi_flash_erase(p, 32768);
+				break;
+			case 0xd8:
+				if (complete)
+					spi_flash_erase(p, 65536);
+				break;
+			case 0xc7:
+			case 0x60:
+				p->addr = 0;
+				spi_flash_erase(p, p->size);
+				break;
+		}
+	}
+	p->cmd = 0;
+	p->index = 0;
+	p->slave.reply_size = p->slave.sink_size = 0;
+}
+
+static uint8_t
+spi_flash_transfer(
+		void * param,
+		uint8_t data)
+{
+	spi_flash_t * p = (spi_flash_t *)param;
+	int alen = p->addr4 ? 4 : 3;
+
+	if (p->index++ == 0) {
+		p->cmd = data;
+		p->addr = 0;
+		// only the status can be read while it's busy
+		if (spi_flash_busy(p) && data != 0x05 && data != 0x35) {
+			p->cmd = 0;
+			return 0xff;
+		}
+		switch (data) {
+			case 0x06: p->status |= FLASH_WEL; break;
+			case 0x04: p->status &= ~FLASH_WEL; break;
+			case 0xb7: p->addr4 = 1; break;
+			case 0xe9: p->addr4 = 0; break;
+			case 0x9f:
+				p->slave.reply = p->jedec;
+				p->slave.reply_size = sizeof(p->jedec);
+				break;
+			case 0x02:
+				p->page_count = -1;
+				break;
+		}
+		return 0xff;
+	}
+	switch (p->cmd) {
+		case 0x05:
+			return p->status | (spi_flash_busy(p) ? FLASH_BUSY : 0);
+		case 0x35:
+			return 0;
+		case 0x03: case 0x0b:
+		case 0x02:
+		case 0x20: case 0x52: case 0xd8:
+			if (p->index - 1 <= alen) {
+				p->addr = (p->addr << 8) | data;
+				if (p->index - 1 < alen)
+					break;
+				p->addr &= p->size - 1;
+			}
+			if (p->cmd == 0x03 || (p->cmd == 0x0b && p->index - 1 > alen)) {
+				// the bytes from there to the end, then again from the start
+				if (p->index - 1 > alen + (p->cmd == 0x0b)) {
+					p->addr = 0;
+					p->slave.reply = p->data + 1;
+					p->slave.reply_size = p->size - 1;
+					return p->data[0];
+				}
+				p->slave.reply = p->data + p->addr;
+				p->slave.reply_size = p->size - p->addr;
+			} else if (p->cmd == 0x02) {
+				// the page buffer wraps around, as on the parts
+				int offset = p->page_count < 0 ? p->addr & 0xff : 0;
+				if (p->page_count < 0)
+					memset(p->page, 0xff, sizeof(p->page));
+				else
+					p->page[offset++] = data;
+				p->page_count = 1;
+				p->slave.sink = p->page + offset;
+				p->slave.sink_size = sizeof(p->page) - offset;
+			}
+			break;
+		case 0x90:	// manufacturer and device ID, after 3 dummy bytes
+		case 0xab:
+			if (p->index - 1 == 3) {
+				p->id[0] = p->id[2] = p->jedec[0];
+				p->id[1] = p->id[3] = p->jedec[2] - 1;
+				p->slave.reply = p->cmd == 0x90 ? p->id : p->id + 1;
+				p->slave.reply_size = p->cmd == 0x90 ? 4 : 1;
+			}
+			break;
+	}
+	return 0xff;
+}
+
+int
+spi_flash_init_store(
+		struct avr_t * avr,
+		spi_flash_t * p,
+		int kind,
+		const char * name,
+		uint64_t size)
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+
+	if (size > (1ull << 31))
+		size = 1ull << 31;
+	while (size & (size - 1))
+		size &= size - 1;
+	if (avr_store_init(avr, &p->store, kind, name, size, 0xff))
+		return -1;
+	// a store that came with its own size
+	size = p->store.size;
+	if (size > (1ull << 31))
+		size = 1ull << 31;
+	while (size & (size - 1))
+		size &= size - 1;
+	if (size < 4096) {
+		fprintf(stderr, "%s: %s can't be a flash of %llu bytes\n", __func__,
+				name ? name : "heap", (unsigned long long)size);
+		avr_store_free(&p->store);
+		return -1;
+	}
+	p->data = p->store.data;
+	p->size = size;
+	p->jedec[0] = 0xef;		// winbond
+	p->jedec[1] = 0x40;
+	p->jedec[2] = __builtin_ctzll(size);
+	p->slave = (avr_spi_slave_t) {
+		.transfer = spi_flash_transfer,
+		.select = spi_flash_select,
+		.param = p,
+	};
+	return 0;
+}
+
+int
+spi_flash_init(
+		struct avr_t * avr,
+		spi_flash_t * p,
+		const char * filename,
+		uint64_t size)
+{
+	return spi_flash_init_store(avr, p, AVR_STORE_FILE, filename, size);
+}
+
+int
+spi_flash_attach(
+		spi_flash_t * p,
+		char spi,
+		char port,
+		uint8_t pin)
+{
+	p->spi = spi;
+	p->slave.port = port;
+	p->slave.pin = pin;
+	return avr_ioctl(p->avr, AVR_IOCTL_SPI_ADD_SLAVE(spi), &p->slave);
+}
+
+void
+spi_flash_stop(
+		spi_flash_t * p)
+{
+	if (!p->data)
+		return;
+	if (p->slave.cs)
+		avr_ioctl(p->avr, AVR_IOCTL_SPI_DEL_SLAVE(p->spi), &p->slave);
+	avr_store_free(&p->store);
+	p->data = NULL;
+}
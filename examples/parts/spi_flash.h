@@ -0,0 +1,102 @@
+/*
+	spi_flash.h
+
+	A W25Qxx style SPI NOR flash, backed by a memory mapped file.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SPI_FLASH_H___
+#define __SPI_FLASH_H___
+
+#include "sim_avr.h"
+#include "sim_store.h"
+#include "avr_spi.h"
+
+/*
+ * The commands supported are the common ones of the Winbond parts:
+ * 0x9f JEDEC ID, 0x90 manufacturer/device ID, 0xab release power down,
+ * 0x05/0x35 status, 0x06/0x04 write enable/disable, 0x03 read, 0x0b fast
+ * read, 0x02 page program, 0x20/0x52/0xd8 4K/32K/64K erase, 0xc7/0x60
+ * chip erase, and 0xb7/0xe9 to enter/exit the 4 bytes address mode.
+ *
+ * The content is a file mapped shared: what the firmware programs is in
+ * the file as soon as it's done, and only the pages it touches are read.
+ * Programs and erases happen when the chip select goes high, as on the
+ * real parts; they keep the BUSY bit for 'program_usec'/'erase_usec',
+ * 0 by default.
+ */
+typedef struct spi_flash_t {
+	struct avr_t *	avr;
+	avr_spi_slave_t	slave;
+	char			spi;		// the bus it's on
+	uint8_t *		data;		// in 'store'
+	uint64_t		size;		// a power of two
+	avr_store_t		store;
+	uint8_t			jedec[3];	// manufacturer, type, capacity
+	uint8_t			id[4];		// the 0x90 and 0xab replies
+
+	uint32_t		program_usec, erase_usec;
+	avr_cycle_count_t	busy_until;
+
+	uint8_t			status;		// WEL is bit 1, BUSY bit 0 is computed
+	uint8_t			addr4;		// 4 bytes addresses
+	// the command being received
+	uint8_t			cmd;
+	int				index;		// bytes received since the command
+	uint32_t		addr;
+	uint8_t			page[256];	// being programmed
+	int				page_count;
+} spi_flash_t;
+
+/*
+ * Maps 'filename' as the content of the flash, creating it, erased, if
+ * it doesn't exist. 'size' is the size of the part, or 0 to use the size
+ * of the file; it's rounded down to a power of two, up to 2GB. Returns 0,
+ * or -1.
+ */
+int
+spi_flash_init(
+		struct avr_t * avr,
+		spi_flash_t * p,
+		const char * filename,
+		uint64_t size);
+/*
+ * Same, with the content in a store of 'kind' (AVR_STORE_*), 'name'; a
+ * private mapping lets instances share an image, see sim_store.h
+ */
+int
+spi_flash_init_store(
+		struct avr_t * avr,
+		spi_flash_t * p,
+		int kind,
+		const char * name,
+		uint64_t size);
+
+// puts the flash on SPI bus 'spi', selected by 'port', 'pin'. Returns 0, or -1
+int
+spi_flash_attach(
+		spi_flash_t * p,
+		char spi,
+		char port,
+		uint8_t pin);
+
+// flushes the file, and unmaps it, or frees the store
+void
+spi_flash_stop(
+		spi_flash_t * p);
+
+#endif /* __SPI_FLASH_H___ */
@@ -30,13 +30,92 @@
 #include "avr_twi.h"
 #include "avr_ioport.h"
 
+static void
+ssd1306_mark_dirty (ssd1306_t *part, uint8_t page, uint8_t first, uint8_t last)
+{
+	if (!(part->dirty_pages & (1 << page))) {
+		part->dirty_pages |= 1 << page;
+		part->dirty[page].first = first;
+		part->dirty[page].last = last;
+	} else {
+		if (first < part->dirty[page].first)
+			part->dirty[page].first = first;
+		if (last > part->dirty[page].last)
+			part->dirty[page].last = last;
+	}
+	ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+}
+
+static void
+ssd1306_publish (ssd1306_t *part)
+{
+	if (!part->frames)
+		return;
+	ssd1306_frame_t * f = frame_swap_back (part->frames);
+	memcpy (f->vram, part->vram, sizeof(f->vram));
+	f->flags = part->flags;
+	f->contrast_register = part->contrast_register;
+	frame_swap_publish (part->frames);
+}
+
+static void
+ssd1306_frame_done (ssd1306_t *part)
+{
+	ssd1306_publish (part);
+	avr_raise_irq (part->irq + IRQ_SSD1306_FRAME, part->dirty_pages);
+}
+
+void
+ssd1306_set_frames (ssd1306_t * part, frame_swap_t * frames)
+{
+	part->frames = frames;
+	ssd1306_publish (part);
+}
+
+/*
+ * The display state changed, all of it has to be redrawn
+ */
+static void
+ssd1306_mark_all_dirty (ssd1306_t *part)
+{
+	for (int p = 0; p < SSD1306_VIRT_PAGES; p++)
+		ssd1306_mark_dirty (part, p, 0, SSD1306_VIRT_COLUMNS - 1);
+	ssd1306_frame_done (part);
+}
+
+int
+ssd1306_get_dirty (ssd1306_t * part,
+                   ssd1306_region_t region[SSD1306_VIRT_PAGES])
+{
+	int count = 0;
+
+	for (int p = 0; p < SSD1306_VIRT_PAGES; p++) {
+		if (!(part->dirty_pages & (1 << p)))
+			continue;
+		region[count].page = p;
+		region[count].column = part->dirty[p].first;
+		region[count].width = part->dirty[p].last - part->dirty[p].first + 1;
+		count++;
+	}
+	part->dirty_pages = 0;
+	return count;
+}
+
 /*
  * Write a byte at the current cursor location and then scroll the cursor.
  */
 static void
 ssd1306_write_data (ssd1306_t *part)
 {
-	part->vram[part->cursor.page][part->cursor.column] = part->spi_data;
+	uint8_t * vram = &part->vram[part->cursor.page][part->cursor.column];
+	if (*vram != part->spi_data) {
+		*vram = part->spi_data;
+		ssd1306_mark_dirty (part, part->cursor.page,
+		                    part->cursor.column, part->cursor.column);
+	}
+	if (part->cursor.column == SSD1306_VIRT_COLUMNS - 1 &&
+			part->cursor.page == part->pages - 1)
+		ssd1306_frame_done (part);
 
 	// Scroll the cursor
 	if (++(part->cursor.column) >= SSD1306_VIRT_COLUMNS)
@@ -48,8 +127,6 @@ ssd1306_write_data (ssd1306_t *part)
 			part->cursor.page = 0;
 		}
 	}
-
-	ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
 }
 
 /*
@@ -70,26 +147,26 @@ ssd1306_update_command_register (ssd1306_t *part)
 		case SSD1306_VIRT_DISP_NORMAL:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_INVERTED,
 			                  0);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_mark_all_dirty (part);
 			//printf ("SSD1306: DISPLAY NORMAL\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_DISP_INVERTED:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_INVERTED,
 			                  1);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_mark_all_dirty (part);
 			//printf ("SSD1306: DISPLAY INVERTED\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_DISP_SUSPEND:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_ON, 0);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_mark_all_dirty (part);
 			//printf ("SSD1306: DISPLAY SUSPENDED\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_DISP_ON:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_ON, 1);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_mark_all_dirty (part);
 			//printf ("SSD1306: DISPLAY ON\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
@@ -193,7 +270,7 @@ ssd1306_update_setting (ssd1306_t *part)
 	{
 		case SSD1306_VIRT_SET_CONTRAST:
 			part->contrast_register = part->spi_data;
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_mark_all_dirty (part);
 			SSD1306_CLEAR_COMMAND_REG(part);
 			//printf ("SSD1306: CONTRAST SET: 0x%02x\n", part->contrast_register);
 			return;
@@ -405,6 +482,7 @@ ssd1306_reset_hook (struct avr_irq_t * irq, uint32_t value, void * param)
 		part->addr_mode = SSD1306_ADDR_MODE_PAGE;
 		ssd1306_set_flag (part, SSD1306_FLAG_COM_SCAN_NORMAL, 1);
 		ssd1306_set_flag (part, SSD1306_FLAG_SEGMENT_REMAP_0, 1);
+		ssd1306_mark_all_dirty (part);
 	}
 
 }
@@ -416,6 +494,7 @@ static const char * irq_names[IRQ_SSD1306_COUNT] =
                 [IRQ_SSD1306_ADDR] = "7>hd44780.ADDR",
                 [IRQ_SSD1306_TWI_OUT] = "32<sdd1306.TWI.out",
                 [IRQ_SSD1306_TWI_IN] = "8>sdd1306.TWI.in",
+                [IRQ_SSD1306_FRAME] = "8>ssd1306.frame",
 };
 
 void
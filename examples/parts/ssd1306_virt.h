@@ -41,6 +41,7 @@
 #define __SSD1306_VIRT_H__
 
 #include "sim_irq.h"
+#include "frame_swap.h"
 
 #define SSD1306_VIRT_DATA			1
 #define SSD1306_VIRT_INSTRUCTION 		0
@@ -110,6 +111,7 @@ enum
 	IRQ_SSD1306_ADDR,		// << For VCD
 	IRQ_SSD1306_TWI_IN,
 	IRQ_SSD1306_TWI_OUT,
+	IRQ_SSD1306_FRAME,		// raised with the mask of the dirty pages
 	IRQ_SSD1306_COUNT
 //TODO: Add IRQs for VCD: Internal state etc.
 };
@@ -145,6 +147,26 @@ struct ssd1306_virt_cursor_t
 	uint8_t column;
 };
 
+/*
+ * Columns 'column' to 'column' + 'width' - 1 of 'page' changed
+ */
+typedef struct ssd1306_region_t
+{
+	uint8_t page;
+	uint8_t column;
+	uint8_t width;
+} ssd1306_region_t;
+
+/*
+ * What is published in 'frames' at the end of each frame
+ */
+typedef struct ssd1306_frame_t
+{
+	uint8_t vram[SSD1306_VIRT_PAGES][SSD1306_VIRT_COLUMNS];
+	uint16_t flags;
+	uint8_t contrast_register;
+} ssd1306_frame_t;
+
 typedef struct ssd1306_t
 {
 	avr_irq_t * irq;
@@ -163,6 +185,14 @@ typedef struct ssd1306_t
 
 	uint8_t twi_selected;
 	uint8_t twi_index;
+
+	// what changed since the last ssd1306_get_dirty()
+	uint8_t dirty_pages;
+	struct {
+		uint8_t first, last;
+	} dirty[SSD1306_VIRT_PAGES];
+	// if set, of ssd1306_frame_t, for another thread to display
+	frame_swap_t * frames;
 } ssd1306_t;
 
 typedef struct ssd1306_pin_t
@@ -201,4 +231,26 @@ ssd1306_connect (ssd1306_t * part, ssd1306_wiring_t * wiring);
 void
 ssd1306_connect_twi (ssd1306_t * part, ssd1306_wiring_t * wiring);
 
+/*
+ * Publishes the VRAM and the state in 'frames', initialized for
+ * ssd1306_frame_t, now then at the end of each frame, for another thread
+ * to display.
+ */
+void
+ssd1306_set_frames (ssd1306_t * part, frame_swap_t * frames);
+
+/*
+ * Fills 'region' with the parts of the VRAM that changed since the last
+ * call, at most one per page, and forgets them. Returns how many there
+ * are, 0 if there is nothing to redraw. A change of the display state
+ * (on/off, inversion, contrast) makes the whole VRAM dirty.
+ *
+ * IRQ_SSD1306_FRAME is raised when a byte is written in the last column
+ * of the last page, which ends a full update whatever the addressing
+ * mode, and when the display state changes.
+ */
+int
+ssd1306_get_dirty (ssd1306_t * part,
+                   ssd1306_region_t region[SSD1306_VIRT_PAGES]);
+
 #endif
@@ -21,12 +21,19 @@
 
 #include "sim_network.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #ifdef __APPLE__
 #include <util.h>
 #else
@@ -38,13 +45,76 @@
 #include "sim_time.h"
 #include "sim_hex.h"
 
-DEFINE_FIFO(uint8_t,uart_pty_fifo);
-
 //#define TRACE(_w) _w
 #ifndef TRACE
 #define TRACE(_w)
 #endif
 
+/*
+ * The one or two parts of the ring from 'start' for 'len' bytes, for
+ * readv()/writev()
+ */
+static int
+uart_pty_ring_iov(
+		avr_uart_ring_t * r,
+		uint32_t start,
+		uint32_t len,
+		struct iovec * iov)
+{
+	uint32_t o = start & (r->size - 1);
+	uint32_t first = r->size - o;
+	if (first > len)
+		first = len;
+	iov[0].iov_base = r->buf + o;
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - first;
+	return len > first ? 2 : 1;
+}
+
+// from the simulation: wakes the thread up, if it waits
+static void
+uart_pty_ring_doorbell(
+		uart_pty_t * p,
+		int force)
+{
+	if (!__atomic_exchange_n(&p->sleeping, 0, __ATOMIC_SEQ_CST) && !force)
+		return;
+	uint64_t one = 1;
+	TRACE(printf("uart_pty doorbell\n");)
+	if (write(p->doorbell[1], &one, p->doorbell[0] == p->doorbell[1] ?
+			sizeof(one) : 1) < 0 && errno != EAGAIN)
+		perror(__func__);
+}
+
+static avr_cycle_count_t
+uart_pty_doorbell_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	uart_pty_ring_doorbell((uart_pty_t*)param, 0);
+	return 0;
+}
+
+/*
+ * from the simulation, a byte for the pty. The thread is woken up a bit
+ * later, so it gets them in batches rather than one at a time
+ */
+static void
+uart_pty_send(
+		uart_pty_t * p,
+		uart_pty_port_t * port,
+		uint8_t byte)
+{
+	if (!avr_uart_ring_put(&port->in, byte)) {
+		TRACE(printf("uart_pty %s full, dropped %02x\n", port->slavename, byte);)
+	}
+	if (!avr_cycle_timer_status(p->avr, uart_pty_doorbell_timer, p))
+		avr_cycle_timer_register(p->avr, avr_hz_to_cycles(p->avr, 10000),
+				uart_pty_doorbell_timer, p);
+}
+
 /*
  * called when a byte is send via the uart on the AVR
  */
@@ -56,47 +126,69 @@ uart_pty_in_hook(
 {
 	uart_pty_t * p = (uart_pty_t*)param;
 	TRACE(printf("uart_pty_in_hook %02x\n", value);)
-	uart_pty_fifo_write(&p->pty.in, value);
+	uart_pty_send(p, &p->pty, value);
 
 	if (p->tap.s) {
 		if (p->tap.crlf && value == '\n')
-			uart_pty_fifo_write(&p->tap.in, '\r');
-		uart_pty_fifo_write(&p->tap.in, value);
+			uart_pty_send(p, &p->tap, '\r');
+		uart_pty_send(p, &p->tap, value);
+	}
+}
+
+// the thread waits for room in 'out', now there is
+static void
+uart_pty_unstall(
+		uart_pty_t * p,
+		uart_pty_port_t * port)
+{
+	if (__atomic_load_n(&port->stalled, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&port->stalled, 0, __ATOMIC_SEQ_CST);
+		uart_pty_ring_doorbell(p, 1);
 	}
 }
 
 // try to empty our fifo, the uart_pty_xoff_hook() will be called when
-// other side is full
+// other side is full. A shared one is the uart's to read
 static void
 uart_pty_flush_incoming(
 		uart_pty_t * p)
 {
-	while (p->xon && !uart_pty_fifo_isempty(&p->pty.out)) {
-		TRACE(int r = p->pty.out.read;)
-		uint8_t byte = uart_pty_fifo_read(&p->pty.out);
-		TRACE(printf("uart_pty_flush_incoming send r %03d:%02x\n", r, byte);)
+	while (p->xon && !p->pty.shared && avr_uart_ring_count(&p->pty.out)) {
+		uint8_t byte = avr_uart_ring_get(&p->pty.out);
+		TRACE(printf("uart_pty_flush_incoming send %02x\n", byte);)
 		avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
 
 		if (p->tap.s) {
 			if (p->tap.crlf && byte == '\n')
-				uart_pty_fifo_write(&p->tap.in, '\r');
-			uart_pty_fifo_write(&p->tap.in, byte);
+				uart_pty_send(p, &p->tap, '\r');
+			uart_pty_send(p, &p->tap, byte);
 		}
 	}
+	uart_pty_unstall(p, &p->pty);
 	if (p->tap.s) {
-		while (p->xon && !uart_pty_fifo_isempty(&p->tap.out)) {
-			uint8_t byte = uart_pty_fifo_read(&p->tap.out);
+		while (p->xon && avr_uart_ring_count(&p->tap.out)) {
+			uint8_t byte = avr_uart_ring_get(&p->tap.out);
 			if (p->tap.crlf && byte == '\r') {
-				uart_pty_fifo_write(&p->tap.in, '\n');
+				uart_pty_send(p, &p->tap, '\n');
 			}
 			if (byte == '\n')
 				continue;
-			uart_pty_fifo_write(&p->tap.in, byte);
+			uart_pty_send(p, &p->tap, byte);
 			avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
 		}
+		uart_pty_unstall(p, &p->tap);
 	}
 }
 
+// bytes the uart had no room for yet
+static int
+uart_pty_incoming(
+		uart_pty_t * p)
+{
+	return (!p->pty.shared && avr_uart_ring_count(&p->pty.out)) ||
+			(p->tap.s && avr_uart_ring_count(&p->tap.out));
+}
+
 avr_cycle_count_t
 uart_pty_flush_timer(
 		struct avr_t * avr,
@@ -107,12 +199,31 @@ uart_pty_flush_timer(
 
 	uart_pty_flush_incoming(p);
 	/* always return a cycle NUMBER not a cycle count */
-	return p->xon ? when + avr_hz_to_cycles(p->avr, 1000) : 0;
+	return p->xon && uart_pty_incoming(p) ?
+			when + avr_hz_to_cycles(p->avr, 1000) : 0;
+}
+
+// posted by the thread when it received bytes, runs in the simulation
+static void
+uart_pty_kick(
+		struct avr_t * avr,
+		avr_inject_t * e)
+{
+	uart_pty_t * p = (uart_pty_t*)((uint8_t*)e - offsetof(uart_pty_t, kick));
+
+	__atomic_store_n(&p->kicked, 0, __ATOMIC_SEQ_CST);
+	uart_pty_flush_incoming(p);
+	if (p->xon && uart_pty_incoming(p) &&
+			!avr_cycle_timer_status(avr, uart_pty_flush_timer, p))
+		avr_cycle_timer_register(avr, avr_hz_to_cycles(avr, 1000),
+				uart_pty_flush_timer, p);
 }
 
 /*
  * Called when the uart has room in it's input buffer. This is called repeateadly
- * if necessary, while the xoff is called only when the uart fifo is FULL
+ * if necessary, while the xoff is called only when the uart fifo is FULL.
+ * With a shared ring, it's only called when the ring was full and has room
+ * again, for the thread to go on reading the pty
  */
 static void
 uart_pty_xon_hook(
@@ -127,7 +238,7 @@ uart_pty_xon_hook(
 	uart_pty_flush_incoming(p);
 
 	// if the buffer is not flushed, try to do it later
-	if (p->xon)
+	if (p->xon && uart_pty_incoming(p))
 			avr_cycle_timer_register(p->avr, avr_hz_to_cycles(p->avr, 1000),
 						uart_pty_flush_timer, param);
 }
@@ -147,79 +258,136 @@ uart_pty_xoff_hook(
 	avr_cycle_timer_cancel(p->avr, uart_pty_flush_timer, param);
 }
 
+// what the thread waits for on a port; epoll only hears about changes
+static void
+uart_pty_watch(
+		uart_pty_t * p,
+		int ti,
+		uint32_t events)
+{
+	uart_pty_port_t * port = &p->port[ti];
+
+	if (port->events == events)
+		return;
+	port->events = events;
+#ifdef __linux__
+	struct epoll_event e = { .events = events, .data.u32 = ti };
+	epoll_ctl(p->poll, EPOLL_CTL_MOD, port->s, &e);
+#endif
+}
+
+/*
+ * Waits for the ports and the doorbell; returns the events of the ports
+ * in 'ready', and 1 if the doorbell rang, or -1
+ */
+static int
+uart_pty_wait(
+		uart_pty_t * p,
+		uint32_t ready[2])
+{
+	int bell = 0;
+	ready[0] = ready[1] = 0;
+#ifdef __linux__
+	struct epoll_event e[3];
+	int n = epoll_wait(p->poll, e, 3, -1);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (int i = 0; i < n; i++) {
+		if (e[i].data.u32 == 2)
+			bell = 1;
+		else
+			ready[e[i].data.u32] = e[i].events;
+	}
+#else
+	struct pollfd fd[3] = {
+		{ .fd = p->doorbell[0], .events = POLLIN },
+		{ .fd = p->port[0].s ? p->port[0].s : -1, .events = p->port[0].events },
+		{ .fd = p->port[1].s ? p->port[1].s : -1, .events = p->port[1].events },
+	};
+	if (poll(fd, 3, -1) < 0)
+		return errno == EINTR ? 0 : -1;
+	bell = !!fd[0].revents;
+	ready[0] = fd[1].revents;
+	ready[1] = fd[2].revents;
+#endif
+	if (bell) {
+		uint8_t drain[64];
+		while (read(p->doorbell[0], drain, sizeof(drain)) > 0)
+			;
+	}
+	return bell;
+}
+
+/*
+ * Moves the bytes between the rings and the ptys, as much of them as
+ * possible at a time, and sleeps until there's more to move.
+ */
 static void *
 uart_pty_thread(
 		void * param)
 {
 	uart_pty_t * p = (uart_pty_t*)param;
+	uint32_t ready[2] = { POLLIN, POLLIN };
 
-	while (1) {
-		fd_set read_set, write_set;
-		int max = 0;
-		FD_ZERO(&read_set);
-		FD_ZERO(&write_set);
+	while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+		int busy = 0;
 
 		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
-			// read more only if buffer was flushed
-			if (p->port[ti].buffer_len == p->port[ti].buffer_done) {
-				FD_SET(p->port[ti].s, &read_set);
-				max = p->port[ti].s > max ? p->port[ti].s : max;
+			uart_pty_port_t * port = &p->port[ti];
+			struct iovec iov[2];
+
+			// the pty to the avr, if there is room
+			uint32_t room = avr_uart_ring_room(&port->out);
+			if (room && (ready[ti] & (POLLIN | POLLHUP | POLLERR))) {
+				int cnt = uart_pty_ring_iov(&port->out, port->out.head, room, iov);
+				ssize_t r = readv(port->s, iov, cnt);
+				if (r > 0) {
+					TRACE(if (!port->tap) printf("pty recv %d\n", (int)r);)
+					__atomic_store_n(&port->out.head, port->out.head + r,
+							__ATOMIC_RELEASE);
+					room -= r;
+					// the uart polls a shared ring on its own
+					if (!port->shared &&
+							!__atomic_exchange_n(&p->kicked, 1, __ATOMIC_SEQ_CST))
+						avr_inject_post(p->avr, &p->kick);
+				}
 			}
-			if (!uart_pty_fifo_isempty(&p->port[ti].in)) {
-				FD_SET(p->port[ti].s, &write_set);
-				max = p->port[ti].s > max ? p->port[ti].s : max;
+			if (!room)
+				__atomic_store_n(&port->stalled, 1, __ATOMIC_SEQ_CST);
+			// the avr to the pty
+			uint32_t len = avr_uart_ring_count(&port->in);
+			int blocked = 0;
+			if (len) {
+				int cnt = uart_pty_ring_iov(&port->in, port->in.tail, len, iov);
+				ssize_t r = writev(port->s, iov, cnt);
+				TRACE(if (!port->tap) printf("pty send %d/%d\n", (int)r, (int)len);)
+				if (r > 0)
+					__atomic_store_n(&port->in.tail, port->in.tail + r,
+							__ATOMIC_RELEASE);
+				blocked = r < (ssize_t)len;
+				busy |= !blocked && avr_uart_ring_count(&port->in);
 			}
+			uart_pty_watch(p, ti, (room ? POLLIN : 0) | (blocked ? POLLOUT : 0));
 		}
-
-		// short, but not too short interval
-		struct timeval timo = { 0, 500 };
-		int ret = select(max+1, &read_set, &write_set, NULL, &timo);
-
-		if (!ret)
+		if (busy)
 			continue;
-		if (ret < 0)
-			break;
-
+		// check again once the simulation knows to ring, not to miss anything
+		__atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+		int pending = 0;
 		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
-			if (FD_ISSET(p->port[ti].s, &read_set)) {
-				ssize_t r = read(p->port[ti].s, p->port[ti].buffer,
-									sizeof(p->port[ti].buffer)-1);
-				p->port[ti].buffer_len = r;
-				p->port[ti].buffer_done = 0;
-				TRACE(if (!p->port[ti].tap)
-						hdump("pty recv", p->port[ti].buffer, r);)
-			}
-			if (p->port[ti].buffer_done < p->port[ti].buffer_len) {
-				// write them in fifo
-				while (p->port[ti].buffer_done < p->port[ti].buffer_len &&
-						!uart_pty_fifo_isfull(&p->port[ti].out)) {
-					int index = p->port[ti].buffer_done++;
-					TRACE(int wi = p->port[ti].out.write;)
-					uart_pty_fifo_write(&p->port[ti].out,
-							p->port[ti].buffer[index]);
-					TRACE(printf("w %3d:%02x (%d/%d) %s\n",
-								wi, p->port[ti].buffer[index],
-								p->port[ti].out.read,
-								p->port[ti].out.write,
-								p->xon ? "XON" : "XOFF");)
-				}
-			}
-			if (FD_ISSET(p->port[ti].s, &write_set)) {
-				uint8_t buffer[512];
-				// write them in fifo
-				uint8_t * dst = buffer;
-				while (!uart_pty_fifo_isempty(&p->port[ti].in) &&
-						dst < (buffer + sizeof(buffer)))
-					*dst++ = uart_pty_fifo_read(&p->port[ti].in);
-				size_t len = dst - buffer;
-				TRACE(size_t r =) write(p->port[ti].s, buffer, len);
-				TRACE(if (!p->port[ti].tap) hdump("pty send", buffer, r);)
-			}
+			uart_pty_port_t * port = &p->port[ti];
+			pending |= avr_uart_ring_count(&port->in) && !(port->events & POLLOUT);
+			pending |= __atomic_load_n(&port->stalled, __ATOMIC_SEQ_CST) &&
+					avr_uart_ring_room(&port->out);
+		}
+		if (pending || __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+			ready[0] = ready[1] = 0;
+			continue;
 		}
-		/* DO NOT call this, this create a concurency issue with the
-		 * FIFO that can't be solved cleanly with a memory barrier
-			uart_pty_flush_incoming(p);
-		  */
+		if (uart_pty_wait(p, ready) < 0)
+			break;
+		__atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
 	}
 	return NULL;
 }
@@ -237,12 +405,30 @@ uart_pty_init(
 	memset(p, 0, sizeof(*p));
 
 	p->avr = avr;
+	p->kick.run = uart_pty_kick;
 	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_PTY_COUNT, irq_names);
 	avr_irq_register_notify(p->irq + IRQ_UART_PTY_BYTE_IN, uart_pty_in_hook, p);
 
 	int hastap = (getenv("SIMAVR_UART_TAP") && atoi(getenv("SIMAVR_UART_TAP"))) ||
 			(getenv("SIMAVR_UART_XTERM") && atoi(getenv("SIMAVR_UART_XTERM"))) ;
 
+#ifdef __linux__
+	p->doorbell[0] = p->doorbell[1] = eventfd(0, EFD_NONBLOCK);
+	p->poll = epoll_create1(0);
+	if (p->doorbell[0] < 0 || p->poll < 0) {
+		fprintf(stderr, "%s: Can't create the doorbell: %s", __FUNCTION__, strerror(errno));
+		return ;
+	}
+	struct epoll_event e = { .events = EPOLLIN, .data.u32 = 2 };
+	epoll_ctl(p->poll, EPOLL_CTL_ADD, p->doorbell[0], &e);
+#else
+	if (pipe(p->doorbell) < 0) {
+		fprintf(stderr, "%s: Can't create the doorbell: %s", __FUNCTION__, strerror(errno));
+		return ;
+	}
+	fcntl(p->doorbell[0], F_SETFL, O_NONBLOCK);
+	fcntl(p->doorbell[1], F_SETFL, O_NONBLOCK);
+#endif
 	for (int ti = 0; ti < 1 + hastap; ti++) {
 		int m, s;
 
@@ -254,7 +440,17 @@ uart_pty_init(
 		tcgetattr(m, &tio);
 		cfmakeraw(&tio);
 		tcsetattr(m, TCSANOW, &tio);
+		fcntl(m, F_SETFL, fcntl(m, F_GETFL) | O_NONBLOCK);
 		p->port[ti].s = m;
+		p->port[ti].events = POLLIN;
+#ifdef __linux__
+		struct epoll_event e = { .events = POLLIN, .data.u32 = ti };
+		epoll_ctl(p->poll, EPOLL_CTL_ADD, m, &e);
+#endif
+		p->port[ti].in = (avr_uart_ring_t) {
+				.buf = p->port[ti].in_buf, .size = UART_PTY_RING_SIZE };
+		p->port[ti].out = (avr_uart_ring_t) {
+				.buf = p->port[ti].out_buf, .size = UART_PTY_RING_SIZE };
 		p->port[ti].tap = ti != 0;
 		p->port[ti].crlf = ti != 0;
 		printf("uart_pty_init %s on port *** %s ***\n",
@@ -270,12 +466,24 @@ uart_pty_stop(
 		uart_pty_t * p)
 {
 	puts(__func__);
-	pthread_kill(p->thread, SIGINT);
+	if (p->pty.shared) {
+		avr_uart_ring_t own = { 0 };
+		avr_ioctl(p->avr, AVR_IOCTL_UART_SET_RING(p->uart), &own);
+		p->pty.shared = 0;
+	}
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	uart_pty_ring_doorbell(p, 1);
+	void * ret;
+	pthread_join(p->thread, &ret);
 	for (int ti = 0; ti < 2; ti++)
 		if (p->port[ti].s)
 			close(p->port[ti].s);
-	void * ret;
-	pthread_join(p->thread, &ret);
+	close(p->doorbell[0]);
+	if (p->doorbell[1] != p->doorbell[0])
+		close(p->doorbell[1]);
+#ifdef __linux__
+	close(p->poll);
+#endif
 }
 
 void
@@ -293,9 +501,18 @@ uart_pty_connect(
 	avr_irq_t * dst = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_INPUT);
 	avr_irq_t * xon = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XON);
 	avr_irq_t * xoff = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XOFF);
+	p->uart = uart;
+	/*
+	 * Without a tap looking at the bytes going by, the uart reads the pty
+	 * thread's ring itself, and BYTE_OUT is left unconnected
+	 */
+	if (p->pty.s && !p->tap.s &&
+			avr_ioctl(p->avr, AVR_IOCTL_UART_SET_RING(uart), &p->pty.out) == 0)
+		p->pty.shared = 1;
 	if (src && dst) {
 		avr_connect_irq(src, p->irq + IRQ_UART_PTY_BYTE_IN);
-		avr_connect_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, dst);
+		if (!p->pty.shared)
+			avr_connect_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, dst);
 	}
 	if (xon)
 		avr_irq_register_notify(xon, uart_pty_xon_hook, p);
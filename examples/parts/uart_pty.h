@@ -25,7 +25,8 @@
 
 #include <pthread.h>
 #include "sim_irq.h"
-#include "fifo_declare.h"
+#include "sim_inject.h"
+#include "avr_uart.h"
 
 enum {
 	IRQ_UART_PTY_BYTE_IN = 0,
@@ -33,24 +34,47 @@ enum {
 	IRQ_UART_PTY_COUNT
 };
 
-DECLARE_FIFO(uint8_t,uart_pty_fifo, 512);
+/*
+ * The bytes between the simulation and the pty thread, in the UART's kind
+ * of rings, with one writer and one reader, in different threads. Without
+ * a tap, 'out' of the pty is shared with the UART, AVR_IOCTL_UART_SET_RING:
+ * the thread reads the pty straight into the UART's input.
+ */
+#define UART_PTY_RING_SIZE	8192	// a power of two
 
 typedef struct uart_pty_port_t {
 	int			tap : 1, crlf : 1;
+	int			shared : 1;	// 'out' is the UART's input
 	int 		s;			// socket we chat on
 	char 		slavename[64];
-	uart_pty_fifo_t in;
-	uart_pty_fifo_t out;
-	uint8_t		buffer[512];
-	size_t		buffer_len, buffer_done;
+	avr_uart_ring_t in;		// from the avr, to the pty
+	avr_uart_ring_t out;	// from the pty, to the avr
+	uint8_t		in_buf[UART_PTY_RING_SIZE];
+	uint8_t		out_buf[UART_PTY_RING_SIZE];
+	int			stalled;	// 'out' was full, the thread waits for room
+	uint32_t	events;		// what the thread waits for on 's'
 } uart_pty_port_t, *uart_pty_port_p;
 
 typedef struct uart_pty_t {
 	avr_irq_t *	irq;		// irq list
 	struct avr_t *avr;		// keep it around so we can pause it
+	char		uart;		// the one connected
 
 	pthread_t	thread;
 	int			xon;
+	/*
+	 * The simulation wakes the thread up through the doorbell when it
+	 * has bytes for it, or room, and the thread is 'sleeping'
+	 */
+	int			doorbell[2];
+	int			poll;		// the epoll descriptor, on linux
+	int			sleeping, stop;
+	/*
+	 * And the thread tells the simulation there are bytes for it, so it
+	 * doesn't poll for them. 'kicked' while 'kick' is posted
+	 */
+	avr_inject_t kick;
+	int			kicked;
 
 	union {
 		struct {
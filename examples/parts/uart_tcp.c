@@ -0,0 +1,487 @@
+/*
+	uart_tcp.c
+
+	Bridges a UART to a TCP socket, as a server or a client.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "uart_tcp.h"
+#include "avr_uart.h"
+#include "sim_time.h"
+
+//#define TRACE(_w) _w
+#ifndef TRACE
+#define TRACE(_w)
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0	// SO_NOSIGPIPE is set instead
+#endif
+
+// the one or two parts of the ring from 'start' for 'len' bytes
+static int
+uart_tcp_ring_iov(
+		avr_uart_ring_t * r,
+		uint32_t start,
+		uint32_t len,
+		struct iovec * iov)
+{
+	uint32_t o = start & (r->size - 1);
+	uint32_t first = r->size - o;
+	if (first > len)
+		first = len;
+	iov[0].iov_base = r->buf + o;
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - first;
+	return len > first ? 2 : 1;
+}
+
+// from the simulation: wakes the thread up, if it waits
+static void
+uart_tcp_doorbell(
+		uart_tcp_t * p,
+		int force)
+{
+	if (!__atomic_exchange_n(&p->sleeping, 0, __ATOMIC_SEQ_CST) && !force)
+		return;
+	uint64_t one = 1;
+	if (write(p->doorbell[1], &one, p->doorbell[0] == p->doorbell[1] ?
+			sizeof(one) : 1) < 0 && errno != EAGAIN)
+		perror(__func__);
+}
+
+static avr_cycle_count_t
+uart_tcp_doorbell_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	uart_tcp_doorbell((uart_tcp_t*)param, 0);
+	return 0;
+}
+
+/*
+ * called when a byte is send via the uart on the AVR. The thread is woken
+ * up a bit later, so it sends them in batches rather than one at a time
+ */
+static void
+uart_tcp_in_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	TRACE(printf("uart_tcp_in_hook %02x\n", value);)
+	if (!avr_uart_ring_put(&p->in, value)) {
+		TRACE(printf("uart_tcp full, dropped %02x\n", value);)
+	}
+	if (!avr_cycle_timer_status(p->avr, uart_tcp_doorbell_timer, p))
+		avr_cycle_timer_register(p->avr, avr_hz_to_cycles(p->avr, 10000),
+				uart_tcp_doorbell_timer, p);
+}
+
+// try to empty our ring, the uart_tcp_xoff_hook() will be called when
+// other side is full. A shared one is the uart's to read, it only raises
+// xon once it has room again
+static void
+uart_tcp_flush_incoming(
+		uart_tcp_t * p)
+{
+	int got = p->shared;
+	while (p->xon && !p->shared && avr_uart_ring_count(&p->out)) {
+		uint8_t byte = avr_uart_ring_get(&p->out);
+		TRACE(printf("uart_tcp_flush_incoming send %02x\n", byte);)
+		avr_raise_irq(p->irq + IRQ_UART_TCP_BYTE_OUT, byte);
+		got++;
+	}
+	// the thread waits for room in 'out', now there is
+	if (got && __atomic_load_n(&p->stalled, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&p->stalled, 0, __ATOMIC_SEQ_CST);
+		uart_tcp_doorbell(p, 1);
+	}
+}
+
+static avr_cycle_count_t
+uart_tcp_flush_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+
+	uart_tcp_flush_incoming(p);
+	/* always return a cycle NUMBER not a cycle count */
+	return p->xon && !p->shared ? when + avr_hz_to_cycles(p->avr, 1000) : 0;
+}
+
+/*
+ * Called when the uart has room in it's input buffer. This is called repeateadly
+ * if necessary, while the xoff is called only when the uart fifo is FULL
+ */
+static void
+uart_tcp_xon_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	TRACE(if (!p->xon) printf("uart_tcp_xon_hook\n");)
+	p->xon = 1;
+
+	uart_tcp_flush_incoming(p);
+
+	// if the buffer is not flushed, try to do it later
+	if (p->xon && !p->shared &&
+			!avr_cycle_timer_status(p->avr, uart_tcp_flush_timer, p))
+		avr_cycle_timer_register(p->avr, avr_hz_to_cycles(p->avr, 1000),
+				uart_tcp_flush_timer, param);
+}
+
+/*
+ * Called when the uart ran out of room in it's input buffer
+ */
+static void
+uart_tcp_xoff_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	TRACE(if (p->xon) printf("uart_tcp_xoff_hook\n");)
+	p->xon = 0;
+	avr_cycle_timer_cancel(p->avr, uart_tcp_flush_timer, param);
+}
+
+static void
+uart_tcp_nonblock(
+		int s)
+{
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+}
+
+// the socket of a new peer
+static void
+uart_tcp_peer(
+		uart_tcp_t * p,
+		int s)
+{
+	int one = 1;
+	uart_tcp_nonblock(s);
+	// the bytes are gathered already, don't let them wait more
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+	setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	p->s = s;
+	__atomic_store_n(&p->connected, 1, __ATOMIC_RELEASE);
+	printf("uart_tcp: connected\n");
+}
+
+static void
+uart_tcp_hangup(
+		uart_tcp_t * p)
+{
+	close(p->s);
+	p->s = -1;
+	__atomic_store_n(&p->connected, 0, __ATOMIC_RELEASE);
+	printf("uart_tcp: disconnected\n");
+}
+
+static void
+uart_tcp_drain(
+		uart_tcp_t * p)
+{
+	uint8_t drain[64];
+	while (read(p->doorbell[0], drain, sizeof(drain)) > 0)
+		;
+}
+
+/*
+ * Waits for 'events' on 'fd' and for the doorbell, for up to 'timeout'
+ * milliseconds; returns the events of 'fd', or -1
+ */
+static int
+uart_tcp_wait(
+		uart_tcp_t * p,
+		int fd,
+		int events,
+		int timeout)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = p->doorbell[0], .events = POLLIN },
+		{ .fd = fd, .events = events },
+	};
+	if (poll(pfd, 2, timeout) < 0)
+		return errno == EINTR ? 0 : -1;
+	if (pfd[0].revents)
+		uart_tcp_drain(p);
+	return pfd[1].revents;
+}
+
+// one try to reach the server; the connection is waited for up to a second
+static int
+uart_tcp_dial(
+		uart_tcp_t * p)
+{
+	int s = socket(p->addr.ss_family, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	uart_tcp_nonblock(s);
+	if (connect(s, (struct sockaddr *)&p->addr, p->addrlen) < 0) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (errno != EINPROGRESS ||
+				uart_tcp_wait(p, s, POLLOUT, 1000) <= 0 ||
+				getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			close(s);
+			return -1;
+		}
+	}
+	uart_tcp_peer(p, s);
+	return 0;
+}
+
+/*
+ * Moves the bytes between the rings and the peer, as much of them as
+ * possible at a time, and sleeps until there's more to move.
+ */
+static void *
+uart_tcp_thread(
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	int ready = POLLIN;
+
+	while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+		if (p->s < 0) {
+			if (p->listen >= 0) {
+				int s = accept(p->listen, NULL, NULL);
+				if (s >= 0)
+					uart_tcp_peer(p, s);
+				else if (uart_tcp_wait(p, p->listen, POLLIN, -1) < 0)
+					break;
+			} else if (uart_tcp_dial(p) < 0 &&
+					!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+				uart_tcp_wait(p, -1, 0, 1000);
+			ready = POLLIN;
+			continue;
+		}
+		struct iovec iov[2];
+		int busy = 0;
+
+		// the peer to the avr, if there is room
+		uint32_t room = avr_uart_ring_room(&p->out);
+		if (room && (ready & (POLLIN | POLLHUP | POLLERR))) {
+			int cnt = uart_tcp_ring_iov(&p->out, p->out.head, room, iov);
+			ssize_t r = readv(p->s, iov, cnt);
+			TRACE(printf("tcp recv %d\n", (int)r);)
+			if (r > 0) {
+				__atomic_store_n(&p->out.head, p->out.head + r, __ATOMIC_RELEASE);
+				room -= r;
+				busy = !room;
+			} else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+				uart_tcp_hangup(p);
+				continue;
+			}
+		}
+		if (!room)
+			__atomic_store_n(&p->stalled, 1, __ATOMIC_SEQ_CST);
+		// the avr to the peer
+		uint32_t len = avr_uart_ring_count(&p->in);
+		int blocked = 0;
+		if (len) {
+			struct msghdr msg = { .msg_iov = iov };
+			msg.msg_iovlen = uart_tcp_ring_iov(&p->in, p->in.tail, len, iov);
+			ssize_t r = sendmsg(p->s, &msg, MSG_NOSIGNAL);
+			TRACE(printf("tcp send %d/%d\n", (int)r, (int)len);)
+			if (r > 0)
+				__atomic_store_n(&p->in.tail, p->in.tail + r, __ATOMIC_RELEASE);
+			else if (errno != EAGAIN && errno != EINTR) {
+				uart_tcp_hangup(p);
+				continue;
+			}
+			blocked = r < (ssize_t)len;
+			busy |= !blocked && avr_uart_ring_count(&p->in);
+		}
+		if (busy) {
+			ready = POLLIN;
+			continue;
+		}
+		// check again once the simulation knows to ring, not to miss anything
+		__atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+		int pending = avr_uart_ring_count(&p->in) && !blocked;
+		if (__atomic_load_n(&p->stalled, __ATOMIC_SEQ_CST) &&
+				avr_uart_ring_room(&p->out)) {
+			__atomic_store_n(&p->stalled, 0, __ATOMIC_SEQ_CST);
+			pending = 1;
+		}
+		if (pending || __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+			ready = POLLIN;
+			continue;
+		}
+		ready = uart_tcp_wait(p, p->s,
+				(room ? POLLIN : 0) | (blocked ? POLLOUT : 0), -1);
+		__atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+		if (ready < 0)
+			break;
+	}
+	return NULL;
+}
+
+static const char * irq_names[IRQ_UART_TCP_COUNT] = {
+	[IRQ_UART_TCP_BYTE_IN] = "8<uart_tcp.in",
+	[IRQ_UART_TCP_BYTE_OUT] = "8>uart_tcp.out",
+};
+
+int
+uart_tcp_init(
+		struct avr_t * avr,
+		uart_tcp_t * p,
+		const char * host,
+		uint16_t port)
+{
+	memset(p, 0, sizeof(*p));
+
+	p->avr = avr;
+	p->listen = p->s = -1;
+	p->doorbell[0] = p->doorbell[1] = -1;
+	p->in = (avr_uart_ring_t) { .buf = p->in_buf, .size = UART_TCP_RING_SIZE };
+	p->out = (avr_uart_ring_t) { .buf = p->out_buf, .size = UART_TCP_RING_SIZE };
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_TCP_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_UART_TCP_BYTE_IN, uart_tcp_in_hook, p);
+
+	char service[8];
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = host ? 0 : AI_PASSIVE,
+	}, * res;
+	snprintf(service, sizeof(service), "%u", port);
+	int err = getaddrinfo(host, service, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: Can't resolve %s: %s\n", __FUNCTION__,
+				host ? host : "*", gai_strerror(err));
+		return -1;
+	}
+	memcpy(&p->addr, res->ai_addr, res->ai_addrlen);
+	p->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	if (!host) {
+		int one = 1;
+		p->listen = socket(p->addr.ss_family, SOCK_STREAM, 0);
+		if (p->listen < 0)
+			goto fail;
+		setsockopt(p->listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(p->listen, (struct sockaddr *)&p->addr, p->addrlen) < 0 ||
+				listen(p->listen, 1) < 0)
+			goto fail;
+		uart_tcp_nonblock(p->listen);
+	}
+#ifdef __linux__
+	p->doorbell[0] = p->doorbell[1] = eventfd(0, EFD_NONBLOCK);
+	if (p->doorbell[0] < 0)
+		goto fail;
+#else
+	if (pipe(p->doorbell) < 0)
+		goto fail;
+	uart_tcp_nonblock(p->doorbell[0]);
+	uart_tcp_nonblock(p->doorbell[1]);
+#endif
+	if (host)
+		printf("uart_tcp_init bridge to %s:%u\n", host, port);
+	else
+		printf("uart_tcp_init bridge on port %u\n", port);
+
+	pthread_create(&p->thread, NULL, uart_tcp_thread, p);
+	return 0;
+fail:
+	fprintf(stderr, "%s: Can't create the socket: %s\n", __FUNCTION__, strerror(errno));
+	if (p->listen >= 0)
+		close(p->listen);
+	p->listen = -1;
+	return -1;
+}
+
+void
+uart_tcp_stop(
+		uart_tcp_t * p)
+{
+	if (p->doorbell[0] < 0)
+		return;
+	if (p->shared) {
+		avr_uart_ring_t own = { 0 };
+		avr_ioctl(p->avr, AVR_IOCTL_UART_SET_RING(p->uart), &own);
+		p->shared = 0;
+	}
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	uart_tcp_doorbell(p, 1);
+	void * ret;
+	pthread_join(p->thread, &ret);
+	if (p->s >= 0)
+		close(p->s);
+	if (p->listen >= 0)
+		close(p->listen);
+	close(p->doorbell[0]);
+	if (p->doorbell[1] != p->doorbell[0])
+		close(p->doorbell[1]);
+	p->doorbell[0] = p->doorbell[1] = -1;
+}
+
+void
+uart_tcp_connect(
+		uart_tcp_t * p,
+		char uart)
+{
+	// disable the stdio dump, as we are sending binary there
+	uint32_t f = 0;
+	avr_ioctl(p->avr, AVR_IOCTL_UART_GET_FLAGS(uart), &f);
+	f &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(p->avr, AVR_IOCTL_UART_SET_FLAGS(uart), &f);
+
+	avr_irq_t * src = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUTPUT);
+	avr_irq_t * dst = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_INPUT);
+	avr_irq_t * xon = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XON);
+	avr_irq_t * xoff = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XOFF);
+	p->uart = uart;
+	// the uart reads the thread's ring itself, BYTE_OUT is left unconnected
+	p->shared = avr_ioctl(p->avr, AVR_IOCTL_UART_SET_RING(uart), &p->out) == 0;
+	if (src && dst) {
+		avr_connect_irq(src, p->irq + IRQ_UART_TCP_BYTE_IN);
+		if (!p->shared)
+			avr_connect_irq(p->irq + IRQ_UART_TCP_BYTE_OUT, dst);
+	}
+	if (xon)
+		avr_irq_register_notify(xon, uart_tcp_xon_hook, p);
+	if (xoff)
+		avr_irq_register_notify(xoff, uart_tcp_xoff_hook, p);
+}
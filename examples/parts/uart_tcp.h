@@ -0,0 +1,101 @@
+/*
+	uart_tcp.h
+
+	Bridges a UART to a TCP socket, as a server or a client.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __UART_TCP_H___
+#define __UART_TCP_H___
+
+#include <pthread.h>
+#include "sim_network.h"
+#include "sim_irq.h"
+#include "avr_uart.h"
+
+enum {
+	IRQ_UART_TCP_BYTE_IN = 0,
+	IRQ_UART_TCP_BYTE_OUT,
+	IRQ_UART_TCP_COUNT
+};
+
+/*
+ * The bytes between the simulation and the socket thread, in the UART's
+ * kind of rings, with one writer and one reader, in different threads.
+ */
+#define UART_TCP_RING_SIZE	65536	// a power of two
+
+/*
+ * As a server, one peer is served at a time, and the next one is accepted
+ * once it's gone. As a client, the connection is tried again every second
+ * until it works, and after the peer closes it.
+ *
+ * The peer is only read from while 'out' has room, so a peer sending
+ * faster than the AVR reads is slowed down by TCP itself. 'out' is shared
+ * with the UART, AVR_IOCTL_UART_SET_RING, which reads the peer's bytes from
+ * it directly; if it can't be, they are given to the UART while it raises
+ * UART_IRQ_OUT_XON. The bytes the AVR
+ * sends while there's no peer are kept for the next one, until 'in' is
+ * full.
+ */
+typedef struct uart_tcp_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t *avr;		// keep it around so we can pause it
+
+	pthread_t	thread;
+	int			xon;
+	int			listen;		// the server socket, -1 for a client
+	int			s;			// the peer, -1 when there's none
+	int			connected;	// while there is a peer, set by the thread
+	struct sockaddr_storage addr;	// the one to connect to, for a client
+	socklen_t	addrlen;
+	/*
+	 * The simulation wakes the thread up through the doorbell when it
+	 * has bytes for it, or room, and the thread is 'sleeping'
+	 */
+	int			doorbell[2];
+	int			sleeping, stop;
+	int			stalled;	// 'out' was full, the thread waits for room
+	avr_uart_ring_t in;		// from the avr, to the socket
+	avr_uart_ring_t out;	// from the socket, to the avr
+	int			shared;		// 'out' is the UART's input
+	char		uart;		// the one connected
+	uint8_t		in_buf[UART_TCP_RING_SIZE];
+	uint8_t		out_buf[UART_TCP_RING_SIZE];
+} uart_tcp_t;
+
+/*
+ * Listens on 'port' if 'host' is NULL, connects to 'host':'port'
+ * otherwise. Returns 0, or -1 if the socket couldn't be set up
+ */
+int
+uart_tcp_init(
+		struct avr_t * avr,
+		uart_tcp_t * p,
+		const char * host,
+		uint16_t port);
+void
+uart_tcp_stop(
+		uart_tcp_t * p);
+
+void
+uart_tcp_connect(
+		uart_tcp_t * p,
+		char uart);
+
+#endif /* __UART_TCP_H___ */
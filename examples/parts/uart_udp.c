@@ -19,56 +19,246 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		// recvmmsg(), sendmmsg()
+#endif
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "uart_udp.h"
 #include "avr_uart.h"
+#include "sim_time.h"
 #include "sim_hex.h"
 
-DEFINE_FIFO(uint8_t,uart_udp_fifo);
+#define RING_MASK	(UART_UDP_RING_SIZE - 1)
+#define UDP_BATCH	16		// datagrams per recvmmsg()/sendmmsg()
+#define UDP_MAX		2048	// biggest datagram received
+
+static inline uint32_t
+uart_udp_ring_count(
+		uart_udp_ring_t * r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+			__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+uart_udp_ring_produced(
+		uart_udp_ring_t * r,
+		uint32_t count)
+{
+	__atomic_store_n(&r->head, r->head + count, __ATOMIC_RELEASE);
+}
+
+static inline void
+uart_udp_ring_consumed(
+		uart_udp_ring_t * r,
+		uint32_t count)
+{
+	__atomic_store_n(&r->tail, r->tail + count, __ATOMIC_RELEASE);
+}
+
+// the one or two parts of the ring from 'start', for 'len' bytes
+static int
+uart_udp_ring_iov(
+		uart_udp_ring_t * r,
+		uint32_t start,
+		uint32_t len,
+		struct iovec * iov)
+{
+	uint32_t o = start & RING_MASK;
+	uint32_t first = UART_UDP_RING_SIZE - o;
+	if (first > len)
+		first = len;
+	iov[0].iov_base = r->buf + o;
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - first;
+	return len > first ? 2 : 1;
+}
+
+// from the simulation: wakes the thread up, if it waits
+static void
+uart_udp_doorbell(
+		uart_udp_t * p,
+		int force)
+{
+	if (!__atomic_exchange_n(&p->sleeping, 0, __ATOMIC_SEQ_CST) && !force)
+		return;
+	uint64_t one = 1;
+	if (write(p->doorbell[1], &one, p->doorbell[0] == p->doorbell[1] ?
+			sizeof(one) : 1) < 0 && errno != EAGAIN)
+		perror(__func__);
+}
+
+static avr_cycle_count_t
+uart_udp_doorbell_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	uart_udp_doorbell((uart_udp_t*)param, 0);
+	return 0;
+}
 
 /*
- * called when a byte is send via the uart on the AVR
+ * called when a byte is send via the uart on the AVR; it's sent once
+ * there are enough of them, or a bit later
  */
 static void uart_udp_in_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
 	uart_udp_t * p = (uart_udp_t*)param;
+	uart_udp_ring_t * r = &p->in;
 //	printf("uart_udp_in_hook %02x\n", value);
-	uart_udp_fifo_write(&p->in, value);
+	uint32_t count = uart_udp_ring_count(r);
+	if (count == UART_UDP_RING_SIZE)
+		return;	// dropped
+	r->buf[r->head & RING_MASK] = value;
+	uart_udp_ring_produced(r, 1);
+	if (count + 1 >= p->datagram) {
+		avr_cycle_timer_cancel(p->avr, uart_udp_doorbell_timer, p);
+		uart_udp_doorbell(p, 0);
+	} else if (!avr_cycle_timer_status(p->avr, uart_udp_doorbell_timer, p))
+		avr_cycle_timer_register_usec(p->avr, p->coalesce,
+				uart_udp_doorbell_timer, p);
 }
 
 /*
- * Called when the uart has room in it's input buffer. This is called repeateadly
- * if necessary, while the xoff is called only when the uart fifo is FULL
+ * The UART pulls the received bytes from here when it has room for
+ * them, see AVR_IOCTL_UART_SET_SOURCE
  */
-static void uart_udp_xon_hook(struct avr_irq_t * irq, uint32_t value, void * param)
+static int uart_udp_pull(void * param, uint8_t * buf, int size)
 {
 	uart_udp_t * p = (uart_udp_t*)param;
-//	if (!p->xon)
-//		printf("uart_udp_xon_hook\n");
-	p->xon = 1;
-	// try to empty our fifo, the uart_udp_xoff_hook() will be called when
-	// other side is full
-	while (p->xon && !uart_udp_fifo_isempty(&p->out)) {
-		uint8_t byte = uart_udp_fifo_read(&p->out);
-	//	printf("uart_udp_xon_hook send %02x\n", byte);
-		avr_raise_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, byte);
+	uart_udp_ring_t * r = &p->out;
+	uint32_t count = uart_udp_ring_count(r);
+
+	if (count > size)
+		count = size;
+	for (uint32_t i = 0; i < count; i++)
+		buf[i] = r->buf[(r->tail + i) & RING_MASK];
+	for (uint32_t i = 0; i < count; i++)
+		avr_raise_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, buf[i]);
+	uart_udp_ring_consumed(r, count);
+	if (count && __atomic_load_n(&p->stalled, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&p->stalled, 0, __ATOMIC_SEQ_CST);
+		uart_udp_doorbell(p, 1);
 	}
+	return count;
 }
 
-/*
- * Called when the uart ran out of room in it's input buffer
- */
-static void uart_udp_xoff_hook(struct avr_irq_t * irq, uint32_t value, void * param)
+// receives as many datagrams as there is room for in 'out'
+static void
+uart_udp_recv(
+		uart_udp_t * p)
 {
-	uart_udp_t * p = (uart_udp_t*)param;
-//	if (p->xon)
-//		printf("uart_udp_xoff_hook\n");
-	p->xon = 0;
+	static uint8_t buffer[UDP_BATCH][UDP_MAX];
+	uart_udp_ring_t * r = &p->out;
+	uint32_t room = UART_UDP_RING_SIZE - uart_udp_ring_count(r);
+	int want = room / UDP_MAX;
+
+	if (want > UDP_BATCH)
+		want = UDP_BATCH;
+	if (!want) {
+		__atomic_store_n(&p->stalled, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	struct iovec iov[UDP_BATCH];
+	int len[UDP_BATCH];
+	int got = 0;
+#ifdef __linux__
+	struct mmsghdr msg[UDP_BATCH];
+	memset(msg, 0, sizeof(msg));
+	for (int i = 0; i < want; i++) {
+		iov[i] = (struct iovec) { .iov_base = buffer[i], .iov_len = UDP_MAX };
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_name = &p->peer;
+		msg[i].msg_hdr.msg_namelen = sizeof(p->peer);
+	}
+	got = recvmmsg(p->s, msg, want, MSG_DONTWAIT, NULL);
+	for (int i = 0; i < got; i++) {
+		len[i] = msg[i].msg_len;
+		if (msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+			printf("UDP truncated a datagram to %d bytes\n", UDP_MAX);
+	}
+#else
+	for (; got < want; got++) {
+		socklen_t alen = sizeof(p->peer);
+		ssize_t l = recvfrom(p->s, buffer[got], UDP_MAX, MSG_DONTWAIT,
+				(struct sockaddr*)&p->peer, &alen);
+		if (l < 0)
+			break;
+		len[got] = l;
+	}
+#endif
+	for (int i = 0; i < got; i++) {
+		struct iovec seg[2];
+		int n = uart_udp_ring_iov(r, r->head, len[i], seg);
+		memcpy(seg[0].iov_base, buffer[i], seg[0].iov_len);
+		if (n > 1)
+			memcpy(seg[1].iov_base, buffer[i] + seg[0].iov_len, seg[1].iov_len);
+		uart_udp_ring_produced(r, len[i]);
+	}
+}
+
+// sends what's in 'in', in datagrams of up to 'datagram' bytes
+static void
+uart_udp_send(
+		uart_udp_t * p)
+{
+	uart_udp_ring_t * r = &p->in;
+	uint32_t count = uart_udp_ring_count(r);
+
+	while (count) {
+		struct iovec iov[UDP_BATCH][2];
+		int n = 0;
+		uint32_t start = r->tail, len[UDP_BATCH];
+#ifdef __linux__
+		struct mmsghdr msg[UDP_BATCH];
+		memset(msg, 0, sizeof(msg));
+#endif
+		for (; n < UDP_BATCH && count; n++) {
+			len[n] = count < p->datagram ? count : p->datagram;
+#ifdef __linux__
+			msg[n].msg_hdr.msg_iov = iov[n];
+			msg[n].msg_hdr.msg_iovlen = uart_udp_ring_iov(r, start, len[n], iov[n]);
+			msg[n].msg_hdr.msg_name = &p->peer;
+			msg[n].msg_hdr.msg_namelen = sizeof(p->peer);
+#endif
+			start += len[n];
+			count -= len[n];
+		}
+#ifdef __linux__
+		int sent = sendmmsg(p->s, msg, n, 0);
+		if (sent < 0)
+			sent = n;	// no peer yet, or unreachable: it's lost
+#else
+		int sent = n;
+		for (int i = 0; i < n; i++) {
+			uint8_t buffer[UART_UDP_RING_SIZE];
+			struct iovec seg[2];
+			int c = uart_udp_ring_iov(r, r->tail, len[i], seg);
+			memcpy(buffer, seg[0].iov_base, seg[0].iov_len);
+			if (c > 1)
+				memcpy(buffer + seg[0].iov_len, seg[1].iov_base, seg[1].iov_len);
+			sendto(p->s, buffer, len[i], 0, (struct sockaddr*)&p->peer, sizeof(p->peer));
+			uart_udp_ring_consumed(r, len[i]);
+		}
+		sent = 0;
+#endif
+		for (int i = 0; i < sent; i++)
+			uart_udp_ring_consumed(r, len[i]);
+		if (sent < n)	// the rest was not sent, start again from there
+			count = uart_udp_ring_count(r);
+	}
 }
 
 static void * uart_udp_thread(void * param)
@@ -76,45 +266,28 @@ static void * uart_udp_thread(void * param)
 	uart_udp_t * p = (uart_udp_t*)param;
 
 	while (1) {
-		fd_set read_set, write_set;
-		int max = p->s + 1;
-		FD_ZERO(&read_set);
-		FD_ZERO(&write_set);
-
-		FD_SET(p->s, &read_set);
-		if (!uart_udp_fifo_isempty(&p->in))
-			FD_SET(p->s, &write_set);
-
-		struct timeval timo = { 0, 500 };	// short, but not too short interval
-		int ret = select(max, &read_set, &write_set, NULL, &timo);
-
-		if (!ret)
-			continue;
-
-		if (FD_ISSET(p->s, &read_set)) {
-			uint8_t buffer[512];
-
-			socklen_t len = sizeof(p->peer);
-			ssize_t r = recvfrom(p->s, buffer, sizeof(buffer)-1, 0, (struct sockaddr*)&p->peer, &len);
+		uart_udp_send(p);
+		uart_udp_recv(p);
 
-		//	hdump("udp recv", buffer, r);
-
-			// write them in fifo
-			uint8_t * src = buffer;
-			while (r-- && !uart_udp_fifo_isfull(&p->out))
-				uart_udp_fifo_write(&p->out, *src++);
-			if (r > 0)
-				printf("UDP dropped %zu bytes\n", r);
+		// check again once the simulation knows to ring, not to miss anything
+		__atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+		int stalled = __atomic_load_n(&p->stalled, __ATOMIC_SEQ_CST);
+		if (stalled && UART_UDP_RING_SIZE - uart_udp_ring_count(&p->out) >= UDP_MAX) {
+			__atomic_store_n(&p->stalled, 0, __ATOMIC_SEQ_CST);
+			stalled = 0;
 		}
-		if (FD_ISSET(p->s, &write_set)) {
-			uint8_t buffer[512];
-			// write them in fifo
-			uint8_t * dst = buffer;
-			while (!uart_udp_fifo_isempty(&p->in) && dst < (buffer+sizeof(buffer)))
-				*dst++ = uart_udp_fifo_read(&p->in);
-			socklen_t len = dst - buffer;
-			/*size_t r = */sendto(p->s, buffer, len, 0, (struct sockaddr*)&p->peer, sizeof(p->peer));
-		//	hdump("udp send", buffer, r);
+		struct pollfd fd[2] = {
+			{ .fd = p->doorbell[0], .events = POLLIN },
+			{ .fd = p->s, .events = stalled ? 0 : POLLIN },
+		};
+		int ret = poll(fd, 2, -1);
+		__atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (fd[0].revents) {
+			uint8_t drain[64];
+			while (read(p->doorbell[0], drain, sizeof(drain)) > 0)
+				;
 		}
 	}
 	return NULL;
@@ -128,6 +301,8 @@ static const char * irq_names[IRQ_UART_UDP_COUNT] = {
 void uart_udp_init(struct avr_t * avr, uart_udp_t * p)
 {
 	p->avr = avr;
+	p->datagram = 512;
+	p->coalesce = 1000;
 	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_UDP_COUNT, irq_names);
 	avr_irq_register_notify(p->irq + IRQ_UART_UDP_BYTE_IN, uart_udp_in_hook, p);
 
@@ -145,6 +320,18 @@ void uart_udp_init(struct avr_t * avr, uart_udp_t * p)
 		return ;
 	}
 
+#ifdef __linux__
+	p->doorbell[0] = p->doorbell[1] = eventfd(0, EFD_NONBLOCK);
+	if (p->doorbell[0] < 0) {
+#else
+	if (pipe(p->doorbell) == 0) {
+		fcntl(p->doorbell[0], F_SETFL, O_NONBLOCK);
+		fcntl(p->doorbell[1], F_SETFL, O_NONBLOCK);
+	} else {
+#endif
+		fprintf(stderr, "%s: Can't create the doorbell: %s", __FUNCTION__, strerror(errno));
+		return ;
+	}
 	printf("uart_udp_init bridge on port %d\n", 4321);
 
 	pthread_create(&p->thread, NULL, uart_udp_thread, p);
@@ -160,16 +347,9 @@ void uart_udp_connect(uart_udp_t * p, char uart)
 	avr_ioctl(p->avr, AVR_IOCTL_UART_SET_FLAGS(uart), &f);
 
 	avr_irq_t * src = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUTPUT);
-	avr_irq_t * dst = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_INPUT);
-	avr_irq_t * xon = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XON);
-	avr_irq_t * xoff = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XOFF);
-	if (src && dst) {
+	if (src)
 		avr_connect_irq(src, p->irq + IRQ_UART_UDP_BYTE_IN);
-		avr_connect_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, dst);
-	}
-	if (xon)
-		avr_irq_register_notify(xon, uart_udp_xon_hook, p);
-	if (xoff)
-		avr_irq_register_notify(xoff, uart_udp_xoff_hook, p);
+	// the uart pulls the bytes received itself
+	avr_uart_source_t source = { .pull = uart_udp_pull, .param = p };
+	avr_ioctl(p->avr, AVR_IOCTL_UART_SET_SOURCE(uart), &source);
 }
-
@@ -23,9 +23,9 @@
 #ifndef __UART_UDP_H___
 #define __UART_UDP_H___
 
+#include <pthread.h>
 #include "sim_network.h"
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 enum {
 	IRQ_UART_UDP_BYTE_IN = 0,
@@ -33,8 +33,24 @@ enum {
 	IRQ_UART_UDP_COUNT
 };
 
-DECLARE_FIFO(uint8_t,uart_udp_fifo, 512);
+/*
+ * The bytes between the simulation and the socket thread, with one
+ * writer and one reader each: 'head' is only moved by the writer, 'tail'
+ * by the reader.
+ */
+#define UART_UDP_RING_SIZE	65536	// a power of two
+
+typedef struct uart_udp_ring_t {
+	uint32_t	head, tail;
+	uint8_t		buf[UART_UDP_RING_SIZE];
+} uart_udp_ring_t;
 
+/*
+ * The bytes the AVR sends are gathered until there are 'datagram' of
+ * them, or for 'coalesce' usecs of simulated time, and sent in as few
+ * datagrams as possible. The datagrams received go straight to the
+ * UART, that pulls them at its own pace, see AVR_IOCTL_UART_SET_SOURCE.
+ */
 typedef struct uart_udp_t {
 	avr_irq_t *	irq;		// irq list
 	struct avr_t *avr;		// keep it around so we can pause it
@@ -43,9 +59,13 @@ typedef struct uart_udp_t {
 	int 		s;			// socket we chat on
 	struct sockaddr_in peer;
 
-	int			xon;
-	uart_udp_fifo_t in;
-	uart_udp_fifo_t out;
+	uint32_t	datagram;	// most bytes sent in one, 512 by default
+	uint32_t	coalesce;	// usecs, 1000 by default
+	int			doorbell[2];	// wakes the thread up, when 'sleeping'
+	int			sleeping;
+	int			stalled;	// 'out' is full, the thread waits for room
+	uart_udp_ring_t in;		// from the avr, to the network
+	uart_udp_ring_t out;	// from the network, to the avr
 } uart_udp_t;
 
 void uart_udp_init(struct avr_t * avr, uart_udp_t * b);
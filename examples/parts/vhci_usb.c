@@ -40,8 +40,36 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "avr_usb.h"
+#include "sim_inject.h"
+
+typedef struct vhci_usb_ioctl_t {
+	uint32_t ctl;
+	void * arg;
+} vhci_usb_ioctl_t;
+
+static int
+vhci_usb_ioctl_run(
+		struct avr_t * avr,
+		void * param)
+{
+	vhci_usb_ioctl_t * c = (vhci_usb_ioctl_t*) param;
+	return avr_ioctl(avr, c->ctl, c->arg);
+}
+
+// from the usb thread, the ioctls are run by the simulation thread
+static int
+vhci_usb_ioctl(
+		struct vhci_usb_t * p,
+		uint32_t ctl,
+		void * arg)
+{
+	vhci_usb_ioctl_t c = { ctl, arg };
+	return avr_inject_call_wait(p->avr, vhci_usb_ioctl_run, &c);
+}
 
 static void
 vhci_usb_attach_hook(
@@ -50,8 +78,23 @@ vhci_usb_attach_hook(
         void * param)
 {
 	struct vhci_usb_t * p = (struct vhci_usb_t*) param;
-	p->attached = !!value;
-	printf("avr attached: %d\n", p->attached);
+	__atomic_store_n(&p->attached, !!value, __ATOMIC_RELEASE);
+	printf("avr attached: %d\n", !!value);
+}
+
+// an endpoint was released, rings the thread if it waits for one
+static void
+vhci_usb_ep_ready_hook(
+        struct avr_irq_t * irq,
+        uint32_t value,
+        void * param)
+{
+	struct vhci_usb_t * p = (struct vhci_usb_t*) param;
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&p->waiting, 0, __ATOMIC_SEQ_CST) &&
+			write(p->ready, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror(__func__);
 }
 
 struct usbsetup {
@@ -67,6 +110,69 @@ char * setuprequests[] =
 	{ "GET_STATUS", "CLEAR_FEAT", "", "SET_FEAT", "", "SET_ADDR", "GET_DESCR",
 	        "SET_DESCR", "GET_CONF", "SET_CONF" };
 
+// how long an IN URB waits for the firmware to have something
+#define VHCI_USB_IN_WAIT	5
+
+/*
+ * Waits for the simulation to ring, up to 'ms' milliseconds. It rings
+ * once when an endpoint was released after 'waiting' was set. Returns 0
+ * if it timed out
+ */
+static int
+vhci_usb_wait(
+		struct vhci_usb_t * p,
+		int ms)
+{
+	struct pollfd pfd = { .fd = p->ready, .events = POLLIN };
+	int res = poll(&pfd, 1, ms);
+	uint64_t count;
+	if (res > 0 && read(p->ready, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror(__func__);
+	return res > 0;
+}
+
+/*
+ * Runs a read or write, waiting for the firmware to release the endpoint
+ * for as long as it NAKs it, or up to 'ms' milliseconds if not 0
+ */
+static int
+vhci_usb_transfer(
+		struct vhci_usb_t * p,
+		uint32_t ctl,
+		struct avr_io_usb * pkt,
+		int ms)
+{
+	for (;;) {
+		__atomic_store_n(&p->waiting, 1, __ATOMIC_SEQ_CST);
+		int ret = vhci_usb_ioctl(p, ctl, pkt);
+		if (ret != AVR_IOCTL_USB_NAK)
+			return ret;
+		// the timeout is a safety net, the doorbell comes first
+		if (!vhci_usb_wait(p, ms ? ms : 50) && ms)
+			return ret;
+	}
+}
+
+// an endpoint's bank is 64 bytes at most, the reads land here first
+static int
+vhci_usb_read(
+		struct vhci_usb_t * p,
+		uint8_t epnum,
+		uint8_t * data,
+		uint32_t room,
+		int ms)
+{
+	uint8_t buf[64];
+	struct avr_io_usb pkt = { epnum, sizeof(buf), buf };
+	int ret = vhci_usb_transfer(p, AVR_IOCTL_USB_READ, &pkt, ms);
+	if (ret < 0)
+		return ret;
+	if (pkt.sz > room)
+		pkt.sz = room;
+	memcpy(data, buf, pkt.sz);
+	return pkt.sz;
+}
+
 static int
 control_read(
         struct vhci_usb_t * p,
@@ -85,39 +191,25 @@ control_read(
 	struct avr_io_usb pkt =
 		{ ep->epnum, sizeof(struct usbsetup), (uint8_t*) &buf };
 
-	avr_ioctl(p->avr, AVR_IOCTL_USB_SETUP, &pkt);
+	vhci_usb_ioctl(p, AVR_IOCTL_USB_SETUP, &pkt);
 
-	pkt.sz = wLength;
-	pkt.buf = data;
-	while (wLength) {
-		usleep(1000);
-		ret = avr_ioctl(p->avr, AVR_IOCTL_USB_READ, &pkt);
-		if (ret == AVR_IOCTL_USB_NAK) {
-			printf(" NAK\n");
-			usleep(50000);
-			continue;
-		}
+	uint16_t done = 0;
+	while (done < wLength) {
+		ret = vhci_usb_read(p, ep->epnum, data + done, wLength - done, 0);
 		if (ret == AVR_IOCTL_USB_STALL) {
 			printf(" STALL\n");
 			return ret;
 		}
-		assert(ret==0);
-		pkt.buf += pkt.sz;
-		if (ep->epsz != pkt.sz)
+		assert(ret>=0);
+		done += ret;
+		if (ep->epsz != ret)
 			break;
-		wLength -= pkt.sz;
-		pkt.sz = wLength;
 	}
-	wLength = pkt.buf - data;
 
-	usleep(1000);
 	pkt.sz = 0;
-	while ((ret = avr_ioctl(p->avr, AVR_IOCTL_USB_WRITE, &pkt))
-	        == AVR_IOCTL_USB_NAK) {
-		usleep(50000);
-	}
+	ret = vhci_usb_transfer(p, AVR_IOCTL_USB_WRITE, &pkt, 0);
 	assert(ret==0);
-	return wLength;
+	return done;
 }
 
 static int
@@ -138,36 +230,80 @@ control_write(
 	struct avr_io_usb pkt =
 		{ ep->epnum, sizeof(struct usbsetup), (uint8_t*) &buf };
 
-	avr_ioctl(p->avr, AVR_IOCTL_USB_SETUP, &pkt);
-	usleep(10000);
+	vhci_usb_ioctl(p, AVR_IOCTL_USB_SETUP, &pkt);
 
-	if (wLength > 0) {
+	pkt.buf = data;
+	while (wLength > 0) {
 		pkt.sz = (wLength > ep->epsz ? ep->epsz : wLength);
-		pkt.buf = data;
-		while ((ret = avr_ioctl(p->avr, AVR_IOCTL_USB_WRITE, &pkt)) != 0) {
-			if (ret == AVR_IOCTL_USB_NAK) {
-				usleep(50000);
-				continue;
-			}
-			if (ret == AVR_IOCTL_USB_STALL) {
-				printf(" STALL\n");
-				return ret;
-			}
-			assert(ret==0);
-			if (pkt.sz != ep->epsz)
-				break;
-			pkt.buf += pkt.sz;
-			wLength -= pkt.sz;
-			pkt.sz = (wLength > ep->epsz ? ep->epsz : wLength);
+		ret = vhci_usb_transfer(p, AVR_IOCTL_USB_WRITE, &pkt, 0);
+		if (ret == AVR_IOCTL_USB_STALL) {
+			printf(" STALL\n");
+			return ret;
 		}
+		assert(ret==0);
+		pkt.buf += pkt.sz;
+		wLength -= pkt.sz;
 	}
 
+	uint8_t status[64];
 	pkt.sz = 0;
-	while ((ret = avr_ioctl(p->avr, AVR_IOCTL_USB_READ, &pkt))
-	        == AVR_IOCTL_USB_NAK) {
-		usleep(50000);
+	pkt.buf = status;
+	return vhci_usb_transfer(p, AVR_IOCTL_USB_READ, &pkt, 0);
+}
+
+/*
+ * The other endpoints move a whole URB at once: the OUT ones are split
+ * in packets, each sent as soon as the firmware took the previous one,
+ * and the
+ * IN ones get the packets the firmware has until a short one. The bulk
+ * endpoints return nothing rather than NAK, see avr_usb.c; then the URB
+ * waits a bit for the firmware to have some, rather than come straight
+ * back empty.
+ */
+static int
+vhci_usb_urb(
+		struct vhci_usb_t * p,
+		struct usb_vhci_urb * urb)
+{
+	uint8_t epnum = urb->epadr & 0xf;
+	int ret = 0;
+
+	if (usb_vhci_is_out(urb->epadr)) {
+		struct avr_io_usb pkt = { urb->epadr, 0, urb->buffer };
+		int32_t left = urb->buffer_actual;
+		do {
+			pkt.sz = left;
+			ret = vhci_usb_transfer(p, AVR_IOCTL_USB_WRITE, &pkt, 50);
+			if (ret < 0)
+				break;
+			pkt.buf += pkt.sz;
+			left -= pkt.sz;
+		} while (left > 0);
+		// the host sends again what the firmware didn't take yet
+		urb->buffer_actual = pkt.buf - urb->buffer;
+		return urb->buffer_actual ? 0 : ret;
+	}
+	uint32_t done = 0;
+	int waited = 0;
+	while (done < urb->buffer_length) {
+		ret = vhci_usb_read(p, urb->epadr, urb->buffer + done,
+				urb->buffer_length - done, done ? 1 : VHCI_USB_IN_WAIT);
+		if (ret < 0)
+			break;
+		if (ret > p->ep_max[epnum])
+			p->ep_max[epnum] = ret;
+		done += ret;
+		if (!ret && !done && !waited) {
+			waited = 1;
+			vhci_usb_wait(p, VHCI_USB_IN_WAIT);
+			continue;
+		}
+		if (!ret || ret < p->ep_max[epnum])
+			break;
 	}
-	return ret;
+	urb->buffer_actual = done;
+	// what was read is handed back, the rest will come in the next URB
+	return done ? 0 : ret;
 }
 
 static void
@@ -178,8 +314,8 @@ handle_status_change(
 {
 	if (~prev->status & USB_VHCI_PORT_STAT_POWER
 	        && curr->status & USB_VHCI_PORT_STAT_POWER) {
-		avr_ioctl(p->avr, AVR_IOCTL_USB_VBUS, (void*) 1);
-		if (p->attached) {
+		vhci_usb_ioctl(p, AVR_IOCTL_USB_VBUS, (void*) 1);
+		if (__atomic_load_n(&p->attached, __ATOMIC_ACQUIRE)) {
 			if (usb_vhci_port_connect(p->fd, 1, USB_VHCI_DATA_RATE_FULL) < 0) {
 				perror("port_connect");
 				abort();
@@ -188,7 +324,7 @@ handle_status_change(
 	}
 	if (prev->status & USB_VHCI_PORT_STAT_POWER
 	        && ~curr->status & USB_VHCI_PORT_STAT_POWER)
-		avr_ioctl(p->avr, AVR_IOCTL_USB_VBUS, 0);
+		vhci_usb_ioctl(p, AVR_IOCTL_USB_VBUS, 0);
 
 	if (curr->change & USB_VHCI_PORT_STAT_C_RESET
 	        && ~curr->status & USB_VHCI_PORT_STAT_RESET
@@ -197,7 +333,7 @@ handle_status_change(
 	}
 	if (~prev->status & USB_VHCI_PORT_STAT_RESET
 	        && curr->status & USB_VHCI_PORT_STAT_RESET) {
-		avr_ioctl(p->avr, AVR_IOCTL_USB_RESET, NULL);
+		vhci_usb_ioctl(p, AVR_IOCTL_USB_RESET, NULL);
 		usleep(50000);
 		if (curr->status & USB_VHCI_PORT_STAT_CONNECTION) {
 			if (usb_vhci_port_reset_done(p->fd, 1, 1) < 0) {
@@ -303,19 +439,20 @@ vhci_usb_thread(
 
 		int res = usb_vhci_fetch_work(p->fd, &wrk);
 
-		if (p->attached != avrattached) {
-			if (p->attached && port_status.status & USB_VHCI_PORT_STAT_POWER) {
+		bool attached = __atomic_load_n(&p->attached, __ATOMIC_ACQUIRE);
+		if (attached != avrattached) {
+			if (attached && port_status.status & USB_VHCI_PORT_STAT_POWER) {
 				if (usb_vhci_port_connect(p->fd, 1, USB_VHCI_DATA_RATE_FULL)
 				        < 0) {
 					perror("port_connect");
 					abort();
 				}
 			}
-			if (!p->attached) {
+			if (!attached) {
 				ep0.epsz = 0;
 				//disconnect
 			}
-			avrattached = p->attached;
+			avrattached = attached;
 		}
 
 		if (res < 0) {
@@ -357,16 +494,7 @@ vhci_usb_thread(
 					handle_ep0_control(p, &ep0, &wrk.work.urb);
 
 				} else {
-					struct avr_io_usb pkt =
-						{ wrk.work.urb.epadr, wrk.work.urb.buffer_actual,
-						        wrk.work.urb.buffer };
-					if (usb_vhci_is_out(wrk.work.urb.epadr))
-						res = avr_ioctl(p->avr, AVR_IOCTL_USB_WRITE, &pkt);
-					else {
-						pkt.sz = wrk.work.urb.buffer_length;
-						res = avr_ioctl(p->avr, AVR_IOCTL_USB_READ, &pkt);
-						wrk.work.urb.buffer_actual = pkt.sz;
-					}
+					res = vhci_usb_urb(p, &wrk.work.urb);
 					if (res == AVR_IOCTL_USB_STALL)
 						wrk.work.urb.status = USB_VHCI_STATUS_STALL;
 					else if (res == AVR_IOCTL_USB_NAK)
@@ -396,6 +524,11 @@ vhci_usb_init(
 		struct vhci_usb_t * p)
 {
 	p->avr = avr;
+	p->ready = eventfd(0, EFD_NONBLOCK);
+	if (p->ready < 0) {
+		perror("vhci_usb eventfd");
+		abort();
+	}
 	pthread_t thread;
 
 	pthread_create(&thread, NULL, vhci_usb_thread, p);
@@ -410,5 +543,7 @@ vhci_usb_connect(
 	avr_irq_t * t = avr_io_getirq(p->avr, AVR_IOCTL_USB_GETIRQ(),
 	        USB_IRQ_ATTACH);
 	avr_irq_register_notify(t, vhci_usb_attach_hook, p);
+	t = avr_io_getirq(p->avr, AVR_IOCTL_USB_GETIRQ(), USB_IRQ_EP_READY);
+	avr_irq_register_notify(t, vhci_usb_ep_ready_hook, p);
 }
 
@@ -20,6 +20,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct avr_t;
 typedef struct vhci_usb_t {
@@ -27,6 +28,10 @@ typedef struct vhci_usb_t {
 
     bool attached;
     int fd;
+    // the simulation rings 'ready' when the thread is 'waiting' for an endpoint
+    int ready;
+    int waiting;
+    uint8_t ep_max[16];	// biggest packet seen on each IN endpoint
 } vhci_usb_t;
 
 
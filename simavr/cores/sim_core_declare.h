@@ -77,6 +77,31 @@
 # define MCU_STATUS_REG MCUCSR
 #endif
 
+/*
+ * The sleep mode select bits are in SMCR, or in MCUCR on the older cores,
+ * and not always next to each other
+ */
+#ifdef SMCR
+# define _SLEEP_REG SMCR
+#elif defined(MCUCR)
+# define _SLEEP_REG MCUCR
+#endif
+#if defined(_SLEEP_REG) && defined(SM0)
+# define _SLEEP_SM0 AVR_IO_REGBIT(_SLEEP_REG, SM0)
+#else
+# define _SLEEP_SM0 { 0 }
+#endif
+#if defined(_SLEEP_REG) && defined(SM1)
+# define _SLEEP_SM1 AVR_IO_REGBIT(_SLEEP_REG, SM1)
+#else
+# define _SLEEP_SM1 { 0 }
+#endif
+#if defined(_SLEEP_REG) && defined(SM2)
+# define _SLEEP_SM2 AVR_IO_REGBIT(_SLEEP_REG, SM2)
+#else
+# define _SLEEP_SM2 { 0 }
+#endif
+
 #ifdef SIGNATURE_0
 #define DEFAULT_CORE(_vector_size) \
 	.ioend  = RAMSTART - 1, \
@@ -92,7 +117,8 @@
 		.extrf = AVR_IO_REGBIT(MCU_STATUS_REG, EXTRF),\
 		.borf = AVR_IO_REGBIT(MCU_STATUS_REG, BORF),\
 		.wdrf = AVR_IO_REGBIT(MCU_STATUS_REG, WDRF)\
-	}
+	}, \
+	.sleep_mode = { _SLEEP_SM0, _SLEEP_SM1, _SLEEP_SM2 }
 #else
 // Disable signature when using an old avr toolchain
 #define DEFAULT_CORE(_vector_size) \
@@ -54,10 +54,12 @@ static const struct mcu_t {
 		/*
 		 * tiny13 has no extended fuse byte, so can not use DEFAULT_CORE macro
 		 */
+		.ioend  = RAMSTART - 1,
 		.ramend = RAMEND,
 		.flashend = FLASHEND,
 		.e2end = E2END,
 		.vector_size = 2,
+		.no_mul = 1,
 // Disable signature when using an old avr toolchain
 #ifdef SIGNATURE_0
 		.signature = { SIGNATURE_0,SIGNATURE_1,SIGNATURE_2 },
@@ -51,6 +51,7 @@ static const struct mcu_t {
 	.core = {
 		.mmcu = "attiny2313a",
 		DEFAULT_CORE(2),
+		.no_mul = 1,
 
 		.init = init,
 		.reset = reset,
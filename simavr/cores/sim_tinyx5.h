@@ -63,6 +63,7 @@ const struct mcu_t SIM_CORENAME = {
 	.core = {
 		.mmcu = SIM_MMCU,
 		DEFAULT_CORE(SIM_VECTOR_SIZE),
+		.no_mul = 1,
 
 		.init = tx5_init,
 		.reset = tx5_reset,
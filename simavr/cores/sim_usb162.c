@@ -56,6 +56,7 @@ const struct mcu_t {
 	.core = {
 		.mmcu = "at90usb162",
 		DEFAULT_CORE(4),
+		.no_mul = 1,	// avr35, no multiplier
 
 		.init = usb162_init,
 		.reset = usb162_reset,
@@ -63,6 +63,7 @@ enum {
 	AVR_MMCU_TAG_VCD_PORTPIN,
 	AVR_MMCU_TAG_VCD_IRQ,
 	AVR_MMCU_TAG_PORT_EXTERNAL_PULL,
+	AVR_MMCU_TAG_VCD_SAMPLE,
 };
 
 enum {
@@ -70,6 +71,12 @@ enum {
 	SIMAVR_CMD_VCD_START_TRACE,
 	SIMAVR_CMD_VCD_STOP_TRACE,
 	SIMAVR_CMD_UART_LOOPBACK,
+	// followed by a byte of id, see sim_regions.h
+	SIMAVR_CMD_REGION_BEGIN,
+	SIMAVR_CMD_REGION_END,
+	SIMAVR_CMD_CYCLE_MARK,
+	// asks for a checkpoint of the simulation, see sim_regions.h
+	SIMAVR_CMD_CHECKPOINT,
 };
 
 #if __AVR__
@@ -226,6 +233,23 @@ struct avr_mmcu_vcd_trace_t {
 		.what = (void*)__what, \
 		.name = _trace_name, \
 	};
+/*!
+ * Samples the trace called '_name' instead of writing each of its changes,
+ * for the signals that change too fast for that (PWM pins, buses, ADC
+ * values). '_mode' is AVR_VCD_SAMPLE_HOLD (1), the value every '_usec',
+ * or AVR_VCD_SAMPLE_MINMAX (2), the lowest and highest value of each
+ * window of '_usec'; see avr_vcd_set_sampling() in sim_vcd_file.h.
+ * AVR_MCU_VCD_SAMPLE("PWM", 100, 2);
+ */
+#define AVR_MCU_VCD_SAMPLE(_name, _usec, _mode) \
+	const struct avr_mmcu_vcd_trace_t DO_CONCAT(DO_CONCAT(_, _tag), __LINE__) _MMCU_ = {\
+		.tag = AVR_MMCU_TAG_VCD_SAMPLE, \
+		.len = sizeof(struct avr_mmcu_vcd_trace_t) - 2,\
+		.mask = _mode, \
+		.what = (void*)_usec, \
+		.name = _name, \
+	}
+
 #define AVR_MCU_VCD_IRQ(_irq_name) \
 	AVR_MCU_VCD_IRQ_TRACE(_irq_name##_vect_num, 1, #_irq_name)
 #define AVR_MCU_VCD_IRQ_PENDING(_irq_name) \
@@ -323,6 +347,19 @@ struct avr_mmcu_vcd_trace_t {
 		_MAP_1(_SEND_SIMAVR_CMD_BYTE, reg, __VA_ARGS__) \
 	} while(0)
 
+/*
+ * Timing of code regions, and cycle marks, with an id of 0 to 255; the
+ * simulator prints them on exit. 'reg' is the AVR_MCU_SIMAVR_COMMAND one.
+ */
+#define SIMAVR_REGION_BEGIN(reg, id) \
+	SEND_SIMAVR_CMD(reg, SIMAVR_CMD_REGION_BEGIN, id)
+#define SIMAVR_REGION_END(reg, id) \
+	SEND_SIMAVR_CMD(reg, SIMAVR_CMD_REGION_END, id)
+#define SIMAVR_CYCLE_MARK(reg, id) \
+	SEND_SIMAVR_CMD(reg, SIMAVR_CMD_CYCLE_MARK, id)
+#define SIMAVR_CHECKPOINT(reg) \
+	SEND_SIMAVR_CMD(reg, SIMAVR_CMD_CHECKPOINT)
+
 #endif /* __AVR__ */
 
 #ifdef __cplusplus
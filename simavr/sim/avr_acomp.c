@@ -21,44 +21,84 @@
 
 #include <stdlib.h>
 #include "avr_acomp.h"
+#include "sim_snapshot.h"
 #include "avr_timer.h"
 
-static uint8_t
-avr_acomp_get_state(
+// the inputs that aren't pins
+enum {
+	ACOMP_IN_BANDGAP = -1,
+	ACOMP_IN_NONE = -2,		// the multiplexer has nothing selected
+};
+
+// which inputs are compared now
+static void
+avr_acomp_get_inputs(
 		struct avr_t * avr,
-		avr_acomp_t *ac)
+		avr_acomp_t *ac,
+		int * positive,
+		int * negative)
 {
-	if (avr_regbit_get(avr, ac->disabled))
-		return 0;
-
-	// get positive voltage
-	uint16_t positive_v;
-
 	if (avr_regbit_get(avr, ac->acbg)) {		// if bandgap
-		positive_v = ACOMP_BANDGAP;
+		*positive = ACOMP_IN_BANDGAP;
 	} else {
-		positive_v = ac->ain_values[0];	// AIN0
+		*positive = ACOMP_IRQ_AIN0;
 	}
 
-	// get negative voltage
-	uint16_t negative_v = 0;
-
+	*negative = ACOMP_IN_NONE;
 	// multiplexer is enabled if acme is set and adc is off
 	if (avr_regbit_get(avr, ac->acme) && !avr_regbit_get(avr, ac->aden)) {
 		if (!avr_regbit_get(avr, ac->pradc)) {
 			uint8_t adc_i = avr_regbit_get_array(avr, ac->mux, ARRAY_SIZE(ac->mux));
 			if (adc_i < ac->mux_inputs && adc_i < ARRAY_SIZE(ac->adc_values)) {
-				negative_v = ac->adc_values[adc_i];
+				*negative = ACOMP_IRQ_ADC0 + adc_i;
 			}
 		}
 
 	} else {
-		negative_v = ac->ain_values[1];	// AIN1
+		*negative = ACOMP_IRQ_AIN1;
+	}
+}
+
+static int32_t
+avr_acomp_get_value(
+		struct avr_t * avr,
+		avr_acomp_t *ac,
+		int in)
+{
+	switch (in) {
+		case ACOMP_IN_BANDGAP:
+			return ACOMP_BANDGAP;
+		case ACOMP_IN_NONE:
+			return 0;
 	}
+	if (ac->waves & (1 << in))
+		return avr_wave_value(&ac->wave[in],
+				avr_wave_nsec(avr, ac->wave_start[in], avr->cycle));
+	if (in >= ACOMP_IRQ_ADC0)
+		return ac->adc_values[in - ACOMP_IRQ_ADC0];
+	return ac->ain_values[in - ACOMP_IRQ_AIN0];
+}
+
+static uint8_t
+avr_acomp_get_state(
+		struct avr_t * avr,
+		avr_acomp_t *ac)
+{
+	if (avr_regbit_get(avr, ac->disabled))
+		return 0;
 
-	return positive_v > negative_v;
+	int positive, negative;
+	avr_acomp_get_inputs(avr, ac, &positive, &negative);
+
+	return avr_acomp_get_value(avr, ac, positive) >
+				avr_acomp_get_value(avr, ac, negative);
 }
 
+static void
+avr_acomp_wave_arm(
+		struct avr_t * avr,
+		avr_acomp_t * p);
+
 static avr_cycle_count_t
 avr_acomp_sync_state(
 	struct avr_t * avr,
@@ -85,10 +125,141 @@ avr_acomp_sync_state(
 		}
 
 	}
+	if (p->waves)
+		avr_acomp_wave_arm(avr, p);
 
 	return 0;
 }
 
+// the cycle 'in' goes to the other side of 'level' at, or 0
+static avr_cycle_count_t
+avr_acomp_wave_crossing(
+		struct avr_t * avr,
+		avr_acomp_t * p,
+		int in,
+		int32_t level)
+{
+	uint64_t nsec = avr_wave_nsec(avr, p->wave_start[in], avr->cycle);
+	uint64_t next = avr_wave_crossing(&p->wave[in], nsec, level, AVR_WAVE_NEVER);
+	if (next == AVR_WAVE_NEVER)
+		return 0;
+	avr_cycle_count_t c = avr_wave_cycle(avr, p->wave_start[in], next);
+	return c > avr->cycle ? c : avr->cycle + 1;
+}
+
+// the first cycle after 'cycle' that 'in' changes course at, or 0
+static avr_cycle_count_t
+avr_acomp_wave_knee(
+		struct avr_t * avr,
+		avr_acomp_t * p,
+		int in,
+		avr_cycle_count_t cycle)
+{
+	uint64_t k = avr_wave_knee(&p->wave[in],
+			avr_wave_nsec(avr, p->wave_start[in], cycle));
+	if (k == AVR_WAVE_NEVER)
+		return 0;
+	avr_cycle_count_t c = avr_wave_cycle(avr, p->wave_start[in], k);
+	return c > cycle ? c : cycle + 1;
+}
+
+static int
+avr_acomp_wave_state(
+		struct avr_t * avr,
+		avr_acomp_t * p,
+		int positive,
+		int negative,
+		avr_cycle_count_t cycle)
+{
+	return avr_wave_value(&p->wave[positive],
+				avr_wave_nsec(avr, p->wave_start[positive], cycle)) >
+			avr_wave_value(&p->wave[negative],
+				avr_wave_nsec(avr, p->wave_start[negative], cycle));
+}
+
+/*
+ * When both inputs are waves, the difference isn't monotonic between the
+ * knees of either, so each stretch is looked at in a few steps, and the
+ * first step that changes side is searched. A crossing and its way back
+ * within one step is missed. Gives up after a few stretches, to look again
+ * from there.
+ */
+#define ACOMP_WAVE_STEPS	16
+#define ACOMP_WAVE_STRETCHES	64
+
+static avr_cycle_count_t
+avr_acomp_wave_crossing2(
+		struct avr_t * avr,
+		avr_acomp_t * p,
+		int positive,
+		int negative)
+{
+	avr_cycle_count_t cur = avr->cycle;
+	int side = avr_acomp_wave_state(avr, p, positive, negative, cur);
+
+	for (int i = 0; i < ACOMP_WAVE_STRETCHES; i++) {
+		avr_cycle_count_t end = avr_acomp_wave_knee(avr, p, positive, cur);
+		avr_cycle_count_t nk = avr_acomp_wave_knee(avr, p, negative, cur);
+		if (!end || (nk && nk < end))
+			end = nk;
+		if (!end)	// both are flat from now on
+			return 0;
+		avr_cycle_count_t step = (end - cur + ACOMP_WAVE_STEPS - 1) / ACOMP_WAVE_STEPS;
+		for (avr_cycle_count_t lo = cur; lo < end; lo += step) {
+			avr_cycle_count_t hi = lo + step < end ? lo + step : end;
+			if (avr_acomp_wave_state(avr, p, positive, negative, hi) == side)
+				continue;
+			while (hi - lo > 1) {
+				avr_cycle_count_t mid = lo + (hi - lo) / 2;
+				if (avr_acomp_wave_state(avr, p, positive, negative, mid) == side)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			return hi;
+		}
+		cur = end;
+	}
+	return cur;
+}
+
+static avr_cycle_count_t
+avr_acomp_wave_timer(
+	struct avr_t * avr,
+	avr_cycle_count_t when,
+	void * param)
+{
+	return avr_acomp_sync_state(avr, when, param);
+}
+
+// one timer, for the next time the output can change
+static void
+avr_acomp_wave_arm(
+		struct avr_t * avr,
+		avr_acomp_t * p)
+{
+	avr_cycle_timer_cancel(avr, avr_acomp_wave_timer, p);
+	if (avr_regbit_get(avr, p->disabled))
+		return;
+
+	int positive, negative;
+	avr_acomp_get_inputs(avr, p, &positive, &negative);
+	int pw = positive >= 0 && (p->waves & (1 << positive));
+	int nw = negative >= 0 && (p->waves & (1 << negative));
+	avr_cycle_count_t next = 0;
+
+	if (pw && nw)
+		next = avr_acomp_wave_crossing2(avr, p, positive, negative);
+	else if (pw)
+		next = avr_acomp_wave_crossing(avr, p, positive,
+					avr_acomp_get_value(avr, p, negative));
+	else if (nw)	// positive > negative is negative > positive - 1, reversed
+		next = avr_acomp_wave_crossing(avr, p, negative,
+					avr_acomp_get_value(avr, p, positive) - 1);
+	if (next)
+		avr_cycle_timer_register(avr, next - avr->cycle, avr_acomp_wave_timer, p);
+}
+
 static inline void
 avr_schedule_sync_state(
 	struct avr_t * avr,
@@ -219,10 +390,45 @@ static const char * irq_names[ACOMP_IRQ_COUNT] = {
 	[ACOMP_IRQ_OUT] = ">out"
 };
 
+static int
+avr_acomp_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_acomp_t * p = (avr_acomp_t *)port;
+
+	if (!io_param || (ctl & ~0xff) != (AVR_IOCTL_ACOMP_SET_WAVE(0) & ~0xff) ||
+			(ctl & 0xff) >= ACOMP_IRQ_OUT)
+		return -1;
+	int in = ctl & 0xff;
+	p->wave[in] = *(avr_wave_t *)io_param;
+	p->wave_start[in] = p->io.avr->cycle;
+	if (p->wave[in].kind != AVR_WAVE_NONE)
+		p->waves |= 1 << in;
+	else {
+		p->waves &= ~(1 << in);
+		if (!p->waves)
+			avr_cycle_timer_cancel(p->io.avr, avr_acomp_wave_timer, p);
+	}
+	avr_schedule_sync_state(p->io.avr, p);
+	return 0;
+}
+
+static void
+avr_acomp_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_snapshot_io(s, io, sizeof(avr_acomp_t));
+}
+
 static avr_io_t _io = {
 	.kind = "ac",
 	.reset = avr_acomp_reset,
+	.ioctl = avr_acomp_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_acomp_snapshot,
 };
 
 void
@@ -19,11 +19,59 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "sim_time.h"
 #include "avr_adc.h"
+#include "sim_snapshot.h"
+
+// of a conversion starting now, in cycles
+static avr_cycle_count_t
+avr_adc_conversion_cycles(
+		avr_adc_t * p)
+{
+	avr_t * avr = p->io.avr;
+	// clock prescaler are just a bit shift.. and 0 means 1
+	uint32_t div = avr_regbit_get_array(avr, p->adps, ARRAY_SIZE(p->adps));
+	if (!div) div++;
+
+	div = avr->frequency >> div;
+	if (p->first)
+		AVR_LOG(avr, LOG_TRACE, "ADC: starting at %uKHz\n", div / 13 / 100);
+	div /= p->first ? 25 : 13;	// first cycle is longer
+	// free running, the conversions are the firmware's time base
+	if (p->adts_mode == avr_adts_free_running)
+		return avr_hz_to_cycles(avr, div);
+	return avr_io_cycles(avr, avr_hz_to_cycles(avr, div));
+}
+
+/*
+ * Free running, a conversion starts as the last one ends; if nothing
+ * else sees the trigger irqs, the next one can be started without them
+ */
+static int
+avr_adc_can_steady(
+		avr_adc_t * p)
+{
+	return p->adts_mode == avr_adts_free_running &&
+			avr_irq_hook_count(p->io.irq + ADC_IRQ_IN_TRIGGER) == 1 &&
+			avr_irq_hook_count(p->io.irq + ADC_IRQ_OUT_TRIGGER) == 0;
+}
+
+static avr_cycle_count_t
+avr_adc_steady(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		avr_cycle_count_t count,
+		void * param);
 
 static avr_cycle_count_t
 avr_adc_int_raise(
@@ -36,12 +84,180 @@ avr_adc_int_raise(
 		avr_regbit_clear(avr, p->adsc);
 		p->first = 0;
 		p->read_status = 0;
-		if( p->adts_mode == avr_adts_free_running )
+		if (avr_adc_can_steady(p)) {
+			// the next conversions are the batch timer's
+			avr_regbit_set(avr, p->adsc);
+			p->sample_cycle = avr->cycle;
+			p->io.events++;
+			p->steady = 1;
+			p->period = avr_adc_conversion_cycles(p);
+			avr_cycle_timer_register_batch(avr, &p->steady_timer,
+					p->period, p->period, avr_adc_steady, p);
+		} else if( p->adts_mode == avr_adts_free_running )
 			avr_raise_irq(p->io.irq + ADC_IRQ_IN_TRIGGER, 1);
 	}
 	return 0;
 }
 
+/*
+ * The 'count' conversions that ended since 'when', usually just the one.
+ * The interrupt flag is the same for one or several, and the result is
+ * only computed when ADCL/ADCH are read, from the start of the next one.
+ * That one starts now, as avr_adc_int_raise() would start it, so the
+ * interrupts come on the same cycles as one timer per conversion.
+ */
+static avr_cycle_count_t
+avr_adc_steady(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		avr_cycle_count_t count,
+		void * param)
+{
+	avr_adc_t * p = (avr_adc_t *)param;
+
+	if (!avr_adc_can_steady(p)) {
+		// something listens now, back to one conversion at a time
+		p->steady = 0;
+		return avr_adc_int_raise(avr, when, p);
+	}
+	avr_raise_interrupt(avr, &p->adc);
+	p->first = 0;
+	p->read_status = 0;
+	p->sample_cycle = avr->cycle;
+	p->io.events += count;
+	return avr->cycle + p->period;
+}
+
+/*
+ * Before ADCSRA/ADCSRB change, the conversion in progress goes back to
+ * its own timer; the next one is steady again if nothing changed
+ */
+static void
+avr_adc_steady_stop(
+		avr_adc_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (!p->steady)
+		return;
+	avr_cycle_count_t left = avr_cycle_timer_status_handle(avr, &p->steady_timer);
+	avr_cycle_timer_cancel_handle(avr, &p->steady_timer);
+	p->steady = 0;
+	if (left)
+		avr_cycle_timer_register(avr, left - 1, avr_adc_int_raise, p);
+}
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+int
+avr_adc_source_map(
+		avr_adc_source_t * s,
+		const char * filename,
+		uint32_t rate)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY | O_BINARY);
+
+	memset(s, 0, sizeof(*s));
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(int16_t)) {
+		close(fd);
+		return -1;
+	}
+	size_t len = st.st_size & ~(sizeof(int16_t) - 1);
+#ifdef __MINGW32__
+	void * map = malloc(len);
+	if (map && read(fd, map, len) != len) {
+		free(map);
+		map = NULL;
+	}
+#else
+	void * map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		map = NULL;
+#endif
+	close(fd);
+	if (!map)
+		return -1;
+	s->samples = map;
+	s->count = len / sizeof(int16_t);
+	s->rate = rate;
+	return 0;
+}
+
+void
+avr_adc_source_unmap(
+		avr_adc_source_t * s)
+{
+	if (!s->samples)
+		return;
+#ifdef __MINGW32__
+	free((void *)s->samples);
+#else
+	munmap((void *)s->samples, s->count * sizeof(int16_t));
+#endif
+	s->samples = NULL;
+	s->count = 0;
+}
+
+// the sample of the stream at the cycle the conversion started
+static void
+avr_adc_stream_sample(
+		avr_adc_t * p,
+		int chan,
+		uint16_t * value)
+{
+	avr_t * avr = p->io.avr;
+	avr_adc_stream_t * s = &p->stream[chan];
+	uint64_t index = 0;
+	int16_t v;
+
+	if (s->source.wave) {
+		int32_t mv = avr_wave_value(s->source.wave,
+				avr_wave_nsec(avr, s->start, p->sample_cycle));
+		*value = mv < 0 ? 0 : mv > 0xffff ? 0xffff : mv;
+		return;
+	}
+	if (p->sample_cycle > s->start && avr->frequency)
+		index = (p->sample_cycle - s->start) * s->source.rate / avr->frequency;
+	if (s->source.samples) {
+		if (index >= s->source.count)
+			index = s->source.loop ? index % s->source.count : s->source.count - 1;
+		v = s->source.samples[index];
+	} else {
+		if (index < s->index || index >= s->index + s->count) {
+			int got = s->source.pull(s->source.param, index,
+							s->block, AVR_ADC_STREAM_BLOCK);
+			if (got < 0) {
+				memset(&s->source, 0, sizeof(s->source));
+				p->streams &= ~(1 << chan);
+			}
+			if (got <= 0) {
+				s->count = 0;
+				return;		// the last value stays
+			}
+			s->index = index;
+			s->count = got > AVR_ADC_STREAM_BLOCK ? AVR_ADC_STREAM_BLOCK : got;
+		}
+		v = s->block[index - s->index];
+	}
+	*value = v < 0 ? 0 : v;
+}
+
+static uint32_t
+avr_adc_get_value(
+		avr_adc_t * p,
+		int chan)
+{
+	chan &= 0xf;
+	if (p->streams & (1 << chan))
+		avr_adc_stream_sample(p, chan, &p->adc_values[chan]);
+	return p->adc_values[chan];
+}
+
 static uint8_t
 avr_adc_read_l(
 		struct avr_t * avr, avr_io_addr_t addr, void * param)
@@ -61,15 +277,17 @@ avr_adc_read_l(
 	uint32_t reg = 0;
 	switch (mux.kind) {
 		case ADC_MUX_SINGLE:
-			reg = p->adc_values[mux.src];
+			reg = avr_adc_get_value(p, mux.src);
 			break;
 		case ADC_MUX_DIFF:
 			if (mux.gain == 0)
 				mux.gain = 1;
-			reg = ((uint32_t)p->adc_values[mux.src] * mux.gain) -
-					((uint32_t)p->adc_values[mux.diff] * mux.gain);
+			reg = (avr_adc_get_value(p, mux.src) * mux.gain) -
+					(avr_adc_get_value(p, mux.diff) * mux.gain);
 			break;
 		case ADC_MUX_TEMP:
+			if (p->streams & (1 << ADC_IRQ_TEMP))
+				avr_adc_stream_sample(p, ADC_IRQ_TEMP, &p->temp);
 			reg = p->temp; // assumed to be already calibrated somehow
 			break;
 		case ADC_MUX_REF:
@@ -210,6 +428,7 @@ avr_adc_write_adcsra(
 {
 	
 	avr_adc_t * p = (avr_adc_t *)param;
+	avr_adc_steady_stop(p);
 	uint8_t adsc = avr_regbit_get(avr, p->adsc);
 	uint8_t aden = avr_regbit_get(avr, p->aden);
 
@@ -239,18 +458,11 @@ avr_adc_write_adcsra(
 			uint32_t v;
 		} e = { .mux = p->muxmode[muxi] };
 		avr_raise_irq(p->io.irq + ADC_IRQ_OUT_TRIGGER, e.v);
-
-		// clock prescaler are just a bit shift.. and 0 means 1
-		uint32_t div = avr_regbit_get_array(avr, p->adps, ARRAY_SIZE(p->adps));
-		if (!div) div++;
-
-		div = avr->frequency >> div;
-		if (p->first)
-			AVR_LOG(avr, LOG_TRACE, "ADC: starting at %uKHz\n", div / 13 / 100);
-		div /= p->first ? 25 : 13;	// first cycle is longer
+		p->sample_cycle = avr->cycle;
+		p->io.events++;
 
 		avr_cycle_timer_register(avr,
-				avr_hz_to_cycles(avr, div),
+				avr_adc_conversion_cycles(p),
 				avr_adc_int_raise, p);
 	}
 	avr_core_watch_write(avr, addr, v);
@@ -261,6 +473,7 @@ static void
 avr_adc_write_adcsrb(
 		struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
 {
+	avr_adc_steady_stop((avr_adc_t *)param);
 	avr_core_watch_write(avr, addr, v);
 	avr_adc_configure_trigger(avr, addr, v, param);
 }
@@ -273,7 +486,7 @@ avr_adc_irq_notify(
 	avr_t * avr = p->io.avr;
 
 	switch (irq->irq) {
-		case ADC_IRQ_ADC0 ... ADC_IRQ_ADC7: {
+		case ADC_IRQ_ADC0 ... ADC_IRQ_ADC15: {
 			p->adc_values[irq->irq] = value;
 		} 	break;
 		case ADC_IRQ_TEMP: {
@@ -302,9 +515,17 @@ static void avr_adc_reset(avr_io_t * port)
 
 	// stop ADC
 	avr_cycle_timer_cancel(p->io.avr, avr_adc_int_raise, p);
+	avr_cycle_timer_cancel_handle(p->io.avr, &p->steady_timer);
+	p->steady = 0;
 	avr_regbit_clear(p->io.avr, p->adsc);
+}
 
-	for (int i = 0; i < ADC_IRQ_COUNT; i++)
+static void avr_adc_irq_attach(avr_io_t * port)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	// the output trigger is only raised, see avr_adc_can_steady()
+	for (int i = 0; i < ADC_IRQ_OUT_TRIGGER; i++)
 		avr_irq_register_notify(p->io.irq + i, avr_adc_irq_notify, p);
 }
 
@@ -317,7 +538,7 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_ADC5] = "16<adc5",
 	[ADC_IRQ_ADC6] = "16<adc6",
 	[ADC_IRQ_ADC7] = "16<adc7",
-	[ADC_IRQ_ADC8] = "16<adc0",
+	[ADC_IRQ_ADC8] = "16<adc8",
 	[ADC_IRQ_ADC9] = "16<adc9",
 	[ADC_IRQ_ADC10] = "16<adc10",
 	[ADC_IRQ_ADC11] = "16<adc11",
@@ -330,10 +551,54 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_OUT_TRIGGER] = ">trigger_out",
 };
 
+static int
+avr_adc_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	if (!io_param || (ctl & ~0xff) != (AVR_IOCTL_ADC_SET_SOURCE(0) & ~0xff) ||
+			(ctl & 0xff) > ADC_IRQ_TEMP)
+		return -1;
+	int chan = ctl & 0xff;
+	avr_adc_stream_t * s = &p->stream[chan];
+	memset(s, 0, sizeof(*s));
+	s->source = *(avr_adc_source_t*)io_param;
+	s->start = p->io.avr->cycle;
+	if (s->source.pull || s->source.wave ||
+			(s->source.samples && s->source.count))
+		p->streams |= 1 << chan;
+	else {
+		memset(&s->source, 0, sizeof(s->source));
+		p->streams &= ~(1 << chan);
+	}
+	return 0;
+}
+
+static void
+avr_adc_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_adc_t * p = (avr_adc_t *)io;
+	// the streams are left as they are
+	avr_adc_stream_t stream[ADC_IRQ_TEMP + 1];
+	uint32_t streams = p->streams;
+	memcpy(stream, p->stream, sizeof(stream));
+	avr_snapshot_io(s, io, sizeof(avr_adc_t));
+	memcpy(p->stream, stream, sizeof(stream));
+	p->streams = streams;
+}
+
 static	avr_io_t	_io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
+	.irq_attach = avr_adc_irq_attach,
+	.ioctl = avr_adc_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_adc_snapshot,
 };
 
 void avr_adc_init(avr_t * avr, avr_adc_t * p)
@@ -27,6 +27,7 @@ extern "C" {
 #endif
 
 #include "sim_avr.h"
+#include "sim_wave.h"
 
 /*
  * simavr ADC allows external code to feed real voltages to the
@@ -39,6 +40,11 @@ extern "C" {
  * ADC_IRQ_ADC* with Millivolts as value.
  *
  * External trigger is not done yet.
+ *
+ * A channel, or the temperature sensor, can instead be given a stream of
+ * samples with AVR_IOCTL_ADC_SET_SOURCE: the ADC then takes the sample of
+ * the cycle each conversion started at by itself, and the ADC_IRQ_ADC*
+ * value of that channel is ignored.
  */
 
 enum {
@@ -56,6 +62,53 @@ enum {
 // Get the internal IRQ corresponding to the INT
 #define AVR_IOCTL_ADC_GETIRQ AVR_IOCTL_DEF('a','d','c',' ')
 
+/*
+ * Samples, in millivolts, taken 'rate' times per second from the time the
+ * source is set. They are either in a buffer, that must stay valid while
+ * it's used, or given by 'pull' a block at a time.
+ * Or, with 'wave', the value of that waveform (see sim_wave.h), which must
+ * stay valid too, and whose time starts when the source is set.
+ */
+typedef struct avr_adc_source_t {
+	uint32_t		rate;		// samples per second
+	const int16_t *	samples;
+	uint32_t		count;
+	uint8_t			loop;		// start again after the last sample, or keep it
+	/*
+	 * Fills 'buf' with up to 'count' samples, from sample 'index' on, and
+	 * returns how many. With 0 the last value is kept, -1 removes the
+	 * source.
+	 */
+	int (*pull)(
+			void * param,
+			uint64_t index,
+			int16_t * buf,
+			int count );
+	void *			param;
+	const avr_wave_t *	wave;
+} avr_adc_source_t;
+
+/*
+ * Takes an avr_adc_source_t*, which is copied, for channel _chan 0-15, or
+ * ADC_IRQ_TEMP for the temperature sensor. One with neither 'samples',
+ * 'pull' nor 'wave' removes the current one.
+ */
+#define AVR_IOCTL_ADC_SET_SOURCE(_chan) AVR_IOCTL_DEF('a','d','s',(_chan))
+
+/*
+ * Maps 'filename', host order int16 millivolts, as the samples of 's'.
+ * Returns 0, or -1 if it can't be read. The mapping stays until
+ * avr_adc_source_unmap(), once the source has been removed.
+ */
+int
+avr_adc_source_map(
+		avr_adc_source_t * s,
+		const char * filename,
+		uint32_t rate );
+void
+avr_adc_source_unmap(
+		avr_adc_source_t * s );
+
 /*
  * Definition of a ADC mux mode.
  */
@@ -101,6 +154,17 @@ typedef enum {
 	avr_adts_psc_module_2_sync_signal,
 } avr_adts_type;
 
+// a channel's source, and the block of samples it last pulled
+#define AVR_ADC_STREAM_BLOCK	64
+
+typedef struct avr_adc_stream_t {
+	avr_adc_source_t	source;
+	avr_cycle_count_t	start;	// cycle of sample 0
+	uint64_t		index;		// of block[0]
+	int				count;		// in block[]
+	int16_t			block[AVR_ADC_STREAM_BLOCK];
+} avr_adc_stream_t;
+
 typedef struct avr_adc_t {
 	avr_io_t		io;
 
@@ -135,10 +199,20 @@ typedef struct avr_adc_t {
 	 * runtime bits
 	 */
 	avr_adc_mux_t	muxmode[64];// maximum 6 bits of mux modes
-	uint16_t		adc_values[8];	// current values on the ADCs
+	uint16_t		adc_values[16];	// current values on the ADCs
 	uint16_t		temp;		// temp sensor reading
 	uint8_t			first;
 	uint8_t			read_status;	// marked one when adcl is read
+	avr_cycle_count_t	sample_cycle;	// the current conversion started there
+	/*
+	 * Free running with nothing hooked on the trigger irqs, the conversions
+	 * are one batch timer rather than one timer each, see avr_adc_steady()
+	 */
+	uint8_t			steady;
+	avr_cycle_count_t	period;		// of a conversion then
+	avr_cycle_timer_handle_t steady_timer;
+	uint32_t		streams;	// bit per channel with a source
+	avr_adc_stream_t	stream[ADC_IRQ_TEMP + 1];
 } avr_adc_t;
 
 void avr_adc_init(avr_t * avr, avr_adc_t * port);
@@ -175,6 +175,93 @@ static void avr_bitbang_clk_hook(struct avr_irq_t * irq, uint32_t value, void *
 	avr_bitbang_clk_edge(p);
 }
 
+/**
+ * word mode: the input bits sampled before 'now' had the current level;
+ * an edge on the same cycle as a change sees the new one
+ *
+ * @param p		bitbang structure
+ * @param now	cycle
+ */
+static void avr_bitbang_word_sample(avr_bitbang_t *p, avr_cycle_count_t now)
+{
+	avr_cycle_count_t edges = now > p->word_start ?
+			(now - p->word_start - 1) / (p->clk_cycles/2) : 0;
+
+	if ( edges > p->buffer_size*2 )
+		edges = p->buffer_size*2;
+	// bits are sampled on the odd edges, or the even ones with clk_phase
+	uint8_t count = p->clk_phase ? edges / 2 : (edges + 1) / 2;
+	for ( ; p->in_count < count; p->in_count++ )
+		p->in_bits |= (uint32_t)p->in_level << p->in_count;
+}
+
+/**
+ * word mode: moves the buffer through the clock edges up to 'edges',
+ * as avr_bitbang_clk_edge() would have
+ *
+ * @param p		bitbang structure
+ * @param edges	since the start of the transfer
+ */
+static void avr_bitbang_word_shift(avr_bitbang_t *p, int edges)
+{
+	if ( edges > p->buffer_size*2 )
+		edges = p->buffer_size*2;
+	for ( ; p->clk_count < edges; p->clk_count++ ) {
+		uint8_t phase = ((p->clk_count & 1) ^ p->clk_phase) ^ 1;
+		int bit = (p->clk_count - p->clk_phase) / 2;
+
+		if ( !phase ) {
+			p->out_bit = p->data_order ? p->data & 1 :
+					(p->data >> (p->buffer_size-1)) & 1;
+			continue;
+		}
+		if ( p->p_in.port ) {
+			uint8_t in = (p->in_bits >> bit) & 1;
+			if ( p->data_order )
+				p->data = (p->data >> 1) | ( in << (p->buffer_size-1));
+			else
+				p->data = (p->data << 1) | in;
+		}
+		p->data = p->data & ~(BITBANG_MASK << p->buffer_size);
+	}
+}
+
+static void avr_bitbang_word_out(avr_bitbang_t *p)
+{
+	if ( p->p_out.port )
+		avr_raise_irq(avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_out.port ), p->p_out.pin), p->out_bit);
+}
+
+static avr_cycle_count_t avr_bitbang_word_timer(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	avr_bitbang_t * p = (avr_bitbang_t *)param;
+
+	if ( !p->enabled )
+		return 0;
+	avr_bitbang_word_sample(p, when + 1);
+	avr_bitbang_word_shift(p, p->buffer_size*2);
+	avr_bitbang_word_out(p);
+	if ( p->callback_transfer_finished ) {
+		p->data = p->callback_transfer_finished(p->data, p->callback_param);
+	}
+	// and the clock goes on with the next one
+	p->clk_count = 0;
+	p->in_count = 0;
+	p->in_bits = 0;
+	p->word_start = when;
+	return when + p->buffer_size * p->clk_cycles;
+}
+
+static void avr_bitbang_word_in_hook(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	avr_bitbang_t * p = (avr_bitbang_t *)param;
+
+	if ( !p->word_run || !value == !p->in_level )
+		return;
+	avr_bitbang_word_sample(p, p->avr->cycle);
+	p->in_level = value != 0;
+}
+
 /**
  * reset bitbang sub-module
  *
@@ -187,6 +274,7 @@ void avr_bitbang_reset(avr_t *avr, avr_bitbang_t * p)
 	p->enabled = 0;
 	p->clk_count = 0;
 	p->data = 0;
+	p->word_run = 0;
 
 	if ( p->buffer_size < 1 || p->buffer_size > 32 ) {
 		AVR_LOG(avr, LOG_ERROR,
@@ -208,6 +296,28 @@ void avr_bitbang_start(avr_bitbang_t * p)
 {
 	p->enabled = 1;
 	p->clk_count = 0;
+	p->word_run = p->word && p->clk_generate && p->clk_cycles >= 2 &&
+			!p->callback_bit_read && !p->callback_bit_write;
+
+	if ( p->word_run ) {
+		avr_ioport_state_t iostate;
+		p->in_count = 0;
+		p->in_bits = 0;
+		p->in_level = 0;
+		if ( p->p_in.port ) {
+			avr_ioctl(p->avr, AVR_IOCTL_IOPORT_GETSTATE( p->p_in.port ), &iostate);
+			p->in_level = ( iostate.pin >> p->p_in.pin ) & 1;
+			avr_irq_register_notify( avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_in.port ), p->p_in.pin), avr_bitbang_word_in_hook, p);
+		}
+		if ( p->clk_phase == 0 ) {
+			p->out_bit = p->data_order ? p->data & 1 :
+					(p->data >> (p->buffer_size-1)) & 1;
+			avr_bitbang_word_out(p);
+		}
+		p->word_start = p->avr->cycle;
+		avr_cycle_timer_register(p->avr, p->buffer_size * p->clk_cycles, avr_bitbang_word_timer, p);
+		return;
+	}
 
 	if ( p->clk_phase == 0 ) {
 		// write first bit
@@ -236,7 +346,17 @@ void avr_bitbang_start(avr_bitbang_t * p)
 void avr_bitbang_stop(avr_bitbang_t * p)
 {
 
+	if ( p->enabled && p->word_run ) {
+		// leaves the buffer and the output as they are at this edge
+		avr_bitbang_word_sample(p, p->avr->cycle);
+		avr_bitbang_word_shift(p, (p->avr->cycle - p->word_start) / (p->clk_cycles/2));
+		avr_bitbang_word_out(p);
+		if ( p->p_in.port )
+			avr_irq_unregister_notify( avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_in.port ), p->p_in.pin), avr_bitbang_word_in_hook, p);
+	}
 	p->enabled = 0;
+	p->word_run = 0;
+	avr_cycle_timer_cancel(p->avr, avr_bitbang_word_timer, p);
 	avr_cycle_timer_cancel(p->avr, avr_bitbang_clk_timer, p);
 	avr_irq_unregister_notify( avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_clk.port ), p->p_clk.pin), avr_bitbang_clk_hook, p);
 }
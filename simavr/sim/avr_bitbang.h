@@ -29,6 +29,8 @@
 	@par Features / Implementation Status
 		- easy buffer access with push() / pop() functions
 		- one input and one output pin (can be the same HW pin for I2C)
+		- word mode: with a generated clock and no per bit callbacks, a
+			transfer is computed a word at a time, see avr_bitbang_start()
 
 	@todo
 		- one input and one output pin (can be the same HW pin for I2C)
@@ -66,6 +68,7 @@ typedef struct avr_bitbang_t {
 							///		- 1: shift right
 
 	uint8_t buffer_size;	///< size of buffer in bits (1...32)
+	uint8_t word;			///< nobody needs the clock and data edges, compute whole words
 
 	void *callback_param;	/// anonymous parameter for callback functions
 	void (*callback_bit_read)(uint8_t bit, void *param); 	///< callback function to notify about bit read
@@ -82,6 +85,13 @@ typedef struct avr_bitbang_t {
 							///		- latest received bit the is lowest / most right one, bit number: 0
 							///		- next bit to be written is the highest one, bit number: (buffer_size-1)
 	int8_t		clk_count;	///< internal clock edge count
+	// word mode
+	uint8_t		word_run;	///< the current transfer is done a word at a time
+	uint8_t		out_bit;	///< last bit written
+	uint8_t		in_level;	///< of the input pin, since 'in_count' bits were sampled
+	uint8_t		in_count;
+	uint32_t	in_bits;	///< sampled bits, first one in bit 0
+	avr_cycle_count_t	word_start;	///< cycle of the first clock edge, minus half a period
 } avr_bitbang_t;
 
 /**
@@ -98,6 +108,13 @@ void avr_bitbang_reset(avr_t *avr, avr_bitbang_t * p);
  * buffers should be written / cleared in advanced
  * timers and interrupts are connected
  *
+ * In 'word' mode, with a generated clock and no bit callbacks, there is
+ * one timer per transfer instead of one per clock edge: the clock pin is
+ * left alone, the output pin only gets the last bit written, and the
+ * input pin is sampled from its changes, at the edges the clock would
+ * have had. callback_transfer_finished() is called on the same cycle as
+ * it would be edge by edge.
+ *
  * @param p			bitbang structure
  */
 void avr_bitbang_start(avr_bitbang_t * p);
@@ -21,35 +21,57 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "avr_eeprom.h"
+#include "sim_snapshot.h"
+#include "sim_time.h"
 
-static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
+/*
+ * EEMPE clears itself 4 cycles after being set; rather than a timer for
+ * it, it's cleared when EECR is next looked at
+ */
+static uint8_t avr_eempe_get(avr_t * avr, avr_eeprom_t * p)
+{
+	if (avr_regbit_get(avr, p->eempe) && avr->cycle >= p->eempe_until)
+		avr_regbit_clear(avr, p->eempe);
+	return avr_regbit_get(avr, p->eempe);
+}
+
+static uint8_t avr_eeprom_read(avr_t * avr, avr_io_addr_t addr, void * param)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)param;
-	avr_regbit_clear(p->io.avr, p->eempe);
-	return 0;
+	avr_eempe_get(avr, p);
+	return avr->data[addr];
 }
 
-static avr_cycle_count_t avr_eei_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
+static avr_cycle_count_t avr_eeprom_write_done(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)param;
-	avr_raise_interrupt(p->io.avr, &p->ready);
+	avr_regbit_clear(avr, p->eepe);
+	if (avr_regbit_get(avr, p->ready.enable))
+		avr_raise_interrupt(avr, &p->ready);
 	return 0;
 }
 
 static void avr_eeprom_write(avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)param;
-	uint8_t eempe = avr_regbit_get(avr, p->eempe);
+	uint8_t eempe = avr_eempe_get(avr, p);
 
 	avr_core_watch_write(avr, addr, v);
 
-	if (!eempe && avr_regbit_get(avr, p->eempe)) {
-		avr_cycle_timer_register(avr, 4, avr_eempe_clear, p);
-	}
+	if (!eempe && avr_regbit_get(avr, p->eempe))
+		p->eempe_until = avr->cycle + 4;
 
 	uint16_t ee_addr;
 	if (p->r_eearh)
@@ -70,19 +92,69 @@ static void avr_eeprom_write(avr_t * avr, avr_io_addr_t addr, uint8_t v, void *
 		p->eeprom[ee_addr] = avr->data[p->r_eedr];
 		// Automatically clears that bit (?)
 		avr_regbit_clear(avr, p->eempe);
+		p->io.events++;
 
-		avr_cycle_timer_register_usec(avr, 3400, avr_eei_raise, p); // 3.4ms here
+		// one after the other if the previous one isn't done
+		avr_cycle_count_t start = p->write_done > avr->cycle ?
+				p->write_done : avr->cycle;
+		p->write_done = start + avr_io_cycles(avr,
+				avr_usec_to_cycles(avr, AVR_EEPROM_WRITE_USEC));
+		avr_cycle_timer_register_handle(avr, &p->write_timer,
+				p->write_done - avr->cycle, avr_eeprom_write_done, p);
 	}
 	if (avr_regbit_get(avr, p->eere)) {	// read operation
 		avr->data[p->r_eedr] = p->eeprom[ee_addr];
 		//	printf("eeprom read %04x : %02x\n", addr, p->eeprom[addr]);
 	}
 
-	// autocleared
-	avr_regbit_clear(avr, p->eepe);
+	// autocleared, EEPE once the write is done
+	if (avr->cycle < p->write_done)
+		avr_regbit_set(avr, p->eepe);
+	else
+		avr_regbit_clear(avr, p->eepe);
 	avr_regbit_clear(avr, p->eere);
 }
 
+static void avr_eeprom_reset(struct avr_io_t * port)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+
+	avr_cycle_timer_cancel_handle(port->avr, &p->write_timer);
+	p->write_done = p->eempe_until = 0;
+}
+
+static void
+avr_eeprom_release(
+		avr_eeprom_t * p)
+{
+	if (!p->eeprom)
+		return;
+	switch (p->owner) {
+		case EEPROM_OWN_MALLOC:
+			free(p->eeprom);
+			break;
+#ifndef __MINGW32__
+		case EEPROM_OWN_MAPPED:
+			msync(p->eeprom, p->size, MS_SYNC);
+			munmap(p->eeprom, p->size);
+			break;
+#endif
+	}
+	p->eeprom = NULL;
+}
+
+// switch to buffer 'ee', which already has the content
+static void
+avr_eeprom_rebind(
+		avr_eeprom_t * p,
+		uint8_t * ee,
+		uint8_t owner)
+{
+	avr_eeprom_release(p);
+	p->eeprom = ee;
+	p->owner = owner;
+}
+
 static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
@@ -99,6 +171,7 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 			memcpy(p->eeprom + desc->offset, desc->ee, desc->size);
 			AVR_LOG(port->avr, LOG_TRACE, "EEPROM: %s: AVR_IOCTL_EEPROM_SET Loaded %d at offset %d\n",
 					__FUNCTION__, desc->size, desc->offset);
+			res = 0;
 		}	break;
 		case AVR_IOCTL_EEPROM_GET: {
 			avr_eeprom_desc_t * desc = (avr_eeprom_desc_t*)io_param;
@@ -111,6 +184,24 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 				memcpy(desc->ee, p->eeprom + desc->offset, desc->size);
 			else	// allow to get access to the read data, for gdb support
 				desc->ee = p->eeprom + desc->offset;
+			res = 0;
+		}	break;
+		case AVR_IOCTL_EEPROM_BIND: {
+			avr_eeprom_desc_t * desc = (avr_eeprom_desc_t*)io_param;
+			if (!desc || desc->offset || (desc->ee && desc->size < p->size)) {
+				AVR_LOG(port->avr, LOG_WARNING, "EEPROM: %s: AVR_IOCTL_EEPROM_BIND Invalid argument\n",
+						__FUNCTION__);
+				return -2;
+			}
+			if (desc->ee == p->eeprom)
+				return 0;
+			uint8_t * ee = desc->ee;
+			if (!ee) {
+				ee = malloc(p->size);
+				memcpy(ee, p->eeprom, p->size);
+			}
+			avr_eeprom_rebind(p, ee, desc->ee ? EEPROM_OWN_CALLER : EEPROM_OWN_MALLOC);
+			res = 0;
 		}	break;
 	}
 	
@@ -120,15 +211,39 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 static void avr_eeprom_dealloc(struct avr_io_t * port)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
-	if (p->eeprom)
-		free(p->eeprom);
-	p->eeprom = NULL;
+	avr_eeprom_release(p);
+}
+
+static void
+avr_eeprom_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)io;
+	// the buffer stays the one in use, a restore only changes its content
+	uint8_t * ee = p->eeprom;
+	uint8_t owner = p->owner;
+	avr_snapshot_io(s, io, sizeof(*p));
+	p->eeprom = ee;
+	p->owner = owner;
+	avr_snapshot_data(s, p->eeprom, p->size);
+}
+
+static size_t
+avr_eeprom_memory(
+		avr_io_t * io)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)io;
+	return p->owner == EEPROM_OWN_MALLOC && p->eeprom ? p->size : 0;
 }
 
 static	avr_io_t	_io = {
 	.kind = "eeprom",
+	.reset = avr_eeprom_reset,
 	.ioctl = avr_eeprom_ioctl,
 	.dealloc = avr_eeprom_dealloc,
+	.snapshot = avr_eeprom_snapshot,
+	.memory = avr_eeprom_memory,
 };
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
@@ -138,11 +253,60 @@ void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
 //			__FUNCTION__, p->size, p->r_eearl, p->r_eearh, p->r_eedr, p->r_eecr);
 
 	p->eeprom = malloc(p->size);
+	p->owner = EEPROM_OWN_MALLOC;
 	memset(p->eeprom, 0xff, p->size);
 	
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->ready);
 
 	avr_register_io_write(avr, p->r_eecr, avr_eeprom_write, p);
+	avr_register_io_read(avr, p->r_eecr, avr_eeprom_read, p);
+	avr_register_io_read_poll(avr, p->r_eecr);
 }
 
+
+int
+avr_eeprom_map(
+		avr_t * avr,
+		const char * filename)
+{
+	avr_eeprom_t * p = NULL;
+	for (avr_io_t * port = avr->io_port; port && !p; port = port->next)
+		if (!strcmp(port->kind, "eeprom"))
+			p = (avr_eeprom_t *)port;
+	if (!p || !p->size)
+		return -1;
+#ifdef __MINGW32__
+	AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: can't map %s on this host\n",
+			__FUNCTION__, filename);
+	return -1;
+#else
+	int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st)) {
+		AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: %s: %s\n",
+				__FUNCTION__, filename, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	// what the file doesn't have yet comes from the current content
+	off_t have = st.st_size < p->size ? st.st_size : p->size;
+	if (have < p->size &&
+			pwrite(fd, p->eeprom + have, p->size - have, have) != p->size - have) {
+		AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: can't extend %s\n",
+				__FUNCTION__, filename);
+		close(fd);
+		return -1;
+	}
+	uint8_t * ee = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ee == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: can't map %s\n",
+				__FUNCTION__, filename);
+		return -1;
+	}
+	avr_eeprom_rebind(p, ee, EEPROM_OWN_MAPPED);
+	return 0;
+#endif
+}
@@ -28,11 +28,20 @@ extern "C" {
 
 #include "sim_avr.h"
 
+/*
+ * How long a write takes. EEPE stays set until then, and the EERIE
+ * interrupt, if enabled, comes at the end. There is a single cycle timer
+ * for the write in progress, moved along by the next one; a loop polling
+ * EEPE in the meantime is skipped up to it by the core.
+ */
+#define AVR_EEPROM_WRITE_USEC	3400
+
 typedef struct avr_eeprom_t {
 	avr_io_t	io;
 
 	uint8_t *	eeprom;	// actual bytes
 	uint16_t	size;	// size for this MCU
+	uint8_t		owner;	// EEPROM_OWN_*, who provides 'eeprom'
 	
 	uint8_t r_eearh;
 	uint8_t r_eearl;
@@ -46,6 +55,10 @@ typedef struct avr_eeprom_t {
 	avr_regbit_t 	eere;	// eeprom read enable
 	
 	avr_int_vector_t ready;	// EERIE vector
+
+	avr_cycle_count_t eempe_until;	// EEMPE clears itself by then
+	avr_cycle_count_t write_done;	// end of the write in progress
+	avr_cycle_timer_handle_t write_timer;
 } avr_eeprom_t;
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * port);
@@ -58,6 +71,31 @@ typedef struct avr_eeprom_desc_t {
 
 #define AVR_IOCTL_EEPROM_GET	AVR_IOCTL_DEF('e','e','g','p')
 #define AVR_IOCTL_EEPROM_SET	AVR_IOCTL_DEF('e','e','s','p')
+/*
+ * Makes the 'size' bytes at 'ee' the EEPROM itself, instead of a copy;
+ * 'offset' must be 0 and 'size' at least the EEPROM size. The buffer
+ * stays the caller's, and must outlive the core. A NULL 'ee' goes back
+ * to a private buffer, with the current content.
+ */
+#define AVR_IOCTL_EEPROM_BIND	AVR_IOCTL_DEF('e','e','b','p')
+
+enum {
+	EEPROM_OWN_MALLOC = 0,
+	EEPROM_OWN_CALLER,
+	EEPROM_OWN_MAPPED,
+};
+
+/*
+ * Uses the file 'filename' as the EEPROM, mapped shared, so what the
+ * firmware writes is in the file as it happens, and the next run starts
+ * from it. A file that doesn't exist, or is short, is first filled with
+ * the current EEPROM content, so this goes after loading the firmware.
+ * Returns 0, or -1.
+ */
+int
+avr_eeprom_map(
+		avr_t * avr,
+		const char * filename);
 
 
 /*
@@ -24,40 +24,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_extint.h"
+#include "sim_snapshot.h"
 #include "avr_ioport.h"
 
-typedef struct avr_extint_poll_context_t {
-	uint32_t	eint_no; // index of particular interrupt source we are monitoring
-	avr_extint_t *extint;
-} avr_extint_poll_context_t;
+// the sense mode of an INT: 0 level, 1 toggle, 2 falling, 3 rising edge
+static uint8_t avr_extint_mode(avr_t * avr, avr_extint_t * p, int i)
+{
+	uint8_t isc_bits = p->eint[i].isc[1].reg ? 2 : 1;
+	uint8_t mode = avr_regbit_get_array(avr, p->eint[i].isc, isc_bits);
+
+	// Asynchronous interrupts, eg int2 in m16, m32 etc. support only down/up
+	if (isc_bits == 1)
+		mode +=2;
+	return mode;
+}
 
+static void avr_extint_level_raise(avr_t * avr, avr_extint_t * p, int i)
+{
+	if (avr->sreg[S_I]) {
+		uint8_t raised = avr_regbit_get(avr, p->eint[i].vector.raised) || p->eint[i].vector.pending;
+		if (!raised)
+			avr_raise_interrupt(avr, &p->eint[i].vector);
+	}
+}
+
+/*
+ * One timer polls all the level triggered INTs held low, while they are
+ * enabled; 'poll_mask' has them
+ */
 static avr_cycle_count_t avr_extint_poll_level_trig(
 		struct avr_t * avr,
 		avr_cycle_count_t when,
 		void * param)
 {
-	avr_extint_poll_context_t *poll = (avr_extint_poll_context_t *)param;
-	avr_extint_t * p = (avr_extint_t *)poll->extint;
-
-	char port = p->eint[poll->eint_no].port_ioctl & 0xFF;
-	avr_ioport_state_t iostate;
-	if (avr_ioctl(avr, AVR_IOCTL_IOPORT_GETSTATE( port ), &iostate) < 0)
-		goto terminate_poll;
-	uint8_t bit = ( iostate.pin >> p->eint[poll->eint_no].port_pin ) & 1;
-	if (bit)
-		goto terminate_poll; // Only poll while pin level remains low
+	avr_extint_t * p = (avr_extint_t *)param;
 
-	if (avr->sreg[S_I]) {
-		uint8_t raised = avr_regbit_get(avr, p->eint[poll->eint_no].vector.raised) || p->eint[poll->eint_no].vector.pending;
-		if (!raised)
-			avr_raise_interrupt(avr, &p->eint[poll->eint_no].vector);
+	for (uint8_t m = p->poll_mask; m; m &= m - 1) {
+		int i = __builtin_ctz(m);
+		// Only poll while pin level remains low
+		if (p->io.irq[i].value || avr_extint_mode(avr, p, i) != 0 ||
+				!p->eint[i].strict_lvl_trig ||
+				!avr_regbit_get(avr, p->eint[i].vector.enable)) {
+			p->poll_mask &= ~(1 << i);
+			continue;
+		}
+		avr_extint_level_raise(avr, p, i);
 	}
+	return p->poll_mask ? when + 1 : 0;
+}
 
-	return when+1;
-
-terminate_poll:
-	free(poll);
-	return 0;
+static void avr_extint_poll_start(avr_t * avr, avr_extint_t * p, int i)
+{
+	if (!p->poll_mask)
+		avr_cycle_timer_register(avr, 1, avr_extint_poll_level_trig, p);
+	p->poll_mask |= 1 << i;
 }
 
 static avr_extint_t * avr_extint_get(avr_t * avr)
@@ -120,15 +140,7 @@ static void avr_extint_irq_notify(struct avr_irq_t * irq, uint32_t value, void *
 	int up = !irq->value && value;
 	int down = irq->value && !value;
 
-	// ?? uint8_t isc_bits = p->eint[irq->irq + 1].isc->reg ? 2 : 1;
-	uint8_t isc_bits = p->eint[irq->irq].isc[1].reg ? 2 : 1;
-	uint8_t mode = avr_regbit_get_array(avr, p->eint[irq->irq].isc, isc_bits);
-
-	// Asynchronous interrupts, eg int2 in m16, m32 etc. support only down/up
-	if (isc_bits == 1)
-		mode +=2;
-
-	switch (mode) {
+	switch (avr_extint_mode(avr, p, irq->irq)) {
 		case 0: // Level triggered (low level) interrupt
 			{
 				/**
@@ -138,21 +150,13 @@ static void avr_extint_irq_notify(struct avr_irq_t * irq, uint32_t value, void *
 					Thus we have to query the pin value continiously while it's held low and try to trigger the interrupt.
 					This can be expensive, so avr_extint_set_strict_lvl_trig function provisioned to allow the user
 					to turn this feature off. In this case bahaviour will be similar to the falling edge interrupt.
+					A level interrupt leaves no flag, so nothing is done while it's
+					masked: enabling it is caught by avr_extint_enable_write().
 				 */
-				if (!value) {
-					if (avr->sreg[S_I]) {
-						uint8_t raised = avr_regbit_get(avr, p->eint[irq->irq].vector.raised) || p->eint[irq->irq].vector.pending;
-						if (!raised)
-							avr_raise_interrupt(avr, &p->eint[irq->irq].vector);
-					}
-					if (p->eint[irq->irq].strict_lvl_trig) {
-						avr_extint_poll_context_t *poll = malloc(sizeof(avr_extint_poll_context_t));
-						if (poll) {
-							poll->eint_no = irq->irq;
-							poll->extint = p;
-							avr_cycle_timer_register(avr, 1, avr_extint_poll_level_trig, poll);
-						}
-					}
+				if (!value && avr_regbit_get(avr, p->eint[irq->irq].vector.enable)) {
+					avr_extint_level_raise(avr, p, irq->irq);
+					if (p->eint[irq->irq].strict_lvl_trig)
+						avr_extint_poll_start(avr, p, irq->irq);
 				}
 			}
 			break;
@@ -171,10 +175,37 @@ static void avr_extint_irq_notify(struct avr_irq_t * irq, uint32_t value, void *
 	}
 }
 
+/*
+ * EIMSK, or whatever has the enable bits: a level triggered INT that gets
+ * unmasked while its pin is held low triggers right away
+ */
+static void avr_extint_enable_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
+{
+	avr_extint_t * p = (avr_extint_t *)param;
+	uint8_t old = avr->data[addr];
+
+	avr_core_watch_write(avr, addr, v);
+	for (int i = 0; i < EXTINT_COUNT; i++) {
+		avr_regbit_t en = p->eint[i].vector.enable;
+		if (!p->eint[i].port_ioctl || !p->eint[i].isc[1].reg || en.reg != addr ||
+				!(v & ~old & (en.mask << en.bit)))
+			continue;
+		avr_irq_t * irq = p->io.irq + i;
+		if ((irq->flags & IRQ_FLAG_INIT) || irq->value ||
+				avr_extint_mode(avr, p, i) != 0)
+			continue;
+		avr_extint_level_raise(avr, p, i);
+		if (p->eint[i].strict_lvl_trig)
+			avr_extint_poll_start(avr, p, i);
+	}
+}
+
 static void avr_extint_reset(avr_io_t * port)
 {
 	avr_extint_t * p = (avr_extint_t *)port;
 
+	p->poll_mask = 0;
+
 	for (int i = 0; i < EXTINT_COUNT; i++) {
 		avr_irq_register_notify(p->io.irq + i, avr_extint_irq_notify, p);
 
@@ -200,10 +231,19 @@ static const char * irq_names[EXTINT_COUNT] = {
 	[EXTINT_IRQ_OUT_INT7] = "<int7",
 };
 
+static void
+avr_extint_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_snapshot_io(s, io, sizeof(avr_extint_t));
+}
+
 static	avr_io_t	_io = {
 	.kind = "extint",
 	.reset = avr_extint_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_extint_snapshot,
 };
 
 void avr_extint_init(avr_t * avr, avr_extint_t * p)
@@ -211,8 +251,14 @@ void avr_extint_init(avr_t * avr, avr_extint_t * p)
 	p->io = _io;
 
 	avr_register_io(avr, &p->io);
-	for (int i = 0; i < EXTINT_COUNT; i++)
+	for (int i = 0; i < EXTINT_COUNT; i++) {
 		avr_register_vector(avr, &p->eint[i].vector);
+		if (p->eint[i].port_ioctl && p->eint[i].isc[1].reg &&
+				p->eint[i].vector.enable.reg)
+			avr_register_io_write_mask(avr, p->eint[i].vector.enable.reg,
+					p->eint[i].vector.enable.mask << p->eint[i].vector.enable.bit,
+					avr_extint_enable_write, p);
+	}
 
 	// allocate this module's IRQ
 	avr_io_setirqs(&p->io, AVR_IOCTL_EXTINT_GETIRQ(), EXTINT_COUNT, NULL);
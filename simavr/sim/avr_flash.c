@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_flash.h"
+#include "sim_snapshot.h"
+#include "sim_core.h"
 
 static avr_cycle_count_t avr_progen_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -53,12 +55,41 @@ static void avr_flash_clear_temppage(avr_flash_t *p)
 	}
 }
 
+static void avr_flash_page_done(avr_flash_t *p, avr_flashaddr_t z, int irq)
+{
+	uint32_t page = z / p->spm_pagesize;
+
+	if (p->dirty && page < p->pages)
+		p->dirty[page >> 5] |= 1u << (page & 31);
+	avr_raise_irq(p->io.irq + irq, page);
+}
+
+static int avr_flash_get_dirty(avr_flash_t *p, avr_flash_dirty_t *d)
+{
+	uint32_t words = (p->pages + 31) >> 5;
+
+	if (d->map && p->dirty) {
+		uint32_t n = d->pages < p->pages ? d->pages : p->pages;
+		memset(d->map, 0, ((d->pages + 31) >> 5) * sizeof(uint32_t));
+		for (uint32_t i = 0; i < n; i++)
+			if (p->dirty[i >> 5] & (1u << (i & 31)))
+				d->map[i >> 5] |= 1u << (i & 31);
+	}
+	d->pages = p->pages;
+	if (d->clear && p->dirty)
+		memset(p->dirty, 0, words * sizeof(uint32_t));
+	return 0;
+}
+
 static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
 {
+	avr_flash_t * p = (avr_flash_t *)port;
+
+	if (ctl == AVR_IOCTL_FLASH_GET_DIRTY)
+		return avr_flash_get_dirty(p, io_param);
 	if (ctl != AVR_IOCTL_FLASH_SPM)
 		return -1;
 
-	avr_flash_t * p = (avr_flash_t *)port;
 	avr_t * avr = p->io.avr;
 
 	avr_flashaddr_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
@@ -69,20 +100,29 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 //	printf("AVR_IOCTL_FLASH_SPM %02x Z:%04x R01:%04x\n", avr->data[p->r_spm], z,r01);
 	if (avr_regbit_get(avr, p->selfprgen)) {
 		avr_cycle_timer_cancel(avr, avr_progen_clear, p);
+		if ((avr_regbit_get(avr, p->pgers) || avr_regbit_get(avr, p->pgwrt)) &&
+				avr_flash_unshare(avr))
+			return -1;
 
 		if (avr_regbit_get(avr, p->pgers)) {
 			z &= ~1;
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_predecode_invalidate(avr, z, p->spm_pagesize);
+			avr_dirty_mark(avr->dirty.flash, z, p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize; i++)
-				avr->flash[z++] = 0xff;
+				avr->flash[z + i] = 0xff;
+			avr_flash_page_done(p, z, FLASH_IRQ_ERASE);
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
 			z &= ~(p->spm_pagesize - 1);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_predecode_invalidate(avr, z, p->spm_pagesize);
+			avr_dirty_mark(avr->dirty.flash, z, p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
-				avr->flash[z++] = p->tmppage[i];
-				avr->flash[z++] = p->tmppage[i] >> 8;
+				avr->flash[z + i * 2] = p->tmppage[i];
+				avr->flash[z + i * 2 + 1] = p->tmppage[i] >> 8;
 			}
 			avr_flash_clear_temppage(p);
+			avr_flash_page_done(p, z, FLASH_IRQ_WRITE);
 		} else if (avr_regbit_get(avr, p->blbset)) {
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Setting lock bits (ignored)\n");
 		} else if (p->flags & AVR_SELFPROG_HAVE_RWW && avr_regbit_get(avr, p->rwwsre)) {
@@ -118,13 +158,55 @@ avr_flash_dealloc(struct avr_io_t * port)
 
 	if (p->tmppage_used)
 		free(p->tmppage_used);
+
+	free(p->dirty);
+	p->dirty = NULL;
+}
+
+static void
+avr_flash_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_flash_t * p = (avr_flash_t *)io;
+	uint16_t * tmppage = p->tmppage;
+	uint8_t * tmppage_used = p->tmppage_used;
+	uint32_t * dirty = p->dirty;
+	avr_snapshot_io(s, io, sizeof(*p));
+	p->tmppage = tmppage;
+	p->tmppage_used = tmppage_used;
+	p->dirty = dirty;
+	if (dirty)
+		avr_snapshot_data(s, dirty, ((p->pages + 31) >> 5) * sizeof(uint32_t));
+	if (tmppage)
+		avr_snapshot_data(s, tmppage, p->spm_pagesize);
+	if (tmppage_used)
+		avr_snapshot_data(s, tmppage_used, p->spm_pagesize / 2);
 }
 
+static size_t
+avr_flash_memory(
+		avr_io_t * io)
+{
+	avr_flash_t * p = (avr_flash_t *)io;
+	return (p->tmppage ? p->spm_pagesize : 0) +
+			(p->tmppage_used ? p->spm_pagesize / 2 : 0) +
+			(p->dirty ? ((p->pages + 31) >> 5) * sizeof(uint32_t) : 0);
+}
+
+static const char * irq_names[FLASH_IRQ_COUNT] = {
+	[FLASH_IRQ_ERASE] = "16>erase",
+	[FLASH_IRQ_WRITE] = "16>write",
+};
+
 static	avr_io_t	_io = {
 	.kind = "flash",
+	.irq_names = irq_names,
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
+	.snapshot = avr_flash_snapshot,
+	.memory = avr_flash_memory,
 };
 
 void avr_flash_init(avr_t * avr, avr_flash_t * p)
@@ -138,8 +220,13 @@ void avr_flash_init(avr_t * avr, avr_flash_t * p)
 	if (!p->tmppage_used)
 		p->tmppage_used = malloc(p->spm_pagesize / 2);
 
+	p->pages = (avr->flashend + 1) / p->spm_pagesize;
+	if (!p->dirty)
+		p->dirty = calloc((p->pages + 31) >> 5, sizeof(uint32_t));
+
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->flash);
+	avr_io_setirqs(&p->io, AVR_IOCTL_FLASH_GETIRQ(), FLASH_IRQ_COUNT, NULL);
 
 	avr_register_io_write(avr, p->r_spm, avr_flash_write, p);
 }
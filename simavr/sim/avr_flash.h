@@ -32,7 +32,37 @@ extern "C" {
 /*
  * Handles self-programming subsystem if the core
  * supports it.
+ *
+ * Each page the firmware erases, or writes, with SPM raises FLASH_IRQ_ERASE
+ * or FLASH_IRQ_WRITE with its index (the byte address / spm_pagesize), once
+ * the flash holds the new content, and is set in a bitmap of dirty pages,
+ * read and cleared with AVR_IOCTL_FLASH_GET_DIRTY. The predecoded cache and
+ * the snapshots already follow these writes by themselves; this is for the
+ * bootloader tests, and anything else that keeps a copy of the program.
+ * Code loaded with avr_loadcode(), or by gdb, doesn't go through here.
  */
+enum {
+	FLASH_IRQ_ERASE = 0,	// page index
+	FLASH_IRQ_WRITE,		// page index
+	FLASH_IRQ_COUNT
+};
+
+#define AVR_IOCTL_FLASH_GETIRQ()	AVR_IOCTL_DEF('f','l','s',' ')
+
+/*
+ * Takes an avr_flash_dirty_t*: copies up to 'pages' bits of the dirty
+ * bitmap into 'map' (bit n of map[n / 32] for page n), sets 'pages' to
+ * the page count of the flash, and clears the bitmap if 'clear' is set.
+ * 'map' can be NULL to only get the count, or to clear
+ */
+#define AVR_IOCTL_FLASH_GET_DIRTY	AVR_IOCTL_DEF('f','l','d','y')
+
+typedef struct avr_flash_dirty_t {
+	uint32_t *	map;
+	uint32_t	pages;
+	uint8_t		clear;
+} avr_flash_dirty_t;
+
 typedef struct avr_flash_t {
 	avr_io_t	io;
 
@@ -49,6 +79,9 @@ typedef struct avr_flash_t {
 	avr_regbit_t rwwsb;		// read while write section busy
 
 	avr_int_vector_t flash;	// Interrupt vector
+
+	uint32_t	pages;
+	uint32_t	*dirty;		// a bit per page written since last cleared
 } avr_flash_t;
 
 /* Set if the flash supports a Read While Write section */
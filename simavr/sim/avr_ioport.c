@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
 
 #define D(_w)
 
@@ -37,6 +38,18 @@ avr_ioport_read(
 	// made to trigger potential watchpoints
 	v = avr_core_watch_read(avr, addr);
 	avr_raise_irq(p->io.irq + IOPORT_IRQ_REG_PIN, v);
+	/*
+	 * The busy loops on PIN are only skipped, and its reads cached, while
+	 * nothing sees these raises; a hook coming or going has the core call
+	 * this again, see avr_register_io_read_cached()
+	 */
+	if (avr_irq_hook_count(p->io.irq + IOPORT_IRQ_REG_PIN)) {
+		avr_unregister_io_read_poll(avr, addr);
+		avr_register_io_read_cached(avr, addr, NULL);
+	} else {
+		avr_register_io_read_poll(avr, addr);
+		avr_register_io_read_cached(avr, addr, &p->pin_version);
+	}
 	D(if (avr->data[addr] != v) printf("** PIN%c(%02x) = %02x\r\n", p->name, addr, v);)
 
 	return v;
@@ -48,17 +61,37 @@ avr_ioport_update_irqs(
 {
 	avr_t * avr = p->io.avr;
 	uint8_t ddr = avr->data[p->r_ddr];
+	uint8_t port = avr->data[p->r_port];
+	uint8_t pull = p->external.pull_mask & ~ddr;
 	// Set the PORT value if the pin is marked as output
 	// otherwise, if there is an 'external' pullup, set it
 	// otherwise, if the PORT pin was 1 to indicate an
 	// internal pullup, set that.
-	for (int i = 0; i < 8; i++) {
-		if (ddr & (1 << i))
-			avr_raise_irq(p->io.irq + i, (avr->data[p->r_port] >> i) & 1);
-		else if (p->external.pull_mask & (1 << i))
-			avr_raise_irq(p->io.irq + i, (p->external.pull_value >> i) & 1);
-		else if ((avr->data[p->r_port] >> i) & 1)
-			avr_raise_irq(p->io.irq + i, 1);
+	uint8_t drive = ddr | pull | port;
+	uint8_t out = (port & ~pull) | (p->external.pull_value & pull);
+	/*
+	 * The pin IRQs are filtered, only bother raising the ones that would
+	 * notify anyone, in pin order as before.
+	 */
+	p->driving = 1;
+	while (drive) {
+		int i = __builtin_ctz(drive);
+		avr_irq_t * irq = p->io.irq + i;
+		uint32_t v = (out >> i) & 1;
+		uint32_t o = (irq->flags & IRQ_FLAG_NOT) ? !v : v;
+		// a pin that was floating is driven now, even to the same value
+		if (o != irq->value ||
+				(irq->flags & (IRQ_FLAG_INIT | IRQ_FLAG_FILTERED |
+					IRQ_FLAG_FLOATING)) != IRQ_FLAG_FILTERED)
+			avr_raise_irq_float(irq, v, 0);
+		drive &= drive - 1;
+	}
+	p->driving = 0;
+	// the pin changes it just made, checked against PCMSK at once
+	if (p->pcint_changed) {
+		if (p->r_pcint && (avr->data[p->r_pcint] & p->pcint_changed))
+			avr_raise_interrupt(avr, &p->pcint);
+		p->pcint_changed = 0;
 	}
 	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (avr->data[p->r_port] & ddr);
 	pin = (pin & ~p->external.pull_mask) | p->external.pull_value;
@@ -67,11 +100,8 @@ avr_ioport_update_irqs(
 	// if IRQs are registered on the PORT register (for example, VCD dumps) send
 	// those as well
 	avr_io_addr_t port_io = AVR_DATA_TO_IO(p->r_port);
-	if (avr->io[port_io].irq) {
-		avr_raise_irq(avr->io[port_io].irq + AVR_IOMEM_IRQ_ALL, avr->data[p->r_port]);
-		for (int i = 0; i < 8; i++)
-			avr_raise_irq(avr->io[port_io].irq + i, (avr->data[p->r_port] >> i) & 1);
- 	}
+	if (avr->io[port_io].irq)
+		avr_iomem_raise_irq(avr->io[port_io].irq, avr->data[p->r_port]);
 }
 
 static void
@@ -147,11 +177,14 @@ avr_ioport_irq_notify(
 	avr->data[p->r_pin] &= ~mask;
 	if (value)
 		avr->data[p->r_pin] |= mask;
+	p->pin_version++;
 
 	if (output)	// if the IRQ was marked as Output, also do the IO write
 		avr_ioport_write(avr, p->r_port, (avr->data[p->r_port] & ~mask) | (value ? mask : 0), p);
 
-	if (p->r_pcint) {
+	if (p->driving || p->setting)
+		p->pcint_changed |= mask;
+	else if (p->r_pcint) {
 		// if the pcint bit is on, try to raise it
 		int raise = avr->data[p->r_pcint] & mask;
 		if (raise)
@@ -160,10 +193,40 @@ avr_ioport_irq_notify(
 }
 
 static void
-avr_ioport_reset(
+avr_ioport_set_pins(
+		avr_ioport_t * p,
+		avr_ioport_pins_t * pins)
+{
+	avr_t * avr = p->io.avr;
+	uint8_t mask = pins->mask;
+
+	avr->data[p->r_pin] = (avr->data[p->r_pin] & ~mask) | (pins->value & mask);
+	p->pin_version++;
+	/*
+	 * The pin irqs are filtered, only the ones that change notify, and
+	 * these notifications only collect the pin changes
+	 */
+	p->setting = 1;
+	while (mask) {
+		int i = __builtin_ctz(mask);
+		avr_raise_irq(p->io.irq + i, (pins->value >> i) & 1);
+		mask &= mask - 1;
+	}
+	p->setting = 0;
+	if (p->pcint_changed && !p->driving) {
+		if (p->r_pcint && (avr->data[p->r_pcint] & p->pcint_changed))
+			avr_raise_interrupt(avr, &p->pcint);
+		p->pcint_changed = 0;
+	}
+}
+
+static void
+avr_ioport_irq_attach(
 		avr_io_t * port)
 {
 	avr_ioport_t * p = (avr_ioport_t *)port;
+	for (int i = 0; i < IOPORT_IRQ_COUNT; i++)
+		p->io.irq[i].flags |= IRQ_FLAG_FILTERED;
 	for (int i = 0; i < IOPORT_IRQ_PIN_ALL; i++)
 		avr_irq_register_notify(p->io.irq + i, avr_ioport_irq_notify, p);
 }
@@ -189,6 +252,8 @@ avr_ioport_ioctl(
 			if (r->bit.reg == p->r_port || r->bit.reg == p->r_pin || r->bit.reg == p->r_ddr) {
 				// it's us ! check the special case when the "all pins" irq is requested
 				int o = 0;
+				// the other modules connect to them
+				avr_io_irqs(&p->io);
 				if (r->bit.mask == 0xff)
 					r->irq[o++] = &p->io.irq[IOPORT_IRQ_PIN_ALL];
 				else {
@@ -226,6 +291,10 @@ avr_ioport_ioctl(
 				p->external.pull_value = m->value;
 				res = 0;
 			}
+			if (ctl == AVR_IOCTL_IOPORT_SET_PINS(p->name)) {
+				avr_ioport_set_pins(p, (avr_ioport_pins_t*)io_param);
+				res = 0;
+			}
 		}
 	}
 
@@ -247,11 +316,20 @@ static const char * irq_names[IOPORT_IRQ_COUNT] = {
 	[IOPORT_IRQ_REG_PIN] = "8>pin",
 };
 
+static void
+avr_ioport_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_snapshot_io(s, io, sizeof(avr_ioport_t));
+}
+
 static	avr_io_t	_io = {
 	.kind = "port",
-	.reset = avr_ioport_reset,
+	.irq_attach = avr_ioport_irq_attach,
 	.ioctl = avr_ioport_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_ioport_snapshot,
 };
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
@@ -268,14 +346,14 @@ void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->pcint);
-	// allocate this module's IRQ
+	// allocate this module's IRQ, see avr_ioport_irq_attach()
 	avr_io_setirqs(&p->io, AVR_IOCTL_IOPORT_GETIRQ(p->name), IOPORT_IRQ_COUNT, NULL);
 
-	for (int i = 0; i < IOPORT_IRQ_COUNT; i++)
-		p->io.irq[i].flags |= IRQ_FLAG_FILTERED;
-
 	avr_register_io_write(avr, p->r_port, avr_ioport_write, p);
 	avr_register_io_read(avr, p->r_pin, avr_ioport_read, p);
+	avr_register_io_read_poll(avr, p->r_pin);
+	// PORT and DDR writes are core writes, they invalidate it already
+	avr_register_io_read_cached(avr, p->r_pin, &p->pin_version);
 	avr_register_io_write(avr, p->r_pin, avr_ioport_pin_write, p);
 	avr_register_io_write(avr, p->r_ddr, avr_ioport_ddr_write, p);
 }
@@ -32,7 +32,7 @@ enum {
 	IOPORT_IRQ_PIN0 = 0,
 	IOPORT_IRQ_PIN1,IOPORT_IRQ_PIN2,IOPORT_IRQ_PIN3,IOPORT_IRQ_PIN4,
 	IOPORT_IRQ_PIN5,IOPORT_IRQ_PIN6,IOPORT_IRQ_PIN7,
-	IOPORT_IRQ_PIN_ALL,
+	IOPORT_IRQ_PIN_ALL,		// the 8 pins in one go, notified once per change
 	IOPORT_IRQ_DIRECTION_ALL,
 	IOPORT_IRQ_REG_PORT,
 	IOPORT_IRQ_REG_PIN,
@@ -84,6 +84,20 @@ typedef struct avr_ioport_external_t {
 // add port name (uppercase) to set default input pin IRQ values
 #define AVR_IOCTL_IOPORT_SET_EXTERNAL(_name) AVR_IOCTL_DEF('i','o','p',(_name))
 
+/*
+ * ioctl that sets the input pins of 'mask' to 'value' in one go, as
+ * raising their pin IRQs would, for a bus driven from outside (see the
+ * VCD input): the PIN register is written once, the pin IRQs are raised
+ * for whoever listens to them, and the pin change interrupt is checked
+ * once, for all the pins that changed.
+ */
+typedef struct avr_ioport_pins_t {
+	uint8_t mask, value;
+} avr_ioport_pins_t;
+
+// add port name (uppercase) to set some of its pins
+#define AVR_IOCTL_IOPORT_SET_PINS(_name) AVR_IOCTL_DEF('i','o','i',(_name))
+
 /**
  * pin structure
  */
@@ -114,6 +128,10 @@ typedef struct avr_ioport_t {
 	struct {
 		uint8_t pull_mask, pull_value;
 	} external;
+	uint8_t driving;	// raising the pin irqs itself, see sim_replay.h
+	uint8_t setting;	// AVR_IOCTL_IOPORT_SET_PINS raising the pin irqs
+	uint8_t pcint_changed;	// the pins that changed while 'driving', or 'setting'
+	uint32_t pin_version;	// bumped when the PIN read could change, see sim_io.h
 } avr_ioport_t;
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * port);
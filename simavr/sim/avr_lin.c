@@ -21,9 +21,18 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "avr_lin.h"
 #include "sim_time.h"
 
+enum {
+	LIN_RX_IDLE = 0,
+	LIN_RX_SYNC,		// had the break
+	LIN_RX_PID,			// had the sync
+	LIN_RX_DATA,		// had the protected id, or sent one
+};
+
 
 static void
 avr_lin_baud_write(
@@ -83,13 +92,294 @@ avr_lin_reset(
 
 	AVR_LOG(avr, LOG_TRACE, "LIN: UART: reset\n");
 
-	p->uart.io.reset(&p->uart.io);
+	// the UART is an io of its own, and has been reset already
 	avr->data[p->r_linbtr] = 0x20;
+	p->tx.head = p->tx.count = 0;
+	avr_cycle_timer_cancel_handle(avr, &p->rx.timer);
+	p->rx.state = LIN_RX_IDLE;
+}
+
+uint8_t
+avr_lin_pid(
+		uint8_t id)
+{
+	id &= 0x3f;
+	uint8_t p0 = (id ^ (id >> 1) ^ (id >> 2) ^ (id >> 4)) & 1;
+	uint8_t p1 = ~((id >> 1) ^ (id >> 3) ^ (id >> 4) ^ (id >> 5)) & 1;
+	return id | (p0 << 6) | (p1 << 7);
+}
+
+static uint8_t
+_avr_lin_sum(
+		uint8_t pid,
+		const uint8_t * data,
+		uint8_t count,
+		int enhanced)
+{
+	uint16_t sum = enhanced ? pid : 0;
+	for (int i = 0; i < count; i++) {
+		sum += data[i];
+		if (sum > 0xff)
+			sum -= 0xff;	// the carry goes back in
+	}
+	return ~sum;
+}
+
+uint8_t
+avr_lin_checksum(
+		const avr_lin_frame_t * frame)
+{
+	return _avr_lin_sum(avr_lin_pid(frame->id), frame->data,
+			frame->count, frame->enhanced);
+}
+
+/*
+ * The UART pulls the queued bytes as its input source; once they are all
+ * gone it's removed, and put back by the next frame sent.
+ */
+static int
+_avr_lin_pull(
+		void * param,
+		uint8_t * buf,
+		int size)
+{
+	avr_lin_t * p = param;
+
+	if (!p->tx.count) {
+		p->tx.head = 0;
+		return -1;
+	}
+	int got = p->tx.count < (uint32_t)size ? p->tx.count : size;
+	memcpy(buf, p->tx.buf + p->tx.head, got);
+	p->tx.head += got;
+	p->tx.count -= got;
+	return got;
+}
+
+static avr_cycle_count_t
+_avr_lin_byte_cycles(
+		avr_lin_t * p)
+{
+	if ((p->uart.flags & AVR_UART_FLAG_FAST) || !p->uart.cycles_per_byte)
+		return 1;
+	return avr_io_cycles(p->io.avr, p->uart.cycles_per_byte);
+}
+
+static void
+_avr_lin_rx_end(
+		avr_lin_t * p)
+{
+	avr_lin_frame_t f = {
+		.id = p->rx.pid & 0x3f,
+		.cycle = p->rx.cycle,
+	};
+
+	p->rx.state = LIN_RX_IDLE;
+	if (!p->hook.notify)
+		return;
+	// the last byte is the checksum, if there are any past the header
+	if (p->rx.count) {
+		f.count = p->rx.count - 1;
+		memcpy(f.data, p->rx.buf, f.count);
+		uint8_t sum = p->rx.buf[f.count];
+		if (_avr_lin_sum(p->rx.pid, f.data, f.count, 1) == sum) {
+			f.enhanced = 1;
+			f.checksum_ok = 1;
+		} else
+			f.checksum_ok =
+				_avr_lin_sum(p->rx.pid, f.data, f.count, 0) == sum;
+	} else
+		f.checksum_ok = 1;
+	p->hook.notify(p->io.avr, &f, p->hook.param);
+}
+
+static avr_cycle_count_t
+_avr_lin_rx_timeout(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_lin_t * p = param;
+
+	if (p->rx.state == LIN_RX_DATA)
+		_avr_lin_rx_end(p);
+	else
+		p->rx.state = LIN_RX_IDLE;
+	return 0;
+}
+
+static void
+_avr_lin_rx_arm(
+		avr_lin_t * p,
+		uint32_t bytes)
+{
+	avr_cycle_timer_register_handle(p->io.avr, &p->rx.timer,
+			bytes * _avr_lin_byte_cycles(p), _avr_lin_rx_timeout, p);
+}
+
+/*
+ * Each byte the firmware sends, on UART_IRQ_OUTPUT; only hooked while
+ * there is a frame hook
+ */
+static void
+_avr_lin_rx(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_lin_t * p = param;
+	uint8_t b = value;
+
+	switch (p->rx.state) {
+		case LIN_RX_IDLE:
+			if (b != 0x00)
+				return;
+			p->rx.cycle = p->io.avr->cycle;
+			p->rx.state = LIN_RX_SYNC;
+			break;
+		case LIN_RX_SYNC:
+			p->rx.state = b == 0x55 ? LIN_RX_PID : LIN_RX_IDLE;
+			break;
+		case LIN_RX_PID:
+			if (avr_lin_pid(b) != b) {
+				AVR_LOG(p->io.avr, LOG_WARNING,
+						"LIN: %s: bad parity in id %02x\n", __func__, b);
+				p->rx.state = LIN_RX_IDLE;
+				break;
+			}
+			p->rx.pid = b;
+			p->rx.count = 0;
+			p->rx.state = LIN_RX_DATA;
+			break;
+		case LIN_RX_DATA:
+			p->rx.buf[p->rx.count++] = b;
+			if (p->rx.count == sizeof(p->rx.buf)) {
+				avr_cycle_timer_cancel_handle(p->io.avr, &p->rx.timer);
+				_avr_lin_rx_end(p);
+				return;
+			}
+			break;
+	}
+	if (p->rx.state == LIN_RX_IDLE)
+		avr_cycle_timer_cancel_handle(p->io.avr, &p->rx.timer);
+	else
+		_avr_lin_rx_arm(p, 2);
+}
+
+static int
+_avr_lin_send(
+		avr_lin_t * p,
+		const avr_lin_frame_t * f)
+{
+	avr_t * avr = p->io.avr;
+	uint8_t count = f->count > 8 ? 8 : f->count;
+	uint8_t pid = avr_lin_pid(f->id);
+	uint8_t frame[3 + 8 + 1];
+	int len = 0;
+
+	if (!f->response) {
+		frame[len++] = 0x00;	// break
+		frame[len++] = 0x55;	// sync
+		frame[len++] = pid;
+	}
+	if (count) {
+		memcpy(frame + len, f->data, count);
+		len += count;
+		frame[len++] = _avr_lin_sum(pid, f->data, count, f->enhanced);
+	}
+	if (!len)
+		return 0;
+	// compact what's left, grow if needed
+	if (p->tx.head) {
+		memmove(p->tx.buf, p->tx.buf + p->tx.head, p->tx.count);
+		p->tx.head = 0;
+	}
+	if (p->tx.count + len > p->tx.size) {
+		uint32_t size = p->tx.size ? p->tx.size : 64;
+		while (size < p->tx.count + len)
+			size *= 2;
+		uint8_t * buf = realloc(p->tx.buf, size);
+		if (!buf) {
+			AVR_LOG(avr, LOG_ERROR, "LIN: %s: out of memory\n", __func__);
+			return -1;
+		}
+		p->tx.buf = buf;
+		p->tx.size = size;
+	}
+	memcpy(p->tx.buf + p->tx.count, frame, len);
+	p->tx.count += len;
+
+	/*
+	 * A header alone asks the firmware for the response; it's decoded as
+	 * a frame with that id, once all that is queued has gone in
+	 */
+	if (!f->response && !count && p->hook.notify) {
+		p->rx.pid = pid;
+		p->rx.count = 0;
+		p->rx.cycle = avr->cycle;
+		p->rx.state = LIN_RX_DATA;
+		_avr_lin_rx_arm(p, p->tx.count + 2);
+	}
+	if (p->uart.source.pull != _avr_lin_pull) {
+		avr_uart_source_t src = {
+			.pull = _avr_lin_pull,
+			.param = p,
+		};
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_SOURCE(p->uart.name), &src);
+	}
+	return 0;
+}
+
+static int
+avr_lin_ioctl(
+		avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_lin_t * p = (avr_lin_t*) port;
+
+	if (ctl == AVR_IOCTL_LIN_SEND_FRAME(p->uart.name))
+		return _avr_lin_send(p, io_param);
+	if (ctl == AVR_IOCTL_LIN_SET_FRAME_HOOK(p->uart.name)) {
+		avr_lin_frame_hook_t * h = io_param;
+		avr_irq_t * out = p->uart.io.irq + UART_IRQ_OUTPUT;
+
+		if (p->hook.notify)
+			avr_irq_unregister_notify(out, _avr_lin_rx, p);
+		p->hook = *h;
+		p->rx.state = LIN_RX_IDLE;
+		avr_cycle_timer_cancel_handle(p->io.avr, &p->rx.timer);
+		if (p->hook.notify)
+			avr_irq_register_notify(out, _avr_lin_rx, p);
+		return 0;
+	}
+	return -1;
+}
+
+static void
+avr_lin_dealloc(
+		avr_io_t * port)
+{
+	avr_lin_t * p = (avr_lin_t*) port;
+
+	free(p->tx.buf);
+	p->tx.buf = NULL;
+	p->tx.size = p->tx.head = p->tx.count = 0;
+}
+
+static size_t
+avr_lin_memory(
+		avr_io_t * port)
+{
+	return ((avr_lin_t*) port)->tx.size;
 }
 
 static avr_io_t _io = {
 		.kind = "lin",
 		.reset = avr_lin_reset,
+		.ioctl = avr_lin_ioctl,
+		.dealloc = avr_lin_dealloc,
+		.memory = avr_lin_memory,
 };
 
 void
@@ -101,6 +391,7 @@ avr_lin_init(
 	avr_uart_init(avr, &p->uart);
 
 	p->io = _io;
+	avr_register_io(avr, &p->io);
 	avr_register_io_write(avr, p->r_linbtr, avr_lin_baud_write, p);
 	avr_register_io_write(avr, p->r_linbrrl, avr_lin_baud_write, p);
 }
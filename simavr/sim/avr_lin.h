@@ -30,6 +30,55 @@ extern "C" {
 #include "sim_avr.h"
 #include "avr_uart.h"
 
+/*
+ * Frames: the LIN controller only runs as a UART here, and a LIN frame
+ * goes through it a byte at a time: a break (a 0x00 byte, the UART mode
+ * can't tell a longer one), the 0x55 sync, the protected id, the data and
+ * the checksum. Rather than raising each of these on UART_IRQ_INPUT, and
+ * parsing them back from UART_IRQ_OUTPUT:
+ * + AVR_IOCTL_LIN_SEND_FRAME queues a whole avr_lin_frame_t; its bytes
+ *   are handed to the UART as its input source, that takes them at the
+ *   baud rate, with no irq on the way;
+ * + AVR_IOCTL_LIN_SET_FRAME_HOOK, with an avr_lin_frame_hook_t, has
+ *   'notify' called once per frame the firmware sends: a header of its own
+ *   with its response, if any, or the response to a header that was sent
+ *   to it. A frame ends after 8 data bytes and a checksum, or when the
+ *   line is idle for two byte times.
+ * The ioctls take the name of the UART, '0'.
+ */
+typedef struct avr_lin_frame_t {
+	uint8_t			id;			// 0 to 63, without the parity bits
+	uint8_t			count;		// data bytes, 0 for a header alone
+	uint8_t			data[8];
+	uint8_t			enhanced;	// the checksum covers the protected id (LIN 2.x)
+	// when sending, only the data and checksum, answering the firmware's header
+	uint8_t			response;
+	// when received
+	uint8_t			checksum_ok;
+	avr_cycle_count_t cycle;	// of its first byte
+} avr_lin_frame_t;
+
+typedef void (*avr_lin_frame_notify_t)(
+		struct avr_t * avr,
+		const avr_lin_frame_t * frame,
+		void * param);
+
+typedef struct avr_lin_frame_hook_t {
+	avr_lin_frame_notify_t notify;	// NULL to remove it
+	void *			param;
+} avr_lin_frame_hook_t;
+
+#define AVR_IOCTL_LIN_SEND_FRAME(_name)		AVR_IOCTL_DEF('l','i','s',(_name))
+#define AVR_IOCTL_LIN_SET_FRAME_HOOK(_name)	AVR_IOCTL_DEF('l','i','h',(_name))
+
+// the frame parity bits over 'id', and its checksum
+uint8_t
+avr_lin_pid(
+		uint8_t id);
+uint8_t
+avr_lin_checksum(
+		const avr_lin_frame_t * frame);
+
 typedef struct avr_lin_t {
 	avr_io_t io;
 
@@ -41,6 +90,21 @@ typedef struct avr_lin_t {
 	avr_regbit_t lbt;
 
 	avr_uart_t uart;  // used when LIN controller is setup as a UART
+
+	// frames, see AVR_IOCTL_LIN_SEND_FRAME
+	struct {
+		uint8_t *	buf;		// bytes queued for the UART input
+		uint32_t	head, count, size;
+	} tx;
+	avr_lin_frame_hook_t hook;
+	struct {
+		uint8_t		state;
+		uint8_t		pid;
+		uint8_t		count;
+		uint8_t		buf[9];
+		avr_cycle_count_t cycle;
+		avr_cycle_timer_handle_t timer;	// idle line, ends the frame
+	} rx;
 } avr_lin_t;
 
 void
@@ -21,6 +21,37 @@
 
 #include <stdio.h>
 #include "avr_spi.h"
+#include "avr_ioport.h"
+#include "sim_snapshot.h"
+
+static avr_spi_slave_t *
+avr_spi_selected(
+		avr_spi_t * p)
+{
+	avr_spi_slave_t * s = p->slave;
+	while (s && !s->selected)
+		s = s->next;
+	return s;
+}
+
+static uint8_t
+avr_spi_slave_byte(
+		avr_spi_slave_t * s,
+		uint8_t data)
+{
+	if (!s->reply_size && !s->sink_size)
+		return s->transfer(s->param, data);
+	uint8_t v = 0xff;
+	if (s->reply_size) {
+		v = *s->reply++;
+		s->reply_size--;
+	}
+	if (s->sink_size) {
+		*s->sink++ = data;
+		s->sink_size--;
+	}
+	return v;
+}
 
 static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -29,13 +60,33 @@ static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t whe
 	if (avr_regbit_get(avr, p->spe)) {
 		// in master mode, any byte is sent as it comes..
 		if (avr_regbit_get(avr, p->mstr)) {
-			avr_raise_interrupt(avr, &p->spi);
-			avr_raise_irq(p->io.irq + SPI_IRQ_OUTPUT, avr->data[p->r_spdr]);
+			avr_spi_slave_t * s = avr_spi_selected(p);
+			p->io.events++;
+			if (s) {
+				p->input_data_register = avr_spi_slave_byte(s, avr->data[p->r_spdr]);
+				avr_raise_interrupt(avr, &p->spi);
+			} else {
+				avr_raise_interrupt(avr, &p->spi);
+				avr_raise_irq(p->io.irq + SPI_IRQ_OUTPUT, avr->data[p->r_spdr]);
+			}
 		}
 	}
 	return 0;
 }
 
+// the 8 bits of a byte, at the SPR1:0 clock divider, halved by SPI2X
+static avr_cycle_count_t
+avr_spi_byte_cycles(
+		avr_spi_t * p)
+{
+	static const uint8_t div[4] = { 4, 16, 64, 128 };
+	avr_t * avr = p->io.avr;
+	uint8_t spr = avr_regbit_get(avr, p->spr[0]) |
+			(avr_regbit_get(avr, p->spr[1]) << 1);
+
+	return avr_io_cycles(avr, (8 * div[spr]) >> avr_regbit_get(avr, p->spr[2]));
+}
+
 static uint8_t avr_spi_read(struct avr_t * avr, avr_io_addr_t addr, void * param)
 {
 	avr_spi_t * p = (avr_spi_t *)param;
@@ -55,7 +106,7 @@ static void avr_spi_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, voi
 		avr_regbit_clear(avr, p->spi.raised);
 
 		avr_core_watch_write(avr, addr, v);
-		avr_cycle_timer_register_usec(avr, 100, avr_spi_raise, p); // should be speed dependent
+		avr_cycle_timer_register(avr, avr_spi_byte_cycles(p), avr_spi_raise, p);
 	}
 }
 
@@ -75,11 +126,12 @@ static void avr_spi_irq_input(struct avr_irq_t * irq, uint32_t value, void * par
 	// if in slave mode, 
 	// 'output' the byte only when we received one...
 	if (!avr_regbit_get(avr, p->mstr)) {
+		p->io.events++;
 		avr_raise_irq(p->io.irq + SPI_IRQ_OUTPUT, avr->data[p->r_spdr]);
 	}
 }
 
-void avr_spi_reset(struct avr_io_t *io)
+static void avr_spi_irq_attach(struct avr_io_t *io)
 {
 	avr_spi_t * p = (avr_spi_t *)io;
 	avr_irq_register_notify(p->io.irq + SPI_IRQ_INPUT, avr_spi_irq_input, p);
@@ -90,10 +142,74 @@ static const char * irq_names[SPI_IRQ_COUNT] = {
 	[SPI_IRQ_OUTPUT] = "8<out",
 };
 
+static void
+avr_spi_cs_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_spi_slave_t * s = (avr_spi_slave_t *)param;
+	int selected = value == 0;
+
+	if (selected == s->selected)
+		return;
+	s->selected = selected;
+	if (s->select)
+		s->select(s->param, selected);
+}
+
+static int
+avr_spi_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_spi_t * p = (avr_spi_t *)port;
+	avr_spi_slave_t * s = io_param;
+
+	if (!s)
+		return -1;
+	if (ctl == AVR_IOCTL_SPI_ADD_SLAVE(p->name)) {
+		s->cs = avr_io_getirq(p->io.avr, AVR_IOCTL_IOPORT_GETIRQ(s->port), s->pin);
+		if (!s->cs || !s->transfer)
+			return -1;
+		// the pin isn't driven low until it's been raised once
+		s->selected = !(s->cs->flags & IRQ_FLAG_INIT) && s->cs->value == 0;
+		avr_irq_register_notify(s->cs, avr_spi_cs_notify, s);
+		s->next = p->slave;
+		p->slave = s;
+		return 0;
+	}
+	if (ctl == AVR_IOCTL_SPI_DEL_SLAVE(p->name)) {
+		for (avr_spi_slave_t ** l = &p->slave; *l; l = &(*l)->next)
+			if (*l == s) {
+				*l = s->next;
+				avr_irq_unregister_notify(s->cs, avr_spi_cs_notify, s);
+				s->next = NULL;
+				return 0;
+			}
+	}
+	return -1;
+}
+
+static void
+avr_spi_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_spi_t * p = (avr_spi_t *)io;
+	// the slaves are left as they are
+	avr_spi_slave_t * slave = p->slave;
+	avr_snapshot_io(s, io, sizeof(avr_spi_t));
+	p->slave = slave;
+}
+
 static	avr_io_t	_io = {
 	.kind = "spi",
-	.reset = avr_spi_reset,
+	.irq_attach = avr_spi_irq_attach,
+	.ioctl = avr_spi_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_spi_snapshot,
 };
 
 void avr_spi_init(avr_t * avr, avr_spi_t * p)
@@ -101,6 +217,7 @@ void avr_spi_init(avr_t * avr, avr_spi_t * p)
 	p->io = _io;
 
 	avr_register_io(avr, &p->io);
+	avr_io_register_gate(&p->io, p->disabled, sizeof(*p));
 	avr_register_vector(avr, &p->spi);
 	// allocate this module's IRQ
 	avr_io_setirqs(&p->io, AVR_IOCTL_SPI_GETIRQ(p->name), SPI_IRQ_COUNT, NULL);
@@ -37,6 +37,48 @@ enum {
 // add port number to get the real IRQ
 #define AVR_IOCTL_SPI_GETIRQ(_name) AVR_IOCTL_DEF('s','p','i',(_name))
 
+/*
+ * A slave on the bus of the master, selected by its chip select pin being
+ * driven low. The bytes exchanged while it's selected only go to it, and
+ * not on SPI_IRQ_OUTPUT; with none selected, the irqs are used as before.
+ *
+ * A slave can answer in bulk: while 'reply_size' isn't zero, the bytes to
+ * send back are taken from 'reply', and while 'sink_size' isn't zero, the
+ * ones received are stored in 'sink'; 0xff is sent, or the byte dropped,
+ * when only one of them is set. 'transfer' is only called for the others,
+ * and can set them up for the following bytes.
+ */
+typedef struct avr_spi_slave_t {
+	char			port;		// 'B' for example
+	uint8_t			pin;		// of the chip select, active low
+	// exchanges a byte, returns the one sent back to the master
+	uint8_t (*transfer)(
+			void * param,
+			uint8_t data );
+	// the chip select changed; can be NULL
+	void (*select)(
+			void * param,
+			int selected );
+	void *			param;
+
+	const uint8_t *	reply;
+	uint32_t		reply_size;
+	uint8_t *		sink;
+	uint32_t		sink_size;
+
+	// private
+	avr_irq_t *		cs;
+	int				selected;
+	struct avr_spi_slave_t * next;
+} avr_spi_slave_t;
+
+/*
+ * Take an avr_spi_slave_t*, which must stay valid while it's registered,
+ * to add it to the bus, or remove it. Adding fails if the pin isn't there.
+ */
+#define AVR_IOCTL_SPI_ADD_SLAVE(_name) AVR_IOCTL_DEF('s','p','a',(_name))
+#define AVR_IOCTL_SPI_DEL_SLAVE(_name) AVR_IOCTL_DEF('s','p','d',(_name))
+
 typedef struct avr_spi_t {
 	avr_io_t	io;
 	char name;
@@ -53,6 +95,7 @@ typedef struct avr_spi_t {
 	avr_int_vector_t spi;	// spi interrupt
 
 	uint8_t		input_data_register;
+	avr_spi_slave_t *	slave;	// the slaves on the bus
 } avr_spi_t;
 
 void avr_spi_init(avr_t * avr, avr_spi_t * port);
@@ -25,9 +25,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "avr_timer.h"
+#include "sim_snapshot.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
 
@@ -275,16 +278,11 @@ avr_timer_irq_ext_clock(
 
 }
 
-// timer overflow
 static avr_cycle_count_t
-avr_timer_tov(
-		struct avr_t * avr,
-		avr_cycle_count_t when,
-		void * param)
+avr_timer_tov_phase(
+		avr_timer_t * p,
+		avr_cycle_count_t when)
 {
-	avr_timer_t * p = (avr_timer_t *)param;
-	int start = p->tov_base == 0;
-
 	avr_cycle_count_t next = when;
 	if (((p->ext_clock_flags & (AVR_TIMER_EXTCLK_FLAG_AS2 | AVR_TIMER_EXTCLK_FLAG_TN)) != 0)
 			&& (p->tov_cycles_fract != 0.0f)) {
@@ -297,39 +295,99 @@ avr_timer_tov(
 			p->phase_accumulator += 1.0f;
 		}
 	}
+	return next;
+}
+
+static const avr_cycle_timer_t avr_timer_comp_dispatch[AVR_TIMER_COMP_COUNT] =
+	{ avr_timer_compa, avr_timer_compb, avr_timer_compc };
+
+/*
+ * Timer overflow, 'count' of them were due since 'when'. The ones before
+ * the last only raise the flag again, and run the compares that happen
+ * on the overflow itself; the last one arms the compares of the period
+ */
+static avr_cycle_count_t
+avr_timer_tov_periods(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		avr_cycle_count_t count,
+		void * param)
+{
+	avr_timer_t * p = (avr_timer_t *)param;
+
+	if (count > 1 && p->tov_base) {
+		int each = p->tov_cycles_fract != 0.0f;
+		for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+			each |= p->comp[compi].comp_cycles &&
+					p->comp[compi].comp_cycles == p->tov_cycles;
+		if (!each) {
+			avr_raise_interrupt(avr, &p->overflow);
+			when += (count - 1) * p->tov_cycles;
+			count = 1;
+		}
+	}
+	for (; count > 1; count--) {
+		int start = p->tov_base == 0;
+		avr_cycle_count_t next = avr_timer_tov_phase(p, when);
+
+		p->tov_base = when;
+		if (!start) {
+			avr_raise_interrupt(avr, &p->overflow);
+			for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+				if (p->comp[compi].comp_cycles &&
+						p->tov_cycles == p->comp[compi].comp_cycles)
+					avr_timer_comp_dispatch[compi](avr, when, param);
+		}
+		when = next + p->tov_cycles;
+	}
+
+	int start = p->tov_base == 0;
+	avr_cycle_count_t next = avr_timer_tov_phase(p, when);
 
 	if (!start)
 		avr_raise_interrupt(avr, &p->overflow);
 	p->tov_base = when;
 
-	static const avr_cycle_timer_t dispatch[AVR_TIMER_COMP_COUNT] =
-		{ avr_timer_compa, avr_timer_compb, avr_timer_compc };
-
 	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
 		if (p->comp[compi].comp_cycles) {
 			if (p->comp[compi].comp_cycles < p->tov_cycles && p->comp[compi].comp_cycles >= (avr->cycle - when)) {
 				avr_timer_comp_on_tov(p, when, compi);
-				avr_cycle_timer_register(avr,
+				avr_cycle_timer_register_handle(avr, &p->comp[compi].cycle_timer,
 					p->comp[compi].comp_cycles - (avr->cycle - next),
-					dispatch[compi], p);
+					avr_timer_comp_dispatch[compi], p);
 			} else if (p->tov_cycles == p->comp[compi].comp_cycles && !start)
-				dispatch[compi](avr, when, param);
+				avr_timer_comp_dispatch[compi](avr, when, param);
 		}
 	}
 
 	return next + p->tov_cycles;
 }
 
+// timer overflow
+static avr_cycle_count_t
+avr_timer_tov(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return avr_timer_tov_periods(avr, when, 1, param);
+}
+
+// TCNT at 'cycle', now or a little before, but not before the last overflow
 static uint16_t
-_avr_timer_get_current_tcnt(
-		avr_timer_t * p)
+_avr_timer_get_tcnt_at(
+		avr_timer_t * p,
+		avr_cycle_count_t cycle)
 {
-	avr_t * avr = p->io.avr;
 	if (!(p->ext_clock_flags & (AVR_TIMER_EXTCLK_FLAG_TN | AVR_TIMER_EXTCLK_FLAG_AS2)) ||
 			(p->ext_clock_flags & AVR_TIMER_EXTCLK_FLAG_VIRT)
 			) {
 		if (p->tov_cycles) {
-			uint64_t when = avr->cycle - p->tov_base;
+			if (cycle < p->tov_base)
+				cycle = p->io.avr->cycle;
+			uint64_t when = cycle - p->tov_base;
+			if (p->quiet)	// there's no overflow event to move the base
+				when %= p->tov_cycles;
 
 			return (when * (((uint32_t)p->tov_top)+1)) / p->tov_cycles;
 		}
@@ -341,6 +399,13 @@ _avr_timer_get_current_tcnt(
 	return 0;
 }
 
+static uint16_t
+_avr_timer_get_current_tcnt(
+		avr_timer_t * p)
+{
+	return _avr_timer_get_tcnt_at(p, p->io.avr->cycle);
+}
+
 static uint8_t
 avr_timer_tcnt_read(
 		struct avr_t * avr,
@@ -372,10 +437,259 @@ avr_timer_cancel_all_cycle_timers(
 	}
 
 
-	avr_cycle_timer_cancel(avr, avr_timer_tov, timer);
-	avr_cycle_timer_cancel(avr, avr_timer_compa, timer);
-	avr_cycle_timer_cancel(avr, avr_timer_compb, timer);
-	avr_cycle_timer_cancel(avr, avr_timer_compc, timer);
+	avr_cycle_timer_cancel_handle(avr, &timer->tov_timer);
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		avr_cycle_timer_cancel_handle(avr, &timer->comp[compi].cycle_timer);
+}
+
+static void
+avr_timer_reconfigure(
+		avr_timer_t * p, uint8_t reset);
+
+static int
+avr_timer_is_pwm(
+		avr_timer_t * p)
+{
+	return p->wgm_op_mode_kind == avr_timer_wgm_fast_pwm ||
+			p->wgm_op_mode_kind == avr_timer_wgm_pwm ||
+			p->wgm_op_mode_kind == avr_timer_wgm_fc_pwm;
+}
+
+/*
+ * Describes the comparator outputs the way the overflow and compare
+ * events drive them, and raises their duty
+ */
+static void
+avr_timer_pwm_update(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		avr_timer_comp_t * comp = &p->comp[compi];
+		avr_timer_pwm_t pwm = { 0 };
+		uint32_t period = p->tov_cycles;
+		uint32_t high = comp->comp_cycles && comp->comp_cycles < period ?
+				comp->comp_cycles : period;
+
+		if (comp->r_ocr && period && avr_timer_is_pwm(p)) {
+			switch (avr_regbit_get(avr, comp->com)) {
+				case avr_timer_com_toggle:
+					pwm.period = period * 2;
+					pwm.high = period;
+					break;
+				case avr_timer_com_clear:	// set at bottom
+					pwm.period = period;
+					pwm.high = high;
+					break;
+				case avr_timer_com_set:		// cleared at bottom
+					pwm.period = period;
+					pwm.high = period - high;
+					pwm.inverted = 1;
+					break;
+			}
+		}
+		comp->pwm = pwm;
+		avr_raise_irq(p->io.irq + TIMER_IRQ_OUT_DUTY + compi,
+				pwm.period ? ((uint64_t)pwm.high << 16) / pwm.period : 0);
+	}
+}
+
+/*
+ * Whether the event 'offset' cycles into each period, as avr_timer_tov()
+ * would schedule it, happened in (last, now]
+ */
+static int
+avr_timer_quiet_event(
+		avr_timer_t * p,
+		uint64_t offset,
+		avr_cycle_count_t last,
+		avr_cycle_count_t now)
+{
+	avr_cycle_count_t t = p->tov_base + offset;
+	if (t <= last)
+		t += ((last - t) / p->tov_cycles + 1) * p->tov_cycles;
+	return t <= now;
+}
+
+// raises the flags the events would have raised since they were stopped
+static void
+avr_timer_quiet_flags(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+	avr_cycle_count_t last = p->quiet_cycle;
+
+	if (!p->quiet || avr->cycle <= last)
+		return;
+	p->quiet_cycle = avr->cycle;
+	if (avr_timer_quiet_event(p, p->tov_cycles, last, avr->cycle))
+		avr_raise_interrupt(avr, &p->overflow);
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		uint64_t cycles = p->comp[compi].comp_cycles;
+		if (cycles && cycles <= p->tov_cycles &&
+				avr_timer_quiet_event(p, cycles, last, avr->cycle))
+			avr_raise_interrupt(avr, &p->comp[compi].interrupt);
+	}
+}
+
+// the events are needed again, they'll go on from the current period
+static void
+avr_timer_quiet_end(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (!p->quiet)
+		return;
+	if (p->lazy_flags)
+		avr_timer_quiet_flags(p);
+	p->tov_base = avr->cycle - (avr->cycle - p->tov_base) % p->tov_cycles;
+	p->quiet = 0;
+}
+
+/*
+ * The events can be stopped when only the flags, and TCNT, would show
+ * them: no interrupt is enabled, and the outputs are disconnected, or in
+ * analytic mode, described by their duty.
+ */
+static int
+avr_timer_can_quiet(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (p->tov_cycles <= 1 || (!p->lazy_flags && !p->analytic) ||
+			(p->ext_clock_flags & (AVR_TIMER_EXTCLK_FLAG_TN | AVR_TIMER_EXTCLK_FLAG_AS2)))
+		return 0;
+	if (avr_regbit_get(avr, p->overflow.enable) ||
+			avr_regbit_get(avr, p->icr.enable))
+		return 0;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		avr_timer_comp_t * comp = &p->comp[compi];
+		if (avr_regbit_get(avr, comp->interrupt.enable))
+			return 0;
+		if (comp->r_ocr && avr_regbit_get(avr, comp->com) != avr_timer_com_normal &&
+				!(p->analytic && avr_timer_is_pwm(p)))
+			return 0;
+	}
+	return 1;
+}
+
+// stops or starts the events as needed, and describes the outputs
+static void
+avr_timer_check_quiet(
+		avr_timer_t * p)
+{
+	int quiet = avr_timer_can_quiet(p);
+	if (p->quiet && !quiet) {
+		avr_timer_reconfigure(p, 0);	// which calls us back
+		return;
+	}
+	if (!p->quiet && quiet) {
+		avr_timer_cancel_all_cycle_timers(p->io.avr, p, 0);
+		p->quiet = 1;
+		p->quiet_cycle = p->io.avr->cycle;
+	}
+	if (!p->analytic)
+		return;
+	avr_timer_pwm_update(p);
+	if (!p->quiet)
+		return;
+	// the events won't move the pins anymore, give them their steady level
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		avr_timer_pwm_t * pwm = &p->comp[compi].pwm;
+		if (pwm->period && pwm->high == 0)
+			avr_raise_irq(p->io.irq + TIMER_IRQ_OUT_COMP + compi, 0);
+		else if (pwm->period && pwm->high == pwm->period)
+			avr_raise_irq(p->io.irq + TIMER_IRQ_OUT_COMP + compi, 1);
+	}
+}
+
+// an interrupt of the timer, or an output, might have been enabled
+static void
+avr_timer_write_enable(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	avr_timer_t * p = (avr_timer_t *)param;
+	avr_timer_quiet_flags(p);
+	avr_core_watch_write(avr, addr, v);
+	avr_timer_check_quiet(p);
+}
+
+/*
+ * Reading the flags brings them up to date. The timers that share the
+ * register are chained from the one that registered it
+ */
+static uint8_t
+avr_timer_read_pending(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		void * param)
+{
+	for (avr_timer_t * p = (avr_timer_t *)param; p; p = p->pending_next)
+		avr_timer_quiet_flags(p);
+	return avr_core_watch_read(avr, addr);
+}
+
+static void
+avr_timer_watch_registers(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+	// the ones avr_timer_write() watches already, it needs to see them change
+	avr_io_addr_t reg[13 + 2 * AVR_TIMER_COMP_COUNT] = {
+		p->wgm[0].reg, p->wgm[1].reg, p->wgm[2].reg, p->wgm[3].reg,
+		p->cs[0].reg, p->cs[1].reg, p->cs[2].reg, p->cs[3].reg, p->as2.reg,
+		p->overflow.raised.reg,
+	};
+	int first = 10, count = first;
+
+	avr_regbit_t bit[2 + 2 * AVR_TIMER_COMP_COUNT] = {
+		p->overflow.enable, p->icr.enable,
+	};
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		bit[2 + 2 * compi] = p->comp[compi].interrupt.enable;
+		bit[3 + 2 * compi] = p->comp[compi].com;
+	}
+	for (int i = 0; i < ARRAY_SIZE(bit); i++)
+		reg[count++] = bit[i].reg;
+	for (int i = first; i < count; i++) {
+		int seen = !reg[i];
+		for (int j = 0; j < i && !seen; j++)
+			seen = reg[j] == reg[i];
+		if (seen)
+			continue;
+		// TIMSK is often shared by the timers, only its own bits matter
+		uint8_t mask = 0;
+		for (int b = 0; b < ARRAY_SIZE(bit); b++)
+			if (bit[b].reg == reg[i])
+				mask |= bit[b].mask << bit[b].bit;
+		avr_register_io_write_mask(avr, reg[i], mask, avr_timer_write_enable, p);
+	}
+
+	// the flags can only be computed if they are all in the same register
+	avr_io_addr_t flags = p->overflow.raised.reg;
+	if (!flags || (p->icr.raised.reg && p->icr.raised.reg != flags))
+		return;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		if (p->comp[compi].interrupt.raised.reg &&
+				p->comp[compi].interrupt.raised.reg != flags)
+			return;
+	avr_io_addr_t a = AVR_DATA_TO_IO(flags);
+	if (avr->io[a].r.c == avr_timer_read_pending) {
+		avr_timer_t * t = avr->io[a].r.param;
+		while (t->pending_next)
+			t = t->pending_next;
+		t->pending_next = p;
+	} else if (!avr->io[a].r.c)
+		avr_register_io_read(avr, flags, avr_timer_read_pending, p);
+	else
+		return;
+	p->lazy_flags = 1;
 }
 
 static void
@@ -404,6 +718,7 @@ avr_timer_tcnt_write(
 		// cancel the current timers, recalculate the "base" we should be at, reset the
 		// timer base as it should, and re-schedule the timers using that base.
 
+		avr_timer_quiet_end(p);
 		avr_timer_cancel_all_cycle_timers(avr, p, 0);
 
 		uint64_t cycles = (tcnt * p->tov_cycles) / p->tov_top;
@@ -412,10 +727,12 @@ avr_timer_tcnt_write(
 
 		// this reset the timers bases to the new base
 		if (p->tov_cycles > 1) {
-			avr_cycle_timer_register(avr, p->tov_cycles - cycles, avr_timer_tov, p);
+			avr_cycle_timer_register_batch(avr, &p->tov_timer, p->tov_cycles - cycles,
+					p->tov_cycles, avr_timer_tov_periods, p);
 			p->tov_base = 0;
 			avr_timer_tov(avr, avr->cycle - cycles, p);
 		}
+		avr_timer_check_quiet(p);
 
 		//	tcnt = ((avr->cycle - p->tov_base) * p->tov_top) / p->tov_cycles;
 		//	printf("%s-%c new tnt derive to %d\n", __FUNCTION__, p->name, tcnt);
@@ -513,14 +830,16 @@ avr_timer_configure(
 	if (!use_ext_clock || virt_ext_clock) {
 		if (p->tov_cycles > 1) {
 			if (reset) {
-				avr_cycle_timer_register(avr, p->tov_cycles, avr_timer_tov, p);
+				avr_cycle_timer_register_batch(avr, &p->tov_timer, p->tov_cycles,
+						p->tov_cycles, avr_timer_tov_periods, p);
 				// calling it once, with when == 0 tells it to arm the A/B/C timers if needed
 				p->tov_base = 0;
 				avr_timer_tov(avr, avr->cycle, p);
 				p->phase_accumulator = 0.0f;
 			} else {
 				uint64_t orig_tov_base = p->tov_base;
-				avr_cycle_timer_register(avr, p->tov_cycles - (avr->cycle - orig_tov_base), avr_timer_tov, p);
+				avr_cycle_timer_register_batch(avr, &p->tov_timer, p->tov_cycles - (avr->cycle - orig_tov_base),
+						p->tov_cycles, avr_timer_tov_periods, p);
 				// calling it once, with when == 0 tells it to arm the A/B/C timers if needed
 				p->tov_base = 0;
 				avr_timer_tov(avr, orig_tov_base, p);
@@ -557,6 +876,7 @@ avr_timer_reconfigure(
 {
 	avr_t * avr = p->io.avr;
 
+	avr_timer_quiet_end(p);
 	// cancel everything
 	avr_timer_cancel_all_cycle_timers(avr, p, 1);
 
@@ -587,6 +907,7 @@ avr_timer_reconfigure(
 					__FUNCTION__, p->name, mode, p->mode.kind);
 		}
 	}
+	avr_timer_check_quiet(p);
 }
 
 static void
@@ -665,7 +986,9 @@ avr_timer_write(
 		if (new_cs == 0) {
 			p->cs_div_value = 0;		// reset prescaler
 			// cancel everything
+			avr_timer_quiet_end(p);
 			avr_timer_cancel_all_cycle_timers(avr, p, 1);
+			avr_timer_check_quiet(p);
 
 			AVR_LOG(avr, LOG_TRACE, "TIMER: %s-%c clock turned off\n",
 					__func__, p->name);
@@ -693,7 +1016,8 @@ avr_timer_write(
 		p->wgm_op_mode_size = (1 << p->mode.size) - 1;
 
 		avr_timer_reconfigure(p, 1);
-	}
+	} else	// the compare output modes might have changed
+		avr_timer_check_quiet(p);
 }
 
 /*
@@ -708,6 +1032,7 @@ avr_timer_write_pending(
 		void * param)
 {
 	avr_timer_t * p = (avr_timer_t *)param;
+	avr_timer_quiet_flags(p);
 	// save old bits values
 	uint8_t ov = avr_regbit_get(avr, p->overflow.raised);
 	uint8_t ic = avr_regbit_get(avr, p->icr.raised);
@@ -727,6 +1052,21 @@ avr_timer_write_pending(
 		avr_clear_interrupt_if(avr, &p->comp[compi].interrupt, cp[compi]);
 }
 
+// copies TCNT at 'cycle' to ICR, and raises the capture interrupt
+static void
+_avr_timer_capture(
+		avr_timer_t * p,
+		avr_cycle_count_t cycle)
+{
+	avr_t * avr = p->io.avr;
+	uint16_t tcnt = _avr_timer_get_tcnt_at(p, cycle);
+
+	avr->data[p->r_icr] = tcnt;
+	if (p->r_icrh)
+		avr->data[p->r_icrh] = tcnt >> 8;
+	avr_raise_interrupt(avr, &p->icr);
+}
+
 static void
 avr_timer_irq_icp(
 		struct avr_irq_t * irq,
@@ -749,12 +1089,126 @@ avr_timer_irq_icp(
 	}
 	if (!bing)
 		return;
-	// get current TCNT, copy it to ICR, and raise interrupt
-	uint16_t tcnt = _avr_timer_get_current_tcnt(p);
-	avr->data[p->r_icr] = tcnt;
-	if (p->r_icrh)
-		avr->data[p->r_icrh] = tcnt >> 8;
-	avr_raise_interrupt(avr, &p->icr);
+	_avr_timer_capture(p, avr->cycle);
+}
+
+/*
+ * The input capture stimulus: the next edge is the timer's only cycle
+ * timer, its param isn't in the avr_timer_t so the clock gating leaves
+ * it alone, the signal goes on while the timer is stopped.
+ */
+typedef struct avr_timer_icp_t {
+	avr_timer_t *		p;
+	avr_timer_icp_stim_t stim;
+	uint32_t *			edge;		// copy of stim.edge
+	uint32_t			index;		// of the next one in 'edge'
+	uint8_t				rising;		// the next edge is
+	double				period, high;	// in cycles, periodic signal
+	double				next;		// its next edge, without jitter
+	uint32_t			rand;
+	avr_cycle_timer_handle_t timer;
+} avr_timer_icp_t;
+
+// the cycle of the next edge, after 'now', or 0 if there's none
+static avr_cycle_count_t
+_avr_timer_icp_next(
+		avr_timer_icp_t * s,
+		avr_cycle_count_t now)
+{
+	avr_cycle_count_t at;
+
+	if (s->edge) {
+		if (s->index == s->stim.edge_count) {
+			if (!s->stim.loop)
+				return 0;
+			s->index = 0;
+		}
+		at = now + s->edge[s->index++];
+	} else {
+		// the falling edge comes 'high' after the rising one
+		s->next += s->rising ? s->period - s->high : s->high;
+		at = (avr_cycle_count_t)(s->next + 0.5);
+	}
+	if (s->stim.jitter) {
+		s->rand ^= s->rand << 13;
+		s->rand ^= s->rand >> 17;
+		s->rand ^= s->rand << 5;
+		int64_t j = (int64_t)(s->rand % (2 * s->stim.jitter + 1)) - s->stim.jitter;
+		at = j < 0 && at < now + 1 - j ? now + 1 : at + j;
+	}
+	return at > now ? at : now + 1;
+}
+
+static avr_cycle_count_t
+_avr_timer_icp_edge(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_timer_icp_t * s = param;
+	avr_timer_t * p = s->p;
+
+	// captured at the cycle of the edge, not at the instruction boundary
+	if (p->mode.top != avr_timer_wgm_reg_icr && !avr_io_gated(&p->io) &&
+			!avr_regbit_get(avr, p->ices) == !s->rising)
+		_avr_timer_capture(p, when);
+	s->rising = !s->rising;
+	return _avr_timer_icp_next(s, when);
+}
+
+static void
+_avr_timer_icp_stop(
+		avr_timer_t * p)
+{
+	avr_timer_icp_t * s = p->icp_stim;
+
+	if (!s)
+		return;
+	avr_cycle_timer_cancel_handle(p->io.avr, &s->timer);
+	free(s->edge);
+	free(s);
+	p->icp_stim = NULL;
+}
+
+static int
+_avr_timer_icp_start(
+		avr_timer_t * p,
+		const avr_timer_icp_stim_t * stim)
+{
+	avr_t * avr = p->io.avr;
+
+	_avr_timer_icp_stop(p);
+	if (!stim)
+		return 0;
+	if (stim->edge ? !stim->edge_count : stim->frequency <= 0 ||
+			stim->frequency > avr->frequency / 2)
+		return -1;
+	avr_timer_icp_t * s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+	s->p = p;
+	s->stim = *stim;
+	s->rand = stim->seed ? stim->seed : 1;
+	s->rising = 1;
+	if (stim->edge) {
+		s->edge = malloc(stim->edge_count * sizeof(*s->edge));
+		if (!s->edge) {
+			free(s);
+			return -1;
+		}
+		memcpy(s->edge, stim->edge, stim->edge_count * sizeof(*s->edge));
+		s->stim.edge = s->edge;
+	} else {
+		s->period = (double)avr->frequency / stim->frequency;
+		float duty = stim->duty > 0 && stim->duty < 1 ? stim->duty : 0.5;
+		s->high = s->period * duty;
+		s->next = avr->cycle;
+	}
+	p->icp_stim = s;
+	avr_cycle_timer_register_handle(avr, &s->timer,
+			_avr_timer_icp_next(s, avr->cycle) - avr->cycle,
+			_avr_timer_icp_edge, s);
+	return 0;
 }
 
 static int
@@ -799,6 +1253,17 @@ avr_timer_ioctl(
 			p->ext_clock_flags |= AVR_TIMER_EXTCLK_FLAG_VIRT;
 			res = 0;
 		}
+	} else if (ctl == AVR_IOCTL_TIMER_SET_ANALYTIC(p->name)) {
+		p->analytic = *((uint32_t*)io_param) != 0;
+		avr_timer_check_quiet(p);
+		return 0;
+	} else if (ctl == AVR_IOCTL_TIMER_SET_ICP(p->name)) {
+		return _avr_timer_icp_start(p, io_param);
+	} else if (ctl == AVR_IOCTL_TIMER_GET_PWM(p->name)) {
+		avr_timer_pwm_t * pwm = (avr_timer_pwm_t *)io_param;
+		for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+			pwm[compi] = p->comp[compi].pwm;
+		return 0;
 	}
 	if (res >= 0)
 		avr_timer_reconfigure(p, 0); // virtual clock: attempt to follow frequency change preserving the phase
@@ -811,14 +1276,33 @@ avr_timer_reset(
 {
 	avr_timer_t * p = (avr_timer_t *)port;
 	avr_timer_cancel_all_cycle_timers(p->io.avr, p, 0);
+	p->quiet = 0;
+
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		p->comp[compi].comp_cycles = 0;
+	p->ext_clock_flags &= ~(AVR_TIMER_EXTCLK_FLAG_STARTED | AVR_TIMER_EXTCLK_FLAG_TN |
+							AVR_TIMER_EXTCLK_FLAG_AS2 | AVR_TIMER_EXTCLK_FLAG_REVDIR);
+}
+
+static void
+avr_timer_irq_attach(
+		avr_io_t * port)
+{
+	avr_timer_t * p = (avr_timer_t *)port;
+
+	// marking IRQs as "filtered" means they don't propagate if the
+	// new value raised is the same as the last one.. in the case of the
+	// pwm value it makes sense not to bother.
+	p->io.irq[TIMER_IRQ_OUT_PWM0].flags |= IRQ_FLAG_FILTERED;
+	p->io.irq[TIMER_IRQ_OUT_PWM1].flags |= IRQ_FLAG_FILTERED;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		p->io.irq[TIMER_IRQ_OUT_DUTY + compi].flags |= IRQ_FLAG_FILTERED;
 
 	// check to see if the comparators have a pin output. If they do,
 	// (try) to get the ioport corresponding IRQ and connect them
 	// they will automagically be triggered when the comparator raises
 	// it's own IRQ
 	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
-		p->comp[compi].comp_cycles = 0;
-
 		avr_ioport_getirq_t req = {
 			.bit = p->comp[compi].com_pin
 		};
@@ -840,9 +1324,6 @@ avr_timer_reset(
 		//printf("%s-%c ICP Connecting PIN IRQ %d\n", __func__, p->name, req.irq[0]->irq);
 		avr_connect_irq(req.irq[0], port->irq + TIMER_IRQ_IN_ICP);
 	}
-	p->ext_clock_flags &= ~(AVR_TIMER_EXTCLK_FLAG_STARTED | AVR_TIMER_EXTCLK_FLAG_TN |
-							AVR_TIMER_EXTCLK_FLAG_AS2 | AVR_TIMER_EXTCLK_FLAG_REVDIR);
-
 }
 
 static const char * irq_names[TIMER_IRQ_COUNT] = {
@@ -852,13 +1333,73 @@ static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_COMP + 0] = ">compa",
 	[TIMER_IRQ_OUT_COMP + 1] = ">compb",
 	[TIMER_IRQ_OUT_COMP + 2] = ">compc",
+	[TIMER_IRQ_OUT_DUTY + 0] = "32>dutya",
+	[TIMER_IRQ_OUT_DUTY + 1] = "32>dutyb",
+	[TIMER_IRQ_OUT_DUTY + 2] = "32>dutyc",
 };
 
+static void
+avr_timer_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_snapshot_io(s, io, sizeof(avr_timer_t));
+}
+
+/*
+ * The count is frozen with the clock: what was flagged before is, and the
+ * base moves on by the time it was stopped. An external clock counts in
+ * the base itself.
+ */
+static void
+avr_timer_gated(
+		avr_io_t * io,
+		int gated,
+		avr_cycle_count_t cycles)
+{
+	avr_timer_t * p = (avr_timer_t *)io;
+
+	if (gated) {
+		if (p->quiet && p->lazy_flags)
+			avr_timer_quiet_flags(p);
+		return;
+	}
+	if (!p->tov_cycles || !p->tov_base ||
+			((p->ext_clock_flags & (AVR_TIMER_EXTCLK_FLAG_TN | AVR_TIMER_EXTCLK_FLAG_AS2)) &&
+			!(p->ext_clock_flags & AVR_TIMER_EXTCLK_FLAG_VIRT)))
+		return;
+	p->tov_base += cycles;
+	if (p->quiet)
+		p->quiet_cycle += cycles;
+}
+
+static void
+avr_timer_dealloc(
+		avr_io_t * port)
+{
+	_avr_timer_icp_stop((avr_timer_t *)port);
+}
+
+static size_t
+avr_timer_memory(
+		avr_io_t * port)
+{
+	avr_timer_icp_t * s = ((avr_timer_t *)port)->icp_stim;
+	if (!s)
+		return 0;
+	return sizeof(*s) + (s->edge ? s->stim.edge_count * sizeof(*s->edge) : 0);
+}
+
 static	avr_io_t	_io = {
 	.kind = "timer",
 	.irq_names = irq_names,
 	.reset = avr_timer_reset,
 	.ioctl = avr_timer_ioctl,
+	.dealloc = avr_timer_dealloc,
+	.snapshot = avr_timer_snapshot,
+	.memory = avr_timer_memory,
+	.gated = avr_timer_gated,
+	.irq_attach = avr_timer_irq_attach,
 };
 
 void
@@ -869,18 +1410,13 @@ avr_timer_init(
 	p->io = _io;
 
 	avr_register_io(avr, &p->io);
+	avr_io_register_gate(&p->io, p->disabled, sizeof(*p));
 	avr_register_vector(avr, &p->overflow);
 	avr_register_vector(avr, &p->icr);
 
-	// allocate this module's IRQ
+	// allocate this module's IRQ, see avr_timer_irq_attach()
 	avr_io_setirqs(&p->io, AVR_IOCTL_TIMER_GETIRQ(p->name), TIMER_IRQ_COUNT, NULL);
 
-	// marking IRQs as "filtered" means they don't propagate if the
-	// new value raised is the same as the last one.. in the case of the
-	// pwm value it makes sense not to bother.
-	p->io.irq[TIMER_IRQ_OUT_PWM0].flags |= IRQ_FLAG_FILTERED;
-	p->io.irq[TIMER_IRQ_OUT_PWM1].flags |= IRQ_FLAG_FILTERED;
-
 	if (p->wgm[0].reg) // these are not present on older AVRs
 		avr_register_io_write(avr, p->wgm[0].reg, avr_timer_write, p);
 	if (p->wgm[1].reg &&
@@ -931,6 +1467,7 @@ avr_timer_init(
 	}
 	avr_register_io_write(avr, p->r_tcnt, avr_timer_tcnt_write, p);
 	avr_register_io_read(avr, p->r_tcnt, avr_timer_tcnt_read, p);
+	avr_timer_watch_registers(p);
 
 	if (p->as2.reg) {
 		p->ext_clock_flags = AVR_TIMER_EXTCLK_FLAG_VIRT;
@@ -41,8 +41,10 @@ enum {
 	TIMER_IRQ_OUT_PWM1,
 	TIMER_IRQ_IN_ICP,	// input capture
 	TIMER_IRQ_OUT_COMP,	// comparator pins output IRQ
+	// in analytic mode, the duty of each comparator output, see below
+	TIMER_IRQ_OUT_DUTY = TIMER_IRQ_OUT_COMP + AVR_TIMER_COMP_COUNT,
 
-	TIMER_IRQ_COUNT = TIMER_IRQ_OUT_COMP + AVR_TIMER_COMP_COUNT
+	TIMER_IRQ_COUNT = TIMER_IRQ_OUT_DUTY + AVR_TIMER_COMP_COUNT
 };
 
 // Get the internal IRQ corresponding to the INT
@@ -54,6 +56,47 @@ enum {
 #define AVR_IOCTL_TIMER_SET_VIRTCLK(_number) AVR_IOCTL_DEF('t','m','v',(_number))
 // set frequency of the virtual clock generator
 #define AVR_IOCTL_TIMER_SET_FREQCLK(_number) AVR_IOCTL_DEF('t','m','f',(_number))
+/*
+ * Analytic PWM mode, the parameter is a uint32_t, non zero to turn it on.
+ * For the models that only care about the duty of a PWM output, like a LED
+ * or a motor: the PWM of each comparator is described in its
+ * avr_timer_pwm_t, and its duty raised on TIMER_IRQ_OUT_DUTY + comparator,
+ * as a 16.16 fraction of the period, each time it changes.
+ * A timer with none of its interrupts enabled stops scheduling its
+ * overflow and compare match events once its outputs are disconnected;
+ * in analytic mode, its PWM outputs don't count: they keep their level
+ * (or take the one of a 0% or 100% duty). Enabling one of its interrupts,
+ * changing the mode, or turning the analytic mode off, brings the events
+ * back.
+ */
+#define AVR_IOCTL_TIMER_SET_ANALYTIC(_number) AVR_IOCTL_DEF('t','m','a',(_number))
+// fills an array of AVR_TIMER_COMP_COUNT avr_timer_pwm_t
+#define AVR_IOCTL_TIMER_GET_PWM(_number) AVR_IOCTL_DEF('t','m','p',(_number))
+/*
+ * Input capture stimulus, the parameter is an avr_timer_icp_stim_t, or
+ * NULL to stop it. The edges of the signal it describes are captured by
+ * the timer at their cycle, as if they came on the ICP pin, without going
+ * through the pin and its irqs: TCNT at that cycle goes in ICR, and the
+ * capture flag is raised, for the edges ICES selects at the time. The
+ * pin itself, and TIMER_IRQ_IN_ICP, don't see them.
+ * The stimulus goes on through a reset of the core; setting another one
+ * replaces it.
+ */
+#define AVR_IOCTL_TIMER_SET_ICP(_number) AVR_IOCTL_DEF('t','m','i',(_number))
+
+typedef struct avr_timer_icp_stim_t {
+	// a periodic signal, starting low, if 'frequency' isn't zero
+	float			frequency;	// in Hz
+	float			duty;		// high part of the period, 0 for half
+	// or these edges, rising first, each 'edge[i]' cycles after the one
+	// before, or after now for the first. The array is copied
+	const uint32_t * edge;
+	uint32_t		edge_count;
+	uint8_t			loop;		// start again after the last one
+	// each edge comes up to 'jitter' cycles early or late, at random
+	uint32_t		jitter;
+	uint32_t		seed;		// of the jitter
+} avr_timer_icp_stim_t;
 
 // Waveform generation modes
 enum {
@@ -105,6 +148,13 @@ typedef struct avr_timer_wgm_t {
 #define AVR_TIMER_WGM_OCPWM() { .kind = avr_timer_wgm_pwm, .top = avr_timer_wgm_reg_ocra }
 #define AVR_TIMER_WGM_ICPWM() { .kind = avr_timer_wgm_pwm, .top = avr_timer_wgm_reg_icr }
 
+// a PWM output, as the pins would show it; 'period' is 0 when there is none
+typedef struct avr_timer_pwm_t {
+	uint32_t	period;		// in cycles
+	uint32_t	high;		// cycles the output is high, in each period
+	uint8_t		inverted;	// set on compare match, rather than cleared
+} avr_timer_pwm_t;
+
 typedef struct avr_timer_comp_t {
 		avr_int_vector_t	interrupt;		// interrupt vector
 		struct avr_timer_t	*timer;			// parent timer
@@ -113,6 +163,8 @@ typedef struct avr_timer_comp_t {
 		avr_regbit_t		com;			// comparator output mode registers
 		avr_regbit_t		com_pin;		// where comparator output is connected
 		uint64_t			comp_cycles;
+		avr_cycle_timer_handle_t	cycle_timer;	// the compare match one
+		avr_timer_pwm_t		pwm;			// in analytic mode
 } avr_timer_comp_t, *avr_timer_comp_p;
 
 enum {
@@ -162,6 +214,19 @@ typedef struct avr_timer_t {
 	float			phase_accumulator;
 	uint64_t		tov_base;	// MCU cycle when the last overflow occured; when clocked externally holds external clock count
 	uint16_t		tov_top;	// current top value to calculate tnct
+	avr_cycle_timer_handle_t	tov_timer;
+
+	/*
+	 * While no interrupt is enabled, and no output connected, the events
+	 * aren't scheduled: they would only raise the flags, which are brought
+	 * up to date when TIFR is read or written, and TCNT is computed anyway.
+	 */
+	uint8_t			quiet;		// the overflow and compare events are not scheduled
+	uint8_t			lazy_flags;	// TIFR reads are watched, the flags can be lazy
+	uint8_t			analytic;	// AVR_IOCTL_TIMER_SET_ANALYTIC
+	avr_cycle_count_t quiet_cycle;	// the flags are up to date until there
+	struct avr_timer_t * pending_next;	// sharing the same TIFR
+	struct avr_timer_icp_t * icp_stim;	// AVR_IOCTL_TIMER_SET_ICP, or NULL
 } avr_timer_t;
 
 void avr_timer_init(avr_t * avr, avr_timer_t * port);
@@ -20,7 +20,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "avr_twi.h"
+#include "sim_time.h"
+#include "sim_snapshot.h"
 
 /*
  * This block respectfully nicked straight out from the Atmel sample
@@ -109,7 +113,8 @@ avr_twi_set_state_timer(
  * This is supposed to trigger a timer whose duration is a multiple
  * of 'twi' clock cycles, which should be derived from the prescaler
  * (100khz, 400khz etc).
- * Right now it cheats and uses one twi cycle == one usec.
+ * Right now it cheats and uses one twi cycle == one usec, unless it's
+ * talking to a registered slave, which gets the SCL clock of TWBR/TWPS.
  */
 static void
 _avr_twi_delay_state(
@@ -117,10 +122,18 @@ _avr_twi_delay_state(
 		int twi_cycles,
 		uint8_t state)
 {
+	avr_t * avr = p->io.avr;
+	avr_cycle_count_t cycles;
+
 	p->next_twstate = state;
-	// TODO: calculate clock rate, convert to cycles, and use that
-	avr_cycle_timer_register_usec(
-			p->io.avr, twi_cycles, avr_twi_set_state_timer, p);
+	if (p->peer) {
+		uint32_t scl = 16 + 2 * avr->data[p->r_twbr] *
+				(1 << (2 * avr_regbit_get(avr, p->twps)));
+		cycles = twi_cycles * scl;
+	} else	// TODO: calculate clock rate, convert to cycles, and use that
+		cycles = avr_usec_to_cycles(avr, twi_cycles);
+	avr_cycle_timer_register(
+			avr, avr_io_cycles(avr, cycles), avr_twi_set_state_timer, p);
 }
 
 static void
@@ -158,6 +171,7 @@ avr_twi_write(
 			_avr_twi_status_set(p, TWI_NO_STATE, 0);
 			p->state = 0;
 			p->peer_addr = 0;
+			p->peer = NULL;
 		}
 		AVR_TRACE(avr, "TWEN: %d\n", twen);
 		if (avr->data[p->r_twar]) {
@@ -182,8 +196,11 @@ avr_twi_write(
 			if (p->state & TWI_COND_START) {
 				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
 						avr_twi_irq_msg(TWI_COND_STOP, p->peer_addr, 1));
+				if (p->peer && p->peer->stop)
+					p->peer->stop(p->peer->param);
 			}
 		}
+		p->peer = NULL;
 		/* clear stop condition regardless of status */
 		avr_regbit_clear(avr, p->twsto);
 		_avr_twi_status_set(p, TWI_NO_STATE, 0);
@@ -215,6 +232,7 @@ avr_twi_write(
 	if (p->state & TWI_COND_SLAVE) {
 		// writing or reading a byte
 		if (p->state & TWI_COND_ADDR) {
+			p->io.events++;
 #if AVR_TWI_DEBUG
 			if (do_read)
 				AVR_TRACE(avr, "I2C slave READ byte\n");
@@ -266,12 +284,19 @@ avr_twi_write(
 			AVR_TRACE(avr, "state %02x want %02x\n", p->state, msgv);
 			// if the latch is ready... as set by writing/reading the TWDR
 			if (p->state & msgv) {
-
+				p->io.events++;
+
+				if (p->peer) {
+					if (do_read)
+						avr->data[p->r_twdr] = p->peer->read(p->peer->param);
+					else if (p->peer->write(p->peer->param, avr->data[p->r_twdr]))
+						p->state |= TWI_COND_ACK;
+				} else
 				// we send an IRQ and we /expect/ a slave to reply
 				// immediately via an IRQ to set the COND_ACK bit
 				// otherwise it's assumed it's been nacked...
-				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
-						avr_twi_irq_msg(msgv, p->peer_addr, avr->data[p->r_twdr]));
+					avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
+							avr_twi_irq_msg(msgv, p->peer_addr, avr->data[p->r_twdr]));
 
 				if (do_read) { // read ?
 					_avr_twi_delay_state(p, 9,
@@ -294,13 +319,22 @@ avr_twi_write(
 			// send the address
 			p->state |= TWI_COND_ADDR;
 			p->peer_addr = avr->data[p->r_twdr];
+			p->io.events++;
 			p->state &= ~TWI_COND_ACK;	// clear ACK bit
 
+			avr_twi_slave_t * s = p->slave ? p->slave[p->peer_addr] : NULL;
+			if (p->peer && p->peer != s && p->peer->stop)
+				p->peer->stop(p->peer->param);
+			p->peer = s;
+			if (s) {
+				if (s->start(s->param, p->peer_addr))
+					p->state |= TWI_COND_ACK;
+			} else
 			// we send an IRQ and we /expect/ a slave to reply
 			// immediately via an IRQ tp set the COND_ACK bit
 			// otherwise it's assumed it's been nacked...
-			avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
-					avr_twi_irq_msg(TWI_COND_START, p->peer_addr, 0));
+				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
+						avr_twi_irq_msg(TWI_COND_START, p->peer_addr, 0));
 
 			if (p->peer_addr & 1) { // read ?
 				p->state |= TWI_COND_READ;	// always allow read to start with
@@ -454,11 +488,17 @@ avr_twi_irq_input(
 	}
 }
 
-void avr_twi_reset(struct avr_io_t *io)
+static void avr_twi_irq_attach(struct avr_io_t *io)
 {
 	avr_twi_t * p = (avr_twi_t *)io;
 	avr_irq_register_notify(p->io.irq + TWI_IRQ_INPUT, avr_twi_irq_input, p);
+}
+
+void avr_twi_reset(struct avr_io_t *io)
+{
+	avr_twi_t * p = (avr_twi_t *)io;
 	p->state = p->peer_addr = 0;
+	p->peer = NULL;
 	avr_regbit_setto_raw(p->io.avr, p->twsr, TWI_NO_STATE);
 }
 
@@ -468,16 +508,82 @@ static const char * irq_names[TWI_IRQ_COUNT] = {
 	[TWI_IRQ_STATUS] = "8>status",
 };
 
+static int
+avr_twi_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_twi_t * p = (avr_twi_t *)port;
+	avr_twi_slave_t * s = io_param;
+
+	if (!s || (ctl != AVR_IOCTL_TWI_ADD_SLAVE(p->name) &&
+			ctl != AVR_IOCTL_TWI_DEL_SLAVE(p->name)))
+		return -1;
+	if (!p->slave) {
+		p->slave = calloc(256, sizeof(*p->slave));
+		if (!p->slave)
+			return -1;
+	}
+	int add = ctl == AVR_IOCTL_TWI_ADD_SLAVE(p->name);
+	for (int a = 0; a < 256; a++) {
+		if (add && !((a ^ s->addr) & ~s->mask))
+			p->slave[a] = s;
+		else if (!add && p->slave[a] == s)
+			p->slave[a] = NULL;
+	}
+	if (!add && p->peer == s)
+		p->peer = NULL;
+	return 0;
+}
+
+static void
+avr_twi_dealloc(
+		struct avr_io_t * port)
+{
+	avr_twi_t * p = (avr_twi_t *)port;
+	free(p->slave);
+	p->slave = NULL;
+}
+
+static void
+avr_twi_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_twi_t * p = (avr_twi_t *)io;
+	// the slaves are left as they are
+	avr_twi_slave_t ** slave = p->slave;
+	avr_snapshot_io(s, io, sizeof(avr_twi_t));
+	p->slave = slave;
+	if (p->peer && (!slave || p->peer != slave[p->peer_addr]))
+		p->peer = NULL;
+}
+
+static size_t
+avr_twi_memory(
+		avr_io_t * io)
+{
+	avr_twi_t * p = (avr_twi_t *)io;
+	return p->slave ? 256 * sizeof(*p->slave) : 0;
+}
+
 static	avr_io_t	_io = {
 	.kind = "twi",
 	.reset = avr_twi_reset,
+	.irq_attach = avr_twi_irq_attach,
+	.ioctl = avr_twi_ioctl,
+	.dealloc = avr_twi_dealloc,
 	.irq_names = irq_names,
+	.snapshot = avr_twi_snapshot,
+	.memory = avr_twi_memory,
 };
 
 void avr_twi_init(avr_t * avr, avr_twi_t * p)
 {
 	p->io = _io;
 	avr_register_io(avr, &p->io);
+	avr_io_register_gate(&p->io, p->disabled, sizeof(*p));
 	avr_register_vector(avr, &p->twi);
 
 	//printf("%s TWI%c init\n", __FUNCTION__, p->name);
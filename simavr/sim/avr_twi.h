@@ -65,6 +65,40 @@ typedef struct avr_twi_msg_irq_t {
 // add port number to get the real IRQ
 #define AVR_IOCTL_TWI_GETIRQ(_name) AVR_IOCTL_DEF('t','w','i',(_name))
 
+/*
+ * A slave the master talks to directly, instead of broadcasting the
+ * messages of each phase on TWI_IRQ_OUTPUT: only the one registered for
+ * the address it sent is called, and each byte takes the time of its 9
+ * bits at the TWBR/TWPS clock. The addresses without one still go through
+ * the irqs, so both kinds of slaves can share a bus.
+ */
+typedef struct avr_twi_slave_t {
+	// 'addr' includes the R/W bit, the bits in 'mask' don't have to match
+	uint8_t			addr, mask;
+	// addressed, with the R/W bit, by a START or a repeated one; 1 to ACK
+	int (*start)(
+			void * param,
+			uint8_t addr );
+	// a byte from the master; 1 to ACK
+	int (*write)(
+			void * param,
+			uint8_t data );
+	// the next byte for the master
+	uint8_t (*read)(
+			void * param );
+	// a STOP, or a repeated START to another slave; can be NULL
+	void (*stop)(
+			void * param );
+	void *			param;
+} avr_twi_slave_t;
+
+/*
+ * Take an avr_twi_slave_t*, which must stay valid while it's registered,
+ * to register it for its addresses, or to remove it
+ */
+#define AVR_IOCTL_TWI_ADD_SLAVE(_name) AVR_IOCTL_DEF('t','w','s',(_name))
+#define AVR_IOCTL_TWI_DEL_SLAVE(_name) AVR_IOCTL_DEF('t','w','u',(_name))
+
 typedef struct avr_twi_t {
 	avr_io_t	io;
 	char name;
@@ -92,6 +126,9 @@ typedef struct avr_twi_t {
 	uint8_t state;
 	uint8_t peer_addr;
 	uint8_t next_twstate;
+
+	avr_twi_slave_t **	slave;	// by address, allocated with the first one
+	avr_twi_slave_t *	peer;	// the one addressed, if any
 } avr_twi_t;
 
 void
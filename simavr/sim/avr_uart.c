@@ -35,7 +35,9 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "avr_uart.h"
+#include "sim_snapshot.h"
 #include "sim_hex.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
@@ -45,7 +47,20 @@
 #define TRACE(_w)
 #endif
 
-DEFINE_FIFO(uint8_t, uart_fifo);
+// the longest line printed on stdio, see AVR_UART_FLAG_STDIO
+#define AVR_UART_STDIO_MAX	256
+
+// the deepest input fifo AVR_IOCTL_UART_SET_FIFO takes
+#define AVR_UART_FIFO_MAX	(1 << 24)
+
+// the time a byte takes on the line, or a cycle in fast or functional mode
+static inline avr_cycle_count_t
+avr_uart_byte_cycles(
+		avr_uart_t * p)
+{
+	return (p->flags & AVR_UART_FLAG_FAST) ? 1 :
+			avr_io_cycles(p->io.avr, p->cycles_per_byte);
+}
 
 static inline void
 avr_uart_clear_interrupt(
@@ -97,13 +112,13 @@ avr_uart_txc_raise(
 				if (!avr_regbit_get(avr, p->udrc.enable)) {
 					return 0; //polling mode: stop TX pump
 				} else // udrc (alias udre) should be rased repeatedly while output buffer is empty
-					return when + p->cycles_per_byte;
+					return when + avr_uart_byte_cycles(p);
 			} else
 				return 0; // transfer disabled: stop TX pump
 		}
 	}
 	if (p->tx_cnt)
-		return when + p->cycles_per_byte;
+		return when + avr_uart_byte_cycles(p);
 	return 0; // stop TX pump
 }
 
@@ -111,18 +126,118 @@ static avr_cycle_count_t
 avr_uart_rxc_raise(
 		struct avr_t * avr,
 		avr_cycle_count_t when,
+		avr_cycle_count_t count,
+		void * param);
+
+static int
+avr_uart_has_source(
+		avr_uart_t * p)
+{
+	return p->source.pull || p->source.size;
+}
+
+// the input is a ring shared with a bridge, see AVR_IOCTL_UART_SET_RING
+static inline int
+avr_uart_shared(
+		avr_uart_t * p)
+{
+	return p->input != &p->fifo;
+}
+
+static inline int
+avr_uart_input_empty(
+		avr_uart_t * p)
+{
+	return avr_uart_ring_count(p->input) == 0;
+}
+
+static void
+avr_uart_rx_start(
+		avr_t * avr,
+		avr_uart_t * p)
+{
+	if (avr_cycle_timer_status_handle(avr, &p->rxc_timer))
+		return;
+	avr_cycle_timer_register_batch(avr, &p->rxc_timer, avr_uart_byte_cycles(p),
+			avr_uart_byte_cycles(p), avr_uart_rxc_raise, p); // start the rx pump
+	p->rx_cnt = 0;
+	avr_uart_regbit_clear(avr, p->dor);
+}
+
+/*
+ * Moves bytes from the source to the fifo, as many as it has room for,
+ * and starts the rx pump if they were the first ones. A pull source is
+ * given the room in the fifo itself, in two pieces when it wraps.
+ */
+static void
+avr_uart_source_fill(
+		avr_t * avr,
+		avr_uart_t * p)
+{
+	if (!avr_uart_has_source(p) || avr_uart_shared(p) ||
+			!avr_regbit_get(avr, p->rxen))
+		return;
+	uint32_t room = avr_uart_ring_room(p->input);
+	if (!room)
+		return;
+	int was_empty = room == p->input->size;
+	uint32_t got = 0;
+	while (room) {
+		uint32_t len;
+		uint8_t * dst = avr_uart_ring_span(p->input, &len);
+		uint32_t n;
+		if (p->source.pull) {
+			int r = p->source.pull(p->source.param, dst, len);
+			if (r < 0) {
+				memset(&p->source, 0, sizeof(p->source));
+				break;
+			}
+			n = (uint32_t)r > len ? len : (uint32_t)r;
+		} else {
+			n = p->source.size < len ? p->source.size : len;
+			memcpy(dst, p->source.buf, n);
+			p->source.buf += n;
+			p->source.size -= n;
+		}
+		avr_uart_ring_written(p->input, n);
+		got += n;
+		room -= n;
+		if (n < len)
+			break;
+	}
+	// a pull source with nothing for now is polled by the pump too
+	if (got ? was_empty : p->source.pull != NULL)
+		avr_uart_rx_start(avr, p);
+}
+
+/*
+ * The rx pump, a byte period apart; when it's late, the firmware couldn't
+ * read anything in between, so the 'count' periods are as good as one
+ */
+static avr_cycle_count_t
+avr_uart_rxc_raise(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		avr_cycle_count_t count,
 		void * param)
 {
 	avr_uart_t * p = (avr_uart_t *)param;
 	if (avr_regbit_get(avr, p->rxen)) {
 		// rxc should be rased continiosly untill input buffer is empty
-		if (!uart_fifo_isempty(&p->input)) {
+		if (!avr_uart_input_empty(p)) {
 			if (!avr_regbit_get(avr, p->rxc.raised)) {
 				p->rxc_raise_time = when;
 				p->rx_cnt = 0;
 			}
 			avr_raise_interrupt(avr, &p->rxc);
+			return when + count * avr_uart_byte_cycles(p);
+		}
+		// a shared ring, a source, with nothing for now is looked at a byte later
+		if (avr_uart_shared(p))
 			return when + p->cycles_per_byte;
+		if (p->source.pull) {
+			avr_uart_source_fill(avr, p);
+			return p->source.pull ? when + p->cycles_per_byte : 0;
 		}
 	}
 	return 0;
@@ -143,18 +258,21 @@ avr_uart_rxc_read(
 	// the AVR core is reading this register, it's probably
 	// to poll the RXC TXC flag and spinloop
 	// so here we introduce a usleep to make it a bit lighter
-	// on CPU and let data arrive
+	// on CPU and let data arrive. The predecoded core skips that
+	// loop to the next cycle timer instead, see avr_register_io_read_poll()
 	//
 	uint8_t ri = !avr_regbit_get(avr, p->rxen) || !avr_regbit_get(avr, p->rxc.raised);
 	uint8_t ti = !avr_regbit_get(avr, p->txen) || !avr_regbit_get(avr, p->txc.raised);
 
-	if (p->flags & AVR_UART_FLAG_POLL_SLEEP) {
+	if ((p->flags & AVR_UART_FLAG_POLL_SLEEP) && !avr->decoded &&
+			avr->timing != AVR_TIMING_FUNCTIONAL) {
 
 		if (ri && ti)
 			usleep(1);
 	}
 	// if reception is idle and the fifo is empty, tell whomever there is room
-	if (avr_regbit_get(avr, p->rxen) && uart_fifo_isempty(&p->input)) {
+	if (avr_regbit_get(avr, p->rxen) && !avr_uart_shared(p) &&
+			avr_uart_input_empty(p)) {
 		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
 		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
 	}
@@ -181,10 +299,20 @@ avr_uart_read(
 		//return 0;
 		goto avr_uart_read_check;
 	}
-	if (!uart_fifo_isempty(&p->input)) { // probably redundant check
-		v = uart_fifo_read(&p->input);
+	if (!avr_uart_input_empty(p)) { // probably redundant check
+		if (avr_uart_shared(p) && !avr_uart_ring_room(p->input))
+			p->ring_full = 1;
+		v = avr_uart_ring_get(p->input);
+		if (p->ring_full && avr_uart_ring_room(p->input) >= p->input->size / 2) {
+			p->ring_full = 0;
+			avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
+		}
 		p->rx_cnt++;
+		p->rx_bytes++;
+		p->io.events++;
 		if ((p->rx_cnt > 1) && // UART actually has 2-character rx buffer
+				!(p->flags & AVR_UART_FLAG_FAST) &&
+				avr->timing != AVR_TIMING_FUNCTIONAL &&
 				((avr->cycle-p->rxc_raise_time)/p->rx_cnt < p->cycles_per_byte)) {
 			// prevent the firmware from reading input characters with non-realistic high speed
 			avr_uart_clear_interrupt(avr, &p->rxc);
@@ -194,19 +322,24 @@ avr_uart_read(
 		AVR_LOG(avr, LOG_TRACE, "UART%c: BUG: rxc raised with empty rx buffer\n", p->name);
 	}
 
-//	TRACE(printf("UART read %02x %s\n", v, uart_fifo_isempty(&p->input) ? "EMPTY!" : "");)
+//	TRACE(printf("UART read %02x %s\n", v, avr_uart_input_empty(p) ? "EMPTY!" : "");)
 	avr->data[addr] = v;
 	// made to trigger potential watchpoints
 	v = avr_core_watch_read(avr, addr);
 
 avr_uart_read_check:
-	if (uart_fifo_isempty(&p->input)) {
-		avr_cycle_timer_cancel(avr, avr_uart_rxc_raise, p);
+	avr_uart_source_fill(avr, p);
+	if (avr_uart_input_empty(p)) {
+		// a pull source, a shared ring, keep the pump polling them
+		if (!p->source.pull && !avr_uart_shared(p))
+			avr_cycle_timer_cancel_handle(avr, &p->rxc_timer);
 		avr_uart_clear_interrupt(avr, &p->rxc);
-		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
-		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
+		if (!avr_uart_shared(p)) {
+			avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
+			avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
+		}
 	}
-	if (!uart_fifo_isfull(&p->input)) {
+	if (avr_uart_ring_room(p->input)) {
 		avr_uart_regbit_clear(avr, p->dor);
 	}
 
@@ -252,22 +385,22 @@ avr_uart_udr_write(
 	// The byte to be sent should NOT be written there,
 	// the value written could never be read back.
 	//avr_core_watch_write(avr, addr, v);
-	if (avr->gdb) {
+	if (avr->gdb_watch && (avr->gdb_watch[addr] & AVR_GDB_WATCH_WRITE))
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
-	}
 
 	//avr_cycle_timer_cancel(avr, avr_uart_txc_raise, p); // synchronize tx pump
 	if (p->udrc.vector && avr_regbit_get(avr, p->udrc.raised)) {
 		avr_uart_clear_interrupt(avr, &p->udrc);
 	}
 
-	if (p->flags & AVR_UART_FLAG_STDIO) {
-		const int maxsize = 256;
+	if ((p->flags & AVR_UART_FLAG_STDIO) && avr->console.buf)
+		avr_console_putc(avr, v);
+	else if (p->flags & AVR_UART_FLAG_STDIO) {
 		if (!p->stdio_out)
-			p->stdio_out = malloc(maxsize);
+			p->stdio_out = malloc(AVR_UART_STDIO_MAX + 1);	// and its zero
 		p->stdio_out[p->stdio_len++] = v < ' ' ? '.' : v;
 		p->stdio_out[p->stdio_len] = 0;
-		if (v == '\n' || p->stdio_len == maxsize) {
+		if (v == '\n' || p->stdio_len == AVR_UART_STDIO_MAX) {
 			p->stdio_len = 0;
 			AVR_LOG(avr, LOG_OUTPUT,
 					FONT_GREEN "%s\n" FONT_DEFAULT, p->stdio_out);
@@ -278,13 +411,15 @@ avr_uart_udr_write(
 	if (avr_regbit_get(avr, p->txen)) {
 		avr_raise_irq(p->io.irq + UART_IRQ_OUTPUT, v);
 		p->tx_cnt++;
+		p->tx_bytes++;
+		p->io.events++;
 		if (p->tx_cnt > 2) // AVR actually has 1-character UART tx buffer, plus shift register
 			AVR_LOG(avr, LOG_TRACE,
 					"UART%c: tx buffer overflow %d\n",
 					p->name, (int)p->tx_cnt);
-		if (avr_cycle_timer_status(avr, avr_uart_txc_raise, p) == 0)
-			avr_cycle_timer_register(avr, p->cycles_per_byte,
-					avr_uart_txc_raise, p); // start the tx pump
+		if (avr_cycle_timer_status_handle(avr, &p->txc_timer) == 0)
+			avr_cycle_timer_register_handle(avr, &p->txc_timer,
+					avr_uart_byte_cycles(p), avr_uart_txc_raise, p); // start the tx pump
 	}
 }
 
@@ -358,7 +493,7 @@ avr_uart_write(
 		// If the FIFO is not empty (clear timer is flying) we don't
 		// need to raise the interrupt, it will happen when the timer
 		// is fired.
-		if (avr_cycle_timer_status(avr, avr_uart_txc_raise, p) == 0)
+		if (avr_cycle_timer_status_handle(avr, &p->txc_timer) == 0)
 			avr_raise_interrupt(avr, &p->udrc);
 	}
 	if (clear_txc)
@@ -370,16 +505,19 @@ avr_uart_write(
 
 	if (new_rxen != rxen) {
 		if (new_rxen) {
-			if (uart_fifo_isempty(&p->input)) {
+			avr_uart_source_fill(avr, p);
+			if (avr_uart_shared(p))
+				avr_uart_rx_start(avr, p);
+			else if (avr_uart_input_empty(p)) {
 				// if reception is enabled and the fifo is empty, tell whomever there is room
 				avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
 				avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
 			}
 		} else {
 			avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 1);
-			avr_cycle_timer_cancel(avr, avr_uart_rxc_raise, p);
-			// flush the Receive Buffer
-			uart_fifo_reset(&p->input);
+			avr_cycle_timer_cancel_handle(avr, &p->rxc_timer);
+			// flush the Receive Buffer; a shared one is the bridge's to keep
+			avr_uart_ring_flush(&p->fifo);
 			// clear the rxc interrupt flag
 			avr_uart_clear_interrupt(avr, &p->rxc);
 		}
@@ -403,31 +541,34 @@ avr_uart_irq_input(
 	// check to see if receiver is enabled
 	if (!avr_regbit_get(avr, p->rxen))
 		return;
+	if (avr_uart_shared(p)) {
+		AVR_LOG(avr, LOG_WARNING, "UART%c: %s: input is a shared ring, dropped 0x%02x\n",
+				p->name, __func__, (uint8_t)value);
+		return;
+	}
 
 	// reserved/not implemented:
 	//avr_uart_regbit_clear(avr, p->fe);
 	//avr_uart_regbit_clear(avr, p->upe);
 	//avr_uart_regbit_clear(avr, p->rxb8);
 
-	if (uart_fifo_isempty(&p->input) &&
-			(avr_cycle_timer_status(avr, avr_uart_rxc_raise, p) == 0)
+	if (avr_uart_input_empty(p) &&
+			(avr_cycle_timer_status_handle(avr, &p->rxc_timer) == 0)
 			) {
-		avr_cycle_timer_register(avr, p->cycles_per_byte, avr_uart_rxc_raise, p); // start the rx pump
-		p->rx_cnt = 0;
-		avr_uart_regbit_clear(avr, p->dor);
-	} else if (uart_fifo_isfull(&p->input)) {
+		avr_uart_rx_start(avr, p);
+	} else if (!avr_uart_ring_room(p->input)) {
 		avr_regbit_setto(avr, p->dor, 1);
 	}
 	if (!avr_regbit_get(avr, p->dor)) { // otherwise newly received character must be rejected
-		uart_fifo_write(&p->input, value); // add to fifo
+		avr_uart_ring_put(p->input, value); // add to fifo
 	} else {
 		AVR_LOG(avr, LOG_ERROR, "UART%c: %s: RX buffer overrun, lost char=%c=0x%02X\n", p->name, __func__,
 				(char)value, (uint8_t)value );
 	}
 
-	TRACE(printf("UART IRQ in %02x (%d/%d) %s\n", value, p->input.read, p->input.write, uart_fifo_isfull(&p->input) ? "FULL!!" : "");)
+	TRACE(printf("UART IRQ in %02x (%d/%d) %s\n", value, p->input->tail, p->input->head, avr_uart_ring_room(p->input) ? "" : "FULL!!");)
 
-	if (uart_fifo_isfull(&p->input))
+	if (!avr_uart_ring_room(p->input))
 		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 1);
 }
 
@@ -444,10 +585,9 @@ avr_uart_reset(
 	}
 	avr_uart_clear_interrupt(avr, &p->txc);
 	avr_uart_clear_interrupt(avr, &p->rxc);
-	avr_irq_register_notify(p->io.irq + UART_IRQ_INPUT, avr_uart_irq_input, p);
-	avr_cycle_timer_cancel(avr, avr_uart_rxc_raise, p);
-	avr_cycle_timer_cancel(avr, avr_uart_txc_raise, p);
-	uart_fifo_reset(&p->input);
+	avr_cycle_timer_cancel_handle(avr, &p->rxc_timer);
+	avr_cycle_timer_cancel_handle(avr, &p->txc_timer);
+	avr_uart_ring_flush(&p->fifo);
 	p->tx_cnt =  0;
 
 	avr_regbit_set(avr, p->ucsz);
@@ -458,6 +598,85 @@ avr_uart_reset(
 	p->cycles_per_byte = avr_usec_to_cycles(avr, 100);
 }
 
+static void
+avr_uart_irq_attach(
+		struct avr_io_t *io)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+	// Only call callbacks when the value change...
+	p->io.irq[UART_IRQ_OUT_XOFF].flags |= IRQ_FLAG_FILTERED;
+	avr_irq_register_notify(p->io.irq + UART_IRQ_INPUT, avr_uart_irq_input, p);
+}
+
+static int
+avr_uart_set_fifo(
+		avr_uart_t * p,
+		uint32_t depth)
+{
+	avr_t * avr = p->io.avr;
+	if (!depth || depth > AVR_UART_FIFO_MAX) {
+		AVR_LOG(avr, LOG_ERROR, "UART%c: %s: invalid depth %u\n",
+				p->name, __func__, depth);
+		return -1;
+	}
+	uint32_t size = 1;
+	while (size < depth)
+		size <<= 1;
+	uint8_t * buf = p->fifo_buf;
+	if (size > AVR_UART_FIFO_SIZE) {
+		buf = size == p->fifo.size && p->fifo.buf != p->fifo_buf ?
+				p->fifo.buf : malloc(size);
+		if (!buf) {
+			AVR_LOG(avr, LOG_ERROR, "UART%c: %s: can't allocate %u bytes\n",
+					p->name, __func__, size);
+			return -1;
+		}
+	}
+	if (p->fifo.buf != p->fifo_buf && p->fifo.buf != buf)
+		free(p->fifo.buf);
+	p->fifo = (avr_uart_ring_t) { .buf = buf, .size = size };
+	if (!avr_uart_shared(p)) {
+		avr_uart_clear_interrupt(avr, &p->rxc);
+		avr_uart_regbit_clear(avr, p->dor);
+		if (avr_regbit_get(avr, p->rxen)) {
+			avr_uart_source_fill(avr, p);
+			avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
+			avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
+		}
+	}
+	return 0;
+}
+
+static int
+avr_uart_set_ring(
+		avr_uart_t * p,
+		avr_uart_ring_t * ring)
+{
+	avr_t * avr = p->io.avr;
+	p->ring_full = 0;
+	if (!ring->size) {
+		p->input = &p->fifo;
+		if (avr_regbit_get(avr, p->rxen)) {
+			avr_uart_source_fill(avr, p);
+			if (avr_uart_input_empty(p)) {
+				avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
+				avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
+			}
+		}
+		return 0;
+	}
+	if (!ring->buf || (ring->size & (ring->size - 1))) {
+		AVR_LOG(avr, LOG_ERROR, "UART%c: %s: invalid ring, size %u\n",
+				p->name, __func__, ring->size);
+		return -1;
+	}
+	// what's left in the UART's own fifo waits there until it's back
+	p->input = ring;
+	if (avr_regbit_get(avr, p->rxen))
+		avr_uart_rx_start(avr, p);
+	return 0;
+}
+
 static int
 avr_uart_ioctl(
 		struct avr_io_t * port,
@@ -478,6 +697,15 @@ avr_uart_ioctl(
 		*(uint32_t*)io_param = p->flags;
 		res = 0;
 	}
+	if (ctl == AVR_IOCTL_UART_SET_SOURCE(p->name)) {
+		p->source = *(avr_uart_source_t*)io_param;
+		avr_uart_source_fill(p->io.avr, p);
+		res = 0;
+	}
+	if (ctl == AVR_IOCTL_UART_SET_FIFO(p->name))
+		res = avr_uart_set_fifo(p, *(uint32_t*)io_param);
+	if (ctl == AVR_IOCTL_UART_SET_RING(p->name))
+		res = avr_uart_set_ring(p, (avr_uart_ring_t*)io_param);
 
 	return res;
 }
@@ -489,11 +717,68 @@ static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_OUT_XOFF] = ">xoff",
 };
 
+static void
+avr_uart_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+	/*
+	 * the stdio line being printed, and the source, are left as they are,
+	 * so is a ring shared with a bridge; its own fifo, as deep as it is now,
+	 * is saved with what's in it
+	 */
+	uint8_t * stdio_out = p->stdio_out;
+	int stdio_len = p->stdio_len;
+	avr_uart_source_t source = p->source;
+	avr_uart_ring_t * input = p->input;
+	uint8_t ring_full = p->ring_full;
+	uint8_t * fifo_buf = p->fifo.buf;
+	uint32_t fifo_size = p->fifo.size;
+	avr_snapshot_io(s, io, sizeof(*p));
+	p->stdio_out = stdio_out;
+	p->stdio_len = stdio_len;
+	p->source = source;
+	p->input = input;
+	p->ring_full = ring_full;
+	p->fifo.buf = fifo_buf;
+	p->fifo.size = fifo_size;
+	if (fifo_buf != p->fifo_buf)
+		avr_snapshot_data(s, fifo_buf, fifo_size);
+}
+
+static size_t
+avr_uart_memory(
+		avr_io_t * io)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+	return (p->stdio_out ? AVR_UART_STDIO_MAX + 1 : 0) +
+			(p->fifo.buf != p->fifo_buf ? p->fifo.size : 0);
+}
+
+static void
+avr_uart_dealloc(
+		avr_io_t * io)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+	free(p->stdio_out);
+	p->stdio_out = NULL;
+	if (p->fifo.buf != p->fifo_buf)
+		free(p->fifo.buf);
+	p->fifo.buf = p->fifo_buf;
+	p->fifo.size = AVR_UART_FIFO_SIZE;
+	p->input = &p->fifo;
+}
+
 static	avr_io_t	_io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
+	.irq_attach = avr_uart_irq_attach,
 	.ioctl = avr_uart_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_uart_snapshot,
+	.memory = avr_uart_memory,
+	.dealloc = avr_uart_dealloc,
 };
 
 void
@@ -506,21 +791,23 @@ avr_uart_init(
 //	printf("%s UART%c UDR=%02x\n", __FUNCTION__, p->name, p->r_udr);
 
 	p->flags = AVR_UART_FLAG_POLL_SLEEP|AVR_UART_FLAG_STDIO;
+	p->fifo = (avr_uart_ring_t) { .buf = p->fifo_buf, .size = AVR_UART_FIFO_SIZE };
+	p->input = &p->fifo;
 
 	avr_register_io(avr, &p->io);
+	avr_io_register_gate(&p->io, p->disabled, sizeof(*p));
 	avr_register_vector(avr, &p->rxc);
 	avr_register_vector(avr, &p->txc);
 	avr_register_vector(avr, &p->udrc);
 
-	// allocate this module's IRQ
+	// allocate this module's IRQ, see avr_uart_irq_attach()
 	avr_io_setirqs(&p->io, AVR_IOCTL_UART_GETIRQ(p->name), UART_IRQ_COUNT, NULL);
-	// Only call callbacks when the value change...
-	p->io.irq[UART_IRQ_OUT_XOFF].flags |= IRQ_FLAG_FILTERED;
 
 	avr_register_io_write(avr, p->r_udr, avr_uart_udr_write, p);
 	avr_register_io_read(avr, p->r_udr, avr_uart_read, p);
 	// monitor code that reads the rxc flag, and delay it a bit
 	avr_register_io_read(avr, p->rxc.raised.reg, avr_uart_rxc_read, p);
+	avr_register_io_read_poll(avr, p->rxc.raised.reg);
 
 	if (p->udrc.vector)
 		avr_register_io_write(avr, p->udrc.enable.reg, avr_uart_write, p);
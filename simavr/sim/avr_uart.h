@@ -30,7 +30,92 @@ extern "C" {
 
 #include "fifo_declare.h"
 
-DECLARE_FIFO(uint8_t, uart_fifo, 64);
+/*
+ * The input fifo is a ring of bytes with one writer and one reader, that
+ * can be in different threads: 'head' is only moved by the writer, 'tail'
+ * by the reader. It's the UART's own, AVR_UART_FIFO_SIZE deep unless made
+ * deeper with AVR_IOCTL_UART_SET_FIFO, or one a bridge shares with it, see
+ * AVR_IOCTL_UART_SET_RING.
+ */
+#define AVR_UART_FIFO_SIZE	64
+
+typedef struct avr_uart_ring_t {
+	uint8_t *	buf;
+	uint32_t	size;		// a power of two
+	uint32_t	head, tail;	// free running
+} avr_uart_ring_t;
+
+static inline uint32_t
+avr_uart_ring_count(
+		avr_uart_ring_t * r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+			__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t
+avr_uart_ring_room(
+		avr_uart_ring_t * r)
+{
+	return r->size - avr_uart_ring_count(r);
+}
+
+// writer side, returns 0 if the ring is full
+static inline int
+avr_uart_ring_put(
+		avr_uart_ring_t * r,
+		uint8_t b)
+{
+	uint32_t head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size)
+		return 0;
+	r->buf[head & (r->size - 1)] = b;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Writer side, the room after 'head' in one piece, to be written in place;
+ * avr_uart_ring_written() then gives them to the reader
+ */
+static inline uint8_t *
+avr_uart_ring_span(
+		avr_uart_ring_t * r,
+		uint32_t * len)
+{
+	uint32_t o = r->head & (r->size - 1);
+	uint32_t room = avr_uart_ring_room(r);
+	*len = r->size - o < room ? r->size - o : room;
+	return r->buf + o;
+}
+
+static inline void
+avr_uart_ring_written(
+		avr_uart_ring_t * r,
+		uint32_t len)
+{
+	__atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+}
+
+// reader side, the ring must not be empty
+static inline uint8_t
+avr_uart_ring_get(
+		avr_uart_ring_t * r)
+{
+	uint32_t tail = r->tail;
+	uint8_t b = r->buf[tail & (r->size - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return b;
+}
+
+// reader side, drops what's in it
+static inline void
+avr_uart_ring_flush(
+		avr_uart_ring_t * r)
+{
+	__atomic_store_n(&r->tail, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+}
 
 /*
  * The method of "connecting" the the UART from external code is to use 4 IRQS.
@@ -63,6 +148,19 @@ DECLARE_FIFO(uint8_t, uart_fifo, 64);
  *     off = 1;
  * }
  *
+ * Large amounts of data can instead be given to the UART as a buffer, or
+ * a callback it pulls them from, with AVR_IOCTL_UART_SET_SOURCE: the UART
+ * then tops up its own fifo whenever the firmware has read from it, at
+ * the pace of the baud rate, without any irq on the way. These bytes
+ * don't go through UART_IRQ_INPUT, so its hooks don't see them.
+ *
+ * A bridge in a thread of its own, like uart_pty, can instead share its
+ * ring with the UART, AVR_IOCTL_UART_SET_RING: the thread reads its file
+ * straight into the ring, and the firmware reads it from there, a byte
+ * time apart as usual, with no UART_IRQ_INPUT. The ring being full is the
+ * flow control: XON is only raised once it was full and is half empty
+ * again, for the writer to go on, and XOFF not at all. The UART polls the
+ * ring every byte time while it's empty.
  */
 enum {
 	UART_IRQ_INPUT = 0,
@@ -78,12 +176,31 @@ enum {
 enum {
 	// the uart code monitors for firmware that poll on
 	// reception registers, and can do an atomic usleep()
-	// if it's detected, this helps regulating CPU
+	// if it's detected, this helps regulating CPU. Not with the
+	// predecoded core, that skips such loops to the next event
 	AVR_UART_FLAG_POOL_SLEEP = (1 << 0),
 	AVR_UART_FLAG_POLL_SLEEP = (1 << 0),		// to replace pool_sleep
 	AVR_UART_FLAG_STDIO = (1 << 1),				// print lines on the console
+	// ignore the baud rate, a byte is sent or received in a cycle
+	AVR_UART_FLAG_FAST = (1 << 2),
 };
 
+typedef struct avr_uart_source_t {
+	/*
+	 * Fills 'buf' with up to 'size' bytes, returns how many; 0 if there are
+	 * none right now, it's called again after a byte time. Returning -1
+	 * removes the source.
+	 */
+	int (*pull)(
+			void * param,
+			uint8_t * buf,
+			int size );
+	void *			param;
+	// when 'pull' is NULL, the bytes to send; they must stay valid until sent
+	const uint8_t *	buf;
+	uint32_t		size;
+} avr_uart_source_t;
+
 typedef struct avr_uart_t {
 	avr_io_t	io;
 	char name;
@@ -113,21 +230,45 @@ typedef struct avr_uart_t {
 	avr_int_vector_t txc;
 	avr_int_vector_t udrc;	
 
-	uart_fifo_t	input;
+	avr_uart_ring_t	fifo;		// its own input fifo
+	uint8_t		fifo_buf[AVR_UART_FIFO_SIZE];	// unless it's made deeper
+	avr_uart_ring_t * input;	// 'fifo', or a shared one
+	uint8_t		ring_full;		// the shared one was, XON when it's half empty
 	uint8_t		tx_cnt;			// number of unsent characters in the output buffer
 	uint32_t	rx_cnt;			// number of characters read by app since rxc_raise_time
+	uint64_t	tx_bytes, rx_bytes;	// totals, sent and read by the firmware
 
 	uint32_t		flags;
 	avr_cycle_count_t cycles_per_byte;
 	avr_cycle_count_t rxc_raise_time; // the cpu cycle when rxc flag was raised last time
+	avr_cycle_timer_handle_t rxc_timer, txc_timer;	// the rx and tx pumps
 
 	uint8_t *		stdio_out;
 	int				stdio_len;	// current size in the stdio output
+
+	avr_uart_source_t	source;	// see AVR_IOCTL_UART_SET_SOURCE
 } avr_uart_t;
 
 /* takes a uint32_t* as parameter */
 #define AVR_IOCTL_UART_SET_FLAGS(_name)	AVR_IOCTL_DEF('u','a','s',(_name))
 #define AVR_IOCTL_UART_GET_FLAGS(_name)	AVR_IOCTL_DEF('u','a','g',(_name))
+/*
+ * takes an avr_uart_source_t* as parameter, it's copied; one with neither
+ * 'pull' nor 'size' removes the current one
+ */
+#define AVR_IOCTL_UART_SET_SOURCE(_name)	AVR_IOCTL_DEF('u','a','i',(_name))
+/*
+ * takes a uint32_t* as parameter, the depth of the UART's own input fifo,
+ * rounded up to a power of two; what's in it is dropped
+ */
+#define AVR_IOCTL_UART_SET_FIFO(_name)	AVR_IOCTL_DEF('u','a','f',(_name))
+/*
+ * takes an avr_uart_ring_t* as parameter, the UART reads its input from
+ * it, and the caller is its only writer, until it's called with a ring of
+ * zero 'size', that goes back to the UART's own fifo. The source and the
+ * bytes on UART_IRQ_INPUT are ignored while it's shared
+ */
+#define AVR_IOCTL_UART_SET_RING(_name)	AVR_IOCTL_DEF('u','a','b',(_name))
 
 void avr_uart_init(avr_t * avr, avr_uart_t * port);
 
@@ -20,7 +20,6 @@
  */
 
 /* TODO correct reset values */
-/* TODO generate sofi every 1ms (when connected) */
 /* TODO otg support? */
 /* TODO drop bitfields? */
 /* TODO thread safe ioctls */
@@ -32,6 +31,8 @@
 #include <string.h>
 #include <assert.h>
 #include "avr_usb.h"
+#include "sim_snapshot.h"
+#include "sim_time.h"
 
 enum usb_regs
 {
@@ -139,8 +140,15 @@ struct _epstate {
 		uint8_t v;
 	} ueienx;
 
-	struct {
+	/*
+	 * The firmware reads UEDATX from 'head', a byte at a time, the host
+	 * takes or gives the whole packet in one copy, from 'head' to 'tail';
+	 * both go back to 0 once it's empty, so a packet is always in one
+	 * piece.
+	 */
+	struct _epbank {
 		uint8_t bytes[64];
+		uint8_t head;
 		uint8_t tail;
 	} bank[2];
 	uint8_t current_bank;
@@ -151,6 +159,17 @@ struct usb_internal_state {
 	struct _epstate ep_state[5];
 	avr_int_vector_t com_vect;
 	avr_int_vector_t gen_vect;
+	/*
+	 * The host sends a start of frame every millisecond once it reset the
+	 * bus. The frames are counted from 'base', and only timed while the
+	 * firmware enabled the SOF interrupt; otherwise the frame number, and
+	 * SOFI, are worked out when the firmware reads them.
+	 */
+	struct {
+		avr_cycle_count_t base;
+		avr_cycle_count_t cleared;	// the frame SOFI was last cleared in
+		uint8_t on;
+	} sof;
 };
 
 const uint8_t num_endpoints = 5;//sizeof (struct usb_internal_state.ep_state) / sizeof (struct usb_internal_state.ep_state[0]);
@@ -251,6 +270,95 @@ raise_usb_interrupt(
 
 }
 
+static avr_cycle_count_t
+sof_frame(
+		avr_usb_t * p)
+{
+	avr_t * avr = p->io.avr;
+	if (!p->state->sof.on)
+		return 0;
+	return (avr->cycle - p->state->sof.base) / avr_usec_to_cycles(avr, 1000);
+}
+
+static avr_cycle_count_t
+sof_generator(
+        struct avr_t * avr,
+        avr_cycle_count_t when,
+        void * param)
+{
+	avr_usb_t * p = (avr_usb_t *) param;
+	// stops once detached, or when the firmware no longer wants them
+	if (!p->state->sof.on || !(avr->data[p->r_usbcon + udien] & (1 << sofi)))
+		return 0;
+	raise_usb_interrupt(p, sofi);
+	return when + avr_usec_to_cycles(avr, 1000);
+}
+
+// times the frames if the SOF interrupt is enabled, from the next one
+static void
+sof_arm(
+		avr_usb_t * p)
+{
+	avr_t * avr = p->io.avr;
+	if (!p->state->sof.on || !(avr->data[p->r_usbcon + udien] & (1 << sofi))) {
+		avr_cycle_timer_cancel(avr, sof_generator, p);
+		return;
+	}
+	if (avr_cycle_timer_status(avr, sof_generator, p))
+		return;
+	avr_cycle_count_t period = avr_usec_to_cycles(avr, 1000);
+	avr_cycle_count_t next = p->state->sof.base + (sof_frame(p) + 1) * period;
+	avr_cycle_timer_register(avr, next - avr->cycle, sof_generator, p);
+}
+
+static uint8_t
+avr_usb_udint_read(
+        struct avr_t * avr,
+        avr_io_addr_t addr,
+        void * param)
+{
+	avr_usb_t * p = (avr_usb_t *) param;
+	// a frame started since SOFI was cleared
+	if (p->state->sof.on && sof_frame(p) != p->state->sof.cleared)
+		avr->data[addr] |= 1 << sofi;
+	return avr->data[addr];
+}
+
+static void
+avr_usb_udint_write(
+        struct avr_t * avr,
+        avr_io_addr_t addr,
+        uint8_t v,
+        void * param)
+{
+	avr_usb_t * p = (avr_usb_t *) param;
+	if (!(v & (1 << sofi)))
+		p->state->sof.cleared = sof_frame(p);
+	avr_core_watch_write(avr, addr, v);
+}
+
+static void
+avr_usb_udien_write(
+        struct avr_t * avr,
+        avr_io_addr_t addr,
+        uint8_t v,
+        void * param)
+{
+	avr_core_watch_write(avr, addr, v);
+	sof_arm((avr_usb_t *) param);
+}
+
+static uint8_t
+avr_usb_udfnum_read(
+        struct avr_t * avr,
+        avr_io_addr_t addr,
+        void * param)
+{
+	avr_usb_t * p = (avr_usb_t *) param;
+	uint16_t frame = sof_frame(p) & 0x7ff;
+	return addr == p->r_usbcon + udfnuml ? frame : frame >> 8;
+}
+
 static void
 reset_endpoints(
 		struct avr_t * avr,
@@ -264,7 +372,8 @@ static int
 ep_fifo_empty(
 		struct _epstate * epstate)
 {
-	return epstate->bank[epstate->current_bank].tail == 0;
+	return epstate->bank[epstate->current_bank].tail ==
+			epstate->bank[epstate->current_bank].head;
 }
 
 static int
@@ -287,16 +396,14 @@ static uint8_t
 ep_fifo_count(
 		struct _epstate * epstate)
 {
-	return epstate->bank[epstate->current_bank].tail;
+	return epstate->bank[epstate->current_bank].tail -
+			epstate->bank[epstate->current_bank].head;
 }
 
 static int
 ep_fifo_cpu_readbyte(
 		struct _epstate * epstate)
 {
-	uint8_t i, j;
-	uint8_t v = epstate->bank[epstate->current_bank].bytes[0];
-
 	if (!epstate->ueconx.epen) {
 		printf("WARNING! Adding bytes to non configured endpoint\n");
 		return -1;
@@ -305,10 +412,10 @@ ep_fifo_cpu_readbyte(
 	if (ep_fifo_empty(epstate))
 		return -2;
 
-	for (i = 0, j = ep_fifo_count(epstate) - 1; i < j; i++)
-		epstate->bank[epstate->current_bank].bytes[i] =
-		        epstate->bank[epstate->current_bank].bytes[i + 1];
-	epstate->bank[epstate->current_bank].tail--;
+	struct _epbank * b = &epstate->bank[epstate->current_bank];
+	uint8_t v = b->bytes[b->head++];
+	if (b->head == b->tail)
+		b->head = b->tail = 0;
 	return v;
 }
 
@@ -344,9 +451,10 @@ ep_fifo_usb_read(
 		return AVR_IOCTL_USB_NAK;
 	}
 
-	int ret = epstate->bank[epstate->current_bank].tail;
-	memcpy(buf, epstate->bank[epstate->current_bank].bytes,
-	        epstate->bank[epstate->current_bank].tail);
+	int ret = ep_fifo_count(epstate);
+	memcpy(buf, epstate->bank[epstate->current_bank].bytes +
+			epstate->bank[epstate->current_bank].head, ret);
+	epstate->bank[epstate->current_bank].head = 0;
 	epstate->bank[epstate->current_bank].tail = 0;
 	return ret;
 }
@@ -369,13 +477,13 @@ ep_fifo_usb_write(
 		return AVR_IOCTL_USB_NAK;
 	}
 
-	if (len > ep_fifo_size(epstate)) {
-		printf("EP OVERFI\n");
-		len = sizeof epstate->bank[epstate->current_bank].bytes;
-	}memcpy(epstate->bank[epstate->current_bank].bytes, buf, len);
+	if (len > ep_fifo_size(epstate))
+		len = ep_fifo_size(epstate);
+	memcpy(epstate->bank[epstate->current_bank].bytes, buf, len);
+	epstate->bank[epstate->current_bank].head = 0;
 	epstate->bank[epstate->current_bank].tail = len;
 
-	return 0;
+	return len;
 }
 
 static uint8_t
@@ -408,6 +516,11 @@ avr_usb_udcon_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * pa
 	if(avr->data[addr]&1 && !(v&1))
 		avr_raise_irq(p->io.irq + USB_IRQ_ATTACH, !(v&1));
 	avr_core_watch_write(avr, addr, v);
+	// detached, no more frames until the host resets the bus again
+	if (v & 1) {
+		p->state->sof.on = 0;
+		sof_arm(p);
+	}
 }
 
 static void
@@ -450,6 +563,9 @@ avr_usb_ep_write_ueintx(
 
 	union _ueintx * newstate = (union _ueintx*) &v;
 	union _ueintx * curstate = &p->state->ep_state[ep].ueintx;
+	// the flags the host waits for to go
+	const union _ueintx wait = { .txini = 1, .rxouti = 1, .rxstpi = 1, .fifocon = 1 };
+	uint8_t released = curstate->v & wait.v;
 
 	if (curstate->rxouti & !newstate->rxouti)
 		curstate->rxouti = 0;
@@ -473,6 +589,8 @@ avr_usb_ep_write_ueintx(
 
 	if ((curstate->v & 0xdf) == 0)
 		avr->data[p->r_usbcon + ueint] &= 0xff ^ (1 << ep); // mark ep0 interrupt
+	if (released & ~curstate->v)
+		avr_raise_irq(p->io.irq + USB_IRQ_EP_READY, ep);
 }
 
 static uint8_t
@@ -513,8 +631,11 @@ avr_usb_ep_write(
 		case ueconx:
 			if (v & 1 << 4)
 				epstate->ueconx.stallrq = 0;
-			if (v & 1 << 5)
+			if ((v & 1 << 5) && !epstate->ueconx.stallrq) {
 				epstate->ueconx.stallrq = 1;
+				avr_raise_irq(p->io.irq + USB_IRQ_EP_READY,
+						current_ep_to_cpu(p));
+			}
 			epstate->ueconx.epen = (v & 1) != 0;
 			break;
 		case uecfg0x:
@@ -591,23 +712,6 @@ avr_usb_pll_write(
 	avr_core_watch_write(avr, addr, v);
 }
 
-
-avr_cycle_count_t
-sof_generator(
-        struct avr_t * avr,
-        avr_cycle_count_t when,
-        void * param)
-{
-	avr_usb_t * p = (avr_usb_t *) param;
-	//stop sof generation if detached
-	if (avr->data[p->r_usbcon + udcon] & 1)
-		return 0;
-	else {
-		raise_usb_interrupt(p, sofi);
-		return when;
-	}
-}
-
 static int
 avr_usb_ioctl(
 		struct avr_io_t * io,
@@ -631,6 +735,8 @@ avr_usb_ioctl(
 			}
 			if (ep && !epstate->uecfg0x.epdir)
 				AVR_LOG(io->avr, LOG_WARNING, "USB: Reading from IN endpoint from host??\n");
+			if (epstate->ueintx.rxstpi)
+				return AVR_IOCTL_USB_NAK;
 
 			ret = ep_fifo_usb_read(epstate, d->buf);
 			if (ret < 0) {
@@ -647,6 +753,8 @@ avr_usb_ioctl(
 			ret = 0;
 			epstate->ueintx.fifocon = 1;
 			raise_ep_interrupt(io->avr, p, ep, txini);
+			avr_raise_irq(p->io.irq + USB_IRQ_EP_DONE,
+					AVR_USB_DONE(ep, d->sz, AVR_USB_DONE_IN));
 			return ret;
 		case AVR_IOCTL_USB_WRITE:
 			ep = d->pipe & 0x7f;
@@ -660,12 +768,17 @@ avr_usb_ioctl(
 				return AVR_IOCTL_USB_STALL;
 			}
 
+			if (epstate->ueintx.rxstpi)
+				return AVR_IOCTL_USB_NAK;
 			ret = ep_fifo_usb_write(epstate, d->buf, d->sz);
 			if (ret < 0)
 				return ret;
+			d->sz = ret;
 
 			epstate->ueintx.fifocon = 1;
 			raise_ep_interrupt(io->avr, p, ep, rxouti);
+			avr_raise_irq(p->io.irq + USB_IRQ_EP_DONE,
+					AVR_USB_DONE(ep, d->sz, 0));
 			return 0;
 		case AVR_IOCTL_USB_SETUP:
 			ep = d->pipe & 0x7f;
@@ -681,14 +794,18 @@ avr_usb_ioctl(
 			if (ret < 0)
 				return ret;
 			raise_ep_interrupt(io->avr, p, ep, rxstpi);
+			avr_raise_irq(p->io.irq + USB_IRQ_EP_DONE,
+					AVR_USB_DONE(ep, ret, AVR_USB_DONE_SETUP));
 
 			return 0;
 		case AVR_IOCTL_USB_RESET:
 			AVR_LOG(io->avr, LOG_TRACE, "USB: __USB_RESET__\n");
 			reset_endpoints(io->avr, p);
 			raise_usb_interrupt(p, eorsti);
-			if (0)
-				avr_cycle_timer_register_usec(io->avr, 1000, sof_generator, p);
+			p->state->sof.on = 1;
+			p->state->sof.base = io->avr->cycle;
+			p->state->sof.cleared = 0;
+			sof_arm(p);
 			return 0;
 		default:
 			return -1;
@@ -703,6 +820,7 @@ avr_usb_reset(
 	uint8_t i;
 
 	memset(p->state->ep_state, 0, sizeof p->state->ep_state);
+	memset(&p->state->sof, 0, sizeof p->state->sof);
 
 	for (i = 0; i < otgtcon; i++)
 		p->io.avr->data[p->r_usbcon + i] = 0;
@@ -715,6 +833,8 @@ avr_usb_reset(
 
 static const char * irq_names[USB_IRQ_COUNT] = {
 	[USB_IRQ_ATTACH] = ">attach",
+	[USB_IRQ_EP_READY] = "8>ep_ready",
+	[USB_IRQ_EP_DONE] = "32>ep_done",
 };
 
 static void
@@ -725,12 +845,35 @@ avr_usb_dealloc(
 	free(p->state);
 }
 
+static void
+avr_usb_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_usb_t * p = (avr_usb_t *)io;
+	struct usb_internal_state * state = p->state;
+	avr_snapshot_io(s, io, sizeof(*p));
+	p->state = state;
+	avr_snapshot_data(s, state->ep_state, sizeof(state->ep_state));
+	avr_snapshot_data(s, &state->sof, sizeof(state->sof));
+}
+
+static size_t
+avr_usb_memory(
+		avr_io_t * io)
+{
+	avr_usb_t * p = (avr_usb_t *)io;
+	return p->state ? sizeof(*p->state) : 0;
+}
+
 static	avr_io_t	_io = {
 	.kind = "usb",
 	.reset = avr_usb_reset,
 	.irq_names = irq_names,
 	.ioctl = avr_usb_ioctl,
 	.dealloc = avr_usb_dealloc,
+	.snapshot = avr_usb_snapshot,
+	.memory = avr_usb_memory,
 };
 
 static void
@@ -773,6 +916,7 @@ void avr_usb_init(avr_t * avr, avr_usb_t * p)
 	p->state = calloc(1, sizeof *p->state);
 
 	avr_register_io(avr, &p->io);
+	avr_io_register_gate(&p->io, p->disabled, sizeof(*p));
 	register_vectors(avr, p);
 	// allocate this module's IRQ
 	avr_io_setirqs(&p->io, AVR_IOCTL_USB_GETIRQ(), USB_IRQ_COUNT, NULL);
@@ -780,6 +924,11 @@ void avr_usb_init(avr_t * avr, avr_usb_t * p)
 	avr_register_io_write(avr, p->r_usbcon + udaddr, avr_usb_udaddr_write, p);
 	avr_register_io_write(avr, p->r_usbcon + udcon, avr_usb_udcon_write, p);
 	avr_register_io_write(avr, p->r_usbcon + uenum, avr_usb_uenum_write, p);
+	avr_register_io_read(avr, p->r_usbcon + udint, avr_usb_udint_read, p);
+	avr_register_io_write(avr, p->r_usbcon + udint, avr_usb_udint_write, p);
+	avr_register_io_write(avr, p->r_usbcon + udien, avr_usb_udien_write, p);
+	avr_register_io_read(avr, p->r_usbcon + udfnuml, avr_usb_udfnum_read, p);
+	avr_register_io_read(avr, p->r_usbcon + udfnumh, avr_usb_udfnum_read, p);
 
 	avr_register_io_read(avr, p->r_usbcon + uedatx, avr_usb_ep_read_data, p);
 	avr_register_io_write(avr, p->r_usbcon + uedatx, avr_usb_ep_write_data, p);
@@ -28,11 +28,28 @@ extern "C" {
 
 #include "sim_avr.h"
 
+/*
+ * USB_IRQ_EP_READY is raised with the number of an endpoint when the
+ * firmware released it (it cleared its TXINI, RXOUTI, RXSTPI or FIFOCON,
+ * or stalled it), so a host that got a NAK can try again, rather than
+ * poll.
+ *
+ * USB_IRQ_EP_DONE is raised once per packet the host moved, in one copy,
+ * with AVR_IOCTL_USB_READ, WRITE or SETUP: the endpoint, with bit 7 set
+ * for IN, the length in bits 8-15, bit 16 for a setup packet. It's what a
+ * bus logger wants, rather than following UEDATX a byte at a time.
+ */
 enum {
 	USB_IRQ_ATTACH = 0,
+	USB_IRQ_EP_READY,
+	USB_IRQ_EP_DONE,
 	USB_IRQ_COUNT
 };
 
+#define AVR_USB_DONE_IN		(1 << 7)
+#define AVR_USB_DONE_SETUP	(1 << 16)
+#define AVR_USB_DONE(_ep, _len, _flags) ((_ep) | ((_len) << 8) | (_flags))
+
 // add port number to get the real IRQ
 #define AVR_IOCTL_USB_WRITE AVR_IOCTL_DEF('u','s','b','w')
 #define AVR_IOCTL_USB_READ AVR_IOCTL_DEF('u','s','b','r')
@@ -41,6 +58,11 @@ enum {
 #define AVR_IOCTL_USB_VBUS AVR_IOCTL_DEF('u','s','b','V')
 #define AVR_IOCTL_USB_GETIRQ() AVR_IOCTL_DEF('u','s','b',' ')
 
+/*
+ * AVR_IOCTL_USB_WRITE takes up to a packet of the endpoint, and sets 'sz'
+ * to what it took, the host splits the bigger transfers. READ and WRITE
+ * NAK while the firmware didn't take a setup packet yet.
+ */
 struct avr_io_usb {
 	uint8_t pipe;	//[in]
 	uint32_t  sz;		//[in/out]
@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "avr_watchdog.h"
+#include "sim_snapshot.h"
+#include "sim_postmortem.h"
 
 static void avr_watchdog_run_callback_software_reset(avr_t * avr)
 {
@@ -34,13 +36,19 @@ static avr_cycle_count_t avr_watchdog_timer(
 {
 	avr_watchdog_t * p = (avr_watchdog_t *)param;
 
+	// kicked since it was set, wait for the new deadline
+	if (when < p->deadline)
+		return p->deadline;
 	if (avr_regbit_get(avr, p->watchdog.enable)) {
 		AVR_LOG(avr, LOG_TRACE, "WATCHDOG: timer fired.\n");
 		avr_raise_interrupt(avr, &p->watchdog);
-		return when + p->cycle_count;
+		p->deadline = when + p->cycle_count;
+		return p->deadline;
 	} else if (avr_regbit_get(avr, p->wde)) {
 		AVR_LOG(avr, LOG_TRACE,
 				"WATCHDOG: timer fired without interrupt. Resetting\n");
+		if (avr->postmortem)
+			avr_postmortem_event(avr, AVR_POSTMORTEM_WATCHDOG);
 
 		p->reset_context.avr_run = avr->run;
 		p->reset_context.wdrf = 1;
@@ -96,6 +104,7 @@ static void avr_watchdog_set_cycle_count_and_timer(
 				message[enable_changed][wdp_changed], 2048 << wdp,
 				1 << wdp, (int)p->cycle_count);
 
+		p->deadline = avr->cycle + p->cycle_count;
 		avr_cycle_timer_register(avr, p->cycle_count, avr_watchdog_timer, p);
 	} else if (enable_changed) {
 		AVR_LOG(avr, LOG_TRACE, "WATCHDOG: disabled\n");
@@ -150,8 +159,18 @@ static void avr_watchdog_write(
 }
 
 /*
- * called by the core when a WTD instruction is found
+ * called by the core when a WDR instruction is found. Firmwares do that in
+ * their tightest loops, so the timer isn't moved: it fires at the deadline
+ * it was set for, and is set again for the new one from there
  */
+void avr_watchdog_kick(avr_watchdog_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (avr_regbit_get(avr, p->wde) || avr_regbit_get(avr, p->watchdog.enable))
+		p->deadline = avr->cycle + p->cycle_count;
+}
+
 static int avr_watchdog_ioctl(
 		struct avr_io_t * port, uint32_t ctl, void * io_param)
 {
@@ -159,10 +178,7 @@ static int avr_watchdog_ioctl(
 	int res = -1;
 
 	if (ctl == AVR_IOCTL_WATCHDOG_RESET) {
-		if (avr_regbit_get(p->io.avr, p->wde) ||
-				avr_regbit_get(p->io.avr, p->watchdog.enable))
-			avr_cycle_timer_register(p->io.avr, p->cycle_count,
-					avr_watchdog_timer, p);
+		avr_watchdog_kick(p);
 		res = 0;
 	}
 
@@ -205,16 +221,34 @@ static void avr_watchdog_reset(avr_io_t * port)
 		avr_regbit_set_array_from_value(avr, p->wdp, 4, 0);
 		
 		avr_watchdog_set_cycle_count_and_timer(avr, p, 0, 0);
+		if (p->io.irq) {
+			avr_raise_irq(p->io.irq + WATCHDOG_IRQ_RESET, 1);
+			avr_raise_irq(p->io.irq + WATCHDOG_IRQ_RESET, 0);
+		}
 	}
 	/* TODO could now use the two pending/running IRQs to do the same
 	 * as before */
 	avr_irq_register_notify(p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
+static void
+avr_watchdog_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_snapshot_io(s, io, sizeof(avr_watchdog_t));
+}
+
+static const char * irq_names[WATCHDOG_IRQ_COUNT] = {
+	[WATCHDOG_IRQ_RESET] = ">reset",
+};
+
 static	avr_io_t	_io = {
 	.kind = "watchdog",
+	.irq_names = irq_names,
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
+	.snapshot = avr_watchdog_snapshot,
 };
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
@@ -223,8 +257,10 @@ void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->watchdog);
+	avr->watchdog = p;
 
 	avr_register_io_write(avr, p->wdce.reg, avr_watchdog_write, p);
+	avr_io_setirqs(&p->io, AVR_IOCTL_WATCHDOG_GETIRQ(), WATCHDOG_IRQ_COUNT, NULL);
 
 	p->reset_context.wdrf = 0;
 }
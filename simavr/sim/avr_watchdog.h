@@ -41,6 +41,8 @@ typedef struct avr_watchdog_t {
 	avr_int_vector_t watchdog;	// watchdog interrupt
 
 	avr_cycle_count_t	cycle_count;
+	// of the reset or interrupt; WDR only moves it, the timer catches up
+	avr_cycle_count_t	deadline;
 
 	struct {
 		uint8_t		wdrf;		// saved watchdog reset flag
@@ -51,7 +53,16 @@ typedef struct avr_watchdog_t {
 /* takes no parameter */
 #define AVR_IOCTL_WATCHDOG_RESET	AVR_IOCTL_DEF('w','d','t','r')
 
+enum {
+	WATCHDOG_IRQ_RESET = 0,	// pulsed when the watchdog resets the core
+	WATCHDOG_IRQ_COUNT
+};
+
+#define AVR_IOCTL_WATCHDOG_GETIRQ()	AVR_IOCTL_DEF('w','d','t',' ')
+
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p);
+// what WDR does, the core calls it through avr->watchdog
+void avr_watchdog_kick(avr_watchdog_t * p);
 
 
 /*
@@ -0,0 +1,994 @@
+/*
+	farm_avr.c
+
+	Simulation server: keeps firmwares loaded and pools of instances ready
+	to run them, and takes jobs over a socket, so a job costs the cycles it
+	simulates, not a process, an ELF file and a core to set up.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The protocol is one line per command, one line per answer, which is
+ * "ok ..." or "error <why>". Numbers are C style, data is in hex.
+ *
+ *	load <firmware> [<mcu> <freq>]	ok <fw>
+ *		the mcu and frequency are mandatory for .hex files; loading the
+ *		same one again gives the same <fw>
+ *	have <hash> [<mcu> <freq>]		ok <fw>
+ *		the firmware whose content has that hash (avr_fwcache_hash(), 16
+ *		hex digits), loaded already or from the store directory, -d; the
+ *		error is "error unknown <hash>" when it's in neither
+ *	put <hash> <offset> <hex>		ok
+ *		writes a piece of a firmware file into the store, for a 'have' of
+ *		that hash to check and load it; see farm_dist.c
+ *	prepare <fw> <count>			ok <spare instances>
+ *		makes instances in advance, so the first jobs don't pay for it,
+ *		up to FARM_MAX_SPARE
+ *	new <fw>						ok <id>
+ *		an instance fresh out of reset, from the pool
+ *	irq <id> <irq> <value> [<delay>]	ok
+ *		raises a pin, like B5, or an irq by name, <delay> cycles from now
+ *	uart <id> <uart> <delay> <gap> <hex>	ok
+ *		sends bytes to a UART, the first <delay> cycles from now, then
+ *		one every <gap> cycles
+ *	run <id> <cycles>				ok <state> <cycle> [postmortem <file>]
+ *		stops early if the firmware is done or crashed; with -k, the
+ *		post-mortem of a crash, an invalid opcode or a watchdog reset of
+ *		that run (see sim_postmortem.h), the first one of the instance only
+ *	read <id> <addr> <len>			ok <hex>
+ *	write <id> <addr> <hex>			ok
+ *		the data space, registers and io included
+ *	snapshot <id>					ok <ck>
+ *		keeps a checkpoint of the instance, in a store shared by all of
+ *		them, deduplicated and compressed (see sim_ckstore.h)
+ *	restore <id> [<ck>]				ok
+ *		back to checkpoint <ck> of that instance, by default the last one
+ *		taken or restored; that one is the quickest
+ *	drop <id> <ck>					ok
+ *		forgets a checkpoint, they all go when the instance is freed
+ *	memory <id>						ok total <bytes> shared <bytes> core <bytes> ...
+ *		the memory the instance takes, per part (see sim_memory.h)
+ *	free <id>						ok
+ *		the instance goes back to its pool
+ *	stats							ok firmwares <n> instances <n> ...
+ *		... checkpoints <n> ckraw <bytes> ckstored <bytes>
+ *	quit							closes the connection
+ *
+ * The instances a connection didn't free are freed when it closes. All is
+ * done on one thread, one command after the other; to keep more cores
+ * busy, run a server per core, pinned to it with -c so the memory of its
+ * instances is on that core's NUMA node (see sim_numa.h).
+ *
+ *	farm_avr [-u <socket path>] [-p <tcp port>] [-m <metrics port>]
+ *		[-c <cpu>] [-d <store directory>] [-k <post-mortem directory>]
+ *		[-s <storm run>] [-q <quota KB>] [-H <thp|hugetlb>] [-v]
+ *
+ * With -H, the instances' tables and irqs are in huge pages, transparent
+ * or explicit ones (see sim_arena.h).
+ *
+ * With -s, an instance whose interrupt is entered <storm run> times in a
+ * row right after its RETI has crashed, its 'run' ends there (see
+ * avr_int_storm_t).
+ *
+ * With -q, an instance that takes more memory than the quota after a 'run'
+ * is freed, the answer is "error quota <bytes>".
+ *
+ * The TCP ports are only bound on the loopback interface. The metrics port
+ * answers any HTTP request with the counters of the farm and of each busy
+ * instance, in the Prometheus text format (see sim_metrics.h), labelled
+ * with its id, firmware and mcu.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_pool.h"
+#include "sim_fwcache.h"
+#include "sim_numa.h"
+#include "sim_arena.h"
+#include "sim_snapshot.h"
+#include "sim_ckstore.h"
+#include "sim_postmortem.h"
+#include "sim_memory.h"
+#include "sim_stimulus.h"
+#include "sim_network.h"
+#include "sim_metrics.h"
+#include "avr_uart.h"
+#include "avr_ioport.h"
+
+#define FARM_MAX_CLIENTS	64
+#define FARM_LINE			65536
+#define FARM_LABELS			1024	// of an instance, for the metrics
+#define FARM_MAX_SPARE		1024	// instances 'prepare' keeps per firmware
+
+typedef struct farm_fw_t {
+	char			path[256];
+	char			mmcu[64];
+	uint32_t		frequency;
+	uint64_t		hash;		// of the file, see 'have'
+	elf_firmware_t	firmware;
+	avr_pool_t *	pool;
+} farm_fw_t;
+
+typedef struct farm_job_t {
+	avr_t *				avr;	// NULL when it's free
+	farm_fw_t *			fw;
+	avr_snapshot_t *	snap;	// of checkpoint 'ck', inflated
+	int					ck;
+	int					client;
+	avr_postmortem_t *	pm;		// with -k
+} farm_job_t;
+
+typedef struct farm_client_t {
+	int		fd;
+	int		http;	// on the metrics port, waits for the end of the request
+	char	in[FARM_LINE];
+	size_t	len;
+} farm_client_t;
+
+static farm_fw_t ** fws;
+static int fw_count;
+static farm_job_t * jobs;
+static int job_count;
+static avr_ckstore_t * checkpoints;
+static const char * postmortems;	// their directory, -k
+static avr_int_storm_t storm = { .stop = 1 };
+static int storms;	// -s
+static size_t quota;	// bytes, -q
+static farm_client_t clients[FARM_MAX_CLIENTS];
+static int log_level = LOG_ERROR;
+static const char * store;	// directory of the firmwares sent with 'put'
+static uint64_t jobs_done;
+
+static int
+farm_send(
+		farm_client_t * c,
+		const char * buf,
+		size_t len)
+{
+	for (size_t done = 0; done < len; ) {
+		ssize_t w = send(c->fd, buf + done, len - done, 0);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		done += w;
+	}
+	return 0;
+}
+
+static int
+farm_reply(
+		farm_client_t * c,
+		const char * fmt,
+		...) __attribute__ ((format (printf, 2, 3)));
+
+static int
+farm_reply(
+		farm_client_t * c,
+		const char * fmt,
+		...)
+{
+	static char out[FARM_LINE * 2 + 64];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(out, sizeof(out) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= (int)sizeof(out) - 1)
+		len = sizeof(out) - 2;
+	out[len++] = '\n';
+	return farm_send(c, out, len);
+}
+
+static farm_fw_t *
+farm_load(
+		const char * path,
+		const char * mmcu,
+		uint32_t frequency)
+{
+	for (int i = 0; i < fw_count; i++)
+		if (!strcmp(fws[i]->path, path) &&
+				(!mmcu || !strcmp(fws[i]->mmcu, mmcu)) &&
+				(!frequency || fws[i]->frequency == frequency))
+			return fws[i];
+
+	farm_fw_t * fw = calloc(1, sizeof(*fw));
+	if (!fw)
+		return NULL;
+	const char * suffix = strrchr(path, '.');
+	elf_firmware_t * f = &fw->firmware;
+	// the buffers are kept for as long as the pool, that's for good
+	if (!suffix || strcasecmp(suffix, ".hex")) {
+		if (elf_read_firmware(path, f))
+			goto fail;
+	} else {
+		ihex_chunk_p chunk = NULL;
+		int cnt = mmcu && frequency ? read_ihex_chunks(path, &chunk) : -1;
+		if (cnt <= 0)
+			goto fail;
+		for (int ci = 0; ci < cnt; ci++) {
+			if (chunk[ci].baseaddr < (1*1024*1024)) {
+				f->flash = chunk[ci].data;
+				f->flashsize = chunk[ci].size;
+				f->flashbase = chunk[ci].baseaddr;
+			} else {
+				f->eeprom = chunk[ci].data;
+				f->eesize = chunk[ci].size;
+			}
+		}
+	}
+	if (mmcu)
+		snprintf(f->mmcu, sizeof(f->mmcu), "%s", mmcu);
+	if (frequency)
+		f->frequency = frequency;
+	fw->pool = avr_pool_new(f);
+	if (!fw->pool)
+		goto fail;
+	// makes the first instance, it's the one the pool checks against
+	avr_t * avr = avr_pool_get(fw->pool);
+	if (!avr) {
+		avr_pool_free(fw->pool);
+		goto fail;
+	}
+	avr_pool_release(fw->pool, avr);
+	farm_fw_t ** n = realloc(fws, (fw_count + 1) * sizeof(*fws));
+	if (!n) {
+		avr_pool_free(fw->pool);
+		goto fail;
+	}
+	fws = n;
+	uint64_t size;
+	avr_fwcache_hash(path, &fw->hash, &size);
+	snprintf(fw->path, sizeof(fw->path), "%s", path);
+	snprintf(fw->mmcu, sizeof(fw->mmcu), "%s", f->mmcu);
+	fw->frequency = f->frequency;
+	fws[fw_count++] = fw;
+	return fw;
+fail:
+	free(fw);
+	return NULL;
+}
+
+static avr_t *
+farm_get(
+		farm_fw_t * fw)
+{
+	avr_t * avr = avr_pool_get(fw->pool);
+	if (!avr)
+		return NULL;
+	if (fw->firmware.flashbase)
+		avr->pc = fw->firmware.flashbase;
+	avr->log = log_level;
+	avr->sleep = avr_callback_sleep_virtual;
+	if (storms)
+		avr_interrupt_storm_set(avr, &storm);
+	// no waiting on an empty UART, and no printing what the firmware sends
+	for (char u = '0'; u <= '9'; u++) {
+		uint32_t flags = 0;
+		if (avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(u), &flags))
+			continue;
+		flags &= ~(AVR_UART_FLAG_POLL_SLEEP | AVR_UART_FLAG_STDIO);
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(u), &flags);
+	}
+	return avr;
+}
+
+static void
+farm_free_job(
+		farm_job_t * j)
+{
+	if (!j->avr)
+		return;
+	avr_stimulus_cancel(j->avr, NULL);
+	avr_ckstore_drop_owner(checkpoints, j->avr);
+	avr_snapshot_free(j->snap);
+	j->snap = NULL;
+	if (j->pm) {
+		avr_postmortem_stop(j->pm);
+		free(j->pm);
+		j->pm = NULL;
+	}
+	avr_pool_release(j->fw->pool, j->avr);
+	j->avr = NULL;
+	jobs_done++;
+}
+
+static farm_job_t *
+farm_job(
+		farm_client_t * c,
+		const char * id)
+{
+	char * e;
+	long i = strtol(id, &e, 0);
+	if (*e || i < 0 || i >= job_count || !jobs[i].avr ||
+			jobs[i].client != c - clients) {
+		farm_reply(c, "error no instance %s", id);
+		return NULL;
+	}
+	return &jobs[i];
+}
+
+static avr_irq_t *
+farm_irq(
+		avr_t * avr,
+		const char * name)
+{
+	if (strlen(name) == 2 && isalpha((unsigned char)name[0]) &&
+			name[1] >= '0' && name[1] <= '7') {
+		avr_irq_t * irq = avr_io_getirq(avr,
+				AVR_IOCTL_IOPORT_GETIRQ(toupper((unsigned char)name[0])),
+				IOPORT_IRQ_PIN0 + name[1] - '0');
+		if (irq)
+			return irq;
+	}
+	return avr_irq_pool_find(&avr->irq_pool, name);
+}
+
+static int
+farm_hex(
+		const char * hex,
+		uint8_t * out,
+		size_t size)
+{
+	size_t len = strlen(hex);
+	if (len & 1 || len / 2 > size)
+		return -1;
+	for (size_t i = 0; i < len / 2; i++) {
+		unsigned int b;
+		if (!isxdigit((unsigned char)hex[i * 2]) ||
+				!isxdigit((unsigned char)hex[i * 2 + 1]) ||
+				sscanf(hex + i * 2, "%2x", &b) != 1)
+			return -1;
+		out[i] = b;
+	}
+	return len / 2;
+}
+
+static const char *
+farm_state(
+		int state)
+{
+	static const char * names[] = {
+		[cpu_Limbo] = "limbo", [cpu_Stopped] = "stopped",
+		[cpu_Running] = "running", [cpu_Sleeping] = "sleeping",
+		[cpu_Step] = "step", [cpu_StepDone] = "step_done",
+		[cpu_Done] = "done", [cpu_Crashed] = "crashed",
+	};
+	return state >= 0 && state < (int)(sizeof(names) / sizeof(names[0])) &&
+			names[state] ? names[state] : "unknown";
+}
+
+static int
+farm_store_path(
+		char * path,
+		size_t size,
+		uint64_t hash,
+		const char * suffix)
+{
+	int len = snprintf(path, size, "%s/%016llx.%s", store,
+			(unsigned long long)hash, suffix);
+	return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+/*
+ * The firmware with that hash: one loaded already, or the file in the
+ * store, or the one being put there once it's all in
+ */
+static farm_fw_t *
+farm_have(
+		uint64_t hash,
+		const char * mmcu,
+		uint32_t frequency)
+{
+	for (int i = 0; i < fw_count; i++)
+		if (fws[i]->hash == hash &&
+				(!mmcu || !strcmp(fws[i]->mmcu, mmcu)) &&
+				(!frequency || fws[i]->frequency == frequency))
+			return fws[i];
+	if (!store)
+		return NULL;
+	char path[512], part[512];
+	static const char * suffix[] = { "elf", "hex" };
+	for (int i = 0; i < 2; i++)
+		if (!farm_store_path(path, sizeof(path), hash, suffix[i]) &&
+				!access(path, R_OK))
+			return farm_load(path, mmcu, frequency);
+	uint64_t got, size;
+	if (farm_store_path(part, sizeof(part), hash, "part") ||
+			avr_fwcache_hash(part, &got, &size) || got != hash)
+		return NULL;
+	// it's all there, farm_load() goes by the suffix
+	char magic[4] = { 0 };
+	FILE * f = fopen(part, "rb");
+	if (!f)
+		return NULL;
+	size_t r = fread(magic, 1, sizeof(magic), f);
+	fclose(f);
+	int elf = r == sizeof(magic) && !memcmp(magic, "\x7f" "ELF", 4);
+	if (farm_store_path(path, sizeof(path), hash, suffix[elf ? 0 : 1]) ||
+			rename(part, path))
+		return NULL;
+	return farm_load(path, mmcu, frequency);
+}
+
+static int
+farm_put(
+		uint64_t hash,
+		uint64_t offset,
+		const uint8_t * data,
+		int len)
+{
+	char part[512];
+	if (!store || farm_store_path(part, sizeof(part), hash, "part"))
+		return -1;
+	int fd = open(part, O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC), 0644);
+	if (fd < 0)
+		return -1;
+	int res = pwrite(fd, data, len, offset) == len ? 0 : -1;
+	if (close(fd))
+		res = -1;
+	return res;
+}
+
+// returns -1 when the connection is to be closed
+static int
+farm_command(
+		farm_client_t * c,
+		char * line)
+{
+	char * argv[8];
+	int argc = 0;
+	for (char * w = strtok(line, " \t\r"); w && argc < 8; w = strtok(NULL, " \t\r"))
+		argv[argc++] = w;
+	if (!argc)
+		return 0;
+	const char * cmd = argv[0];
+	farm_job_t * j;
+
+	if (!strcmp(cmd, "quit"))
+		return -1;
+	if (!strcmp(cmd, "load") && (argc == 2 || argc == 4)) {
+		farm_fw_t * fw = farm_load(argv[1], argc == 4 ? argv[2] : NULL,
+				argc == 4 ? strtoul(argv[3], NULL, 0) : 0);
+		if (!fw)
+			return farm_reply(c, "error can't load %s", argv[1]);
+		for (int i = 0; i < fw_count; i++)
+			if (fws[i] == fw)
+				return farm_reply(c, "ok %d", i);
+		return farm_reply(c, "error can't load %s", argv[1]);
+	}
+	if (!strcmp(cmd, "have") && (argc == 2 || argc == 4)) {
+		uint64_t hash = strtoull(argv[1], NULL, 16);
+		farm_fw_t * fw = farm_have(hash, argc == 4 ? argv[2] : NULL,
+				argc == 4 ? strtoul(argv[3], NULL, 0) : 0);
+		for (int i = 0; fw && i < fw_count; i++)
+			if (fws[i] == fw)
+				return farm_reply(c, "ok %d", i);
+		return farm_reply(c, "error unknown %s", argv[1]);
+	}
+	if (!strcmp(cmd, "put") && argc == 4) {
+		static uint8_t data[FARM_LINE / 2];
+		int n = farm_hex(argv[3], data, sizeof(data));
+		if (n < 0)
+			return farm_reply(c, "error bad data");
+		if (farm_put(strtoull(argv[1], NULL, 16), strtoull(argv[2], NULL, 0),
+				data, n))
+			return farm_reply(c, store ? "error can't write %s" :
+					"error no store for %s", argv[1]);
+		return farm_reply(c, "ok");
+	}
+	if ((!strcmp(cmd, "new") && argc == 2) ||
+			(!strcmp(cmd, "prepare") && argc == 3)) {
+		int f = atoi(argv[1]);
+		if (f < 0 || f >= fw_count)
+			return farm_reply(c, "error no firmware %s", argv[1]);
+		farm_fw_t * fw = fws[f];
+		if (argc == 3) {
+			int want = atoi(argv[2]);
+			if (want < 0 || want > FARM_MAX_SPARE)
+				return farm_reply(c, "error %s not in 0..%d", argv[2],
+						FARM_MAX_SPARE);
+			if (fw->pool->count >= want)
+				return farm_reply(c, "ok %d", fw->pool->count);
+			avr_t ** made = malloc(want * sizeof(*made));
+			if (!made)
+				return farm_reply(c, "error out of memory");
+			int n = 0;
+			while (fw->pool->count + n < want && (made[n] = farm_get(fw)))
+				n++;
+			while (n)
+				avr_pool_release(fw->pool, made[--n]);
+			free(made);
+			return farm_reply(c, "ok %d", fw->pool->count);
+		}
+		int i;
+		for (i = 0; i < job_count && jobs[i].avr; i++)
+			;
+		if (i == job_count) {
+			farm_job_t * n = realloc(jobs, (job_count + 1) * sizeof(*jobs));
+			if (!n)
+				return farm_reply(c, "error out of memory");
+			jobs = n;
+			memset(&jobs[job_count++], 0, sizeof(*jobs));
+		}
+		if (!(jobs[i].avr = farm_get(fw)))
+			return farm_reply(c, "error can't make a %s", fw->mmcu);
+		jobs[i].fw = fw;
+		jobs[i].ck = -1;
+		jobs[i].client = c - clients;
+		// on the heap, 'jobs' moves
+		if (postmortems && (jobs[i].pm = malloc(sizeof(avr_postmortem_t)))) {
+			char path[256];
+			snprintf(path, sizeof(path), "%s/%016llx-%d-%llu.pm", postmortems,
+					(unsigned long long)fw->hash, i,
+					(unsigned long long)jobs_done);
+			if (avr_postmortem_init(jobs[i].avr, jobs[i].pm, path,
+					AVR_POSTMORTEM_ALL, 1)) {
+				free(jobs[i].pm);
+				jobs[i].pm = NULL;
+			}
+		}
+		return farm_reply(c, "ok %d", i);
+	}
+	if (!strcmp(cmd, "stats") && argc == 1) {
+		int spare = 0, dropped = 0, busy = 0;
+		for (int i = 0; i < fw_count; i++) {
+			spare += fws[i]->pool->count;
+			dropped += fws[i]->pool->dropped;
+		}
+		for (int i = 0; i < job_count; i++)
+			busy += jobs[i].avr != NULL;
+		return farm_reply(c, "ok firmwares %d instances %d spare %d "
+				"dropped %d jobs %llu checkpoints %u ckraw %llu ckstored %llu",
+				fw_count, busy, spare, dropped, (unsigned long long)jobs_done,
+				checkpoints->live, (unsigned long long)checkpoints->raw,
+				(unsigned long long)checkpoints->stored);
+	}
+	// all the others are about an instance
+	char word[16];
+	snprintf(word, sizeof(word), " %s ", cmd);
+	if (argc < 2 || !strstr(" irq uart run read write snapshot restore drop memory free ", word))
+		return farm_reply(c, "error can't make sense of '%s'", cmd);
+	if (!(j = farm_job(c, argv[1])))
+		return 0;
+	avr_t * avr = j->avr;
+
+	if (!strcmp(cmd, "free") && argc == 2) {
+		farm_free_job(j);
+		return farm_reply(c, "ok");
+	}
+	if (!strcmp(cmd, "memory") && argc == 2) {
+		avr_memory_t m;
+		char line[1024];
+		avr_memory_get(avr, &m);
+		int len = snprintf(line, sizeof(line), "ok total %zu shared %zu",
+				m.total, m.shared);
+		for (int i = 0; i < AVR_MEM_COUNT && len < (int)sizeof(line); i++)
+			if (m.bytes[i])
+				len += snprintf(line + len, sizeof(line) - len, " %s %zu",
+						avr_memory_kind(i), m.bytes[i]);
+		return farm_reply(c, "%s", line);
+	}
+	if (!strcmp(cmd, "snapshot") && argc == 2) {
+		avr_snapshot_t * s = avr_snapshot_save(avr);
+		int ck = s ? avr_ckstore_put(checkpoints, s, avr) : -1;
+		if (ck < 0) {
+			avr_snapshot_free(s);
+			return farm_reply(c, "error can't take a snapshot");
+		}
+		// the last one stays inflated, for the reset loops
+		avr_snapshot_free(j->snap);
+		j->snap = s;
+		j->ck = ck;
+		return farm_reply(c, "ok %d", ck);
+	}
+	if (!strcmp(cmd, "restore") && (argc == 2 || argc == 3)) {
+		int ck = argc == 3 ? (int)strtol(argv[2], NULL, 0) : j->ck;
+		if (!j->snap || ck != j->ck) {
+			avr_snapshot_t * s = NULL;
+			if (avr_ckstore_owner(checkpoints, ck) == avr)
+				s = avr_ckstore_get(checkpoints, ck);
+			if (!s)
+				return farm_reply(c, "error no checkpoint %d", ck);
+			avr_snapshot_free(j->snap);
+			j->snap = s;
+			j->ck = ck;
+		}
+		if (avr_snapshot_restore(avr, j->snap))
+			return farm_reply(c, "error can't restore checkpoint %d", ck);
+		return farm_reply(c, "ok");
+	}
+	if (!strcmp(cmd, "drop") && argc == 3) {
+		int ck = (int)strtol(argv[2], NULL, 0);
+		if (avr_ckstore_owner(checkpoints, ck) != avr)
+			return farm_reply(c, "error no checkpoint %d", ck);
+		avr_ckstore_drop(checkpoints, ck);
+		if (ck == j->ck) {
+			avr_snapshot_free(j->snap);
+			j->snap = NULL;
+			j->ck = -1;
+		}
+		return farm_reply(c, "ok");
+	}
+	if (!strcmp(cmd, "run") && argc == 3) {
+		avr_cycle_count_t end = avr->cycle + strtoull(argv[2], NULL, 0);
+		int state = avr->state;
+		uint32_t written = j->pm ? j->pm->written : 0;
+		while (avr->cycle < end) {
+			state = avr_run_cycles(avr, end - avr->cycle);
+			if (state != cpu_Running && state != cpu_Sleeping)
+				break;
+		}
+		if (quota) {
+			avr_memory_t m;
+			avr_memory_get(avr, &m);
+			if (m.total > quota) {
+				farm_free_job(j);
+				return farm_reply(c, "error quota %zu", m.total);
+			}
+		}
+		if (j->pm && j->pm->written != written && j->pm->last[0])
+			return farm_reply(c, "ok %s %" PRI_avr_cycle_count " postmortem %s",
+					farm_state(state), avr->cycle, j->pm->last);
+		return farm_reply(c, "ok %s %" PRI_avr_cycle_count,
+				farm_state(state), avr->cycle);
+	}
+	if (!strcmp(cmd, "irq") && (argc == 4 || argc == 5)) {
+		avr_irq_t * irq = farm_irq(avr, argv[2]);
+		if (!irq)
+			return farm_reply(c, "error no irq %s", argv[2]);
+		if (avr_stimulus_raise_in(avr, argc == 5 ? strtoull(argv[4], NULL, 0) : 0,
+				irq, strtoul(argv[3], NULL, 0)))
+			return farm_reply(c, "error out of memory");
+		return farm_reply(c, "ok");
+	}
+	if (!strcmp(cmd, "uart") && argc == 6) {
+		avr_irq_t * irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(argv[2][0]),
+				UART_IRQ_INPUT);
+		if (!irq)
+			return farm_reply(c, "error no UART%s", argv[2]);
+		static uint8_t data[FARM_LINE / 2];
+		int n = farm_hex(argv[5], data, sizeof(data));
+		if (n < 0)
+			return farm_reply(c, "error bad data");
+		avr_cycle_count_t when = avr->cycle + strtoull(argv[3], NULL, 0);
+		avr_cycle_count_t gap = strtoull(argv[4], NULL, 0);
+		avr_stimulus_event_t * e = calloc(n ? n : 1, sizeof(*e));
+		if (!e)
+			return farm_reply(c, "error out of memory");
+		for (int i = 0; i < n; i++) {
+			e[i].cycle = when + i * gap;
+			e[i].irq = irq;
+			e[i].value = data[i];
+		}
+		int res = avr_stimulus_add(avr, e, n);
+		free(e);
+		return farm_reply(c, res ? "error out of memory" : "ok");
+	}
+	if (!strcmp(cmd, "read") && argc == 4) {
+		uint32_t addr = strtoul(argv[2], NULL, 0);
+		uint32_t len = strtoul(argv[3], NULL, 0);
+		if (addr > avr->ramend || len > avr->ramend + 1 - addr ||
+				len > FARM_LINE / 2)
+			return farm_reply(c, "error out of the data space");
+		static char hex[FARM_LINE + 1];
+		for (uint32_t i = 0; i < len; i++)
+			sprintf(hex + i * 2, "%02x", avr->data[addr + i]);
+		hex[len * 2] = 0;
+		return farm_reply(c, "ok %s", hex);
+	}
+	if (!strcmp(cmd, "write") && argc == 4) {
+		uint32_t addr = strtoul(argv[2], NULL, 0);
+		static uint8_t data[FARM_LINE / 2];
+		int n = farm_hex(argv[3], data, sizeof(data));
+		if (n < 0)
+			return farm_reply(c, "error bad data");
+		if (addr > avr->ramend || (uint32_t)n > avr->ramend + 1 - addr)
+			return farm_reply(c, "error out of the data space");
+		memcpy(avr->data + addr, data, n);
+		avr_dirty_mark(avr->dirty.data, addr, n);
+		avr_io_read_invalidate(avr);
+		return farm_reply(c, "ok");
+	}
+	return farm_reply(c, "error can't make sense of '%s'", cmd);
+}
+
+// the HTTP answer of the metrics port
+static int
+farm_metrics(
+		farm_client_t * c)
+{
+	char * body = NULL;
+	size_t size = 0;
+	FILE * out = open_memstream(&body, &size);
+	if (!out)
+		return -1;
+	int spare = 0, busy = 0;
+	for (int i = 0; i < fw_count; i++)
+		spare += fws[i]->pool->count;
+	avr_metrics_source_t * src = calloc(job_count + 1, sizeof(*src));
+	char (*labels)[FARM_LABELS] = calloc(job_count + 1, FARM_LABELS);
+	for (int i = 0; src && labels && i < job_count; i++) {
+		if (!jobs[i].avr)
+			continue;
+		char path[sizeof(jobs[i].fw->path) * 2], mmcu[sizeof(jobs[i].fw->mmcu) * 2];
+		avr_metrics_label_escape(jobs[i].fw->path, path, sizeof(path));
+		avr_metrics_label_escape(jobs[i].fw->mmcu, mmcu, sizeof(mmcu));
+		snprintf(labels[busy], FARM_LABELS,
+				"instance=\"%d\",firmware=\"%s\",mcu=\"%s\"", i, path, mmcu);
+		src[busy].avr = jobs[i].avr;
+		src[busy].labels = labels[busy];
+		busy++;
+	}
+	fprintf(out, "# HELP simavr_farm_firmwares Firmwares loaded\n"
+			"# TYPE simavr_farm_firmwares gauge\n"
+			"simavr_farm_firmwares %d\n", fw_count);
+	fprintf(out, "# HELP simavr_farm_instances Instances running a job\n"
+			"# TYPE simavr_farm_instances gauge\n"
+			"simavr_farm_instances %d\n", busy);
+	fprintf(out, "# HELP simavr_farm_spare_instances Instances in the pools\n"
+			"# TYPE simavr_farm_spare_instances gauge\n"
+			"simavr_farm_spare_instances %d\n", spare);
+	fprintf(out, "# HELP simavr_farm_jobs_total Jobs done\n"
+			"# TYPE simavr_farm_jobs_total counter\n"
+			"simavr_farm_jobs_total %llu\n", (unsigned long long)jobs_done);
+	int res = src && labels ? avr_metrics_write(src, busy, out) : -1;
+	fclose(out);
+	free(src);
+	free(labels);
+	if (res == 0) {
+		char head[160];
+		int len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\nConnection: close\r\n\r\n", size);
+		res = farm_send(c, head, len) || farm_send(c, body, size) ? -1 : 0;
+	} else {
+		static const char error[] = "HTTP/1.0 500 Internal Server Error\r\n"
+				"Connection: close\r\n\r\n";
+		farm_send(c, error, sizeof(error) - 1);
+	}
+	free(body);
+	return res;
+}
+
+static void
+farm_close(
+		farm_client_t * c)
+{
+	for (int i = 0; i < job_count; i++)
+		if (jobs[i].avr && jobs[i].client == c - clients)
+			farm_free_job(&jobs[i]);
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+static void
+farm_read(
+		farm_client_t * c)
+{
+	ssize_t r = recv(c->fd, c->in + c->len, sizeof(c->in) - 1 - c->len, 0);
+	if (r < 0 && errno == EINTR)
+		return;
+	if (r <= 0) {
+		farm_close(c);
+		return;
+	}
+	c->len += r;
+	if (c->http) {
+		c->in[c->len] = 0;
+		if (strstr(c->in, "\r\n\r\n") || strstr(c->in, "\n\n")) {
+			farm_metrics(c);
+			farm_close(c);
+		} else if (c->len == sizeof(c->in) - 1)
+			farm_close(c);
+		return;
+	}
+	char * line = c->in, * nl;
+	while (c->fd != -1 && (nl = memchr(line, '\n', c->in + c->len - line))) {
+		*nl = 0;
+		if (farm_command(c, line))
+			farm_close(c);
+		line = nl + 1;
+	}
+	if (c->fd == -1)
+		return;
+	c->len -= line - c->in;
+	memmove(c->in, line, c->len);
+	if (c->len == sizeof(c->in) - 1) {
+		farm_reply(c, "error line too long");
+		farm_close(c);
+	}
+}
+
+static int
+farm_listen_unix(
+		const char * path)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "farm_avr: %s is too long\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("farm_avr: socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+			listen(fd, 16)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+farm_listen_tcp(
+		int port)
+{
+	int fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("farm_avr: socket");
+		return -1;
+	}
+	int optval = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	struct sockaddr_in address = { 0 };
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+			listen(fd, 16)) {
+		perror("farm_avr: tcp port");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	const char * unix_path = NULL;
+	int port = 0, metrics_port = 0, cpu = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "u:p:m:c:d:k:s:q:H:v")) != -1) {
+		switch (opt) {
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'm':
+				metrics_port = atoi(optarg);
+				break;
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+			case 'd':
+				store = optarg;
+				break;
+			case 'k':
+				postmortems = optarg;
+				break;
+			case 's':
+				storm.run = strtoul(optarg, NULL, 0);
+				storms++;
+				break;
+			case 'q':
+				quota = strtoull(optarg, NULL, 0) * 1024;
+				break;
+			case 'H':
+				if (avr_arena_enable(!strcmp(optarg, "hugetlb") ?
+						AVR_ARENA_HUGETLB : AVR_ARENA_THP))
+					fprintf(stderr, "%s: no huge pages here\n", argv[0]);
+				break;
+			case 'v':
+				log_level++;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-u <socket path>] [-p <tcp port>] "
+						"[-m <metrics port>] [-c <cpu>] [-d <store>] [-k <post-mortems>] "
+						"[-s <storm run>] [-q <quota KB>] [-H <thp|hugetlb>] [-v]\n"
+						"  see %s for the protocol\n", argv[0], __FILE__);
+				return 1;
+		}
+	}
+	if (!unix_path && !port) {
+		fprintf(stderr, "%s: needs a socket, -u or -p\n", argv[0]);
+		return 1;
+	}
+	// before any instance is made, their pages go to the node they're made on
+	if (cpu >= 0 && avr_numa_bind(cpu))
+		return 1;
+	if (!(checkpoints = avr_ckstore_new(0, -1)) || network_init())
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+	int listen_fd[3] = { -1, -1, -1 };
+	if (unix_path && (listen_fd[0] = farm_listen_unix(unix_path)) < 0)
+		return 1;
+	if (port && (listen_fd[1] = farm_listen_tcp(port)) < 0)
+		return 1;
+	if (metrics_port && (listen_fd[2] = farm_listen_tcp(metrics_port)) < 0)
+		return 1;
+	for (int i = 0; i < FARM_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	for (;;) {
+		struct pollfd fds[3 + FARM_MAX_CLIENTS];
+		int who[3 + FARM_MAX_CLIENTS];
+		int n = 0;
+		for (int i = 0; i < 3; i++)
+			if (listen_fd[i] >= 0) {
+				fds[n] = (struct pollfd){ .fd = listen_fd[i], .events = POLLIN };
+				who[n++] = -1 - i;
+			}
+		for (int i = 0; i < FARM_MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0) {
+				fds[n] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+				who[n++] = i;
+			}
+		if (poll(fds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("farm_avr: poll");
+			return 1;
+		}
+		for (int i = 0; i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+			if (who[i] >= 0) {
+				farm_read(&clients[who[i]]);
+				continue;
+			}
+			int fd = accept(fds[i].fd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			int ci;
+			for (ci = 0; ci < FARM_MAX_CLIENTS && clients[ci].fd >= 0; ci++)
+				;
+			if (ci == FARM_MAX_CLIENTS) {
+				close(fd);
+				continue;
+			}
+			clients[ci].fd = fd;
+			clients[ci].http = who[i] == -3;
+			clients[ci].len = 0;
+		}
+	}
+	return 0;
+}
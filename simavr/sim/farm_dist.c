@@ -0,0 +1,663 @@
+/*
+	farm_dist.c
+
+	Spreads a list of simulation jobs over several farm_avr servers, on
+	this host or others, and gathers their results and counters.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	farm_dist -n <node> [-n <node>...] [-r <retries>] [-v] <jobs file>
+ *
+ * A node is a farm_avr server, "host:port" or the path of its socket; as
+ * each server runs its jobs one after the other, give one per core of
+ * each host (see farm_avr.c). The jobs file has one job per line:
+ *
+ *	<firmware> <mcu|-> <freq|0> <command> [; <command>...]
+ *
+ * the commands being the farm_avr ones about an instance, without its id:
+ * irq, uart, run, read, write. Each job goes to the next node that's
+ * free, on a new instance of the firmware, and prints a line as it ends:
+ *
+ *	job <line> <node> ok|error <what run and read answered, ';' between>
+ *
+ * The firmwares are never sent by name: a node is asked for the hash of
+ * the file's content ("have"), and only if it doesn't know it, the file
+ * is sent to its store once ("put", the node needs a -d directory), then
+ * it stays loaded there, with its pool of instances, for the next jobs.
+ *
+ * A node that goes away has its job run again from the start on another
+ * one, up to <retries> times (default 2): the simulation is deterministic,
+ * so replaying the commands gets the instance to the same state. The
+ * snapshots of farm_avr can't be used for that, they only go back into
+ * the instance they were taken from.
+ *
+ * At the end, the jobs, failures and cycles of each node are printed, with
+ * its own "stats" answer, and the totals.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include "sim_avr.h"
+#include "sim_fwcache.h"
+#include "sim_network.h"
+
+#define DIST_LINE		65536
+#define DIST_CHUNK		16384	// bytes of firmware per 'put'
+#define DIST_COMMANDS	64
+#define DIST_NODES		256
+
+typedef struct dist_fw_t {
+	char		path[256];
+	char		mmcu[64];	// "" when the file says it
+	uint32_t	frequency;
+	uint64_t	hash, size;
+} dist_fw_t;
+
+typedef struct dist_job_t {
+	int			line;
+	int			fw;
+	char *		cmd[DIST_COMMANDS];
+	int			cmd_count;
+	int			tries;
+} dist_job_t;
+
+enum {
+	NODE_IDLE = 0,
+	NODE_HAVE,		// asked for the firmware by hash
+	NODE_PUT,		// sending it
+	NODE_NEW,
+	NODE_CMD,
+	NODE_FREE,
+	NODE_STATS,
+	NODE_DEAD,
+};
+
+typedef struct dist_node_t {
+	char		name[256];
+	int			fd;
+	int			state;
+	char		in[DIST_LINE];
+	size_t		len;
+	int *		fw_id;		// the node's <fw> for each firmware, -1 unknown
+	// the job it's running
+	dist_job_t * job;
+	int			step;
+	int			instance;
+	int			put;		// the firmware was sent already
+	uint64_t	offset;		// of the 'put' in progress
+	char		result[DIST_LINE];
+	int			error;
+	avr_cycle_count_t cycle;	// where the instance got to
+	// counters
+	uint64_t	jobs, failed;
+	avr_cycle_count_t cycles;
+	char		stats[512];
+} dist_node_t;
+
+static dist_fw_t * fws;
+static int fw_count;
+static dist_job_t * jobs;
+static int job_count;
+static dist_job_t ** queue;	// to be run, as a ring
+static int queue_head, queue_count;
+static dist_node_t nodes[DIST_NODES];
+static int node_count;
+static int retries = 2;
+static int verbose;
+static int jobs_left;
+
+static int
+dist_send(
+		dist_node_t * n,
+		const char * fmt,
+		...) __attribute__ ((format (printf, 2, 3)));
+
+static int
+dist_send(
+		dist_node_t * n,
+		const char * fmt,
+		...)
+{
+	static char out[DIST_LINE * 2 + 64];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(out, sizeof(out) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= (int)sizeof(out) - 1)
+		return -1;
+	if (verbose > 1)
+		fprintf(stderr, "%s < %s\n", n->name, out);
+	out[len++] = '\n';
+	for (int done = 0; done < len; ) {
+		ssize_t w = send(n->fd, out + done, len - done, 0);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		done += w;
+	}
+	return 0;
+}
+
+static int
+dist_connect(
+		const char * name)
+{
+	const char * colon = strrchr(name, ':');
+	int fd;
+
+	if (colon && !strchr(name, '/')) {
+		char host[256];
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - name), name);
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, * res;
+		if (getaddrinfo(host, colon + 1, &hints, &res))
+			return -1;
+		fd = -1;
+		for (struct addrinfo * a = res; a && fd < 0; a = a->ai_next) {
+			fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen)) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(res);
+		if (fd >= 0) {
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		return fd;
+	}
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(name) >= sizeof(address.sun_path))
+		return -1;
+	strcpy(address.sun_path, name);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static int
+dist_firmware(
+		const char * path,
+		const char * mmcu,
+		uint32_t frequency)
+{
+	if (!strcmp(mmcu, "-"))
+		mmcu = "";
+	for (int i = 0; i < fw_count; i++)
+		if (!strcmp(fws[i].path, path) && !strcmp(fws[i].mmcu, mmcu) &&
+				fws[i].frequency == frequency)
+			return i;
+	dist_fw_t f = { .frequency = frequency };
+	if (avr_fwcache_hash(path, &f.hash, &f.size)) {
+		fprintf(stderr, "farm_dist: can't read %s\n", path);
+		return -1;
+	}
+	snprintf(f.path, sizeof(f.path), "%s", path);
+	snprintf(f.mmcu, sizeof(f.mmcu), "%s", mmcu);
+	dist_fw_t * n = realloc(fws, (fw_count + 1) * sizeof(*fws));
+	if (!n)
+		return -1;
+	fws = n;
+	fws[fw_count] = f;
+	return fw_count++;
+}
+
+static int
+dist_read_jobs(
+		const char * path)
+{
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	char * line = NULL;
+	size_t size = 0;
+	int number = 0;
+	while (getline(&line, &size, f) > 0) {
+		number++;
+		char * l = line;
+		while (isspace((unsigned char)*l))
+			l++;
+		if (!*l || *l == '#')
+			continue;
+		char file[256], mmcu[64];
+		unsigned long freq;
+		int used = 0;
+		if (sscanf(l, "%255s %63s %lu %n", file, mmcu, &freq, &used) != 3 ||
+				!used) {
+			fprintf(stderr, "%s:%d: can't make sense of it\n", path, number);
+			goto fail;
+		}
+		dist_job_t j = { .line = number };
+		if ((j.fw = dist_firmware(file, mmcu, freq)) < 0)
+			goto fail;
+		for (char * c = strtok(l + used, ";\n"); c; c = strtok(NULL, ";\n")) {
+			while (isspace((unsigned char)*c))
+				c++;
+			char * e = c + strlen(c);
+			while (e > c && isspace((unsigned char)e[-1]))
+				*--e = 0;
+			if (!*c)
+				continue;
+			if (j.cmd_count == DIST_COMMANDS) {
+				fprintf(stderr, "%s:%d: too many commands\n", path, number);
+				goto fail;
+			}
+			j.cmd[j.cmd_count++] = strdup(c);
+		}
+		dist_job_t * n = realloc(jobs, (job_count + 1) * sizeof(*jobs));
+		if (!n)
+			goto fail;
+		jobs = n;
+		jobs[job_count++] = j;
+	}
+	free(line);
+	fclose(f);
+	return 0;
+fail:
+	free(line);
+	fclose(f);
+	return -1;
+}
+
+static void
+dist_queue(
+		dist_job_t * j)
+{
+	queue[(queue_head + queue_count++) % job_count] = j;
+}
+
+static dist_job_t *
+dist_dequeue(void)
+{
+	if (!queue_count)
+		return NULL;
+	dist_job_t * j = queue[queue_head];
+	queue_head = (queue_head + 1) % job_count;
+	queue_count--;
+	return j;
+}
+
+static void
+dist_job_end(
+		dist_node_t * n)
+{
+	dist_job_t * j = n->job;
+	printf("job %d %s %s %s\n", j->line, n->name,
+			n->error ? "error" : "ok", n->result);
+	fflush(stdout);
+	n->jobs++;
+	n->failed += n->error;
+	n->cycles += n->cycle;
+	n->job = NULL;
+	n->state = NODE_IDLE;
+	jobs_left--;
+}
+
+// the node is gone; its job goes back to the others, if it can
+static void
+dist_node_dead(
+		dist_node_t * n)
+{
+	fprintf(stderr, "farm_dist: lost %s\n", n->name);
+	if (n->fd >= 0)
+		close(n->fd);
+	n->fd = -1;
+	n->state = NODE_DEAD;
+	dist_job_t * j = n->job;
+	n->job = NULL;
+	if (!j)
+		return;
+	if (++j->tries <= retries) {
+		dist_queue(j);
+		return;
+	}
+	printf("job %d %s error node lost\n", j->line, n->name);
+	jobs_left--;
+}
+
+static int
+dist_have(
+		dist_node_t * n)
+{
+	dist_fw_t * f = fws + n->job->fw;
+	n->state = NODE_HAVE;
+	if (f->mmcu[0])
+		return dist_send(n, "have %016llx %s %u",
+				(unsigned long long)f->hash, f->mmcu, f->frequency);
+	return dist_send(n, "have %016llx", (unsigned long long)f->hash);
+}
+
+// sends the next piece of the firmware, or asks for it again once it's all in
+static int
+dist_put(
+		dist_node_t * n)
+{
+	dist_fw_t * f = fws + n->job->fw;
+	if (n->offset >= f->size) {
+		n->put = 1;
+		return dist_have(n);
+	}
+	static uint8_t data[DIST_CHUNK];
+	static char hex[DIST_CHUNK * 2 + 1];
+	FILE * in = fopen(f->path, "rb");
+	size_t r = 0;
+	if (in) {
+		fseek(in, n->offset, SEEK_SET);
+		r = fread(data, 1, sizeof(data), in);
+		fclose(in);
+	}
+	if (!r) {
+		fprintf(stderr, "farm_dist: can't read %s\n", f->path);
+		return -1;
+	}
+	for (size_t i = 0; i < r; i++)
+		sprintf(hex + i * 2, "%02x", data[i]);
+	n->state = NODE_PUT;
+	uint64_t offset = n->offset;
+	n->offset += r;
+	return dist_send(n, "put %016llx %llu %s", (unsigned long long)f->hash,
+			(unsigned long long)offset, hex);
+}
+
+static int
+dist_step(
+		dist_node_t * n)
+{
+	if (n->step == n->job->cmd_count) {
+		n->state = NODE_FREE;
+		return dist_send(n, "free %d", n->instance);
+	}
+	// the id goes after the command name
+	const char * c = n->job->cmd[n->step++];
+	int len = strcspn(c, " \t");
+	n->state = NODE_CMD;
+	return dist_send(n, "%.*s %d%s", len, c, n->instance, c + len);
+}
+
+static void
+dist_result(
+		dist_node_t * n,
+		const char * what)
+{
+	size_t len = strlen(n->result);
+	snprintf(n->result + len, sizeof(n->result) - len, "%s%s",
+			len ? " ; " : "", what);
+}
+
+// starts the next job, if there's one; returns -1 if the node failed
+static int
+dist_start(
+		dist_node_t * n)
+{
+	dist_job_t * j = dist_dequeue();
+	if (!j)
+		return 0;
+	n->job = j;
+	n->step = 0;
+	n->put = 0;
+	n->offset = 0;
+	n->error = 0;
+	n->cycle = 0;
+	n->result[0] = 0;
+	if (n->fw_id[j->fw] < 0)
+		return dist_have(n);
+	n->state = NODE_NEW;
+	return dist_send(n, "new %d", n->fw_id[j->fw]);
+}
+
+// one line from the node; returns -1 if it failed
+static int
+dist_answer(
+		dist_node_t * n,
+		char * line)
+{
+	int ok = !strncmp(line, "ok", 2) && (!line[2] || line[2] == ' ');
+	const char * rest = ok ? line + 2 + !!line[2] : line;
+
+	if (verbose > 1)
+		fprintf(stderr, "%s > %s\n", n->name, line);
+	switch (n->state) {
+		case NODE_HAVE:
+			if (ok) {
+				n->fw_id[n->job->fw] = atoi(rest);
+				n->state = NODE_NEW;
+				return dist_send(n, "new %d", n->fw_id[n->job->fw]);
+			}
+			if (!n->put && !strncmp(line, "error unknown", 13)) {
+				if (verbose)
+					fprintf(stderr, "farm_dist: sending %s to %s\n",
+							fws[n->job->fw].path, n->name);
+				return dist_put(n);
+			}
+			break;
+		case NODE_PUT:
+			if (ok)
+				return dist_put(n);
+			break;
+		case NODE_NEW:
+			if (ok) {
+				n->instance = atoi(rest);
+				return dist_step(n);
+			}
+			break;
+		case NODE_CMD: {
+			const char * c = n->job->cmd[n->step - 1];
+			if (!ok) {
+				// the instance is still there, free it
+				n->error = 1;
+				dist_result(n, line);
+				n->step = n->job->cmd_count;
+				return dist_step(n);
+			}
+			if (!strncmp(c, "run", 3)) {
+				char state[32];
+				unsigned long long cycle;
+				if (sscanf(rest, "%31s %llu", state, &cycle) == 2)
+					n->cycle = cycle;
+			}
+			if (*rest)
+				dist_result(n, rest);
+			return dist_step(n);
+		}
+		case NODE_FREE:
+			dist_job_end(n);
+			return dist_start(n);
+		case NODE_STATS:
+			snprintf(n->stats, sizeof(n->stats), "%.*s", (int)sizeof(n->stats) - 1, rest);
+			n->state = NODE_IDLE;
+			return 0;
+		default:
+			return -1;
+	}
+	// the job can't be run there
+	n->error = 1;
+	dist_result(n, line);
+	dist_job_end(n);
+	return dist_start(n);
+}
+
+static void
+dist_read(
+		dist_node_t * n)
+{
+	ssize_t r = recv(n->fd, n->in + n->len, sizeof(n->in) - 1 - n->len, 0);
+	if (r < 0 && errno == EINTR)
+		return;
+	if (r <= 0) {
+		dist_node_dead(n);
+		return;
+	}
+	n->len += r;
+	char * line = n->in, * nl;
+	while (n->fd >= 0 && (nl = memchr(line, '\n', n->in + n->len - line))) {
+		*nl = 0;
+		if (dist_answer(n, line))
+			dist_node_dead(n);
+		line = nl + 1;
+	}
+	if (n->fd < 0)
+		return;
+	n->len -= line - n->in;
+	memmove(n->in, line, n->len);
+	if (n->len == sizeof(n->in) - 1)
+		dist_node_dead(n);
+}
+
+/*
+ * Waits for the answers, and keeps the nodes busy with the jobs, until
+ * they're all idle; with 'stats', only waits for the answers to that
+ */
+static int
+dist_poll(
+		int stats)
+{
+	for (;;) {
+		struct pollfd fds[DIST_NODES];
+		int who[DIST_NODES];
+		int count = 0;
+		for (int i = 0; i < node_count; i++) {
+			dist_node_t * n = nodes + i;
+			if (n->state == NODE_DEAD)
+				continue;
+			// a job put back by a lost node goes to an idle one
+			if (!stats && n->state == NODE_IDLE && queue_count &&
+					dist_start(n))
+				dist_node_dead(n);
+			if (n->state != NODE_IDLE && n->state != NODE_DEAD) {
+				fds[count] = (struct pollfd){ .fd = n->fd, .events = POLLIN };
+				who[count++] = i;
+			}
+		}
+		if (!count)
+			return stats || !jobs_left ? 0 : -1;
+		if (poll(fds, count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("farm_dist: poll");
+			return -1;
+		}
+		for (int i = 0; i < count; i++)
+			if (fds[i].revents)
+				dist_read(nodes + who[i]);
+	}
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:v")) != -1) {
+		switch (opt) {
+			case 'n':
+				if (node_count == DIST_NODES) {
+					fprintf(stderr, "%s: too many nodes\n", argv[0]);
+					return 1;
+				}
+				snprintf(nodes[node_count++].name, sizeof(nodes[0].name),
+						"%s", optarg);
+				break;
+			case 'r':
+				retries = atoi(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (!node_count || optind != argc - 1) {
+usage:
+		fprintf(stderr, "Usage: %s -n <node> [-n <node>...] [-r <retries>] "
+				"[-v] <jobs file>\n  see %s for the details\n", argv[0], __FILE__);
+		return 1;
+	}
+	if (network_init() || dist_read_jobs(argv[optind]))
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+	queue = calloc(job_count ? job_count : 1, sizeof(*queue));
+	for (int i = 0; i < job_count; i++)
+		dist_queue(jobs + i);
+	jobs_left = job_count;
+
+	int alive = 0;
+	for (int i = 0; i < node_count; i++) {
+		dist_node_t * n = nodes + i;
+		n->fw_id = malloc((fw_count ? fw_count : 1) * sizeof(int));
+		for (int f = 0; f < fw_count; f++)
+			n->fw_id[f] = -1;
+		if ((n->fd = dist_connect(n->name)) < 0) {
+			fprintf(stderr, "farm_dist: can't connect to %s\n", n->name);
+			n->state = NODE_DEAD;
+			continue;
+		}
+		alive++;
+	}
+	if (!alive)
+		return 1;
+	int res = dist_poll(0);
+	if (res)
+		fprintf(stderr, "farm_dist: %d jobs left, and no node to run them\n",
+				jobs_left);
+
+	// the nodes' own counters
+	for (int i = 0; i < node_count; i++)
+		if (nodes[i].state == NODE_IDLE) {
+			nodes[i].state = NODE_STATS;
+			if (dist_send(nodes + i, "stats"))
+				dist_node_dead(nodes + i);
+		}
+	dist_poll(1);
+	uint64_t total = 0, failed = 0;
+	avr_cycle_count_t cycles = 0;
+	for (int i = 0; i < node_count; i++) {
+		dist_node_t * n = nodes + i;
+		printf("node %s jobs %llu failed %llu cycles %" PRI_avr_cycle_count
+				" %s\n", n->name, (unsigned long long)n->jobs,
+				(unsigned long long)n->failed, n->cycles,
+				n->state == NODE_DEAD ? "lost" : n->stats);
+		total += n->jobs;
+		failed += n->failed;
+		cycles += n->cycles;
+		if (n->fd >= 0) {
+			dist_send(n, "quit");
+			close(n->fd);
+		}
+	}
+	printf("total jobs %llu failed %llu cycles %" PRI_avr_cycle_count "\n",
+			(unsigned long long)total, (unsigned long long)failed, cycles);
+	return res || failed ? 1 : 0;
+}
@@ -0,0 +1,334 @@
+/*
+	fuzz_avr.c
+
+	In-process fuzzing front end: libFuzzer entry points, AFL++ persistent
+	mode, or a plain runner for reproducing crashes.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The firmware is loaded once, and run for SIMAVR_FUZZ_WARMUP cycles to
+ * get past its initialization. That state is snapshotted, and every input
+ * starts from it again; as only the pages it wrote are copied back, a
+ * restore costs next to nothing (see sim_snapshot.h).
+ *
+ * The input is fed to a UART, honouring its XON/XOFF, or copied into a
+ * memory buffer, and the firmware runs for SIMAVR_FUZZ_CYCLES. An AVR
+ * crash (bad opcode, out of bounds access...) aborts, so the fuzzer keeps
+ * that input. The edges taken by the firmware are counted straight into
+ * the fuzzer's coverage map (sim_coverage.h).
+ *
+ * libFuzzer owns the command line, so it's all set in the environment:
+ *	SIMAVR_FUZZ_FIRMWARE	ELF file, or .hex with the two below
+ *	SIMAVR_FUZZ_MMCU		overrides the ELF's, mandatory for .hex
+ *	SIMAVR_FUZZ_FREQ		same, in Hz
+ *	SIMAVR_FUZZ_WARMUP		cycles run before the snapshot, default 0
+ *	SIMAVR_FUZZ_CYCLES		budget per input, default 10000000
+ *	SIMAVR_FUZZ_UART		UART to feed, default '0'
+ *	SIMAVR_FUZZ_BUFFER		<addr>:<size> feed a data space buffer instead;
+ *							the length is stored at <addr> as 16 bits, the
+ *							bytes follow, up to <size> - 2 of them
+ *
+ * Builds, from this directory:
+ *	libFuzzer:	clang -fsanitize=fuzzer -DSIMAVR_FUZZ_LIBFUZZER ...
+ *	AFL++:		afl-clang-fast ... (persistent mode is picked up)
+ *	otherwise:	'make fuzz_avr', runs the files given as arguments and
+ *				prints the number of edges each one hit
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_core.h"
+#include "sim_snapshot.h"
+#include "sim_coverage.h"
+#include "avr_uart.h"
+
+#include "sim_core_decl.h"
+
+#define FUZZ_MAP_SIZE	65536
+
+#if defined(SIMAVR_FUZZ_LIBFUZZER)
+// libFuzzer picks up anything in that section as extra coverage counters
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t fuzz_map[FUZZ_MAP_SIZE];
+#elif defined(__AFL_FUZZ_TESTCASE_LEN)
+__AFL_FUZZ_INIT();
+extern uint8_t * __afl_area_ptr;
+extern uint32_t __afl_map_size;
+#endif
+
+static struct {
+	avr_t *				avr;
+	avr_snapshot_t *	snap;
+	avr_coverage_t		cov;
+	avr_cycle_count_t	cycles;
+	// UART feed
+	avr_irq_t *			input, * xon, * xoff;
+	const uint8_t *		data;
+	size_t				size, pos;
+	// or data space buffer
+	uint32_t			buf_addr, buf_size;
+} fuzz;
+
+static void
+fuzz_uart_feed(void)
+{
+	while (fuzz.pos < fuzz.size && !fuzz.xoff->value)
+		avr_raise_irq(fuzz.input, fuzz.data[fuzz.pos++]);
+}
+
+static void
+fuzz_uart_xon_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	fuzz_uart_feed();
+}
+
+static int
+fuzz_load(
+		elf_firmware_t * f,
+		const char * filename)
+{
+	const char * suffix = strrchr(filename, '.');
+
+	if (!suffix || strcasecmp(suffix, ".hex"))
+		return elf_read_firmware(filename, f);
+	if (!f->mmcu[0] || !f->frequency) {
+		fprintf(stderr, "FUZZ: SIMAVR_FUZZ_MMCU and SIMAVR_FUZZ_FREQ are "
+				"mandatory to load .hex files\n");
+		return -1;
+	}
+	ihex_chunk_p chunk = NULL;
+	int cnt = read_ihex_chunks(filename, &chunk);
+	for (int ci = 0; ci < cnt; ci++) {
+		if (chunk[ci].baseaddr < AVR_SEGMENT_OFFSET_EEPROM) {
+			f->flash = chunk[ci].data;
+			f->flashsize = chunk[ci].size;
+			f->flashbase = chunk[ci].baseaddr;
+		} else {
+			f->eeprom = chunk[ci].data;
+			f->eesize = chunk[ci].size;
+		}
+	}
+	return f->flash ? 0 : -1;
+}
+
+static int
+fuzz_init(void)
+{
+	static elf_firmware_t f = {{0}};
+	const char * v;
+
+	const char * filename = getenv("SIMAVR_FUZZ_FIRMWARE");
+	if (!filename) {
+		fprintf(stderr, "FUZZ: SIMAVR_FUZZ_FIRMWARE isn't set\n");
+		return -1;
+	}
+	if ((v = getenv("SIMAVR_FUZZ_MMCU")))
+		snprintf(f.mmcu, sizeof(f.mmcu), "%s", v);
+	if ((v = getenv("SIMAVR_FUZZ_FREQ")))
+		f.frequency = strtoul(v, NULL, 0);
+	if (fuzz_load(&f, filename)) {
+		fprintf(stderr, "FUZZ: Unable to load firmware from %s\n", filename);
+		return -1;
+	}
+	// the command line ones win over the ELF's, as with run_avr
+	if ((v = getenv("SIMAVR_FUZZ_MMCU")))
+		snprintf(f.mmcu, sizeof(f.mmcu), "%s", v);
+	if ((v = getenv("SIMAVR_FUZZ_FREQ")))
+		f.frequency = strtoul(v, NULL, 0);
+
+	fuzz.avr = avr_make_mcu_by_name(f.mmcu);
+	if (!fuzz.avr) {
+		fprintf(stderr, "FUZZ: AVR '%s' not known\n", f.mmcu);
+		return -1;
+	}
+	avr_t * avr = fuzz.avr;
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+	if (f.flashbase)
+		avr->pc = f.flashbase;
+	avr->log = LOG_NONE;
+	// the UARTs sleep when polled while empty, and print lines; not here
+	for (char u = '0'; u <= '9'; u++) {
+		uint32_t flags = 0;
+		if (avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(u), &flags))
+			continue;
+		flags &= ~(AVR_UART_FLAG_POLL_SLEEP | AVR_UART_FLAG_STDIO);
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(u), &flags);
+	}
+	if (avr_predecode_init(avr))
+		fprintf(stderr, "FUZZ: Warning: instruction predecoding not available\n");
+
+	fuzz.cycles = 10000000;
+	if ((v = getenv("SIMAVR_FUZZ_CYCLES")))
+		fuzz.cycles = strtoull(v, NULL, 0);
+	if ((v = getenv("SIMAVR_FUZZ_BUFFER"))) {
+		char * e;
+		fuzz.buf_addr = strtoul(v, &e, 0);
+		fuzz.buf_size = *e == ':' ? strtoul(e + 1, NULL, 0) : 0;
+		if (fuzz.buf_size < 2 ||
+				fuzz.buf_addr + fuzz.buf_size > avr->ramend + 1) {
+			fprintf(stderr, "FUZZ: bad SIMAVR_FUZZ_BUFFER %s\n", v);
+			return -1;
+		}
+	} else {
+		v = getenv("SIMAVR_FUZZ_UART");
+		uint32_t ctl = AVR_IOCTL_UART_GETIRQ(v && v[0] ? v[0] : '0');
+		fuzz.input = avr_io_getirq(avr, ctl, UART_IRQ_INPUT);
+		fuzz.xon = avr_io_getirq(avr, ctl, UART_IRQ_OUT_XON);
+		fuzz.xoff = avr_io_getirq(avr, ctl, UART_IRQ_OUT_XOFF);
+		if (!fuzz.input || !fuzz.xon || !fuzz.xoff) {
+			fprintf(stderr, "FUZZ: %s has no UART%c\n", avr->mmcu,
+					v && v[0] ? v[0] : '0');
+			return -1;
+		}
+		avr_irq_register_notify(fuzz.xon, fuzz_uart_xon_hook, NULL);
+	}
+
+	if ((v = getenv("SIMAVR_FUZZ_WARMUP"))) {
+		avr_cycle_count_t until = strtoull(v, NULL, 0);
+		while (avr->cycle < until) {
+			int state = avr_run_cycles(avr, until - avr->cycle);
+			if (state == cpu_Done || state == cpu_Crashed) {
+				fprintf(stderr, "FUZZ: firmware stopped during warmup\n");
+				return -1;
+			}
+		}
+	}
+	fuzz.snap = avr_snapshot_save(avr);
+	if (!fuzz.snap)
+		return -1;
+
+	uint8_t * map = NULL;
+	uint32_t size = FUZZ_MAP_SIZE;
+#if defined(SIMAVR_FUZZ_LIBFUZZER)
+	map = fuzz_map;
+#elif defined(__AFL_FUZZ_TESTCASE_LEN)
+	map = __afl_area_ptr;
+	// the largest power of two that fits, it's shared with the host edges
+	for (size = FUZZ_MAP_SIZE; size > __afl_map_size; size >>= 1)
+		;
+#endif
+	return avr_coverage_init(avr, &fuzz.cov, map, size);
+}
+
+int
+LLVMFuzzerInitialize(
+		int * argc,
+		char *** argv)
+{
+	if (fuzz_init())
+		exit(1);
+	return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(
+		const uint8_t * data,
+		size_t size)
+{
+	avr_t * avr = fuzz.avr;
+
+	if (avr_snapshot_restore(avr, fuzz.snap))
+		abort();
+	avr_coverage_reset(&fuzz.cov);
+
+	if (fuzz.buf_size) {
+		if (size > fuzz.buf_size - 2)
+			size = fuzz.buf_size - 2;
+		avr->data[fuzz.buf_addr] = size;
+		avr->data[fuzz.buf_addr + 1] = size >> 8;
+		memcpy(avr->data + fuzz.buf_addr + 2, data, size);
+		avr_dirty_mark(avr->dirty.data, fuzz.buf_addr, size + 2);
+	} else {
+		fuzz.data = data;
+		fuzz.size = size;
+		fuzz.pos = 0;
+		// the receiver might be ready already, otherwise XON starts it
+		if (fuzz.xon->value)
+			fuzz_uart_feed();
+	}
+
+	avr_cycle_count_t until = avr->cycle + fuzz.cycles;
+	while (avr->cycle < until) {
+		int state = avr_run_cycles(avr, until - avr->cycle);
+		if (state == cpu_Crashed) {
+			fprintf(stderr, "FUZZ: firmware crashed at pc %04x, cycle %llu\n",
+					avr->pc, (unsigned long long)avr->cycle);
+			abort();
+		}
+		if (state == cpu_Done)
+			break;
+	}
+	fuzz.data = NULL;
+	fuzz.size = 0;
+	return 0;
+}
+
+#if !defined(SIMAVR_FUZZ_LIBFUZZER)
+int
+main(
+		int argc,
+		char *argv[])
+{
+	LLVMFuzzerInitialize(&argc, &argv);
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+	__AFL_INIT();
+	uint8_t * buf = __AFL_FUZZ_TESTCASE_BUF;
+	while (__AFL_LOOP(100000))
+		LLVMFuzzerTestOneInput(buf, __AFL_FUZZ_TESTCASE_LEN);
+#else
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <input>...\n"
+				"  see %s for the environment it needs\n", argv[0], __FILE__);
+		return 1;
+	}
+	for (int i = 1; i < argc; i++) {
+		FILE * in = fopen(argv[i], "rb");
+		if (!in) {
+			perror(argv[i]);
+			return 1;
+		}
+		uint8_t * data = NULL;
+		size_t size = 0, len;
+		uint8_t chunk[4096];
+		while ((len = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+			uint8_t * d = realloc(data, size + len);
+			if (!d)
+				return 1;
+			data = d;
+			memcpy(data + size, chunk, len);
+			size += len;
+		}
+		fclose(in);
+		memset(fuzz.cov.map, 0, fuzz.cov.mask + 1);
+		LLVMFuzzerTestOneInput(data, size);
+		printf("%s: %zu bytes, %u edges\n", argv[i], size,
+				avr_coverage_count(&fuzz.cov));
+		free(data);
+	}
+#endif
+	return 0;
+}
+#endif
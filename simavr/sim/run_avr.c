@@ -23,16 +23,61 @@
 #include <stdio.h>
 #include <libgen.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/personality.h>
+#include <unistd.h>
+#endif
 #include "sim_avr.h"
 #include "sim_elf.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
 #include "sim_hex.h"
+#include "sim_board.h"
+#include "sim_shm.h"
 #include "sim_vcd_file.h"
+#include "avr_watchdog.h"
+#include "avr_eeprom.h"
+#include "sim_pacing.h"
+#include "sim_trace_ring.h"
+#include "sim_trace_file.h"
+#include "sim_profile.h"
+#include "sim_callgraph.h"
+#include "sim_cfg.h"
+#include "sim_lcov.h"
+#include "sim_heatmap.h"
+#include "sim_logger.h"
+#include "sim_regions.h"
+#include "sim_stats.h"
+#include "sim_timer_prof.h"
+#include "sim_irq_prof.h"
+#include "sim_intrinsics.h"
+#include "sim_tier.h"
+#include "sim_telemetry.h"
+#include "sim_sampling.h"
+#include "sim_energy.h"
+#include "sim_replay.h"
+#include "sim_buslog.h"
+#include "sim_fwcache.h"
+#include "sim_snapshot.h"
+#include "sim_ckstore.h"
+#include "sim_snapdiff.h"
+#include "sim_postmortem.h"
+#include "sim_memory.h"
+#include "sim_forkserver.h"
+#include "sim_aio.h"
+#include "sim_arena.h"
 
 #include "sim_core_decl.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 static void
 display_usage(
 	const char * app)
@@ -44,14 +89,148 @@ display_usage(
 			"       [--help|-h]         Display this usage message and exit\n"
 			"       [--trace, -t]       Run full scale decoder trace\n"
 			"       [-ti <vector>]      Add traces for IRQ vector <vector>\n"
+			"       [--trace-only <symbol|from-to>] Only trace that code,\n"
+			"       [--trace-skip <symbol|from-to>] or all but that code;\n"
+			"                           both can be repeated, in order\n"
+			"       [--trace-isr]       Only trace the interrupt handlers\n"
+			"       [--trace-ring <n>]  Keep the last <n> instructions, and\n"
+			"                           print them if the core crashes\n"
+			"       [--postmortem-to <file>] Write the state and that ring\n"
+			"                           there on a crash, an invalid opcode or\n"
+			"                           a watchdog reset\n"
+			"       [--postmortem <file>] Print one, and load it for --gdb\n"
+			"       [--irq-storm <n>]   Crash when a vector is entered <n> times\n"
+			"                           in a row right after its RETI\n"
 			"       [--gdb|-g]          Listen for gdb connection on port 1234\n"
+			"       [--profile <file>]  Count the cycles used per instruction, and\n"
+			"                           write them to <file> in callgrind format\n"
+			"       [--profile-sample <n>] Only sample the pc every <n> cycles\n"
+			"       [--callgraph <file>] Follow calls and interrupts, and write\n"
+			"                           the call stacks for flamegraph.pl\n"
+			"       [--lcov <file>]     Record the lines and branches the firmware\n"
+			"                           runs, and add them to lcov tracefile\n"
+			"                           <file>; needs an ELF built with -g\n"
+			"       [--cfg <file>]      Write the basic blocks of the firmware,\n"
+			"                           and where they go, to <file>\n"
+			"       [--stats [json]]    Count instructions, irqs, timers and IO\n"
+			"                           callbacks, and print them on exit, or\n"
+			"                           print one line of JSON, with the ISRs\n"
+			"       [--timer-profile]   Count the calls and host time of each\n"
+			"                           cycle timer, and print them on exit\n"
+			"       [--irq-profile]     Count the raises of each irq, and the\n"
+			"                           calls and host time of each of its\n"
+			"                           hooks, and print them on exit\n"
+			"       [--intrinsics]      Run the libgcc and avr-libc routines it\n"
+			"                           can natively, once checked, and print\n"
+			"                           which on exit\n"
+			"       [--intrinsics-signatures <file>] Same, and trust the\n"
+			"                           routines listed in <file>, then add\n"
+			"                           the ones checked to it\n"
+			"       [--memory]          Print the memory the instance takes,\n"
+			"                           per part, on exit\n"
+			"       [--huge-pages [hugetlb]] Put the tables of the instance,\n"
+			"                           and its irqs, in transparent huge pages,\n"
+			"                           or explicit ones\n"
+			"       [--telemetry <sec>] Print the real time factor, speed and\n"
+			"                           sleep ratio every <sec> seconds\n"
+			"       [--sample <period> <window>] Run the threaded engine\n"
+			"                           without the profile, stats or heatmap\n"
+			"                           but for <window> cycles every <period>,\n"
+			"                           and extrapolate the stats from those\n"
+			"       [--energy <table>]  Count the time per sleep mode and per\n"
+			"                           peripheral state, and the energy with\n"
+			"                           the currents in <table>, see sim_energy.h\n"
+			"       [--trace-file <file> [regs] [writes]] Write a compact trace\n"
+			"                           of the run, with the registers that\n"
+			"                           changed, and the SRAM writes\n"
+			"       [--trace-text <file>] Print such a trace as text, and exit\n"
+			"       [--trace-diff <a> <b>] Print where two of them first\n"
+			"                           differ, and exit with 1 if they do\n"
+			"       [--heatmap <bytes>] Count the SRAM reads and writes per\n"
+			"                           <bytes> bucket, and the stack depth,\n"
+			"                           and print them per object on exit\n"
+			"       [--cycles <n>]      Stop at cycle <n>, exit code 3; a\n"
+			"                           restored run stops there too\n"
+			"       [--save-at-cycle <n> <file>] Save a checkpoint of the run\n"
+			"                           in <file> once it reaches cycle <n>\n"
+			"       [--checkpoint <file>] Save one there on SIGUSR1, or when\n"
+			"                           the firmware sends SIMAVR_CMD_CHECKPOINT\n"
+			"       [--checkpoint-every <n> <store>] Keep one every <n>\n"
+			"                           cycles, in a deduplicated, compressed\n"
+			"                           <store> file written on exit\n"
+			"       [--restore <file>[@<ck>]] Start from a checkpoint, taken\n"
+			"                           with the same command line but for\n"
+			"                           the checkpoint options; for a store, its\n"
+			"                           checkpoint <ck>, by default the last\n"
+			"       [--time-us <n>]     Same, after <n> simulated usec\n"
+			"       [--snapshot-diff <a> <b>] Compare two checkpoints, or\n"
+			"                           find the first pair that differ in\n"
+			"                           two stores; exit with 1 if they do\n"
+			"       [--predecode]       Decode each instruction once, and cache it\n"
+			"       [--threaded]        Same, and use the threaded dispatch engine\n"
+			"       [--tiered [<n>]]    Only use it for the flash blocks jumped\n"
+			"                           into <n> times (1000), decode the rest\n"
+			"       [--lazy-io]         Only allocate the irqs of a peripheral\n"
+			"                           once the firmware, or a part, uses it\n"
+			"       [--functional]      Keep the core's cycles exact, but have\n"
+			"                           the uart, spi, twi, eeprom and adc finish\n"
+			"                           their bytes and writes the next cycle\n"
+			"       [--virtual-time]    Don't pace sleeps to the host clock, run\n"
+			"                           as fast as possible\n"
+			"       [--pace <factor>]   Run in step with the host clock, at\n"
+			"                           <factor> times the real speed\n"
+			"       [--deadline <usec>] With --pace, warn when the host is more\n"
+			"                           than <usec> behind\n"
+			"       [--realtime <cpu> <priority>] Pin to <cpu> (-1 for none),\n"
+			"                           lock memory and run SCHED_FIFO at\n"
+			"                           <priority> (0 to leave it)\n"
 			"       [-ff <.hex file>]   Load next .hex file as flash\n"
 			"       [-ee <.hex file>]   Load next .hex file as eeprom\n"
+			"       [--eeprom-file <file>] Keep the eeprom in <file>, as the\n"
+			"                           firmware writes it; an existing file\n"
+			"                           replaces the firmware eeprom\n"
 			"       [--input|-i <file>] A .vcd file to use as input signals\n"
+			"       [--input-repeat <n>] Play it <n> times, 0 to loop forever\n"
+			"       [--vcd-thread]      Write the .vcd trace of the firmware from\n"
+			"                           another thread\n"
+			"       [--aio]             Write the .vcd, trace file and checkpoint\n"
+			"                           store through io_uring, in the background\n"
+			"       [--vcd-window <pre> <post>] Only write the <pre> cycles before,\n"
+			"                           and <post> after, each watchdog reset or\n"
+			"                           SIMAVR_CMD_VCD_START_TRACE\n"
+			"       [--vcd-sample <name> <usec> [minmax]] Write the firmware's\n"
+			"                           trace <name> every <usec>, or its lowest\n"
+			"                           and highest values over <usec>\n"
+			"       [--record <file>]   Record the values sent to the inputs of\n"
+			"                           the core, with their cycle\n"
+			"       [--replay <file>]   Send them again, at the same cycles\n"
+			"       [--bus-log <file> [<bus>]] Log the bytes of the uarts, spi and\n"
+			"                           twi, or of <bus> only (uart0...), with\n"
+			"                           their cycle; binary for a .bin file\n"
+			"       [--cache <dir>]     Keep the loaded firmware, and its decoded\n"
+			"                           instructions, in <dir> for the next runs\n"
+			"       [--warm-start]      With --cache, start at main(), with the\n"
+			"                           state crt0 left, kept from the first run\n"
+			"       [--console <file>]  Write the console and uart output to\n"
+			"                           <file>, or - for stdout, as it is\n"
+			"       [--shm <name> [eeprom]] Put the data space, and the\n"
+			"                           eeprom, in shared memory segment\n"
+			"                           <name>, for other processes to watch,\n"
+			"                           see sim_shm.h\n"
+			"       [--board <file>]    Run the instances, and their wires,\n"
+			"                           of a board file, see sim_board.h;\n"
+			"                           only --cycles, of the first instance,\n"
+			"                           --time-us, -v and --fork-server apply\n"
+			"       [--fork-server]     Load and set up once, then fork a run\n"
+			"                           per request on fds 198 and 199, as\n"
+			"                           AFL does, see sim_forkserver.h\n"
+			"       [--log-thread]      Write the log from another thread\n"
 			"       [-v]                Raise verbosity level\n"
 			"                           (can be passed more than once)\n"
 			"       <firmware>          A .hex or an ELF file. ELF files are\n"
-			"                           prefered, and can include debugging syms\n");
+			"                           prefered, and can include debugging syms\n"
+			"The exit code is 0 when the firmware is done, 2 if it crashed,\n"
+			"3 if it ran out of --cycles or --time-us\n");
 	exit(1);
 }
 
@@ -69,35 +248,514 @@ list_cores()
 }
 
 static avr_t * avr = NULL;
+static avr_pacing_t pacing;
+static avr_trace_ring_t trace_ring;
+static avr_postmortem_t postmortem;
+static avr_int_storm_t storm = { .stop = 1 };
+static avr_trace_file_t trace_file;
+static const char * trace_file_name;
+static uint32_t trace_file_flags;
+static avr_profile_t profile;
+static const char * profile_file;
+static avr_callgraph_t callgraph;
+static const char * callgraph_file;
+static const char * cfg_file;
+static avr_lcov_t lcov;
+static const char * lcov_file;
+static avr_heatmap_t heatmap;
+static uint32_t heatmap_bucket;
+static avr_stats_t stats;
+static avr_tier_t tier;
+static avr_shm_t shm;
+static int stats_json;
+static int memory_report;
+static avr_timer_prof_t timer_prof;
+static int timer_profile;
+static avr_irq_prof_t irq_prof;
+static int irq_profile;
+static avr_intrinsics_t intrinsics;
+static int use_intrinsics;
+static const char * intrinsics_file;
+static avr_telemetry_t telemetry;
+static avr_sampling_t sampling;
+static avr_energy_t energy;
+static const char * energy_file;
+static double host_start;
+static avr_replay_t replay;
+static avr_buslog_t buslog;
+static const char * cache_dir;
+static const char * cache_file;
+static elf_firmware_t cache_f;	// as loaded, before the command line settings
+static int cache_decoded;		// store the decoded instructions on exit
+static const char * checkpoint_file;
+static avr_ckstore_t * ck_store;
+static const char * ck_store_file;
+static volatile sig_atomic_t checkpoint_wanted;
+static elf_firmware_t f = {{0}};
+
+static double
+host_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+profile_done(void)
+{
+#if ELF_SYMBOLS
+	if (profile_file || callgraph_file || heatmap.avr)
+		elf_firmware_symbols(&f);
+	avr_symbol_t ** symbol = f.symbol;
+	uint32_t symbolcount = f.symbolcount;
+#else
+	avr_symbol_t ** symbol = NULL;
+	uint32_t symbolcount = 0;
+#endif
+	// first, while the tools still have their buffers
+	if (avr && memory_report) {
+		avr_memory_t m;
+		avr_memory_get(avr, &m);
+		avr_memory_report(&m, stdout);
+		memory_report = 0;
+	}
+	if (sampling.avr) {
+		avr_sampling_stop(&sampling);
+		avr_sampling_report(&sampling, stdout);
+	}
+	if (profile_file) {
+		avr_profile_stop(&profile);
+		avr_profile_report(&profile, symbol, symbolcount, 10, stdout);
+		avr_profile_write_callgrind(&profile, symbol, symbolcount, profile_file);
+		profile_file = NULL;
+	}
+	if (callgraph_file) {
+		avr_callgraph_stop(&callgraph);
+		avr_callgraph_write_folded(&callgraph, symbol, symbolcount, callgraph_file);
+		callgraph_file = NULL;
+	}
+	if (heatmap.avr) {
+		avr_heatmap_stop(&heatmap);
+		avr_heatmap_report(&heatmap, symbol, symbolcount, 20, stdout);
+	}
+	if (lcov_file) {
+		avr_lcov_stop(&lcov);
+#if ELF_SYMBOLS
+		if (elf_firmware_lines(&f) == 0)
+			avr_lcov_write(&lcov, f.line, f.linecount, f.file, f.filecount,
+					lcov_file);
+		else
+#endif
+			fprintf(stderr, "Warning: no line table, %s not written\n",
+					lcov_file);
+		lcov_file = NULL;
+	}
+	if (trace_file.avr && avr_trace_file_stop(&trace_file))
+		fprintf(stderr, "Warning: the trace in %s is incomplete\n",
+				trace_file_name);
+	if (avr && avr->regions)
+		avr_regions_report(avr, stdout);
+	if (energy.avr) {
+		avr_energy_stop(&energy);
+		avr_energy_report(&energy, stdout);
+	}
+	if (stats.avr) {
+		if (stats_json)
+			avr_stats_report_json(&stats, host_now() - host_start, stdout);
+		else
+			avr_stats_report(&stats, stdout);
+		avr_stats_stop(&stats);
+	}
+	if (timer_prof.avr) {
+		avr_timer_prof_report(&timer_prof, stdout);
+		avr_timer_prof_stop(&timer_prof);
+	}
+	if (irq_prof.pool) {
+		avr_irq_prof_report(&irq_prof, stdout);
+		avr_irq_prof_stop(&irq_prof);
+	}
+	if (intrinsics.avr) {
+		avr_intrinsics_report(&intrinsics, stdout);
+		if (intrinsics_file && avr_intrinsics_save(&intrinsics, intrinsics_file))
+			fprintf(stderr, "Warning: can't write the signatures in %s\n",
+					intrinsics_file);
+		avr_intrinsics_stop(&intrinsics);
+	}
+	if (replay.avr && avr_replay_stop(&replay))
+		fprintf(stderr, "Warning: recording or replay failed\n");
+	if (buslog.avr && avr_buslog_close(&buslog))
+		fprintf(stderr, "Warning: the bus log is incomplete\n");
+	if (cache_decoded) {
+		avr_fwcache_store(cache_dir, cache_file, &cache_f, avr);
+		cache_decoded = 0;
+	}
+}
+
+/*
+ * Checkpoints keep pointers, so they can only be restored in a process
+ * laid out the same as the one that saved them; that's only possible
+ * without address space randomization, so run again without it.
+ */
+static void
+checkpoint_exec(
+		int argc,
+		char *argv[])
+{
+#ifdef __linux__
+	int wanted = 0;
+	for (int pi = 1; pi < argc; pi++)
+		wanted |= !strcmp(argv[pi], "--save-at-cycle") ||
+				!strcmp(argv[pi], "--checkpoint") ||
+				!strcmp(argv[pi], "--checkpoint-every") ||
+				!strcmp(argv[pi], "--snapshot-diff") ||
+				!strcmp(argv[pi], "--postmortem-to") ||
+				!strcmp(argv[pi], "--postmortem") ||
+				!strcmp(argv[pi], "--restore");
+	int persona = personality(0xffffffff);
+	if (!wanted || persona == -1 || (persona & ADDR_NO_RANDOMIZE))
+		return;
+	if (personality(persona | ADDR_NO_RANDOMIZE) != -1)
+		execv("/proc/self/exe", argv);
+	fprintf(stderr, "%s: Warning: checkpoints need the address space "
+			"randomization off\n", argv[0]);
+#endif
+}
+
+static int
+checkpoint_save(
+		const char * file)
+{
+	avr_snapshot_t * s = avr_snapshot_save(avr);
+	int res = s ? avr_snapshot_write(avr, s, file) : -1;
+	avr_snapshot_free(s);
+	// no need to keep track of the pages for that one
+	avr_snapshot_untrack(avr);
+	if (res)
+		fprintf(stderr, "Warning: can't save a checkpoint in %s\n", file);
+	else
+		printf("Checkpoint of cycle %" PRI_avr_cycle_count " saved in %s\n",
+				avr->cycle, file);
+	return res;
+}
+
+// the firmware asked for one with SIMAVR_CMD_CHECKPOINT
+static void
+checkpoint_request(
+		avr_t * avr,
+		void * param)
+{
+	checkpoint_wanted = 1;
+}
+
+#ifdef SIGUSR1
+static void
+sig_usr1(
+		int sign)
+{
+	checkpoint_wanted = 1;
+}
+#endif
+
+static void
+checkpoint_keep(void)
+{
+	avr_snapshot_t * s = avr_snapshot_save(avr);
+	if (!s || avr_ckstore_put(ck_store, s, NULL) < 0)
+		fprintf(stderr, "Warning: can't keep a checkpoint at cycle %"
+				PRI_avr_cycle_count "\n", avr->cycle);
+	avr_snapshot_free(s);
+	avr_snapshot_untrack(avr);
+}
+
+static void
+checkpoint_done(void)
+{
+	if (!ck_store)
+		return;
+	if (avr_ckstore_write(ck_store, ck_store_file) == 0) {
+		printf("Checkpoints saved in %s: ", ck_store_file);
+		avr_ckstore_report(ck_store, stdout);
+	}
+	avr_ckstore_free(ck_store);
+	ck_store = NULL;
+}
+
+static int
+checkpoint_is_store(
+		const char * path)
+{
+	char magic[8] = "";
+	FILE * f = fopen(path, "rb");
+	if (f) {
+		if (fread(magic, sizeof(magic), 1, f) != 1)
+			magic[0] = 0;
+		fclose(f);
+	}
+	return !memcmp(magic, AVR_CKSTORE_FILE_MAGIC, sizeof(magic));
+}
+
+/*
+ * A store is "<file>@<ck>", or just its file for its last checkpoint.
+ * Returns NULL if 'file' isn't a store at all
+ */
+static avr_snapshot_t *
+checkpoint_from_store(
+		const char * file)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", file);
+	int ck = -1;
+	char * at = strrchr(path, '@');
+	if (at && at[1] && strspn(at + 1, "0123456789") == strlen(at + 1)) {
+		ck = atoi(at + 1);
+		*at = 0;
+	}
+	if (!checkpoint_is_store(path))
+		return NULL;
+	avr_ckstore_t * st = avr_ckstore_read(path);
+	if (!st)
+		return NULL;
+	for (int i = st->cks - 1; ck < 0 && i >= 0; i--)
+		if (st->ck[i].chunk)
+			ck = i;
+	avr_snapshot_t * s = avr_ckstore_get(st, ck);
+	avr_ckstore_free(st);
+	return s;
+}
+
+static int
+checkpoint_is_postmortem(
+		const char * path)
+{
+	gzFile f = gzopen(path, "rb");
+	char magic[8] = "";
+	if (f) {
+		if (gzread(f, magic, sizeof(magic)) != sizeof(magic))
+			magic[0] = 0;
+		gzclose(f);
+	}
+	return !memcmp(magic, AVR_POSTMORTEM_FILE_MAGIC, sizeof(magic));
+}
+
+// a snapshot file, a store entry, or the snapshot of a post-mortem
+static avr_snapshot_t *
+checkpoint_load(
+		const char * file)
+{
+	avr_snapshot_t * s = checkpoint_from_store(file);
+	if (!s && checkpoint_is_postmortem(file) &&
+			avr_postmortem_read(avr, file, NULL, &s, NULL))
+		return NULL;
+	return s ? s : avr_snapshot_read(avr, file);
+}
+
+// prints it, and loads it for gdb to look at. Returns 0, or -1
+static int
+postmortem_load(
+		const char * file,
+		int gdb)
+{
+	avr_postmortem_info_t info;
+	avr_snapshot_t * s = NULL;
+	avr_trace_rec_t * rec = NULL;
+	if (avr_postmortem_read(avr, file, &info, &s, &rec))
+		return -1;
+	avr_postmortem_print(&info, rec, 32, stdout);
+	free(rec);
+	int res = 0;
+	if (strcmp(info.mmcu, avr->mmcu)) {
+		fprintf(stderr, "%s is of a %s, not a %s\n", file, info.mmcu,
+				avr->mmcu);
+		res = -1;
+	} else if (gdb) {
+		res = avr_snapshot_restore(avr, s);
+		avr_snapshot_untrack(avr);
+		avr->state = cpu_Stopped;
+	}
+	avr_snapshot_free(s);
+	return res;
+}
+
+/*
+ * Two stores are bisected to the first pair of checkpoints that differ,
+ * and that pair is compared; otherwise it's the two checkpoints given.
+ * Returns the exit code: 0 if they're the same, 1 if not, 2 on error
+ */
+static int
+checkpoint_diff(
+		const char * file_a,
+		const char * file_b)
+{
+#if ELF_SYMBOLS
+	elf_firmware_symbols(&f);
+	avr_symbol_t ** symbol = f.symbol;
+	uint32_t symbolcount = f.symbolcount;
+#else
+	avr_symbol_t ** symbol = NULL;
+	uint32_t symbolcount = 0;
+#endif
+	avr_snapshot_t * a = NULL, * b = NULL;
+
+	if (checkpoint_is_store(file_a) && checkpoint_is_store(file_b)) {
+		avr_ckstore_t * sa = avr_ckstore_read(file_a);
+		avr_ckstore_t * sb = avr_ckstore_read(file_b);
+		int ck = sa && sb ? avr_snapdiff_bisect(avr, sa, sb,
+				AVR_SNAPDIFF_STATE) : -1;
+		int count = sa && sb ? (sa->cks < sb->cks ? sa->cks : sb->cks) : 0;
+		if (ck >= 0 && ck < count) {
+			a = avr_ckstore_get(sa, ck);
+			b = avr_ckstore_get(sb, ck);
+			printf("First difference at checkpoint %d\n", ck);
+		} else if (ck == count)
+			printf("The %d checkpoints are the same\n", count);
+		avr_ckstore_free(sa);
+		avr_ckstore_free(sb);
+		if (ck == count)
+			return 0;
+	} else {
+		a = checkpoint_load(file_a);
+		b = checkpoint_load(file_b);
+	}
+	int res = a && b ?
+			avr_snapdiff(avr, a, b, symbol, symbolcount, stdout, NULL) : -1;
+	avr_snapshot_free(a);
+	avr_snapshot_free(b);
+	return res < 0 ? 2 : res > 0;
+}
 
 static void
 sig_int(
 		int sign)
 {
 	printf("signal caught, simavr terminating\n");
+	if (pacing.avr)
+		avr_pacing_report(&pacing, stdout);
+	profile_done();
+	checkpoint_done();
 	if (avr)
 		avr_terminate(avr);
 	exit(0);
 }
 
+/*
+ * The instances of a board each run on a thread of their own, they
+ * land on the host cores wherever the scheduler puts them.
+ */
+static int
+run_board(
+		const char * file,
+		avr_cycle_count_t max_cycles,
+		uint64_t max_usec,
+		int log,
+		int fork_server)
+{
+	static avr_board_t board;
+
+	if (avr_board_load(&board, file)) {
+		fprintf(stderr, "Unable to load the board in %s\n", file);
+		return 1;
+	}
+	for (int i = 0; i < board.mcu_count; i++)
+		board.mcu[i].avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
+	// the threads of the instances are only started by the runs
+	if (fork_server && avr_fork_server(board.mcu[0].avr,
+			AVR_FORKSRV_FD, AVR_FORKSRV_FD + 1) == 0)
+		return 0;
+	uint64_t budget = max_usec * 1000;
+	if (max_cycles) {
+		uint64_t ns = max_cycles * 1000000000ull / board.mcu[0].avr->frequency;
+		if (!budget || ns < budget)
+			budget = ns;
+	}
+	int running;
+	if (budget)
+		running = avr_board_run(&board, budget);
+	else
+		while ((running = avr_board_run(&board, 1000000000ull)) > 0)
+			;
+	int ret = running ? 3 : 0;
+	for (int i = 0; i < board.mcu_count; i++) {
+		avr_t * a = board.mcu[i].avr;
+		printf("%s: %s at cycle %" PRI_avr_cycle_count "\n", board.mcu[i].name,
+				a->state == cpu_Done ? "done" :
+				a->state == cpu_Crashed ? "crashed" : "running", a->cycle);
+		if (a->state == cpu_Crashed)
+			ret = 2;
+	}
+	avr_board_free(&board);
+	return ret;
+}
+
 int
 main(
 		int argc,
 		char *argv[])
 {
-	elf_firmware_t f = {{0}};
 	uint32_t f_cpu = 0;
 	int trace = 0;
 	int gdb = 0;
+	int predecode = 0;
+	int threaded = 0;
+	int tiered = 0;
+	uint32_t tier_threshold = 0;
+	int virtual_time = 0;
+	int lazy_io = 0;
+	int functional = 0;
+	double pace = 0;
+	uint32_t deadline = 0;
+	int rt_cpu = -1, rt_priority = 0, realtime = 0;
+	uint32_t ring = 0;
+	int irq_storm = 0;
+	uint32_t profile_sample = 0;
+	int count_stats = 0;
+	double telemetry_period = 0;
+	avr_cycle_count_t sample_period = 0, sample_window = 0;
+	int warm_start = 0;
+	avr_cycle_count_t max_cycles = 0;
+	uint64_t max_usec = 0;
+	avr_cycle_count_t save_cycle = 0;
+	avr_cycle_count_t ck_every = 0, ck_next = 0;
+	const char * save_file = NULL;
+	const char * restore_file = NULL;
+	const char * diff_a = NULL, * diff_b = NULL;
+	const char * postmortem_to = NULL, * postmortem_file = NULL;
 	int log = 1;
 	char name[24] = "";
 	uint32_t loadBase = AVR_SEGMENT_OFFSET_FLASH;
 	int trace_vectors[8] = {0};
 	int trace_vectors_count = 0;
+	const char * trace_filter[16];
+	int trace_filter_include[16];
+	int trace_filter_count = 0;
+	int trace_isr = 0;
 	const char *vcd_input = NULL;
+	uint32_t vcd_input_repeat = 1;
+	const char *record_file = NULL;
+	const char *buslog_file = NULL;
+	const char *buslog_bus = NULL;
+	const char *replay_file = NULL;
+	int firmware_count = 0;
+	int vcd_thread = 0;
+	int log_thread = 0;
+	int vcd_window = 0;
+	const char * console_file = NULL;
+	const char * eeprom_file = NULL;
+	const char * board_file = NULL;
+	const char * shm_name = NULL;
+	int shm_eeprom = 0;
+	int fork_server = 0;
+	avr_cycle_count_t vcd_pre = 0, vcd_post = 0;
+	struct {
+		const char * name;
+		uint32_t usec;
+		int mode;
+	} vcd_sample[8];
+	int vcd_sample_count = 0;
 
 	if (argc == 1)
 		display_usage(basename(argv[0]));
+	checkpoint_exec(argc, argv);
 
 	for (int pi = 1; pi < argc; pi++) {
 		if (!strcmp(argv[pi], "--list-cores")) {
@@ -119,13 +777,294 @@ main(
 				vcd_input = argv[++pi];
 			else
 				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--input-repeat")) {
+			if (pi < argc-1)
+				vcd_input_repeat = strtoul(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--vcd-thread")) {
+			vcd_thread++;
+		} else if (!strcmp(argv[pi], "--aio")) {
+			avr_aio_enable(1);
+		} else if (!strcmp(argv[pi], "--huge-pages")) {
+			int mode = AVR_ARENA_THP;
+			if (pi < argc-1 && !strcmp(argv[pi + 1], "hugetlb")) {
+				mode = AVR_ARENA_HUGETLB;
+				pi++;
+			}
+			if (avr_arena_enable(mode))
+				fprintf(stderr, "%s: Warning: no huge pages here\n", argv[0]);
+		} else if (!strcmp(argv[pi], "--log-thread")) {
+			log_thread++;
+		} else if (!strcmp(argv[pi], "--lazy-io")) {
+			lazy_io++;
+		} else if (!strcmp(argv[pi], "--functional")) {
+			functional++;
+		} else if (!strcmp(argv[pi], "--fork-server")) {
+			fork_server++;
+		} else if (!strcmp(argv[pi], "--vcd-window")) {
+			if (pi < argc-2) {
+				vcd_pre = strtoull(argv[++pi], NULL, 0);
+				vcd_post = strtoull(argv[++pi], NULL, 0);
+				vcd_window++;
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--vcd-sample")) {
+			if (pi < argc-2 && vcd_sample_count < 8) {
+				vcd_sample[vcd_sample_count].name = argv[++pi];
+				vcd_sample[vcd_sample_count].usec = strtoul(argv[++pi], NULL, 0);
+				vcd_sample[vcd_sample_count].mode = AVR_VCD_SAMPLE_HOLD;
+				if (pi < argc-1 && !strcmp(argv[pi + 1], "minmax")) {
+					vcd_sample[vcd_sample_count].mode = AVR_VCD_SAMPLE_MINMAX;
+					pi++;
+				}
+				vcd_sample_count++;
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--record")) {
+			if (pi < argc-1)
+				record_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--bus-log")) {
+			if (pi < argc-1) {
+				buslog_file = argv[++pi];
+				if (pi < argc-1 && argv[pi + 1][0] != '-' &&
+						(!strncmp(argv[pi + 1], "uart", 4) ||
+						!strncmp(argv[pi + 1], "spi", 3) ||
+						!strncmp(argv[pi + 1], "twi", 3)))
+					buslog_bus = argv[++pi];
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--replay")) {
+			if (pi < argc-1)
+				replay_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--console")) {
+			if (pi < argc-1)
+				console_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--eeprom-file")) {
+			if (pi < argc-1)
+				eeprom_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--warm-start")) {
+			warm_start++;
+		} else if (!strcmp(argv[pi], "--cache")) {
+			if (pi < argc-1)
+				cache_dir = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-t") || !strcmp(argv[pi], "--trace")) {
 			trace++;
 		} else if (!strcmp(argv[pi], "-ti")) {
 			if (pi < argc-1)
 				trace_vectors[trace_vectors_count++] = atoi(argv[++pi]);
+		} else if (!strcmp(argv[pi], "--trace-only") ||
+				!strcmp(argv[pi], "--trace-skip")) {
+			if (pi < argc-1 && trace_filter_count < 16) {
+				trace_filter_include[trace_filter_count] =
+						!strcmp(argv[pi], "--trace-only");
+				trace_filter[trace_filter_count++] = argv[++pi];
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--trace-isr")) {
+			trace_isr++;
+		} else if (!strcmp(argv[pi], "--trace-ring")) {
+			if (pi < argc-1)
+				ring = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--irq-storm")) {
+			if (pi < argc-1) {
+				storm.run = strtoul(argv[++pi], NULL, 0);
+				irq_storm++;
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--trace-file")) {
+			if (pi < argc-1)
+				trace_file_name = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+			for (;;) {
+				if (pi < argc-1 && !strcmp(argv[pi + 1], "regs"))
+					trace_file_flags |= AVR_TRACE_FILE_REGS;
+				else if (pi < argc-1 && !strcmp(argv[pi + 1], "writes"))
+					trace_file_flags |= AVR_TRACE_FILE_WRITES;
+				else
+					break;
+				pi++;
+			}
+		} else if (!strcmp(argv[pi], "--trace-text")) {
+			if (pi < argc-1)
+				exit(avr_trace_file_text(argv[++pi], stdout) ? 1 : 0);
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--trace-diff")) {
+			if (pi < argc-2) {
+				int res = avr_trace_file_diff(argv[pi + 1], argv[pi + 2], stdout);
+				exit(res < 0 ? 2 : res);
+			}
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile")) {
+			if (pi < argc-1)
+				profile_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--callgraph")) {
+			if (pi < argc-1)
+				callgraph_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--heatmap")) {
+			if (pi < argc-1)
+				heatmap_bucket = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--lcov")) {
+			if (pi < argc-1)
+				lcov_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--cfg")) {
+			if (pi < argc-1)
+				cfg_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--stats")) {
+			count_stats++;
+			if (pi < argc-1 && !strcmp(argv[pi + 1], "json")) {
+				stats_json++;
+				pi++;
+			}
+		} else if (!strcmp(argv[pi], "--timer-profile")) {
+			timer_profile++;
+		} else if (!strcmp(argv[pi], "--irq-profile")) {
+			irq_profile++;
+		} else if (!strcmp(argv[pi], "--intrinsics")) {
+			use_intrinsics++;
+		} else if (!strcmp(argv[pi], "--intrinsics-signatures")) {
+			if (pi < argc-1) {
+				intrinsics_file = argv[++pi];
+				use_intrinsics++;
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--memory")) {
+			memory_report++;
+		} else if (!strcmp(argv[pi], "--telemetry")) {
+			if (pi < argc-1)
+				telemetry_period = atof(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--sample")) {
+			if (pi < argc-2) {
+				sample_period = strtoull(argv[++pi], NULL, 0);
+				sample_window = strtoull(argv[++pi], NULL, 0);
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--energy")) {
+			if (pi < argc-1)
+				energy_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--shm")) {
+			if (pi < argc-1)
+				shm_name = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+			if (pi < argc-1 && !strcmp(argv[pi + 1], "eeprom")) {
+				shm_eeprom++;
+				pi++;
+			}
+		} else if (!strcmp(argv[pi], "--save-at-cycle")) {
+			if (pi < argc-2) {
+				save_cycle = strtoull(argv[++pi], NULL, 0);
+				save_file = argv[++pi];
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--checkpoint")) {
+			if (pi < argc-1)
+				checkpoint_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--checkpoint-every")) {
+			if (pi < argc-2) {
+				ck_every = strtoull(argv[++pi], NULL, 0);
+				ck_store_file = argv[++pi];
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--snapshot-diff")) {
+			if (pi < argc-2) {
+				diff_a = argv[++pi];
+				diff_b = argv[++pi];
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--postmortem-to")) {
+			if (pi < argc-1)
+				postmortem_to = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--postmortem")) {
+			if (pi < argc-1)
+				postmortem_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--restore")) {
+			if (pi < argc-1)
+				restore_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--board")) {
+			if (pi < argc-1)
+				board_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--cycles")) {
+			if (pi < argc-1)
+				max_cycles = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--time-us")) {
+			if (pi < argc-1)
+				max_usec = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile-sample")) {
+			if (pi < argc-1)
+				profile_sample = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-g") || !strcmp(argv[pi], "--gdb")) {
 			gdb++;
+		} else if (!strcmp(argv[pi], "--predecode")) {
+			predecode++;
+		} else if (!strcmp(argv[pi], "--threaded")) {
+			threaded++;
+		} else if (!strcmp(argv[pi], "--tiered")) {
+			tiered++;
+			if (pi < argc-1 && isdigit((unsigned char)argv[pi + 1][0]))
+				tier_threshold = strtoul(argv[++pi], NULL, 0);
+		} else if (!strcmp(argv[pi], "--virtual-time")) {
+			virtual_time++;
+		} else if (!strcmp(argv[pi], "--pace")) {
+			if (pi < argc-1)
+				pace = atof(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--deadline")) {
+			if (pi < argc-1)
+				deadline = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--realtime")) {
+			if (pi < argc-2) {
+				rt_cpu = atoi(argv[++pi]);
+				rt_priority = atoi(argv[++pi]);
+				realtime++;
+			} else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-v")) {
 			log++;
 		} else if (!strcmp(argv[pi], "-ee")) {
@@ -135,7 +1074,11 @@ main(
 		} else if (argv[pi][0] != '-') {
 			char * filename = argv[pi];
 			char * suffix = strrchr(filename, '.');
-			if (suffix && !strcasecmp(suffix, ".hex")) {
+			cache_file = filename;
+			if (cache_dir && ++firmware_count == 1 &&
+					avr_fwcache_load(cache_dir, filename, &f) == 0) {
+				printf("Loaded %s from %s\n", filename, cache_dir);
+			} else if (suffix && !strcasecmp(suffix, ".hex")) {
 				if (!name[0] || !f_cpu) {
 					fprintf(stderr, "%s: -mcu and -freq are mandatory to load .hex files\n", argv[0]);
 					exit(1);
@@ -172,6 +1115,16 @@ main(
 		}
 	}
 
+	if (board_file)
+		return run_board(board_file, max_cycles, max_usec, log, fork_server);
+	// only a single file can be cached, the others are merged into it
+	if (firmware_count != 1)
+		cache_dir = NULL;
+	if (cache_dir) {
+		if (!f.cache)
+			avr_fwcache_store(cache_dir, cache_file, &f, NULL);
+		cache_f = f;
+	}
 	if (strlen(name))
 		strcpy(f.mmcu, name);
 	if (f_cpu)
@@ -182,41 +1135,277 @@ main(
 		fprintf(stderr, "%s: AVR '%s' not known\n", argv[0], f.mmcu);
 		exit(1);
 	}
+	avr->io_lazy.enabled = lazy_io;
+	avr->timing = functional ? AVR_TIMING_FUNCTIONAL : AVR_TIMING_EXACT;
 	avr_init(avr);
 	avr_load_firmware(avr, &f);
+	if (eeprom_file && avr_eeprom_map(avr, eeprom_file))
+		fprintf(stderr, "%s: Warning: can't keep the eeprom in %s\n",
+				argv[0], eeprom_file);
+	// the eeprom file mapping wins, it's the one that's kept
+	if (shm_name && avr_shm_init(avr, &shm, shm_name,
+			shm_eeprom && !eeprom_file, 1000))
+		fprintf(stderr, "%s: Warning: can't share the data space in %s\n",
+				argv[0], shm_name);
 	if (f.flashbase) {
 		printf("Attempted to load a bootloader at %04x\n", f.flashbase);
 		avr->pc = f.flashbase;
 	}
 	avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
 	avr->trace = trace;
+	for (int ti = 0; ti < trace_filter_count; ti++)
+		if (avr_trace_filter(avr, trace_filter[ti], trace_filter_include[ti]))
+			fprintf(stderr, "%s: Warning: can't filter the trace with %s\n",
+					argv[0], trace_filter[ti]);
+	if (trace_isr)
+		avr_trace_filter_isr(avr, 1);
+	if (log_thread && avr_logger_thread_start(avr, 0))
+		fprintf(stderr, "%s: Warning: can't log from a thread\n", argv[0]);
+	if (predecode && avr_predecode_init(avr))
+		fprintf(stderr, "%s: Warning: instruction predecoding not available\n", argv[0]);
+	if (cache_dir && (predecode || threaded) && !gdb)
+		cache_decoded = avr_fwcache_predecode(&cache_f, avr) != 0;
+	if (warm_start && !cache_dir)
+		fprintf(stderr, "%s: Warning: --warm-start needs --cache, and a "
+				"single firmware\n", argv[0]);
+	else if (warm_start && !gdb) {
+		int warm = avr_fwcache_warm_start(cache_dir, cache_file, &f, avr,
+				avr->frequency * 10ull);
+		if (warm >= 0)
+			printf("%s main() at cycle %" PRI_avr_cycle_count "\n",
+					warm ? "Warm start in" : "Ran to", avr->cycle);
+	}
 	for (int ti = 0; ti < trace_vectors_count; ti++) {
 		for (int vi = 0; vi < avr->interrupts.vector_count; vi++)
 			if (avr->interrupts.vector[vi]->vector == trace_vectors[ti])
 				avr->interrupts.vector[vi]->trace = 1;
 	}
+	if (console_file) {
+		int fd = strcmp(console_file, "-") ? open(console_file,
+				O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644) : 1;
+		if (fd < 0 || avr_console_open(avr, fd, 0))
+			fprintf(stderr, "%s: Warning: can't write the console to %s\n",
+					argv[0], console_file);
+	}
+	if (vcd_thread && avr->vcd && avr_vcd_set_writer_thread(avr->vcd, 0))
+		fprintf(stderr, "%s: Warning: can't write the VCD trace from a thread\n", argv[0]);
+	if (vcd_window && avr->vcd) {
+		if (avr_vcd_set_trigger(avr->vcd, vcd_pre, vcd_post, 0) ||
+				avr_vcd_trigger_on_irq(avr->vcd,
+					avr_io_getirq(avr, AVR_IOCTL_WATCHDOG_GETIRQ(),
+							WATCHDOG_IRQ_RESET), 1))
+			fprintf(stderr, "%s: Warning: can't set the VCD trigger\n", argv[0]);
+	}
+	for (int i = 0; i < vcd_sample_count; i++)
+		if (!avr->vcd || avr_vcd_set_sampling(avr->vcd, vcd_sample[i].name,
+				vcd_sample[i].usec, vcd_sample[i].mode) <= 0)
+			fprintf(stderr, "%s: Warning: can't sample the VCD trace '%s'\n",
+					argv[0], vcd_sample[i].name);
 	if (vcd_input) {
 		static avr_vcd_t input;
 		if (avr_vcd_init_input(avr, vcd_input, &input)) {
 			fprintf(stderr, "%s: Warning: VCD input file %s failed\n", argv[0], vcd_input);
-		}
+		} else
+			avr_vcd_input_repeat(&input, vcd_input_repeat);
 	}
 
-	// even if not setup at startup, activate gdb if crashing
-	avr->gdb_port = 1234;
+	if (replay_file) {
+		if (avr_replay_play(&replay, avr, replay_file))
+			fprintf(stderr, "%s: Warning: replay file %s failed\n", argv[0], replay_file);
+	} else if (record_file) {
+		if (avr_replay_record(&replay, avr, record_file) == 0)
+			avr_replay_record_inputs(&replay);
+		else
+			fprintf(stderr, "%s: Warning: can't record into %s\n", argv[0], record_file);
+	}
+	if (buslog_file) {
+		size_t len = strlen(buslog_file);
+		int binary = len > 4 && !strcmp(buslog_file + len - 4, ".bin");
+		if (avr_buslog_open(&buslog, avr, buslog_file, binary))
+			fprintf(stderr, "%s: Warning: can't log the buses into %s\n", argv[0], buslog_file);
+		else if (avr_buslog_add(&buslog, buslog_bus) <= 0)
+			fprintf(stderr, "%s: Warning: no bus %s to log\n", argv[0],
+					buslog_bus ? buslog_bus : "");
+	}
+
+	avr_cycle_count_t budget = max_cycles;
+	// not avr_usec_to_cycles(), that one is for 32 bits of usec
+	avr_cycle_count_t usec_cycles = max_usec * avr->frequency / 1000000;
+	if (max_usec && (!budget || usec_cycles < budget))
+		budget = usec_cycles;
+	// even if not setup at startup, activate gdb if crashing, but don't
+	// wait for it in a batch run
+	if (!budget || gdb)
+		avr->gdb_port = 1234;
 	if (gdb) {
 		avr->state = cpu_Stopped;
 		avr_gdb_init(avr);
+	} else {
+		if (threaded)
+			avr->run = avr_callback_run_threaded;
+		else if (tiered && avr_tier_init(avr, &tier, tier_threshold, 0))
+			fprintf(stderr, "%s: Warning: can't tier the engines\n", argv[0]);
+		if (virtual_time)
+			avr->sleep = avr_callback_sleep_virtual;
+	}
+	if (pace > 0 && avr_pacing_init(avr, &pacing, pace, 1000) == 0 && deadline)
+		avr_pacing_deadline(&pacing, deadline, NULL, NULL);
+	if (realtime)
+		avr_pacing_realtime(avr, rt_cpu, rt_priority);
+	if (ring)
+		avr_trace_ring_init(avr, &trace_ring, ring);
+	if (irq_storm)
+		avr_interrupt_storm_set(avr, &storm);
+	if (profile_file && avr_profile_init(avr, &profile, profile_sample))
+		profile_file = NULL;
+	if (callgraph_file && avr_callgraph_init(avr, &callgraph))
+		callgraph_file = NULL;
+	if (heatmap_bucket)
+		avr_heatmap_init(avr, &heatmap, heatmap_bucket);
+	if (lcov_file && avr_lcov_init(avr, &lcov))
+		lcov_file = NULL;
+	if (cfg_file) {
+		avr_cfg_t * cfg = avr_cfg_get(avr);
+		if (!cfg || avr_cfg_write(cfg, cfg_file))
+			fprintf(stderr, "%s: Warning: can't write the control flow "
+					"graph in %s\n", argv[0], cfg_file);
+	}
+	if (count_stats)
+		avr_stats_init(avr, &stats);
+	if (timer_profile)
+		avr_timer_prof_init(avr, &timer_prof);
+	if (irq_profile)
+		avr_irq_prof_init(&avr->irq_pool, &irq_prof);
+	if (use_intrinsics) {
+		// not there yet is fine, it's made on exit
+		if (intrinsics_file)
+			avr_intrinsics_load(&intrinsics, intrinsics_file);
+		avr_intrinsics_init(avr, &intrinsics, &f);
 	}
+	if (energy_file && avr_energy_init(avr, &energy, 0) == 0 &&
+			avr_energy_load(&energy, energy_file))
+		fprintf(stderr, "%s: Warning: the currents in %s weren't all read\n",
+				argv[0], energy_file);
+	// last, what's attached by now is what the windows have
+	if (sample_period)
+		avr_sampling_init(avr, &sampling, sample_period, sample_window);
+
+	avr_irq_pool_freeze(&avr->irq_pool);
 
 	signal(SIGINT, sig_int);
 	signal(SIGTERM, sig_int);
 
+	if (diff_a)
+		exit(checkpoint_diff(diff_a, diff_b));
+	if (postmortem_file) {
+		if (postmortem_load(postmortem_file, gdb))
+			exit(1);
+		if (!gdb)
+			exit(0);
+	}
+	if (postmortem_to && avr_postmortem_init(avr, &postmortem, postmortem_to,
+			AVR_POSTMORTEM_ALL, 1))
+		exit(1);
+	if (restore_file) {
+		avr_snapshot_t * s = checkpoint_load(restore_file);
+		if (!s || avr_snapshot_restore(avr, s)) {
+			fprintf(stderr, "%s: Unable to restore the checkpoint in %s\n",
+					argv[0], restore_file);
+			exit(1);
+		}
+		avr_snapshot_free(s);
+		avr_snapshot_untrack(avr);
+		// it's gdb that starts it
+		if (gdb)
+			avr->state = cpu_Stopped;
+		printf("Restored cycle %" PRI_avr_cycle_count " from %s\n",
+				avr->cycle, restore_file);
+		if (stats.avr)
+			avr_stats_reset(&stats);
+	}
+	// after the restore, its first sync record is the restored state
+	if (trace_file_name &&
+			avr_trace_file_start(avr, &trace_file, trace_file_name, trace_file_flags))
+		fprintf(stderr, "%s: Warning: can't write the trace in %s\n",
+				argv[0], trace_file_name);
+	if (ck_every && !(ck_store = avr_ckstore_new(0, -1))) {
+		fprintf(stderr, "%s: Unable to make a checkpoint store\n", argv[0]);
+		exit(1);
+	}
+	ck_next = avr->cycle;
+	if (save_file && !checkpoint_file)
+		checkpoint_file = save_file;
+	if (checkpoint_file)
+		avr_regions_on_checkpoint(avr, checkpoint_request, NULL);
+#ifdef SIGUSR1
+	if (checkpoint_file)
+		signal(SIGUSR1, sig_usr1);
+#endif
+
+	// the threads wouldn't be in the runs
+	if (fork_server && (gdb || vcd_thread || log_thread || trace_file_name))
+		fprintf(stderr, "%s: Warning: --fork-server can't be used with "
+				"--gdb, --vcd-thread, --log-thread or --trace-file\n", argv[0]);
+	else if (fork_server && avr_fork_server(avr,
+			AVR_FORKSRV_FD, AVR_FORKSRV_FD + 1) == 0)
+		return 0;
+
+	host_start = host_now();
+	// the figures span the last ten periods
+	double telemetry_next = host_start + telemetry_period;
+	if (telemetry_period > 0)
+		avr_telemetry_init(avr, &telemetry, 10);
+	/*
+	 * The budget ends at an absolute cycle, and the runs end on multiples
+	 * of 10000 cycles: a run restored from a checkpoint is cut in the same
+	 * pieces as the one that saved it, and stops at the same cycle
+	 */
+	avr_cycle_count_t end = budget;
+	int state, ret = 3;
 	for (;;) {
-		int state = avr_run(avr);
-		if (state == cpu_Done || state == cpu_Crashed)
+		avr_cycle_count_t run = 10000 - avr->cycle % 10000;
+		// saved before the budget is checked, it can end on the same cycle
+		if (save_file) {
+			if (avr->cycle >= save_cycle) {
+				checkpoint_save(save_file);
+				save_file = NULL;
+			} else if (save_cycle - avr->cycle < run)
+				run = save_cycle - avr->cycle;
+		}
+		if (ck_store) {
+			if (avr->cycle >= ck_next) {
+				checkpoint_keep();
+				ck_next = avr->cycle + ck_every;
+			}
+			if (ck_next - avr->cycle < run)
+				run = ck_next - avr->cycle;
+		}
+		if (budget) {
+			if (avr->cycle >= end)
+				break;
+			if (end - avr->cycle < run)
+				run = end - avr->cycle;
+		}
+		if (checkpoint_wanted) {
+			checkpoint_wanted = 0;
+			checkpoint_save(checkpoint_file);
+		}
+		if (telemetry_period > 0 && host_now() >= telemetry_next) {
+			telemetry_next += telemetry_period;
+			if (avr_telemetry_sample(&telemetry) == 0)
+				avr_telemetry_print(&telemetry, stderr);
+		}
+		state = avr_run_cycles(avr, run);
+		if (state == cpu_Done || state == cpu_Crashed) {
+			ret = state == cpu_Done ? 0 : 2;
 			break;
+		}
 	}
 
+	if (pacing.avr)
+		avr_pacing_report(&pacing, stdout);
+	profile_done();
+	checkpoint_done();
 	avr_terminate(avr);
+	return ret;
 }
@@ -0,0 +1,463 @@
+/*
+	sim_aio.c
+
+	Output files written through one io_uring, shared by all of them.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		// for fopencookie()
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define AVR_AIO_URING
+#endif
+#endif
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef AVR_AIO_URING
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#include "sim_aio.h"
+#include "sim_avr.h"
+
+static pthread_mutex_t _avr_aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static avr_aio_stats_t _avr_aio_stats;
+
+#ifdef AVR_AIO_URING
+
+/*
+ * There's no liburing needed, the ring is set up with the system calls
+ * themselves, and its queues are read and written as <linux/io_uring.h>
+ * lays them out.
+ */
+typedef struct _avr_aio_file_t {
+	int			fd;
+	off_t		offset;		// where the next buffer queued goes
+	int			cur;		// the buffer being filled, or -1
+	uint32_t	len;		// in it
+	int			inflight;	// writes queued, not completed
+	int			error;
+} _avr_aio_file_t;
+
+typedef struct _avr_aio_ring_t {
+	int			fd;
+	int			fixed;		// the buffers are registered
+	unsigned *	sq_head, * sq_tail, * sq_mask, * sq_array;
+	unsigned *	cq_head, * cq_tail, * cq_mask;
+	struct io_uring_sqe * sqe;
+	struct io_uring_cqe * cqe;
+	uint8_t *	buf;		// AVR_AIO_BUFFERS of them, in a row
+	int			free[AVR_AIO_BUFFERS];
+	int			free_count;
+	_avr_aio_file_t * owner[AVR_AIO_BUFFERS];	// of the queued ones
+	_avr_aio_file_t * filler[AVR_AIO_BUFFERS];	// of the ones being filled
+	uint32_t	len[AVR_AIO_BUFFERS];
+	unsigned	queued;		// in the SQ, not submitted yet
+	unsigned	inflight;
+} _avr_aio_ring_t;
+
+static _avr_aio_ring_t _avr_aio;
+static int _avr_aio_state;	// 0 not set up yet, 1 running, -1 can't be
+static int _avr_aio_on;
+
+#define AVR_AIO_BUF(_r, _b) ((_r)->buf + (size_t)(_b) * AVR_AIO_BUFFER_SIZE)
+
+static int
+_avr_aio_setup(void)
+{
+	_avr_aio_ring_t * r = &_avr_aio;
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, AVR_AIO_BUFFERS, &p);
+	if (r->fd < 0)
+		return -1;
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	int single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	uint8_t * sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	uint8_t * cq = single || sq == MAP_FAILED ? sq :
+			mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	void * sqe = mmap(NULL, sqe_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqe == MAP_FAILED ||
+			posix_memalign((void **)&r->buf, 4096,
+					(size_t)AVR_AIO_BUFFERS * AVR_AIO_BUFFER_SIZE)) {
+		if (sqe != MAP_FAILED)
+			munmap(sqe, sqe_size);
+		if (cq != MAP_FAILED && cq != sq)
+			munmap(cq, cq_size);
+		if (sq != MAP_FAILED)
+			munmap(sq, sq_size);
+		close(r->fd);
+		return -1;
+	}
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqe = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sqe = sqe;
+
+	struct iovec iov[AVR_AIO_BUFFERS];
+	for (int i = 0; i < AVR_AIO_BUFFERS; i++) {
+		iov[i].iov_base = AVR_AIO_BUF(r, i);
+		iov[i].iov_len = AVR_AIO_BUFFER_SIZE;
+		r->free[i] = AVR_AIO_BUFFERS - 1 - i;
+	}
+	r->free_count = AVR_AIO_BUFFERS;
+	// older kernels count them in RLIMIT_MEMLOCK, it's plain writes then
+	r->fixed = syscall(__NR_io_uring_register, r->fd,
+			IORING_REGISTER_BUFFERS, iov, AVR_AIO_BUFFERS) == 0;
+	return 0;
+}
+
+static void
+_avr_aio_reap(
+		_avr_aio_ring_t * r)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe * c = r->cqe + (head & *r->cq_mask);
+		int b = c->user_data;
+		_avr_aio_file_t * f = r->owner[b];
+		// a short write to a file is a full disk, as good as an error
+		if (c->res != (int)r->len[b])
+			f->error = 1;
+		f->inflight--;
+		r->inflight--;
+		r->owner[b] = NULL;
+		r->free[r->free_count++] = b;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// submits what's queued, and waits for a completion if 'wait'
+static int
+_avr_aio_submit(
+		_avr_aio_ring_t * r,
+		int wait)
+{
+	_avr_aio_stats.submits++;
+	if (wait)
+		_avr_aio_stats.waits++;
+	for (;;) {
+		int res = syscall(__NR_io_uring_enter, r->fd, r->queued, wait ? 1 : 0,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (res >= 0) {
+			r->queued -= res;
+			break;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -1;
+		// a full completion queue, room is made and it's tried again
+		_avr_aio_reap(r);
+	}
+	_avr_aio_reap(r);
+	return 0;
+}
+
+// queues the buffer 'f' is filling, at its offset in the file
+static void
+_avr_aio_queue(
+		_avr_aio_ring_t * r,
+		_avr_aio_file_t * f)
+{
+	int b = f->cur;
+	unsigned tail = *r->sq_tail;
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe * s = r->sqe + i;
+
+	memset(s, 0, sizeof(*s));
+	s->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	s->fd = f->fd;
+	s->off = f->offset;
+	s->addr = (uintptr_t)AVR_AIO_BUF(r, b);
+	s->len = f->len;
+	s->buf_index = b;
+	s->user_data = b;
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	r->owner[b] = f;
+	r->filler[b] = NULL;
+	r->len[b] = f->len;
+	_avr_aio_stats.writes++;
+	_avr_aio_stats.bytes += f->len;
+	f->offset += f->len;
+	f->inflight++;
+	f->cur = -1;
+	f->len = 0;
+	r->inflight++;
+	if (++r->queued >= AVR_AIO_BATCH)
+		_avr_aio_submit(r, 0);
+}
+
+/*
+ * A free buffer for 'f', waiting for one if needs be. With more files than
+ * buffers, they can all be partly filled, with nothing to wait for; a
+ * batch of the fullest are written then, as if they were full. -1 if
+ * there's none at all
+ */
+static int
+_avr_aio_buffer(
+		_avr_aio_ring_t * r,
+		_avr_aio_file_t * f)
+{
+	if (_avr_aio_state < 0)
+		return -1;
+	while (!r->free_count) {
+		for (int n = 0; !r->inflight || (n && n < AVR_AIO_BATCH); n++) {
+			int full = -1;
+			for (int b = 0; b < AVR_AIO_BUFFERS; b++)
+				if (r->filler[b] && r->filler[b]->len &&
+						(full < 0 || r->filler[b]->len > r->filler[full]->len))
+					full = b;
+			if (full < 0) {
+				if (!r->inflight)
+					return -1;
+				break;
+			}
+			_avr_aio_queue(r, r->filler[full]);
+		}
+		if (_avr_aio_submit(r, 1))
+			return -1;
+	}
+	int b = r->free[--r->free_count];
+	r->filler[b] = f;
+	return b;
+}
+
+static int
+_avr_aio_pwrite(
+		_avr_aio_file_t * f,
+		const uint8_t * buf,
+		size_t size)
+{
+	while (size) {
+		ssize_t w = pwrite(f->fd, buf, size, f->offset);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR)
+				continue;
+			f->error = 1;
+			return -1;
+		}
+		_avr_aio_stats.sync_writes++;
+		f->offset += w;
+		buf += w;
+		size -= w;
+	}
+	return 0;
+}
+
+static ssize_t
+_avr_aio_write(
+		void * cookie,
+		const char * buf,
+		size_t size)
+{
+	_avr_aio_file_t * f = cookie;
+	_avr_aio_ring_t * r = &_avr_aio;
+	size_t done = 0;
+
+	pthread_mutex_lock(&_avr_aio_lock);
+	while (done < size && !f->error) {
+		/*
+		 * With every buffer being filled, by as many files, this one
+		 * writes its own, nothing of it is waiting in a buffer
+		 */
+		if (f->cur < 0 && (f->cur = _avr_aio_buffer(r, f)) < 0) {
+			if (_avr_aio_pwrite(f, (const uint8_t *)buf + done, size - done) == 0)
+				done = size;
+			break;
+		}
+		size_t l = AVR_AIO_BUFFER_SIZE - f->len;
+		if (l > size - done)
+			l = size - done;
+		memcpy(AVR_AIO_BUF(r, f->cur) + f->len, buf + done, l);
+		f->len += l;
+		done += l;
+		if (f->len == AVR_AIO_BUFFER_SIZE)
+			_avr_aio_queue(r, f);
+	}
+	if (f->error)
+		done = 0;	// fopencookie() wants 0 for an error
+	pthread_mutex_unlock(&_avr_aio_lock);
+	return done;
+}
+
+static int
+_avr_aio_close(
+		void * cookie)
+{
+	_avr_aio_file_t * f = cookie;
+	_avr_aio_ring_t * r = &_avr_aio;
+
+	pthread_mutex_lock(&_avr_aio_lock);
+	if (f->cur >= 0) {
+		if (f->len && !f->error && _avr_aio_state > 0)
+			_avr_aio_queue(r, f);
+		else {
+			// in a forked child, the ring is the parent's
+			if (f->len && !f->error)
+				_avr_aio_pwrite(f, AVR_AIO_BUF(r, f->cur), f->len);
+			r->filler[f->cur] = NULL;
+			r->free[r->free_count++] = f->cur;
+			f->cur = -1;
+		}
+	}
+	while (f->inflight && _avr_aio_state > 0)
+		if (_avr_aio_submit(r, 1)) {
+			f->error = 1;
+			break;
+		}
+	int res = f->error || f->inflight ? -1 : 0;
+	// the ring still points at it, if the submit failed
+	int keep = f->inflight && _avr_aio_state > 0;
+	pthread_mutex_unlock(&_avr_aio_lock);
+	if (close(f->fd))
+		res = -1;
+	if (!keep)
+		free(f);
+	return res;
+}
+
+static void
+_avr_aio_prepare(void)
+{
+	pthread_mutex_lock(&_avr_aio_lock);
+}
+
+static void
+_avr_aio_parent(void)
+{
+	pthread_mutex_unlock(&_avr_aio_lock);
+}
+
+// what the child has opened it writes with pwrite()
+static void
+_avr_aio_child(void)
+{
+	if (_avr_aio_state > 0)
+		_avr_aio_state = -1;
+	pthread_mutex_unlock(&_avr_aio_lock);
+}
+
+int
+avr_aio_enable(
+		int on)
+{
+	pthread_mutex_lock(&_avr_aio_lock);
+	if (on && !_avr_aio_state) {
+		_avr_aio_state = _avr_aio_setup() ? -1 : 1;
+		if (_avr_aio_state > 0)
+			pthread_atfork(_avr_aio_prepare, _avr_aio_parent, _avr_aio_child);
+	}
+	_avr_aio_on = on;
+	int res = on && _avr_aio_state < 0 ? -1 : 0;
+	pthread_mutex_unlock(&_avr_aio_lock);
+	if (res)
+		AVR_LOG(NULL, LOG_WARNING,
+				"AIO: no io_uring here, the files are plain ones\n");
+	return res;
+}
+
+FILE *
+avr_aio_fopen(
+		const char * path,
+		const char * mode)
+{
+	pthread_mutex_lock(&_avr_aio_lock);
+	int on = _avr_aio_on && _avr_aio_state > 0;
+	pthread_mutex_unlock(&_avr_aio_lock);
+	if (!on)
+		return fopen(path, mode);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return NULL;
+	_avr_aio_file_t * f = calloc(1, sizeof(*f));
+	if (!f) {
+		close(fd);
+		return NULL;
+	}
+	f->fd = fd;
+	f->cur = -1;
+	cookie_io_functions_t io = {
+		.write = _avr_aio_write,
+		.close = _avr_aio_close,
+	};
+	FILE * file = fopencookie(f, "w", io);
+	if (!file) {
+		close(fd);
+		free(f);
+		return NULL;
+	}
+	// the ring's buffers are the only ones, no need to copy twice
+	setvbuf(file, NULL, _IONBF, 0);
+	return file;
+}
+
+#else
+
+int
+avr_aio_enable(
+		int on)
+{
+	if (!on)
+		return 0;
+	AVR_LOG(NULL, LOG_WARNING,
+			"AIO: no io_uring here, the files are plain ones\n");
+	return -1;
+}
+
+FILE *
+avr_aio_fopen(
+		const char * path,
+		const char * mode)
+{
+	return fopen(path, mode);
+}
+
+#endif
+
+void
+avr_aio_stats(
+		avr_aio_stats_t * stats)
+{
+	pthread_mutex_lock(&_avr_aio_lock);
+	*stats = _avr_aio_stats;
+	pthread_mutex_unlock(&_avr_aio_lock);
+}
@@ -0,0 +1,84 @@
+/*
+	sim_aio.h
+
+	Output files written through one io_uring, shared by all of them.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_AIO_H__
+#define __SIM_AIO_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The VCD writer, the trace file writer and the checkpoint store open
+ * their files with avr_aio_fopen(). Unless avr_aio_enable() was called,
+ * that's a plain fopen(); with it, the FILE given back copies what's
+ * written into buffers registered with the kernel, and the full ones are
+ * queued as writes at their offset in the file, submitted a batch at a
+ * time, without waiting for them. All the files of the process share the
+ * one ring and its buffers, so a hundred instances writing their traces
+ * make a few io_uring_enter() calls instead of a write() each; only
+ * running out of buffers, and fclose(), wait for the writes to complete.
+ *
+ * The files can only be written in order, no fseek(), and fflush() doesn't
+ * push a partly filled buffer out, only fclose() does. If the ring can't
+ * be set up (not Linux, too old a kernel, a seccomp filter), the files
+ * are plain ones. A failed write is returned by the next fwrite(), or
+ * fclose().
+ */
+#define AVR_AIO_BUFFERS		64
+#define AVR_AIO_BUFFER_SIZE	(128 * 1024)
+#define AVR_AIO_BATCH		8		// full buffers queued before a submit
+
+typedef struct avr_aio_stats_t {
+	uint64_t	writes;		// queued in the ring
+	uint64_t	bytes;
+	uint64_t	submits;	// io_uring_enter() calls
+	uint64_t	waits;		// of these, the ones waiting for a buffer
+	uint64_t	sync_writes;	// pwrite(), with all the buffers taken
+} avr_aio_stats_t;
+
+/*
+ * Turns the ring on, or off, for the files opened from now on. Returns 0,
+ * or -1 if it can't be set up here; the files are then plain ones
+ */
+int
+avr_aio_enable(
+		int on );
+/*
+ * Opens 'path' for writing, truncated, through the ring if it's on; 'mode'
+ * is for fopen() otherwise, "w" or "wb"
+ */
+FILE *
+avr_aio_fopen(
+		const char * path,
+		const char * mode );
+void
+avr_aio_stats(
+		avr_aio_stats_t * stats );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_AIO_H__ */
@@ -0,0 +1,260 @@
+/*
+	sim_arena.c
+
+	Per instance allocations, carved out of huge pages shared by all the
+	instances of the process.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		// MAP_HUGETLB, MADV_HUGEPAGE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include "sim_arena.h"
+
+#define ARENA_LINE	64		// the chunk header, and the alignment
+#define ARENA_COLORS	32		// start offsets of the arenas, in lines
+
+typedef struct _avr_arena_chunk_t {
+	struct _avr_arena_chunk_t * next;
+	uint32_t	used;		// from the start of the chunk
+} _avr_arena_chunk_t;
+
+struct avr_arena_t {
+	_avr_arena_chunk_t * chunk;	// newest first, the arena is in the last one
+	uint64_t	bytes;
+};
+
+static pthread_mutex_t _avr_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _avr_arena_mode;
+static int _avr_arena_no_hugetlb;	// none reserved, the mmap() failed
+static uint32_t _avr_arena_color;
+static _avr_arena_chunk_t * _avr_arena_free_chunks;
+static avr_arena_stats_t _avr_arena_stats;
+
+#ifdef __linux__
+// a 2MB region, aligned on 2MB so it can be a huge page, or NULL
+static uint8_t *
+_avr_arena_region(void)
+{
+	if (_avr_arena_mode == AVR_ARENA_HUGETLB && !_avr_arena_no_hugetlb) {
+		void * p = mmap(NULL, AVR_ARENA_REGION, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			_avr_arena_stats.hugetlb++;
+			return p;
+		}
+		_avr_arena_no_hugetlb = 1;
+	}
+	// twice the size, and the ends trimmed, for the alignment
+	uint8_t * p = mmap(NULL, 2 * AVR_ARENA_REGION, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	uint8_t * start = (uint8_t *)(((uintptr_t)p + AVR_ARENA_REGION - 1) &
+			~(uintptr_t)(AVR_ARENA_REGION - 1));
+	if (start > p)
+		munmap(p, start - p);
+	munmap(start + AVR_ARENA_REGION, p + 2 * AVR_ARENA_REGION -
+			(start + AVR_ARENA_REGION));
+#ifdef MADV_HUGEPAGE
+	madvise(start, AVR_ARENA_REGION, MADV_HUGEPAGE);
+#endif
+	return start;
+}
+
+static void
+_avr_arena_prepare(void)
+{
+	pthread_mutex_lock(&_avr_arena_lock);
+}
+
+static void
+_avr_arena_parent(void)
+{
+	pthread_mutex_unlock(&_avr_arena_lock);
+}
+#else
+static uint8_t *
+_avr_arena_region(void)
+{
+	return NULL;
+}
+#endif
+
+// called locked
+static _avr_arena_chunk_t *
+_avr_arena_chunk(void)
+{
+	if (!_avr_arena_free_chunks) {
+		uint8_t * r = _avr_arena_region();
+		if (!r)
+			return NULL;
+		_avr_arena_stats.regions++;
+		for (int i = AVR_ARENA_REGION / AVR_ARENA_CHUNK; i-- > 0; ) {
+			_avr_arena_chunk_t * c = (_avr_arena_chunk_t *)(r + i * AVR_ARENA_CHUNK);
+			c->next = _avr_arena_free_chunks;
+			_avr_arena_free_chunks = c;
+			_avr_arena_stats.chunks_free++;
+		}
+	}
+	_avr_arena_chunk_t * c = _avr_arena_free_chunks;
+	_avr_arena_free_chunks = c->next;
+	_avr_arena_stats.chunks_free--;
+	_avr_arena_stats.chunks++;
+	c->next = NULL;
+	c->used = ARENA_LINE;
+	return c;
+}
+
+int
+avr_arena_enable(
+		int mode)
+{
+#ifdef __linux__
+	static int atfork;
+	pthread_mutex_lock(&_avr_arena_lock);
+	_avr_arena_mode = mode;
+	// a fork server's children make their instances from the same pages
+	if (mode && !atfork) {
+		atfork = 1;
+		pthread_atfork(_avr_arena_prepare, _avr_arena_parent, _avr_arena_parent);
+	}
+	pthread_mutex_unlock(&_avr_arena_lock);
+	return 0;
+#else
+	return mode ? -1 : 0;
+#endif
+}
+
+avr_arena_t *
+avr_arena_new(void)
+{
+	if (!_avr_arena_mode)
+		return NULL;
+	pthread_mutex_lock(&_avr_arena_lock);
+	_avr_arena_chunk_t * c = _avr_arena_chunk();
+	uint32_t color = _avr_arena_color++ % ARENA_COLORS;
+	pthread_mutex_unlock(&_avr_arena_lock);
+	if (!c)
+		return NULL;
+	/*
+	 * The chunks are 64KB apart, so the data of each instance would be on
+	 * the same cache sets as that of all the others; each arena starts a
+	 * few lines further than the last one made
+	 */
+	c->used += color * 2 * ARENA_LINE;
+	avr_arena_t * a = (avr_arena_t *)((uint8_t *)c + c->used);
+	c->used += (sizeof(*a) + ARENA_LINE - 1) & ~(ARENA_LINE - 1);
+	a->chunk = c;
+	a->bytes = 0;
+	return a;
+}
+
+void *
+avr_arena_alloc(
+		avr_arena_t * a,
+		size_t size)
+{
+	if (!a || !size || size > AVR_ARENA_CHUNK - ARENA_LINE)
+		return NULL;
+	size = (size + ARENA_LINE - 1) & ~(size_t)(ARENA_LINE - 1);
+	_avr_arena_chunk_t * c = a->chunk;
+	if (c->used + size > AVR_ARENA_CHUNK) {
+		pthread_mutex_lock(&_avr_arena_lock);
+		c = _avr_arena_chunk();
+		pthread_mutex_unlock(&_avr_arena_lock);
+		if (!c)
+			return NULL;
+		c->next = a->chunk;
+		a->chunk = c;
+	}
+	void * res = (uint8_t *)c + c->used;
+	c->used += size;
+	a->bytes += size;
+	__atomic_add_fetch(&_avr_arena_stats.bytes, size, __ATOMIC_RELAXED);
+	// the chunks are reused, they're not zero any more
+	memset(res, 0, size);
+	return res;
+}
+
+void *
+avr_arena_calloc(
+		avr_arena_t * a,
+		size_t size)
+{
+	void * res = avr_arena_alloc(a, size);
+	return res ? res : calloc(1, size);
+}
+
+int
+avr_arena_owns(
+		avr_arena_t * a,
+		const void * p)
+{
+	if (!a)
+		return 0;
+	for (_avr_arena_chunk_t * c = a->chunk; c; c = c->next)
+		if ((const uint8_t *)p >= (uint8_t *)c &&
+				(const uint8_t *)p < (uint8_t *)c + AVR_ARENA_CHUNK)
+			return 1;
+	return 0;
+}
+
+void
+avr_arena_free(
+		avr_arena_t * a,
+		void * p)
+{
+	if (p && !avr_arena_owns(a, p))
+		free(p);
+}
+
+void
+avr_arena_release(
+		avr_arena_t * a)
+{
+	if (!a)
+		return;
+	__atomic_sub_fetch(&_avr_arena_stats.bytes, a->bytes, __ATOMIC_RELAXED);
+	_avr_arena_chunk_t * c = a->chunk;
+	// 'a' is in the last one, it's gone once that's on the free list
+	pthread_mutex_lock(&_avr_arena_lock);
+	while (c) {
+		_avr_arena_chunk_t * next = c->next;
+		c->next = _avr_arena_free_chunks;
+		_avr_arena_free_chunks = c;
+		_avr_arena_stats.chunks--;
+		_avr_arena_stats.chunks_free++;
+		c = next;
+	}
+	pthread_mutex_unlock(&_avr_arena_lock);
+}
+
+void
+avr_arena_stats(
+		avr_arena_stats_t * stats)
+{
+	pthread_mutex_lock(&_avr_arena_lock);
+	*stats = _avr_arena_stats;
+	pthread_mutex_unlock(&_avr_arena_lock);
+}
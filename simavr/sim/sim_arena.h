@@ -0,0 +1,121 @@
+/*
+	sim_arena.h
+
+	Per instance allocations, carved out of huge pages shared by all the
+	instances of the process.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_ARENA_H__
+#define __SIM_ARENA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * With avr_arena_enable(), each instance avr_init() makes gets an arena,
+ * and the tables the core goes through on every instruction come out of
+ * it, next to each other: the data space, the io tables and their hook
+ * bits, the map of the 32 bits opcodes, and the chunks of the irq pool,
+ * that hold the irqs, their names and hooks. avr_terminate() hands the
+ * arena back in one go, there's no free() of each.
+ *
+ * The arenas are made of AVR_ARENA_CHUNK chunks, taken from 2MB regions,
+ * either explicit huge pages (MAP_HUGETLB, when some are reserved) or
+ * transparent ones (MADV_HUGEPAGE); so a farm of a thousand instances
+ * goes through a few dozen TLB entries, not a few thousand, and an
+ * instance's chunks go back to the process, for the next one, when it's
+ * terminated. The regions are only unmapped when the process exits.
+ *
+ * The flash isn't in the arena: it outlives its instance when it's
+ * shared, see avr_flash_share(). Neither are the tables that grow as
+ * the simulation goes, the cycle timers, the interrupt vectors, the
+ * frozen irq hooks, nor what the io modules allocate, VCD buffers too.
+ * Anything bigger than a chunk comes from malloc() too.
+ */
+#define AVR_ARENA_REGION	(2 * 1024 * 1024)
+#define AVR_ARENA_CHUNK		(64 * 1024)
+
+enum {
+	AVR_ARENA_OFF = 0,
+	AVR_ARENA_THP,			// transparent huge pages, madvise()d
+	AVR_ARENA_HUGETLB,		// explicit ones, or transparent if there's none
+};
+
+typedef struct avr_arena_t avr_arena_t;
+
+typedef struct avr_arena_stats_t {
+	uint32_t	regions;
+	uint32_t	hugetlb;		// of these, explicit huge pages
+	uint32_t	chunks;			// in the arenas
+	uint32_t	chunks_free;
+	uint64_t	bytes;			// given out, still in use
+} avr_arena_stats_t;
+
+/*
+ * Sets the mode for the instances initialized from now on. Returns 0, or
+ * -1 if huge pages aren't to be had here (not Linux); the instances then
+ * have no arena
+ */
+int
+avr_arena_enable(
+		int mode );
+// a new, empty arena, or NULL if they're off
+avr_arena_t *
+avr_arena_new(void);
+/*
+ * 'size' zeroed bytes, aligned on a cache line, or NULL if 'a' is NULL,
+ * or it's too big for a chunk, or out of memory
+ */
+void *
+avr_arena_alloc(
+		avr_arena_t * a,
+		size_t size );
+/*
+ * Same, falling back on calloc() if it can't; give it back with
+ * avr_arena_free()
+ */
+void *
+avr_arena_calloc(
+		avr_arena_t * a,
+		size_t size );
+// free()s 'p' unless it's in the arena, it goes with the arena then
+void
+avr_arena_free(
+		avr_arena_t * a,
+		void * p );
+int
+avr_arena_owns(
+		avr_arena_t * a,
+		const void * p );
+// gives all the chunks of 'a', and 'a', back
+void
+avr_arena_release(
+		avr_arena_t * a );
+void
+avr_arena_stats(
+		avr_arena_stats_t * stats );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_ARENA_H__ */
@@ -24,12 +24,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
 #include "avr_uart.h"
 #include "sim_vcd_file.h"
+#include "sim_trace_ring.h"
+#include "sim_trace_file.h"
+#include "sim_profile.h"
+#include "sim_callgraph.h"
+#include "sim_coverage.h"
+#include "sim_lcov.h"
+#include "sim_tier.h"
+#include "sim_heatmap.h"
+#include "sim_logger.h"
+#include "sim_regions.h"
+#include "sim_stats.h"
+#include "sim_stimulus.h"
+#include "sim_shm.h"
+#include "sim_sampling.h"
+#include "sim_energy.h"
+#include "sim_cfg.h"
+#include "sim_guard.h"
+#include "sim_arena.h"
+#include "sim_inject.h"
+#include "sim_snapshot.h"
+#include "sim_postmortem.h"
 #include "avr/avr_mcu_section.h"
 
 #define AVR_KIND_DECL
@@ -52,7 +74,9 @@ avr_global_logger(
 {
 	va_list args;
 	va_start(args, format);
-	if (_avr_global_logger)
+	if (avr && avr->logger)
+		avr->logger(avr, level, format, args);
+	else if (_avr_global_logger)
 		_avr_global_logger(avr, level, format, args);
 	va_end(args);
 }
@@ -70,16 +94,124 @@ avr_global_logger_get(void)
 	return _avr_global_logger;
 }
 
+void
+avr_logger_set(
+		avr_t * avr,
+		avr_logger_p logger)
+{
+	avr->logger = logger;
+}
+
+
+static void
+_avr_flash_release(
+		avr_t * avr)
+{
+	avr_flash_image_t * image = avr->flash_image;
+
+	if (!image)
+		avr_guard_free(avr->flash, avr->flashend + 1, avr_guard_flash_reach(avr));
+	else if (__atomic_sub_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		avr_guard_free(image->flash, avr->flashend + 1, avr_guard_flash_reach(avr));
+		avr_cfg_release(image->cfg);
+		avr_predecode_image_release(image->decoded);
+		free(image);
+	}
+	avr->flash_image = NULL;
+	avr->flash = NULL;
+}
+
+int
+avr_flash_share(
+		avr_t * avr,
+		avr_t * from)
+{
+	if (avr->flashend != from->flashend || !from->flash ||
+			avr_guard_flash_reach(avr) != avr_guard_flash_reach(from)) {
+		AVR_LOG(avr, LOG_ERROR, "%s: can't share the flash of %s\n",
+				__func__, from->mmcu);
+		return -1;
+	}
+	if (avr == from || (avr->flash_image && avr->flash_image == from->flash_image))
+		return 0;
+	if (!from->flash_image) {
+		avr_flash_image_t * image = calloc(1, sizeof(*image));
+		if (!image)
+			return -1;
+		// 'from' hands its own copy over
+		image->flash = from->flash;
+		image->refcount = 1;
+		from->flash_image = image;
+	}
+	__atomic_add_fetch(&from->flash_image->refcount, 1, __ATOMIC_RELAXED);
+	_avr_flash_release(avr);
+	avr->flash_image = from->flash_image;
+	avr->flash = from->flash;
+	avr->codeend = from->codeend;
+	avr_predecode_invalidate(avr, 0, avr->flashend + 1);
+	avr_dirty_mark(avr->dirty.flash, 0, avr->flashend + 1);
+	return 0;
+}
+
+int
+avr_flash_unshare(
+		avr_t * avr)
+{
+	avr_flash_image_t * image = avr->flash_image;
+
+	if (!image)
+		return 0;
+	if (__atomic_load_n(&image->refcount, __ATOMIC_ACQUIRE) == 1) {
+		// the last one using it, it's private already
+		avr_cfg_release(image->cfg);
+		avr_predecode_image_release(image->decoded);
+		free(image);
+		avr->flash_image = NULL;
+		return 0;
+	}
+	uint8_t * flash = avr_guard_alloc(avr->flashend + 1,
+			avr_guard_flash_reach(avr));
+	if (!flash) {
+		AVR_LOG(avr, LOG_ERROR, "%s: out of memory\n", __func__);
+		return -1;
+	}
+	memcpy(flash, avr->flash, avr->flashend + 1);
+	_avr_flash_release(avr);
+	avr->flash = flash;
+	return 0;
+}
 
 int
 avr_init(
 		avr_t * avr)
 {
-	avr->flash = malloc(avr->flashend + 1);
+	// the hot tables, and the irqs, come out of it, see sim_arena.h
+	if (!avr->arena)
+		avr->arena = avr_arena_new();
+	avr->irq_pool.pages = avr->arena;
+	avr->flash = avr_guard_alloc(avr->flashend + 1, avr_guard_flash_reach(avr));
 	memset(avr->flash, 0xff, avr->flashend + 1);
+	// erased flash has no 32 bits instruction; one more bit for flashend + 1
+	avr->flash_wide = avr_arena_calloc(avr->arena,
+			(((avr->flashend + 1) >> 6) + 1) * sizeof(uint32_t));
 	avr->codeend = avr->flashend;
-	avr->data = malloc(avr->ramend + 1);
+#if CONFIG_SIMAVR_GUARD_PAGES
+	avr->data = avr_guard_alloc(avr->ramend + 1, AVR_GUARD_DATA_REACH);
+#else
+	avr->data = avr_arena_calloc(avr->arena, avr->ramend + 1);
+#endif
 	memset(avr->data, 0, avr->ramend + 1);
+	// the io tables stop at the end of the io space, or MAX_IOs if not declared
+	uint32_t ioend = avr->ioend ? avr->ioend : 32 + MAX_IOs - 1;
+	if (ioend < R_SREG)
+		ioend = R_SREG;
+	avr->io_count = ioend + 1 - 32 > MAX_IOs ? MAX_IOs : ioend + 1 - 32;
+	avr->io = avr_arena_calloc(avr->arena, avr->io_count * sizeof(*avr->io));
+	avr->io_hook = avr_arena_calloc(avr->arena, 32 + avr->io_count);
+	// SREG is split/reconstructed by the core, takes the slow path too
+	avr->io_hook[R_SREG] = AVR_IO_HOOK_READ | AVR_IO_HOOK_WRITE;
+	// so that no cached read matches until the callback ran once
+	avr->io_epoch = 1;
 #ifdef CONFIG_SIMAVR_TRACE
 	avr->trace_data = calloc(1, sizeof(struct avr_trace_data_t));
 #endif
@@ -95,11 +227,13 @@ avr_init(
 		avr->custom.init(avr, avr->custom.data);
 	if (avr->init)
 		avr->init(avr);
+	avr->io_lazy.current = 0;
 	// set default (non gdb) fast callbacks
 	avr->run = avr_callback_run_raw;
 	avr->sleep = avr_callback_sleep_raw;
 	// number of address bytes to push/pull on/off the stack
 	avr->address_size = avr->eind ? 3 : 2;
+	avr_core_select_variant(avr);
 	avr->log = 1;
 	avr_reset(avr);
 	avr_regbit_set(avr, avr->reset_flags.porf);		// by  default set to power-on reset
@@ -110,6 +244,8 @@ void
 avr_terminate(
 		avr_t * avr)
 {
+	// the threads waiting for their entries to run are let go
+	avr_inject_drain(avr);
 	if (avr->custom.deinit)
 		avr->custom.deinit(avr, avr->custom.data);
 	if (avr->gdb) {
@@ -120,10 +256,56 @@ avr_terminate(
 		avr_vcd_close(avr->vcd);
 		avr->vcd = NULL;
 	}
+	if (avr->sampling)
+		avr_sampling_stop(avr->sampling);
+	if (avr->trace_ring)
+		avr_trace_ring_stop(avr->trace_ring);
+	if (avr->trace_file)
+		avr_trace_file_stop(avr->trace_file);
+	if (avr->profile)
+		avr_profile_stop(avr->profile);
+	if (avr->callgraph)
+		avr_callgraph_stop(avr->callgraph);
+	if (avr->coverage)
+		avr_coverage_stop(avr->coverage);
+	if (avr->lcov)
+		avr_lcov_stop(avr->lcov);
+	if (avr->heatmap)
+		avr_heatmap_stop(avr->heatmap);
+	if (avr->stats)
+		avr_stats_stop(avr->stats);
+	if (avr->energy)
+		avr_energy_stop(avr->energy);
+	if (avr->tier)
+		avr_tier_stop(avr->tier);
+	if (avr->log >= LOG_TRACE)
+		avr_interrupt_stats_report(avr, stdout);
+	avr_stimulus_free(avr);
+	avr_regions_free(avr);
+	if (avr->shm)
+		avr_shm_stop(avr->shm);
 	avr_deallocate_ios(avr);
-
-	if (avr->flash) free(avr->flash);
-	if (avr->data) free(avr->data);
+	avr_cycle_timer_free(avr);
+	avr_interrupt_free(avr);
+	avr_predecode_free(avr);
+	avr_irq_pool_free(&avr->irq_pool);
+	avr_snapshot_untrack(avr);
+
+	avr_cfg_flush(avr);
+	_avr_flash_release(avr);
+	avr_arena_free(avr->arena, avr->flash_wide);
+	avr->flash_wide = NULL;
+#if CONFIG_SIMAVR_GUARD_PAGES
+	avr_guard_free(avr->data, avr->ramend + 1, AVR_GUARD_DATA_REACH);
+#else
+	avr_arena_free(avr->arena, avr->data);
+#endif
+	avr_arena_free(avr->arena, avr->io);
+	avr_arena_free(avr->arena, avr->io_hook);
+	avr->io = NULL;
+	avr->io_hook = NULL;
+	avr->io_count = 0;
+	avr_console_open(avr, -1, 0);
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
 		avr->io_console_buffer.size = 0;
@@ -131,6 +313,12 @@ avr_terminate(
 		avr->io_console_buffer.buf = NULL;
 	}
 	avr->flash = avr->data = NULL;
+	// what's left in it goes too
+	avr_arena_release(avr->arena);
+	avr->arena = NULL;
+	avr->irq_pool.pages = NULL;
+	// last, what was logged above goes out too
+	avr_logger_thread_stop(avr);
 }
 
 void
@@ -139,23 +327,38 @@ avr_reset(
 {
 	AVR_LOG(avr, LOG_TRACE, "%s reset\n", avr->mmcu);
 
+	if (avr->trace_file)
+		avr_trace_file_break(avr->trace_file);
 	avr->state = cpu_Running;
 	for(int i = 0x20; i <= avr->ioend; i++)
 		avr->data[i] = 0;
+	avr_io_read_invalidate(avr);
 	_avr_sp_set(avr, avr->ramend);
 	avr->pc = avr->reset_pc;	// Likely to be zero
 	for (int i = 0; i < 8; i++)
 		avr->sreg[i] = 0;
+	avr->sreg_lazy.op = 0;
 	avr_interrupt_reset(avr);
 	avr_cycle_timer_reset(avr);
+	avr_stimulus_reset(avr);
+	avr_shm_reset(avr);
+	avr_sampling_reset(avr);
+	avr_energy_reset(avr);
 	if (avr->reset)
 		avr->reset(avr);
 	avr_io_t * port = avr->io_port;
 	while (port) {
+		avr_io_gate_reset(port);
 		if (port->reset)
 			port->reset(port);
+		if (port->irq && port->irq_attach)
+			port->irq_attach(port);
 		port = port->next;
 	}
+	// the core's own wiring is done by now, boards can freeze again later
+	avr_irq_pool_freeze(&avr->irq_pool);
+	if (avr->trace_file)
+		avr_trace_file_sync(avr->trace_file);
 }
 
 void
@@ -164,6 +367,11 @@ avr_sadly_crashed(
 		uint8_t signal)
 {
 	AVR_LOG(avr, LOG_ERROR, "%s\n", __FUNCTION__);
+	avr_console_flush(avr);
+	if (avr->postmortem)
+		avr_postmortem_event(avr, AVR_POSTMORTEM_CRASH);
+	if (avr->trace_ring)
+		avr_trace_ring_crashed(avr->trace_ring);
 	avr->state = cpu_Stopped;
 	if (avr->gdb_port) {
 		// enable gdb server, and wait
@@ -189,6 +397,13 @@ _avr_io_console_write(
 		uint8_t v,
 		void * param)
 {
+	if (avr->console.buf) {
+		if (v == '\r')
+			avr_console_putc(avr, '\n');
+		else if (v >= ' ')
+			avr_console_putc(avr, v);
+		return;
+	}
 	if (v == '\r' && avr->io_console_buffer.buf) {
 		avr->io_console_buffer.buf[avr->io_console_buffer.len] = 0;
 		AVR_LOG(avr, LOG_OUTPUT, "O:" "%s" "" "\n",
@@ -206,6 +421,49 @@ _avr_io_console_write(
 		avr->io_console_buffer.buf[avr->io_console_buffer.len++] = v;
 }
 
+int
+avr_console_open(
+		avr_t * avr,
+		int fd,
+		uint32_t size)
+{
+	avr_console_flush(avr);
+	free(avr->console.buf);
+	avr->console.buf = NULL;
+	avr->console.size = avr->console.len = 0;
+	if (fd < 0)
+		return 0;
+	if (!size)
+		size = 65536;
+	avr->console.buf = malloc(size);
+	if (!avr->console.buf) {
+		AVR_LOG(avr, LOG_ERROR, "CONSOLE: %s: out of memory\n", __func__);
+		return -1;
+	}
+	avr->console.fd = fd;
+	avr->console.size = size;
+	return 0;
+}
+
+void
+avr_console_flush(
+		avr_t * avr)
+{
+	uint32_t done = 0;
+
+	while (done < avr->console.len) {
+		ssize_t r = write(avr->console.fd, avr->console.buf + done,
+				avr->console.len - done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			break;	// nowhere to write it, it's lost
+		}
+		done += r;
+	}
+	avr->console.len = 0;
+}
+
 void
 avr_set_console_register(
 		avr_t * avr,
@@ -227,7 +485,14 @@ avr_loadcode(
 			size, avr->flashend + 1);
 		abort();
 	}
+	// loading the same firmware in a shared flash is fine
+	if (avr->flash_image && !memcmp(avr->flash + address, code, size))
+		return;
+	if (avr_flash_unshare(avr))
+		abort();
 	memcpy(avr->flash + address, code, size);
+	avr_predecode_invalidate(avr, address, size);
+	avr_dirty_mark(avr->dirty.flash, address, size);
 }
 
 /**
@@ -259,6 +524,30 @@ avr_callback_sleep_gdb(
 		;
 }
 
+static void
+_avr_irq_delta_pending(
+		void * param)
+{
+	avr_t * avr = param;
+	// ends the engine's run after this instruction, to flush the queue
+	avr->run_cycle_count = 1;
+}
+
+int
+avr_delta_init(
+		avr_t * avr)
+{
+	return avr_irq_delta_init(&avr->irq_pool, _avr_irq_delta_pending, avr);
+}
+
+static inline void
+_avr_delta_flush(
+		avr_t * avr)
+{
+	if (unlikely(avr->irq_pool.delta))
+		avr_irq_delta_flush(&avr->irq_pool);
+}
+
 void
 avr_callback_run_gdb(
 		avr_t * avr)
@@ -280,11 +569,14 @@ avr_callback_run_gdb(
 #if CONFIG_SIMAVR_TRACE
 		avr_dump_state(avr);
 #endif
+		_avr_delta_flush(avr);
 	}
 
+	avr_inject_poll(avr);
 	// run the cycle timers, get the suggested sleep time
 	// until the next timer is due
 	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
+	_avr_delta_flush(avr);
 
 	avr->pc = new_pc;
 
@@ -300,6 +592,7 @@ avr_callback_run_gdb(
 		 */
 		avr->sleep(avr, sleep);
 		avr->cycle += 1 + sleep;
+		avr->sleep_cycles += 1 + sleep;
 	}
 	// Interrupt servicing might change the PC too, during 'sleep'
 	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
@@ -322,22 +615,37 @@ avr_callback_sleep_raw(
 	}
 }
 
+/*
+ * Virtual time, for headless/batch runs: never wait for the host clock,
+ * the caller skips the cycles to the next timer anyway.
+ */
 void
-avr_callback_run_raw(
-		avr_t * avr)
+avr_callback_sleep_virtual(
+		avr_t * avr,
+		avr_cycle_count_t howLong)
+{
+}
+
+static inline void
+_avr_callback_run(
+		avr_t * avr,
+		avr_flashaddr_t (*run_one)(avr_t * avr))
 {
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
+		new_pc = run_one(avr);
 #if CONFIG_SIMAVR_TRACE
 		avr_dump_state(avr);
 #endif
+		_avr_delta_flush(avr);
 	}
 
+	avr_inject_poll(avr);
 	// run the cycle timers, get the suggested sleep time
 	// until the next timer is due
 	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
+	_avr_delta_flush(avr);
 
 	avr->pc = new_pc;
 
@@ -353,6 +661,7 @@ avr_callback_run_raw(
 		 */
 		avr->sleep(avr, sleep);
 		avr->cycle += 1 + sleep;
+		avr->sleep_cycles += 1 + sleep;
 	}
 	// Interrupt servicing might change the PC too, during 'sleep'
 	if (avr->state == cpu_Running || avr->state == cpu_Sleeping) {
@@ -364,12 +673,100 @@ avr_callback_run_raw(
 	}
 }
 
+void
+avr_callback_run_raw(
+		avr_t * avr)
+{
+	_avr_callback_run(avr, avr_run_one);
+}
+
+/*
+ * Same as avr_callback_run_raw(), but uses the threaded engine, allocating
+ * the predecoded cache when needed.
+ */
+void
+avr_callback_run_threaded(
+		avr_t * avr)
+{
+	if (!avr->decoded && avr_predecode_init(avr)) {
+		avr->run = avr_callback_run_raw;
+		avr_callback_run_raw(avr);
+		return;
+	}
+	_avr_callback_run(avr, avr_run_threaded);
+}
+
+/*
+ * Runs the core with the decoder, or with the threaded engine if the pc
+ * is in a hot block, see sim_tier.h
+ */
+void
+avr_callback_run_tiered(
+		avr_t * avr)
+{
+	avr_tier_t * t = avr->tier;
+	avr_cycle_count_t start = avr->cycle;
+	int tier = AVR_TIER_INTERPRETED;
+
+	if (t && avr_tier_hot(t, avr->pc))
+		tier = AVR_TIER_THREADED;
+	if (tier == AVR_TIER_THREADED && !avr->decoded && avr_predecode_init(avr)) {
+		AVR_LOG(avr, LOG_WARNING, "TIER: no threaded engine, staying with the decoder\n");
+		avr_tier_stop(t);
+		t = NULL;
+		tier = AVR_TIER_INTERPRETED;
+	}
+	if (t)
+		t->counting = tier == AVR_TIER_INTERPRETED;
+	_avr_callback_run(avr,
+			tier == AVR_TIER_THREADED ? avr_run_threaded : avr_run_interpreted);
+	if (t)
+		t->cycles[tier] += avr->cycle - start;
+}
+
 
 int
 avr_run(
 		avr_t * avr)
 {
-	avr->run(avr);
+	AVR_GUARDED(avr, avr->run(avr));
+	return avr->state;
+}
+
+static void
+_avr_run_until(
+		avr_t * avr,
+		avr_cycle_count_t end)
+{
+	while (avr->cycle < end) {
+		/*
+		 * Let the core run back to back up to the next timer deadline,
+		 * but not past our own. gdb needs to check its breakpoints at
+		 * every instruction, so it stays the way it was.
+		 */
+		if (!avr->gdb) {
+			avr->run_cycle_limit = end - avr->cycle;
+			if (avr->run_cycle_count > avr->run_cycle_limit)
+				avr->run_cycle_count = avr->run_cycle_limit;
+		}
+		avr->run(avr);
+		if (avr->state != cpu_Running && avr->state != cpu_Sleeping)
+			break;
+	}
+}
+
+int
+avr_run_cycles(
+		avr_t * avr,
+		avr_cycle_count_t budget)
+{
+	avr_cycle_count_t end = avr->cycle + budget;
+	avr_cycle_count_t limit = avr->run_cycle_limit;
+
+	AVR_GUARDED(avr, _avr_run_until(avr, end));
+	avr->run_cycle_limit = limit;
+	if (avr->run_cycle_count > limit)
+		avr->run_cycle_count = limit ? limit : 1;
 	return avr->state;
 }
 
@@ -378,22 +775,106 @@ avr_core_allocate(
 		const avr_t * core,
 		uint32_t coreLen)
 {
-	uint8_t * b = malloc(coreLen);
+	uint8_t * b = NULL;
+
+	// the hot block of avr_t starts on a cache line, see AVR_CACHE_LINE
+#ifdef __MINGW32__
+	b = malloc(coreLen);	// _aligned_malloc() wouldn't go with free()
+#else
+	if (posix_memalign((void **)&b, AVR_CACHE_LINE, coreLen))
+		b = NULL;
+#endif
+	if (!b)
+		return NULL;
 	memcpy(b, core, coreLen);
+	((avr_t *)b)->core_size = coreLen;
 	return (avr_t *)b;
 }
 
+/*
+ * Open addressing hash of all the core names, at most half full. It's
+ * built the first time a core is looked up; racing threads each build
+ * one, the first one published wins.
+ */
+typedef struct avr_kind_index_t {
+	uint32_t		mask;
+	struct {
+		const char *	name;
+		avr_kind_t *	kind;
+	} slot[];
+} avr_kind_index_t;
+
+static avr_kind_index_t * _avr_kind_index;
+
+static uint32_t
+_avr_kind_hash(
+		const char * name)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h;
+}
+
+static avr_kind_index_t *
+_avr_kind_index_get(void)
+{
+	avr_kind_index_t * index = __atomic_load_n(&_avr_kind_index, __ATOMIC_ACQUIRE);
+	if (index)
+		return index;
+	uint32_t count = 0, size = 16;
+	for (int i = 0; avr_kind[i]; i++)
+		for (int j = 0; avr_kind[i]->names[j]; j++)
+			count++;
+	while (size < count * 2)
+		size *= 2;
+	index = calloc(1, sizeof(*index) + size * sizeof(index->slot[0]));
+	if (!index)
+		return NULL;
+	index->mask = size - 1;
+	for (int i = 0; avr_kind[i]; i++)
+		for (int j = 0; avr_kind[i]->names[j]; j++) {
+			uint32_t h = _avr_kind_hash(avr_kind[i]->names[j]) & index->mask;
+			while (index->slot[h].name) {
+				if (!strcmp(index->slot[h].name, avr_kind[i]->names[j]))
+					break;	// the first core with that name wins
+				h = (h + 1) & index->mask;
+			}
+			if (!index->slot[h].name) {
+				index->slot[h].name = avr_kind[i]->names[j];
+				index->slot[h].kind = avr_kind[i];
+			}
+		}
+	avr_kind_index_t * expected = NULL;
+	if (!__atomic_compare_exchange_n(&_avr_kind_index, &expected, index,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(index);
+		index = expected;
+	}
+	return index;
+}
+
 avr_t *
 avr_make_mcu_by_name(
 		const char *name)
 {
 	avr_kind_t * maker = NULL;
-	for (int i = 0; avr_kind[i] && !maker; i++) {
-		for (int j = 0; avr_kind[i]->names[j]; j++)
-			if (!strcmp(avr_kind[i]->names[j], name)) {
-				maker = avr_kind[i];
+	avr_kind_index_t * index = _avr_kind_index_get();
+	if (index) {
+		for (uint32_t h = _avr_kind_hash(name) & index->mask;
+				index->slot[h].name; h = (h + 1) & index->mask)
+			if (!strcmp(index->slot[h].name, name)) {
+				maker = index->slot[h].kind;
 				break;
 			}
+	} else {
+		for (int i = 0; avr_kind[i] && !maker; i++) {
+			for (int j = 0; avr_kind[i]->names[j]; j++)
+				if (!strcmp(avr_kind[i]->names[j], name)) {
+					maker = avr_kind[i];
+					break;
+				}
+		}
 	}
 	if (!maker) {
 		AVR_LOG(((avr_t*)0), LOG_ERROR, "%s: AVR '%s' not known\n", __FUNCTION__, name);
@@ -401,11 +882,32 @@ avr_make_mcu_by_name(
 	}
 
 	avr_t * avr = maker->make();
+	if (!avr) {
+		AVR_LOG(NULL, LOG_ERROR, "%s: can't allocate '%s'\n", __func__, name);
+		return NULL;
+	}
 	AVR_LOG(avr, LOG_TRACE, "Starting %s - flashend %04x ramend %04x e2end %04x\n",
 			avr->mmcu, avr->flashend, avr->ramend, avr->e2end);
 	return avr;
 }
 
+avr_symbol_t *
+avr_symbol_find(
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		uint32_t addr)
+{
+	uint32_t lo = 0, hi = symbolcount;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (symbol[mid]->addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? symbol[lo - 1] : NULL;
+}
+
 static void
 std_logger(
 		avr_t * avr,
@@ -36,6 +36,18 @@ extern "C" {
 	#define FALLTHROUGH
 #endif
 
+/*
+ * The line size the hot part of avr_t is aligned on. 64 bytes on the
+ * x86 and most ARM hosts; being wrong only costs a line here and there.
+ */
+#define AVR_CACHE_LINE	64
+#if __has_attribute(aligned)
+	#define AVR_CACHE_ALIGNED __attribute__((aligned(AVR_CACHE_LINE)))
+#else
+	#define AVR_CACHE_ALIGNED
+#endif
+
+#include <stdarg.h>
 #include "sim_irq.h"
 #include "sim_interrupts.h"
 #include "sim_cmds.h"
@@ -69,9 +81,27 @@ enum {
 	MAX_IOs	= 280,	// Bigger AVRs need more than 256-32 (mega1280)
 };
 
+// modules that can have their irqs allocated late, see avr_t.io_lazy
+#define AVR_IO_LAZY_MAX	64
+
+// avr_t.timing
+enum {
+	AVR_TIMING_EXACT = 0,
+	AVR_TIMING_FUNCTIONAL,	// see avr_io_cycles()
+};
+
 #define AVR_DATA_TO_IO(v) ((v) - 32)
 #define AVR_IO_TO_DATA(v) ((v) + 32)
 
+// bits of avr_t.io_hook[]
+enum {
+	AVR_IO_HOOK_READ	= (1 << 0),
+	AVR_IO_HOOK_WRITE	= (1 << 1),
+	AVR_IO_HOOK_IRQ		= (1 << 2),	// iomem IRQs, raised on writes
+	AVR_IO_HOOK_IRQ_READ	= (1 << 3),	// ... and on reads
+	AVR_IO_HOOK_READ_POLL	= (1 << 4),	// see avr_register_io_read_poll()
+};
+
 /**
  * Logging macros and associated log levels.
  * The current log level is kept in avr->log.
@@ -86,10 +116,15 @@ enum {
 };
 
 
+/*
+ * The level is checked before anything is formatted, so the messages above
+ * avr->log cost a test; a NULL 'avr' always logs.
+ */
 #ifndef AVR_LOG
 #define AVR_LOG(avr, level, ...) \
 	do { \
-		avr_global_logger(avr, level, __VA_ARGS__); \
+		if (avr_log_wanted(avr, level)) \
+			avr_global_logger(avr, level, __VA_ARGS__); \
 	} while(0)
 #endif
 #define AVR_TRACE(avr, ... ) \
@@ -114,7 +149,9 @@ enum {
 
 // this is only ever used if CONFIG_SIMAVR_TRACE is defined
 struct avr_trace_data_t {
-	struct avr_symbol_t ** codeline;
+	// the symbols in flash, sorted by address, see avr_symbol_find()
+	struct avr_symbol_t ** symbol;
+	uint32_t symbolcount;
 
 	/* DEBUG ONLY
 	 * this keeps track of "jumps" ie, call,jmp,ret,reti and so on
@@ -143,6 +180,10 @@ struct avr_trace_data_t {
 	// keeps track of which registers gets touched by instructions
 	// reset before each new instructions. Allows meaningful traces
 	uint32_t	touched[256 / 32];	// debug
+	int			donttrace;	// the last instruction wasn't traced
+	// bit per flash word, set when it's traced; NULL traces them all
+	uint8_t *	filter;
+	uint8_t		filter_isr;	// only trace the interrupt handlers
 };
 
 typedef void (*avr_run_t)(
@@ -157,7 +198,128 @@ typedef void (*avr_run_t)(
  * the rest is runtime data (as little as possible)
  */
 typedef struct avr_t {
+	/*
+	 * What the run loop touches at every instruction comes first, in the
+	 * first AVR_CACHE_LINE aligned lines of the instance, so a core runs
+	 * out of three or four lines rather than a dozen spread over two
+	 * kilobytes. The configuration and the tables follow. Nothing goes in
+	 * this block that the interpreter doesn't need as it runs.
+	 */
+	/*
+	 * ** current PC **
+	 * Note that the PC is representing /bytes/ while the AVR value is
+	 * assumed to be "words". This is in line with what GDB does...
+	 * this is why you will see >>1 and <<1 in the decoder to handle jumps.
+	 * It CAN be a little confusing, so concentrate, young grasshopper.
+	 */
+	avr_flashaddr_t	pc AVR_CACHE_ALIGNED;
+	int					state;		// stopped, running, sleeping
+	// cycles gets incremented when sleeping and when running; it corresponds
+	// not only to "cycles that runs" but also "cycles that might have run"
+	// like, sleeping.
+	avr_cycle_count_t	cycle;		// current cycle
+	// these next two allow the core to freely run between cycle timers and also allows
+	// for a maximum run cycle limit... run_cycle_count is set during cycle timer processing.
+	avr_cycle_count_t	run_cycle_count;	// cycles to run before next timer
+	avr_cycle_count_t	run_cycle_limit;	// maximum run cycle interval limit
+
+	// Mirror of the SREG register, to facilitate the access to bits
+	// in the opcode decoder.
+	// This array is re-synthesized back/forth when SREG changes
+	uint8_t		sreg[8];
+	/*
+	 * The predecoded engines defer computing the arithmetic flags of the
+	 * last ALU operation until something reads them, or the engine returns.
+	 * 'op' is zero when sreg[] is up to date, see avr_sreg_materialize()
+	 */
+	struct {
+		uint8_t		op, res, rd, rr;
+	} sreg_lazy;
+
+	/* Interrupt state:
+		00: idle (no wait, no pending interrupts) or disabled
+		<0: wait till zero
+		>0: interrupt pending */
+	int8_t			interrupt_state;	// interrupt state
+
+	// this is the general purpose registers, IO registers, and SRAM
+	uint8_t *		data;
+	// flash memory (initialized to 0xff, and code loaded into it)
+	uint8_t *		flash;
+	// optional predecoded copy of the flash, one entry per word (sim_core.h)
+	struct avr_decoded_t * decoded;
+	// one bit per flash word, set on the first word of 32 bits instructions
+	uint32_t *		flash_wide;
+	/*
+	 * callback when specific IO registers are read/written.
+	 * The table is sized by avr_init() from the core's 'ioend' (capped to
+	 * MAX_IOs) so the small cores don't pay for the big ones; io_count is
+	 * its number of entries.
+	 */
+	uint16_t		io_count;
+	struct {
+		struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
+		uint8_t irq_read;	// raise them on reads too, see avr_iomem_irq_on_read()
+		struct {
+			void * param;
+			avr_io_read_t c;
+			uint32_t * version;	// see avr_register_io_read_cached()
+			uint32_t seen;		// *version, when it was called last
+			uint32_t seen_epoch;	// and io_epoch + irq_pool.serial
+		} r;
+		struct {
+			void * param;
+			avr_io_write_t c;
+			uint8_t mask;	// see avr_register_io_write_mask()
+		} w;
+		uint64_t lazy;	// modules to set up first, one bit per io_lazy.io[]
+	} * io;
+	/*
+	 * One byte per data address up to the end of the IO space (32 + io_count),
+	 * with a AVR_IO_HOOK_* bit set for each of the io[] entries above in use,
+	 * so the core can test for a 'plain' register in one go. Maintained
+	 * by avr_register_io_read/write(), and for the avr_iomem_getirq() irqs,
+	 * only while one of them is hooked.
+	 */
+	uint8_t *		io_hook;
+	// bumped to have the cached io reads done again, see avr_io_read_invalidate()
+	uint32_t		io_epoch;
+	// cycle timers tracking & delivery
+	avr_cycle_timer_pool_t	cycle_timers;
+
+	// the rest of the block is only tested, and rarely set
+	// posted by host threads, run between instructions, see sim_inject.h
+	struct avr_inject_t * inject;
+	// compact execution trace file, when writing one, see sim_trace_file.h
+	struct avr_trace_file_t * trace_file;
+	// SRAM access counts and stack high water, see sim_heatmap.h
+	struct avr_heatmap_t * heatmap;
+	// performance counters, when counting, see sim_stats.h
+	struct avr_stats_t * stats;
+	// per timer counts and host time, when counting, see sim_timer_prof.h
+	struct avr_timer_prof_t * timer_prof;
+	// where avr_init() allocates the tables, or NULL, see sim_arena.h
+	struct avr_arena_t * arena;
+	// watched access kinds (enum avr_gdb_watch_type) for each data
+	// address, only set while gdb has data watchpoints
+	uint8_t * gdb_watch;
+	/*
+	 * Pages of data and flash written since the last snapshot, one bit
+	 * each. NULL until a snapshot is taken, see sim_snapshot.h
+	 */
+	struct {
+		uint64_t *		data, * flash;
+		uint32_t		base;	// id of the snapshot they are relative to
+		uint32_t		serial;	// last snapshot id given out
+	} dirty;
+	// last busy loop candidate that didn't turn out idle, see sim_core.c
+	struct {
+		avr_flashaddr_t	pc;
+		uint8_t			miss;
+	} idle_loop;
+
 	const char * 		mmcu;	// name of the AVR
+	uint32_t			core_size;	// avr_t and its io modules, see avr_core_allocate()
 	// these are filled by sim_core_declare from constants in /usr/lib/avr/include/avr/io*.h
 	uint16_t			ioend;
 	uint16_t 			ramend;
@@ -170,30 +332,25 @@ typedef struct avr_t {
 	avr_io_addr_t		rampz;	// optional, only for ELPM/SPM on >64Kb cores
 	avr_io_addr_t		eind;	// optional, only for EIJMP/EICALL on >64Kb cores
 	uint8_t				address_size;	// 2, or 3 for cores >128KB in flash
+	uint8_t				no_mul;	// set for cores without MUL/MULS/MULSU/FMUL*
+	uint8_t				core_variant;	// decoder variant, see avr_core_select_variant()
 	struct {
 		avr_regbit_t		porf;
 		avr_regbit_t		extrf;
 		avr_regbit_t		borf;
 		avr_regbit_t		wdrf;
 	} reset_flags;
+	// the sleep mode select bits, SM0 to SM2, those the core has
+	avr_regbit_t		sleep_mode[3];
 
 	// filled by the ELF data, this allow tracking of invalid jumps
 	uint32_t			codeend;
 
-	int					state;		// stopped, running, sleeping
 	uint32_t			frequency;	// frequency we are running at
 	// mostly used by the ADC for now
 	uint32_t			vcc,avcc,aref; // (optional) voltages in millivolts
 
-	// cycles gets incremented when sleeping and when running; it corresponds
-	// not only to "cycles that runs" but also "cycles that might have run"
-	// like, sleeping.
-	avr_cycle_count_t	cycle;		// current cycle
-
-	// these next two allow the core to freely run between cycle timers and also allows
-	// for a maximum run cycle limit... run_cycle_count is set during cycle timer processing.
-	avr_cycle_count_t	run_cycle_count;	// cycles to run before next timer
-	avr_cycle_count_t	run_cycle_limit;	// maximum run cycle interval limit
+	avr_cycle_count_t	sleep_cycles;	// how many of them were spent sleeping
 
 	/**
 	 * Sleep requests are accumulated in sleep_usec until the minimum sleep value
@@ -228,7 +385,8 @@ typedef struct avr_t {
 	/*!
 	 * Sleep default behaviour.
 	 * In "raw" mode, it calls usleep, in gdb mode, it waits
-	 * for howLong for gdb command on it's sockets.
+	 * for howLong for gdb command on it's sockets. The "virtual" one
+	 * doesn't wait at all, the cycle count just jumps to the next timer.
 	 */
 	void (*sleep)(struct avr_t * avr, avr_cycle_count_t howLong);
 
@@ -238,52 +396,12 @@ typedef struct avr_t {
 	 */
 	avr_irq_pool_t	irq_pool;
 
-	// Mirror of the SREG register, to facilitate the access to bits
-	// in the opcode decoder.
-	// This array is re-synthesized back/forth when SREG changes
-	uint8_t		sreg[8];
-
-	/* Interrupt state:
-		00: idle (no wait, no pending interrupts) or disabled
-		<0: wait till zero
-		>0: interrupt pending */
-	int8_t			interrupt_state;	// interrupt state
-
-	/*
-	 * ** current PC **
-	 * Note that the PC is representing /bytes/ while the AVR value is
-	 * assumed to be "words". This is in line with what GDB does...
-	 * this is why you will see >>1 and <<1 in the decoder to handle jumps.
-	 * It CAN be a little confusing, so concentrate, young grasshopper.
-	 */
-	avr_flashaddr_t	pc;
 	/*
 	 * Reset PC, this is the value used to jump to at reset time, this
 	 * allow support for bootloaders
 	 */
 	avr_flashaddr_t	reset_pc;
 
-	/*
-	 * callback when specific IO registers are read/written.
-	 * There is one drawback here, there is in way of knowing what is the
-	 * "beginning of useful sram" on a core, so there is no way to deduce
-	 * what is the maximum IO register for a core, and thus, we can't
-	 * allocate this table dynamically.
-	 * If you wanted to emulate the BIG AVRs, and XMegas, this would need
-	 * work.
-	 */
-	struct {
-		struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
-		struct {
-			void * param;
-			avr_io_read_t c;
-		} r;
-		struct {
-			void * param;
-			avr_io_write_t c;
-		} w;
-	} io[MAX_IOs];
-
 	/*
 	 * This block allows sharing of the IO write/read on addresses between
 	 * multiple callbacks. In 99% of case it's not needed, however on the tiny*
@@ -291,38 +409,95 @@ typedef struct avr_t {
 	 * IO modules.
 	 * If this case is detected, a special "dispatch" callback is installed that
 	 * will handle this particular case, without impacting the performance of the
-	 * other, normal cases...
+	 * other, normal cases... It's allocated the first time, and grows with
+	 * the number of shared registers and of handlers on each, see sim_io.c
 	 */
-	int				io_shared_io_count;
-	struct {
-		int used;
-		struct {
-			void * param;
-			void * c;
-		} io[4];
-	} io_shared_io[4];
+	struct avr_io_shared_t * io_shared_io;
 
-	// flash memory (initialized to 0xff, and code loaded into it)
-	uint8_t *		flash;
-	// this is the general purpose registers, IO registers, and SRAM
-	uint8_t *		data;
+	// set when 'flash' is shared with other instances, see avr_flash_share()
+	struct avr_flash_image_t * flash_image;
+	// 'decoded' is a copy on write mapping, see avr_predecode_share()
+	uint8_t				decoded_mapped;
+	// static control flow analysis of the flash, built on demand (sim_cfg.h)
+	struct avr_cfg_t * cfg;
 
 	// queue of io modules
 	struct avr_io_t * io_port;
+	/*
+	 * Set 'enabled' before avr_init(), and the modules that can (see
+	 * avr_io_t.irq_attach) only allocate their irqs when the firmware
+	 * first accesses one of their registers, or something asks for them,
+	 * with avr_io_getirq() or avr_ioctl(): the peripherals the firmware
+	 * doesn't use cost no irq. See sim_io.c
+	 */
+	struct {
+		uint8_t				enabled;
+		uint8_t				count;
+		uint8_t				current;	// 1 + the module being initialized
+		struct avr_io_t *	io[AVR_IO_LAZY_MAX];
+	} io_lazy;
+	/*
+	 * AVR_TIMING_FUNCTIONAL, for the runs that only need the firmware to do
+	 * the right thing: the core's cycles are as exact as ever, but the
+	 * bytes of a UART, SPI or TWI, an EEPROM write, a single ADC conversion,
+	 * are done the cycle after they start instead of on the line's time.
+	 * Can be changed at any time, the operations under way keep theirs.
+	 */
+	uint8_t				timing;
+	// kicked by WDR directly, when the core has one, see avr_watchdog.h
+	struct avr_watchdog_t * watchdog;
+	// ioctl number to io module lookup, rebuilt after io_port changes
+	struct {
+		struct avr_io_ctl_t *	slot;
+		uint32_t				size, count;
+		int						dirty;
+	} io_ctl;
 
 	// Builtin and user-defined commands
 	avr_cmd_table_t commands;
-	// cycle timers tracking & delivery
-	avr_cycle_timer_pool_t	cycle_timers;
 	// interrupt vectors and delivery fifo
 	avr_int_table_t	interrupts;
 
 	// DEBUG ONLY -- value ignored if CONFIG_SIMAVR_TRACE = 0
 	uint8_t	trace : 1,
 			log : 4; // log level, default to 1
+	// this instance's logger, see avr_logger_set(). NULL for the global one
+	void (*logger)(
+			struct avr_t * avr,
+			const int level,
+			const char * format,
+			va_list ap);
+	// set when the log is written by a thread, see sim_logger.h
+	struct avr_logger_thread_t * logger_thread;
 
 	// Only used if CONFIG_SIMAVR_TRACE is defined
 	struct avr_trace_data_t *trace_data;
+	// binary instruction trace, when running, see sim_trace_ring.h
+	struct avr_trace_ring_t * trace_ring;
+	// file written on a crash, see sim_postmortem.h
+	struct avr_postmortem_t * postmortem;
+	// pc histogram, when profiling, see sim_profile.h
+	struct avr_profile_t * profile;
+	// shadow call stack, when running, see sim_callgraph.h
+	struct avr_callgraph_t * callgraph;
+	// runtime routines run on the host, see sim_intrinsics.h
+	struct avr_intrinsics_t * intrinsics;
+	// edge coverage map, when fuzzing, see sim_coverage.h
+	struct avr_coverage_t * coverage;
+	// executed words and branch directions, see sim_lcov.h
+	struct avr_lcov_t * lcov;
+	// hotness of the flash blocks, when tiering, see sim_tier.h
+	struct avr_tier_t * tier;
+	// cycles of the regions the firmware marks, see sim_regions.h
+	struct avr_regions_t * regions;
+	// switches the above between windows, when sampling, see sim_sampling.h
+	struct avr_sampling_t * sampling;
+	// per state times and peripheral events, see sim_energy.h
+	struct avr_energy_t * energy;
+	// scheduled input events, when any were queued, see sim_stimulus.h
+	struct avr_stimulus_t * stimulus;
+	// the data space in a shared memory segment, see sim_shm.h
+	struct avr_shm_t * shm;
 
 	// VALUE CHANGE DUMP file (waveforms)
 	// this is the VCD file that gets allocated if the
@@ -345,6 +520,17 @@ typedef struct avr_t {
 		uint32_t size;
 		uint32_t len;
 	} io_console_buffer;
+	/*
+	 * With avr_console_open(), what the console register and the uarts
+	 * in AVR_UART_FLAG_STDIO mode print is appended here as it is, and
+	 * written to 'fd' without going through the logger
+	 */
+	struct {
+		int		 fd;
+		uint8_t * buf;		// NULL when the console goes to the logger
+		uint32_t size;
+		uint32_t len;
+	} console;
 } avr_t;
 
 
@@ -357,9 +543,24 @@ typedef struct avr_kind_t {
 // a symbol loaded from the .elf file
 typedef struct avr_symbol_t {
 	uint32_t	addr;
+	uint32_t	size;		// of the object, zero if unknown
 	const char  symbol[0];
 } avr_symbol_t;
 
+// returns the symbol 'addr' is in, the last one at or before it, or NULL
+avr_symbol_t *
+avr_symbol_find(
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		uint32_t addr);
+
+// a row of the line table loaded from the .elf file, sorted by address
+typedef struct avr_line_t {
+	uint32_t	addr;		// in bytes, the row runs up to the next one
+	uint32_t	line;		// 0 for the end of a sequence
+	uint32_t	file;		// index in the file names
+} avr_line_t;
+
 // locate the maker for mcu "name" and allocates a new avr instance
 avr_t *
 avr_make_mcu_by_name(
@@ -382,7 +583,22 @@ avr_reset(
 int
 avr_run(
 		avr_t * avr);
-// finish any pending operations
+/*
+ * Run for (at least) 'budget' cycles. Instructions are executed back to back
+ * until the next cycle timer is due, an interrupt is pending or the cpu
+ * state changes; timers and interrupts are only serviced at these points,
+ * exactly as avr_run() would. Returns the cpu state, and stops early if it
+ * is neither cpu_Running nor cpu_Sleeping.
+ */
+int
+avr_run_cycles(
+		avr_t * avr,
+		avr_cycle_count_t budget);
+/*
+ * finish any pending operations. The module irqs are freed with the irq
+ * pool; the parts' own, from avr_alloc_irq(), stay unhooked until they
+ * avr_free_irq() them, before or after this
+ */
 void
 avr_terminate(
 		avr_t * avr);
@@ -401,6 +617,33 @@ avr_set_console_register(
 		avr_t * avr,
 		avr_io_addr_t addr);
 
+/*
+ * Sends the console output straight to 'fd' (1 for stdout), through a
+ * buffer of 'size' bytes (64KB if 0), instead of printing it line by line
+ * with the logger. The buffer is written when it's full, when the core
+ * crashes, in avr_terminate() and by avr_console_flush(). A negative 'fd'
+ * goes back to the logger. Returns 0, or -1
+ */
+int
+avr_console_open(
+		avr_t * avr,
+		int fd,
+		uint32_t size);
+// writes what was printed on the console so far
+void
+avr_console_flush(
+		avr_t * avr);
+
+static inline void
+avr_console_putc(
+		avr_t * avr,
+		uint8_t c)
+{
+	if (avr->console.len == avr->console.size)
+		avr_console_flush(avr);
+	avr->console.buf[avr->console.len++] = c;
+}
+
 // load code in the "flash"
 void
 avr_loadcode(
@@ -409,6 +652,46 @@ avr_loadcode(
 		uint32_t size,
 		avr_flashaddr_t address);
 
+/*
+ * A flash image shared by instances running the same firmware; it is
+ * never written to. Whatever writes the flash (SPM, gdb, avr_loadcode()
+ * with different code...) calls avr_flash_unshare() first, which gives
+ * that instance a private copy again.
+ * Loading the same code again keeps it shared, so the usual firmware
+ * loading can still be done on each instance:
+ *
+ *	avr_init(b);
+ *	avr_flash_share(b, a);
+ *	avr_load_firmware(b, &f);	// same firmware as 'a', no copy
+ */
+typedef struct avr_flash_image_t {
+	uint8_t *		flash;
+	int				refcount;	// atomic, the instances can run in threads
+	struct avr_cfg_t * cfg;		// analysis of the image, once one instance built it
+	// decoded instructions of the image, see avr_predecode_share()
+	struct avr_decoded_image_t * decoded;
+} avr_flash_image_t;
+
+// makes 'avr' use the flash of 'from', returns zero if all is well
+int
+avr_flash_share(
+		avr_t * avr,
+		avr_t * from);
+// makes the flash private again, if it was shared. Returns zero if all is well
+int
+avr_flash_unshare(
+		avr_t * avr);
+
+/*
+ * Starts the delta queue of the irqs of 'avr' (see avr_irq_delta_init()):
+ * the raises of the irqs flagged IRQ_FLAG_DELTA in an instruction, or in a
+ * pass of the cycle timers, reach their hooks once, with the last value,
+ * after it. Returns zero if all is well
+ */
+int
+avr_delta_init(
+		avr_t * avr);
+
 /*
  * These are accessors for avr->data but allows watchpoints to be set for gdb
  * IO modules use that to set values to registers, and the AVR core decoder uses
@@ -431,6 +714,15 @@ avr_sadly_crashed(
 		avr_t *avr,
 		uint8_t signal);
 
+// 1 if a message of 'level' is to be logged for 'avr', see AVR_LOG()
+static inline int
+avr_log_wanted(
+		const struct avr_t * avr,
+		int level)
+{
+	return !avr || avr->log >= level;
+}
+
 /*
  * Logs a message using the current logger
  */
@@ -442,19 +734,31 @@ avr_global_logger(
 		... );
 
 #ifndef AVR_CORE
-#include <stdarg.h>
 /*
  * Type for custom logging functions
  */
 typedef void (*avr_logger_p)(struct avr_t* avr, const int level, const char * format, va_list ap);
 
-/* Sets a global logging function in place of the default */
+/*
+ * Sets a global logging function in place of the default. It is used for
+ * the instances that have no logger of their own, and for messages that
+ * are not about an instance.
+ */
 void
 avr_global_logger_set(
 		avr_logger_p logger);
 /* Gets the current global logger function */
 avr_logger_p
 avr_global_logger_get(void);
+/*
+ * Sets the logger of that instance only, NULL reverts to the global one.
+ * Unlike the global one, that is safe with instances running in other
+ * threads.
+ */
+void
+avr_logger_set(
+		struct avr_t * avr,
+		avr_logger_p logger);
 #endif
 
 /*
@@ -463,7 +767,10 @@ avr_global_logger_get(void);
 void avr_callback_sleep_gdb(avr_t * avr, avr_cycle_count_t howLong);
 void avr_callback_run_gdb(avr_t * avr);
 void avr_callback_sleep_raw(avr_t * avr, avr_cycle_count_t howLong);
+void avr_callback_sleep_virtual(avr_t * avr, avr_cycle_count_t howLong);
 void avr_callback_run_raw(avr_t * avr);
+void avr_callback_run_threaded(avr_t * avr);
+void avr_callback_run_tiered(avr_t * avr);
 
 /**
  * Accumulates sleep requests (and returns a sleep time of 0) until
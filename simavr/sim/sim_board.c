@@ -0,0 +1,306 @@
+/*
+	sim_board.c
+
+	Several instances, their firmwares and the wires between them, from a
+	board description file, run together by sim_cosim.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "sim_board.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "avr_uart.h"
+#include "avr_twi.h"
+#include "avr_ioport.h"
+
+#define BOARD_ERROR(_path, _line, _fmt, ...) \
+	AVR_LOG(NULL, LOG_ERROR, "BOARD: %s:%d: " _fmt, _path, _line, ## __VA_ARGS__)
+
+static int
+_avr_board_firmware(
+		const char * file,
+		const char * core,
+		uint32_t frequency,
+		elf_firmware_t * f)
+{
+	const char * suffix = strrchr(file, '.');
+
+	memset(f, 0, sizeof(*f));
+	if (!suffix || strcasecmp(suffix, ".hex")) {
+		if (elf_read_firmware(file, f))
+			return -1;
+	} else {
+		ihex_chunk_p chunk = NULL;
+		int cnt = read_ihex_chunks(file, &chunk);
+		if (cnt <= 0)
+			return -1;
+		// the chunks are kept, the firmware points to them
+		for (int ci = 0; ci < cnt; ci++) {
+			if (chunk[ci].baseaddr < (1*1024*1024)) {
+				f->flash = chunk[ci].data;
+				f->flashsize = chunk[ci].size;
+				f->flashbase = chunk[ci].baseaddr;
+			} else {
+				f->eeprom = chunk[ci].data;
+				f->eesize = chunk[ci].size;
+			}
+		}
+	}
+	// the board has the last word
+	snprintf(f->mmcu, sizeof(f->mmcu), "%s", core);
+	f->frequency = frequency;
+	return 0;
+}
+
+static int
+_avr_board_mcu(
+		avr_board_t * b,
+		const char * path,
+		int line,
+		const char * name,
+		const char * core,
+		uint32_t frequency,
+		const char * file)
+{
+	if (b->mcu_count == AVR_COSIM_NODES) {
+		BOARD_ERROR(path, line, "too many mcus\n");
+		return -1;
+	}
+	if (avr_board_get(b, name)) {
+		BOARD_ERROR(path, line, "%s is there already\n", name);
+		return -1;
+	}
+	elf_firmware_t f;
+	if (_avr_board_firmware(file, core, frequency, &f)) {
+		BOARD_ERROR(path, line, "can't load %s\n", file);
+		return -1;
+	}
+	avr_t * avr = avr_make_mcu_by_name(core);
+	if (!avr) {
+		BOARD_ERROR(path, line, "AVR '%s' not known\n", core);
+		return -1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+	if (f.flashbase)
+		avr->pc = f.flashbase;
+	if (avr_cosim_add(&b->cosim, avr)) {
+		avr_terminate(avr);
+		return -1;
+	}
+	avr_board_mcu_t * m = &b->mcu[b->mcu_count++];
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	m->avr = avr;
+	return 0;
+}
+
+// splits 'name:what', returns the instance
+static avr_t *
+_avr_board_endpoint(
+		avr_board_t * b,
+		const char * path,
+		int line,
+		char * spec,
+		char ** what)
+{
+	char * colon = strchr(spec, ':');
+	if (what) {
+		if (!colon || !colon[1]) {
+			BOARD_ERROR(path, line, "'%s' isn't <mcu>:<what>\n", spec);
+			return NULL;
+		}
+		*colon = 0;
+		*what = colon + 1;
+	}
+	avr_t * avr = avr_board_get(b, spec);
+	if (!avr)
+		BOARD_ERROR(path, line, "no mcu called '%s'\n", spec);
+	return avr;
+}
+
+static avr_irq_t *
+_avr_board_pin(
+		avr_t * avr,
+		const char * pin)
+{
+	if (strlen(pin) != 2 || !isalpha((unsigned char)pin[0]) ||
+			pin[1] < '0' || pin[1] > '7')
+		return NULL;
+	return avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(toupper(pin[0])),
+			IOPORT_IRQ_PIN0 + pin[1] - '0');
+}
+
+static int
+_avr_board_link(
+		avr_board_t * b,
+		const char * path,
+		int line,
+		avr_t * src,
+		avr_irq_t * src_irq,
+		avr_t * dst,
+		avr_irq_t * dst_irq,
+		uint64_t latency)
+{
+	if (!src_irq || !dst_irq) {
+		BOARD_ERROR(path, line, "no such irq\n");
+		return -1;
+	}
+	if (!avr_cosim_connect(&b->cosim, src, src_irq, dst, dst_irq, latency)) {
+		BOARD_ERROR(path, line, "can't connect these\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+_avr_board_line(
+		avr_board_t * b,
+		const char * path,
+		int line,
+		int argc,
+		char ** argv,
+		uint64_t * latency)
+{
+	const char * what = argv[0];
+	char * sa = NULL, * sb = NULL;
+	avr_t * a, * d;
+
+	if (!strcmp(what, "mcu") && argc == 5)
+		return _avr_board_mcu(b, path, line, argv[1], argv[2],
+				strtoul(argv[3], NULL, 0), argv[4]);
+	if (!strcmp(what, "latency") && argc == 2) {
+		*latency = strtoull(argv[1], NULL, 0);
+		if (*latency)
+			return 0;
+		BOARD_ERROR(path, line, "the latency can't be zero\n");
+		return -1;
+	}
+	if (!strcmp(what, "quantum") && argc == 2) {
+		uint64_t q = strtoull(argv[1], NULL, 0);
+		if (q && q < b->cosim.quantum)
+			b->cosim.quantum = q;
+		return 0;
+	}
+	if (argc != 3) {
+		BOARD_ERROR(path, line, "can't make sense of '%s'\n", what);
+		return -1;
+	}
+	if (!strcmp(what, "twi")) {
+		if (!(a = _avr_board_endpoint(b, path, line, argv[1], NULL)) ||
+				!(d = _avr_board_endpoint(b, path, line, argv[2], NULL)))
+			return -1;
+		uint32_t ioctl = AVR_IOCTL_TWI_GETIRQ(0);
+		return _avr_board_link(b, path, line,
+					a, avr_io_getirq(a, ioctl, TWI_IRQ_OUTPUT),
+					d, avr_io_getirq(d, ioctl, TWI_IRQ_INPUT), *latency) ||
+				_avr_board_link(b, path, line,
+					d, avr_io_getirq(d, ioctl, TWI_IRQ_OUTPUT),
+					a, avr_io_getirq(a, ioctl, TWI_IRQ_INPUT), *latency);
+	}
+	if (!(a = _avr_board_endpoint(b, path, line, argv[1], &sa)) ||
+			!(d = _avr_board_endpoint(b, path, line, argv[2], &sb)))
+		return -1;
+	if (!strcmp(what, "uart")) {
+		uint32_t ua = AVR_IOCTL_UART_GETIRQ(sa[0]);
+		uint32_t ud = AVR_IOCTL_UART_GETIRQ(sb[0]);
+		return _avr_board_link(b, path, line,
+					a, avr_io_getirq(a, ua, UART_IRQ_OUTPUT),
+					d, avr_io_getirq(d, ud, UART_IRQ_INPUT), *latency) ||
+				_avr_board_link(b, path, line,
+					d, avr_io_getirq(d, ud, UART_IRQ_OUTPUT),
+					a, avr_io_getirq(a, ua, UART_IRQ_INPUT), *latency);
+	}
+	if (!strcmp(what, "pin"))
+		return _avr_board_link(b, path, line,
+				a, _avr_board_pin(a, sa), d, _avr_board_pin(d, sb), *latency);
+	if (!strcmp(what, "irq"))
+		return _avr_board_link(b, path, line,
+				a, avr_irq_pool_find(&a->irq_pool, sa),
+				d, avr_irq_pool_find(&d->irq_pool, sb), *latency);
+	BOARD_ERROR(path, line, "can't make sense of '%s'\n", what);
+	return -1;
+}
+
+int
+avr_board_load(
+		avr_board_t * b,
+		const char * path)
+{
+	memset(b, 0, sizeof(*b));
+	if (avr_cosim_init(&b->cosim, AVR_BOARD_QUANTUM))
+		return -1;
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		AVR_LOG(NULL, LOG_ERROR, "BOARD: can't open %s\n", path);
+		return -1;
+	}
+	char buf[1024];
+	uint64_t latency = AVR_BOARD_LATENCY;
+	int line = 0, res = 0;
+	while (!res && fgets(buf, sizeof(buf), f)) {
+		line++;
+		buf[strcspn(buf, "#\r\n")] = 0;
+		char * argv[8];
+		int argc = 0;
+		for (char * w = strtok(buf, " \t"); w && argc < 8; w = strtok(NULL, " \t"))
+			argv[argc++] = w;
+		if (argc)
+			res = _avr_board_line(b, path, line, argc, argv, &latency);
+	}
+	fclose(f);
+	if (!res && !b->mcu_count) {
+		AVR_LOG(NULL, LOG_ERROR, "BOARD: %s has no mcu\n", path);
+		res = -1;
+	}
+	if (res)
+		avr_board_free(b);
+	return res;
+}
+
+avr_t *
+avr_board_get(
+		avr_board_t * b,
+		const char * name)
+{
+	for (int i = 0; i < b->mcu_count; i++)
+		if (!strcmp(b->mcu[i].name, name))
+			return b->mcu[i].avr;
+	return NULL;
+}
+
+int
+avr_board_run(
+		avr_board_t * b,
+		uint64_t duration)
+{
+	return avr_cosim_run(&b->cosim, duration);
+}
+
+void
+avr_board_free(
+		avr_board_t * b)
+{
+	avr_cosim_free(&b->cosim);
+	for (int i = 0; i < b->mcu_count; i++)
+		avr_terminate(b->mcu[i].avr);
+	b->mcu_count = 0;
+}
@@ -0,0 +1,91 @@
+/*
+	sim_board.h
+
+	Several instances, their firmwares and the wires between them, from a
+	board description file, run together by sim_cosim.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_BOARD_H__
+#define __SIM_BOARD_H__
+
+#include "sim_cosim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A board file is one statement a line, '#' starts a comment:
+ *
+ *	mcu <name> <core> <frequency> <firmware>
+ *		an instance; the firmware is an ELF or a .hex file
+ *	latency <nsec>
+ *		of the connections that follow, 10000 to start with
+ *	quantum <nsec>
+ *		the longest quantum of the scheduler, 1000000 to start with
+ *	uart <name>:<uart> <name>:<uart>
+ *		a serial line between two UARTs, like 'a:0 b:1', both ways
+ *	twi <name> <name>
+ *		the TWI of both on the same bus, both ways; the latency has to
+ *		be shorter than a bit time for the acks to make it in time
+ *	pin <name>:<port><bit> <name>:<port><bit>
+ *		one way, the first drives the second, like 'a:B5 b:D2'
+ *	irq <name>:<irq name> <name>:<irq name>
+ *		one way, the irqs by their name, see avr_irq_pool_find()
+ *
+ * Each instance runs on a thread of its own, see sim_cosim.h.
+ */
+#define AVR_BOARD_LATENCY	10000
+#define AVR_BOARD_QUANTUM	1000000
+
+typedef struct avr_board_mcu_t {
+	char			name[32];
+	struct avr_t *	avr;
+} avr_board_mcu_t;
+
+typedef struct avr_board_t {
+	avr_cosim_t		cosim;
+	avr_board_mcu_t	mcu[AVR_COSIM_NODES];
+	int				mcu_count;
+} avr_board_t;
+
+// reads 'path', makes the instances and connects them. Returns 0, or -1
+int
+avr_board_load(
+		avr_board_t * b,
+		const char * path );
+// returns the instance called 'name', or NULL
+struct avr_t *
+avr_board_get(
+		avr_board_t * b,
+		const char * name );
+// same as avr_cosim_run()
+int
+avr_board_run(
+		avr_board_t * b,
+		uint64_t duration );
+// disconnects and terminates the instances
+void
+avr_board_free(
+		avr_board_t * b );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_BOARD_H__ */
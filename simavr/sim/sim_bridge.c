@@ -0,0 +1,354 @@
+/*
+	sim_bridge.c
+
+	Co-simulation with another simulator, a Verilator model for example,
+	another process, through rings of cycle stamped events in shared memory.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "sim_bridge.h"
+#include "sim_stimulus.h"
+
+#define LOAD(_v)		__atomic_load_n(&(_v), __ATOMIC_ACQUIRE)
+#define STORE(_v, _n)	__atomic_store_n(&(_v), (_n), __ATOMIC_RELEASE)
+
+static int
+_avr_bridge_push(
+		avr_bridge_ring_t * r,
+		const avr_bridge_event_t * e)
+{
+	uint64_t head = r->head;
+	if (head - LOAD(r->tail) == AVR_BRIDGE_RING)
+		return -1;
+	r->event[head & (AVR_BRIDGE_RING - 1)] = *e;
+	STORE(r->head, head + 1);
+	return 0;
+}
+
+// what was kept back goes first, in order
+static void
+_avr_bridge_flush(
+		avr_bridge_t * b)
+{
+	uint32_t i = 0;
+	while (i < b->pending_count &&
+			_avr_bridge_push(&b->shared->to_peer, &b->pending[i]) == 0)
+		i++;
+	if (!i)
+		return;
+	b->pending_count -= i;
+	memmove(b->pending, b->pending + i, b->pending_count * sizeof(*b->pending));
+}
+
+// everything stamped before it is in the ring
+static void
+_avr_bridge_publish(
+		avr_bridge_t * b)
+{
+	uint64_t t = b->avr->cycle;
+	if (b->pending_count && b->pending[0].cycle < t)
+		t = b->pending[0].cycle;
+	if (t > b->shared->avr_time)
+		STORE(b->shared->avr_time, t);
+}
+
+static void
+_avr_bridge_out_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_bridge_port_t * p = param;
+	avr_bridge_t * b = p->bridge;
+	avr_bridge_event_t e = {
+		.cycle = b->avr->cycle,
+		.port = p - b->port,
+		.value = value,
+	};
+	b->sent++;
+	if (!b->pending_count && _avr_bridge_push(&b->shared->to_peer, &e) == 0)
+		return;
+	if (b->pending_count == b->pending_size) {
+		uint32_t size = b->pending_size ? b->pending_size * 2 : 1024;
+		avr_bridge_event_t * n = realloc(b->pending, size * sizeof(*n));
+		if (!n) {
+			AVR_LOG(b->avr, LOG_ERROR, "BRIDGE: %s: out of memory\n", __func__);
+			return;
+		}
+		b->pending = n;
+		b->pending_size = size;
+	}
+	b->pending[b->pending_count++] = e;
+}
+
+// the peer's events, to the stimulus queue, a quantum after their stamp
+static void
+_avr_bridge_drain(
+		avr_bridge_t * b)
+{
+	avr_bridge_ring_t * r = &b->shared->to_avr;
+	avr_stimulus_event_t batch[256];
+	uint32_t count = 0;
+	uint64_t tail = r->tail, head = LOAD(r->head);
+
+	while (tail != head) {
+		avr_bridge_event_t * e = &r->event[tail & (AVR_BRIDGE_RING - 1)];
+		tail++;
+		if (e->port >= AVR_BRIDGE_PORTS || !b->port[e->port].irq ||
+				b->port[e->port].output)
+			continue;
+		b->received++;
+		batch[count++] = (avr_stimulus_event_t) {
+			.cycle = e->cycle + b->shared->quantum,
+			.irq = b->port[e->port].irq,
+			.value = e->value,
+		};
+		if (count == 256) {
+			avr_stimulus_add(b->avr, batch, count);
+			count = 0;
+		}
+	}
+	if (count)
+		avr_stimulus_add(b->avr, batch, count);
+	STORE(r->tail, tail);
+}
+
+int
+avr_bridge_init(
+		struct avr_t * avr,
+		avr_bridge_t * b,
+		const char * name,
+		uint64_t quantum)
+{
+	memset(b, 0, sizeof(*b));
+#ifdef __MINGW32__
+	AVR_LOG(avr, LOG_ERROR, "BRIDGE: %s: no shared memory on this host\n", __func__);
+	return -1;
+#else
+	if (!quantum) {
+		AVR_LOG(avr, LOG_ERROR, "BRIDGE: %s: the quantum can't be zero\n", __func__);
+		return -1;
+	}
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, sizeof(avr_bridge_shared_t))) {
+		AVR_LOG(avr, LOG_ERROR, "BRIDGE: %s: %s: %s\n", __func__, name,
+				strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			shm_unlink(name);
+		}
+		return -1;
+	}
+	avr_bridge_shared_t * s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "BRIDGE: %s: can't map %s\n", __func__, name);
+		shm_unlink(name);
+		return -1;
+	}
+	s->version = AVR_BRIDGE_VERSION;
+	s->frequency = avr->frequency;
+	s->quantum = quantum;
+	s->avr_time = s->peer_time = avr->cycle;
+	// last, the peer waits for it
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(s->magic, AVR_BRIDGE_MAGIC, sizeof(s->magic));
+	b->avr = avr;
+	b->shared = s;
+	snprintf(b->name, sizeof(b->name), "%s", name);
+	return 0;
+#endif
+}
+
+int
+avr_bridge_port(
+		avr_bridge_t * b,
+		uint32_t port,
+		avr_irq_t * irq,
+		int output)
+{
+	if (port >= AVR_BRIDGE_PORTS || !irq || b->port[port].irq) {
+		AVR_LOG(b->avr, LOG_ERROR, "BRIDGE: %s: can't use port %u\n",
+				__func__, port);
+		return -1;
+	}
+	avr_bridge_port_t * p = &b->port[port];
+	p->bridge = b;
+	p->irq = irq;
+	p->output = output != 0;
+	if (p->output)
+		avr_irq_register_notify(irq, _avr_bridge_out_hook, p);
+	return 0;
+}
+
+int
+avr_bridge_run(
+		avr_bridge_t * b,
+		avr_cycle_count_t cycles)
+{
+	avr_t * avr = b->avr;
+	avr_bridge_shared_t * s = b->shared;
+	avr_cycle_count_t end = avr->cycle + cycles;
+	int state = avr->state;
+
+	while (avr->cycle < end) {
+		uint64_t peer = LOAD(s->peer_time);
+		_avr_bridge_drain(b);
+		_avr_bridge_flush(b);
+		_avr_bridge_publish(b);
+		if (LOAD(s->closed))
+			return cpu_Done;
+		uint64_t limit = peer + s->quantum;
+		if (limit <= avr->cycle) {
+			b->waits++;
+			while (LOAD(s->peer_time) == peer && !LOAD(s->closed)) {
+				_avr_bridge_drain(b);
+				_avr_bridge_flush(b);
+				_avr_bridge_publish(b);
+				sched_yield();
+			}
+			continue;
+		}
+		state = avr_run_cycles(avr, (limit < end ? limit : end) - avr->cycle);
+		if (state != cpu_Running && state != cpu_Sleeping)
+			break;
+	}
+	_avr_bridge_flush(b);
+	_avr_bridge_publish(b);
+	return state;
+}
+
+void
+avr_bridge_free(
+		avr_bridge_t * b)
+{
+	if (!b->shared)
+		return;
+	for (int i = 0; i < AVR_BRIDGE_PORTS; i++)
+		if (b->port[i].irq && b->port[i].output)
+			avr_irq_unregister_notify(b->port[i].irq, _avr_bridge_out_hook,
+					&b->port[i]);
+	_avr_bridge_flush(b);
+	_avr_bridge_publish(b);
+	STORE(b->shared->closed, 1);
+#ifndef __MINGW32__
+	munmap(b->shared, sizeof(*b->shared));
+	shm_unlink(b->name);
+#endif
+	free(b->pending);
+	memset(b, 0, sizeof(*b));
+}
+
+avr_bridge_shared_t *
+avr_bridge_attach(
+		const char * name)
+{
+#ifdef __MINGW32__
+	return NULL;
+#else
+	int fd = shm_open(name, O_RDWR, 0);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) || st.st_size < (off_t)sizeof(avr_bridge_shared_t)) {
+		AVR_LOG(NULL, LOG_ERROR, "BRIDGE: %s: can't attach to %s\n", __func__, name);
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	avr_bridge_shared_t * s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return NULL;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (memcmp(s->magic, AVR_BRIDGE_MAGIC, sizeof(s->magic)) ||
+			s->version != AVR_BRIDGE_VERSION) {
+		AVR_LOG(NULL, LOG_ERROR,
+				"BRIDGE: %s: %s isn't a bridge, or not this version\n",
+				__func__, name);
+		munmap(s, sizeof(*s));
+		return NULL;
+	}
+	return s;
+#endif
+}
+
+int
+avr_bridge_peer_send(
+		avr_bridge_shared_t * s,
+		uint64_t cycle,
+		uint32_t port,
+		uint32_t value)
+{
+	avr_bridge_event_t e = { .cycle = cycle, .port = port, .value = value };
+	while (_avr_bridge_push(&s->to_avr, &e)) {
+		if (LOAD(s->closed))
+			return -1;
+		sched_yield();
+	}
+	return 0;
+}
+
+uint64_t
+avr_bridge_peer_sync(
+		avr_bridge_shared_t * s,
+		uint64_t now,
+		avr_bridge_receive_t receive,
+		void * param)
+{
+	avr_bridge_ring_t * r = &s->to_peer;
+
+	if (now > s->peer_time)
+		STORE(s->peer_time, now);
+	for (;;) {
+		uint64_t avr = LOAD(s->avr_time);
+		int closed = LOAD(s->closed);
+		uint64_t tail = r->tail, head = LOAD(r->head);
+		for (; tail != head; tail++)
+			if (receive)
+				receive(&r->event[tail & (AVR_BRIDGE_RING - 1)], param);
+		STORE(r->tail, tail);
+		if (avr + s->quantum > now)
+			return avr + s->quantum;
+		if (closed)
+			return AVR_BRIDGE_CLOSED;
+		sched_yield();
+	}
+}
+
+void
+avr_bridge_detach(
+		avr_bridge_shared_t * s)
+{
+	if (!s)
+		return;
+	STORE(s->closed, 1);
+#ifndef __MINGW32__
+	munmap(s, sizeof(*s));
+#endif
+}
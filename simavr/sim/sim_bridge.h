@@ -0,0 +1,180 @@
+/*
+	sim_bridge.h
+
+	Co-simulation with another simulator, a Verilator model for example,
+	another process, through rings of cycle stamped events in shared memory.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_BRIDGE_H__
+#define __SIM_BRIDGE_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The core and the peer each run on their own, and only wait for each
+ * other every 'quantum' cycles, as sim_cosim.h does between cores.
+ * Everything is in cycles of the core; the peer has the frequency in the
+ * shared header to convert.
+ *
+ * A port is an irq of the core. The values raised on an output port get
+ * to the peer stamped with the cycle they were raised at; an event the
+ * peer sends to an input port is raised 'quantum' cycles after its stamp.
+ * That latency is what lets each side run a whole quantum ahead: neither
+ * runs further than the other's published time plus the quantum, so
+ * nothing ever arrives in its past. The values are 32 bits, so a port
+ * can be a bus, IOPORT_IRQ_PIN_ALL or a UART byte, as well as a pin.
+ *
+ * Each side publishes its time after the events stamped before it, and
+ * drains the other ring while it waits; the core never blocks on a full
+ * ring, it keeps the excess and publishes no further than it. The peer
+ * side is in here too, for a C or C++ test bench to link with:
+ *
+ *	avr_bridge_shared_t * s = avr_bridge_attach("/bridge");
+ *	uint64_t now = 0;
+ *	for (;;) {
+ *		uint64_t limit = avr_bridge_peer_sync(s, now, on_event, model);
+ *		if (limit == AVR_BRIDGE_CLOSED)
+ *			break;
+ *		while (now < limit) {
+ *			... step the model to cycle 'now', apply the events due,
+ *			... avr_bridge_peer_send(s, now, port, value) what changed
+ *			now++;
+ *		}
+ *	}
+ *	avr_bridge_detach(s);
+ */
+#define AVR_BRIDGE_MAGIC	"simavrBR"
+#define AVR_BRIDGE_VERSION	1
+#define AVR_BRIDGE_RING		4096	// events, a power of two
+#define AVR_BRIDGE_PORTS	64
+#define AVR_BRIDGE_CLOSED	(~0ull)
+
+typedef struct avr_bridge_event_t {
+	uint64_t			cycle;		// it happened at, on the sender side
+	uint32_t			port;
+	uint32_t			value;
+} avr_bridge_event_t;
+
+typedef struct avr_bridge_ring_t {
+	volatile uint64_t	head;		// written by the sender
+	uint8_t				_pad0[56];
+	volatile uint64_t	tail;		// by the receiver
+	uint8_t				_pad1[56];
+	avr_bridge_event_t	event[AVR_BRIDGE_RING];
+} avr_bridge_ring_t;
+
+typedef struct avr_bridge_shared_t {
+	char				magic[8];
+	uint32_t			version;
+	uint32_t			frequency;
+	uint64_t			quantum;	// cycles
+	volatile uint64_t	avr_time;	// the core has run up to that cycle
+	volatile uint64_t	peer_time;	// the peer has
+	volatile uint32_t	closed;		// either side is gone
+	uint8_t				_pad[20];
+	avr_bridge_ring_t	to_peer, to_avr;
+} avr_bridge_shared_t;
+
+typedef struct avr_bridge_port_t {
+	struct avr_bridge_t *	bridge;
+	avr_irq_t *				irq;
+	uint8_t					output;
+} avr_bridge_port_t;
+
+typedef struct avr_bridge_t {
+	struct avr_t *			avr;
+	char					name[64];
+	avr_bridge_shared_t *	shared;
+	avr_bridge_port_t		port[AVR_BRIDGE_PORTS];
+	// what didn't fit in the ring yet, oldest first
+	avr_bridge_event_t *	pending;
+	uint32_t				pending_count, pending_size;
+	uint64_t				sent, received;
+	uint64_t				waits;		// times the core caught up with the peer
+} avr_bridge_t;
+
+/*
+ * Makes the shared memory segment 'name', as for shm_open(), for a peer
+ * to attach to, with a 'quantum' in cycles. Returns 0, or -1
+ */
+int
+avr_bridge_init(
+		struct avr_t * avr,
+		avr_bridge_t * b,
+		const char * name,
+		uint64_t quantum );
+// makes 'irq' port number 'port' (< AVR_BRIDGE_PORTS), to or from the peer
+int
+avr_bridge_port(
+		avr_bridge_t * b,
+		uint32_t port,
+		avr_irq_t * irq,
+		int output );
+/*
+ * Runs the core for 'cycles', in step with the peer. Returns the cpu
+ * state, stops early if that's neither running nor sleeping, or if the
+ * peer detached, then it's cpu_Done
+ */
+int
+avr_bridge_run(
+		avr_bridge_t * b,
+		avr_cycle_count_t cycles );
+// tells the peer, and removes the segment
+void
+avr_bridge_free(
+		avr_bridge_t * b );
+
+// the peer side
+avr_bridge_shared_t *
+avr_bridge_attach(
+		const char * name );
+// waits for room in the ring if needed; returns -1 if the core is gone
+int
+avr_bridge_peer_send(
+		avr_bridge_shared_t * s,
+		uint64_t cycle,
+		uint32_t port,
+		uint32_t value );
+typedef void (*avr_bridge_receive_t)(
+		const avr_bridge_event_t * e,
+		void * param);
+/*
+ * Publishes that the peer has run up to cycle 'now' and passes what the
+ * core sent to 'receive', as long as it takes for the core to be far
+ * enough. Returns the cycle the peer can run up to, or AVR_BRIDGE_CLOSED.
+ * The events are due at their cycle plus the quantum.
+ */
+uint64_t
+avr_bridge_peer_sync(
+		avr_bridge_shared_t * s,
+		uint64_t now,
+		avr_bridge_receive_t receive,
+		void * param );
+void
+avr_bridge_detach(
+		avr_bridge_shared_t * s );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_BRIDGE_H__ */
@@ -0,0 +1,217 @@
+/*
+	sim_buslog.c
+
+	Logs the bytes and messages of the uarts, spi and twi as they go,
+	with their cycle, instead of their pins.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_buslog.h"
+#include "avr_uart.h"
+#include "avr_spi.h"
+#include "avr_twi.h"
+
+static const char buslog_magic[8] = "simavrB1";
+
+static const char * buslog_kind[] = {
+	[AVR_BUSLOG_UART] = "uart",
+	[AVR_BUSLOG_SPI] = "spi",
+	[AVR_BUSLOG_TWI] = "twi",
+};
+
+static void
+_avr_buslog_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_buslog_bus_t * b = param;
+	avr_buslog_t * l = b->l;
+	avr_buslog_record_t r = {
+		.cycle = l->avr->cycle,
+		.kind = b->kind,
+		.index = b->index,
+		.out = b->out,
+		.data = value,
+	};
+
+	if (b->kind == AVR_BUSLOG_TWI) {
+		avr_twi_msg_irq_t v = { .u.v = value };
+		r.cond = v.u.twi.msg;
+		r.addr = v.u.twi.addr;
+		r.data = v.u.twi.data;
+	}
+	l->records++;
+	if (l->binary) {
+		// the record is little endian on the file
+		uint8_t out[sizeof(r)];
+		for (int i = 0; i < 8; i++)
+			out[i] = r.cycle >> (i * 8);
+		out[8] = r.kind;
+		out[9] = r.index;
+		out[10] = r.out;
+		out[11] = r.cond;
+		out[12] = r.addr;
+		out[13] = 0;
+		out[14] = r.data;
+		out[15] = r.data >> 8;
+		fwrite(out, 1, sizeof(out), l->file);
+		return;
+	}
+	fprintf(l->file, "%" PRIu64 ",%s%d,%s,", (uint64_t)r.cycle,
+			buslog_kind[r.kind], r.index, r.out ? "out" : "in");
+	if (r.kind == AVR_BUSLOG_TWI) {
+		static const char * cond[] = {
+			"start", "stop", "addr", "ack", "write", "read" };
+		int first = 1;
+		for (int i = 0; i < 6; i++)
+			if (r.cond & (1 << i)) {
+				fprintf(l->file, "%s%s", first ? "" : "+", cond[i]);
+				first = 0;
+			}
+		fprintf(l->file, ",0x%02x,", r.addr);
+	} else
+		fprintf(l->file, ",,");
+	fprintf(l->file, "0x%02x\n", r.data);
+}
+
+int
+avr_buslog_open(
+		avr_buslog_t * l,
+		avr_t * avr,
+		const char * filename,
+		int binary)
+{
+	memset(l, 0, sizeof(*l));
+	l->avr = avr;
+	l->binary = binary;
+	l->file = fopen(filename, binary ? "wb" : "w");
+	if (!l->file) {
+		AVR_LOG(avr, LOG_ERROR, "BUSLOG: %s: can't create %s\n", __func__, filename);
+		l->avr = NULL;
+		return -1;
+	}
+	// the records come a few bytes at a time
+	setvbuf(l->file, NULL, _IOFBF, 64 * 1024);
+	if (binary)
+		fwrite(buslog_magic, 1, sizeof(buslog_magic), l->file);
+	else
+		fprintf(l->file, "cycle,bus,dir,cond,addr,data\n");
+	return 0;
+}
+
+static int
+_avr_buslog_hook(
+		avr_buslog_t * l,
+		avr_irq_t * irq,
+		uint8_t kind,
+		uint8_t index,
+		uint8_t out)
+{
+	if (l->count == l->alloc) {
+		uint32_t alloc = l->alloc ? l->alloc * 2 : 8;
+		avr_buslog_bus_t ** bus = realloc(l->bus, alloc * sizeof(*bus));
+		if (!bus)
+			return -1;
+		l->bus = bus;
+		l->alloc = alloc;
+	}
+	avr_buslog_bus_t * b = calloc(1, sizeof(*b));
+	if (!b)
+		return -1;
+	b->l = l;
+	b->irq = irq;
+	b->kind = kind;
+	b->index = index;
+	b->out = out;
+	l->bus[l->count++] = b;
+	avr_irq_register_notify(irq, _avr_buslog_notify, b);
+	return 0;
+}
+
+int
+avr_buslog_add(
+		avr_buslog_t * l,
+		const char * name)
+{
+	int count = 0;
+
+	if (!l->file)
+		return -1;
+	for (avr_io_t * io = l->avr->io_port; io; io = io->next) {
+		int kind, input, output;
+
+		if (!avr_io_irqs(io))
+			continue;
+		if (!strcmp(io->kind, "uart")) {
+			kind = AVR_BUSLOG_UART;
+			input = UART_IRQ_INPUT;
+			output = UART_IRQ_OUTPUT;
+		} else if (!strcmp(io->kind, "spi")) {
+			kind = AVR_BUSLOG_SPI;
+			input = SPI_IRQ_INPUT;
+			output = SPI_IRQ_OUTPUT;
+		} else if (!strcmp(io->kind, "twi")) {
+			kind = AVR_BUSLOG_TWI;
+			input = TWI_IRQ_INPUT;
+			output = TWI_IRQ_OUTPUT;
+		} else
+			continue;
+		// the cores name them '0', or 0
+		int index = io->irq_ioctl_get & 0xff;
+		if (index >= '0')
+			index -= '0';
+		char bus[16];
+		snprintf(bus, sizeof(bus), "%s%d", buslog_kind[kind], index);
+		if (name && strcmp(name, bus))
+			continue;
+		if (_avr_buslog_hook(l, io->irq + output, kind, index, 1) ||
+				_avr_buslog_hook(l, io->irq + input, kind, index, 0)) {
+			AVR_LOG(l->avr, LOG_ERROR, "BUSLOG: %s: out of memory\n", __func__);
+			return -1;
+		}
+		count++;
+	}
+	return count;
+}
+
+int
+avr_buslog_close(
+		avr_buslog_t * l)
+{
+	if (!l->avr)
+		return -1;
+	for (uint32_t i = 0; i < l->count; i++) {
+		avr_irq_unregister_notify(l->bus[i]->irq,
+				_avr_buslog_notify, l->bus[i]);
+		free(l->bus[i]);
+	}
+	free(l->bus);
+	l->bus = NULL;
+	l->count = l->alloc = 0;
+	if (ferror(l->file))
+		l->error = 1;
+	if (fclose(l->file))
+		l->error = 1;
+	l->file = NULL;
+	int res = l->error ? -1 : 0;
+	l->avr = NULL;
+	return res;
+}
@@ -0,0 +1,113 @@
+/*
+	sim_buslog.h
+
+	Logs the bytes and messages of the uarts, spi and twi as they go,
+	with their cycle, instead of their pins.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_BUSLOG_H__
+#define __SIM_BUSLOG_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The io modules already know what goes through them: the uarts raise
+ * UART_IRQ_OUTPUT with each byte sent, the spi SPI_IRQ_OUTPUT, the twi
+ * TWI_IRQ_OUTPUT with an avr_twi_msg_irq_t for each phase, and the
+ * _INPUT ones carry what comes back. The bus log hooks these, and writes
+ * a record for each, with the cycle it was raised at, rather than the
+ * pins of a .vcd file that would have to be decoded again.
+ *
+ * The text format has one line per record:
+ *	cycle,bus,dir,cond,addr,data
+ * 'bus' is "uart0", "spi0", "twi0"..., 'dir' "out" for what the core
+ * sends, "in" for what it receives. 'cond' and 'addr' are only filled
+ * for the twi: the TWI_COND_* of the message as start/stop/addr/ack/
+ * write/read joined by '+', and the address byte. Numbers are decimal,
+ * data in hex.
+ *
+ * The binary format starts with the 8 bytes "simavrB1", followed by
+ * avr_buslog_record_t records, little endian.
+ *
+ * A twi slave added with AVR_IOCTL_TWI_ADD_SLAVE() is called directly,
+ * its messages aren't on TWI_IRQ_OUTPUT, so they are not logged.
+ */
+enum {
+	AVR_BUSLOG_UART = 0,
+	AVR_BUSLOG_SPI,
+	AVR_BUSLOG_TWI,
+};
+
+typedef struct avr_buslog_record_t {
+	uint64_t	cycle;
+	uint8_t		kind;		// AVR_BUSLOG_*
+	uint8_t		index;		// 0 for uart0 etc
+	uint8_t		out;		// 1 for what the core sends
+	uint8_t		cond;		// TWI_COND_* for the twi
+	uint8_t		addr;		// twi address byte
+	uint8_t		pad;
+	uint16_t	data;		// 9 bits for the uarts in that mode
+} __attribute__((__packed__)) avr_buslog_record_t;
+
+typedef struct avr_buslog_bus_t {
+	struct avr_buslog_t * l;
+	avr_irq_t *		irq;
+	uint8_t			kind, index, out;
+} avr_buslog_bus_t;
+
+typedef struct avr_buslog_t {
+	avr_t *			avr;
+	FILE *			file;
+	int				binary;
+	avr_buslog_bus_t ** bus;	// one per irq hooked
+	uint32_t		count, alloc;
+	uint64_t		records;
+	int				error;
+} avr_buslog_t;
+
+// starts a log into 'filename', with no buses yet. Returns 0, or -1
+int
+avr_buslog_open(
+		avr_buslog_t * l,
+		avr_t * avr,
+		const char * filename,
+		int binary );
+/*
+ * Logs the bus called 'name' ("uart0", "spi1", "twi0"...), or all the
+ * uarts, spi and twi of the core with NULL. Returns how many buses were
+ * added, 0 if there's none by that name.
+ */
+int
+avr_buslog_add(
+		avr_buslog_t * l,
+		const char * name );
+// unhooks the buses and closes the file. Returns -1 if anything went wrong
+int
+avr_buslog_close(
+		avr_buslog_t * l );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_BUSLOG_H__ */
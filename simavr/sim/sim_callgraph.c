@@ -0,0 +1,199 @@
+/*
+	sim_callgraph.c
+
+	Shadow call stack profiler, writes flamegraph.pl "folded" stacks.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_callgraph.h"
+#include "sim_core.h"
+
+static inline void
+_avr_callgraph_charge(
+		avr_callgraph_t * cg)
+{
+	cg->node[cg->current].self += cg->avr->cycle - cg->last;
+	cg->last = cg->avr->cycle;
+}
+
+// returns the child of 'parent' for 'addr', allocating it if needed, or 0
+static uint32_t
+_avr_callgraph_child(
+		avr_callgraph_t * cg,
+		uint32_t parent,
+		uint32_t addr)
+{
+	for (uint32_t c = cg->node[parent].child; c; c = cg->node[c].next)
+		if (cg->node[c].addr == addr)
+			return c;
+	if (cg->count == cg->size) {
+		uint32_t size = cg->size * 2;
+		avr_callgraph_node_t * n = realloc(cg->node, size * sizeof(*n));
+		if (!n)
+			return 0;
+		cg->node = n;
+		cg->size = size;
+	}
+	uint32_t c = cg->count++;
+	memset(cg->node + c, 0, sizeof(cg->node[c]));
+	cg->node[c].addr = addr;
+	cg->node[c].parent = parent;
+	cg->node[c].next = cg->node[parent].child;
+	cg->node[parent].child = c;
+	return c;
+}
+
+void
+avr_callgraph_call(
+		avr_t * avr,
+		avr_flashaddr_t target)
+{
+	avr_callgraph_t * cg = avr->callgraph;
+
+	if (cg->depth == AVR_CALLGRAPH_DEPTH)
+		return;		// the return will unwind past it anyway
+	uint32_t c = _avr_callgraph_child(cg, cg->current, target);
+	if (!c)
+		return;
+	_avr_callgraph_charge(cg);
+	cg->node[c].calls++;
+	cg->frame[cg->depth].node = c;
+	cg->frame[cg->depth].sp = _avr_sp_get(avr);
+	cg->frame[cg->depth].start = avr->cycle;
+	cg->depth++;
+	cg->current = c;
+}
+
+void
+avr_callgraph_ret(
+		avr_t * avr)
+{
+	avr_callgraph_t * cg = avr->callgraph;
+	uint16_t sp = _avr_sp_get(avr);
+
+	if (!cg->depth || cg->frame[cg->depth - 1].sp >= sp)
+		return;
+	_avr_callgraph_charge(cg);
+	while (cg->depth && cg->frame[cg->depth - 1].sp < sp) {
+		cg->depth--;
+		uint32_t c = cg->frame[cg->depth].node;
+		cg->node[c].total += avr->cycle - cg->frame[cg->depth].start;
+		cg->current = cg->node[c].parent;
+	}
+}
+
+int
+avr_callgraph_init(
+		avr_t * avr,
+		avr_callgraph_t * cg)
+{
+	if (avr->callgraph) {
+		AVR_LOG(avr, LOG_ERROR, "CALLGRAPH: already running\n");
+		return -1;
+	}
+	memset(cg, 0, sizeof(*cg));
+	cg->size = 256;
+	cg->node = calloc(cg->size, sizeof(cg->node[0]));
+	if (!cg->node) {
+		AVR_LOG(avr, LOG_ERROR, "CALLGRAPH: can't allocate nodes\n");
+		return -1;
+	}
+	cg->count = 1;
+	cg->node[0].addr = avr->pc;
+	cg->avr = avr;
+	cg->last = avr->cycle;
+	avr->callgraph = cg;
+	return 0;
+}
+
+void
+avr_callgraph_stop(
+		avr_callgraph_t * cg)
+{
+	if (!cg->avr)
+		return;
+	_avr_callgraph_charge(cg);
+	cg->avr->callgraph = NULL;
+	cg->avr = NULL;
+}
+
+void
+avr_callgraph_free(
+		avr_callgraph_t * cg)
+{
+	avr_callgraph_stop(cg);
+	free(cg->node);
+	cg->node = NULL;
+	cg->count = cg->size = 0;
+}
+
+static void
+_avr_callgraph_name(
+		FILE * out,
+		uint32_t addr,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount)
+{
+	avr_symbol_t * s = avr_symbol_find(symbol, symbolcount, addr);
+	if (!s)
+		fprintf(out, "0x%04x", addr);
+	else if (s->addr == addr)
+		fprintf(out, "%s", s->symbol);
+	else
+		fprintf(out, "%s+0x%x", s->symbol, addr - s->addr);
+}
+
+int
+avr_callgraph_write_folded(
+		avr_callgraph_t * cg,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		const char * filename)
+{
+	FILE * out = fopen(filename, "w");
+	if (!out) {
+		perror(filename);
+		return -1;
+	}
+	if (cg->avr)
+		_avr_callgraph_charge(cg);
+
+	// the tree is never deeper than the shadow stack, plus the root
+	uint32_t path[AVR_CALLGRAPH_DEPTH + 1];
+	for (uint32_t n = 0; n < cg->count; n++) {
+		if (!cg->node[n].self)
+			continue;
+		int depth = 0;
+		for (uint32_t p = n; ; p = cg->node[p].parent) {
+			path[depth++] = p;
+			if (!p)
+				break;
+		}
+		while (depth--) {
+			_avr_callgraph_name(out, cg->node[path[depth]].addr,
+					symbol, symbolcount);
+			fprintf(out, "%s", depth ? ";" : "");
+		}
+		fprintf(out, " %" PRIu64 "\n", cg->node[n].self);
+	}
+	fclose(out);
+	return 0;
+}
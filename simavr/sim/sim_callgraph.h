@@ -0,0 +1,107 @@
+/*
+	sim_callgraph.h
+
+	Shadow call stack profiler, writes flamegraph.pl "folded" stacks.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_CALLGRAPH_H__
+#define __SIM_CALLGRAPH_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The core tells us about every CALL/RCALL/ICALL/EICALL, interrupt vector
+ * entry and RET/RETI, and nothing else, so there is no cost for the other
+ * instructions. A shadow call stack follows them, and every call path ever
+ * seen is a node in a tree; cycles are charged to the current node
+ * (exclusive) and, once a call returns, to the whole path (inclusive).
+ *
+ * Frames are matched to returns using the stack pointer, so returns that
+ * skip frames (longjmp, stack switching) unwind them, and "push; ret"
+ * style jumps don't pop anything.
+ */
+#define AVR_CALLGRAPH_DEPTH		256
+
+typedef struct avr_callgraph_node_t {
+	uint32_t		addr;			// function entry, in bytes
+	uint32_t		parent;
+	uint32_t		child, next;	// first child, next sibling. 0 is none
+	uint64_t		self;			// exclusive cycles
+	uint64_t		total;			// inclusive cycles, for returned calls
+	uint64_t		calls;
+} avr_callgraph_node_t;
+
+typedef struct avr_callgraph_t {
+	struct avr_t *			avr;
+	avr_callgraph_node_t *	node;		// node 0 is the root
+	uint32_t				count, size;
+	uint32_t				current;
+	avr_cycle_count_t		last;		// last time 'self' was updated
+	int						depth;
+	struct {
+		uint32_t			node;
+		uint16_t			sp;			// after the return address was pushed
+		avr_cycle_count_t	start;
+	} frame[AVR_CALLGRAPH_DEPTH];
+} avr_callgraph_t;
+
+// starts following calls, returns zero if all is well
+int
+avr_callgraph_init(
+		struct avr_t * avr,
+		avr_callgraph_t * cg );
+// stops following calls, the tree is kept until avr_callgraph_free()
+void
+avr_callgraph_stop(
+		avr_callgraph_t * cg );
+void
+avr_callgraph_free(
+		avr_callgraph_t * cg );
+
+// writes one line per call path, with its exclusive cycles, using a
+// symbol table sorted by address (like elf_read_firmware() loads)
+int
+avr_callgraph_write_folded(
+		avr_callgraph_t * cg,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		const char * filename );
+
+/*
+ * Called by the core, after the return address was pushed
+ */
+void
+avr_callgraph_call(
+		struct avr_t * avr,
+		avr_flashaddr_t target );
+/*
+ * Called by the core after the return address was popped
+ */
+void
+avr_callgraph_ret(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_CALLGRAPH_H__ */
@@ -0,0 +1,432 @@
+/*
+	sim_cfg.c
+
+	Static control flow analysis of the flash: basic blocks, calls,
+	vectors and jump tables, and which words are code or data.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_cfg.h"
+#include "sim_core.h"
+
+#define AVR_CFG_TABLE_MAX	256		// entries of a jump table
+
+static inline uint16_t
+_avr_cfg_read16(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	return avr->flash[pc] | (avr->flash[pc + 1] << 8);
+}
+
+/*
+ * Returns how the instruction at 'pc' changes the flow, AVR_CFG_END_FALL if
+ * it doesn't, with where it goes in 'target'
+ */
+static uint8_t
+_avr_cfg_flow(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		avr_flashaddr_t * target)
+{
+	uint16_t o = _avr_cfg_read16(avr, pc);
+	avr_flashaddr_t next = pc + (avr_flash_is_wide(avr, pc) ? 4 : 2);
+
+	*target = AVR_CFG_NONE;
+	if ((o & 0xe000) == 0xc000) {	// RJMP, RCALL, wrapping around as the core does
+		int16_t off = ((int16_t)(o << 4)) >> 3;
+		*target = (pc + 2 + (int32_t)off) % (avr->flashend + 1);
+		return o & 0x1000 ? AVR_CFG_END_CALL : AVR_CFG_END_JUMP;
+	}
+	if ((o & 0xfe0c) == 0x940c) {	// JMP, CALL
+		avr_flashaddr_t a = ((o & 0x01f0) >> 3) | (o & 1);
+		*target = ((a << 16) | _avr_cfg_read16(avr, pc + 2)) << 1;
+		return o & 2 ? AVR_CFG_END_CALL : AVR_CFG_END_JUMP;
+	}
+	if ((o & 0xf800) == 0xf000) {	// BRBS, BRBC
+		int16_t off = ((int16_t)(o << 6)) >> 9;
+		*target = pc + 2 + (off << 1);
+		return AVR_CFG_END_BRANCH;
+	}
+	if ((o & 0xfc00) == 0x1000 ||	// CPSE
+			(o & 0xfc08) == 0xfc00 ||	// SBRC, SBRS
+			(o & 0xfd00) == 0x9900) {	// SBIC, SBIS
+		*target = next + (avr_flash_is_wide(avr, next) ? 4 : 2);
+		return AVR_CFG_END_SKIP;
+	}
+	switch (o) {
+		case 0x9508:	// RET
+		case 0x9518:	// RETI
+			return AVR_CFG_END_RET;
+		case 0x9409:	// IJMP
+		case 0x9419:	// EIJMP
+			return AVR_CFG_END_IJMP;
+		case 0x9509:	// ICALL
+		case 0x9519:	// EICALL
+			return AVR_CFG_END_ICALL;
+	}
+	return AVR_CFG_END_FALL;
+}
+
+/*
+ * Looks for a table of RJMP or JMP for the IJMP at 'pc', as in
+ *		subi r30, lo8(-(pm(table)))
+ *		sbci r31, hi8(-(pm(table)))
+ *		ijmp
+ * Returns its address, and the size of its entries in 'step', or
+ * AVR_CFG_NONE
+ */
+static avr_flashaddr_t
+_avr_cfg_table(
+		avr_t * avr,
+		avr_cfg_t * cfg,
+		avr_flashaddr_t pc,
+		uint32_t * step)
+{
+	uint32_t w = pc >> 1;
+
+	if (_avr_cfg_read16(avr, pc) != 0x9409 || w < 2 ||
+			!(cfg->map[w - 1] & AVR_CFG_INSN) || !(cfg->map[w - 2] & AVR_CFG_INSN))
+		return AVR_CFG_NONE;
+	uint16_t hi = _avr_cfg_read16(avr, pc - 2);
+	uint16_t lo = _avr_cfg_read16(avr, pc - 4);
+	if ((hi & 0xf0f0) != 0x40f0 || (lo & 0xf0f0) != 0x50e0)
+		return AVR_CFG_NONE;
+	uint16_t k = (((lo >> 4) & 0xf0) | (lo & 0xf)) |
+			((((hi >> 4) & 0xf0) | (hi & 0xf)) << 8);
+	avr_flashaddr_t table = (avr_flashaddr_t)(uint16_t)-k << 1;
+	if (table + 2 > avr->flashend + 1)
+		return AVR_CFG_NONE;
+	uint16_t o = _avr_cfg_read16(avr, table);
+	if ((o & 0xf000) == 0xc000)
+		*step = 2;
+	else if ((o & 0xfe0e) == 0x940c)
+		*step = 4;
+	else
+		return AVR_CFG_NONE;
+	return table;
+}
+
+typedef struct avr_cfg_walk_t {
+	avr_flashaddr_t *	pc;
+	uint32_t			count, size;
+} avr_cfg_walk_t;
+
+static void
+_avr_cfg_push(
+		avr_cfg_t * cfg,
+		avr_cfg_walk_t * walk,
+		avr_flashaddr_t pc,
+		uint8_t flags)
+{
+	if ((pc & 1) || (pc >> 1) >= cfg->words)
+		return;
+	cfg->map[pc >> 1] |= flags | AVR_CFG_LEADER;
+	if (walk->count == walk->size) {
+		uint32_t size = walk->size ? walk->size * 2 : 256;
+		avr_flashaddr_t * n = realloc(walk->pc, size * sizeof(*n));
+		if (!n)
+			return;
+		walk->pc = n;
+		walk->size = size;
+	}
+	walk->pc[walk->count++] = pc;
+}
+
+// follows the instructions from 'pc' until the flow can't go on
+static void
+_avr_cfg_walk(
+		avr_t * avr,
+		avr_cfg_t * cfg,
+		avr_cfg_walk_t * walk,
+		avr_flashaddr_t pc)
+{
+	for (;;) {
+		uint32_t w = pc >> 1;
+		if (w >= cfg->words || (cfg->map[w] & AVR_CFG_CODE))
+			return;		// walked already, or the middle of an instruction
+		uint32_t len = avr_flash_is_wide(avr, pc) ? 2 : 1;
+		if (w + len > cfg->words || _avr_cfg_read16(avr, pc) == 0xffff)
+			return;		// erased flash
+		cfg->map[w] |= AVR_CFG_CODE | AVR_CFG_INSN;
+		if (len == 2)
+			cfg->map[w + 1] |= AVR_CFG_CODE;
+		cfg->code += len;
+
+		avr_flashaddr_t target, next = pc + (len << 1);
+		uint32_t step;
+		switch (_avr_cfg_flow(avr, pc, &target)) {
+			case AVR_CFG_END_FALL:
+				break;
+			case AVR_CFG_END_CALL:
+				_avr_cfg_push(cfg, walk, target, AVR_CFG_CALLEE);
+				_avr_cfg_push(cfg, walk, next, 0);
+				return;
+			case AVR_CFG_END_BRANCH:
+			case AVR_CFG_END_SKIP:
+				_avr_cfg_push(cfg, walk, target, 0);
+				_avr_cfg_push(cfg, walk, next, 0);
+				return;
+			case AVR_CFG_END_ICALL:
+				_avr_cfg_push(cfg, walk, next, 0);
+				return;
+			case AVR_CFG_END_JUMP:
+				_avr_cfg_push(cfg, walk, target, 0);
+				return;
+			case AVR_CFG_END_IJMP:
+				target = _avr_cfg_table(avr, cfg, pc, &step);
+				if (target == AVR_CFG_NONE)
+					return;
+				cfg->tables++;
+				for (uint32_t i = 0; i < AVR_CFG_TABLE_MAX; i++, target += step) {
+					if (target + step > avr->flashend + 1)
+						break;
+					uint16_t o = _avr_cfg_read16(avr, target);
+					if (step == 2 ? (o & 0xf000) != 0xc000 : (o & 0xfe0e) != 0x940c)
+						break;
+					_avr_cfg_push(cfg, walk, target, AVR_CFG_TABLE);
+				}
+				return;
+			default:
+				return;
+		}
+		pc = next;
+	}
+}
+
+static int
+_avr_cfg_add_block(
+		avr_cfg_t * cfg,
+		uint32_t * size,
+		avr_cfg_block_t * b)
+{
+	if (cfg->block_count == *size) {
+		uint32_t n = *size ? *size * 2 : 64;
+		avr_cfg_block_t * nb = realloc(cfg->block, n * sizeof(*nb));
+		if (!nb)
+			return -1;
+		cfg->block = nb;
+		*size = n;
+	}
+	cfg->block[cfg->block_count++] = *b;
+	return 0;
+}
+
+// cuts the code in blocks, once it's all been walked
+static int
+_avr_cfg_blocks(
+		avr_t * avr,
+		avr_cfg_t * cfg)
+{
+	uint32_t size = 0;
+
+	for (uint32_t w = 0; w < cfg->words; ) {
+		if (!(cfg->map[w] & AVR_CFG_INSN)) {
+			w++;
+			continue;
+		}
+		cfg->map[w] |= AVR_CFG_LEADER;
+		avr_cfg_block_t b = { .start = w << 1, .kind = AVR_CFG_END_DATA };
+		avr_flashaddr_t target = AVR_CFG_NONE;
+		for (;;) {
+			avr_flashaddr_t pc = w << 1;
+			uint8_t kind = _avr_cfg_flow(avr, pc, &target);
+			w += avr_flash_is_wide(avr, pc) ? 2 : 1;
+			if (kind == AVR_CFG_END_IJMP) {
+				uint32_t step;
+				target = _avr_cfg_table(avr, cfg, pc, &step);
+			}
+			if (kind != AVR_CFG_END_FALL) {
+				b.kind = kind;
+				break;
+			}
+			target = AVR_CFG_NONE;
+			if (w >= cfg->words || !(cfg->map[w] & AVR_CFG_INSN))
+				break;
+			if (cfg->map[w] & AVR_CFG_LEADER) {
+				b.kind = AVR_CFG_END_FALL;
+				break;
+			}
+		}
+		b.end = w << 1;
+		b.target = target;
+		b.next = AVR_CFG_NONE;
+		switch (b.kind) {
+			case AVR_CFG_END_FALL:
+			case AVR_CFG_END_BRANCH:
+			case AVR_CFG_END_SKIP:
+			case AVR_CFG_END_CALL:
+			case AVR_CFG_END_ICALL:
+				if (w < cfg->words && (cfg->map[w] & AVR_CFG_INSN))
+					b.next = b.end;
+				break;
+		}
+		if (_avr_cfg_add_block(cfg, &size, &b))
+			return -1;
+	}
+	return 0;
+}
+
+avr_cfg_t *
+avr_cfg_build(
+		avr_t * avr)
+{
+	avr_cfg_t * cfg = calloc(1, sizeof(*cfg));
+	if (!cfg)
+		return NULL;
+	cfg->refcount = 1;
+	cfg->words = (avr->flashend + 1) >> 1;
+	cfg->map = calloc(cfg->words, 1);
+	avr_cfg_walk_t walk = { 0 };
+	if (!cfg->map)
+		goto error;
+
+	// the vector table goes up to the last vector the core knows about
+	int vectors = 1;
+	for (int i = 0; i < avr->interrupts.vector_count; i++)
+		if (avr->interrupts.vector[i]->vector >= vectors)
+			vectors = avr->interrupts.vector[i]->vector + 1;
+	for (int i = 0; i < vectors; i++)
+		_avr_cfg_push(cfg, &walk, i * avr->vector_size, AVR_CFG_VECTOR);
+	_avr_cfg_push(cfg, &walk, avr->reset_pc, AVR_CFG_VECTOR);
+
+	while (walk.count)
+		_avr_cfg_walk(avr, cfg, &walk, walk.pc[--walk.count]);
+	free(walk.pc);
+
+	// what was a target but turned out to be data isn't code
+	for (uint32_t w = 0; w < cfg->words; w++) {
+		if (!(cfg->map[w] & AVR_CFG_INSN))
+			cfg->map[w] &= AVR_CFG_CODE;
+		else if (cfg->map[w] & AVR_CFG_CALLEE)
+			cfg->callees++;
+	}
+	if (_avr_cfg_blocks(avr, cfg))
+		goto error;
+	AVR_LOG(avr, LOG_TRACE, "CFG: %u words of code in %u blocks, %u functions, "
+			"%u jump tables\n", cfg->code, cfg->block_count, cfg->callees,
+			cfg->tables);
+	return cfg;
+error:
+	AVR_LOG(avr, LOG_ERROR, "CFG: %s: out of memory\n", __func__);
+	avr_cfg_release(cfg);
+	return NULL;
+}
+
+void
+avr_cfg_release(
+		avr_cfg_t * cfg)
+{
+	if (!cfg || __atomic_sub_fetch(&cfg->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(cfg->map);
+	free(cfg->block);
+	free(cfg);
+}
+
+avr_cfg_t *
+avr_cfg_get(
+		avr_t * avr)
+{
+	if (avr->cfg)
+		return avr->cfg;
+
+	avr_flash_image_t * image = avr->flash_image;
+	avr_cfg_t * cfg = image ?
+			__atomic_load_n(&image->cfg, __ATOMIC_ACQUIRE) : NULL;
+	if (!cfg) {
+		cfg = avr_cfg_build(avr);
+		if (!cfg || !image)
+			return avr->cfg = cfg;
+		// the image keeps one for the next instances, unless one was quicker
+		avr_cfg_t * none = NULL;
+		cfg->refcount = 2;
+		if (__atomic_compare_exchange_n(&image->cfg, &none, cfg, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return avr->cfg = cfg;
+		cfg->refcount = 1;
+		avr_cfg_release(cfg);
+		cfg = none;
+	}
+	__atomic_add_fetch(&cfg->refcount, 1, __ATOMIC_RELAXED);
+	return avr->cfg = cfg;
+}
+
+void
+avr_cfg_flush(
+		avr_t * avr)
+{
+	avr_cfg_release(avr->cfg);
+	avr->cfg = NULL;
+}
+
+avr_cfg_block_t *
+avr_cfg_block_find(
+		avr_cfg_t * cfg,
+		avr_flashaddr_t pc)
+{
+	uint32_t lo = 0, hi = cfg->block_count;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (pc < cfg->block[mid].start)
+			hi = mid;
+		else if (pc >= cfg->block[mid].end)
+			lo = mid + 1;
+		else
+			return cfg->block + mid;
+	}
+	return NULL;
+}
+
+int
+avr_cfg_write(
+		avr_cfg_t * cfg,
+		const char * filename)
+{
+	static const char * const kind[] = {
+		[AVR_CFG_END_FALL] = "fall", [AVR_CFG_END_BRANCH] = "branch",
+		[AVR_CFG_END_SKIP] = "skip", [AVR_CFG_END_JUMP] = "jump",
+		[AVR_CFG_END_CALL] = "call", [AVR_CFG_END_ICALL] = "icall",
+		[AVR_CFG_END_IJMP] = "ijmp", [AVR_CFG_END_RET] = "ret",
+		[AVR_CFG_END_DATA] = "data",
+	};
+	FILE * out = fopen(filename, "w");
+	if (!out) {
+		perror(filename);
+		return -1;
+	}
+	// start end kind [next] [target], in bytes, with the entry flags
+	for (uint32_t i = 0; i < cfg->block_count; i++) {
+		avr_cfg_block_t * b = cfg->block + i;
+		uint8_t f = cfg->map[b->start >> 1];
+		fprintf(out, "%06x %06x %s", b->start, b->end, kind[b->kind]);
+		if (b->next != AVR_CFG_NONE)
+			fprintf(out, " next=%06x", b->next);
+		if (b->target != AVR_CFG_NONE)
+			fprintf(out, " target=%06x", b->target);
+		fprintf(out, "%s%s%s\n",
+				f & AVR_CFG_VECTOR ? " vector" : "",
+				f & AVR_CFG_CALLEE ? " function" : "",
+				f & AVR_CFG_TABLE ? " table" : "");
+	}
+	fclose(out);
+	return 0;
+}
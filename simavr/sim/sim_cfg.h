@@ -0,0 +1,135 @@
+/*
+	sim_cfg.h
+
+	Static control flow analysis of the flash: basic blocks, calls,
+	vectors and jump tables, and which words are code or data.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_CFG_H__
+#define __SIM_CFG_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The flash is walked from the reset and interrupt vectors, following
+ * every branch, skip, jump and call, as a disassembler would. Whatever
+ * is reached is code, the rest is data. Jump tables of RJMP/JMP indexed
+ * with SUBI/SBCI on Z before an IJMP are followed too; code only reached
+ * through a pointer (ICALL of a function pointer, tables of addresses in
+ * flash) can't be found this way, and is seen as data.
+ *
+ * The analysis is shared: avr_cfg_get() builds it the first time it's
+ * needed, and it's kept until the flash changes, for all the instances
+ * sharing that flash (see avr_flash_share()).
+ */
+#define AVR_CFG_NONE	((avr_flashaddr_t)~0)
+
+// flags of each flash word
+enum {
+	AVR_CFG_CODE	= (1 << 0),	// part of an instruction that is reached
+	AVR_CFG_INSN	= (1 << 1),	// and its first word
+	AVR_CFG_LEADER	= (1 << 2),	// first instruction of a block
+	AVR_CFG_CALLEE	= (1 << 3),	// called, a function entry
+	AVR_CFG_VECTOR	= (1 << 4),	// reset or interrupt vector
+	AVR_CFG_TABLE	= (1 << 5),	// entry of a jump table
+};
+
+// how a block ends
+enum {
+	AVR_CFG_END_FALL = 0,	// runs into the block at 'next'
+	AVR_CFG_END_BRANCH,		// branches to 'target', or goes on to 'next'
+	AVR_CFG_END_SKIP,		// skips to 'target', or goes on to 'next'
+	AVR_CFG_END_JUMP,		// RJMP/JMP to 'target'
+	AVR_CFG_END_CALL,		// RCALL/CALL to 'target', returns to 'next'
+	AVR_CFG_END_ICALL,		// ICALL/EICALL, returns to 'next'
+	AVR_CFG_END_IJMP,		// IJMP/EIJMP, 'target' is the jump table, if found
+	AVR_CFG_END_RET,		// RET/RETI
+	AVR_CFG_END_DATA,		// runs into data, or off the end of the flash
+};
+
+typedef struct avr_cfg_block_t {
+	avr_flashaddr_t	start;		// in bytes
+	avr_flashaddr_t	end;		// past its last instruction
+	avr_flashaddr_t	next;		// AVR_CFG_NONE if the flow can't go on
+	avr_flashaddr_t	target;		// AVR_CFG_NONE if there isn't one
+	uint8_t			kind;		// AVR_CFG_END_*
+} avr_cfg_block_t;
+
+typedef struct avr_cfg_t {
+	uint32_t			words;		// size of the flash, in words
+	uint8_t *			map;		// AVR_CFG_* flags of each word
+	avr_cfg_block_t *	block;		// sorted by address
+	uint32_t			block_count;
+	uint32_t			code;		// words of code
+	uint32_t			callees, tables;
+	int					refcount;	// atomic
+} avr_cfg_t;
+
+/*
+ * Returns the analysis of the current flash of 'avr', building it if
+ * needed, or NULL if it can't be allocated. It belongs to 'avr', and is
+ * valid until the flash changes.
+ */
+avr_cfg_t *
+avr_cfg_get(
+		struct avr_t * avr );
+/*
+ * Builds a new analysis of the flash of 'avr', that the caller releases
+ */
+avr_cfg_t *
+avr_cfg_build(
+		struct avr_t * avr );
+void
+avr_cfg_release(
+		avr_cfg_t * cfg );
+// called by the core when the flash changes
+void
+avr_cfg_flush(
+		struct avr_t * avr );
+
+// returns the block 'pc' is in, or NULL if it's not code
+avr_cfg_block_t *
+avr_cfg_block_find(
+		avr_cfg_t * cfg,
+		avr_flashaddr_t pc );
+
+// writes one line per block, and its successors
+int
+avr_cfg_write(
+		avr_cfg_t * cfg,
+		const char * filename );
+
+// 1 if an instruction starts at 'pc'
+static inline int
+avr_cfg_is_insn(
+		avr_cfg_t * cfg,
+		avr_flashaddr_t pc )
+{
+	return (pc >> 1) < cfg->words && (cfg->map[pc >> 1] & AVR_CFG_INSN);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_CFG_H__ */
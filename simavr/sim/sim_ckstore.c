@@ -0,0 +1,526 @@
+/*
+	sim_ckstore.c
+
+	Keeps many snapshots in memory, cut in chunks that are shared between
+	them and compressed.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "sim_ckstore.h"
+#include "sim_aio.h"
+
+#define AVR_CKSTORE_VERSION		1
+
+static uint64_t
+_avr_ckstore_hash(
+		const uint8_t * p,
+		uint32_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ len;
+	uint32_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, p + i, 8);
+		h = (h ^ v) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	return h ^ (h >> 32);
+}
+
+// gets chunk 'c' back into 'out', which is at least c->len long
+static int
+_avr_ckstore_inflate(
+		avr_ckstore_chunk_t * c,
+		uint8_t * out)
+{
+	if (c->clen == c->len) {
+		memcpy(out, c->data, c->len);
+		return 0;
+	}
+	uLongf len = c->len;
+	if (uncompress(out, &len, c->data, c->clen) != Z_OK || len != c->len)
+		return -1;
+	return 0;
+}
+
+static int
+_avr_ckstore_rehash(
+		avr_ckstore_t * st,
+		uint32_t count)
+{
+	uint32_t * b = calloc(count, sizeof(*b));
+	if (!b)
+		return -1;
+	for (uint32_t i = 0; i < st->chunks; i++) {
+		avr_ckstore_chunk_t * c = st->chunk + i;
+		if (!c->refs)
+			continue;
+		uint32_t h = c->hash & (count - 1);
+		c->next = b[h];
+		b[h] = i + 1;
+	}
+	free(st->bucket);
+	st->bucket = b;
+	st->bucket_count = count;
+	return 0;
+}
+
+static avr_ckstore_chunk_t *
+_avr_ckstore_slot(
+		avr_ckstore_t * st,
+		uint32_t * index)
+{
+	if (st->free_chunk) {
+		*index = st->free_chunk - 1;
+		st->free_chunk = st->chunk[*index].next;
+		return st->chunk + *index;
+	}
+	if (st->chunks == st->chunk_alloc) {
+		uint32_t alloc = st->chunk_alloc ? st->chunk_alloc * 2 : 256;
+		avr_ckstore_chunk_t * n = realloc(st->chunk, alloc * sizeof(*n));
+		if (!n)
+			return NULL;
+		st->chunk = n;
+		st->chunk_alloc = alloc;
+	}
+	*index = st->chunks++;
+	return st->chunk + *index;
+}
+
+static void
+_avr_ckstore_link(
+		avr_ckstore_t * st,
+		uint32_t index)
+{
+	avr_ckstore_chunk_t * c = st->chunk + index;
+	uint32_t h = c->hash & (st->bucket_count - 1);
+	c->next = st->bucket[h];
+	st->bucket[h] = index + 1;
+	st->unique++;
+	st->unique_bytes += c->len;
+	st->stored += c->clen;
+}
+
+// returns the index of the chunk holding 'p', shared or new, or -1
+static int64_t
+_avr_ckstore_chunk(
+		avr_ckstore_t * st,
+		const uint8_t * p,
+		uint32_t len)
+{
+	uint64_t hash = _avr_ckstore_hash(p, len);
+
+	for (uint32_t i = st->bucket[hash & (st->bucket_count - 1)]; i;
+			i = st->chunk[i - 1].next) {
+		avr_ckstore_chunk_t * c = st->chunk + i - 1;
+		if (c->hash != hash || c->len != len)
+			continue;
+		// a hash isn't proof, it's compared whole
+		if (c->clen == c->len ? memcmp(c->data, p, len) :
+				_avr_ckstore_inflate(c, st->tmp) || memcmp(st->tmp, p, len))
+			continue;
+		c->refs++;
+		return i - 1;
+	}
+	if (st->unique >= st->bucket_count &&
+			_avr_ckstore_rehash(st, st->bucket_count * 2))
+		return -1;
+
+	uint8_t * data = NULL;
+	uLongf clen = compressBound(len);
+	if (st->level && compress2(st->tmp, &clen, p, len, st->level) == Z_OK &&
+			clen < len) {
+		if ((data = malloc(clen)))
+			memcpy(data, st->tmp, clen);
+	} else if ((data = malloc(len ? len : 1))) {
+		memcpy(data, p, len);
+		clen = len;
+	}
+	uint32_t index;
+	avr_ckstore_chunk_t * c = data ? _avr_ckstore_slot(st, &index) : NULL;
+	if (!c) {
+		free(data);
+		return -1;
+	}
+	*c = (avr_ckstore_chunk_t) {
+		.hash = hash, .data = data, .len = len, .clen = clen, .refs = 1 };
+	_avr_ckstore_link(st, index);
+	return index;
+}
+
+static void
+_avr_ckstore_release(
+		avr_ckstore_t * st,
+		uint32_t index)
+{
+	avr_ckstore_chunk_t * c = st->chunk + index;
+
+	if (--c->refs)
+		return;
+	uint32_t * link = &st->bucket[c->hash & (st->bucket_count - 1)];
+	while (*link != index + 1)
+		link = &st->chunk[*link - 1].next;
+	*link = c->next;
+	st->unique--;
+	st->unique_bytes -= c->len;
+	st->stored -= c->clen;
+	free(c->data);
+	c->data = NULL;
+	c->next = st->free_chunk;
+	st->free_chunk = index + 1;
+}
+
+avr_ckstore_t *
+avr_ckstore_new(
+		uint32_t chunk_size,
+		int level)
+{
+	avr_ckstore_t * st = calloc(1, sizeof(*st));
+
+	if (!st)
+		return NULL;
+	st->chunk_size = chunk_size ? chunk_size : AVR_CKSTORE_CHUNK;
+	st->level = level < 0 ? Z_DEFAULT_COMPRESSION :
+			level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level;
+	st->tmp = malloc(compressBound(st->chunk_size));
+	if (!st->tmp || _avr_ckstore_rehash(st, 256)) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s: out of memory\n", __func__);
+		avr_ckstore_free(st);
+		return NULL;
+	}
+	return st;
+}
+
+static avr_ckstore_ck_t *
+_avr_ckstore_new_ck(
+		avr_ckstore_t * st,
+		uint32_t count)
+{
+	if (st->cks == st->ck_alloc) {
+		uint32_t alloc = st->ck_alloc ? st->ck_alloc * 2 : 64;
+		avr_ckstore_ck_t * n = realloc(st->ck, alloc * sizeof(*n));
+		if (!n)
+			return NULL;
+		st->ck = n;
+		st->ck_alloc = alloc;
+	}
+	avr_ckstore_ck_t * ck = st->ck + st->cks;
+	memset(ck, 0, sizeof(*ck));
+	if (!(ck->chunk = malloc((count ? count : 1) * sizeof(uint32_t))))
+		return NULL;
+	ck->count = count;
+	st->cks++;
+	st->live++;
+	return ck;
+}
+
+int
+avr_ckstore_put(
+		avr_ckstore_t * st,
+		const avr_snapshot_t * s,
+		void * owner)
+{
+	uint32_t count = (s->len + st->chunk_size - 1) / st->chunk_size;
+	avr_ckstore_ck_t * ck = _avr_ckstore_new_ck(st, count);
+
+	if (!ck) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s: out of memory\n", __func__);
+		return -1;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t off = i * st->chunk_size;
+		uint32_t len = s->len - off < st->chunk_size ?
+				s->len - off : st->chunk_size;
+		int64_t c = _avr_ckstore_chunk(st, s->buf + off, len);
+		if (c < 0) {
+			AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s: out of memory\n", __func__);
+			ck->count = i;
+			avr_ckstore_drop(st, st->cks - 1);
+			return -1;
+		}
+		ck->chunk[i] = c;
+	}
+	ck->len = s->len;
+	ck->id = s->id;
+	ck->owner = owner;
+	st->raw += s->len;
+	return st->cks - 1;
+}
+
+static avr_ckstore_ck_t *
+_avr_ckstore_ck(
+		avr_ckstore_t * st,
+		int ck)
+{
+	if (ck < 0 || (uint32_t)ck >= st->cks || !st->ck[ck].chunk)
+		return NULL;
+	return st->ck + ck;
+}
+
+avr_snapshot_t *
+avr_ckstore_get(
+		avr_ckstore_t * st,
+		int index)
+{
+	avr_ckstore_ck_t * ck = _avr_ckstore_ck(st, index);
+	if (!ck) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: no checkpoint %d\n", index);
+		return NULL;
+	}
+	avr_snapshot_t * s = calloc(1, sizeof(*s));
+	if (s)
+		s->buf = malloc(ck->len ? ck->len : 1);
+	if (!s || !s->buf) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s: out of memory\n", __func__);
+		avr_snapshot_free(s);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < ck->count; i++)
+		if (_avr_ckstore_inflate(st->chunk + ck->chunk[i],
+				s->buf + i * st->chunk_size)) {
+			AVR_LOG(NULL, LOG_ERROR, "CKSTORE: checkpoint %d is corrupted\n",
+					index);
+			avr_snapshot_free(s);
+			return NULL;
+		}
+	s->size = s->len = ck->len;
+	s->id = ck->id;
+	return s;
+}
+
+void *
+avr_ckstore_owner(
+		avr_ckstore_t * st,
+		int index)
+{
+	avr_ckstore_ck_t * ck = _avr_ckstore_ck(st, index);
+	return ck ? ck->owner : NULL;
+}
+
+void
+avr_ckstore_drop(
+		avr_ckstore_t * st,
+		int index)
+{
+	avr_ckstore_ck_t * ck = _avr_ckstore_ck(st, index);
+	if (!ck)
+		return;
+	for (uint32_t i = 0; i < ck->count; i++)
+		_avr_ckstore_release(st, ck->chunk[i]);
+	free(ck->chunk);
+	ck->chunk = NULL;
+	st->raw -= ck->len;
+	st->live--;
+}
+
+void
+avr_ckstore_drop_owner(
+		avr_ckstore_t * st,
+		void * owner)
+{
+	for (uint32_t i = 0; i < st->cks; i++)
+		if (st->ck[i].chunk && st->ck[i].owner == owner)
+			avr_ckstore_drop(st, i);
+}
+
+typedef struct _avr_ckstore_file_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	chunk_size;
+	uint32_t	chunks;		// including the free slots, with a zero len
+	uint32_t	cks;
+} _avr_ckstore_file_t;
+
+int
+avr_ckstore_write(
+		avr_ckstore_t * st,
+		const char * path)
+{
+	FILE * f = avr_aio_fopen(path, "wb");
+	if (!f) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: can't create %s\n", path);
+		return -1;
+	}
+	_avr_ckstore_file_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AVR_CKSTORE_FILE_MAGIC, sizeof(h.magic));
+	h.version = AVR_CKSTORE_VERSION;
+	h.chunk_size = st->chunk_size;
+	h.chunks = st->chunks;
+	h.cks = st->cks;
+	int res = fwrite(&h, sizeof(h), 1, f) == 1;
+	for (uint32_t i = 0; i < st->chunks && res; i++) {
+		avr_ckstore_chunk_t * c = st->chunk + i;
+		uint32_t l[2] = { c->refs ? c->len : 0, c->refs ? c->clen : 0 };
+		res = fwrite(l, sizeof(l), 1, f) == 1 &&
+				fwrite(c->data, 1, l[1], f) == l[1];
+	}
+	for (uint32_t i = 0; i < st->cks && res; i++) {
+		avr_ckstore_ck_t * ck = st->ck + i;
+		uint32_t l[2] = { ck->chunk ? ck->len : 0, ck->chunk ? ck->count : 0 };
+		res = fwrite(l, sizeof(l), 1, f) == 1 &&
+				fwrite(ck->chunk, sizeof(uint32_t), l[1], f) == l[1];
+		// dropped ones are kept, with a zero len, so the numbers stay
+		if (res && !ck->chunk)
+			res = fputc(0, f) != EOF;
+		else if (res)
+			res = fputc(1, f) != EOF;
+	}
+	if (fclose(f) || !res) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: can't write %s\n", path);
+		remove(path);
+		return -1;
+	}
+	return 0;
+}
+
+avr_ckstore_t *
+avr_ckstore_read(
+		const char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: can't open %s\n", path);
+		return NULL;
+	}
+	_avr_ckstore_file_t h;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+			memcmp(h.magic, AVR_CKSTORE_FILE_MAGIC, sizeof(h.magic)) ||
+			h.version != AVR_CKSTORE_VERSION || !h.chunk_size) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s isn't a store of this version\n",
+				path);
+		fclose(f);
+		return NULL;
+	}
+	avr_ckstore_t * st = avr_ckstore_new(h.chunk_size, -1);
+	int res = st != NULL;
+	for (uint32_t i = 0; i < h.chunks && res; i++) {
+		uint32_t l[2], index;
+		avr_ckstore_chunk_t * c;
+		res = fread(l, sizeof(l), 1, f) == 1 && l[0] <= h.chunk_size &&
+				l[1] <= compressBound(l[0]) &&
+				(c = _avr_ckstore_slot(st, &index)) != NULL;
+		if (!res)
+			break;
+		// the free ones are chained back once the checkpoints are in
+		*c = (avr_ckstore_chunk_t) { .len = l[0], .clen = l[1] };
+		res = (c->data = malloc(l[1] ? l[1] : 1)) &&
+				fread(c->data, 1, l[1], f) == l[1];
+	}
+	for (uint32_t i = 0; i < h.cks && res; i++) {
+		uint32_t l[2];
+		avr_ckstore_ck_t * ck;
+		res = fread(l, sizeof(l), 1, f) == 1 &&
+				(ck = _avr_ckstore_new_ck(st, l[1])) != NULL;
+		if (!res)
+			break;
+		ck->len = l[0];
+		res = fread(ck->chunk, sizeof(uint32_t), l[1], f) == l[1];
+		uint32_t end = 0;
+		for (uint32_t c = 0; c < l[1] && res; c++) {
+			res = ck->chunk[c] < st->chunks && st->chunk[ck->chunk[c]].len;
+			if (res)
+				end += st->chunk[ck->chunk[c]].len;
+		}
+		int used = fgetc(f);
+		res = res && used != EOF && (used ? end == l[0] : !l[1]);
+		if (!res) {
+			ck->count = 0;
+			continue;
+		}
+		for (uint32_t c = 0; c < l[1]; c++)
+			st->chunk[ck->chunk[c]].refs++;
+		st->raw += ck->len;
+		if (!used) {
+			free(ck->chunk);
+			ck->chunk = NULL;
+			st->live--;
+		}
+	}
+	fclose(f);
+	if (!res) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: can't read %s\n", path);
+		avr_ckstore_free(st);
+		return NULL;
+	}
+	// the hashes are made again, so a new put can share these chunks
+	uint8_t * buf = malloc(st->chunk_size);
+	for (uint32_t i = st->chunks; i-- > 0 && buf;) {
+		avr_ckstore_chunk_t * c = st->chunk + i;
+		if (!c->refs) {
+			free(c->data);
+			c->data = NULL;
+			c->next = st->free_chunk;
+			st->free_chunk = i + 1;
+		} else if (_avr_ckstore_inflate(c, buf) == 0) {
+			c->hash = _avr_ckstore_hash(buf, c->len);
+			st->unique++;
+			st->unique_bytes += c->len;
+			st->stored += c->clen;
+		} else {
+			AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s is corrupted\n", path);
+			free(buf);
+			avr_ckstore_free(st);
+			return NULL;
+		}
+	}
+	uint32_t count = st->bucket_count;
+	while (count < st->unique)
+		count *= 2;
+	if (!buf || _avr_ckstore_rehash(st, count)) {
+		AVR_LOG(NULL, LOG_ERROR, "CKSTORE: %s: out of memory\n", __func__);
+		free(buf);
+		avr_ckstore_free(st);
+		return NULL;
+	}
+	free(buf);
+	return st;
+}
+
+void
+avr_ckstore_report(
+		avr_ckstore_t * st,
+		FILE * out)
+{
+	fprintf(out, "checkpoints %u raw %llu chunks %u unique %llu stored %llu\n",
+			st->live, (unsigned long long)st->raw, st->unique,
+			(unsigned long long)st->unique_bytes,
+			(unsigned long long)st->stored);
+}
+
+void
+avr_ckstore_free(
+		avr_ckstore_t * st)
+{
+	if (!st)
+		return;
+	for (uint32_t i = 0; i < st->chunks; i++)
+		free(st->chunk[i].data);
+	for (uint32_t i = 0; i < st->cks; i++)
+		free(st->ck[i].chunk);
+	free(st->chunk);
+	free(st->ck);
+	free(st->bucket);
+	free(st->tmp);
+	free(st);
+}
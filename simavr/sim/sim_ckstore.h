@@ -0,0 +1,153 @@
+/*
+	sim_ckstore.h
+
+	Keeps many snapshots in memory, cut in chunks that are shared between
+	them and compressed.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_CKSTORE_H__
+#define __SIM_CKSTORE_H__
+
+#include <stdio.h>
+#include "sim_snapshot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The snapshots of a run taken every so often, or of the instances of a
+ * farm running the same firmware, are mostly the same bytes: the flash is
+ * the bulk of it and rarely changes, much of the SRAM stays as the startup
+ * code left it. A snapshot lays out the core, then the data space, then
+ * the flash, at offsets that only depend on the core; the variable parts
+ * (timers, io modules) come after. So cutting the buffer in fixed size
+ * chunks lines the same memory up with the same chunks from one snapshot
+ * to the next, without a content defined cut.
+ *
+ * Each chunk is kept once, deflated with zlib, with a count of the
+ * checkpoints using it; a chunk that doesn't shrink is kept as it is. Two
+ * chunks with the same hash are compared whole before being shared.
+ *
+ * A checkpoint is only a list of chunks, getting it back inflates them
+ * into a new snapshot, with the id it had when saved: restoring it into
+ * the instance it came from, while it's still the last one taken or
+ * restored, only copies the dirty pages back. It's still bound to that
+ * instance, like any snapshot (see sim_snapshot.h).
+ */
+#define AVR_CKSTORE_CHUNK	1024	// bytes, by default
+#define AVR_CKSTORE_FILE_MAGIC	"simavrCS"
+
+typedef struct avr_ckstore_chunk_t {
+	uint64_t		hash;
+	uint8_t *		data;		// deflated, unless clen == len
+	uint32_t		len, clen;
+	uint32_t		refs;		// 0 when the slot is free
+	uint32_t		next;		// in its hash bucket, index + 1
+} avr_ckstore_chunk_t;
+
+typedef struct avr_ckstore_ck_t {
+	uint32_t *		chunk;		// NULL when it was dropped
+	uint32_t		count;
+	uint32_t		len;		// of the snapshot
+	uint32_t		id;			// of the snapshot
+	void *			owner;
+} avr_ckstore_ck_t;
+
+typedef struct avr_ckstore_t {
+	uint32_t		chunk_size;
+	int				level;		// of zlib
+	avr_ckstore_chunk_t * chunk;
+	uint32_t		chunks, chunk_alloc;
+	uint32_t		free_chunk;	// a chain through 'next', index + 1
+	uint32_t *		bucket;		// index + 1
+	uint32_t		bucket_count;	// a power of two
+	avr_ckstore_ck_t * ck;
+	uint32_t		cks, ck_alloc;
+	// counters
+	uint32_t		live;		// checkpoints not dropped
+	uint32_t		unique;		// chunks in use
+	uint64_t		raw;		// bytes of the live checkpoints
+	uint64_t		unique_bytes, stored;	// of the chunks, before and after
+	uint8_t *		tmp;		// for deflate and compare
+} avr_ckstore_t;
+
+/*
+ * Returns a new store, with chunks of 'chunk_size' bytes (0 for the
+ * default) compressed with 'level' (-1 for zlib's default, 0 for none)
+ */
+avr_ckstore_t *
+avr_ckstore_new(
+		uint32_t chunk_size,
+		int level );
+/*
+ * Adds a copy of snapshot 's'. 'owner' is anything to tell whose it is,
+ * see avr_ckstore_drop_owner(). Returns the checkpoint number, or -1
+ */
+int
+avr_ckstore_put(
+		avr_ckstore_t * st,
+		const avr_snapshot_t * s,
+		void * owner );
+// returns a new snapshot of checkpoint 'ck', or NULL
+avr_snapshot_t *
+avr_ckstore_get(
+		avr_ckstore_t * st,
+		int ck );
+// returns the owner of checkpoint 'ck', NULL if there's no such one
+void *
+avr_ckstore_owner(
+		avr_ckstore_t * st,
+		int ck );
+// releases checkpoint 'ck', and the chunks nothing else uses
+void
+avr_ckstore_drop(
+		avr_ckstore_t * st,
+		int ck );
+// drops all the checkpoints of 'owner'
+void
+avr_ckstore_drop_owner(
+		avr_ckstore_t * st,
+		void * owner );
+/*
+ * The whole store in a file, "simavrCS" then the chunks and checkpoints,
+ * in the byte order of the host. They keep their numbers, the dropped
+ * ones included; the owners are lost, and so are the snapshot ids, the
+ * process that reads it has its own tracking. Both return 0/NULL on error
+ */
+int
+avr_ckstore_write(
+		avr_ckstore_t * st,
+		const char * path );
+avr_ckstore_t *
+avr_ckstore_read(
+		const char * path );
+// prints the counters, and the bytes they take, in one line
+void
+avr_ckstore_report(
+		avr_ckstore_t * st,
+		FILE * out );
+void
+avr_ckstore_free(
+		avr_ckstore_t * st );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_CKSTORE_H__ */
@@ -25,6 +25,7 @@
 #include "sim_avr.h"
 #include "sim_cmds.h"
 #include "sim_vcd_file.h"
+#include "sim_regions.h"
 #include "avr_uart.h"
 #include "avr/avr_mcu_section.h"
 
@@ -143,9 +144,13 @@ _simavr_cmd_vcd_start_trace(
 		uint8_t v,
 		void * param)
 {
-	if (avr->vcd)
-		avr_vcd_start(avr->vcd);
-
+	if (avr->vcd) {
+		// in trigger mode, it only opens the window
+		if (!avr->vcd->capture || !avr->vcd->output)
+			avr_vcd_start(avr->vcd);
+		if (avr->vcd->capture)
+			avr_vcd_trigger(avr->vcd);
+	}
 	return 0;
 }
 
@@ -180,6 +185,62 @@ _simavr_cmd_uart_loopback(
 	return 0;
 }
 
+/*
+ * The timing commands are followed by their id; the first call, with the
+ * code, is the one with nothing pending yet.
+ */
+static int
+_simavr_cmd_region_begin(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	if (!avr->commands.pending)
+		return 1;
+	avr_region_begin(avr, v);
+	return 0;
+}
+
+static int
+_simavr_cmd_region_end(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	avr_regions_t * r = avr_regions_get(avr, 1);
+	if (!r)
+		return 0;
+	// timed up to its code, the same as the begin is from its id
+	if (!avr->commands.pending) {
+		r->end = avr->cycle;
+		return 1;
+	}
+	avr_region_end(avr, v, r->end);
+	return 0;
+}
+
+static int
+_simavr_cmd_cycle_mark(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	if (!avr->commands.pending)
+		return 1;
+	avr_cycle_mark(avr, v);
+	return 0;
+}
+
+static int
+_simavr_cmd_checkpoint(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	avr_checkpoint_request(avr);
+	return 0;
+}
+
 void
 avr_cmd_init(
 		avr_t * avr)
@@ -190,4 +251,8 @@ avr_cmd_init(
 	avr_cmd_register(avr, SIMAVR_CMD_VCD_START_TRACE, &_simavr_cmd_vcd_start_trace, NULL);
 	avr_cmd_register(avr, SIMAVR_CMD_VCD_STOP_TRACE, &_simavr_cmd_vcd_stop_trace, NULL);
 	avr_cmd_register(avr, SIMAVR_CMD_UART_LOOPBACK, &_simavr_cmd_uart_loopback, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_REGION_BEGIN, &_simavr_cmd_region_begin, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_REGION_END, &_simavr_cmd_region_end, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_CYCLE_MARK, &_simavr_cmd_cycle_mark, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_CHECKPOINT, &_simavr_cmd_checkpoint, NULL);
 }
@@ -19,13 +19,34 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		// for dl_iterate_phdr()
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef __linux__
+#include <link.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_callgraph.h"
+#include "sim_intrinsics.h"
+#include "sim_coverage.h"
+#include "sim_lcov.h"
+#include "sim_tier.h"
+#include "sim_heatmap.h"
+#include "sim_trace_file.h"
+#include "sim_stats.h"
+#include "sim_snapshot.h"
+#include "sim_postmortem.h"
+#include "sim_guard.h"
+#include "sim_cfg.h"
 #include "avr_flash.h"
 #include "avr_watchdog.h"
 
@@ -45,39 +66,27 @@ const char * _sreg_bit_name = "cznvshti";
 #define REG_ISTOUCHED(a, r) ((a)->trace_data->touched[(r) >> 5] & (1 << ((r) & 0x1f)))
 
 /*
- * This allows a "special case" to skip instruction tracing when in these
- * symbols since printf() is useful to have, but generates a lot of cycles.
+ * The filter (see avr_trace_filter()) is a bit per flash word, so the
+ * symbol is only looked up for the instructions that are printed
  */
-int dont_trace(const char * name)
-{
-	return (
-		!strcmp(name, "uart_putchar") ||
-		!strcmp(name, "fputc") ||
-		!strcmp(name, "printf") ||
-		!strcmp(name, "vfprintf") ||
-		!strcmp(name, "__ultoa_invert") ||
-		!strcmp(name, "__prologue_saves__") ||
-		!strcmp(name, "__epilogue_restores__"));
-}
-
-int donttrace = 0;
-
 #define STATE(_f, args...) { \
 	if (avr->trace) {\
-		if (avr->trace_data->codeline && avr->trace_data->codeline[avr->pc>>1]) {\
-			const char * symn = avr->trace_data->codeline[avr->pc>>1]->symbol; \
-			int dont = 0 && dont_trace(symn);\
-			if (dont!=donttrace) { \
-				donttrace = dont;\
-				DUMP_REG();\
-			}\
-			if (donttrace==0)\
-				printf("%04x: %-25s " _f, avr->pc, symn, ## args);\
-		} else \
-			printf("%s: %04x: " _f, __FUNCTION__, avr->pc, ## args);\
+		int dont = !avr_trace_wanted(avr, avr->pc);\
+		if (dont != avr->trace_data->donttrace) { \
+			avr->trace_data->donttrace = dont;\
+			DUMP_REG();\
 		}\
-	}
-#define SREG() if (avr->trace && donttrace == 0) {\
+		if (!dont) {\
+			avr_symbol_t * sym = avr_symbol_find(avr->trace_data->symbol, \
+					avr->trace_data->symbolcount, avr->pc); \
+			if (sym) \
+				printf("%04x: %-25s " _f, avr->pc, sym->symbol, ## args);\
+			else \
+				printf("%s: %04x: " _f, __FUNCTION__, avr->pc, ## args);\
+		}\
+	}\
+}
+#define SREG() if (avr->trace && avr->trace_data->donttrace == 0) {\
 	printf("%04x: \t\t\t\t\t\t\t\t\tSREG = ", avr->pc); \
 	for (int _sbi = 0; _sbi < 8; _sbi++)\
 		printf("%c", avr->sreg[_sbi] ? toupper(_sreg_bit_name[_sbi]) : '.');\
@@ -86,13 +95,14 @@ int donttrace = 0;
 
 void crash(avr_t* avr)
 {
+	avr_sreg_materialize(avr);
 	DUMP_REG();
 	printf("*** CYCLE %" PRI_avr_cycle_count "PC %04x\n", avr->cycle, avr->pc);
 
 	for (int i = OLD_PC_SIZE-1; i > 0; i--) {
 		int pci = (avr->trace_data->old_pci + i) & 0xf;
 		printf(FONT_RED "*** %04x: %-25s RESET -%d; sp %04x\n" FONT_DEFAULT,
-				avr->trace_data->old[pci].pc, avr->trace_data->codeline ? avr->trace_data->codeline[avr->trace_data->old[pci].pc>>1]->symbol : "unknown", OLD_PC_SIZE-i, avr->trace_data->old[pci].sp);
+				avr->trace_data->old[pci].pc, avr_trace_symbol(avr, avr->trace_data->old[pci].pc), OLD_PC_SIZE-i, avr->trace_data->old[pci].sp);
 	}
 
 	printf("Stack Ptr %04x/%04x = %d \n", _avr_sp_get(avr), avr->ramend, avr->ramend - _avr_sp_get(avr));
@@ -108,6 +118,7 @@ void crash(avr_t* avr)
 
 void crash(avr_t* avr)
 {
+	avr_sreg_materialize(avr);
 	avr_sadly_crashed(avr, 0);
 
 }
@@ -123,6 +134,7 @@ _avr_flash_read16le(
 
 void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 {
+#if !CONFIG_SIMAVR_GUARD_PAGES
 	if (addr > avr->ramend) {
 		AVR_LOG(avr, LOG_ERROR, FONT_RED
 				"CORE: *** Invalid write address "
@@ -131,6 +143,7 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 				avr->pc, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc), addr, v);
 		crash(avr);
 	}
+#endif
 	if (addr < 32) {
 		AVR_LOG(avr, LOG_ERROR, FONT_RED
 				"CORE: *** Invalid write address PC=%04x SP=%04x O=%04x Address %04x=%02x low registers\n"
@@ -151,15 +164,21 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 	}
 #endif
 
-	if (avr->gdb) {
+	if (unlikely(avr->gdb_watch) && (avr->gdb_watch[addr] & AVR_GDB_WATCH_WRITE))
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
-	}
-
+	if (unlikely(avr->heatmap))
+		avr_heatmap_write(avr->heatmap, addr);
+	if (unlikely(avr->trace_file))
+		avr_trace_file_write(avr->trace_file, addr, v);
+	// before the dirty map, that's only ramend long, faults on a guard page
 	avr->data[addr] = v;
+	if (unlikely(avr->dirty.data))
+		avr_dirty_mark(avr->dirty.data, addr, 1);
 }
 
 uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 {
+#if !CONFIG_SIMAVR_GUARD_PAGES
 	if (addr > avr->ramend) {
 		AVR_LOG(avr, LOG_ERROR, FONT_RED
 				"CORE: *** Invalid read address "
@@ -168,10 +187,12 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 				avr->pc, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc), addr, avr->ramend);
 		crash(avr);
 	}
+#endif
 
-	if (avr->gdb) {
+	if (unlikely(avr->gdb_watch) && (avr->gdb_watch[addr] & AVR_GDB_WATCH_READ))
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_READ);
-	}
+	if (unlikely(avr->heatmap))
+		avr_heatmap_read(avr->heatmap, addr);
 
 	return avr->data[addr];
 }
@@ -185,6 +206,11 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 {
 	REG_TOUCH(avr, r);
 
+	// plain register, no SREG split or callbacks
+	if (likely(!(avr->io_hook[r] & (AVR_IO_HOOK_WRITE | AVR_IO_HOOK_IRQ)))) {
+		avr->data[r] = v;
+		return;
+	}
 	if (r == R_SREG) {
 		avr->data[R_SREG] = v;
 		// unsplit the SREG
@@ -193,15 +219,18 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 	}
 	if (r > 31) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(r);
-		if (avr->io[io].w.c)
+		// the cached reads may depend on it
+		avr->io_epoch++;
+		if (unlikely(avr->io[io].lazy))
+			_avr_io_lazy_access(avr, io);
+		if (avr->io[io].w.c) {
+			if (unlikely(avr->stats))
+				avr->stats->io_write[io]++;
 			avr->io[io].w.c(avr, r, v, avr->io[io].w.param);
-		else
+		} else
 			avr->data[r] = v;
-		if (avr->io[io].irq) {
-			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);
-		}
+		if (avr->io[io].irq)
+			avr_iomem_raise_irq(avr->io[io].irq, v);
 	} else
 		avr->data[r] = v;
 }
@@ -236,6 +265,16 @@ inline uint16_t _avr_sp_get(avr_t * avr)
 
 inline void _avr_sp_set(avr_t * avr, uint16_t sp)
 {
+	if (unlikely(avr->heatmap))
+		avr_heatmap_sp(avr->heatmap, sp);
+	// nothing to call for SPL/SPH, unless something was hooked there
+	if (likely(!(avr->io_hook[R_SPL] | avr->io_hook[R_SPH]))) {
+		REG_TOUCH(avr, R_SPL);
+		REG_TOUCH(avr, R_SPH);
+		avr->data[R_SPL] = sp;
+		avr->data[R_SPH] = sp >> 8;
+		return;
+	}
 	_avr_set_r16le(avr, R_SPL, sp);
 }
 
@@ -244,7 +283,7 @@ inline void _avr_sp_set(avr_t * avr, uint16_t sp)
  */
 static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
 {
-	if (addr < MAX_IOs + 31)
+	if (addr < 32 + avr->io_count)
 		_avr_set_r(avr, addr, v);
 	else
 		avr_core_watch_write(avr, addr, v);
@@ -255,93 +294,229 @@ static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
  */
 static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 {
-	if (addr == R_SREG) {
-		/*
-		 * SREG is special it's reconstructed when read
-		 * while the core itself uses the "shortcut" array
-		 */
-		READ_SREG_INTO(avr, avr->data[R_SREG]);
-
-	} else if (addr > 31 && addr < 31 + MAX_IOs) {
-		avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+	// plain registers and SRAM don't need any of the checks below
+	if (addr < 32 + avr->io_count &&
+			unlikely(avr->io_hook[addr] & (AVR_IO_HOOK_READ | AVR_IO_HOOK_IRQ_READ))) {
+		if (addr == R_SREG) {
+			/*
+			 * SREG is special it's reconstructed when read
+			 * while the core itself uses the "shortcut" array
+			 */
+			READ_SREG_INTO(avr, avr->data[R_SREG]);
+		} else {
+			avr_io_addr_t io = AVR_DATA_TO_IO(addr);
 
-		if (avr->io[io].r.c)
-			avr->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
+			if (unlikely(avr->io[io].lazy))
+				_avr_io_lazy_access(avr, io);
+			uint32_t * version = avr->io[io].r.version;
+			/*
+			 * Nothing it reads changed since last time, it's in data[] already.
+			 * Irqs hooked or unhooked, what the callback raises matters again.
+			 * The version is compared on its own, a snapshot restore can take
+			 * it back; the other two only ever go up.
+			 */
+			uint32_t epoch = avr->io_epoch + avr->irq_pool.serial;
+			if (version && avr->io[io].r.seen == *version &&
+					avr->io[io].r.seen_epoch == epoch) {
+				if (unlikely(avr->stats))
+					avr->stats->io_read_cached++;
+			} else if (avr->io[io].r.c) {
+				if (unlikely(avr->stats))
+					avr->stats->io_read[io]++;
+				avr->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
+				if (version) {
+					avr->io[io].r.seen = *version;
+					avr->io[io].r.seen_epoch = epoch;
+				}
+			}
 
-		if (avr->io[io].irq) {
-			uint8_t v = avr->data[addr];
-			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);
+			if (avr->io_hook[addr] & AVR_IO_HOOK_IRQ_READ)
+				avr_iomem_raise_irq(avr->io[io].irq, avr->data[addr]);
 		}
 	}
 	return avr_core_watch_read(avr, addr);
 }
 
 /*
- * Stack push accessors.
+ * Stack push accessors. The stack is most often in plain SRAM, with
+ * nothing watching it: its bytes are then accessed directly, otherwise
+ * they go through _avr_set_ram() and _avr_get_ram() like any other data
  */
+static inline int
+_avr_stack_plain(
+		avr_t * avr,
+		uint16_t lo,
+		uint16_t hi)
+{
+#if AVR_STACK_WATCH
+	return 0;
+#else
+	return lo >= 32 + avr->io_count && hi <= avr->ramend && lo <= hi &&
+			!((uintptr_t)avr->gdb_watch | (uintptr_t)avr->heatmap |
+				(uintptr_t)avr->trace_file | (uintptr_t)avr->dirty.data);
+#endif
+}
+
 static inline void _avr_push8(avr_t * avr, uint16_t v)
 {
 	uint16_t sp = _avr_sp_get(avr);
-	_avr_set_ram(avr, sp, v);
+	if (likely(_avr_stack_plain(avr, sp, sp)))
+		avr->data[sp] = v;
+	else
+		_avr_set_ram(avr, sp, v);
 	_avr_sp_set(avr, sp-1);
 }
 
 static inline uint8_t _avr_pop8(avr_t * avr)
 {
 	uint16_t sp = _avr_sp_get(avr) + 1;
-	uint8_t res = _avr_get_ram(avr, sp);
+	uint8_t res = likely(_avr_stack_plain(avr, sp, sp)) ?
+			avr->data[sp] : _avr_get_ram(avr, sp);
 	_avr_sp_set(avr, sp);
 	return res;
 }
 
-int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr)
+static inline int
+_avr_push_addr_size(
+		avr_t * avr,
+		avr_flashaddr_t addr,
+		const int size)
 {
 	uint16_t sp = _avr_sp_get(avr);
 	addr >>= 1;
-	for (int i = 0; i < avr->address_size; i++, addr >>= 8, sp--) {
-		_avr_set_ram(avr, sp, addr);
+	if (likely(_avr_stack_plain(avr, sp - size + 1, sp))) {
+		for (int i = 0; i < size; i++, addr >>= 8, sp--)
+			avr->data[sp] = addr;
+	} else {
+		for (int i = 0; i < size; i++, addr >>= 8, sp--) {
+			_avr_set_ram(avr, sp, addr);
+		}
 	}
 	_avr_sp_set(avr, sp);
-	return avr->address_size;
+	return size;
 }
 
-avr_flashaddr_t _avr_pop_addr(avr_t * avr)
+static inline avr_flashaddr_t
+_avr_pop_addr_size(
+		avr_t * avr,
+		const int size)
 {
 	uint16_t sp = _avr_sp_get(avr) + 1;
 	avr_flashaddr_t res = 0;
-	for (int i = 0; i < avr->address_size; i++, sp++) {
-		res = (res << 8) | _avr_get_ram(avr, sp);
+	if (likely(_avr_stack_plain(avr, sp, sp + size - 1))) {
+		for (int i = 0; i < size; i++, sp++)
+			res = (res << 8) | avr->data[sp];
+	} else {
+		for (int i = 0; i < size; i++, sp++) {
+			res = (res << 8) | _avr_get_ram(avr, sp);
+		}
 	}
 	res <<= 1;
 	_avr_sp_set(avr, sp -1);
 	return res;
 }
 
+int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr)
+{
+	return _avr_push_addr_size(avr, addr, avr->address_size);
+}
+
+avr_flashaddr_t _avr_pop_addr(avr_t * avr)
+{
+	return _avr_pop_addr_size(avr, avr->address_size);
+}
+
 /*
- * "Pretty" register names
+ * Control flow events, for the call graph profiler and the intrinsics.
+ * '*cycle' is the cycles of the call instruction, all of them; the call
+ * returns where it goes, the return address if the routine was run
+ * natively, its cycles then added to '*cycle'
  */
-const char * reg_names[255] = {
-		[R_XH] = "XH", [R_XL] = "XL",
-		[R_YH] = "YH", [R_YL] = "YL",
-		[R_ZH] = "ZH", [R_ZL] = "ZL",
-		[R_SPH] = "SPH", [R_SPL] = "SPL",
-		[R_SREG] = "SREG",
+static inline void
+_avr_ret_event(
+		avr_t * avr)
+{
+	if (unlikely(avr->callgraph))
+		avr_callgraph_ret(avr);
+	if (unlikely(avr->intrinsics))
+		avr_intrinsics_ret(avr);
+}
+
+static inline avr_flashaddr_t
+_avr_call_event(
+		avr_t * avr,
+		avr_flashaddr_t target,
+		int * cycle)
+{
+	if (unlikely(avr->callgraph))
+		avr_callgraph_call(avr, target);
+	if (unlikely(avr->intrinsics) && avr_intrinsics_call(avr, target, cycle)) {
+		target = _avr_pop_addr(avr);
+		_avr_ret_event(avr);
+	}
+	return target;
+}
+
+/*
+ * Where a branch, skip, jump, call or return goes, taken or not, for the
+ * fuzzers' edge coverage, the lcov coverage, the trace file and tiering.
+ * Returns 'target'
+ */
+static inline avr_flashaddr_t
+_avr_edge_event(
+		avr_t * avr,
+		avr_flashaddr_t target)
+{
+	if (unlikely(avr->coverage))
+		avr_coverage_edge(avr->coverage, target);
+	if (unlikely(avr->lcov))
+		avr_lcov_edge(avr->lcov, avr->pc, target);
+	if (unlikely(avr->trace_file))
+		avr_trace_file_edge(avr->trace_file, avr->pc, target);
+	if (unlikely(avr->tier))
+		avr_tier_edge(avr->tier, target);
+	return target;
+}
+
+/*
+ * "Pretty" register names. These are all constant, as instances can be
+ * tracing from several threads at once.
+ */
+#define _IO_HEX(d) ((d) < 10 ? '0' + (d) : 'a' + (d) - 10)
+#define _IO_NAME(n) { 'i', 'o', ':', _IO_HEX((n) >> 4), _IO_HEX((n) & 0xf), 0 }
+#define _IO_NAME4(n) _IO_NAME(n), _IO_NAME(n + 1), _IO_NAME(n + 2), _IO_NAME(n + 3)
+#define _IO_NAME16(n) _IO_NAME4(n), _IO_NAME4(n + 4), _IO_NAME4(n + 8), _IO_NAME4(n + 12)
+static const char io_names[256][6] = {
+		_IO_NAME16(0x00), _IO_NAME16(0x10), _IO_NAME16(0x20), _IO_NAME16(0x30),
+		_IO_NAME16(0x40), _IO_NAME16(0x50), _IO_NAME16(0x60), _IO_NAME16(0x70),
+		_IO_NAME16(0x80), _IO_NAME16(0x90), _IO_NAME16(0xa0), _IO_NAME16(0xb0),
+		_IO_NAME16(0xc0), _IO_NAME16(0xd0), _IO_NAME16(0xe0), _IO_NAME16(0xf0),
 };
 
+#define _IO_REF4(n) io_names[n], io_names[n + 1], io_names[n + 2], io_names[n + 3]
+#define _IO_REF16(n) _IO_REF4(n), _IO_REF4(n + 4), _IO_REF4(n + 8), _IO_REF4(n + 12)
+/*
+ * Still exported for the tools that index it; it's filled in full now,
+ * nothing writes to it anymore
+ */
+const char * reg_names[255] = {
+		"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+		"r16", "r17", "r18", "r19", "r20", "r21", "r22", "r23",
+		"r24", "r25", [R_XL] = "XL", [R_XH] = "XH",
+		[R_YL] = "YL", [R_YH] = "YH", [R_ZL] = "ZL", [R_ZH] = "ZH",
+		_IO_REF16(0x20), _IO_REF16(0x30), _IO_REF16(0x40),
+		_IO_REF4(0x50), _IO_REF4(0x54), _IO_REF4(0x58), io_names[0x5c],
+		[R_SPL] = "SPL", [R_SPH] = "SPH", [R_SREG] = "SREG",
+		_IO_REF16(0x60), _IO_REF16(0x70), _IO_REF16(0x80), _IO_REF16(0x90),
+		_IO_REF16(0xa0), _IO_REF16(0xb0), _IO_REF16(0xc0), _IO_REF16(0xd0),
+		_IO_REF16(0xe0), _IO_REF4(0xf0), _IO_REF4(0xf4), _IO_REF4(0xf8),
+		io_names[0xfc], io_names[0xfd], io_names[0xfe],
+};
 
 const char * avr_regname(uint8_t reg)
 {
-	if (!reg_names[reg]) {
-		char tt[16];
-		if (reg < 32)
-			sprintf(tt, "r%d", reg);
-		else
-			sprintf(tt, "io:%02x", reg);
-		reg_names[reg] = strdup(tt);
-	}
-	return reg_names[reg];
+	return reg < 255 ? reg_names[reg] : io_names[reg];
 }
 
 /*
@@ -351,11 +526,13 @@ static void _avr_invalid_opcode(avr_t * avr)
 {
 #if CONFIG_SIMAVR_TRACE
 	printf( FONT_RED "*** %04x: %-25s Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
-			avr->pc, avr->trace_data->codeline[avr->pc>>1]->symbol, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
+			avr->pc, avr_trace_symbol(avr, avr->pc), _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
 #else
 	AVR_LOG(avr, LOG_ERROR, FONT_RED "CORE: *** %04x: Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
 			avr->pc, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
 #endif
+	if (avr->postmortem)
+		avr_postmortem_event(avr, AVR_POSTMORTEM_OPCODE);
 }
 
 #if CONFIG_SIMAVR_TRACE
@@ -364,7 +541,7 @@ static void _avr_invalid_opcode(avr_t * avr)
  */
 void avr_dump_state(avr_t * avr)
 {
-	if (!avr->trace || donttrace)
+	if (!avr->trace || avr->trace_data->donttrace)
 		return;
 
 	int doit = 0;
@@ -388,6 +565,112 @@ void avr_dump_state(avr_t * avr)
 		}
 	printf("\n");
 }
+
+// the byte range of 'spec', a symbol or "<from>-<to>", or -1
+static int
+_avr_trace_filter_range(
+		avr_t * avr,
+		const char * spec,
+		uint32_t * from,
+		uint32_t * to)
+{
+	struct avr_trace_data_t * t = avr->trace_data;
+	char * end;
+
+	*from = strtoul(spec, &end, 0);
+	if (end != spec && *end == '-') {
+		*to = strtoul(end + 1, &end, 0);
+		return *end || *to < *from ? -1 : 0;
+	}
+	// a symbol runs up to the next one at another address
+	for (uint32_t i = 0; i < t->symbolcount; i++) {
+		if (strcmp(t->symbol[i]->symbol, spec))
+			continue;
+		*from = t->symbol[i]->addr;
+		*to = avr->flashend + 1;
+		for (uint32_t j = i + 1; j < t->symbolcount; j++)
+			if (t->symbol[j]->addr > *from) {
+				*to = t->symbol[j]->addr;
+				break;
+			}
+		return 0;
+	}
+	return -1;
+}
+
+int
+avr_trace_filter(
+		avr_t * avr,
+		const char * spec,
+		int include)
+{
+	struct avr_trace_data_t * t = avr->trace_data;
+	uint32_t words = (avr->flashend + 1) >> 1;
+	uint32_t from, to;
+
+	if (_avr_trace_filter_range(avr, spec, &from, &to)) {
+		AVR_LOG(avr, LOG_ERROR, "CORE: %s: no symbol or range '%s'\n",
+				__func__, spec);
+		return -1;
+	}
+	if (!t->filter) {
+		t->filter = malloc((words + 7) / 8);
+		if (!t->filter) {
+			AVR_LOG(avr, LOG_ERROR, "CORE: %s: out of memory\n", __func__);
+			return -1;
+		}
+		// the first include traces nothing else, the first exclude all else
+		memset(t->filter, include ? 0 : 0xff, (words + 7) / 8);
+	}
+	if (to > avr->flashend + 1)
+		to = avr->flashend + 1;
+	for (uint32_t w = from >> 1; w < (to + 1) >> 1; w++)
+		if (include)
+			t->filter[w >> 3] |= 1 << (w & 7);
+		else
+			t->filter[w >> 3] &= ~(1 << (w & 7));
+	return 0;
+}
+
+void
+avr_trace_filter_isr(
+		avr_t * avr,
+		int isr_only)
+{
+	avr->trace_data->filter_isr = isr_only;
+}
+
+void
+avr_trace_filter_clear(
+		avr_t * avr)
+{
+	free(avr->trace_data->filter);
+	avr->trace_data->filter = NULL;
+	avr->trace_data->filter_isr = 0;
+}
+#else
+int
+avr_trace_filter(
+		avr_t * avr,
+		const char * spec,
+		int include)
+{
+	AVR_LOG(avr, LOG_WARNING, "CORE: %s: tracing is not compiled in\n", __func__);
+	return -1;
+}
+
+void
+avr_trace_filter_isr(
+		avr_t * avr,
+		int isr_only)
+{
+}
+
+void
+avr_trace_filter_clear(
+		avr_t * avr)
+{
+}
 #endif
 
 #define get_d5(o) \
@@ -408,196 +691,2814 @@ void avr_dump_state(avr_t * avr)
 		get_vd5(o); \
 		const uint8_t s = o & 7;
 
-#define get_vd5_s3_mask(o) \
-		get_vd5_s3(o); \
-		const uint8_t mask = 1 << s;
+#define get_vd5_s3_mask(o) \
+		get_vd5_s3(o); \
+		const uint8_t mask = 1 << s;
+
+#define get_vd5_vr5(o) \
+		get_r5(o); \
+		get_d5(o); \
+		const uint8_t vd = avr->data[d], vr = avr->data[r];
+
+#define get_d5_vr5(o) \
+		get_d5(o); \
+		get_r5(o); \
+		const uint8_t vr = avr->data[r];
+
+#define get_h4_k8(o) \
+		const uint8_t h = 16 + ((o >> 4) & 0xf); \
+		const uint8_t k = ((o & 0x0f00) >> 4) | (o & 0xf);
+
+#define get_vh4_k8(o) \
+		get_h4_k8(o) \
+		const uint8_t vh = avr->data[h];
+
+#define get_d5_q6(o) \
+		get_d5(o) \
+		const uint8_t q = ((o & 0x2000) >> 8) | ((o & 0x0c00) >> 7) | (o & 0x7);
+
+#define get_io5(o) \
+		const uint8_t io = ((o >> 3) & 0x1f) + 32;
+
+#define get_io5_b3(o) \
+		get_io5(o); \
+		const uint8_t b = o & 0x7;
+
+#define get_io5_b3mask(o) \
+		get_io5(o); \
+		const uint8_t mask = 1 << (o & 0x7);
+
+//	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
+#define get_o12(op) \
+		const int16_t o = ((int16_t)((op << 4) & 0xffff)) >> 3;
+
+#define get_vp2_k6(o) \
+		const uint8_t p = 24 + ((o >> 3) & 0x6); \
+		const uint8_t k = ((o & 0x00c0) >> 2) | (o & 0xf); \
+		const uint16_t vp = avr->data[p] | (avr->data[p + 1] << 8);
+
+#define get_sreg_bit(o) \
+		const uint8_t b = (o >> 4) & 7;
+
+/*
+ * Add a "jump" address to the jump trace buffer
+ */
+#if CONFIG_SIMAVR_TRACE
+#define TRACE_JUMP()\
+	avr->trace_data->old[avr->trace_data->old_pci].pc = avr->pc;\
+	avr->trace_data->old[avr->trace_data->old_pci].sp = _avr_sp_get(avr);\
+	avr->trace_data->old_pci = (avr->trace_data->old_pci + 1) & (OLD_PC_SIZE-1);\
+
+#if AVR_STACK_WATCH
+#define STACK_FRAME_PUSH()\
+	avr->trace_data->stack_frame[avr->trace_data->stack_frame_index].pc = avr->pc;\
+	avr->trace_data->stack_frame[avr->trace_data->stack_frame_index].sp = _avr_sp_get(avr);\
+	avr->trace_data->stack_frame_index++;
+#define STACK_FRAME_POP()\
+	if (avr->trace_data->stack_frame_index > 0) \
+		avr->trace_data->stack_frame_index--;
+#else
+#define STACK_FRAME_PUSH()
+#define STACK_FRAME_POP()
+#endif
+#else /* CONFIG_SIMAVR_TRACE */
+
+#define TRACE_JUMP()
+#define STACK_FRAME_PUSH()
+#define STACK_FRAME_POP()
+
+#endif
+
+/****************************************************************************\
+ *
+ * Helper functions for calculating the status register bit values.
+ * See the Atmel data sheet for the instruction set for more info.
+ *
+\****************************************************************************/
+
+static  void
+_avr_flags_zns (struct avr_t * avr, uint8_t res)
+{
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_N] = (res >> 7) & 1;
+	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+}
+
+static  void
+_avr_flags_zns16 (struct avr_t * avr, uint16_t res)
+{
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_N] = (res >> 15) & 1;
+	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+}
+
+static  void
+_avr_flags_add_zns (struct avr_t * avr, uint8_t res, uint8_t rd, uint8_t rr)
+{
+	/* carry & half carry */
+	uint8_t add_carry = (rd & rr) | (rr & ~res) | (~res & rd);
+	avr->sreg[S_H] = (add_carry >> 3) & 1;
+	avr->sreg[S_C] = (add_carry >> 7) & 1;
+
+	/* overflow */
+	avr->sreg[S_V] = (((rd & rr & ~res) | (~rd & ~rr & res)) >> 7) & 1;
+
+	/* zns */
+	_avr_flags_zns(avr, res);
+}
+
+
+static  void
+_avr_flags_sub_zns (struct avr_t * avr, uint8_t res, uint8_t rd, uint8_t rr)
+{
+	/* carry & half carry */
+	uint8_t sub_carry = (~rd & rr) | (rr & res) | (res & ~rd);
+	avr->sreg[S_H] = (sub_carry >> 3) & 1;
+	avr->sreg[S_C] = (sub_carry >> 7) & 1;
+
+	/* overflow */
+	avr->sreg[S_V] = (((rd & ~rr & ~res) | (~rd & rr & res)) >> 7) & 1;
+
+	/* zns */
+	_avr_flags_zns(avr, res);
+}
+
+static  void
+_avr_flags_Rzns (struct avr_t * avr, uint8_t res)
+{
+	if (res)
+		avr->sreg[S_Z] = 0;
+	avr->sreg[S_N] = (res >> 7) & 1;
+	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+}
+
+static  void
+_avr_flags_sub_Rzns (struct avr_t * avr, uint8_t res, uint8_t rd, uint8_t rr)
+{
+	/* carry & half carry */
+	uint8_t sub_carry = (~rd & rr) | (rr & res) | (res & ~rd);
+	avr->sreg[S_H] = (sub_carry >> 3) & 1;
+	avr->sreg[S_C] = (sub_carry >> 7) & 1;
+
+	/* overflow */
+	avr->sreg[S_V] = (((rd & ~rr & ~res) | (~rd & rr & res)) >> 7) & 1;
+
+	_avr_flags_Rzns(avr, res);
+}
+
+static  void
+_avr_flags_zcvs (struct avr_t * avr, uint8_t res, uint8_t vr)
+{
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_C] = vr & 1;
+	avr->sreg[S_V] = avr->sreg[S_N] ^ avr->sreg[S_C];
+	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+}
+
+static  void
+_avr_flags_zcnvs (struct avr_t * avr, uint8_t res, uint8_t vr)
+{
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_C] = vr & 1;
+	avr->sreg[S_N] = res >> 7;
+	avr->sreg[S_V] = avr->sreg[S_N] ^ avr->sreg[S_C];
+	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+}
+
+static  void
+_avr_flags_znv0s (struct avr_t * avr, uint8_t res)
+{
+	avr->sreg[S_V] = 0;
+	_avr_flags_zns(avr, res);
+}
+
+void
+_avr_sreg_materialize(
+		avr_t * avr)
+{
+	uint8_t res = avr->sreg_lazy.res, rd = avr->sreg_lazy.rd, rr = avr->sreg_lazy.rr;
+
+	switch (avr->sreg_lazy.op) {
+		case AVR_SREG_LAZY_ADD:
+			_avr_flags_add_zns(avr, res, rd, rr);
+			break;
+		case AVR_SREG_LAZY_SUB:
+			_avr_flags_sub_zns(avr, res, rd, rr);
+			break;
+		case AVR_SREG_LAZY_SUB_R:
+			_avr_flags_sub_Rzns(avr, res, rd, rr);
+			break;
+		case AVR_SREG_LAZY_NEG:
+			avr->sreg[S_H] = ((res >> 3) | (rd >> 3)) & 1;
+			avr->sreg[S_V] = res == 0x80;
+			avr->sreg[S_C] = res != 0;
+			_avr_flags_zns(avr, res);
+			break;
+	}
+	avr->sreg_lazy.op = AVR_SREG_LAZY_NONE;
+}
+
+static inline void
+_avr_sreg_lazy(
+		avr_t * avr,
+		uint8_t op,
+		uint8_t res,
+		uint8_t rd,
+		uint8_t rr)
+{
+	avr->sreg_lazy.op = op;
+	avr->sreg_lazy.res = res;
+	avr->sreg_lazy.rd = rd;
+	avr->sreg_lazy.rr = rr;
+}
+
+static inline int _avr_opcode_is_32_bits(uint16_t opcode)
+{
+	uint16_t o = opcode & 0xfc0f;
+	return	o == 0x9200 || // STS ! Store Direct to Data Space
+			o == 0x9000 || // LDS Load Direct from Data Space
+			o == 0x940c || // JMP Long Jump
+			o == 0x940d || // JMP Long Jump
+			o == 0x940e ||  // CALL Long Call to sub
+			o == 0x940f; // CALL Long Call to sub
+}
+
+/*
+ * Predecoded instruction handlers.
+ *
+ * These mirror the cases of the decoder in avr_run_one(), with the operands
+ * extracted once by _avr_decode(). 'o->cycles' holds the fixed part of the
+ * cycle count; handlers only add the variable part (branches, skips, pushes).
+ */
+#define AVR_DECODED_OP(_name) \
+	static inline avr_flashaddr_t _avr_op_##_name( \
+			avr_t * avr, avr_decoded_t * o, \
+			avr_flashaddr_t new_pc, int * cycle)
+
+typedef avr_flashaddr_t (*avr_decoded_op_t)(
+		avr_t * avr,
+		avr_decoded_t * o,
+		avr_flashaddr_t new_pc,
+		int * cycle);
+
+/*
+ * All the handlers, in 'kind' order. Kind 0 is "not decoded yet".
+ * The "pure" ones only touch the general purpose registers and SREG, they
+ * can't change the pc flow, the cpu state nor raise any IRQ, so a run of
+ * them can be executed as a block (see _avr_decode_block()).
+ * Note that BSET is only pure when it's not changing the I bit.
+ */
+#define AVR_DECODED_PURE_OPS(_) \
+	_(nop) \
+	_(cpc) _(add) _(adc) _(sbc) _(sub) _(cp) \
+	_(and) _(eor) _(or) _(mov) _(movw) \
+	_(muls) _(fmul) _(mul) \
+	_(cpi) _(sbci) _(subi) _(ori) _(andi) _(ldi) _(lpm) \
+	_(com) _(neg) _(swap) _(inc) _(dec) _(asr) _(lsr) _(ror) _(adiw) _(sbiw) \
+	_(bset) _(bld) _(bst)
+
+#define AVR_DECODED_OPS(_) \
+	AVR_DECODED_PURE_OPS(_) \
+	_(invalid) _(cpse) \
+	_(ldd) _(std) _(ld) _(st) _(lds) _(sts) _(elpm) _(pop) _(push) \
+	_(cbi) _(sbi) _(sbic) _(sbis) _(out) _(in) \
+	_(rjmp) _(rcall) _(jmp) _(call) _(ijmp) _(reti) _(ret) \
+	_(brbx) _(sbrx) \
+	_(sleep) _(break) _(wdr) _(spm) \
+	_(rjmp_loop) _(brbx_loop) _(brbx_countdown) _(brbx_copy)
+
+/*
+ * Superinstructions, with the kind of their first instruction (see
+ * _avr_fuse()). The first list is of the ones starting with a pure one.
+ */
+#define AVR_DECODED_FUSED_PURE_OPS(_) \
+	_(ldi_ldi, ldi) _(subi_sbci, subi) \
+	_(cp_cpc, cp) _(cpi_cpc, cpi) _(cp_cpc_brbx, cp) \
+	_(cpc_brbx, cpc) _(cpi_brbx, cpi)
+
+#define AVR_DECODED_FUSED_OPS(_) \
+	AVR_DECODED_FUSED_PURE_OPS(_) \
+	_(ld_st, ld) _(push_push, push) _(pop_pop, pop)
+
+#define AVR_DECODED_KIND(_name) AVR_OP_##_name,
+#define AVR_FUSED_KIND(_name, _first) AVR_OP_##_name,
+enum {
+	AVR_OP_decode = 0,
+	AVR_DECODED_OPS(AVR_DECODED_KIND)
+	AVR_DECODED_FUSED_OPS(AVR_FUSED_KIND)
+	AVR_OP_COUNT
+};
+
+#define AVR_DECODED_PURE(_name) [AVR_OP_##_name] = 1,
+static const uint8_t _avr_decoded_pure[AVR_OP_COUNT] = {
+	AVR_DECODED_PURE_OPS(AVR_DECODED_PURE)
+};
+
+// the kind of the first instruction of each entry, for the loop detectors
+#define AVR_DECODED_FIRST(_name) [AVR_OP_##_name] = AVR_OP_##_name,
+#define AVR_FUSED_FIRST(_name, _first) [AVR_OP_##_name] = AVR_OP_##_first,
+static const uint8_t _avr_decoded_first[AVR_OP_COUNT] = {
+	AVR_DECODED_OPS(AVR_DECODED_FIRST)
+	AVR_DECODED_FUSED_OPS(AVR_FUSED_FIRST)
+};
+
+// the handler list, to tell decoded entries of other builds apart
+#define AVR_DECODED_NAME(_name) #_name " "
+#define AVR_FUSED_NAME(_name, _first) #_name " "
+static const char _avr_decoded_names[] =
+	AVR_DECODED_OPS(AVR_DECODED_NAME)
+	AVR_DECODED_FUSED_OPS(AVR_FUSED_NAME);
+
+static inline avr_flashaddr_t
+_avr_decoded_skip(
+		avr_t * avr,
+		avr_flashaddr_t new_pc,
+		int * cycle)
+{
+	if (avr_flash_is_wide(avr, new_pc)) {
+		*cycle += 2;
+		return new_pc + 4;
+	}
+	*cycle += 1;
+	return new_pc + 2;
+}
+
+AVR_DECODED_OP(decode);
+AVR_DECODED_OP(rjmp_loop);
+AVR_DECODED_OP(brbx_loop);
+AVR_DECODED_OP(brbx_countdown);
+AVR_DECODED_OP(brbx_copy);
+
+AVR_DECODED_OP(nop)
+{
+	return new_pc;
+}
+
+AVR_DECODED_OP(invalid)
+{
+	_avr_invalid_opcode(avr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(cpc)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vd = avr->data[o->d], vr = avr->data[o->r];
+	uint8_t res = vd - vr - avr->sreg[S_C];
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB_R, res, vd, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(add)
+{
+	uint8_t vd = avr->data[o->d], vr = avr->data[o->r];
+	uint8_t res = vd + vr;
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_ADD, res, vd, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(adc)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vd = avr->data[o->d], vr = avr->data[o->r];
+	uint8_t res = vd + vr + avr->sreg[S_C];
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_ADD, res, vd, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(sbc)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vd = avr->data[o->d], vr = avr->data[o->r];
+	uint8_t res = vd - vr - avr->sreg[S_C];
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB_R, res, vd, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(sub)
+{
+	uint8_t vd = avr->data[o->d], vr = avr->data[o->r];
+	uint8_t res = vd - vr;
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB, res, vd, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(cp)
+{
+	uint8_t vd = avr->data[o->d], vr = avr->data[o->r];
+	uint8_t res = vd - vr;
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB, res, vd, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(cpse)
+{
+	if (avr->data[o->d] == avr->data[o->r])
+		new_pc = _avr_decoded_skip(avr, new_pc, cycle);
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(and)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] & avr->data[o->r];
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_znv0s(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(eor)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] ^ avr->data[o->r];
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_znv0s(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(or)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] | avr->data[o->r];
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_znv0s(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(mov)
+{
+	_avr_set_r(avr, o->d, avr->data[o->r]);
+	return new_pc;
+}
+
+AVR_DECODED_OP(movw)
+{
+	uint16_t vr = avr->data[o->r] | (avr->data[o->r + 1] << 8);
+	_avr_set_r16le(avr, o->d, vr);
+	return new_pc;
+}
+
+AVR_DECODED_OP(muls)
+{
+	avr_sreg_materialize(avr);
+	int16_t res = ((int8_t)avr->data[o->r]) * ((int8_t)avr->data[o->d]);
+	_avr_set_r16le(avr, 0, res);
+	avr->sreg[S_C] = (res >> 15) & 1;
+	avr->sreg[S_Z] = res == 0;
+	return new_pc;
+}
+
+/* MULSU, FMUL, FMULS, FMULSU, 'o->k' holds the (opcode & 0x88) variant */
+AVR_DECODED_OP(fmul)
+{
+	avr_sreg_materialize(avr);
+	int16_t res = 0;
+	uint8_t c = 0;
+	switch (o->k) {
+		case 0x00:
+			res = ((uint8_t)avr->data[o->r]) * ((int8_t)avr->data[o->d]);
+			c = (res >> 15) & 1;
+			break;
+		case 0x08:
+			res = ((uint8_t)avr->data[o->r]) * ((uint8_t)avr->data[o->d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			break;
+		case 0x80:
+			res = ((int8_t)avr->data[o->r]) * ((int8_t)avr->data[o->d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			break;
+		case 0x88:
+			res = ((uint8_t)avr->data[o->r]) * ((int8_t)avr->data[o->d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			break;
+	}
+	_avr_set_r16le(avr, 0, res);
+	avr->sreg[S_C] = c;
+	avr->sreg[S_Z] = res == 0;
+	return new_pc;
+}
+
+AVR_DECODED_OP(mul)
+{
+	avr_sreg_materialize(avr);
+	uint16_t res = avr->data[o->d] * avr->data[o->r];
+	_avr_set_r16le(avr, 0, res);
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_C] = (res >> 15) & 1;
+	return new_pc;
+}
+
+AVR_DECODED_OP(cpi)
+{
+	uint8_t vh = avr->data[o->d], k = o->k;
+	uint8_t res = vh - k;
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB, res, vh, k);
+	return new_pc;
+}
+
+AVR_DECODED_OP(sbci)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vh = avr->data[o->d], k = o->k;
+	uint8_t res = vh - k - avr->sreg[S_C];
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB_R, res, vh, k);
+	return new_pc;
+}
+
+AVR_DECODED_OP(subi)
+{
+	uint8_t vh = avr->data[o->d], k = o->k;
+	uint8_t res = vh - k;
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_SUB, res, vh, k);
+	return new_pc;
+}
+
+AVR_DECODED_OP(ori)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] | o->k;
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_znv0s(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(andi)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] & o->k;
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_znv0s(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(ldi)
+{
+	_avr_set_r(avr, o->d, o->k);
+	return new_pc;
+}
+
+/* LDD/STD, 'o->r' is the pointer register (Y or Z), 'o->k' the displacement */
+AVR_DECODED_OP(ldd)
+{
+	uint16_t v = avr->data[o->r] | (avr->data[o->r + 1] << 8);
+	_avr_set_r(avr, o->d, _avr_get_ram(avr, v + o->k));
+	return new_pc;
+}
+
+AVR_DECODED_OP(std)
+{
+	uint16_t v = avr->data[o->r] | (avr->data[o->r + 1] << 8);
+	_avr_set_ram(avr, v + o->k, avr->data[o->d]);
+	return new_pc;
+}
+
+/* LD/ST with X, Y or Z in 'o->r', 'o->k' is 1) post increment, 2) pre-decrement */
+AVR_DECODED_OP(ld)
+{
+	uint16_t x = (avr->data[o->r + 1] << 8) | avr->data[o->r];
+	if (o->k == 2) x--;
+	uint8_t vd = _avr_get_ram(avr, x);
+	if (o->k == 1) x++;
+	_avr_set_r16le_hl(avr, o->r, x);
+	_avr_set_r(avr, o->d, vd);
+	return new_pc;
+}
+
+AVR_DECODED_OP(st)
+{
+	uint8_t vd = avr->data[o->d];
+	uint16_t x = (avr->data[o->r + 1] << 8) | avr->data[o->r];
+	if (o->k == 2) x--;
+	_avr_set_ram(avr, x, vd);
+	if (o->k == 1) x++;
+	_avr_set_r16le_hl(avr, o->r, x);
+	return new_pc;
+}
+
+AVR_DECODED_OP(lds)
+{
+	_avr_set_r(avr, o->d, _avr_get_ram(avr, o->k));
+	return new_pc + 2;
+}
+
+AVR_DECODED_OP(sts)
+{
+	_avr_set_ram(avr, o->k, avr->data[o->d]);
+	return new_pc + 2;
+}
+
+/* LPM, 'o->k' is set for the post increment form */
+AVR_DECODED_OP(lpm)
+{
+	uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	_avr_set_r(avr, o->d, avr->flash[z]);
+	if (o->k) {
+		z++;
+		_avr_set_r16le_hl(avr, R_ZL, z);
+	}
+	return new_pc;
+}
+
+AVR_DECODED_OP(elpm)
+{
+	if (!avr->rampz)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
+	_avr_set_r(avr, o->d, avr->flash[z]);
+	if (o->k) {
+		z++;
+		_avr_set_r(avr, avr->rampz, z >> 16);
+		_avr_set_r16le_hl(avr, R_ZL, z);
+	}
+	return new_pc;
+}
+
+AVR_DECODED_OP(pop)
+{
+	_avr_set_r(avr, o->d, _avr_pop8(avr));
+	return new_pc;
+}
+
+AVR_DECODED_OP(push)
+{
+	_avr_push8(avr, avr->data[o->d]);
+	return new_pc;
+}
+
+AVR_DECODED_OP(com)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = 0xff - avr->data[o->d];
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_znv0s(avr, res);
+	avr->sreg[S_C] = 1;
+	return new_pc;
+}
+
+AVR_DECODED_OP(neg)
+{
+	uint8_t vd = avr->data[o->d];
+	uint8_t res = 0x00 - vd;
+	_avr_set_r(avr, o->d, res);
+	_avr_sreg_lazy(avr, AVR_SREG_LAZY_NEG, res, vd, 0);
+	return new_pc;
+}
+
+AVR_DECODED_OP(swap)
+{
+	uint8_t vd = avr->data[o->d];
+	_avr_set_r(avr, o->d, (vd >> 4) | (vd << 4));
+	return new_pc;
+}
+
+AVR_DECODED_OP(inc)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] + 1;
+	_avr_set_r(avr, o->d, res);
+	avr->sreg[S_V] = res == 0x80;
+	_avr_flags_zns(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(dec)
+{
+	avr_sreg_materialize(avr);
+	uint8_t res = avr->data[o->d] - 1;
+	_avr_set_r(avr, o->d, res);
+	avr->sreg[S_V] = res == 0x7f;
+	_avr_flags_zns(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(asr)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vd = avr->data[o->d];
+	uint8_t res = (vd >> 1) | (vd & 0x80);
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_zcnvs(avr, res, vd);
+	return new_pc;
+}
+
+AVR_DECODED_OP(lsr)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vd = avr->data[o->d];
+	uint8_t res = vd >> 1;
+	_avr_set_r(avr, o->d, res);
+	avr->sreg[S_N] = 0;
+	_avr_flags_zcvs(avr, res, vd);
+	return new_pc;
+}
+
+AVR_DECODED_OP(ror)
+{
+	avr_sreg_materialize(avr);
+	uint8_t vd = avr->data[o->d];
+	uint8_t res = (avr->sreg[S_C] ? 0x80 : 0) | vd >> 1;
+	_avr_set_r(avr, o->d, res);
+	_avr_flags_zcnvs(avr, res, vd);
+	return new_pc;
+}
+
+AVR_DECODED_OP(adiw)
+{
+	avr_sreg_materialize(avr);
+	uint16_t vp = avr->data[o->d] | (avr->data[o->d + 1] << 8);
+	uint16_t res = vp + o->k;
+	_avr_set_r16le_hl(avr, o->d, res);
+	avr->sreg[S_V] = ((~vp & res) >> 15) & 1;
+	avr->sreg[S_C] = ((~res & vp) >> 15) & 1;
+	_avr_flags_zns16(avr, res);
+	return new_pc;
+}
+
+AVR_DECODED_OP(sbiw)
+{
+	avr_sreg_materialize(avr);
+	uint16_t vp = avr->data[o->d] | (avr->data[o->d + 1] << 8);
+	uint16_t res = vp - o->k;
+	_avr_set_r16le_hl(avr, o->d, res);
+	avr->sreg[S_V] = ((vp & ~res) >> 15) & 1;
+	avr->sreg[S_C] = ((res & ~vp) >> 15) & 1;
+	_avr_flags_zns16(avr, res);
+	return new_pc;
+}
+
+/* CBI/SBI/SBIC/SBIS, 'o->d' is the IO data address, 'o->r' the bit mask */
+AVR_DECODED_OP(cbi)
+{
+	_avr_set_ram(avr, o->d, _avr_get_ram(avr, o->d) & ~o->r);
+	return new_pc;
+}
+
+AVR_DECODED_OP(sbi)
+{
+	_avr_set_ram(avr, o->d, _avr_get_ram(avr, o->d) | o->r);
+	return new_pc;
+}
+
+AVR_DECODED_OP(sbic)
+{
+	if (!(_avr_get_ram(avr, o->d) & o->r))
+		new_pc = _avr_decoded_skip(avr, new_pc, cycle);
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(sbis)
+{
+	if (_avr_get_ram(avr, o->d) & o->r)
+		new_pc = _avr_decoded_skip(avr, new_pc, cycle);
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(out)
+{
+	_avr_set_ram(avr, o->d, avr->data[o->r]);
+	return new_pc;
+}
+
+AVR_DECODED_OP(in)
+{
+	_avr_set_r(avr, o->d, _avr_get_ram(avr, o->r));
+	return new_pc;
+}
+
+AVR_DECODED_OP(rjmp)
+{
+	return _avr_edge_event(avr, (new_pc + (int32_t)o->k) % (avr->flashend + 1));
+}
+
+AVR_DECODED_OP(rcall)
+{
+	*cycle += _avr_push_addr(avr, new_pc);
+	new_pc = (new_pc + (int32_t)o->k) % (avr->flashend + 1);
+	if (o->k)	// 'rcall .+0' just makes room on the stack
+		new_pc = _avr_call_event(avr, new_pc, cycle);
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(jmp)
+{
+	return _avr_edge_event(avr, o->k << 1);
+}
+
+AVR_DECODED_OP(call)
+{
+	*cycle += _avr_push_addr(avr, new_pc + 2);
+	return _avr_edge_event(avr, _avr_call_event(avr, o->k << 1, cycle));
+}
+
+/* IJMP/EIJMP/ICALL/EICALL, 'o->d' is the "extended" flag, 'o->r' the "push pc" one */
+AVR_DECODED_OP(ijmp)
+{
+	if (o->d && !avr->eind)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	if (o->d)
+		z |= avr->data[avr->eind] << 16;
+	if (o->r) {
+		*cycle += _avr_push_addr(avr, new_pc) - 1;
+		return _avr_edge_event(avr, _avr_call_event(avr, z << 1, cycle));
+	}
+	return _avr_edge_event(avr, z << 1);
+}
+
+AVR_DECODED_OP(reti)
+{
+	avr_sreg_set(avr, S_I, 1);
+	avr_interrupt_reti(avr);
+	new_pc = _avr_pop_addr(avr);
+	_avr_ret_event(avr);
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(ret)
+{
+	new_pc = _avr_pop_addr(avr);
+	_avr_ret_event(avr);
+	return _avr_edge_event(avr, new_pc);
+}
+
+/* BRBS/BRBC, 'o->r' is the SREG bit, 'o->d' is set for BRBS, 'o->k' the offset */
+AVR_DECODED_OP(brbx)
+{
+	avr_sreg_materialize(avr);
+	if ((avr->sreg[o->r] != 0) == o->d) {
+		*cycle += 1;
+		new_pc = new_pc + o->k;
+	}
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(bset)
+{
+	avr_sreg_materialize(avr);
+	avr_sreg_set(avr, o->r, o->d);
+	return new_pc;
+}
+
+/* BLD/BST/SBRC/SBRS, 'o->r' is the bit mask */
+AVR_DECODED_OP(bld)
+{
+	uint8_t vd = avr->data[o->d];
+	_avr_set_r(avr, o->d, (vd & ~o->r) | (avr->sreg[S_T] ? o->r : 0));
+	return new_pc;
+}
+
+AVR_DECODED_OP(bst)
+{
+	avr->sreg[S_T] = (avr->data[o->d] & o->r) != 0;
+	return new_pc;
+}
+
+/* 'o->k' is set for SBRS */
+AVR_DECODED_OP(sbrx)
+{
+	if (((avr->data[o->d] & o->r) != 0) == o->k)
+		new_pc = _avr_decoded_skip(avr, new_pc, cycle);
+	return _avr_edge_event(avr, new_pc);
+}
+
+AVR_DECODED_OP(sleep)
+{
+	if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
+		avr->state = cpu_Sleeping;
+	return new_pc;
+}
+
+AVR_DECODED_OP(break)
+{
+	if (avr->gdb) {
+		avr->state = cpu_StepDone;
+		*cycle = 0;
+		return avr->pc;
+	}
+	return new_pc;
+}
+
+AVR_DECODED_OP(wdr)
+{
+	if (avr->watchdog)
+		avr_watchdog_kick(avr->watchdog);
+	else
+		avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
+	return new_pc;
+}
+
+AVR_DECODED_OP(spm)
+{
+	avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
+	return new_pc;
+}
+
+/*
+ * Superinstructions: an entry starting one of the frequent sequences of
+ * AVR_DECODED_FUSED_OPS runs the following instructions too, saving their
+ * dispatch. It keeps the operands and cycles of its first instruction, the
+ * others are run from their own entries; so jumping in the middle of a
+ * sequence, or running it as part of a block, sees each one on its own.
+ * In between, the checks and accounting of the main loop are done here, and
+ * the sequence stops where the main loop would have. The cycle count, SREG
+ * and interrupt latency are exactly those of the separate instructions.
+ */
+static inline int
+_avr_fused_next(
+		avr_t * avr,
+		avr_decoded_t ** o,
+		avr_flashaddr_t * new_pc,
+		int * cycle)
+{
+	if ((avr->state != cpu_Running) ||
+		(avr->run_cycle_count <= *cycle) ||
+		(avr->interrupt_state != 0))
+		return 0;
+	avr->cycle += *cycle;
+	avr->run_cycle_count -= *cycle;
+	avr->pc = *new_pc;
+	*new_pc += 2;
+	(*o)++;
+	*cycle = (*o)->cycles;
+	return 1;
+}
+
+#define AVR_FUSED_OP2(_first, _second) \
+	AVR_DECODED_OP(_first##_##_second) \
+	{ \
+		new_pc = _avr_op_##_first(avr, o, new_pc, cycle); \
+		if (!_avr_fused_next(avr, &o, &new_pc, cycle)) \
+			return new_pc; \
+		return _avr_op_##_second(avr, o, new_pc, cycle); \
+	}
+
+AVR_FUSED_OP2(ldi, ldi)
+AVR_FUSED_OP2(subi, sbci)
+AVR_FUSED_OP2(cp, cpc)
+AVR_FUSED_OP2(cpi, cpc)
+AVR_FUSED_OP2(cpc, brbx)
+AVR_FUSED_OP2(cpi, brbx)
+AVR_FUSED_OP2(ld, st)
+AVR_FUSED_OP2(push, push)
+AVR_FUSED_OP2(pop, pop)
+
+// 16 bits compare and branch
+AVR_DECODED_OP(cp_cpc_brbx)
+{
+	new_pc = _avr_op_cp(avr, o, new_pc, cycle);
+	if (!_avr_fused_next(avr, &o, &new_pc, cycle))
+		return new_pc;
+	new_pc = _avr_op_cpc(avr, o, new_pc, cycle);
+	if (!_avr_fused_next(avr, &o, &new_pc, cycle))
+		return new_pc;
+	return _avr_op_brbx(avr, o, new_pc, cycle);
+}
+
+#define AVR_DECODED_HANDLER(_name) _avr_op_##_name,
+#define AVR_FUSED_HANDLER(_name, _first) _avr_op_##_name,
+static const avr_decoded_op_t _avr_decoded_op[AVR_OP_COUNT] = {
+	_avr_op_decode,
+	AVR_DECODED_OPS(AVR_DECODED_HANDLER)
+	AVR_DECODED_FUSED_OPS(AVR_FUSED_HANDLER)
+};
+
+static inline void
+_avr_decoded_set(
+		avr_decoded_t * o,
+		uint8_t kind,
+		uint8_t d,
+		uint8_t r,
+		uint32_t k,
+		uint8_t cycles)
+{
+	o->kind = kind;
+	o->d = d;
+	o->r = r;
+	o->k = k;
+	o->cycles = cycles;
+	o->size = 1;
+}
+
+/*
+ * Decode the instruction at 'pc' into 'o'. This follows the exact same
+ * opcode tree as avr_run_one(), so that invalid or partially decoded
+ * opcodes behave the same way in both cases.
+ */
+static void
+_avr_decode(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		avr_decoded_t * o)
+{
+	uint32_t opcode = _avr_flash_read16le(avr, pc);
+	// second word of 32 bits instructions, reads as erased flash past the end
+	uint16_t x = pc + 3 <= avr->flashend ? _avr_flash_read16le(avr, pc + 2) : 0xffff;
+
+	_avr_decoded_set(o, AVR_OP_invalid, 0, 0, 0, 1);
+
+	switch (opcode & 0xf000) {
+		case 0x0000: {
+			if (opcode == 0x0000) {
+				_avr_decoded_set(o, AVR_OP_nop, 0, 0, 0, 1);
+				break;
+			}
+			get_d5(opcode);
+			get_r5(opcode);
+			switch (opcode & 0xfc00) {
+				case 0x0400: _avr_decoded_set(o, AVR_OP_cpc, d, r, 0, 1); break;
+				case 0x0c00: _avr_decoded_set(o, AVR_OP_add, d, r, 0, 1); break;
+				case 0x0800: _avr_decoded_set(o, AVR_OP_sbc, d, r, 0, 1); break;
+				default:
+					switch (opcode & 0xff00) {
+						case 0x0100:
+							_avr_decoded_set(o, AVR_OP_movw,
+									((opcode >> 4) & 0xf) << 1, (opcode & 0xf) << 1, 0, 1);
+							break;
+						case 0x0200:
+							if (avr->no_mul)
+								break;
+							_avr_decoded_set(o, AVR_OP_muls,
+									16 + ((opcode >> 4) & 0xf), 16 + (opcode & 0xf), 0, 2);
+							break;
+						case 0x0300:
+							if (avr->no_mul)
+								break;
+							_avr_decoded_set(o, AVR_OP_fmul,
+									16 + ((opcode >> 4) & 0x7), 16 + (opcode & 0x7),
+									opcode & 0x88, 2);
+							break;
+					}
+			}
+		}	break;
+		case 0x1000: {
+			get_d5(opcode);
+			get_r5(opcode);
+			switch (opcode & 0xfc00) {
+				case 0x1800: _avr_decoded_set(o, AVR_OP_sub, d, r, 0, 1); break;
+				case 0x1000: _avr_decoded_set(o, AVR_OP_cpse, d, r, 0, 1); break;
+				case 0x1400: _avr_decoded_set(o, AVR_OP_cp, d, r, 0, 1); break;
+				case 0x1c00: _avr_decoded_set(o, AVR_OP_adc, d, r, 0, 1); break;
+			}
+		}	break;
+		case 0x2000: {
+			get_d5(opcode);
+			get_r5(opcode);
+			switch (opcode & 0xfc00) {
+				case 0x2000: _avr_decoded_set(o, AVR_OP_and, d, r, 0, 1); break;
+				case 0x2400: _avr_decoded_set(o, AVR_OP_eor, d, r, 0, 1); break;
+				case 0x2800: _avr_decoded_set(o, AVR_OP_or, d, r, 0, 1); break;
+				case 0x2c00: _avr_decoded_set(o, AVR_OP_mov, d, r, 0, 1); break;
+			}
+		}	break;
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x6000:
+		case 0x7000:
+		case 0xe000: {
+			get_h4_k8(opcode);
+			static const uint8_t imm[16] = {
+				[0x3] = AVR_OP_cpi, [0x4] = AVR_OP_sbci, [0x5] = AVR_OP_subi,
+				[0x6] = AVR_OP_ori, [0x7] = AVR_OP_andi, [0xe] = AVR_OP_ldi,
+			};
+			_avr_decoded_set(o, imm[opcode >> 12], h, 0, k, 1);
+		}	break;
+		case 0xa000:
+		case 0x8000: {
+			get_d5_q6(opcode);
+			_avr_decoded_set(o, opcode & 0x0200 ? AVR_OP_std : AVR_OP_ldd,
+					d, opcode & 0x0008 ? R_YL : R_ZL, q, 2);
+		}	break;
+		case 0x9000: {
+			if ((opcode & 0xff0f) == 0x9408) {
+				get_sreg_bit(opcode);
+				_avr_decoded_set(o, AVR_OP_bset, (opcode & 0x0080) == 0, b, 0, 1);
+				break;
+			}
+			switch (opcode) {
+				case 0x9588: _avr_decoded_set(o, AVR_OP_sleep, 0, 0, 0, 1); return;
+				case 0x9598: _avr_decoded_set(o, AVR_OP_break, 0, 0, 0, 1); return;
+				case 0x95a8: _avr_decoded_set(o, AVR_OP_wdr, 0, 0, 0, 1); return;
+				case 0x95e8: _avr_decoded_set(o, AVR_OP_spm, 0, 0, 0, 1); return;
+				case 0x9409:
+				case 0x9419:
+				case 0x9509:
+				case 0x9519:
+					_avr_decoded_set(o, AVR_OP_ijmp,
+							(opcode & 0x10) != 0, (opcode & 0x100) != 0, 0, 2);
+					return;
+				case 0x9518:
+					_avr_decoded_set(o, AVR_OP_reti, 0, 0, 0, 2 + avr->address_size);
+					return;
+				case 0x9508:
+					_avr_decoded_set(o, AVR_OP_ret, 0, 0, 0, 2 + avr->address_size);
+					return;
+				case 0x95c8: _avr_decoded_set(o, AVR_OP_lpm, 0, 0, 0, 3); return;
+				case 0x95d8: _avr_decoded_set(o, AVR_OP_elpm, 0, 0, 0, 3); return;
+			}
+			get_d5(opcode);
+			switch (opcode & 0xfe0f) {
+				case 0x9000:
+					_avr_decoded_set(o, AVR_OP_lds, d, 0, x, 2);
+					o->size = 2;
+					return;
+				case 0x9200:
+					_avr_decoded_set(o, AVR_OP_sts, d, 0, x, 2);
+					o->size = 2;
+					return;
+				case 0x9004:
+				case 0x9005: _avr_decoded_set(o, AVR_OP_lpm, d, 0, opcode & 1, 3); return;
+				case 0x9006:
+				case 0x9007: _avr_decoded_set(o, AVR_OP_elpm, d, 0, opcode & 1, 3); return;
+				case 0x900c:
+				case 0x900d:
+				case 0x900e: _avr_decoded_set(o, AVR_OP_ld, d, R_XL, opcode & 3, 2); return;
+				case 0x920c:
+				case 0x920d:
+				case 0x920e: _avr_decoded_set(o, AVR_OP_st, d, R_XL, opcode & 3, 2); return;
+				case 0x9009:
+				case 0x900a: _avr_decoded_set(o, AVR_OP_ld, d, R_YL, opcode & 3, 2); return;
+				case 0x9209:
+				case 0x920a: _avr_decoded_set(o, AVR_OP_st, d, R_YL, opcode & 3, 2); return;
+				case 0x9001:
+				case 0x9002: _avr_decoded_set(o, AVR_OP_ld, d, R_ZL, opcode & 3, 2); return;
+				case 0x9201:
+				case 0x9202: _avr_decoded_set(o, AVR_OP_st, d, R_ZL, opcode & 3, 2); return;
+				case 0x900f: _avr_decoded_set(o, AVR_OP_pop, d, 0, 0, 2); return;
+				case 0x920f: _avr_decoded_set(o, AVR_OP_push, d, 0, 0, 2); return;
+				case 0x9400: _avr_decoded_set(o, AVR_OP_com, d, 0, 0, 1); return;
+				case 0x9401: _avr_decoded_set(o, AVR_OP_neg, d, 0, 0, 1); return;
+				case 0x9402: _avr_decoded_set(o, AVR_OP_swap, d, 0, 0, 1); return;
+				case 0x9403: _avr_decoded_set(o, AVR_OP_inc, d, 0, 0, 1); return;
+				case 0x9405: _avr_decoded_set(o, AVR_OP_asr, d, 0, 0, 1); return;
+				case 0x9406: _avr_decoded_set(o, AVR_OP_lsr, d, 0, 0, 1); return;
+				case 0x9407: _avr_decoded_set(o, AVR_OP_ror, d, 0, 0, 1); return;
+				case 0x940a: _avr_decoded_set(o, AVR_OP_dec, d, 0, 0, 1); return;
+				case 0x940c:
+				case 0x940d:
+				case 0x940e:
+				case 0x940f: {
+					avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
+					a = (a << 16) | x;
+					if (opcode & 2)
+						_avr_decoded_set(o, AVR_OP_call, 0, 0, a, 2);
+					else
+						_avr_decoded_set(o, AVR_OP_jmp, 0, 0, a, 3);
+					o->size = 2;
+				}	return;
+			}
+			switch (opcode & 0xff00) {
+				case 0x9600:
+				case 0x9700: {
+					const uint8_t p = 24 + ((opcode >> 3) & 0x6);
+					const uint8_t k = ((opcode & 0x00c0) >> 2) | (opcode & 0xf);
+					_avr_decoded_set(o, opcode & 0x0100 ? AVR_OP_sbiw : AVR_OP_adiw,
+							p, 0, k, 2);
+				}	return;
+				case 0x9800:
+				case 0x9900:
+				case 0x9a00:
+				case 0x9b00: {
+					get_io5_b3mask(opcode);
+					static const uint8_t bio[4] = {
+						AVR_OP_cbi, AVR_OP_sbic, AVR_OP_sbi, AVR_OP_sbis,
+					};
+					// only CBI and SBI have a fixed 2 cycles
+					_avr_decoded_set(o, bio[(opcode >> 8) & 3], io, mask, 0,
+							(opcode & 0x0100) ? 1 : 2);
+				}	return;
+			}
+			if ((opcode & 0xfc00) == 0x9c00 && !avr->no_mul) {
+				get_r5(opcode);
+				_avr_decoded_set(o, AVR_OP_mul, d, r, 0, 2);
+			}
+		}	break;
+		case 0xb000: {
+			get_d5_a6(opcode);
+			if (opcode & 0x0800)
+				_avr_decoded_set(o, AVR_OP_out, A, d, 0, 1);
+			else
+				_avr_decoded_set(o, AVR_OP_in, d, A, 0, 1);
+		}	break;
+		case 0xc000:
+		case 0xd000: {
+			const int16_t off = ((int16_t)((opcode << 4) & 0xffff)) >> 3;
+			if (opcode & 0x1000)
+				_avr_decoded_set(o, AVR_OP_rcall, 0, 0, (int32_t)off, 1);
+			else
+				_avr_decoded_set(o, AVR_OP_rjmp, 0, 0, (int32_t)off, 2);
+		}	break;
+		case 0xf000: {
+			switch (opcode & 0xfe00) {
+				case 0xf000:
+				case 0xf200:
+				case 0xf400:
+				case 0xf600: {
+					int16_t off = ((int16_t)(opcode << 6)) >> 9;
+					int set = (opcode & 0x0400) == 0;
+					_avr_decoded_set(o, AVR_OP_brbx, set, opcode & 7, (int32_t)(off << 1), 1);
+				}	break;
+				case 0xf800: {
+					get_d5(opcode);
+					_avr_decoded_set(o, AVR_OP_bld, d, 1 << (opcode & 7), 0, 1);
+				}	break;
+				case 0xfa00: {
+					get_d5(opcode);
+					_avr_decoded_set(o, AVR_OP_bst, d, 1 << (opcode & 7), 0, 1);
+				}	break;
+				case 0xfc00:
+				case 0xfe00: {
+					get_d5(opcode);
+					_avr_decoded_set(o, AVR_OP_sbrx, d, 1 << (opcode & 7),
+							(opcode & 0x0200) != 0, 1);
+				}	break;
+			}
+		}	break;
+	}
+}
+
+/*
+ * Busy loop detection.
+ * A short backward RJMP/BRBx whose body only works on registers, tests and
+ * reads memory without side effects (no store, no stack, no IO callbacks
+ * but those registered with avr_register_io_read_poll(), like the status
+ * registers peripherals are polled on) is decoded as a "loop" op. When such a branch is taken, and there is room
+ * left in run_cycle_count, one more iteration is run right away; if it
+ * leaves the registers and SREG untouched, every following iteration will
+ * do exactly the same thing until a cycle timer or an interrupt changes the
+ * memory, so as many whole iterations as fit in the budget are skipped by
+ * just adding their cycles.
+ */
+#define AVR_IDLE_LOOP_MAX	16	// words in the loop body
+#define AVR_IDLE_LOOP_MISS	4	// failed tries before giving up on a loop
+
+static inline int
+_avr_idle_read_ok(
+		avr_t * avr,
+		uint32_t addr)
+{
+	if (addr < 32 + avr->io_count) {
+		uint8_t h = avr->io_hook[addr];
+		if (h & AVR_IO_HOOK_READ_POLL)
+			h &= ~AVR_IO_HOOK_READ;
+		return !(h & (AVR_IO_HOOK_READ | AVR_IO_HOOK_IRQ_READ));
+	}
+	return addr <= avr->ramend;
+}
+
+static int
+_avr_idle_allowed(
+		avr_t * avr,
+		avr_decoded_t * o)
+{
+	const uint8_t kind = _avr_decoded_first[o->kind];
+
+	switch (kind) {
+		case AVR_OP_lds:
+			return _avr_idle_read_ok(avr, o->k);
+		case AVR_OP_in:
+			return _avr_idle_read_ok(avr, o->r);
+		case AVR_OP_sbic:
+		case AVR_OP_sbis:
+			return _avr_idle_read_ok(avr, o->d);
+		case AVR_OP_cpse:
+		case AVR_OP_sbrx:
+		case AVR_OP_brbx:
+		case AVR_OP_rjmp:
+		case AVR_OP_brbx_loop:
+		case AVR_OP_rjmp_loop:
+		case AVR_OP_brbx_countdown:
+			return 1;
+		case AVR_OP_bset:
+			return o->r != S_I;
+	}
+	return _avr_decoded_pure[kind];
+}
+
+static void
+_avr_idle_loop_classify(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		avr_decoded_t * o)
+{
+	int32_t off = (int32_t)o->k;
+
+	if (off >= 0 || -off > AVR_IDLE_LOOP_MAX * 2 || pc + 2 < (uint32_t)-off)
+		return;
+	avr_flashaddr_t a = pc + 2 + off;
+	while (a < pc) {
+		avr_decoded_t t;
+		_avr_decode(avr, a, &t);
+		if (!_avr_idle_allowed(avr, &t))
+			return;
+		a += t.size << 1;
+	}
+	if (a == pc)	// and not the second word of a 32 bits instruction
+		o->kind = o->kind == AVR_OP_rjmp ? AVR_OP_rjmp_loop : AVR_OP_brbx_loop;
+}
+
+/*
+ * Countdown loops, as generated for _delay_loop_1/2() and the
+ * __builtin_avr_delay_cycles() of _delay_us/ms():
+ *	1:	dec r		1:	sbiw r,1	1:	subi r0,1
+ *		brne 1b			brne 1b			sbci r1,0 ...
+ *						brne 1b
+ * These are recognized when a BRNE is decoded. Their only side effect is
+ * on the counter and SREG, so the number of iterations that fit in the
+ * budget can be computed instead of run.
+ */
+#define AVR_COUNTDOWN_MAX	4	// bytes in the counter
+
+/*
+ * Returns the size of the counter if the 'count' entries at 'e' are a
+ * countdown loop body, and fills 'reg' with its registers, LSB first.
+ */
+static int
+_avr_countdown_body(
+		avr_decoded_t * e,
+		uint32_t count,
+		uint8_t * reg)
+{
+	// the entries can be superinstructions, their first part is what counts
+	if (count == 1 && _avr_decoded_first[e->kind] == AVR_OP_dec) {
+		reg[0] = e->d;
+		return 1;
+	}
+	if (count == 1 && _avr_decoded_first[e->kind] == AVR_OP_sbiw && e->k == 1) {
+		reg[0] = e->d;
+		reg[1] = e->d + 1;
+		return 2;
+	}
+	if (count < 1 || count > AVR_COUNTDOWN_MAX ||
+			_avr_decoded_first[e->kind] != AVR_OP_subi || e->k != 1)
+		return 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (i && (_avr_decoded_first[e[i].kind] != AVR_OP_sbci || e[i].k != 0))
+			return 0;
+		for (uint32_t j = 0; j < i; j++)
+			if (reg[j] == e[i].d)
+				return 0;
+		reg[i] = e[i].d;
+	}
+	return count;
+}
+
+/*
+ * Copy and fill loops, as in avr-libc's memcpy(), memcpy_P(), memset(),
+ * and the __do_copy_data/__do_clear_bss of crt0:
+ *	1:	ld r0,Z+	1:	lpm r0,Z+	1:	st X+,r22
+ *		st X+,r0		st X+,r0		subi r20,1
+ *		subi r20,1		cpi r26,lo8(end)	sbci r21,0
+ *		sbci r21,0		cpc r27,r17		brcc 1b
+ *		brcc 1b			brne 1b
+ * The load can be an LD, LPM or ELPM with a post increment, or none; the
+ * loop ends when a 16 bits counter goes below zero, or when one of the
+ * pointers reaches the end. These are recognized when the branch is
+ * decoded, and the memory they use is checked when it's taken.
+ */
+typedef struct avr_copy_loop_t {
+	uint8_t		load;		// AVR_OP_ld, lpm or elpm, 0 for a fill
+	uint8_t		src, dst;	// pointer registers
+	uint8_t		v;			// the register copied, or the value of a fill
+	uint8_t		counter;	// 'reg' is a counter, not a pointer
+	uint8_t		reg;		// the pointer that is compared, or the counter
+	uint8_t		end, k;		// register with the end high byte, and low byte
+} avr_copy_loop_t;
+
+// 1 if register 'r' is one of the pair at 'p'
+#define AVR_COPY_PAIR(_p, _r) ((_r) == (_p) || (_r) == (_p) + 1)
+// 1 if the pairs at 'a' and 'b' share a register
+#define AVR_COPY_PAIRS(_a, _b) ((_a) + 1 >= (_b) && (_b) + 1 >= (_a))
+
+/*
+ * Returns 1 if the 'count' entries at 'e', and the branch 'o', are a copy
+ * or fill loop body, and describes it in 'l'.
+ */
+static int
+_avr_copy_body(
+		avr_t * avr,
+		avr_decoded_t * e,
+		uint32_t count,
+		avr_decoded_t * o,
+		avr_copy_loop_t * l)
+{
+	if (count < 3 || count > 4)
+		return 0;
+	memset(l, 0, sizeof(*l));
+	if (count == 4) {
+		l->load = _avr_decoded_first[e->kind];
+		if (e->k != 1 || (l->load != AVR_OP_ld && l->load != AVR_OP_lpm &&
+					(l->load != AVR_OP_elpm || !avr->rampz)))
+			return 0;
+		l->src = l->load == AVR_OP_ld ? e->r : R_ZL;
+		l->v = e->d;
+		e++;
+	}
+	// the store
+	if (_avr_decoded_first[e->kind] != AVR_OP_st || e->k != 1 ||
+			(l->load && (e->d != l->v || e->r == l->src)))
+		return 0;
+	l->dst = e->r;
+	l->v = e->d;
+	if (AVR_COPY_PAIR(l->dst, l->v) ||
+			(l->load && AVR_COPY_PAIR(l->src, l->v)))
+		return 0;
+	e++;
+	// and the test
+	uint8_t t0 = _avr_decoded_first[e[0].kind];
+	uint8_t t1 = _avr_decoded_first[e[1].kind];
+	l->reg = e[0].d;
+	if (t0 == AVR_OP_cpi && t1 == AVR_OP_cpc && o->r == S_Z && !o->d) {
+		if (e[1].d != l->reg + 1 ||
+				(l->reg != l->dst && (!l->load || l->reg != l->src)))
+			return 0;
+		l->end = e[1].r;
+		l->k = e[0].k;
+		return !AVR_COPY_PAIR(l->dst, l->end) && l->end != l->v &&
+				(!l->load || !AVR_COPY_PAIR(l->src, l->end));
+	}
+	if (t0 == AVR_OP_subi && t1 == AVR_OP_sbci && o->r == S_C && !o->d) {
+		if (e[0].k != 1 || e[1].k != 0 || e[1].d != l->reg + 1)
+			return 0;
+		l->counter = 1;
+		return !AVR_COPY_PAIRS(l->reg, l->dst) && !AVR_COPY_PAIR(l->reg, l->v) &&
+				(!l->load || !AVR_COPY_PAIRS(l->reg, l->src));
+	}
+	return 0;
+}
+
+static void
+_avr_copy_classify(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		avr_decoded_t * o)
+{
+	int32_t off = (int32_t)o->k;
+
+	if (off != -8 && off != -10)
+		return;
+	if (pc + 2 < (uint32_t)-off)
+		return;
+	avr_decoded_t t[4];
+	uint32_t count = (-off - 2) >> 1;
+	avr_copy_loop_t l;
+	for (uint32_t i = 0; i < count; i++)
+		_avr_decode(avr, pc + 2 + off + (i << 1), t + i);
+	if (_avr_copy_body(avr, t, count, o, &l))
+		o->kind = AVR_OP_brbx_copy;
+}
+
+static void
+_avr_countdown_classify(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		avr_decoded_t * o)
+{
+	int32_t off = (int32_t)o->k;
+
+	if (o->r != S_Z || o->d || off >= 0 ||
+			-off > (AVR_COUNTDOWN_MAX + 1) * 2 || pc + 2 < (uint32_t)-off)
+		return;
+	avr_decoded_t t[AVR_COUNTDOWN_MAX];
+	uint32_t count = (-off - 2) >> 1;
+	uint8_t reg[AVR_COUNTDOWN_MAX];
+	for (uint32_t i = 0; i < count; i++)
+		_avr_decode(avr, pc + 2 + off + (i << 1), t + i);
+	if (_avr_countdown_body(t, count, reg))
+		o->kind = AVR_OP_brbx_countdown;
+}
+
+static void
+_avr_decode_block(
+		avr_t * avr,
+		uint32_t i,
+		int fuse);
+
+// kind of the first instruction of entry 'i', decoding it if needed
+static uint8_t
+_avr_fuse_kind(
+		avr_t * avr,
+		uint32_t i)
+{
+	if (i >= (avr->flashend + 1) >> 1)
+		return AVR_OP_decode;
+	if (avr->decoded[i].kind == AVR_OP_decode)
+		_avr_decode_block(avr, i, 0);
+	return _avr_decoded_first[avr->decoded[i].kind];
+}
+
+/*
+ * Turns entry 'i' into a superinstruction if it starts one of the
+ * sequences. The busy loop branches are left alone, they have their own
+ * handlers.
+ */
+static void
+_avr_fuse(
+		avr_t * avr,
+		uint32_t i)
+{
+	avr_decoded_t * o = avr->decoded + i;
+
+	switch (o->kind) {
+		case AVR_OP_ldi:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_ldi)
+				o->kind = AVR_OP_ldi_ldi;
+			break;
+		case AVR_OP_subi:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_sbci)
+				o->kind = AVR_OP_subi_sbci;
+			break;
+		case AVR_OP_cp:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_cpc)
+				o->kind = _avr_fuse_kind(avr, i + 2) == AVR_OP_brbx ?
+						AVR_OP_cp_cpc_brbx : AVR_OP_cp_cpc;
+			break;
+		case AVR_OP_cpi:
+			switch (_avr_fuse_kind(avr, i + 1)) {
+				case AVR_OP_cpc: o->kind = AVR_OP_cpi_cpc; break;
+				case AVR_OP_brbx: o->kind = AVR_OP_cpi_brbx; break;
+			}
+			break;
+		case AVR_OP_cpc:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_brbx)
+				o->kind = AVR_OP_cpc_brbx;
+			break;
+		case AVR_OP_ld:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_st)
+				o->kind = AVR_OP_ld_st;
+			break;
+		case AVR_OP_push:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_push)
+				o->kind = AVR_OP_push_push;
+			break;
+		case AVR_OP_pop:
+			if (_avr_fuse_kind(avr, i + 1) == AVR_OP_pop)
+				o->kind = AVR_OP_pop_pop;
+			break;
+	}
+}
+
+/*
+ * Decode entry 'i', and the following ones for as long as they are "pure",
+ * filling in their 'block' and 'block_cycles': the number of pure
+ * instructions starting at each of them, and how long they take.
+ * A block stops at the first branch, skip or IO/SRAM access, and also
+ * where an already decoded entry is found; that one has a block of its own.
+ * With 'fuse', the new entries are then made superinstructions where they
+ * can; the instructions that follows are decoded for that if needed, but
+ * not fused themselves, that's done when they are reached.
+ */
+static void
+_avr_decode_block(
+		avr_t * avr,
+		uint32_t i,
+		int fuse)
+{
+	uint32_t count = (avr->flashend + 1) >> 1;
+	uint32_t e = i;
+	uint32_t decoded = 0;
+
+	do {
+		avr_decoded_t * o = avr->decoded + e;
+		_avr_decode(avr, e << 1, o);
+		o->block = 0;
+		o->block_cycles = 0;
+		decoded++;
+		if (o->kind == AVR_OP_brbx)
+			_avr_countdown_classify(avr, e << 1, o);
+		if (o->kind == AVR_OP_brbx)
+			_avr_copy_classify(avr, e << 1, o);
+		if (o->kind == AVR_OP_rjmp || o->kind == AVR_OP_brbx)
+			_avr_idle_loop_classify(avr, e << 1, o);
+		if (!_avr_decoded_pure[o->kind] ||
+				(o->kind == AVR_OP_bset && o->r == S_I))
+			break;
+		e++;
+	} while (e < count && e - i < AVR_DECODED_BLOCK_MAX &&
+				avr->decoded[e].kind == AVR_OP_decode);
+
+	uint16_t cycles = 0;
+	for (uint32_t j = e; j-- > i; ) {
+		cycles += avr->decoded[j].cycles;
+		avr->decoded[j].block = e - j;
+		avr->decoded[j].block_cycles = cycles;
+	}
+	if (fuse)
+		for (uint32_t j = i; j < i + decoded; j++)
+			_avr_fuse(avr, j);
+}
+
+AVR_DECODED_OP(decode)
+{
+	_avr_decode_block(avr, avr->pc >> 1, 1);
+	*cycle = o->cycles;
+	return _avr_decoded_op[o->kind](avr, o, new_pc, cycle);
+}
+
+static void
+_avr_idle_loop_miss(
+		avr_t * avr,
+		avr_flashaddr_t branch,
+		avr_decoded_t * o)
+{
+	if (avr->idle_loop.pc != branch) {
+		avr->idle_loop.pc = branch;
+		avr->idle_loop.miss = 0;
+	}
+	if (++avr->idle_loop.miss >= AVR_IDLE_LOOP_MISS)
+		o->kind = o->kind == AVR_OP_rjmp_loop ? AVR_OP_rjmp : AVR_OP_brbx;
+}
+
+/*
+ * Called with the loop branch just taken back to 'target'. The extra
+ * iteration is run with the normal handlers, but it can't reach the end of
+ * run_cycle_count (that's checked first) so it's just as if the main loop
+ * had run it. If it strays out of the loop, or reaches something not
+ * allowed, it stops there and the main loop carries on from that point.
+ */
+static avr_flashaddr_t
+_avr_idle_loop(
+		avr_t * avr,
+		avr_decoded_t * o,
+		avr_flashaddr_t target,
+		int * cycle)
+{
+	const avr_flashaddr_t branch = avr->pc;
+
+	if (target > branch || avr->gdb || avr->trace_file ||
+			avr->interrupt_state ||
+			avr->state != cpu_Running ||
+			avr->run_cycle_count <= *cycle + (AVR_IDLE_LOOP_MAX + 1) * 4)
+		return target;
+
+	uint8_t r[32], sreg[8];
+	avr_sreg_materialize(avr);
+	memcpy(r, avr->data, 32);
+	memcpy(sreg, avr->sreg, 8);
+
+	avr_flashaddr_t pc = target;
+	int c = 0;
+	for (int count = 0; ; count++) {
+		avr_decoded_t * e = NULL;
+		// only looked up once it's known to be in the loop, thus in flash
+		if (pc >= target && pc <= branch && count <= AVR_IDLE_LOOP_MAX &&
+				avr->state == cpu_Running) {
+			e = avr->decoded + (pc >> 1);
+			if (e->kind == AVR_OP_decode)
+				_avr_decode_block(avr, pc >> 1, 1);
+		}
+		if (!e || !_avr_idle_allowed(avr, e)) {
+			_avr_idle_loop_miss(avr, branch, o);
+			avr->pc = branch;
+			*cycle += c;
+			return pc;
+		}
+		int ec = e->cycles;
+		avr->pc = pc;
+		switch (e->kind) {	// don't recurse in here, even for nested loops
+			case AVR_OP_rjmp_loop:
+				pc = _avr_op_rjmp(avr, e, pc + 2, &ec);
+				break;
+			case AVR_OP_brbx_loop:
+			case AVR_OP_brbx_countdown:
+				pc = _avr_op_brbx(avr, e, pc + 2, &ec);
+				break;
+			default:	// nor run superinstructions, that account for cycles
+				pc = _avr_decoded_op[_avr_decoded_first[e->kind]](avr, e, pc + 2, &ec);
+		}
+		c += ec;
+		if (avr->pc == branch && pc == target)
+			break;
+	}
+	avr->pc = branch;
+	*cycle += c;
+
+	avr_sreg_materialize(avr);
+	if (memcmp(r, avr->data, 32) || memcmp(sreg, avr->sreg, 8)) {
+		_avr_idle_loop_miss(avr, branch, o);
+		return target;
+	}
+	// a polled register's callback raised an interrupt, or stopped the core
+	if (avr->interrupt_state || avr->state != cpu_Running)
+		return target;
+	// or isn't one anymore, see avr_unregister_io_read_poll()
+	for (pc = target; pc < branch; pc += avr->decoded[pc >> 1].size << 1)
+		if (!_avr_idle_allowed(avr, avr->decoded + (pc >> 1))) {
+			_avr_idle_loop_miss(avr, branch, o);
+			return target;
+		}
+	/*
+	 * Idle. Leave at least one cycle of budget after the skipped iterations,
+	 * as the main loop would.
+	 */
+	avr_cycle_count_t n = (avr->run_cycle_count - *cycle - 1) / c;
+	if (n > (INT32_MAX / 2) / c)
+		n = (INT32_MAX / 2) / c;
+	*cycle += n * c;
+	avr->idle_loop.miss = 0;
+	return target;
+}
+
+AVR_DECODED_OP(rjmp_loop)
+{
+	return _avr_idle_loop(avr, o, _avr_op_rjmp(avr, o, new_pc, cycle), cycle);
+}
+
+AVR_DECODED_OP(brbx_loop)
+{
+	return _avr_idle_loop(avr, o, _avr_op_brbx(avr, o, new_pc, cycle), cycle);
+}
+
+/*
+ * Runs the 'count' entries of a loop body at 'target', and its branch 'o',
+ * with the normal handlers; the last of the iterations a loop handler
+ * accounted for, so SREG ends up exactly as it would have.
+ */
+static avr_flashaddr_t
+_avr_loop_iteration(
+		avr_t * avr,
+		avr_decoded_t * o,
+		avr_decoded_t * e,
+		uint32_t count,
+		avr_flashaddr_t target,
+		int * cycle)
+{
+	const avr_flashaddr_t branch = avr->pc;
+
+	avr_flashaddr_t pc = target;
+	for (uint32_t i = 0; i < count; i++, pc += 2) {
+		int ec = e[i].cycles;
+		avr->pc = pc;
+		_avr_decoded_op[_avr_decoded_first[e[i].kind]](avr, e + i, pc + 2, &ec);
+		*cycle += ec;
+	}
+	int ec = o->cycles;
+	avr->pc = branch;
+	pc = _avr_op_brbx(avr, o, branch + 2, &ec);
+	*cycle += ec;
+	return pc;
+}
+
+/*
+ * Called with the BRNE of a countdown loop just executed. If it was taken,
+ * the counter holds the number of iterations left, the last one falling
+ * through. As many as fit in run_cycle_count are accounted for by
+ * decrementing the counter and adding their cycles, minus one which is run
+ * with the normal handlers so SREG ends up exactly as it would have.
+ * Returns where the main loop should carry on; the loop exit when all of
+ * it fit, or the loop start if a cycle timer or the end of the burst is due
+ * before that.
+ */
+static avr_flashaddr_t
+_avr_countdown_loop(
+		avr_t * avr,
+		avr_decoded_t * o,
+		avr_flashaddr_t target,
+		int * cycle)
+{
+	const avr_flashaddr_t branch = avr->pc;
+
+	if (target > branch || avr->gdb || avr->trace_file ||
+			avr->interrupt_state ||
+			avr->state != cpu_Running)
+		return target;
+
+	uint32_t count = (branch - target) >> 1;
+	avr_decoded_t * e = avr->decoded + (target >> 1);
+	uint8_t reg[AVR_COUNTDOWN_MAX];
+	int bytes = _avr_countdown_body(e, count, reg);
+	if (!bytes)		// not decoded yet, or the flash was rewritten
+		return target;
+
+	int c = o->cycles + 1;
+	for (uint32_t i = 0; i < count; i++)
+		c += e[i].cycles;
+	if (avr->run_cycle_count <= (avr_cycle_count_t)*cycle + c)
+		return target;
+	avr_cycle_count_t n = (avr->run_cycle_count - *cycle - 1) / c;
+	if (n > (INT32_MAX / 2) / c)
+		n = (INT32_MAX / 2) / c;
+
+	uint32_t v = 0;
+	for (int i = bytes; i--; )
+		v = (v << 8) | avr->data[reg[i]];
+	if (n > v)		// can only be 0 if it was jumped into, in the middle
+		n = v;
+	if (n < 2)
+		return target;
+
+	v -= n - 1;
+	for (int i = 0; i < bytes; i++)
+		_avr_set_r(avr, reg[i], v >> (i * 8));
+	*cycle += (n - 1) * c;
+
+	return _avr_loop_iteration(avr, o, e, count, target, cycle);
+}
+
+AVR_DECODED_OP(brbx_countdown)
+{
+	return _avr_countdown_loop(avr, o, _avr_op_brbx(avr, o, new_pc, cycle), cycle);
+}
+
+/*
+ * Called with the branch of a copy or fill loop just executed (see
+ * _avr_copy_body()). Same as _avr_countdown_loop(), the iterations that
+ * fit are done with a memcpy() or memset(), but only if the bytes read
+ * and written are all plain SRAM, or flash, and don't overlap. Otherwise
+ * the loop is just interpreted.
+ */
+static avr_flashaddr_t
+_avr_copy_loop(
+		avr_t * avr,
+		avr_decoded_t * o,
+		avr_flashaddr_t target,
+		int * cycle)
+{
+	const avr_flashaddr_t branch = avr->pc;
+
+	if (target > branch || avr->gdb || avr->gdb_watch || avr->heatmap ||
+			avr->trace_file ||
+			avr->interrupt_state || avr->state != cpu_Running)
+		return target;
+
+	uint32_t count = (branch - target) >> 1;
+	avr_decoded_t * e = avr->decoded + (target >> 1);
+	avr_copy_loop_t l;
+	if (!_avr_copy_body(avr, e, count, o, &l))
+		return target;
+
+	int c = o->cycles + 1;
+	for (uint32_t i = 0; i < count; i++)
+		c += e[i].cycles;
+	if (avr->run_cycle_count <= (avr_cycle_count_t)*cycle + c)
+		return target;
+	avr_cycle_count_t n = (avr->run_cycle_count - *cycle - 1) / c;
+	if (n > (INT32_MAX / 2) / c)
+		n = (INT32_MAX / 2) / c;
+
+	// iterations left, this one included; the counter goes down to -1
+	uint32_t v = avr->data[l.reg] | (avr->data[l.reg + 1] << 8);
+	uint32_t left = l.counter ? v + 1 :
+			(((l.k | (avr->data[l.end] << 8)) - v - 1) & 0xffff) + 1;
+	if (n > left)
+		n = left;
+	if (n < 2)
+		return target;
+
+	uint32_t k = n - 1;
+	uint32_t dst = avr->data[l.dst] | (avr->data[l.dst + 1] << 8);
+	if (dst < 32 + avr->io_count || dst + k > avr->ramend + 1u)
+		return target;
+	uint8_t * src = NULL;
+	uint32_t from = 0;
+	switch (l.load) {
+		case AVR_OP_ld:
+			from = avr->data[l.src] | (avr->data[l.src + 1] << 8);
+			if (from < 32 + avr->io_count || from + k > avr->ramend + 1u ||
+					(from < dst + k && dst < from + k))
+				return target;
+			src = avr->data + from;
+			break;
+		case AVR_OP_lpm:
+		case AVR_OP_elpm:
+			from = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+			if (l.load == AVR_OP_elpm)
+				from |= avr->data[avr->rampz] << 16;
+			else if (from + k > 0x10000)	// Z doesn't carry into RAMPZ
+				return target;
+			if (from + k > avr->flashend + 1)
+				return target;
+			src = avr->flash + from;
+			break;
+	}
+
+	if (src) {
+		memcpy(avr->data + dst, src, k);
+		_avr_set_r(avr, l.v, src[k - 1]);
+		from += k;
+		if (l.load == AVR_OP_elpm)
+			_avr_set_r(avr, avr->rampz, from >> 16);
+		_avr_set_r16le_hl(avr, l.src, from);
+	} else
+		memset(avr->data + dst, avr->data[l.v], k);
+	if (unlikely(avr->dirty.data))
+		avr_dirty_mark(avr->dirty.data, dst, k);
+	_avr_set_r16le_hl(avr, l.dst, dst + k);
+	if (l.counter) {
+		v -= k;
+		_avr_set_r(avr, l.reg, v);
+		_avr_set_r(avr, l.reg + 1, v >> 8);
+	}
+	*cycle += k * c;
+
+	return _avr_loop_iteration(avr, o, e, count, target, cycle);
+}
+
+AVR_DECODED_OP(brbx_copy)
+{
+	return _avr_copy_loop(avr, o, _avr_op_brbx(avr, o, new_pc, cycle), cycle);
+}
+
+/*
+ * Same as avr_run_one(), but using the predecoded entries
+ */
+static avr_flashaddr_t
+_avr_run_decoded(
+		avr_t * avr)
+{
+	for (;;) {
+		if (unlikely(avr->pc >= avr->flashend)) {
+			crash(avr);
+			return 0;
+		}
+		avr_decoded_t * o = avr->decoded + (avr->pc >> 1);
+		int cycle = o->cycles;
+		avr_flashaddr_t new_pc = _avr_decoded_op[o->kind](avr, o, avr->pc + 2, &cycle);
+		avr->cycle += cycle;
+
+		if ((avr->state != cpu_Running) ||
+			(avr->run_cycle_count <= cycle) ||
+			(avr->interrupt_state != 0)) {
+			avr_sreg_materialize(avr);
+			return new_pc;
+		}
+		avr->run_cycle_count -= cycle;
+		avr->pc = new_pc;
+	}
+}
+
+/*
+ * Threaded version of _avr_run_decoded(). Each handler is expanded in place
+ * and ends with its own copy of the dispatch, so the host branch predictor
+ * gets one indirect jump per AVR instruction kind instead of a single shared
+ * one. Needs the GCC/clang "labels as values" extension.
+ *
+ * When a block of pure instructions starts at the pc, and it completes
+ * before the next cycle timer is due, it's run in one go with only a
+ * minimal dispatch between instructions; the cycle count, budget and pc
+ * are updated once for the whole block. This can't change the outcome,
+ * as none of these instructions can stop the loop below on their own.
+ */
+#if defined(__GNUC__)
+#define AVR_THREADED_LABEL(_name) &&op_##_name,
+#define AVR_THREADED_FUSED_LABEL(_name, _first) &&op_##_name,
+#define AVR_THREADED_OP(_name) \
+	op_##_name: \
+		new_pc = _avr_op_##_name(avr, o, avr->pc + 2, &cycle); \
+		AVR_THREADED_NEXT();
+#define AVR_THREADED_FUSED_OP(_name, _first) AVR_THREADED_OP(_name)
+#define AVR_THREADED_BLOCK_LABEL(_name) [AVR_OP_##_name] = &&block_##_name,
+// in a block, a superinstruction only runs its first part
+#define AVR_THREADED_FUSED_BLOCK_LABEL(_name, _first) \
+	[AVR_OP_##_name] = &&block_##_first,
+#define AVR_THREADED_BLOCK_OP(_name) \
+	block_##_name: \
+		_avr_op_##_name(avr, o, 0, &cycle); \
+		if (--left) { \
+			o++; \
+			goto *block_dispatch[o->kind]; \
+		} \
+		AVR_THREADED_DISPATCH();
+#define AVR_THREADED_DISPATCH() \
+	if (unlikely(avr->pc >= avr->flashend)) { \
+		crash(avr); \
+		return 0; \
+	} \
+	o = avr->decoded + (avr->pc >> 1); \
+	if (o->block > 1 && avr->run_cycle_count > o->block_cycles && \
+			avr->interrupt_state == 0) { \
+		left = o->block; \
+		avr->cycle += o->block_cycles; \
+		avr->run_cycle_count -= o->block_cycles; \
+		avr->pc += left << 1; \
+		goto *block_dispatch[o->kind]; \
+	} \
+	cycle = o->cycles; \
+	goto *dispatch[o->kind];
+#define AVR_THREADED_NEXT() \
+	avr->cycle += cycle; \
+	if ((avr->state != cpu_Running) || \
+		(avr->run_cycle_count <= cycle) || \
+		(avr->interrupt_state != 0)) { \
+		avr_sreg_materialize(avr); \
+		return new_pc; \
+	} \
+	avr->run_cycle_count -= cycle; \
+	avr->pc = new_pc; \
+	AVR_THREADED_DISPATCH();
+
+avr_flashaddr_t
+avr_run_threaded(
+		avr_t * avr)
+{
+	static const void * const dispatch[AVR_OP_COUNT] = {
+		&&op_decode,
+		AVR_DECODED_OPS(AVR_THREADED_LABEL)
+		AVR_DECODED_FUSED_OPS(AVR_THREADED_FUSED_LABEL)
+	};
+	static const void * const block_dispatch[AVR_OP_COUNT] = {
+		AVR_DECODED_PURE_OPS(AVR_THREADED_BLOCK_LABEL)
+		AVR_DECODED_FUSED_PURE_OPS(AVR_THREADED_FUSED_BLOCK_LABEL)
+	};
+	avr_decoded_t * o;
+	avr_flashaddr_t new_pc;
+	int cycle;
+	unsigned int left = 0;
+
+	AVR_THREADED_DISPATCH();
+op_decode:
+	_avr_decode_block(avr, avr->pc >> 1, 1);
+	AVR_THREADED_DISPATCH();
+
+	AVR_DECODED_OPS(AVR_THREADED_OP)
+	AVR_DECODED_FUSED_OPS(AVR_THREADED_FUSED_OP)
+	AVR_DECODED_PURE_OPS(AVR_THREADED_BLOCK_OP)
+}
+#else
+avr_flashaddr_t
+avr_run_threaded(
+		avr_t * avr)
+{
+	return _avr_run_decoded(avr);
+}
+#endif
+
+/*
+ * Pure blocks run on several cores at once (see sim_lockstep.h): the
+ * registers the block uses and the SREG bits of the lanes are copied in
+ * vectors, one per register, with an element per lane, and each
+ * instruction is decoded once and applied to whole vectors. The flags are
+ * computed eagerly, with the same formulas as the _avr_flags_*() above.
+ * Needs the GCC/clang vector extension.
+ */
+#if defined(__GNUC__)
+#define AVR_LANES	16
+
+typedef uint8_t avr_lanes_v __attribute__((vector_size(AVR_LANES)));
 
-#define get_vd5_vr5(o) \
-		get_r5(o); \
-		get_d5(o); \
-		const uint8_t vd = avr->data[d], vr = avr->data[r];
+typedef struct avr_lanes_t {
+	avr_lanes_v		r[32];
+	avr_lanes_v		f[8];
+} avr_lanes_t;
 
-#define get_d5_vr5(o) \
-		get_d5(o); \
-		get_r5(o); \
-		const uint8_t vr = avr->data[r];
+// the comparisons give 0 or -1 in each element
+#define AVR_LANES_BOOL(_cmp) ((avr_lanes_v)(_cmp) & 1)
 
-#define get_h4_k8(o) \
-		const uint8_t h = 16 + ((o >> 4) & 0xf); \
-		const uint8_t k = ((o & 0x0f00) >> 4) | (o & 0xf);
+static inline void
+_avr_lanes_zns(
+		avr_lanes_t * s,
+		avr_lanes_v res)
+{
+	s->f[S_Z] = AVR_LANES_BOOL(res == 0);
+	s->f[S_N] = res >> 7;
+	s->f[S_S] = s->f[S_N] ^ s->f[S_V];
+}
 
-#define get_vh4_k8(o) \
-		get_h4_k8(o) \
-		const uint8_t vh = avr->data[h];
+static inline void
+_avr_lanes_add(
+		avr_lanes_t * s,
+		avr_lanes_v res,
+		avr_lanes_v rd,
+		avr_lanes_v rr)
+{
+	avr_lanes_v add_carry = (rd & rr) | (rr & ~res) | (~res & rd);
+	s->f[S_H] = (add_carry >> 3) & 1;
+	s->f[S_C] = add_carry >> 7;
+	s->f[S_V] = ((rd & rr & ~res) | (~rd & ~rr & res)) >> 7;
+	_avr_lanes_zns(s, res);
+}
 
-#define get_d5_q6(o) \
-		get_d5(o) \
-		const uint8_t q = ((o & 0x2000) >> 8) | ((o & 0x0c00) >> 7) | (o & 0x7);
+// 'keep_z' is for the ones with carry, that only clear Z
+static inline void
+_avr_lanes_sub(
+		avr_lanes_t * s,
+		avr_lanes_v res,
+		avr_lanes_v rd,
+		avr_lanes_v rr,
+		int keep_z)
+{
+	avr_lanes_v sub_carry = (~rd & rr) | (rr & res) | (res & ~rd);
+	avr_lanes_v z = s->f[S_Z];
+	s->f[S_H] = (sub_carry >> 3) & 1;
+	s->f[S_C] = sub_carry >> 7;
+	s->f[S_V] = ((rd & ~rr & ~res) | (~rd & rr & res)) >> 7;
+	_avr_lanes_zns(s, res);
+	if (keep_z)
+		s->f[S_Z] &= z;
+}
 
-#define get_io5(o) \
-		const uint8_t io = ((o >> 3) & 0x1f) + 32;
+static inline void
+_avr_lanes_znv0s(
+		avr_lanes_t * s,
+		avr_lanes_v res)
+{
+	s->f[S_V] = (avr_lanes_v){};
+	_avr_lanes_zns(s, res);
+}
 
-#define get_io5_b3(o) \
-		get_io5(o); \
-		const uint8_t b = o & 0x7;
+static inline void
+_avr_lanes_zcnvs(
+		avr_lanes_t * s,
+		avr_lanes_v res,
+		avr_lanes_v vr)
+{
+	s->f[S_Z] = AVR_LANES_BOOL(res == 0);
+	s->f[S_C] = vr & 1;
+	s->f[S_N] = res >> 7;
+	s->f[S_V] = s->f[S_N] ^ s->f[S_C];
+	s->f[S_S] = s->f[S_N] ^ s->f[S_V];
+}
 
-#define get_io5_b3mask(o) \
-		get_io5(o); \
-		const uint8_t mask = 1 << (o & 0x7);
+// the registers instruction 'o' reads or writes
+static uint32_t
+_avr_lanes_used(
+		const avr_decoded_t * o)
+{
+	uint32_t used = 3u << o->d;
 
-//	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
-#define get_o12(op) \
-		const int16_t o = ((int16_t)((op << 4) & 0xffff)) >> 3;
+	switch (_avr_decoded_first[o->kind]) {
+		case AVR_OP_cpc: case AVR_OP_add: case AVR_OP_adc: case AVR_OP_sbc:
+		case AVR_OP_sub: case AVR_OP_cp: case AVR_OP_and: case AVR_OP_eor:
+		case AVR_OP_or: case AVR_OP_mov: case AVR_OP_movw:
+			used |= 3u << o->r;
+			break;
+		case AVR_OP_muls: case AVR_OP_fmul: case AVR_OP_mul:
+			used |= (3u << o->r) | 3;
+			break;
+		case AVR_OP_lpm:
+			used |= 3u << R_ZL;
+			break;
+	}
+	return used;
+}
 
-#define get_vp2_k6(o) \
-		const uint8_t p = 24 + ((o >> 3) & 0x6); \
-		const uint8_t k = ((o & 0x00c0) >> 2) | (o & 0xf); \
-		const uint16_t vp = avr->data[p] | (avr->data[p + 1] << 8);
+// the products, a lane at a time, as in _avr_op_mul() and the others
+static void
+_avr_lanes_mul(
+		avr_lanes_t * s,
+		uint8_t kind,
+		const avr_decoded_t * o)
+{
+	for (int l = 0; l < AVR_LANES; l++) {
+		uint8_t vd = s->r[o->d][l], vr = s->r[o->r][l];
+		int16_t res;
+		uint8_t c;
+		if (kind == AVR_OP_mul)
+			res = (uint16_t)(vd * vr);
+		else if (kind == AVR_OP_muls || o->k == 0x80)
+			res = ((int8_t)vr) * ((int8_t)vd);
+		else if (o->k == 0x08)
+			res = vr * vd;
+		else
+			res = vr * ((int8_t)vd);
+		c = (res >> 15) & 1;
+		if (kind == AVR_OP_fmul && o->k)
+			res <<= 1;
+		s->r[0][l] = res;
+		s->r[1][l] = (uint16_t)res >> 8;
+		s->f[S_C][l] = c;
+		s->f[S_Z][l] = res == 0;
+	}
+}
 
-#define get_sreg_bit(o) \
-		const uint8_t b = (o >> 4) & 7;
+// one instruction of the block, on all the lanes
+static void
+_avr_lanes_op(
+		avr_t ** lane,
+		int n,
+		avr_lanes_t * s,
+		const avr_decoded_t * o)
+{
+	avr_lanes_v * d = &s->r[o->d], * r = &s->r[o->r & 31];
+	const avr_lanes_v k = (avr_lanes_v){} + (uint8_t)o->k;
+	const uint8_t kind = _avr_decoded_first[o->kind];
+	avr_lanes_v vd = *d, res;
 
-/*
- * Add a "jump" address to the jump trace buffer
- */
-#if CONFIG_SIMAVR_TRACE
-#define TRACE_JUMP()\
-	avr->trace_data->old[avr->trace_data->old_pci].pc = avr->pc;\
-	avr->trace_data->old[avr->trace_data->old_pci].sp = _avr_sp_get(avr);\
-	avr->trace_data->old_pci = (avr->trace_data->old_pci + 1) & (OLD_PC_SIZE-1);\
+	switch (kind) {
+		case AVR_OP_nop:
+			break;
+		case AVR_OP_cpc:
+			res = vd - *r - s->f[S_C];
+			_avr_lanes_sub(s, res, vd, *r, 1);
+			break;
+		case AVR_OP_add:
+		case AVR_OP_adc:
+			res = vd + *r;
+			if (kind == AVR_OP_adc)
+				res += s->f[S_C];
+			_avr_lanes_add(s, res, vd, *r);
+			*d = res;
+			break;
+		case AVR_OP_sbc:
+			res = vd - *r - s->f[S_C];
+			_avr_lanes_sub(s, res, vd, *r, 1);
+			*d = res;
+			break;
+		case AVR_OP_sub:
+		case AVR_OP_cp:
+			res = vd - *r;
+			_avr_lanes_sub(s, res, vd, *r, 0);
+			if (kind == AVR_OP_sub)
+				*d = res;
+			break;
+		case AVR_OP_and:
+			*d = vd & *r;
+			_avr_lanes_znv0s(s, *d);
+			break;
+		case AVR_OP_eor:
+			*d = vd ^ *r;
+			_avr_lanes_znv0s(s, *d);
+			break;
+		case AVR_OP_or:
+			*d = vd | *r;
+			_avr_lanes_znv0s(s, *d);
+			break;
+		case AVR_OP_mov:
+			*d = *r;
+			break;
+		case AVR_OP_movw: {
+			avr_lanes_v lo = r[0], hi = r[1];
+			d[0] = lo;
+			d[1] = hi;
+		}	break;
+		case AVR_OP_muls:
+		case AVR_OP_fmul:
+		case AVR_OP_mul:
+			_avr_lanes_mul(s, kind, o);
+			break;
+		case AVR_OP_cpi:
+			_avr_lanes_sub(s, vd - k, vd, k, 0);
+			break;
+		case AVR_OP_sbci:
+			res = vd - k - s->f[S_C];
+			_avr_lanes_sub(s, res, vd, k, 1);
+			*d = res;
+			break;
+		case AVR_OP_subi:
+			res = vd - k;
+			_avr_lanes_sub(s, res, vd, k, 0);
+			*d = res;
+			break;
+		case AVR_OP_ori:
+			*d = vd | k;
+			_avr_lanes_znv0s(s, *d);
+			break;
+		case AVR_OP_andi:
+			*d = vd & k;
+			_avr_lanes_znv0s(s, *d);
+			break;
+		case AVR_OP_ldi:
+			*d = k;
+			break;
+		case AVR_OP_lpm:
+			for (int l = 0; l < n; l++) {
+				uint16_t z = s->r[R_ZL][l] | (s->r[R_ZH][l] << 8);
+				s->r[o->d][l] = lane[l]->flash[z];
+				if (o->k) {
+					z++;
+					s->r[R_ZL][l] = z;
+					s->r[R_ZH][l] = z >> 8;
+				}
+			}
+			break;
+		case AVR_OP_com:
+			*d = ~vd;
+			_avr_lanes_znv0s(s, *d);
+			s->f[S_C] = (avr_lanes_v){} + 1;
+			break;
+		case AVR_OP_neg:
+			res = -vd;
+			s->f[S_H] = ((res >> 3) | (vd >> 3)) & 1;
+			s->f[S_V] = AVR_LANES_BOOL(res == 0x80);
+			s->f[S_C] = AVR_LANES_BOOL(res != 0);
+			_avr_lanes_zns(s, res);
+			*d = res;
+			break;
+		case AVR_OP_swap:
+			*d = (vd >> 4) | (vd << 4);
+			break;
+		case AVR_OP_inc:
+			*d = vd + 1;
+			s->f[S_V] = AVR_LANES_BOOL(*d == 0x80);
+			_avr_lanes_zns(s, *d);
+			break;
+		case AVR_OP_dec:
+			*d = vd - 1;
+			s->f[S_V] = AVR_LANES_BOOL(*d == 0x7f);
+			_avr_lanes_zns(s, *d);
+			break;
+		case AVR_OP_asr:
+			*d = (vd >> 1) | (vd & 0x80);
+			_avr_lanes_zcnvs(s, *d, vd);
+			break;
+		case AVR_OP_lsr:
+			*d = vd >> 1;
+			s->f[S_N] = (avr_lanes_v){};
+			_avr_lanes_zcnvs(s, *d, vd);
+			break;
+		case AVR_OP_ror:
+			*d = (s->f[S_C] << 7) | (vd >> 1);
+			_avr_lanes_zcnvs(s, *d, vd);
+			break;
+		case AVR_OP_adiw:
+		case AVR_OP_sbiw: {
+			// 16 bits, in two halves; 'k' is 0 to 63
+			avr_lanes_v hi = d[1], lo, nhi;
+			if (kind == AVR_OP_adiw) {
+				lo = vd + k;
+				nhi = hi + AVR_LANES_BOOL(lo < vd);
+				s->f[S_V] = (~hi & nhi) >> 7;
+				s->f[S_C] = (~nhi & hi) >> 7;
+			} else {
+				lo = vd - k;
+				nhi = hi - AVR_LANES_BOOL(vd < k);
+				s->f[S_V] = (hi & ~nhi) >> 7;
+				s->f[S_C] = (nhi & ~hi) >> 7;
+			}
+			d[0] = lo;
+			d[1] = nhi;
+			s->f[S_Z] = AVR_LANES_BOOL((lo | nhi) == 0);
+			s->f[S_N] = nhi >> 7;
+			s->f[S_S] = s->f[S_N] ^ s->f[S_V];
+		}	break;
+		case AVR_OP_bset:
+			s->f[o->r] = (avr_lanes_v){} + o->d;
+			break;
+		case AVR_OP_bld:
+			*d = (vd & (uint8_t)~o->r) | (-s->f[S_T] & o->r);
+			break;
+		case AVR_OP_bst:
+			s->f[S_T] = AVR_LANES_BOOL((vd & o->r) != 0);
+			break;
+	}
+}
+#endif
 
-#if AVR_STACK_WATCH
-#define STACK_FRAME_PUSH()\
-	avr->trace_data->stack_frame[avr->trace_data->stack_frame_index].pc = avr->pc;\
-	avr->trace_data->stack_frame[avr->trace_data->stack_frame_index].sp = _avr_sp_get(avr);\
-	avr->trace_data->stack_frame_index++;
-#define STACK_FRAME_POP()\
-	if (avr->trace_data->stack_frame_index > 0) \
-		avr->trace_data->stack_frame_index--;
+uint16_t
+avr_lanes_block(
+		avr_t * avr)
+{
+#if defined(__GNUC__)
+	if (!avr->decoded || avr->state != cpu_Running ||
+			avr->interrupt_state || avr->gdb || avr->pc >= avr->flashend)
+		return 0;
+	avr_decoded_t * o = avr->decoded + (avr->pc >> 1);
+	if (o->kind == AVR_OP_decode)
+		_avr_decode_block(avr, avr->pc >> 1, 1);
+	if (o->block < 2)
+		return 0;
+	// registers with hooks have to go through _avr_set_r(), 8 at a time
+	const uint64_t hooks = 0x0101010101010101ull *
+			(AVR_IO_HOOK_WRITE | AVR_IO_HOOK_IRQ);
+	for (int i = 0; i < 32; i += 8) {
+		uint64_t h;
+		memcpy(&h, avr->io_hook + i, sizeof(h));
+		if (h & hooks)
+			return 0;
+	}
+	return o->block_cycles;
 #else
-#define STACK_FRAME_PUSH()
-#define STACK_FRAME_POP()
+	return 0;
 #endif
-#else /* CONFIG_SIMAVR_TRACE */
+}
 
-#define TRACE_JUMP()
-#define STACK_FRAME_PUSH()
-#define STACK_FRAME_POP()
+int
+avr_lanes_run_block(
+		avr_t ** lane,
+		int count,
+		uint32_t cycles)
+{
+#if defined(__GNUC__)
+	avr_lanes_t s;
+	const avr_decoded_t * first = lane[0]->decoded + (lane[0]->pc >> 1);
+	int block = 0;
+	uint32_t used = 0, took = 0;
 
-#endif
+	// as much of the block as fits
+	while (block < first->block && took + first[block].cycles <= cycles) {
+		used |= _avr_lanes_used(first + block);
+		took += first[block++].cycles;
+	}
+	if (!block)
+		return 0;
+	memset(&s, 0, sizeof(s));
 
-/****************************************************************************\
- *
- * Helper functions for calculating the status register bit values.
- * See the Atmel data sheet for the instruction set for more info.
- *
-\****************************************************************************/
+	for (int base = 0; base < count; base += AVR_LANES) {
+		avr_t ** ln = lane + base;
+		int n = count - base < AVR_LANES ? count - base : AVR_LANES;
 
-static  void
-_avr_flags_zns (struct avr_t * avr, uint8_t res)
-{
-	avr->sreg[S_Z] = res == 0;
-	avr->sreg[S_N] = (res >> 7) & 1;
-	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+		for (int l = 0; l < n; l++) {
+			avr_sreg_materialize(ln[l]);
+			for (int b = 0; b < 8; b++)
+				s.f[b][l] = ln[l]->sreg[b];
+			for (int i = 0; i < 32; i++)
+				if (used & (1u << i))
+					s.r[i][l] = ln[l]->data[i];
+		}
+		for (int i = 0; i < block; i++)
+			_avr_lanes_op(ln, n, &s, first + i);
+		for (int l = 0; l < n; l++) {
+			for (int b = 0; b < 8; b++)
+				ln[l]->sreg[b] = s.f[b][l];
+			for (int i = 0; i < 32; i++)
+				if (used & (1u << i))
+					ln[l]->data[i] = s.r[i][l];
+			ln[l]->pc += block << 1;
+			ln[l]->cycle += took;
+		}
+	}
+	return block;
+#else
+	return 0;
+#endif
 }
 
-static  void
-_avr_flags_zns16 (struct avr_t * avr, uint16_t res)
+int
+avr_predecode_init(
+		avr_t * avr)
 {
-	avr->sreg[S_Z] = res == 0;
-	avr->sreg[S_N] = (res >> 15) & 1;
-	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+#if CONFIG_SIMAVR_TRACE
+	AVR_LOG(avr, LOG_WARNING, "CORE: predecoding is not available with tracing\n");
+	return -1;
+#else
+	if (avr->decoded_mapped)
+		avr_predecode_free(avr);	// its pages would all be copied
+	if (!avr->decoded) {
+		avr->decoded = calloc((avr->flashend + 1) >> 1, sizeof(avr_decoded_t));
+		if (!avr->decoded) {
+			AVR_LOG(avr, LOG_ERROR, "CORE: %s: out of memory\n", __func__);
+			return -1;
+		}
+	}
+	memset(avr->decoded, 0, ((avr->flashend + 1) >> 1) * sizeof(avr_decoded_t));
+	return 0;
+#endif
 }
 
-static  void
-_avr_flags_add_zns (struct avr_t * avr, uint8_t res, uint8_t rd, uint8_t rr)
+void
+avr_predecode_free(
+		avr_t * avr)
 {
-	/* carry & half carry */
-	uint8_t add_carry = (rd & rr) | (rr & ~res) | (~res & rd);
-	avr->sreg[S_H] = (add_carry >> 3) & 1;
-	avr->sreg[S_C] = (add_carry >> 7) & 1;
-
-	/* overflow */
-	avr->sreg[S_V] = (((rd & rr & ~res) | (~rd & ~rr & res)) >> 7) & 1;
+	avr_sreg_materialize(avr);
+#ifdef __linux__
+	if (avr->decoded_mapped)
+		munmap(avr->decoded, ((avr->flashend + 1) >> 1) * sizeof(avr_decoded_t));
+	else
+#endif
+	if (avr->decoded)
+		free(avr->decoded);
+	avr->decoded = NULL;
+	avr->decoded_mapped = 0;
+}
 
-	/* zns */
-	_avr_flags_zns(avr, res);
+void
+avr_predecode_invalidate(
+		avr_t * avr,
+		avr_flashaddr_t addr,
+		uint32_t size)
+{
+	uint32_t count = (avr->flashend + 1) >> 1;
+	uint32_t start = addr >> 1;
+	uint32_t end = (addr + size + 1) >> 1;
+	if (end > count)
+		end = count;
+	if (avr->flash_wide)
+		for (uint32_t i = start; i < end; i++) {
+			uint32_t bit = 1u << (i & 31);
+			if (_avr_opcode_is_32_bits(_avr_flash_read16le(avr, i << 1)))
+				avr->flash_wide[i >> 5] |= bit;
+			else
+				avr->flash_wide[i >> 5] &= ~bit;
+		}
+	avr_cfg_flush(avr);
+	if (avr->trace_file && size)
+		avr_trace_file_flash(avr->trace_file, addr, size);
+	if (!avr->decoded || !size)
+		return;
+	// the previous entries may have a block running into this range, and
+	// the previous word could also be a 32 bits instruction using this one
+	start = start > AVR_DECODED_BLOCK_MAX ? start - AVR_DECODED_BLOCK_MAX : 0;
+	for (uint32_t i = start; i < end; i++) {
+		avr->decoded[i].kind = AVR_OP_decode;
+		avr->decoded[i].block = 0;
+	}
 }
 
+#if defined(__linux__) && defined(__GLIBC__)
+typedef struct avr_build_id_t {
+	uintptr_t	addr;		// of code in the object we're looking for
+	uint32_t	hash;
+} avr_build_id_t;
 
-static  void
-_avr_flags_sub_zns (struct avr_t * avr, uint8_t res, uint8_t rd, uint8_t rr)
+// mixes the GNU build ID of the object with this code into the hash
+static int
+_avr_build_id_note(
+		struct dl_phdr_info * info,
+		size_t size,
+		void * param)
 {
-	/* carry & half carry */
-	uint8_t sub_carry = (~rd & rr) | (rr & res) | (res & ~rd);
-	avr->sreg[S_H] = (sub_carry >> 3) & 1;
-	avr->sreg[S_C] = (sub_carry >> 7) & 1;
+	avr_build_id_t * b = param;
+	int found = 0;
 
-	/* overflow */
-	avr->sreg[S_V] = (((rd & ~rr & ~res) | (~rd & rr & res)) >> 7) & 1;
+	for (int i = 0; i < info->dlpi_phnum && !found; i++) {
+		const ElfW(Phdr) * p = info->dlpi_phdr + i;
+		uintptr_t start = info->dlpi_addr + p->p_vaddr;
+		found = p->p_type == PT_LOAD &&
+				b->addr >= start && b->addr < start + p->p_memsz;
+	}
+	if (!found)
+		return 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) * p = info->dlpi_phdr + i;
+		if (p->p_type != PT_NOTE)
+			continue;
+		const uint8_t * n = (const uint8_t *)(info->dlpi_addr + p->p_vaddr);
+		const uint8_t * end = n + p->p_memsz;
+		while (n + sizeof(ElfW(Nhdr)) <= end) {
+			const ElfW(Nhdr) * nh = (const ElfW(Nhdr) *)n;
+			const uint8_t * name = n + sizeof(*nh);
+			const uint8_t * desc = name + ((nh->n_namesz + 3) & ~3);
+			if (desc + nh->n_descsz > end)
+				break;
+			if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+					!memcmp(name, "GNU", 4)) {
+				for (uint32_t j = 0; j < nh->n_descsz; j++)
+					b->hash = (b->hash ^ desc[j]) * 16777619u;
+				return 1;
+			}
+			n = desc + ((nh->n_descsz + 3) & ~3);
+		}
+	}
+	return 1;
+}
+#endif
 
-	/* zns */
-	_avr_flags_zns(avr, res);
+uint32_t
+avr_predecode_format(void)
+{
+	static uint32_t format;
+
+	// racing threads just work it out twice
+	uint32_t h = __atomic_load_n(&format, __ATOMIC_RELAXED);
+	if (h)
+		return h;
+	h = 2166136261u;
+	for (const char * s = _avr_decoded_names; *s; s++)
+		h = (h ^ (uint8_t)*s) * 16777619u;
+#if defined(__linux__) && defined(__GLIBC__)
+	avr_build_id_t b = { .addr = (uintptr_t)avr_predecode_format, .hash = h };
+	dl_iterate_phdr(_avr_build_id_note, &b);
+	h = b.hash;
+#endif
+	h ^= sizeof(avr_decoded_t);
+	if (!h)
+		h = 1;
+	__atomic_store_n(&format, h, __ATOMIC_RELAXED);
+	return h;
 }
 
-static  void
-_avr_flags_Rzns (struct avr_t * avr, uint8_t res)
+void
+avr_predecode_export(
+		avr_t * avr,
+		avr_decoded_t * out,
+		uint32_t count)
 {
-	if (res)
-		avr->sreg[S_Z] = 0;
-	avr->sreg[S_N] = (res >> 7) & 1;
-	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+	uint32_t words = (avr->flashend + 1) >> 1;
+	if (count > words)
+		count = words;
+	memset(out, 0, count * sizeof(*out));
+	if (!avr->decoded)
+		return;
+	memcpy(out, avr->decoded, count * sizeof(*out));
+	// busy loops were picked with this instance's IO hooks, let the
+	// importer find its own; the superinstructions can use these entries
+	for (uint32_t i = 0; i < count; i++) {
+		out[i].kind = _avr_decoded_first[out[i].kind];
+		switch (out[i].kind) {
+			case AVR_OP_rjmp:
+			case AVR_OP_brbx:
+			case AVR_OP_rjmp_loop:
+			case AVR_OP_brbx_loop:
+				memset(out + i, 0, sizeof(*out));
+				break;
+		}
+	}
 }
 
-static  void
-_avr_flags_sub_Rzns (struct avr_t * avr, uint8_t res, uint8_t rd, uint8_t rr)
+int
+avr_predecode_import(
+		avr_t * avr,
+		const avr_decoded_t * in,
+		uint32_t count)
 {
-	/* carry & half carry */
-	uint8_t sub_carry = (~rd & rr) | (rr & res) | (res & ~rd);
-	avr->sreg[S_H] = (sub_carry >> 3) & 1;
-	avr->sreg[S_C] = (sub_carry >> 7) & 1;
+	if (avr_predecode_init(avr))
+		return -1;
+	uint32_t words = (avr->flashend + 1) >> 1;
+	if (count > words)
+		count = words;
+	for (uint32_t i = 0; i < count; i++)
+		if (in[i].kind >= AVR_OP_COUNT)
+			return -1;
+	memcpy(avr->decoded, in, count * sizeof(*in));
+	return 0;
+}
 
-	/* overflow */
-	avr->sreg[S_V] = (((rd & ~rr & ~res) | (~rd & rr & res)) >> 7) & 1;
+typedef struct avr_decoded_image_t {
+	const char *	mmcu;		// the core it was decoded for
+	int				fd;			// memfd with the entries, -1 if none
+	avr_decoded_t *	decoded;	// the entries, when there's no memfd
+} avr_decoded_image_t;
 
-	_avr_flags_Rzns(avr, res);
+/*
+ * The superinstructions ending with one of the entries left to decode are
+ * cut back to the part before it, they would run it from its entry
+ */
+void
+avr_predecode_build(
+		avr_t * avr,
+		avr_decoded_t * t,
+		uint32_t count)
+{
+	uint32_t words = (avr->flashend + 1) >> 1;
+	if (count > words)
+		count = words;
+	uint32_t end = (avr->codeend >> 1) + 1;
+	if (end > count)
+		end = count;
+	memset(t, 0, count * sizeof(*t));
+	avr_decoded_t * decoded = avr->decoded;
+	avr->decoded = t;
+	for (uint32_t i = 0; i < end; i++)
+		if (t[i].kind == AVR_OP_decode)
+			_avr_decode_block(avr, i, 1);
+	avr->decoded = decoded;
+
+	for (uint32_t i = 0; i < count; i++) {
+		switch (t[i].kind) {
+			case AVR_OP_rjmp:
+			case AVR_OP_brbx:
+			case AVR_OP_rjmp_loop:
+			case AVR_OP_brbx_loop:
+				if ((int32_t)t[i].k < 0)
+					memset(t + i, 0, sizeof(*t));
+				break;
+		}
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t first = _avr_decoded_first[t[i].kind];
+		if (first == t[i].kind)
+			continue;
+		if (i + 1 < count && t[i + 1].kind == AVR_OP_decode)
+			t[i].kind = first;
+		else if (t[i].kind == AVR_OP_cp_cpc_brbx &&
+				i + 2 < count && t[i + 2].kind == AVR_OP_decode)
+			t[i].kind = AVR_OP_cp_cpc;
+	}
 }
 
-static  void
-_avr_flags_zcvs (struct avr_t * avr, uint8_t res, uint8_t vr)
+static avr_decoded_image_t *
+_avr_predecode_image_build(
+		avr_t * avr)
 {
-	avr->sreg[S_Z] = res == 0;
-	avr->sreg[S_C] = vr & 1;
-	avr->sreg[S_V] = avr->sreg[S_N] ^ avr->sreg[S_C];
-	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+	uint32_t count = (avr->flashend + 1) >> 1;
+	size_t size = count * sizeof(avr_decoded_t);
+	avr_decoded_image_t * d = calloc(1, sizeof(*d));
+	avr_decoded_t * t = calloc(count, sizeof(*t));
+
+	if (!d || !t) {
+		free(d);
+		free(t);
+		return NULL;
+	}
+	avr_predecode_build(avr, t, count);
+	d->mmcu = avr->mmcu;
+	d->fd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+	d->fd = syscall(SYS_memfd_create, "simavr-decoded", 0);
+	if (d->fd >= 0 && (ftruncate(d->fd, size) ||
+			pwrite(d->fd, t, size, 0) != (ssize_t)size)) {
+		close(d->fd);
+		d->fd = -1;
+	}
+	if (d->fd >= 0) {
+		free(t);
+		return d;
+	}
+#endif
+	d->decoded = t;
+	return d;
 }
 
-static  void
-_avr_flags_zcnvs (struct avr_t * avr, uint8_t res, uint8_t vr)
+void
+avr_predecode_image_release(
+		avr_decoded_image_t * d)
 {
-	avr->sreg[S_Z] = res == 0;
-	avr->sreg[S_C] = vr & 1;
-	avr->sreg[S_N] = res >> 7;
-	avr->sreg[S_V] = avr->sreg[S_N] ^ avr->sreg[S_C];
-	avr->sreg[S_S] = avr->sreg[S_N] ^ avr->sreg[S_V];
+	if (!d)
+		return;
+#ifdef __linux__
+	if (d->fd >= 0)
+		close(d->fd);
+#endif
+	free(d->decoded);
+	free(d);
 }
 
-static  void
-_avr_flags_znv0s (struct avr_t * avr, uint8_t res)
+int
+avr_predecode_share(
+		avr_t * avr)
 {
-	avr->sreg[S_V] = 0;
-	_avr_flags_zns(avr, res);
+#if CONFIG_SIMAVR_TRACE
+	return avr_predecode_init(avr);
+#else
+	avr_flash_image_t * image = avr->flash_image;
+	if (!image || avr->flash != image->flash)
+		return -1;
+
+	avr_decoded_image_t * d = __atomic_load_n(&image->decoded, __ATOMIC_ACQUIRE);
+	if (!d) {
+		d = _avr_predecode_image_build(avr);
+		if (!d) {
+			AVR_LOG(avr, LOG_ERROR, "CORE: %s: out of memory\n", __func__);
+			return -1;
+		}
+		// unless another instance was quicker
+		avr_decoded_image_t * none = NULL;
+		if (!__atomic_compare_exchange_n(&image->decoded, &none, d, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			avr_predecode_image_release(d);
+			d = none;
+		}
+	}
+	// the same flash size could be another core, with other instructions
+	if (strcmp(d->mmcu, avr->mmcu))
+		return -1;
+
+	uint32_t count = (avr->flashend + 1) >> 1;
+	size_t size = count * sizeof(avr_decoded_t);
+	avr_decoded_t * decoded = NULL;
+#ifdef __linux__
+	if (d->fd >= 0) {
+		decoded = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, d->fd, 0);
+		if (decoded == MAP_FAILED)
+			return -1;
+	}
+#endif
+	if (!decoded) {
+		decoded = malloc(size);
+		if (!decoded)
+			return -1;
+		memcpy(decoded, d->decoded, size);
+	}
+	avr_predecode_free(avr);
+	avr->decoded = decoded;
+	avr->decoded_mapped = d->fd >= 0;
+	return 0;
+#endif
 }
 
-static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
+/*
+ * Core variants the decoder below is specialized for, picked by avr_init()
+ * from the core declaration. AVR_CORE_ANY tests everything at runtime, and
+ * is used for whatever doesn't match one of the others.
+ */
+enum {
+	AVR_CORE_ANY = 0,
+	AVR_CORE_TINY,		// no MUL, no RAMPZ/EIND, 2 bytes PC
+	AVR_CORE_MEGA,		// MUL, optional RAMPZ, no EIND, 2 bytes PC
+	AVR_CORE_MEGA_EIND,	// MUL, EIND, 3 bytes PC
+};
+
+#define AVR_VARIANT_ADDRESS_SIZE(avr, v) \
+	((v) == AVR_CORE_ANY ? (avr)->address_size : \
+		(v) == AVR_CORE_MEGA_EIND ? 3 : 2)
+#define AVR_VARIANT_MUL(avr, v) \
+	((v) == AVR_CORE_ANY ? !(avr)->no_mul : (v) != AVR_CORE_TINY)
+#define AVR_VARIANT_RAMPZ(avr, v) \
+	((v) == AVR_CORE_TINY ? 0 : (avr)->rampz)
+#define AVR_VARIANT_EIND(avr, v) \
+	((v) == AVR_CORE_ANY ? (avr)->eind : (v) == AVR_CORE_MEGA_EIND)
+
+void
+avr_core_select_variant(
+		avr_t * avr)
 {
-	uint16_t o = _avr_flash_read16le(avr, pc) & 0xfc0f;
-	return	o == 0x9200 || // STS ! Store Direct to Data Space
-			o == 0x9000 || // LDS Load Direct from Data Space
-			o == 0x940c || // JMP Long Jump
-			o == 0x940d || // JMP Long Jump
-			o == 0x940e ||  // CALL Long Call to sub
-			o == 0x940f; // CALL Long Call to sub
+	if (avr->no_mul && !avr->rampz && !avr->eind && avr->address_size == 2)
+		avr->core_variant = AVR_CORE_TINY;
+	else if (!avr->no_mul && !avr->eind && avr->address_size == 2)
+		avr->core_variant = AVR_CORE_MEGA;
+	else if (!avr->no_mul && avr->eind && avr->address_size == 3)
+		avr->core_variant = AVR_CORE_MEGA_EIND;
+	else
+		avr->core_variant = AVR_CORE_ANY;
 }
 
 /*
@@ -611,13 +3512,17 @@ static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
  * I assume that the decoder could easily be 2/3 of it's current size.
  *
  * + It lacks the "extended" XMega jumps.
- * + It also doesn't check whether the core it's
- *   emulating is supposed to have the fancy instructions, like multiply and such.
+ *
+ * It is instantiated once per 'variant' of core below, so the tests on the
+ * core features become constants in the common cases.
  *
  * The number of cycles taken by instruction has been added, but might not be
  * entirely accurate.
  */
-avr_flashaddr_t avr_run_one(avr_t * avr)
+static inline __attribute__((always_inline)) avr_flashaddr_t
+_avr_run_one(
+		avr_t * avr,
+		const int variant)
 {
 run_one_again:
 #if CONFIG_SIMAVR_TRACE
@@ -632,6 +3537,7 @@ run_one_again:
 	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
 #endif
 
+#if !CONFIG_SIMAVR_GUARD_PAGES
 	/* Ensure we don't crash simavr due to a bad instruction reading past
 	 * the end of the flash.
 	 */
@@ -640,6 +3546,7 @@ run_one_again:
 		crash(avr);
 		return 0;
 	}
+#endif
 
 	uint32_t		opcode = _avr_flash_read16le(avr, avr->pc);
 	avr_flashaddr_t	new_pc = avr->pc + 2;	// future "default" pc
@@ -690,6 +3597,10 @@ run_one_again:
 									_avr_set_r16le(avr, d, vr);
 								}	break;
 								case 0x0200: {	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
+									if (!AVR_VARIANT_MUL(avr, variant)) {
+										_avr_invalid_opcode(avr);
+										break;
+									}
 									int8_t r = 16 + (opcode & 0xf);
 									int8_t d = 16 + ((opcode >> 4) & 0xf);
 									int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
@@ -701,6 +3612,10 @@ run_one_again:
 									SREG();
 								}	break;
 								case 0x0300: {	// MUL -- Multiply -- 0000 0011 fddd frrr
+									if (!AVR_VARIANT_MUL(avr, variant)) {
+										_avr_invalid_opcode(avr);
+										break;
+									}
 									int8_t r = 16 + (opcode & 0x7);
 									int8_t d = 16 + ((opcode >> 4) & 0x7);
 									int16_t res = 0;
@@ -760,12 +3675,13 @@ run_one_again:
 					uint16_t res = vd == vr;
 					STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
 					if (res) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
+						if (avr_flash_is_wide(avr, new_pc)) {
 							new_pc += 4; cycle += 2;
 						} else {
 							new_pc += 2; cycle++;
 						}
 					}
+					_avr_edge_event(avr, new_pc);
 				}	break;
 				case 0x1400: {	// CP -- Compare -- 0001 01rd dddd rrrr
 					get_vd5_vr5(opcode);
@@ -949,7 +3865,10 @@ run_one_again:
 				}	break;
 				case 0x95a8: { // WDR -- Watchdog Reset -- 1001 0101 1010 1000
 					STATE("wdr\n");
-					avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
+					if (avr->watchdog)
+						avr_watchdog_kick(avr->watchdog);
+					else
+						avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
 				}	break;
 				case 0x95e8: { // SPM -- Store Program Memory -- 1001 0101 1110 1000
 					STATE("spm\n");
@@ -961,28 +3880,36 @@ run_one_again:
 				case 0x9519: { // EICALL -- Indirect Call to Subroutine -- 1001 0101 0001 1001   bit 8 is "push pc"
 					int e = opcode & 0x10;
 					int p = opcode & 0x100;
-					if (e && !avr->eind)
+					if (e && !AVR_VARIANT_EIND(avr, variant))
 						_avr_invalid_opcode(avr);
 					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
 					if (e)
 						z |= avr->data[avr->eind] << 16;
 					STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
-					if (p)
-						cycle += _avr_push_addr(avr, new_pc) - 1;
-					new_pc = z << 1;
-					cycle++;
+					if (p) {
+						cycle += _avr_push_addr_size(avr, new_pc,
+								AVR_VARIANT_ADDRESS_SIZE(avr, variant));
+						new_pc = _avr_call_event(avr, z << 1, &cycle);
+					} else {
+						new_pc = z << 1;
+						cycle++;
+					}
 					TRACE_JUMP();
+					_avr_edge_event(avr, new_pc);
 				}	break;
 				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
 					avr_sreg_set(avr, S_I, 1);
 					avr_interrupt_reti(avr);
 					FALLTHROUGH
 				case 0x9508: {	// RET -- Return -- 1001 0101 0000 1000
-					new_pc = _avr_pop_addr(avr);
-					cycle += 1 + avr->address_size;
+					new_pc = _avr_pop_addr_size(avr,
+							AVR_VARIANT_ADDRESS_SIZE(avr, variant));
+					_avr_ret_event(avr);
+					cycle += 1 + AVR_VARIANT_ADDRESS_SIZE(avr, variant);
 					STATE("ret%s\n", opcode & 0x10 ? "i" : "");
 					TRACE_JUMP();
 					STACK_FRAME_POP();
+					_avr_edge_event(avr, new_pc);
 				}	break;
 				case 0x95c8: {	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
 					uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
@@ -991,7 +3918,7 @@ run_one_again:
 					_avr_set_r(avr, 0, avr->flash[z]);
 				}	break;
 				case 0x95d8: {	// ELPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1101 1000
-					if (!avr->rampz)
+					if (!AVR_VARIANT_RAMPZ(avr, variant))
 						_avr_invalid_opcode(avr);
 					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
 					STATE("elpm %s, (Z[%02x:%04x])\n", avr_regname(0), z >> 16, z & 0xffff);
@@ -1023,7 +3950,7 @@ run_one_again:
 						}	break;
 						case 0x9006:
 						case 0x9007: {	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
-							if (!avr->rampz)
+							if (!AVR_VARIANT_RAMPZ(avr, variant))
 								_avr_invalid_opcode(avr);
 							uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
 							get_d5(opcode);
@@ -1222,6 +4149,7 @@ run_one_again:
 							new_pc = a << 1;
 							cycle += 2;
 							TRACE_JUMP();
+							_avr_edge_event(avr, new_pc);
 						}	break;
 						case 0x940e:
 						case 0x940f: {	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
@@ -1230,10 +4158,12 @@ run_one_again:
 							a = (a << 16) | x;
 							STATE("call 0x%06x\n", a);
 							new_pc += 2;
-							cycle += 1 + _avr_push_addr(avr, new_pc);
-							new_pc = a << 1;
+							cycle += 1 + _avr_push_addr_size(avr, new_pc,
+									AVR_VARIANT_ADDRESS_SIZE(avr, variant));
+							new_pc = _avr_call_event(avr, a << 1, &cycle);
 							TRACE_JUMP();
 							STACK_FRAME_PUSH();
+							_avr_edge_event(avr, new_pc);
 						}	break;
 
 						default: {
@@ -1272,12 +4202,13 @@ run_one_again:
 									uint8_t res = _avr_get_ram(avr, io) & mask;
 									STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
 									if (!res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
+										if (avr_flash_is_wide(avr, new_pc)) {
 											new_pc += 4; cycle += 2;
 										} else {
 											new_pc += 2; cycle++;
 										}
 									}
+									_avr_edge_event(avr, new_pc);
 								}	break;
 								case 0x9a00: {	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
 									get_io5_b3mask(opcode);
@@ -1291,16 +4222,21 @@ run_one_again:
 									uint8_t res = _avr_get_ram(avr, io) & mask;
 									STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
 									if (res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
+										if (avr_flash_is_wide(avr, new_pc)) {
 											new_pc += 4; cycle += 2;
 										} else {
 											new_pc += 2; cycle++;
 										}
 									}
+									_avr_edge_event(avr, new_pc);
 								}	break;
 								default:
 									switch (opcode & 0xfc00) {
 										case 0x9c00: {	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
+											if (!AVR_VARIANT_MUL(avr, variant)) {
+												_avr_invalid_opcode(avr);
+												break;
+											}
 											get_vd5_vr5(opcode);
 											uint16_t res = vd * vr;
 											STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
@@ -1341,18 +4277,22 @@ run_one_again:
 			new_pc = (new_pc + o) % (avr->flashend+1);
 			cycle++;
 			TRACE_JUMP();
+			_avr_edge_event(avr, new_pc);
 		}	break;
 
 		case 0xd000: {	// RCALL -- 1101 kkkk kkkk kkkk
 			get_o12(opcode);
 			STATE("rcall .%d [%04x]\n", o >> 1, new_pc + o);
-			cycle += _avr_push_addr(avr, new_pc);
+			cycle += _avr_push_addr_size(avr, new_pc,
+					AVR_VARIANT_ADDRESS_SIZE(avr, variant));
 			new_pc = (new_pc + o) % (avr->flashend+1);
 			// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
 			if (o != 0) {
+				new_pc = _avr_call_event(avr, new_pc, &cycle);
 				TRACE_JUMP();
 				STACK_FRAME_PUSH();
 			}
+			_avr_edge_event(avr, new_pc);
 		}	break;
 
 		case 0xe000: {	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
@@ -1384,6 +4324,7 @@ run_one_again:
 						cycle++; // 2 cycles if taken, 1 otherwise
 						new_pc = new_pc + (o << 1);
 					}
+					_avr_edge_event(avr, new_pc);
 				}	break;
 				case 0xf800:
 				case 0xf900: {	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
@@ -1406,12 +4347,13 @@ run_one_again:
 					int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
 					STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
 					if (branch) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
+						if (avr_flash_is_wide(avr, new_pc)) {
 							new_pc += 4; cycle += 2;
 						} else {
 							new_pc += 2; cycle++;
 						}
 					}
+					_avr_edge_event(avr, new_pc);
 				}	break;
 				default: _avr_invalid_opcode(avr);
 			}
@@ -1434,4 +4376,35 @@ run_one_again:
 	return new_pc;
 }
 
+#define AVR_CORE_VARIANT(_name, _v) \
+	static avr_flashaddr_t _avr_run_one_##_name(avr_t * avr) \
+	{ \
+		return _avr_run_one(avr, _v); \
+	}
+AVR_CORE_VARIANT(any, AVR_CORE_ANY)
+AVR_CORE_VARIANT(tiny, AVR_CORE_TINY)
+AVR_CORE_VARIANT(mega, AVR_CORE_MEGA)
+AVR_CORE_VARIANT(mega_eind, AVR_CORE_MEGA_EIND)
+
+avr_flashaddr_t avr_run_one(avr_t * avr)
+{
+	if (avr->decoded)
+		return _avr_run_decoded(avr);
+	return avr_run_interpreted(avr);
+}
+
+avr_flashaddr_t avr_run_interpreted(avr_t * avr)
+{
+	switch (avr->core_variant) {
+		case AVR_CORE_TINY:
+			return _avr_run_one_tiny(avr);
+		case AVR_CORE_MEGA:
+			return _avr_run_one_mega(avr);
+		case AVR_CORE_MEGA_EIND:
+			return _avr_run_one_mega_eind(avr);
+		default:
+			return _avr_run_one_any(avr);
+	}
+}
+
 
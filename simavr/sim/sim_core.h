@@ -41,12 +41,181 @@ extern "C" {
  */
 avr_flashaddr_t avr_run_one(avr_t * avr);
 
+/*
+ * Pick the decoder variant matching the features of the core (no_mul,
+ * rampz, eind, address_size). Called by avr_init()
+ */
+void avr_core_select_variant(avr_t * avr);
+
+/*
+ * Predecoded instruction cache.
+ * When enabled, avr_run_one() no longer decodes the opcode at every step;
+ * each flash word gets an entry that is filled the first time it's
+ * executed, and reused afterward. Anything that changes the flash once the
+ * core has started (SPM, gdb, avr_loadcode()) must invalidate the entries
+ * covering the modified bytes.
+ */
+typedef struct avr_decoded_t {
+	uint32_t		k;		// immediate, address or offset operand
+	uint8_t			kind;		// handler index, 0 is "not decoded yet"
+	uint8_t			d, r;		// register, IO or bit operands
+	uint8_t			cycles;		// fixed part of the cycle count
+	uint8_t			size;		// in words, 1 or 2
+	uint8_t			block;		// straight "pure" instructions from here
+	uint16_t		block_cycles;	// and the cycles they take
+} avr_decoded_t;
+
+#define AVR_DECODED_BLOCK_MAX	255
+
+/*
+ * Same as avr_run_one(), using the predecoded cache with a "threaded"
+ * dispatch (computed goto) where the compiler supports it. avr->decoded
+ * must have been allocated by avr_predecode_init().
+ */
+avr_flashaddr_t avr_run_threaded(avr_t * avr);
+
+/*
+ * Same as avr_run_one(), but always with the decoder, even when there is
+ * a predecoded cache; for the cold code, when tiering (sim_tier.h)
+ */
+avr_flashaddr_t avr_run_interpreted(avr_t * avr);
+
+/*
+ * Allocate the cache for this core and switch avr_run_one() to it.
+ * Needs to be called after avr_init(). Returns 0 on success.
+ */
+int avr_predecode_init(avr_t * avr);
+/*
+ * Release the cache, the core returns to decoding every instruction
+ */
+void avr_predecode_free(avr_t * avr);
+/*
+ * To be called when 'size' bytes of flash starting at 'addr' changed: it
+ * updates avr->flash_wide, and marks them as needing to be decoded again
+ */
+void avr_predecode_invalidate(
+		avr_t * avr,
+		avr_flashaddr_t addr,
+		uint32_t size);
+/*
+ * Copies the entries of the first 'count' flash words to 'out', so another
+ * instance of the same core running the same firmware can start with
+ * them. The branches are left out, they are decoded again by the importer;
+ * whether they are busy loops depends on the IO of the instance.
+ */
+void avr_predecode_export(
+		avr_t * avr,
+		avr_decoded_t * out,
+		uint32_t count);
+/*
+ * Allocates the cache if needed, and fills it with exported entries.
+ * Returns 0, or -1 if it can't, or they are not valid.
+ */
+int avr_predecode_import(
+		avr_t * avr,
+		const avr_decoded_t * in,
+		uint32_t count);
+/*
+ * Decodes the whole flash, up to codeend, in the first 'count' entries of
+ * 'out', without touching the cache of 'avr'. The entries are those of a
+ * cache that ran all of the code, but for the backward branches, which
+ * are left out as in avr_predecode_export(). They can be imported.
+ */
+void avr_predecode_build(
+		avr_t * avr,
+		avr_decoded_t * out,
+		uint32_t count);
+/*
+ * Changes when the exported entries of a build can't be used by another:
+ * with the handlers, and with the GNU build ID of the binary the core is
+ * in, when it has one (Linux).
+ */
+uint32_t avr_predecode_format(void);
+
+/*
+ * Instances sharing a flash image (avr_flash_share()) can share its
+ * decoded entries too. The first instance to call this decodes the whole
+ * image, up to codeend, and keeps it with the image; then it, and each
+ * instance after it, gets a copy on write mapping of those entries as
+ * its cache. The pages an instance never writes stay the same memory for
+ * all of them, and none pays for decoding the code again.
+ * As in avr_predecode_export(), the backward branches are left out: they
+ * are decoded by each instance in its own pages, whether they are busy
+ * loops depends on its IO. So are the entries invalidated when it writes
+ * its flash. Without memfd_create() (Linux), each instance gets a copy.
+ * Returns 0, or -1 if the flash isn't shared; the cache is left as it was
+ */
+int avr_predecode_share(avr_t * avr);
+// called with the flash image, when its last instance lets go of it
+void avr_predecode_image_release(struct avr_decoded_image_t * d);
+
+/*
+ * For sim_lockstep.c: the cycles of the block of pure instructions at the
+ * pc, if the core could run it as one now, 0 otherwise. It's still up to
+ * the caller to check when the next cycle timer is due.
+ */
+uint16_t avr_lanes_block(
+		avr_t * avr);
+/*
+ * Runs as much of that block as takes no more than 'cycles', on 'count'
+ * cores at the same pc, with the same code there, each instruction decoded
+ * once (from lane[0]) for all of them. Returns the number of instructions
+ * run, 0 if even the first one doesn't fit.
+ */
+int avr_lanes_run_block(
+		avr_t ** lane,
+		int count,
+		uint32_t cycles);
+
+/*
+ * 1 if the flash word at 'pc' is the first of a 32 bits instruction (LDS,
+ * STS, JMP, CALL). Skips use it; from a known instruction boundary, it also
+ * tells where the next one is, for breakpoints or profiles.
+ */
+static inline int
+avr_flash_is_wide(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	uint32_t w = pc >> 1;
+	return (avr->flash_wide[w >> 5] >> (w & 31)) & 1;
+}
+
 /*
  * These are for internal access to the stack (for interrupts)
  */
 uint16_t _avr_sp_get(avr_t * avr);
 void _avr_sp_set(avr_t * avr, uint16_t sp);
 int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr);
+// dumps what it can, and stops the core, as for an invalid access
+void crash(avr_t * avr);
+
+/*
+ * Restricts the instruction trace (avr->trace) to some of the code, or
+ * leaves some of it out: 'spec' is a symbol, up to the next one, or a
+ * range of byte addresses "<from>-<to>", 'to' excluded. The first call
+ * decides what isn't listed: nothing is traced but what's included, or
+ * everything but what's excluded. They apply in order, so a function can
+ * be left out of a range that's included. Goes after the firmware is
+ * loaded, for its symbols. Returns 0, or -1.
+ * With avr_trace_filter_isr(), only the interrupt handlers (and what
+ * they call) that pass the filter are traced, but for their RETI: it's
+ * traced once the handler is left.
+ * None of it is available without CONFIG_SIMAVR_TRACE.
+ */
+int
+avr_trace_filter(
+		avr_t * avr,
+		const char * spec,
+		int include);
+void
+avr_trace_filter_isr(
+		avr_t * avr,
+		int isr_only);
+// traces everything again
+void
+avr_trace_filter_clear(
+		avr_t * avr);
 
 #if CONFIG_SIMAVR_TRACE
 
@@ -54,6 +223,8 @@ int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr);
  * Get a "pretty" register name
  */
 const char * avr_regname(uint8_t reg);
+// the same names, by register, for the tools still indexing them
+extern const char * reg_names[255];
 
 /*
  * DEBUG bits follow
@@ -61,6 +232,29 @@ const char * avr_regname(uint8_t reg);
  */
 void avr_dump_state(avr_t * avr);
 
+// 1 if the instruction at 'pc' is traced
+static inline int
+avr_trace_wanted(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	struct avr_trace_data_t * t = avr->trace_data;
+	if (t->filter_isr && !avr->interrupts.running_ptr)
+		return 0;
+	return !t->filter || (t->filter[pc >> 4] & (1 << ((pc >> 1) & 7)));
+}
+
+// name of the symbol 'pc' is in
+static inline const char *
+avr_trace_symbol(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	avr_symbol_t * s = avr_symbol_find(avr->trace_data->symbol,
+			avr->trace_data->symbolcount, pc);
+	return s ? s->symbol : "unknown";
+}
+
 #define DUMP_REG() { \
 				for (int i = 0; i < 32; i++) printf("%s=%02x%c", avr_regname(i), avr->data[i],i==15?'\n':' ');\
 				printf("\n");\
@@ -76,7 +270,7 @@ void avr_dump_state(avr_t * avr);
 			int pci = i-1;\
 			printf(FONT_RED "*** %04x: %-25s sp %04x\n" FONT_DEFAULT,\
 					avr->trace_data->stack_frame[pci].pc, \
-					avr->trace_data->codeline ? avr->trace_data->codeline[avr->trace_data->stack_frame[pci].pc>>1]->symbol : "unknown", \
+					avr_trace_symbol(avr, avr->trace_data->stack_frame[pci].pc), \
 							avr->trace_data->stack_frame[pci].sp);\
 		}
 #else
@@ -90,10 +284,35 @@ void avr_dump_state(avr_t * avr);
 
 #endif
 
+/*
+ * Lazy SREG operations, the flags are computed from the result and the
+ * operands in avr->sreg_lazy when needed
+ */
+enum {
+	AVR_SREG_LAZY_NONE = 0,
+	AVR_SREG_LAZY_ADD,		// ADD, ADC
+	AVR_SREG_LAZY_SUB,		// SUB, SUBI, CP, CPI
+	AVR_SREG_LAZY_SUB_R,	// SBC, SBCI, CPC, Z is only ever cleared
+	AVR_SREG_LAZY_NEG,
+};
+
+void _avr_sreg_materialize(avr_t * avr);
+
+/*
+ * Bring avr->sreg[] up to date with any pending lazy flags. The I and T
+ * bits are never deferred.
+ */
+static inline void avr_sreg_materialize(avr_t * avr)
+{
+	if (avr->sreg_lazy.op)
+		_avr_sreg_materialize(avr);
+}
+
 /**
  * Reconstructs the SREG value from avr->sreg into dst.
  */
 #define READ_SREG_INTO(avr, dst) { \
+			avr_sreg_materialize(avr); \
 			dst = 0; \
 			for (int i = 0; i < 8; i++) \
 				if (avr->sreg[i] > 1) { \
@@ -125,6 +344,7 @@ static inline void avr_sreg_set(avr_t * avr, uint8_t flag, uint8_t ival)
  * Splits the SREG value from src into the avr->sreg array.
  */
 #define SET_SREG_FROM(avr, src) { \
+			avr->sreg_lazy.op = AVR_SREG_LAZY_NONE; \
 			for (int i = 0; i < 8; i++) \
 				avr_sreg_set(avr, i, (src & (1 << i)) != 0); \
 		}
@@ -0,0 +1,144 @@
+/*
+	sim_coro.c
+
+	Stackless coroutines for the models of parts and peripherals, resumed
+	by the cycle timers and the irqs they wait for.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "sim_coro.h"
+
+static void
+_avr_coro_resume(
+		avr_coro_t * c )
+{
+	c->wait_irq = NULL;
+	if (c->body(c) == AVR_CORO_DONE)
+		c->line = -1;
+}
+
+static avr_cycle_count_t
+_avr_coro_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param )
+{
+	avr_coro_t * c = param;
+
+	c->timeout = c->wait_irq != NULL;
+	c->now = when;
+	c->wake = 0;
+	c->in_timer = 1;
+	_avr_coro_resume(c);
+	c->in_timer = 0;
+	// the pool puts it back, if it waits for cycles again
+	return c->wake;
+}
+
+static void
+_avr_coro_irq(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param )
+{
+	avr_coro_t * c = param;
+
+	if (c->wait_irq != irq)
+		return;
+	avr_cycle_timer_cancel_handle(c->avr, &c->timer);
+	c->timeout = 0;
+	c->value = value;
+	c->now = c->avr->cycle;
+	_avr_coro_resume(c);
+}
+
+void
+_avr_coro_wait_cycles(
+		avr_coro_t * c,
+		avr_cycle_count_t cycles )
+{
+	// zero would have the timer process resume it again, and again
+	if (!cycles)
+		cycles = 1;
+	if (c->in_timer)
+		c->wake = c->now + cycles;
+	else
+		avr_cycle_timer_register_handle(c->avr, &c->timer,
+				c->now + cycles - c->avr->cycle, _avr_coro_timer, c);
+}
+
+void
+_avr_coro_wait_irq(
+		avr_coro_t * c,
+		avr_irq_t * irq )
+{
+	int i;
+
+	// the hooks stay, it's not safe to remove them from one of them
+	for (i = 0; i < AVR_CORO_IRQ_MAX && c->hooked[i]; i++)
+		if (c->hooked[i] == irq)
+			break;
+	if (i == AVR_CORO_IRQ_MAX) {
+		AVR_LOG(c->avr, LOG_ERROR,
+				"CORO: %s: more than %d irqs, '%s' is never coming\n",
+				__func__, AVR_CORO_IRQ_MAX, irq->name ? irq->name : "?");
+		return;
+	}
+	if (!c->hooked[i]) {
+		c->hooked[i] = irq;
+		avr_irq_register_notify(irq, _avr_coro_irq, c);
+	}
+	c->wait_irq = irq;
+}
+
+void
+avr_coro_init(
+		struct avr_t * avr,
+		avr_coro_t * c,
+		avr_coro_body_t body,
+		void * param )
+{
+	memset(c, 0, sizeof(*c));
+	c->avr = avr;
+	c->body = body;
+	c->param = param;
+}
+
+void
+avr_coro_start(
+		avr_coro_t * c )
+{
+	avr_cycle_timer_cancel_handle(c->avr, &c->timer);
+	c->line = 0;
+	c->timeout = 0;
+	c->now = c->avr->cycle;
+	_avr_coro_resume(c);
+}
+
+void
+avr_coro_stop(
+		avr_coro_t * c )
+{
+	avr_cycle_timer_cancel_handle(c->avr, &c->timer);
+	for (int i = 0; i < AVR_CORO_IRQ_MAX && c->hooked[i]; i++) {
+		avr_irq_unregister_notify(c->hooked[i], _avr_coro_irq, c);
+		c->hooked[i] = NULL;
+	}
+	c->wait_irq = NULL;
+	c->line = 0;
+}
@@ -0,0 +1,178 @@
+/*
+	sim_coro.h
+
+	Stackless coroutines for the models of parts and peripherals, resumed
+	by the cycle timers and the irqs they wait for.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_CORO_H__
+#define __SIM_CORO_H__
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+#include "sim_time.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A model that goes through a sequence of states, each with its delay or
+ * the input it waits for, can be written as that sequence rather than as
+ * a timer and a hook per state:
+ *
+ *	static int
+ *	pulse_body(
+ *			avr_coro_t * c )
+ *	{
+ *		pulse_t * p = c->param;
+ *		AVR_CORO_BEGIN(c);
+ *		for (p->count = 0; p->count < 8; p->count++) {
+ *			avr_raise_irq(p->irq + IRQ_PULSE_OUT, 1);
+ *			AVR_CORO_WAIT_USEC(c, 10);
+ *			avr_raise_irq(p->irq + IRQ_PULSE_OUT, 0);
+ *			AVR_CORO_WAIT_IRQ_FOR(c, p->irq + IRQ_PULSE_ACK, 1000);
+ *			if (c->timeout)
+ *				break;
+ *		}
+ *		AVR_CORO_END(c);
+ *	}
+ *
+ * The body is called again at each wakeup, and the AVR_CORO_* macros go
+ * on from where it waited, so:
+ * + its locals don't survive a wait, what it keeps goes in the model's
+ *   state, as 'count' above;
+ * + there's one wait per line, and none in a switch of its own.
+ * A wait for cycles is the coroutine's cycle timer; when the coroutine
+ * runs from that timer and waits for cycles again, the timer returns the
+ * next wakeup, it isn't cancelled and registered again. The due
+ * coroutines are resumed by avr_cycle_timer_process() with the other
+ * timers, in one pass.
+ */
+enum {
+	AVR_CORO_WAIT = 0,		// returned by the body when it waits
+	AVR_CORO_DONE,			// when it's finished
+};
+
+// the irqs a coroutine can wait for over its life
+#define AVR_CORO_IRQ_MAX	4
+
+struct avr_coro_t;
+typedef int (*avr_coro_body_t)(
+		struct avr_coro_t * c );
+
+typedef struct avr_coro_t {
+	struct avr_t *		avr;
+	avr_coro_body_t		body;
+	void *				param;
+	int					line;		// where the body goes on, 0 to start, -1 when done
+	/*
+	 * How the last wait ended: 'timeout' is set if the time ran out before
+	 * the irq came, otherwise 'value' is the new value of the irq (its
+	 * 'value' field is only updated once its hooks have run)
+	 */
+	uint8_t				timeout;
+	uint32_t			value;
+	// private
+	avr_irq_t *			wait_irq;	// NULL when it doesn't wait for one
+	avr_cycle_count_t	now;		// cycle it was resumed at, or due at
+	avr_cycle_count_t	wake;		// next wakeup, when resumed by its timer
+	uint8_t				in_timer;
+	avr_cycle_timer_handle_t timer;
+	avr_irq_t *			hooked[AVR_CORO_IRQ_MAX];
+} avr_coro_t;
+
+// sets up 'c' to run 'body'; it only runs once started
+void
+avr_coro_init(
+		struct avr_t * avr,
+		avr_coro_t * c,
+		avr_coro_body_t body,
+		void * param );
+/*
+ * Runs the body from its start now, up to its first wait. A coroutine
+ * that was waiting stops waiting and starts over.
+ */
+void
+avr_coro_start(
+		avr_coro_t * c );
+/*
+ * Stops waiting, and lets go of the irqs it had hooks on; it can be
+ * started again. Not to be called from the body, nor from the hooks of
+ * the irqs it waits for.
+ */
+void
+avr_coro_stop(
+		avr_coro_t * c );
+
+// 1 while it waits to go on, 0 before it's started, and once it's done
+static inline int
+avr_coro_running(
+		avr_coro_t * c )
+{
+	return c->line > 0;
+}
+
+// used by the macros below
+void
+_avr_coro_wait_cycles(
+		avr_coro_t * c,
+		avr_cycle_count_t cycles );
+void
+_avr_coro_wait_irq(
+		avr_coro_t * c,
+		avr_irq_t * irq );
+
+#define AVR_CORO_BEGIN(_c) \
+		switch ((_c)->line) { \
+			case 0:
+#define AVR_CORO_END(_c) \
+		} \
+		return AVR_CORO_DONE
+#define _AVR_CORO_YIELD(_c) \
+		(_c)->line = __LINE__; \
+		return AVR_CORO_WAIT; \
+		case __LINE__: ;
+
+// resumes after 'cycles' cycles, counted from when it was due to resume
+#define AVR_CORO_WAIT_CYCLES(_c, _cycles) \
+		do { \
+			_avr_coro_wait_cycles((_c), (_cycles)); \
+			_AVR_CORO_YIELD(_c); \
+		} while (0)
+#define AVR_CORO_WAIT_USEC(_c, _usec) \
+		AVR_CORO_WAIT_CYCLES(_c, avr_usec_to_cycles((_c)->avr, (_usec)))
+// resumes when 'irq' is next raised, with its value in (_c)->value
+#define AVR_CORO_WAIT_IRQ(_c, _irq) \
+		do { \
+			_avr_coro_wait_irq((_c), (_irq)); \
+			_AVR_CORO_YIELD(_c); \
+		} while (0)
+// same, or after 'cycles' at most, with (_c)->timeout set then
+#define AVR_CORO_WAIT_IRQ_FOR(_c, _irq, _cycles) \
+		do { \
+			_avr_coro_wait_irq((_c), (_irq)); \
+			_avr_coro_wait_cycles((_c), (_cycles)); \
+			_AVR_CORO_YIELD(_c); \
+		} while (0)
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_CORO_H__ */
@@ -0,0 +1,340 @@
+/*
+	sim_cosim.c
+
+	Runs several AVR instances in lockstep, one thread each, with irqs
+	connected from one to another.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_cosim.h"
+#include "sim_time.h"
+#include "sim_numa.h"
+
+static int
+_avr_cosim_push(
+		avr_cosim_queue_t * q,
+		uint64_t when,
+		uint32_t value)
+{
+	if (q->count == q->size) {
+		if (q->head) {
+			q->count -= q->head;
+			memmove(q->e, q->e + q->head, q->count * sizeof(q->e[0]));
+			q->head = 0;
+		} else {
+			uint32_t size = q->size ? q->size * 2 : 64;
+			avr_cosim_event_t * e = realloc(q->e, size * sizeof(*e));
+			if (!e)
+				return -1;
+			q->e = e;
+			q->size = size;
+		}
+	}
+	q->e[q->count].when = when;
+	q->e[q->count].value = value;
+	q->count++;
+	return 0;
+}
+
+static inline const avr_time_base_t *
+_avr_cosim_time(
+		avr_cosim_node_t * n)
+{
+	// the firmware might have changed the clock
+	if (unlikely(n->time.frequency != n->avr->frequency))
+		avr_time_base_init(&n->time, n->avr->frequency);
+	return &n->time;
+}
+
+static inline uint64_t
+_avr_cosim_ps(
+		avr_cosim_node_t * n)
+{
+	return avr_time_to_ps(_avr_cosim_time(n), n->avr->cycle - n->base);
+}
+
+// the first cycle of that node at or after 'ps', so events are never early
+static inline avr_cycle_count_t
+_avr_cosim_cycle(
+		avr_cosim_node_t * n,
+		uint64_t ps)
+{
+	return n->base + avr_time_to_cycles(_avr_cosim_time(n), ps);
+}
+
+// runs on the source's thread
+static void
+_avr_cosim_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_cosim_link_t * l = param;
+
+	if (_avr_cosim_push(&l->out[l->cosim->window & 1],
+			_avr_cosim_ps(l->src) + l->latency * 1000, value))
+		AVR_LOG(l->src->avr, LOG_ERROR, "COSIM: %s: event lost\n", irq->name);
+}
+
+// runs on the destination's thread, raises whatever is due
+static avr_cycle_count_t
+_avr_cosim_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_cosim_link_t * l = param;
+	avr_cosim_queue_t * q = &l->in;
+
+	while (q->head < q->count) {
+		avr_cycle_count_t due = _avr_cosim_cycle(l->dst, q->e[q->head].when);
+		if (due > avr->cycle)
+			return due;
+		avr_raise_irq(l->dst_irq, q->e[q->head++].value);
+	}
+	q->head = q->count = 0;
+	return 0;
+}
+
+// moves what the sources sent during the last quantum to their destination
+static void
+_avr_cosim_receive(
+		avr_cosim_node_t * n)
+{
+	avr_cosim_t * c = n->cosim;
+
+	if (!c->window)
+		return;
+	for (int i = 0; i < c->link_count; i++) {
+		avr_cosim_link_t * l = c->link[i];
+		avr_cosim_queue_t * out = &l->out[(c->window - 1) & 1];
+		if (l->dst != n || !out->count)
+			continue;
+		for (uint32_t e = 0; e < out->count; e++)
+			if (_avr_cosim_push(&l->in, out->e[e].when, out->e[e].value))
+				AVR_LOG(n->avr, LOG_ERROR, "COSIM: %s: event lost\n",
+						l->dst_irq->name);
+		out->count = 0;
+		if (!l->timer.slot && l->in.head < l->in.count) {
+			avr_cycle_count_t due = _avr_cosim_cycle(n, l->in.e[l->in.head].when);
+			avr_cycle_timer_register_handle(n->avr, &l->timer,
+					due > n->avr->cycle ? due - n->avr->cycle : 0,
+					_avr_cosim_timer, l);
+		}
+	}
+}
+
+// starts the next quantum, with the lock held
+static void
+_avr_cosim_next(
+		avr_cosim_t * c)
+{
+	c->waiting = 0;
+	c->window++;
+	c->now += c->quantum;
+	int running = 0;
+	for (int i = 0; i < c->node_count; i++)
+		running += !c->node[i].done;
+	c->stop = !running || c->now >= c->until;
+	pthread_cond_broadcast(&c->cond);
+}
+
+// returns non zero when it's time to stop
+static int
+_avr_cosim_barrier(
+		avr_cosim_t * c)
+{
+	pthread_mutex_lock(&c->lock);
+	uint64_t window = c->window;
+	if (++c->waiting == c->threads)
+		_avr_cosim_next(c);
+	else while (c->window == window)
+		pthread_cond_wait(&c->cond, &c->lock);
+	int stop = c->stop;
+	pthread_mutex_unlock(&c->lock);
+	return stop;
+}
+
+static void *
+_avr_cosim_thread(
+		void * param)
+{
+	avr_cosim_node_t * n = param;
+	avr_cosim_t * c = n->cosim;
+
+	// the core was made by another thread, maybe on another node
+	avr_numa_localize(n->avr);
+	do {
+		_avr_cosim_receive(n);
+		if (n->done)
+			continue;
+		avr_cycle_count_t end = _avr_cosim_cycle(n, (c->now + c->quantum) * 1000);
+		if (n->avr->cycle < end) {
+			int state = avr_run_cycles(n->avr, end - n->avr->cycle);
+			n->done = state != cpu_Running && state != cpu_Sleeping;
+		}
+	} while (!_avr_cosim_barrier(c));
+	return NULL;
+}
+
+int
+avr_cosim_init(
+		avr_cosim_t * c,
+		uint64_t quantum)
+{
+	memset(c, 0, sizeof(*c));
+	if (!quantum) {
+		AVR_LOG(NULL, LOG_ERROR, "COSIM: quantum can't be zero\n");
+		return -1;
+	}
+	c->quantum = quantum;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	return 0;
+}
+
+static avr_cosim_node_t *
+_avr_cosim_node(
+		avr_cosim_t * c,
+		avr_t * avr)
+{
+	for (int i = 0; i < c->node_count; i++)
+		if (c->node[i].avr == avr)
+			return c->node + i;
+	return NULL;
+}
+
+int
+avr_cosim_add(
+		avr_cosim_t * c,
+		avr_t * avr)
+{
+	if (_avr_cosim_node(c, avr)) {
+		AVR_LOG(avr, LOG_ERROR, "COSIM: %s added twice\n", avr->mmcu);
+		return -1;
+	}
+	if (c->node_count == AVR_COSIM_NODES) {
+		AVR_LOG(avr, LOG_ERROR, "COSIM: too many instances\n");
+		return -1;
+	}
+	avr_cosim_node_t * n = c->node + c->node_count;
+	memset(n, 0, sizeof(*n));
+	n->cosim = c;
+	n->avr = avr;
+	// it joins at the current time, whatever its cycle count
+	n->base = avr->cycle - _avr_cosim_cycle(n, c->now * 1000);
+	c->node_count++;
+	return 0;
+}
+
+avr_cosim_link_t *
+avr_cosim_connect(
+		avr_cosim_t * c,
+		avr_t * src,
+		avr_irq_t * src_irq,
+		avr_t * dst,
+		avr_irq_t * dst_irq,
+		uint64_t latency)
+{
+	avr_cosim_node_t * s = _avr_cosim_node(c, src);
+	avr_cosim_node_t * d = _avr_cosim_node(c, dst);
+
+	if (!s || !d || !src_irq || !dst_irq) {
+		AVR_LOG(src, LOG_ERROR, "COSIM: %s: unknown instance or irq\n", __func__);
+		return NULL;
+	}
+	if (!latency) {
+		AVR_LOG(src, LOG_ERROR, "COSIM: %s: link latency can't be zero\n",
+				src_irq->name);
+		return NULL;
+	}
+	avr_cosim_link_t ** list = realloc(c->link,
+			(c->link_count + 1) * sizeof(c->link[0]));
+	if (!list)
+		return NULL;
+	c->link = list;
+	avr_cosim_link_t * l = calloc(1, sizeof(*l));
+	if (!l)
+		return NULL;
+	l->cosim = c;
+	l->src = s;
+	l->dst = d;
+	l->src_irq = src_irq;
+	l->dst_irq = dst_irq;
+	l->latency = latency;
+	c->link[c->link_count++] = l;
+	if (latency < c->quantum)
+		c->quantum = latency;
+	avr_irq_register_notify(src_irq, _avr_cosim_notify, l);
+	return l;
+}
+
+int
+avr_cosim_run(
+		avr_cosim_t * c,
+		uint64_t duration)
+{
+	int started = 0;
+
+	c->until = c->now + duration;
+	c->stop = 0;
+	pthread_mutex_lock(&c->lock);
+	c->threads = c->node_count;
+	for (; started < c->node_count; started++)
+		if (pthread_create(&c->node[started].thread, NULL,
+				_avr_cosim_thread, c->node + started))
+			break;
+	if (started < c->node_count) {
+		// the barrier counts on all of them, stop the ones that started
+		AVR_LOG(c->node[started].avr, LOG_ERROR,
+				"COSIM: can't start thread %d\n", started);
+		c->until = c->now;
+		c->threads = started;
+		if (started && c->waiting == started)
+			_avr_cosim_next(c);
+	}
+	pthread_mutex_unlock(&c->lock);
+	for (int i = 0; i < started; i++)
+		pthread_join(c->node[i].thread, NULL);
+
+	int running = 0;
+	for (int i = 0; i < c->node_count; i++)
+		running += !c->node[i].done;
+	return running;
+}
+
+void
+avr_cosim_free(
+		avr_cosim_t * c)
+{
+	for (int i = 0; i < c->link_count; i++) {
+		avr_cosim_link_t * l = c->link[i];
+		avr_irq_unregister_notify(l->src_irq, _avr_cosim_notify, l);
+		avr_cycle_timer_cancel_handle(l->dst->avr, &l->timer);
+		free(l->out[0].e);
+		free(l->out[1].e);
+		free(l->in.e);
+		free(l);
+	}
+	free(c->link);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	memset(c, 0, sizeof(*c));
+}
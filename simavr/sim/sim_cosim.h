@@ -0,0 +1,150 @@
+/*
+	sim_cosim.h
+
+	Runs several AVR instances in lockstep, one thread each, with irqs
+	connected from one to another.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_COSIM_H__
+#define __SIM_COSIM_H__
+
+#include <pthread.h>
+#include "sim_avr.h"
+#include "sim_time.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Simulated time is cut in quanta of 'quantum' nanoseconds. Each instance
+ * runs the current quantum on its own thread, then waits for all the
+ * others at a barrier before starting the next one.
+ *
+ * A link carries the values raised on an irq of one instance to an irq
+ * of another one, 'latency' nanoseconds later, like avr_connect_irq() does
+ * within an instance. The quantum is never longer than the shortest link
+ * latency, so whatever is raised during a quantum is due in a later one,
+ * and no instance ever receives an event in its past.
+ *
+ * Events are ordered on one time line, in picoseconds, each instance
+ * going from its cycles to it and back with its own avr_time_base_t,
+ * without a division.
+ *
+ * The links don't need any locks: the source appends to one of two
+ * buffers, picked by the parity of the quantum, while the destination
+ * empties the other one, and the barrier is what swaps them.
+ */
+#define AVR_COSIM_NODES		16
+/*
+ * For example, two chips talking over a serial line, with one byte time
+ * of latency at 115200 baud:
+ *
+ *	avr_cosim_connect(&c,
+ *		a, avr_io_getirq(a, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+ *		b, avr_io_getirq(b, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT),
+ *		86805);
+ */
+
+typedef struct avr_cosim_event_t {
+	uint64_t			when;		// at the destination, ps
+	uint32_t			value;
+} avr_cosim_event_t;
+
+typedef struct avr_cosim_queue_t {
+	avr_cosim_event_t *	e;
+	uint32_t			head, count, size;
+} avr_cosim_queue_t;
+
+typedef struct avr_cosim_link_t {
+	struct avr_cosim_t *		cosim;
+	struct avr_cosim_node_t *	src, * dst;
+	avr_irq_t *					src_irq, * dst_irq;
+	uint64_t					latency;	// nsec
+	avr_cosim_queue_t			out[2];		// filled by the source
+	avr_cosim_queue_t			in;			// destination side, not raised yet
+	avr_cycle_timer_handle_t	timer;
+} avr_cosim_link_t;
+
+typedef struct avr_cosim_node_t {
+	struct avr_cosim_t *	cosim;
+	avr_t *					avr;
+	avr_cycle_count_t		base;		// avr->cycle at time zero
+	avr_time_base_t			time;		// of its current frequency
+	pthread_t				thread;
+	int						done;		// neither running nor sleeping
+} avr_cosim_node_t;
+
+typedef struct avr_cosim_t {
+	uint64_t			quantum;	// nsec
+	uint64_t			now;		// start of the current quantum
+	uint64_t			until;		// of the current avr_cosim_run()
+	uint64_t			window;		// quantum number, for the buffer parity
+	avr_cosim_node_t	node[AVR_COSIM_NODES];
+	int					node_count;
+	avr_cosim_link_t **	link;
+	int					link_count;
+	// the barrier, pthread_barrier_t isn't available everywhere
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					threads, waiting;
+	int					stop;
+} avr_cosim_t;
+
+// 'quantum' is the longest one wanted, in nsec. Returns zero if all is well
+int
+avr_cosim_init(
+		avr_cosim_t * c,
+		uint64_t quantum );
+// adds an instance, initialized and reset already
+int
+avr_cosim_add(
+		avr_cosim_t * c,
+		struct avr_t * avr );
+/*
+ * Raises of 'src_irq' on 'src' are raised on 'dst_irq' of 'dst', 'latency'
+ * nsec later. That shortens the quantum if needed. Both instances have
+ * to be added first. Returns NULL on error.
+ */
+avr_cosim_link_t *
+avr_cosim_connect(
+		avr_cosim_t * c,
+		struct avr_t * src,
+		avr_irq_t * src_irq,
+		struct avr_t * dst,
+		avr_irq_t * dst_irq,
+		uint64_t latency );
+/*
+ * Runs all the instances for 'duration' nsec, or until none of them is
+ * running or sleeping anymore. Can be called again to carry on; returns
+ * the number of instances still running.
+ */
+int
+avr_cosim_run(
+		avr_cosim_t * c,
+		uint64_t duration );
+// disconnects the links and releases them, the instances are left alone
+void
+avr_cosim_free(
+		avr_cosim_t * c );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_COSIM_H__ */
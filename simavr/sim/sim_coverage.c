@@ -0,0 +1,105 @@
+/*
+	sim_coverage.c
+
+	AFL style edge coverage of the firmware, for fuzzers.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_coverage.h"
+
+int
+avr_coverage_init(
+		avr_t * avr,
+		avr_coverage_t * c,
+		uint8_t * map,
+		uint32_t size)
+{
+	if (avr->coverage) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: already running\n");
+		return -1;
+	}
+	if (!size || (size & (size - 1))) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: map size %u isn't a power of two\n",
+				size);
+		return -1;
+	}
+	memset(c, 0, sizeof(*c));
+	c->map = map;
+	if (!c->map) {
+		c->map = calloc(1, size);
+		if (!c->map) {
+			AVR_LOG(avr, LOG_ERROR, "COVERAGE: can't allocate the map\n");
+			return -1;
+		}
+		c->own = 1;
+	}
+	c->mask = size - 1;
+	c->stop = ~0;
+	c->avr = avr;
+	avr->coverage = c;
+	return 0;
+}
+
+void
+avr_coverage_reset(
+		avr_coverage_t * c)
+{
+	c->prev = 0;
+}
+
+void
+avr_coverage_stop_at(
+		avr_coverage_t * c,
+		uint32_t pc)
+{
+	c->stop = pc;
+}
+
+void
+avr_coverage_stop(
+		avr_coverage_t * c)
+{
+	if (!c->avr)
+		return;
+	c->avr->coverage = NULL;
+	c->avr = NULL;
+}
+
+void
+avr_coverage_free(
+		avr_coverage_t * c)
+{
+	avr_coverage_stop(c);
+	if (c->own)
+		free(c->map);
+	c->map = NULL;
+	c->own = 0;
+}
+
+uint32_t
+avr_coverage_count(
+		avr_coverage_t * c)
+{
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; c->map && i <= c->mask; i++)
+		count += c->map[i] != 0;
+	return count;
+}
@@ -0,0 +1,106 @@
+/*
+	sim_coverage.h
+
+	AFL style edge coverage of the firmware, for fuzzers.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_COVERAGE_H__
+#define __SIM_COVERAGE_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The core tells us where every branch, skip, jump, call and return goes,
+ * taken or not, and nothing else. Like AFL does for the blocks of a host
+ * program, the edge between the previous such destination and this one
+ * bumps a counter in the map.
+ * The map can be supplied, to count straight into a fuzzer's own (AFL's
+ * shared memory, libFuzzer's extra counters); it's up to the fuzzer to
+ * clear it between inputs.
+ */
+typedef struct avr_coverage_t {
+	struct avr_t *	avr;
+	uint8_t *		map;
+	uint32_t		mask;		// map size - 1
+	uint32_t		prev;		// previous location, shifted
+	uint32_t		stop;		// see avr_coverage_stop_at()
+	int				own;		// map allocated by avr_coverage_init()
+} avr_coverage_t;
+
+/*
+ * Starts counting edges in 'map', 'size' bytes which must be a power of
+ * two. If 'map' is NULL one is allocated. Returns zero if all is well
+ */
+int
+avr_coverage_init(
+		struct avr_t * avr,
+		avr_coverage_t * c,
+		uint8_t * map,
+		uint32_t size );
+// forgets the previous location, to call at the start of each input
+void
+avr_coverage_reset(
+		avr_coverage_t * c );
+/*
+ * Makes the core stop, cpu_Stopped, once the flow gets to 'pc' (a call to
+ * a function, a jump to a loop), after the instruction that goes there.
+ * Setting the state back to cpu_Running goes on from there. ~0 for none,
+ * the default
+ */
+void
+avr_coverage_stop_at(
+		avr_coverage_t * c,
+		uint32_t pc );
+// stops counting, the map is kept until avr_coverage_free()
+void
+avr_coverage_stop(
+		avr_coverage_t * c );
+void
+avr_coverage_free(
+		avr_coverage_t * c );
+// number of non zero counters
+uint32_t
+avr_coverage_count(
+		avr_coverage_t * c );
+
+/*
+ * Called by the core with the pc the flow goes to
+ */
+static inline void
+avr_coverage_edge(
+		avr_coverage_t * c,
+		avr_flashaddr_t pc )
+{
+	uint32_t cur = (pc >> 1) * 2654435761u;
+	cur ^= cur >> 16;
+	uint8_t * e = c->map + ((cur ^ c->prev) & c->mask);
+	*e += 1 + (*e == 0xff);		// never wraps back to zero
+	c->prev = (cur & c->mask) >> 1;
+	if (pc == c->stop)
+		c->avr->state = cpu_Stopped;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_COVERAGE_H__ */
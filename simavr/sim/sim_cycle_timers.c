@@ -25,44 +25,111 @@
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_cycle_timers.h"
+#include "sim_stats.h"
+#include "sim_timer_prof.h"
 
-#define QUEUE(__q, __e) { \
-		(__e)->next = (__q); \
-		(__q) = __e; \
-	}
-#define DETACH(__q, __l, __e) { \
-		if (__l) \
-			(__l)->next = (__e)->next; \
-		else \
-			(__q) = (__e)->next; \
+#define DEFAULT_SLEEP_CYCLES 1000
+
+static inline int
+avr_cycle_timer_before(
+		avr_cycle_timer_slot_p a,
+		avr_cycle_timer_slot_p b)
+{
+	return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static inline void
+avr_cycle_timer_place(
+		avr_cycle_timer_slot_p h,
+		uint32_t i,
+		avr_cycle_timer_slot_p t)
+{
+	h[i] = *t;
+	if (t->handle)
+		t->handle->slot = i + 1;
+}
+
+// move heap entry 'i' up or down until it's in order again
+static void
+avr_cycle_timer_sift(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t i)
+{
+	avr_cycle_timer_slot_p h = pool->timer;
+	avr_cycle_timer_slot_t t = h[i];
+
+	while (i) {
+		uint32_t parent = (i - 1) / 2;
+		if (!avr_cycle_timer_before(&t, &h[parent]))
+			break;
+		avr_cycle_timer_place(h, i, &h[parent]);
+		i = parent;
 	}
-#define INSERT(__q, __l, __e) { \
-		if (__l) { \
-			(__e)->next = (__l)->next; \
-			(__l)->next = (__e); \
-		} else { \
-			(__e)->next = (__q); \
-			(__q) = (__e); \
-		} \
+	for (;;) {
+		uint32_t c = 2 * i + 1;
+		if (c >= pool->count)
+			break;
+		if (c + 1 < pool->count && avr_cycle_timer_before(&h[c + 1], &h[c]))
+			c++;
+		if (!avr_cycle_timer_before(&h[c], &t))
+			break;
+		avr_cycle_timer_place(h, i, &h[c]);
+		i = c;
 	}
+	avr_cycle_timer_place(h, i, &t);
+}
 
-#define DEFAULT_SLEEP_CYCLES 1000
+static void
+avr_cycle_timer_remove(
+		avr_cycle_timer_pool_t * pool,
+		uint32_t i)
+{
+	if (pool->timer[i].handle)
+		pool->timer[i].handle->slot = 0;
+	pool->count--;
+	if (i == pool->count)
+		return;
+	pool->timer[i] = pool->timer[pool->count];
+	avr_cycle_timer_sift(pool, i);
+}
+
+// returns the heap index of the timer, or -1
+static int
+avr_cycle_timer_find(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	for (uint32_t i = 0; i < pool->count; i++)
+		if (pool->timer[i].timer == timer && pool->timer[i].param == param)
+			return i;
+	return -1;
+}
 
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
-	memset(pool, 0, sizeof(*pool));
-	// queue all slots into the free queue
-	for (int i = 0; i < MAX_CYCLE_TIMERS; i++) {
-		avr_cycle_timer_slot_p t = &pool->timer_slots[i];
-		QUEUE(pool->timer_free, t);
-	}
+	// the heap itself is kept, for the next run
+	for (uint32_t i = 0; i < pool->count; i++)
+		if (pool->timer[i].handle)
+			pool->timer[i].handle->slot = 0;
+	pool->count = 0;
+	pool->seq = 0;
 	avr->run_cycle_count = 1;
 	avr->run_cycle_limit = 1;
 }
 
+void
+avr_cycle_timer_free(
+		struct avr_t * avr)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	free(pool->timer);
+	memset(pool, 0, sizeof(*pool));
+}
+
 static avr_cycle_count_t
 avr_cycle_timer_return_sleep_run_cycles_limited(
 	avr_t *avr,
@@ -85,9 +152,9 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 	avr_cycle_count_t sleep_cycle_count = DEFAULT_SLEEP_CYCLES;
 
-	if(pool->timer) {
-		if(pool->timer->when > avr->cycle) {
-			sleep_cycle_count = pool->timer->when - avr->cycle;
+	if(pool->count) {
+		if(pool->timer[0].when > avr->cycle) {
+			sleep_cycle_count = pool->timer[0].when - avr->cycle;
 		} else {
 			sleep_cycle_count = 0;
 		}
@@ -96,40 +163,65 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_return_sleep_run_cycles_limited(avr, sleep_cycle_count);
 }
 
+// counts a registration, or a cancellation, when profiling the timers
+static void
+avr_cycle_timer_prof_count(
+		avr_t * avr,
+		avr_cycle_timer_t timer,
+		void * param,
+		int cancel)
+{
+	avr_timer_prof_entry_t * e = avr_timer_prof_get(avr->timer_prof, timer, param);
+	if (e) {
+		e->registered += !cancel;
+		e->cancelled += cancel;
+	}
+}
+
 // no sanity checks checking here, on purpose
 static void
 avr_cycle_timer_insert(
 		avr_t * avr,
 		avr_cycle_count_t when,
 		avr_cycle_timer_t timer,
-		void * param)
+		void * param,
+		avr_cycle_timer_handle_t * handle,
+		avr_cycle_count_t period)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
 	when += avr->cycle;
 
-	avr_cycle_timer_slot_p t = pool->timer_free;
-
-	if (!t) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: ran out of timers (%d)!\n", __func__, MAX_CYCLE_TIMERS);
+	if (handle && handle->slot) {
+		// already pending, just move it
+		avr_cycle_timer_slot_p t = &pool->timer[handle->slot - 1];
+		t->timer = timer;
+		t->param = param;
+		t->when = when;
+		t->period = period;
+		t->seq = pool->seq++;
+		avr_cycle_timer_sift(pool, handle->slot - 1);
 		return;
 	}
-	// detach head
-	pool->timer_free = t->next;
-	t->next = NULL;
+	if (pool->count == pool->size) {
+		uint32_t size = pool->size ? pool->size * 2 : MAX_CYCLE_TIMERS;
+		avr_cycle_timer_slot_p h = realloc(pool->timer, size * sizeof(*h));
+		if (!h) {
+			AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: ran out of timers (%d)!\n",
+					__func__, pool->size);
+			return;
+		}
+		pool->timer = h;
+		pool->size = size;
+	}
+	avr_cycle_timer_slot_p t = &pool->timer[pool->count++];
 	t->timer = timer;
 	t->param = param;
 	t->when = when;
-
-	// find its place in the list
-	avr_cycle_timer_slot_p loop = pool->timer, last = NULL;
-	while (loop) {
-		if (loop->when > when)
-			break;
-		last = loop;
-		loop = loop->next;
-	}
-	INSERT(pool->timer, last, t);
+	t->period = period;
+	t->seq = pool->seq++;
+	t->handle = handle;
+	avr_cycle_timer_sift(pool, pool->count - 1);
 }
 
 void
@@ -142,14 +234,14 @@ avr_cycle_timer_register(
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
 	// remove it if it was already scheduled
-	avr_cycle_timer_cancel(avr, timer, param);
+	int i = avr_cycle_timer_find(pool, timer, param);
+	if (i != -1)
+		avr_cycle_timer_remove(pool, i);
 
-	if (!pool->timer_free) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: pool is full (%d)!\n", __func__, MAX_CYCLE_TIMERS);
-		return;
-	}
-	avr_cycle_timer_insert(avr, when, timer, param);
+	avr_cycle_timer_insert(avr, when, timer, param, NULL, 0);
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+	if (unlikely(avr->timer_prof))
+		avr_cycle_timer_prof_count(avr, timer, param, 0);
 }
 
 void
@@ -170,16 +262,11 @@ avr_cycle_timer_cancel(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer, last = NULL;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			DETACH(pool->timer, last, t);
-			QUEUE(pool->timer_free, t);
-			break;
-		}
-		last = t;
-		t = t->next;
+	int i = avr_cycle_timer_find(pool, timer, param);
+	if (i != -1) {
+		avr_cycle_timer_remove(pool, i);
+		if (unlikely(avr->timer_prof))
+			avr_cycle_timer_prof_count(avr, timer, param, 1);
 	}
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
@@ -196,15 +283,124 @@ avr_cycle_timer_status(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			return 1 + (t->when - avr->cycle);
+	int i = avr_cycle_timer_find(pool, timer, param);
+	if (i == -1)
+		return 0;
+	return 1 + (pool->timer[i].when - avr->cycle);
+}
+
+void
+avr_cycle_timer_register_handle(
+		avr_t * avr,
+		avr_cycle_timer_handle_t * handle,
+		avr_cycle_count_t when,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	avr_cycle_timer_insert(avr, when, timer, param, handle, 0);
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+	if (unlikely(avr->timer_prof))
+		avr_cycle_timer_prof_count(avr, timer, param, 0);
+}
+
+void
+avr_cycle_timer_register_batch(
+		avr_t * avr,
+		avr_cycle_timer_handle_t * handle,
+		avr_cycle_count_t when,
+		avr_cycle_count_t period,
+		avr_cycle_timer_batch_t timer,
+		void * param)
+{
+	// kept as a plain timer, 'period' tells them apart
+	avr_cycle_timer_insert(avr, when, (avr_cycle_timer_t)(void (*)(void))timer, param, handle,
+			period ? period : 1);
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+	if (unlikely(avr->timer_prof))
+		avr_cycle_timer_prof_count(avr, (avr_cycle_timer_t)(void (*)(void))timer,
+				param, 0);
+}
+
+void
+avr_cycle_timer_cancel_handle(
+		avr_t * avr,
+		avr_cycle_timer_handle_t * handle)
+{
+	if (handle->slot) {
+		avr_cycle_timer_slot_p t = &avr->cycle_timers.timer[handle->slot - 1];
+		if (unlikely(avr->timer_prof))
+			avr_cycle_timer_prof_count(avr, t->timer, t->param, 1);
+		avr_cycle_timer_remove(&avr->cycle_timers, handle->slot - 1);
+	}
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+}
+
+avr_cycle_count_t
+avr_cycle_timer_status_handle(
+		avr_t * avr,
+		avr_cycle_timer_handle_t * handle)
+{
+	if (!handle->slot)
+		return 0;
+	return 1 + (avr->cycle_timers.timer[handle->slot - 1].when - avr->cycle);
+}
+
+uint32_t
+avr_cycle_timer_suspend(
+		avr_t * avr,
+		void * base,
+		uint32_t size,
+		avr_cycle_timer_slot_t ** saved,
+		uint32_t * room)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	uint32_t count = 0, keep = 0;
+
+	for (uint32_t i = 0; i < pool->count; i++) {
+		avr_cycle_timer_slot_p t = &pool->timer[i];
+		if ((uint8_t *)t->param < (uint8_t *)base ||
+				(uint8_t *)t->param >= (uint8_t *)base + size) {
+			avr_cycle_timer_place(pool->timer, keep++, t);
+			continue;
 		}
-		t = t->next;
+		if (count == *room) {
+			uint32_t n = *room ? *room * 2 : 8;
+			avr_cycle_timer_slot_p s = realloc(*saved, n * sizeof(*s));
+			if (!s) {
+				AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: out of memory\n", __func__);
+				avr_cycle_timer_place(pool->timer, keep++, t);
+				continue;
+			}
+			*saved = s;
+			*room = n;
+		}
+		avr_cycle_timer_slot_p s = &(*saved)[count++];
+		*s = *t;
+		s->when = t->when > avr->cycle ? t->when - avr->cycle : 0;
+		if (t->handle)
+			t->handle->slot = 0;
 	}
-	return 0;
+	if (!count)
+		return 0;
+	// what's left is in the same order, only the heap needs mending
+	pool->count = keep;
+	for (uint32_t i = keep / 2; i-- > 0; )
+		avr_cycle_timer_sift(pool, i);
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+	return count;
+}
+
+void
+avr_cycle_timer_resume(
+		avr_t * avr,
+		avr_cycle_timer_slot_t * saved,
+		uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+		avr_cycle_timer_insert(avr, saved[i].when, saved[i].timer,
+				saved[i].param, saved[i].handle, saved[i].period);
+	if (count)
+		avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
 
 /*
@@ -218,29 +414,49 @@ avr_cycle_timer_process(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	if (pool->timer) do {
-		avr_cycle_timer_slot_p t = pool->timer;
-		avr_cycle_count_t when = t->when;
+	while (pool->count) {
+		avr_cycle_timer_slot_t t = pool->timer[0];
+		avr_cycle_count_t when = t.when;
 
 		if (when > avr->cycle)
 			return avr_cycle_timer_return_sleep_run_cycles_limited(avr, when - avr->cycle);
 
 		// detach from active timers
-		pool->timer = t->next;
-		t->next = NULL;
+		avr_cycle_timer_remove(pool, 0);
+		int turn = 0;
 		do {
-			avr_cycle_count_t w = t->timer(avr, when, t->param);
+			avr_cycle_count_t w, late = t.period ? 1 + (avr->cycle - when) / t.period : 1;
+			avr_timer_prof_t * prof = avr->timer_prof;
+			uint64_t start = unlikely(prof) ? avr_prof_now() : 0;
+			if (t.period)	// all the periods it's late for, in one go
+				w = ((avr_cycle_timer_batch_t)(void (*)(void))t.timer)(avr, when,
+						late, t.param);
+			else
+				w = t.timer(avr, when, t.param);
 			// make sure the return value is either zero, or greater
 			// than the last one to prevent infinite loop here
 			when = w > when ? w : 0;
+			if (unlikely(avr->stats)) {
+				avr->stats->timer_fired++;
+				avr->stats->timer_rescheduled += when != 0;
+			}
+			// the callback could have started, or stopped, the profile
+			if (unlikely(prof) && prof == avr->timer_prof) {
+				uint64_t ns = avr_prof_now() - start;
+				avr_timer_prof_entry_t * e = avr_timer_prof_get(prof, t.timer, t.param);
+				if (e) {
+					e->fired++;
+					e->rescheduled += when != 0;
+					e->catchup += (turn > 0) + late - 1;
+					e->host_ns += ns;
+				}
+			}
+			turn++;
 		} while (when && when <= avr->cycle);
 		
 		if (when) // reschedule then
-			avr_cycle_timer_insert(avr, when - avr->cycle, t->timer, t->param);
-		
-		// requeue this one into the free ones
-		QUEUE(pool->timer_free, t);
-	} while (pool->timer);
+			avr_cycle_timer_insert(avr, when - avr->cycle, t.timer, t.param, t.handle, t.period);
+	}
 
 	// original behavior was to return 1000 cycles when no timers were present...
 	// run_cycles are bound to at least one cycle but no more than requested limit...
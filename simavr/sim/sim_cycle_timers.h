@@ -24,9 +24,9 @@
  * these timers are one shots, then get cleared if the timer function returns zero,
  * they get reset if the callback function returns a new cycle number
  *
- * the implementation maintains a list of 'pending' timers, sorted by when they
- * should run, it allows very quick comparison with the next timer to run, and
- * quick removal of then from the pile once dispatched.
+ * the implementation maintains a binary heap of 'pending' timers, ordered by
+ * when they should run, it allows very quick comparison with the next timer to
+ * run, and O(log n) insertion and removal; it grows as needed.
  */
 #ifndef __SIM_CYCLE_TIMERS_H___
 #define __SIM_CYCLE_TIMERS_H___
@@ -37,6 +37,7 @@
 extern "C" {
 #endif
 
+// initial size of the pool, it grows as needed
 #define MAX_CYCLE_TIMERS	64
 
 typedef avr_cycle_count_t (*avr_cycle_timer_t)(
@@ -44,6 +45,17 @@ typedef avr_cycle_count_t (*avr_cycle_timer_t)(
 		avr_cycle_count_t when,
 		void * param);
 
+/*
+ * A timer that runs every 'period' cycles can instead be called once when
+ * it's late, with the 'count' of periods that were due since 'when' (the
+ * first of them), and return the cycle it is due next, as above.
+ */
+typedef avr_cycle_count_t (*avr_cycle_timer_batch_t)(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		avr_cycle_count_t count,
+		void * param);
+
 /*
  * Each timer instance contains the absolute cycle number they
  * are hoping to run at, a function pointer to call and a parameter
@@ -52,25 +64,37 @@ typedef avr_cycle_count_t (*avr_cycle_timer_t)(
  * not divisible and might take 2 or more cycles anyway.
  * 
  * However if there was a LOT of cycle lag, the timer migth be called
- * repeteadly until it 'caches up'.
+ * repeteadly until it 'caches up', unless it's a batch timer.
+ */
+/*
+ * A handle to a timer, for timers that are rescheduled a lot: embed one
+ * in the peripheral state, zeroed, and pass it to the *_handle() calls
+ * below, they don't need to look the timer up, so they are O(1) for
+ * status, and O(log n) for register and cancel.
+ * A timer registered with a handle can still be cancelled or looked up
+ * by (timer, param), just not as quickly.
  */
+typedef struct avr_cycle_timer_handle_t {
+	uint32_t	slot;		// heap index + 1 while pending, 0 otherwise
+} avr_cycle_timer_handle_t;
+
 typedef struct avr_cycle_timer_slot_t {
-	struct avr_cycle_timer_slot_t *next;
 	avr_cycle_count_t	when;
-	avr_cycle_timer_t	timer;
+	uint64_t			seq;	// timers due on the same cycle run in order
+	avr_cycle_timer_t	timer;	// an avr_cycle_timer_batch_t if 'period' is set
 	void * param;
+	avr_cycle_timer_handle_t * handle;	// or NULL
+	avr_cycle_count_t	period;	// of a batch timer, zero otherwise
 } avr_cycle_timer_slot_t, *avr_cycle_timer_slot_p;
 
 /*
- * Timer pool contains a pool of timer slots available, they all
- * start queued into the 'free' qeueue, are migrated to the
- * 'active' queue when needed and are re-queued to the free one
- * when done
+ * Timer pool is a heap of 'count' pending timers, the next one to run
+ * is always in timer[0]; the array is reallocated when it is full.
  */
 typedef struct avr_cycle_timer_pool_t {
-	avr_cycle_timer_slot_t timer_slots[MAX_CYCLE_TIMERS];
-	avr_cycle_timer_slot_p timer_free;
 	avr_cycle_timer_slot_p timer;
+	uint32_t count, size;
+	uint64_t seq;
 } avr_cycle_timer_pool_t, *avr_cycle_timer_pool_p;
 
 
@@ -104,6 +128,55 @@ avr_cycle_timer_status(
 		avr_cycle_timer_t timer,
 		void * param);
 
+// same as the three above, for timers with a handle
+void
+avr_cycle_timer_register_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t * handle,
+		avr_cycle_count_t when,
+		avr_cycle_timer_t timer,
+		void * param);
+void
+avr_cycle_timer_cancel_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t * handle);
+avr_cycle_count_t
+avr_cycle_timer_status_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t * handle);
+/*
+ * Registers a batch timer, due in 'when' cycles then every 'period' cycles,
+ * as long as it returns the next one. It is cancelled, and looked up, with
+ * the handle functions above
+ */
+void
+avr_cycle_timer_register_batch(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t * handle,
+		avr_cycle_count_t when,
+		avr_cycle_count_t period,
+		avr_cycle_timer_batch_t timer,
+		void * param);
+
+/*
+ * Takes the pending timers whose 'param' is in [base, base + size) out of
+ * the pool, into '*saved', reallocated as needed ('*room' slots); their
+ * 'when' is then the number of cycles they had left. Returns how many were
+ * taken, they are put back, as they were, by avr_cycle_timer_resume().
+ */
+uint32_t
+avr_cycle_timer_suspend(
+		struct avr_t * avr,
+		void * base,
+		uint32_t size,
+		avr_cycle_timer_slot_t ** saved,
+		uint32_t * room);
+void
+avr_cycle_timer_resume(
+		struct avr_t * avr,
+		avr_cycle_timer_slot_t * saved,
+		uint32_t count);
+
 //
 // Private, called from the core
 //
@@ -113,6 +186,9 @@ avr_cycle_timer_process(
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr);
+void
+avr_cycle_timer_free(
+		struct avr_t * avr);
 
 #ifdef __cplusplus
 };
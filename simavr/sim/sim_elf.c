@@ -24,6 +24,9 @@
  */
 
 #include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -55,22 +58,14 @@ avr_load_firmware(
 	if (firmware->aref)
 		avr->aref = firmware->aref;
 #if CONFIG_SIMAVR_TRACE && ELF_SYMBOLS
-	int scount = firmware->flashsize >> 1;
-	avr->trace_data->codeline = malloc(scount * sizeof(avr_symbol_t*));
-	memset(avr->trace_data->codeline, 0, scount * sizeof(avr_symbol_t*));
-
-	for (int i = 0; i < firmware->symbolcount; i++)
-		if (firmware->symbol[i]->addr < firmware->flashsize)	// code address
-			avr->trace_data->codeline[firmware->symbol[i]->addr >> 1] =
-				firmware->symbol[i];
-	// "spread" the pointers for known symbols forward
-	avr_symbol_t * last = NULL;
-	for (int i = 0; i < scount; i++) {
-		if (!avr->trace_data->codeline[i])
-			avr->trace_data->codeline[i] = last;
-		else
-			last = avr->trace_data->codeline[i];
-	}
+	elf_firmware_symbols(firmware);
+	// they are sorted, the code addresses come first
+	uint32_t scount = 0;
+	while (scount < firmware->symbolcount &&
+			firmware->symbol[scount]->addr < firmware->flashsize)
+		scount++;
+	avr->trace_data->symbol = firmware->symbol;
+	avr->trace_data->symbolcount = scount;
 #endif
 
 	avr_loadcode(avr, firmware->flash,
@@ -116,7 +111,9 @@ avr_load_firmware(
 			avr->vcd->filename);
 
 	for (int ti = 0; ti < firmware->tracecount; ti++) {
-		if (firmware->trace[ti].kind == AVR_MMCU_TAG_VCD_PORTPIN) {
+		if (firmware->trace[ti].kind == AVR_MMCU_TAG_VCD_SAMPLE) {
+			continue;	// once the signals are all there, below
+		} else if (firmware->trace[ti].kind == AVR_MMCU_TAG_VCD_PORTPIN) {
 			avr_irq_t * irq = avr_io_getirq(avr,
 					AVR_IOCTL_IOPORT_GETIRQ(firmware->trace[ti].mask),
 					firmware->trace[ti].addr);
@@ -180,6 +177,15 @@ avr_load_firmware(
 				}
 		}
 	}
+	for (int ti = 0; ti < firmware->tracecount; ti++) {
+		if (firmware->trace[ti].kind != AVR_MMCU_TAG_VCD_SAMPLE)
+			continue;
+		if (avr_vcd_set_sampling(avr->vcd, firmware->trace[ti].name,
+				firmware->trace[ti].addr, firmware->trace[ti].mask) <= 0)
+			AVR_LOG(avr, LOG_WARNING,
+					"ELF: %s: can't sample trace '%s'\n",
+					__FUNCTION__, firmware->trace[ti].name);
+	}
 	// if the firmware has specified a command register, do NOT start the trace here
 	// the firmware probably knows best when to start/stop it
 	if (!firmware->command_register_addr)
@@ -236,6 +242,7 @@ elf_parse_mmcu_section(
 					}
 			}	break;
 			case AVR_MMCU_TAG_VCD_PORTPIN:
+			case AVR_MMCU_TAG_VCD_SAMPLE:
 			case AVR_MMCU_TAG_VCD_IRQ:
 			case AVR_MMCU_TAG_VCD_TRACE: {
 				uint8_t mask = src[0];
@@ -289,18 +296,661 @@ elf_copy_section(
 	return 0;
 }
 
+/*
+ * The file is mapped rather than read, libelf works on it in place so
+ * only the sections that are copied out are ever paged in.
+ */
+static char *
+elf_map_file(
+		const char * file,
+		size_t * size)
+{
+	struct stat st;
+	char * image = NULL;
+	int fd = open(file, O_RDONLY | O_BINARY);
+
+	if (fd == -1 || fstat(fd, &st) || st.st_size < sizeof(Elf32_Ehdr)) {
+		AVR_LOG(NULL, LOG_ERROR, "could not read %s\n", file);
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+#ifdef __MINGW32__
+	image = malloc(*size);
+	if (image && read(fd, image, *size) != *size) {
+		free(image);
+		image = NULL;
+	}
+#else
+	// private and writable, in case libelf has to swap bytes in place
+	image = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED)
+		image = NULL;
+#endif
+	close(fd);
+	if (!image)
+		AVR_LOG(NULL, LOG_ERROR, "could not map %s\n", file);
+	return image;
+}
+
+static void
+elf_unmap_file(
+		char * image,
+		size_t size)
+{
+#ifdef __MINGW32__
+	free(image);
+#else
+	munmap(image, size);
+#endif
+}
+
+static Elf *
+elf_open_image(
+		char * image,
+		size_t size,
+		size_t * shstrndx)
+{
+	/* this is actually mandatory !! otherwise elf_begin() fails */
+	if (elf_version(EV_CURRENT) == EV_NONE) {
+			/* library out of date - recover from error */
+	}
+	Elf * elf = elf_memory(image, size);
+	if (elf && elf_getshdrstrndx(elf, shstrndx)) {
+		elf_end(elf);
+		elf = NULL;
+	}
+	return elf;
+}
+
+#if ELF_SYMBOLS
+static int
+elf_symbol_wanted(
+		GElf_Sym * sym)
+{
+	return ELF32_ST_BIND(sym->st_info) == STB_GLOBAL ||
+			ELF32_ST_TYPE(sym->st_info) == STT_FUNC ||
+			ELF32_ST_TYPE(sym->st_info) == STT_OBJECT;
+}
+
+static int
+elf_symbol_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_symbol_t * sa = *(const avr_symbol_t **)a;
+	const avr_symbol_t * sb = *(const avr_symbol_t **)b;
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	// same address, the last one in the file comes first, as it always did
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+int
+elf_firmware_symbols(
+		elf_firmware_t * firmware)
+{
+	if (firmware->symbols_read)
+		return 0;
+	if (!firmware->elfname)
+		return -1;
+
+	size_t size, shstrndx;
+	char * image = elf_map_file(firmware->elfname, &size);
+	if (!image)
+		return -1;
+	Elf * elf = elf_open_image(image, size, &shstrndx);
+	Elf_Scn * scn = NULL;
+	int res = elf ? 0 : -1;
+
+	while (elf && (scn = elf_nextscn(elf, scn)) != NULL) {
+		GElf_Shdr shdr;
+		if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != SHT_SYMTAB ||
+				!shdr.sh_entsize)
+			continue;
+		Elf_Data * edata = elf_getdata(scn, NULL);
+		int symbol_count = shdr.sh_size / shdr.sh_entsize;
+
+		// sizes first, so all the symbols go in one block
+		size_t total = 0;
+		uint32_t count = 0;
+		for (int i = 0; i < symbol_count; i++) {
+			GElf_Sym sym;
+			if (!gelf_getsym(edata, i, &sym) || !elf_symbol_wanted(&sym))
+				continue;
+			const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+			if (!name)
+				continue;
+			total += (sizeof(avr_symbol_t) + strlen(name) + 1 + 3) & ~3;
+			count++;
+		}
+		if (!count)
+			continue;
+		uint8_t * block = malloc(total);
+		avr_symbol_t ** symbol = realloc(firmware->symbol,
+				(firmware->symbolcount + count) * sizeof(symbol[0]));
+		if (!block || !symbol) {
+			free(block);
+			if (symbol)
+				firmware->symbol = symbol;
+			res = -1;
+			break;
+		}
+		firmware->symbol = symbol;
+		for (int i = 0; i < symbol_count; i++) {
+			GElf_Sym sym;
+			if (!gelf_getsym(edata, i, &sym) || !elf_symbol_wanted(&sym))
+				continue;
+			const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+			if (!name)
+				continue;
+			avr_symbol_t * s = (avr_symbol_t *)block;
+			s->addr = sym.st_value;
+			s->size = sym.st_size;
+			strcpy((char*)s->symbol, name);
+			block += (sizeof(avr_symbol_t) + strlen(name) + 1 + 3) & ~3;
+			symbol[firmware->symbolcount++] = s;
+		}
+	}
+	if (firmware->symbolcount)
+		qsort(firmware->symbol, firmware->symbolcount,
+				sizeof(firmware->symbol[0]), elf_symbol_cmp);
+	if (elf)
+		elf_end(elf);
+	elf_unmap_file(image, size);
+	firmware->symbols_read = res == 0;
+	return res;
+}
+
+/*
+ * DWARF line table reader, just enough of it for the address of each
+ * source line: the line number program of each unit is run, and its rows
+ * are kept along with the file names, which are merged across units.
+ */
+typedef struct elf_dwarf_t {
+	const uint8_t *	p;
+	const uint8_t *	end;
+	int				offset_size;	// 4, or 8 for 64 bits DWARF
+} elf_dwarf_t;
+
+typedef struct elf_lines_t {
+	elf_firmware_t *	firmware;
+	uint32_t			linesize, filesize;
+	Elf_Data *			line_str;		// .debug_line_str, for DWARF 5
+	Elf_Data *			str;			// .debug_str
+	uint32_t *			unit_file;		// unit file index -> firmware file
+	uint32_t			unit_files;
+	char **				dir;
+	uint32_t			dirs;
+} elf_lines_t;
+
+static uint64_t
+elf_dwarf_fixed(
+		elf_dwarf_t * d,
+		int size)
+{
+	uint64_t v = 0;
+	if (d->end - d->p < size) {
+		d->p = d->end;
+		return 0;
+	}
+	for (int i = 0; i < size; i++)
+		v |= (uint64_t)d->p[i] << (i * 8);
+	d->p += size;
+	return v;
+}
+
+static uint64_t
+elf_dwarf_uleb(
+		elf_dwarf_t * d)
+{
+	uint64_t v = 0;
+	for (int shift = 0; d->p < d->end; shift += 7) {
+		uint8_t b = *d->p++;
+		if (shift < 64)
+			v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			break;
+	}
+	return v;
+}
+
+static int64_t
+elf_dwarf_sleb(
+		elf_dwarf_t * d)
+{
+	int64_t v = 0;
+	int shift = 0;
+	uint8_t b = 0;
+	while (d->p < d->end) {
+		b = *d->p++;
+		if (shift < 64)
+			v |= (int64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80))
+			break;
+	}
+	if (shift < 64 && (b & 0x40))
+		v |= -((int64_t)1 << shift);
+	return v;
+}
+
+static const char *
+elf_dwarf_string(
+		elf_dwarf_t * d)
+{
+	const char * s = (const char *)d->p;
+	const uint8_t * z = memchr(d->p, 0, d->end - d->p);
+	if (!z) {
+		d->p = d->end;
+		return NULL;
+	}
+	d->p = z + 1;
+	return s;
+}
+
+static const char *
+elf_dwarf_strp(
+		elf_dwarf_t * d,
+		Elf_Data * section)
+{
+	uint64_t off = elf_dwarf_fixed(d, d->offset_size);
+	if (!section || off >= section->d_size ||
+			!memchr((char *)section->d_buf + off, 0, section->d_size - off))
+		return NULL;
+	return (const char *)section->d_buf + off;
+}
+
+// returns the index of 'name' in the firmware files, adding it if needed
+static int
+elf_lines_file(
+		elf_lines_t * l,
+		uint64_t dir,
+		const char * name)
+{
+	elf_firmware_t * f = l->firmware;
+	// relative names are in their directory, relative to directory 0
+	const char * part[3] = {
+		dir && l->dirs ? l->dir[0] : NULL,
+		dir < l->dirs ? l->dir[dir] : NULL,
+		name };
+	size_t len = 0;
+	int first = 0;
+
+	if (!name)
+		return -1;
+	for (int i = 0; i < 3; i++)
+		if (part[i] && part[i][0] == '/')
+			first = i;
+	for (int i = first; i < 3; i++)
+		len += part[i] ? strlen(part[i]) + 1 : 0;
+	char * path = malloc(len + 1);
+	if (!path)
+		return -1;
+	path[0] = 0;
+	for (int i = first; i < 3; i++)
+		if (part[i] && part[i][0]) {
+			if (path[0])
+				strcat(path, "/");
+			strcat(path, part[i]);
+		}
+	for (uint32_t i = 0; i < f->filecount; i++)
+		if (!strcmp(f->file[i], path)) {
+			free(path);
+			return i;
+		}
+	if (f->filecount == l->filesize) {
+		uint32_t size = l->filesize ? l->filesize * 2 : 32;
+		char ** n = realloc(f->file, size * sizeof(n[0]));
+		if (!n) {
+			free(path);
+			return -1;
+		}
+		f->file = n;
+		l->filesize = size;
+	}
+	f->file[f->filecount] = path;
+	return f->filecount++;
+}
+
+static int
+elf_lines_add(
+		void ** array,
+		uint32_t * count,
+		uint32_t * size,
+		size_t elsize)
+{
+	if (*count < *size)
+		return 0;
+	uint32_t n = *size ? *size * 2 : 64;
+	void * a = realloc(*array, n * elsize);
+	if (!a)
+		return -1;
+	*array = a;
+	*size = n;
+	return 0;
+}
+
+static void
+elf_lines_row(
+		elf_lines_t * l,
+		uint64_t addr,
+		uint32_t line,
+		uint64_t file)
+{
+	elf_firmware_t * f = l->firmware;
+
+	if (addr >= AVR_SEGMENT_OFFSET_DATA)		// not in flash
+		return;
+	if (line && (file >= l->unit_files || l->unit_file[file] == ~0u))
+		return;
+	if (elf_lines_add((void **)&f->line, &f->linecount, &l->linesize,
+			sizeof(f->line[0])))
+		return;
+	avr_line_t * r = f->line + f->linecount++;
+	r->addr = addr;
+	r->line = line;
+	r->file = line ? l->unit_file[file] : 0;
+}
+
+/*
+ * DWARF 5 directory and file tables, described by their entry formats.
+ * Fills 'dir' or the unit files, returns -1 if a form isn't known
+ */
+static int
+elf_lines_v5_table(
+		elf_lines_t * l,
+		elf_dwarf_t * d,
+		int files)
+{
+	uint8_t format_count = elf_dwarf_fixed(d, 1);
+	uint64_t format[256][2];
+	for (int i = 0; i < format_count; i++) {
+		format[i][0] = elf_dwarf_uleb(d);
+		format[i][1] = elf_dwarf_uleb(d);
+	}
+	uint64_t count = elf_dwarf_uleb(d);
+	for (uint64_t e = 0; e < count && d->p < d->end; e++) {
+		const char * name = NULL;
+		uint64_t dir = 0;
+		for (int i = 0; i < format_count; i++) {
+			uint64_t v = 0;
+			const char * s = NULL;
+			switch (format[i][1]) {
+				case 0x08: s = elf_dwarf_string(d); break;			// string
+				case 0x1f: s = elf_dwarf_strp(d, l->line_str); break;	// line_strp
+				case 0x0e: s = elf_dwarf_strp(d, l->str); break;		// strp
+				case 0x0b: v = elf_dwarf_fixed(d, 1); break;		// data1
+				case 0x05: v = elf_dwarf_fixed(d, 2); break;		// data2
+				case 0x06: v = elf_dwarf_fixed(d, 4); break;		// data4
+				case 0x07: v = elf_dwarf_fixed(d, 8); break;		// data8
+				case 0x0f: v = elf_dwarf_uleb(d); break;			// udata
+				case 0x1e: elf_dwarf_fixed(d, 16); break;			// data16
+				case 0x09:											// block
+					v = elf_dwarf_uleb(d);
+					d->p = v < (uint64_t)(d->end - d->p) ? d->p + v : d->end;
+					break;
+				default:
+					return -1;
+			}
+			if (format[i][0] == 1)			// DW_LNCT_path
+				name = s;
+			else if (format[i][0] == 2)		// DW_LNCT_directory_index
+				dir = v;
+		}
+		if (!files) {
+			char ** n = realloc(l->dir, (l->dirs + 1) * sizeof(n[0]));
+			if (!n)
+				return -1;
+			l->dir = n;
+			l->dir[l->dirs++] = (char *)name;
+		} else {
+			uint32_t * n = realloc(l->unit_file, (l->unit_files + 1) * sizeof(n[0]));
+			if (!n)
+				return -1;
+			l->unit_file = n;
+			int fi = elf_lines_file(l, dir, name);
+			l->unit_file[l->unit_files++] = fi < 0 ? ~0u : fi;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The DWARF 2 to 4 tables, include directories, then file names, each
+ * ending with an empty string
+ */
+static void
+elf_lines_v4_table(
+		elf_lines_t * l,
+		elf_dwarf_t * d)
+{
+	const char * s;
+	while ((s = elf_dwarf_string(d)) && *s) {
+		char ** n = realloc(l->dir, (l->dirs + 2) * sizeof(n[0]));
+		if (!n)
+			return;
+		l->dir = n;
+		if (!l->dirs)
+			l->dir[l->dirs++] = NULL;	// 0 is the compilation directory
+		l->dir[l->dirs++] = (char *)s;
+	}
+	// file 0 isn't used before DWARF 5
+	uint32_t * n = realloc(l->unit_file, sizeof(n[0]));
+	if (!n)
+		return;
+	l->unit_file = n;
+	l->unit_file[l->unit_files++] = ~0u;
+	while ((s = elf_dwarf_string(d)) && *s) {
+		uint64_t dir = elf_dwarf_uleb(d);
+		elf_dwarf_uleb(d);		// mtime
+		elf_dwarf_uleb(d);		// size
+		n = realloc(l->unit_file, (l->unit_files + 1) * sizeof(n[0]));
+		if (!n)
+			return;
+		l->unit_file = n;
+		int fi = elf_lines_file(l, dir, s);
+		l->unit_file[l->unit_files++] = fi < 0 ? ~0u : fi;
+	}
+}
+
+// runs the line number program of one unit, 'd' covers just that unit
+static int
+elf_lines_unit(
+		elf_lines_t * l,
+		elf_dwarf_t * d)
+{
+	uint16_t version = elf_dwarf_fixed(d, 2);
+	if (version < 2 || version > 5)
+		return -1;
+	if (version >= 5)
+		elf_dwarf_fixed(d, 2);		// address and segment selector sizes
+	uint64_t header_length = elf_dwarf_fixed(d, d->offset_size);
+	if (header_length > (uint64_t)(d->end - d->p))
+		return -1;
+	elf_dwarf_t program = { .p = d->p + header_length, .end = d->end,
+			.offset_size = d->offset_size };
+	uint8_t min_inst = elf_dwarf_fixed(d, 1);
+	if (version >= 4)
+		elf_dwarf_fixed(d, 1);		// max ops per instruction, VLIW only
+	elf_dwarf_fixed(d, 1);			// default is_stmt
+	int8_t line_base = elf_dwarf_fixed(d, 1);
+	uint8_t line_range = elf_dwarf_fixed(d, 1);
+	uint8_t opcode_base = elf_dwarf_fixed(d, 1);
+	if (!line_range || !opcode_base)
+		return -1;
+	const uint8_t * lengths = d->p;
+	d->p += opcode_base - 1;
+	if (d->p > d->end)
+		return -1;
+
+	l->unit_files = 0;
+	l->dirs = 0;
+	if (version >= 5) {
+		if (elf_lines_v5_table(l, d, 0) || elf_lines_v5_table(l, d, 1))
+			return -1;
+	} else
+		elf_lines_v4_table(l, d);
+
+	*d = program;
+	uint64_t addr = 0, file = 1;
+	int64_t line = 1;
+	while (d->p < d->end) {
+		uint8_t op = *d->p++;
+		if (op >= opcode_base) {	// special opcode, adds a row
+			op -= opcode_base;
+			addr += (op / line_range) * min_inst;
+			line += line_base + (op % line_range);
+			elf_lines_row(l, addr, line, file);
+			continue;
+		}
+		switch (op) {
+			case 0: {		// extended opcode
+				uint64_t len = elf_dwarf_uleb(d);
+				if (!len || len > (uint64_t)(d->end - d->p))
+					return -1;
+				const uint8_t * next = d->p + len;
+				switch (*d->p++) {
+					case 1:		// DW_LNE_end_sequence
+						elf_lines_row(l, addr, 0, 0);
+						addr = 0; file = 1; line = 1;
+						break;
+					case 2:		// DW_LNE_set_address
+						addr = elf_dwarf_fixed(d, len - 1);
+						break;
+				}
+				d->p = next;
+			}	break;
+			case 1:			// DW_LNS_copy
+				elf_lines_row(l, addr, line, file);
+				break;
+			case 2:			// DW_LNS_advance_pc
+				addr += elf_dwarf_uleb(d) * min_inst;
+				break;
+			case 3:			// DW_LNS_advance_line
+				line += elf_dwarf_sleb(d);
+				break;
+			case 4:			// DW_LNS_set_file
+				file = elf_dwarf_uleb(d);
+				break;
+			case 8:			// DW_LNS_const_add_pc
+				addr += ((255 - opcode_base) / line_range) * min_inst;
+				break;
+			case 9:			// DW_LNS_fixed_advance_pc
+				addr += elf_dwarf_fixed(d, 2);
+				break;
+			default:		// skips the operands of the others
+				for (int i = 0; i < lengths[op - 1]; i++)
+					elf_dwarf_uleb(d);
+				break;
+		}
+	}
+	return 0;
+}
+
+static int
+elf_line_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_line_t * la = a;
+	const avr_line_t * lb = b;
+	if (la->addr != lb->addr)
+		return la->addr < lb->addr ? -1 : 1;
+	// the end of a sequence goes before what starts at the same address
+	if (!la->line != !lb->line)
+		return la->line ? 1 : -1;
+	return 0;
+}
+
+int
+elf_firmware_lines(
+		elf_firmware_t * firmware)
+{
+	if (firmware->lines_read)
+		return 0;
+	if (!firmware->elfname)
+		return -1;
+
+	size_t size, shstrndx;
+	char * image = elf_map_file(firmware->elfname, &size);
+	if (!image)
+		return -1;
+	Elf * elf = elf_open_image(image, size, &shstrndx);
+	Elf_Scn * scn = NULL;
+	Elf_Data * debug_line = NULL;
+	elf_lines_t l = { .firmware = firmware };
+	int res = elf ? 0 : -1;
+
+	while (elf && (scn = elf_nextscn(elf, scn)) != NULL) {
+		GElf_Shdr shdr;
+		if (!gelf_getshdr(scn, &shdr))
+			continue;
+		char * name = elf_strptr(elf, shstrndx, shdr.sh_name);
+		if (!name)
+			continue;
+		if (!strcmp(name, ".debug_line"))
+			debug_line = elf_getdata(scn, NULL);
+		else if (!strcmp(name, ".debug_line_str"))
+			l.line_str = elf_getdata(scn, NULL);
+		else if (!strcmp(name, ".debug_str"))
+			l.str = elf_getdata(scn, NULL);
+	}
+	if (elf && !debug_line) {
+		AVR_LOG(NULL, LOG_WARNING, "%s: no line table, build with -g\n",
+				firmware->elfname);
+		res = -1;
+	}
+	elf_dwarf_t d = { 0 };
+	if (debug_line) {
+		d.p = debug_line->d_buf;
+		d.end = d.p + debug_line->d_size;
+	}
+	while (!res && d.p < d.end) {
+		elf_dwarf_t unit = { .offset_size = 4 };
+		uint64_t length = elf_dwarf_fixed(&d, 4);
+		if (length == 0xffffffff) {
+			length = elf_dwarf_fixed(&d, 8);
+			unit.offset_size = 8;
+		}
+		if (!length || length > (uint64_t)(d.end - d.p))
+			break;
+		unit.p = d.p;
+		unit.end = d.p + length;
+		d.p = unit.end;
+		if (elf_lines_unit(&l, &unit))
+			AVR_LOG(NULL, LOG_WARNING, "%s: skipped a line table unit\n",
+					firmware->elfname);
+	}
+	free(l.unit_file);
+	free(l.dir);
+	if (firmware->linecount)
+		qsort(firmware->line, firmware->linecount,
+				sizeof(firmware->line[0]), elf_line_cmp);
+	if (elf)
+		elf_end(elf);
+	elf_unmap_file(image, size);
+	firmware->lines_read = res == 0;
+	return res;
+}
+#endif
 
 int elf_read_firmware(const char * file, elf_firmware_t * firmware)
 {
-	Elf32_Ehdr elf_header;			/* ELF header */
 	Elf *elf = NULL;                       /* Our Elf pointer for libelf */
-	int fd; // File Descriptor
+	size_t size, shstrndx;
 
-	if ((fd = open(file, O_RDONLY | O_BINARY)) == -1 ||
-			(read(fd, &elf_header, sizeof(elf_header))) < sizeof(elf_header)) {
-		AVR_LOG(NULL, LOG_ERROR, "could not read %s\n", file);
+	memset(firmware, 0, sizeof(*firmware));
+	char * image = elf_map_file(file, &size);
+	if (!image) {
 		perror(file);
-		close(fd);
+		return -1;
+	}
+	elf = elf_open_image(image, size, &shstrndx);
+	if (!elf) {
+		AVR_LOG(NULL, LOG_ERROR, "%s is not an ELF file\n", file);
+		elf_unmap_file(image, size);
 		return -1;
 	}
 
@@ -309,27 +959,16 @@ int elf_read_firmware(const char * file, elf_firmware_t * firmware)
 		*data_ee = NULL;                /* Data Descriptor */
 	Elf_Data *data_fuse = NULL;
 	Elf_Data *data_lockbits = NULL;
-
-	memset(firmware, 0, sizeof(*firmware));
-#if ELF_SYMBOLS
-	firmware->symbolcount = 0;
-	firmware->symbol = NULL;
-#endif
-
-	/* this is actually mandatory !! otherwise elf_begin() fails */
-	if (elf_version(EV_CURRENT) == EV_NONE) {
-			/* library out of date - recover from error */
-	}
-	// Iterate through section headers again this time well stop when we find symbols
-	elf = elf_begin(fd, ELF_C_READ, NULL);
-	//printf("Loading elf %s : %p\n", file, elf);
-
 	Elf_Scn *scn = NULL;                   /* Section Descriptor */
+	int res = 0;
 
 	while ((scn = elf_nextscn(elf, scn)) != NULL) {
 		GElf_Shdr shdr;                 /* Section Header */
-		gelf_getshdr(scn, &shdr);
-		char * name = elf_strptr(elf, elf_header.e_shstrndx, shdr.sh_name);
+		if (!gelf_getshdr(scn, &shdr))
+			continue;
+		char * name = elf_strptr(elf, shstrndx, shdr.sh_name);
+		if (!name)
+			continue;
 	//	printf("Walking elf section '%s'\n", name);
 
 		if (!strcmp(name, ".text"))
@@ -344,60 +983,32 @@ int elf_read_firmware(const char * file, elf_firmware_t * firmware)
 			data_lockbits = elf_getdata(scn, NULL);
 		else if (!strcmp(name, ".bss")) {
 			Elf_Data *s = elf_getdata(scn, NULL);
-			firmware->bsssize = s->d_size;
+			if (s)
+				firmware->bsssize = s->d_size;
 		} else if (!strcmp(name, ".mmcu")) {
 			Elf_Data *s = elf_getdata(scn, NULL);
-			elf_parse_mmcu_section(firmware, s->d_buf, s->d_size);
+			if (s)
+				elf_parse_mmcu_section(firmware, s->d_buf, s->d_size);
 			//printf("%s: avr_mcu_t size %ld / read %ld\n", __FUNCTION__, sizeof(struct avr_mcu_t), s->d_size);
 		//	avr->frequency = f_cpu;
 		}
 #if ELF_SYMBOLS
-		// When we find a section header marked SHT_SYMTAB stop and get symbols
-		if (shdr.sh_type == SHT_SYMTAB) {
-			// edata points to our symbol table
+		/*
+		 * The symbols are only read if someone asks, with
+		 * elf_firmware_symbols(); all that's needed now is the entry
+		 * point of a bootloader.
+		 */
+		if (shdr.sh_type == SHT_SYMTAB && shdr.sh_entsize) {
 			Elf_Data *edata = elf_getdata(scn, NULL);
-
-			// how many symbols are there? this number comes from the size of
-			// the section divided by the entry size
 			int symbol_count = shdr.sh_size / shdr.sh_entsize;
 
-			// loop through to grab all symbols
-			for (int i = 0; i < symbol_count; i++) {
+			for (int i = 0; edata && i < symbol_count; i++) {
 				GElf_Sym sym;			/* Symbol */
-				// libelf grabs the symbol data using gelf_getsym()
-				gelf_getsym(edata, i, &sym);
-
-				// print out the value and size
-				if (ELF32_ST_BIND(sym.st_info) == STB_GLOBAL ||
-						ELF32_ST_TYPE(sym.st_info) == STT_FUNC ||
-						ELF32_ST_TYPE(sym.st_info) == STT_OBJECT) {
-					const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
-
-					// if its a bootloader, this symbol will be the entry point we need
-					if (!strcmp(name, "__vectors"))
-						firmware->flashbase = sym.st_value;
-					avr_symbol_t * s = malloc(sizeof(avr_symbol_t) + strlen(name) + 1);
-					strcpy((char*)s->symbol, name);
-					s->addr = sym.st_value;
-					if (!(firmware->symbolcount % 8))
-						firmware->symbol = realloc(
-							firmware->symbol,
-							(firmware->symbolcount + 8) * sizeof(firmware->symbol[0]));
-
-					// insert new element, keep the array sorted
-					int insert = -1;
-					for (int si = 0; si < firmware->symbolcount && insert == -1; si++)
-						if (firmware->symbol[si]->addr >= s->addr)
-							insert = si;
-					if (insert == -1)
-						insert = firmware->symbolcount;
-					else
-						memmove(firmware->symbol + insert + 1,
-								firmware->symbol + insert,
-								(firmware->symbolcount - insert) * sizeof(firmware->symbol[0]));
-					firmware->symbol[insert] = s;
-					firmware->symbolcount++;
-				}
+				if (!gelf_getsym(edata, i, &sym) || !elf_symbol_wanted(&sym))
+					continue;
+				const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+				if (name && !strcmp(name, "__vectors"))
+					firmware->flashbase = sym.st_value;
 			}
 		}
 #endif
@@ -425,21 +1036,23 @@ int elf_read_firmware(const char * file, elf_firmware_t * firmware)
 	}
 	if (data_ee) {
 		if (elf_copy_section(".eeprom", data_ee, &firmware->eeprom))
-			return -1;
+			res = -1;
 		firmware->eesize = data_ee->d_size;
 	}
-	if (data_fuse) {
+	if (data_fuse && !res) {
 		if (elf_copy_section(".fuse", data_fuse, &firmware->fuse))
-			return -1;
+			res = -1;
         firmware->fusesize = data_fuse->d_size;
 	}
-	if (data_lockbits) {
-		if (elf_copy_section(".lock", data_fuse, &firmware->lockbits))
-			return -1;
+	if (data_lockbits && !res) {
+		if (elf_copy_section(".lock", data_lockbits, &firmware->lockbits))
+			res = -1;
 	}
 //	hdump("flash", avr->flash, offset);
 	elf_end(elf);
-	close(fd);
-	return 0;
+	elf_unmap_file(image, size);
+#if ELF_SYMBOLS
+	firmware->elfname = strdup(file);
+#endif
+	return res;
 }
-
@@ -36,6 +36,7 @@ extern "C" {
  * "fake" a non-Harvard addressing space for the AVR
  */
 #define AVR_SEGMENT_OFFSET_FLASH 0
+#define AVR_SEGMENT_OFFSET_DATA 0x00800000
 #define AVR_SEGMENT_OFFSET_EEPROM 0x00810000
 
 #include "sim_avr.h"
@@ -75,14 +76,36 @@ typedef struct elf_firmware_t {
 	uint8_t *	fuse;
 	uint32_t	fusesize;
 	uint8_t *	lockbits;
+	const void *	cache;	// the entry it was loaded from, see sim_fwcache.h
 
 #if ELF_SYMBOLS
+	// empty until elf_firmware_symbols() is called
 	avr_symbol_t **  symbol;
 	uint32_t		symbolcount;
+	int				symbols_read;
+	char *			elfname;	// the file they are read from
+	// empty until elf_firmware_lines() is called
+	avr_line_t *	line;
+	uint32_t		linecount;
+	char **			file;		// source file names, 'line' indexes them
+	uint32_t		filecount;
+	int				lines_read;
 #endif
 } elf_firmware_t ;
 
 int elf_read_firmware(const char * file, elf_firmware_t * firmware);
+#if ELF_SYMBOLS
+/*
+ * Reads the symbol table of the firmware, sorted by address, the first
+ * time it's called; the file has to still be there. Returns 0, or -1.
+ */
+int elf_firmware_symbols(elf_firmware_t * firmware);
+/*
+ * Same for the DWARF line table (.debug_line, versions 2 to 5), the
+ * address each source line starts at.
+ */
+int elf_firmware_lines(elf_firmware_t * firmware);
+#endif
 
 void avr_load_firmware(avr_t * avr, elf_firmware_t * firmware);
 
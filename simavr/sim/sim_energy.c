@@ -0,0 +1,309 @@
+/*
+	sim_energy.c
+
+	Time spent per core state and per peripheral state, and the energy
+	that costs, from a table of currents.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "sim_energy.h"
+#include "sim_io.h"
+#include "sim_regbit.h"
+#include "sim_cycle_timers.h"
+#include "sim_time.h"
+#include "avr_eeprom.h"
+
+static const char * _avr_energy_mode_name[8] = {
+	"idle", "adc_noise", "power_down", "power_save",
+	"mode4", "mode5", "standby", "ext_standby",
+};
+
+static int
+_avr_energy_mode(
+		avr_t * avr)
+{
+	int mode = 0;
+
+	for (int i = 0; i < 3; i++)
+		if (avr->sleep_mode[i].reg)
+			mode |= avr_regbit_get(avr, avr->sleep_mode[i]) << i;
+	return mode;
+}
+
+static void
+_avr_energy_account(
+		avr_energy_t * e)
+{
+	avr_t * avr = e->avr;
+	avr_cycle_count_t c = avr->cycle - e->last;
+	avr_cycle_count_t s = avr->sleep_cycles - e->last_sleep;
+
+	if (s > c)
+		s = c;
+	e->active += c - s;
+	e->sleep[_avr_energy_mode(avr)] += s;
+	for (int i = 0; i < e->io_count; i++) {
+		avr_energy_io_t * io = &e->io[i];
+		if (avr_io_gated(io->io))
+			io->gated += c;
+		else {
+			io->active += c - s;
+			io->idle += s;
+		}
+		io->events = io->io->events - io->start;
+	}
+	e->frequency = avr->frequency;
+	e->last = avr->cycle;
+	e->last_sleep = avr->sleep_cycles;
+}
+
+static avr_cycle_count_t
+_avr_energy_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_energy_t * e = param;
+
+	_avr_energy_account(e);
+	return when + e->period;
+}
+
+int
+avr_energy_init(
+		avr_t * avr,
+		avr_energy_t * e,
+		avr_cycle_count_t period)
+{
+	if (avr->energy) {
+		AVR_LOG(avr, LOG_ERROR, "ENERGY: already counting\n");
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->avr = avr;
+	e->period = period ? period : avr_usec_to_cycles(avr, 1000);
+	if (!e->period)
+		e->period = 1;
+	e->start = e->last = avr->cycle;
+	e->last_sleep = avr->sleep_cycles;
+	// the list is last registered first, the names go in the core's order
+	for (avr_io_t * io = avr->io_port; io && e->io_count < AVR_ENERGY_IO_MAX;
+			io = io->next)
+		e->io[e->io_count++].io = io;
+	for (int i = 0; i < e->io_count / 2; i++) {
+		avr_energy_io_t t = e->io[i];
+		e->io[i] = e->io[e->io_count - 1 - i];
+		e->io[e->io_count - 1 - i] = t;
+	}
+	for (int i = 0; i < e->io_count; i++) {
+		avr_energy_io_t * io = &e->io[i];
+		io->kind = io->io->kind ? io->io->kind : "io";
+		io->gate = io->io->gate != NULL;
+		io->start = io->io->events;
+		int index = 0, count = 0;
+		for (int j = 0; j < e->io_count; j++) {
+			const char * k = e->io[j].io->kind ? e->io[j].io->kind : "io";
+			if (strcmp(k, io->kind))
+				continue;
+			index += j < i;
+			count++;
+		}
+		if (count > 1)
+			snprintf(io->name, sizeof(io->name), "%s%d", io->kind, index);
+		else
+			snprintf(io->name, sizeof(io->name), "%s", io->kind);
+	}
+	e->frequency = avr->frequency;
+	avr->energy = e;
+	avr_cycle_timer_register(avr, e->period, _avr_energy_timer, e);
+	return 0;
+}
+
+int
+avr_energy_load(
+		avr_energy_t * e,
+		const char * filename)
+{
+	FILE * f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	char line[256];
+	int lineno = 0, res = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char * c = strchr(line, '#');
+		if (c)
+			*c = 0;
+		char name[32], more;
+		double value;
+		int n = sscanf(line, "%31s %lf %c", name, &value, &more);
+		if (n <= 0)
+			continue;
+		if (n != 2 || value < 0) {
+			AVR_LOG(e->avr, LOG_ERROR, "ENERGY: %s:%d: expected <name> <value>\n",
+					filename, lineno);
+			res = -1;
+			break;
+		}
+		int i;
+		for (i = 0; i < e->table_count && strcmp(e->table[i].name, name); i++)
+			;
+		if (i == AVR_ENERGY_TABLE_MAX) {
+			AVR_LOG(e->avr, LOG_ERROR, "ENERGY: %s: too many entries\n", filename);
+			res = -1;
+			break;
+		}
+		if (i == e->table_count)
+			e->table_count++;
+		strcpy(e->table[i].name, name);
+		e->table[i].value = value;
+	}
+	fclose(f);
+	return res;
+}
+
+void
+avr_energy_stop(
+		avr_energy_t * e)
+{
+	avr_t * avr = e->avr;
+
+	if (!avr)
+		return;
+	_avr_energy_account(e);
+	avr_cycle_timer_cancel(avr, _avr_energy_timer, e);
+	avr->energy = NULL;
+	e->avr = NULL;
+}
+
+// 'name', or 'name.what' if 'what', from the table, 0 if it's not there
+static double
+_avr_energy_value(
+		avr_energy_t * e,
+		const char * name,
+		const char * what)
+{
+	char key[48];
+
+	if (what)
+		snprintf(key, sizeof(key), "%s.%s", name, what);
+	else
+		snprintf(key, sizeof(key), "%s", name);
+	for (int i = 0; i < e->table_count; i++)
+		if (!strcmp(e->table[i].name, key))
+			return e->table[i].value;
+	return 0;
+}
+
+// for a module, its own entry, or that of its kind
+static double
+_avr_energy_io_value(
+		avr_energy_t * e,
+		avr_energy_io_t * io,
+		const char * what)
+{
+	char key[48];
+
+	snprintf(key, sizeof(key), "%s.%s", io->name, what);
+	for (int i = 0; i < e->table_count; i++)
+		if (!strcmp(e->table[i].name, key))
+			return e->table[i].value;
+	return _avr_energy_value(e, io->kind, what);
+}
+
+void
+avr_energy_report(
+		avr_energy_t * e,
+		FILE * out)
+{
+	if (e->avr)
+		_avr_energy_account(e);
+	avr_cycle_count_t total = e->last - e->start;
+	double freq = e->frequency;
+	double pc = total ? 100.0 / total : 0;
+
+	fprintf(out, "energy: %" PRI_avr_cycle_count " cycles, active %.1f%%",
+			total, e->active * pc);
+	for (int m = 0; m < 8; m++)
+		if (e->sleep[m])
+			fprintf(out, ", %s %.1f%%", _avr_energy_mode_name[m],
+					e->sleep[m] * pc);
+	fprintf(out, "\n");
+	for (int i = 0; i < e->io_count; i++) {
+		avr_energy_io_t * io = &e->io[i];
+		if (!io->gate && !io->events)
+			continue;
+		fprintf(out, "  %-10s active %5.1f%% idle %5.1f%% gated %5.1f%% "
+				"events %" PRIu64 "\n", io->name, io->active * pc,
+				io->idle * pc, io->gated * pc, io->events);
+	}
+
+	double volt = _avr_energy_value(e, "voltage", NULL);
+	if (!e->table_count || !freq)
+		return;
+	if (!volt) {
+		fprintf(out, "energy: the table has no voltage\n");
+		return;
+	}
+	// mA by seconds is mC, by volts mJ
+	double sec = total / freq;
+	double core = _avr_energy_value(e, "active", NULL) * e->active / freq;
+	for (int m = 0; m < 8; m++)
+		core += _avr_energy_value(e, _avr_energy_mode_name[m], NULL) *
+				e->sleep[m] / freq;
+	core *= volt;
+	double sum = core;
+	fprintf(out, "  %-10s %10.3f mJ\n", "core", core);
+	for (int i = 0; i < e->io_count; i++) {
+		avr_energy_io_t * io = &e->io[i];
+		double mj = volt * (
+				_avr_energy_io_value(e, io, "active") * io->active +
+				_avr_energy_io_value(e, io, "idle") * io->idle +
+				_avr_energy_io_value(e, io, "gated") * io->gated) / freq;
+		mj += _avr_energy_io_value(e, io, "event") * io->events / 1000.0;
+		if (!strcmp(io->kind, "eeprom"))
+			mj += volt * _avr_energy_io_value(e, io, "program") *
+					io->events * AVR_EEPROM_WRITE_USEC / 1e6;
+		if (mj == 0)
+			continue;
+		fprintf(out, "  %-10s %10.3f mJ\n", io->name, mj);
+		sum += mj;
+	}
+	double ma = sec > 0 ? sum / volt / sec : 0;
+	fprintf(out, "energy: %.3f mJ in %.3f s at %.2f V, %.4f mA on average",
+			sum, sec, volt, ma);
+	double battery = _avr_energy_value(e, "battery", NULL);
+	if (battery && ma > 0)
+		fprintf(out, ", %.1f hours on %.0f mAh", battery / ma, battery);
+	fprintf(out, "\n");
+}
+
+void
+avr_energy_reset(
+		avr_t * avr)
+{
+	avr_energy_t * e = avr->energy;
+
+	if (!e)
+		return;
+	_avr_energy_account(e);
+	avr_cycle_timer_register(avr, e->period, _avr_energy_timer, e);
+}
@@ -0,0 +1,127 @@
+/*
+	sim_energy.h
+
+	Time spent per core state and per peripheral state, and the energy
+	that costs, from a table of currents.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SIM_ENERGY_H__
+#define __SIM_ENERGY_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every 'period' cycles, a cycle timer splits the cycles since the last
+ * one: for the core, awake or asleep in the mode its SM bits select, from
+ * the exact avr->sleep_cycles count; for each IO module, clocked while the
+ * core is awake (active), clocked while it sleeps (idle), or stopped by
+ * its PRR bit (gated). A sleep mode changed in the middle of a period goes
+ * to the one it was at the end; a millisecond is plenty for a battery.
+ * The modules also count their events (see avr_io_t): bytes moved by the
+ * UARTs, SPI and TWI, ADC conversions started, EEPROM writes.
+ *
+ * The energy is worked out from a table, a text file of 'name value' lines
+ * ('#' starts a comment):
+ *	voltage <V>
+ *	active <mA>					the core, awake
+ *	idle, adc_noise, power_down, power_save, standby, ext_standby <mA>
+ *								the core, in that sleep mode
+ *	<module>.active <mA>		a module, clocked, with the core awake
+ *	<module>.idle <mA>			... with the core asleep
+ *	<module>.gated <mA>			... stopped by its PRR bit
+ *	<module>.event <uJ>			each of its events
+ *	eeprom.program <mA>			while a write programs, for 3.4 ms
+ *	battery <mAh>				to give how long it'd last
+ * A <module> is a kind, like "uart", for all of them, or one of them, in
+ * the order the core registers them, like "timer2"; the latter wins.
+ * Anything not in the table draws nothing.
+ */
+#define AVR_ENERGY_IO_MAX		32
+#define AVR_ENERGY_TABLE_MAX	128
+
+typedef struct avr_energy_io_t {
+	struct avr_io_t *	io;
+	const char *		kind;
+	char				name[16];	// kind, and its index if there are several
+	int					gate;		// it has a PRR bit
+	avr_cycle_count_t	active, idle, gated;
+	uint64_t			start;		// io->events when counting started
+	uint64_t			events;		// since then
+} avr_energy_io_t;
+
+typedef struct avr_energy_entry_t {
+	char				name[32];
+	double				value;
+} avr_energy_entry_t;
+
+typedef struct avr_energy_t {
+	struct avr_t *		avr;
+	uint32_t			frequency;
+	avr_cycle_count_t	period;
+	avr_cycle_count_t	start, last, last_sleep;
+	avr_cycle_count_t	active;
+	avr_cycle_count_t	sleep[8];	// per value of the SM bits
+	int					io_count;
+	avr_energy_io_t		io[AVR_ENERGY_IO_MAX];
+	int					table_count;
+	avr_energy_entry_t	table[AVR_ENERGY_TABLE_MAX];
+} avr_energy_t;
+
+/*
+ * Starts counting, every 'period' cycles, or every millisecond if zero.
+ * Returns zero if all is well
+ */
+int
+avr_energy_init(
+		struct avr_t * avr,
+		avr_energy_t * e,
+		avr_cycle_count_t period );
+/*
+ * Adds the currents in 'filename' to the table.
+ * Returns zero if all is well, -1 if it can't be read or makes no sense
+ */
+int
+avr_energy_load(
+		avr_energy_t * e,
+		const char * filename );
+// stops counting, up to the current cycle
+void
+avr_energy_stop(
+		avr_energy_t * e );
+// the times and events, and the energy if there's a table
+void
+avr_energy_report(
+		avr_energy_t * e,
+		FILE * out );
+
+// called by avr_reset(), to schedule the timer again
+void
+avr_energy_reset(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_ENERGY_H__ */
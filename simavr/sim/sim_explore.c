@@ -0,0 +1,419 @@
+/*
+	sim_explore.c
+
+	Explores the bytes a firmware takes on a UART, from snapshots of its
+	decision points, on a set of worker threads.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim_explore.h"
+#include "avr_uart.h"
+
+static uint64_t
+_avr_explore_now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * The UART's pull source: the byte being tried, once. Asked again, the
+ * fifo (1 byte deep) is empty, the firmware read it
+ */
+static int
+_avr_explore_pull(
+		void * param,
+		uint8_t * buf,
+		int size)
+{
+	avr_explore_worker_t * w = param;
+
+	if (!w->fed) {
+		w->fed = 1;
+		buf[0] = w->byte;
+		return 1;
+	}
+	if (!w->consumed) {
+		w->consumed = 1;
+		w->consumed_at = w->avr->cycle;
+	}
+	return 0;
+}
+
+/*
+ * Gives 'byte' (none for the root) and runs to the next decision point.
+ * Returns AVR_EXPLORE_*
+ */
+static int
+_avr_explore_step(
+		avr_explore_worker_t * w,
+		int byte)
+{
+	avr_explore_t * x = w->x;
+	avr_t * avr = w->avr;
+	avr_cycle_count_t start = avr->cycle;
+
+	w->byte = byte;
+	w->fed = w->consumed = byte < 0;
+	w->consumed_at = start;
+	if (byte >= 0) {
+		// the receiver might be waiting already, the source isn't asked again
+		avr_uart_source_t src = { .pull = _avr_explore_pull, .param = w };
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_SOURCE(x->uart), &src);
+	}
+	for (;;) {
+		avr_cycle_count_t end = w->consumed_at + x->gap;
+		if (avr->cycle >= end)
+			break;
+		int state = avr_run_cycles(avr, end - avr->cycle);
+		if (state == cpu_Stopped) {		// got to 'stop'
+			avr->state = cpu_Running;
+			if (w->consumed)
+				break;
+		} else if (state == cpu_Done)
+			return AVR_EXPLORE_DONE;
+		else if (state == cpu_Crashed)
+			return AVR_EXPLORE_CRASHED;
+	}
+	w->cycles += avr->cycle - start;
+	return w->consumed ? AVR_EXPLORE_DECISION : AVR_EXPLORE_IGNORED;
+}
+
+// brings the worker's instance to decision point 'n'. Returns 0, or -1
+static int
+_avr_explore_goto(
+		avr_explore_worker_t * w,
+		uint32_t n)
+{
+	avr_explore_t * x = w->x;
+	avr_t * avr = w->avr;
+
+	if (!n)
+		return avr_snapshot_restore(avr, w->root);
+	if (w->node == n)
+		return avr_snapshot_restore(avr, w->snap);
+	// the runs are deterministic, the same bytes get there again
+	pthread_mutex_lock(&x->lock);
+	uint32_t len = avr_explore_path(x, n, w->path);
+	pthread_mutex_unlock(&x->lock);
+	if (avr_snapshot_restore(avr, w->root))
+		return -1;
+	for (uint32_t i = 0; i < len; i++)
+		if (_avr_explore_step(w, w->path[i]) != AVR_EXPLORE_DECISION) {
+			AVR_LOG(avr, LOG_ERROR,
+					"EXPLORE: node %u isn't where it was, byte %u of %u\n",
+					n, i, len);
+			return -1;
+		}
+	w->replays++;
+	if (w->snap)
+		avr_snapshot_free(w->snap);
+	w->snap = avr_snapshot_save(avr);
+	w->node = w->snap ? n : 0;
+	return w->snap ? 0 : -1;
+}
+
+// the edges of the last run that no run took before; with the lock held
+static uint32_t
+_avr_explore_merge(
+		avr_explore_worker_t * w)
+{
+	avr_explore_t * x = w->x;
+	uint32_t edges = 0;
+	const uint64_t * m = (const uint64_t *)w->cov.map;
+	uint64_t * v = (uint64_t *)x->virgin;
+
+	for (uint32_t i = 0; i < AVR_EXPLORE_MAP_SIZE / 8; i++) {
+		if (!(m[i] & ~v[i]))
+			continue;
+		for (int b = i * 8; b < (i + 1) * 8; b++)
+			if (w->cov.map[b] && !x->virgin[b]) {
+				x->virgin[b] = 0xff;
+				edges++;
+			}
+	}
+	x->edges += edges;
+	return edges;
+}
+
+// hands out the next run, node and byte; returns 0 when there are none left
+static int
+_avr_explore_next(
+		avr_explore_t * x,
+		uint32_t * n,
+		uint8_t * byte)
+{
+	pthread_mutex_lock(&x->lock);
+	for (;;) {
+		if (x->max_runs && x->runs >= x->max_runs)
+			break;
+		if (x->next_node < x->node_count) {
+			*n = x->next_node;
+			*byte = x->alphabet ? x->alphabet[x->next_byte] : x->next_byte;
+			if (++x->next_byte == x->alphabet_len) {
+				x->next_byte = 0;
+				x->next_node++;
+			}
+			x->runs++;
+			x->running++;
+			pthread_mutex_unlock(&x->lock);
+			return 1;
+		}
+		// the ones still running might find more branches
+		if (!x->running)
+			break;
+		pthread_cond_wait(&x->cond, &x->lock);
+	}
+	pthread_cond_broadcast(&x->cond);
+	pthread_mutex_unlock(&x->lock);
+	return 0;
+}
+
+static void *
+_avr_explore_thread(
+		void * param)
+{
+	avr_explore_worker_t * w = param;
+	avr_explore_t * x = w->x;
+	uint32_t n;
+	uint8_t byte;
+
+	while (_avr_explore_next(x, &n, &byte)) {
+		int result = -1;
+		if (_avr_explore_goto(w, n) == 0) {
+			memset(w->cov.map, 0, AVR_EXPLORE_MAP_SIZE);
+			avr_coverage_reset(&w->cov);
+			result = _avr_explore_step(w, byte);
+			w->runs++;
+		}
+		pthread_mutex_lock(&x->lock);
+		uint32_t edges = result >= 0 ? _avr_explore_merge(w) : 0;
+		if (edges) {
+			x->result[result]++;
+			uint16_t depth = x->node[n].depth + 1;
+			avr_explore_path(x, n, w->path);
+			w->path[depth - 1] = byte;
+			if (x->found) {
+				avr_explore_branch_t b = {
+					.path = w->path, .len = depth, .result = result,
+					.edges = edges, .cycle = w->avr->cycle,
+				};
+				x->found(x, &b, x->param);
+			}
+			if (result == AVR_EXPLORE_DECISION && depth < x->max_depth) {
+				if (x->node_count == x->node_size && x->node_size < x->max_nodes) {
+					uint32_t size = x->node_size * 2;
+					if (size > x->max_nodes)
+						size = x->max_nodes;
+					avr_explore_node_t * nn = realloc(x->node, size * sizeof(*nn));
+					if (nn) {
+						x->node = nn;
+						x->node_size = size;
+					}
+				}
+				if (x->node_count < x->node_size)
+					x->node[x->node_count++] = (avr_explore_node_t) {
+						.parent = n, .depth = depth, .byte = byte };
+			}
+		}
+		x->running--;
+		pthread_cond_broadcast(&x->cond);
+		pthread_mutex_unlock(&x->lock);
+	}
+	return NULL;
+}
+
+void
+avr_explore_init(
+		avr_explore_t * x,
+		struct avr_t * (*make)(void * param),
+		void * param)
+{
+	memset(x, 0, sizeof(*x));
+	x->make = make;
+	x->param = param;
+	x->uart = '0';
+	x->gap = AVR_EXPLORE_GAP;
+	x->stop = ~0;
+	x->max_depth = 16;
+	x->max_nodes = 65536;
+}
+
+// makes the instance of a worker, and brings it to the root
+static int
+_avr_explore_worker_init(
+		avr_explore_worker_t * w)
+{
+	avr_explore_t * x = w->x;
+
+	w->avr = x->make(x->param);
+	w->path = malloc(x->max_depth + 1);
+	if (!w->avr || !w->path)
+		return -1;
+	avr_t * avr = w->avr;
+	uint32_t flags = 0;
+	if (avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(x->uart), &flags)) {
+		AVR_LOG(avr, LOG_ERROR, "EXPLORE: %s has no UART%c\n",
+				avr->mmcu, x->uart);
+		return -1;
+	}
+	flags &= ~(AVR_UART_FLAG_POLL_SLEEP | AVR_UART_FLAG_STDIO);
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(x->uart), &flags);
+	uint32_t depth = 1;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FIFO(x->uart), &depth);
+	if (avr_coverage_init(avr, &w->cov, NULL, AVR_EXPLORE_MAP_SIZE))
+		return -1;
+	avr_coverage_stop_at(&w->cov, x->stop);
+	int result = _avr_explore_step(w, -1);
+	if (result != AVR_EXPLORE_DECISION) {
+		AVR_LOG(avr, LOG_ERROR, "EXPLORE: the firmware stopped before the root\n");
+		return -1;
+	}
+	w->root = avr_snapshot_save(avr);
+	return w->root ? 0 : -1;
+}
+
+int64_t
+avr_explore_run(
+		avr_explore_t * x,
+		uint32_t workers)
+{
+	if (!workers) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+	if (workers > AVR_EXPLORE_WORKERS)
+		workers = AVR_EXPLORE_WORKERS;
+	if (!x->alphabet)
+		x->alphabet_len = 256;
+	if (!x->make || !x->alphabet_len || !x->max_depth || !x->max_nodes) {
+		AVR_LOG(NULL, LOG_ERROR, "EXPLORE: %s: nothing to explore\n", __func__);
+		return -1;
+	}
+	x->worker = calloc(workers, sizeof(*x->worker));
+	x->virgin = calloc(1, AVR_EXPLORE_MAP_SIZE);
+	x->node_size = x->max_nodes < 1024 ? x->max_nodes : 1024;
+	x->node = malloc(x->node_size * sizeof(*x->node));
+	if (!x->worker || !x->virgin || !x->node) {
+		AVR_LOG(NULL, LOG_ERROR, "EXPLORE: %s: out of memory\n", __func__);
+		return -1;
+	}
+	pthread_mutex_init(&x->lock, NULL);
+	pthread_cond_init(&x->cond, NULL);
+	x->count = workers;
+	x->start_ns = _avr_explore_now();
+	// the instances are made one after the other, 'make' needn't be thread safe
+	for (uint32_t i = 0; i < workers; i++) {
+		avr_explore_worker_t * w = x->worker + i;
+		w->x = x;
+		if (_avr_explore_worker_init(w)) {
+			AVR_LOG(NULL, LOG_ERROR, "EXPLORE: can't make worker %u\n", i);
+			return -1;
+		}
+	}
+	// the root's own edges aren't anyone's
+	_avr_explore_merge(x->worker);
+	x->node[x->node_count++] = (avr_explore_node_t) { 0 };
+	for (uint32_t i = 0; i < workers; i++) {
+		avr_explore_worker_t * w = x->worker + i;
+		if (pthread_create(&w->thread, NULL, _avr_explore_thread, w)) {
+			AVR_LOG(w->avr, LOG_ERROR, "EXPLORE: can't start worker %u\n", i);
+			break;
+		}
+		w->started = 1;
+	}
+	int64_t res = 0;
+	for (uint32_t i = 0; i < workers; i++)
+		if (x->worker[i].started)
+			pthread_join(x->worker[i].thread, NULL);
+	x->end_ns = _avr_explore_now();
+	for (int i = 0; i <= AVR_EXPLORE_CRASHED; i++)
+		res += x->result[i];
+	return x->worker[0].started ? res : -1;
+}
+
+uint32_t
+avr_explore_path(
+		avr_explore_t * x,
+		uint32_t n,
+		uint8_t * path)
+{
+	uint32_t len = x->node[n].depth;
+
+	for (uint32_t i = len; i > 0; i--) {
+		path[i - 1] = x->node[n].byte;
+		n = x->node[n].parent;
+	}
+	return len;
+}
+
+void
+avr_explore_report(
+		avr_explore_t * x,
+		FILE * out)
+{
+	uint64_t wall = x->end_ns - x->start_ns;
+
+	fprintf(out, "explore: %" PRIu64 " runs, %u edges, %u nodes, %.3fs\n",
+			x->runs, x->edges, x->node_count, wall / 1e9);
+	fprintf(out, "  branches: %" PRIu64 " decision, %" PRIu64 " ignored, %"
+			PRIu64 " done, %" PRIu64 " crashed\n",
+			x->result[AVR_EXPLORE_DECISION], x->result[AVR_EXPLORE_IGNORED],
+			x->result[AVR_EXPLORE_DONE], x->result[AVR_EXPLORE_CRASHED]);
+	fprintf(out, "worker       runs  replays     cycles\n");
+	for (uint32_t i = 0; i < x->count; i++) {
+		avr_explore_worker_t * w = x->worker + i;
+		fprintf(out, "%6u %10" PRIu64 " %8" PRIu64 " %10" PRI_avr_cycle_count "\n",
+				i, w->runs, w->replays, w->cycles);
+	}
+}
+
+void
+avr_explore_free(
+		avr_explore_t * x)
+{
+	for (uint32_t i = 0; x->worker && i < x->count; i++) {
+		avr_explore_worker_t * w = x->worker + i;
+		if (w->snap)
+			avr_snapshot_free(w->snap);
+		if (w->root)
+			avr_snapshot_free(w->root);
+		if (w->avr) {
+			avr_coverage_free(&w->cov);
+			avr_terminate(w->avr);
+			free(w->avr);
+		}
+		free(w->path);
+	}
+	free(x->worker);
+	free(x->virgin);
+	free(x->node);
+	if (x->count) {
+		pthread_mutex_destroy(&x->lock);
+		pthread_cond_destroy(&x->cond);
+	}
+	x->worker = NULL;
+	x->virgin = NULL;
+	x->node = NULL;
+	x->count = 0;
+}
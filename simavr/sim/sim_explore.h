@@ -0,0 +1,180 @@
+/*
+	sim_explore.h
+
+	Explores the bytes a firmware takes on a UART, from snapshots of its
+	decision points, on a set of worker threads.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_EXPLORE_H__
+#define __SIM_EXPLORE_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "sim_avr.h"
+#include "sim_snapshot.h"
+#include "sim_coverage.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A decision point is where the firmware has consumed the bytes it was
+ * given on the UART, and had 'gap' cycles to act on the last one, or got
+ * to 'stop' (its getc(), its main loop) before that. From each one the
+ * bytes of the 'alphabet' are tried, each one a run of its own to the
+ * next decision point; the runs that took edges no run took before are
+ * the interesting branches, the ones that didn't are dropped. An
+ * interesting branch that got to a decision point is explored in turn,
+ * breadth first, up to 'max_depth' bytes.
+ *
+ * Snapshots only go back into the instance they were taken from (see
+ * sim_snapshot.h), so each worker thread has an instance of its own,
+ * made by 'make', the same way each time, and run to the root decision
+ * point. A worker gets to a branch by going back to its root and giving
+ * it the bytes of the branch, the runs being deterministic, once: it
+ * keeps a snapshot of the branch it's on, and trying the next byte from
+ * there only copies back the pages the previous try wrote.
+ *
+ * The UART's input fifo is made 1 byte deep, the bytes are given one at
+ * a time by a pull source; its stdio and poll sleep flags are cleared.
+ * The instances count their edges into coverage maps of their own.
+ */
+#define AVR_EXPLORE_WORKERS		256
+#define AVR_EXPLORE_MAP_SIZE	65536
+#define AVR_EXPLORE_GAP			100000	// cycles, by default
+
+enum {
+	AVR_EXPLORE_DECISION = 0,	// got to the next decision point
+	AVR_EXPLORE_IGNORED,		// the firmware didn't read the byte in 'gap'
+	AVR_EXPLORE_DONE,			// the core stopped, cpu_Done
+	AVR_EXPLORE_CRASHED,		// cpu_Crashed
+};
+
+// an interesting branch, for the 'found' callback
+typedef struct avr_explore_branch_t {
+	const uint8_t *	path;		// the bytes given since the root
+	uint32_t		len;
+	int				result;		// AVR_EXPLORE_*
+	uint32_t		edges;		// the new ones it took
+	avr_cycle_count_t cycle;	// where it ended
+} avr_explore_branch_t;
+
+// a decision point, the branch that got there
+typedef struct avr_explore_node_t {
+	uint32_t		parent;
+	uint16_t		depth;
+	uint8_t			byte;
+} avr_explore_node_t;
+
+struct avr_explore_t;
+
+typedef struct avr_explore_worker_t {
+	struct avr_explore_t * x;
+	pthread_t		thread;
+	int				started;
+	struct avr_t *	avr;
+	avr_coverage_t	cov;
+	avr_snapshot_t * root;
+	avr_snapshot_t * snap;		// of 'node', unless it's the root
+	uint32_t		node;
+	uint8_t *		path;		// max_depth bytes
+	// the byte being given, from the pull source
+	uint8_t			byte, fed, consumed;
+	avr_cycle_count_t consumed_at;
+	// counters, only written by the worker itself
+	uint64_t		runs, replays;
+	avr_cycle_count_t cycles;
+} avr_explore_worker_t;
+
+typedef struct avr_explore_t {
+	// set by avr_explore_init(), to change before avr_explore_run()
+	struct avr_t *	(*make)(
+			void * param );
+	void *			param;
+	char			uart;
+	avr_cycle_count_t gap;
+	uint32_t		stop;		// pc, in bytes, ~0 for none
+	const uint8_t *	alphabet;	// NULL for the 256 bytes
+	uint32_t		alphabet_len;
+	uint32_t		max_depth;
+	uint32_t		max_nodes;
+	uint64_t		max_runs;	// 0 for no limit
+	/*
+	 * Called for each interesting branch, one at a time, on the worker
+	 * that ran it. Optional
+	 */
+	void (*found)(
+			struct avr_explore_t * x,
+			const avr_explore_branch_t * b,
+			void * param );
+	// filled in by avr_explore_run()
+	avr_explore_worker_t * worker;
+	uint32_t		count;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	uint8_t *		virgin;		// the edges taken so far, by any run
+	uint32_t		edges;
+	avr_explore_node_t * node;
+	uint32_t		node_count, node_size;
+	uint32_t		next_node, next_byte;	// the next run to hand out
+	uint32_t		running;
+	uint64_t		runs;
+	uint64_t		result[AVR_EXPLORE_CRASHED + 1];	// of the interesting ones
+	uint64_t		start_ns, end_ns;
+} avr_explore_t;
+
+// sets the defaults, UART '0', AVR_EXPLORE_GAP, 16 bytes deep, 65536 nodes
+void
+avr_explore_init(
+		avr_explore_t * x,
+		struct avr_t * (*make)(void * param),
+		void * param );
+/*
+ * Makes an instance per worker, 'workers' of them (0 for one per online
+ * cpu), and explores until there are no branches left to try, or
+ * 'max_runs' were made. Returns the number of interesting branches, or -1
+ * if it couldn't start
+ */
+int64_t
+avr_explore_run(
+		avr_explore_t * x,
+		uint32_t workers );
+/*
+ * The path of node 'n', in 'path', max_depth bytes; returns its length
+ */
+uint32_t
+avr_explore_path(
+		avr_explore_t * x,
+		uint32_t n,
+		uint8_t * path );
+// the runs, edges, branches and nodes, and what each worker did
+void
+avr_explore_report(
+		avr_explore_t * x,
+		FILE * out );
+// terminates the instances, frees the nodes and the snapshots
+void
+avr_explore_free(
+		avr_explore_t * x );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_EXPLORE_H__ */
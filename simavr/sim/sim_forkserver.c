@@ -0,0 +1,102 @@
+/*
+	sim_forkserver.c
+
+	Loads and initializes a core once, then forks a process per run,
+	AFL-style, over a pair of pipes.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifndef __MINGW32__
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#include "sim_forkserver.h"
+
+#ifndef __MINGW32__
+static int
+_avr_fork_server_io(
+		int fd,
+		void * buf,
+		int write_it )
+{
+	uint8_t * b = buf;
+	size_t done = 0;
+
+	while (done < 4) {
+		ssize_t r = write_it ? write(fd, b + done, 4 - done) :
+				read(fd, b + done, 4 - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+	return 0;
+}
+#endif
+
+int
+avr_fork_server(
+		avr_t * avr,
+		int ctl_fd,
+		int status_fd )
+{
+#ifdef __MINGW32__
+	AVR_LOG(avr, LOG_ERROR, "FORKSRV: %s: no fork() on this host\n", __func__);
+	return -1;
+#else
+	uint32_t word = 0;
+
+	// nobody listening, the caller runs once, as usual
+	if (_avr_fork_server_io(status_fd, &word, 1)) {
+		AVR_LOG(avr, LOG_WARNING, "FORKSRV: %s: no status fd %d\n",
+				__func__, status_fd);
+		return -1;
+	}
+	while (_avr_fork_server_io(ctl_fd, &word, 0) == 0) {
+		// or what's buffered would be printed by every run
+		fflush(NULL);
+		pid_t pid = fork();
+		if (pid < 0) {
+			AVR_LOG(avr, LOG_ERROR, "FORKSRV: %s: fork: %s\n",
+					__func__, strerror(errno));
+			return 0;
+		}
+		if (pid == 0) {
+			close(ctl_fd);
+			close(status_fd);
+			return 1;
+		}
+		int status = 0;
+		word = pid;
+		if (_avr_fork_server_io(status_fd, &word, 1))
+			break;
+		while (waitpid(pid, &status, 0) < 0)
+			if (errno != EINTR) {
+				status = 0;
+				break;
+			}
+		word = status;
+		if (_avr_fork_server_io(status_fd, &word, 1))
+			break;
+	}
+	return 0;
+#endif
+}
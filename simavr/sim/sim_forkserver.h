@@ -0,0 +1,66 @@
+/*
+	sim_forkserver.h
+
+	Loads and initializes a core once, then forks a process per run,
+	AFL-style, over a pair of pipes.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_FORKSERVER_H__
+#define __SIM_FORKSERVER_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The server has a control fd it reads from, and a status fd it writes
+ * to, AFL's by default. It writes 4 bytes once it's ready, then for each
+ * run it's asked for (4 bytes, whatever they are, on the control fd):
+ * + it forks; the run gets a copy on write of the whole process, with
+ *   the core as it was set up, and nothing parsed or initialized again;
+ * + writes the pid of the run, 4 bytes;
+ * + waits for it, and writes its wait() status, 4 bytes.
+ * Runs are one at a time, the next request is read after the status is
+ * written. From a shell, or a script, the pipes are given as:
+ *
+ *	run_avr --fork-server ... 198<ctl 199>status
+ *
+ * The core mustn't have threads (the log, or VCD writers, gdb) by then,
+ * they are not in the copies. Anything else that's open is shared, the
+ * files the runs write are best opened by the runs.
+ */
+#define AVR_FORKSRV_FD		198		// the control fd, the status one is next
+
+/*
+ * Serves runs of 'avr' until the control fd is closed. Returns 1 in the
+ * process of a run, which is to run and exit; 0 in the server, once
+ * there are no more; -1 if it can't serve, and nothing was forked.
+ */
+int
+avr_fork_server(
+		avr_t * avr,
+		int ctl_fd,
+		int status_fd );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_FORKSERVER_H__ */
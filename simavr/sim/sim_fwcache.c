@@ -0,0 +1,503 @@
+/*
+	sim_fwcache.c
+
+	A directory of firmwares already loaded, to skip parsing them again.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_fwcache.h"
+#include "sim_core.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct avr_fwcache_header_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	firmware_size;	// sizeof(elf_firmware_t) of the build
+	uint64_t	hash, size;		// of the file it was loaded from
+	// offsets in the entry, 0 when there's none
+	uint32_t	firmware, flash, eeprom, fuse, lockbits;
+	uint32_t	decoded, decoded_count, decoded_format;
+	char		decoded_mmcu[64];
+} avr_fwcache_header_t;
+
+static const char fwcache_magic[8] = "simavrFC";
+
+/*
+ * A quick 64 bits hash of the file, 8 bytes at a time, in four lanes so
+ * the multiplies don't wait on each other.
+ */
+int
+avr_fwcache_hash(
+		const char * file,
+		uint64_t * hash,
+		uint64_t * size)
+{
+	int fd = open(file, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		return -1;
+	uint64_t buf[8192];
+	uint64_t h[4] = { 0xcbf29ce484222325ull, 1, 2, 3 };
+	ssize_t r = 0;
+	*size = 0;
+	do {
+		size_t got = 0;
+		// fill it, so only the last block can have a tail
+		while (got < sizeof(buf) &&
+				(r = read(fd, (uint8_t*)buf + got, sizeof(buf) - got)) > 0)
+			got += r;
+		if (r < 0)
+			break;
+		memset((uint8_t*)buf + got, 0, (32 - (got & 31)) & 31);
+		for (size_t i = 0; i < (got + 31) / 32 * 4; i += 4)
+			for (int l = 0; l < 4; l++) {
+				h[l] = (h[l] ^ buf[i + l]) * 0x100000001b3ull;
+				h[l] ^= h[l] >> 29;
+			}
+		*size += got;
+		if (got < sizeof(buf))
+			break;
+	} while (1);
+	close(fd);
+	if (r < 0)
+		return -1;
+	*hash = *size;
+	for (int l = 0; l < 4; l++)
+		*hash = (*hash ^ h[l]) * 0x100000001b3ull;
+	return 0;
+}
+
+static void
+_avr_fwcache_path(
+		char * path,
+		size_t len,
+		const char * dir,
+		uint64_t hash)
+{
+	snprintf(path, len, "%s/%016llx.fwc", dir, (unsigned long long)hash);
+}
+
+int
+avr_fwcache_load(
+		const char * dir,
+		const char * file,
+		elf_firmware_t * firmware)
+{
+	uint64_t hash, size;
+	char path[1024];
+
+	if (avr_fwcache_hash(file, &hash, &size))
+		return -1;
+	_avr_fwcache_path(path, sizeof(path), dir, hash);
+
+	int fd = open(path, O_RDONLY | O_BINARY);
+	struct stat st;
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < sizeof(avr_fwcache_header_t)) {
+		close(fd);
+		return -1;
+	}
+	size_t len = st.st_size;
+#ifdef __MINGW32__
+	uint8_t * map = malloc(len);
+	if (map && read(fd, map, len) != len) {
+		free(map);
+		map = NULL;
+	}
+#else
+	// private and writable, the firmware buffers are used as they are
+	uint8_t * map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		map = NULL;
+#endif
+	close(fd);
+	if (!map)
+		return -1;
+
+	avr_fwcache_header_t * h = (avr_fwcache_header_t *)map;
+	elf_firmware_t * f = (elf_firmware_t *)(map + h->firmware);
+	if (memcmp(h->magic, fwcache_magic, sizeof(fwcache_magic)) ||
+			h->version != AVR_FWCACHE_VERSION ||
+			h->firmware_size != sizeof(elf_firmware_t) ||
+			h->hash != hash || h->size != size ||
+			h->firmware < sizeof(*h) || h->firmware > len - sizeof(*f) ||
+			(h->flash && (h->flash > len || f->flashsize > len - h->flash)) ||
+			(h->eeprom && (h->eeprom > len || f->eesize > len - h->eeprom)) ||
+			(h->fuse && (h->fuse > len || f->fusesize > len - h->fuse)) ||
+			(h->lockbits && h->lockbits >= len) ||
+			(h->decoded && (h->decoded > len || h->decoded_count >
+				(len - h->decoded) / sizeof(avr_decoded_t)))) {
+		AVR_LOG(NULL, LOG_WARNING, "FWCACHE: %s: ignoring %s\n", __func__, path);
+#ifdef __MINGW32__
+		free(map);
+#else
+		munmap(map, len);
+#endif
+		return -1;
+	}
+	*firmware = *f;
+	firmware->flash = h->flash ? map + h->flash : NULL;
+	firmware->eeprom = h->eeprom ? map + h->eeprom : NULL;
+	firmware->fuse = h->fuse ? map + h->fuse : NULL;
+	firmware->lockbits = h->lockbits ? map + h->lockbits : NULL;
+	firmware->cache = map;
+#if ELF_SYMBOLS
+	firmware->symbol = NULL;
+	firmware->symbolcount = 0;
+	firmware->symbols_read = 0;
+	firmware->elfname = strdup(file);
+#endif
+	return 0;
+}
+
+static uint32_t
+_avr_fwcache_align(
+		uint32_t offset)
+{
+	return (offset + 7) & ~7;
+}
+
+static int
+_avr_fwcache_put(
+		FILE * o,
+		uint32_t offset,
+		const void * buf,
+		uint32_t size)
+{
+	if (!buf || !size)
+		return 0;
+	return fseek(o, offset, SEEK_SET) || fwrite(buf, 1, size, o) != size;
+}
+
+int
+avr_fwcache_store(
+		const char * dir,
+		const char * file,
+		const elf_firmware_t * firmware,
+		struct avr_t * avr)
+{
+	uint64_t hash, size;
+	char path[1024], tmp[1100];
+
+	if (avr_fwcache_hash(file, &hash, &size))
+		return -1;
+	_avr_fwcache_path(path, sizeof(path), dir, hash);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+	avr_fwcache_header_t h = {
+		.version = AVR_FWCACHE_VERSION,
+		.firmware_size = sizeof(elf_firmware_t),
+		.hash = hash,
+		.size = size,
+	};
+	memcpy(h.magic, fwcache_magic, sizeof(h.magic));
+	// the pointers mean nothing in the file
+	elf_firmware_t f = *firmware;
+	f.flash = f.eeprom = f.fuse = f.lockbits = NULL;
+	f.cache = NULL;
+#if ELF_SYMBOLS
+	f.symbol = NULL;
+	f.symbolcount = 0;
+	f.symbols_read = 0;
+	f.elfname = NULL;
+#endif
+	uint32_t offset = _avr_fwcache_align(sizeof(h));
+	h.firmware = offset;
+	offset = _avr_fwcache_align(offset + sizeof(f));
+	if (firmware->flash && firmware->flashsize) {
+		h.flash = offset;
+		offset = _avr_fwcache_align(offset + firmware->flashsize);
+	}
+	if (firmware->eeprom && firmware->eesize) {
+		h.eeprom = offset;
+		offset = _avr_fwcache_align(offset + firmware->eesize);
+	}
+	if (firmware->fuse && firmware->fusesize) {
+		h.fuse = offset;
+		offset = _avr_fwcache_align(offset + firmware->fusesize);
+	}
+	if (firmware->lockbits) {
+		h.lockbits = offset;
+		offset = _avr_fwcache_align(offset + 1);
+	}
+	avr_decoded_t * decoded = NULL;
+	if (avr && avr->decoded) {
+		h.decoded_count = (firmware->flashbase + firmware->flashsize + 1) >> 1;
+		if (h.decoded_count > (avr->flashend + 1) >> 1)
+			h.decoded_count = (avr->flashend + 1) >> 1;
+		decoded = malloc(h.decoded_count * sizeof(*decoded));
+		if (decoded) {
+			avr_predecode_build(avr, decoded, h.decoded_count);
+			h.decoded = offset;
+			h.decoded_format = avr_predecode_format();
+			snprintf(h.decoded_mmcu, sizeof(h.decoded_mmcu), "%s", avr->mmcu);
+		} else
+			h.decoded_count = 0;
+	}
+
+#ifdef __MINGW32__
+	mkdir(dir);
+#else
+	mkdir(dir, 0777);
+#endif
+	FILE * o = fopen(tmp, "wb");
+	if (!o) {
+		AVR_LOG(avr, LOG_WARNING, "FWCACHE: %s: can't create %s\n", __func__, tmp);
+		free(decoded);
+		return -1;
+	}
+	int err = _avr_fwcache_put(o, 0, &h, sizeof(h)) ||
+			_avr_fwcache_put(o, h.firmware, &f, sizeof(f)) ||
+			_avr_fwcache_put(o, h.flash, firmware->flash, firmware->flashsize) ||
+			_avr_fwcache_put(o, h.eeprom, firmware->eeprom, firmware->eesize) ||
+			_avr_fwcache_put(o, h.fuse, firmware->fuse, firmware->fusesize) ||
+			_avr_fwcache_put(o, h.lockbits, firmware->lockbits, 1) ||
+			_avr_fwcache_put(o, h.decoded, decoded,
+					h.decoded_count * sizeof(*decoded));
+	free(decoded);
+	if (fclose(o))
+		err = 1;
+	if (!err && rename(tmp, path))
+		err = 1;
+	if (err) {
+		AVR_LOG(avr, LOG_WARNING, "FWCACHE: %s: can't write %s\n", __func__, path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int
+avr_fwcache_predecode(
+		const elf_firmware_t * firmware,
+		struct avr_t * avr)
+{
+	const avr_fwcache_header_t * h = firmware->cache;
+
+	if (!h || !h->decoded || !h->decoded_count ||
+			h->decoded_format != avr_predecode_format() ||
+			strcmp(h->decoded_mmcu, avr->mmcu))
+		return -1;
+	return avr_predecode_import(avr,
+			(const avr_decoded_t *)((const uint8_t *)h + h->decoded),
+			h->decoded_count);
+}
+
+typedef struct avr_fwcache_warm_t {
+	char		magic[8];
+	uint32_t	version;
+	uint64_t	hash, size;			// of the firmware file
+	char		mmcu[64];
+	uint32_t	reset_pc, pc;		// where it starts, and main()
+	avr_cycle_count_t	cycle;		// from reset to main()
+	uint32_t	ramend;
+	uint8_t		sreg;
+	// followed by the data space, ramend + 1 bytes
+} avr_fwcache_warm_t;
+
+static const char fwcache_warm_magic[8] = "simavrWS";
+
+// the io registers crt0 may leave changed
+static int
+_avr_fwcache_warm_io(
+		avr_t * avr,
+		uint32_t addr)
+{
+	return addr == R_SPL || addr == R_SPH || addr == R_SREG ||
+			(avr->rampz && addr == avr->rampz) ||
+			(avr->eind && addr == avr->eind);
+}
+
+// the last io register, all the ones past that are plain sram
+static uint32_t
+_avr_fwcache_io_end(
+		avr_t * avr)
+{
+	uint32_t io_end = avr->ioend > 31 + avr->io_count ?
+			avr->ioend : 31 + avr->io_count;
+	return io_end > avr->ramend ? avr->ramend : io_end;
+}
+
+static void
+_avr_fwcache_warm_path(
+		char * path,
+		size_t len,
+		const char * dir,
+		uint64_t hash,
+		avr_t * avr)
+{
+	snprintf(path, len, "%s/%016llx.%s.warm", dir,
+			(unsigned long long)hash, avr->mmcu);
+}
+
+static void
+_avr_fwcache_warm_apply(
+		avr_t * avr,
+		const avr_fwcache_warm_t * w,
+		const uint8_t * data)
+{
+	uint32_t io_end = _avr_fwcache_io_end(avr);
+	memcpy(avr->data, data, 32);
+	for (uint32_t a = 32; a <= io_end; a++)
+		if (_avr_fwcache_warm_io(avr, a) && a != R_SREG)
+			avr->data[a] = data[a];
+	if (io_end < avr->ramend)
+		memcpy(avr->data + io_end + 1, data + io_end + 1, avr->ramend - io_end);
+	SET_SREG_FROM(avr, w->sreg);
+	avr->pc = w->pc;
+	avr->cycle += w->cycle;
+	avr_io_read_invalidate(avr);
+}
+
+// runs it to main(), returns 0 if the state it's in there can be stored
+static int
+_avr_fwcache_warm_run(
+		elf_firmware_t * firmware,
+		avr_t * avr,
+		avr_cycle_count_t max_cycles,
+		uint32_t * main_pc)
+{
+#if ELF_SYMBOLS
+	if (elf_firmware_symbols(firmware))
+		return -1;
+	avr_symbol_t * sym = NULL;
+	for (uint32_t i = 0; i < firmware->symbolcount && !sym; i++)
+		if (!strcmp(firmware->symbol[i]->symbol, "main"))
+			sym = firmware->symbol[i];
+	if (!sym || sym->addr > avr->flashend) {
+		AVR_LOG(avr, LOG_WARNING, "FWCACHE: %s: no main() in %s\n", __func__,
+				firmware->elfname ? firmware->elfname : "the firmware");
+		return -1;
+	}
+	*main_pc = sym->addr;
+	uint32_t io_end = _avr_fwcache_io_end(avr);
+	uint8_t * io = malloc(io_end + 1);
+	if (!io)
+		return -1;
+	memcpy(io, avr->data, io_end + 1);
+	int portable = avr->cycle_timers.count == 0;
+	avr_cycle_count_t end = avr->cycle + max_cycles;
+	// one instruction at a time, so it stops right there
+	while (avr->pc != *main_pc && avr->cycle < end &&
+			(avr->state == cpu_Running || avr->state == cpu_Sleeping))
+		avr_run_cycles(avr, 1);
+	if (avr->pc != *main_pc) {
+		AVR_LOG(avr, LOG_WARNING, "FWCACHE: %s: main() wasn't reached\n",
+				__func__);
+		free(io);
+		return -1;
+	}
+	avr_sreg_materialize(avr);
+	for (uint32_t a = 32; a <= io_end && portable; a++)
+		portable = avr->data[a] == io[a] || _avr_fwcache_warm_io(avr, a);
+	free(io);
+	portable = portable && avr->state == cpu_Running &&
+			avr->cycle_timers.count == 0 && !avr->interrupts.pending &&
+			!avr->interrupts.running_ptr;
+	if (!portable)
+		AVR_LOG(avr, LOG_TRACE, "FWCACHE: %s: crt0 left state that isn't "
+				"kept\n", __func__);
+	return portable ? 0 : 1;
+#else
+	return -1;
+#endif
+}
+
+int
+avr_fwcache_warm_start(
+		const char * dir,
+		const char * file,
+		elf_firmware_t * firmware,
+		struct avr_t * avr,
+		avr_cycle_count_t max_cycles)
+{
+	uint64_t hash, size;
+	char path[1024], tmp[1100];
+
+	if (avr_fwcache_hash(file, &hash, &size))
+		return -1;
+	_avr_fwcache_warm_path(path, sizeof(path), dir, hash, avr);
+
+	avr_fwcache_warm_t w;
+	FILE * f = fopen(path, "rb");
+	if (f) {
+		uint8_t * data = malloc(avr->ramend + 1);
+		int ok = data && fread(&w, sizeof(w), 1, f) == 1 &&
+				!memcmp(w.magic, fwcache_warm_magic, sizeof(w.magic)) &&
+				w.version == AVR_FWCACHE_VERSION &&
+				w.hash == hash && w.size == size &&
+				!strncmp(w.mmcu, avr->mmcu, sizeof(w.mmcu)) &&
+				w.reset_pc == avr->pc && w.ramend == avr->ramend &&
+				w.pc <= avr->flashend &&
+				fread(data, 1, avr->ramend + 1, f) == avr->ramend + 1;
+		fclose(f);
+		if (ok)
+			_avr_fwcache_warm_apply(avr, &w, data);
+		else
+			AVR_LOG(avr, LOG_WARNING, "FWCACHE: %s: ignoring %s\n", __func__, path);
+		free(data);
+		if (ok)
+			return 1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	memcpy(w.magic, fwcache_warm_magic, sizeof(w.magic));
+	w.version = AVR_FWCACHE_VERSION;
+	w.hash = hash;
+	w.size = size;
+	snprintf(w.mmcu, sizeof(w.mmcu), "%s", avr->mmcu);
+	w.reset_pc = avr->pc;
+	w.ramend = avr->ramend;
+	avr_cycle_count_t start = avr->cycle;
+	int res = _avr_fwcache_warm_run(firmware, avr, max_cycles, &w.pc);
+	if (res)
+		return res < 0 ? -1 : 0;
+	w.cycle = avr->cycle - start;
+	READ_SREG_INTO(avr, w.sreg);
+
+#ifdef __MINGW32__
+	mkdir(dir);
+#else
+	mkdir(dir, 0777);
+#endif
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	FILE * o = fopen(tmp, "wb");
+	int err = !o || fwrite(&w, sizeof(w), 1, o) != 1 ||
+			fwrite(avr->data, 1, avr->ramend + 1, o) != avr->ramend + 1;
+	if (o && fclose(o))
+		err = 1;
+	if (!err && rename(tmp, path))
+		err = 1;
+	if (err) {
+		AVR_LOG(avr, LOG_WARNING, "FWCACHE: %s: can't write %s\n", __func__, path);
+		unlink(tmp);
+	}
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+	sim_fwcache.h
+
+	A directory of firmwares already loaded, to skip parsing them again.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_FWCACHE_H__
+#define __SIM_FWCACHE_H__
+
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Each entry of the cache is a file named after a hash of the content of
+ * the .elf or .hex file it was loaded from. It holds the elf_firmware_t
+ * as it was loaded: its .mmcu settings, flash, eeprom, fuses and lock
+ * bits and, once an instance ran it with the predecoded cache, the
+ * decoded instructions for that core.
+ *
+ * An entry is read with a single mmap(), and the buffers of the firmware
+ * point into it; they are valid until the process ends. Entries are
+ * written to a temporary file that is then renamed, so several processes
+ * can share the directory. Entries of another build, or of a file that
+ * changed, are ignored. The symbols are read from the file itself, when
+ * elf_firmware_symbols() is called.
+ */
+#define AVR_FWCACHE_VERSION	1
+
+/*
+ * The hash the entries are named after, of the content of 'file', and its
+ * size. Also what the farm servers know a firmware by (see farm_avr.c).
+ * Returns 0, or -1
+ */
+int
+avr_fwcache_hash(
+		const char * file,
+		uint64_t * hash,
+		uint64_t * size );
+
+// returns 0 and fills 'firmware' if 'file' is in the cache, -1 otherwise
+int
+avr_fwcache_load(
+		const char * dir,
+		const char * file,
+		elf_firmware_t * firmware );
+/*
+ * Writes the entry of 'file', which was loaded into 'firmware'. If 'avr'
+ * isn't NULL and has a predecoded cache, the whole firmware is decoded
+ * for its core and stored too (avr_predecode_build()), so the next runs
+ * start with all of it, not just the code this one went through. These
+ * entries are only used by the same build of simavr, with the same GNU
+ * build ID (avr_predecode_format()). Returns 0, or -1.
+ */
+int
+avr_fwcache_store(
+		const char * dir,
+		const char * file,
+		const elf_firmware_t * firmware,
+		struct avr_t * avr );
+/*
+ * Starts the predecoded cache of 'avr' with the entries stored with the
+ * firmware, if they were made for the same core. Returns 0 if there were
+ * some, -1 otherwise.
+ */
+int
+avr_fwcache_predecode(
+		const elf_firmware_t * firmware,
+		struct avr_t * avr );
+
+/*
+ * Warm start: the instance, fresh out of reset, is taken straight to the
+ * start of main(), with the state crt0 left it in, registers, stack and
+ * the .data and .bss copied and cleared; and the cycle it got there.
+ *
+ * The first time, that's done by running it there, at most 'max_cycles',
+ * with the address of main() from the ELF symbols; if crt0 touched no io
+ * register but the stack pointer, SREG, RAMPZ and EIND, and left no cycle
+ * timer pending, the state is kept in the cache next to the firmware, for
+ * that core. Returns 1 if it came from the cache, 0 if it ran to main(),
+ * -1 if it can't do either; the instance can still be run from where it
+ * is then, only maybe not at the start of main().
+ */
+int
+avr_fwcache_warm_start(
+		const char * dir,
+		const char * file,
+		elf_firmware_t * firmware,
+		struct avr_t * avr,
+		avr_cycle_count_t max_cycles );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_FWCACHE_H__ */
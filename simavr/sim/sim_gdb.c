@@ -26,26 +26,161 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
 #include "sim_avr.h"
 #include "sim_core.h" // for SET_SREG_FROM, READ_SREG_INTO
 #include "sim_hex.h"
 #include "avr_eeprom.h"
 #include "sim_gdb.h"
+#include "sim_snapshot.h"
+#include "sim_replay.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
 
 #define DBG(w)
 
+// initial room in the point lists, they grow as needed
 #define WATCH_LIMIT (32)
+// how long a stopped core waits for gdb at a time, in usec
+#define GDB_STOPPED_WAIT (10000)
+/*
+ * Largest packet we take, and tell gdb about; big enough for gdb to move
+ * a few KB of memory per round trip.
+ */
+#define GDB_PACKET_SIZE (16384)
+/*
+ * Reverse execution: the core is snapshotted every so many cycles while
+ * it runs, up to that many snapshots; when they are all taken, every
+ * other one is dropped and the interval doubled, so they always cover
+ * the whole history, and going back never re-runs more than an interval
+ * or two.
+ */
+#define GDB_HISTORY_SNAPSHOTS	(64)
+#define GDB_HISTORY_INTERVAL	(1 << 18)
+#define GDB_HISTORY_NONE		(~(avr_cycle_count_t)0)
+
+/*
+ * Agent expressions (gdb manual, appendix F), one after the other in
+ * 'code', each after its length as a uint16_t.
+ */
+typedef struct avr_gdb_ax_t {
+	uint8_t *	code;
+	uint32_t	len;
+} avr_gdb_ax_t;
 
 typedef struct {
 	uint32_t len; /**< How many points are taken (points[0] .. points[len - 1]). */
+	uint32_t size; /**< How many points there is room for. */
 	struct {
 		uint32_t addr; /**< Which address is watched. */
 		uint32_t size; /**< How large is the watched segment. */
 		uint32_t kind; /**< Bitmask of enum avr_gdb_watch_type values. */
-	} points[WATCH_LIMIT];
+		avr_gdb_ax_t cond; /**< Breakpoint conditions, it stops if any holds. */
+	} * points;
 } avr_gdb_watchpoints_t;
 
+// an input of the core, whose values are logged
+typedef struct avr_gdb_input_t {
+	struct avr_gdb_t *	g;
+	avr_irq_t *			irq;
+	struct avr_ioport_t * port;	// pin irqs, to ignore the port's own changes
+} avr_gdb_input_t;
+
+typedef struct avr_gdb_stimulus_t {
+	avr_cycle_count_t	cycle;
+	avr_irq_t *			irq;
+	uint32_t			value;
+	uint8_t				floating;
+	uint8_t				late;		// after the instruction boundary at 'cycle'
+} avr_gdb_stimulus_t;
+
+/*
+ * What it takes to go back: the snapshots, and the values the inputs were
+ * set to from outside, as running again from a snapshot has to see the
+ * same ones at the same cycles. Behind 'present', the core is 'replaying':
+ * the inputs are raised again from the log, the live ones aren't logged.
+ */
+typedef struct avr_gdb_history_t {
+	struct {
+		avr_cycle_count_t	cycle;
+		avr_snapshot_t *	s;
+	}					snap[GDB_HISTORY_SNAPSHOTS];
+	uint32_t			count;
+	avr_cycle_count_t	interval, next;	// of the snapshots
+	avr_cycle_count_t	boundary;	// cycle of the current instruction boundary
+	avr_cycle_count_t	present;	// the furthest one reached
+	avr_gdb_stimulus_t *	log;
+	uint32_t			len, size, pos;	// pos is the next one to replay
+	avr_gdb_input_t **	input;
+	uint32_t			inputs;
+	uint8_t				replaying;
+	uint8_t				rerun;		// running again quietly, to go back
+	uint8_t				hit;		// watchpoint kind hit while doing so
+	uint16_t			hit_addr;
+} avr_gdb_history_t;
+
+/*
+ * Tracepoints (gdb manual, E.6) don't stop the core: when one is hit, its
+ * condition is evaluated here, and if it holds, a frame with the registers
+ * and the memory it asks for is added to the trace buffer. gdb then looks
+ * at the frames with 'tfind', once tracing is stopped or even while it
+ * runs. The registers are in every frame, whatever the actions say; the
+ * while-stepping actions aren't supported, they are ignored.
+ */
+#define GDB_TRACE_BUFFER	(1024 * 1024)
+#define GDB_REG_BYTES		(39)	// r0-r31, SREG, SP, PC, as in a 'g' reply
+
+enum {
+	GDB_TRACE_NOTRUN = 0,
+	GDB_TRACE_STOP,			// by gdb
+	GDB_TRACE_FULL,
+	GDB_TRACE_PASS,			// a tracepoint reached its pass count
+	GDB_TRACE_ERROR,		// an expression failed
+};
+
+typedef struct avr_gdb_tracepoint_t {
+	uint32_t		number;
+	uint32_t		addr;
+	uint8_t			enabled;
+	uint32_t		pass;		// tracing stops at that many hits, 0 never
+	uint32_t		hits;
+	uint32_t		bytes;		// of the frames it added
+	avr_gdb_ax_t	cond;
+	avr_gdb_ax_t	eval;		// the 'X' actions, for what they trace
+	struct {
+		int32_t		basereg;	// -1 for an absolute address
+		uint32_t	offset, len;
+	} *				mem;		// the 'M' actions
+	uint32_t		mem_count;
+} avr_gdb_tracepoint_t;
+
+// a frame in the trace buffer, followed by its memory blocks
+typedef struct avr_gdb_frame_t {
+	uint32_t		size;		// with the blocks
+	uint32_t		tp;			// number of the tracepoint
+	uint8_t			reg[GDB_REG_BYTES];
+} avr_gdb_frame_t;
+
+typedef struct avr_gdb_block_t {
+	uint32_t		addr;		// gdb address
+	uint32_t		len;		// of the bytes after it
+} avr_gdb_block_t;
+
+typedef struct avr_gdb_trace_t {
+	avr_gdb_tracepoint_t * tp;
+	uint32_t		count, size;
+	uint8_t			running;
+	uint8_t			stop;		// GDB_TRACE_*, why it's not running
+	uint8_t			full;		// while adding a frame
+	uint32_t		stop_tp;	// the tracepoint that stopped it
+	uint8_t *		buf;		// the frames
+	uint32_t		len, buf_size, frames;
+	int32_t			frame;		// selected by gdb, or -1
+	uint32_t		frame_pos;	// where it is in 'buf'
+} avr_gdb_trace_t;
+
 typedef struct avr_gdb_t {
 	avr_t * avr;
 	int		listen;	// listen socket
@@ -53,8 +188,56 @@ typedef struct avr_gdb_t {
 
 	avr_gdb_watchpoints_t breakpoints;
 	avr_gdb_watchpoints_t watchpoints;
+	// one bit per flash word, set where there is a breakpoint
+	uint32_t *	bp_map;
+	// watched access kinds, per data byte, see avr->gdb_watch
+	uint8_t *	watch_map;
+
+	avr_gdb_history_t	history;
+	avr_gdb_trace_t		trace;
+
+	/*
+	 * What the server thread has for the core, under 'lock'; 'pending'
+	 * is set when there's any of it, and can be read without the lock.
+	 */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int			pending;
+	int			accepted;	// a new connection, or -1
+	int			closed;		// the current one was closed
+	int			interrupt;	// control-c
+	uint8_t *	queue;		// whole packets, each a uint32_t size then the bytes
+	uint32_t	queue_len, queue_size;
+	// the packets being handled by the core, swapped with 'queue'
+	uint8_t *	work;
+	uint32_t	work_len, work_size;
+
+	// only used by the server thread
+	int			conn;		// the connection it reads, or -1
+	uint32_t	rx_len;		// received bytes, until they make up a whole packet
+	uint8_t		rx[GDB_PACKET_SIZE + 4];
 } avr_gdb_t;
 
+/*
+ * One thread serves the gdb connections of all the instances, each on its
+ * own port: it accepts them, acknowledges and splits the packets, and
+ * queues them for the instance. The instance only handles them when it
+ * checks in from its run loop, so a running one only looks at a flag
+ * until there's something for it, and a stopped one sleeps until then.
+ */
+static struct {
+	pthread_mutex_t	lock;
+	pthread_t		thread;
+	int				running;
+	int				wake[2];	// pipe, to have it look at the list again
+	uint32_t		serial;		// changes with the list
+	avr_gdb_t **	target;
+	int				count, size;
+} gdb_server = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = { -1, -1 },
+};
+
 
 /**
  * Returns the index of the watchpoint if found, -1 otherwise.
@@ -114,8 +297,13 @@ gdb_watch_add_or_update(
 	}
 
 	/* Otherwise add it. */
-	if (w->len == WATCH_LIMIT) {
-		return -1;
+	if (w->len == w->size) {
+		uint32_t size = w->size ? w->size * 2 : WATCH_LIMIT;
+		void * points = realloc(w->points, size * sizeof(w->points[0]));
+		if (!points)
+			return -1;
+		w->points = points;
+		w->size = size;
 	}
 
 	/* Find the insertion point. */
@@ -128,7 +316,7 @@ gdb_watch_add_or_update(
 	w->len++;
 
 	/* Make space for new element, moving old ones from the end. */
-	for (int j = w->len; j > i; j--) {
+	for (int j = w->len - 1; j > i; j--) {
 		w->points[j] = w->points[j - 1];
 	}
 
@@ -136,6 +324,7 @@ gdb_watch_add_or_update(
 	w->points[i].kind = kind;
 	w->points[i].addr = addr;
 	w->points[i].size = size;
+	w->points[i].cond = (avr_gdb_ax_t) { 0 };
 
 	return 0;
 }
@@ -158,6 +347,7 @@ gdb_watch_rm(
 	if (w->points[i].kind) {
 		return 0;
 	}
+	free(w->points[i].cond.code);
 
 	for (i = i + 1; i < w->len; i++) {
 		w->points[i - 1] = w->points[i];
@@ -172,15 +362,97 @@ static void
 gdb_watch_clear(
 		avr_gdb_watchpoints_t * w )
 {
+	for (int i = 0; i < w->len; i++)
+		free(w->points[i].cond.code);
 	w->len = 0;
 }
 
+static void
+gdb_watch_free(
+		avr_gdb_watchpoints_t * w )
+{
+	gdb_watch_clear(w);
+	free(w->points);
+	w->points = NULL;
+	w->len = w->size = 0;
+}
+
+/*
+ * Rebuilds the per data byte map of watched access kinds the core tests,
+ * it is only visible to the core while there are watchpoints.
+ */
+static void
+gdb_watch_map_update(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_watchpoints_t * w = &g->watchpoints;
+
+	avr->gdb_watch = NULL;
+	if (!w->len)
+		return;
+	if (!g->watch_map) {
+		g->watch_map = calloc(0x10000, 1);
+		if (!g->watch_map) {
+			AVR_LOG(avr, LOG_ERROR, "GDB: Can't allocate watchpoint map\n");
+			return;
+		}
+	} else
+		memset(g->watch_map, 0, 0x10000);
+	for (int i = 0; i < w->len; i++) {
+		uint32_t end = w->points[i].addr + w->points[i].size;
+		for (uint32_t a = w->points[i].addr; a < end && a < 0x10000; a++)
+			g->watch_map[a] |= w->points[i].kind;
+	}
+	avr->gdb_watch = g->watch_map;
+}
+
+/*
+ * The breakpoint list is only changed by gdb, but checked before every
+ * instruction, so that is done in a bitmap instead.
+ */
+static inline int
+gdb_bp_map_get(
+		avr_gdb_t * g,
+		avr_flashaddr_t addr )
+{
+	addr >>= 1;
+	return (g->bp_map[addr >> 5] >> (addr & 31)) & 1;
+}
+
+/*
+ * Brings the bit for addr back in line with the breakpoint list, and the
+ * enabled tracepoints while tracing runs.
+ */
+static void
+gdb_bp_map_update(
+		avr_gdb_t * g,
+		avr_flashaddr_t addr )
+{
+	uint32_t word = addr >> 1;
+	int set = gdb_watch_find(&g->breakpoints, addr) != -1;
+
+	for (uint32_t i = 0; i < g->trace.count && g->trace.running && !set; i++)
+		set = g->trace.tp[i].addr == addr && g->trace.tp[i].enabled;
+	if (set)
+		g->bp_map[word >> 5] |= 1 << (word & 31);
+	else
+		g->bp_map[word >> 5] &= ~(1 << (word & 31));
+}
+
+static void
+gdb_bp_map_clear(
+		avr_gdb_t * g )
+{
+	memset(g->bp_map, 0, ((g->avr->flashend >> 6) + 1) * sizeof(g->bp_map[0]));
+}
+
 static void
 gdb_send_reply(
 		avr_gdb_t * g,
 		char * cmd )
 {
-	uint8_t reply[1024];
+	uint8_t reply[GDB_PACKET_SIZE + 4];
 	uint8_t * dst = reply;
 	uint8_t check = 0;
 	*dst++ = '$';
@@ -193,20 +465,47 @@ gdb_send_reply(
 	send(g->s, reply, dst - reply + 3, 0);
 }
 
+// stop reply, with 'extra' stop reason fields after the registers
 static void
-gdb_send_quick_status(
+gdb_send_status(
 		avr_gdb_t * g,
-		uint8_t signal )
+		uint8_t signal,
+		const char * extra )
 {
-	char cmd[64];
+	char cmd[96];
 
-	sprintf(cmd, "T%02x20:%02x;21:%02x%02x;22:%02x%02x%02x00;",
+	snprintf(cmd, sizeof(cmd), "T%02x20:%02x;21:%02x%02x;22:%02x%02x%02x00;%s",
 		signal ? signal : 5, g->avr->data[R_SREG],
 		g->avr->data[R_SPL], g->avr->data[R_SPH],
-		g->avr->pc & 0xff, (g->avr->pc>>8)&0xff, (g->avr->pc>>16)&0xff);
+		g->avr->pc & 0xff, (g->avr->pc>>8)&0xff, (g->avr->pc>>16)&0xff,
+		extra);
 	gdb_send_reply(g, cmd);
 }
 
+static void
+gdb_send_quick_status(
+		avr_gdb_t * g,
+		uint8_t signal )
+{
+	gdb_send_status(g, signal, "");
+}
+
+// stop reply for a watchpoint of 'kind' hit at 'addr' (gdb manual, E.3)
+static void
+gdb_send_watch_status(
+		avr_gdb_t * g,
+		int kind,
+		uint16_t addr )
+{
+	char extra[32];
+
+	sprintf(extra, "%s:%06x;",
+			kind & AVR_GDB_WATCH_ACCESS ? "awatch" :
+				kind & AVR_GDB_WATCH_WRITE ? "watch" : "rwatch",
+			addr | 0x800000);
+	gdb_send_status(g, 0, extra);
+}
+
 static int
 gdb_change_breakpoint(
 		avr_gdb_watchpoints_t * w,
@@ -215,15 +514,790 @@ gdb_change_breakpoint(
 		uint32_t addr,
 		uint32_t size )
 {
-	DBG(printf("set %d kind %d addr %08x len %d\n", set, kind, addr, len);)
-
-	if (set) {
-		return gdb_watch_add_or_update(w, kind, addr, size);
-	} else {
-		return gdb_watch_rm(w, kind, addr);
+	DBG(printf("set %d kind %d addr %08x len %d\n", set, kind, addr, len);)
+
+	if (set) {
+		return gdb_watch_add_or_update(w, kind, addr, size);
+	} else {
+		return gdb_watch_rm(w, kind, addr);
+	}
+
+	return -1;
+}
+
+/*
+ * Agent expressions are evaluated right here, so a breakpoint whose
+ * condition doesn't hold doesn't stop at all, rather than stopping for gdb
+ * to evaluate it, and resuming. They also tell a tracepoint what to trace.
+ * The floating point, trace state variable and printf opcodes aren't
+ * supported, they make the expression fail.
+ */
+#define GDB_AX_STACK	(32)
+#define GDB_AX_STEPS	(4096)	// against the loops that don't end
+
+enum {
+	AX_ADD = 0x02, AX_SUB, AX_MUL, AX_DIV_SIGNED, AX_DIV_UNSIGNED,
+	AX_REM_SIGNED, AX_REM_UNSIGNED, AX_LSH, AX_RSH_SIGNED, AX_RSH_UNSIGNED,
+	AX_TRACE, AX_TRACE_QUICK, AX_LOG_NOT, AX_BIT_AND, AX_BIT_OR,
+	AX_BIT_XOR, AX_BIT_NOT, AX_EQUAL, AX_LESS_SIGNED, AX_LESS_UNSIGNED,
+	AX_EXT, AX_REF8, AX_REF16, AX_REF32, AX_REF64,
+	AX_IF_GOTO = 0x20, AX_GOTO, AX_CONST8, AX_CONST16, AX_CONST32,
+	AX_CONST64, AX_REG, AX_END, AX_DUP, AX_POP, AX_ZERO_EXT, AX_SWAP,
+	AX_TRACENZ = 0x2f, AX_TRACE16, AX_PICK = 0x32, AX_ROT,
+};
+
+// reads the byte at a gdb address, returns -1 if there's none
+static int
+gdb_read_byte(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint8_t * v )
+{
+	avr_t * avr = g->avr;
+
+	addr &= 0xffffff;
+	if (addr <= avr->flashend)
+		*v = avr->flash[addr];
+	else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend)
+		*v = avr->data[addr - 0x800000];
+	else
+		return -1;
+	return 0;
+}
+
+static int
+gdb_reg_value(
+		avr_gdb_t * g,
+		int regi,
+		int64_t * v )
+{
+	avr_t * avr = g->avr;
+
+	switch (regi) {
+		case 0 ... 31:
+			*v = avr->data[regi];
+			return 0;
+		case 32: {
+			uint8_t sreg;
+			READ_SREG_INTO(avr, sreg);
+			*v = sreg;
+		}	return 0;
+		case 33:
+			*v = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+			return 0;
+		case 34:
+			*v = avr->pc;
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Adds 'len' bytes at 'addr' to the frame being made, up to the first
+ * one that can't be read, or after the first zero one if 'nz' is set.
+ * Returns -1 when the buffer is full.
+ */
+static int
+gdb_trace_mem(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint32_t len,
+		int nz )
+{
+	avr_gdb_trace_t * t = &g->trace;
+	avr_gdb_block_t b = { .addr = addr & 0xffffff };
+
+	if (len > t->buf_size || t->len + sizeof(b) + len > t->buf_size) {
+		t->full = 1;
+		return -1;
+	}
+	uint8_t * dst = t->buf + t->len + sizeof(b);
+	while (b.len < len && !gdb_read_byte(g, addr + b.len, dst + b.len))
+		if (!dst[b.len++] && nz)
+			break;
+	if (!b.len)
+		return 0;
+	memcpy(t->buf + t->len, &b, sizeof(b));
+	t->len += sizeof(b) + b.len;
+	return 0;
+}
+
+/*
+ * Runs one expression, the trace opcodes add to the frame being made if
+ * 'collect' is set. Returns 0 with what's on top of the stack at the end
+ * in 'res', or -1.
+ */
+static int
+gdb_ax_eval(
+		avr_gdb_t * g,
+		const uint8_t * code,
+		uint32_t len,
+		int collect,
+		int64_t * res )
+{
+	int64_t st[GDB_AX_STACK], a, b;
+	int sp = 0;
+	uint32_t pc = 0;
+
+#define NEED(_n) if (sp < (_n)) return -1
+#define PUSH(_v) { int64_t _p = (_v); if (sp == GDB_AX_STACK) return -1; st[sp++] = _p; }
+	for (int steps = 0; steps < GDB_AX_STEPS; steps++) {
+		if (pc >= len)
+			return -1;
+		uint8_t op = code[pc++];
+		// the operand, big endian
+		int size = 0;
+		switch (op) {
+			case AX_EXT: case AX_TRACE_QUICK: case AX_ZERO_EXT: case AX_PICK:
+			case AX_CONST8:
+				size = 1;
+				break;
+			case AX_IF_GOTO: case AX_GOTO: case AX_CONST16: case AX_REG:
+			case AX_TRACE16:
+				size = 2;
+				break;
+			case AX_CONST32:
+				size = 4;
+				break;
+			case AX_CONST64:
+				size = 8;
+				break;
+		}
+		if (pc + size > len)
+			return -1;
+		uint64_t n = 0;
+		for (int i = 0; i < size; i++)
+			n = (n << 8) | code[pc++];
+
+		switch (op) {
+			case AX_ADD ... AX_RSH_UNSIGNED:
+			case AX_BIT_AND ... AX_BIT_XOR:
+			case AX_EQUAL ... AX_LESS_UNSIGNED:
+				NEED(2);
+				b = st[--sp];
+				a = st[sp - 1];
+				switch (op) {
+					case AX_ADD: a = (uint64_t)a + b; break;
+					case AX_SUB: a = (uint64_t)a - b; break;
+					case AX_MUL: a = (uint64_t)a * b; break;
+					case AX_DIV_SIGNED:
+					case AX_REM_SIGNED:
+						if (!b || (b == -1 && a == INT64_MIN))
+							return -1;
+						a = op == AX_DIV_SIGNED ? a / b : a % b;
+						break;
+					case AX_DIV_UNSIGNED:
+					case AX_REM_UNSIGNED:
+						if (!b)
+							return -1;
+						a = op == AX_DIV_UNSIGNED ? (uint64_t)a / b : (uint64_t)a % b;
+						break;
+					case AX_LSH: a = b > 63 ? 0 : (uint64_t)a << b; break;
+					case AX_RSH_SIGNED: a = a >> (b > 63 ? 63 : b); break;
+					case AX_RSH_UNSIGNED: a = b > 63 ? 0 : (uint64_t)a >> b; break;
+					case AX_BIT_AND: a &= b; break;
+					case AX_BIT_OR: a |= b; break;
+					case AX_BIT_XOR: a ^= b; break;
+					case AX_EQUAL: a = a == b; break;
+					case AX_LESS_SIGNED: a = a < b; break;
+					case AX_LESS_UNSIGNED: a = (uint64_t)a < (uint64_t)b; break;
+				}
+				st[sp - 1] = a;
+				break;
+			case AX_LOG_NOT:
+				NEED(1);
+				st[sp - 1] = !st[sp - 1];
+				break;
+			case AX_BIT_NOT:
+				NEED(1);
+				st[sp - 1] = ~st[sp - 1];
+				break;
+			case AX_EXT:
+			case AX_ZERO_EXT:
+				NEED(1);
+				if (n && n < 64) {
+					uint64_t v = st[sp - 1] & ((1ULL << n) - 1);
+					if (op == AX_EXT && (v >> (n - 1)))
+						v |= ~0ULL << n;
+					st[sp - 1] = v;
+				}
+				break;
+			case AX_REF8 ... AX_REF64: {
+				NEED(1);
+				uint32_t addr = st[sp - 1];
+				uint64_t v = 0;
+				for (int i = (1 << (op - AX_REF8)) - 1; i >= 0; i--) {
+					uint8_t byte;
+					if (gdb_read_byte(g, addr + i, &byte))
+						return -1;
+					v = (v << 8) | byte;
+				}
+				st[sp - 1] = v;
+			}	break;
+			case AX_TRACE:
+			case AX_TRACENZ:
+				NEED(2);
+				sp -= 2;
+				if (collect && gdb_trace_mem(g, st[sp], st[sp + 1], op == AX_TRACENZ))
+					return -1;
+				break;
+			case AX_TRACE_QUICK:
+			case AX_TRACE16:
+				NEED(1);
+				if (collect && gdb_trace_mem(g, st[sp - 1], n, 0))
+					return -1;
+				break;
+			case AX_IF_GOTO:
+				NEED(1);
+				if (st[--sp])
+					pc = n;
+				break;
+			case AX_GOTO:
+				pc = n;
+				break;
+			case AX_CONST8:
+			case AX_CONST16:
+			case AX_CONST32:
+			case AX_CONST64:
+				PUSH(n);
+				break;
+			case AX_REG:
+				if (gdb_reg_value(g, n, &a))
+					return -1;
+				PUSH(a);
+				break;
+			case AX_END:
+				*res = sp ? st[sp - 1] : 0;
+				return 0;
+			case AX_DUP:
+				NEED(1);
+				PUSH(st[sp - 1]);
+				break;
+			case AX_POP:
+				NEED(1);
+				sp--;
+				break;
+			case AX_SWAP:
+				NEED(2);
+				a = st[sp - 1];
+				st[sp - 1] = st[sp - 2];
+				st[sp - 2] = a;
+				break;
+			case AX_PICK:
+				NEED((int)n + 1);
+				PUSH(st[sp - 1 - n]);
+				break;
+			case AX_ROT:	// a b c => c a b
+				NEED(3);
+				a = st[sp - 1];
+				st[sp - 1] = st[sp - 2];
+				st[sp - 2] = st[sp - 3];
+				st[sp - 3] = a;
+				break;
+			default:
+				return -1;
+		}
+	}
+#undef NEED
+#undef PUSH
+	return -1;
+}
+
+/*
+ * Whether any of the expressions in 'ax' holds, or 1 if there are none.
+ * -1 if one failed.
+ */
+static int
+gdb_ax_test(
+		avr_gdb_t * g,
+		const avr_gdb_ax_t * ax )
+{
+	if (!ax->len)
+		return 1;
+	for (uint32_t pos = 0; pos < ax->len; ) {
+		uint16_t len;
+		int64_t res;
+		memcpy(&len, ax->code + pos, sizeof(len));
+		pos += sizeof(len);
+		if (gdb_ax_eval(g, ax->code + pos, len, 0, &res))
+			return -1;
+		if (res)
+			return 1;
+		pos += len;
+	}
+	return 0;
+}
+
+// adds the expression at '*src', "len,bytes" in hex, and moves past it
+static int
+gdb_ax_parse(
+		avr_gdb_ax_t * ax,
+		char ** src )
+{
+	char * p = *src;
+	uint32_t len = strtoul(p, &p, 16);
+
+	if (*p++ != ',' || !len || len > 0xffff)
+		return -1;
+	uint8_t * code = realloc(ax->code, ax->len + sizeof(uint16_t) + len);
+	if (!code)
+		return -1;
+	ax->code = code;
+	uint16_t l = len;
+	memcpy(code + ax->len, &l, sizeof(l));
+	if (read_hex_string(p, code + ax->len + sizeof(l), len) != len)
+		return -1;
+	ax->len += sizeof(l) + len;
+	*src = p + len * 2;
+	return 0;
+}
+
+static void
+gdb_ax_free(
+		avr_gdb_ax_t * ax )
+{
+	free(ax->code);
+	ax->code = NULL;
+	ax->len = 0;
+}
+
+/*
+ * Replaces the conditions of the breakpoint at 'addr' with the ones after
+ * its Z packet, ";X" and an expression each. None makes it unconditional.
+ */
+static int
+gdb_bp_condition(
+		avr_gdb_t * g,
+		uint32_t addr,
+		char * p )
+{
+	int i = gdb_watch_find(&g->breakpoints, addr);
+	if (i == -1)
+		return -1;
+	avr_gdb_ax_t * cond = &g->breakpoints.points[i].cond;
+	gdb_ax_free(cond);
+	while (p && p[0] == ';' && p[1] == 'X') {
+		p += 2;
+		if (gdb_ax_parse(cond, &p)) {
+			gdb_ax_free(cond);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// whether the breakpoint at 'pc' stops the core; it does if a condition fails
+static int
+gdb_bp_stop(
+		avr_gdb_t * g,
+		avr_flashaddr_t pc )
+{
+	int i = gdb_watch_find(&g->breakpoints, pc);
+
+	return i != -1 && gdb_ax_test(g, &g->breakpoints.points[i].cond) != 0;
+}
+
+static void
+gdb_regs_save(
+		avr_gdb_t * g,
+		uint8_t * reg )
+{
+	avr_t * avr = g->avr;
+
+	memcpy(reg, avr->data, 32);
+	READ_SREG_INTO(avr, reg[32]);
+	reg[33] = avr->data[R_SPL];
+	reg[34] = avr->data[R_SPH];
+	reg[35] = avr->pc;
+	reg[36] = avr->pc >> 8;
+	reg[37] = avr->pc >> 16;
+	reg[38] = 0;
+}
+
+static void
+gdb_trace_stop(
+		avr_gdb_t * g,
+		int why,
+		uint32_t tp )
+{
+	avr_gdb_trace_t * t = &g->trace;
+
+	if (!t->running)
+		return;
+	t->running = 0;
+	t->stop = why;
+	t->stop_tp = tp;
+	for (uint32_t i = 0; i < t->count; i++)
+		gdb_bp_map_update(g, t->tp[i].addr);
+}
+
+/*
+ * The tracepoints at 'pc' are hit: each one whose condition holds adds a
+ * frame. Tracing stops when the buffer is full, or at a pass count.
+ */
+static void
+gdb_trace_hit(
+		avr_gdb_t * g,
+		avr_flashaddr_t pc )
+{
+	avr_gdb_trace_t * t = &g->trace;
+
+	for (uint32_t i = 0; i < t->count && t->running; i++) {
+		avr_gdb_tracepoint_t * tp = &t->tp[i];
+		if (tp->addr != pc || !tp->enabled)
+			continue;
+		int res = gdb_ax_test(g, &tp->cond);
+		if (!res)
+			continue;
+		uint32_t start = t->len;
+		avr_gdb_frame_t f = { .tp = tp->number };
+		t->full = t->len + sizeof(f) > t->buf_size;
+		if (res == 1 && !t->full) {
+			gdb_regs_save(g, f.reg);
+			t->len += sizeof(f);
+			for (uint32_t m = 0; m < tp->mem_count && res == 1; m++) {
+				int64_t base = 0;
+				if (tp->mem[m].basereg != -1 &&
+						gdb_reg_value(g, tp->mem[m].basereg, &base))
+					res = -1;
+				else if (gdb_trace_mem(g, base + tp->mem[m].offset,
+							tp->mem[m].len, 0))
+					res = -1;
+			}
+			for (uint32_t pos = 0; pos < tp->eval.len && res == 1; ) {
+				uint16_t len;
+				int64_t v;
+				memcpy(&len, tp->eval.code + pos, sizeof(len));
+				pos += sizeof(len);
+				if (gdb_ax_eval(g, tp->eval.code + pos, len, 1, &v))
+					res = -1;
+				pos += len;
+			}
+		}
+		if (t->full || res == -1) {
+			t->len = start;
+			gdb_trace_stop(g, t->full ? GDB_TRACE_FULL : GDB_TRACE_ERROR,
+					tp->number);
+			break;
+		}
+		f.size = t->len - start;
+		memcpy(t->buf + start, &f, sizeof(f));
+		t->frames++;
+		tp->hits++;
+		tp->bytes += f.size;
+		if (tp->pass && tp->hits >= tp->pass)
+			gdb_trace_stop(g, GDB_TRACE_PASS, tp->number);
+	}
+}
+
+// forgets the tracepoints, and the frames
+static void
+gdb_trace_clear(
+		avr_gdb_t * g )
+{
+	avr_gdb_trace_t * t = &g->trace;
+
+	gdb_trace_stop(g, GDB_TRACE_STOP, 0);
+	for (uint32_t i = 0; i < t->count; i++) {
+		gdb_ax_free(&t->tp[i].cond);
+		gdb_ax_free(&t->tp[i].eval);
+		free(t->tp[i].mem);
+	}
+	t->count = 0;
+	t->len = t->frames = 0;
+	t->frame = -1;
+	t->stop = GDB_TRACE_NOTRUN;
+}
+
+static avr_gdb_tracepoint_t *
+gdb_trace_find_tp(
+		avr_gdb_t * g,
+		uint32_t number,
+		uint32_t addr )
+{
+	for (uint32_t i = 0; i < g->trace.count; i++)
+		if (g->trace.tp[i].number == number && g->trace.tp[i].addr == addr)
+			return &g->trace.tp[i];
+	return NULL;
+}
+
+/*
+ * QTDP, a new tracepoint, "n:addr:E|D:step:pass", then maybe ":X" and
+ * its condition; or, with "-n:addr:", actions for it. Returns 0, or -1
+ */
+static int
+gdb_trace_define(
+		avr_gdb_t * g,
+		char * p )
+{
+	avr_gdb_trace_t * t = &g->trace;
+	avr_gdb_tracepoint_t * tp;
+	int more = *p == '-';
+
+	if (more)
+		p++;
+	uint32_t number = strtoul(p, &p, 16);
+	if (*p++ != ':')
+		return -1;
+	uint32_t addr = strtoul(p, &p, 16);
+	if (*p++ != ':')
+		return -1;
+	if (!more) {
+		if (addr > g->avr->flashend || t->running ||
+				gdb_trace_find_tp(g, number, addr))
+			return -1;
+		if (t->count == t->size) {
+			uint32_t size = t->size ? t->size * 2 : WATCH_LIMIT;
+			tp = realloc(t->tp, size * sizeof(*tp));
+			if (!tp)
+				return -1;
+			t->tp = tp;
+			t->size = size;
+		}
+		tp = &t->tp[t->count];
+		memset(tp, 0, sizeof(*tp));
+		tp->number = number;
+		tp->addr = addr;
+		tp->enabled = *p++ == 'E';
+		if (*p++ != ':')
+			return -1;
+		strtoul(p, &p, 16);		// the steps, for the while-stepping actions
+		if (*p++ != ':')
+			return -1;
+		tp->pass = strtoul(p, &p, 16);
+		t->count++;
+		while (*p == ':') {
+			if (p[1] != 'X')
+				return -1;		// fast and static ones aren't for here
+			p += 2;
+			if (gdb_ax_parse(&tp->cond, &p))
+				return -1;
+		}
+		return 0;
+	}
+	if (!(tp = gdb_trace_find_tp(g, number, addr)))
+		return -1;
+	while (*p && *p != '-') {
+		switch (*p++) {
+			case 'S':	// while-stepping, not supported
+				return 0;
+			case 'R':	// the registers are always collected
+				strtoull(p, &p, 16);
+				break;
+			case 'M': {
+				void * mem = realloc(tp->mem, (tp->mem_count + 1) * sizeof(*tp->mem));
+				if (!mem)
+					return -1;
+				tp->mem = mem;
+				tp->mem[tp->mem_count].basereg = strtol(p, &p, 16);
+				if (*p++ != ',')
+					return -1;
+				tp->mem[tp->mem_count].offset = strtoul(p, &p, 16);
+				if (*p++ != ',')
+					return -1;
+				tp->mem[tp->mem_count++].len = strtoul(p, &p, 16);
+			}	break;
+			case 'X':
+				if (gdb_ax_parse(&tp->eval, &p))
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+gdb_trace_frame_get(
+		avr_gdb_t * g,
+		avr_gdb_frame_t * f )
+{
+	memcpy(f, g->trace.buf + g->trace.frame_pos, sizeof(*f));
+}
+
+/*
+ * QTFrame, selects a frame: by number, or the next one after the current
+ * one at a pc, for a tracepoint, or with its pc in or outside a range.
+ */
+static void
+gdb_trace_select(
+		avr_gdb_t * g,
+		char * p )
+{
+	avr_gdb_trace_t * t = &g->trace;
+	enum { BY_NUMBER, BY_PC, BY_TP, BY_RANGE, BY_OUTSIDE } by = BY_NUMBER;
+	uint32_t a, b = 0;
+
+	if (!strncmp(p, "pc:", 3))
+		by = BY_PC, p += 3;
+	else if (!strncmp(p, "tdp:", 4))
+		by = BY_TP, p += 4;
+	else if (!strncmp(p, "range:", 6))
+		by = BY_RANGE, p += 6;
+	else if (!strncmp(p, "outside:", 8))
+		by = BY_OUTSIDE, p += 8;
+	a = strtoul(p, &p, 16);
+	if (*p == ':')
+		b = strtoul(p + 1, NULL, 16);
+	if (by == BY_NUMBER && a == 0xffffffff) {
+		t->frame = -1;
+		gdb_send_reply(g, "OK");
+		return;
+	}
+	uint32_t pos = 0;
+	for (int32_t n = 0; pos < t->len; n++) {
+		avr_gdb_frame_t f;
+		memcpy(&f, t->buf + pos, sizeof(f));
+		uint32_t pc = f.reg[35] | (f.reg[36] << 8) | (f.reg[37] << 16);
+		int found;
+		switch (by) {
+			case BY_NUMBER: found = n == a; break;
+			case BY_PC: found = n > t->frame && pc == a; break;
+			case BY_TP: found = n > t->frame && f.tp == a; break;
+			case BY_RANGE: found = n > t->frame && pc >= a && pc <= b; break;
+			default: found = n > t->frame && (pc < a || pc > b); break;
+		}
+		if (found) {
+			char rep[32];
+			t->frame = n;
+			t->frame_pos = pos;
+			sprintf(rep, "F%xT%x", n, f.tp);
+			gdb_send_reply(g, rep);
+			return;
+		}
+		pos += f.size;
+	}
+	t->frame = -1;
+	gdb_send_reply(g, "F-1");
+}
+
+/*
+ * Copies what the selected frame has of the 'len' bytes at 'addr', and
+ * returns how many it has, from the first one.
+ */
+static uint32_t
+gdb_trace_frame_read(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint8_t * dst,
+		uint32_t len )
+{
+	avr_gdb_trace_t * t = &g->trace;
+	avr_gdb_frame_t f;
+	uint32_t done = 0;
+
+	gdb_trace_frame_get(g, &f);
+	addr &= 0xffffff;
+	while (done < len) {
+		uint32_t pos = t->frame_pos + sizeof(f), got = 0;
+		while (pos < t->frame_pos + f.size && !got) {
+			avr_gdb_block_t b;
+			memcpy(&b, t->buf + pos, sizeof(b));
+			uint32_t a = addr + done;
+			if (a >= b.addr && a < b.addr + b.len) {
+				got = b.addr + b.len - a;
+				if (got > len - done)
+					got = len - done;
+				memcpy(dst + done, t->buf + pos + sizeof(b) + a - b.addr, got);
+			}
+			pos += sizeof(b) + b.len;
+		}
+		if (!got)
+			break;
+		done += got;
 	}
+	return done;
+}
 
-	return -1;
+// the Q and q packets for tracing, returns 0 if it isn't one of them
+static int
+gdb_trace_command(
+		avr_gdb_t * g,
+		char * cmd )
+{
+	avr_gdb_trace_t * t = &g->trace;
+	char rep[160];
+
+	if (!strcmp(cmd, "QTinit")) {
+		gdb_trace_clear(g);
+		gdb_send_reply(g, "OK");
+	} else if (!strncmp(cmd, "QTDPsrc:", 8) || !strncmp(cmd, "QTro", 4)) {
+		gdb_send_reply(g, "OK");	// nothing to do with those
+	} else if (!strncmp(cmd, "QTDP:", 5)) {
+		gdb_send_reply(g, gdb_trace_define(g, cmd + 5) ? "E01" : "OK");
+	} else if (!strncmp(cmd, "QTEnable:", 9) || !strncmp(cmd, "QTDisable:", 10)) {
+		char * p = strchr(cmd, ':') + 1;
+		uint32_t number = strtoul(p, &p, 16);
+		avr_gdb_tracepoint_t * tp = *p == ':' ?
+				gdb_trace_find_tp(g, number, strtoul(p + 1, NULL, 16)) : NULL;
+		if (!tp) {
+			gdb_send_reply(g, "E01");
+			return 1;
+		}
+		tp->enabled = cmd[3] == 'E';
+		gdb_bp_map_update(g, tp->addr);
+		gdb_send_reply(g, "OK");
+	} else if (!strncmp(cmd, "QTBuffer:size:", 14)) {
+		long size = strtol(cmd + 14, NULL, 16);
+		if (t->running) {
+			gdb_send_reply(g, "E01");
+			return 1;
+		}
+		t->buf_size = size < 0 ? GDB_TRACE_BUFFER : size;
+		gdb_send_reply(g, "OK");
+	} else if (!strcmp(cmd, "QTStart")) {
+		if (!t->buf_size)
+			t->buf_size = GDB_TRACE_BUFFER;
+		uint8_t * buf = realloc(t->buf, t->buf_size);
+		if (!buf) {
+			AVR_LOG(g->avr, LOG_ERROR, "GDB: Can't allocate the trace buffer\n");
+			gdb_send_reply(g, "E01");
+			return 1;
+		}
+		t->buf = buf;
+		t->len = t->frames = 0;
+		t->frame = -1;
+		for (uint32_t i = 0; i < t->count; i++)
+			t->tp[i].hits = t->tp[i].bytes = 0;
+		t->running = 1;
+		for (uint32_t i = 0; i < t->count; i++)
+			gdb_bp_map_update(g, t->tp[i].addr);
+		gdb_send_reply(g, "OK");
+	} else if (!strcmp(cmd, "QTStop")) {
+		gdb_trace_stop(g, GDB_TRACE_STOP, 0);
+		gdb_send_reply(g, "OK");
+	} else if (!strncmp(cmd, "QTFrame:", 8)) {
+		gdb_trace_select(g, cmd + 8);
+	} else if (!strcmp(cmd, "qTStatus")) {
+		char why[32] = "";
+		switch (t->running ? -1 : t->stop) {
+			case GDB_TRACE_NOTRUN: strcpy(why, "tnotrun:0;"); break;
+			case GDB_TRACE_STOP: strcpy(why, "tstop::0;"); break;
+			case GDB_TRACE_FULL: strcpy(why, "tfull:0;"); break;
+			case GDB_TRACE_PASS: sprintf(why, "tpasscount:%x;", t->stop_tp); break;
+			case GDB_TRACE_ERROR: sprintf(why, "terror::%x;", t->stop_tp); break;
+		}
+		uint32_t size = t->buf_size ? t->buf_size : GDB_TRACE_BUFFER;
+		snprintf(rep, sizeof(rep),
+				"T%d;%stframes:%x;tcreated:%x;tfree:%x;tsize:%x;"
+				"circular:0;disconn:0",
+				t->running, why, t->frames, t->frames, size - t->len, size);
+		gdb_send_reply(g, rep);
+	} else if (!strncmp(cmd, "qTP:", 4)) {
+		char * p = cmd + 4;
+		uint32_t number = strtoul(p, &p, 16);
+		avr_gdb_tracepoint_t * tp = *p == ':' ?
+				gdb_trace_find_tp(g, number, strtoul(p + 1, NULL, 16)) : NULL;
+		if (!tp) {
+			gdb_send_reply(g, "E01");
+			return 1;
+		}
+		sprintf(rep, "V%x:%x", tp->hits, tp->bytes);
+		gdb_send_reply(g, rep);
+	} else
+		return 0;
+	return 1;
 }
 
 static int
@@ -257,6 +1331,16 @@ gdb_read_register(
 		int regi,
 		char * rep )
 {
+	if (g->trace.frame != -1) {
+		// gdb is looking at a trace frame
+		avr_gdb_frame_t f;
+		gdb_trace_frame_get(g, &f);
+		int pos = regi < 33 ? regi : regi == 33 ? 33 : 35;
+		int len = regi < 33 ? 1 : regi == 33 ? 2 : 4;
+		for (int i = 0; i < len && regi < 35; i++)
+			sprintf(rep + i * 2, "%02x", f.reg[pos + i]);
+		return regi < 35 ? len * 2 : 0;
+	}
 	switch (regi) {
 		case 0 ... 31:
 			sprintf(rep, "%02x", g->avr->data[regi]);
@@ -278,22 +1362,392 @@ gdb_read_register(
 	return strlen(rep);
 }
 
+/**
+ * Writes len bytes at a gdb address, returns -1 on error, 0 otherwise.
+ */
+static int
+gdb_write_memory(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint8_t * src,
+		uint32_t len )
+{
+	avr_t * avr = g->avr;
+
+	if (addr <= avr->flashend) {
+		if (len > avr->flashend + 1 - addr)
+			return -1;
+		if (avr_flash_unshare(avr))
+			return -1;
+		memcpy(avr->flash + addr, src, len);
+		avr_predecode_invalidate(avr, addr, len);
+		avr_dirty_mark(avr->dirty.flash, addr, len);
+	} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
+		if (len > avr->ramend + 1 - (addr - 0x800000))
+			return -1;
+		memcpy(avr->data + addr - 0x800000, src, len);
+		avr_dirty_mark(avr->dirty.data, addr - 0x800000, len);
+		avr_io_read_invalidate(avr);
+	} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
+		avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len, .ee = src };
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+	} else
+		return -1;
+	return 0;
+}
+
+/*
+ * Reverse execution. While gdb is connected, the core is snapshotted as it
+ * runs, and the values raised on its inputs (see avr_replay_inputs()) are
+ * logged with their cycle. Going back is restoring the last snapshot
+ * before where to go, and running again, quietly, up to it, with the
+ * logged values raised again on the way. The parts are not snapshotted:
+ * the ones that answer the firmware's outputs answer them again, the
+ * ones that drive inputs on their own, a pty, a thread, should be left
+ * alone while going back and forth. Anything gdb changes (registers,
+ * memory, a reset) isn't in the history, so it starts over from there.
+ */
+static avr_cycle_count_t
+gdb_history_timer(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param )
+{
+	avr_gdb_history_t * h = param;
+
+	while (h->pos < h->len && h->log[h->pos].cycle <= avr->cycle) {
+		avr_gdb_stimulus_t * st = &h->log[h->pos++];
+		// the hook saw the value after IRQ_FLAG_NOT was applied
+		uint32_t v = st->value;
+		if (st->irq->flags & IRQ_FLAG_NOT)
+			v = !v;
+		avr_raise_irq_float(st->irq, v, st->floating);
+	}
+	return h->pos < h->len ? h->log[h->pos].cycle : 0;
+}
+
+// (re)starts raising the logged values, from the current boundary on
+static void
+gdb_history_play(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_history_t * h = &g->history;
+
+	avr_cycle_timer_cancel(avr, gdb_history_timer, h);
+	if (!h->replaying)
+		return;
+	// the ones before the boundary are in the state already
+	uint32_t lo = 0, hi = h->len;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		avr_gdb_stimulus_t * st = &h->log[mid];
+		if (st->cycle > h->boundary || (st->cycle == h->boundary && st->late))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	h->pos = lo;
+	if (h->pos < h->len)
+		avr_cycle_timer_register(avr,
+				h->log[h->pos].cycle > avr->cycle ?
+					h->log[h->pos].cycle - avr->cycle : 0,
+				gdb_history_timer, h);
+}
+
+static void
+gdb_history_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param )
+{
+	avr_gdb_input_t * in = param;
+	avr_gdb_history_t * h = &in->g->history;
+	avr_t * avr = in->g->avr;
+
+	if (h->replaying || !h->count || (in->port && in->port->driving))
+		return;
+	if (h->len == h->size) {
+		uint32_t size = h->size ? h->size * 2 : 256;
+		avr_gdb_stimulus_t * log = realloc(h->log, size * sizeof(*log));
+		if (!log) {
+			AVR_LOG(avr, LOG_ERROR, "GDB: Can't log input %s\n", irq->name);
+			return;
+		}
+		h->log = log;
+		h->size = size;
+	}
+	avr_gdb_stimulus_t * st = &h->log[h->len++];
+	st->cycle = avr->cycle;
+	st->irq = irq;
+	st->value = value;
+	st->floating = !!(irq->flags & IRQ_FLAG_FLOATING);
+	st->late = avr->cycle == h->boundary;
+}
+
+static int
+gdb_history_hook(
+		avr_irq_t * irq,
+		struct avr_ioport_t * port,
+		void * param )
+{
+	avr_gdb_t * g = param;
+	avr_gdb_history_t * h = &g->history;
+
+	avr_gdb_input_t ** input = realloc(h->input, (h->inputs + 1) * sizeof(*input));
+	if (!input)
+		return -1;
+	h->input = input;
+	avr_gdb_input_t * in = malloc(sizeof(*in));
+	if (!in)
+		return -1;
+	in->g = g;
+	in->irq = irq;
+	in->port = port;
+	h->input[h->inputs++] = in;
+	avr_irq_register_notify(irq, gdb_history_notify, in);
+	return 0;
+}
+
+static void
+gdb_history_unhook(
+		avr_gdb_t * g )
+{
+	avr_gdb_history_t * h = &g->history;
+
+	for (uint32_t i = 0; i < h->inputs; i++) {
+		avr_irq_unregister_notify(h->input[i]->irq, gdb_history_notify, h->input[i]);
+		free(h->input[i]);
+	}
+	free(h->input);
+	h->input = NULL;
+	h->inputs = 0;
+}
+
+// forgets it all, it starts again at the next instruction boundary
+static void
+gdb_history_clear(
+		avr_gdb_t * g )
+{
+	avr_gdb_history_t * h = &g->history;
+
+	avr_cycle_timer_cancel(g->avr, gdb_history_timer, h);
+	for (uint32_t i = 0; i < h->count; i++)
+		avr_snapshot_free(h->snap[i].s);
+	h->count = 0;
+	h->len = h->pos = 0;
+	h->replaying = 0;
+	h->interval = GDB_HISTORY_INTERVAL;
+}
+
+/*
+ * Called at every instruction boundary, when the gdb run loop checks in:
+ * takes the snapshots, and goes back to live inputs once the present is
+ * reached again.
+ */
+static void
+gdb_history_boundary(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_history_t * h = &g->history;
+
+	// sleeping calls in again, for the same boundary
+	if (g->s == -1 || (h->count && avr->cycle == h->boundary))
+		return;
+	h->boundary = avr->cycle;
+	if (h->replaying) {
+		if (avr->cycle < h->present)
+			return;
+		h->replaying = 0;
+		avr_cycle_timer_cancel(avr, gdb_history_timer, h);
+	}
+	h->present = avr->cycle;
+	if (avr->state == cpu_Stopped || avr->state == cpu_Done ||
+			avr->state == cpu_Crashed)
+		return;
+	if (h->count && avr->cycle < h->next)
+		return;
+	if (!h->inputs)
+		avr_replay_inputs(avr, gdb_history_hook, g);
+	if (h->count == GDB_HISTORY_SNAPSHOTS) {
+		// keep the first, and every other one after it
+		uint32_t n = 1;
+		for (uint32_t i = 1; i < h->count; i++) {
+			if (i & 1)
+				avr_snapshot_free(h->snap[i].s);
+			else
+				h->snap[n++] = h->snap[i];
+		}
+		h->count = n;
+		h->interval *= 2;
+	}
+	avr_snapshot_t * s = avr_snapshot_save(avr);
+	if (!s) {
+		// not fatal, the previous one is still there, if any
+		h->next = avr->cycle + h->interval;
+		return;
+	}
+	h->snap[h->count].cycle = avr->cycle;
+	h->snap[h->count].s = s;
+	h->count++;
+	h->next = avr->cycle + h->interval;
+}
+
+// restores snapshot 'i', and replays from there
+static int
+gdb_history_restore(
+		avr_gdb_t * g,
+		uint32_t i )
+{
+	avr_gdb_history_t * h = &g->history;
+
+	if (avr_snapshot_restore(g->avr, h->snap[i].s))
+		return -1;
+	h->boundary = h->snap[i].cycle;
+	h->replaying = 1;
+	gdb_history_play(g);
+	return 0;
+}
+
+/*
+ * Runs up to the first instruction boundary at or after 'end', and returns
+ * the last one before it where the core would have stopped: any of them
+ * when 'step' is set, otherwise a breakpoint or a watchpoint; for those,
+ * it's the boundary before the instruction that hit it, as that's where
+ * running backward stops. GDB_HISTORY_NONE if there wasn't one.
+ */
+static avr_cycle_count_t
+gdb_history_rerun(
+		avr_gdb_t * g,
+		avr_cycle_count_t end,
+		int step,
+		int * kind,
+		uint16_t * addr )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_history_t * h = &g->history;
+	avr_cycle_count_t found = GDB_HISTORY_NONE;
+
+	while (avr->cycle < end) {
+		avr_cycle_count_t cycle = avr->cycle;
+		if (step || (avr->pc <= avr->flashend && gdb_bp_map_get(g, avr->pc) &&
+				gdb_bp_stop(g, avr->pc))) {
+			found = cycle;
+			*kind = 0;
+		}
+		if (avr->state == cpu_Done || avr->state == cpu_Crashed)
+			break;
+		// as gdb would have it after a stop, but sleeping stays sleeping
+		if (avr->state != cpu_Sleeping)
+			avr->state = cpu_Running;
+		h->hit = 0;
+		avr->run(avr);
+		if (h->hit) {
+			found = cycle;
+			*kind = h->hit;
+			*addr = h->hit_addr;
+		}
+		if (avr->cycle == cycle)	// it's not going anywhere
+			break;
+	}
+	return found;
+}
+
+/*
+ * Handles 'bs' and 'bc'. Each interval, starting with the last, is run
+ * again to find the last place to stop in it, then once more up to it.
+ */
+static void
+gdb_history_reverse(
+		avr_gdb_t * g,
+		int step )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_history_t * h = &g->history;
+	avr_cycle_count_t now = avr->cycle, end = now;
+	avr_cycle_count_t found = GDB_HISTORY_NONE;
+	int kind = 0;
+	uint16_t addr = 0;
+	int i = h->count - 1;
+
+	while (i >= 0 && h->snap[i].cycle >= now)
+		i--;
+	if (i < 0) {
+		gdb_send_status(g, 0, "replaylog:begin;");
+		return;
+	}
+	h->rerun = 1;
+	for (; i >= 0; i--) {
+		if (gdb_history_restore(g, i))
+			goto error;
+		found = gdb_history_rerun(g, end, step, &kind, &addr);
+		if (found != GDB_HISTORY_NONE)
+			break;
+		end = h->snap[i].cycle;
+	}
+	if (found != GDB_HISTORY_NONE) {
+		int k;
+		uint16_t a;
+		if (gdb_history_restore(g, i))
+			goto error;
+		gdb_history_rerun(g, found, 1, &k, &a);
+		if (avr->cycle != found) {
+			AVR_LOG(avr, LOG_ERROR,
+					"GDB: history diverged, at cycle %lld instead of %lld\n",
+					(long long)avr->cycle, (long long)found);
+			goto error;
+		}
+	} else if (gdb_history_restore(g, 0))	// back at the start of it all
+		goto error;
+	h->rerun = 0;
+	h->boundary = avr->cycle;
+	h->replaying = avr->cycle < h->present;
+	gdb_history_play(g);
+	avr->state = cpu_Stopped;
+	if (found == GDB_HISTORY_NONE)
+		gdb_send_status(g, 0, "replaylog:begin;");
+	else if (kind)
+		gdb_send_watch_status(g, kind, addr);
+	else
+		gdb_send_quick_status(g, 0);
+	return;
+error:
+	// wherever it is now, that's where the history starts again
+	h->rerun = 0;
+	gdb_history_clear(g);
+	avr->state = cpu_Stopped;
+	gdb_send_reply(g, "E01");
+}
+
 static void
 gdb_handle_command(
 		avr_gdb_t * g,
-		char * cmd )
+		char * cmd,
+		uint32_t length )
 {
 	avr_t * avr = g->avr;
-	char rep[1024];
+	char rep[GDB_PACKET_SIZE];
 	uint8_t command = *cmd++;
 	switch (command) {
+		case 'Q':
+			if (!gdb_trace_command(g, cmd - 1))
+				gdb_send_reply(g, "");
+			break;
 		case 'q':
-			if (strncmp(cmd, "Supported", 9) == 0) {
+			if (gdb_trace_command(g, cmd - 1)) {
+				break;
+			} else if (strncmp(cmd, "Supported", 9) == 0) {
 				/* If GDB asked what features we support, report back
-				 * the features we support, which is just memory layout
-				 * information for now.
+				 * the features we support, which is the largest packet
+				 * we take, and memory layout information.
 				 */
-				gdb_send_reply(g, "qXfer:memory-map:read+");
+				snprintf(rep, sizeof(rep),
+						"PacketSize=%x;qXfer:memory-map:read+;"
+						"ReverseStep+;ReverseContinue+;ConditionalBreakpoints+;"
+						"EnableDisableTracepoints+;QTBuffer:size+",
+						GDB_PACKET_SIZE);
+				gdb_send_reply(g, rep);
 				break;
 			} else if (strncmp(cmd, "Attached", 8) == 0) {
 				/* Respond that we are attached to an existing process..
@@ -329,6 +1783,7 @@ gdb_handle_command(
 			uint8_t *src = (uint8_t*)rep;
 			for (int i = 0; i < 35; i++)
 				src += gdb_write_register(g, i, src);
+			gdb_history_clear(g);
 			gdb_send_reply(g, "OK");
 		}	break;
 		case 'g': {	// read all general purpose registers
@@ -352,15 +1807,31 @@ gdb_handle_command(
 			sscanf(cmd, "%x", &regi);
 			read_hex_string(val, (uint8_t*)rep, strlen(val));
 			gdb_write_register(g, regi, (uint8_t*)rep);
+			gdb_history_clear(g);
 			gdb_send_reply(g, "OK");
 		}	break;
 		case 'm': {	// read memory
 			avr_flashaddr_t addr;
 			uint32_t len;
 			sscanf(cmd, "%x,%x", &addr, &len);
+			if (len > sizeof(rep) / 2 - 1)
+				len = sizeof(rep) / 2 - 1;	// gdb asks for the rest after
 			uint8_t * src = NULL;
 			/* GDB seems to also use 0x1800000 for sram ?!?! */
 			addr &= 0xffffff;
+			if (g->trace.frame != -1 && addr > avr->flashend) {
+				// from the trace frame; the flash doesn't change, it's read below
+				uint8_t buf[sizeof(rep) / 2];
+				len = gdb_trace_frame_read(g, addr, buf, len);
+				if (!len) {
+					gdb_send_reply(g, "E01");
+					break;
+				}
+				for (uint32_t i = 0; i < len; i++)
+					sprintf(rep + i * 2, "%02x", buf[i]);
+				gdb_send_reply(g, rep);
+				break;
+			}
 			if (addr < avr->flashend) {
 				src = avr->flash + addr;
 			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
@@ -404,21 +1875,40 @@ gdb_handle_command(
 				gdb_send_reply(g, "E01");
 				break;
 			}
-			if (addr < 0xffff) {
-				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
-				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
-				read_hex_string(start + 1, avr->data + addr - 0x800000, strlen(start+1));
-				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
-				read_hex_string(start + 1, (uint8_t*)rep, strlen(start+1));
-				avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len, .ee = (uint8_t*)rep };
-				avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
-				gdb_send_reply(g, "OK");
-			} else {
+			if (len > sizeof(rep) ||
+					read_hex_string(start + 1, (uint8_t*)rep, len) != len ||
+					gdb_write_memory(g, addr, (uint8_t*)rep, len)) {
+				AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			if (len)
+				gdb_history_clear(g);
+			gdb_send_reply(g, "OK");
+		}	break;
+		case 'X': {	// write memory, binary
+			uint32_t addr, len;
+			sscanf(cmd, "%x,%x", &addr, &len);
+			uint8_t * src = (uint8_t*)strchr(cmd, ':');
+			if (!src) {
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			// undo the escaping, '}' then the byte xor 0x20
+			uint8_t * end = (uint8_t*)cmd - 1 + length;
+			uint8_t * dst = (uint8_t*)rep;
+			for (src++; src < end && dst - (uint8_t*)rep < sizeof(rep); src++)
+				*dst++ = *src == '}' && src + 1 < end ? *++src ^ 0x20 : *src;
+			// gdb sends an empty one first, to see if we know about 'X'
+			if (dst - (uint8_t*)rep != len ||
+					(len && gdb_write_memory(g, addr, (uint8_t*)rep, len))) {
 				AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
 				gdb_send_reply(g, "E01");
+				break;
 			}
+			if (len)
+				gdb_history_clear(g);
+			gdb_send_reply(g, "OK");
 		}	break;
 		case 'c': {	// continue
 			avr->state = cpu_Running;
@@ -429,6 +1919,18 @@ gdb_handle_command(
 		case 'r': {	// deprecated, suggested for AVRStudio compatibility
 			avr->state = cpu_StepDone;
 			avr_reset(avr);
+			gdb_history_clear(g);
+		}	break;
+		case 'b': {	// reverse step, or continue
+			/*
+			 * Only while stopped, then the run loop is calling in at an
+			 * instruction boundary, and the core can be restored.
+			 */
+			if ((*cmd != 's' && *cmd != 'c') || avr->state != cpu_Stopped) {
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			gdb_history_reverse(g, *cmd == 's');
 		}	break;
 		case 'Z': 	// set clear break/watchpoint
 		case 'z': {
@@ -440,10 +1942,12 @@ gdb_handle_command(
 				case 0:	// software breakpoint
 				case 1:	// hardware breakpoint
 					if (addr > avr->flashend ||
-							gdb_change_breakpoint(&g->breakpoints, set, 1 << kind, addr, len) == -1) {
+							gdb_change_breakpoint(&g->breakpoints, set, 1 << kind, addr, len) == -1 ||
+							(set && gdb_bp_condition(g, addr, strchr(cmd, ';')))) {
 						gdb_send_reply(g, "E01");
 						break;
 					}
+					gdb_bp_map_update(g, addr);
 
 					gdb_send_reply(g, "OK");
 					break;
@@ -457,6 +1961,7 @@ gdb_handle_command(
 						gdb_send_reply(g, "E01");
 						break;
 					}
+					gdb_watch_map_update(g);
 
 					gdb_send_reply(g, "OK");
 					break;
@@ -471,88 +1976,345 @@ gdb_handle_command(
 	}
 }
 
+// appends a packet for the core, called with g->lock held
 static int
-gdb_network_handler(
+gdb_queue_packet(
 		avr_gdb_t * g,
-		uint32_t dosleep )
+		const uint8_t * src,
+		uint32_t len )
 {
-	fd_set read_set;
-	int max;
-	FD_ZERO(&read_set);
-
-	if (g->s != -1) {
-		FD_SET(g->s, &read_set);
-		max = g->s + 1;
-	} else {
-		FD_SET(g->listen, &read_set);
-		max = g->listen + 1;
+	uint32_t need = g->queue_len + sizeof(uint32_t) + len + 1;
+
+	if (need > g->queue_size) {
+		uint32_t size = g->queue_size ? g->queue_size : 4096;
+		while (size < need)
+			size *= 2;
+		uint8_t * queue = realloc(g->queue, size);
+		if (!queue)
+			return -1;
+		g->queue = queue;
+		g->queue_size = size;
 	}
-	struct timeval timo = { dosleep / 1000000, dosleep % 1000000 };
-	int ret = select(max, &read_set, NULL, NULL, &timo);
+	memcpy(g->queue + g->queue_len, &len, sizeof(len));
+	memcpy(g->queue + g->queue_len + sizeof(len), src, len);
+	g->queue[g->queue_len + sizeof(len) + len] = 0;
+	g->queue_len = need;
+	return 0;
+}
 
-	if (ret == 0)
-		return 0;
+// server thread: a new connection on the listening socket of 'g'
+static void
+gdb_server_accept(
+		avr_gdb_t * g )
+{
+	int s = accept(g->listen, NULL, NULL);
+
+	if (s == -1) {
+		perror("gdb_server_accept accept");
+		return;
+	}
+	int i = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+	g->conn = s;
+	g->rx_len = 0;
+	pthread_mutex_lock(&g->lock);
+	g->accepted = s;
+	__atomic_store_n(&g->pending, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
 
-	if (FD_ISSET(g->listen, &read_set)) {
-		g->s = accept(g->listen, NULL, NULL);
+// server thread: data on the connection of 'g'
+static void
+gdb_server_read(
+		avr_gdb_t * g )
+{
+	ssize_t r = recv(g->conn, g->rx + g->rx_len, sizeof(g->rx) - g->rx_len, 0);
 
-		if (g->s == -1) {
-			perror("gdb_network_handler accept");
-			sleep(5);
-			return 1;
+	if (r == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	pthread_mutex_lock(&g->lock);
+	if (r <= 0) {
+		if (r == -1)
+			perror("gdb_server_read recv");
+		// the core closes it, unless it didn't even get to see it
+		if (g->accepted == g->conn) {
+			close(g->conn);
+			g->accepted = -1;
+		} else
+			g->closed = 1;
+		g->conn = -1;
+		goto done;
+	}
+	g->rx_len += r;
+	/*
+	 * Big packets can come in several pieces, and several small ones
+	 * in one; queue all the complete ones, keep the rest for later.
+	 * Binary packets escape '#', so the first one ends the payload.
+	 */
+	uint8_t * src = g->rx;
+	uint8_t * end = g->rx + g->rx_len;
+	while (src < end) {
+		// control C -- the core sends the guy a nice status packet
+		if (*src == 3) {
+			src++;
+			g->interrupt = 1;
+			continue;
 		}
-        int i = 1;
-        setsockopt (g->s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
-		g->avr->state = cpu_Stopped;
-		printf("%s connection opened\n", __FUNCTION__);
+		if (*src != '$') {	// acks, and noise
+			src++;
+			continue;
+		}
+		uint8_t * hash = memchr(src, '#', end - src);
+		if (!hash || end - hash < 3)
+			break;
+		DBG(printf("GDB command = '%.*s'\n", (int)(hash - src - 1), src + 1);)
+		send(g->conn, "+", 1, 0);
+		if (gdb_queue_packet(g, src + 1, hash - src - 1))
+			AVR_LOG(g->avr, LOG_ERROR, "GDB: can't queue packet, dropped\n");
+		src = hash + 3;
+	}
+	g->rx_len = end - src;
+	if (g->rx_len == sizeof(g->rx)) {
+		AVR_LOG(g->avr, LOG_ERROR, "GDB: packet too big, dropped\n");
+		g->rx_len = 0;
 	}
+	memmove(g->rx, src, g->rx_len);
+done:
+	if (g->closed || g->interrupt || g->queue_len) {
+		__atomic_store_n(&g->pending, 1, __ATOMIC_RELEASE);
+		pthread_cond_signal(&g->cond);
+	}
+	pthread_mutex_unlock(&g->lock);
+}
 
-	if (g->s != -1 && FD_ISSET(g->s, &read_set)) {
-		uint8_t buffer[1024];
+static void *
+gdb_server_thread(
+		void * param )
+{
+	struct pollfd * fds = NULL;
+	avr_gdb_t ** who = NULL;
+	int size = 0;
+
+	pthread_mutex_lock(&gdb_server.lock);
+	while (gdb_server.running) {
+		// each instance has either its listening socket, or its connection
+		if (size < gdb_server.count + 1) {
+			size = gdb_server.count + 1;
+			struct pollfd * f = realloc(fds, size * sizeof(*fds));
+			avr_gdb_t ** w = realloc(who, size * sizeof(*who));
+			if (f)
+				fds = f;
+			if (w)
+				who = w;
+			if (!f || !w) {
+				AVR_LOG(NULL, LOG_ERROR, "GDB: server out of memory\n");
+				break;
+			}
+		}
+		int n = 0;
+		fds[n].fd = gdb_server.wake[0];
+		fds[n++].events = POLLIN;
+		for (int i = 0; i < gdb_server.count; i++) {
+			avr_gdb_t * g = gdb_server.target[i];
+			who[n] = g;
+			fds[n].fd = g->conn != -1 ? g->conn : g->listen;
+			fds[n++].events = POLLIN;
+		}
+		uint32_t serial = gdb_server.serial;
+		pthread_mutex_unlock(&gdb_server.lock);
 
-		ssize_t r = recv(g->s, buffer, sizeof(buffer)-1, 0);
+		int ret = poll(fds, n, -1);
 
-		if (r == 0) {
-			printf("%s connection closed\n", __FUNCTION__);
-			close(g->s);
-			gdb_watch_clear(&g->breakpoints);
-			gdb_watch_clear(&g->watchpoints);
-			g->avr->state = cpu_Running;	// resume
-			g->s = -1;
-			return 1;
+		pthread_mutex_lock(&gdb_server.lock);
+		if (ret < 0) {
+			if (errno != EINTR) {
+				perror("gdb_server_thread poll");
+				break;
+			}
+			continue;
 		}
-		if (r == -1) {
-			perror("gdb_network_handler recv");
-			sleep(1);
-			return 1;
+		if (fds[0].revents) {
+			char b[64];
+			while (read(gdb_server.wake[0], b, sizeof(b)) == sizeof(b))
+				;
+		}
+		// the list changed, some of these might be gone
+		if (serial != gdb_server.serial)
+			continue;
+		for (int i = 1; i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+			avr_gdb_t * g = who[i];
+			if (fds[i].fd == g->listen)
+				gdb_server_accept(g);
+			else
+				gdb_server_read(g);
 		}
-		buffer[r] = 0;
-	//	printf("%s: received %d bytes\n'%s'\n", __FUNCTION__, r, buffer);
-	//	hdump("gdb", buffer, r);
+	}
+	pthread_mutex_unlock(&gdb_server.lock);
+	free(fds);
+	free(who);
+	return NULL;
+}
 
-		uint8_t * src = buffer;
-		while (*src == '+' || *src == '-')
-			src++;
-		// control C -- lets send the guy a nice status packet
-		if (*src == 3) {
-			src++;
-			g->avr->state = cpu_StepDone;
-			printf("GDB hit control-c\n");
-		}
-		if (*src  == '$') {
-			// strip checksum
-			uint8_t * end = buffer + r - 1;
-			while (end > src && *end != '#')
-				*end-- = 0;
-			*end = 0;
-			src++;
-			DBG(printf("GDB command = '%s'\n", src);)
+// has the server thread look at its list again, called with its lock held
+static void
+gdb_server_wake(void)
+{
+	gdb_server.serial++;
+	// when the pipe is full, it's being woken up already
+	if (write(gdb_server.wake[1], "", 1) < 0 && errno != EAGAIN)
+		perror("gdb_server_wake write");
+}
+
+// adds 'g' to the server, starting it if needed. Returns 0, or -1
+static int
+gdb_server_add(
+		avr_gdb_t * g )
+{
+	int res = -1;
+
+	pthread_mutex_lock(&gdb_server.lock);
+	if (gdb_server.count == gdb_server.size) {
+		int size = gdb_server.size ? gdb_server.size * 2 : 8;
+		avr_gdb_t ** t = realloc(gdb_server.target, size * sizeof(*t));
+		if (!t)
+			goto done;
+		gdb_server.target = t;
+		gdb_server.size = size;
+	}
+	if (!gdb_server.running) {
+		if (pipe(gdb_server.wake))
+			goto done;
+		fcntl(gdb_server.wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(gdb_server.wake[1], F_SETFL, O_NONBLOCK);
+		gdb_server.running = 1;
+		if (pthread_create(&gdb_server.thread, NULL, gdb_server_thread, NULL)) {
+			gdb_server.running = 0;
+			close(gdb_server.wake[0]);
+			close(gdb_server.wake[1]);
+			gdb_server.wake[0] = gdb_server.wake[1] = -1;
+			goto done;
+		}
+	}
+	gdb_server.target[gdb_server.count++] = g;
+	gdb_server_wake();
+	res = 0;
+done:
+	pthread_mutex_unlock(&gdb_server.lock);
+	return res;
+}
 
-			send(g->s, "+", 1, 0);
+/*
+ * Once this returns, the server thread doesn't touch 'g' anymore; the last
+ * one out stops it.
+ */
+static void
+gdb_server_remove(
+		avr_gdb_t * g )
+{
+	int stop = 0;
+
+	pthread_mutex_lock(&gdb_server.lock);
+	for (int i = 0; i < gdb_server.count; i++) {
+		if (gdb_server.target[i] != g)
+			continue;
+		gdb_server.target[i] = gdb_server.target[--gdb_server.count];
+		if (!gdb_server.count) {
+			gdb_server.running = 0;
+			stop = 1;
+		}
+		gdb_server_wake();
+		break;
+	}
+	pthread_mutex_unlock(&gdb_server.lock);
+	if (!stop)
+		return;
+	pthread_join(gdb_server.thread, NULL);
+	pthread_mutex_lock(&gdb_server.lock);
+	close(gdb_server.wake[0]);
+	close(gdb_server.wake[1]);
+	gdb_server.wake[0] = gdb_server.wake[1] = -1;
+	free(gdb_server.target);
+	gdb_server.target = NULL;
+	gdb_server.size = 0;
+	pthread_mutex_unlock(&gdb_server.lock);
+}
 
-			gdb_handle_command(g, (char*)src);
+/*
+ * Handles whatever the server thread has for the core, waiting up to
+ * 'dosleep' usec for something. Returns 1 if there was anything.
+ */
+static int
+gdb_network_handler(
+		avr_gdb_t * g,
+		uint32_t dosleep )
+{
+	if (g->avr->state == cpu_Stopped && dosleep < GDB_STOPPED_WAIT)
+		dosleep = GDB_STOPPED_WAIT;
+
+	pthread_mutex_lock(&g->lock);
+	if (!g->pending && dosleep) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += dosleep / 1000000;
+		until.tv_nsec += (dosleep % 1000000) * 1000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
 		}
+		while (!g->pending &&
+				pthread_cond_timedwait(&g->cond, &g->lock, &until) == 0)
+			;
+	}
+	if (!g->pending) {
+		pthread_mutex_unlock(&g->lock);
+		return 0;
+	}
+	int closed = g->closed, accepted = g->accepted, interrupt = g->interrupt;
+	g->closed = g->interrupt = 0;
+	g->accepted = -1;
+	uint8_t * b = g->work;
+	uint32_t bsize = g->work_size;
+	g->work = g->queue;
+	g->work_len = g->queue_len;
+	g->work_size = g->queue_size;
+	g->queue = b;
+	g->queue_size = bsize;
+	g->queue_len = 0;
+	__atomic_store_n(&g->pending, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&g->lock);
+
+	if (closed) {
+		printf("%s connection closed\n", __FUNCTION__);
+		close(g->s);
+		gdb_watch_clear(&g->breakpoints);
+		gdb_watch_clear(&g->watchpoints);
+		gdb_watch_map_update(g);
+		gdb_trace_clear(g);
+		gdb_bp_map_clear(g);
+		gdb_history_clear(g);
+		g->avr->state = cpu_Running;	// resume
+		g->s = -1;
 	}
+	if (accepted != -1) {
+		g->s = accepted;
+		g->avr->state = cpu_Stopped;
+		printf("%s connection opened\n", __FUNCTION__);
+	}
+	if (interrupt && g->s != -1) {
+		g->avr->state = cpu_StepDone;
+		printf("GDB hit control-c\n");
+	}
+	for (uint32_t pos = 0; pos < g->work_len && g->s != -1; ) {
+		uint32_t len;
+		memcpy(&len, g->work + pos, sizeof(len));
+		pos += sizeof(len);
+		gdb_handle_command(g, (char*)g->work + pos, len);
+		pos += len + 1;
+	}
+	g->work_len = 0;
 	return 1;
 }
 
@@ -575,16 +2337,12 @@ avr_gdb_handle_watchpoints(
 
 	int kind = g->watchpoints.points[i].kind;
 	if (kind & type) {
-		/* Send gdb reply (see GDB user manual appendix E.3). */
-		char cmd[78];
-		sprintf(cmd, "T%02x20:%02x;21:%02x%02x;22:%02x%02x%02x00;%s:%06x;",
-				5, g->avr->data[R_SREG],
-				g->avr->data[R_SPL], g->avr->data[R_SPH],
-				g->avr->pc & 0xff, (g->avr->pc>>8)&0xff, (g->avr->pc>>16)&0xff,
-				kind & AVR_GDB_WATCH_ACCESS ? "awatch" :
-					kind & AVR_GDB_WATCH_WRITE ? "watch" : "rwatch",
-				addr | 0x800000);
-		gdb_send_reply(g, cmd);
+		if (g->history.rerun) {
+			// going back, it's only noted
+			g->history.hit = kind;
+			g->history.hit_addr = addr;
+		} else
+			gdb_send_watch_status(g, kind, addr);
 
 		avr->state = cpu_Stopped;
 	}
@@ -599,17 +2357,30 @@ avr_gdb_processor(
 		return 0;
 	avr_gdb_t * g = avr->gdb;
 
-	if (avr->state == cpu_Running &&
-			gdb_watch_find(&g->breakpoints, avr->pc) != -1) {
-		DBG(printf("avr_gdb_processor hit breakpoint at %08x\n", avr->pc);)
-		gdb_send_quick_status(g, 0);
-		avr->state = cpu_Stopped;
+	if (g->history.rerun)
+		return 0;
+	gdb_history_boundary(g);
+	if (avr->state == cpu_Running) {
+		int hit = avr->pc <= avr->flashend && gdb_bp_map_get(g, avr->pc);
+		// tracepoints are collected, and the breakpoint conditions evaluated
+		if (hit && g->trace.running)
+			gdb_trace_hit(g, avr->pc);
+		if (hit && gdb_bp_stop(g, avr->pc)) {
+			DBG(printf("avr_gdb_processor hit breakpoint at %08x\n", avr->pc);)
+			gdb_send_quick_status(g, 0);
+			avr->state = cpu_Stopped;
+		} else if (!__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE))
+			return 0;
 	} else if (avr->state == cpu_StepDone) {
 		gdb_send_quick_status(g, 0);
 		avr->state = cpu_Stopped;
 	}
 	// this also sleeps for a bit
-	return gdb_network_handler(g, sleep);
+	int res = gdb_network_handler(g, sleep);
+	// the history starts where gdb first lets it go, not an instruction later
+	if (!g->history.count && avr->state != cpu_Stopped)
+		gdb_history_boundary(g);
+	return res;
 }
 
 
@@ -625,6 +2396,12 @@ avr_gdb_init(
 
 	avr->gdb = NULL;
 
+	g->bp_map = calloc((avr->flashend >> 6) + 1, sizeof(g->bp_map[0]));
+	if (!g->bp_map) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: Can't allocate breakpoint map");
+		goto error;
+	}
+
 	if ( network_init() ) {
 		AVR_LOG(avr, LOG_ERROR, "GDB: Can't initialize network");
 		goto error;
@@ -650,9 +2427,19 @@ avr_gdb_init(
 		perror("listen");
 		goto error;
 	}
-	printf("avr_gdb_init listening on port %d\n", avr->gdb_port);
 	g->avr = avr;
-	g->s = -1;
+	g->s = g->conn = g->accepted = -1;
+	g->history.interval = GDB_HISTORY_INTERVAL;
+	g->trace.frame = -1;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	if (gdb_server_add(g)) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: Can't start the server thread\n");
+		pthread_mutex_destroy(&g->lock);
+		pthread_cond_destroy(&g->cond);
+		goto error;
+	}
+	printf("avr_gdb_init listening on port %d\n", avr->gdb_port);
 	avr->gdb = g;
 	// change default run behaviour to use the slightly slower versions
 	avr->run = avr_callback_run_gdb;
@@ -663,6 +2450,7 @@ avr_gdb_init(
 error:
 	if (g->listen >= 0)
 		close(g->listen);
+	free(g->bp_map);
 	free(g);
 
 	return -1;
@@ -676,12 +2464,31 @@ avr_deinit_gdb(
 		return;
 	avr->run = avr_callback_run_raw; // restore normal callbacks
 	avr->sleep = avr_callback_sleep_raw;
+	gdb_server_remove(avr->gdb);
+	// a connection the core didn't get to see yet
+	if (avr->gdb->accepted != -1)
+		close(avr->gdb->accepted);
 	if (avr->gdb->listen != -1)
 		close(avr->gdb->listen);
 	avr->gdb->listen = -1;
 	if (avr->gdb->s != -1)
 		close(avr->gdb->s);
 	avr->gdb->s = -1;
+	avr->gdb_watch = NULL;
+	gdb_history_clear(avr->gdb);
+	gdb_history_unhook(avr->gdb);
+	free(avr->gdb->history.log);
+	gdb_trace_clear(avr->gdb);
+	free(avr->gdb->trace.tp);
+	free(avr->gdb->trace.buf);
+	gdb_watch_free(&avr->gdb->breakpoints);
+	gdb_watch_free(&avr->gdb->watchpoints);
+	free(avr->gdb->watch_map);
+	free(avr->gdb->bp_map);
+	free(avr->gdb->queue);
+	free(avr->gdb->work);
+	pthread_mutex_destroy(&avr->gdb->lock);
+	pthread_cond_destroy(&avr->gdb->cond);
 	free(avr->gdb);
 	avr->gdb = NULL;
 
@@ -37,6 +37,11 @@ enum avr_gdb_watch_type {
 	AVR_GDB_WATCH_ACCESS = AVR_GDB_WATCH_WRITE | AVR_GDB_WATCH_READ,
 };
 
+/*
+ * Listens on avr->gdb_port. The connections of all the instances are
+ * served by one thread, started with the first one; each instance only
+ * handles the packets for it when it checks in with avr_gdb_processor().
+ */
 int avr_gdb_init(avr_t * avr);
 
 void avr_deinit_gdb(avr_t * avr);
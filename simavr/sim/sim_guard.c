@@ -0,0 +1,215 @@
+/*
+	sim_guard.c
+
+	Guard pages after the data space and the flash, so an out of range
+	access faults instead of being checked for at every instruction.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE		// REG_ERR
+#include <stdlib.h>
+#include "sim_guard.h"
+#include "sim_core.h"
+
+uint32_t
+avr_guard_flash_reach(
+		avr_t * avr)
+{
+	// the pc, in bytes, or RAMPZ:Z; 4 for the second word of an opcode
+	uint32_t pc = 1 << (avr->address_size * 8 + 1);
+	uint32_t z = avr->rampz ? 1 << 24 : 1 << 16;
+	return (pc > z ? pc : z) + 4;
+}
+
+#if CONFIG_SIMAVR_GUARD_PAGES
+
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static __thread avr_guard_t * _avr_guard;
+static struct sigaction _avr_guard_old;
+static pthread_once_t _avr_guard_once = PTHREAD_ONCE_INIT;
+
+static int
+_avr_guard_inside(
+		uint8_t * p,
+		uint8_t * space,
+		size_t size,
+		size_t reach,
+		uint32_t * addr)
+{
+	if (!space || p < space + size || p >= space + reach)
+		return 0;
+	*addr = p - space;
+	return 1;
+}
+
+static void
+_avr_guard_handler(
+		int sig,
+		siginfo_t * si,
+		void * context)
+{
+	avr_guard_t * g = _avr_guard;
+
+	if (g) {
+		avr_t * avr = g->avr;
+		uint8_t * p = si->si_addr;
+		if (_avr_guard_inside(p, avr->data, avr->ramend + 1,
+					AVR_GUARD_DATA_REACH, &g->addr))
+			g->space = 'd';
+		else if (_avr_guard_inside(p, avr->flash, avr->flashend + 1,
+					avr_guard_flash_reach(avr), &g->addr))
+			g->space = 'f';
+		if (g->space) {
+			g->write = -1;
+#if defined(__linux__) && defined(__x86_64__)
+			g->write = (((ucontext_t *)context)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#endif
+			siglongjmp(g->jmp, 1);
+		}
+	}
+	if (_avr_guard_old.sa_flags & SA_SIGINFO)
+		_avr_guard_old.sa_sigaction(sig, si, context);
+	else if (_avr_guard_old.sa_handler != SIG_DFL &&
+			_avr_guard_old.sa_handler != SIG_IGN)
+		_avr_guard_old.sa_handler(sig);
+	else	// the access faults again, and is fatal this time
+		sigaction(sig, &_avr_guard_old, NULL);
+}
+
+static void
+_avr_guard_install(void)
+{
+	struct sigaction sa = {
+		.sa_sigaction = _avr_guard_handler,
+		// no mask to restore on the way out, sigsetjmp() stays cheap
+		.sa_flags = SA_SIGINFO | SA_NODEFER,
+	};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &_avr_guard_old);
+}
+
+void
+avr_guard_push(
+		avr_t * avr,
+		avr_guard_t * g)
+{
+	g->avr = avr;
+	g->space = 0;
+	g->prev = _avr_guard;
+	_avr_guard = g;
+}
+
+void
+avr_guard_pop(
+		avr_guard_t * g)
+{
+	avr_t * avr = g->avr;
+
+	_avr_guard = g->prev;
+	if (!g->space)
+		return;
+	if (g->space == 'f') {
+		// running off the end of the flash is a crash, as it always was
+		if (g->addr < avr->pc || g->addr >= avr->pc + 4)
+			AVR_LOG(avr, LOG_ERROR, FONT_RED
+					"CORE: *** Invalid flash read "
+					"PC=%04x SP=%04x Address %06x out of flash (%06x)\n"
+					FONT_DEFAULT,
+					avr->pc, _avr_sp_get(avr), g->addr, avr->flashend);
+	} else if (g->write == 1)
+		AVR_LOG(avr, LOG_ERROR, FONT_RED
+				"CORE: *** Invalid write address "
+				"PC=%04x SP=%04x O=%04x Address %04x out of ram\n"
+				FONT_DEFAULT,
+				avr->pc, _avr_sp_get(avr),
+				avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8), g->addr);
+	else
+		AVR_LOG(avr, LOG_ERROR, FONT_RED
+				"CORE: *** Invalid %s address "
+				"PC=%04x SP=%04x O=%04x Address %04x out of ram (%04x)\n"
+				FONT_DEFAULT, g->write ? "read or write" : "read",
+				avr->pc, _avr_sp_get(avr),
+				avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8),
+				g->addr, avr->ramend);
+	crash(avr);
+}
+
+static size_t
+_avr_guard_round(
+		size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+}
+
+uint8_t *
+avr_guard_alloc(
+		size_t size,
+		size_t reach)
+{
+	pthread_once(&_avr_guard_once, _avr_guard_install);
+	size_t lead = _avr_guard_round(size);
+	size_t guard = _avr_guard_round(reach > size ? reach - size : 1);
+	uint8_t * base = mmap(NULL, lead + guard, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	if (mprotect(base, lead, PROT_READ | PROT_WRITE)) {
+		munmap(base, lead + guard);
+		return NULL;
+	}
+	return base + lead - size;
+}
+
+void
+avr_guard_free(
+		uint8_t * p,
+		size_t size,
+		size_t reach)
+{
+	if (!p)
+		return;
+	size_t lead = _avr_guard_round(size);
+	size_t guard = _avr_guard_round(reach > size ? reach - size : 1);
+	munmap(p + size - lead, lead + guard);
+}
+
+#else
+
+uint8_t *
+avr_guard_alloc(
+		size_t size,
+		size_t reach)
+{
+	return malloc(size);
+}
+
+void
+avr_guard_free(
+		uint8_t * p,
+		size_t size,
+		size_t reach)
+{
+	free(p);
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+	sim_guard.h
+
+	Guard pages after the data space and the flash, so an out of range
+	access faults instead of being checked for at every instruction.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_GUARD_H__
+#define __SIM_GUARD_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * With CONFIG_SIMAVR_GUARD_PAGES=1, avr->data and avr->flash are mapped
+ * so their last byte is the last of a page, followed by as many PROT_NONE
+ * pages as a 16 bits data address, or a pc or RAMPZ:Z, can reach. The core
+ * then drops its ramend and flashend tests; instead, avr_run() and
+ * avr_run_cycles() catch the SIGSEGV, report it as the tests did, and
+ * crash() the core. Any other fault goes to the handler that was there.
+ *
+ * It's a build option because testing for it at run time costs as much as
+ * the tests it removes. Without it, the alloc and free below are malloc()
+ * and free(), and AVR_GUARDED() is just the call.
+ */
+#ifndef CONFIG_SIMAVR_GUARD_PAGES
+#define CONFIG_SIMAVR_GUARD_PAGES 0
+#endif
+
+#if CONFIG_SIMAVR_GUARD_PAGES
+#ifdef __MINGW32__
+#error "CONFIG_SIMAVR_GUARD_PAGES needs mmap() and sigaction()"
+#endif
+#include <setjmp.h>
+
+typedef struct avr_guard_t {
+	struct avr_t *			avr;
+	struct avr_guard_t *	prev;		// the one this one is nested in
+	sigjmp_buf				jmp;
+	char					space;		// 'd'ata or 'f'lash, 0 if no fault
+	int						write;		// -1 if the host doesn't tell
+	uint32_t				addr;
+} avr_guard_t;
+
+void
+avr_guard_push(
+		struct avr_t * avr,
+		avr_guard_t * g );
+// reports and crash()es the core if there was a fault
+void
+avr_guard_pop(
+		avr_guard_t * g );
+
+#define AVR_GUARDED(_avr, _call) do { \
+		avr_guard_t _g; \
+		avr_guard_push(_avr, &_g); \
+		if (!sigsetjmp(_g.jmp, 0)) \
+			_call; \
+		avr_guard_pop(&_g); \
+	} while (0)
+#else
+#define AVR_GUARDED(_avr, _call) _call
+#endif
+
+// how far past the start of each space an address can point
+#define AVR_GUARD_DATA_REACH	0x10002
+uint32_t
+avr_guard_flash_reach(
+		struct avr_t * avr );
+
+uint8_t *
+avr_guard_alloc(
+		size_t size,
+		size_t reach );
+void
+avr_guard_free(
+		uint8_t * p,
+		size_t size,
+		size_t reach );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_GUARD_H__ */
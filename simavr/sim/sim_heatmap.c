@@ -0,0 +1,164 @@
+/*
+	sim_heatmap.c
+
+	SRAM access counts, and stack high water mark.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_heatmap.h"
+#include "sim_core.h"
+#include "sim_elf.h"
+
+int
+avr_heatmap_init(
+		avr_t * avr,
+		avr_heatmap_t * h,
+		uint32_t bucket)
+{
+	if (avr->heatmap) {
+		AVR_LOG(avr, LOG_ERROR, "HEATMAP: already counting\n");
+		return -1;
+	}
+	if (!bucket || (bucket & (bucket - 1))) {
+		AVR_LOG(avr, LOG_ERROR, "HEATMAP: bucket size %u isn't a power of two\n",
+				bucket);
+		return -1;
+	}
+	memset(h, 0, sizeof(*h));
+	h->start = 32 + avr->io_count;
+	h->size = avr->ramend + 1 - h->start;
+	while ((1u << h->shift) < bucket)
+		h->shift++;
+	h->buckets = ((uint32_t)h->size + bucket - 1) >> h->shift;
+	h->read = calloc(h->buckets, sizeof(h->read[0]));
+	h->write = calloc(h->buckets, sizeof(h->write[0]));
+	if (!h->read || !h->write) {
+		AVR_LOG(avr, LOG_ERROR, "HEATMAP: can't allocate the counters\n");
+		avr_heatmap_free(h);
+		return -1;
+	}
+	h->sp_start = h->sp_min = _avr_sp_get(avr);
+	h->sp_min_pc = avr->pc;
+	h->sp_min_cycle = avr->cycle;
+	h->avr = avr;
+	avr->heatmap = h;
+	return 0;
+}
+
+void
+avr_heatmap_stop(
+		avr_heatmap_t * h)
+{
+	if (!h->avr)
+		return;
+	h->avr->heatmap = NULL;
+	h->avr = NULL;
+}
+
+void
+avr_heatmap_free(
+		avr_heatmap_t * h)
+{
+	avr_heatmap_stop(h);
+	free(h->read);
+	free(h->write);
+	h->read = h->write = NULL;
+}
+
+typedef struct _avr_heatmap_obj_t {
+	const char *	name;
+	uint32_t		addr;		// data address
+	uint64_t		read, write;
+} _avr_heatmap_obj_t;
+
+static int
+_avr_heatmap_cmp(
+		const void * a,
+		const void * b)
+{
+	const _avr_heatmap_obj_t * oa = a, * ob = b;
+	uint64_t ta = oa->read + oa->write, tb = ob->read + ob->write;
+	return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+/*
+ * Folds the buckets into one entry per data symbol, plus one for what's
+ * before the first one, and one for what the stack used; a bucket goes
+ * to the object its first byte is in, but for the stack's.
+ */
+void
+avr_heatmap_report(
+		avr_heatmap_t * h,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		int top,
+		FILE * out)
+{
+	_avr_heatmap_obj_t * obj = calloc(symbolcount + 2, sizeof(*obj));
+	// the bucket the stack bottom is in is the stack's
+	uint32_t stack_addr = h->start +
+			(((h->sp_min + 1 - h->start) >> h->shift) << h->shift);
+	int n = 0;
+
+	if (!obj)
+		return;
+	obj[0].name = "(unknown)";
+	obj[0].addr = h->start;
+	for (uint32_t si = 0; si < symbolcount; si++) {
+		uint32_t addr = symbol[si]->addr - AVR_SEGMENT_OFFSET_DATA;
+		if (symbol[si]->addr < AVR_SEGMENT_OFFSET_DATA ||
+				addr < h->start || addr >= stack_addr)
+			continue;
+		if (n && obj[n].addr == addr) {
+			obj[n].name = symbol[si]->symbol;
+			continue;
+		}
+		n++;
+		obj[n].name = symbol[si]->symbol;
+		obj[n].addr = addr;
+	}
+	int stack = ++n;
+	obj[stack].name = "(stack)";
+	obj[stack].addr = stack_addr;
+	n++;
+	for (uint32_t b = 0, o = 0; b < h->buckets; b++) {
+		uint32_t addr = h->start + (b << h->shift);
+		while (o + 1 < n && obj[o + 1].addr <= addr)
+			o++;
+		obj[o].read += h->read[b];
+		obj[o].write += h->write[b];
+	}
+
+	fprintf(out, "heatmap: stack from %04x down to %04x, %u bytes, "
+			"at pc %04x cycle %" PRIu64 "\n",
+			h->sp_start, h->sp_min, h->sp_start - h->sp_min,
+			h->sp_min_pc, (uint64_t)h->sp_min_cycle);
+	avr_symbol_t * fn = avr_symbol_find(symbol, symbolcount, h->sp_min_pc);
+	if (fn && fn->addr < AVR_SEGMENT_OFFSET_DATA)
+		fprintf(out, "heatmap: in %s+0x%x\n", fn->symbol,
+				h->sp_min_pc - fn->addr);
+	qsort(obj, n, sizeof(*obj), _avr_heatmap_cmp);
+	fprintf(out, "heatmap: %12s %12s  addr object\n", "reads", "writes");
+	for (int i = 0; i < n && (!top || i < top) && (obj[i].read || obj[i].write); i++)
+		fprintf(out, "         %12" PRIu64 " %12" PRIu64 "  %04x %s\n",
+				obj[i].read, obj[i].write, obj[i].addr, obj[i].name);
+	free(obj);
+}
@@ -0,0 +1,118 @@
+/*
+	sim_heatmap.h
+
+	SRAM access counts, and stack high water mark.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_HEATMAP_H__
+#define __SIM_HEATMAP_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counts the reads and writes the firmware does to each SRAM address, or
+ * to each bucket of 2^shift of them, and the lowest the stack pointer
+ * went with where the firmware was then. The core's SRAM accessors only
+ * test avr->heatmap, like they do for the gdb watchpoints; the bulk copy
+ * loop shortcut is off while it's set.
+ */
+typedef struct avr_heatmap_t {
+	struct avr_t *		avr;
+	uint16_t			start;		// first SRAM address, after the IOs
+	uint16_t			size;		// bytes of SRAM
+	uint8_t				shift;		// log2 of the bucket size
+	uint32_t			buckets;
+	uint64_t *			read;		// per bucket
+	uint64_t *			write;
+	uint16_t			sp_start;	// SP when counting started
+	uint16_t			sp_min;
+	avr_flashaddr_t		sp_min_pc;
+	avr_cycle_count_t	sp_min_cycle;
+} avr_heatmap_t;
+
+/*
+ * Starts counting, with 'bucket' bytes per counter, a power of two.
+ * Returns zero if all is well
+ */
+int
+avr_heatmap_init(
+		struct avr_t * avr,
+		avr_heatmap_t * h,
+		uint32_t bucket );
+// stops counting, the counts are kept until avr_heatmap_free()
+void
+avr_heatmap_stop(
+		avr_heatmap_t * h );
+void
+avr_heatmap_free(
+		avr_heatmap_t * h );
+/*
+ * Prints the stack high water mark, and the 'top' (all if zero) data
+ * objects by accesses, folded by the .data/.bss symbols of the firmware
+ */
+void
+avr_heatmap_report(
+		avr_heatmap_t * h,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		int top,
+		FILE * out );
+
+// called by the core
+static inline void
+avr_heatmap_read(
+		avr_heatmap_t * h,
+		uint16_t addr )
+{
+	uint16_t i = addr - h->start;
+	if (i < h->size)
+		h->read[i >> h->shift]++;
+}
+
+static inline void
+avr_heatmap_write(
+		avr_heatmap_t * h,
+		uint16_t addr )
+{
+	uint16_t i = addr - h->start;
+	if (i < h->size)
+		h->write[i >> h->shift]++;
+}
+
+static inline void
+avr_heatmap_sp(
+		avr_heatmap_t * h,
+		uint16_t sp )
+{
+	if (sp < h->sp_min) {
+		h->sp_min = sp;
+		h->sp_min_pc = h->avr->pc;
+		h->sp_min_cycle = h->avr->cycle;
+	}
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_HEATMAP_H__ */
@@ -45,6 +45,14 @@ void hdump(const char *w, uint8_t *b, size_t l)
 	printf("\n");
 }
 
+// value + 1 of each hex digit, 0 for anything else
+static const uint8_t ihex_nibble[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
     // decode line text hex to binary
 int read_hex_string(const char * src, uint8_t * buffer, int maxlen)
 {
@@ -52,18 +60,16 @@ int read_hex_string(const char * src, uint8_t * buffer, int maxlen)
     int ls = 0;
     uint8_t b = 0;
     while (*src && maxlen) {
-        char c = *src++;
-        switch (c) {
-            case 'a' ... 'f':   b = (b << 4) | (c - 'a' + 0xa); break;
-            case 'A' ... 'F':   b = (b << 4) | (c - 'A' + 0xa); break;
-            case '0' ... '9':   b = (b << 4) | (c - '0'); break;
-            default:
-                if (c > ' ') {
-                    fprintf(stderr, "%s: huh '%c' (%s)\n", __FUNCTION__, c, src);
-                    return -1;
-                }
-                continue;
+        uint8_t c = *src++;
+        uint8_t n = ihex_nibble[c];
+        if (!n) {
+            if (c > ' ') {
+                fprintf(stderr, "%s: huh '%c' (%s)\n", __FUNCTION__, c, src);
+                return -1;
+            }
+            continue;
         }
+        b = (b << 4) | (n - 1);
         if (ls & 1) {
             *dst++ = b; b = 0;
             maxlen--;
@@ -74,96 +80,238 @@ int read_hex_string(const char * src, uint8_t * buffer, int maxlen)
     return dst - buffer;
 }
 
-void
-free_ihex_chunks(
-		ihex_chunk_p chunks)
-{
-	if (!chunks)
-		return;
-	for (int i = 0; chunks[i].size; i++)
-		if (chunks[i].data)
-			free(chunks[i].data);
-}
+// called for each data record, with its absolute address
+typedef int (*ihex_record_p)(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint8_t len);
 
-int
-read_ihex_chunks(
+/*
+ * Reads the whole file, then decodes and checks each record in one pass
+ * over it. Returns 0, or -1 if the file is broken; the records before
+ * the broken one were passed to 'record' already.
+ */
+static int
+_ihex_parse(
 		const char * fname,
-		ihex_chunk_p * chunks )
+		ihex_record_p record,
+		void * param)
 {
-	if (!fname || !chunks)
-		return -1;
-	FILE * f = fopen(fname, "r");
+	FILE * f = fopen(fname, "rb");
 	if (!f) {
 		perror(fname);
 		return -1;
 	}
+	long size = -1;
+	uint8_t * buf = NULL;
+	if (fseek(f, 0, SEEK_END) == 0)
+		size = ftell(f);
+	if (size >= 0 && (buf = malloc(size + 1)) != NULL &&
+			(fseek(f, 0, SEEK_SET) || fread(buf, 1, size, f) != (size_t)size)) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	if (!buf) {
+		perror(fname);
+		return -1;
+	}
+	buf[size] = 0;
+	const uint8_t * s = buf, * end = buf + size;
 	uint32_t segment = 0;	// segment address
-	int chunk = 0, max_chunks = 0;
-	*chunks = NULL;
+	int res = 0;
 
-	while (!feof(f)) {
-		char line[128];
-		if (!fgets(line, sizeof(line)-1, f))
+	while (s < end) {
+		if (*s <= ' ') {
+			s++;
 			continue;
-		if (line[0] != ':') {
-			fprintf(stderr, "AVR: '%s' invalid ihex format (%.4s)\n", fname, line);
+		}
+		if (*s != ':') {
+			fprintf(stderr, "AVR: '%s' invalid ihex format (%.4s)\n", fname, s);
+			res = -1;
 			break;
 		}
-		uint8_t bline[64];
-
-		int len = read_hex_string(line + 1, bline, sizeof(bline));
-		if (len <= 0)
-			continue;
-
+		s++;
+		// count, address, type, up to 255 bytes and the checksum
+		uint8_t bline[5 + 255];
+		int len = 0, bad = 0;
 		uint8_t chk = 0;
-		{	// calculate checksum
-			uint8_t * src = bline;
-			int tlen = len-1;
-			while (tlen--)
-				chk += *src++;
-			chk = 0x100 - chk;
+		while (s < end && *s != '\n') {
+			uint8_t h = ihex_nibble[s[0]], l = s + 1 < end ? ihex_nibble[s[1]] : 0;
+			if (h && l) {
+				uint8_t b = ((h - 1) << 4) | (l - 1);
+				if (len < sizeof(bline))
+					bline[len++] = b;
+				else
+					bad = 1;
+				chk += b;
+				s += 2;
+			} else if (*s <= ' ')
+				s++;
+			else {
+				bad = 1;
+				s++;
+			}
+		}
+		if (bad) {	// skipped, like lines with garbage always were
+			fprintf(stderr, "%s: %s, invalid record skipped at offset %ld\n",
+					__FUNCTION__, fname, (long)(s - buf));
+			continue;
 		}
-		if (chk != bline[len-1]) {
-			fprintf(stderr, "%s: %s, invalid checksum %02x/%02x\n", __FUNCTION__, fname, chk, bline[len-1]);
+		if (len < 5 || len != bline[0] + 5 || chk) {
+			fprintf(stderr, "%s: %s, invalid record at offset %ld\n", __FUNCTION__,
+					fname, (long)(s - buf));
+			res = -1;
 			break;
 		}
-		uint32_t addr = 0;
 		switch (bline[3]) {
 			case 0: // normal data
-				addr = segment | (bline[1] << 8) | bline[2];
+				if (bline[0] && record(param,
+						segment + ((bline[1] << 8) | bline[2]), bline + 4, bline[0]))
+					res = -1;
 				break;
 			case 1: // end of file
-				continue;
+				break;
 			case 2: // extended address 2 bytes
 				segment = ((bline[4] << 8) | bline[5]) << 4;
-				continue;
+				break;
 			case 4:
 				segment = ((bline[4] << 8) | bline[5]) << 16;
-				continue;
+				break;
 			default:
 				fprintf(stderr, "%s: %s, unsupported check type %02x\n", __FUNCTION__, fname, bline[3]);
-				continue;
-		}
-		if (chunk < max_chunks && addr != ((*chunks)[chunk].baseaddr + (*chunks)[chunk].size)) {
-			if ((*chunks)[chunk].size)
-				chunk++;
-		}
-		if (chunk >= max_chunks) {
-			max_chunks++;
-			/* Here we allocate and zero an extra chunk, to act as terminator */
-			*chunks = realloc(*chunks, (1 + max_chunks) * sizeof(ihex_chunk_t));
-			memset(*chunks + chunk, 0,
-					(1 + (max_chunks - chunk)) * sizeof(ihex_chunk_t));
-			(*chunks)[chunk].baseaddr = addr;
+				break;
 		}
-		(*chunks)[chunk].data = realloc((*chunks)[chunk].data,
-									(*chunks)[chunk].size + bline[0]);
-		memcpy((*chunks)[chunk].data + (*chunks)[chunk].size,
-				bline + 4, bline[0]);
-		(*chunks)[chunk].size += bline[0];
+		if (res)
+			break;
 	}
-	fclose(f);
-	return max_chunks;
+	free(buf);
+	return res;
+}
+
+void
+free_ihex_chunks(
+		ihex_chunk_p chunks)
+{
+	if (!chunks)
+		return;
+	for (int i = 0; chunks[i].size; i++)
+		if (chunks[i].data)
+			free(chunks[i].data);
+}
+
+typedef struct ihex_chunks_t {
+	ihex_chunk_p chunks;
+	int chunk, max_chunks;
+	uint32_t alloc;		// of the data of the last chunk
+} ihex_chunks_t;
+
+static int
+_ihex_chunks_record(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint8_t len)
+{
+	ihex_chunks_t * c = param;
+
+	if (c->chunk < c->max_chunks &&
+			addr != c->chunks[c->chunk].baseaddr + c->chunks[c->chunk].size) {
+		c->chunk++;
+		c->alloc = 0;
+	}
+	if (c->chunk >= c->max_chunks) {
+		/* Here we allocate and zero an extra chunk, to act as terminator */
+		ihex_chunk_p n = realloc(c->chunks, (2 + c->max_chunks) * sizeof(ihex_chunk_t));
+		if (!n)
+			return -1;
+		c->chunks = n;
+		c->max_chunks++;
+		memset(c->chunks + c->chunk, 0, 2 * sizeof(ihex_chunk_t));
+		c->chunks[c->chunk].baseaddr = addr;
+	}
+	ihex_chunk_p ch = c->chunks + c->chunk;
+	if (ch->size + len > c->alloc) {
+		uint32_t alloc = c->alloc ? c->alloc * 2 : 4096;
+		while (alloc < ch->size + len)
+			alloc *= 2;
+		uint8_t * d = realloc(ch->data, alloc);
+		if (!d)
+			return -1;
+		ch->data = d;
+		c->alloc = alloc;
+	}
+	memcpy(ch->data + ch->size, data, len);
+	ch->size += len;
+	return 0;
+}
+
+int
+read_ihex_chunks(
+		const char * fname,
+		ihex_chunk_p * chunks )
+{
+	if (!fname || !chunks)
+		return -1;
+	ihex_chunks_t c = { 0 };
+
+	// a broken file still returns the chunks read up to there
+	_ihex_parse(fname, _ihex_chunks_record, &c);
+	*chunks = c.chunks;
+	return c.max_chunks;
+}
+
+typedef struct ihex_images_t {
+	ihex_image_p image;
+	int count;
+	const char * fname;
+} ihex_images_t;
+
+static int
+_ihex_image_record(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint8_t len)
+{
+	ihex_images_t * im = param;
+
+	for (int i = 0; i < im->count; i++) {
+		ihex_image_p m = im->image + i;
+		if (addr < m->base || addr - m->base > m->size ||
+				len > m->size - (addr - m->base))
+			continue;
+		memcpy(m->data + (addr - m->base), data, len);
+		if (m->start == m->end || addr < m->start)
+			m->start = addr;
+		if (addr + len > m->end)
+			m->end = addr + len;
+		return 0;
+	}
+	fprintf(stderr, "%s: %s, %d bytes at %08x don't fit\n", __FUNCTION__,
+			im->fname, len, addr);
+	return -1;
+}
+
+int
+read_ihex_image(
+		const char * fname,
+		ihex_image_p image,
+		int count )
+{
+	if (!fname || !image)
+		return -1;
+	ihex_images_t im = { .image = image, .count = count, .fname = fname };
+	for (int i = 0; i < count; i++)
+		image[i].start = image[i].end = 0;
+	if (_ihex_parse(fname, _ihex_image_record, &im))
+		return -1;
+	int res = 0;
+	for (int i = 0; i < count; i++)
+		if (image[i].end)
+			res++;
+	return res;
 }
 
 
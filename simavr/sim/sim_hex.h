@@ -58,6 +58,26 @@ void
 free_ihex_chunks(
 		ihex_chunk_p chunks);
 
+// a buffer read_ihex_image() decodes the records from 'base' onward into
+typedef struct ihex_image_t {
+	uint32_t base;		// address of data[0] in the .hex file
+	uint32_t size;		// of 'data'
+	uint8_t * data;
+	uint32_t start, end;	// range of the addresses it got, both 0 if none
+} ihex_image_t, *ihex_image_p;
+
+/*
+ * Reads a .hex file straight into the 'count' buffers of 'image', without
+ * making chunks of it first; what isn't in a record is left untouched.
+ * Returns how many of the buffers got some data, or -1 if the file is
+ * broken or has data that doesn't fit in any of them.
+ */
+int
+read_ihex_image(
+		const char * fname,
+		ihex_image_p image,
+		int count );
+
 // reads IHEX file 'fname', puts it's decoded size in *'dsize' and returns
 // a newly allocated buffer with the binary data (or NULL, if error)
 uint8_t *
@@ -0,0 +1,178 @@
+/*
+	sim_inject.c
+
+	Lets host threads hand work to the thread running the simulation.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_inject.h"
+
+/*
+ * The queue is a stack, pushed with a compare and swap by the producers,
+ * and taken whole by the simulation, which reverses it to get the order
+ * they were posted in.
+ */
+void
+avr_inject_post(
+		avr_t * avr,
+		avr_inject_t * e)
+{
+	avr_inject_t * head = __atomic_load_n(&avr->inject, __ATOMIC_RELAXED);
+	do
+		e->next = head;
+	while (!__atomic_compare_exchange_n(&avr->inject, &head, e, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void
+avr_inject_drain(
+		avr_t * avr)
+{
+	avr_inject_t * e = __atomic_exchange_n(&avr->inject, NULL, __ATOMIC_ACQUIRE);
+	avr_inject_t * list = NULL;
+
+	while (e) {
+		avr_inject_t * next = e->next;
+		e->next = list;
+		list = e;
+		e = next;
+	}
+	while (list) {
+		e = list;
+		list = e->next;
+		e->run(avr, e);
+	}
+}
+
+typedef struct avr_inject_irq_t {
+	avr_inject_t	e;
+	avr_irq_t *		irq;
+	uint32_t		len;
+	uint32_t		value;
+	uint8_t			buf[];
+} avr_inject_irq_t;
+
+static void
+_avr_inject_raise(
+		avr_t * avr,
+		avr_inject_t * e)
+{
+	avr_inject_irq_t * r = (avr_inject_irq_t *)e;
+	avr_raise_irq(r->irq, r->value);
+	free(r);
+}
+
+static void
+_avr_inject_bytes(
+		avr_t * avr,
+		avr_inject_t * e)
+{
+	avr_inject_irq_t * r = (avr_inject_irq_t *)e;
+	for (uint32_t i = 0; i < r->len; i++)
+		avr_raise_irq(r->irq, r->buf[i]);
+	free(r);
+}
+
+int
+avr_inject_raise(
+		avr_t * avr,
+		avr_irq_t * irq,
+		uint32_t value)
+{
+	avr_inject_irq_t * r = malloc(sizeof(*r));
+	if (!r)
+		return -1;
+	r->e.run = _avr_inject_raise;
+	r->irq = irq;
+	r->value = value;
+	avr_inject_post(avr, &r->e);
+	return 0;
+}
+
+int
+avr_inject_bytes(
+		avr_t * avr,
+		avr_irq_t * irq,
+		const uint8_t * buf,
+		uint32_t len)
+{
+	avr_inject_irq_t * r = malloc(sizeof(*r) + len);
+	if (!r)
+		return -1;
+	r->e.run = _avr_inject_bytes;
+	r->irq = irq;
+	r->len = len;
+	memcpy(r->buf, buf, len);
+	avr_inject_post(avr, &r->e);
+	return 0;
+}
+
+typedef struct avr_inject_call_t {
+	avr_inject_t	e;
+	int (*fn)(avr_t * avr, void * param);
+	void *			param;
+	int				res;
+	int				done;	// when waited for
+	uint8_t			wait;
+} avr_inject_call_t;
+
+static void
+_avr_inject_call(
+		avr_t * avr,
+		avr_inject_t * e)
+{
+	avr_inject_call_t * c = (avr_inject_call_t *)e;
+	int res = c->fn(avr, c->param);
+	if (c->wait) {
+		// it's on the waiter's stack, it can be gone once 'done' is set
+		c->res = res;
+		__atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+	} else
+		free(c);
+}
+
+int
+avr_inject_call(
+		avr_t * avr,
+		int (*fn)(avr_t * avr, void * param),
+		void * param)
+{
+	avr_inject_call_t * c = malloc(sizeof(*c));
+	if (!c)
+		return -1;
+	*c = (avr_inject_call_t) {
+		.e.run = _avr_inject_call, .fn = fn, .param = param };
+	avr_inject_post(avr, &c->e);
+	return 0;
+}
+
+int
+avr_inject_call_wait(
+		avr_t * avr,
+		int (*fn)(avr_t * avr, void * param),
+		void * param)
+{
+	avr_inject_call_t c = {
+		.e.run = _avr_inject_call, .fn = fn, .param = param, .wait = 1 };
+	avr_inject_post(avr, &c.e);
+	while (!__atomic_load_n(&c.done, __ATOMIC_ACQUIRE))
+		usleep(10);
+	return c.res;
+}
@@ -0,0 +1,101 @@
+/*
+	sim_inject.h
+
+	Lets host threads hand work to the thread running the simulation.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_INJECT_H__
+#define __SIM_INJECT_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Nothing in the core is thread safe: a part running a thread (a pty, a
+ * socket, a usb host) mustn't raise irqs or call ioctls from there.
+ * Instead it posts them here, from any number of threads, without locks;
+ * the run loop picks them up between two batches of instructions and
+ * runs them in the order they were posted, in the simulation thread,
+ * at the cost of a single load while there are none.
+ *
+ * An entry is usually embedded in the part's own state, and reposted once
+ * it ran; it's no longer used by the queue when its 'run' is called. The
+ * helpers below allocate their own.
+ */
+typedef struct avr_inject_t {
+	struct avr_inject_t * next;
+	void (*run)(
+			struct avr_t * avr,
+			struct avr_inject_t * e);
+} avr_inject_t;
+
+// from any thread
+void
+avr_inject_post(
+		avr_t * avr,
+		avr_inject_t * e );
+// raises 'irq' with 'value'. Returns 0, or -1 if out of memory
+int
+avr_inject_raise(
+		avr_t * avr,
+		avr_irq_t * irq,
+		uint32_t value );
+// raises 'irq' with each of the 'len' bytes of 'buf', that's copied
+int
+avr_inject_bytes(
+		avr_t * avr,
+		avr_irq_t * irq,
+		const uint8_t * buf,
+		uint32_t len );
+// calls 'fn' in the simulation thread
+int
+avr_inject_call(
+		avr_t * avr,
+		int (*fn)(avr_t * avr, void * param),
+		void * param );
+/*
+ * Same, but waits for 'fn' to have run, and returns what it returned. The
+ * simulation has to be running, or terminated, for it to return.
+ */
+int
+avr_inject_call_wait(
+		avr_t * avr,
+		int (*fn)(avr_t * avr, void * param),
+		void * param );
+
+// runs the entries posted so far, in the simulation thread
+void
+avr_inject_drain(
+		avr_t * avr );
+
+static inline void
+avr_inject_poll(
+		avr_t * avr )
+{
+	if (__atomic_load_n(&avr->inject, __ATOMIC_RELAXED))
+		avr_inject_drain(avr);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_INJECT_H__ */
@@ -27,8 +27,9 @@
 #include "sim_interrupts.h"
 #include "sim_avr.h"
 #include "sim_core.h"
-
-DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
+#include "sim_callgraph.h"
+#include "sim_stats.h"
+#include "sim_trace_file.h"
 
 void
 avr_interrupt_init(
@@ -50,12 +51,81 @@ avr_interrupt_reset(
 	avr_int_table_p table = &avr->interrupts;
 
 	table->running_ptr = 0;
-	avr_int_pending_reset(&table->pending);
+	table->pending = 0;
 	avr->interrupt_state = 0;
 	for (int i = 0; i < table->vector_count; i++)
 		table->vector[i]->pending = 0;
 }
 
+void
+avr_interrupt_free(
+		avr_t * avr )
+{
+	avr_int_table_p table = &avr->interrupts;
+
+	free(table->vector);
+	free(table->running);
+	free(table->running_start);
+	table->vector = table->running = NULL;
+	table->running_start = NULL;
+	table->vector_count = table->running_ptr = 0;
+	table->vector_alloc = table->running_alloc = 0;
+}
+
+void
+avr_interrupt_storm_set(
+		avr_t * avr,
+		avr_int_storm_t * storm)
+{
+	avr_int_table_p table = &avr->interrupts;
+
+	table->storm = storm;
+	for (int i = 0; i < table->vector_count; i++) {
+		avr_int_stats_t * s = &table->vector[i]->stats;
+		s->back_to_back = s->window_count = 0;
+		s->window_start = avr->cycle;
+		s->reti_cycle = 0;
+	}
+}
+
+/*
+ * Called when 'vector' is serviced, interrupting 'pc'. Returns non-zero
+ * if it's just become a storm
+ */
+static int
+_avr_interrupt_storm(
+		avr_t * avr,
+		avr_int_vector_t * vector,
+		uint32_t pc)
+{
+	avr_int_storm_t * storm = avr->interrupts.storm;
+	avr_int_stats_t * s = &vector->stats;
+	avr_cycle_count_t gap = storm->gap ? storm->gap : AVR_INT_STORM_GAP;
+	uint32_t run = storm->run ? storm->run : AVR_INT_STORM_RUN;
+	int storming = 0;
+
+	if (s->reti_cycle && avr->cycle - s->reti_cycle <= gap)
+		storming = ++s->back_to_back == run;
+	else
+		s->back_to_back = 0;
+	if (storm->rate && storm->window) {
+		if (avr->cycle - s->window_start >= storm->window) {
+			s->window_start = avr->cycle;
+			s->window_count = 0;
+		}
+		storming |= ++s->window_count == storm->rate + 1;
+	}
+	if (!storming)
+		return 0;
+	if (!s->storms++)
+		AVR_LOG(avr, LOG_ERROR, "IRQ%d: interrupt storm at cycle %"
+				PRI_avr_cycle_count ", pc %04x can't run\n", vector->vector,
+				avr->cycle, pc);
+	if (storm->callback)
+		storm->callback(avr, vector, pc, storm->param);
+	return storm->stop;
+}
+
 void
 avr_register_vector(
 		avr_t *avr,
@@ -66,6 +136,25 @@ avr_register_vector(
 
 	avr_int_table_p table = &avr->interrupts;
 
+	if (vector->vector >= AVR_INT_VECTOR_MAX) {
+		AVR_LOG(avr, LOG_ERROR, "IRQ%d vector number out of range\n",
+			vector->vector);
+		return;
+	}
+
+	if (table->vector_count == table->vector_alloc) {
+		int size = table->vector_alloc ? table->vector_alloc * 2 : 16;
+		avr_int_vector_t ** v = size < 256 ?
+				realloc(table->vector, size * sizeof(*v)) : NULL;
+		if (!v) {
+			AVR_LOG(avr, LOG_ERROR, "IRQ%d can't register vector\n",
+				vector->vector);
+			return;
+		}
+		table->vector = v;
+		table->vector_alloc = size;
+	}
+
 	char name0[48], name1[48];
 	sprintf(name0, ">avr.int.%02x.pending", vector->vector);
 	sprintf(name1, ">avr.int.%02x.running", vector->vector);
@@ -74,6 +163,7 @@ avr_register_vector(
 			vector->vector * 256, // base number
 			AVR_INT_IRQ_COUNT, names);
 	table->vector[table->vector_count++] = vector;
+	table->by_number[vector->vector] = vector;
 	if (vector->trace)
 		printf("IRQ%d registered (enabled %04x:%d)\n",
 			vector->vector, vector->enable.reg, vector->enable.bit);
@@ -83,12 +173,33 @@ avr_register_vector(
 			vector->vector);
 }
 
+// makes room for one more nested interrupt
+static int
+_avr_interrupt_nest(
+		avr_int_table_p table)
+{
+	if (table->running_ptr < table->running_alloc)
+		return 0;
+	if (table->running_alloc >= AVR_INT_NESTED_MAX)
+		return -1;
+	int size = table->running_alloc ? table->running_alloc * 2 : 4;
+	avr_int_vector_t ** r = realloc(table->running, size * sizeof(*r));
+	if (!r)
+		return -1;
+	table->running = r;
+	avr_cycle_count_t * t = realloc(table->running_start, size * sizeof(*t));
+	if (!t)
+		return -1;
+	table->running_start = t;
+	table->running_alloc = size;
+	return 0;
+}
+
 int
 avr_has_pending_interrupts(
 		avr_t * avr)
 {
-	avr_int_table_p table = &avr->interrupts;
-	return !avr_int_pending_isempty(&table->pending);
+	return avr->interrupts.pending != 0;
 }
 
 int
@@ -112,9 +223,10 @@ avr_raise_interrupt(
 		avr_t * avr,
 		avr_int_vector_t * vector)
 {
-	if (!vector || !vector->vector)
+	if (!vector || !vector->vector || vector->vector >= AVR_INT_VECTOR_MAX)
 		return 0;
 	if (vector->pending) {
+		vector->stats.coalesced++;
 		if (vector->trace)
 			printf("IRQ%d:I=%d already raised (enabled %d) (cycle %lld pc 0x%x)\n",
 				vector->vector, !!avr->sreg[S_I], avr_regbit_get(avr, vector->enable),
@@ -137,10 +249,12 @@ avr_raise_interrupt(
 	if (avr_regbit_get(avr, vector->enable)) {
 		// Mark the interrupt as pending
 		vector->pending = 1;
+		vector->stats.raised++;
+		vector->stats.raise_cycle = avr->cycle;
 
-		avr_int_table_p table = &avr->interrupts;
-
-		avr_int_pending_write(&table->pending, vector);
+		avr->interrupts.pending |= 1ULL << vector->vector;
+		// in case it was never registered
+		avr->interrupts.by_number[vector->vector] = vector;
 
 		if (avr->sreg[S_I] && avr->interrupt_state == 0)
 			avr->interrupt_state = 1;
@@ -162,16 +276,22 @@ avr_clear_interrupt(
 {
 	if (!vector)
 		return;
+	avr_int_table_p table = &avr->interrupts;
+
 	if (vector->trace)
 		printf("IRQ%d cleared\n", vector->vector);
+	// still pending, so not from avr_service_interrupts()
+	if (vector->vector < AVR_INT_VECTOR_MAX &&
+			(table->pending & (1ULL << vector->vector))) {
+		table->pending &= ~(1ULL << vector->vector);
+		vector->stats.lost++;
+	}
 	vector->pending = 0;
 
 	avr_raise_irq(vector->irq + AVR_INT_IRQ_PENDING, 0);
-	avr_raise_irq_float(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr) ?
-					avr_int_pending_read_at(
-							&avr->interrupts.pending, 0)->vector : 0,
-							!avr_has_pending_interrupts(avr));
+	avr_raise_irq_float(table->irq + AVR_INT_IRQ_PENDING,
+			table->pending ? __builtin_ctzll(table->pending) : 0,
+			!table->pending);
 
 	if (vector->raised.reg && !vector->raise_sticky)
 		avr_regbit_clear(avr, vector->raised);
@@ -207,6 +327,49 @@ avr_get_interrupt_irq(
 	return NULL;
 }
 
+void
+avr_interrupt_stats_reset(
+		avr_t * avr)
+{
+	avr_int_table_p table = &avr->interrupts;
+
+	for (int i = 0; i < table->vector_count; i++)
+		memset(&table->vector[i]->stats, 0, sizeof(table->vector[i]->stats));
+}
+
+void
+avr_interrupt_stats_report(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_int_table_p table = &avr->interrupts;
+
+	for (int i = 0; i < table->vector_count; i++) {
+		avr_int_stats_t * s = &table->vector[i]->stats;
+		if (!s->raised && !s->coalesced)
+			continue;
+		fprintf(out, "IRQ%d: raised %" PRIu64 " serviced %" PRIu64
+				" coalesced %" PRIu64 " lost %" PRIu64 " depth %d",
+				table->vector[i]->vector, s->raised, s->serviced,
+				s->coalesced, s->lost, s->depth_max);
+		if (s->storms)
+			fprintf(out, " storms %" PRIu64, s->storms);
+		fprintf(out, "\n");
+		if (!s->serviced)
+			continue;
+		fprintf(out, "  latency avg %" PRI_avr_cycle_count " max %"
+				PRI_avr_cycle_count " cycles, time avg %" PRI_avr_cycle_count
+				" max %" PRI_avr_cycle_count " total %" PRI_avr_cycle_count
+				" (%.2f%%)\n  latency <2^n:",
+				s->latency_total / s->serviced, s->latency_max,
+				s->time_total / s->serviced, s->time_max, s->time_total,
+				avr->cycle ? s->time_total * 100.0 / avr->cycle : 0);
+		for (int b = 0; b < AVR_INT_LATENCY_BUCKETS; b++)
+			fprintf(out, " %" PRIu64, s->latency[b]);
+		fprintf(out, "\n");
+	}
+}
+
 /* this is called uppon RETI. */
 void
 avr_interrupt_reti(
@@ -215,6 +378,11 @@ avr_interrupt_reti(
 	avr_int_table_p table = &avr->interrupts;
 	if (table->running_ptr) {
 		avr_int_vector_t * vector = table->running[--table->running_ptr];
+		avr_cycle_count_t t = avr->cycle - table->running_start[table->running_ptr];
+		vector->stats.time_total += t;
+		if (t > vector->stats.time_max)
+			vector->stats.time_max = t;
+		vector->stats.reti_cycle = avr->cycle;
 		avr_raise_irq(vector->irq + AVR_INT_IRQ_RUNNING, 0);
 	}
 	avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING,
@@ -244,47 +412,61 @@ avr_service_interrupts(
 
 	avr_int_table_p table = &avr->interrupts;
 
-	// how many are pending...
-	int cnt = avr_int_pending_get_read_size(&table->pending);
-	// locate the highest priority one
-	int min = 0xff;
-	int mini = 0;
-	for (int ii = 0; ii < cnt; ii++) {
-		avr_int_vector_t * v = avr_int_pending_read_at(&table->pending, ii);
-		if (v->vector < min) {
-			min = v->vector;
-			mini = ii;
-		}
+	if (!table->pending) {
+		avr->interrupt_state = 0;
+		return;
 	}
-	avr_int_vector_t * vector = avr_int_pending_read_at(&table->pending, mini);
+	// the lowest vector number has the highest priority
+	int no = __builtin_ctzll(table->pending);
+	avr_int_vector_t * vector = table->by_number[no];
 
-	// now move the one at the front of the fifo in the slot of
-	// the one we service
-	table->pending.buffer[(table->pending.read + mini) % avr_int_pending_fifo_size] =
-			avr_int_pending_read(&table->pending);
+	table->pending &= ~(1ULL << no);
 	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
 			avr_has_pending_interrupts(avr));
 
 	// if that single interrupt is masked, ignore it and continue
-	// could also have been disabled, or cleared
-	if (!avr_regbit_get(avr, vector->enable) || !vector->pending) {
+	// could also have been disabled since
+	if (!avr_regbit_get(avr, vector->enable)) {
+		vector->stats.lost++;
 		vector->pending = 0;
 		avr->interrupt_state = avr_has_pending_interrupts(avr);
 	} else {
-		if (vector && vector->trace)
+		if (vector->trace)
 			printf("IRQ%d calling\n", vector->vector);
+		if (avr->trace_file)
+			avr_trace_file_irq(avr->trace_file, vector->vector);
+		avr_flashaddr_t pc = avr->pc;
 		_avr_push_addr(avr, avr->pc);
 		avr_sreg_set(avr, S_I, 0);
 		avr->pc = vector->vector * avr->vector_size;
+		if (avr->callgraph)
+			avr_callgraph_call(avr, avr->pc);
 
 		avr_raise_irq(vector->irq + AVR_INT_IRQ_RUNNING, 1);
 		avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING, vector->vector);
-		if (table->running_ptr == ARRAY_SIZE(table->running)) {
+		avr_int_stats_t * s = &vector->stats;
+		avr_cycle_count_t latency = avr->cycle - s->raise_cycle;
+		int bucket = 0;
+		while (bucket < AVR_INT_LATENCY_BUCKETS - 1 && (latency >> bucket))
+			bucket++;
+		s->serviced++;
+		if (avr->stats)
+			avr->stats->interrupts++;
+		s->latency[bucket]++;
+		s->latency_total += latency;
+		if (latency > s->latency_max)
+			s->latency_max = latency;
+		if (_avr_interrupt_nest(table)) {
 			AVR_LOG(avr, LOG_ERROR, "%s run out of nested stack!", __func__);
 		} else {
+			table->running_start[table->running_ptr] = avr->cycle;
 			table->running[table->running_ptr++] = vector;
+			if (table->running_ptr > s->depth_max)
+				s->depth_max = table->running_ptr;
 		}
 		avr_clear_interrupt(avr, vector);
+		if (table->storm && _avr_interrupt_storm(avr, vector, pc))
+			avr_sadly_crashed(avr, 0);
 	}
 }
 
@@ -22,9 +22,9 @@
 #ifndef __SIM_INTERRUPTS_H__
 #define __SIM_INTERRUPTS_H__
 
+#include <stdio.h>
 #include "sim_avr_types.h"
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +36,33 @@ enum {
 	AVR_INT_IRQ_COUNT,
 	AVR_INT_ANY		= 0xff,	// for avr_get_interrupt_irq()
 };
+// latency histogram buckets, bucket n is for latencies < 2^n cycles
+#define AVR_INT_LATENCY_BUCKETS	16
+
+/*
+ * Per vector statistics, always kept up to date; they only cost something
+ * when interrupts are raised, serviced or returned from.
+ * Latencies are from the raise to the jump to the vector, in cycles, and
+ * the time in the ISR is up to its RETI, so includes nested interrupts.
+ */
+typedef struct avr_int_stats_t {
+	uint64_t		raised;			// made pending
+	uint64_t		coalesced;		// raised again while still pending
+	uint64_t		lost;			// disabled or cleared before being serviced
+	uint64_t		serviced;
+	avr_cycle_count_t	latency_total, latency_max;
+	uint64_t		latency[AVR_INT_LATENCY_BUCKETS];
+	avr_cycle_count_t	time_total, time_max;
+	uint8_t			depth_max;		// nesting depth, 1 when not nested
+	avr_cycle_count_t	raise_cycle;	// when it was last made pending
+	// for the storm detection, see avr_int_storm_t
+	uint64_t		storms;
+	avr_cycle_count_t	reti_cycle;		// of its last RETI
+	uint32_t		back_to_back;	// re-entries in a row, right after a RETI
+	uint32_t		window_count;	// serviced since 'window_start'
+	avr_cycle_count_t	window_start;
+} avr_int_stats_t;
+
 // interrupt vector for the IO modules
 typedef struct avr_int_vector_t {
 	uint8_t 		vector;			// vector number, zero (reset) is reserved
@@ -44,24 +71,65 @@ typedef struct avr_int_vector_t {
 
 	// 'pending' IRQ, and 'running' status as signaled here
 	avr_irq_t		irq[AVR_INT_IRQ_COUNT];
-	uint8_t			pending : 1,	// 1 while scheduled in the fifo
+	uint8_t			pending : 1,	// 1 while its bit is set in the table's 'pending'
 					trace : 1,		// only for debug of a vector
 					raise_sticky : 1;	// 1 if the interrupt flag (= the raised regbit) is not cleared
 										// by the hardware when executing the interrupt routine (see TWINT)
+	avr_int_stats_t	stats;
 } avr_int_vector_t, *avr_int_vector_p;
 
-// Size needs to be >= max number of vectors, and a power of two
-DECLARE_FIFO(avr_int_vector_p, avr_int_pending, 64);
+/*
+ * An interrupt storm: a flag the ISR never clears, a level INT that stays
+ * asserted, and the vector is entered again right after each RETI, the
+ * main line code getting one instruction in between; the simulation goes
+ * on at full cost, doing nothing. A vector serviced 'run' times in a row
+ * less than 'gap' cycles after its own RETI, or more than 'rate' times in
+ * 'window' cycles, is a storm. It's logged once with the vector and the
+ * pc it keeps interrupting, 'callback' is called, and the instance crashes
+ * if 'stop' is set, so a runaway job ends there (and writes its
+ * post-mortem, see sim_postmortem.h).
+ */
+#define AVR_INT_STORM_GAP	8		// cycles, RETI, one instruction and the call
+#define AVR_INT_STORM_RUN	1000
+
+typedef struct avr_int_storm_t {
+	avr_cycle_count_t	gap;	// 0 for AVR_INT_STORM_GAP
+	uint32_t		run;		// 0 for AVR_INT_STORM_RUN
+	uint32_t		rate;		// 0 for no rate limit
+	avr_cycle_count_t	window;
+	uint8_t			stop;
+	void (*callback)(
+			struct avr_t * avr,
+			avr_int_vector_t * vector,
+			uint32_t pc,
+			void * param);
+	void *			param;
+} avr_int_storm_t;
+
+// vector numbers need to be below that, they are bits in a pending mask
+#define AVR_INT_VECTOR_MAX	64
+// how deep interrupts can nest
+#define AVR_INT_NESTED_MAX	64
 
-// interrupt vectors, and their enable/clear registers
+/*
+ * interrupt vectors, and their enable/clear registers.
+ * The vector list and the nesting stack are grown as needed, only the
+ * pending mask and the lookup by number are used on every interrupt.
+ */
 typedef struct  avr_int_table_t {
-	avr_int_vector_t * vector[64];
-	uint8_t			vector_count;
-	avr_int_pending_t pending;
+	// pending vectors, one bit per vector number; the lowest one wins
+	uint64_t		pending;
 	uint8_t			running_ptr;
-	avr_int_vector_t *running[64]; // stack of nested interrupts
+	uint8_t			vector_count;
+	uint16_t		vector_alloc, running_alloc;
+	avr_int_vector_t * by_number[AVR_INT_VECTOR_MAX];
+	avr_int_vector_t ** running; // stack of nested interrupts
+	avr_cycle_count_t * running_start;	// and the cycle they were entered
+	// the registered vectors
+	avr_int_vector_t ** vector;
 	// global status for pending + running in interrupt context
 	avr_irq_t		irq[AVR_INT_IRQ_COUNT];
+	avr_int_storm_t *	storm;	// the detector, NULL when off
 } avr_int_table_t, *avr_int_table_p;
 
 /*
@@ -114,16 +182,40 @@ avr_get_interrupt_irq(
 		struct avr_t * avr,
 		uint8_t v);
 
+// clears the statistics of all the vectors
+void
+avr_interrupt_stats_reset(
+		struct avr_t * avr );
+// prints the statistics of the vectors that were raised
+void
+avr_interrupt_stats_report(
+		struct avr_t * avr,
+		FILE * out );
+
+/*
+ * Sets a storm detector on 'avr', NULL to remove it. It's not copied,
+ * one can be shared by many instances
+ */
+void
+avr_interrupt_storm_set(
+		struct avr_t * avr,
+		avr_int_storm_t * storm );
+
 // Initializes the interrupt table
 void
 avr_interrupt_init(
 		struct avr_t * avr );
 
-// reset the interrupt table and the fifo
+// reset the interrupt table and the pending vectors
 void
 avr_interrupt_reset(
 		struct avr_t * avr );
 
+// frees the interrupt table, called by avr_terminate()
+void
+avr_interrupt_free(
+		struct avr_t * avr );
+
 #ifdef __cplusplus
 };
 #endif
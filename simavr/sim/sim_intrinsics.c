@@ -0,0 +1,675 @@
+/*
+	sim_intrinsics.c
+
+	Runs some of the libgcc and avr-libc routines natively.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_intrinsics.h"
+#include "sim_core.h"
+#include "sim_interrupts.h"
+
+// the ones a routine may leave anything in: r0, r18-r27, r30-r31
+#define AVR_INTRINSIC_SCRATCH	(0xcffc0001)
+// without a symbol size, how far the signature goes at most
+#define AVR_INTRINSIC_SIZE_MAX	512
+
+typedef struct avr_intrinsic_kind_t {
+	const char *	name;
+	// fills 'r', or returns -1 if this one has to run as code
+	int (*run)(
+			avr_t * avr,
+			avr_intrinsic_result_t * r);
+} avr_intrinsic_kind_t;
+
+static inline uint16_t
+_rd16(
+		avr_t * avr,
+		int r)
+{
+	return avr->data[r] | (avr->data[r + 1] << 8);
+}
+
+static inline uint32_t
+_rd32(
+		avr_t * avr,
+		int r)
+{
+	return _rd16(avr, r) | ((uint32_t)_rd16(avr, r + 2) << 16);
+}
+
+static inline void
+_wr(
+		avr_intrinsic_result_t * r,
+		int reg,
+		uint32_t v,
+		int bytes)
+{
+	for (int i = 0; i < bytes; i++, v >>= 8) {
+		r->reg[reg + i] = v;
+		r->out |= 1u << (reg + i);
+	}
+}
+
+static inline uint32_t
+_bits(
+		uint32_t v)
+{
+	return v ? 32 - __builtin_clz(v) : 0;
+}
+
+// 'p' to 'p + len' is plain SRAM, no io register in it
+static inline int
+_plain(
+		avr_t * avr,
+		uint32_t p,
+		uint32_t len)
+{
+	return p >= 32 + avr->io_count && p + len <= (uint32_t)avr->ramend + 1;
+}
+
+/*
+ * The multiplications without MUL shift and add once per bit of the
+ * multiplier, the additions only for the bits set. With MUL, the cycles
+ * don't depend on the operands, and the model ends up with a zero slope
+ */
+static int
+_avr_intrinsic_mulsi3(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t b = _rd32(avr, 18);
+	_wr(r, 22, _rd32(avr, 22) * b, 4);
+	r->key = _bits(b);
+	r->x = __builtin_popcount(b);
+	return 0;
+}
+
+static int
+_avr_intrinsic_mulhi3(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint16_t b = _rd16(avr, 22);
+	_wr(r, 24, (uint16_t)(_rd16(avr, 24) * b), 2);
+	r->key = _bits(b);
+	r->x = __builtin_popcount(b);
+	return 0;
+}
+
+/*
+ * The restoring divisions take the subtraction once per quotient bit set.
+ * A division by zero gives all ones, and the dividend as remainder
+ */
+static int
+_avr_intrinsic_udivmodqi4(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint8_t a = avr->data[24], b = avr->data[22];
+	uint8_t q = b ? a / b : 0xff;
+	_wr(r, 24, q, 1);
+	_wr(r, 25, b ? a % b : a, 1);
+	r->x = __builtin_popcount(q);
+	return 0;
+}
+
+static int
+_avr_intrinsic_udivmodhi4(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint16_t a = _rd16(avr, 24), b = _rd16(avr, 22);
+	uint16_t q = b ? a / b : 0xffff;
+	_wr(r, 22, q, 2);
+	_wr(r, 24, b ? a % b : a, 2);
+	r->x = __builtin_popcount(q);
+	return 0;
+}
+
+static int
+_avr_intrinsic_udivmodsi4(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t a = _rd32(avr, 22), b = _rd32(avr, 18);
+	uint32_t q = b ? a / b : 0xffffffff;
+	_wr(r, 18, q, 4);
+	_wr(r, 22, b ? a % b : a, 4);
+	r->x = __builtin_popcount(q);
+	return 0;
+}
+
+static int
+_avr_intrinsic_strlen(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t s = _rd16(avr, 24);
+	if (!_plain(avr, s, 0))
+		return -1;
+	const uint8_t * p = memchr(avr->data + s, 0, avr->ramend + 1 - s);
+	if (!p)
+		return -1;	// it would read past the RAM
+	r->x = p - (avr->data + s);
+	_wr(r, 24, r->x, 2);
+	return 0;
+}
+
+// the difference of the first bytes that differ, as an int
+static int
+_avr_intrinsic_memcmp(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t s1 = _rd16(avr, 24), s2 = _rd16(avr, 22), n = _rd16(avr, 20);
+	if (!_plain(avr, s1, n) || !_plain(avr, s2, n))
+		return -1;
+	uint32_t i = 0;
+	while (i < n && avr->data[s1 + i] == avr->data[s2 + i])
+		i++;
+	if (i < n) {
+		uint8_t a = avr->data[s1 + i], b = avr->data[s2 + i];
+		_wr(r, 24, (uint8_t)(a - b) | (a < b ? 0xff00 : 0), 2);
+		r->key = 1;
+		r->x = i + 1;
+	} else {
+		_wr(r, 24, 0, 2);
+		r->x = n;
+	}
+	return 0;
+}
+
+/*
+ * The float routines are only taken for normal operands giving a normal
+ * result, where round to nearest even has one answer; zeroes, denormals,
+ * infinities and NaNs are left to the code. Their cycles depend on the
+ * alignment and normalisation shifts, that's what the keys are made of.
+ */
+static inline int
+_normal(
+		uint32_t f)
+{
+	uint32_t e = (f >> 23) & 0xff;
+	return e && e != 0xff;
+}
+
+static inline float
+_f(
+		uint32_t v)
+{
+	float f;
+	memcpy(&f, &v, sizeof(f));
+	return f;
+}
+
+static inline uint32_t
+_u(
+		float f)
+{
+	uint32_t v;
+	memcpy(&v, &f, sizeof(v));
+	return v;
+}
+
+static int
+_avr_intrinsic_add(
+		avr_t * avr,
+		avr_intrinsic_result_t * r,
+		uint32_t flip)
+{
+	uint32_t a = _rd32(avr, 22), b = _rd32(avr, 18) ^ flip;
+	if (!_normal(a) || !_normal(b))
+		return -1;
+	uint32_t res = _u(_f(a) + _f(b));
+	if (!_normal(res))
+		return -1;
+	int ea = (a >> 23) & 0xff, eb = (b >> 23) & 0xff, er = (res >> 23) & 0xff;
+	int top = ea > eb ? ea : eb;
+	int diff = top - (ea > eb ? eb : ea);
+	int shift = top - er + 8;	// -1 for a carry, up to 23 to the left
+	_wr(r, 22, res, 4);
+	r->key = (diff > 25 ? 25 : diff) | ((a ^ b) >> 31 << 5) |
+			((shift < 0 ? 0 : shift > 31 ? 31 : shift) << 6);
+	return 0;
+}
+
+static int
+_avr_intrinsic_addsf3(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	return _avr_intrinsic_add(avr, r, 0);
+}
+
+static int
+_avr_intrinsic_subsf3(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	return _avr_intrinsic_add(avr, r, 0x80000000);
+}
+
+static int
+_avr_intrinsic_mulsf3(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t a = _rd32(avr, 22), b = _rd32(avr, 18);
+	if (!_normal(a) || !_normal(b))
+		return -1;
+	uint32_t res = _u(_f(a) * _f(b));
+	if (!_normal(res))
+		return -1;
+	uint64_t m = (uint64_t)((a & 0x7fffff) | 0x800000) *
+			((b & 0x7fffff) | 0x800000);
+	_wr(r, 22, res, 4);
+	r->key = (m >> 47) & 1;
+	return 0;
+}
+
+static int
+_avr_intrinsic_divsf3(
+		avr_t * avr,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t a = _rd32(avr, 22), b = _rd32(avr, 18);
+	if (!_normal(a) || !_normal(b))
+		return -1;
+	uint32_t res = _u(_f(a) / _f(b));
+	if (!_normal(res))
+		return -1;
+	_wr(r, 22, res, 4);
+	r->key = (a & 0x7fffff) >= (b & 0x7fffff);
+	r->x = __builtin_popcount(res & 0x7fffff);
+	return 0;
+}
+
+static const avr_intrinsic_kind_t _avr_intrinsic_kind[] = {
+	{ "__mulsi3", _avr_intrinsic_mulsi3 },
+	{ "__mulhi3", _avr_intrinsic_mulhi3 },
+	{ "__udivmodqi4", _avr_intrinsic_udivmodqi4 },
+	{ "__udivmodhi4", _avr_intrinsic_udivmodhi4 },
+	{ "__udivmodsi4", _avr_intrinsic_udivmodsi4 },
+	{ "__addsf3", _avr_intrinsic_addsf3 },
+	{ "__subsf3", _avr_intrinsic_subsf3 },
+	{ "__mulsf3", _avr_intrinsic_mulsf3 },
+	{ "__divsf3", _avr_intrinsic_divsf3 },
+	{ "strlen", _avr_intrinsic_strlen },
+	{ "memcmp", _avr_intrinsic_memcmp },
+	{ NULL },
+};
+
+// FNV-1a of the code
+static uint32_t
+_avr_intrinsic_signature(
+		avr_t * avr,
+		avr_flashaddr_t addr,
+		uint32_t size)
+{
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < size && addr + i <= avr->flashend; i++)
+		h = (h ^ avr->flash[addr + i]) * 16777619u;
+	return h;
+}
+
+static void
+_avr_intrinsic_trust(
+		avr_intrinsics_t * it,
+		avr_intrinsic_t * in)
+{
+	for (int i = 0; i < it->known_count; i++)
+		if (it->known[i] == in->signature)
+			in->trusted = 1;
+}
+
+int
+avr_intrinsics_add(
+		avr_intrinsics_t * it,
+		const char * name,
+		avr_flashaddr_t addr,
+		uint32_t size)
+{
+	const avr_intrinsic_kind_t * k = _avr_intrinsic_kind;
+	while (k->name && strcmp(k->name, name))
+		k++;
+	if (!k->name || addr > it->avr->flashend)
+		return -1;
+	if (it->count == AVR_INTRINSIC_MAX) {
+		AVR_LOG(it->avr, LOG_ERROR, "INTRINSICS: too many routines\n");
+		return -1;
+	}
+	avr_intrinsic_t * in = &it->routine[it->count++];
+	memset(in, 0, sizeof(*in));
+	in->kind = k;
+	in->addr = addr;
+	in->size = size;
+	in->signature = _avr_intrinsic_signature(it->avr, addr, size);
+	_avr_intrinsic_trust(it, in);
+	if (it->count == 1 || addr < it->lo)
+		it->lo = addr;
+	if (addr > it->hi)
+		it->hi = addr;
+	return 0;
+}
+
+int
+avr_intrinsics_init(
+		avr_t * avr,
+		avr_intrinsics_t * it,
+		elf_firmware_t * firmware)
+{
+	if (avr->intrinsics) {
+		AVR_LOG(avr, LOG_ERROR, "INTRINSICS: already running\n");
+		return -1;
+	}
+	// what was loaded stays
+	uint32_t * known = it->known;
+	int known_count = it->known_count;
+	memset(it, 0, sizeof(*it));
+	it->avr = avr;
+	it->known = known;
+	it->known_count = known_count;
+
+	if (firmware && elf_firmware_symbols(firmware) == 0) {
+		for (uint32_t i = 0; i < firmware->symbolcount; i++) {
+			avr_symbol_t * s = firmware->symbol[i];
+			if (s->addr > avr->flashend)
+				break;	// sorted, the rest are data
+			uint32_t size = s->size;
+			if (!size) {
+				size = i + 1 < firmware->symbolcount ?
+						firmware->symbol[i + 1]->addr - s->addr : 0;
+				if (size > AVR_INTRINSIC_SIZE_MAX)
+					size = AVR_INTRINSIC_SIZE_MAX;
+			}
+			avr_intrinsics_add(it, s->symbol, s->addr, size);
+		}
+	}
+	avr->intrinsics = it;
+	return it->count;
+}
+
+void
+avr_intrinsics_stop(
+		avr_intrinsics_t * it)
+{
+	if (it->avr && it->avr->intrinsics == it)
+		it->avr->intrinsics = NULL;
+	free(it->known);
+	it->known = NULL;
+	it->known_count = 0;
+	it->count = 0;
+	it->check.in = NULL;
+	it->avr = NULL;
+}
+
+int
+avr_intrinsics_load(
+		avr_intrinsics_t * it,
+		const char * path)
+{
+	FILE * f = fopen(path, "r");
+	if (!f)
+		return -1;
+	char name[64];
+	uint32_t sig;
+	while (fscanf(f, "%63s %x", name, &sig) == 2) {
+		uint32_t * k = realloc(it->known, (it->known_count + 1) * sizeof(*k));
+		if (!k)
+			break;
+		it->known = k;
+		it->known[it->known_count++] = sig;
+	}
+	fclose(f);
+	for (int i = 0; i < it->count; i++)
+		_avr_intrinsic_trust(it, &it->routine[i]);
+	return 0;
+}
+
+int
+avr_intrinsics_save(
+		avr_intrinsics_t * it,
+		const char * path)
+{
+	FILE * f = fopen(path, "w");
+	if (!f)
+		return -1;
+	for (int i = 0; i < it->count; i++)
+		if (it->routine[i].trusted && it->routine[i].state != AVR_INTRINSIC_OFF)
+			fprintf(f, "%s %08x\n", it->routine[i].kind->name,
+					it->routine[i].signature);
+	// and the ones this firmware doesn't have
+	for (int k = 0; k < it->known_count; k++) {
+		int listed = 0;
+		for (int i = 0; i < it->count && !listed; i++)
+			listed = it->routine[i].trusted &&
+					it->routine[i].state != AVR_INTRINSIC_OFF &&
+					it->routine[i].signature == it->known[k];
+		if (!listed)
+			fprintf(f, "- %08x\n", it->known[k]);
+	}
+	return fclose(f) ? -1 : 0;
+}
+
+void
+avr_intrinsics_report(
+		avr_intrinsics_t * it,
+		FILE * out)
+{
+	static const char * state[] = { "checking", "native", "off" };
+	for (int i = 0; i < it->count; i++) {
+		avr_intrinsic_t * in = &it->routine[i];
+		fprintf(out, "intrinsic: %-14s %06x %08x %-8s %10llu calls %10llu native",
+				in->kind->name, in->addr, in->signature, state[in->state],
+				(unsigned long long)in->calls, (unsigned long long)in->native);
+		if (in->why)
+			fprintf(out, ", %s", in->why);
+		fprintf(out, "\n");
+	}
+}
+
+static avr_intrinsic_t *
+_avr_intrinsic_find(
+		avr_intrinsics_t * it,
+		avr_flashaddr_t target)
+{
+	if (target < it->lo || target > it->hi)
+		return NULL;
+	for (int i = 0; i < it->count; i++)
+		if (it->routine[i].addr == target)
+			return &it->routine[i];
+	return NULL;
+}
+
+static void
+_avr_intrinsic_off(
+		avr_intrinsic_t * in,
+		const char * why)
+{
+	in->state = AVR_INTRINSIC_OFF;
+	in->why = why;
+}
+
+// the cycles of a call with 'r', or -1 if that wasn't learnt yet
+static int64_t
+_avr_intrinsic_cycles(
+		avr_intrinsic_t * in,
+		avr_intrinsic_result_t * r)
+{
+	uint32_t h = r->key % AVR_INTRINSIC_KEYS;
+	for (uint32_t i = 0; i < AVR_INTRINSIC_KEYS; i++, h = (h + 1) % AVR_INTRINSIC_KEYS) {
+		if (!in->model[h].used)
+			return -1;
+		if (in->model[h].key != r->key)
+			continue;
+		if (r->x == in->model[h].x)
+			return in->model[h].cycles;
+		if (!in->slope_known)
+			return -1;
+		return in->model[h].cycles +
+				(int64_t)in->slope * ((int64_t)r->x - in->model[h].x);
+	}
+	return -1;
+}
+
+// learns, or checks, the cycles of a call run as code
+static void
+_avr_intrinsic_learn(
+		avr_intrinsic_t * in,
+		avr_intrinsic_result_t * r,
+		uint32_t cycles)
+{
+	uint32_t h = r->key % AVR_INTRINSIC_KEYS;
+	for (uint32_t i = 0; i < AVR_INTRINSIC_KEYS; i++, h = (h + 1) % AVR_INTRINSIC_KEYS) {
+		if (!in->model[h].used) {
+			in->model[h].used = 1;
+			in->model[h].key = r->key;
+			in->model[h].x = r->x;
+			in->model[h].cycles = cycles;
+			return;
+		}
+		if (in->model[h].key != r->key)
+			continue;
+		if (r->x != in->model[h].x && !in->slope_known) {
+			int64_t dc = (int64_t)cycles - in->model[h].cycles;
+			int64_t dx = (int64_t)r->x - in->model[h].x;
+			if (dc % dx) {
+				_avr_intrinsic_off(in, "cycles not linear");
+				return;
+			}
+			in->slope = dc / dx;
+			in->slope_known = 1;
+		}
+		if (_avr_intrinsic_cycles(in, r) != cycles)
+			_avr_intrinsic_off(in, "cycles differ");
+		return;
+	}
+	_avr_intrinsic_off(in, "too many cycle models");
+}
+
+static uint64_t
+_avr_intrinsic_serviced(
+		avr_t * avr)
+{
+	uint64_t n = 0;
+	for (int i = 0; i < avr->interrupts.vector_count; i++)
+		n += avr->interrupts.vector[i]->stats.serviced;
+	return n;
+}
+
+int
+avr_intrinsics_call(
+		avr_t * avr,
+		avr_flashaddr_t target,
+		int * cycle)
+{
+	avr_intrinsics_t * it = avr->intrinsics;
+	avr_intrinsic_t * in = _avr_intrinsic_find(it, target);
+	if (!in || in->state == AVR_INTRINSIC_OFF)
+		return 0;
+	in->calls++;
+
+	avr_intrinsic_result_t r;
+	memset(&r, 0, sizeof(r));
+	if (in->kind->run(avr, &r))
+		return 0;
+
+	uint32_t need = in->trusted ? 2 : AVR_INTRINSIC_CHECKS;
+	int64_t cycles = in->checked >= need ? _avr_intrinsic_cycles(in, &r) : -1;
+	if (cycles > 0 && cycles < avr->run_cycle_count &&
+			avr->state == cpu_Running && avr->interrupt_state == 0 &&
+			!avr->gdb && !avr->gdb_watch && !avr->trace && !avr->trace_file &&
+			!avr->heatmap) {
+		for (int i = 0; i < 32; i++)
+			if (r.out & (1u << i))
+				avr->data[i] = r.reg[i];
+			else if ((in->same & ~in->kept) & (1u << i))
+				avr->data[i] = in->value[i];
+		*cycle = cycles;
+		in->native++;
+		return 1;
+	}
+	// run it as code, and see what it did on the way out
+	if (!it->check.in) {
+		it->check.in = in;
+		it->check.sp = _avr_sp_get(avr);
+		it->check.start = avr->cycle;
+		it->check.serviced = _avr_intrinsic_serviced(avr);
+		memcpy(it->check.reg, avr->data, 32);
+		it->check.r = r;
+	}
+	return 0;
+}
+
+void
+avr_intrinsics_ret(
+		avr_t * avr)
+{
+	avr_intrinsics_t * it = avr->intrinsics;
+	avr_intrinsic_t * in = it->check.in;
+	if (!in)
+		return;
+	uint16_t sp = _avr_sp_get(avr);
+	uint16_t back = it->check.sp + avr->address_size;
+	if (sp < back)
+		return;		// from something it called, or an interrupt
+	it->check.in = NULL;
+	// unwound past it, or interrupted, says nothing about it
+	if (sp > back || it->check.serviced != _avr_intrinsic_serviced(avr) ||
+			in->state == AVR_INTRINSIC_OFF)
+		return;
+	avr_intrinsic_result_t * r = &it->check.r;
+	for (int i = 0; i < 32; i++) {
+		uint32_t bit = 1u << i;
+		uint8_t v = avr->data[i];
+		if (r->out & bit) {
+			if (v != r->reg[i]) {
+				_avr_intrinsic_off(in, "result differs");
+				return;
+			}
+			continue;
+		}
+		if (!in->checked) {
+			in->value[i] = v;
+			in->same |= bit;
+			in->kept |= v == it->check.reg[i] ? bit : 0;
+			continue;
+		}
+		if (v != in->value[i])
+			in->same &= ~bit;
+		if (v != it->check.reg[i])
+			in->kept &= ~bit;
+	}
+	if (~(in->kept | in->same | r->out | AVR_INTRINSIC_SCRATCH)) {
+		_avr_intrinsic_off(in, "saved registers changed");
+		return;
+	}
+	// CALL to after the RET, as the core counts a native one
+	_avr_intrinsic_learn(in, r,
+			avr->cycle - it->check.start + 2 + avr->address_size);
+	if (in->state == AVR_INTRINSIC_OFF)
+		return;
+	if (++in->checked >= AVR_INTRINSIC_CHECKS) {
+		in->trusted = 1;
+		in->state = AVR_INTRINSIC_NATIVE;
+	} else if (in->trusted && in->checked >= 2)
+		in->state = AVR_INTRINSIC_NATIVE;
+}
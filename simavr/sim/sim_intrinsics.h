@@ -0,0 +1,190 @@
+/*
+	sim_intrinsics.h
+
+	Runs some of the libgcc and avr-libc routines natively.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_INTRINSICS_H__
+#define __SIM_INTRINSICS_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The firmware's own copies of the runtime routines, __udivmodsi4,
+ * __mulsi3, the fplib float add/sub/mul/div, strlen(), memcmp(), found
+ * by their ELF symbol, are called as usual; on a CALL to one, instead of
+ * running its code, the result is worked out on the host, written in the
+ * registers, and the call returns at once, having taken the cycles the
+ * code would have.
+ *
+ * Nothing about these is taken for granted: which libgcc, which avr-libc,
+ * with MUL or not, changes the code, its cycles and what it leaves in the
+ * scratch registers. Each routine is first run as code and checked: the
+ * registers the result goes in must be what the host works out, the other
+ * registers it changes must be left the same constant each time (loop
+ * counters, r1), or the ABI's scratch ones, and its cycles must follow
+ * one of the routine's own models, a base per 'key' plus a slope per
+ * 'x', like per quotient bit set for a division. After AVR_INTRINSIC_CHECKS
+ * calls that all agree it runs natively, unless its key wasn't seen yet,
+ * in which case it runs once more as code to learn it. One that disagrees
+ * is run as code from then on, and the report tells why.
+ *
+ * What was checked is kept as the signature of the routine, a hash of its
+ * code: avr_intrinsics_save() writes the ones that passed, and a firmware
+ * loading them with avr_intrinsics_load() has the routines with these
+ * same bytes trusted at once, only their cycles left to learn.
+ *
+ * The call is only taken natively when nothing could have happened during
+ * it: no cycle timer due and no interrupt pending before it would have
+ * returned, no gdb, watchpoints, trace or heatmap looking at each access,
+ * and its memory arguments in plain SRAM. Otherwise it's run as code. The
+ * scratch registers it leaves (Z for strlen, r0 after MUL) and SREG are
+ * left as they were before the call, which the ABI allows; the stack below
+ * SP isn't written either. The instructions and edges inside it aren't
+ * counted, by the stats nor the coverage, the call graph sees the call.
+ */
+#define AVR_INTRINSIC_CHECKS	8
+#define AVR_INTRINSIC_KEYS		64		// cycle models per routine
+#define AVR_INTRINSIC_MAX		16
+
+enum {
+	AVR_INTRINSIC_CHECKING = 0,
+	AVR_INTRINSIC_NATIVE,
+	AVR_INTRINSIC_OFF,		// disagreed once, runs as code
+};
+
+struct avr_intrinsic_kind_t;
+
+// what the host works out for one call
+typedef struct avr_intrinsic_result_t {
+	uint32_t		out;		// registers set, one bit each
+	uint8_t			reg[32];
+	uint32_t		key;		// picks the cycle model
+	uint32_t		x;			// and what it's multiplied by
+} avr_intrinsic_result_t;
+
+typedef struct avr_intrinsic_t {
+	const struct avr_intrinsic_kind_t * kind;
+	avr_flashaddr_t	addr;		// in bytes
+	uint32_t		size;
+	uint32_t		signature;
+	uint8_t			state;
+	uint8_t			trusted;	// signature loaded, or checks passed
+	uint32_t		checked;
+	const char *	why;		// it was turned off
+	// the other registers, as runs as code left them
+	uint32_t		kept;		// as they were before the call
+	uint32_t		same;		// always 'value'
+	uint8_t			value[32];
+	// cycles of a call, CALL to after the RET, base[key] + slope * x
+	int				slope_known;
+	int32_t			slope;
+	struct {
+		uint32_t	key, x;
+		uint32_t	cycles;
+		uint8_t		used;
+	} model[AVR_INTRINSIC_KEYS];
+	uint64_t		calls, native;
+} avr_intrinsic_t;
+
+typedef struct avr_intrinsics_t {
+	struct avr_t *	avr;
+	avr_intrinsic_t	routine[AVR_INTRINSIC_MAX];
+	int				count;
+	avr_flashaddr_t	lo, hi;		// of their entry points
+	struct {
+		avr_intrinsic_t * in;	// the routine being checked, or NULL
+		uint16_t		sp;		// after the return address was pushed
+		avr_cycle_count_t start;
+		uint64_t		serviced;
+		uint8_t			reg[32];
+		avr_intrinsic_result_t r;
+	} check;
+	uint32_t *		known;		// from avr_intrinsics_load()
+	int				known_count;
+} avr_intrinsics_t;
+
+/*
+ * Finds the routines in the firmware's symbols (read if they weren't
+ * already), and starts watching the calls to them. Returns the number of
+ * routines found, or -1
+ */
+int
+avr_intrinsics_init(
+		struct avr_t * avr,
+		avr_intrinsics_t * it,
+		elf_firmware_t * firmware );
+/*
+ * Adds routine 'name' at 'addr', 'size' bytes long, for firmwares without
+ * symbols. Returns 0, or -1 if it isn't one of ours
+ */
+int
+avr_intrinsics_add(
+		avr_intrinsics_t * it,
+		const char * name,
+		avr_flashaddr_t addr,
+		uint32_t size );
+void
+avr_intrinsics_stop(
+		avr_intrinsics_t * it );
+/*
+ * The signatures file has a "<name> <signature>" line per routine, the
+ * name "-" for the ones loaded that this firmware doesn't have. Load goes
+ * before or after avr_intrinsics_init(); save writes the ones trusted
+ * now, and those loaded. Both return 0, or -1
+ */
+int
+avr_intrinsics_load(
+		avr_intrinsics_t * it,
+		const char * path );
+int
+avr_intrinsics_save(
+		avr_intrinsics_t * it,
+		const char * path );
+// a line per routine: where, its state, its calls, how many were native
+void
+avr_intrinsics_report(
+		avr_intrinsics_t * it,
+		FILE * out );
+
+/*
+ * Called by the core after the return address of a call was pushed, with
+ * the cycles of the instruction so far. Returns 1 if it ran natively, the
+ * registers and '*cycle' are then set, and the core returns from it
+ */
+int
+avr_intrinsics_call(
+		struct avr_t * avr,
+		avr_flashaddr_t target,
+		int * cycle );
+// called by the core after the return address was popped
+void
+avr_intrinsics_ret(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_INTRINSICS_H__ */
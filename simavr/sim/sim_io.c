@@ -26,6 +26,94 @@
 #include <ctype.h>
 #include <stdint.h>
 #include "sim_io.h"
+#include "sim_snapshot.h"
+
+// the handlers of one shared register
+typedef struct avr_io_mux_t {
+	uint32_t		used, size;
+	struct {
+		uint8_t			mask;	// 0 to be called for every write
+		void *			param;
+		avr_io_write_t	c;
+	} * io;
+} avr_io_mux_t;
+
+// see avr_t.io_shared_io, allocated the first time a register is shared
+typedef struct avr_io_shared_t {
+	uint32_t		count, size;
+	avr_io_mux_t *	reg;
+} avr_io_shared_t;
+
+/*
+ * Open addressing hash of ioctl numbers, kept at most half full: which
+ * module owns the irqs of a 'getirq' ioctl, and which one answered the
+ * last time that ioctl was sent. Any change to the module list just
+ * empties it, it is refilled as it gets used.
+ */
+typedef struct avr_io_ctl_t {
+	uint32_t		ctl;		// 0 is a free slot
+	avr_io_t *		irq;		// module with irq_ioctl_get == ctl
+	avr_io_t *		ioctl;		// module that answers ctl
+} avr_io_ctl_t;
+
+static avr_io_ctl_t *
+_avr_io_ctl_slot(
+		avr_io_ctl_t * slot,
+		uint32_t size,
+		uint32_t ctl)
+{
+	uint32_t i = (ctl * 2654435761u) & (size - 1);
+	while (slot[i].ctl && slot[i].ctl != ctl)
+		i = (i + 1) & (size - 1);
+	return slot + i;
+}
+
+static int
+_avr_io_ctl_grow(
+		avr_t * avr)
+{
+	uint32_t size = avr->io_ctl.size ? avr->io_ctl.size * 2 : 64;
+	avr_io_ctl_t * slot = calloc(size, sizeof(*slot));
+	if (!slot)
+		return -1;
+	for (uint32_t i = 0; i < avr->io_ctl.size; i++)
+		if (avr->io_ctl.slot[i].ctl)
+			*_avr_io_ctl_slot(slot, size, avr->io_ctl.slot[i].ctl) =
+					avr->io_ctl.slot[i];
+	free(avr->io_ctl.slot);
+	avr->io_ctl.slot = slot;
+	avr->io_ctl.size = size;
+	return 0;
+}
+
+static avr_io_ctl_t *
+_avr_io_ctl_get(
+		avr_t * avr,
+		uint32_t ctl)
+{
+	if (!ctl)
+		return NULL;
+	if (avr->io_ctl.dirty) {
+		if (avr->io_ctl.slot)
+			memset(avr->io_ctl.slot, 0,
+					avr->io_ctl.size * sizeof(avr->io_ctl.slot[0]));
+		avr->io_ctl.count = 0;
+		avr->io_ctl.dirty = 0;
+	}
+	if ((avr->io_ctl.count + 1) * 2 > avr->io_ctl.size &&
+			_avr_io_ctl_grow(avr))
+		return NULL;
+	avr_io_ctl_t * s = _avr_io_ctl_slot(avr->io_ctl.slot, avr->io_ctl.size, ctl);
+	if (!s->ctl) {
+		s->ctl = ctl;
+		avr->io_ctl.count++;
+		// first module in the list wins, like the walks below
+		for (avr_io_t * port = avr->io_port; port && !s->irq; port = port->next)
+			if (port->irq_count && port->irq_ioctl_get == ctl)
+				s->irq = port;
+	}
+	return s;
+}
 
 int
 avr_ioctl(
@@ -33,11 +121,20 @@ avr_ioctl(
 		uint32_t ctl,
 		void * io_param)
 {
-	avr_io_t * port = avr->io_port;
+	avr_io_ctl_t * s = _avr_io_ctl_get(avr, ctl);
 	int res = -1;
+
+	if (s && s->ioctl) {
+		res = s->ioctl->ioctl(s->ioctl, ctl, io_param);
+		if (res != -1)
+			return res;
+	}
+	avr_io_t * port = avr->io_port;
 	while (port && res == -1) {
 		if (port->ioctl)
 			res = port->ioctl(port, ctl, io_param);
+		if (res != -1 && s)
+			s->ioctl = port;
 		port = port->next;
 	}
 	return res;
@@ -51,6 +148,9 @@ avr_register_io(
 	io->next = avr->io_port;
 	io->avr = avr;
 	avr->io_port = io;
+	avr->io_ctl.dirty = 1;
+	// until its irqs are left for later, see avr_io_setirqs()
+	avr->io_lazy.current = 0;
 }
 
 void
@@ -61,6 +161,15 @@ avr_register_io_read(
 		void * param)
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (a >= avr->io_count) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
+				__func__, a, avr->io_count);
+		abort();
+	}
+	if (avr->io_lazy.current)
+		avr->io[a].lazy |= 1ull << (avr->io_lazy.current - 1);
 	if (avr->io[a].r.param || avr->io[a].r.c) {
 		if (avr->io[a].r.param != param || avr->io[a].r.c != readp) {
 			AVR_LOG(avr, LOG_ERROR,
@@ -75,8 +184,43 @@ avr_register_io_read(
 	}
 	avr->io[a].r.param = param;
 	avr->io[a].r.c = readp;
+	avr->io_hook[addr] |= AVR_IO_HOOK_READ;
 }
 
+void
+avr_register_io_read_cached(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		uint32_t * version)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+	if (a < avr->io_count)
+		avr->io[a].r.version = version;
+}
+
+void
+avr_register_io_read_poll(
+		avr_t *avr,
+		avr_io_addr_t addr)
+{
+	if (AVR_DATA_TO_IO(addr) < avr->io_count)
+		avr->io_hook[addr] |= AVR_IO_HOOK_READ_POLL;
+}
+
+void
+avr_unregister_io_read_poll(
+		avr_t *avr,
+		avr_io_addr_t addr)
+{
+	if (AVR_DATA_TO_IO(addr) < avr->io_count)
+		avr->io_hook[addr] &= ~AVR_IO_HOOK_READ_POLL;
+}
+
+/*
+ * Calls the handlers that want to see this write; the ones with a mask
+ * only when one of their bits changes. If none of them were, the value
+ * is stored here, as each of them would have done
+ */
 static void
 _avr_io_mux_write(
 		avr_t * avr,
@@ -84,69 +228,119 @@ _avr_io_mux_write(
 		uint8_t v,
 		void * param)
 {
-	int io = (intptr_t)param;
-	for (int i = 0; i < avr->io_shared_io[io].used; i++) {
-		avr_io_write_t c = avr->io_shared_io[io].io[i].c;
-		if (c)
-			c(avr, addr, v, avr->io_shared_io[io].io[i].param);
+	avr_io_mux_t * m = &avr->io_shared_io->reg[(intptr_t)param];
+	uint8_t changed = avr->data[addr] ^ v;
+	int called = 0;
+
+	for (uint32_t i = 0; i < m->used; i++) {
+		if (!m->io[i].c || (m->io[i].mask && !(m->io[i].mask & changed)))
+			continue;
+		m->io[i].c(avr, addr, v, m->io[i].param);
+		called++;
+	}
+	if (!called)
+		avr_core_watch_write(avr, addr, v);
+}
+
+static void
+_avr_io_mux_add(
+		avr_t * avr,
+		int no,
+		uint8_t mask,
+		avr_io_write_t writep,
+		void * param)
+{
+	avr_io_mux_t * m = &avr->io_shared_io->reg[no];
+
+	for (uint32_t i = 0; i < m->used; i++)
+		if (m->io[i].c == writep && m->io[i].param == param) {
+			// more bits of the same module, or now all of them
+			m->io[i].mask = m->io[i].mask && mask ? m->io[i].mask | mask : 0;
+			return;
+		}
+	if (m->used == m->size) {
+		m->size = m->size ? m->size * 2 : 4;
+		m->io = realloc(m->io, m->size * sizeof(m->io[0]));
+	}
+	m->io[m->used].mask = mask;
+	m->io[m->used].param = param;
+	m->io[m->used].c = writep;
+	m->used++;
+}
+
+// returns the index of a new shared register, with the current handler of 'a'
+static int
+_avr_io_mux_install(
+		avr_t * avr,
+		avr_io_addr_t a)
+{
+	if (!avr->io_shared_io)
+		avr->io_shared_io = calloc(1, sizeof(*avr->io_shared_io));
+	avr_io_shared_t * sh = avr->io_shared_io;
+	if (sh->count == sh->size) {
+		sh->size = sh->size ? sh->size * 2 : 4;
+		sh->reg = realloc(sh->reg, sh->size * sizeof(sh->reg[0]));
 	}
+	int no = sh->count++;
+	memset(&sh->reg[no], 0, sizeof(sh->reg[no]));
+	_avr_io_mux_add(avr, no, avr->io[a].w.mask, avr->io[a].w.c, avr->io[a].w.param);
+	avr->io[a].w.param = (void*)(intptr_t)no;
+	avr->io[a].w.c = _avr_io_mux_write;
+	avr->io[a].w.mask = 0;
+	return no;
 }
 
 void
-avr_register_io_write(
+avr_register_io_write_mask(
 		avr_t *avr,
 		avr_io_addr_t addr,
+		uint8_t mask,
 		avr_io_write_t writep,
 		void * param)
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
 
-	if (a >= MAX_IOs) {
+	if (a >= avr->io_count) {
 		AVR_LOG(avr, LOG_ERROR,
 				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
-				__func__, a, MAX_IOs);
+				__func__, a, avr->io_count);
 		abort();
 	}
+	if (avr->io_lazy.current)
+		avr->io[a].lazy |= 1ull << (avr->io_lazy.current - 1);
 	/*
 	 * Verifying that some other piece of code is not installed to watch write
 	 * on this address. If there is, this code installs a "dispatcher" callback
 	 * instead to handle multiple clients, otherwise, it continues as usual
 	 */
-	if (avr->io[a].w.param || avr->io[a].w.c) {
-		if (avr->io[a].w.param != param || avr->io[a].w.c != writep) {
-			// if the muxer not already installed, allocate a new slot
-			if (avr->io[a].w.c != _avr_io_mux_write) {
-				int no = avr->io_shared_io_count++;
-				if (avr->io_shared_io_count > ARRAY_SIZE(avr->io_shared_io)) {
-					AVR_LOG(avr, LOG_ERROR,
-							"IO: %s(): Too many shared IO registers.\n", __func__);
-					abort();
-				}
-				AVR_LOG(avr, LOG_TRACE,
-						"IO: %s(%04x): Installing muxer on register.\n",
-						__func__, addr);
-				avr->io_shared_io[no].used = 1;
-				avr->io_shared_io[no].io[0].param = avr->io[a].w.param;
-				avr->io_shared_io[no].io[0].c = avr->io[a].w.c;
-				avr->io[a].w.param = (void*)(intptr_t)no;
-				avr->io[a].w.c = _avr_io_mux_write;
-			}
-			int no = (intptr_t)avr->io[a].w.param;
-			int d = avr->io_shared_io[no].used++;
-			if (avr->io_shared_io[no].used > ARRAY_SIZE(avr->io_shared_io[0].io)) {
-				AVR_LOG(avr, LOG_ERROR,
-						"IO: %s(): Too many callbacks on %04x.\n",
-						__func__, addr);
-				abort();
-			}
-			avr->io_shared_io[no].io[d].param = param;
-			avr->io_shared_io[no].io[d].c = writep;
-			return;
-		}
+	if (avr->io[a].w.c == _avr_io_mux_write) {
+		_avr_io_mux_add(avr, (intptr_t)avr->io[a].w.param, mask, writep, param);
+		return;
 	}
-
+	if ((avr->io[a].w.param || avr->io[a].w.c) &&
+			(avr->io[a].w.param != param || avr->io[a].w.c != writep)) {
+		AVR_LOG(avr, LOG_TRACE,
+				"IO: %s(%04x): Installing muxer on register.\n",
+				__func__, addr);
+		_avr_io_mux_add(avr, _avr_io_mux_install(avr, a), mask, writep, param);
+		return;
+	}
+	if (avr->io[a].w.c == writep && avr->io[a].w.param == param)
+		mask = avr->io[a].w.mask && mask ? avr->io[a].w.mask | mask : 0;
 	avr->io[a].w.param = param;
 	avr->io[a].w.c = writep;
+	avr->io[a].w.mask = mask;
+	avr->io_hook[addr] |= AVR_IO_HOOK_WRITE;
+}
+
+void
+avr_register_io_write(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		avr_io_write_t writep,
+		void * param)
+{
+	avr_register_io_write_mask(avr, addr, 0, writep, param);
 }
 
 avr_irq_t *
@@ -155,15 +349,64 @@ avr_io_getirq(
 		uint32_t ctl,
 		int index)
 {
+	avr_io_ctl_t * s = _avr_io_ctl_get(avr, ctl);
+	if (s && s->irq && s->irq->irq_count > index)
+		return avr_io_irqs(s->irq) + index;
+	/*
+	 * The slot was filled from the whole list, so no module has these
+	 * irqs; parts probing for a module the core doesn't have, like a
+	 * second UART, get their answer without walking it each time
+	 */
+	if (s && !s->irq)
+		return NULL;
+
 	avr_io_t * port = avr->io_port;
 	while (port) {
-		if (port->irq && port->irq_ioctl_get == ctl && port->irq_count > index)
-			return port->irq + index;
+		if (port->irq_count && port->irq_ioctl_get == ctl && port->irq_count > index)
+			return avr_io_irqs(port) + index;
 		port = port->next;
 	}
 	return NULL;
 }
 
+// sets the core's bits for the irqs of 'a', for whether they are hooked
+static void
+_avr_iomem_irq_update(
+		avr_t * avr,
+		avr_io_addr_t a)
+{
+	avr_irq_t * irq = avr->io[a].irq;
+	uint8_t * h = avr->io_hook + AVR_IO_TO_DATA(a);
+	int hooked = 0;
+
+	for (int i = 0; i <= AVR_IOMEM_IRQ_ALL && !hooked; i++)
+		hooked = irq[i].hook != NULL;
+	*h &= ~(AVR_IO_HOOK_IRQ | AVR_IO_HOOK_IRQ_READ);
+	if (hooked)
+		*h |= AVR_IO_HOOK_IRQ |
+				(avr->io[a].irq_read ? AVR_IO_HOOK_IRQ_READ : 0);
+}
+
+// the irq pool callback, when an irq gets its first hook or loses its last
+static void
+_avr_iomem_irq_hooked(
+		avr_irq_t * irq,
+		void * param)
+{
+	avr_t * avr = param;
+
+	// these are allocated with a base of 0, the other irqs mostly aren't
+	if (irq->irq > AVR_IOMEM_IRQ_ALL)
+		return;
+	for (avr_io_addr_t a = 0; a < avr->io_count; a++) {
+		avr_irq_t * base = avr->io[a].irq;
+		if (base && irq >= base && irq <= base + AVR_IOMEM_IRQ_ALL) {
+			_avr_iomem_irq_update(avr, a);
+			return;
+		}
+	}
+}
+
 avr_irq_t *
 avr_iomem_getirq(
 		avr_t * avr,
@@ -174,6 +417,12 @@ avr_iomem_getirq(
 	if (index > 8)
 		return NULL;
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+	if (a >= avr->io_count) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
+				__func__, a, avr->io_count);
+		return NULL;
+	}
 	if (avr->io[a].irq == NULL) {
 		/*
 		 * Prepare an array of names for the io IRQs. Ideally we'd love to have
@@ -182,30 +431,89 @@ avr_iomem_getirq(
 		char names[9 * 20];
 		char * d = names;
 		const char * namep[9];
-		for (int ni = 0; ni < 9; ni++) {
-			if (ni < 8)
-				sprintf(d, "=avr.io.%04x.%d", addr, ni);
-			else
-				sprintf(d, "8=avr.io.%04x.all", addr);
+		char base[16];
+		int bl = sprintf(base, "=avr.io.%04x.", addr);
+		for (int ni = 0; ni < 8; ni++) {
+			memcpy(d, base, bl);
+			d[bl] = '0' + ni;
+			d[bl + 1] = 0;
 			namep[ni] = d;
-			d += strlen(d) + 1;
+			d += bl + 2;
 		}
-		avr->io[a].irq = avr_alloc_irq(&avr->irq_pool, 0, 9, namep);
+		sprintf(d, "8%sall", base);
+		namep[8] = d;
+		avr->io[a].irq = avr_alloc_irq_arena(&avr->irq_pool, 0, 9, namep);
 		// mark the pin ones as filtered, so they only are raised when changing
 		for (int i = 0; i < 8; i++)
 			avr->io[a].irq[i].flags |= IRQ_FLAG_FILTERED;
+		// the core raises them once one is hooked
+		avr->io[a].irq_read = 1;
+		avr->irq_pool.hooked = _avr_iomem_irq_hooked;
+		avr->irq_pool.hooked_param = avr;
 	}
 	// if given a name, replace the default one...
 	if (name) {
 		int l = strlen(name);
 		char n[l + 10];
 		sprintf(n, "avr.io.%s", name);
-		free((void*)avr->io[a].irq[index].name);
-		avr->io[a].irq[index].name = strdup(n);
+		avr_irq_set_name(avr->io[a].irq + index, n);
 	}
 	return avr->io[a].irq + index;
 }
 
+// the irqs of a module, named after it
+static avr_irq_t *
+_avr_io_alloc_irqs(
+		avr_io_t * io,
+		uint32_t ctl,
+		int count )
+{
+	const char ** irq_names = NULL;
+
+	if (io->irq_names) {
+		// the pointers, then the names, in one go
+		irq_names = malloc(count * (sizeof(char*) + 64));
+		char * buf = (char*)(irq_names + count);
+		for (int i = 0; i < count; i++, buf += 64) {
+			/*
+			 * this bit takes the io module 'kind' ("port")
+			 * the IRQ name ("=0") and the last character of the ioctl ('p','o','r','A')
+			 * to create a full name "=porta.0"
+			 */
+			char * dst = buf;
+			// copy the 'flags' of the name out
+			const char * kind = io->irq_names[i];
+			while (isdigit(*kind))
+				*dst++ = *kind++;
+			while (!isalpha(*kind))
+				*dst++ = *kind++;
+			// add avr name
+//			strcpy(dst, io->avr->mmcu);
+			strcpy(dst, "avr");
+			dst += strlen(dst);
+			*dst ++ = '.';
+			// add module 'kind'
+			strcpy(dst, io->kind);
+			dst += strlen(dst);
+			// add port name, if any
+			if ((ctl & 0xff) > ' ')
+				*dst ++ = tolower(ctl & 0xff);
+			*dst ++ = '.';
+			// add the rest of the irq name
+			strcpy(dst, kind);
+			dst += strlen(dst);
+			*dst = 0;
+
+//			printf("%s\n", buf);
+			irq_names[i] = buf;
+		}
+	}
+	avr_irq_t * irqs = avr_alloc_irq_arena(&io->avr->irq_pool, 0,
+					count, irq_names);
+	free((char*)irq_names);
+	return irqs;
+}
+
 avr_irq_t *
 avr_io_setirqs(
 		avr_io_t * io,
@@ -213,62 +521,297 @@ avr_io_setirqs(
 		int count,
 		avr_irq_t * irqs )
 {
-	// allocate this module's IRQ
+	avr_t * avr = io->avr;
+
 	io->irq_count = count;
+	io->irq_ioctl_get = ctl;
+	if (avr)
+		avr->io_ctl.dirty = 1;
+	// left for later; its registers, registered next, will ask for them
+	if (!irqs && count && io->irq_attach && avr && avr->io_lazy.enabled &&
+			avr->io_lazy.count < AVR_IO_LAZY_MAX) {
+		avr->io_lazy.io[avr->io_lazy.count++] = io;
+		avr->io_lazy.current = avr->io_lazy.count;
+		io->irq = NULL;
+		return NULL;
+	}
+	// allocate this module's IRQ
+	io->irq = irqs ? irqs : _avr_io_alloc_irqs(io, ctl, count);
+	return io->irq;
+}
+
+void
+_avr_io_lazy_attach(
+		avr_io_t * io)
+{
+	AVR_LOG(io->avr, LOG_TRACE, "IO: %s: %s irqs\n", __func__, io->kind);
+	io->irq = _avr_io_alloc_irqs(io, io->irq_ioctl_get, io->irq_count);
+	if (io->irq && io->irq_attach)
+		io->irq_attach(io);
+}
+
+void
+_avr_io_lazy_access(
+		avr_t * avr,
+		avr_io_addr_t a)
+{
+	uint64_t m = avr->io[a].lazy;
+
+	avr->io[a].lazy = 0;
+	for (int i = 0; m; i++, m >>= 1)
+		if (m & 1)
+			avr_io_irqs(avr->io_lazy.io[i]);
+}
+
+/*
+ * A module's clock gate. While it's 'on', the module's timers are kept in
+ * 'timer', and the hooks it had on its registers in 'hook'; the io table
+ * has the stubs below in their place.
+ */
+typedef struct avr_io_gate_t {
+	avr_regbit_t		bit;
+	uint32_t			size;		// of the module structure
+	uint8_t				on;
+	avr_cycle_count_t	since;
+	avr_cycle_timer_slot_t * timer;
+	uint32_t			count, room;
+	struct {
+		avr_io_addr_t	a;
+		int				read;
+		void *			param;
+		void *			c;
+	} *					hook;
+	uint32_t			hooks, hooks_room;
+} avr_io_gate_t;
 
-	if (!irqs) {
-		const char ** irq_names = NULL;
-
-		if (io->irq_names) {
-			irq_names = malloc(count * sizeof(char*));
-			memset(irq_names, 0, count * sizeof(char*));
-			char buf[64];
-			for (int i = 0; i < count; i++) {
-				/*
-				 * this bit takes the io module 'kind' ("port")
-				 * the IRQ name ("=0") and the last character of the ioctl ('p','o','r','A')
-				 * to create a full name "=porta.0"
-				 */
-				char * dst = buf;
-				// copy the 'flags' of the name out
-				const char * kind = io->irq_names[i];
-				while (isdigit(*kind))
-					*dst++ = *kind++;
-				while (!isalpha(*kind))
-					*dst++ = *kind++;
-				// add avr name
-//				strcpy(dst, io->avr->mmcu);
-				strcpy(dst, "avr");
-				dst += strlen(dst);
-				*dst ++ = '.';
-				// add module 'kind'
-				strcpy(dst, io->kind);
-				dst += strlen(dst);
-				// add port name, if any
-				if ((ctl & 0xff) > ' ')
-					*dst ++ = tolower(ctl & 0xff);
-				*dst ++ = '.';
-				// add the rest of the irq name
-				strcpy(dst, kind);
-				dst += strlen(dst);
-				*dst = 0;
-
-//				printf("%s\n", buf);
-				irq_names[i] = strdup(buf);
-			}
+static void
+_avr_io_gated_write(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+}
+
+static uint8_t
+_avr_io_gated_read(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		void * param)
+{
+	return avr->data[addr];
+}
+
+static int
+_avr_io_gate_owns(
+		avr_io_t * io,
+		void * param)
+{
+	return (uint8_t *)param >= (uint8_t *)io &&
+			(uint8_t *)param < (uint8_t *)io + io->gate->size;
+}
+
+// remembers hook 'c', returns 0 if it can be replaced by a stub
+static int
+_avr_io_gate_save(
+		avr_io_t * io,
+		avr_io_addr_t a,
+		int read,
+		void * param,
+		void * c)
+{
+	avr_io_gate_t * g = io->gate;
+	if (g->hooks == g->hooks_room) {
+		uint32_t n = g->hooks_room ? g->hooks_room * 2 : 8;
+		void * h = realloc(g->hook, n * sizeof(g->hook[0]));
+		if (!h) {
+			AVR_LOG(io->avr, LOG_ERROR, "IO: %s: out of memory\n", __func__);
+			return -1;
 		}
-		irqs = avr_alloc_irq(&io->avr->irq_pool, 0,
-						count, irq_names);
-		if (irq_names) {
-			for (int i = 0; i < count; i++)
-				free((char*)irq_names[i]);
-			free((char*)irq_names);
+		g->hook = h;
+		g->hooks_room = n;
+	}
+	g->hook[g->hooks].a = a;
+	g->hook[g->hooks].read = read;
+	g->hook[g->hooks].param = param;
+	g->hook[g->hooks].c = c;
+	g->hooks++;
+	return 0;
+}
+
+// swaps the module's register hooks for the stubs, and back
+static void
+_avr_io_gate_hooks(
+		avr_io_t * io,
+		int on)
+{
+	avr_t * avr = io->avr;
+	avr_io_gate_t * g = io->gate;
+	avr_io_shared_t * sh = avr->io_shared_io;
+
+	if (on) {
+		g->hooks = 0;
+		for (avr_io_addr_t a = 0; a < avr->io_count; a++) {
+			if (avr->io[a].r.c && _avr_io_gate_owns(io, avr->io[a].r.param) &&
+					!_avr_io_gate_save(io, a, 1, avr->io[a].r.param, avr->io[a].r.c))
+				avr->io[a].r.c = _avr_io_gated_read;
+			if (avr->io[a].w.c == _avr_io_mux_write) {
+				int no = (intptr_t)avr->io[a].w.param;
+				for (uint32_t i = 0; i < sh->reg[no].used; i++)
+					if (sh->reg[no].io[i].c &&
+							_avr_io_gate_owns(io, sh->reg[no].io[i].param) &&
+							!_avr_io_gate_save(io, a, 0, sh->reg[no].io[i].param,
+									sh->reg[no].io[i].c))
+						sh->reg[no].io[i].c = _avr_io_gated_write;
+			} else if (avr->io[a].w.c && _avr_io_gate_owns(io, avr->io[a].w.param) &&
+					!_avr_io_gate_save(io, a, 0, avr->io[a].w.param, avr->io[a].w.c))
+				avr->io[a].w.c = _avr_io_gated_write;
 		}
+		return;
 	}
+	// a muxer might have been put in since, look for the stubs
+	for (uint32_t h = 0; h < g->hooks; h++) {
+		avr_io_addr_t a = g->hook[h].a;
+		void * param = g->hook[h].param;
+		if (g->hook[h].read) {
+			if (avr->io[a].r.c == _avr_io_gated_read && avr->io[a].r.param == param)
+				avr->io[a].r.c = g->hook[h].c;
+		} else if (avr->io[a].w.c == _avr_io_mux_write) {
+			int no = (intptr_t)avr->io[a].w.param;
+			for (uint32_t i = 0; i < sh->reg[no].used; i++)
+				if (sh->reg[no].io[i].c == _avr_io_gated_write &&
+						sh->reg[no].io[i].param == param) {
+					sh->reg[no].io[i].c = g->hook[h].c;
+					break;
+				}
+		} else if (avr->io[a].w.c == _avr_io_gated_write && avr->io[a].w.param == param)
+			avr->io[a].w.c = g->hook[h].c;
+	}
+	g->hooks = 0;
+}
 
-	io->irq = irqs;
-	io->irq_ioctl_get = ctl;
-	return io->irq;
+static void
+_avr_io_gate_set(
+		avr_io_t * io,
+		int on)
+{
+	avr_t * avr = io->avr;
+	avr_io_gate_t * g = io->gate;
+
+	AVR_LOG(avr, LOG_TRACE, "IO: %s clock %s\n", io->kind, on ? "stopped" : "started");
+	if (on) {
+		if (io->gated)
+			io->gated(io, 1, 0);
+		g->count = avr_cycle_timer_suspend(avr, io, g->size, &g->timer, &g->room);
+		_avr_io_gate_hooks(io, 1);
+		g->since = avr->cycle;
+		g->on = 1;
+		return;
+	}
+	_avr_io_gate_hooks(io, 0);
+	avr_cycle_timer_resume(avr, g->timer, g->count);
+	g->count = 0;
+	g->on = 0;
+	if (io->gated)
+		io->gated(io, 0, avr->cycle - g->since);
+}
+
+// the PRR registers, for all the modules they gate
+static void
+_avr_io_gate_write(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	avr_core_watch_write(avr, addr, v);
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		avr_io_gate_t * g = io->gate;
+		if (g && g->bit.reg == addr && !!avr_regbit_get(avr, g->bit) != g->on)
+			_avr_io_gate_set(io, !g->on);
+	}
+}
+
+int
+avr_io_register_gate(
+		avr_io_t * io,
+		avr_regbit_t bit,
+		uint32_t size)
+{
+	avr_t * avr = io->avr;
+
+	if (!bit.reg || AVR_DATA_TO_IO(bit.reg) >= avr->io_count || io->gate)
+		return -1;
+	avr_io_gate_t * g = calloc(1, sizeof(*g));
+	if (!g)
+		return -1;
+	g->bit = bit;
+	g->size = size;
+	int hooked = 0;
+	for (avr_io_t * p = avr->io_port; p; p = p->next)
+		hooked |= p->gate && p->gate->bit.reg == bit.reg;
+	io->gate = g;
+	if (!hooked)
+		avr_register_io_write(avr, bit.reg, _avr_io_gate_write, NULL);
+	return 0;
+}
+
+int
+avr_io_gated(
+		avr_io_t * io)
+{
+	return io->gate && io->gate->on;
+}
+
+// the timers are gone already, and the PRR registers cleared
+void
+avr_io_gate_reset(
+		avr_io_t * io)
+{
+	avr_io_gate_t * g = io->gate;
+
+	if (!g || !g->on)
+		return;
+	_avr_io_gate_hooks(io, 0);
+	g->count = 0;
+	g->on = 0;
+}
+
+void
+avr_io_gate_snapshot(
+		avr_io_t * io,
+		avr_snapshot_t * s)
+{
+	avr_io_gate_t * g = io->gate;
+	if (!g)
+		return;
+	uint8_t on = g->on;
+	avr_cycle_count_t since = g->since;
+	uint32_t count = g->count;
+	avr_snapshot_data(s, &on, sizeof(on));
+	avr_snapshot_data(s, &since, sizeof(since));
+	avr_snapshot_data(s, &count, sizeof(count));
+	if (!s->restore) {
+		avr_snapshot_data(s, g->timer, count * sizeof(g->timer[0]));
+		return;
+	}
+	if (s->error)
+		return;
+	if (count > g->room) {
+		avr_cycle_timer_slot_t * t = realloc(g->timer, count * sizeof(*t));
+		if (!t) {
+			s->error = 1;
+			return;
+		}
+		g->timer = t;
+		g->room = count;
+	}
+	if (on != g->on)
+		_avr_io_gate_hooks(io, on);
+	g->on = on;
+	g->since = since;
+	g->count = count;
+	avr_snapshot_data(s, g->timer, count * sizeof(g->timer[0]));
 }
 
 static void
@@ -277,6 +820,12 @@ avr_deallocate_io(
 {
 	if (io->dealloc)
 		io->dealloc(io);
+	if (io->gate) {
+		free(io->gate->timer);
+		free(io->gate->hook);
+		free(io->gate);
+		io->gate = NULL;
+	}
 	avr_free_irq(io->irq, io->irq_count);
 	io->irq_count = 0;
 	io->irq_ioctl_get = 0;
@@ -284,6 +833,60 @@ avr_deallocate_io(
 	io->next = NULL;
 }
 
+void
+avr_iomem_irq_on_read(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		int enable)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (a >= avr->io_count || !avr->io[a].irq) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(): No IRQs allocated on IO address 0x%04x.\n",
+				__func__, addr);
+		return;
+	}
+	avr->io[a].irq_read = !!enable;
+	_avr_iomem_irq_update(avr, a);
+}
+
+void
+avr_iomem_raise_irq(
+		avr_irq_t * irq,
+		uint8_t v)
+{
+	avr_irq_t * all = irq + AVR_IOMEM_IRQ_ALL;
+	/*
+	 * The per bit IRQs are filtered anyway, so only bother raising the ones
+	 * that changed since the last value sent on the 'all' one. If that one
+	 * was never raised, send all of them once.
+	 */
+	uint8_t changed = (all->flags & IRQ_FLAG_INIT) ? 0xff : v ^ all->value;
+
+	avr_raise_irq(all, v);
+	while (changed) {
+		int i = __builtin_ctz(changed);
+		avr_raise_irq(irq + i, (v >> i) & 1);
+		changed &= changed - 1;
+	}
+}
+
+size_t
+avr_io_memory(
+		avr_t * avr)
+{
+	size_t res = avr->io_count * sizeof(*avr->io) + 32 + avr->io_count +
+			avr->io_ctl.size * sizeof(avr->io_ctl.slot[0]);
+	avr_io_shared_t * sh = avr->io_shared_io;
+	if (sh) {
+		res += sizeof(*sh) + sh->size * sizeof(sh->reg[0]);
+		for (uint32_t i = 0; i < sh->count; i++)
+			res += sh->reg[i].size * sizeof(sh->reg[i].io[0]);
+	}
+	return res;
+}
+
 void
 avr_deallocate_ios(
 		avr_t * avr)
@@ -295,4 +898,13 @@ avr_deallocate_ios(
 		port = next;
 	}
 	avr->io_port = NULL;
+	if (avr->io_shared_io) {
+		for (uint32_t i = 0; i < avr->io_shared_io->count; i++)
+			free(avr->io_shared_io->reg[i].io);
+		free(avr->io_shared_io->reg);
+		free(avr->io_shared_io);
+		avr->io_shared_io = NULL;
+	}
+	free(avr->io_ctl.slot);
+	memset(&avr->io_ctl, 0, sizeof(avr->io_ctl));
 }
@@ -35,6 +35,9 @@ extern "C" {
 #define AVR_IOCTL_DEF(_a,_b,_c,_d) \
 	(((_a) << 24)|((_b) << 16)|((_c) << 8)|((_d)))
 
+struct avr_snapshot_t;
+struct avr_io_gate_t;
+
 /*
  * IO module base struct
  * Modules uses that as their first member in their own struct
@@ -56,12 +59,51 @@ typedef struct avr_io_t {
 
 	// optional, a function to free up allocated system resources
 	void (*dealloc)(struct avr_io_t *io);
+	// optional, saves or restores the run time state, see sim_snapshot.h
+	void (*snapshot)(struct avr_io_t *io, struct avr_snapshot_t *s);
+	/*
+	 * optional, called when the module's clock is stopped ('gated' is 1),
+	 * and when it starts again, 'cycles' later; see avr_io_register_gate()
+	 */
+	void (*gated)(struct avr_io_t *io, int gated, avr_cycle_count_t cycles);
+	struct avr_io_gate_t * gate;	// private, see avr_io_register_gate()
+	/*
+	 * optional, sets the irqs up once they are allocated: their flags, the
+	 * module's notifies, and the connections to the other modules. It's
+	 * called after reset(), and when the irqs are allocated late; the
+	 * modules that have it can have them allocated late, see avr_t.io_lazy
+	 */
+	void (*irq_attach)(struct avr_io_t *io);
+	// bytes moved, conversions started or writes, see sim_energy.h
+	uint64_t			events;
+	// optional, the bytes the module allocated for itself, see sim_memory.h
+	size_t (*memory)(struct avr_io_t *io);
 } avr_io_t;
 
 /*
  * IO modules helper functions
  */
 
+/*
+ * The cycles an operation of a module takes: 'cycles', its own time, or
+ * just the one with AVR_TIMING_FUNCTIONAL; it's then done by the time the
+ * firmware reads its status, or its interrupt is taken after the next
+ * instruction. Not for the module's periods, the ones the firmware keeps
+ * its time with (timers, watchdog, free running ADC) stay as they are.
+ */
+static inline avr_cycle_count_t
+avr_io_cycles(
+		avr_t * avr,
+		avr_cycle_count_t cycles )
+{
+	return avr->timing == AVR_TIMING_FUNCTIONAL && cycles > 1 ? 1 : cycles;
+}
+
+// the bytes of the io register tables, their hooks and the ioctl lookup
+size_t
+avr_io_memory(
+		avr_t * avr);
+
 // registers an IO module, so it's run(), reset() etc are called
 // this is called by the AVR core init functions, you /could/ register an external
 // one after instantiation, for whatever purpose...
@@ -78,6 +120,29 @@ avr_io_setirqs(
 		int count,
 		avr_irq_t * irqs );
 
+// allocates the irqs left for later, and attaches them, see avr_io_irqs()
+void
+_avr_io_lazy_attach(
+		avr_io_t * io);
+// for the core, the registers at IO address 'a' are accessed the first time
+void
+_avr_io_lazy_access(
+		avr_t * avr,
+		avr_io_addr_t a);
+/*
+ * The irqs of the module, allocated now if they were left for later, see
+ * avr_t.io_lazy. For the module's own code that can be called before the
+ * firmware touches it, like its ioctl, and for code walking the modules.
+ */
+static inline struct avr_irq_t *
+avr_io_irqs(
+		avr_io_t * io )
+{
+	if (!io->irq && io->irq_count)
+		_avr_io_lazy_attach(io);
+	return io->irq;
+}
+
 // register a callback for when IO register "addr" is read
 void
 avr_register_io_read(
@@ -85,6 +150,48 @@ avr_register_io_read(
 		avr_io_addr_t addr,
 		avr_io_read_t read,
 		void * param);
+/*
+ * Tells the core that the read callback of "addr" only reports state:
+ * reading it again and again returns the same value and changes nothing
+ * more, until a cycle timer, an irq, an interrupt or a write changes it.
+ * A busy loop polling that register is then skipped up to the next cycle
+ * timer, as if it had no callback (see the busy loops in sim_core.c).
+ * A callback can stop being one, when what it raises is watched, with
+ * avr_unregister_io_read_poll(); the loop it's in isn't skipped then.
+ */
+void
+avr_register_io_read_poll(
+		avr_t *avr,
+		avr_io_addr_t addr);
+void
+avr_unregister_io_read_poll(
+		avr_t *avr,
+		avr_io_addr_t addr);
+/*
+ * Tells the core that the read callback of "addr" returns the same value,
+ * and does nothing more that matters, as long as '*version' doesn't change;
+ * the module bumps it when the state the callback reads changes other than
+ * from a write to one of its registers. Until then, the core doesn't call
+ * it again, it returns what it returned last, from avr->data.
+ *
+ * The firmware's writes to the registers with a callback, avr_reset(),
+ * avr_snapshot_restore() and any irq hook coming or going (what the
+ * callbacks raise is watched differently) make the core call them all
+ * again; so should code
+ * that changes avr->data behind the modules' back, with
+ * avr_io_read_invalidate().
+ */
+void
+avr_register_io_read_cached(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		uint32_t * version);
+static inline void
+avr_io_read_invalidate(
+		avr_t * avr)
+{
+	avr->io_epoch++;
+}
 // register a callback for when the IO register is written. callback has to set the memory itself
 void
 avr_register_io_write(
@@ -92,6 +199,19 @@ avr_register_io_write(
 		avr_io_addr_t addr,
 		avr_io_write_t write,
 		void * param);
+/*
+ * Same, for a register shared with other modules: the callback is only
+ * called when one of the 'mask' bits changes, the others are not its own.
+ * When none of the callbacks of a write are called, the value is stored
+ * as is. A 'mask' of zero is the same as avr_register_io_write()
+ */
+void
+avr_register_io_write_mask(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		uint8_t mask,
+		avr_io_write_t write,
+		void * param);
 // call every IO modules until one responds to this
 int
 avr_ioctl(
@@ -110,6 +230,9 @@ avr_io_getirq(
 // tracing changes of values into a register
 // Note that the values do not "magically" change, they change only
 // when the AVR code attempt to read and write at that address
+// The core only raises them while one of them is hooked, or connected:
+// a tracer that unhooks them when paused costs nothing to the core, and
+// their values are stale until one is hooked again.
 //
 // the "index" is a bit number, or ALL bits if index == 8
 #define AVR_IOMEM_IRQ_ALL 8
@@ -120,6 +243,52 @@ avr_iomem_getirq(
 		const char * name /* Optional, if NULL, "ioXXXX" will be used */ ,
 		int index);
 
+// Enable/disable raising the IRQs returned by avr_iomem_getirq() when the
+// AVR code *reads* the register, they are raised on reads by default. This
+// has to be called after avr_iomem_getirq()
+void
+avr_iomem_irq_on_read(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		int enable);
+
+// Raise the avr_iomem_getirq() 'irq' array for a new register value 'v';
+// the per bit IRQs are only raised for the bits that changed since last time
+void
+avr_iomem_raise_irq(
+		avr_irq_t * irq,
+		uint8_t v);
+
+/*
+ * Clock gating: 'bit' is the module's bit in a PRR register, and 'size' the
+ * size of the module structure. While the bit is set, the module's pending
+ * cycle timers are taken out, with the cycles they had left, and its
+ * register hooks are bypassed: writes are dropped, reads return what the
+ * register held. The hooks are the ones whose 'param' is inside the
+ * structure. Clearing the bit puts it all back, the module does nothing,
+ * and costs nothing, in between.
+ * Returns 0, or -1 if the bit isn't in the io space.
+ */
+int
+avr_io_register_gate(
+		avr_io_t * io,
+		avr_regbit_t bit,
+		uint32_t size);
+
+// returns 1 while the module's clock is stopped
+int
+avr_io_gated(
+		avr_io_t * io);
+
+// Private, called from avr_reset() and the snapshots
+void
+avr_io_gate_reset(
+		avr_io_t * io);
+void
+avr_io_gate_snapshot(
+		avr_io_t * io,
+		struct avr_snapshot_t * s);
+
 // Terminates all IOs and remove from them from the io chain
 void
 avr_deallocate_ios(
@@ -22,7 +22,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include "sim_irq.h"
+#include "sim_irq_prof.h"
+#include "sim_arena.h"
+#include "sim_timer_prof.h"
 
 // internal structure for a hook, never seen by the notify procs
 typedef struct avr_irq_hook_t {
@@ -34,12 +38,205 @@ typedef struct avr_irq_hook_t {
 	void * param;				// "notify" parameter
 } avr_irq_hook_t;
 
+// a frozen copy of an irq hook list
+typedef struct avr_irq_flat_t {
+	int count;
+	int depth;		// nested raises going through it
+	int dead;		// the irq was changed during a raise, free when done
+	struct {
+		avr_irq_notify_t notify;
+		void * param;
+		struct avr_irq_t * chain;
+		int busy;
+	} hook[];
+} avr_irq_flat_t;
+
+/*
+ * Irqs, their names and hooks for a pool are bump allocated in chunks,
+ * so a board's are next to each other, and they all go in one go.
+ */
+#define AVR_IRQ_ARENA_CHUNK	4096
+
+typedef struct avr_irq_arena_t {
+	struct avr_irq_arena_t * next;
+	size_t size, used;
+	int paged;		// from pool->pages, it goes with them
+	uint8_t data[];
+} avr_irq_arena_t;
+
+// returns zeroed memory, aligned for anything
+static void *
+_avr_irq_arena_alloc(
+		avr_irq_pool_t * pool,
+		size_t size)
+{
+	const size_t align = 2 * sizeof(void*);
+	avr_irq_arena_t * a = pool->arena;
+
+	size = (size + align - 1) & ~(align - 1);
+	if (!a || a->used + size > a->size) {
+		size_t chunk = size > AVR_IRQ_ARENA_CHUNK ? size : AVR_IRQ_ARENA_CHUNK;
+		size_t bytes = sizeof(*a) + chunk + align;
+		int paged = 0;
+		if (pool->pages && (a = avr_arena_alloc(pool->pages, bytes)))
+			paged = 1;
+		else if (!(a = malloc(bytes)))
+			return NULL;
+		a->paged = paged;
+		a->next = pool->arena;
+		a->size = chunk + align;
+		// start on an aligned address
+		a->used = (align - ((uintptr_t)a->data & (align - 1))) & (align - 1);
+		pool->arena = a;
+	}
+	void * res = a->data + a->used;
+	a->used += size;
+	memset(res, 0, size);
+	return res;
+}
+
+static char *
+_avr_irq_strdup(
+		avr_irq_pool_t * pool,
+		const char * s)
+{
+	if (!pool)
+		return strdup(s);
+	char * res = _avr_irq_arena_alloc(pool, strlen(s) + 1);
+	if (res)
+		strcpy(res, s);
+	return res;
+}
+
+// drops the frozen copy, the hook list is used again
+static void
+_avr_irq_thaw(
+		avr_irq_t * irq)
+{
+	avr_irq_flat_t * flat = irq->flat;
+	if (!flat)
+		return;
+	irq->flat = NULL;
+	if (flat->depth)
+		flat->dead = 1;
+	else
+		free(flat);
+}
+
+/*
+ * The name index is an open addressing hash of the pool's named irqs,
+ * kept at most half full. Removing irqs just marks it for a rebuild.
+ */
+static const char *
+_avr_irq_name_key(
+		const char * name)
+{
+	while (isdigit((unsigned char)*name))
+		name++;
+	while (*name && !isalpha((unsigned char)*name))
+		name++;
+	return name;
+}
+
+static uint32_t
+_avr_irq_name_hash(
+		const char * key)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	while (*key)
+		h = (h ^ (uint8_t)*key++) * 16777619u;
+	return h;
+}
+
+static void
+_avr_irq_index_insert(
+		avr_irq_pool_t * pool,
+		avr_irq_t * irq)
+{
+	uint32_t mask = pool->index_size - 1;
+	uint32_t i = _avr_irq_name_hash(_avr_irq_name_key(irq->name)) & mask;
+	while (pool->index[i])
+		i = (i + 1) & mask;
+	pool->index[i] = irq;
+	pool->index_count++;
+}
+
+static void
+_avr_irq_index_rebuild(
+		avr_irq_pool_t * pool,
+		uint32_t size)
+{
+	avr_irq_t ** index = calloc(size, sizeof(index[0]));
+	if (!index)
+		return;		// keep the old one
+	free(pool->index);
+	pool->index = index;
+	pool->index_size = size;
+	pool->index_count = 0;
+	pool->index_dirty = 0;
+	for (int i = 0; i < pool->count; i++)
+		if (pool->irq[i] && pool->irq[i]->name)
+			_avr_irq_index_insert(pool, pool->irq[i]);
+}
+
+static void
+_avr_irq_index_add(
+		avr_irq_pool_t * pool,
+		avr_irq_t * irq)
+{
+	// the index is only built once something is looked up
+	if (!pool->index || pool->index_dirty || !irq->name)
+		return;
+	if ((pool->index_count + 1) * 2 > pool->index_size)
+		_avr_irq_index_rebuild(pool, pool->index_size * 2);
+	else
+		_avr_irq_index_insert(pool, irq);
+}
+
+avr_irq_t *
+avr_irq_pool_find(
+		avr_irq_pool_t * pool,
+		const char * name)
+{
+	if (!pool || !name)
+		return NULL;
+	if (!pool->index || pool->index_dirty) {
+		uint32_t size = 64;
+		while (size < pool->count * 2)
+			size *= 2;
+		_avr_irq_index_rebuild(pool, size);
+		if (!pool->index)
+			return NULL;
+	}
+	const char * key = _avr_irq_name_key(name);
+	uint32_t mask = pool->index_size - 1;
+	for (uint32_t i = _avr_irq_name_hash(key) & mask; pool->index[i]; i = (i + 1) & mask)
+		if (!strcmp(_avr_irq_name_key(pool->index[i]->name), key))
+			return pool->index[i];
+	return NULL;
+}
+
+void
+avr_irq_set_name(
+		avr_irq_t * irq,
+		const char * name)
+{
+	if (!irq->pool) {
+		free((void*)irq->name);
+		irq->name = name ? strdup(name) : NULL;
+		return;
+	}
+	// the old one stays in the arena until the pool goes
+	irq->name = name ? _avr_irq_strdup(irq->pool, name) : NULL;
+	irq->pool->index_dirty = 1;
+}
+
 static void
 _avr_irq_pool_add(
 		avr_irq_pool_t * pool,
 		avr_irq_t * irq)
 {
-	int insert = 0;
+	int insert = pool->free_hint;
 	/* lookup a slot */
 	for (; insert < pool->count && pool->irq[insert]; insert++)
 		;
@@ -51,19 +248,35 @@ _avr_irq_pool_add(
 		pool->count++;
 	}
 	pool->irq[insert] = irq;
+	pool->free_hint = insert + 1;
+	pool->serial++;
 	irq->pool = pool;
 }
 
+/*
+ * The lookup starts at '*hint', and leaves it past the irq removed; irqs
+ * allocated together are next to each other in the pool too.
+ */
 static void
 _avr_irq_pool_remove(
 		avr_irq_pool_t * pool,
-		avr_irq_t * irq)
+		avr_irq_t * irq,
+		int * hint)
 {
-	for (int i = 0; i < pool->count; i++)
+	int start = *hint < pool->count ? *hint : 0;
+	for (int n = 0, i = start; n < pool->count; n++, i++) {
+		if (i == pool->count)
+			i = 0;
 		if (pool->irq[i] == irq) {
 			pool->irq[i] = 0;
+			pool->index_dirty = 1;
+			if (i < pool->free_hint)
+				pool->free_hint = i;
+			pool->serial++;
+			*hint = i + 1;
 			return;
 		}
+	}
 }
 
 void
@@ -82,10 +295,12 @@ avr_init_irq(
 		if (pool)
 			_avr_irq_pool_add(pool, &irq[i]);
 		if (names && names[i])
-			irq[i].name = strdup(names[i]);
+			irq[i].name = _avr_irq_strdup(pool, names[i]);
 		else {
 			printf("WARNING %s() with NULL name for irq %d.\n", __func__, irq[i].irq);
 		}
+		if (pool)
+			_avr_irq_index_add(pool, &irq[i]);
 	}
 }
 
@@ -96,24 +311,183 @@ avr_alloc_irq(
 		uint32_t count,
 		const char ** names /* optional */)
 {
-	avr_irq_t * irq = (avr_irq_t*)malloc(sizeof(avr_irq_t) * count);
+	avr_irq_t * irq = malloc(sizeof(avr_irq_t) * count);
+	if (!irq)
+		return NULL;
 	avr_init_irq(pool, irq, base, count, names);
 	for (int i = 0; i < count; i++)
 		irq[i].flags |= IRQ_FLAG_ALLOC;
 	return irq;
 }
 
+avr_irq_t *
+avr_alloc_irq_arena(
+		avr_irq_pool_t * pool,
+		uint32_t base,
+		uint32_t count,
+		const char ** names /* optional */)
+{
+	if (!pool)
+		return avr_alloc_irq(pool, base, count, names);
+	// freed with the pool
+	avr_irq_t * irq = _avr_irq_arena_alloc(pool, sizeof(avr_irq_t) * count);
+	if (irq)
+		avr_init_irq(pool, irq, base, count, names);
+	return irq;
+}
+
+// tells the pool's owner the irq is now hooked, or not anymore
+static inline void
+_avr_irq_hooked(
+		avr_irq_t * irq)
+{
+	avr_irq_pool_t * pool = irq->pool;
+
+	if (pool && pool->hooked)
+		pool->hooked(irq, pool->hooked_param);
+}
+
 static avr_irq_hook_t *
 _avr_alloc_irq_hook(
 		avr_irq_t * irq)
 {
-	avr_irq_hook_t *hook = malloc(sizeof(avr_irq_hook_t));
-	memset(hook, 0, sizeof(avr_irq_hook_t));
+	avr_irq_pool_t * pool = irq->pool;
+	avr_irq_hook_t *hook;
+	if (pool && pool->hook_free) {
+		hook = pool->hook_free;
+		pool->hook_free = hook->next;
+		memset(hook, 0, sizeof(avr_irq_hook_t));
+	} else if (pool)
+		hook = _avr_irq_arena_alloc(pool, sizeof(avr_irq_hook_t));
+	else
+		hook = calloc(1, sizeof(avr_irq_hook_t));
+	if (!hook)
+		return NULL;
 	hook->next = irq->hook;
 	irq->hook = hook;
+	_avr_irq_thaw(irq);
+	if (pool)
+		pool->serial++;
+	if (!hook->next)
+		_avr_irq_hooked(irq);
 	return hook;
 }
 
+static void
+_avr_irq_raise(
+		avr_irq_t * irq,
+		uint32_t value,
+		int floating,
+		avr_irq_stats_t * stats);
+
+// counts a raise of 'irq', and how deep it is, when profiling the pool
+static void
+_avr_irq_prof_raised(
+		avr_irq_t * irq)
+{
+	avr_irq_prof_t * prof = irq->pool->prof;
+	avr_irq_prof_entry_t * e = avr_irq_prof_get(prof, irq, NULL, NULL, NULL);
+	if (e) {
+		e->raised++;
+		if (e->depth < prof->depth)
+			e->depth = prof->depth;
+	}
+}
+
+static void
+_avr_irq_prof_filtered(
+		avr_irq_t * irq)
+{
+	avr_irq_prof_entry_t * e = avr_irq_prof_get(irq->pool->prof, irq,
+			NULL, NULL, NULL);
+	if (e)
+		e->filtered++;
+}
+
+typedef struct avr_irq_delta_t {
+	avr_irq_delta_pending_t pending;
+	void *			param;
+	int				flushing;
+	uint32_t		count, size;
+	struct {
+		avr_irq_t *	irq;
+		uint32_t	value;
+		int			floating;
+	} * entry;
+} avr_irq_delta_t;
+
+// returns 1 if the raise was queued, or merged with the queued one
+static int
+_avr_irq_delta_queue(
+		avr_irq_t * irq,
+		uint32_t value,
+		int floating,
+		avr_irq_stats_t * stats)
+{
+	avr_irq_delta_t * d = irq->pool->delta;
+
+	if (d->flushing)
+		return 0;
+	if (irq->flags & IRQ_FLAG_QUEUED) {
+		for (uint32_t i = 0; i < d->count; i++)
+			if (d->entry[i].irq == irq) {
+				d->entry[i].value = value;
+				d->entry[i].floating = floating;
+				if (stats)
+					stats->coalesced++;
+				return 1;
+			}
+	}
+	uint32_t output = (irq->flags & IRQ_FLAG_NOT) ? !value : value;
+	if (irq->value == output &&
+			(irq->flags & IRQ_FLAG_FILTERED) && !(irq->flags & IRQ_FLAG_INIT)) {
+		if (irq->pool->prof)
+			_avr_irq_prof_filtered(irq);
+		return 1;
+	}
+	if (d->count == d->size) {
+		uint32_t size = d->size ? d->size * 2 : 16;
+		void * e = realloc(d->entry, size * sizeof(d->entry[0]));
+		if (!e)
+			return 0;
+		d->entry = e;
+		d->size = size;
+	}
+	d->entry[d->count].irq = irq;
+	d->entry[d->count].value = value;
+	d->entry[d->count].floating = floating;
+	irq->flags |= IRQ_FLAG_QUEUED;
+	if (d->count++ == 0 && d->pending)
+		d->pending(d->param);
+	return 1;
+}
+
+// drops the queued raises of 'irq', it's going away
+static void
+_avr_irq_delta_remove(
+		avr_irq_t * irq)
+{
+	avr_irq_delta_t * d = irq->pool->delta;
+
+	for (uint32_t i = 0; i < d->count; i++)
+		if (d->entry[i].irq == irq)
+			d->entry[i].irq = NULL;
+	irq->flags &= ~IRQ_FLAG_QUEUED;
+}
+
+static void
+_avr_free_irq_hook(
+		avr_irq_t * irq,
+		avr_irq_hook_t * hook)
+{
+	if (irq->pool) {
+		hook->next = irq->pool->hook_free;
+		irq->pool->hook_free = hook;
+		irq->pool->serial++;
+	} else
+		free(hook);
+}
+
 void
 avr_free_irq(
 		avr_irq_t * irq,
@@ -121,18 +495,22 @@ avr_free_irq(
 {
 	if (!irq || !count)
 		return;
+	int hint = 0;
 	for (int i = 0; i < count; i++) {
 		avr_irq_t * iq = irq + i;
+		if ((iq->flags & IRQ_FLAG_QUEUED) && iq->pool && iq->pool->delta)
+			_avr_irq_delta_remove(iq);
 		if (iq->pool)
-			_avr_irq_pool_remove(iq->pool, iq);
-		if (iq->name)
+			_avr_irq_pool_remove(iq->pool, iq, &hint);
+		if (iq->name && !iq->pool)
 			free((char*)iq->name);
 		iq->name = NULL;
+		_avr_irq_thaw(iq);
 		// purge hooks
 		avr_irq_hook_t *hook = iq->hook;
 		while (hook) {
 			avr_irq_hook_t * next = hook->next;
-			free(hook);
+			_avr_free_irq_hook(iq, hook);
 			hook = next;
 		}
 		iq->hook = NULL;
@@ -158,6 +536,8 @@ avr_irq_register_notify(
 		hook = hook->next;
 	}
 	hook = _avr_alloc_irq_hook(irq);
+	if (!hook)
+		return;
 	hook->notify = notify;
 	hook->param = param;
 }
@@ -180,7 +560,10 @@ avr_irq_unregister_notify(
 				prev->next = hook->next;
 			else
 				irq->hook = hook->next;
-			free(hook);
+			_avr_free_irq_hook(irq, hook);
+			_avr_irq_thaw(irq);
+			if (!irq->hook)
+				_avr_irq_hooked(irq);
 			return;
 		}
 		prev = hook;
@@ -188,6 +571,53 @@ avr_irq_unregister_notify(
 	}
 }
 
+int
+avr_irq_hook_count(
+		avr_irq_t * irq)
+{
+	int count = 0;
+	for (avr_irq_hook_t * hook = irq ? irq->hook : NULL; hook; hook = hook->next)
+		count++;
+	return count;
+}
+
+int
+avr_irq_delta_init(
+		avr_irq_pool_t * pool,
+		avr_irq_delta_pending_t pending,
+		void * param)
+{
+	if (pool->delta)
+		return 0;
+	pool->delta = calloc(1, sizeof(*pool->delta));
+	if (!pool->delta)
+		return -1;
+	pool->delta->pending = pending;
+	pool->delta->param = param;
+	return 0;
+}
+
+void
+avr_irq_delta_flush(
+		avr_irq_pool_t * pool)
+{
+	avr_irq_delta_t * d = pool->delta;
+
+	if (!d || !d->count || d->flushing)
+		return;
+	d->flushing = 1;
+	for (uint32_t i = 0; i < d->count; i++) {
+		avr_irq_t * irq = d->entry[i].irq;
+		if (!irq)
+			continue;
+		irq->flags &= ~IRQ_FLAG_QUEUED;
+		_avr_irq_raise(irq, d->entry[i].value, d->entry[i].floating,
+				pool->stats);
+	}
+	d->count = 0;
+	d->flushing = 0;
+}
+
 void
 avr_raise_irq_float(
 		avr_irq_t * irq,
@@ -196,22 +626,146 @@ avr_raise_irq_float(
 {
 	if (!irq)
 		return ;
+	avr_irq_stats_t * stats = irq->pool ? irq->pool->stats : NULL;
+	if (stats)
+		stats->raised++;
+	if (irq->pool && irq->pool->prof)
+		_avr_irq_prof_raised(irq);
+	if ((irq->flags & IRQ_FLAG_DELTA) && irq->pool && irq->pool->delta &&
+			_avr_irq_delta_queue(irq, value, floating, stats))
+		return;
+	_avr_irq_raise(irq, value, floating, stats);
+}
+
+// calls one hook, and counts it, when profiling
+static void
+_avr_irq_prof_hook(
+		avr_irq_t * irq,
+		uint32_t output,
+		int floating,
+		avr_irq_stats_t * stats,
+		avr_irq_notify_t notify,
+		void * param,
+		avr_irq_t * chain,
+		int * busy)
+{
+	avr_irq_prof_t * prof = irq->pool->prof;
+	avr_irq_prof_entry_t * e;
+
+	if (*busy) {
+		if ((e = avr_irq_prof_get(prof, irq, notify, param, chain)))
+			e->busy++;
+		return;
+	}
+	(*busy)++;
+	uint64_t start = avr_prof_now();
+	if (notify) {
+		if (stats)
+			stats->notified++;
+		notify(irq, output, param);
+	}
+	if (chain)
+		avr_raise_irq_float(chain, output, floating);
+	uint64_t ns = avr_prof_now() - start;
+	(*busy)--;
+	// the hook could have stopped the profile
+	if (irq->pool->prof == prof &&
+			(e = avr_irq_prof_get(prof, irq, notify, param, chain))) {
+		e->called++;
+		e->host_ns += ns;
+	}
+}
+
+// same as _avr_irq_raise() past the filter, hook by hook
+static void
+_avr_irq_raise_prof(
+		avr_irq_t * irq,
+		uint32_t output,
+		int floating,
+		avr_irq_stats_t * stats)
+{
+	avr_irq_prof_t * prof = irq->pool->prof;
+	avr_irq_flat_t * flat = irq->flat;
+
+	prof->depth++;
+	if (flat) {
+		flat->depth++;
+		for (int i = 0; i < flat->count && !flat->dead; i++)
+			_avr_irq_prof_hook(irq, output, floating, stats,
+					flat->hook[i].notify, flat->hook[i].param,
+					flat->hook[i].chain, &flat->hook[i].busy);
+		if (!--flat->depth && flat->dead)
+			free(flat);
+	} else {
+		avr_irq_hook_t * hook = irq->hook;
+		while (hook) {
+			avr_irq_hook_t * next = hook->next;
+			_avr_irq_prof_hook(irq, output, floating, stats,
+					hook->notify, hook->param, hook->chain, &hook->busy);
+			hook = next;
+		}
+	}
+	if (irq->pool->prof == prof)
+		prof->depth--;
+	irq->value = output;
+}
+
+static void
+_avr_irq_raise(
+		avr_irq_t * irq,
+		uint32_t value,
+		int floating,
+		avr_irq_stats_t * stats)
+{
 	uint32_t output = (irq->flags & IRQ_FLAG_NOT) ? !value : value;
-	// if value is the same but it's the first time, raise it anyway
+	// if value is the same but it's the first time, or it was floating and
+	// isn't anymore (or the other way around), raise it anyway
 	if (irq->value == output &&
-			(irq->flags & IRQ_FLAG_FILTERED) && !(irq->flags & IRQ_FLAG_INIT))
+			(irq->flags & IRQ_FLAG_FILTERED) && !(irq->flags & IRQ_FLAG_INIT) &&
+			!(irq->flags & IRQ_FLAG_FLOATING) == !floating) {
+		if (irq->pool && irq->pool->prof)
+			_avr_irq_prof_filtered(irq);
 		return;
+	}
 	irq->flags &= ~(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING);
 	if (floating)
 		irq->flags |= IRQ_FLAG_FLOATING;
+	if (irq->pool && irq->pool->prof) {
+		_avr_irq_raise_prof(irq, output, floating, stats);
+		return;
+	}
+	avr_irq_flat_t * flat = irq->flat;
+	if (flat) {
+		flat->depth++;
+		for (int i = 0; i < flat->count && !flat->dead; i++) {
+			if (flat->hook[i].busy)
+				continue;
+			flat->hook[i].busy++;
+			if (flat->hook[i].notify) {
+				if (stats)
+					stats->notified++;
+				flat->hook[i].notify(irq, output, flat->hook[i].param);
+			}
+			if (flat->hook[i].chain)
+				avr_raise_irq_float(flat->hook[i].chain, output, floating);
+			flat->hook[i].busy--;
+		}
+		if (!--flat->depth && flat->dead)
+			free(flat);
+		irq->value = output;
+		return;
+	}
 	avr_irq_hook_t *hook = irq->hook;
 	while (hook) {
 		avr_irq_hook_t * next = hook->next;
 			// prevents reentrance / endless calling loops
 		if (hook->busy == 0) {
 			hook->busy++;
-			if (hook->notify)
+			if (hook->notify) {
+				if (stats)
+					stats->notified++;
 				hook->notify(irq, output,  hook->param);
+			}
 			if (hook->chain)
 				avr_raise_irq_float(hook->chain, output, floating);
 			hook->busy--;
@@ -248,6 +802,8 @@ avr_connect_irq(
 		hook = hook->next;
 	}
 	hook = _avr_alloc_irq_hook(src);
+	if (!hook)
+		return;
 	hook->chain = dst;
 }
 
@@ -270,7 +826,10 @@ avr_unconnect_irq(
 				prev->next = hook->next;
 			else
 				src->hook = hook->next;
-			free(hook);
+			_avr_free_irq_hook(src, hook);
+			_avr_irq_thaw(src);
+			if (!src->hook)
+				_avr_irq_hooked(src);
 			return;
 		}
 		prev = hook;
@@ -278,6 +837,101 @@ avr_unconnect_irq(
 	}
 }
 
+void
+avr_irq_pool_freeze(
+		avr_irq_pool_t * pool)
+{
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		_avr_irq_thaw(irq);
+		int count = 0;
+		for (avr_irq_hook_t * hook = irq->hook; hook; hook = hook->next)
+			count++;
+		if (!count)
+			continue;
+		avr_irq_flat_t * flat = malloc(sizeof(*flat) + count * sizeof(flat->hook[0]));
+		if (!flat)
+			continue;	// the list works too
+		memset(flat, 0, sizeof(*flat));
+		for (avr_irq_hook_t * hook = irq->hook; hook; hook = hook->next) {
+			flat->hook[flat->count].notify = hook->notify;
+			flat->hook[flat->count].param = hook->param;
+			flat->hook[flat->count].chain = hook->chain;
+			flat->hook[flat->count].busy = 0;
+			flat->count++;
+		}
+		irq->flat = flat;
+	}
+}
+
+void
+avr_irq_pool_memory(
+		avr_irq_pool_t * pool,
+		size_t * irqs,
+		size_t * hooks)
+{
+	size_t arena = 0, hooked = 0, in_arena = 0;
+
+	for (avr_irq_arena_t * a = pool->arena; a; a = a->next)
+		arena += sizeof(*a) + a->size;
+	for (avr_irq_hook_t * h = pool->hook_free; h; h = h->next)
+		in_arena += sizeof(*h);
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		for (avr_irq_hook_t * h = irq->hook; h; h = h->next)
+			in_arena += sizeof(*h);
+		if (irq->flat)
+			hooked += sizeof(*irq->flat) +
+					irq->flat->count * sizeof(irq->flat->hook[0]);
+	}
+	if (in_arena > arena)	// the hooks of irqs allocated without a pool
+		in_arena = arena;
+	if (irqs)
+		*irqs = arena - in_arena +
+				((pool->count + 15) & ~15) * sizeof(pool->irq[0]) +
+				pool->index_size * sizeof(pool->index[0]) +
+				(pool->delta ? sizeof(*pool->delta) +
+					pool->delta->size * sizeof(pool->delta->entry[0]) : 0);
+	if (hooks)
+		*hooks = in_arena + hooked;
+}
+
+void
+avr_irq_pool_free(
+		avr_irq_pool_t * pool)
+{
+	/*
+	 * The irqs outside the arena stay, the parts' ones; their hooks and
+	 * names are in it, and the pool is gone
+	 */
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		_avr_irq_thaw(irq);
+		irq->pool = NULL;
+		irq->hook = NULL;
+		irq->name = NULL;
+		irq->flags &= ~IRQ_FLAG_QUEUED;
+	}
+	while (pool->arena) {
+		avr_irq_arena_t * next = pool->arena->next;
+		if (!pool->arena->paged)
+			free(pool->arena);
+		pool->arena = next;
+	}
+	free(pool->irq);
+	free(pool->index);
+	if (pool->delta)
+		free(pool->delta->entry);
+	free(pool->delta);
+	memset(pool, 0, sizeof(*pool));
+}
+
 uint8_t
 avr_irq_get_flags(
 		avr_irq_t * irq )
@@ -23,6 +23,7 @@
 #define __SIM_IRQ_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,14 +59,47 @@ enum {
 	IRQ_FLAG_INIT		= (1 << 3), //!< this irq hasn't been used yet
 	IRQ_FLAG_FLOATING	= (1 << 4), //!< this 'pin'/signal is floating
 	IRQ_FLAG_USER		= (1 << 5), //!< Can be used by irq users
+	IRQ_FLAG_DELTA		= (1 << 6), //!< raises are queued, see avr_irq_delta_init()
+	IRQ_FLAG_QUEUED		= (1 << 7), //!< private, it is in the delta queue
 };
 
+/*
+ * IRQ counters, for the irqs of a pool, when it has some
+ */
+typedef struct avr_irq_stats_t {
+	uint64_t raised;				//!< avr_raise_irq() calls
+	uint64_t notified;				//!< hook callbacks called
+	uint64_t coalesced;				//!< raises merged in the delta queue
+} avr_irq_stats_t;
+
+/*
+ * Called when one of the irqs of a pool gets its first hook, or loses its
+ * last one, so its owner can stop raising the irqs nobody listens to, and
+ * start again once someone does.
+ */
+typedef void (*avr_irq_hooked_t)(
+		struct avr_irq_t * irq,
+		void * param);
+
 /*
  * IRQ Pool structure
  */
 typedef struct avr_irq_pool_t {
 	int count;						//!< number of irqs living in the pool
 	struct avr_irq_t ** irq;		//!< irqs belonging in this pool
+	avr_irq_stats_t * stats;		//!< counters, or NULL
+	struct avr_irq_prof_t * prof;	//!< per irq and hook counters, see sim_irq_prof.h
+	struct avr_irq_arena_t * arena;	//!< allocated irqs, names and hooks
+	struct avr_arena_t * pages;		//!< the arena's chunks come from there, or NULL, see sim_arena.h
+	struct avr_irq_hook_t * hook_free;	//!< released hooks, for reuse
+	struct avr_irq_t ** index;		//!< name hash, see avr_irq_pool_find()
+	uint32_t index_size, index_count;
+	int index_dirty;				//!< irqs were removed, rebuild it
+	int free_hint;					//!< no free slot in irq[] below that one
+	uint32_t serial;				//!< bumped each time an irq or a hook comes or goes
+	struct avr_irq_delta_t * delta;	//!< queue of the IRQ_FLAG_DELTA raises, or NULL
+	avr_irq_hooked_t hooked;		//!< see avr_irq_hooked_t, or NULL
+	void * hooked_param;
 } avr_irq_pool_t;
 
 /*!
@@ -78,15 +112,42 @@ typedef struct avr_irq_t {
 	uint32_t			value;		//!< current value
 	uint8_t				flags;		//!< IRQ_* flags
 	struct avr_irq_hook_t * hook;	//!< list of hooks to be notified
+	struct avr_irq_flat_t * flat;	//!< same hooks, as an array, once frozen
 } avr_irq_t;
 
-//! allocates 'count' IRQs, initializes their "irq" starting from 'base' and increment
+/*!
+ * The bytes a pool takes: 'irqs' gets its irqs, names and tables, 'hooks'
+ * the hooks, in use or free, and their frozen arrays
+ */
+void
+avr_irq_pool_memory(
+		avr_irq_pool_t * pool,
+		size_t * irqs,
+		size_t * hooks);
+
+/*!
+ * allocates 'count' IRQs, initializes their "irq" starting from 'base' and increment
+ * With a pool, their names and hooks are carved out of the pool's arena;
+ * the irqs themselves are the caller's until avr_free_irq(), they can
+ * outlive the pool, see avr_irq_pool_free()
+ */
 avr_irq_t *
 avr_alloc_irq(
 		avr_irq_pool_t * pool,
 		uint32_t base,
 		uint32_t count,
 		const char ** names /* optional */);
+/*!
+ * Same, with the irqs in the pool's arena too, next to each other, and
+ * only released by avr_irq_pool_free(): for the core's own io modules,
+ * that go with the pool in avr_terminate()
+ */
+avr_irq_t *
+avr_alloc_irq_arena(
+		avr_irq_pool_t * pool,
+		uint32_t base,
+		uint32_t count,
+		const char ** names /* optional */);
 void
 avr_free_irq(
 		avr_irq_t * irq,
@@ -142,6 +203,74 @@ avr_irq_unregister_notify(
 		avr_irq_t * irq,
 		avr_irq_notify_t notify,
 		void * param);
+//! the number of hooks, notifications and connections, on 'irq'
+int
+avr_irq_hook_count(
+		avr_irq_t * irq);
+
+/*!
+ * Copies the hooks of every irq of the pool into one array per irq, so
+ * raising them doesn't chase the hook list. Call it once the board is
+ * wired up; any irq whose hooks change afterward goes back to the list,
+ * until the next freeze.
+ */
+void
+avr_irq_pool_freeze(
+		avr_irq_pool_t * pool);
+/*!
+ * Returns the irq of the pool with that name, or NULL. The size and
+ * direction flags at the start of irq names ("8>", "=" etc) are
+ * optional, "avr.portb.3" finds "=avr.portb.3". If several irqs share a
+ * name, the first one added wins.
+ */
+avr_irq_t *
+avr_irq_pool_find(
+		avr_irq_pool_t * pool,
+		const char * name);
+/*!
+ * Replaces the name of an irq, keeping the name index up to date.
+ */
+void
+avr_irq_set_name(
+		avr_irq_t * irq,
+		const char * name);
+/*!
+ * Delta queue: once started on a pool, raising one of its irqs flagged
+ * IRQ_FLAG_DELTA doesn't call the hooks, it queues the value, or replaces
+ * the one already queued for that irq. avr_irq_delta_flush() then raises
+ * each queued irq once, with its last value; with IRQ_FLAG_FILTERED, an
+ * irq that ends up where it started isn't raised at all. Until then, the
+ * irq's 'value' is still the one it had.
+ * 'pending' is called with 'param' when the queue stops being empty, so
+ * the owner of the pool knows it has to flush it; the core does that at
+ * the end of each instruction, see avr_delta_init().
+ * The raises the hooks make during the flush aren't queued, they go
+ * through right away.
+ */
+typedef void (*avr_irq_delta_pending_t)(
+		void * param);
+
+//! starts queuing on 'pool', returns 0, or -1
+int
+avr_irq_delta_init(
+		avr_irq_pool_t * pool,
+		avr_irq_delta_pending_t pending,
+		void * param);
+//! raises the queued irqs
+void
+avr_irq_delta_flush(
+		avr_irq_pool_t * pool);
+
+/*!
+ * Releases all the memory of the pool in one go. The irqs of its arena
+ * can't be used afterward; the others, from avr_alloc_irq() or
+ * avr_init_irq() on memory of their own (the parts'), are left out of
+ * any pool with no hooks and no name: avr_free_irq(), avr_unconnect_irq()
+ * and avr_irq_unregister_notify() can still be called on them.
+ */
+void
+avr_irq_pool_free(
+		avr_irq_pool_t * pool);
 
 #ifdef __cplusplus
 };
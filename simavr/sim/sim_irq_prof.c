@@ -0,0 +1,269 @@
+/*
+	sim_irq_prof.c
+
+	Tells which irqs, and which of their hooks, a simulation spends its
+	time on.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sim_irq_prof.h"
+#include "sim_timer_prof.h"
+
+#define IRQ_PROF_SIZE	256
+
+static inline uint32_t
+_avr_irq_prof_hash(
+		avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		void * param,
+		avr_irq_t * chain)
+{
+	uint64_t h = ((uintptr_t)irq ^ ((uintptr_t)notify * 31) ^
+			((uintptr_t)param * 131) ^ ((uintptr_t)chain * 1031)) *
+			0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+static inline int
+_avr_irq_prof_is(
+		avr_irq_prof_entry_t * e,
+		avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		void * param,
+		avr_irq_t * chain)
+{
+	return e->irq == irq && e->notify == notify && e->param == param &&
+			e->chain == chain;
+}
+
+// the entry, or NULL if there's none
+static avr_irq_prof_entry_t *
+_avr_irq_prof_find(
+		avr_irq_prof_t * p,
+		avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		void * param,
+		avr_irq_t * chain)
+{
+	if (!p->size)
+		return NULL;
+	for (uint32_t h = _avr_irq_prof_hash(irq, notify, param, chain);; h++) {
+		avr_irq_prof_entry_t * e = &p->entry[h & (p->size - 1)];
+		if (!e->irq)
+			return NULL;
+		if (_avr_irq_prof_is(e, irq, notify, param, chain))
+			return e;
+	}
+}
+
+static int
+_avr_irq_prof_grow(
+		avr_irq_prof_t * p)
+{
+	uint32_t size = p->size ? p->size * 2 : IRQ_PROF_SIZE;
+	avr_irq_prof_entry_t * e = calloc(size, sizeof(*e));
+	if (!e)
+		return -1;
+	for (uint32_t i = 0; i < p->size; i++) {
+		avr_irq_prof_entry_t * o = &p->entry[i];
+		if (!o->irq)
+			continue;
+		uint32_t h = _avr_irq_prof_hash(o->irq, o->notify, o->param, o->chain);
+		while (e[h & (size - 1)].irq)
+			h++;
+		e[h & (size - 1)] = *o;
+	}
+	free(p->entry);
+	p->entry = e;
+	p->size = size;
+	return 0;
+}
+
+avr_irq_prof_entry_t *
+avr_irq_prof_get(
+		avr_irq_prof_t * p,
+		avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		void * param,
+		avr_irq_t * chain)
+{
+	avr_irq_prof_entry_t * e = _avr_irq_prof_find(p, irq, notify, param, chain);
+	if (e)
+		return e;
+	// kept at most 3/4 full
+	if ((p->count + 1) * 4 > p->size * 3 && _avr_irq_prof_grow(p))
+		return NULL;
+	uint32_t h = _avr_irq_prof_hash(irq, notify, param, chain);
+	while (p->entry[h & (p->size - 1)].irq)
+		h++;
+	e = &p->entry[h & (p->size - 1)];
+	e->irq = irq;
+	e->notify = notify;
+	e->param = param;
+	e->chain = chain;
+	// the names are kept in the pool's arena, they outlive the irqs
+	e->name = irq->name;
+	e->number = irq->irq;
+	e->chain_name = chain ? chain->name : NULL;
+	p->count++;
+	return e;
+}
+
+int
+avr_irq_prof_init(
+		avr_irq_pool_t * pool,
+		avr_irq_prof_t * p)
+{
+	if (pool->prof) {
+		AVR_LOG(NULL, LOG_ERROR, "IRQ_PROF: already counting\n");
+		return -1;
+	}
+	memset(p, 0, sizeof(*p));
+	p->pool = pool;
+	pool->prof = p;
+	return 0;
+}
+
+void
+avr_irq_prof_stop(
+		avr_irq_prof_t * p)
+{
+	if (p->pool && p->pool->prof == p)
+		p->pool->prof = NULL;
+	free(p->entry);
+	memset(p, 0, sizeof(*p));
+}
+
+static void
+_avr_irq_prof_name(
+		avr_irq_prof_entry_t * e,
+		char * out,
+		size_t size)
+{
+	if (e->name)
+		snprintf(out, size, "%s", e->name);
+	else
+		snprintf(out, size, "irq%u", e->number);
+}
+
+typedef struct avr_irq_prof_line_t {
+	avr_irq_prof_entry_t *	e;
+	uint64_t				key;	// the irq's rank, for a hook
+	uint64_t				ns;		// of the irq's hooks, for an irq
+} avr_irq_prof_line_t;
+
+static int
+_avr_irq_prof_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_irq_prof_line_t * la = a, * lb = b;
+	if (la->key != lb->key)
+		return la->key < lb->key ? -1 : 1;
+	if (la->ns != lb->ns)
+		return la->ns < lb->ns ? 1 : -1;
+	return 0;
+}
+
+void
+avr_irq_prof_report(
+		avr_irq_prof_t * p,
+		FILE * out)
+{
+	avr_irq_prof_line_t * irq = calloc(p->count + 1, sizeof(*irq));
+	avr_irq_prof_line_t * hook = calloc(p->count + 1, sizeof(*hook));
+	uint64_t * ns = calloc(p->size + 1, sizeof(*ns));
+	uint32_t irq_count = 0, hook_count = 0;
+
+	if (!irq || !hook || !ns)
+		goto done;
+	// the host time of each irq is that of its hooks
+	for (uint32_t i = 0; i < p->size; i++) {
+		avr_irq_prof_entry_t * e = &p->entry[i];
+		if (!e->irq || (!e->notify && !e->chain))
+			continue;
+		avr_irq_prof_entry_t * o = _avr_irq_prof_find(p, e->irq, NULL, NULL, NULL);
+		if (o)
+			ns[o - p->entry] += e->host_ns;
+	}
+	for (uint32_t i = 0; i < p->size; i++) {
+		avr_irq_prof_entry_t * e = &p->entry[i];
+		if (e->irq && !e->notify && !e->chain) {
+			irq[irq_count].e = e;
+			irq[irq_count++].ns = ns[i];
+		}
+	}
+	qsort(irq, irq_count, sizeof(*irq), _avr_irq_prof_cmp);
+	// the hooks go by the rank of their irq, then their own time
+	for (uint32_t i = 0; i < irq_count; i++)
+		ns[irq[i].e - p->entry] = i;
+	for (uint32_t i = 0; i < p->size; i++) {
+		avr_irq_prof_entry_t * e = &p->entry[i];
+		if (!e->irq || (!e->notify && !e->chain))
+			continue;
+		avr_irq_prof_entry_t * o = _avr_irq_prof_find(p, e->irq, NULL, NULL, NULL);
+		hook[hook_count].e = e;
+		hook[hook_count].key = o ? ns[o - p->entry] : irq_count;
+		hook[hook_count++].ns = e->host_ns;
+	}
+	qsort(hook, hook_count, sizeof(*hook), _avr_irq_prof_cmp);
+
+	fprintf(out, "irqs: %u, %u hooks\n", irq_count, hook_count);
+	fprintf(out, "  %-36s %10s %10s %10s %6s %10s %10s\n",
+			"irq / hook", "raised", "filtered", "called", "depth",
+			"busy", "host_us");
+	uint32_t h = 0;
+	for (uint32_t i = 0; i <= irq_count; i++) {
+		char name[128];
+		if (i < irq_count) {
+			avr_irq_prof_entry_t * e = irq[i].e;
+			_avr_irq_prof_name(e, name, sizeof(name));
+			fprintf(out, "  %-36s %10llu %10llu %10s %6u %10s %10.1f\n",
+					name, (unsigned long long)e->raised,
+					(unsigned long long)e->filtered, "", e->depth, "",
+					irq[i].ns / 1000.0);
+		}
+		// the hooks of an irq that was never raised itself, from a
+		// raise that started before counting, come last
+		for (; h < hook_count && hook[h].key == i; h++) {
+			avr_irq_prof_entry_t * e = hook[h].e;
+			char what[128];
+			if (e->notify) {
+				avr_prof_symbol((void *)e->notify, what, sizeof(what));
+				snprintf(name, sizeof(name), "%s(%p)", what, e->param);
+			} else if (e->chain_name)
+				snprintf(name, sizeof(name), "-> %s", e->chain_name);
+			else
+				snprintf(name, sizeof(name), "-> %p", e->chain);
+			if (i == irq_count) {
+				_avr_irq_prof_name(e, what, sizeof(what));
+				fprintf(out, "  %s\n", what);
+			}
+			fprintf(out, "    %-34s %10s %10s %10llu %6s %10llu %10.1f\n",
+					name, "", "", (unsigned long long)e->called, "",
+					(unsigned long long)e->busy, e->host_ns / 1000.0);
+		}
+	}
+done:
+	free(irq);
+	free(hook);
+	free(ns);
+}
@@ -0,0 +1,108 @@
+/*
+	sim_irq_prof.h
+
+	Tells which irqs, and which of their hooks, a simulation spends its
+	time on.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_IRQ_PROF_H__
+#define __SIM_IRQ_PROF_H__
+
+#include <stdio.h>
+#include "sim_irq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * avr_irq_stats_t counts the raises and callbacks of a whole pool; this
+ * counts them per irq, and per hook, with the host time each hook took.
+ * Nothing is counted unless pool->prof is set; the raise only tests that
+ * pointer, and takes a path of its own when it's set.
+ *
+ * Per irq, the raises, the ones IRQ_FLAG_FILTERED dropped as they didn't
+ * change the value, and how deep in a chain of raises it was raised at
+ * worst, 0 being raised by the core or a part itself. Per hook, the
+ * callbacks, or chained raises, and the times the hook was skipped as it
+ * was busy, raised again from its own callback. The host time of a hook
+ * includes the raises it makes in turn, so the ones up a chain also have
+ * the time of the ones further down.
+ *
+ * The report has the irqs with the host time of their hooks, the costliest
+ * first, then their hooks; a callback is named as the timer profiler does,
+ * see avr_prof_symbol().
+ */
+typedef struct avr_irq_prof_entry_t {
+	struct avr_irq_t *	irq;
+	// the hook, or all NULL for the irq's own entry
+	avr_irq_notify_t	notify;
+	void *				param;
+	struct avr_irq_t *	chain;
+	const char *		name;		// of the irq, and of 'chain'
+	const char *		chain_name;
+	uint32_t			number;		// irq->irq, when it has no name
+	uint32_t			depth;		// deepest raise, irq
+	uint64_t			raised;		// irq
+	uint64_t			filtered;	// irq
+	uint64_t			called;		// hook
+	uint64_t			busy;		// hook
+	uint64_t			host_ns;	// hook
+} avr_irq_prof_entry_t;
+
+typedef struct avr_irq_prof_t {
+	struct avr_irq_pool_t *	pool;
+	avr_irq_prof_entry_t *	entry;	// hashed on the irq and hook
+	uint32_t			size;		// a power of 2
+	uint32_t			count;
+	uint32_t			depth;		// of the raise going on
+} avr_irq_prof_t;
+
+// starts counting the raises of the irqs of 'pool', returns zero if all is well
+int
+avr_irq_prof_init(
+		struct avr_irq_pool_t * pool,
+		avr_irq_prof_t * p );
+// stops counting, and frees the counters
+void
+avr_irq_prof_stop(
+		avr_irq_prof_t * p );
+// prints a line per irq that was raised, the costliest first, and its hooks
+void
+avr_irq_prof_report(
+		avr_irq_prof_t * p,
+		FILE * out );
+
+/*
+ * The hook in sim_irq.c, only called with pool->prof set. Returns the
+ * entry of the hook of 'irq', or the irq's own with all NULL, made if
+ * it's new, or NULL if out of memory
+ */
+avr_irq_prof_entry_t *
+avr_irq_prof_get(
+		avr_irq_prof_t * p,
+		struct avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		void * param,
+		struct avr_irq_t * chain );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_IRQ_PROF_H__ */
@@ -0,0 +1,310 @@
+/*
+	sim_jobs.c
+
+	Runs independent AVR instances on a set of worker threads, each job
+	cut in slices of cycles, and the workers stealing from each other.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim_jobs.h"
+#include "sim_numa.h"
+
+static uint64_t
+_avr_jobs_now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int
+_avr_jobs_push(
+		avr_jobs_deque_t * q,
+		avr_job_t * job)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count == q->size) {
+		uint32_t size = q->size ? q->size * 2 : 16;
+		avr_job_t ** n = malloc(size * sizeof(*n));
+		if (n) {
+			for (uint32_t i = 0; i < q->count; i++)
+				n[i] = q->job[(q->head + i) % q->size];
+			free(q->job);
+			q->job = n;
+			q->head = 0;
+			q->size = size;
+		} else
+			res = -1;
+	}
+	if (!res)
+		q->job[(q->head + q->count++) % q->size] = job;
+	pthread_mutex_unlock(&q->lock);
+	return res;
+}
+
+// the owner takes from the front, the others steal from the back
+static avr_job_t *
+_avr_jobs_pop(
+		avr_jobs_deque_t * q,
+		int front)
+{
+	avr_job_t * job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count) {
+		if (front) {
+			job = q->job[q->head];
+			q->head = (q->head + 1) % q->size;
+		} else
+			job = q->job[(q->head + q->count - 1) % q->size];
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+static void
+_avr_jobs_queued(
+		avr_jobs_t * j)
+{
+	__atomic_add_fetch(&j->queued, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&j->lock);
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+}
+
+static avr_job_t *
+_avr_jobs_steal(
+		avr_jobs_worker_t * w)
+{
+	avr_jobs_t * j = w->jobs;
+
+	// xorshift, so they don't all go for the same victim
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	for (uint32_t i = 0, v = w->seed % j->count; i < j->count;
+			i++, v = (v + 1) % j->count) {
+		if (v == w->index)
+			continue;
+		avr_job_t * job = _avr_jobs_pop(&j->worker[v].queue, 0);
+		if (job) {
+			w->steals++;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+// runs a slice of 'job', returns non zero when it's done
+static int
+_avr_jobs_slice(
+		avr_jobs_worker_t * w,
+		avr_job_t * job)
+{
+	avr_jobs_t * j = w->jobs;
+	avr_t * avr = job->avr;
+
+	if (!job->localized) {
+		// the core was made by another thread, maybe on another node
+		avr_numa_localize(avr);
+		job->localized = 1;
+	}
+	job->worker = w->index;
+	job->slices++;
+	w->slices++;
+	avr_cycle_count_t start = avr->cycle;
+	avr_cycle_count_t left = job->end > avr->cycle ? job->end - avr->cycle : 0;
+	int state = avr->state;
+	if (left)
+		state = avr_run_cycles(avr, left < j->quantum ? left : j->quantum);
+	w->cycles += avr->cycle - start;
+	job->state = state;
+	return avr->cycle >= job->end ||
+			(state != cpu_Running && state != cpu_Sleeping);
+}
+
+static void *
+_avr_jobs_thread(
+		void * param)
+{
+	avr_jobs_worker_t * w = param;
+	avr_jobs_t * j = w->jobs;
+
+	for (;;) {
+		avr_job_t * job = _avr_jobs_pop(&w->queue, 1);
+		if (!job)
+			job = _avr_jobs_steal(w);
+		if (!job) {
+			pthread_mutex_lock(&j->lock);
+			while (!j->stop && !__atomic_load_n(&j->queued, __ATOMIC_ACQUIRE))
+				pthread_cond_wait(&j->cond, &j->lock);
+			int stop = j->stop;
+			pthread_mutex_unlock(&j->lock);
+			if (stop)
+				break;
+			continue;
+		}
+		__atomic_sub_fetch(&j->queued, 1, __ATOMIC_RELEASE);
+
+		uint64_t start = _avr_jobs_now();
+		int over = _avr_jobs_slice(w, job);
+		if (over && job->done)
+			job->done(job, job->param);
+		w->busy_ns += _avr_jobs_now() - start;
+		if (!over) {
+			// to the back of the line, the others get their turn
+			if (_avr_jobs_push(&w->queue, job) == 0) {
+				_avr_jobs_queued(j);
+				continue;
+			}
+			AVR_LOG(job->avr, LOG_ERROR,
+					"JOBS: out of memory, job stopped at cycle %"
+					PRI_avr_cycle_count "\n", job->avr->cycle);
+			if (job->done)
+				job->done(job, job->param);
+		}
+		w->done++;
+		if (__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+			pthread_mutex_lock(&j->lock);
+			pthread_cond_broadcast(&j->cond);
+			pthread_mutex_unlock(&j->lock);
+		}
+	}
+	return NULL;
+}
+
+int
+avr_jobs_init(
+		avr_jobs_t * j,
+		uint32_t workers,
+		avr_cycle_count_t quantum)
+{
+	memset(j, 0, sizeof(*j));
+	if (!workers) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+	if (workers > AVR_JOBS_WORKERS)
+		workers = AVR_JOBS_WORKERS;
+	j->quantum = quantum ? quantum : AVR_JOBS_QUANTUM;
+	j->worker = calloc(workers, sizeof(*j->worker));
+	if (!j->worker) {
+		AVR_LOG(NULL, LOG_ERROR, "JOBS: %s: out of memory\n", __func__);
+		return -1;
+	}
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	j->count = workers;
+	j->start_ns = _avr_jobs_now();
+	for (uint32_t i = 0; i < workers; i++) {
+		avr_jobs_worker_t * w = j->worker + i;
+		w->jobs = j;
+		w->index = i;
+		w->seed = 0x9e3779b9 * (i + 1);
+		pthread_mutex_init(&w->queue.lock, NULL);
+	}
+	for (uint32_t i = 0; i < workers; i++) {
+		avr_jobs_worker_t * w = j->worker + i;
+		if (pthread_create(&w->thread, NULL, _avr_jobs_thread, w)) {
+			AVR_LOG(NULL, LOG_ERROR, "JOBS: can't start worker %u\n", i);
+			avr_jobs_free(j);
+			return -1;
+		}
+		w->started = 1;
+	}
+	return 0;
+}
+
+int
+avr_jobs_add(
+		avr_jobs_t * j,
+		avr_job_t * job)
+{
+	job->end = job->avr->cycle + job->cycles;
+	job->state = job->avr->state;
+	job->slices = 0;
+	job->localized = 0;
+	uint32_t i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED) % j->count;
+	__atomic_add_fetch(&j->pending, 1, __ATOMIC_ACQ_REL);
+	if (_avr_jobs_push(&j->worker[i].queue, job)) {
+		AVR_LOG(job->avr, LOG_ERROR, "JOBS: %s: out of memory\n", __func__);
+		__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL);
+		return -1;
+	}
+	_avr_jobs_queued(j);
+	return 0;
+}
+
+void
+avr_jobs_wait(
+		avr_jobs_t * j)
+{
+	pthread_mutex_lock(&j->lock);
+	while (__atomic_load_n(&j->pending, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&j->cond, &j->lock);
+	pthread_mutex_unlock(&j->lock);
+}
+
+void
+avr_jobs_report(
+		avr_jobs_t * j,
+		FILE * out)
+{
+	uint64_t wall = _avr_jobs_now() - j->start_ns;
+
+	fprintf(out, "worker   busy%%     slices   steals     jobs     cycles\n");
+	for (uint32_t i = 0; i < j->count; i++) {
+		avr_jobs_worker_t * w = j->worker + i;
+		fprintf(out, "%6u %6.1f%% %10llu %8llu %8llu %10" PRI_avr_cycle_count "\n",
+				i, wall ? w->busy_ns * 100.0 / wall : 0.0,
+				(unsigned long long)w->slices, (unsigned long long)w->steals,
+				(unsigned long long)w->done, w->cycles);
+	}
+}
+
+void
+avr_jobs_free(
+		avr_jobs_t * j)
+{
+	if (!j->worker)
+		return;
+	avr_jobs_wait(j);
+	pthread_mutex_lock(&j->lock);
+	j->stop = 1;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	// they all steal from each other, so they all stop first
+	for (uint32_t i = 0; i < j->count; i++)
+		if (j->worker[i].started)
+			pthread_join(j->worker[i].thread, NULL);
+	for (uint32_t i = 0; i < j->count; i++) {
+		avr_jobs_worker_t * w = j->worker + i;
+		pthread_mutex_destroy(&w->queue.lock);
+		free(w->queue.job);
+	}
+	free(j->worker);
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	memset(j, 0, sizeof(*j));
+}
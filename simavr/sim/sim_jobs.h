@@ -0,0 +1,143 @@
+/*
+	sim_jobs.h
+
+	Runs independent AVR instances on a set of worker threads, each job
+	cut in slices of cycles, and the workers stealing from each other.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_JOBS_H__
+#define __SIM_JOBS_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unlike sim_cosim.h, the instances have nothing to do with each other:
+ * a test suite, or the runs of a farm, each one taking from a millisecond
+ * to minutes of host time. Handing them out to the threads up front
+ * leaves threads idle while another one is still on a long one, so:
+ * + each worker has its own queue of jobs; a job added from outside goes
+ *   to the next worker in turn.
+ * + a worker runs the job at the front of its queue for one slice of
+ *   'quantum' cycles (with avr_run_cycles(), so a slice is only a few
+ *   bursts of the core), then puts it at the back if it's not done. The
+ *   long jobs take turns with the short ones instead of holding them up.
+ * + a worker with an empty queue takes the job at the back of another's
+ *   queue, and waits only when they are all empty.
+ * A job stays on the thread that runs its slice for that slice only, the
+ * instance can't be touched by anything else until the job is done.
+ */
+#define AVR_JOBS_WORKERS	256
+#define AVR_JOBS_QUANTUM	1000000		// cycles in a slice, by default
+
+typedef struct avr_job_t {
+	struct avr_t *		avr;		// made, initialized and loaded already
+	avr_cycle_count_t	cycles;		// to run, from where it is when added
+	/*
+	 * Called on the worker once the job is over, the cycles were run or
+	 * the core stopped; the instance can be freed there. Optional
+	 */
+	void (*done)(
+			struct avr_job_t * job,
+			void * param );
+	void *				param;
+	// filled in by the executor
+	avr_cycle_count_t	end;		// the cycle it stops at
+	int					state;		// of the core, when done
+	uint32_t			slices;
+	uint32_t			worker;		// the one that ran its last slice
+	uint8_t				localized;	// its memory moved to the worker's node
+} avr_job_t;
+
+typedef struct avr_jobs_deque_t {
+	pthread_mutex_t		lock;
+	avr_job_t **		job;
+	uint32_t			head, count, size;
+} avr_jobs_deque_t;
+
+typedef struct avr_jobs_worker_t {
+	struct avr_jobs_t *	jobs;
+	uint32_t			index;
+	pthread_t			thread;
+	int					started;
+	avr_jobs_deque_t	queue;
+	uint32_t			seed;		// to pick who to steal from
+	// counters, only written by the worker itself
+	uint64_t			busy_ns;	// running slices
+	uint64_t			slices, steals, done;
+	avr_cycle_count_t	cycles;
+} avr_jobs_worker_t;
+
+typedef struct avr_jobs_t {
+	avr_jobs_worker_t *	worker;
+	uint32_t			count;
+	avr_cycle_count_t	quantum;
+	uint32_t			next;		// worker the next job added goes to
+	uint64_t			start_ns;
+	// idle workers, and avr_jobs_wait(), wait on these
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	uint32_t			queued;		// in the queues
+	uint32_t			pending;	// added and not done yet
+	int					stop;
+} avr_jobs_t;
+
+/*
+ * Starts 'workers' threads (0 for one per online cpu), to run the jobs in
+ * slices of 'quantum' cycles (0 for AVR_JOBS_QUANTUM). Returns 0, or -1
+ */
+int
+avr_jobs_init(
+		avr_jobs_t * j,
+		uint32_t workers,
+		avr_cycle_count_t quantum );
+/*
+ * Queues 'job', which has to stay around until it's done. Can be called
+ * from any thread, the 'done' callback included. Returns 0, or -1
+ */
+int
+avr_jobs_add(
+		avr_jobs_t * j,
+		avr_job_t * job );
+// waits for all the jobs added so far to be done
+void
+avr_jobs_wait(
+		avr_jobs_t * j );
+/*
+ * Prints, for each worker, the share of the time since avr_jobs_init()
+ * it spent running slices, and its slices, steals, jobs done and cycles
+ */
+void
+avr_jobs_report(
+		avr_jobs_t * j,
+		FILE * out );
+// waits for the jobs, stops the workers and frees them
+void
+avr_jobs_free(
+		avr_jobs_t * j );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_JOBS_H__ */
@@ -0,0 +1,342 @@
+/*
+	sim_lcov.c
+
+	Instruction and branch coverage of the firmware, written as lcov
+	tracefiles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_lcov.h"
+#include "sim_cfg.h"
+
+// straight line code the analysis missed, covered up to that far
+#define AVR_LCOV_REACH		1024
+
+// covers block 'b', and the ones it falls into
+static void
+_avr_lcov_block(
+		avr_lcov_t * l,
+		uint32_t b)
+{
+	while (b != ~0u && !l->hit[b]) {
+		avr_cfg_block_t * cb = l->cfg->block + b;
+		l->hit[b] = 1;
+		for (uint32_t w = cb->start >> 1; w < cb->end >> 1; w++)
+			l->map[w] |= AVR_LCOV_EXEC;
+		if (cb->kind != AVR_CFG_END_FALL || cb->next == AVR_CFG_NONE)
+			break;
+		b = l->block[cb->next >> 1];
+	}
+}
+
+int
+avr_lcov_init(
+		avr_t * avr,
+		avr_lcov_t * l)
+{
+	if (avr->lcov) {
+		AVR_LOG(avr, LOG_ERROR, "LCOV: already running\n");
+		return -1;
+	}
+	memset(l, 0, sizeof(*l));
+	l->words = (avr->flashend + 1) >> 1;
+	l->cfg = avr_cfg_build(avr);
+	l->map = calloc(l->words, sizeof(l->map[0]));
+	l->block = malloc(l->words * sizeof(l->block[0]));
+	l->hit = l->cfg ? calloc(l->cfg->block_count + 1, 1) : NULL;
+	if (!l->map || !l->block || !l->hit) {
+		AVR_LOG(avr, LOG_ERROR, "LCOV: out of memory\n");
+		avr_lcov_free(l);
+		return -1;
+	}
+	memset(l->block, 0xff, l->words * sizeof(l->block[0]));
+	for (uint32_t b = 0; b < l->cfg->block_count; b++) {
+		avr_cfg_block_t * cb = l->cfg->block + b;
+		for (uint32_t w = cb->start >> 1; w < cb->end >> 1; w++)
+			l->block[w] = b;
+		if (cb->kind == AVR_CFG_END_BRANCH || cb->kind == AVR_CFG_END_SKIP)
+			l->map[(cb->end >> 1) - 1] |= AVR_LCOV_BRANCH;
+	}
+	l->avr = avr;
+	avr->lcov = l;
+	// what runs first doesn't come from any event
+	l->from = avr->pc;
+	if ((avr->pc >> 1) < l->words && l->block[avr->pc >> 1] != ~0u)
+		_avr_lcov_block(l, l->block[avr->pc >> 1]);
+	return 0;
+}
+
+void
+avr_lcov_stop(
+		avr_lcov_t * l)
+{
+	if (!l->avr)
+		return;
+	l->avr->lcov = NULL;
+	l->avr = NULL;
+}
+
+void
+avr_lcov_free(
+		avr_lcov_t * l)
+{
+	avr_lcov_stop(l);
+	avr_cfg_release(l->cfg);
+	free(l->map);
+	free(l->block);
+	free(l->hit);
+	memset(l, 0, sizeof(*l));
+}
+
+int
+avr_lcov_merge(
+		avr_lcov_t * l,
+		avr_lcov_t * from)
+{
+	if (l->words != from->words || !l->map || !from->map)
+		return -1;
+	for (uint32_t w = 0; w < l->words; w++)
+		l->map[w] |= from->map[w];
+	return 0;
+}
+
+void
+avr_lcov_edge(
+		avr_lcov_t * l,
+		avr_flashaddr_t pc,
+		avr_flashaddr_t target)
+{
+	uint32_t w = pc >> 1;
+
+	if (w < l->words && l->block[w] != ~0u) {
+		uint32_t b = l->block[w];
+		_avr_lcov_block(l, b);
+		if (l->map[w] & AVR_LCOV_BRANCH)
+			l->map[w] |= target == l->cfg->block[b].target ?
+					AVR_LCOV_TAKEN : AVR_LCOV_NOT_TAKEN;
+	} else if (w < l->words && l->from <= pc && pc - l->from < AVR_LCOV_REACH) {
+		for (uint32_t i = l->from >> 1; i <= w; i++)
+			l->map[i] |= AVR_LCOV_EXEC;
+	}
+	l->from = target;
+	w = target >> 1;
+	if (w < l->words && l->block[w] != ~0u)
+		_avr_lcov_block(l, l->block[w]);
+}
+
+/*
+ * One DA or BRDA line of a tracefile; the current run counts 0 or 1,
+ * the file read back adds its own
+ */
+typedef struct _avr_lcov_rec_t {
+	const char *	file;
+	uint32_t		line;
+	int32_t			block;		// -1 for DA, else the pc of the branch
+	uint32_t		branch;		// 0 taken, 1 not taken
+	int64_t			count;		// -1 for a branch that never ran, "-"
+} _avr_lcov_rec_t;
+
+typedef struct _avr_lcov_recs_t {
+	_avr_lcov_rec_t *	rec;
+	uint32_t			count, size;
+	char **				name;		// file names read back
+	uint32_t			names;
+} _avr_lcov_recs_t;
+
+static int
+_avr_lcov_add(
+		_avr_lcov_recs_t * r,
+		const char * file,
+		uint32_t line,
+		int32_t block,
+		uint32_t branch,
+		int64_t count)
+{
+	if (r->count == r->size) {
+		uint32_t size = r->size ? r->size * 2 : 1024;
+		_avr_lcov_rec_t * n = realloc(r->rec, size * sizeof(n[0]));
+		if (!n)
+			return -1;
+		r->rec = n;
+		r->size = size;
+	}
+	r->rec[r->count++] = (_avr_lcov_rec_t) {
+		.file = file, .line = line, .block = block, .branch = branch,
+		.count = count };
+	return 0;
+}
+
+static int
+_avr_lcov_rec_cmp(
+		const void * a,
+		const void * b)
+{
+	const _avr_lcov_rec_t * ra = a;
+	const _avr_lcov_rec_t * rb = b;
+	int c = strcmp(ra->file, rb->file);
+	if (c)
+		return c;
+	if (ra->line != rb->line)
+		return ra->line < rb->line ? -1 : 1;
+	if (ra->block != rb->block)
+		return ra->block < rb->block ? -1 : 1;
+	if (ra->branch != rb->branch)
+		return ra->branch < rb->branch ? -1 : 1;
+	return 0;
+}
+
+// sorts, and folds the duplicates with their max, or their sum
+static void
+_avr_lcov_fold(
+		_avr_lcov_recs_t * r,
+		int sum)
+{
+	if (!r->count)
+		return;
+	qsort(r->rec, r->count, sizeof(r->rec[0]), _avr_lcov_rec_cmp);
+	uint32_t o = 0;
+	for (uint32_t i = 1; i < r->count; i++) {
+		_avr_lcov_rec_t * d = r->rec + o, * s = r->rec + i;
+		if (_avr_lcov_rec_cmp(d, s)) {
+			r->rec[++o] = *s;
+			continue;
+		}
+		if (d->count < 0 || (!sum && s->count > d->count))
+			d->count = s->count;
+		else if (sum && s->count > 0)
+			d->count += s->count;
+	}
+	r->count = o + 1;
+}
+
+// reads back the DA and BRDA lines of an existing tracefile
+static void
+_avr_lcov_read(
+		_avr_lcov_recs_t * r,
+		const char * filename)
+{
+	FILE * in = fopen(filename, "r");
+	char buf[4096];
+	const char * file = NULL;
+
+	if (!in)
+		return;
+	while (fgets(buf, sizeof(buf), in)) {
+		buf[strcspn(buf, "\r\n")] = 0;
+		uint32_t line, branch;
+		int32_t block;
+		char taken[32];
+		uint64_t count;
+		if (!strncmp(buf, "SF:", 3)) {
+			char ** n = realloc(r->name, (r->names + 1) * sizeof(n[0]));
+			if (!n || !(file = strdup(buf + 3)))
+				break;
+			r->name = n;
+			r->name[r->names++] = (char *)file;
+		} else if (!strcmp(buf, "end_of_record"))
+			file = NULL;
+		else if (!file)
+			continue;
+		else if (sscanf(buf, "DA:%" SCNu32 ",%" SCNu64, &line, &count) == 2)
+			_avr_lcov_add(r, file, line, -1, 0, count);
+		else if (sscanf(buf, "BRDA:%" SCNu32 ",%" SCNd32 ",%" SCNu32 ",%31s",
+				&line, &block, &branch, taken) == 4)
+			_avr_lcov_add(r, file, line, block, branch,
+					taken[0] == '-' ? -1 : strtoll(taken, NULL, 10));
+	}
+	fclose(in);
+}
+
+int
+avr_lcov_write(
+		avr_lcov_t * l,
+		avr_line_t * line,
+		uint32_t linecount,
+		char ** file,
+		uint32_t filecount,
+		const char * filename)
+{
+	_avr_lcov_recs_t r = { 0 };
+	int res = 0;
+
+	for (uint32_t i = 0; i + 1 < linecount && !res; i++) {
+		avr_line_t * row = line + i;
+		uint32_t start = row->addr >> 1, end = line[i + 1].addr >> 1;
+		if (!row->line || row->file >= filecount || start >= end)
+			continue;
+		if (end > l->words)
+			end = l->words;
+		int hit = 0;
+		for (uint32_t w = start; w < end; w++)
+			hit |= l->map[w] & AVR_LCOV_EXEC;
+		res = _avr_lcov_add(&r, file[row->file], row->line, -1, 0, hit);
+		for (uint32_t w = start; w < end && !res; w++) {
+			uint8_t m = l->map[w];
+			if (!(m & AVR_LCOV_BRANCH))
+				continue;
+			int ran = m & AVR_LCOV_EXEC;
+			res = _avr_lcov_add(&r, file[row->file], row->line, w << 1, 0,
+						ran ? !!(m & AVR_LCOV_TAKEN) : -1) ||
+					_avr_lcov_add(&r, file[row->file], row->line, w << 1, 1,
+						ran ? !!(m & AVR_LCOV_NOT_TAKEN) : -1);
+		}
+	}
+	_avr_lcov_fold(&r, 0);
+	_avr_lcov_read(&r, filename);
+	_avr_lcov_fold(&r, 1);
+
+	FILE * out = res ? NULL : fopen(filename, "w");
+	if (!out) {
+		if (!res)
+			perror(filename);
+		res = -1;
+	}
+	for (uint32_t i = 0; out && i < r.count; ) {
+		const char * name = r.rec[i].file;
+		uint32_t lf = 0, lh = 0, brf = 0, brh = 0;
+		fprintf(out, "TN:\nSF:%s\n", name);
+		for (; i < r.count && !strcmp(r.rec[i].file, name); i++) {
+			_avr_lcov_rec_t * e = r.rec + i;
+			if (e->block < 0) {
+				fprintf(out, "DA:%u,%" PRId64 "\n", e->line, e->count);
+				lf++;
+				lh += e->count > 0;
+				continue;
+			}
+			if (e->count < 0)
+				fprintf(out, "BRDA:%u,%d,%u,-\n", e->line, e->block, e->branch);
+			else
+				fprintf(out, "BRDA:%u,%d,%u,%" PRId64 "\n", e->line, e->block,
+						e->branch, e->count);
+			brf++;
+			brh += e->count > 0;
+		}
+		fprintf(out, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n",
+				brf, brh, lf, lh);
+	}
+	if (out)
+		fclose(out);
+	for (uint32_t i = 0; i < r.names; i++)
+		free(r.name[i]);
+	free(r.name);
+	free(r.rec);
+	return res;
+}
@@ -0,0 +1,108 @@
+/*
+	sim_lcov.h
+
+	Instruction and branch coverage of the firmware, written as lcov
+	tracefiles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_LCOV_H__
+#define __SIM_LCOV_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Coverage of an unmodified firmware: which flash words were executed,
+ * and which way each conditional branch and skip went.
+ *
+ * Like the fuzzers' edge coverage (sim_coverage.h) this only hooks the
+ * control flow events of the core, so it costs nothing per instruction.
+ * The basic blocks found by the static analysis (sim_cfg.h) tell what ran
+ * between two events: the block a branch, jump or return is in ran, so
+ * did the one it goes to, and the ones that one falls into. The analysis
+ * is taken when coverage starts; code it doesn't know about (functions
+ * only called through pointers) is covered from the last destination to
+ * the next event instead.
+ *
+ * avr_lcov_write() maps the words to source lines with the DWARF line
+ * table of the firmware (elf_firmware_lines()), and adds the counts to
+ * those of the file if it exists already, so it accumulates runs and
+ * instances; each run counts once per line and branch direction.
+ */
+enum {
+	AVR_LCOV_EXEC		= (1 << 0),
+	AVR_LCOV_TAKEN		= (1 << 1),		// branch taken, or skipped
+	AVR_LCOV_NOT_TAKEN	= (1 << 2),
+	AVR_LCOV_BRANCH		= (1 << 3),		// conditional branch or skip
+};
+
+typedef struct avr_lcov_t {
+	struct avr_t *		avr;
+	struct avr_cfg_t *	cfg;
+	uint32_t			words;
+	uint8_t *			map;		// AVR_LCOV_* flags of each flash word
+	uint32_t *			block;		// cfg block of each word, or ~0
+	uint8_t *			hit;		// each cfg block, once covered
+	avr_flashaddr_t		from;		// last destination
+} avr_lcov_t;
+
+// starts recording, returns zero if all is well
+int
+avr_lcov_init(
+		struct avr_t * avr,
+		avr_lcov_t * l );
+// stops recording, what was covered is kept until avr_lcov_free()
+void
+avr_lcov_stop(
+		avr_lcov_t * l );
+void
+avr_lcov_free(
+		avr_lcov_t * l );
+// adds what 'from' covered to 'l', of another instance with the same flash
+int
+avr_lcov_merge(
+		avr_lcov_t * l,
+		avr_lcov_t * from );
+/*
+ * Writes (or updates) the lcov tracefile 'filename', with 'line' and
+ * 'file' from elf_firmware_lines()
+ */
+int
+avr_lcov_write(
+		avr_lcov_t * l,
+		avr_line_t * line,
+		uint32_t linecount,
+		char ** file,
+		uint32_t filecount,
+		const char * filename );
+
+// called by the core with a branch, jump, call or return at 'pc'
+void
+avr_lcov_edge(
+		avr_lcov_t * l,
+		avr_flashaddr_t pc,
+		avr_flashaddr_t target );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_LCOV_H__ */
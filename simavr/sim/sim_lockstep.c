@@ -0,0 +1,262 @@
+/*
+	sim_lockstep.c
+
+	Runs several instances of the same firmware side by side, sharing the
+	decoding, and running their pure blocks together, a register at a time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_lockstep.h"
+#include "sim_core.h"
+
+// what the scheduler looks at, kept together rather than in each avr_t
+typedef struct avr_lockstep_lane_t {
+	avr_flashaddr_t		pc;
+	int					active;
+	avr_cycle_count_t	cycle, end;
+} avr_lockstep_lane_t;
+
+avr_lockstep_t *
+avr_lockstep_new(
+		avr_t ** lane,
+		int count )
+{
+	if (count < 1)
+		return NULL;
+	avr_lockstep_t * ls = calloc(1, sizeof(*ls));
+	if (!ls)
+		return NULL;
+	ls->lane = malloc(count * sizeof(*ls->lane));
+	ls->group = malloc(count * sizeof(*ls->group));
+	ls->member = malloc(count * sizeof(*ls->member));
+	ls->at = malloc(count * sizeof(*ls->at));
+	if (!ls->lane || !ls->group || !ls->member || !ls->at) {
+		avr_lockstep_free(ls);
+		return NULL;
+	}
+	memcpy(ls->lane, lane, count * sizeof(*ls->lane));
+	ls->count = count;
+	ls->window = AVR_LOCKSTEP_WINDOW;
+
+	avr_t * first = lane[0];
+	for (int i = 0; i < count; i++) {
+		avr_t * avr = lane[i];
+		if (i && avr->flash != first->flash &&
+				avr->flashend == first->flashend &&
+				!memcmp(avr->flash, first->flash, first->flashend + 1))
+			avr_flash_share(avr, first);
+	}
+	for (int i = 0; i < count; i++) {
+		avr_t * avr = lane[i];
+		// without it, the lane just never runs with a group
+		if (!avr->decoded && avr_predecode_share(avr))
+			avr_predecode_init(avr);
+	}
+	return ls;
+}
+
+void
+avr_lockstep_free(
+		avr_lockstep_t * ls )
+{
+	if (!ls)
+		return;
+	free(ls->lane);
+	free(ls->group);
+	free(ls->member);
+	free(ls->at);
+	free(ls);
+}
+
+static inline void
+_avr_lockstep_update(
+		avr_lockstep_t * ls,
+		int i )
+{
+	avr_t * avr = ls->lane[i];
+	avr_lockstep_lane_t * at = &ls->at[i];
+
+	at->pc = avr->pc;
+	at->cycle = avr->cycle;
+	at->active = avr->cycle < at->end &&
+			(avr->state == cpu_Running || avr->state == cpu_Sleeping);
+}
+
+// how many cycles lane 'i' can run without a stop: its next timer, or the end
+static inline avr_cycle_count_t
+_avr_lockstep_room(
+		avr_lockstep_t * ls,
+		int i )
+{
+	avr_t * avr = ls->lane[i];
+	avr_cycle_count_t until = ls->at[i].end;
+
+	if (avr->cycle_timers.count && avr->cycle_timers.timer[0].when < until)
+		until = avr->cycle_timers.timer[0].when;
+	return until > avr->cycle ? until - avr->cycle - 1 : 0;
+}
+
+// the cycle of the slowest lane still running, and if there's one
+static int
+_avr_lockstep_slowest(
+		avr_lockstep_t * ls,
+		avr_cycle_count_t * slowest )
+{
+	int found = 0;
+
+	for (int i = 0; i < ls->count; i++)
+		if (ls->at[i].active && (!found || ls->at[i].cycle < *slowest)) {
+			*slowest = ls->at[i].cycle;
+			found = 1;
+		}
+	return found;
+}
+
+static int
+_avr_lockstep_running(
+		avr_lockstep_t * ls )
+{
+	int running = 0;
+	for (int i = 0; i < ls->count; i++)
+		running += ls->lane[i]->state == cpu_Running ||
+				ls->lane[i]->state == cpu_Sleeping;
+	return running;
+}
+
+// when the lanes don't stay together, they're better off on their own
+static int
+_avr_lockstep_solo(
+		avr_lockstep_t * ls,
+		avr_cycle_count_t budget )
+{
+	for (int i = 0; i < ls->count; i++) {
+		avr_t * avr = ls->lane[i];
+		if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
+			avr_run_cycles(avr, budget);
+	}
+	return _avr_lockstep_running(ls);
+}
+
+int
+avr_lockstep_run(
+		avr_lockstep_t * ls,
+		avr_cycle_count_t budget )
+{
+	avr_lockstep_lane_t * at = ls->at;
+	avr_cycle_count_t slowest = 0;
+	uint64_t grouped = 0, steps = ls->steps, blocks = ls->blocks;
+
+	if (ls->solo) {
+		ls->solo--;
+		return _avr_lockstep_solo(ls, budget);
+	}
+	for (int i = 0; i < ls->count; i++) {
+		at[i].end = ls->lane[i]->cycle + budget;
+		_avr_lockstep_update(ls, i);
+	}
+	if (!_avr_lockstep_slowest(ls, &slowest))
+		return 0;
+
+	for (;;) {
+		/*
+		 * The lowest pc of the lanes not too far ahead. 'slowest' is
+		 * from before the last lanes ran, it can only be lower than it is
+		 */
+		int lead = -1;
+		for (int i = 0; i < ls->count; i++)
+			if (at[i].active && at[i].cycle <= slowest + ls->window &&
+					(lead < 0 || at[i].pc < at[lead].pc))
+				lead = i;
+		if (lead < 0) {
+			if (!_avr_lockstep_slowest(ls, &slowest))
+				break;
+			continue;
+		}
+		/*
+		 * The group is the lanes at that pc, and not too far ahead either;
+		 * they run as much of the block as they all can before they have
+		 * to stop. If it's not a block, they're stepped one after the
+		 * other, so they're still together after it.
+		 */
+		avr_t * l = ls->lane[lead];
+		uint16_t cycles = avr_lanes_block(l);
+		avr_cycle_count_t room = cycles;
+		avr_flashaddr_t next = ~0;
+		int n = 0, alone = 0, running = 0;
+		for (int i = 0; i < ls->count; i++) {
+			if (!at[i].active)
+				continue;
+			if (!running++ || at[i].cycle < slowest)
+				slowest = at[i].cycle;
+			if (at[i].cycle > at[lead].cycle + ls->window)
+				continue;
+			if (at[i].pc != at[lead].pc || ls->lane[i]->flash != l->flash) {
+				if (at[i].pc > at[lead].pc && at[i].pc < next)
+					next = at[i].pc;
+				continue;
+			}
+			// it's the same block, if it's the same cycles
+			if (cycles && (i == lead || avr_lanes_block(ls->lane[i]) == cycles)) {
+				avr_cycle_count_t r = _avr_lockstep_room(ls, i);
+				if (r < room)
+					room = r;
+				ls->member[n] = i;
+				ls->group[n++] = ls->lane[i];
+			} else
+				ls->member[ls->count - ++alone] = i;
+		}
+		int ran = n > 1 ? avr_lanes_run_block(ls->group, n, room) : 0;
+		if (ran) {
+			ls->blocks++;
+			ls->block_lanes += n;
+			ls->block_insns += ran;
+			grouped += (uint64_t)n * ran;
+		} else
+			while (n)
+				ls->member[ls->count - ++alone] = ls->member[--n];
+		for (int i = 0; i < n; i++)
+			_avr_lockstep_update(ls, ls->member[i]);
+		for (int i = ls->count - alone; i < ls->count; i++) {
+			avr_run_cycles(ls->lane[ls->member[i]], 1);
+			_avr_lockstep_update(ls, ls->member[i]);
+		}
+		ls->steps += alone;
+		/*
+		 * A lane on its own goes on until it reaches one of the others,
+		 * as it would be picked again until then anyway
+		 */
+		if (alone == 1 && !ran)
+			while (at[lead].active && at[lead].pc < next &&
+					at[lead].cycle <= slowest + ls->window) {
+				avr_run_cycles(l, 1);
+				_avr_lockstep_update(ls, lead);
+				ls->steps++;
+			}
+	}
+
+	/*
+	 * Copying the lanes in and out of the vectors only pays off for long
+	 * enough blocks, and the scheduling for groups large enough
+	 */
+	steps = ls->steps - steps;
+	if (grouped < steps ||
+			grouped < AVR_LOCKSTEP_MIN_BLOCK * ls->count * (ls->blocks - blocks))
+		ls->solo = AVR_LOCKSTEP_BACKOFF;
+	return _avr_lockstep_running(ls);
+}
@@ -0,0 +1,103 @@
+/*
+	sim_lockstep.h
+
+	Runs several instances of the same firmware side by side, sharing the
+	decoding, and running their pure blocks together, a register at a time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_LOCKSTEP_H__
+#define __SIM_LOCKSTEP_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The lanes are instances made as usual, with the same firmware, typically
+ * with different inputs (a parameter sweep, a fuzzer's corpus). Instead of
+ * running one then the next, they are interleaved: the lanes at the same
+ * pc, and close enough in time, form a group. When the pc starts a block
+ * of pure instructions (see _avr_decode_block()), as much of it as all of
+ * the group can run before their next cycle timer is decoded once, and run
+ * for all of them with each register a vector, an element per lane (see
+ * avr_lanes_run_block()). Everything else (IO, branches that went different
+ * ways, interrupts, sleep) is run one lane at a time, with avr_run_cycles().
+ *
+ * The lane that is picked next is the one with the lowest pc among those
+ * no more than 'window' cycles ahead of the slowest; loops and calls end
+ * up lower in the flash more often than not, so the lanes that went their
+ * own way tend to meet again, like on a GPU.
+ *
+ * The outcome is that of running each lane on its own for the same cycles,
+ * exactly; how much faster it goes depends on how long the lanes stay
+ * together, and how long the pure blocks are: copying the registers in and
+ * out of the vectors is paid for each block. When less than half of the
+ * instructions of a run went through the vectors, or the blocks were
+ * shorter than AVR_LOCKSTEP_MIN_BLOCK instructions for all the lanes, the
+ * next AVR_LOCKSTEP_BACKOFF runs just run the lanes one after the other,
+ * then it tries again.
+ *
+ * The lanes with the same flash contents as the first are made to share
+ * it (see avr_flash_share()), that's what tells they can run together; a
+ * lane writing to its flash drops out of the groups. The lanes are not
+ * owned, they're still the caller's to terminate, after avr_lockstep_free().
+ */
+typedef struct avr_lockstep_t {
+	struct avr_t **		lane;
+	int					count;
+	avr_cycle_count_t	window;		// AVR_LOCKSTEP_WINDOW by default
+	// how it went
+	uint64_t			blocks;		// pure blocks run for a group
+	uint64_t			block_lanes;	// lanes in these groups, in all
+	uint64_t			block_insns;	// and the instructions in the blocks
+	uint64_t			steps;		// lane steps run on their own
+	int					solo;		// runs left without the groups
+	// scratch
+	struct avr_t **		group;
+	int *				member;
+	struct avr_lockstep_lane_t * at;
+} avr_lockstep_t;
+
+#define AVR_LOCKSTEP_WINDOW		256
+#define AVR_LOCKSTEP_MIN_BLOCK	16
+#define AVR_LOCKSTEP_BACKOFF	16
+
+// returns NULL if there's no lane, or out of memory. 'lane' is copied
+avr_lockstep_t *
+avr_lockstep_new(
+		struct avr_t ** lane,
+		int count );
+void
+avr_lockstep_free(
+		avr_lockstep_t * ls );
+/*
+ * Runs each lane for (at least) 'budget' cycles, as avr_run_cycles()
+ * would. Returns the number of lanes still cpu_Running or cpu_Sleeping.
+ */
+int
+avr_lockstep_run(
+		avr_lockstep_t * ls,
+		avr_cycle_count_t budget );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_LOCKSTEP_H__ */
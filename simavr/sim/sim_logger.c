@@ -0,0 +1,146 @@
+/*
+	sim_logger.c
+
+	Writes the log of an instance from another thread.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include "sim_logger.h"
+
+static void
+_avr_logger_forward(
+		avr_logger_thread_t * t,
+		int level,
+		const char * format,
+		...)
+{
+	va_list args;
+	va_start(args, format);
+	avr_logger_p logger = t->logger ? t->logger : avr_global_logger_get();
+	logger(t->avr, level, format, args);
+	va_end(args);
+}
+
+static void *
+_avr_logger_thread(
+		void * param)
+{
+	avr_logger_thread_t * t = param;
+
+	for (;;) {
+		uint32_t tail = t->tail;
+		uint32_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			// the last records were pushed before 'stop' was set
+			if (__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&t->head, __ATOMIC_ACQUIRE) == tail)
+					break;
+				continue;
+			}
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = 200000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		for (; tail != head; tail++) {
+			avr_logger_record_t * r = t->ring + (tail & t->mask);
+			_avr_logger_forward(t, r->level, "%s", r->text);
+		}
+		__atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+// the logger of the instance while the thread runs
+static void
+_avr_logger_push(
+		avr_t * avr,
+		const int level,
+		const char * format,
+		va_list ap)
+{
+	avr_logger_thread_t * t = avr->logger_thread;
+	uint32_t head = t->head;
+
+	while (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) > t->mask) {
+		t->stalls++;
+		sched_yield();
+	}
+	avr_logger_record_t * r = t->ring + (head & t->mask);
+	r->level = level;
+	vsnprintf(r->text, sizeof(r->text), format, ap);
+	__atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+avr_logger_thread_start(
+		avr_t * avr,
+		uint32_t size)
+{
+	if (avr->logger_thread)
+		return 0;
+	uint32_t count = 64;
+	while (count < size && count < (1 << 20))
+		count <<= 1;
+	if (!size)
+		count = 4096;
+	avr_logger_thread_t * t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->ring = malloc(count * sizeof(*t->ring));
+	if (!t->ring) {
+		free(t);
+		return -1;
+	}
+	t->avr = avr;
+	t->mask = count - 1;
+	t->logger = avr->logger;
+	if (pthread_create(&t->thread, NULL, _avr_logger_thread, t)) {
+		AVR_LOG(avr, LOG_ERROR, "LOG: %s: can't start the thread\n", __func__);
+		free(t->ring);
+		free(t);
+		return -1;
+	}
+	avr->logger_thread = t;
+	avr->logger = _avr_logger_push;
+	return 0;
+}
+
+void
+avr_logger_thread_stop(
+		avr_t * avr)
+{
+	avr_logger_thread_t * t = avr->logger_thread;
+
+	if (!t)
+		return;
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->thread, NULL);
+	avr->logger = t->logger;
+	avr->logger_thread = NULL;
+	if (t->stalls)
+		AVR_LOG(avr, LOG_TRACE, "LOG: %s: waited %" PRIu64
+				" times for the thread\n", __func__, t->stalls);
+	free(t->ring);
+	free(t);
+}
@@ -0,0 +1,77 @@
+/*
+	sim_logger.h
+
+	Writes the log of an instance from another thread.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_LOGGER_H__
+#define __SIM_LOGGER_H__
+
+#include <pthread.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The messages of the instance are formatted in place into a ring of
+ * records, and a thread hands them to the logger the instance had before,
+ * or the global one; the core never waits on the terminal or the file
+ * behind it. Messages longer than a record are cut. When the ring is
+ * full the core waits for the thread, nothing is dropped.
+ */
+#define AVR_LOGGER_RECORD_SIZE	256
+
+typedef struct avr_logger_record_t {
+	int		level;
+	char	text[AVR_LOGGER_RECORD_SIZE - sizeof(int)];
+} avr_logger_record_t;
+
+typedef struct avr_logger_thread_t {
+	struct avr_t *			avr;
+	avr_logger_p			logger;		// the one the records go to, or NULL
+	avr_logger_record_t *	ring;
+	uint32_t				mask;
+	char					pad0[64];	// keeps 'head' and 'tail' apart
+	uint32_t				head;
+	uint64_t				stalls;		// times the core waited for room
+	char					pad1[64];
+	uint32_t				tail;
+	uint32_t				stop;
+	pthread_t				thread;
+} avr_logger_thread_t;
+
+/*
+ * Starts the thread, with a ring of 'size' records (0 for 4096 of them).
+ * Returns 0, or -1.
+ */
+int
+avr_logger_thread_start(
+		struct avr_t * avr,
+		uint32_t size );
+// writes what's left, and puts the previous logger back
+void
+avr_logger_thread_stop(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_LOGGER_H__ */
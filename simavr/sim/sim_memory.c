@@ -0,0 +1,146 @@
+/*
+	sim_memory.c
+
+	Tells how much memory an instance takes, and what for.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "sim_memory.h"
+#include "sim_core.h"
+#include "sim_io.h"
+#include "sim_snapshot.h"
+#include "sim_vcd_file.h"
+#include "sim_trace_ring.h"
+
+static const char * _avr_memory_kind[AVR_MEM_COUNT] = {
+	[AVR_MEM_CORE] = "core",
+	[AVR_MEM_FLASH] = "flash",
+	[AVR_MEM_DATA] = "data",
+	[AVR_MEM_EEPROM] = "eeprom",
+	[AVR_MEM_IO] = "io",
+	[AVR_MEM_IRQ] = "irq",
+	[AVR_MEM_HOOKS] = "hooks",
+	[AVR_MEM_TIMERS] = "timers",
+	[AVR_MEM_INTERRUPTS] = "interrupts",
+	[AVR_MEM_DECODE] = "decode",
+	[AVR_MEM_SNAPSHOT] = "snapshot",
+	[AVR_MEM_VCD] = "vcd",
+	[AVR_MEM_TRACE] = "trace",
+	[AVR_MEM_MODULES] = "modules",
+};
+
+const char *
+avr_memory_kind(
+		int kind)
+{
+	return kind >= 0 && kind < AVR_MEM_COUNT ? _avr_memory_kind[kind] : "?";
+}
+
+static size_t
+_avr_memory_dirty(
+		uint32_t size)
+{
+	uint32_t pages = (size + (1 << AVR_DIRTY_PAGE_SHIFT) - 1) >> AVR_DIRTY_PAGE_SHIFT;
+	return (pages + 63) / 64 * sizeof(uint64_t);
+}
+
+void
+avr_memory_get(
+		avr_t * avr,
+		avr_memory_t * m)
+{
+	size_t * b = m->bytes;
+	memset(m, 0, sizeof(*m));
+
+	b[AVR_MEM_CORE] = avr->core_size ? avr->core_size : sizeof(*avr);
+	if (avr->flash) {
+		if (avr->flash_image)
+			m->shared += avr->flashend + 1;
+		else
+			b[AVR_MEM_FLASH] += avr->flashend + 1;
+	}
+	if (avr->flash_wide)
+		b[AVR_MEM_FLASH] += (((avr->flashend + 1) >> 6) + 1) * sizeof(uint32_t);
+	if (avr->data)
+		b[AVR_MEM_DATA] = avr->ramend + 1;
+	if (avr->io)
+		b[AVR_MEM_IO] = avr_io_memory(avr);
+	avr_irq_pool_memory(&avr->irq_pool, &b[AVR_MEM_IRQ], &b[AVR_MEM_HOOKS]);
+	b[AVR_MEM_TIMERS] = avr->cycle_timers.size * sizeof(avr->cycle_timers.timer[0]);
+	b[AVR_MEM_INTERRUPTS] =
+			avr->interrupts.vector_alloc * sizeof(avr->interrupts.vector[0]) +
+			avr->interrupts.running_alloc * (sizeof(avr->interrupts.running[0]) +
+					sizeof(avr->interrupts.running_start[0]));
+	if (avr->decoded) {
+		size_t size = ((avr->flashend + 1) >> 1) * sizeof(avr_decoded_t);
+		if (avr->decoded_mapped)
+			m->shared += size;
+		else
+			b[AVR_MEM_DECODE] = size;
+	}
+	if (avr->dirty.data)
+		b[AVR_MEM_SNAPSHOT] = _avr_memory_dirty(avr->ramend + 1) +
+				_avr_memory_dirty(avr->flashend + 1);
+	if (avr->vcd)
+		b[AVR_MEM_VCD] = sizeof(*avr->vcd) + avr_vcd_memory(avr->vcd);
+	if (avr->trace_data)
+		b[AVR_MEM_TRACE] += sizeof(*avr->trace_data);
+	if (avr->trace_ring)
+		b[AVR_MEM_TRACE] += (avr->trace_ring->mask + 1ULL) *
+				sizeof(avr->trace_ring->rec[0]);
+
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		size_t bytes = io->memory ? io->memory(io) : 0;
+		if (!bytes)
+			continue;
+		// the EEPROM has a kind of its own
+		if (!strcmp(io->kind, "eeprom"))
+			b[AVR_MEM_EEPROM] += bytes;
+		else
+			b[AVR_MEM_MODULES] += bytes;
+		if (m->module_count == AVR_MEM_MODULES_MAX)
+			continue;
+		int index = io->irq_ioctl_get & 0xff;
+		m->module[m->module_count].kind = io->kind;
+		m->module[m->module_count].name =
+				index >= '0' && index <= '9' ? index : 0;
+		m->module[m->module_count++].bytes = bytes;
+	}
+	for (int i = 0; i < AVR_MEM_COUNT; i++)
+		m->total += b[i];
+}
+
+void
+avr_memory_report(
+		avr_memory_t * m,
+		FILE * out)
+{
+	fprintf(out, "memory: %zu bytes, %zu shared\n", m->total, m->shared);
+	for (int i = 0; i < AVR_MEM_COUNT; i++)
+		if (m->bytes[i])
+			fprintf(out, "  %-12s %10zu\n", avr_memory_kind(i), m->bytes[i]);
+	for (int i = 0; i < m->module_count; i++) {
+		char name[32];
+		if (m->module[i].name)
+			snprintf(name, sizeof(name), "%s%c", m->module[i].kind,
+					m->module[i].name);
+		else
+			snprintf(name, sizeof(name), "%s", m->module[i].kind);
+		fprintf(out, "    %-10s %10zu\n", name, m->module[i].bytes);
+	}
+}
@@ -0,0 +1,95 @@
+/*
+	sim_memory.h
+
+	Tells how much memory an instance takes, and what for.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_MEMORY_H__
+#define __SIM_MEMORY_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Nothing is counted as it's allocated, that would cost on every irq hook
+ * and timer; the sizes are worked out when asked for, from the tables
+ * themselves: the irq pool walks its arenas and hooks, the io modules
+ * that allocate anything tell how much with their 'memory' hook. They're
+ * the bytes asked for, not the pages or the allocator's own overhead.
+ *
+ * A flash image shared with other instances (avr_flash_share()), and the
+ * copy on write decoded flash, aren't in the total, they're in 'shared'.
+ * A VCD file is only counted if it's the instance's own, avr->vcd; the
+ * ones made by the program are counted with avr_vcd_memory().
+ */
+enum {
+	AVR_MEM_CORE = 0,	// avr_t and the io modules, as the core declares them
+	AVR_MEM_FLASH,		// and the map of its 32 bits instructions
+	AVR_MEM_DATA,
+	AVR_MEM_EEPROM,
+	AVR_MEM_IO,			// the io register tables and their hooks
+	AVR_MEM_IRQ,		// the irq pool: irqs, names, the name index
+	AVR_MEM_HOOKS,		// the irq hooks, and their frozen arrays
+	AVR_MEM_TIMERS,		// cycle timers
+	AVR_MEM_INTERRUPTS,	// vector table and nesting stack
+	AVR_MEM_DECODE,		// the predecoded flash
+	AVR_MEM_SNAPSHOT,	// the dirty page maps, once a snapshot was taken
+	AVR_MEM_VCD,
+	AVR_MEM_TRACE,		// trace data, trace ring
+	AVR_MEM_MODULES,	// what the io modules allocated, see 'module'
+	AVR_MEM_COUNT
+};
+
+#define AVR_MEM_MODULES_MAX	32
+
+typedef struct avr_memory_t {
+	size_t		bytes[AVR_MEM_COUNT];
+	size_t		total;
+	size_t		shared;		// with other instances, not in 'total'
+	struct {
+		const char *	kind;
+		char			name;	// of its ioctls, like '0' for uart0, or 0
+		size_t			bytes;
+	} module[AVR_MEM_MODULES_MAX];	// the ones that allocated anything
+	int			module_count;
+} avr_memory_t;
+
+// fills 'm' for 'avr'
+void
+avr_memory_get(
+		struct avr_t * avr,
+		avr_memory_t * m );
+// the name of an AVR_MEM_* kind
+const char *
+avr_memory_kind(
+		int kind );
+// prints the total, then a line per kind and module that isn't empty
+void
+avr_memory_report(
+		avr_memory_t * m,
+		FILE * out );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_MEMORY_H__ */
@@ -0,0 +1,325 @@
+/*
+	sim_metrics.c
+
+	Counters of running cores, in the Prometheus text format.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_metrics.h"
+#include "sim_stats.h"
+#include "sim_vcd_file.h"
+#include "avr_uart.h"
+
+typedef struct avr_metric_t {
+	const char *	name;
+	const char *	type;
+	const char *	help;
+	// returns zero if 'avr' doesn't have this one
+	int (*get)(avr_t * avr, uint64_t * value);
+} avr_metric_t;
+
+static int
+_avr_metric_cycles(
+		avr_t * avr,
+		uint64_t * value)
+{
+	*value = avr->cycle;
+	return 1;
+}
+
+static int
+_avr_metric_sleep(
+		avr_t * avr,
+		uint64_t * value)
+{
+	*value = avr->sleep_cycles;
+	return 1;
+}
+
+static int
+_avr_metric_state(
+		avr_t * avr,
+		uint64_t * value)
+{
+	*value = avr->state;
+	return 1;
+}
+
+static int
+_avr_metric_frequency(
+		avr_t * avr,
+		uint64_t * value)
+{
+	*value = avr->frequency;
+	return 1;
+}
+
+static int
+_avr_metric_instructions(
+		avr_t * avr,
+		uint64_t * value)
+{
+	if (!avr->stats)
+		return 0;
+	*value = avr->stats->instructions;
+	return 1;
+}
+
+static int
+_avr_metric_timers(
+		avr_t * avr,
+		uint64_t * value)
+{
+	if (!avr->stats)
+		return 0;
+	*value = avr->stats->timer_fired;
+	return 1;
+}
+
+static int
+_avr_metric_irqs(
+		avr_t * avr,
+		uint64_t * value)
+{
+	if (!avr->stats)
+		return 0;
+	*value = avr->stats->irq.raised;
+	return 1;
+}
+
+static int
+_avr_metric_vcd(
+		avr_t * avr,
+		uint64_t * value)
+{
+	if (!avr->vcd || !avr->vcd->output)
+		return 0;
+	*value = avr->vcd->written;
+	return 1;
+}
+
+static const avr_metric_t _avr_metric[] = {
+	{ "simavr_cycles_total", "counter", "Simulated cycles", _avr_metric_cycles },
+	{ "simavr_sleep_cycles_total", "counter",
+		"Simulated cycles spent sleeping", _avr_metric_sleep },
+	{ "simavr_state", "gauge",
+		"Core state: 0 limbo, 1 stopped, 2 running, 3 sleeping, "
+		"4 step, 5 step done, 6 done, 7 crashed", _avr_metric_state },
+	{ "simavr_frequency_hz", "gauge", "Simulated clock", _avr_metric_frequency },
+	{ "simavr_instructions_total", "counter",
+		"Instructions retired, with stats on", _avr_metric_instructions },
+	{ "simavr_timers_fired_total", "counter",
+		"Cycle timer callbacks called, with stats on", _avr_metric_timers },
+	{ "simavr_irqs_raised_total", "counter",
+		"IRQs raised, with stats on", _avr_metric_irqs },
+	{ "simavr_vcd_bytes_total", "counter",
+		"VCD text written, before compression", _avr_metric_vcd },
+};
+
+static void
+_avr_metrics_head(
+		FILE * out,
+		const char * name,
+		const char * type,
+		const char * help)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// 'name{labels,extra} value', without braces if there are no labels
+static void
+_avr_metrics_sample(
+		FILE * out,
+		const char * name,
+		const char * labels,
+		const char * extra,
+		uint64_t value)
+{
+	int l = labels && *labels, e = extra && *extra;
+
+	fputs(name, out);
+	if (l || e)
+		fprintf(out, "{%s%s%s}", l ? labels : "", l && e ? "," : "",
+				e ? extra : "");
+	fprintf(out, " %" PRIu64 "\n", value);
+}
+
+// the vectors that were ever raised, the others would only be noise
+static int
+_avr_metrics_vector_used(
+		avr_int_vector_t * v)
+{
+	return v && (v->stats.raised || v->stats.serviced);
+}
+
+static void
+_avr_metrics_vectors(
+		const avr_metrics_source_t * src,
+		int count,
+		FILE * out)
+{
+	static const struct {
+		const char * name, * help;
+		size_t offset;
+	} counter[] = {
+		{ "simavr_vector_raised_total", "Interrupts made pending",
+			offsetof(avr_int_stats_t, raised) },
+		{ "simavr_vector_serviced_total", "Interrupts serviced",
+			offsetof(avr_int_stats_t, serviced) },
+		{ "simavr_vector_lost_total",
+			"Interrupts disabled or cleared before being serviced",
+			offsetof(avr_int_stats_t, lost) },
+		{ "simavr_vector_isr_cycles_total",
+			"Cycles spent in the ISR, nested ones included",
+			offsetof(avr_int_stats_t, time_total) },
+	};
+	const char * hname = "simavr_vector_latency_cycles";
+	char extra[48], name[64];
+
+	for (int c = 0; c < (int)(sizeof(counter) / sizeof(counter[0])); c++) {
+		_avr_metrics_head(out, counter[c].name, "counter", counter[c].help);
+		for (int i = 0; i < count; i++) {
+			avr_int_table_p t = &src[i].avr->interrupts;
+			for (int vi = 0; vi < t->vector_count; vi++) {
+				avr_int_vector_t * v = t->vector[vi];
+				if (!_avr_metrics_vector_used(v))
+					continue;
+				snprintf(extra, sizeof(extra), "vector=\"%d\"", v->vector);
+				_avr_metrics_sample(out, counter[c].name, src[i].labels, extra,
+						*(uint64_t *)((uint8_t *)&v->stats + counter[c].offset));
+			}
+		}
+	}
+	/*
+	 * Bucket n of the core is for latencies under 2^n, so up to 2^n - 1
+	 * for the 'le' of Prometheus; the last one has all the longer ones.
+	 */
+	_avr_metrics_head(out, hname, "histogram",
+			"Cycles from the raise of an interrupt to its vector");
+	for (int i = 0; i < count; i++) {
+		avr_int_table_p t = &src[i].avr->interrupts;
+		for (int vi = 0; vi < t->vector_count; vi++) {
+			avr_int_vector_t * v = t->vector[vi];
+			if (!_avr_metrics_vector_used(v))
+				continue;
+			uint64_t total = 0;
+			snprintf(name, sizeof(name), "%s_bucket", hname);
+			for (int b = 0; b < AVR_INT_LATENCY_BUCKETS; b++) {
+				total += v->stats.latency[b];
+				if (b < AVR_INT_LATENCY_BUCKETS - 1)
+					snprintf(extra, sizeof(extra), "vector=\"%d\",le=\"%u\"",
+							v->vector, (1u << b) - 1);
+				else
+					snprintf(extra, sizeof(extra), "vector=\"%d\",le=\"+Inf\"",
+							v->vector);
+				_avr_metrics_sample(out, name, src[i].labels, extra, total);
+			}
+			snprintf(extra, sizeof(extra), "vector=\"%d\"", v->vector);
+			snprintf(name, sizeof(name), "%s_sum", hname);
+			_avr_metrics_sample(out, name, src[i].labels, extra,
+					v->stats.latency_total);
+			snprintf(name, sizeof(name), "%s_count", hname);
+			_avr_metrics_sample(out, name, src[i].labels, extra, total);
+		}
+	}
+}
+
+static void
+_avr_metrics_uarts(
+		const avr_metrics_source_t * src,
+		int count,
+		FILE * out)
+{
+	char extra[16];
+
+	for (int dir = 0; dir < 2; dir++) {
+		const char * name = dir ? "simavr_uart_rx_bytes_total" :
+				"simavr_uart_tx_bytes_total";
+		_avr_metrics_head(out, name, "counter", dir ?
+				"Bytes read by the firmware from a UART" :
+				"Bytes sent by the firmware to a UART");
+		for (int i = 0; i < count; i++) {
+			for (avr_io_t * io = src[i].avr->io_port; io; io = io->next) {
+				if (!io->kind || strcmp(io->kind, "uart"))
+					continue;
+				avr_uart_t * p = (avr_uart_t *)io;
+				snprintf(extra, sizeof(extra), "uart=\"%c\"", p->name);
+				_avr_metrics_sample(out, name, src[i].labels, extra,
+						dir ? p->rx_bytes : p->tx_bytes);
+			}
+		}
+	}
+}
+
+int
+avr_metrics_write(
+		const avr_metrics_source_t * src,
+		int count,
+		FILE * out)
+{
+	uint64_t value;
+
+	for (int m = 0; m < (int)(sizeof(_avr_metric) / sizeof(_avr_metric[0])); m++) {
+		int head = 0;
+		for (int i = 0; i < count; i++) {
+			if (!_avr_metric[m].get(src[i].avr, &value))
+				continue;
+			if (!head++)
+				_avr_metrics_head(out, _avr_metric[m].name, _avr_metric[m].type,
+						_avr_metric[m].help);
+			_avr_metrics_sample(out, _avr_metric[m].name, src[i].labels, NULL,
+					value);
+		}
+	}
+	_avr_metrics_vectors(src, count, out);
+	_avr_metrics_uarts(src, count, out);
+	fflush(out);
+	return ferror(out) ? -1 : 0;
+}
+
+int
+avr_metrics_label_escape(
+		const char * value,
+		char * out,
+		size_t size)
+{
+	size_t o = 0;
+
+	for (; *value; value++) {
+		const char * e = NULL;
+		switch (*value) {
+			case '\\': e = "\\\\"; break;
+			case '"': e = "\\\""; break;
+			case '\n': e = "\\n"; break;
+		}
+		size_t n = e ? 2 : 1;
+		if (o + n >= size)
+			break;
+		if (e)
+			memcpy(out + o, e, n);
+		else
+			out[o] = *value;
+		o += n;
+	}
+	if (size)
+		out[o < size ? o : size - 1] = 0;
+	return *value ? -1 : 0;
+}
@@ -0,0 +1,75 @@
+/*
+	sim_metrics.h
+
+	Counters of running cores, in the Prometheus text format.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SIM_METRICS_H__
+#define __SIM_METRICS_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * For a daemon that runs many cores for a long time, what a scraper like
+ * Prometheus reads: each metric has its HELP and TYPE lines, then one
+ * sample per instance, told apart by its labels. The counters are read as
+ * they are, with no locking, so this can run from another thread than the
+ * cores; a sample may be a little behind, never wrong by more than that.
+ *
+ * The cycles, the sleep cycles, the state, the per vector interrupt counts
+ * and latency histogram, the bytes of each UART and of the VCD file are
+ * always there; the instruction, timer and IRQ counts only for the cores
+ * with avr->stats set (see sim_stats.h).
+ */
+typedef struct avr_metrics_source_t {
+	struct avr_t *	avr;
+	// 'name="value",...' added to each of its samples, or NULL
+	const char *	labels;
+} avr_metrics_source_t;
+
+/*
+ * Writes the metrics of the 'count' sources to 'out'.
+ * Returns zero if all is well, -1 if 'out' failed
+ */
+int
+avr_metrics_write(
+		const avr_metrics_source_t * src,
+		int count,
+		FILE * out );
+
+/*
+ * Writes 'value' into 'out', of 'size' bytes, escaped as a label value
+ * must be. Returns zero, or -1 if it didn't fit
+ */
+int
+avr_metrics_label_escape(
+		const char * value,
+		char * out,
+		size_t size );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_METRICS_H__ */
@@ -0,0 +1,115 @@
+/*
+	sim_numa.c
+
+	Keeps the memory of a core on the NUMA node of the thread that runs it.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		// for sched_setaffinity()
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#include "sim_numa.h"
+#include "sim_core.h"
+
+#ifdef __linux__
+// from <numaif.h>, without needing libnuma
+#define AVR_MPOL_PREFERRED	1
+#define AVR_MPOL_MF_MOVE	(1 << 1)
+
+/*
+ * Only the pages all inside [p, p + size) are moved, the ones around
+ * belong to someone else as well
+ */
+static int
+_avr_numa_move(
+		const void * p,
+		size_t size,
+		int node )
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)p + size) & ~(page - 1);
+	unsigned long mask = 1UL << node;
+
+	if (!p || end <= start)
+		return 0;
+	return syscall(SYS_mbind, start, end - start, AVR_MPOL_PREFERRED,
+			&mask, sizeof(mask) * 8, AVR_MPOL_MF_MOVE) ? -1 : 0;
+}
+#endif
+
+int
+avr_numa_node(void)
+{
+#ifdef __linux__
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return node;
+#endif
+	return -1;
+}
+
+int
+avr_numa_localize(
+		avr_t * avr )
+{
+#ifdef __linux__
+	int node = avr_numa_node();
+	if (node < 0 || node >= (int)sizeof(unsigned long) * 8)
+		return -1;
+	int res = _avr_numa_move(avr->data, avr->ramend + 1, node);
+	if (!avr->flash_image)
+		res |= _avr_numa_move(avr->flash, avr->flashend + 1, node);
+	if (avr->decoded && !avr->decoded_mapped)
+		res |= _avr_numa_move(avr->decoded,
+				((avr->flashend + 1) >> 1) * sizeof(avr_decoded_t), node);
+	res |= _avr_numa_move(avr->io, avr->io_count * sizeof(*avr->io), node);
+	res |= _avr_numa_move(avr, sizeof(*avr), node);
+	if (res)
+		AVR_LOG(avr, LOG_DEBUG, "NUMA: %s: can't move to node %d: %s\n",
+				__func__, node, strerror(errno));
+	return res;
+#else
+	return -1;
+#endif
+}
+
+int
+avr_numa_bind(
+		int cpu )
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == 0)
+		return 0;
+	AVR_LOG(NULL, LOG_WARNING, "NUMA: can't run on cpu %d: %s\n",
+			cpu, strerror(errno));
+#else
+	AVR_LOG(NULL, LOG_WARNING, "NUMA: can't pin to a cpu here\n");
+#endif
+	return -1;
+}
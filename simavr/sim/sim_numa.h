@@ -0,0 +1,64 @@
+/*
+	sim_numa.h
+
+	Keeps the memory of a core on the NUMA node of the thread that runs it.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_NUMA_H__
+#define __SIM_NUMA_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Linux gives a page the node of the thread that first writes it, so a
+ * core made by the thread that runs it already has its memory local.
+ * Cores made by one thread and run by others (sim_cosim.h) are not: the
+ * thread calls avr_numa_localize() first, which moves the pages the data
+ * space, the flash, the predecoded cache and the io tables of the core
+ * have to themselves to its node. The buffers smaller than a page stay
+ * where they are, unless they were given pages of their own
+ * (CONFIG_SIMAVR_GUARD_PAGES); a flash shared with other cores
+ * (avr_flash_share()) isn't moved either, nor its shared decoded entries
+ * (avr_predecode_share()).
+ *
+ * A server that runs its cores on one thread (farm_avr) is kept on one
+ * cpu, and so on one node, with avr_numa_bind() before it makes them.
+ * None of it does anything but on Linux.
+ */
+
+// the node the calling thread runs on, -1 if it can't be known
+int
+avr_numa_node(void);
+// returns 0, or -1 if the pages could not be moved
+int
+avr_numa_localize(
+		avr_t * avr );
+// runs the calling thread, and those it starts, on 'cpu' only. Returns 0, or -1
+int
+avr_numa_bind(
+		int cpu );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_NUMA_H__ */
@@ -0,0 +1,240 @@
+/*
+	sim_pacing.c
+
+	Keeps the simulation in step with the host clock, for
+	hardware-in-the-loop setups.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		// for pthread_setaffinity_np()
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "sim_pacing.h"
+#include "sim_time.h"
+#include "sim_cycle_timers.h"
+
+// being this late means the host can't keep up, don't try to catch up
+#define AVR_PACING_RESYNC_NS	(100 * 1000000ULL)
+
+static uint64_t
+_avr_pacing_now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void
+_avr_pacing_wait(
+		uint64_t deadline,
+		uint64_t now)
+{
+#ifdef __APPLE__
+	// no clock_nanosleep() there, a relative sleep is close enough
+	struct timespec ts = {
+		.tv_sec = (deadline - now) / 1000000000ULL,
+		.tv_nsec = (deadline - now) % 1000000000ULL,
+	};
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+#else
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000ULL,
+		.tv_nsec = deadline % 1000000000ULL,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#endif
+}
+
+static avr_cycle_count_t
+_avr_pacing_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_pacing_t * p = param;
+	uint64_t deadline = p->start_ns + (uint64_t)(avr_cycles_to_nsec(avr,
+			avr->cycle - p->start_cycle) / p->speed);
+	uint64_t now = _avr_pacing_now();
+
+	p->stats.periods++;
+	if (now >= deadline) {
+		uint64_t late = now - deadline;
+		int b = 0;
+		for (uint64_t us = late / 1000; us && b < AVR_PACING_BUCKETS - 1; us >>= 1)
+			b++;
+		p->stats.lag[b]++;
+		if (p->deadline_ns && late > p->deadline_ns) {
+			p->stats.missed++;
+			if (p->missed)
+				p->missed(p, late, p->missed_param);
+			else
+				AVR_LOG(avr, LOG_WARNING,
+						"PACING: %" PRIu64 "us late at cycle %" PRI_avr_cycle_count "\n",
+						late / 1000, avr->cycle);
+		}
+		p->stats.late++;
+		p->stats.late_total_ns += late;
+		if (late > p->stats.late_max_ns)
+			p->stats.late_max_ns = late;
+		if (late > p->resync_ns) {
+			p->stats.resync++;
+			p->start_cycle = avr->cycle;
+			p->start_ns = now;
+		}
+	} else {
+		p->stats.lag[0]++;
+		_avr_pacing_wait(deadline, now);
+		uint64_t over = _avr_pacing_now() - deadline;
+		if (over > p->stats.oversleep_max_ns)
+			p->stats.oversleep_max_ns = over;
+	}
+	return when + p->period;
+}
+
+int
+avr_pacing_init(
+		struct avr_t * avr,
+		avr_pacing_t * p,
+		double speed,
+		uint32_t period)
+{
+	if (speed <= 0 || !period) {
+		AVR_LOG(avr, LOG_ERROR, "PACING: invalid speed %f or period %u\n",
+				speed, period);
+		return -1;
+	}
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->speed = speed;
+	p->period = avr_usec_to_cycles(avr, period);
+	if (!p->period)
+		p->period = 1;
+	p->resync_ns = AVR_PACING_RESYNC_NS;
+	p->start_cycle = avr->cycle;
+	p->start_ns = _avr_pacing_now();
+	p->sleep = avr->sleep;
+	avr->sleep = avr_callback_sleep_virtual;
+	avr_cycle_timer_register(avr, p->period, _avr_pacing_timer, p);
+	return 0;
+}
+
+void
+avr_pacing_deadline(
+		avr_pacing_t * p,
+		uint32_t deadline,
+		avr_pacing_missed_p missed,
+		void * param)
+{
+	p->deadline_ns = (uint64_t)deadline * 1000;
+	p->missed = missed;
+	p->missed_param = param;
+}
+
+int
+avr_pacing_realtime(
+		struct avr_t * avr,
+		int cpu,
+		int priority)
+{
+	int res = 0;
+
+	if (cpu >= 0) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			AVR_LOG(avr, LOG_WARNING, "PACING: can't pin to cpu %d: %s\n",
+					cpu, strerror(err));
+			res = -1;
+		}
+#else
+		AVR_LOG(avr, LOG_WARNING, "PACING: can't pin to a cpu here\n");
+		res = -1;
+#endif
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		AVR_LOG(avr, LOG_WARNING, "PACING: can't lock memory: %s\n",
+				strerror(errno));
+		res = -1;
+	}
+	if (priority) {
+		struct sched_param sp = { .sched_priority = priority };
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (err) {
+			AVR_LOG(avr, LOG_WARNING, "PACING: can't use SCHED_FIFO %d: %s\n",
+					priority, strerror(err));
+			res = -1;
+		}
+	}
+	return res;
+}
+
+void
+avr_pacing_stop(
+		avr_pacing_t * p)
+{
+	if (!p->avr)
+		return;
+	avr_cycle_timer_cancel(p->avr, _avr_pacing_timer, p);
+	if (p->avr->sleep == avr_callback_sleep_virtual)
+		p->avr->sleep = p->sleep;
+	p->avr = NULL;
+}
+
+void
+avr_pacing_report(
+		avr_pacing_t * p,
+		FILE * out)
+{
+	avr_pacing_stats_t * s = &p->stats;
+
+	fprintf(out, "pacing: %" PRIu64 " periods, %" PRIu64 " late "
+			"(avg %" PRIu64 "us, max %" PRIu64 "us), "
+			"max oversleep %" PRIu64 "us, %" PRIu64 " resync\n",
+			s->periods, s->late,
+			s->late ? s->late_total_ns / s->late / 1000 : 0,
+			s->late_max_ns / 1000, s->oversleep_max_ns / 1000, s->resync);
+	if (p->deadline_ns)
+		fprintf(out, "pacing: %" PRIu64 " deadlines of %" PRIu64 "us missed\n",
+				s->missed, p->deadline_ns / 1000);
+	if (!s->periods)
+		return;
+	fprintf(out, "pacing lag:");
+	for (int b = 0; b < AVR_PACING_BUCKETS; b++) {
+		if (!s->lag[b])
+			continue;
+		if (b == 0)
+			fprintf(out, " <1us:%" PRIu64, s->lag[b]);
+		else if (b == AVR_PACING_BUCKETS - 1)
+			fprintf(out, " >=%uus:%" PRIu64, 1u << (b - 1), s->lag[b]);
+		else
+			fprintf(out, " <%uus:%" PRIu64, 1u << b, s->lag[b]);
+	}
+	fprintf(out, "\n");
+}
@@ -0,0 +1,134 @@
+/*
+	sim_pacing.h
+
+	Keeps the simulation in step with the host clock, for
+	hardware-in-the-loop setups.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_PACING_H__
+#define __SIM_PACING_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Real time pacing governor.
+ *
+ * A cycle timer fires every 'period', compares avr->cycle with the host
+ * monotonic clock, and waits until the absolute host time that cycle
+ * count corresponds to. As the deadlines are all computed from the start
+ * point, the wake up jitter doesn't accumulate into a drift; and as this
+ * runs whether the core is busy or sleeping, busy firmware is paced too.
+ * Sleeps don't need to wait on their own anymore, so the "virtual" sleep
+ * callback is installed while the governor is running.
+ *
+ * 'speed' scales the AVR time, 2.0 runs twice as fast as the real part.
+ * When the host is so far behind it can't catch up (see resync_ns) the
+ * reference point is moved instead of running flat out for a while.
+ *
+ * The lag, how far the host is behind the AVR time at each pacing point,
+ * is kept as a histogram of powers of two microseconds: bucket 0 is on
+ * time or less than a microsecond late, bucket n is a lag of
+ * [2^(n-1), 2^n) usec, the last one has all the longer ones.
+ */
+#define AVR_PACING_BUCKETS	24
+
+typedef struct avr_pacing_stats_t {
+	uint64_t		periods;		// pacing points reached
+	uint64_t		late;			// ... already past their deadline
+	uint64_t		late_total_ns;
+	uint64_t		late_max_ns;
+	uint64_t		oversleep_max_ns;	// worst wake up after a deadline
+	uint64_t		resync;			// times the reference was moved
+	uint64_t		missed;			// deadlines missed, see deadline_ns
+	uint64_t		lag[AVR_PACING_BUCKETS];
+} avr_pacing_stats_t;
+
+struct avr_pacing_t;
+// called when a pacing point is more than deadline_ns late
+typedef void (*avr_pacing_missed_p)(
+		struct avr_pacing_t * p,
+		uint64_t late_ns,
+		void * param);
+
+typedef struct avr_pacing_t {
+	struct avr_t *		avr;
+	double				speed;
+	avr_cycle_count_t	period;		// in cycles
+	uint64_t			resync_ns;	// lateness that moves the reference
+
+	avr_cycle_count_t	start_cycle;
+	uint64_t			start_ns;
+	void (*sleep)(struct avr_t * avr, avr_cycle_count_t howLong);
+
+	uint64_t			deadline_ns;	// zero for none
+	avr_pacing_missed_p	missed;
+	void *				missed_param;
+
+	avr_pacing_stats_t	stats;
+} avr_pacing_t;
+
+// initializes and starts the governor, returns zero if all is well
+int
+avr_pacing_init(
+		struct avr_t * avr,
+		avr_pacing_t * p,
+		double speed,				// 1.0 for real time
+		uint32_t period );			// check period, in usec
+/*
+ * Calls 'missed' each time a pacing point is more than 'deadline' usec
+ * late. A NULL 'missed' logs a warning instead.
+ */
+void
+avr_pacing_deadline(
+		avr_pacing_t * p,
+		uint32_t deadline,
+		avr_pacing_missed_p missed,
+		void * param );
+/*
+ * Makes the calling thread, the one running the core, as real time as the
+ * host allows: pinned to 'cpu' (none if negative, Linux only), with all
+ * of the process memory locked, and scheduled SCHED_FIFO at 'priority'
+ * (not changed if zero). That usually takes root, or CAP_SYS_NICE and
+ * CAP_IPC_LOCK; what can't be done is logged, and the rest done anyway.
+ * Returns zero if all of it was done
+ */
+int
+avr_pacing_realtime(
+		struct avr_t * avr,
+		int cpu,
+		int priority );
+// stops pacing, and restores the previous sleep callback
+void
+avr_pacing_stop(
+		avr_pacing_t * p );
+// prints the statistics, and the lag histogram, to 'out'
+void
+avr_pacing_report(
+		avr_pacing_t * p,
+		FILE * out );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PACING_H__ */
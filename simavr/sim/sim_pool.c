@@ -0,0 +1,191 @@
+/*
+	sim_pool.c
+
+	Keeps instances running the same firmware around, for the next test.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_pool.h"
+#include "sim_snapshot.h"
+#include "sim_io.h"
+#include "sim_stimulus.h"
+#include "avr_eeprom.h"
+
+avr_pool_t *
+avr_pool_new(
+		const elf_firmware_t * firmware)
+{
+	avr_pool_t * pool = calloc(1, sizeof(*pool));
+
+	if (!pool)
+		return NULL;
+	pool->firmware = *firmware;
+	return pool;
+}
+
+// what a new instance looks like, to put it back and check it later
+static int
+_avr_pool_capture(
+		avr_pool_t * pool,
+		avr_t * avr)
+{
+	pool->flashsize = avr->flashend + 1;
+	pool->datasize = avr->ramend + 1;
+	pool->flash = malloc(pool->flashsize);
+	pool->data = malloc(pool->datasize);
+	if (!pool->flash || !pool->data)
+		goto fail;
+	memcpy(pool->flash, avr->flash, pool->flashsize);
+	memcpy(pool->data, avr->data, pool->datasize);
+
+	avr_eeprom_desc_t d = { .ee = NULL, .offset = 0, .size = avr->e2end + 1 };
+	if (avr->e2end && avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d) == 0 && d.ee) {
+		pool->eeprom = malloc(d.size);
+		if (!pool->eeprom)
+			goto fail;
+		memcpy(pool->eeprom, d.ee, d.size);
+		pool->eesize = d.size;
+	}
+	pool->codeend = avr->codeend;
+	pool->frequency = avr->frequency;
+	pool->lockbits = avr->lockbits;
+	pool->serial = avr->irq_pool.serial;
+	return 0;
+fail:
+	free(pool->flash);
+	free(pool->data);
+	pool->flash = pool->data = NULL;
+	return -1;
+}
+
+avr_t *
+avr_pool_get(
+		avr_pool_t * pool)
+{
+	if (pool->count)
+		return pool->spare[--pool->count];
+
+	avr_t * avr = avr_make_mcu_by_name(pool->firmware.mmcu);
+	if (!avr)
+		return NULL;
+	avr_init(avr);
+	avr_load_firmware(avr, &pool->firmware);
+	// without it, the instances are only terminated when given back
+	if (!pool->flash && _avr_pool_capture(pool, avr))
+		AVR_LOG(avr, LOG_WARNING, "POOL: %s: out of memory\n", __func__);
+	return avr;
+}
+
+// nothing attached to it that avr_reset() wouldn't take care of
+static int
+_avr_pool_attached(
+		avr_pool_t * pool,
+		avr_t * avr)
+{
+	return avr->irq_pool.serial != pool->serial || avr->irq_pool.prof ||
+			avr->gdb || avr->vcd || avr->trace_ring || avr->trace_file ||
+			avr->profile || avr->callgraph || avr->coverage || avr->lcov ||
+			avr->stats || avr->sampling || avr->energy || avr->heatmap ||
+			avr->shm || avr->intrinsics || avr->postmortem ||
+			avr->timer_prof || avr->tier || avr->regions ||
+			avr->logger_thread || avr->inject ||
+			avr->timing != AVR_TIMING_EXACT;
+}
+
+static void
+_avr_pool_drop(
+		avr_pool_t * pool,
+		avr_t * avr)
+{
+	memset(&avr->custom, 0, sizeof(avr->custom));
+	avr_terminate(avr);
+	free(avr);
+	pool->dropped++;
+}
+
+void
+avr_pool_release(
+		avr_pool_t * pool,
+		avr_t * avr)
+{
+	if (!avr)
+		return;
+	if (!pool->flash || _avr_pool_attached(pool, avr)) {
+		_avr_pool_drop(pool, avr);
+		return;
+	}
+	memset(&avr->custom, 0, sizeof(avr->custom));
+	// avr_reset() only reschedules them, they'd fire into the next job
+	avr_stimulus_cancel(avr, NULL);
+	// the dirty pages won't match any snapshot after this
+	avr_snapshot_untrack(avr);
+	memcpy(avr->data, pool->data, pool->datasize);
+	avr_io_read_invalidate(avr);
+	if (memcmp(avr->flash, pool->flash, pool->flashsize))
+		avr_loadcode(avr, pool->flash, pool->flashsize, 0);
+	avr->codeend = pool->codeend;
+	if (pool->eeprom) {
+		avr_eeprom_desc_t d = { .ee = pool->eeprom, .offset = 0, .size = pool->eesize };
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &d);
+	}
+	avr->frequency = pool->frequency;
+	avr->lockbits = pool->lockbits;
+	avr->cycle = 0;
+	avr_interrupt_stats_reset(avr);
+	avr_reset(avr);
+	avr_regbit_set(avr, avr->reset_flags.porf);
+
+	// the io modules have put their registers back too
+	if (memcmp(avr->data, pool->data, pool->datasize) ||
+			memcmp(avr->flash, pool->flash, pool->flashsize) ||
+			avr->irq_pool.serial != pool->serial) {
+		AVR_LOG(avr, LOG_WARNING, "POOL: %s: %s not clean after reset\n",
+				__func__, avr->mmcu);
+		_avr_pool_drop(pool, avr);
+		return;
+	}
+	if (pool->count == pool->size) {
+		int size = pool->size ? pool->size * 2 : 8;
+		avr_t ** spare = realloc(pool->spare, size * sizeof(*spare));
+		if (!spare) {
+			_avr_pool_drop(pool, avr);
+			return;
+		}
+		pool->spare = spare;
+		pool->size = size;
+	}
+	pool->spare[pool->count++] = avr;
+}
+
+void
+avr_pool_free(
+		avr_pool_t * pool)
+{
+	if (!pool)
+		return;
+	for (int i = 0; i < pool->count; i++) {
+		avr_terminate(pool->spare[i]);
+		free(pool->spare[i]);
+	}
+	free(pool->spare);
+	free(pool->flash);
+	free(pool->data);
+	free(pool->eeprom);
+	free(pool);
+}
@@ -0,0 +1,84 @@
+/*
+	sim_pool.h
+
+	Keeps instances running the same firmware around, for the next test.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_POOL_H__
+#define __SIM_POOL_H__
+
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A pool hands out instances of the firmware's mcu with the firmware
+ * loaded, as avr_make_mcu_by_name(), avr_init() and avr_load_firmware()
+ * would. When it's given one back, the instance goes through avr_reset()
+ * with the flash, data and eeprom of a new one put back, and is checked
+ * against them before it's handed out again.
+ *
+ * Only instances that were left as they were handed out, apart from
+ * running, are kept: one that had irq hooks added or removed, gdb, a vcd
+ * file, a trace ring, profiling, call graph, coverage, stats, a shared
+ * memory segment or any other tool with an avr_t pointer attached, or
+ * the functional timing, is terminated instead. Its 'custom' hooks are
+ * cleared, not called, and its pending stimulus events are cancelled.
+ * A pool is not thread safe.
+ */
+typedef struct avr_pool_t {
+	elf_firmware_t	firmware;	// its buffers must outlive the pool
+	struct avr_t **	spare;
+	int				count, size;
+	// the state of a new instance, once one was made
+	uint8_t *		flash;
+	uint8_t *		data;
+	uint8_t *		eeprom;
+	uint32_t		flashsize, datasize, eesize;
+	avr_flashaddr_t	codeend;
+	uint32_t		frequency;
+	uint8_t			lockbits;
+	uint32_t		serial;		// the irq pool's, see avr_irq_pool_t
+	uint32_t		dropped;	// instances that were not clean
+} avr_pool_t;
+
+// returns a pool for 'firmware', which is copied, or NULL
+avr_pool_t *
+avr_pool_new(
+		const elf_firmware_t * firmware );
+// returns an instance ready to run, or NULL
+struct avr_t *
+avr_pool_get(
+		avr_pool_t * pool );
+// gives an instance back, it's terminated and freed if it's not clean
+void
+avr_pool_release(
+		avr_pool_t * pool,
+		struct avr_t * avr );
+// terminates the spare instances; the ones still out are left alone
+void
+avr_pool_free(
+		avr_pool_t * pool );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_POOL_H__ */
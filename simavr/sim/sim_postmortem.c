@@ -0,0 +1,251 @@
+/*
+	sim_postmortem.c
+
+	Writes the state of a core to a file when it crashes, runs an invalid
+	opcode or is reset by its watchdog, with its last instructions.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "sim_postmortem.h"
+#include "sim_core.h"
+
+#define AVR_POSTMORTEM_VERSION	1
+
+typedef struct _avr_postmortem_file_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	reason;
+	uint64_t	cycle;
+	uint32_t	pc;
+	uint16_t	sp;
+	uint8_t		sreg, pad;
+	char		mmcu[32];
+	uint32_t	snapshot_len;
+	uint32_t	records, record_size;
+} _avr_postmortem_file_t;
+
+static const char *
+_avr_postmortem_why(
+		uint32_t reason)
+{
+	switch (reason) {
+		case AVR_POSTMORTEM_CRASH: return "crash";
+		case AVR_POSTMORTEM_OPCODE: return "invalid opcode";
+		case AVR_POSTMORTEM_WATCHDOG: return "watchdog reset";
+	}
+	return "?";
+}
+
+int
+avr_postmortem_init(
+		avr_t * avr,
+		avr_postmortem_t * pm,
+		const char * path,
+		uint32_t reasons,
+		uint32_t limit)
+{
+	memset(pm, 0, sizeof(*pm));
+	if (strlen(path) >= sizeof(pm->path)) {
+		AVR_LOG(avr, LOG_ERROR, "POSTMORTEM: %s: path too long\n", __func__);
+		return -1;
+	}
+	strcpy(pm->path, path);
+	pm->avr = avr;
+	pm->reasons = reasons;
+	pm->limit = limit ? limit : 1;
+	avr->postmortem = pm;
+	return 0;
+}
+
+void
+avr_postmortem_stop(
+		avr_postmortem_t * pm)
+{
+	if (pm->avr && pm->avr->postmortem == pm)
+		pm->avr->postmortem = NULL;
+	pm->avr = NULL;
+}
+
+void
+avr_postmortem_event(
+		avr_t * avr,
+		uint32_t reason)
+{
+	avr_postmortem_t * pm = avr->postmortem;
+
+	if (!pm || !(pm->reasons & reason) || pm->written >= pm->limit)
+		return;
+	char path[sizeof(pm->last)];
+	if (pm->written)
+		snprintf(path, sizeof(path), "%s.%u", pm->path, pm->written);
+	else
+		snprintf(path, sizeof(path), "%s", pm->path);
+	// counted even if it fails, a full disk isn't retried on every opcode
+	pm->written++;
+	if (avr_postmortem_write(avr, path, reason) == 0)
+		strcpy(pm->last, path);
+}
+
+int
+avr_postmortem_write(
+		avr_t * avr,
+		const char * path,
+		uint32_t reason)
+{
+	avr_snapshot_t * s = avr_snapshot_save(avr);
+	if (!s)
+		return -1;
+	// no need to keep track of the pages for that one
+	avr_snapshot_untrack(avr);
+
+	_avr_postmortem_file_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AVR_POSTMORTEM_FILE_MAGIC, sizeof(h.magic));
+	h.version = AVR_POSTMORTEM_VERSION;
+	h.reason = reason;
+	h.cycle = avr->cycle;
+	h.pc = avr->pc;
+	h.sp = _avr_sp_get(avr);
+	READ_SREG_INTO(avr, h.sreg);
+	snprintf(h.mmcu, sizeof(h.mmcu), "%s", avr->mmcu);
+	h.snapshot_len = s->len;
+	h.record_size = sizeof(avr_trace_rec_t);
+
+	// the ring, oldest first
+	avr_trace_ring_t * t = avr->trace_ring;
+	uint32_t start = 0;
+	if (t) {
+		h.records = t->count < t->mask + 1ULL ? t->count : t->mask + 1;
+		start = t->count <= t->mask + 1ULL ? 0 : t->count & t->mask;
+	}
+
+	gzFile f = gzopen(path, "wb6");
+	if (!f) {
+		AVR_LOG(avr, LOG_ERROR, "POSTMORTEM: can't create %s\n", path);
+		avr_snapshot_free(s);
+		return -1;
+	}
+	int res = gzwrite(f, &h, sizeof(h)) == sizeof(h) &&
+			gzwrite(f, s->buf, s->len) == (int)s->len;
+	if (res && h.records) {
+		uint32_t first = h.records - start;
+		res = gzwrite(f, t->rec + start, first * sizeof(*t->rec)) ==
+					(int)(first * sizeof(*t->rec)) &&
+				(!start || gzwrite(f, t->rec, start * sizeof(*t->rec)) ==
+					(int)(start * sizeof(*t->rec)));
+	}
+	avr_snapshot_free(s);
+	if (gzclose(f) != Z_OK || !res) {
+		AVR_LOG(avr, LOG_ERROR, "POSTMORTEM: can't write %s\n", path);
+		remove(path);
+		return -1;
+	}
+	AVR_LOG(avr, LOG_ERROR, "POSTMORTEM: %s at cycle %" PRI_avr_cycle_count
+			", written in %s\n", _avr_postmortem_why(reason),
+			avr->cycle, path);
+	return 0;
+}
+
+int
+avr_postmortem_read(
+		avr_t * avr,
+		const char * path,
+		avr_postmortem_info_t * info,
+		avr_snapshot_t ** s,
+		avr_trace_rec_t ** rec)
+{
+	gzFile f = gzopen(path, "rb");
+	if (!f) {
+		AVR_LOG(avr, LOG_ERROR, "POSTMORTEM: can't open %s\n", path);
+		return -1;
+	}
+	_avr_postmortem_file_t h;
+	if (gzread(f, &h, sizeof(h)) != sizeof(h) ||
+			memcmp(h.magic, AVR_POSTMORTEM_FILE_MAGIC, sizeof(h.magic)) ||
+			h.version != AVR_POSTMORTEM_VERSION ||
+			h.record_size != sizeof(avr_trace_rec_t)) {
+		AVR_LOG(avr, LOG_ERROR,
+				"POSTMORTEM: %s isn't a post-mortem of this version\n", path);
+		gzclose(f);
+		return -1;
+	}
+	if (info) {
+		memset(info, 0, sizeof(*info));
+		info->reason = h.reason;
+		info->cycle = h.cycle;
+		info->pc = h.pc;
+		info->sp = h.sp;
+		info->sreg = h.sreg;
+		memcpy(info->mmcu, h.mmcu, sizeof(info->mmcu));
+		info->mmcu[sizeof(info->mmcu) - 1] = 0;
+		info->records = h.records;
+	}
+	avr_snapshot_t * snap = calloc(1, sizeof(*snap));
+	avr_trace_rec_t * r = malloc((h.records ? h.records : 1) * sizeof(*r));
+	if (snap)
+		snap->buf = malloc(h.snapshot_len ? h.snapshot_len : 1);
+	int res = snap && snap->buf && r &&
+			gzread(f, snap->buf, h.snapshot_len) == (int)h.snapshot_len &&
+			gzread(f, r, h.records * sizeof(*r)) == (int)(h.records * sizeof(*r));
+	gzclose(f);
+	if (!res) {
+		AVR_LOG(avr, LOG_ERROR, "POSTMORTEM: can't read %s\n", path);
+		avr_snapshot_free(snap);
+		free(r);
+		return -1;
+	}
+	snap->size = snap->len = h.snapshot_len;
+	if (s)
+		*s = snap;
+	else
+		avr_snapshot_free(snap);
+	if (rec)
+		*rec = r;
+	else
+		free(r);
+	return 0;
+}
+
+void
+avr_postmortem_print(
+		avr_postmortem_info_t * info,
+		avr_trace_rec_t * rec,
+		uint32_t last,
+		FILE * out)
+{
+	const char * bits = "ITHSVNZC";
+	char sreg[9];
+	for (int i = 0; i < 8; i++)
+		sreg[i] = info->sreg & (0x80 >> i) ? bits[i] : '-';
+	sreg[8] = 0;
+	fprintf(out, "postmortem: %s on %s at cycle %" PRI_avr_cycle_count
+			", pc %04x sp %04x sreg %s\n",
+			_avr_postmortem_why(info->reason), info->mmcu, info->cycle,
+			info->pc, info->sp, sreg);
+	if (!rec || !info->records)
+		return;
+	// the records are in order, a ring that never wrapped prints them
+	avr_trace_ring_t t = { .rec = rec, .count = info->records };
+	while (t.mask + 1ULL < info->records)
+		t.mask = (t.mask << 1) | 1;
+	fprintf(out, "postmortem: the last %u of %u instructions\n",
+			last < info->records ? last : info->records, info->records);
+	avr_trace_ring_print(&t, out, last);
+}
@@ -0,0 +1,129 @@
+/*
+	sim_postmortem.h
+
+	Writes the state of a core to a file when it crashes, runs an invalid
+	opcode or is reset by its watchdog, with its last instructions.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_POSTMORTEM_H__
+#define __SIM_POSTMORTEM_H__
+
+#include "sim_avr.h"
+#include "sim_snapshot.h"
+#include "sim_trace_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * crash() only prints, and only in CONFIG_SIMAVR_TRACE builds. With a
+ * post-mortem set on the instance, avr_sadly_crashed(), the invalid
+ * opcodes and the watchdog resets write a file instead, there and then,
+ * before anything is reset:
+ *	+ a header: why, the cycle, pc, SP and SREG, the mcu
+ *	+ a snapshot of the whole instance (see sim_snapshot.h)
+ *	+ the records of the trace ring, oldest first, if one is running
+ *	  (see sim_trace_ring.h)
+ * gzip compressed. The snapshot is bound to the instance layout like any
+ * other: it's loaded into the same program, set up the same way (run_avr
+ * --postmortem), and from there looked at with gdb, or compared with
+ * the snapshot diff (sim_snapdiff.h).
+ *
+ * The first file is 'path', the next ones 'path'.1, 'path'.2... up to
+ * 'limit' of them; an invalid opcode is usually followed by many more.
+ */
+#define AVR_POSTMORTEM_FILE_MAGIC	"simavrPM"
+
+enum {
+	AVR_POSTMORTEM_CRASH	= (1 << 0),
+	AVR_POSTMORTEM_OPCODE	= (1 << 1),
+	AVR_POSTMORTEM_WATCHDOG	= (1 << 2),
+	AVR_POSTMORTEM_ALL		= 0x7,
+};
+
+typedef struct avr_postmortem_t {
+	struct avr_t *	avr;
+	char			path[256];
+	uint32_t		reasons;	// AVR_POSTMORTEM_*, that write a file
+	uint32_t		limit;		// of files
+	uint32_t		written;
+	char			last[272];	// the last file written
+} avr_postmortem_t;
+
+// what a post-mortem file says, before its snapshot and records
+typedef struct avr_postmortem_info_t {
+	uint32_t			reason;		// one AVR_POSTMORTEM_*
+	avr_cycle_count_t	cycle;
+	avr_flashaddr_t		pc;
+	uint16_t			sp;
+	uint8_t				sreg;
+	char				mmcu[32];
+	uint32_t			records;	// of the trace ring
+} avr_postmortem_info_t;
+
+/*
+ * Sets 'pm' on 'avr', to write up to 'limit' files (0 for one) when one
+ * of the 'reasons' happens. Returns 0, or -1
+ */
+int
+avr_postmortem_init(
+		struct avr_t * avr,
+		avr_postmortem_t * pm,
+		const char * path,
+		uint32_t reasons,
+		uint32_t limit );
+void
+avr_postmortem_stop(
+		avr_postmortem_t * pm );
+// called by the core when 'reason' happens; writes a file if it's wanted
+void
+avr_postmortem_event(
+		struct avr_t * avr,
+		uint32_t reason );
+// writes a post-mortem of 'avr' now. Returns 0, or -1
+int
+avr_postmortem_write(
+		struct avr_t * avr,
+		const char * path,
+		uint32_t reason );
+/*
+ * Reads a post-mortem file; 's' gets its snapshot (to restore into 'avr'),
+ * 'rec' its trace records, info->records of them, if not NULL.
+ * Returns 0, or -1 if it's not one, or not of this version
+ */
+int
+avr_postmortem_read(
+		struct avr_t * avr,
+		const char * path,
+		avr_postmortem_info_t * info,
+		avr_snapshot_t ** s,
+		avr_trace_rec_t ** rec );
+// prints the header, and the last 'last' records, in text form
+void
+avr_postmortem_print(
+		avr_postmortem_info_t * info,
+		avr_trace_rec_t * rec,
+		uint32_t last,
+		FILE * out );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_POSTMORTEM_H__ */
@@ -0,0 +1,238 @@
+/*
+	sim_profile.c
+
+	Flash PC histogram profiler, with per function reports.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_profile.h"
+#include "sim_cycle_timers.h"
+
+static void
+_avr_profile_run(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	uint32_t word = avr->pc >> 1;
+	int sleeping = avr->state == cpu_Sleeping;
+	avr_cycle_count_t start = avr->cycle;
+
+	if (avr->state == cpu_Running)
+		avr->run_cycle_count = 1;
+	p->run(avr);
+
+	avr_cycle_count_t c = avr->cycle - start;
+	p->total += c;
+	if (!sleeping && avr->state == cpu_Sleeping && c > 1) {
+		// that was SLEEP, and the core went to sleep right after it
+		p->sleep += c - 1;
+		c = 1;
+	}
+	if (sleeping)
+		p->sleep += c;
+	else if (word < p->words)
+		p->hist[word] += c;
+}
+
+static avr_cycle_count_t
+_avr_profile_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_profile_t * p = param;
+	uint32_t word = avr->pc >> 1;
+
+	p->total += p->sample;
+	if (avr->state == cpu_Sleeping)
+		p->sleep += p->sample;
+	else if (word < p->words)
+		p->hist[word] += p->sample;
+	return when + p->sample;
+}
+
+int
+avr_profile_init(
+		avr_t * avr,
+		avr_profile_t * p,
+		uint32_t sample)
+{
+	if (avr->profile) {
+		AVR_LOG(avr, LOG_ERROR, "PROFILE: already profiling\n");
+		return -1;
+	}
+	memset(p, 0, sizeof(*p));
+	p->words = (avr->flashend + 1) >> 1;
+	p->hist = calloc(p->words, sizeof(p->hist[0]));
+	if (!p->hist) {
+		AVR_LOG(avr, LOG_ERROR, "PROFILE: can't allocate histogram\n");
+		return -1;
+	}
+	p->avr = avr;
+	p->sample = sample;
+	avr->profile = p;
+	if (sample)
+		avr_cycle_timer_register(avr, sample, _avr_profile_timer, p);
+	else {
+		p->run = avr->run;
+		avr->run = _avr_profile_run;
+	}
+	return 0;
+}
+
+void
+avr_profile_stop(
+		avr_profile_t * p)
+{
+	avr_t * avr = p->avr;
+
+	if (!avr)
+		return;
+	if (p->sample)
+		avr_cycle_timer_cancel(avr, _avr_profile_timer, p);
+	else if (avr->run == _avr_profile_run)
+		avr->run = p->run;
+	avr->profile = NULL;
+	p->avr = NULL;
+}
+
+void
+avr_profile_free(
+		avr_profile_t * p)
+{
+	avr_profile_stop(p);
+	free(p->hist);
+	p->hist = NULL;
+}
+
+typedef struct _avr_profile_fn_t {
+	const char *	name;
+	uint32_t		addr;		// in bytes
+	uint64_t		cycles;
+} _avr_profile_fn_t;
+
+/*
+ * Folds the histogram into one entry per symbol (plus one for what's
+ * before the first one), in address order. Symbols found at the same
+ * address are merged, the last one gives its name.
+ */
+static _avr_profile_fn_t *
+_avr_profile_fold(
+		avr_profile_t * p,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		int * count)
+{
+	_avr_profile_fn_t * fn = calloc(symbolcount + 1, sizeof(*fn));
+	int n = 0;
+
+	fn[0].name = "(unknown)";
+	for (uint32_t si = 0; si < symbolcount; si++) {
+		uint32_t addr = symbol[si]->addr;
+		if (addr >= p->words * 2)
+			break;		// sorted, the rest is all RAM & co
+		if (n && fn[n].addr == addr) {
+			fn[n].name = symbol[si]->symbol;
+			continue;
+		}
+		if (addr || n)
+			n++;
+		fn[n].name = symbol[si]->symbol;
+		fn[n].addr = addr;
+	}
+	n++;
+	for (uint32_t w = 0, f = 0; w < p->words; w++) {
+		while (f + 1 < n && fn[f + 1].addr <= w * 2)
+			f++;
+		fn[f].cycles += p->hist[w];
+	}
+	*count = n;
+	return fn;
+}
+
+static int
+_avr_profile_cmp(
+		const void * a,
+		const void * b)
+{
+	const _avr_profile_fn_t * fa = a, * fb = b;
+	return fa->cycles < fb->cycles ? 1 : fa->cycles > fb->cycles ? -1 : 0;
+}
+
+void
+avr_profile_report(
+		avr_profile_t * p,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		int top,
+		FILE * out)
+{
+	int count;
+	_avr_profile_fn_t * fn = _avr_profile_fold(p, symbol, symbolcount, &count);
+	double total = p->total ? p->total : 1;
+
+	qsort(fn, count, sizeof(*fn), _avr_profile_cmp);
+	fprintf(out, "profile: %" PRIu64 " cycles, %" PRIu64 " sleeping (%.1f%%)\n",
+			p->total, p->sleep, p->sleep * 100.0 / total);
+	for (int i = 0; i < count && (!top || i < top) && fn[i].cycles; i++)
+		fprintf(out, "%12" PRIu64 " %5.1f%%  %04x %s\n",
+				fn[i].cycles, fn[i].cycles * 100.0 / total,
+				fn[i].addr, fn[i].name);
+	free(fn);
+}
+
+int
+avr_profile_write_callgrind(
+		avr_profile_t * p,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		const char * filename)
+{
+	FILE * out = fopen(filename, "w");
+	if (!out) {
+		perror(filename);
+		return -1;
+	}
+	int count;
+	_avr_profile_fn_t * fn = _avr_profile_fold(p, symbol, symbolcount, &count);
+
+	fprintf(out, "# callgrind format\nversion: 1\ncreator: simavr\n"
+			"positions: instr\nevents: Cycles\nsummary: %" PRIu64 "\n\n",
+			p->total);
+	if (p->sleep)
+		fprintf(out, "fn=(sleeping)\n0 %" PRIu64 "\n\n", p->sleep);
+	uint32_t w = 0;
+	for (int f = 0; f < count; f++) {
+		uint32_t end = f + 1 < count ? fn[f + 1].addr / 2 : p->words;
+		if (!fn[f].cycles) {
+			w = end;
+			continue;
+		}
+		fprintf(out, "fn=%s\n", fn[f].name);
+		for (; w < end; w++)
+			if (p->hist[w])
+				fprintf(out, "0x%x %" PRIu64 "\n", w * 2, p->hist[w]);
+		fprintf(out, "\n");
+	}
+	free(fn);
+	fclose(out);
+	return 0;
+}
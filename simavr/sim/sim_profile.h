@@ -0,0 +1,90 @@
+/*
+	sim_profile.h
+
+	Flash PC histogram profiler, with per function reports.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_PROFILE_H__
+#define __SIM_PROFILE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counts the cycles spent at each flash word.
+ *
+ * With a 'sample' period of zero, every instruction is accounted for
+ * exactly: a run callback is installed in front of the current one, and
+ * runs one instruction per call, which is accurate but slow.
+ * Otherwise a cycle timer fires every 'sample' cycles and charges them
+ * all to the current pc; that costs next to nothing, and still lets the
+ * fast engines run in bursts in between.
+ * Cycles spent with the core sleeping are counted on their own.
+ *
+ * The reports fold the words into functions, using a symbol table sorted
+ * by address, like the one elf_read_firmware() loads.
+ */
+typedef struct avr_profile_t {
+	struct avr_t *		avr;
+	avr_run_t			run;		// exact mode, the callback we're in front of
+	avr_cycle_count_t	sample;		// sampling period, or 0
+	uint32_t			words;
+	uint64_t *			hist;		// cycles per flash word
+	uint64_t			sleep;		// cycles spent sleeping
+	uint64_t			total;
+} avr_profile_t;
+
+// starts profiling, returns zero if all is well
+int
+avr_profile_init(
+		struct avr_t * avr,
+		avr_profile_t * p,
+		uint32_t sample );		// in cycles, 0 for exact counting
+// stops profiling, the counts are kept until avr_profile_free()
+void
+avr_profile_stop(
+		avr_profile_t * p );
+void
+avr_profile_free(
+		avr_profile_t * p );
+
+// prints the 'top' functions (all if zero) by cycles used
+void
+avr_profile_report(
+		avr_profile_t * p,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		int top,
+		FILE * out );
+// writes the counts in callgrind format, for kcachegrind & co
+int
+avr_profile_write_callgrind(
+		avr_profile_t * p,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		const char * filename );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PROFILE_H__ */
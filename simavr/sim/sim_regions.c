@@ -0,0 +1,165 @@
+/*
+	sim_regions.c
+
+	Cycle counts of the code regions the firmware marks with
+	SIMAVR_CMD_REGION_BEGIN/END, and its other timing commands.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_regions.h"
+
+avr_regions_t *
+avr_regions_get(
+		avr_t * avr,
+		int create)
+{
+	if (!avr->regions && create) {
+		avr->regions = calloc(1, sizeof(*avr->regions));
+		if (!avr->regions)
+			AVR_LOG(avr, LOG_ERROR, "REGIONS: out of memory\n");
+	}
+	return avr->regions;
+}
+
+void
+avr_regions_free(
+		avr_t * avr)
+{
+	free(avr->regions);
+	avr->regions = NULL;
+}
+
+int
+avr_regions_on_checkpoint(
+		avr_t * avr,
+		avr_checkpoint_hook_t hook,
+		void * param)
+{
+	avr_regions_t * r = avr_regions_get(avr, 1);
+	if (!r)
+		return -1;
+	r->checkpoint = hook;
+	r->checkpoint_param = param;
+	return 0;
+}
+
+void
+avr_region_begin(
+		avr_t * avr,
+		uint8_t id)
+{
+	avr_regions_t * r = avr_regions_get(avr, 1);
+	if (!r)
+		return;
+	avr_region_t * g = r->region + id;
+	if (!g->depth++)
+		g->start = avr->cycle;
+}
+
+void
+avr_region_end(
+		avr_t * avr,
+		uint8_t id,
+		avr_cycle_count_t when)
+{
+	avr_regions_t * r = avr_regions_get(avr, 1);
+	if (!r)
+		return;
+	avr_region_t * g = r->region + id;
+	if (!g->depth) {
+		AVR_LOG(avr, LOG_WARNING, "REGIONS: end of region %d at pc %04x, "
+				"that didn't begin\n", id, avr->pc);
+		return;
+	}
+	if (--g->depth)
+		return;
+	uint64_t c = when - g->start;
+	if (!g->count || c < g->min)
+		g->min = c;
+	if (c > g->max)
+		g->max = c;
+	g->total += c;
+	g->count++;
+}
+
+void
+avr_cycle_mark(
+		avr_t * avr,
+		uint8_t id)
+{
+	avr_regions_t * r = avr_regions_get(avr, 1);
+	if (!r)
+		return;
+	avr_cycle_mark_t * m = r->mark + id;
+	AVR_LOG(avr, LOG_TRACE, "REGIONS: mark %d at cycle %" PRI_avr_cycle_count
+			", %" PRI_avr_cycle_count " since the last one\n", id, avr->cycle,
+			m->count ? avr->cycle - m->last : 0);
+	if (!m->count)
+		m->first = avr->cycle;
+	m->last = avr->cycle;
+	m->count++;
+}
+
+void
+avr_checkpoint_request(
+		avr_t * avr)
+{
+	avr_regions_t * r = avr_regions_get(avr, 1);
+	if (!r)
+		return;
+	r->checkpoints++;
+	if (r->checkpoint)
+		r->checkpoint(avr, r->checkpoint_param);
+	else
+		AVR_LOG(avr, LOG_WARNING, "REGIONS: checkpoint requested at cycle %"
+				PRI_avr_cycle_count ", nothing saves it\n", avr->cycle);
+}
+
+void
+avr_regions_report(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_regions_t * r = avr->regions;
+	if (!r)
+		return;
+	for (int i = 0; i < 256; i++) {
+		avr_region_t * g = r->region + i;
+		if (!g->count && !g->depth)
+			continue;
+		fprintf(out, "region %3d: %" PRIu64 " times, %" PRIu64 " cycles, "
+				"min %" PRIu64 " mean %" PRIu64 " max %" PRIu64 "%s\n",
+				i, g->count, g->total, g->min,
+				g->count ? g->total / g->count : 0, g->max,
+				g->depth ? ", still open" : "");
+	}
+	for (int i = 0; i < 256; i++) {
+		avr_cycle_mark_t * m = r->mark + i;
+		if (!m->count)
+			continue;
+		fprintf(out, "mark   %3d: %" PRIu64 " times, first at cycle %"
+				PRI_avr_cycle_count ", last at %" PRI_avr_cycle_count
+				", mean interval %" PRIu64 "\n", i, m->count, m->first, m->last,
+				m->count > 1 ? (m->last - m->first) / (m->count - 1) : 0);
+	}
+	if (r->checkpoints)
+		fprintf(out, "checkpoints requested: %" PRIu64 "\n", r->checkpoints);
+}
@@ -0,0 +1,116 @@
+/*
+	sim_regions.h
+
+	Cycle counts of the code regions the firmware marks with
+	SIMAVR_CMD_REGION_BEGIN/END, and its other timing commands.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_REGIONS_H__
+#define __SIM_REGIONS_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The firmware sends these through its command register (see
+ * AVR_MCU_SIMAVR_COMMAND), each followed by a byte of id:
+ *	SIMAVR_CMD_REGION_BEGIN, SIMAVR_CMD_REGION_END: a region is timed
+ *		from the write of the id of its begin to the write of the code of
+ *		its end, which includes the couple of cycles of these writes.
+ *		A region can nest into itself, recursion only counts the outer one.
+ *	SIMAVR_CMD_CYCLE_MARK: notes the cycle it's at, and the time since the
+ *		previous mark of that id.
+ * and, without id:
+ *	SIMAVR_CMD_CHECKPOINT: calls the hook set with avr_regions_on_checkpoint();
+ *		it's called from the write, while the instruction runs, so it can
+ *		only take note of it for when the core stops.
+ * Nothing is allocated until the firmware sends one of them.
+ */
+typedef struct avr_region_t {
+	uint64_t			count;
+	uint64_t			total, min, max;	// cycles
+	avr_cycle_count_t	start;
+	uint32_t			depth;
+} avr_region_t;
+
+typedef struct avr_cycle_mark_t {
+	uint64_t			count;
+	avr_cycle_count_t	first, last;
+} avr_cycle_mark_t;
+
+typedef void (*avr_checkpoint_hook_t)(
+		struct avr_t * avr,
+		void * param);
+
+typedef struct avr_regions_t {
+	avr_region_t		region[256];
+	avr_cycle_mark_t	mark[256];
+	avr_checkpoint_hook_t checkpoint;
+	void *				checkpoint_param;
+	uint64_t			checkpoints;	// requested by the firmware
+	avr_cycle_count_t	end;		// cycle of the last REGION_END code
+} avr_regions_t;
+
+// returns the regions of 'avr', allocating them if 'create'
+avr_regions_t *
+avr_regions_get(
+		struct avr_t * avr,
+		int create );
+void
+avr_regions_free(
+		struct avr_t * avr );
+// sets what SIMAVR_CMD_CHECKPOINT does, returns 0, or -1
+int
+avr_regions_on_checkpoint(
+		struct avr_t * avr,
+		avr_checkpoint_hook_t hook,
+		void * param );
+// prints the regions and marks that were seen
+void
+avr_regions_report(
+		struct avr_t * avr,
+		FILE * out );
+
+// the command handlers
+void
+avr_region_begin(
+		struct avr_t * avr,
+		uint8_t id );
+// 'when' is the cycle the end began at, before its id was sent
+void
+avr_region_end(
+		struct avr_t * avr,
+		uint8_t id,
+		avr_cycle_count_t when );
+void
+avr_cycle_mark(
+		struct avr_t * avr,
+		uint8_t id );
+void
+avr_checkpoint_request(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_REGIONS_H__ */
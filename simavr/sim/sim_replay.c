@@ -0,0 +1,388 @@
+/*
+	sim_replay.c
+
+	Records the values raised on input irqs, and raises them again later.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_replay.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+#include "avr_spi.h"
+#include "avr_twi.h"
+#include "avr_adc.h"
+#include "avr_acomp.h"
+#include "avr_timer.h"
+
+static const char replay_magic[8] = "simavrR1";
+
+// channel 'index', allocated if it's not there yet
+static avr_replay_channel_t *
+_avr_replay_channel(
+		avr_replay_t * r,
+		uint32_t index)
+{
+	if (index >= r->alloc) {
+		uint32_t alloc = r->alloc ? r->alloc : 16;
+		while (alloc <= index)
+			alloc *= 2;
+		avr_replay_channel_t ** c = realloc(r->channel, alloc * sizeof(*c));
+		if (!c)
+			return NULL;
+		memset(c + r->alloc, 0, (alloc - r->alloc) * sizeof(*c));
+		r->channel = c;
+		r->alloc = alloc;
+	}
+	if (!r->channel[index]) {
+		r->channel[index] = calloc(1, sizeof(avr_replay_channel_t));
+		if (!r->channel[index])
+			return NULL;
+		r->channel[index]->r = r;
+		r->channel[index]->index = index;
+	}
+	if (index >= r->count)
+		r->count = index + 1;
+	return r->channel[index];
+}
+
+static void
+_avr_replay_put(
+		avr_replay_t * r,
+		uint64_t v)
+{
+	while (v >= 0x80) {
+		putc((v & 0x7f) | 0x80, r->file);
+		v >>= 7;
+	}
+	putc(v, r->file);
+}
+
+static void
+_avr_replay_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_replay_channel_t * c = param;
+	avr_replay_t * r = c->r;
+
+	if (!r->file || (c->port && c->port->driving))
+		return;
+	avr_cycle_count_t cycle = r->avr->cycle;
+	if (!c->named) {
+		size_t len = strlen(irq->name);
+		_avr_replay_put(r, cycle - r->cycle);
+		_avr_replay_put(r, 0);
+		_avr_replay_put(r, c->index);
+		_avr_replay_put(r, len);
+		fwrite(irq->name, 1, len, r->file);
+		r->cycle = cycle;
+		c->named = 1;
+	}
+	_avr_replay_put(r, cycle - r->cycle);
+	_avr_replay_put(r, 1 + ((c->index << 1) |
+			!!(irq->flags & IRQ_FLAG_FLOATING)));
+	_avr_replay_put(r, value);
+	r->cycle = cycle;
+	r->values++;
+}
+
+int
+avr_replay_record(
+		avr_replay_t * r,
+		avr_t * avr,
+		const char * filename)
+{
+	memset(r, 0, sizeof(*r));
+	r->avr = avr;
+	r->cycle = avr->cycle;
+	r->file = fopen(filename, "wb");
+	if (!r->file) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: %s: can't create %s\n", __func__, filename);
+		return -1;
+	}
+	fwrite(replay_magic, 1, sizeof(replay_magic), r->file);
+	// so the cycles of the values are the same as the instance's
+	_avr_replay_put(r, r->cycle);
+	return 0;
+}
+
+static int
+_avr_replay_add(
+		avr_replay_t * r,
+		avr_irq_t * irq,
+		avr_ioport_t * port)
+{
+	if (!r->file || !irq)
+		return -1;
+	if (!irq->name) {
+		AVR_LOG(r->avr, LOG_ERROR, "REPLAY: %s: irq %d has no name\n",
+				__func__, irq->irq);
+		return -1;
+	}
+	for (uint32_t i = 0; i < r->count; i++)
+		if (r->channel[i]->irq == irq)
+			return 0;
+	avr_replay_channel_t * c = _avr_replay_channel(r, r->count);
+	if (!c)
+		return -1;
+	c->irq = irq;
+	c->port = port;
+	avr_irq_register_notify(irq, _avr_replay_notify, c);
+	return 0;
+}
+
+int
+avr_replay_record_irq(
+		avr_replay_t * r,
+		avr_irq_t * irq)
+{
+	return _avr_replay_add(r, irq, NULL);
+}
+
+static int
+_avr_replay_add_input(
+		avr_irq_t * irq,
+		avr_ioport_t * port,
+		void * param)
+{
+	return _avr_replay_add(param, irq, port);
+}
+
+int
+avr_replay_record_inputs(
+		avr_replay_t * r)
+{
+	return avr_replay_inputs(r->avr, _avr_replay_add_input, r);
+}
+
+int
+avr_replay_inputs(
+		avr_t * avr,
+		avr_replay_input_p cb,
+		void * param)
+{
+	int count = 0;
+
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		int first = 0, last = -1;
+		avr_ioport_t * port = NULL;
+
+		// the inputs are all recorded, even if the firmware didn't get to them
+		if (!avr_io_irqs(io))
+			continue;
+		if (!strcmp(io->kind, "uart"))
+			first = last = UART_IRQ_INPUT;
+		else if (!strcmp(io->kind, "spi"))
+			first = last = SPI_IRQ_INPUT;
+		else if (!strcmp(io->kind, "twi"))
+			first = last = TWI_IRQ_INPUT;
+		else if (!strcmp(io->kind, "adc")) {
+			first = ADC_IRQ_ADC0;
+			last = ADC_IRQ_TEMP;
+		} else if (!strcmp(io->kind, "ac")) {
+			first = ACOMP_IRQ_AIN0;
+			last = ACOMP_IRQ_ADC15;
+		} else if (!strcmp(io->kind, "timer"))
+			first = last = TIMER_IRQ_IN_ICP;
+		else if (!strcmp(io->kind, "port")) {
+			port = (avr_ioport_t *)io;
+			first = IOPORT_IRQ_PIN0;
+			last = IOPORT_IRQ_PIN7;
+		}
+		for (int i = first; i <= last && i < io->irq_count; i++)
+			if (cb(io->irq + i, port, param) == 0)
+				count++;
+	}
+	return count;
+}
+
+static int
+_avr_replay_get(
+		avr_replay_t * r,
+		uint64_t * v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (r->pos >= r->size)
+			return -1;
+		uint8_t b = r->buf[r->pos++];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+// reads up to the next value, looking up the irqs named on the way
+static void
+_avr_replay_next(
+		avr_replay_t * r)
+{
+	uint64_t delta, code, index, len, value;
+
+	r->pending = 0;
+	while (r->pos < r->size) {
+		if (_avr_replay_get(r, &delta) || _avr_replay_get(r, &code))
+			goto corrupt;
+		r->cycle += delta;
+		if (code) {
+			code--;
+			if (_avr_replay_get(r, &value) || (code >> 1) >= r->count ||
+					!r->channel[code >> 1])
+				goto corrupt;
+			r->next.channel = code >> 1;
+			r->next.floating = code & 1;
+			r->next.value = value;
+			r->pending = 1;
+			return;
+		}
+		if (_avr_replay_get(r, &index) || _avr_replay_get(r, &len) ||
+				index > 0xffff || len > r->size - r->pos)
+			goto corrupt;
+		char * name = malloc(len + 1);
+		avr_replay_channel_t * c = _avr_replay_channel(r, index);
+		if (!name || !c) {
+			free(name);
+			AVR_LOG(r->avr, LOG_ERROR, "REPLAY: %s: out of memory\n", __func__);
+			r->error = 1;
+			return;
+		}
+		memcpy(name, r->buf + r->pos, len);
+		name[len] = 0;
+		r->pos += len;
+		c->irq = avr_irq_pool_find(&r->avr->irq_pool, name);
+		if (!c->irq) {
+			AVR_LOG(r->avr, LOG_WARNING, "REPLAY: %s: no irq named %s\n",
+					__func__, name);
+			r->error = 1;
+		}
+		free(name);
+	}
+	return;
+corrupt:
+	AVR_LOG(r->avr, LOG_ERROR, "REPLAY: %s: corrupt file at offset %u\n",
+			__func__, r->pos);
+	r->error = 1;
+}
+
+static avr_cycle_count_t
+_avr_replay_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_replay_t * r = param;
+
+	while (r->pending && r->cycle <= avr->cycle) {
+		avr_irq_t * irq = r->channel[r->next.channel]->irq;
+		if (irq) {
+			// the hook saw the value after IRQ_FLAG_NOT was applied
+			uint32_t v = r->next.value;
+			if (irq->flags & IRQ_FLAG_NOT)
+				v = !v;
+			avr_raise_irq_float(irq, v, r->next.floating);
+			r->values++;
+		}
+		_avr_replay_next(r);
+	}
+	return r->pending ? r->cycle : 0;
+}
+
+int
+avr_replay_play(
+		avr_replay_t * r,
+		avr_t * avr,
+		const char * filename)
+{
+	memset(r, 0, sizeof(*r));
+	r->avr = avr;
+
+	FILE * f = fopen(filename, "rb");
+	if (!f) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: %s: can't open %s\n", __func__, filename);
+		return -1;
+	}
+	long size = -1;
+	if (fseek(f, 0, SEEK_END) == 0)
+		size = ftell(f);
+	if (size >= (long)sizeof(replay_magic)) {
+		r->buf = malloc(size);
+		if (r->buf && (fseek(f, 0, SEEK_SET) ||
+				fread(r->buf, 1, size, f) != (size_t)size)) {
+			free(r->buf);
+			r->buf = NULL;
+		}
+	}
+	fclose(f);
+	if (!r->buf || memcmp(r->buf, replay_magic, sizeof(replay_magic))) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: %s: %s is not a recording\n",
+				__func__, filename);
+		free(r->buf);
+		r->buf = NULL;
+		return -1;
+	}
+	r->size = size;
+	r->pos = sizeof(replay_magic);
+	uint64_t start;
+	if (_avr_replay_get(r, &start)) {
+		avr_replay_stop(r);
+		return -1;
+	}
+	r->cycle = start;
+	_avr_replay_next(r);
+	if (r->pending)
+		avr_cycle_timer_register(avr,
+				r->cycle > avr->cycle ? r->cycle - avr->cycle : 0,
+				_avr_replay_timer, r);
+	return 0;
+}
+
+int
+avr_replay_stop(
+		avr_replay_t * r)
+{
+	if (!r->avr)
+		return -1;
+	if (r->file) {
+		for (uint32_t i = 0; i < r->count; i++)
+			avr_irq_unregister_notify(r->channel[i]->irq,
+					_avr_replay_notify, r->channel[i]);
+		if (ferror(r->file))
+			r->error = 1;
+		if (fclose(r->file))
+			r->error = 1;
+		r->file = NULL;
+	}
+	if (r->buf) {
+		avr_cycle_timer_cancel(r->avr, _avr_replay_timer, r);
+		free(r->buf);
+		r->buf = NULL;
+		r->pending = 0;
+	}
+	for (uint32_t i = 0; i < r->count; i++)
+		free(r->channel[i]);
+	free(r->channel);
+	r->channel = NULL;
+	r->count = r->alloc = 0;
+	int res = r->error ? -1 : 0;
+	r->avr = NULL;
+	return res;
+}
@@ -0,0 +1,122 @@
+/*
+	sim_replay.h
+
+	Records the values raised on input irqs, and raises them again later.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_REPLAY_H__
+#define __SIM_REPLAY_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A recording is the list of the values raised on some irqs of the core,
+ * with the cycle they were raised at. Playing it back into an instance
+ * running the same firmware raises them again at the same cycles, so a
+ * run that was driven by a pty, a part running in a thread etc can be
+ * reproduced exactly, without them.
+ *
+ * Values are raised back at the first instruction boundary at or after
+ * their cycle: one that was raised from inside an instruction, by an io
+ * callback, is replayed at the boundary before it. The irqs raised
+ * by the core itself are not recorded; a port's own pin changes, for
+ * example, are left out.
+ *
+ * The file is made of varints: for each value, the cycles since the
+ * previous one, a channel, and the value. The name of the irq of a
+ * channel comes before its first value, so the irqs are looked up by
+ * name, with avr_irq_pool_find(), when playing.
+ */
+typedef struct avr_replay_channel_t {
+	struct avr_replay_t * r;
+	uint32_t		index;
+	avr_irq_t *		irq;		// NULL if it wasn't found when playing
+	struct avr_ioport_t * port;	// pin irqs, to ignore the port's own changes
+	uint8_t			named;		// its name was written already
+} avr_replay_channel_t;
+
+typedef struct avr_replay_t {
+	avr_t *			avr;
+	FILE *			file;		// when recording
+	uint8_t *		buf;		// when playing, the whole file
+	uint32_t		size, pos;
+	avr_cycle_count_t cycle;	// of the last value read or written
+	avr_replay_channel_t ** channel;
+	uint32_t		count, alloc;
+	struct {					// the next value to play, if 'pending'
+		uint32_t	channel, value;
+		uint8_t		floating;
+	} next;
+	uint8_t			pending;
+	uint64_t		values;		// recorded, or played
+	int				error;
+} avr_replay_t;
+
+// starts recording into 'filename', with no irqs yet. Returns 0, or -1
+int
+avr_replay_record(
+		avr_replay_t * r,
+		avr_t * avr,
+		const char * filename );
+// adds 'irq' to the recording
+int
+avr_replay_record_irq(
+		avr_replay_t * r,
+		avr_irq_t * irq );
+/*
+ * Adds the inputs of the io modules of the core: the uarts, spi and twi
+ * inputs, the adc and analog comparator inputs, the timers input capture,
+ * and the pins of the ports. Returns how many irqs were added.
+ */
+int
+avr_replay_record_inputs(
+		avr_replay_t * r );
+/*
+ * Calls 'cb' for each of these inputs, with the port of the pin irqs.
+ * Returns how many calls returned zero.
+ */
+typedef int (*avr_replay_input_p)(
+		avr_irq_t * irq,
+		struct avr_ioport_t * port,
+		void * param);
+int
+avr_replay_inputs(
+		avr_t * avr,
+		avr_replay_input_p cb,
+		void * param );
+// loads 'filename' and starts raising its values into 'avr'. Returns 0, or -1
+int
+avr_replay_play(
+		avr_replay_t * r,
+		avr_t * avr,
+		const char * filename );
+// stops recording or playing; returns -1 if anything went wrong
+int
+avr_replay_stop(
+		avr_replay_t * r );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_REPLAY_H__ */
@@ -0,0 +1,225 @@
+/*
+	sim_sampling.c
+
+	Sampled simulation: a fast engine for most of the run, with periodic
+	detailed windows the figures are extrapolated from.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "sim_sampling.h"
+#include "sim_core.h"
+#include "sim_cycle_timers.h"
+#include "sim_stats.h"
+
+// when something else is in front of the run callback, like a watchdog
+// reset, the switch waits that many cycles and tries again
+#define AVR_SAMPLING_RETRY	64
+
+static void
+_avr_sampling_attach(
+		avr_sampling_t * s)
+{
+	avr_t * avr = s->avr;
+
+	avr->run = s->detail;
+	avr->stats = s->stats;
+	avr->irq_pool.stats = s->irq_stats;
+	avr->heatmap = s->heatmap;
+	s->detailed = 1;
+	s->window_start = avr->cycle;
+	s->window_insn = s->stats ? s->stats->instructions : 0;
+}
+
+static void
+_avr_sampling_detach(
+		avr_sampling_t * s)
+{
+	avr_t * avr = s->avr;
+	avr_cycle_count_t c = avr->cycle - s->window_start;
+
+	s->detailed_cycles += c;
+	s->windows++;
+	if (s->stats && c) {
+		double ipc = (double)(s->stats->instructions - s->window_insn) / c;
+		double d = ipc - s->ipc_mean;
+		s->ipc_mean += d / s->windows;
+		s->ipc_m2 += d * (ipc - s->ipc_mean);
+	}
+	avr->run = s->fast;
+	avr->stats = NULL;
+	avr->irq_pool.stats = NULL;
+	avr->heatmap = NULL;
+	s->detailed = 0;
+}
+
+static avr_cycle_count_t
+_avr_sampling_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_sampling_t * s = param;
+
+	if (avr->run != (s->detailed ? s->detail : s->fast))
+		return when + AVR_SAMPLING_RETRY;
+	if (s->detailed) {
+		_avr_sampling_detach(s);
+		while (s->next <= when)
+			s->next += s->period;
+		return s->next;
+	}
+	_avr_sampling_attach(s);
+	s->end = when + s->window;
+	s->next += s->period;
+	return s->end;
+}
+
+int
+avr_sampling_init(
+		avr_t * avr,
+		avr_sampling_t * s,
+		avr_cycle_count_t period,
+		avr_cycle_count_t window)
+{
+	if (avr->sampling) {
+		AVR_LOG(avr, LOG_ERROR, "SAMPLING: already sampling\n");
+		return -1;
+	}
+	if (avr->gdb) {
+		AVR_LOG(avr, LOG_ERROR, "SAMPLING: can't sample under gdb\n");
+		return -1;
+	}
+	if (!window || window >= period) {
+		AVR_LOG(avr, LOG_ERROR, "SAMPLING: the window must be shorter "
+				"than the period\n");
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	s->avr = avr;
+	s->period = period;
+	s->window = window;
+	s->start = avr->cycle;
+	s->next = avr->cycle + period;
+	s->detail = avr->run;
+	s->fast = avr->decoded || avr_predecode_init(avr) == 0 ?
+			avr_callback_run_threaded : avr_callback_run_raw;
+	s->stats = avr->stats;
+	s->irq_stats = avr->irq_pool.stats;
+	s->heatmap = avr->heatmap;
+	s->detailed = 1;
+	_avr_sampling_detach(s);
+	// that wasn't a window
+	s->windows = 0;
+	s->detailed_cycles = 0;
+	avr->sampling = s;
+	avr_cycle_timer_register(avr, period, _avr_sampling_timer, s);
+	return 0;
+}
+
+void
+avr_sampling_stop(
+		avr_sampling_t * s)
+{
+	avr_t * avr = s->avr;
+
+	if (!avr)
+		return;
+	avr_cycle_timer_cancel(avr, _avr_sampling_timer, s);
+	if (s->detailed)
+		_avr_sampling_detach(s);
+	_avr_sampling_attach(s);
+	s->detailed = 0;
+	avr->sampling = NULL;
+	s->avr = NULL;
+	s->end = avr->cycle;
+}
+
+void
+avr_sampling_window(
+		avr_sampling_t * s,
+		avr_cycle_count_t cycles)
+{
+	avr_t * avr = s->avr;
+
+	if (!avr)
+		return;
+	if (s->detailed) {
+		if (avr->cycle + cycles <= s->end)
+			return;
+	} else if (avr->run != s->fast)
+		return;
+	else
+		_avr_sampling_attach(s);
+	s->end = avr->cycle + cycles;
+	avr_cycle_timer_cancel(avr, _avr_sampling_timer, s);
+	avr_cycle_timer_register(avr, cycles, _avr_sampling_timer, s);
+}
+
+double
+avr_sampling_scale(
+		avr_sampling_t * s)
+{
+	avr_cycle_count_t c = s->detailed_cycles;
+
+	if (s->detailed && s->avr)
+		c += s->avr->cycle - s->window_start;
+	if (!c)
+		return 0;
+	return (double)((s->avr ? s->avr->cycle : s->end) - s->start) / c;
+}
+
+void
+avr_sampling_report(
+		avr_sampling_t * s,
+		FILE * out)
+{
+	avr_cycle_count_t total = (s->avr ? s->avr->cycle : s->end) - s->start;
+	double scale = avr_sampling_scale(s);
+
+	fprintf(out, "Sampling: %" PRIu64 " windows of %" PRI_avr_cycle_count
+			" cycles every %" PRI_avr_cycle_count ", %.2f%% of %"
+			PRI_avr_cycle_count " cycles in detail, scale %.1f\n",
+			s->windows, s->window, s->period,
+			scale ? 100.0 / scale : 0.0, total, scale);
+	if (!s->stats || s->windows < 2)
+		return;
+	double sd = sqrt(s->ipc_m2 / (s->windows - 1));
+	double half = 1.96 * sd / sqrt(s->windows);
+	fprintf(out, "  instructions per cycle %.4f +/- %.4f (95%%), "
+			"estimated instructions %.0f +/- %.0f\n",
+			s->ipc_mean, half, s->ipc_mean * total, half * total);
+	fprintf(out, "  estimated interrupts %.0f, timers fired %.0f\n",
+			s->stats->interrupts * scale, s->stats->timer_fired * scale);
+}
+
+void
+avr_sampling_reset(
+		avr_t * avr)
+{
+	avr_sampling_t * s = avr->sampling;
+
+	if (!s)
+		return;
+	// the timers are gone, a window in progress ends here
+	if (s->detailed && avr->run == s->detail)
+		_avr_sampling_detach(s);
+	s->next = avr->cycle + s->period;
+	avr_cycle_timer_register(avr, s->period, _avr_sampling_timer, s);
+}
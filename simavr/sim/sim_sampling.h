@@ -0,0 +1,123 @@
+/*
+	sim_sampling.h
+
+	Sampled simulation: a fast engine for most of the run, with periodic
+	detailed windows the figures are extrapolated from.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SIM_SAMPLING_H__
+#define __SIM_SAMPLING_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Whatever is attached when sampling starts is the detailed mode: the run
+ * callback, with the exact profiler, the stats counters or the trace ring
+ * in front of it, and the stats and heatmap the core tests for. Between
+ * windows, these are detached, and the core runs on the threaded engine,
+ * or the plain one if the predecoded cache can't be had. Every 'period'
+ * cycles, the detailed mode is put back for 'window' cycles; the firmware,
+ * or the host, can also ask for a window around something it's interested
+ * in, with avr_sampling_window().
+ *
+ * The callgraph, the coverage maps and the trace files stay attached, they
+ * need every call, edge or instruction to make sense; so does a sampled
+ * profile (see avr_profile_init()), it's a cycle timer, as cheap as it gets.
+ *
+ * With stats, each window gives an instruction per cycle figure; their mean
+ * and spread give the estimate of the instructions of the whole run, with
+ * a 95% confidence interval, as SMARTS does. The profile, the heatmap and
+ * the other counters only cover the windows: their shares are what they'd
+ * be over the whole run, their counts are to be multiplied by 'scale'.
+ */
+typedef struct avr_sampling_t {
+	struct avr_t *		avr;
+	avr_cycle_count_t	period, window;
+	avr_cycle_count_t	start;		// avr->cycle when sampling started
+	avr_cycle_count_t	next;		// start of the next periodic window
+	avr_cycle_count_t	end;		// of the current window
+	int					detailed;	// in a window
+	avr_run_t			fast, detail;	// the run callbacks of both modes
+	// detached between windows
+	struct avr_stats_t *	stats;
+	struct avr_irq_stats_t *	irq_stats;
+	struct avr_heatmap_t *	heatmap;
+	// current window
+	avr_cycle_count_t	window_start;
+	uint64_t			window_insn;
+	// totals
+	uint64_t			windows;
+	avr_cycle_count_t	detailed_cycles;
+	double				ipc_mean, ipc_m2;	// Welford's running variance
+} avr_sampling_t;
+
+/*
+ * Starts sampling, in fast mode, with a window of 'window' cycles every
+ * 'period' cycles. Attach the instrumentation to sample before this.
+ * Returns zero if all is well
+ */
+int
+avr_sampling_init(
+		struct avr_t * avr,
+		avr_sampling_t * s,
+		avr_cycle_count_t period,
+		avr_cycle_count_t window );
+/*
+ * Back to the detailed mode for good, so the instrumentation can be
+ * stopped and reported as usual; a window in progress is counted
+ */
+void
+avr_sampling_stop(
+		avr_sampling_t * s );
+/*
+ * Starts a detailed window of 'cycles' now, or makes the current one last
+ * that long at least. Can be called from an IO or IRQ callback, the core
+ * switches at the end of the current instruction
+ */
+void
+avr_sampling_window(
+		avr_sampling_t * s,
+		avr_cycle_count_t cycles );
+/*
+ * The cycles so far over those in windows, what the counts of the
+ * instrumentation are to be multiplied by; 0 before the first window
+ */
+double
+avr_sampling_scale(
+		avr_sampling_t * s );
+void
+avr_sampling_report(
+		avr_sampling_t * s,
+		FILE * out );
+
+// called by avr_reset(), to schedule the windows again
+void
+avr_sampling_reset(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SAMPLING_H__ */
@@ -0,0 +1,182 @@
+/*
+	sim_shm.c
+
+	The data space, and the EEPROM, in a named shared memory segment, for
+	other processes to watch without slowing the core down.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "sim_shm.h"
+#include "sim_arena.h"
+#include "sim_time.h"
+#include "sim_guard.h"
+#include "avr_eeprom.h"
+
+#define SHM_ALIGN(_v)	(((_v) + 63) & ~63)
+
+static avr_cycle_count_t
+_avr_shm_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_shm_t * shm = param;
+	avr_shm_stamp(shm);
+	return when + shm->period;
+}
+
+void
+avr_shm_stamp(
+		avr_shm_t * shm)
+{
+	avr_shm_header_t * h = shm->header;
+	if (!h)
+		return;
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	h->cycle = shm->avr->cycle;
+	h->state = shm->avr->state;
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+avr_shm_init(
+		struct avr_t * avr,
+		avr_shm_t * shm,
+		const char * name,
+		int eeprom,
+		uint32_t period_usec)
+{
+#ifdef __MINGW32__
+	AVR_LOG(avr, LOG_ERROR, "SHM: %s: no shared memory on this host\n", __func__);
+	return -1;
+#else
+	if (avr->shm) {
+		AVR_LOG(avr, LOG_ERROR, "SHM: %s: already shared\n", __func__);
+		return -1;
+	}
+	if (CONFIG_SIMAVR_GUARD_PAGES) {
+		AVR_LOG(avr, LOG_ERROR, "SHM: %s: the data space has guard pages\n",
+				__func__);
+		return -1;
+	}
+	memset(shm, 0, sizeof(*shm));
+	uint32_t ee_size = eeprom && avr->e2end ? avr->e2end + 1 : 0;
+	uint32_t data_offset = SHM_ALIGN(sizeof(avr_shm_header_t));
+	uint32_t ee_offset = SHM_ALIGN(data_offset + avr->ramend + 1);
+	shm->size = ee_offset + ee_size;
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, shm->size)) {
+		AVR_LOG(avr, LOG_ERROR, "SHM: %s: %s: %s\n", __func__, name,
+				strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			shm_unlink(name);
+		}
+		return -1;
+	}
+	void * base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "SHM: %s: can't map %s\n", __func__, name);
+		shm_unlink(name);
+		return -1;
+	}
+	avr_shm_header_t * h = base;
+	uint8_t * data = (uint8_t *)base + data_offset;
+	memcpy(data, avr->data, avr->ramend + 1);
+	if (ee_size) {
+		avr_eeprom_desc_t d = { .ee = (uint8_t *)base + ee_offset, .size = ee_size };
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d) ||
+				avr_ioctl(avr, AVR_IOCTL_EEPROM_BIND, &d)) {
+			AVR_LOG(avr, LOG_WARNING, "SHM: %s: the EEPROM stays private\n",
+					__func__);
+			ee_size = 0;
+		}
+	}
+	h->version = AVR_SHM_VERSION;
+	h->header_size = sizeof(*h);
+	snprintf(h->mmcu, sizeof(h->mmcu), "%s", avr->mmcu);
+	h->frequency = avr->frequency;
+	h->data_offset = data_offset;
+	h->data_size = avr->ramend + 1;
+	h->eeprom_offset = ee_size ? ee_offset : 0;
+	h->eeprom_size = ee_size;
+
+	avr_arena_free(avr->arena, avr->data);
+	avr->data = data;
+	shm->avr = avr;
+	shm->header = h;
+	snprintf(shm->name, sizeof(shm->name), "%s", name);
+	shm->period = avr_usec_to_cycles(avr, period_usec);
+	if (!shm->period)
+		shm->period = 1;
+	avr->shm = shm;
+	avr_shm_stamp(shm);
+	// last, so a reader that checks the magic finds the rest filled in
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(h->magic, AVR_SHM_MAGIC, sizeof(h->magic));
+	avr_cycle_timer_register(avr, shm->period, _avr_shm_timer, shm);
+	return 0;
+#endif
+}
+
+void
+avr_shm_reset(
+		struct avr_t * avr)
+{
+	avr_shm_t * shm = avr->shm;
+	if (!shm)
+		return;
+	avr_shm_stamp(shm);
+	avr_cycle_timer_register(avr, shm->period, _avr_shm_timer, shm);
+}
+
+void
+avr_shm_stop(
+		avr_shm_t * shm)
+{
+#ifndef __MINGW32__
+	avr_t * avr = shm->avr;
+	if (!avr)
+		return;
+	avr_cycle_timer_cancel(avr, _avr_shm_timer, shm);
+	avr_shm_stamp(shm);
+	uint8_t * data = malloc(avr->ramend + 1);
+	memcpy(data, avr->data, avr->ramend + 1);
+	avr->data = data;
+	if (shm->header->eeprom_size) {
+		avr_eeprom_desc_t d = { .ee = NULL };
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_BIND, &d);
+	}
+	munmap(shm->header, shm->size);
+	shm_unlink(shm->name);
+	shm->header = NULL;
+	shm->avr = NULL;
+	avr->shm = NULL;
+#endif
+}
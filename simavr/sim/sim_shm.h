@@ -0,0 +1,101 @@
+/*
+	sim_shm.h
+
+	The data space, and the EEPROM, in a named shared memory segment, for
+	other processes to watch without slowing the core down.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_SHM_H__
+#define __SIM_SHM_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * avr->data itself is moved in the segment, so the core reads and writes
+ * it as it always did, and a process that maps the segment sees it live.
+ * The EEPROM can be bound there too (AVR_IOCTL_EEPROM_BIND).
+ *
+ * Every 'period' cycles, a cycle timer stamps the header: 'seq' goes odd,
+ * 'cycle' and 'state' are updated, 'seq' goes even again. A reader that
+ * sees the same even 'seq' before and after its copy knows the copy was
+ * taken after 'cycle', and before the next stamp. Nothing stops the core
+ * from writing a value while it's copied; a multi byte variable can be
+ * torn, as it can be for an ISR on the real part.
+ *
+ * The header is at the start of the segment, the offsets are from there.
+ */
+#define AVR_SHM_MAGIC		"simavrSH"
+#define AVR_SHM_VERSION		1
+
+typedef struct avr_shm_header_t {
+	char				magic[8];
+	uint32_t			version;
+	uint32_t			header_size;
+	char				mmcu[32];
+	uint32_t			frequency;
+	uint32_t			data_offset, data_size;		// avr->data, ramend + 1
+	uint32_t			eeprom_offset, eeprom_size;	// zero if not shared
+	uint32_t			state;						// avr->state, as of 'cycle'
+	volatile uint64_t	seq;
+	volatile uint64_t	cycle;
+} avr_shm_header_t;
+
+typedef struct avr_shm_t {
+	struct avr_t *		avr;
+	char				name[64];
+	avr_shm_header_t *	header;
+	size_t				size;
+	avr_cycle_count_t	period;
+} avr_shm_t;
+
+/*
+ * Makes the segment 'name', as for shm_open(), like "/simavr.<pid>", and
+ * moves the data space, and the EEPROM if 'eeprom' is set, into it. The
+ * header is stamped every 'period_usec' of simulated time. Goes after the
+ * firmware is loaded. Returns 0, or -1.
+ */
+int
+avr_shm_init(
+		struct avr_t * avr,
+		avr_shm_t * shm,
+		const char * name,
+		int eeprom,
+		uint32_t period_usec );
+// stamps the header now, as the cycle timer does
+void
+avr_shm_stamp(
+		avr_shm_t * shm );
+// moves the data space, and the EEPROM, back to the heap, and removes the segment
+void
+avr_shm_stop(
+		avr_shm_t * shm );
+
+// called by avr_reset(), to schedule the stamps again
+void
+avr_shm_reset(
+		struct avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SHM_H__ */
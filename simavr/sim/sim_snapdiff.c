@@ -0,0 +1,464 @@
+/*
+	sim_snapdiff.c
+
+	Compares two snapshots of an instance, field by field, and tells
+	where they differ.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_snapdiff.h"
+#include "sim_core.h"
+#include "sim_io.h"
+#include "avr_eeprom.h"
+
+#define AVR_SNAPDIFF_BYTES	8	// shown of a run, at most
+
+// what a snapshot holds, read back from the instance
+typedef struct _avr_snapdiff_state_t {
+	avr_cycle_count_t	cycle;
+	int					state;
+	avr_flashaddr_t		pc;
+	uint8_t				sreg;
+	uint16_t			sp;
+	uint8_t *			data;
+	uint8_t *			flash;
+	uint8_t *			ee;
+	avr_cycle_timer_slot_t * timer;
+	uint32_t			timers;
+	avr_snapshot_t *	module;		// one per io module, as it saves itself
+	uint32_t			modules;
+} _avr_snapdiff_state_t;
+
+typedef struct _avr_snapdiff_ctx_t {
+	avr_t *				avr;
+	avr_symbol_t **		symbol;
+	uint32_t			symbolcount;
+	FILE *				out;
+	avr_snapdiff_t *	d;
+} _avr_snapdiff_ctx_t;
+
+static void
+_avr_snapdiff_state_free(
+		_avr_snapdiff_state_t * st)
+{
+	free(st->data);
+	free(st->flash);
+	free(st->ee);
+	free(st->timer);
+	for (uint32_t i = 0; i < st->modules; i++)
+		free(st->module[i].buf);
+	free(st->module);
+	memset(st, 0, sizeof(*st));
+}
+
+static int
+_avr_snapdiff_state(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		_avr_snapdiff_state_t * st)
+{
+	memset(st, 0, sizeof(*st));
+	if (avr_snapshot_restore(avr, s))
+		return -1;
+	st->cycle = avr->cycle;
+	st->state = avr->state;
+	st->pc = avr->pc;
+	READ_SREG_INTO(avr, st->sreg);
+	st->sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+	st->data = malloc(avr->ramend + 1);
+	st->flash = malloc(avr->flashend + 1);
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		st->modules++;
+	st->module = calloc(st->modules ? st->modules : 1, sizeof(*st->module));
+	st->timers = avr->cycle_timers.count;
+	st->timer = malloc((st->timers ? st->timers : 1) * sizeof(*st->timer));
+	if (!st->data || !st->flash || !st->module || !st->timer)
+		goto nomem;
+	memcpy(st->data, avr->data, avr->ramend + 1);
+	memcpy(st->flash, avr->flash, avr->flashend + 1);
+	memcpy(st->timer, avr->cycle_timers.timer, st->timers * sizeof(*st->timer));
+	if (avr->e2end) {
+		avr_eeprom_desc_t ee = { .size = avr->e2end + 1 };
+		if (!(ee.ee = st->ee = malloc(ee.size)))
+			goto nomem;
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee)) {
+			free(st->ee);
+			st->ee = NULL;
+		}
+	}
+	uint32_t i = 0;
+	for (avr_io_t * io = avr->io_port; io; io = io->next, i++) {
+		avr_io_gate_snapshot(io, st->module + i);
+		if (io->snapshot)
+			io->snapshot(io, st->module + i);
+		if (st->module[i].error)
+			goto nomem;
+	}
+	return 0;
+nomem:
+	AVR_LOG(avr, LOG_ERROR, "SNAPDIFF: %s: out of memory\n", __func__);
+	_avr_snapdiff_state_free(st);
+	return -1;
+}
+
+static void
+_avr_snapdiff_count(
+		_avr_snapdiff_ctx_t * c,
+		int kind)
+{
+	c->d->count[kind]++;
+	c->d->total++;
+}
+
+// "name+off" of what 'addr' is in, in the segment at 'segment'
+static void
+_avr_snapdiff_where(
+		_avr_snapdiff_ctx_t * c,
+		uint32_t segment,
+		uint32_t addr,
+		char * where,
+		size_t len)
+{
+	avr_symbol_t * sym = avr_symbol_find(c->symbol, c->symbolcount,
+			segment + addr);
+	if (sym && sym->addr >= segment && (segment || sym->addr < 0x800000) &&
+			(!sym->size || segment + addr < sym->addr + sym->size))
+		snprintf(where, len, "%s+%u", sym->symbol, segment + addr - sym->addr);
+	else
+		snprintf(where, len, "(unknown)");
+}
+
+static void
+_avr_snapdiff_bytes(
+		FILE * out,
+		const uint8_t * p,
+		uint32_t len)
+{
+	for (uint32_t i = 0; i < len && i < AVR_SNAPDIFF_BYTES; i++)
+		fprintf(out, "%02x", p[i]);
+	if (len > AVR_SNAPDIFF_BYTES)
+		fprintf(out, "..");
+}
+
+/*
+ * One line per run of bytes that differ, and that are in the same object;
+ * 'segment' is where the memory is in the symbols' addresses, ~0 for none.
+ * Addresses from 'stack' up are the stack's
+ */
+static void
+_avr_snapdiff_mem(
+		_avr_snapdiff_ctx_t * c,
+		int kind,
+		const char * label,
+		uint32_t base,
+		const uint8_t * a,
+		const uint8_t * b,
+		uint32_t len,
+		uint32_t segment,
+		uint32_t stack)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		if (a[i] == b[i])
+			continue;
+		char where[128] = "", next[128];
+		if (base + i >= stack)
+			snprintf(where, sizeof(where), "(stack)");
+		else if (segment != ~0u)
+			_avr_snapdiff_where(c, segment, base + i, where, sizeof(where));
+		uint32_t e = i + 1;
+		// the io registers are one per line
+		while (segment != ~0u && e < len && a[e] != b[e]) {
+			if (base + e >= stack)
+				snprintf(next, sizeof(next), "(stack)");
+			else
+				_avr_snapdiff_where(c, segment, base + e, next, sizeof(next));
+			// a new object starts at its offset zero
+			char * plus = strrchr(next, '+');
+			if (plus && !strcmp(plus, "+0"))
+				break;
+			if (base + i < stack && base + e >= stack)
+				break;
+			e++;
+		}
+		_avr_snapdiff_count(c, kind);
+		if (c->out) {
+			fprintf(c->out, "diff: %s 0x%04x", label, base + i);
+			if (where[0])
+				fprintf(c->out, " %s", where);
+			fprintf(c->out, " %u byte%s: ", e - i, e - i > 1 ? "s" : "");
+			_avr_snapdiff_bytes(c->out, a + i, e - i);
+			fprintf(c->out, " / ");
+			_avr_snapdiff_bytes(c->out, b + i, e - i);
+			fprintf(c->out, "\n");
+		}
+		i = e - 1;
+	}
+}
+
+// "timer1", "uart0"... for the modules that come in numbers
+static const char *
+_avr_snapdiff_io_name(
+		avr_io_t * io,
+		char * buf,
+		size_t len)
+{
+	int index = io->irq_ioctl_get & 0xff;
+	if (index >= '0' && index <= '9')
+		snprintf(buf, len, "%s%c", io->kind, index);
+	else
+		snprintf(buf, len, "%s", io->kind);
+	return buf;
+}
+
+static const char *
+_avr_snapdiff_timer_owner(
+		avr_t * avr,
+		void * param,
+		char * buf,
+		size_t len)
+{
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		if (param == io)
+			return _avr_snapdiff_io_name(io, buf, len);
+	snprintf(buf, len, "%p", param);
+	return buf;
+}
+
+static int
+_avr_snapdiff_timer_cmp(
+		const void * pa,
+		const void * pb)
+{
+	const avr_cycle_timer_slot_t * a = pa, * b = pb;
+	if (a->when != b->when)
+		return a->when < b->when ? -1 : 1;
+	if (a->timer != b->timer)
+		return (uintptr_t)a->timer < (uintptr_t)b->timer ? -1 : 1;
+	if (a->param != b->param)
+		return (uintptr_t)a->param < (uintptr_t)b->param ? -1 : 1;
+	return 0;
+}
+
+// the timers pending in only one of them, by due cycle
+static void
+_avr_snapdiff_timers(
+		_avr_snapdiff_ctx_t * c,
+		_avr_snapdiff_state_t * a,
+		_avr_snapdiff_state_t * b)
+{
+	qsort(a->timer, a->timers, sizeof(*a->timer), _avr_snapdiff_timer_cmp);
+	qsort(b->timer, b->timers, sizeof(*b->timer), _avr_snapdiff_timer_cmp);
+	uint32_t ia = 0, ib = 0;
+	while (ia < a->timers || ib < b->timers) {
+		int cmp = ia == a->timers ? 1 : ib == b->timers ? -1 :
+				_avr_snapdiff_timer_cmp(a->timer + ia, b->timer + ib);
+		if (!cmp) {
+			ia++;
+			ib++;
+			continue;
+		}
+		avr_cycle_timer_slot_t * t = cmp < 0 ? a->timer + ia++ : b->timer + ib++;
+		_avr_snapdiff_count(c, AVR_SNAPDIFF_TIMERS);
+		if (c->out) {
+			char buf[32];
+			fprintf(c->out, "diff: timer of %s due at cycle %" PRI_avr_cycle_count
+					" only in %s\n",
+					_avr_snapdiff_timer_owner(c->avr, t->param, buf, sizeof(buf)),
+					t->when, cmp < 0 ? "a" : "b");
+		}
+	}
+}
+
+static void
+_avr_snapdiff_core(
+		_avr_snapdiff_ctx_t * c,
+		_avr_snapdiff_state_t * a,
+		_avr_snapdiff_state_t * b)
+{
+	FILE * out = c->out;
+
+	if (a->cycle != b->cycle) {
+		_avr_snapdiff_count(c, AVR_SNAPDIFF_CORE);
+		if (out)
+			fprintf(out, "diff: cycle %" PRI_avr_cycle_count " / %"
+					PRI_avr_cycle_count "\n", a->cycle, b->cycle);
+	}
+	if (a->state != b->state) {
+		_avr_snapdiff_count(c, AVR_SNAPDIFF_CORE);
+		if (out)
+			fprintf(out, "diff: state %d / %d\n", a->state, b->state);
+	}
+	if (a->pc != b->pc) {
+		_avr_snapdiff_count(c, AVR_SNAPDIFF_PC);
+		if (out) {
+			char wa[128], wb[128];
+			_avr_snapdiff_where(c, 0, a->pc, wa, sizeof(wa));
+			_avr_snapdiff_where(c, 0, b->pc, wb, sizeof(wb));
+			fprintf(out, "diff: pc 0x%04x %s / 0x%04x %s\n",
+					a->pc, wa, b->pc, wb);
+		}
+	}
+	if (a->sreg != b->sreg) {
+		_avr_snapdiff_count(c, AVR_SNAPDIFF_CORE);
+		if (out) {
+			const char * bits = "ITHSVNZC";
+			char sa[9], sb[9];
+			for (int i = 0; i < 8; i++) {
+				sa[i] = a->sreg & (0x80 >> i) ? bits[i] : '-';
+				sb[i] = b->sreg & (0x80 >> i) ? bits[i] : '-';
+			}
+			sa[8] = sb[8] = 0;
+			fprintf(out, "diff: sreg %s / %s\n", sa, sb);
+		}
+	}
+	for (int r = 0; r < 32; r++) {
+		if (a->data[r] == b->data[r])
+			continue;
+		_avr_snapdiff_count(c, AVR_SNAPDIFF_REGS);
+		if (out)
+			fprintf(out, "diff: r%d %02x / %02x\n", r, a->data[r], b->data[r]);
+	}
+}
+
+int
+avr_snapdiff(
+		avr_t * avr,
+		avr_snapshot_t * sa,
+		avr_snapshot_t * sb,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		FILE * out,
+		avr_snapdiff_t * d)
+{
+	avr_snapdiff_t counts;
+	_avr_snapdiff_ctx_t c = {
+		.avr = avr, .symbol = symbol, .symbolcount = symbol ? symbolcount : 0,
+		.out = out, .d = d ? d : &counts,
+	};
+	memset(c.d, 0, sizeof(*c.d));
+
+	// what it was before, to put it back
+	avr_snapshot_t * now = avr_snapshot_save(avr);
+	if (!now)
+		return -1;
+	_avr_snapdiff_state_t a, b;
+	int res = -1;
+	if (_avr_snapdiff_state(avr, sa, &a))
+		goto restore;
+	if (_avr_snapdiff_state(avr, sb, &b)) {
+		_avr_snapdiff_state_free(&a);
+		goto restore;
+	}
+
+	_avr_snapdiff_core(&c, &a, &b);
+	uint32_t io = avr->ioend + 1;
+	_avr_snapdiff_mem(&c, AVR_SNAPDIFF_IO, "io", 32,
+			a.data + 32, b.data + 32, io - 32, ~0u, ~0u);
+	// the stack is from the lowest of the two stack pointers up
+	uint32_t sp = (a.sp < b.sp ? a.sp : b.sp) + 1;
+	_avr_snapdiff_mem(&c, AVR_SNAPDIFF_SRAM, "sram", io,
+			a.data + io, b.data + io, avr->ramend + 1 - io,
+			0x800000, sp > io ? sp : ~0u);
+	if (a.ee && b.ee)
+		_avr_snapdiff_mem(&c, AVR_SNAPDIFF_EEPROM, "eeprom", 0,
+				a.ee, b.ee, avr->e2end + 1, 0x810000, ~0u);
+
+	// two builds differ all over the flash, it's only summed up
+	uint32_t bytes = 0, runs = 0, first = 0;
+	for (uint32_t i = 0; i <= avr->flashend; i++) {
+		if (a.flash[i] == b.flash[i])
+			continue;
+		if (!bytes)
+			first = i;
+		if (!i || a.flash[i - 1] == b.flash[i - 1])
+			runs++;
+		bytes++;
+	}
+	if (bytes) {
+		_avr_snapdiff_count(&c, AVR_SNAPDIFF_FLASH);
+		if (out) {
+			char where[128];
+			_avr_snapdiff_where(&c, 0, first, where, sizeof(where));
+			fprintf(out, "diff: flash %u byte%s in %u run%s, from 0x%04x %s\n",
+					bytes, bytes > 1 ? "s" : "", runs, runs > 1 ? "s" : "",
+					first, where);
+		}
+	}
+
+	_avr_snapdiff_timers(&c, &a, &b);
+
+	uint32_t i = 0;
+	for (avr_io_t * m = avr->io_port; m; m = m->next, i++) {
+		avr_snapshot_t * ma = a.module + i, * mb = b.module + i;
+		if (ma->len == mb->len && !memcmp(ma->buf, mb->buf, ma->len))
+			continue;
+		uint32_t n = ma->len > mb->len ? ma->len - mb->len : mb->len - ma->len;
+		for (uint32_t o = 0; o < ma->len && o < mb->len; o++)
+			n += ma->buf[o] != mb->buf[o];
+		_avr_snapdiff_count(&c, AVR_SNAPDIFF_MODULES);
+		if (out) {
+			char name[32];
+			fprintf(out, "diff: module %s, %u byte%s of its state\n",
+					_avr_snapdiff_io_name(m, name, sizeof(name)), n,
+					n > 1 ? "s" : "");
+		}
+	}
+	res = c.d->total;
+	_avr_snapdiff_state_free(&a);
+	_avr_snapdiff_state_free(&b);
+restore:
+	if (avr_snapshot_restore(avr, now))
+		AVR_LOG(avr, LOG_ERROR, "SNAPDIFF: can't put the instance back\n");
+	avr_snapshot_free(now);
+	avr_snapshot_untrack(avr);
+	return res;
+}
+
+int
+avr_snapdiff_bisect(
+		avr_t * avr,
+		avr_ckstore_t * a,
+		avr_ckstore_t * b,
+		uint32_t kinds)
+{
+	int lo = 0, hi = a->cks < b->cks ? a->cks : b->cks;
+
+	// the first one that differs is in [lo, hi], hi if none does
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		avr_snapshot_t * sa = avr_ckstore_get(a, mid);
+		avr_snapshot_t * sb = avr_ckstore_get(b, mid);
+		avr_snapdiff_t d;
+		int res = sa && sb ? avr_snapdiff(avr, sa, sb, NULL, 0, NULL, &d) : -1;
+		avr_snapshot_free(sa);
+		avr_snapshot_free(sb);
+		if (res < 0)
+			return -1;
+		res = 0;
+		for (int k = 0; k < AVR_SNAPDIFF_COUNT; k++)
+			if (kinds & (1 << k))
+				res += d.count[k];
+		if (res)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
@@ -0,0 +1,111 @@
+/*
+	sim_snapdiff.h
+
+	Compares two snapshots of an instance, field by field, and tells
+	where they differ.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_SNAPDIFF_H__
+#define __SIM_SNAPDIFF_H__
+
+#include <stdio.h>
+#include "sim_snapshot.h"
+#include "sim_ckstore.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A snapshot is only a stream of bytes in the order the walk made them,
+ * it can't be read without the instance it belongs to. So each one is
+ * restored into that instance, in turn, and what it holds is read back:
+ * the core (cycle, state, pc, registers, SREG), the SRAM, the io space,
+ * the flash, the EEPROM, the pending cycle timers, and the state of each
+ * io module as its 'snapshot' hook writes it. The instance is put back
+ * the way it was afterwards.
+ *
+ * The report has one line per difference, "a / b" for the two values;
+ * the SRAM and EEPROM runs are named after the object they're in, from
+ * the firmware symbols, the pc after its function. The flash only gets a
+ * count of the bytes and runs that differ, and the first run.
+ *
+ * Two runs of different builds can be compared as long as the instance
+ * is made the same (same mcu and modules, see sim_snapshot.h about
+ * files). Taking checkpoints of both every so often (run_avr's
+ * --checkpoint-every) and comparing them with avr_snapdiff_bisect()
+ * finds the first pair that differs in a logarithmic number of
+ * comparisons; the run is then replayed from the pair before with a
+ * smaller period, rather than stepping the whole run again.
+ */
+enum {
+	AVR_SNAPDIFF_CORE = 0,	// cycle, state, SREG
+	AVR_SNAPDIFF_PC,
+	AVR_SNAPDIFF_REGS,
+	AVR_SNAPDIFF_IO,
+	AVR_SNAPDIFF_SRAM,
+	AVR_SNAPDIFF_FLASH,
+	AVR_SNAPDIFF_EEPROM,
+	AVR_SNAPDIFF_TIMERS,
+	AVR_SNAPDIFF_MODULES,
+	AVR_SNAPDIFF_COUNT
+};
+
+typedef struct avr_snapdiff_t {
+	uint32_t	count[AVR_SNAPDIFF_COUNT];	// differences, of each kind
+	uint32_t	total;
+} avr_snapdiff_t;
+
+/*
+ * Compares 'a' and 'b', both of 'avr', and prints the differences to
+ * 'out' if it's not NULL. 'symbol' can be NULL. 'd' gets the counts, if
+ * not NULL. Returns the number of differences, or -1 if either couldn't
+ * be restored. Not to be called from within avr_run()
+ */
+int
+avr_snapdiff(
+		struct avr_t * avr,
+		avr_snapshot_t * a,
+		avr_snapshot_t * b,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount,
+		FILE * out,
+		avr_snapdiff_t * d );
+/*
+ * Two stores of checkpoints taken at the same cycles: returns the first
+ * checkpoint number where they differ, in one of the 'kinds' (a mask of
+ * 1 << AVR_SNAPDIFF_*), assuming they stay different once they do. The
+ * number of checkpoints both have if they never do, or -1 on error. A
+ * dropped checkpoint is an error.
+ * Two builds always differ in their flash, and in the pc too if the code
+ * moved; these are left out of 'kinds' to find where their state parts.
+ */
+#define AVR_SNAPDIFF_STATE	(~((1 << AVR_SNAPDIFF_FLASH) | (1 << AVR_SNAPDIFF_PC)))
+
+int
+avr_snapdiff_bisect(
+		struct avr_t * avr,
+		avr_ckstore_t * a,
+		avr_ckstore_t * b,
+		uint32_t kinds );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPDIFF_H__ */
@@ -0,0 +1,486 @@
+/*
+	sim_snapshot.c
+
+	Saves the run time state of an instance to memory, and restores it.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_snapshot.h"
+#include "sim_core.h"
+
+#define AVR_SNAPSHOT_MAGIC		0x52564153	// "SAVR"
+#define AVR_SNAPSHOT_VERSION	1
+
+typedef struct _avr_snapshot_header_t {
+	uint32_t	magic, version;
+	avr_t *		avr;
+	uint32_t	flashend, ramend;
+	uint32_t	io_count;
+} _avr_snapshot_header_t;
+
+void
+avr_snapshot_data(
+		avr_snapshot_t * s,
+		void * data,
+		uint32_t size)
+{
+	if (s->error)
+		return;
+	if (s->restore) {
+		if (s->pos + size > s->len) {
+			s->error = 1;
+			return;
+		}
+		memcpy(data, s->buf + s->pos, size);
+		s->pos += size;
+		return;
+	}
+	if (s->len + size > s->size) {
+		uint32_t n = s->size ? s->size : 4096;
+		while (n < s->len + size)
+			n *= 2;
+		uint8_t * b = realloc(s->buf, n);
+		if (!b) {
+			s->error = 1;
+			return;
+		}
+		s->buf = b;
+		s->size = n;
+	}
+	memcpy(s->buf + s->len, data, size);
+	s->len += size;
+}
+
+#define SNAP(_s, _v) avr_snapshot_data(_s, &(_v), sizeof(_v))
+
+void
+avr_snapshot_io(
+		avr_snapshot_t * s,
+		avr_io_t * io,
+		uint32_t size)
+{
+	uint8_t * start = (uint8_t *)io + sizeof(*io);
+	uint8_t * end = (uint8_t *)io + size;
+
+	if (!s->restore) {
+		avr_snapshot_data(s, start, end - start);
+		return;
+	}
+	/*
+	 * The vectors of a module have their irqs in the structure, with
+	 * whatever hooks were added since; put these back once it's copied
+	 */
+	avr_irq_pool_t * pool = &io->avr->irq_pool;
+	int count = 0;
+	for (int i = 0; i < pool->count; i++)
+		count += pool->irq[i] && (uint8_t *)pool->irq[i] >= start &&
+				(uint8_t *)pool->irq[i] < end;
+	avr_irq_t * keep = count ? malloc(count * sizeof(*keep)) : NULL;
+	if (count && !keep) {
+		s->error = 1;
+		return;
+	}
+	for (int i = 0, k = 0; i < pool->count; i++)
+		if (pool->irq[i] && (uint8_t *)pool->irq[i] >= start &&
+				(uint8_t *)pool->irq[i] < end)
+			keep[k++] = *pool->irq[i];
+	avr_snapshot_data(s, start, end - start);
+	for (int i = 0, k = 0; i < pool->count; i++)
+		if (pool->irq[i] && (uint8_t *)pool->irq[i] >= start &&
+				(uint8_t *)pool->irq[i] < end)
+			*pool->irq[i] = keep[k++];
+	free(keep);
+}
+
+static inline uint32_t
+_avr_dirty_words(
+		uint32_t size)
+{
+	uint32_t pages = (size + (1 << AVR_DIRTY_PAGE_SHIFT) - 1) >> AVR_DIRTY_PAGE_SHIFT;
+	return (pages + 63) / 64;
+}
+
+// puts back a range of the flash, if it changed
+static void
+_avr_snapshot_flash(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		const uint8_t * src,
+		uint32_t start,
+		uint32_t len)
+{
+	if (!memcmp(avr->flash + start, src + start, len))
+		return;
+	// that also changes avr->flash if it was shared
+	if (avr_flash_unshare(avr)) {
+		s->error = 1;
+		return;
+	}
+	memcpy(avr->flash + start, src + start, len);
+	avr_predecode_invalidate(avr, start, len);
+}
+
+/*
+ * Data space or flash. When 'dirty' is set, the restore only copies the
+ * pages it marks, plus the first 'fixed' bytes that aren't tracked.
+ */
+static void
+_avr_snapshot_mem(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		uint8_t * mem,
+		uint32_t size,
+		const uint64_t * dirty,
+		uint32_t fixed,
+		int flash)
+{
+	if (!s->restore || s->error) {
+		avr_snapshot_data(s, mem, size);
+		return;
+	}
+	if (s->pos + size > s->len) {
+		s->error = 1;
+		return;
+	}
+	const uint8_t * src = s->buf + s->pos;
+	if (dirty) {
+		memcpy(mem, src, fixed);
+		for (uint32_t i = 0; i < _avr_dirty_words(size); i++) {
+			for (uint64_t w = dirty[i]; w; w &= w - 1) {
+				uint32_t start = (i * 64 + __builtin_ctzll(w)) << AVR_DIRTY_PAGE_SHIFT;
+				uint32_t len = 1 << AVR_DIRTY_PAGE_SHIFT;
+				if (start + len > size)
+					len = size - start;
+				if (flash)
+					_avr_snapshot_flash(avr, s, src, start, len);
+				else
+					memcpy(mem + start, src + start, len);
+			}
+		}
+	} else if (!flash)
+		memcpy(mem, src, size);
+	else	// it's rarely been touched, don't throw the decoded cache away
+		_avr_snapshot_flash(avr, s, src, 0, size);
+	s->pos += size;
+}
+
+static void
+_avr_snapshot_timers(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	uint32_t count = pool->count;
+
+	if (!s->restore) {
+		SNAP(s, count);
+		SNAP(s, pool->seq);
+		avr_snapshot_data(s, pool->timer, count * sizeof(pool->timer[0]));
+		return;
+	}
+	SNAP(s, count);
+	if (s->error)
+		return;
+	if (count > pool->size) {
+		avr_cycle_timer_slot_p t = realloc(pool->timer, count * sizeof(*t));
+		if (!t) {
+			s->error = 1;
+			return;
+		}
+		pool->timer = t;
+		pool->size = count;
+	}
+	// whatever is pending now is forgotten
+	for (uint32_t i = 0; i < pool->count; i++)
+		if (pool->timer[i].handle)
+			pool->timer[i].handle->slot = 0;
+	pool->count = 0;
+	SNAP(s, pool->seq);
+	avr_snapshot_data(s, pool->timer, count * sizeof(pool->timer[0]));
+	if (s->error)
+		return;
+	pool->count = count;
+	for (uint32_t i = 0; i < count; i++)
+		if (pool->timer[i].handle)
+			pool->timer[i].handle->slot = i + 1;
+}
+
+static void
+_avr_snapshot_irqs(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	const uint32_t mask = IRQ_FLAG_INIT | IRQ_FLAG_FLOATING;
+	avr_irq_pool_t * pool = &avr->irq_pool;
+	int count = pool->count;
+
+	SNAP(s, count);
+	for (int i = 0; i < count && !s->error; i++) {
+		avr_irq_t * irq = i < pool->count ? pool->irq[i] : NULL;
+		struct {
+			avr_irq_t *	irq;
+			uint32_t	value, flags;
+		} e = { irq };
+		if (!s->restore && irq) {
+			e.value = irq->value;
+			e.flags = irq->flags & mask;
+		}
+		SNAP(s, e);
+		// irqs freed or allocated since are left alone
+		if (s->restore && irq && e.irq == irq) {
+			irq->value = e.value;
+			irq->flags = (irq->flags & ~mask) | (e.flags & mask);
+		}
+	}
+}
+
+/*
+ * The same walk saves and restores, avr_snapshot_data() only changes the
+ * direction of the copies.
+ */
+static void
+_avr_snapshot_walk(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	_avr_snapshot_header_t h;
+	memset(&h, 0, sizeof(h));	// it's compared with memcmp()
+	h.magic = AVR_SNAPSHOT_MAGIC;
+	h.version = AVR_SNAPSHOT_VERSION;
+	h.avr = avr;
+	h.flashend = avr->flashend;
+	h.ramend = avr->ramend;
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		h.io_count++;
+	_avr_snapshot_header_t saved = h;
+	SNAP(s, saved);
+	if (memcmp(&saved, &h, sizeof(h))) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: not taken from this instance\n");
+		s->error = 1;
+	}
+	if (s->error)
+		return;
+
+	SNAP(s, avr->state);
+	SNAP(s, avr->frequency);
+	SNAP(s, avr->cycle);
+	SNAP(s, avr->run_cycle_count);
+	SNAP(s, avr->run_cycle_limit);
+	SNAP(s, avr->sleep_usec);
+	SNAP(s, avr->sreg);
+	SNAP(s, avr->sreg_lazy);
+	SNAP(s, avr->interrupt_state);
+	SNAP(s, avr->pc);
+	/*
+	 * The registers and the io space are written all over the place,
+	 * they are copied whole; the rest comes from the dirty pages when
+	 * restoring the snapshot they are tracked from.
+	 */
+	int incremental = s->restore && s->id && avr->dirty.data &&
+			avr->dirty.base == s->id;
+	uint32_t fixed = avr->ioend + 1 > 32 + avr->io_count ?
+			avr->ioend + 1 : 32 + avr->io_count;
+	if (fixed > avr->ramend + 1)
+		fixed = avr->ramend + 1;
+	_avr_snapshot_mem(avr, s, avr->data, avr->ramend + 1,
+			incremental ? avr->dirty.data : NULL, fixed, 0);
+	_avr_snapshot_mem(avr, s, avr->flash, avr->flashend + 1,
+			incremental ? avr->dirty.flash : NULL, 0, 1);
+
+	avr_int_table_p table = &avr->interrupts;
+	SNAP(s, table->pending);
+	SNAP(s, table->running_ptr);
+	// the stack never shrinks, it's still big enough when restoring
+	avr_snapshot_data(s, table->running,
+			table->running_ptr * sizeof(*table->running));
+	avr_snapshot_data(s, table->running_start,
+			table->running_ptr * sizeof(*table->running_start));
+
+	_avr_snapshot_timers(avr, s);
+
+	for (avr_io_t * io = avr->io_port; io && !s->error; io = io->next) {
+		const char * kind = io->kind;
+		SNAP(s, kind);
+		if (kind != io->kind) {
+			AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: io module %s moved\n", io->kind);
+			s->error = 1;
+		} else {
+			avr_io_gate_snapshot(io, s);
+			if (io->snapshot)
+				io->snapshot(io, s);
+		}
+	}
+	_avr_snapshot_irqs(avr, s);
+	// just a cache
+	memset(&avr->idle_loop, 0, sizeof(avr->idle_loop));
+}
+
+// after a save or restore, the pages are tracked from this snapshot on
+static void
+_avr_snapshot_track(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	uint32_t dwords = _avr_dirty_words(avr->ramend + 1);
+	uint32_t fwords = _avr_dirty_words(avr->flashend + 1);
+
+	if (!avr->dirty.data) {
+		avr->dirty.data = malloc(dwords * sizeof(uint64_t));
+		avr->dirty.flash = malloc(fwords * sizeof(uint64_t));
+		if (!avr->dirty.data || !avr->dirty.flash) {
+			// not fatal, all the restores are complete copies then
+			avr_snapshot_untrack(avr);
+			return;
+		}
+	}
+	memset(avr->dirty.data, 0, dwords * sizeof(uint64_t));
+	memset(avr->dirty.flash, 0, fwords * sizeof(uint64_t));
+	avr->dirty.base = s->id;
+}
+
+void
+avr_snapshot_untrack(
+		avr_t * avr)
+{
+	free(avr->dirty.data);
+	free(avr->dirty.flash);
+	avr->dirty.data = avr->dirty.flash = NULL;
+	avr->dirty.base = 0;
+}
+
+avr_snapshot_t *
+avr_snapshot_save(
+		avr_t * avr)
+{
+	avr_snapshot_t * s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+	avr_sreg_materialize(avr);
+	_avr_snapshot_walk(avr, s);
+	if (s->error) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: can't save %s\n", avr->mmcu);
+		avr_snapshot_free(s);
+		return NULL;
+	}
+	s->id = ++avr->dirty.serial;
+	if (!s->id)	// zero is 'none'
+		s->id = ++avr->dirty.serial;
+	_avr_snapshot_track(avr, s);
+	return s;
+}
+
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	s->restore = 1;
+	s->pos = 0;
+	s->error = 0;
+	_avr_snapshot_walk(avr, s);
+	s->restore = 0;
+	// the modules' state is back, without their version bumped
+	avr_io_read_invalidate(avr);
+	if (s->error || s->pos != s->len) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: can't restore %s\n", avr->mmcu);
+		avr->dirty.base = 0;
+		return -1;
+	}
+	_avr_snapshot_track(avr, s);
+	return 0;
+}
+
+void
+avr_snapshot_free(
+		avr_snapshot_t * s)
+{
+	if (!s)
+		return;
+	free(s->buf);
+	free(s);
+}
+
+#define AVR_SNAPSHOT_FILE_MAGIC	"simavrck"
+
+typedef struct _avr_snapshot_file_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	len;
+} _avr_snapshot_file_t;
+
+int
+avr_snapshot_write(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		const char * path)
+{
+	_avr_snapshot_file_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AVR_SNAPSHOT_FILE_MAGIC, sizeof(h.magic));
+	h.version = AVR_SNAPSHOT_VERSION;
+	h.len = s->len;
+
+	FILE * f = fopen(path, "wb");
+	if (!f) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: can't create %s\n", path);
+		return -1;
+	}
+	int res = fwrite(&h, sizeof(h), 1, f) == 1 &&
+			fwrite(s->buf, 1, s->len, f) == s->len;
+	if (fclose(f) || !res) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: can't write %s\n", path);
+		remove(path);
+		return -1;
+	}
+	return 0;
+}
+
+avr_snapshot_t *
+avr_snapshot_read(
+		avr_t * avr,
+		const char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: can't open %s\n", path);
+		return NULL;
+	}
+	_avr_snapshot_file_t h;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+			memcmp(h.magic, AVR_SNAPSHOT_FILE_MAGIC, sizeof(h.magic)) ||
+			h.version != AVR_SNAPSHOT_VERSION) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s isn't a snapshot of this version\n",
+				path);
+		fclose(f);
+		return NULL;
+	}
+	avr_snapshot_t * s = calloc(1, sizeof(*s));
+	if (s)
+		s->buf = malloc(h.len ? h.len : 1);
+	if (!s || !s->buf || fread(s->buf, 1, h.len, f) != h.len) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: can't read %s\n", path);
+		avr_snapshot_free(s);
+		s = NULL;
+	} else
+		s->size = s->len = h.len;
+	fclose(f);
+	return s;
+}
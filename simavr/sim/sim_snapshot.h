@@ -0,0 +1,138 @@
+/*
+	sim_snapshot.h
+
+	Saves the run time state of an instance to memory, and restores it.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_SNAPSHOT_H__
+#define __SIM_SNAPSHOT_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A snapshot holds the core registers, the data space, the flash, the
+ * interrupt table, the pending cycle timers, the irq values, and the state
+ * of every io module that has a 'snapshot' hook.
+ *
+ * It is only meant to be restored into the very instance it was taken
+ * from, in the same process: the timers and a few module fields are kept
+ * as pointers. The wiring (irq hooks and connections) is not part of it,
+ * so parts can be attached after a snapshot was taken; but a part that
+ * had a cycle timer pending at the time must still be around when it is
+ * restored.
+ * Neither call may be made from within avr_run().
+ */
+typedef struct avr_snapshot_t {
+	uint32_t	id;				// for the dirty page tracking
+	uint8_t *	buf;
+	uint32_t	size, len;		// allocated, used
+	uint32_t	pos;			// when restoring
+	int			restore;
+	int			error;
+} avr_snapshot_t;
+
+/*
+ * The instance tracks the pages of data and flash written since the last
+ * snapshot it took or restored; restoring that same snapshot again only
+ * copies these pages back, which is what makes tight reset loops cheap:
+ *
+ *	avr_snapshot_t * s = avr_snapshot_save(avr);
+ *	for (;;) {
+ *		avr_run_cycles(avr, budget);
+ *		avr_snapshot_restore(avr, s);	// only what was touched
+ *	}
+ *
+ * The registers and the io space are always copied whole, everything
+ * else has to go through avr_core_watch_write(), or be marked with
+ * avr_dirty_mark() if it's written directly.
+ */
+#define AVR_DIRTY_PAGE_SHIFT	6		// 64 bytes pages
+
+static inline void
+avr_dirty_mark(
+		uint64_t * map,
+		uint32_t addr,
+		uint32_t size )
+{
+	if (!map || !size)
+		return;
+	for (uint32_t p = addr >> AVR_DIRTY_PAGE_SHIFT;
+			p <= (addr + size - 1) >> AVR_DIRTY_PAGE_SHIFT; p++)
+		map[p >> 6] |= 1ULL << (p & 63);
+}
+
+// returns a new snapshot of 'avr', or NULL
+avr_snapshot_t *
+avr_snapshot_save(
+		struct avr_t * avr );
+// returns zero if all is well
+int
+avr_snapshot_restore(
+		struct avr_t * avr,
+		avr_snapshot_t * s );
+void
+avr_snapshot_free(
+		avr_snapshot_t * s );
+
+/*
+ * A snapshot in a file, for another process to pick up. As it keeps
+ * pointers, that process has to be laid out the same: the same program,
+ * set up the same way, without address space randomization; the checks
+ * of a restore tell when it isn't. Both return zero/NULL on error.
+ */
+int
+avr_snapshot_write(
+		struct avr_t * avr,
+		avr_snapshot_t * s,
+		const char * path );
+avr_snapshot_t *
+avr_snapshot_read(
+		struct avr_t * avr,
+		const char * path );
+// stops the dirty page tracking, and frees it. Called by avr_terminate()
+void
+avr_snapshot_untrack(
+		struct avr_t * avr );
+
+/*
+ * For the io modules 'snapshot' hook, which is called for both saving and
+ * restoring. avr_snapshot_io() takes care of the module structure, past
+ * its avr_io_t; avr_snapshot_data() of any buffer it points to.
+ * The irqs embedded in the structure keep their hooks, their values are
+ * restored with all the others.
+ */
+void
+avr_snapshot_io(
+		avr_snapshot_t * s,
+		struct avr_io_t * io,
+		uint32_t size );
+void
+avr_snapshot_data(
+		avr_snapshot_t * s,
+		void * data,
+		uint32_t size );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPSHOT_H__ */
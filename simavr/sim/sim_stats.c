@@ -0,0 +1,195 @@
+/*
+	sim_stats.c
+
+	Simulator performance counters, switchable at run time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_stats.h"
+#include "sim_tier.h"
+
+static void
+_avr_stats_run(
+		avr_t * avr)
+{
+	avr_stats_t * s = avr->stats;
+	int running = avr->state == cpu_Running || avr->state == cpu_Step;
+	int sleeping = avr->state == cpu_Sleeping;
+	avr_cycle_count_t start = avr->cycle;
+
+	if (running)
+		avr->run_cycle_count = 1;
+	s->run(avr);
+
+	avr_cycle_count_t c = avr->cycle - start;
+	if (running && c) {
+		s->instructions++;
+		// that was SLEEP, and the core went to sleep right after it
+		if (avr->state == cpu_Sleeping && c > 1)
+			s->sleep += c - 1;
+	} else if (sleeping)
+		s->sleep += c;
+}
+
+int
+avr_stats_init(
+		avr_t * avr,
+		avr_stats_t * s)
+{
+	if (avr->stats) {
+		AVR_LOG(avr, LOG_ERROR, "STATS: already counting\n");
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	s->avr = avr;
+	s->start = avr->cycle;
+	s->run = avr->run;
+	avr->run = _avr_stats_run;
+	avr->irq_pool.stats = &s->irq;
+	avr->stats = s;
+	return 0;
+}
+
+void
+avr_stats_stop(
+		avr_stats_t * s)
+{
+	avr_t * avr = s->avr;
+
+	if (!avr)
+		return;
+	if (avr->run == _avr_stats_run)
+		avr->run = s->run;
+	if (avr->irq_pool.stats == &s->irq)
+		avr->irq_pool.stats = NULL;
+	avr->stats = NULL;
+	s->avr = NULL;
+}
+
+void
+avr_stats_reset(
+		avr_stats_t * s)
+{
+	s->start = s->avr ? s->avr->cycle : 0;
+	s->instructions = s->sleep = s->interrupts = 0;
+	s->timer_fired = s->timer_rescheduled = 0;
+	s->io_read_cached = 0;
+	memset(&s->irq, 0, sizeof(s->irq));
+	memset(s->io_read, 0, sizeof(s->io_read));
+	memset(s->io_write, 0, sizeof(s->io_write));
+}
+
+void
+avr_stats_report(
+		avr_stats_t * s,
+		FILE * out)
+{
+	avr_cycle_count_t cycles = s->avr ? s->avr->cycle - s->start : 0;
+	avr_cycle_count_t awake = cycles > s->sleep ? cycles - s->sleep : 0;
+
+	fprintf(out, "stats: %" PRI_avr_cycle_count " cycles, %" PRI_avr_cycle_count
+			" sleeping, %" PRIu64 " instructions",
+			cycles, (avr_cycle_count_t)s->sleep, s->instructions);
+	if (s->instructions)
+		fprintf(out, " (%.2f cycles each)", (double)awake / s->instructions);
+	fprintf(out, "\n");
+	fprintf(out, "stats: %" PRIu64 " interrupts, %" PRIu64 " irqs raised, %"
+			PRIu64 " hooks called",
+			s->interrupts, s->irq.raised, s->irq.notified);
+	if (s->irq.coalesced)
+		fprintf(out, ", %" PRIu64 " raises coalesced", s->irq.coalesced);
+	fprintf(out, "\n");
+	fprintf(out, "stats: %" PRIu64 " cycle timers fired, %" PRIu64 " rescheduled\n",
+			s->timer_fired, s->timer_rescheduled);
+	avr_tier_t * t = s->avr ? s->avr->tier : NULL;
+	if (t)
+		fprintf(out, "stats: %" PRI_avr_cycle_count " cycles decoded, %"
+				PRI_avr_cycle_count " threaded, %u hot blocks\n",
+				t->cycles[AVR_TIER_INTERPRETED], t->cycles[AVR_TIER_THREADED],
+				t->promoted);
+	if (s->io_read_cached)
+		fprintf(out, "stats: %" PRIu64 " io reads cached\n", s->io_read_cached);
+	for (int io = 0; io < MAX_IOs; io++) {
+		if (!s->io_read[io] && !s->io_write[io])
+			continue;
+		fprintf(out, "stats: io 0x%02x: %12" PRIu64 " reads %12" PRIu64 " writes\n",
+				AVR_IO_TO_DATA(io), s->io_read[io], s->io_write[io]);
+	}
+}
+
+static const char *
+_avr_stats_state_name(
+		int state)
+{
+	static const char * names[] = {
+		[cpu_Limbo] = "limbo", [cpu_Stopped] = "stopped",
+		[cpu_Running] = "running", [cpu_Sleeping] = "sleeping",
+		[cpu_Step] = "step", [cpu_StepDone] = "step_done",
+		[cpu_Done] = "done", [cpu_Crashed] = "crashed",
+	};
+	return state >= 0 && state < (int)(sizeof(names) / sizeof(names[0])) &&
+			names[state] ? names[state] : "unknown";
+}
+
+void
+avr_stats_report_json(
+		avr_stats_t * s,
+		double host_sec,
+		FILE * out)
+{
+	avr_t * avr = s->avr;
+	avr_cycle_count_t cycles = avr ? avr->cycle - s->start : 0;
+
+	fprintf(out, "{\"state\":\"%s\",\"cycles\":%" PRI_avr_cycle_count
+			",\"sleep_cycles\":%" PRIu64 ",\"sleep_fraction\":%.4f"
+			",\"instructions\":%" PRIu64 ",\"interrupts\":%" PRIu64
+			",\"irqs_raised\":%" PRIu64 ",\"hooks_called\":%" PRIu64
+			",\"timers_fired\":%" PRIu64 ",\"timers_rescheduled\":%" PRIu64
+			",\"host_sec\":%.4f,\"mips\":%.2f,",
+			avr ? _avr_stats_state_name(avr->state) : "unknown",
+			cycles, s->sleep, cycles ? (double)s->sleep / cycles : 0,
+			s->instructions, s->interrupts, s->irq.raised, s->irq.notified,
+			s->timer_fired, s->timer_rescheduled, host_sec,
+			host_sec > 0 ? s->instructions / host_sec / 1e6 : 0);
+	if (avr && avr->tier)
+		fprintf(out, "\"tier_cycles\":[%" PRI_avr_cycle_count ",%"
+				PRI_avr_cycle_count "],\"tier_hot_blocks\":%u,",
+				avr->tier->cycles[AVR_TIER_INTERPRETED],
+				avr->tier->cycles[AVR_TIER_THREADED], avr->tier->promoted);
+	fprintf(out, "\"vectors\":[");
+	for (int i = 0, first = 1; avr && i < avr->interrupts.vector_count; i++) {
+		avr_int_vector_t * v = avr->interrupts.vector[i];
+		avr_int_stats_t * is = &v->stats;
+		if (!is->raised && !is->coalesced)
+			continue;
+		fprintf(out, "%s{\"vector\":%d,\"raised\":%" PRIu64
+				",\"serviced\":%" PRIu64 ",\"coalesced\":%" PRIu64
+				",\"lost\":%" PRIu64 ",\"latency_avg\":%" PRI_avr_cycle_count
+				",\"latency_max\":%" PRI_avr_cycle_count
+				",\"time_total\":%" PRI_avr_cycle_count
+				",\"time_max\":%" PRI_avr_cycle_count "}",
+				first ? "" : ",", v->vector, is->raised, is->serviced,
+				is->coalesced, is->lost,
+				is->serviced ? is->latency_total / is->serviced : 0,
+				is->latency_max, is->time_total, is->time_max);
+		first = 0;
+	}
+	fprintf(out, "]}\n");
+}
@@ -0,0 +1,94 @@
+/*
+	sim_stats.h
+
+	Simulator performance counters, switchable at run time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_STATS_H__
+#define __SIM_STATS_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One place to look at what the simulator spends its time on. Nothing is
+ * counted unless avr->stats is set, the core and the other modules only
+ * test that pointer, and only on their slow paths.
+ *
+ * Counting instructions needs a run callback in front of the current one,
+ * that runs one instruction per call, like the exact profiler does; the
+ * idle and delay loop shortcuts don't kick in while it's there, so the
+ * count is exact but the simulation slower.
+ *
+ * The counters can be read at any time, and cleared with avr_stats_reset().
+ * When tiering (sim_tier.h), the reports also give the cycles each engine
+ * ran, and the number of hot blocks, counted from the start of tiering.
+ */
+typedef struct avr_stats_t {
+	struct avr_t *		avr;
+	avr_run_t			run;			// the callback we're in front of
+	avr_cycle_count_t	start;			// avr->cycle when counting started
+	uint64_t			instructions;	// retired
+	uint64_t			sleep;			// cycles spent sleeping
+	uint64_t			interrupts;		// vectors serviced
+	uint64_t			timer_fired;	// cycle timer callbacks called
+	uint64_t			timer_rescheduled;	// ... that asked to be called again
+	uint64_t			io_read_cached;	// IO reads that didn't need their callback
+	avr_irq_stats_t		irq;			// for avr->irq_pool
+	// IO read/write callbacks called, per IO register (data address - 32)
+	uint64_t			io_read[MAX_IOs];
+	uint64_t			io_write[MAX_IOs];
+} avr_stats_t;
+
+// starts counting, returns zero if all is well
+int
+avr_stats_init(
+		struct avr_t * avr,
+		avr_stats_t * s );
+// stops counting, the counters are kept
+void
+avr_stats_stop(
+		avr_stats_t * s );
+// clears the counters, and restarts the cycle count from now
+void
+avr_stats_reset(
+		avr_stats_t * s );
+void
+avr_stats_report(
+		avr_stats_t * s,
+		FILE * out );
+/*
+ * Same, as one line of JSON, with the state of the core and the per
+ * vector interrupt stats; 'host_sec' is the host time the counted cycles
+ * took, for the simulated MIPS, 0 if unknown.
+ */
+void
+avr_stats_report_json(
+		avr_stats_t * s,
+		double host_sec,
+		FILE * out );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_STATS_H__ */
@@ -0,0 +1,219 @@
+/*
+	sim_stimulus.c
+
+	A queue of values to raise on irqs, at given cycles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_stimulus.h"
+#include "sim_cycle_timers.h"
+
+static avr_cycle_count_t
+_avr_stimulus_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_stimulus_t * s = param;
+
+	s->raising = 1;
+	// a hook can queue more events, the array can move
+	while (s->head < s->count && s->event[s->head].cycle <= avr->cycle) {
+		avr_stimulus_event_t e = s->event[s->head++];
+		avr_raise_irq_float(e.irq, e.value, e.floating);
+		s->raised++;
+	}
+	s->raising = 0;
+	if (s->head == s->count) {
+		s->head = s->count = 0;
+		return 0;
+	}
+	return s->event[s->head].cycle;
+}
+
+static void
+avr_stimulus_schedule(
+		avr_t * avr)
+{
+	avr_stimulus_t * s = avr->stimulus;
+
+	if (s->raising)
+		return;
+	if (s->head == s->count) {
+		avr_cycle_timer_cancel(avr, _avr_stimulus_timer, s);
+		return;
+	}
+	avr_cycle_count_t when = s->event[s->head].cycle;
+	avr_cycle_timer_register(avr,
+			when > avr->cycle ? when - avr->cycle : 0,
+			_avr_stimulus_timer, s);
+}
+
+// a stable merge sort, the events are most often already in order
+static void
+avr_stimulus_sort(
+		avr_stimulus_event_t * e,
+		avr_stimulus_event_t * tmp,
+		uint32_t count)
+{
+	if (count < 2)
+		return;
+	uint32_t half = count / 2;
+	avr_stimulus_sort(e, tmp, half);
+	avr_stimulus_sort(e + half, tmp, count - half);
+	if (e[half - 1].cycle <= e[half].cycle)
+		return;
+	memcpy(tmp, e, half * sizeof(*e));
+	uint32_t i = 0, j = half, o = 0;
+	while (i < half && j < count)
+		e[o++] = e[j].cycle < tmp[i].cycle ? e[j++] : tmp[i++];
+	while (i < half)
+		e[o++] = tmp[i++];
+}
+
+int
+avr_stimulus_add(
+		avr_t * avr,
+		const avr_stimulus_event_t * events,
+		uint32_t count)
+{
+	if (!count)
+		return 0;
+	avr_stimulus_t * s = avr->stimulus;
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			return -1;
+		avr->stimulus = s;
+	}
+	uint32_t pending = s->count - s->head;
+	if ((uint64_t)pending + count > (1u << 31) / sizeof(*s->event))
+		return -1;
+	/*
+	 * The new events are sorted where they'll end, after the pending
+	 * ones, then merged with them, from the end, unless they all come
+	 * after them, as when a script is loaded in chunks
+	 */
+	uint32_t size = pending + count;
+	avr_stimulus_event_t * tmp = malloc(((count + 1) / 2) * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+	if (s->head && size > s->size - s->head) {
+		memmove(s->event, s->event + s->head, pending * sizeof(*s->event));
+		s->count = pending;
+		s->head = 0;
+	}
+	if (s->count + count > s->size) {
+		uint32_t n = s->size ? s->size : 256;
+		while (n < s->count + count)
+			n *= 2;
+		avr_stimulus_event_t * e = realloc(s->event, n * sizeof(*e));
+		if (!e) {
+			free(tmp);
+			return -1;
+		}
+		s->event = e;
+		s->size = n;
+	}
+	avr_stimulus_event_t * add = s->event + s->count;
+	memcpy(add, events, count * sizeof(*add));
+	avr_stimulus_sort(add, tmp, count);
+	free(tmp);
+
+	avr_stimulus_event_t * e = s->event + s->head;
+	if (pending && e[pending - 1].cycle > add[0].cycle) {
+		// merged from the end, into the space the new ones were sorted in
+		avr_stimulus_event_t * b = malloc(count * sizeof(*b));
+		if (!b)
+			return -1;
+		memcpy(b, add, count * sizeof(*b));
+		int64_t i = pending - 1, j = count - 1, o = size - 1;
+		while (j >= 0) {
+			if (i >= 0 && e[i].cycle > b[j].cycle)
+				e[o--] = e[i--];
+			else
+				e[o--] = b[j--];
+		}
+		free(b);
+	}
+	s->count += count;
+	avr_stimulus_schedule(avr);
+	return 0;
+}
+
+int
+avr_stimulus_raise_in(
+		avr_t * avr,
+		avr_cycle_count_t delay,
+		avr_irq_t * irq,
+		uint32_t value)
+{
+	avr_stimulus_event_t e = {
+		.cycle = avr->cycle + delay,
+		.irq = irq,
+		.value = value,
+	};
+	return avr_stimulus_add(avr, &e, 1);
+}
+
+uint32_t
+avr_stimulus_cancel(
+		avr_t * avr,
+		avr_irq_t * irq)
+{
+	avr_stimulus_t * s = avr->stimulus;
+	if (!s)
+		return 0;
+	uint32_t o = s->head;
+	for (uint32_t i = s->head; i < s->count; i++)
+		if (irq && s->event[i].irq != irq)
+			s->event[o++] = s->event[i];
+	uint32_t res = s->count - o;
+	s->count = o;
+	avr_stimulus_schedule(avr);
+	return res;
+}
+
+uint32_t
+avr_stimulus_pending(
+		avr_t * avr)
+{
+	return avr->stimulus ? avr->stimulus->count - avr->stimulus->head : 0;
+}
+
+void
+avr_stimulus_reset(
+		avr_t * avr)
+{
+	if (avr->stimulus)
+		avr_stimulus_schedule(avr);
+}
+
+void
+avr_stimulus_free(
+		avr_t * avr)
+{
+	avr_stimulus_t * s = avr->stimulus;
+	if (!s)
+		return;
+	avr_cycle_timer_cancel(avr, _avr_stimulus_timer, s);
+	free(s->event);
+	free(s);
+	avr->stimulus = NULL;
+}
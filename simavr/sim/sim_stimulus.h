@@ -0,0 +1,97 @@
+/*
+	sim_stimulus.h
+
+	A queue of values to raise on irqs, at given cycles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_STIMULUS_H__
+#define __SIM_STIMULUS_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The stimulus queue drives inputs from a script: button presses, analog
+ * values, pin changes etc. The events are kept sorted by cycle in one
+ * array per core, and a single cycle timer raises them, instead of a
+ * timer per part or per event; thousands of them can be queued in one
+ * call before the run starts.
+ *
+ * An event is raised at the first instruction boundary at or after its
+ * cycle, with avr_raise_irq_float(). Events that are due at the same
+ * cycle are raised in the order they were queued. The queue survives a
+ * reset of the core, the cycle count isn't reset.
+ */
+typedef struct avr_stimulus_event_t {
+	avr_cycle_count_t cycle;		// absolute
+	avr_irq_t *		irq;
+	uint32_t		value;
+	uint8_t			floating;
+} avr_stimulus_event_t;
+
+typedef struct avr_stimulus_t {
+	avr_stimulus_event_t * event;	// sorted, the pending ones from 'head'
+	uint32_t		head, count, size;
+	uint64_t		raised;
+	uint8_t			raising;		// in the timer, it reschedules itself
+} avr_stimulus_t;
+
+/*
+ * Queues 'count' events, in any order; the ones already due are raised
+ * at the next instruction boundary. Returns 0, or -1 if out of memory, and
+ * none were queued.
+ */
+int
+avr_stimulus_add(
+		avr_t * avr,
+		const avr_stimulus_event_t * events,
+		uint32_t count );
+// queues a single event, 'delay' cycles from now
+int
+avr_stimulus_raise_in(
+		avr_t * avr,
+		avr_cycle_count_t delay,
+		avr_irq_t * irq,
+		uint32_t value );
+// drops the pending events of 'irq', or all of them if NULL. Returns how many
+uint32_t
+avr_stimulus_cancel(
+		avr_t * avr,
+		avr_irq_t * irq );
+// number of events still pending
+uint32_t
+avr_stimulus_pending(
+		avr_t * avr );
+
+// called by avr_reset(), to schedule the queue again
+void
+avr_stimulus_reset(
+		avr_t * avr );
+// called by avr_terminate()
+void
+avr_stimulus_free(
+		avr_t * avr );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_STIMULUS_H__ */
@@ -0,0 +1,239 @@
+/*
+	sim_store.c
+
+	The content of external memory parts: on the heap, in a mapped file, or
+	in a shared memory segment, with copy on write snapshots.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+#include "sim_store.h"
+
+#define STORE_PAGE		(1 << AVR_STORE_PAGE_SHIFT)
+
+#ifndef __MINGW32__
+/*
+ * Opens the file or the segment, and tells whether it had to be created.
+ * The segment is created exclusively, so two instances asking for it at
+ * the same time don't both fill it.
+ */
+static int
+_avr_store_open(
+		avr_store_t * s,
+		int private,
+		int * created )
+{
+	int fd;
+
+	*created = 0;
+	if ((s->kind & 0xff) == AVR_STORE_SHM) {
+		fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd != -1)
+			*created = 1;
+		else if (errno == EEXIST)
+			fd = shm_open(s->name, O_RDWR, 0644);
+		return fd;
+	}
+	if (private)
+		return open(s->name, O_RDONLY);
+	fd = open(s->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd != -1)
+		*created = 1;
+	else if (errno == EEXIST)
+		fd = open(s->name, O_RDWR);
+	return fd;
+}
+#endif
+
+int
+avr_store_init(
+		struct avr_t * avr,
+		avr_store_t * s,
+		int kind,
+		const char * name,
+		uint64_t size,
+		uint8_t fill )
+{
+	memset(s, 0, sizeof(*s));
+	s->kind = kind;
+	if ((kind & 0xff) == AVR_STORE_HEAP) {
+		if (!size || !(s->data = malloc(size))) {
+			AVR_LOG(avr, LOG_ERROR, "STORE: %s: can't allocate %llu bytes\n",
+					__func__, (unsigned long long)size);
+			return -1;
+		}
+		memset(s->data, fill, size);
+		s->size = size;
+		s->created = 1;
+		return 0;
+	}
+#ifdef __MINGW32__
+	AVR_LOG(avr, LOG_ERROR, "STORE: %s: %s can't be mapped on this host\n",
+			__func__, name);
+	return -1;
+#else
+	int private = (kind & AVR_STORE_PRIVATE) != 0;
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	int created;
+	int fd = _avr_store_open(s, private, &created);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st)) {
+		AVR_LOG(avr, LOG_ERROR, "STORE: %s: %s: %s\n", __func__, name,
+				strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if (!size)
+		size = st.st_size;
+	// the part of a file past its end is filled too
+	uint64_t filled = created ? 0 : st.st_size;
+	if (!size || ((uint64_t)st.st_size < size &&
+			(private || ftruncate(fd, size)))) {
+		AVR_LOG(avr, LOG_ERROR, "STORE: %s: %s can't hold %llu bytes\n",
+				__func__, name, (unsigned long long)size);
+		close(fd);
+		if (created && (kind & 0xff) == AVR_STORE_SHM)
+			shm_unlink(name);
+		return -1;
+	}
+	s->data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			private ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	close(fd);
+	if (s->data == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "STORE: %s: can't map %s\n", __func__, name);
+		s->data = NULL;
+		return -1;
+	}
+	s->size = size;
+	s->created = created;
+	if (filled < size)
+		memset(s->data + filled, fill, size - filled);
+	return 0;
+#endif
+}
+
+void
+avr_store_free(
+		avr_store_t * s )
+{
+	avr_store_drop(s);
+	if (!s->data)
+		return;
+	if ((s->kind & 0xff) == AVR_STORE_HEAP)
+		free(s->data);
+#ifndef __MINGW32__
+	else {
+		if ((s->kind & 0xff) == AVR_STORE_FILE && !(s->kind & AVR_STORE_PRIVATE))
+			msync(s->data, s->size, MS_SYNC);
+		munmap(s->data, s->size);
+	}
+#endif
+	s->data = NULL;
+	s->size = 0;
+}
+
+void
+_avr_store_save(
+		avr_store_t * s,
+		uint64_t addr,
+		uint64_t size )
+{
+	if (addr >= s->size)
+		return;
+	if (size > s->size - addr)
+		size = s->size - addr;
+	for (uint64_t p = addr >> AVR_STORE_PAGE_SHIFT;
+			p <= (addr + size - 1) >> AVR_STORE_PAGE_SHIFT; p++) {
+		if (s->saved[p >> 6] & (1ULL << (p & 63)))
+			continue;
+		if (s->copy_count == s->copy_size) {
+			uint32_t n = s->copy_size ? s->copy_size * 2 : 16;
+			uint8_t * copy = realloc(s->copy, (size_t)n * STORE_PAGE);
+			if (!copy)
+				return;		// can't do better than losing the page
+			s->copy = copy;
+			uint32_t * page = realloc(s->copy_page, n * sizeof(*page));
+			if (!page)
+				return;
+			s->copy_page = page;
+			s->copy_size = n;
+		}
+		uint64_t o = p << AVR_STORE_PAGE_SHIFT;
+		uint64_t len = s->size - o < STORE_PAGE ? s->size - o : STORE_PAGE;
+		memcpy(s->copy + (size_t)s->copy_count * STORE_PAGE, s->data + o, len);
+		s->copy_page[s->copy_count++] = p;
+		s->saved[p >> 6] |= 1ULL << (p & 63);
+	}
+}
+
+int
+avr_store_snapshot(
+		avr_store_t * s )
+{
+	uint64_t pages = (s->size + STORE_PAGE - 1) >> AVR_STORE_PAGE_SHIFT;
+	size_t words = (pages + 63) / 64;
+
+	if (!s->data)
+		return -1;
+	if (!s->saved && !(s->saved = malloc(words * sizeof(uint64_t))))
+		return -1;
+	memset(s->saved, 0, words * sizeof(uint64_t));
+	s->copy_count = 0;
+	return 0;
+}
+
+int
+avr_store_restore(
+		avr_store_t * s )
+{
+	if (!s->saved)
+		return -1;
+	for (uint32_t i = 0; i < s->copy_count; i++) {
+		uint64_t p = s->copy_page[i];
+		uint64_t o = p << AVR_STORE_PAGE_SHIFT;
+		uint64_t len = s->size - o < STORE_PAGE ? s->size - o : STORE_PAGE;
+		memcpy(s->data + o, s->copy + (size_t)i * STORE_PAGE, len);
+		s->saved[p >> 6] &= ~(1ULL << (p & 63));
+	}
+	s->copy_count = 0;
+	return 0;
+}
+
+void
+avr_store_drop(
+		avr_store_t * s )
+{
+	free(s->saved);
+	free(s->copy);
+	free(s->copy_page);
+	s->saved = NULL;
+	s->copy = NULL;
+	s->copy_page = NULL;
+	s->copy_count = s->copy_size = 0;
+}
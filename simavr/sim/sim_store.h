@@ -0,0 +1,141 @@
+/*
+	sim_store.h
+
+	The content of external memory parts: on the heap, in a mapped file, or
+	in a shared memory segment, with copy on write snapshots.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_STORE_H__
+#define __SIM_STORE_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Parts (EEPROMs, flashes, SD cards, an RTC NVRAM) read and write 'data'
+ * directly, whatever is behind it:
+ * + AVR_STORE_HEAP is private to the part, and gone when it's freed.
+ * + AVR_STORE_FILE maps 'name', the part's writes go to the file. With
+ *   AVR_STORE_PRIVATE, it's mapped copy on write instead: the file is only
+ *   read, and the instances of a farm mapping the same image share its
+ *   pages until they write to them.
+ * + AVR_STORE_SHM is the segment 'name', as for shm_open(), for other
+ *   processes (or instances) to see, or to provide, the content.
+ * A store that is created is filled with 'fill' (0xff for an erased
+ * memory), otherwise the content is kept, and 'created' is zero.
+ *
+ * A store keeps one snapshot at most, and it costs nothing but a bitmap
+ * until the part writes: the first write to a page since the snapshot
+ * (or its last restore) saves that page first. Restoring only copies
+ * these pages back, so a large card costs what the firmware touched.
+ * Which is why every write has to be preceded by avr_store_touch(), or
+ * go through avr_store_write().
+ */
+enum {
+	AVR_STORE_HEAP = 0,
+	AVR_STORE_FILE,
+	AVR_STORE_SHM,
+};
+
+#define AVR_STORE_PRIVATE		(1 << 8)	// or'ed with AVR_STORE_FILE
+#define AVR_STORE_PAGE_SHIFT	9			// 512 bytes pages
+
+typedef struct avr_store_t {
+	uint8_t *	data;
+	uint64_t	size;
+	int			kind;		// AVR_STORE_*, with the flags
+	int			created;
+	char		name[64];	// of the file or the segment
+	// the snapshot, if there is one
+	uint64_t *	saved;		// bitmap of the pages saved since
+	uint8_t *	copy;		// and their content, in the order saved
+	uint32_t *	copy_page;
+	uint32_t	copy_count, copy_size;
+} avr_store_t;
+
+/*
+ * Makes a store of 'size' bytes; 0 takes the size of an existing file or
+ * segment. Returns 0, or -1 with a message.
+ */
+int
+avr_store_init(
+		struct avr_t * avr,
+		avr_store_t * s,
+		int kind,
+		const char * name,
+		uint64_t size,
+		uint8_t fill );
+// flushes a file, and frees or unmaps the store. The segment is kept
+void
+avr_store_free(
+		avr_store_t * s );
+
+// saves the pages of 'addr', 'size' if they aren't already
+void
+_avr_store_save(
+		avr_store_t * s,
+		uint64_t addr,
+		uint64_t size );
+
+// to call before writing 'size' bytes at 'addr' in 'data'
+static inline void
+avr_store_touch(
+		avr_store_t * s,
+		uint64_t addr,
+		uint64_t size )
+{
+	if (s->saved && size)
+		_avr_store_save(s, addr, size);
+}
+
+static inline void
+avr_store_write(
+		avr_store_t * s,
+		uint64_t addr,
+		uint8_t v )
+{
+	avr_store_touch(s, addr, 1);
+	s->data[addr] = v;
+}
+
+/*
+ * Takes the snapshot, replacing the previous one. Returns 0, or -1
+ */
+int
+avr_store_snapshot(
+		avr_store_t * s );
+/*
+ * Puts the content back as it was at the snapshot, which is kept for
+ * the next time. Returns 0, or -1 if there is no snapshot
+ */
+int
+avr_store_restore(
+		avr_store_t * s );
+// forgets the snapshot, the writes cost nothing extra again
+void
+avr_store_drop(
+		avr_store_t * s );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_STORE_H__ */
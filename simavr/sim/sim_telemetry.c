@@ -0,0 +1,105 @@
+/*
+	sim_telemetry.c
+
+	Rolling real time factor, speed and sleep ratio of a running core.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "sim_telemetry.h"
+#include "sim_stats.h"
+
+static uint64_t
+_avr_telemetry_now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void
+_avr_telemetry_take(
+		avr_telemetry_t * t,
+		avr_telemetry_sample_t * s)
+{
+	avr_t * avr = t->avr;
+
+	s->host_ns = _avr_telemetry_now();
+	// the core might be running on another thread, these are good enough
+	s->cycle = __atomic_load_n(&avr->cycle, __ATOMIC_RELAXED);
+	s->sleep = __atomic_load_n(&avr->sleep_cycles, __ATOMIC_RELAXED);
+	avr_stats_t * stats = __atomic_load_n(&avr->stats, __ATOMIC_RELAXED);
+	s->instructions = stats ? stats->instructions : ~0ULL;
+}
+
+void
+avr_telemetry_init(
+		avr_t * avr,
+		avr_telemetry_t * t,
+		uint32_t window)
+{
+	memset(t, 0, sizeof(*t));
+	t->avr = avr;
+	if (window < 2)
+		window = 2;
+	t->window = window > AVR_TELEMETRY_SAMPLES ? AVR_TELEMETRY_SAMPLES : window;
+	t->mips = -1;
+	_avr_telemetry_take(t, &t->sample[0]);
+	t->count = 1;
+}
+
+int
+avr_telemetry_sample(
+		avr_telemetry_t * t)
+{
+	t->head = (t->head + 1) % t->window;
+	avr_telemetry_sample_t * s = &t->sample[t->head];
+	_avr_telemetry_take(t, s);
+	if (t->count < t->window)
+		t->count++;
+	avr_telemetry_sample_t * o =
+			&t->sample[(t->head + t->window - t->count + 1) % t->window];
+
+	if (s->host_ns <= o->host_ns || s->cycle < o->cycle || !t->avr->frequency)
+		return -1;
+	double host_us = (s->host_ns - o->host_ns) / 1000.0;
+	avr_cycle_count_t cycles = s->cycle - o->cycle;
+	avr_cycle_count_t sleep = s->sleep - o->sleep;
+	if (sleep > cycles)	// a sample taken between the two counters moving
+		sleep = cycles;
+	t->factor = cycles / (host_us * t->avr->frequency / 1000000.0);
+	t->mhz = (cycles - sleep) / host_us;
+	t->sleep_ratio = cycles ? (double)sleep / cycles : 0;
+	// only if it was counting over the whole window
+	t->mips = s->instructions != ~0ULL && o->instructions != ~0ULL &&
+			s->instructions >= o->instructions ?
+				(s->instructions - o->instructions) / host_us : -1;
+	return 0;
+}
+
+void
+avr_telemetry_print(
+		avr_telemetry_t * t,
+		FILE * out)
+{
+	fprintf(out, "%s: %.3fx real time, %.2f MHz awake", t->avr->mmcu,
+			t->factor, t->mhz);
+	if (t->mips >= 0)
+		fprintf(out, ", %.2f MIPS", t->mips);
+	fprintf(out, ", %.1f%% asleep\n", t->sleep_ratio * 100);
+}
@@ -0,0 +1,87 @@
+/*
+	sim_telemetry.h
+
+	Rolling real time factor, speed and sleep ratio of a running core.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_TELEMETRY_H__
+#define __SIM_TELEMETRY_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Each sample is the host monotonic clock, avr->cycle and the cycles
+ * spent sleeping; the figures are worked out between the oldest sample of
+ * the window and the newest, so they follow the last 'window' samples.
+ * Nothing is added to the core: samples can be taken from any thread, at
+ * whatever pace suits, the counters are read as they are.
+ *
+ * Instructions are only counted while avr->stats is set (see sim_stats.h),
+ * 'mips' is negative otherwise; 'mhz', the cycles the core was awake for
+ * per host second, is always there.
+ */
+#define AVR_TELEMETRY_SAMPLES	64
+
+typedef struct avr_telemetry_sample_t {
+	uint64_t			host_ns;
+	avr_cycle_count_t	cycle;
+	avr_cycle_count_t	sleep;
+	uint64_t			instructions;
+} avr_telemetry_sample_t;
+
+typedef struct avr_telemetry_t {
+	struct avr_t *		avr;
+	uint32_t			window;		// samples, up to AVR_TELEMETRY_SAMPLES
+	avr_telemetry_sample_t	sample[AVR_TELEMETRY_SAMPLES];
+	uint32_t			head, count;
+	// as of the last sample
+	double				factor;		// simulated seconds per host second
+	double				mhz;		// awake cycles per host usec
+	double				mips;		// instructions per host usec, or -1
+	double				sleep_ratio;	// of the simulated time, 0 to 1
+} avr_telemetry_t;
+
+// starts with a first sample. 'window' is how many samples the figures span
+void
+avr_telemetry_init(
+		struct avr_t * avr,
+		avr_telemetry_t * t,
+		uint32_t window );
+/*
+ * Takes a sample, and updates the figures. Returns zero if they are
+ * valid, -1 while there's no time between the samples yet
+ */
+int
+avr_telemetry_sample(
+		avr_telemetry_t * t );
+// prints the figures, on one line
+void
+avr_telemetry_print(
+		avr_telemetry_t * t,
+		FILE * out );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TELEMETRY_H__ */
@@ -0,0 +1,69 @@
+/*
+	sim_tier.c
+
+	Tiered execution: the plain decoder first, the threaded engine for the
+	code that turns out to be hot.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_tier.h"
+
+int
+avr_tier_init(
+		avr_t * avr,
+		avr_tier_t * t,
+		uint32_t threshold,
+		uint8_t shift)
+{
+	if (avr->tier) {
+		AVR_LOG(avr, LOG_ERROR, "TIER: already tiering\n");
+		return -1;
+	}
+	memset(t, 0, sizeof(*t));
+	t->shift = shift ? shift : AVR_TIER_SHIFT;
+	t->threshold = threshold ? threshold : AVR_TIER_THRESHOLD;
+	t->blocks = ((avr->flashend + 1) >> t->shift) + 1;
+	t->hot = calloc(t->blocks, sizeof(*t->hot));
+	if (!t->hot) {
+		AVR_LOG(avr, LOG_ERROR, "TIER: %s: out of memory\n", __func__);
+		return -1;
+	}
+	t->avr = avr;
+	t->run = avr->run;
+	avr->run = avr_callback_run_tiered;
+	avr->tier = t;
+	return 0;
+}
+
+void
+avr_tier_stop(
+		avr_tier_t * t)
+{
+	avr_t * avr = t->avr;
+
+	if (!avr)
+		return;
+	if (avr->run == avr_callback_run_tiered)
+		avr->run = t->run;
+	avr->tier = NULL;
+	free(t->hot);
+	t->hot = NULL;
+	t->blocks = 0;
+	t->avr = NULL;
+}
@@ -0,0 +1,128 @@
+/*
+	sim_tier.h
+
+	Tiered execution: the plain decoder first, the threaded engine for the
+	code that turns out to be hot.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_TIER_H__
+#define __SIM_TIER_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The threaded engine (avr_callback_run_threaded()) needs the predecoded
+ * cache, and pays for decoding each instruction the first time, which a
+ * short test run never gets back. With avr_tier_init(), the run callback
+ * becomes avr_callback_run_tiered(), that starts every run of the core in
+ * the plain decoder, avr_run_interpreted(), unless the flash block at the
+ * pc is hot.
+ *
+ * The flash is cut in blocks of (1 << shift) bytes, each with a counter
+ * of the control flow edges the plain decoder took into it. The one that
+ * reaches the threshold makes the block hot: the decoder stops there, and
+ * the core goes on from it with the threaded engine, allocating the cache
+ * the first time. A hot block stays hot; the threaded engine runs up to
+ * the next cycle timer, through cold blocks as well, as their instructions
+ * are decoded once anyway.
+ *
+ * There's no tier past the threaded engine (with its superinstructions and
+ * pure blocks) in this tree. The cycles run from each tier, and the blocks
+ * made hot, are kept here, and reported with the performance counters
+ * (sim_stats.h).
+ */
+enum {
+	AVR_TIER_INTERPRETED = 0,
+	AVR_TIER_THREADED,
+	AVR_TIER_COUNT,
+};
+
+#define AVR_TIER_THRESHOLD	1000	// edges into a block to make it hot
+#define AVR_TIER_SHIFT		6		// 64 bytes blocks
+
+typedef struct avr_tier_t {
+	struct avr_t *		avr;
+	avr_run_t			run;		// the callback before us
+	uint32_t			threshold;
+	uint8_t				shift;
+	uint8_t				counting;	// while in the plain decoder
+	uint32_t *			hot;		// edge count, per block
+	uint32_t			blocks;
+	// counters
+	uint32_t			promoted;	// blocks made hot
+	avr_cycle_count_t	cycles[AVR_TIER_COUNT];
+} avr_tier_t;
+
+/*
+ * Starts tiering, with 'threshold' edges (0 for AVR_TIER_THRESHOLD) into a
+ * block of (1 << shift) bytes (0 for AVR_TIER_SHIFT) to make it hot.
+ * Returns 0, or -1
+ */
+int
+avr_tier_init(
+		struct avr_t * avr,
+		avr_tier_t * t,
+		uint32_t threshold,
+		uint8_t shift );
+// puts the run callback back, and frees the counters; the cycles are kept.
+// avr_terminate() does it too
+void
+avr_tier_stop(
+		avr_tier_t * t );
+
+// 1 if the block at 'pc' is hot
+static inline int
+avr_tier_hot(
+		avr_tier_t * t,
+		avr_flashaddr_t pc )
+{
+	uint32_t b = pc >> t->shift;
+	return b < t->blocks && t->hot[b] >= t->threshold;
+}
+
+/*
+ * Called by the core at each control flow edge. In the plain decoder, it
+ * counts it, and ends the run when it goes into a hot block, so the run
+ * callback carries on from there in the threaded engine
+ */
+static inline void
+avr_tier_edge(
+		avr_tier_t * t,
+		avr_flashaddr_t target )
+{
+	uint32_t b = target >> t->shift;
+	if (!t->counting || b >= t->blocks)
+		return;
+	if (t->hot[b] < t->threshold && ++t->hot[b] < t->threshold)
+		return;
+	if (t->hot[b] == t->threshold) {
+		t->hot[b]++;	// counted once
+		t->promoted++;
+	}
+	t->avr->run_cycle_count = 1;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TIER_H__ */
@@ -57,6 +57,87 @@ avr_hz_to_cycles(avr_t * avr, uint32_t hz)
 	return avr->frequency / hz;
 }
 
+/*
+ * A time line shared by instances running at different frequencies, in
+ * picoseconds: from cycles and back with a multiplication by a fixed point
+ * factor made once, instead of a division each time. Good for frequencies
+ * of 1kHz and up, and 200 days or so of simulated time.
+ */
+typedef struct avr_time_base_t {
+	uint32_t	frequency;	// it was made for
+	uint64_t	ps;			// per cycle, 32.32 fixed point
+	uint64_t	cycles;		// per ps, 0.64 fixed point, rounded up
+} avr_time_base_t;
+
+#define AVR_TIME_PS_PER_SEC	1000000000000ULL
+
+static inline void
+avr_time_base_init(
+		avr_time_base_t * t,
+		uint32_t frequency)
+{
+	t->frequency = frequency;
+	t->ps = t->cycles = 0;
+	if (!frequency)
+		return;
+	// long divisions, 16 bits of fraction at a time so nothing overflows
+	uint64_t r = AVR_TIME_PS_PER_SEC % frequency;
+	t->ps = AVR_TIME_PS_PER_SEC / frequency;
+	for (int i = 0; i < 2; i++) {
+		r <<= 16;
+		t->ps = (t->ps << 16) | (r / frequency);
+		r %= frequency;
+	}
+	r = frequency;
+	for (int i = 0; i < 4; i++) {
+		r <<= 16;
+		t->cycles = (t->cycles << 16) | (r / AVR_TIME_PS_PER_SEC);
+		r %= AVR_TIME_PS_PER_SEC;
+	}
+	t->cycles += r != 0;
+}
+
+// 'a' * 'b', as two 64 bits halves
+static inline uint64_t
+_avr_time_mul(
+		uint64_t a,
+		uint64_t b,
+		uint64_t * lo)
+{
+	uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+	uint64_t ll = al * bl, lh = al * bh, hl = ah * bl;
+	uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+
+	*lo = (mid << 32) | (uint32_t)ll;
+	return ah * bh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+}
+
+// picoseconds since cycle zero
+static inline uint64_t
+avr_time_to_ps(
+		const avr_time_base_t * t,
+		avr_cycle_count_t cycles)
+{
+	uint64_t lo, hi = _avr_time_mul(cycles, t->ps, &lo);
+	return (hi << 32) | (lo >> 32);
+}
+
+// the first cycle at or after 'ps', so an event is never early
+static inline avr_cycle_count_t
+avr_time_to_cycles(
+		const avr_time_base_t * t,
+		uint64_t ps)
+{
+	uint64_t lo;
+	avr_cycle_count_t c = _avr_time_mul(ps, t->cycles, &lo);
+
+	if (avr_time_to_ps(t, c) < ps)
+		c++;
+	else if (c && avr_time_to_ps(t, c - 1) >= ps)
+		c--;
+	return c;
+}
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,315 @@
+/*
+	sim_timer_prof.c
+
+	Tells which cycle timers the scheduler spends its time on.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		// dladdr()
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <libelf.h>
+#include <gelf.h>
+#include "sim_timer_prof.h"
+#include "sim_io.h"
+
+#define TIMER_PROF_SIZE	64
+
+uint64_t
+avr_prof_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static inline uint32_t
+_avr_timer_prof_hash(
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	uint64_t h = ((uintptr_t)timer ^ ((uintptr_t)param * 31)) *
+			0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+static int
+_avr_timer_prof_grow(
+		avr_timer_prof_t * p)
+{
+	uint32_t size = p->size ? p->size * 2 : TIMER_PROF_SIZE;
+	avr_timer_prof_entry_t * e = calloc(size, sizeof(*e));
+	if (!e)
+		return -1;
+	for (uint32_t i = 0; i < p->size; i++) {
+		if (!p->entry[i].timer)
+			continue;
+		uint32_t h = _avr_timer_prof_hash(p->entry[i].timer, p->entry[i].param);
+		while (e[h & (size - 1)].timer)
+			h++;
+		e[h & (size - 1)] = p->entry[i];
+	}
+	free(p->entry);
+	p->entry = e;
+	p->size = size;
+	return 0;
+}
+
+avr_timer_prof_entry_t *
+avr_timer_prof_get(
+		avr_timer_prof_t * p,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	if (p->size) {
+		uint32_t h = _avr_timer_prof_hash(timer, param);
+		for (;; h++) {
+			avr_timer_prof_entry_t * e = &p->entry[h & (p->size - 1)];
+			if (!e->timer)
+				break;
+			if (e->timer == timer && e->param == param)
+				return e;
+		}
+	}
+	// kept at most 3/4 full
+	if ((p->count + 1) * 4 > p->size * 3 && _avr_timer_prof_grow(p)) {
+		AVR_LOG(p->avr, LOG_ERROR, "TIMER_PROF: out of memory\n");
+		return NULL;
+	}
+	uint32_t h = _avr_timer_prof_hash(timer, param);
+	while (p->entry[h & (p->size - 1)].timer)
+		h++;
+	avr_timer_prof_entry_t * e = &p->entry[h & (p->size - 1)];
+	e->timer = timer;
+	e->param = param;
+	for (uint32_t i = 0; i < p->name_count; i++)
+		if (p->names[i].timer == timer)
+			e->name = p->names[i].name;
+	p->count++;
+	return e;
+}
+
+int
+avr_timer_prof_init(
+		avr_t * avr,
+		avr_timer_prof_t * p)
+{
+	if (avr->timer_prof) {
+		AVR_LOG(avr, LOG_ERROR, "TIMER_PROF: already counting\n");
+		return -1;
+	}
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	avr->timer_prof = p;
+	return 0;
+}
+
+void
+avr_timer_prof_stop(
+		avr_timer_prof_t * p)
+{
+	if (p->avr && p->avr->timer_prof == p)
+		p->avr->timer_prof = NULL;
+	free(p->entry);
+	free(p->names);
+	p->entry = NULL;
+	p->names = NULL;
+	p->size = p->count = p->name_count = 0;
+	p->avr = NULL;
+}
+
+int
+avr_timer_prof_name(
+		avr_timer_prof_t * p,
+		avr_cycle_timer_t timer,
+		const char * name)
+{
+	void * n = realloc(p->names, (p->name_count + 1) * sizeof(p->names[0]));
+	if (!n)
+		return -1;
+	p->names = n;
+	p->names[p->name_count].timer = timer;
+	p->names[p->name_count++].name = name;
+	// and the ones already counted
+	for (uint32_t i = 0; i < p->size; i++)
+		if (p->entry[i].timer == timer)
+			p->entry[i].name = name;
+	return 0;
+}
+
+/*
+ * The name of the function at 'addr' in the symbol table of 'file', that
+ * is mapped at 'base' if it's position independent
+ */
+static int
+_avr_timer_prof_elf_symbol(
+		const char * file,
+		uintptr_t base,
+		uintptr_t addr,
+		char * out,
+		size_t size)
+{
+	int found = 0;
+	if (elf_version(EV_CURRENT) == EV_NONE)
+		return 0;
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	Elf * elf = elf_begin(fd, ELF_C_READ, NULL);
+	GElf_Ehdr ehdr;
+	if (!elf || !gelf_getehdr(elf, &ehdr))
+		goto done;
+	if (ehdr.e_type == ET_DYN)
+		addr -= base;
+	Elf_Scn * scn = NULL;
+	while (!found && (scn = elf_nextscn(elf, scn))) {
+		GElf_Shdr shdr;
+		if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != SHT_SYMTAB)
+			continue;
+		Elf_Data * data = elf_getdata(scn, NULL);
+		int count = shdr.sh_entsize ? shdr.sh_size / shdr.sh_entsize : 0;
+		for (int i = 0; data && i < count; i++) {
+			GElf_Sym sym;
+			if (!gelf_getsym(data, i, &sym) ||
+					ELF32_ST_TYPE(sym.st_info) != STT_FUNC ||
+					sym.st_value != addr)
+				continue;
+			const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+			if (name && *name) {
+				snprintf(out, size, "%s", name);
+				found = 1;
+				break;
+			}
+		}
+	}
+done:
+	if (elf)
+		elf_end(elf);
+	close(fd);
+	return found;
+}
+
+void
+avr_prof_symbol(
+		void * addr,
+		char * out,
+		size_t size)
+{
+	Dl_info info = { 0 };
+	if (dladdr(addr, &info)) {
+		if (info.dli_sname && info.dli_saddr == addr) {
+			snprintf(out, size, "%s", info.dli_sname);
+			return;
+		}
+		// a static function, or an executable that doesn't export any
+		if (_avr_timer_prof_elf_symbol(info.dli_fname && *info.dli_fname ?
+				info.dli_fname : "/proc/self/exe", (uintptr_t)info.dli_fbase,
+				(uintptr_t)addr, out, size))
+			return;
+	}
+	snprintf(out, size, "%p", addr);
+}
+
+// what 'param' is in the core, if it's in there
+static void
+_avr_timer_prof_param(
+		avr_t * avr,
+		void * param,
+		char * out,
+		size_t size)
+{
+	uint8_t * b = (uint8_t *)avr;
+	if (avr && param == (void *)avr) {
+		snprintf(out, size, "core");
+		return;
+	}
+	if (!avr || !avr->core_size || (uint8_t *)param < b ||
+			(uint8_t *)param >= b + avr->core_size) {
+		snprintf(out, size, "%p", param);
+		return;
+	}
+	// the modules are in the core, the closest one before is the one
+	avr_io_t * best = NULL;
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		if ((void *)io <= param && (!best || io > best))
+			best = io;
+	if (!best) {
+		snprintf(out, size, "core+%d", (int)((uint8_t *)param - b));
+		return;
+	}
+	int index = best->irq_ioctl_get & 0xff;
+	if (index >= '0' && index <= '9')
+		snprintf(out, size, "%s%c", best->kind, index);
+	else
+		snprintf(out, size, "%s", best->kind);
+}
+
+static int
+_avr_timer_prof_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_timer_prof_entry_t * ea = *(const avr_timer_prof_entry_t **)a;
+	const avr_timer_prof_entry_t * eb = *(const avr_timer_prof_entry_t **)b;
+	if (ea->host_ns != eb->host_ns)
+		return ea->host_ns < eb->host_ns ? 1 : -1;
+	return ea->fired < eb->fired ? 1 : ea->fired > eb->fired ? -1 : 0;
+}
+
+void
+avr_timer_prof_report(
+		avr_timer_prof_t * p,
+		FILE * out)
+{
+	avr_timer_prof_entry_t ** e = p->count ? calloc(p->count, sizeof(*e)) : NULL;
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; e && i < p->size; i++)
+		if (p->entry[i].timer)
+			e[count++] = &p->entry[i];
+	qsort(e, count, sizeof(*e), _avr_timer_prof_cmp);
+
+	fprintf(out, "timers: %u\n", count);
+	fprintf(out, "  %-36s %-10s %10s %10s %10s %10s %10s %10s\n",
+			"callback", "param", "registered", "cancelled", "fired",
+			"resched", "catchup", "host_us");
+	for (uint32_t i = 0; i < count; i++) {
+		char name[128], param[32];
+		if (e[i]->name)
+			snprintf(name, sizeof(name), "%s", e[i]->name);
+		else
+			avr_prof_symbol((void *)e[i]->timer, name, sizeof(name));
+		_avr_timer_prof_param(p->avr, e[i]->param, param, sizeof(param));
+		fprintf(out, "  %-36s %-10s %10llu %10llu %10llu %10llu %10llu %10.1f\n",
+				name, param,
+				(unsigned long long)e[i]->registered,
+				(unsigned long long)e[i]->cancelled,
+				(unsigned long long)e[i]->fired,
+				(unsigned long long)e[i]->rescheduled,
+				(unsigned long long)e[i]->catchup,
+				e[i]->host_ns / 1000.0);
+	}
+	free(e);
+}
@@ -0,0 +1,125 @@
+/*
+	sim_timer_prof.h
+
+	Tells which cycle timers the scheduler spends its time on.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_TIMER_PROF_H__
+#define __SIM_TIMER_PROF_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * avr_stats_t only counts the timers fired, all of them together; this
+ * keeps the counts per timer, that is per callback and parameter, and the
+ * host time spent in each callback. Like the stats, nothing is counted
+ * unless avr->timer_prof is set, the scheduler only tests that pointer.
+ *
+ * 'catchup' is the calls the timer took to catch up with the core, when
+ * it was late by more than its own period: the extra turns of the firing
+ * loop for a plain timer, the extra periods in one call for a batch one.
+ * A timer that's catching up a lot is one that would do better batched.
+ *
+ * The report names the callbacks: the name given with
+ * avr_timer_prof_name() if any, else the symbol, from dladdr() or, for
+ * the static functions dladdr() can't see, the ELF symbol table of the
+ * object it's in. A parameter inside the core is named after the io
+ * module it's in, like "timer0", or "core" for the core itself.
+ */
+typedef struct avr_timer_prof_entry_t {
+	avr_cycle_timer_t	timer;
+	void *				param;
+	const char *		name;		// given one, or NULL
+	uint64_t			registered;
+	uint64_t			cancelled;	// while pending
+	uint64_t			fired;		// callbacks called
+	uint64_t			rescheduled;	// ... that asked to be called again
+	uint64_t			catchup;
+	uint64_t			host_ns;	// spent in the callback
+} avr_timer_prof_entry_t;
+
+typedef struct avr_timer_prof_t {
+	struct avr_t *		avr;
+	avr_timer_prof_entry_t * entry;	// hashed on timer and param
+	uint32_t			size;		// a power of 2
+	uint32_t			count;
+	struct {
+		avr_cycle_timer_t	timer;
+		const char *		name;
+	} * names;						// from avr_timer_prof_name()
+	uint32_t			name_count;
+} avr_timer_prof_t;
+
+// starts counting, returns zero if all is well
+int
+avr_timer_prof_init(
+		struct avr_t * avr,
+		avr_timer_prof_t * p );
+// stops counting, and frees the counters
+void
+avr_timer_prof_stop(
+		avr_timer_prof_t * p );
+/*
+ * Names the callback 'timer' in the report, whatever its parameter;
+ * 'name' isn't copied. Returns 0, or -1 if out of memory
+ */
+int
+avr_timer_prof_name(
+		avr_timer_prof_t * p,
+		avr_cycle_timer_t timer,
+		const char * name );
+// prints a line per timer, the costliest first
+void
+avr_timer_prof_report(
+		avr_timer_prof_t * p,
+		FILE * out );
+
+/*
+ * The hook in sim_cycle_timers.c, only called with avr->timer_prof set.
+ * Returns the entry of the timer, made if it's new, or NULL if out of
+ * memory
+ */
+avr_timer_prof_entry_t *
+avr_timer_prof_get(
+		avr_timer_prof_t * p,
+		avr_cycle_timer_t timer,
+		void * param );
+
+/*
+ * Shared with the irq profiler, sim_irq_prof.h: the host clock, in ns,
+ * and the name of the function at 'addr', as the reports give it, or its
+ * address
+ */
+uint64_t
+avr_prof_now(void);
+void
+avr_prof_symbol(
+		void * addr,
+		char * out,
+		size_t size );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TIMER_PROF_H__ */
@@ -0,0 +1,1140 @@
+/*
+	sim_trace_file.c
+
+	Compact binary execution trace of long runs, compressed and written
+	from another thread, and its reader.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <zlib.h>
+#include "sim_trace_file.h"
+#include "sim_core.h"
+#include "sim_aio.h"
+
+/*
+ * Record tags. An edge has the words from the start of the run to its
+ * last instruction in its low 6 bits, and a write the zigzag distance to
+ * the guessed address; 63 means the value is 63 plus the LEB128 after.
+ */
+enum {
+	AVR_TF_EDGE		= 0x00,	// words, zigzag target words, cycles
+	AVR_TF_WRITE	= 0x40,	// distance, value
+	AVR_TF_REGS		= 0x80,	// mask, the values
+	AVR_TF_IRQ		= 0x81,	// words, vector, cycles
+	AVR_TF_STOP		= 0x82,	// words, cycles
+	AVR_TF_SYNC		= 0x83,	// flag, pc(4), cycle(8), waddr(2), registers
+	AVR_TF_FLASH	= 0x84,	// offset, size, bytes
+};
+
+// room past AVR_TRACE_FILE_BLOCK for the records started before it
+#define AVR_TF_SLACK		8192
+#define AVR_TF_FLASH_CHUNK	4096
+// blocks between the core and the thread, a power of two
+#define AVR_TF_BLOCKS		8
+// in the raw size of a frame, it has flash records
+#define AVR_TF_FRAME_FLASH	(1u << 31)
+
+/*
+ * Same as the VCD writer thread, but with whole blocks: the core fills the
+ * one at 'head', and moves on when the thread is done with the next one.
+ */
+typedef struct avr_trace_file_writer_t {
+	FILE *			out;
+	uint8_t *		block[AVR_TF_BLOCKS];
+	uint32_t		len[AVR_TF_BLOCKS];	// with AVR_TF_FRAME_FLASH
+	z_stream		z;
+	uint8_t *		frame;
+	uint32_t		frame_size;
+	uint64_t		written;
+	int				error;
+	char			pad0[64];	// keeps 'head' and 'tail' apart
+	uint32_t		head;
+	char			pad1[64];
+	uint32_t		tail;
+	uint32_t		stop;
+	pthread_t		thread;
+} avr_trace_file_writer_t;
+
+static void
+_avr_tf_put_le(
+		uint8_t * dst,
+		uint64_t v,
+		int bytes)
+{
+	while (bytes--) {
+		*dst++ = v;
+		v >>= 8;
+	}
+}
+
+static uint64_t
+_avr_tf_get_le(
+		const uint8_t * src,
+		int bytes)
+{
+	uint64_t v = 0;
+	while (bytes--)
+		v = (v << 8) | src[bytes];
+	return v;
+}
+
+static inline uint8_t *
+_avr_tf_uleb(
+		uint8_t * p,
+		uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline uint8_t *
+_avr_tf_small(
+		uint8_t * p,
+		uint8_t tag,
+		uint64_t v)
+{
+	if (v < 63) {
+		*p++ = tag | v;
+		return p;
+	}
+	*p++ = tag | 63;
+	return _avr_tf_uleb(p, v - 63);
+}
+
+static inline uint64_t
+_avr_tf_zigzag(
+		int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static void *
+_avr_trace_file_thread(
+		void * param)
+{
+	avr_trace_file_writer_t * w = param;
+
+	for (;;) {
+		uint32_t tail = w->tail;
+		if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail) {
+			// the last block was pushed before 'stop' was set
+			if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail)
+					break;
+				continue;
+			}
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = 200000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		uint32_t i = tail & (AVR_TF_BLOCKS - 1);
+		deflateReset(&w->z);
+		w->z.next_in = w->block[i];
+		w->z.avail_in = w->len[i] & ~AVR_TF_FRAME_FLASH;
+		w->z.next_out = w->frame + 8;
+		w->z.avail_out = w->frame_size - 8;
+		if (deflate(&w->z, Z_FINISH) != Z_STREAM_END)
+			w->error = 1;
+		else {
+			uint32_t size = w->z.total_out;
+			_avr_tf_put_le(w->frame, size, 4);
+			_avr_tf_put_le(w->frame + 4, w->len[i], 4);
+			if (fwrite(w->frame, 1, size + 8, w->out) != size + 8)
+				w->error = 1;
+			w->written += size + 8;
+		}
+		__atomic_store_n(&w->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void
+_avr_trace_file_sync_rec(
+		avr_trace_file_t * t,
+		uint8_t flag)
+{
+	uint8_t * p = t->buf + t->len;
+	*p++ = AVR_TF_SYNC;
+	*p++ = flag;
+	_avr_tf_put_le(p, t->pc, 4);
+	_avr_tf_put_le(p + 4, t->cycle, 8);
+	_avr_tf_put_le(p + 12, t->waddr, 2);
+	memcpy(p + 14, t->reg, 32);
+	t->len = p + 14 + 32 - t->buf;
+}
+
+// hands the block to the thread
+static uint32_t
+_avr_trace_file_hand(
+		avr_trace_file_t * t)
+{
+	avr_trace_file_writer_t * w = t->writer;
+	uint32_t head = w->head;
+
+	w->len[head & (AVR_TF_BLOCKS - 1)] = t->len |
+			(t->flashed ? AVR_TF_FRAME_FLASH : 0);
+	t->raw += t->len;
+	t->flashed = 0;
+	__atomic_store_n(&w->head, ++head, __ATOMIC_RELEASE);
+	return head;
+}
+
+// ... and starts the next one
+static void
+_avr_trace_file_push(
+		avr_trace_file_t * t)
+{
+	avr_trace_file_writer_t * w = t->writer;
+	uint32_t head = _avr_trace_file_hand(t);
+	while (head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= AVR_TF_BLOCKS) {
+		t->stalls++;
+		sched_yield();
+	}
+	t->buf = w->block[head & (AVR_TF_BLOCKS - 1)];
+	t->len = 0;
+	// each frame can be read on its own, given the flash
+	_avr_trace_file_sync_rec(t, 0);
+}
+
+static inline void
+_avr_trace_file_reserve(
+		avr_trace_file_t * t)
+{
+	if (t->len >= AVR_TRACE_FILE_BLOCK)
+		_avr_trace_file_push(t);
+}
+
+static void
+_avr_trace_file_regs(
+		avr_trace_file_t * t)
+{
+	const uint8_t * r = t->avr->data;
+
+	if (!memcmp(r, t->reg, 32))
+		return;
+	uint8_t * p = t->buf + t->len;
+	uint8_t * v = p + 6;	// after the tag and the longest mask
+	uint32_t mask = 0;
+	for (int i = 0; i < 32; i++)
+		if (r[i] != t->reg[i]) {
+			mask |= 1u << i;
+			*v++ = r[i];
+		}
+	*p++ = AVR_TF_REGS;
+	uint8_t * m = _avr_tf_uleb(p, mask);
+	uint32_t count = v - (p + 5);
+	memmove(m, p + 5, count);
+	t->len = m + count - t->buf;
+	memcpy(t->reg, r, 32);
+}
+
+// words from the start of the run to 'pc', or a new run if it's behind
+static uint32_t
+_avr_trace_file_words(
+		avr_trace_file_t * t,
+		avr_flashaddr_t pc)
+{
+	if (pc < t->pc || t->avr->cycle < t->cycle) {
+		// the pc, or the cycle, was changed behind the flow
+		uint8_t * p = t->buf + t->len;
+		*p++ = AVR_TF_STOP;
+		*p++ = 0;
+		*p++ = 0;
+		t->len = p - t->buf;
+		t->pc = pc;
+		t->cycle = t->avr->cycle;
+		memcpy(t->reg, t->avr->data, 32);
+		_avr_trace_file_sync_rec(t, 1);
+	}
+	return (pc - t->pc) >> 1;
+}
+
+void
+avr_trace_file_edge(
+		avr_trace_file_t * t,
+		avr_flashaddr_t from,
+		avr_flashaddr_t to)
+{
+	avr_t * avr = t->avr;
+
+	// not taken, the reader gets there by itself
+	if (to == from + (avr_flash_is_wide(avr, from) ? 4 : 2))
+		return;
+	_avr_trace_file_reserve(t);
+	if (t->flags & AVR_TRACE_FILE_REGS)
+		_avr_trace_file_regs(t);
+	uint32_t words = _avr_trace_file_words(t, from);
+	uint8_t * p = t->buf + t->len;
+	p = _avr_tf_small(p, AVR_TF_EDGE, words);
+	p = _avr_tf_uleb(p, _avr_tf_zigzag(((int64_t)to - (int64_t)from) / 2));
+	p = _avr_tf_uleb(p, avr->cycle - t->cycle);
+	t->len = p - t->buf;
+	t->pc = to;
+	t->cycle = avr->cycle;
+	t->edges++;
+}
+
+void
+avr_trace_file_irq(
+		avr_trace_file_t * t,
+		uint8_t vector)
+{
+	avr_t * avr = t->avr;
+
+	_avr_trace_file_reserve(t);
+	if (t->flags & AVR_TRACE_FILE_REGS)
+		_avr_trace_file_regs(t);
+	uint32_t words = _avr_trace_file_words(t, avr->pc);
+	uint8_t * p = t->buf + t->len;
+	*p++ = AVR_TF_IRQ;
+	p = _avr_tf_uleb(p, words);
+	p = _avr_tf_uleb(p, vector);
+	p = _avr_tf_uleb(p, avr->cycle - t->cycle);
+	t->len = p - t->buf;
+	t->pc = vector * avr->vector_size;
+	t->cycle = avr->cycle;
+	t->irqs++;
+}
+
+void
+avr_trace_file_write(
+		avr_trace_file_t * t,
+		uint16_t addr,
+		uint8_t v)
+{
+	// the IO modules store their registers through here too
+	if (!(t->flags & AVR_TRACE_FILE_WRITES) || addr < 32 + t->avr->io_count)
+		return;
+	_avr_trace_file_reserve(t);
+	uint8_t * p = t->buf + t->len;
+	p = _avr_tf_small(p, AVR_TF_WRITE,
+			_avr_tf_zigzag((int32_t)addr - (int32_t)t->waddr));
+	*p++ = v;
+	t->len = p - t->buf;
+	t->waddr = addr + 1;
+	t->writes++;
+}
+
+void
+avr_trace_file_flash(
+		avr_trace_file_t * t,
+		avr_flashaddr_t addr,
+		uint32_t size)
+{
+	avr_t * avr = t->avr;
+
+	if (addr > avr->flashend)
+		return;
+	if (size > avr->flashend + 1 - addr)
+		size = avr->flashend + 1 - addr;
+	while (size) {
+		uint32_t n = size < AVR_TF_FLASH_CHUNK ? size : AVR_TF_FLASH_CHUNK;
+		_avr_trace_file_reserve(t);
+		uint8_t * p = t->buf + t->len;
+		*p++ = AVR_TF_FLASH;
+		p = _avr_tf_uleb(p, addr);
+		p = _avr_tf_uleb(p, n);
+		memcpy(p, avr->flash + addr, n);
+		t->len = p + n - t->buf;
+		t->flashed = 1;
+		addr += n;
+		size -= n;
+	}
+}
+
+void
+avr_trace_file_break(
+		avr_trace_file_t * t)
+{
+	avr_t * avr = t->avr;
+
+	_avr_trace_file_reserve(t);
+	if (t->flags & AVR_TRACE_FILE_REGS)
+		_avr_trace_file_regs(t);
+	uint32_t words = _avr_trace_file_words(t, avr->pc);
+	uint8_t * p = t->buf + t->len;
+	*p++ = AVR_TF_STOP;
+	p = _avr_tf_uleb(p, words);
+	p = _avr_tf_uleb(p, avr->cycle - t->cycle);
+	t->len = p - t->buf;
+	t->pc = avr->pc;
+	t->cycle = avr->cycle;
+}
+
+void
+avr_trace_file_sync(
+		avr_trace_file_t * t)
+{
+	avr_t * avr = t->avr;
+
+	_avr_trace_file_reserve(t);
+	t->pc = avr->pc;
+	t->cycle = avr->cycle;
+	memcpy(t->reg, avr->data, 32);
+	_avr_trace_file_sync_rec(t, 1);
+}
+
+static void
+_avr_trace_file_free(
+		avr_trace_file_writer_t * w)
+{
+	for (int i = 0; i < AVR_TF_BLOCKS; i++)
+		free(w->block[i]);
+	free(w->frame);
+	deflateEnd(&w->z);
+	free(w);
+}
+
+int
+avr_trace_file_start(
+		avr_t * avr,
+		avr_trace_file_t * t,
+		const char * filename,
+		uint32_t flags)
+{
+	if (avr->trace_file) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: already tracing\n");
+		return -1;
+	}
+	avr_trace_file_writer_t * w = calloc(1, sizeof(*w));
+	if (!w || deflateInit2(&w->z, Z_BEST_SPEED, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: can't start the compressor\n");
+		free(w);
+		return -1;
+	}
+	w->frame_size = deflateBound(&w->z, AVR_TRACE_FILE_BLOCK + AVR_TF_SLACK) + 8;
+	w->frame = malloc(w->frame_size);
+	int fail = !w->frame;
+	for (int i = 0; i < AVR_TF_BLOCKS; i++)
+		fail |= !(w->block[i] = malloc(AVR_TRACE_FILE_BLOCK + AVR_TF_SLACK));
+	if (fail) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: can't allocate the blocks\n");
+		_avr_trace_file_free(w);
+		return -1;
+	}
+	w->out = avr_aio_fopen(filename, "wb");
+	if (!w->out) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: can't create %s\n", filename);
+		_avr_trace_file_free(w);
+		return -1;
+	}
+	avr_trace_file_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AVR_TRACE_FILE_MAGIC, sizeof(h.magic));
+	_avr_tf_put_le((uint8_t *)&h.version, AVR_TRACE_FILE_VERSION, 4);
+	_avr_tf_put_le((uint8_t *)&h.flags, flags, 4);
+	_avr_tf_put_le((uint8_t *)&h.frequency, avr->frequency, 4);
+	_avr_tf_put_le((uint8_t *)&h.flash_size, avr->flashend + 1, 4);
+	_avr_tf_put_le((uint8_t *)&h.vector_size, avr->vector_size, 4);
+	strncpy(h.mmcu, avr->mmcu, sizeof(h.mmcu) - 1);
+	if (fwrite(&h, sizeof(h), 1, w->out) != 1 ||
+			pthread_create(&w->thread, NULL, _avr_trace_file_thread, w)) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: can't start writing %s\n", filename);
+		fclose(w->out);
+		_avr_trace_file_free(w);
+		return -1;
+	}
+	memset(t, 0, sizeof(*t));
+	t->avr = avr;
+	t->flags = flags;
+	t->writer = w;
+	t->buf = w->block[0];
+	t->pc = avr->pc;
+	t->cycle = avr->cycle;
+	memcpy(t->reg, avr->data, 32);
+	_avr_trace_file_sync_rec(t, 0);
+	avr_trace_file_flash(t, 0, avr->flashend + 1);
+	avr->trace_file = t;
+	return 0;
+}
+
+int
+avr_trace_file_stop(
+		avr_trace_file_t * t)
+{
+	avr_t * avr = t->avr;
+
+	if (!avr)
+		return 0;
+	avr_trace_file_break(t);
+	avr->trace_file = NULL;
+
+	avr_trace_file_writer_t * w = t->writer;
+	_avr_trace_file_hand(t);
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(w->thread, NULL);
+	int res = w->error;
+	if (fclose(w->out))
+		res = 1;
+	t->written = w->written + sizeof(avr_trace_file_header_t);
+	_avr_trace_file_free(w);
+	t->writer = NULL;
+	t->buf = NULL;
+	t->avr = NULL;
+	if (res)
+		AVR_LOG(avr, LOG_ERROR, "TRACE: the trace file is incomplete\n");
+	AVR_LOG(avr, LOG_TRACE, "TRACE: %" PRIu64 " edges, %" PRIu64 " interrupts, "
+			"%" PRIu64 " writes, %" PRIu64 " bytes (%" PRIu64 " raw), waited "
+			"%" PRIu64 " times for the thread\n",
+			t->edges, t->irqs, t->writes, t->written, t->raw, t->stalls);
+	return res ? -1 : 0;
+}
+
+/*
+ * Reader
+ */
+typedef struct avr_trace_reader_t {
+	FILE *				f;
+	avr_trace_file_header_t h;
+	uint8_t *			flash;
+	uint32_t			flash_size;
+	uint32_t			vector_size;
+	z_stream			z;
+	uint8_t *			in;
+	uint32_t			in_size;
+	uint32_t			in_len, in_raw;	// of the frame in 'in'
+	int					in_ready;		// not inflated yet
+	uint8_t *			raw;
+	uint32_t			len, pos;
+	// the state, as the recorder had it
+	avr_flashaddr_t		pc;
+	avr_cycle_count_t	cycle;
+	uint16_t			waddr;
+	uint8_t				reg[32];
+	// the run being returned
+	int					walking;
+	avr_flashaddr_t		end;		// first address not run
+	avr_flashaddr_t		next;		// and where the flow goes then
+	avr_cycle_count_t	end_cycle;
+	int					end_exact;	// 'end_cycle' is the last instruction's
+	// then its writes and registers, then 'close' if there's one
+	int					draining;
+	avr_trace_event_t *	pending;
+	uint32_t			pending_count, pending_size, pending_pos;
+	int					has_close;
+	avr_trace_event_t	close;
+} avr_trace_reader_t;
+
+static int
+_avr_trace_reader_is_wide(
+		uint16_t opcode)
+{
+	uint16_t o = opcode & 0xfc0f;
+	return o == 0x9200 || o == 0x9000 || (o & 0xfffc) == 0x940c;
+}
+
+static uint16_t
+_avr_trace_reader_word(
+		avr_trace_reader_t * r,
+		avr_flashaddr_t pc)
+{
+	if (pc + 1 >= r->flash_size)
+		return 0xffff;
+	return r->flash[pc] | (r->flash[pc + 1] << 8);
+}
+
+// reads the next frame, without inflating it yet
+static int
+_avr_trace_reader_peek(
+		avr_trace_reader_t * r)
+{
+	if (r->in_ready)
+		return 1;
+	uint8_t h[8];
+	size_t got = fread(h, 1, sizeof(h), r->f);
+	if (got == 0)
+		return 0;
+	if (got != sizeof(h))
+		return -1;
+	r->in_len = _avr_tf_get_le(h, 4);
+	r->in_raw = _avr_tf_get_le(h + 4, 4);
+	if (r->in_len > r->in_size ||
+			(r->in_raw & ~AVR_TF_FRAME_FLASH) > AVR_TRACE_FILE_BLOCK + AVR_TF_SLACK ||
+			fread(r->in, 1, r->in_len, r->f) != r->in_len)
+		return -1;
+	r->in_ready = 1;
+	return 1;
+}
+
+static int
+_avr_trace_reader_frame(
+		avr_trace_reader_t * r)
+{
+	int res = _avr_trace_reader_peek(r);
+	if (res <= 0)
+		return res;
+	uint32_t len = r->in_raw & ~AVR_TF_FRAME_FLASH;
+	r->in_ready = 0;
+	inflateReset(&r->z);
+	r->z.next_in = r->in;
+	r->z.avail_in = r->in_len;
+	r->z.next_out = r->raw;
+	r->z.avail_out = len;
+	if (inflate(&r->z, Z_FINISH) != Z_STREAM_END || r->z.total_out != len)
+		return -1;
+	r->len = len;
+	r->pos = 0;
+	return 1;
+}
+
+static int
+_avr_trace_reader_bytes(
+		avr_trace_reader_t * r,
+		uint8_t * dst,
+		uint32_t count)
+{
+	if (r->len - r->pos < count)
+		return -1;
+	memcpy(dst, r->raw + r->pos, count);
+	r->pos += count;
+	return 0;
+}
+
+static int
+_avr_trace_reader_uleb(
+		avr_trace_reader_t * r,
+		uint64_t * v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (r->pos >= r->len)
+			return -1;
+		uint8_t b = r->raw[r->pos++];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+static int
+_avr_trace_reader_small(
+		avr_trace_reader_t * r,
+		uint8_t tag,
+		uint64_t * v)
+{
+	*v = tag & 63;
+	if (*v < 63)
+		return 0;
+	uint64_t more;
+	if (_avr_trace_reader_uleb(r, &more))
+		return -1;
+	*v += more;
+	return 0;
+}
+
+static int64_t
+_avr_tf_unzigzag(
+		uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static avr_trace_event_t *
+_avr_trace_reader_pend(
+		avr_trace_reader_t * r,
+		uint8_t kind)
+{
+	if (r->pending_count == r->pending_size) {
+		uint32_t size = r->pending_size ? r->pending_size * 2 : 64;
+		avr_trace_event_t * p = realloc(r->pending, size * sizeof(*p));
+		if (!p)
+			return NULL;
+		r->pending = p;
+		r->pending_size = size;
+	}
+	avr_trace_event_t * e = r->pending + r->pending_count++;
+	memset(e, 0, sizeof(*e));
+	e->kind = kind;
+	e->pc = r->pc;
+	e->cycle = r->cycle;
+	return e;
+}
+
+// the run from r->pc stops before 'end', and its writes follow it
+static void
+_avr_trace_reader_run(
+		avr_trace_reader_t * r,
+		avr_flashaddr_t end,
+		avr_flashaddr_t next,
+		avr_cycle_count_t cycle,
+		int exact)
+{
+	r->walking = 1;
+	r->end = end;
+	r->next = next;
+	r->end_cycle = cycle;
+	r->end_exact = exact;
+	r->pending_pos = 0;
+}
+
+// parses one record, returns 1 when it has an event for the caller
+static int
+_avr_trace_reader_record(
+		avr_trace_reader_t * r,
+		avr_trace_event_t * e)
+{
+	uint8_t tag = r->raw[r->pos++];
+	uint64_t a, b, c;
+
+	if (tag < AVR_TF_WRITE) {
+		if (_avr_trace_reader_small(r, tag, &a) ||
+				_avr_trace_reader_uleb(r, &b) || _avr_trace_reader_uleb(r, &c))
+			return -1;
+		avr_flashaddr_t from = r->pc + (a << 1);
+		int len = _avr_trace_reader_is_wide(_avr_trace_reader_word(r, from)) ? 4 : 2;
+		_avr_trace_reader_run(r, from + len,
+				from + _avr_tf_unzigzag(b) * 2, r->cycle + c, 1);
+		return 0;
+	}
+	if (tag < AVR_TF_REGS) {
+		uint8_t v;
+		if (_avr_trace_reader_small(r, tag, &a) ||
+				_avr_trace_reader_bytes(r, &v, 1))
+			return -1;
+		avr_trace_event_t * w = _avr_trace_reader_pend(r, AVR_TRACE_EV_WRITE);
+		if (!w)
+			return -1;
+		w->addr = r->waddr + _avr_tf_unzigzag(a);
+		w->value = v;
+		r->waddr = w->addr + 1;
+		return 0;
+	}
+	switch (tag) {
+		case AVR_TF_REGS: {
+			if (_avr_trace_reader_uleb(r, &a) || a >> 32)
+				return -1;
+			for (int i = 0; i < 32; i++)
+				if (((a >> i) & 1) && _avr_trace_reader_bytes(r, r->reg + i, 1))
+					return -1;
+			avr_trace_event_t * g = _avr_trace_reader_pend(r, AVR_TRACE_EV_REGS);
+			if (!g)
+				return -1;
+			g->mask = a;
+			memcpy(g->reg, r->reg, 32);
+		}	return 0;
+		case AVR_TF_IRQ:
+		case AVR_TF_STOP: {
+			b = 0;
+			if (_avr_trace_reader_uleb(r, &a) ||
+					(tag == AVR_TF_IRQ && _avr_trace_reader_uleb(r, &b)) ||
+					_avr_trace_reader_uleb(r, &c))
+				return -1;
+			avr_flashaddr_t end = r->pc + (a << 1);
+			memset(&r->close, 0, sizeof(r->close));
+			r->close.cycle = r->cycle + c;
+			if (tag == AVR_TF_IRQ) {
+				r->close.kind = AVR_TRACE_EV_IRQ;
+				r->close.vector = b;
+				r->close.pc = b * r->vector_size;
+			} else {
+				r->close.kind = AVR_TRACE_EV_STOP;
+				r->close.pc = end;
+			}
+			r->has_close = 1;
+			_avr_trace_reader_run(r, end, r->close.pc, r->close.cycle, 0);
+		}	return 0;
+		case AVR_TF_SYNC: {
+			uint8_t s[1 + 4 + 8 + 2];
+			if (_avr_trace_reader_bytes(r, s, sizeof(s)) ||
+					_avr_trace_reader_bytes(r, r->reg, 32))
+				return -1;
+			r->pc = _avr_tf_get_le(s + 1, 4);
+			r->cycle = _avr_tf_get_le(s + 5, 8);
+			r->waddr = _avr_tf_get_le(s + 13, 2);
+			if (!s[0])	// start of a frame, nothing happened
+				return 0;
+			memset(e, 0, sizeof(*e));
+			e->kind = AVR_TRACE_EV_SYNC;
+			e->pc = r->pc;
+			e->cycle = r->cycle;
+			memcpy(e->reg, r->reg, 32);
+		}	return 1;
+		case AVR_TF_FLASH: {
+			if (_avr_trace_reader_uleb(r, &a) || _avr_trace_reader_uleb(r, &b) ||
+					a > r->flash_size || b > r->flash_size - a)
+				return -1;
+			if (_avr_trace_reader_bytes(r, r->flash + a, b))
+				return -1;
+		}	return 0;
+	}
+	return -1;
+}
+
+int
+avr_trace_reader_next(
+		avr_trace_reader_t * r,
+		avr_trace_event_t * e)
+{
+	for (;;) {
+		if (r->walking) {
+			if (r->pc < r->end) {
+				memset(e, 0, sizeof(*e));
+				e->kind = AVR_TRACE_EV_INSN;
+				e->pc = r->pc;
+				e->opcode[0] = _avr_trace_reader_word(r, r->pc);
+				e->opcode[1] = 0xffff;
+				int len = 2;
+				if (_avr_trace_reader_is_wide(e->opcode[0])) {
+					e->opcode[1] = _avr_trace_reader_word(r, r->pc + 2);
+					len = 4;
+				}
+				r->pc += len;
+				if (r->pc == r->end && r->end_exact) {
+					e->exact = 1;
+					e->cycle = r->end_cycle;
+				} else
+					e->cycle = r->cycle;
+				return 1;
+			}
+			// ran past the end, the trace doesn't match the flash
+			if (r->pc != r->end)
+				return -1;
+			r->walking = 0;
+			r->draining = 1;
+			r->pc = r->next;
+			r->cycle = r->end_cycle;
+		}
+		if (r->draining) {
+			if (r->pending_pos < r->pending_count) {
+				*e = r->pending[r->pending_pos++];
+				e->cycle = r->cycle;
+				return 1;
+			}
+			r->pending_count = r->pending_pos = 0;
+			r->draining = 0;
+			if (r->has_close) {
+				r->has_close = 0;
+				*e = r->close;
+				return 1;
+			}
+		}
+		if (r->pos >= r->len) {
+			int res = _avr_trace_reader_frame(r);
+			if (res <= 0)
+				return res;
+			continue;
+		}
+		int res = _avr_trace_reader_record(r, e);
+		if (res)
+			return res;
+	}
+}
+
+avr_trace_reader_t *
+avr_trace_reader_open(
+		const char * filename)
+{
+	avr_trace_reader_t * r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->f = fopen(filename, "rb");
+	if (!r->f) {
+		AVR_LOG(NULL, LOG_ERROR, "TRACE: can't open %s: %s\n",
+				filename, strerror(errno));
+		free(r);
+		return NULL;
+	}
+	if (fread(&r->h, sizeof(r->h), 1, r->f) != 1 ||
+			memcmp(r->h.magic, AVR_TRACE_FILE_MAGIC, sizeof(r->h.magic)) ||
+			_avr_tf_get_le((uint8_t *)&r->h.version, 4) != AVR_TRACE_FILE_VERSION) {
+		AVR_LOG(NULL, LOG_ERROR, "TRACE: %s: not a simavr trace file\n",
+				filename);
+		goto fail;
+	}
+	r->flash_size = _avr_tf_get_le((uint8_t *)&r->h.flash_size, 4);
+	r->vector_size = _avr_tf_get_le((uint8_t *)&r->h.vector_size, 4);
+	r->in_size = compressBound(AVR_TRACE_FILE_BLOCK + AVR_TF_SLACK) + 64;
+	if (!r->flash_size || r->flash_size > (8 << 20) ||
+			!(r->flash = malloc(r->flash_size)) ||
+			!(r->in = malloc(r->in_size)) ||
+			!(r->raw = malloc(AVR_TRACE_FILE_BLOCK + AVR_TF_SLACK)) ||
+			inflateInit2(&r->z, -15) != Z_OK) {
+		AVR_LOG(NULL, LOG_ERROR, "TRACE: %s: can't allocate the reader\n",
+				filename);
+		goto fail;
+	}
+	memset(r->flash, 0xff, r->flash_size);
+	return r;
+fail:
+	fclose(r->f);
+	free(r->flash);
+	free(r->in);
+	free(r->raw);
+	free(r);
+	return NULL;
+}
+
+const avr_trace_file_header_t *
+avr_trace_reader_header(
+		avr_trace_reader_t * r)
+{
+	return &r->h;
+}
+
+void
+avr_trace_reader_close(
+		avr_trace_reader_t * r)
+{
+	if (!r)
+		return;
+	inflateEnd(&r->z);
+	fclose(r->f);
+	free(r->flash);
+	free(r->in);
+	free(r->raw);
+	free(r->pending);
+	free(r);
+}
+
+void
+avr_trace_event_print(
+		const avr_trace_event_t * e,
+		FILE * out)
+{
+	switch (e->kind) {
+		case AVR_TRACE_EV_INSN:
+			if (e->exact)
+				fprintf(out, "%12" PRI_avr_cycle_count, e->cycle);
+			else
+				fprintf(out, "%12s", "");
+			fprintf(out, " %05x: %04x", e->pc, e->opcode[0]);
+			if (e->opcode[1] != 0xffff)
+				fprintf(out, " %04x", e->opcode[1]);
+			fprintf(out, "\n");
+			break;
+		case AVR_TRACE_EV_WRITE:
+			fprintf(out, "%12s write %04x = %02x\n", "", e->addr, e->value);
+			break;
+		case AVR_TRACE_EV_REGS:
+			fprintf(out, "%12s", "");
+			for (int i = 0; i < 32; i++)
+				if ((e->mask >> i) & 1)
+					fprintf(out, " r%d=%02x", i, e->reg[i]);
+			fprintf(out, "\n");
+			break;
+		case AVR_TRACE_EV_IRQ:
+			fprintf(out, "%12" PRI_avr_cycle_count " irq %d -> %05x\n",
+					e->cycle, e->vector, e->pc);
+			break;
+		case AVR_TRACE_EV_STOP:
+			fprintf(out, "%12" PRI_avr_cycle_count " stop before %05x\n",
+					e->cycle, e->pc);
+			break;
+		case AVR_TRACE_EV_SYNC:
+			fprintf(out, "%12" PRI_avr_cycle_count " start at %05x\n",
+					e->cycle, e->pc);
+			break;
+	}
+}
+
+int
+avr_trace_file_text(
+		const char * filename,
+		FILE * out)
+{
+	avr_trace_reader_t * r = avr_trace_reader_open(filename);
+	if (!r)
+		return -1;
+	uint32_t flags = _avr_tf_get_le((uint8_t *)&r->h.flags, 4);
+	fprintf(out, "# %.16s at %u Hz, %u bytes of flash%s%s\n", r->h.mmcu,
+			(uint32_t)_avr_tf_get_le((uint8_t *)&r->h.frequency, 4),
+			r->flash_size,
+			flags & AVR_TRACE_FILE_REGS ? ", registers" : "",
+			flags & AVR_TRACE_FILE_WRITES ? ", writes" : "");
+	avr_trace_event_t e;
+	int res;
+	while ((res = avr_trace_reader_next(r, &e)) > 0)
+		avr_trace_event_print(&e, out);
+	if (res < 0)
+		AVR_LOG(NULL, LOG_ERROR,
+				"TRACE: %s: damaged, or doesn't match its flash\n", filename);
+	avr_trace_reader_close(r);
+	return res < 0 ? -1 : 0;
+}
+
+// events before the difference that are printed with it
+#define AVR_TRACE_DIFF_CONTEXT	8
+
+// the next event of a kind both traces have
+static int
+_avr_trace_diff_next(
+		avr_trace_reader_t * r,
+		avr_trace_event_t * e,
+		uint32_t skip)
+{
+	int res;
+	while ((res = avr_trace_reader_next(r, e)) > 0 && ((skip >> e->kind) & 1))
+		;
+	return res;
+}
+
+// between two frames, and nothing left of the previous one to return
+static int
+_avr_trace_reader_between(
+		avr_trace_reader_t * r)
+{
+	return r->pos >= r->len && !r->walking && !r->draining;
+}
+
+/*
+ * Skips the frames that are the same, byte for byte, in both traces: the
+ * next one starts with the whole state anyway. The writes of the run in
+ * progress are dropped with them, they were the same too. Only the frames
+ * with flash records are read, the flash is needed to walk the next ones.
+ */
+static int
+_avr_trace_diff_skip(
+		avr_trace_reader_t * a,
+		avr_trace_reader_t * b)
+{
+	while (_avr_trace_reader_between(a) && _avr_trace_reader_between(b)) {
+		int pa = _avr_trace_reader_peek(a), pb = _avr_trace_reader_peek(b);
+		if (pa < 0 || pb < 0)
+			return -1;
+		if (!pa || !pb || a->in_len != b->in_len || a->in_raw != b->in_raw ||
+				(a->in_raw & AVR_TF_FRAME_FLASH) ||
+				memcmp(a->in, b->in, a->in_len))
+			break;
+		a->in_ready = b->in_ready = 0;
+		a->pending_count = b->pending_count = 0;
+	}
+	return 0;
+}
+
+static int
+_avr_trace_event_same(
+		const avr_trace_event_t * a,
+		const avr_trace_event_t * b)
+{
+	if (a->kind != b->kind)
+		return 0;
+	switch (a->kind) {
+		case AVR_TRACE_EV_INSN:
+			return a->pc == b->pc && a->opcode[0] == b->opcode[0] &&
+					a->opcode[1] == b->opcode[1] &&
+					(!a->exact || !b->exact || a->cycle == b->cycle);
+		case AVR_TRACE_EV_WRITE:
+			return a->addr == b->addr && a->value == b->value;
+		case AVR_TRACE_EV_REGS:
+			return a->mask == b->mask && !memcmp(a->reg, b->reg, 32);
+		case AVR_TRACE_EV_IRQ:
+			return a->vector == b->vector && a->cycle == b->cycle;
+		case AVR_TRACE_EV_SYNC:
+			if (memcmp(a->reg, b->reg, 32))
+				return 0;
+			// fall through
+		case AVR_TRACE_EV_STOP:
+			return a->pc == b->pc && a->cycle == b->cycle;
+	}
+	return 0;
+}
+
+int
+avr_trace_file_diff(
+		const char * file_a,
+		const char * file_b,
+		FILE * out)
+{
+	avr_trace_reader_t * a = avr_trace_reader_open(file_a);
+	avr_trace_reader_t * b = avr_trace_reader_open(file_b);
+	int res = -1;
+
+	if (!a || !b)
+		goto done;
+	// only what both recorded is compared
+	uint32_t flags = _avr_tf_get_le((uint8_t *)&a->h.flags, 4) &
+			_avr_tf_get_le((uint8_t *)&b->h.flags, 4);
+	uint32_t skip = 0;
+	if (!(flags & AVR_TRACE_FILE_REGS))
+		skip |= 1 << AVR_TRACE_EV_REGS;
+	if (!(flags & AVR_TRACE_FILE_WRITES))
+		skip |= 1 << AVR_TRACE_EV_WRITE;
+
+	avr_trace_event_t context[AVR_TRACE_DIFF_CONTEXT];
+	avr_trace_event_t ea, eb;
+	uint64_t events = 0;
+	avr_cycle_count_t agreed = 0;	// last cycle known to be the same
+	int ra, rb;
+	for (;;) {
+		if (_avr_trace_diff_skip(a, b)) {
+			AVR_LOG(NULL, LOG_ERROR, "TRACE: %s or %s: damaged\n",
+					file_a, file_b);
+			goto done;
+		}
+		ra = _avr_trace_diff_next(a, &ea, skip);
+		rb = _avr_trace_diff_next(b, &eb, skip);
+		if (ra < 0 || rb < 0) {
+			AVR_LOG(NULL, LOG_ERROR,
+					"TRACE: %s: damaged, or doesn't match its flash\n",
+					ra < 0 ? file_a : file_b);
+			goto done;
+		}
+		if (!ra && !rb) {
+			fprintf(out, "no difference\n");
+			res = 0;
+			goto done;
+		}
+		if (ra && rb && _avr_trace_event_same(&ea, &eb)) {
+			if (ea.kind != AVR_TRACE_EV_INSN || ea.exact)
+				agreed = ea.cycle;
+			context[events++ % AVR_TRACE_DIFF_CONTEXT] = ea;
+			continue;
+		}
+		break;
+	}
+	fprintf(out, "first difference, the same up to cycle %" PRI_avr_cycle_count
+			"\n", agreed);
+	uint64_t n = events < AVR_TRACE_DIFF_CONTEXT ? events : AVR_TRACE_DIFF_CONTEXT;
+	for (uint64_t i = events - n; i < events; i++) {
+		fprintf(out, "   ");
+		avr_trace_event_print(&context[i % AVR_TRACE_DIFF_CONTEXT], out);
+	}
+	const char * name[2] = { file_a, file_b };
+	avr_trace_event_t * e[2] = { &ea, &eb };
+	avr_trace_reader_t * r[2] = { a, b };
+	int more[2] = { ra, rb };
+	for (int i = 0; i < 2; i++) {
+		fprintf(out, "%s: %s\n", i ? "b" : "a", name[i]);
+		// and a few more, where the flows part
+		for (int count = 0; more[i] > 0 && count < 4; count++) {
+			fprintf(out, "   ");
+			avr_trace_event_print(e[i], out);
+			more[i] = _avr_trace_diff_next(r[i], e[i], skip);
+		}
+		if (!more[i])
+			fprintf(out, "   (end)\n");
+	}
+	res = 1;
+done:
+	avr_trace_reader_close(a);
+	avr_trace_reader_close(b);
+	return res;
+}
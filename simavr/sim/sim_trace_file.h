@@ -0,0 +1,228 @@
+/*
+	sim_trace_file.h
+
+	Compact binary execution trace of long runs, compressed and written
+	from another thread, and its reader.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_TRACE_FILE_H__
+#define __SIM_TRACE_FILE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unlike sim_trace_ring.h, nothing is recorded per instruction: the file
+ * starts with a copy of the flash, and then only has where the flow left
+ * the straight line, with the cycle it did so at. The reader walks the
+ * flash from one of these to the next to give back every instruction.
+ * That only needs the core's control flow events, so any engine runs at
+ * close to its own speed; the loop shortcuts of the predecoded engines are
+ * off while tracing, they'd hide iterations.
+ *
+ * Optionally, the registers that changed are recorded at the end of each
+ * straight run of code, and the SRAM writes as they happen (the stack
+ * included, but not the IO registers).
+ *
+ * The records are a byte of tag and a few LEB128 deltas: from the start
+ * of the run, to the target, the cycles since the previous one, the
+ * address since the last write. They are put in blocks of about
+ * AVR_TRACE_FILE_BLOCK bytes, each deflated by the writer thread and
+ * written as a frame, that starts with the state the reader needs to
+ * carry on from there.
+ *
+ * File: the avr_trace_file_header_t, then frames of a little endian 32 bits
+ * compressed size, 32 bits raw size, and the raw deflate data. The top bit
+ * of the raw size is set when the frame has flash records.
+ */
+#define AVR_TRACE_FILE_MAGIC	"SIMAVRTF"
+#define AVR_TRACE_FILE_VERSION	1
+#define AVR_TRACE_FILE_BLOCK	(64 * 1024)
+
+enum {
+	AVR_TRACE_FILE_REGS		= (1 << 0),	// the registers that changed, per run
+	AVR_TRACE_FILE_WRITES	= (1 << 1),	// the SRAM writes
+};
+
+// all little endian
+typedef struct avr_trace_file_header_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	flags;		// AVR_TRACE_FILE_*
+	uint32_t	frequency;
+	uint32_t	flash_size;	// bytes
+	uint32_t	vector_size;	// bytes per interrupt vector
+	char		mmcu[16];
+} avr_trace_file_header_t;
+
+struct avr_trace_file_writer_t;
+
+typedef struct avr_trace_file_t {
+	struct avr_t *		avr;
+	uint32_t			flags;
+	// what the reader will have, as of the last record
+	avr_flashaddr_t		pc;			// start of the current run
+	avr_cycle_count_t	cycle;
+	uint16_t			waddr;		// address of the next write, guessed
+	uint8_t				reg[32];
+	// block being filled
+	uint8_t *			buf;
+	uint32_t			len;
+	int					flashed;	// it has flash records
+	struct avr_trace_file_writer_t * writer;
+	// totals
+	uint64_t			edges, irqs, writes;
+	uint64_t			raw, written;	// bytes, before and after deflate
+	uint64_t			stalls;		// times the core waited for the thread
+} avr_trace_file_t;
+
+/*
+ * Starts tracing 'avr' into 'filename', with the AVR_TRACE_FILE_* 'flags'.
+ * Returns zero if all is well
+ */
+int
+avr_trace_file_start(
+		struct avr_t * avr,
+		avr_trace_file_t * t,
+		const char * filename,
+		uint32_t flags );
+/*
+ * Stops tracing, and waits for the thread to write the last block.
+ * Returns zero if all of the trace was written
+ */
+int
+avr_trace_file_stop(
+		avr_trace_file_t * t );
+
+// called by the core, when the flow goes from 'from' to 'to'
+void
+avr_trace_file_edge(
+		avr_trace_file_t * t,
+		avr_flashaddr_t from,
+		avr_flashaddr_t to );
+// ... when an interrupt is taken, before the return address is pushed
+void
+avr_trace_file_irq(
+		avr_trace_file_t * t,
+		uint8_t vector );
+// ... for a write to SRAM
+void
+avr_trace_file_write(
+		avr_trace_file_t * t,
+		uint16_t addr,
+		uint8_t v );
+// ... when the flash changes
+void
+avr_trace_file_flash(
+		avr_trace_file_t * t,
+		avr_flashaddr_t addr,
+		uint32_t size );
+/*
+ * ... when the pc is changed behind the flow, as on a reset: the flow
+ * stopped at the current pc (that instruction didn't run) and, after
+ * avr_trace_file_sync(), starts again from the new pc and registers
+ */
+void
+avr_trace_file_break(
+		avr_trace_file_t * t );
+void
+avr_trace_file_sync(
+		avr_trace_file_t * t );
+
+/*
+ * Reading. Events come one instruction at a time; the writes and register
+ * changes of a straight run of code come after its last instruction, as
+ * the trace doesn't tell which instruction of the run did them.
+ */
+enum {
+	AVR_TRACE_EV_INSN = 0,	// 'pc' ran, at 'cycle' if 'exact'
+	AVR_TRACE_EV_WRITE,		// 'addr' was set to 'value'
+	AVR_TRACE_EV_REGS,		// 'mask' registers changed, 'reg' has them all
+	AVR_TRACE_EV_IRQ,		// 'vector' was taken at 'cycle', to 'pc'
+	AVR_TRACE_EV_STOP,		// the flow stopped before 'pc', at 'cycle'
+	AVR_TRACE_EV_SYNC,		// and starts again from 'pc', with 'reg'
+};
+
+typedef struct avr_trace_event_t {
+	uint8_t				kind;		// AVR_TRACE_EV_*
+	uint8_t				exact;		// 'cycle' is that of this instruction
+	uint8_t				vector;
+	uint8_t				value;
+	avr_flashaddr_t		pc;
+	uint16_t			opcode[2];	// second word only for 32 bits ones
+	uint16_t			addr;
+	uint32_t			mask;
+	avr_cycle_count_t	cycle;		// otherwise, the last one known
+	uint8_t				reg[32];
+} avr_trace_event_t;
+
+struct avr_trace_reader_t;
+
+// returns NULL, with a message on stderr, if it can't be read
+struct avr_trace_reader_t *
+avr_trace_reader_open(
+		const char * filename );
+// 1 for an event, 0 at the end of the trace, -1 if it's damaged
+int
+avr_trace_reader_next(
+		struct avr_trace_reader_t * r,
+		avr_trace_event_t * e );
+const avr_trace_file_header_t *
+avr_trace_reader_header(
+		struct avr_trace_reader_t * r );
+void
+avr_trace_reader_close(
+		struct avr_trace_reader_t * r );
+
+// one line of text for 'e'
+void
+avr_trace_event_print(
+		const avr_trace_event_t * e,
+		FILE * out );
+/*
+ * Writes the trace in 'filename' as text, one line per event.
+ * Returns zero if all of it could be read
+ */
+int
+avr_trace_file_text(
+		const char * filename,
+		FILE * out );
+
+/*
+ * Reads the two traces side by side, and prints where they first differ:
+ * in the flow, a cycle, a register or a write (those last two only when
+ * both traces have them), with the events leading there. A cycle is only
+ * known at the end of each run of code, so the difference is somewhere
+ * after the last cycle that was still the same.
+ * Returns 0 if they are the same, 1 if they differ, -1 if one can't be read
+ */
+int
+avr_trace_file_diff(
+		const char * file_a,
+		const char * file_b,
+		FILE * out );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TRACE_FILE_H__ */
@@ -0,0 +1,173 @@
+/*
+	sim_trace_ring.c
+
+	Binary instruction trace into a ring buffer, switchable at run time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_trace_ring.h"
+#include "sim_core.h"
+
+// records printed when the core crashes, if there's no file to dump to
+#define AVR_TRACE_RING_CRASH_PRINT	16
+
+static void
+_avr_trace_ring_run(
+		avr_t * avr)
+{
+	avr_trace_ring_t * t = avr->trace_ring;
+
+	if (avr->state != cpu_Running) {
+		t->run(avr);
+		return;
+	}
+	avr_trace_rec_t * rec = t->rec + (t->count & t->mask);
+	uint8_t r[32];
+	memcpy(r, avr->data, 32);
+	rec->cycle = avr->cycle;
+	rec->pc = avr->pc;
+	rec->opcode[0] = rec->opcode[1] = 0xffff;
+	if (avr->pc + 1 <= avr->flashend)
+		rec->opcode[0] = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+	if (avr->pc + 3 <= avr->flashend)
+		rec->opcode[1] = avr->flash[avr->pc + 2] | (avr->flash[avr->pc + 3] << 8);
+
+	// one instruction at a time, whatever the cycle timers would allow
+	avr->run_cycle_count = 1;
+	t->run(avr);
+
+	READ_SREG_INTO(avr, rec->sreg);
+	rec->sp = _avr_sp_get(avr);
+	rec->count = 0;
+	rec->flags = 0;
+	for (int i = 0; i < 32; i++) {
+		if (r[i] == avr->data[i])
+			continue;
+		if (rec->count == AVR_TRACE_RING_REGS) {
+			rec->flags |= AVR_TRACE_RING_OVERFLOW;
+			break;
+		}
+		rec->reg[rec->count].r = i;
+		rec->reg[rec->count].v = avr->data[i];
+		rec->count++;
+	}
+	t->count++;
+	if (t->stream && !(t->count & t->mask))
+		fwrite(t->rec, sizeof(*t->rec), t->mask + 1, t->stream);
+}
+
+int
+avr_trace_ring_init(
+		avr_t * avr,
+		avr_trace_ring_t * t,
+		uint32_t size)
+{
+	if (avr->trace_ring) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: already tracing\n");
+		return -1;
+	}
+	if (!size || size > (1 << 30)) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: invalid ring size %u\n", size);
+		return -1;
+	}
+	uint32_t s = 1;
+	while (s < size)
+		s <<= 1;
+	memset(t, 0, sizeof(*t));
+	t->rec = calloc(s, sizeof(*t->rec));
+	if (!t->rec) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: can't allocate %u records\n", s);
+		return -1;
+	}
+	t->avr = avr;
+	t->mask = s - 1;
+	t->run = avr->run;
+	avr->run = _avr_trace_ring_run;
+	avr->trace_ring = t;
+	return 0;
+}
+
+void
+avr_trace_ring_stop(
+		avr_trace_ring_t * t)
+{
+	avr_t * avr = t->avr;
+
+	if (!avr)
+		return;
+	if (t->stream && (t->count & t->mask))
+		fwrite(t->rec, sizeof(*t->rec), t->count & t->mask, t->stream);
+	if (avr->run == _avr_trace_ring_run)
+		avr->run = t->run;
+	avr->trace_ring = NULL;
+	free(t->rec);
+	t->rec = NULL;
+	t->avr = NULL;
+}
+
+void
+avr_trace_ring_dump(
+		avr_trace_ring_t * t,
+		FILE * out)
+{
+	uint64_t size = t->mask + 1;
+
+	if (t->count <= size) {
+		fwrite(t->rec, sizeof(*t->rec), t->count, out);
+		return;
+	}
+	uint32_t start = t->count & t->mask;
+	fwrite(t->rec + start, sizeof(*t->rec), size - start, out);
+	fwrite(t->rec, sizeof(*t->rec), start, out);
+}
+
+void
+avr_trace_ring_print(
+		avr_trace_ring_t * t,
+		FILE * out,
+		uint32_t last)
+{
+	uint64_t n = t->count < t->mask + 1ULL ? t->count : t->mask + 1ULL;
+
+	if (last > n)
+		last = n;
+	for (uint64_t i = t->count - last; i < t->count; i++) {
+		avr_trace_rec_t * rec = t->rec + (i & t->mask);
+		fprintf(out, "%" PRI_avr_cycle_count " %04x: %04x sreg %02x sp %04x",
+				(avr_cycle_count_t)rec->cycle, rec->pc, rec->opcode[0],
+				rec->sreg, rec->sp);
+		for (int r = 0; r < rec->count; r++)
+			fprintf(out, " r%d=%02x", rec->reg[r].r, rec->reg[r].v);
+		fprintf(out, "%s\n", rec->flags & AVR_TRACE_RING_OVERFLOW ? " ..." : "");
+	}
+}
+
+void
+avr_trace_ring_crashed(
+		avr_trace_ring_t * t)
+{
+	if (t->crash) {
+		avr_trace_ring_dump(t, t->crash);
+		fflush(t->crash);
+	} else
+		avr_trace_ring_print(t, stdout, AVR_TRACE_RING_CRASH_PRINT);
+	if (t->stream)
+		fflush(t->stream);
+}
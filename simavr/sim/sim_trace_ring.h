@@ -0,0 +1,107 @@
+/*
+	sim_trace_ring.h
+
+	Binary instruction trace into a ring buffer, switchable at run time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_TRACE_RING_H__
+#define __SIM_TRACE_RING_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unlike CONFIG_SIMAVR_TRACE, this doesn't need a special build, and costs
+ * nothing until it's started: it installs its own run callback in front of
+ * the current one, and makes it execute one instruction per call.
+ * Each instruction gets a fixed size record in the ring, so the last
+ * 'size' of them are always available; they are dumped when the core
+ * crashes, and can also be streamed to a file as the ring fills up.
+ *
+ * The records are written as is (host endianness) by the dump functions.
+ */
+#define AVR_TRACE_RING_REGS		4	// register deltas per record
+
+enum {
+	AVR_TRACE_RING_OVERFLOW		= (1 << 0),	// more registers changed
+};
+
+typedef struct avr_trace_rec_t {
+	uint64_t	cycle;		// when the instruction started
+	uint32_t	pc;
+	uint16_t	opcode[2];	// second word only used by 32 bits ones
+	uint8_t		sreg;		// after the instruction
+	uint8_t		count;		// valid entries in reg[]
+	uint8_t		flags;
+	uint8_t		pad;
+	uint16_t	sp;			// after the instruction
+	uint16_t	pad2;
+	struct {
+		uint8_t		r, v;	// register, and its new value
+	} reg[AVR_TRACE_RING_REGS];
+} avr_trace_rec_t;
+
+typedef struct avr_trace_ring_t {
+	struct avr_t *		avr;
+	avr_run_t			run;		// the run callback we're in front of
+	avr_trace_rec_t *	rec;
+	uint32_t			mask;		// ring size - 1
+	uint64_t			count;		// records written since the start
+	// optional, gets the records every time the ring wraps
+	FILE *				stream;
+	// optional, gets the ring content when the core crashes. When not
+	// set, the last few records are printed instead
+	FILE *				crash;
+} avr_trace_ring_t;
+
+// starts tracing into a ring of at least 'size' records (rounded up to a
+// power of two), returns zero if all is well
+int
+avr_trace_ring_init(
+		struct avr_t * avr,
+		avr_trace_ring_t * t,
+		uint32_t size );
+// stops tracing, flushes the stream and frees the ring
+void
+avr_trace_ring_stop(
+		avr_trace_ring_t * t );
+// writes the records in the ring to 'out', oldest first
+void
+avr_trace_ring_dump(
+		avr_trace_ring_t * t,
+		FILE * out );
+// prints the 'last' records in text form
+void
+avr_trace_ring_print(
+		avr_trace_ring_t * t,
+		FILE * out,
+		uint32_t last );
+// called by avr_sadly_crashed()
+void
+avr_trace_ring_crashed(
+		avr_trace_ring_t * t );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TRACE_RING_H__ */
@@ -0,0 +1,112 @@
+/*
+	sim_var.c
+
+	Firmware variables, resolved from the ELF symbols once, then read and
+	written directly in the core's memory.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "sim_var.h"
+#include "avr_eeprom.h"
+
+#if ELF_SYMBOLS
+// the linker puts the data and the EEPROM at these offsets, see sim_elf.h
+static void
+_avr_var_from_symbol(
+		const avr_symbol_t * s,
+		avr_var_t * v )
+{
+	v->size = s->size;
+	if (s->addr >= AVR_SEGMENT_OFFSET_EEPROM) {
+		v->space = AVR_VAR_EEPROM;
+		v->addr = s->addr - AVR_SEGMENT_OFFSET_EEPROM;
+	} else if (s->addr >= AVR_SEGMENT_OFFSET_DATA) {
+		v->space = AVR_VAR_DATA;
+		v->addr = s->addr - AVR_SEGMENT_OFFSET_DATA;
+	} else {
+		v->space = AVR_VAR_FLASH;
+		v->addr = s->addr;
+	}
+}
+
+int
+avr_var_find_all(
+		elf_firmware_t * firmware,
+		const char ** name,
+		int count,
+		avr_var_t * v )
+{
+	int missing = count;
+
+	for (int i = 0; i < count; i++)
+		memset(&v[i], 0, sizeof(v[i]));
+	if (elf_firmware_symbols(firmware))
+		return missing;
+	for (uint32_t si = 0; si < firmware->symbolcount && missing; si++) {
+		const avr_symbol_t * s = firmware->symbol[si];
+		for (int i = 0; i < count; i++) {
+			if (v[i].space || strcmp(s->symbol, name[i]))
+				continue;
+			_avr_var_from_symbol(s, &v[i]);
+			missing--;
+		}
+	}
+	return missing;
+}
+
+int
+avr_var_find(
+		elf_firmware_t * firmware,
+		const char * name,
+		avr_var_t * v )
+{
+	return avr_var_find_all(firmware, &name, 1, v) ? -1 : 0;
+}
+#endif
+
+uint8_t *
+_avr_var_eeprom(
+		avr_t * avr,
+		const avr_var_t * v )
+{
+	avr_eeprom_desc_t ee = { .offset = v->addr, .size = v->size };
+
+	if (v->addr > 0xffff || avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee))
+		return NULL;
+	return ee.ee;
+}
+
+uint32_t
+avr_var_read_all(
+		avr_t * avr,
+		const avr_var_t * v,
+		int count,
+		uint8_t * dst )
+{
+	uint8_t * start = dst;
+
+	for (int i = 0; i < count; i++) {
+		const uint8_t * src = avr_var_ptr(avr, &v[i]);
+		if (src)
+			memcpy(dst, src, v[i].size);
+		else
+			memset(dst, 0, v[i].size);
+		dst += v[i].size;
+	}
+	return dst - start;
+}
@@ -0,0 +1,204 @@
+/*
+	sim_var.h
+
+	Firmware variables, resolved from the ELF symbols once, then read and
+	written directly in the core's memory.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_VAR_H__
+#define __SIM_VAR_H__
+
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_snapshot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A harness finds the variables it looks at once, by name, and keeps the
+ * handles: where the variable is, in which memory, and how large it is.
+ * Going through a handle is then a bounds check and a copy from (or to)
+ * avr->data, nothing is looked up anymore:
+ *
+ *	avr_var_t count;
+ *	avr_var_find(&firmware, "tick_count", &count);
+ *	...
+ *	if (avr_var_get(avr, &count) > 1000)
+ *		avr_var_set(avr, &count, 0);
+ *
+ * The handles only depend on the firmware, they work for all the cores
+ * running it. The flash is read only; the data writes are marked for the
+ * snapshots (see avr_dirty_mark()).
+ */
+enum {
+	AVR_VAR_NONE = 0,	// not found
+	AVR_VAR_DATA,
+	AVR_VAR_FLASH,
+	AVR_VAR_EEPROM,
+};
+
+typedef struct avr_var_t {
+	uint8_t		space;		// AVR_VAR_*
+	uint32_t	addr;		// in that memory
+	uint32_t	size;		// in bytes, zero if the ELF doesn't say
+} avr_var_t;
+
+#if ELF_SYMBOLS
+/*
+ * Resolves the symbol 'name', reading the symbols of the firmware if they
+ * aren't yet. Returns 0, or -1 if there's no such symbol.
+ */
+int
+avr_var_find(
+		elf_firmware_t * firmware,
+		const char * name,
+		avr_var_t * v );
+/*
+ * Same for 'count' names, in one pass over the symbols. Returns how many
+ * weren't found, their handles are AVR_VAR_NONE.
+ */
+int
+avr_var_find_all(
+		elf_firmware_t * firmware,
+		const char ** name,
+		int count,
+		avr_var_t * v );
+#endif
+
+// the EEPROM is behind its module, see avr_var_ptr()
+uint8_t *
+_avr_var_eeprom(
+		avr_t * avr,
+		const avr_var_t * v );
+
+// where the variable is in 'avr', NULL if it's not all there
+static inline uint8_t *
+avr_var_ptr(
+		avr_t * avr,
+		const avr_var_t * v )
+{
+	switch (v->space) {
+		case AVR_VAR_DATA:
+			return v->addr + v->size <= (uint32_t)avr->ramend + 1 ?
+					avr->data + v->addr : NULL;
+		case AVR_VAR_FLASH:
+			return v->addr + v->size <= avr->flashend + 1 ?
+					avr->flash + v->addr : NULL;
+		case AVR_VAR_EEPROM:
+			return _avr_var_eeprom(avr, v);
+	}
+	return NULL;
+}
+
+// the value of a variable of up to 8 bytes, little endian; 0 if it's not there
+static inline uint64_t
+avr_var_get(
+		avr_t * avr,
+		const avr_var_t * v )
+{
+	const uint8_t * src = avr_var_ptr(avr, v);
+	uint64_t res = 0;
+
+	if (!src)
+		return 0;
+	for (int i = (v->size > 8 ? 8 : v->size) - 1; i >= 0; i--)
+		res = (res << 8) | src[i];
+	return res;
+}
+
+// same, sign extended from its size
+static inline int64_t
+avr_var_get_signed(
+		avr_t * avr,
+		const avr_var_t * v )
+{
+	uint64_t res = avr_var_get(avr, v);
+
+	if (v->size && v->size < 8 && (res >> (v->size * 8 - 1)))
+		res |= ~0ULL << (v->size * 8);
+	return res;
+}
+
+// the size of the variable isn't checked, 'src' has to have it all
+static inline int
+avr_var_write(
+		avr_t * avr,
+		const avr_var_t * v,
+		const void * src )
+{
+	uint8_t * dst = v->space == AVR_VAR_FLASH ? NULL : avr_var_ptr(avr, v);
+
+	if (!dst)
+		return -1;
+	memcpy(dst, src, v->size);
+	if (v->space == AVR_VAR_DATA)
+		avr_dirty_mark(avr->dirty.data, v->addr, v->size);
+	return 0;
+}
+
+// 'value' goes in the variable's size, up to 8 bytes. Returns 0, or -1
+static inline int
+avr_var_set(
+		avr_t * avr,
+		const avr_var_t * v,
+		uint64_t value )
+{
+	uint8_t b[8];
+
+	if (v->size > 8)
+		return -1;
+	for (int i = 0; i < 8; i++, value >>= 8)
+		b[i] = value;
+	return avr_var_write(avr, v, b);
+}
+
+// copies the whole variable to 'dst'. Returns 0, or -1
+static inline int
+avr_var_read(
+		avr_t * avr,
+		const avr_var_t * v,
+		void * dst )
+{
+	const uint8_t * src = avr_var_ptr(avr, v);
+
+	if (!src)
+		return -1;
+	memcpy(dst, src, v->size);
+	return 0;
+}
+
+/*
+ * Copies 'count' variables one after the other in 'dst', which is to
+ * hold the sum of their sizes; the ones that aren't there are zeroes.
+ * Returns the number of bytes copied.
+ */
+uint32_t
+avr_var_read_all(
+		avr_t * avr,
+		const avr_var_t * v,
+		int count,
+		uint8_t * dst );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_VAR_H__ */
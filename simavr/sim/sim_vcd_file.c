@@ -27,21 +27,151 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdarg.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
 #include "sim_vcd_file.h"
 #include "sim_avr.h"
 #include "sim_time.h"
-#include "sim_utils.h"
+#include "sim_aio.h"
+#include "avr_ioport.h"
 
 DEFINE_FIFO(avr_vcd_log_t, avr_vcd_fifo);
 
 #define strdupa(__s) strcpy(alloca(strlen(__s)+1), __s)
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * The ring between the core and the writer thread: the core only moves
+ * 'head', and the thread 'tail'. When the ring is full the core waits for
+ * the thread, nothing is dropped.
+ */
+typedef struct avr_vcd_writer_t {
+	avr_vcd_t *		vcd;
+	avr_vcd_log_t *	ring;
+	uint32_t		mask;
+	char			pad0[64];	// keeps 'head' and 'tail' apart
+	uint32_t		head;
+	uint64_t		stalls;		// times the core waited for room
+	char			pad1[64];
+	uint32_t		tail;
+	uint32_t		stop;
+	int				running;
+	pthread_t		thread;
+} avr_vcd_writer_t;
+
+// a gzip member is written for about each AVR_VCD_BLOCK_SIZE of text
+#define AVR_VCD_BLOCK_SIZE	(64 * 1024)
+// gzip header, with the extra field, and trailer
+#define AVR_VCD_BLOCK_HEAD	28
+#define AVR_VCD_BLOCK_TAIL	8
+
+/*
+ * With a .gz filename the file is a series of gzip members, so it reads
+ * like any other .vcd.gz. Each one starts at a timestamp, and has it in
+ * an "SV" extra field of its header with the size of the member, so a
+ * reader can hop from one member to the next to find a time without
+ * inflating them.
+ */
+typedef struct avr_vcd_block_t {
+	z_stream		z;
+	uint64_t		when;		// first timestamp of the member
+	uint32_t		len;
+	uint8_t			text[AVR_VCD_BLOCK_SIZE + 8192];
+	uint8_t *		out;		// the compressed member
+	uint32_t		out_size;
+	int				error;
+} avr_vcd_block_t;
+
+// an irq that triggers the capture when it gets 'value'
+typedef struct avr_vcd_match_t {
+	struct avr_vcd_match_t * next;
+	avr_vcd_t *		vcd;
+	avr_irq_t *		irq;
+	uint32_t		value;
+} avr_vcd_match_t;
+
+// the state of a sampled signal, see avr_vcd_set_sampling()
+typedef struct avr_vcd_sample_t {
+	avr_vcd_t *			vcd;
+	uint32_t			index;		// of the signal
+	int					mode;
+	avr_cycle_count_t	period;		// in cycles
+	// the last change the signal got
+	uint32_t			value;
+	uint8_t				floating;
+	// what's written, and the window of MINMAX
+	uint32_t			written;
+	uint8_t				written_floating;
+	uint8_t				window;		// 'min' and 'max' are valid
+	uint8_t				max_last;	// the max came after the min
+	uint32_t			min, max;
+	uint8_t				pending;	// 'second' to write at mid window
+	uint32_t			second;
+	uint8_t				phase;		// MINMAX runs on half windows
+} avr_vcd_sample_t;
+
+/*
+ * The changes of trigger mode, oldest at 'tail'. Out of a window, the
+ * oldest ones are dropped when it's full; in one, they are all in the
+ * window, so it's written out.
+ */
+typedef struct avr_vcd_capture_t {
+	avr_cycle_count_t	pre, post;
+	avr_vcd_log_t *		ring;
+	uint32_t			mask, tail, count;
+	int					triggered;
+	avr_cycle_count_t	end;		// of the window being written
+	avr_cycle_count_t	written;	// cycle of the last change written
+	uint32_t			windows;
+	avr_vcd_match_t *	match;
+} avr_vcd_capture_t;
+
+static void
+_avr_vcd_match_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param);
+
 static void
 _avr_vcd_notify(
 		struct avr_irq_t * irq,
 		uint32_t value,
 		void * param);
 
+// adds a new zeroed signal to the table, its addresses don't change
+static avr_vcd_signal_t *
+_avr_vcd_new_signal(
+		avr_vcd_t * vcd)
+{
+	if (vcd->signal_count == AVR_VCD_MAX_SIGNALS)
+		return NULL;
+	if (vcd->signal_count == vcd->signal_alloc) {
+		int alloc = vcd->signal_alloc ? vcd->signal_alloc * 2 : 64;
+		avr_vcd_signal_t ** n = realloc(vcd->signal, alloc * sizeof(*n));
+		if (!n)
+			return NULL;
+		vcd->signal = n;
+		vcd->signal_alloc = alloc;
+	}
+	avr_vcd_signal_t * s = calloc(1, sizeof(*s));
+	if (s)
+		vcd->signal[vcd->signal_count++] = s;
+	return s;
+}
+
 int
 avr_vcd_init(
 		struct avr_t * avr,
@@ -57,10 +187,152 @@ avr_vcd_init(
 	return 0;
 }
 
+static inline int
+_avr_vcd_input_blank(
+		char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// skips the blanks, and returns the next word of the file, of 'len' bytes
+static const char *
+_avr_vcd_input_word(
+		const char ** p,
+		const char * end,
+		size_t * len)
+{
+	const char * w = *p;
+
+	while (w < end && _avr_vcd_input_blank(*w))
+		w++;
+	const char * e = w;
+	while (e < end && !_avr_vcd_input_blank(*e))
+		e++;
+	*p = e;
+	*len = e - w;
+	return *len ? w : NULL;
+}
+
+static int
+_avr_vcd_input_is(
+		const char * w,
+		size_t len,
+		const char * keyword)
+{
+	return w && len == strlen(keyword) && !memcmp(w, keyword, len);
+}
+
 /*
- * Parse a VCD 'timing' line. The lines are assumed to be:
- * #<absolute timestamp>[\n][<value x/0/1><signal alias character>|
- * 		b[x/0/1]?<space><signal alias character]+
+ * Maps the "$timescale <1|10|100><s|ms|us|ns|ps|fs> $end" unit of an input
+ * file to usecs, as a multiplier or, for the sub-usec ones, a divisor.
+ * The number and the unit can be one word or two. Returns 0, or -1 for
+ * anything else
+ */
+static int
+_avr_vcd_input_timescale(
+		avr_vcd_t * vcd,
+		const char ** arg,
+		size_t * arg_len,
+		int argc)
+{
+	static const struct {
+		const char * unit;
+		uint64_t fs;
+	} units[] = {
+		{ "s", 1000000000000000ULL }, { "ms", 1000000000000ULL },
+		{ "us", 1000000000ULL }, { "ns", 1000000ULL },
+		{ "ps", 1000ULL }, { "fs", 1ULL },
+	};
+	if (!argc)
+		goto bad;
+	const char * u = arg[0];
+	size_t u_len = arg_len[0];
+	uint64_t cnt = 0;
+	while (u_len && isdigit((unsigned char)*u)) {
+		cnt = (cnt * 10) + (*u++ - '0');
+		u_len--;
+	}
+	if (!u_len && argc > 1) {
+		u = arg[1];
+		u_len = arg_len[1];
+	}
+	if (cnt != 1 && cnt != 10 && cnt != 100)
+		goto bad;
+	for (int i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+		if (!_avr_vcd_input_is(u, u_len, units[i].unit))
+			continue;
+		uint64_t fs = cnt * units[i].fs;
+		vcd->vcd_to_us = fs >= 1000000000ULL ? fs / 1000000000ULL : 1;
+		vcd->vcd_per_us = fs >= 1000000000ULL ? 1 : 1000000000ULL / fs;
+		return 0;
+	}
+bad:
+	AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: unsupported $timescale '%.*s%s%.*s'\n",
+			__func__, argc ? (int)arg_len[0] : 0, argc ? arg[0] : "",
+			argc > 1 ? " " : "", argc > 1 ? (int)arg_len[1] : 0,
+			argc > 1 ? arg[1] : "");
+	return -1;
+}
+
+// the aliases of the signals, hashed, to look the changes up quickly
+typedef struct avr_vcd_alias_t {
+	uint32_t	mask;
+	int *		index;	// signal + 1, 0 for none
+} avr_vcd_alias_t;
+
+static uint32_t
+_avr_vcd_alias_hash(
+		const char * w,
+		size_t len)
+{
+	uint32_t h = 2166136261u;
+	while (len--)
+		h = (h ^ (uint8_t)*w++) * 16777619u;
+	return h;
+}
+
+static int
+_avr_vcd_alias_init(
+		avr_vcd_t * vcd,
+		avr_vcd_alias_t * a)
+{
+	uint32_t size = 16;
+	while (size < vcd->signal_count * 2)
+		size <<= 1;
+	a->mask = size - 1;
+	a->index = calloc(size, sizeof(*a->index));
+	if (!a->index)
+		return -1;
+	for (int i = 0; i < vcd->signal_count; i++) {
+		const char * n = vcd->signal[i]->alias;
+		uint32_t h = _avr_vcd_alias_hash(n, strlen(n)) & a->mask;
+		while (a->index[h])
+			h = (h + 1) & a->mask;
+		a->index[h] = i + 1;
+	}
+	return 0;
+}
+
+static int
+_avr_vcd_alias_find(
+		avr_vcd_t * vcd,
+		avr_vcd_alias_t * a,
+		const char * w,
+		size_t len)
+{
+	uint32_t h = _avr_vcd_alias_hash(w, len) & a->mask;
+	for (; a->index[h]; h = (h + 1) & a->mask) {
+		const char * n = vcd->signal[a->index[h] - 1]->alias;
+		if (!strncmp(n, w, len) && !n[len])
+			return a->index[h] - 1;
+	}
+	return -1;
+}
+
+/*
+ * Parses the changes after the header, they look like:
+ * #<absolute timestamp>[\n][<value x/0/1><signal alias>|
+ * 		b[x/0/1]+<space><signal alias>]+
  * For example:
  * #1234 1' 0$
  * Or:
@@ -68,113 +340,102 @@ avr_vcd_init(
  * b1101x1 '
  * 0$
  *
- * This function tries to handle this transparently, and pushes the
- * signal/values into the FIFO for processing by the timer when
- * convenient.
- * NOTE: Add 'floating' support here. Also, FIX THE TIMING.
+ * Each change is parsed once into the 'input' table, that the timer
+ * walks through. The timestamps are in usecs, rounded down from the
+ * file's $timescale.
  */
-static avr_cycle_count_t
-avr_vcd_input_parse_line(
+static int
+_avr_vcd_input_parse(
 		avr_vcd_t * vcd,
-		argv_p v )
+		const char * p,
+		const char * end)
 {
-	avr_cycle_count_t res = 0;
-	int vi = 0;
-
-	if (v->argc == 0)
-		return res;
-
-	if (v->argv[0][0] == '#') {
-		res = atoll(v->argv[0] + 1) * vcd->vcd_to_us;
-		vcd->start = vcd->period;
-		vcd->period = res;
-		vi++;
-	}
-	for (int i = vi; i < v->argc; i++) {
-		char * a = v->argv[i];
+	avr_vcd_alias_t alias;
+	uint64_t when = 0;
+	uint32_t alloc = 1024;
+	const char * w;
+	size_t len;
+
+	// allocated even if it's empty, it's what tells it's an input
+	vcd->input = malloc(alloc * sizeof(*vcd->input));
+	if (!vcd->input || _avr_vcd_alias_init(vcd, &alias))
+		return -1;
+	while ((w = _avr_vcd_input_word(&p, end, &len))) {
+		if (*w == '#') {
+			uint64_t t = 0;
+			for (size_t i = 1; i < len && isdigit((unsigned char)w[i]); i++)
+				t = (t * 10) + (w[i] - '0');
+			when = t * vcd->vcd_to_us / vcd->vcd_per_us;
+			vcd->input_end = when;
+			continue;
+		}
+		if (*w == '$') {	// $dumpvars, $end etc don't matter here
+			if (_avr_vcd_input_is(w, len, "$comment"))
+				while ((w = _avr_vcd_input_word(&p, end, &len)) &&
+						!_avr_vcd_input_is(w, len, "$end"))
+					;
+			continue;
+		}
 		uint32_t val = 0;
 		int floating = 0;
-		char name = 0;
-		int sigindex = -1;
+		const char * name = NULL;
+		size_t name_len = 0;
 
-		if (*a == 'b')
-			a++;
-		while (*a) {
-			if (*a == 'x') {
+		if (*w == 'b' || *w == 'B' || *w == 'r' || *w == 'R') {
+			for (size_t i = 1; i < len; i++) {
+				char c = w[i] | 0x20;
 				val <<= 1;
-				floating |= (floating << 1) | 1;
-			} else if (*a == '0' || *a == '1') {
-				val = (val << 1) | (*a - '0');
-				floating <<= 1;
-			} else {
-				name = *a;
-				break;
-			}
-			a++;
-		}
-		if (!name && (i < v->argc - 1)) {
-			const char *n = v->argv[i+1];
-			if (strlen(n) == 1) {
-				// we've got a name, it was not attached
-				name = *n;
-				i++;	// skip that one
-			}
-		}
-		if (name) {
-			for (int si = 0;
-						si < vcd->signal_count &&
-						sigindex == -1; si++) {
-				if (vcd->signal[si].alias == name)
-					sigindex = si;
+				if (c == '1')
+					val |= 1;
+				else if (c == 'x' || c == 'z')
+					floating = 1;
 			}
+			name = _avr_vcd_input_word(&p, end, &name_len);
+			if ((*w | 0x20) == 'r')	// real values, not for irqs
+				continue;
+		} else {
+			// a scalar value is a single character, the identifier follows
+			char c = *w | 0x20;
+			val = c == '1';
+			floating = c == 'x' || c == 'z';
+			if (len > 1) {
+				name = w + 1;
+				name_len = len - 1;
+			} else
+				name = _avr_vcd_input_word(&p, end, &name_len);
 		}
+		int sigindex = name ? _avr_vcd_alias_find(vcd, &alias, name, name_len) : -1;
 		if (sigindex == -1) {
-			printf("Signal name '%c' value %x not found\n",
-					name? name : '?', val);
+			AVR_LOG(vcd->avr, LOG_WARNING, "VCD: %s: signal '%.*s' not found\n",
+					__func__, (int)name_len, name ? name : "");
 			continue;
 		}
-		avr_vcd_log_t e = {
-				.when = vcd->period,
+		if (vcd->input_count == alloc) {
+			alloc *= 2;
+			avr_vcd_log_t * n = realloc(vcd->input, alloc * sizeof(*n));
+			if (!n) {
+				free(alias.index);
+				return -1;
+			}
+			vcd->input = n;
+		}
+		vcd->input[vcd->input_count++] = (avr_vcd_log_t) {
+				.when = when,
 				.sigindex = sigindex,
-				.floating = !!floating,
+				.floating = floating,
 				.value = val,
 		};
-	//	printf("%10u %d\n", e.when, e.value);
-		avr_vcd_fifo_write(&vcd->log, e);
-	}
-	return res;
-}
-
-/*
- * Read some signals from the file and fill the FIFO with it, we read
- * a completely arbitrary amount of stuff to fill the FIFO reasonably well
- */
-static int
-avr_vcd_input_read(
-		avr_vcd_t * vcd )
-{
-	char line[1024];
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-	//	printf("%s", line);
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		vcd->input_line = argv_parse(vcd->input_line, line);
-		avr_vcd_input_parse_line(vcd, vcd->input_line);
-		/* stop once the fifo is full enough */
-		if (avr_vcd_fifo_get_read_size(&vcd->log) >= 128)
-			break;
 	}
-	return avr_vcd_fifo_isempty(&vcd->log);
+	free(alias.index);
+	return 0;
 }
 
 /*
- * This is called when we need to change the state of one or more IRQ,
- * so look in the FIFO to know 'our' stamp time, read as much as we can
- * that is still on that same timestamp.
- * When when the FIFO content has too far in the future, re-schedule the
- * timer for that time and shoot of.
- * Also try to top up the FIFO with new read stuff when it's drained
+ * This is called when we need to change the state of one or more IRQ:
+ * all the changes of the current timestamp are raised, and the timer is
+ * re-scheduled for the next one. At the end of the table, it starts
+ * again at the beginning if it's looping, one loop being as long as
+ * the last timestamp of the file.
  */
 static avr_cycle_count_t
 _avr_vcd_input_timer(
@@ -183,42 +444,89 @@ _avr_vcd_input_timer(
 		void * param)
 {
 	avr_vcd_t * vcd = param;
+	const avr_vcd_log_t * log = vcd->input;
 
-	// get some more if needed
-	if (avr_vcd_fifo_get_read_size(&vcd->log) < (vcd->signal_count * 16))
-		avr_vcd_input_read(vcd);
-
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		printf("%s DONE but why are we here?\n", __func__);
+	if (vcd->input_pos >= vcd->input_count)
 		return 0;
+	uint64_t stamp = log[vcd->input_pos].when;
+	uint32_t ports = 0;
+	while (vcd->input_pos < vcd->input_count &&
+			log[vcd->input_pos].when == stamp) {
+		const avr_vcd_log_t * l = log + vcd->input_pos++;
+		avr_vcd_signal_t * s = vcd->signal[l->sigindex];
+		if (s->port && !l->floating) {
+			int pi = s->port - 1;
+			uint8_t mask = 1 << s->bit;
+			vcd->port[pi].mask |= mask;
+			vcd->port[pi].value = (vcd->port[pi].value & ~mask) |
+					(l->value ? mask : 0);
+			s->irq.value = l->value;
+			ports |= 1 << pi;
+		} else if (s->port)	// the port has no floating pins, the irq has
+			avr_raise_irq_float(avr_io_getirq(avr,
+					AVR_IOCTL_IOPORT_GETIRQ(vcd->port[s->port - 1].name), s->bit),
+					l->value, l->floating);
+		else
+			avr_raise_irq_float(&s->irq, l->value, l->floating);
 	}
-
-	avr_vcd_log_t log = avr_vcd_fifo_read_at(&vcd->log, 0);
-	uint64_t stamp = log.when;
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		log = avr_vcd_fifo_read_at(&vcd->log, 0);
-		if (log.when != stamp)	// leave those in the FIFO
-			break;
-		// we already have it
-		avr_vcd_fifo_read_offset(&vcd->log, 1);
-		avr_vcd_signal_p signal = &vcd->signal[log.sigindex];
-		avr_raise_irq_float(&signal->irq, log.value, log.floating);
+	while (ports) {
+		int pi = __builtin_ctz(ports);
+		avr_ioport_pins_t pins = {
+			.mask = vcd->port[pi].mask, .value = vcd->port[pi].value };
+		avr_ioctl(avr, AVR_IOCTL_IOPORT_SET_PINS(vcd->port[pi].name), &pins);
+		vcd->port[pi].mask = 0;
+		ports &= ports - 1;
 	}
-
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		AVR_LOG(vcd->avr, LOG_TRACE,
-				"%s Finished reading, ending simavr\n",
-				vcd->filename);
-		avr->state = cpu_Done;
-		return 0;
+	uint64_t next;
+	if (vcd->input_pos < vcd->input_count)
+		next = log[vcd->input_pos].when;
+	else {
+		vcd->input_loops++;
+		if ((vcd->input_repeat && vcd->input_loops >= vcd->input_repeat) ||
+				!vcd->input_end) {
+			AVR_LOG(vcd->avr, LOG_TRACE,
+					"%s Finished reading, ending simavr\n",
+					vcd->filename);
+			avr->state = cpu_Done;
+			return 0;
+		}
+		vcd->input_pos = 0;
+		next = vcd->input_end + log[0].when;
 	}
-	log = avr_vcd_fifo_read_at(&vcd->log, 0);
-
-	when += avr_usec_to_cycles(avr, log.when - stamp);
+	when += avr_usec_to_cycles(avr, next - stamp);
 
 	return when;
 }
 
+// groups input signal 's' on pin 'bit' of port 'name', returns 0, or -1
+static int
+_avr_vcd_input_port(
+		avr_vcd_t * vcd,
+		avr_vcd_signal_t * s,
+		char name,
+		int bit)
+{
+	int pi = 0;
+	while (pi < vcd->port_count && vcd->port[pi].name != name)
+		pi++;
+	if (pi == AVR_VCD_PORTS)
+		return -1;
+	if (pi == vcd->port_count)
+		vcd->port[vcd->port_count++].name = name;
+	s->port = pi + 1;
+	s->bit = bit;
+	return 0;
+}
+
+void
+avr_vcd_input_repeat(
+		avr_vcd_t * vcd,
+		uint32_t count)
+{
+	vcd->input_repeat = count;
+	vcd->input_loops = 0;
+}
+
 int
 avr_vcd_init_input(
 		struct avr_t * avr,
@@ -228,76 +536,106 @@ avr_vcd_init_input(
 	memset(vcd, 0, sizeof(avr_vcd_t));
 	vcd->avr = avr;
 	vcd->filename = strdup(filename);
+	vcd->input_repeat = 1;
 
-	vcd->input = fopen(vcd->filename, "r");
-	if (!vcd->input) {
+	int fd = open(vcd->filename, O_RDONLY | O_BINARY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st)) {
 		perror(filename);
+		if (fd != -1)
+			close(fd);
 		return -1;
 	}
-	char line[1024];
-	argv_p v = NULL;
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		v = argv_parse(v, line);
+	size_t size = st.st_size;
+	// mapped, the parser only ever looks at it once
+#ifdef __MINGW32__
+	char * map = malloc(size + 1);
+	if (map && read(fd, map, size) != size) {
+		free(map);
+		map = NULL;
+	}
+#else
+	char * map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	if (map == MAP_FAILED)
+		map = NULL;
+#endif
+	close(fd);
+	if (!map && size) {
+		AVR_LOG(avr, LOG_ERROR, "VCD: %s: can't read %s\n", __func__, filename);
+		return -1;
+	}
+	const char * p = map, * end = map + size;
+	const char * w;
+	size_t len;
 
+	vcd->vcd_to_us = vcd->vcd_per_us = 1;
+	int res = 0;
+	while (!res && (w = _avr_vcd_input_word(&p, end, &len))) {
 		// we are done reading headers, got our first timestamp
-		if (v->line[0] == '#') {
-			vcd->start = 0;
-			avr_vcd_input_parse_line(vcd, v);
-			avr_cycle_timer_register_usec(vcd->avr,
-						vcd->period, _avr_vcd_input_timer, vcd);
+		if (*w == '#') {
+			p = w;
 			break;
 		}
-		// ignore multiline stuff
-		if (v->line[0] != '$')
+		// ignore anything that isn't a section
+		if (*w != '$')
 			continue;
-
-		const char * end = !strcmp(v->argv[v->argc - 1], "$end") ?
-								v->argv[v->argc - 1] : NULL;
-		const char *keyword = v->argv[0];
-
-		if (keyword == end)
-			keyword = NULL;
-		if (!keyword)
-			continue;
-
-		if (!strcmp(keyword, "$timescale")) {
-			double cnt = 0;
-			vcd->vcd_to_us = 1;
-			char *si = v->argv[1];
-			while (si && *si && isdigit(*si))
-				cnt = (cnt * 10) + (*si++ - '0');
-			while (*si == ' ')
-				si++;
-			if (!*si)
-				si = v->argv[2];
-		//	if (!strcmp(si, "ns")) // TODO: Check that,
-		//		vcd->vcd_to_us = cnt;
-		//	printf("cnt %dus; unit %s\n", (int)cnt, si);
-		} else if (!strcmp(keyword, "$var")) {
-			const char *name = v->argv[4];
-
-			vcd->signal[vcd->signal_count].alias = v->argv[3][0];
-			vcd->signal[vcd->signal_count].size = atoi(v->argv[2]);
-			strncpy(vcd->signal[vcd->signal_count].name, name,
-						sizeof(vcd->signal[0].name));
-
-			vcd->signal_count++;
+		// the words of the section, up to its $end
+		const char * arg[8];
+		size_t arg_len[8];
+		int argc = 0;
+		const char * a;
+		size_t a_len;
+		while ((a = _avr_vcd_input_word(&p, end, &a_len)) &&
+				!_avr_vcd_input_is(a, a_len, "$end")) {
+			if (argc < 8) {
+				arg[argc] = a;
+				arg_len[argc++] = a_len;
+			}
+		}
+		if (_avr_vcd_input_is(w, len, "$timescale")) {
+			res = _avr_vcd_input_timescale(vcd, arg, arg_len, argc);
+		} else if (_avr_vcd_input_is(w, len, "$var") && argc >= 4) {
+			avr_vcd_signal_t * s = _avr_vcd_new_signal(vcd);
+
+			if (!s) {
+				AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: too many signals\n",
+						__func__);
+				break;
+			}
+			snprintf(s->alias, sizeof(s->alias), "%.*s", (int)arg_len[2], arg[2]);
+			s->size = atoi(arg[1]);
+			snprintf(s->name, sizeof(s->name), "%.*s", (int)arg_len[3], arg[3]);
 		}
 	}
-	// reuse this one
-	vcd->input_line = v;
+	if (!res) {
+		res = _avr_vcd_input_parse(vcd, p, end);
+		if (res)
+			AVR_LOG(avr, LOG_ERROR, "VCD: %s: out of memory\n", __func__);
+	}
+#ifdef __MINGW32__
+	free(map);
+#else
+	if (map)
+		munmap(map, size);
+#endif
+	if (res) {
+		free(vcd->input);
+		vcd->input = NULL;
+		vcd->input_count = 0;
+		return -1;
+	}
+	if (vcd->input_count)
+		avr_cycle_timer_register_usec(vcd->avr,
+					vcd->input[0].when, _avr_vcd_input_timer, vcd);
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%c' %s : size %d\n",
+		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%s' %s : size %d\n",
 				__func__, i,
-				vcd->signal[i].alias, vcd->signal[i].name,
-				vcd->signal[i].size);
+				vcd->signal[i]->alias, vcd->signal[i]->name,
+				vcd->signal[i]->size);
 		/* format is <four-character ioctl>[_<IRQ index>] */
-		if (strlen(vcd->signal[i].name) >= 4) {
-			char *dup = strdupa(vcd->signal[i].name);
+		if (strlen(vcd->signal[i]->name) >= 4) {
+			char *dup = strdupa(vcd->signal[i]->name);
 			char *ioctl = strsep(&dup, "_");
 			int index = 0;
 			if (dup)
@@ -306,23 +644,57 @@ avr_vcd_init_input(
 				uint32_t ioc = AVR_IOCTL_DEF(
 									ioctl[0], ioctl[1], ioctl[2], ioctl[3]);
 				avr_irq_t * irq = avr_io_getirq(vcd->avr, ioc, index);
+				if (irq && vcd->signal[i]->size == 1 &&
+						index < IOPORT_IRQ_PIN_ALL &&
+						ioc == AVR_IOCTL_IOPORT_GETIRQ(ioctl[3]) &&
+						_avr_vcd_input_port(vcd, vcd->signal[i], ioctl[3], index) == 0)
+					continue;
 				if (irq) {
-					vcd->signal[i].irq.flags = IRQ_FLAG_INIT;
-					avr_connect_irq(&vcd->signal[i].irq, irq);
+					vcd->signal[i]->irq.flags = IRQ_FLAG_INIT;
+					avr_connect_irq(&vcd->signal[i]->irq, irq);
 				} else
 					AVR_LOG(vcd->avr, LOG_WARNING,
 							"%s IRQ was not found\n",
-							vcd->signal[i].name);
+							vcd->signal[i]->name);
 				continue;
 			}
 			AVR_LOG(vcd->avr, LOG_WARNING,
 					"%s is an invalid IRQ format\n",
-					vcd->signal[i].name);
+					vcd->signal[i]->name);
 		}
 	}
 	return 0;
 }
 
+size_t
+avr_vcd_memory(
+		avr_vcd_t * vcd)
+{
+	size_t res = vcd->signal_alloc * sizeof(vcd->signal[0]);
+
+	for (int i = 0; i < vcd->signal_count; i++)
+		res += sizeof(*vcd->signal[i]) +
+				(vcd->signal[i]->sample ? sizeof(*vcd->signal[i]->sample) : 0);
+	if (vcd->input) {
+		uint32_t alloc = 1024;
+		while (alloc < vcd->input_count)
+			alloc *= 2;
+		res += alloc * sizeof(*vcd->input);
+	}
+	if (vcd->writer)
+		res += sizeof(*vcd->writer) +
+				(vcd->writer->mask + 1) * sizeof(*vcd->writer->ring);
+	if (vcd->block)
+		res += sizeof(*vcd->block) + vcd->block->out_size;
+	if (vcd->capture) {
+		res += sizeof(*vcd->capture) +
+				(vcd->capture->mask + 1) * sizeof(*vcd->capture->ring);
+		for (avr_vcd_match_t * m = vcd->capture->match; m; m = m->next)
+			res += sizeof(*m);
+	}
+	return res;
+}
+
 void
 avr_vcd_close(
 		avr_vcd_t * vcd)
@@ -331,75 +703,214 @@ avr_vcd_close(
 
 	/* dispose of any link and hooks */
 	for (int i = 0; i < vcd->signal_count; i++) {
-		avr_vcd_signal_t * s = &vcd->signal[i];
+		avr_vcd_signal_t * s = vcd->signal[i];
 
 		avr_free_irq(&s->irq, 1);
+		free(s->sample);
+		free(s);
 	}
+	free(vcd->signal);
+	vcd->signal = NULL;
+	vcd->signal_count = vcd->signal_alloc = 0;
 
 	if (vcd->filename) {
 		free(vcd->filename);
 		vcd->filename = NULL;
 	}
+	if (vcd->writer) {
+		free(vcd->writer->ring);
+		free(vcd->writer);
+		vcd->writer = NULL;
+	}
+	if (vcd->block) {
+		deflateEnd(&vcd->block->z);
+		free(vcd->block->out);
+		free(vcd->block);
+		vcd->block = NULL;
+	}
+	if (vcd->capture) {
+		while (vcd->capture->match) {
+			avr_vcd_match_t * m = vcd->capture->match;
+			vcd->capture->match = m->next;
+			free(m);
+		}
+		free(vcd->capture->ring);
+		free(vcd->capture);
+		vcd->capture = NULL;
+	}
 }
 
+// longest line of text of a change: a timestamp, or a 32 bits value
+#define AVR_VCD_LINE_MAX	(1 + 20 + 1 + 1 + 32 + 1 + 16 + 1)
+
 static char *
-_avr_vcd_get_float_signal_text(
-		avr_vcd_signal_t * s,
-		char * out)
+_avr_vcd_put_u64(
+		char * dst,
+		uint64_t v)
 {
-	char * dst = out;
-
-	if (s->size > 1)
-		*dst++ = 'b';
-
-	for (int i = s->size; i > 0; i--)
-		*dst++ = 'x';
-	if (s->size > 1)
-		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
-	return out;
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	while (n)
+		*dst++ = tmp[--n];
+	return dst;
 }
 
+// writes the line of text of a value of 's', returns the end of it
 static char *
-_avr_vcd_get_signal_text(
+_avr_vcd_put_signal_text(
 		avr_vcd_signal_t * s,
-		char * out,
-		uint32_t value)
+		char * dst,
+		uint32_t value,
+		int floating)
 {
-	char * dst = out;
-
 	if (s->size > 1)
 		*dst++ = 'b';
 
-	for (int i = s->size; i > 0; i--)
-		*dst++ = value & (1 << (i-1)) ? '1' : '0';
+	if (floating)
+		for (int i = s->size; i > 0; i--)
+			*dst++ = 'x';
+	else
+		for (int i = s->size; i > 0; i--)
+			*dst++ = '0' + ((value >> (i-1)) & 1);
 	if (s->size > 1)
 		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
-	return out;
+	for (const char * a = s->alias; *a; a++)
+		*dst++ = *a;
+	*dst++ = '\n';
+	return dst;
 }
 
 static void
-avr_vcd_flush_log(
+_avr_vcd_put_le(
+		uint8_t * dst,
+		uint64_t v,
+		int bytes)
+{
+	while (bytes--) {
+		*dst++ = v;
+		v >>= 8;
+	}
+}
+
+static void
+_avr_vcd_block_flush(
 		avr_vcd_t * vcd)
 {
-#if AVR_VCD_MAX_SIGNALS > 32
-	uint64_t seen = 0;
-#else
-	uint32_t seen = 0;
-#endif
-	uint64_t oldbase = 0;	// make sure it's different
-	char out[48];
+	avr_vcd_block_t * b = vcd->block;
 
-	if (avr_vcd_fifo_isempty(&vcd->log) || !vcd->output)
+	if (!b->len)
 		return;
+	deflateReset(&b->z);
+	b->z.next_in = b->text;
+	b->z.avail_in = b->len;
+	b->z.next_out = b->out + AVR_VCD_BLOCK_HEAD;
+	b->z.avail_out = b->out_size - AVR_VCD_BLOCK_HEAD - AVR_VCD_BLOCK_TAIL;
+	if (deflate(&b->z, Z_FINISH) != Z_STREAM_END) {
+		b->error = 1;
+		b->len = 0;
+		return;
+	}
+	uint32_t size = AVR_VCD_BLOCK_HEAD + b->z.total_out + AVR_VCD_BLOCK_TAIL;
+	uint8_t * h = b->out;
+	static const uint8_t head[] = {
+		0x1f, 0x8b, 8, 4,	// deflate, with an extra field
+		0, 0, 0, 0, 0, 0xff,
+		16, 0, 'S', 'V', 12, 0,
+	};
+	memcpy(h, head, sizeof(head));
+	_avr_vcd_put_le(h + 16, size, 4);
+	_avr_vcd_put_le(h + 20, b->when, 8);
+	h += AVR_VCD_BLOCK_HEAD + b->z.total_out;
+	_avr_vcd_put_le(h, crc32(crc32(0, NULL, 0), b->text, b->len), 4);
+	_avr_vcd_put_le(h + 4, b->len, 4);
+	if (fwrite(b->out, 1, size, vcd->output) != size)
+		b->error = 1;
+	b->len = 0;
+}
+
+static void
+_avr_vcd_write(
+		avr_vcd_t * vcd,
+		const void * buf,
+		size_t len)
+{
+	avr_vcd_block_t * b = vcd->block;
+
+	vcd->written += len;
+	if (!b) {
+		fwrite(buf, 1, len, vcd->output);
+		return;
+	}
+	while (len) {
+		size_t n = sizeof(b->text) - b->len;
+		if (n > len)
+			n = len;
+		memcpy(b->text + b->len, buf, n);
+		b->len += n;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		if (b->len == sizeof(b->text))
+			_avr_vcd_block_flush(vcd);
+	}
+}
+
+// called before timestamp 'when' is written, a new member can start there
+static void
+_avr_vcd_mark(
+		avr_vcd_t * vcd,
+		uint64_t when)
+{
+	avr_vcd_block_t * b = vcd->block;
+
+	if (b->len >= AVR_VCD_BLOCK_SIZE)
+		_avr_vcd_block_flush(vcd);
+	if (!b->len)
+		b->when = when;
+}
+
+static void
+_avr_vcd_printf(
+		avr_vcd_t * vcd,
+		const char * format,
+		...)
+{
+	char line[256];
+	va_list ap;
+
+	va_start(ap, format);
+	int len = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if (len > 0)
+		_avr_vcd_write(vcd, line, len < sizeof(line) ? len : sizeof(line) - 1);
+}
+
+// formats the changes in 'log', and writes them out
+static void
+_avr_vcd_write_log(
+		avr_vcd_t * vcd,
+		const avr_vcd_log_t * log,
+		int count)
+{
+	uint64_t oldbase = 0;	// make sure it's different
+	uint64_t when = 0, base = 0;
+	// formatted by hand, and written a few KB at a time
+	char out[8192];
+	char * dst = out;
 
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		avr_vcd_log_t l = avr_vcd_fifo_read(&vcd->log);
+	for (int i = 0; i < count; i++) {
+		const avr_vcd_log_t * l = log + i;
+		avr_vcd_signal_t * s = vcd->signal[l->sigindex];
 		// 10ns base -- 100MHz should be enough
-		uint64_t base = avr_cycles_to_nsec(vcd->avr, l.when - vcd->start) / 10;
+		if (i == 0 || l->when != when) {
+			when = l->when;
+			base = avr_cycles_to_nsec(vcd->avr, when - vcd->start) / 10;
+		}
+		uint64_t b = base;
 
 		/*
 		 * if that trace was seen in this nsec already, we fudge the
@@ -408,27 +919,55 @@ avr_vcd_flush_log(
 		 *
 		 * This is a bit of a fudge, but it is the only way to represent
 		 * very short "pulses" that are still visible on the waveform.
+		 *
+		 * Each timestamp written gets a new 'seen' number, a signal was
+		 * seen at this one if it has the same.
 		 */
-		if (base == oldbase &&
-				(seen & (1 << l.sigindex)))
-			base++;	// this forces a new timestamp
-
-		if (base > oldbase || !seen) {
-			seen = 0;
-			fprintf(vcd->output, "#%" PRIu64  "\n", base);
-			oldbase = base;
+		if (i > 0 && b == oldbase && s->seen == vcd->seen)
+			b++;	// this forces a new timestamp
+
+		if (b > oldbase || i == 0) {
+			if (vcd->block &&
+					vcd->block->len + (dst - out) >= AVR_VCD_BLOCK_SIZE) {
+				_avr_vcd_write(vcd, out, dst - out);
+				dst = out;
+				_avr_vcd_mark(vcd, b);
+			}
+			if (++vcd->seen == 0) {	// wrapped, forget them all
+				for (int si = 0; si < vcd->signal_count; si++)
+					vcd->signal[si]->seen = 0;
+				vcd->seen = 1;
+			}
+			*dst++ = '#';
+			dst = _avr_vcd_put_u64(dst, b);
+			*dst++ = '\n';
+			oldbase = b;
 		}
 		// mark this trace as seen for this timestamp
-		seen |= (1 << l.sigindex);
-		fprintf(vcd->output, "%s\n",
-				l.floating ?
-					_avr_vcd_get_float_signal_text(
-							&vcd->signal[l.sigindex],
-							out) :
-					_avr_vcd_get_signal_text(
-							&vcd->signal[l.sigindex],
-							out, l.value));
+		s->seen = vcd->seen;
+		dst = _avr_vcd_put_signal_text(s, dst, l->value, l->floating);
+		if (dst - out > sizeof(out) - AVR_VCD_LINE_MAX * 2) {
+			_avr_vcd_write(vcd, out, dst - out);
+			dst = out;
+		}
 	}
+	if (dst > out)
+		_avr_vcd_write(vcd, out, dst - out);
+}
+
+static void
+avr_vcd_flush_log(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_log_t log[avr_vcd_fifo_fifo_size];
+	int count = 0;
+
+	if (avr_vcd_fifo_isempty(&vcd->log) || !vcd->output)
+		return;
+
+	while (!avr_vcd_fifo_isempty(&vcd->log))
+		log[count++] = avr_vcd_fifo_read(&vcd->log);
+	_avr_vcd_write_log(vcd, log, count);
 }
 
 static avr_cycle_count_t
@@ -442,24 +981,322 @@ _avr_vcd_timer(
 	return when + vcd->period;
 }
 
+static void *
+_avr_vcd_writer_thread(
+		void * param)
+{
+	avr_vcd_writer_t * w = param;
+	avr_vcd_log_t batch[1024];
+
+	for (;;) {
+		uint32_t tail = w->tail;
+		uint32_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			// the last changes were pushed before 'stop' was set
+			if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail)
+					break;
+				continue;
+			}
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = 200000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		uint32_t count = head - tail;
+		if (count > sizeof(batch) / sizeof(batch[0]))
+			count = sizeof(batch) / sizeof(batch[0]);
+		for (uint32_t i = 0; i < count; i++)
+			batch[i] = w->ring[(tail + i) & w->mask];
+		__atomic_store_n(&w->tail, tail + count, __ATOMIC_RELEASE);
+		_avr_vcd_write_log(w->vcd, batch, count);
+	}
+	return NULL;
+}
+
+static int
+_avr_vcd_writer_start(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_writer_t * w = vcd->writer;
+
+	w->head = w->tail = 0;
+	w->stop = 0;
+	if (pthread_create(&w->thread, NULL, _avr_vcd_writer_thread, w)) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: can't start the writer thread\\n",
+				__func__);
+		return -1;
+	}
+	w->running = 1;
+	return 0;
+}
+
 static void
-_avr_vcd_notify(
+_avr_vcd_writer_stop(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_writer_t * w = vcd->writer;
+
+	if (!w || !w->running)
+		return;
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(w->thread, NULL);
+	w->running = 0;
+	if (w->stalls)
+		AVR_LOG(vcd->avr, LOG_TRACE, "VCD: %s: waited %" PRIu64
+				" times for the writer thread\\n", __func__, w->stalls);
+}
+
+static void
+_avr_vcd_writer_push(
+		avr_vcd_writer_t * w,
+		avr_vcd_log_t l)
+{
+	uint32_t head = w->head;
+
+	while (head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) > w->mask) {
+		w->stalls++;
+		sched_yield();
+	}
+	w->ring[head & w->mask] = l;
+	__atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+avr_vcd_set_writer_thread(
+		avr_vcd_t * vcd,
+		uint32_t size)
+{
+	if (vcd->input || vcd->capture)
+		return -1;
+	if (vcd->writer)
+		return 0;
+	uint32_t count = 1024;
+	while (count < size && count < (1 << 24))
+		count <<= 1;
+	if (!size)
+		count = 64 * 1024;
+	avr_vcd_writer_t * w = calloc(1, sizeof(*w));
+	if (!w)
+		return -1;
+	w->ring = malloc(count * sizeof(*w->ring));
+	if (!w->ring) {
+		free(w);
+		return -1;
+	}
+	w->vcd = vcd;
+	w->mask = count - 1;
+	vcd->writer = w;
+	// already started, the thread takes over from the cycle timer
+	if (vcd->output) {
+		avr_cycle_timer_cancel(vcd->avr, _avr_vcd_timer, vcd);
+		avr_vcd_flush_log(vcd);
+		if (_avr_vcd_writer_start(vcd)) {
+			free(w->ring);
+			free(w);
+			vcd->writer = NULL;
+			avr_cycle_timer_register(vcd->avr, vcd->period, _avr_vcd_timer, vcd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the value of the signal of 'l', as the viewer will have it after it
+static void
+_avr_vcd_capture_last(
+		avr_vcd_t * vcd,
+		const avr_vcd_log_t * l)
+{
+	avr_vcd_signal_t * s = vcd->signal[l->sigindex];
+
+	s->last = l->value;
+	s->last_state = l->floating ? 2 : 1;
+}
+
+// writes the ring, that is all in the window
+static void
+_avr_vcd_capture_write(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_capture_t * c = vcd->capture;
+
+	while (c->count) {
+		uint32_t n = c->mask + 1 - c->tail;
+		if (n > c->count)
+			n = c->count;
+		_avr_vcd_write_log(vcd, c->ring + c->tail, n);
+		c->written = c->ring[(c->tail + n - 1) & c->mask].when;
+		for (uint32_t i = 0; i < n; i++)
+			_avr_vcd_capture_last(vcd, c->ring + c->tail + i);
+		c->tail = (c->tail + n) & c->mask;
+		c->count -= n;
+	}
+}
+
+static void
+_avr_vcd_capture(
+		avr_vcd_t * vcd,
+		avr_vcd_log_t l)
+{
+	avr_vcd_capture_t * c = vcd->capture;
+
+	if (c->triggered && l.when > c->end) {
+		_avr_vcd_capture_write(vcd);
+		c->triggered = 0;
+	}
+	if (c->count > c->mask) {
+		if (c->triggered)
+			_avr_vcd_capture_write(vcd);
+		else {
+			_avr_vcd_capture_last(vcd, c->ring + c->tail);
+			c->tail = (c->tail + 1) & c->mask;
+			c->count--;
+		}
+	}
+	c->ring[(c->tail + c->count) & c->mask] = l;
+	c->count++;
+}
+
+void
+avr_vcd_trigger(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_capture_t * c = vcd->capture;
+
+	if (!c || !vcd->output)
+		return;
+	avr_cycle_count_t now = vcd->avr->cycle;
+	if (c->triggered) {
+		c->end = now + c->post;
+		return;
+	}
+	avr_cycle_count_t start = now > c->pre ? now - c->pre : 0;
+	if (start < vcd->start)
+		start = vcd->start;
+	// windows don't overlap, time only goes forward in the file
+	if (c->windows && start <= c->written)
+		start = c->written + 1;
+	// the changes at 'start' itself go with the values it opens with
+	while (c->count && c->ring[c->tail].when <= start) {
+		_avr_vcd_capture_last(vcd, c->ring + c->tail);
+		c->tail = (c->tail + 1) & c->mask;
+		c->count--;
+	}
+	// what the signals were when the window opens
+	avr_vcd_log_t * log = malloc(vcd->signal_count * sizeof(*log));
+	int count = 0;
+	for (int i = 0; log && i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = vcd->signal[i];
+		if (!s->last_state)
+			continue;
+		log[count++] = (avr_vcd_log_t) {
+			.when = start, .sigindex = i,
+			.value = s->last, .floating = s->last_state == 2,
+		};
+	}
+	if (count)
+		_avr_vcd_write_log(vcd, log, count);
+	free(log);
+	AVR_LOG(vcd->avr, LOG_TRACE, "VCD: %s: window %u at cycle %" PRIu64 "\n",
+			__func__, c->windows, (uint64_t)now);
+	c->triggered = 1;
+	c->end = now + c->post;
+	c->windows++;
+}
+
+static void
+_avr_vcd_match_notify(
 		struct avr_irq_t * irq,
 		uint32_t value,
 		void * param)
 {
-	avr_vcd_t * vcd = (avr_vcd_t *)param;
+	avr_vcd_match_t * m = param;
 
-	if (!vcd->output)
-		return;
+	if (value == m->value)
+		avr_vcd_trigger(m->vcd);
+}
 
-	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
-	avr_vcd_log_t l = {
-		.sigindex = s->irq.irq,
-		.when = vcd->avr->cycle,
-		.value = value,
-		.floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING),
-	};
+int
+avr_vcd_trigger_on_irq(
+		avr_vcd_t * vcd,
+		avr_irq_t * irq,
+		uint32_t value)
+{
+	if (!vcd->capture || !irq)
+		return -1;
+	avr_vcd_match_t * m = calloc(1, sizeof(*m));
+	if (!m)
+		return -1;
+	m->vcd = vcd;
+	m->irq = irq;
+	m->value = value;
+	m->next = vcd->capture->match;
+	vcd->capture->match = m;
+	if (vcd->output)
+		avr_irq_register_notify(irq, _avr_vcd_match_notify, m);
+	return 0;
+}
+
+int
+avr_vcd_set_trigger(
+		avr_vcd_t * vcd,
+		uint64_t pre,
+		uint64_t post,
+		uint32_t size)
+{
+	if (vcd->input || vcd->writer)
+		return -1;
+	uint32_t count = 1024;
+	while (count < size && count < (1 << 24))
+		count <<= 1;
+	if (!size)
+		count = 64 * 1024;
+	avr_vcd_capture_t * c = vcd->capture;
+	if (c) {
+		if (c->mask + 1 != count) {
+			avr_vcd_log_t * ring = realloc(c->ring, count * sizeof(*ring));
+			if (!ring)
+				return -1;
+			c->ring = ring;
+			c->mask = count - 1;
+		}
+		c->tail = c->count = 0;
+	} else {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			return -1;
+		c->ring = malloc(count * sizeof(*c->ring));
+		if (!c->ring) {
+			free(c);
+			return -1;
+		}
+		c->mask = count - 1;
+	}
+	c->pre = pre;
+	c->post = post;
+	// already started, what was recorded is written, the rest waits
+	if (vcd->output && !vcd->capture) {
+		avr_cycle_timer_cancel(vcd->avr, _avr_vcd_timer, vcd);
+		avr_vcd_flush_log(vcd);
+	}
+	vcd->capture = c;
+	return 0;
+}
+
+// queues a change, to be written by the writer, the capture or the timer
+static void
+_avr_vcd_log(
+		avr_vcd_t * vcd,
+		avr_vcd_log_t l)
+{
+	if (vcd->writer && vcd->writer->running) {
+		_avr_vcd_writer_push(vcd->writer, l);
+		return;
+	}
+	if (vcd->capture) {
+		_avr_vcd_capture(vcd, l);
+		return;
+	}
 	if (avr_vcd_fifo_isfull(&vcd->log)) {
 		AVR_LOG(vcd->avr, LOG_WARNING,
 				"%s FIFO Overload, flushing!\n",
@@ -471,6 +1308,130 @@ _avr_vcd_notify(
 	avr_vcd_fifo_write(&vcd->log, l);
 }
 
+static void
+_avr_vcd_sample_write(
+		avr_vcd_sample_t * p,
+		uint32_t value,
+		int floating)
+{
+	p->written = value;
+	p->written_floating = floating;
+	_avr_vcd_log(p->vcd, (avr_vcd_log_t) {
+		.sigindex = p->index,
+		.when = p->vcd->avr->cycle,
+		.value = value,
+		.floating = floating,
+	});
+}
+
+// a change of a sampled signal only updates its state
+static void
+_avr_vcd_sample_change(
+		avr_vcd_sample_t * p,
+		uint32_t value,
+		int floating)
+{
+	p->value = value;
+	p->floating = floating;
+	if (floating)
+		return;
+	if (!p->window) {
+		p->min = p->max = value;
+		p->window = 1;
+	} else if (value < p->min) {
+		p->min = value;
+		p->max_last = 0;
+	} else if (value > p->max) {
+		p->max = value;
+		p->max_last = 1;
+	}
+}
+
+/*
+ * Ends the window: HOLD writes the value if it changed, MINMAX writes the
+ * first of the extremes now, and the other one at mid window
+ */
+static void
+_avr_vcd_sample_window(
+		avr_vcd_sample_t * p)
+{
+	if (p->mode == AVR_VCD_SAMPLE_HOLD || p->floating || !p->window) {
+		if (p->value != p->written || p->floating != p->written_floating)
+			_avr_vcd_sample_write(p, p->value, p->floating);
+		p->window = 0;
+		return;
+	}
+	uint32_t first = p->max_last ? p->min : p->max;
+	uint32_t second = p->max_last ? p->max : p->min;
+	if (first != p->written || p->written_floating)
+		_avr_vcd_sample_write(p, first, 0);
+	p->pending = second != first;
+	p->second = second;
+	// the next window starts with the value the signal has now
+	p->min = p->max = p->value;
+	p->max_last = 0;
+}
+
+static avr_cycle_count_t
+_avr_vcd_sample_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_vcd_sample_t * p = param;
+
+	if (p->mode == AVR_VCD_SAMPLE_HOLD) {
+		_avr_vcd_sample_window(p);
+		return when + p->period;
+	}
+	if (p->phase ^= 1)
+		_avr_vcd_sample_window(p);
+	else if (p->pending) {
+		_avr_vcd_sample_write(p, p->second, 0);
+		p->pending = 0;
+	}
+	return when + (p->period + 1) / 2;
+}
+
+// from the value avr_vcd_start() wrote, 'x'
+static void
+_avr_vcd_sample_start(
+		avr_vcd_sample_t * p)
+{
+	p->floating = p->written_floating = 1;
+	p->value = p->written = 0;
+	p->window = p->pending = p->phase = 0;
+	avr_cycle_timer_register(p->vcd->avr,
+			p->mode == AVR_VCD_SAMPLE_HOLD ?
+				p->period : (p->period + 1) / 2,
+			_avr_vcd_sample_timer, p);
+}
+
+static void
+_avr_vcd_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_vcd_t * vcd = (avr_vcd_t *)param;
+
+	if (!vcd->output)
+		return;
+
+	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
+	int floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING);
+	if (s->sample) {
+		_avr_vcd_sample_change(s->sample, value, floating);
+		return;
+	}
+	_avr_vcd_log(vcd, (avr_vcd_log_t) {
+		.sigindex = s->irq.irq,
+		.when = vcd->avr->cycle,
+		.value = value,
+		.floating = floating,
+	});
+}
+
 int
 avr_vcd_add_signal(
 		avr_vcd_t * vcd,
@@ -478,13 +1439,23 @@ avr_vcd_add_signal(
 		int signal_bit_size,
 		const char * name )
 {
-	if (vcd->signal_count == AVR_VCD_MAX_SIGNALS)
+	avr_vcd_signal_t * s = _avr_vcd_new_signal(vcd);
+	if (!s)
 		return -1;
-	int index = vcd->signal_count++;
-	avr_vcd_signal_t * s = &vcd->signal[index];
-	strncpy(s->name, name, sizeof(s->name));
+	int index = vcd->signal_count - 1;
+	strncpy(s->name, name, sizeof(s->name) - 1);
 	s->size = signal_bit_size;
-	s->alias = ' ' + vcd->signal_count ;
+	/*
+	 * identifiers are made of the 94 printable characters, the first
+	 * ones are the single character ones they always were, '!' onward
+	 */
+	char * a = s->alias;
+	int id = index;
+	do {
+		*a++ = '!' + (id % 94);
+		id /= 94;
+	} while (id);
+	*a = 0;
 
 	/* manufacture a nice IRQ name */
 	int l = strlen(name);
@@ -498,10 +1469,95 @@ avr_vcd_add_signal(
 	avr_init_irq(&vcd->avr->irq_pool, &s->irq, index, 1, names);
 	avr_irq_register_notify(&s->irq, _avr_vcd_notify, vcd);
 
-	avr_connect_irq(signal_irq, &s->irq);
+	// connected while started only, see _avr_vcd_attach()
+	s->source = signal_irq;
+	if (vcd->output)
+		avr_connect_irq(signal_irq, &s->irq);
 	return 0;
 }
 
+/*
+ * The signals, and the trigger irqs, are only hooked while the trace is
+ * started: a stopped one costs nothing, and the registers it traces go
+ * back to plain ones for the core (see avr_iomem_getirq()).
+ */
+static void
+_avr_vcd_attach(
+		avr_vcd_t * vcd,
+		int attach)
+{
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = vcd->signal[i];
+		if (!s->source)
+			continue;
+		if (attach)
+			avr_connect_irq(s->source, &s->irq);
+		else
+			avr_unconnect_irq(s->source, &s->irq);
+	}
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_sample_t * p = vcd->signal[i]->sample;
+		if (!p)
+			continue;
+		avr_cycle_timer_cancel(vcd->avr, _avr_vcd_sample_timer, p);
+		if (attach)
+			_avr_vcd_sample_start(p);
+	}
+	for (avr_vcd_match_t * m = vcd->capture ? vcd->capture->match : NULL;
+			m; m = m->next) {
+		if (attach)
+			avr_irq_register_notify(m->irq, _avr_vcd_match_notify, m);
+		else
+			avr_irq_unregister_notify(m->irq, _avr_vcd_match_notify, m);
+	}
+}
+
+int
+avr_vcd_set_sampling(
+		avr_vcd_t * vcd,
+		const char * name,
+		uint32_t usec,
+		int mode)
+{
+	size_t len = strlen(name);
+	int count = 0;
+
+	if (vcd->input || mode < AVR_VCD_SAMPLE_NONE ||
+			mode > AVR_VCD_SAMPLE_MINMAX)
+		return -1;
+	avr_cycle_count_t period = avr_usec_to_cycles(vcd->avr, usec);
+	if (mode != AVR_VCD_SAMPLE_NONE && period < 2) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: %u usec is too short to sample\n",
+				__func__, usec);
+		return -1;
+	}
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = vcd->signal[i];
+		if (strncmp(s->name, name, len) ||
+				(s->name[len] && (s->name[len] != '.' || s->name[len + 1] < '0' ||
+					s->name[len + 1] > '7' || s->name[len + 2])))
+			continue;
+		count++;
+		if (s->sample)
+			avr_cycle_timer_cancel(vcd->avr, _avr_vcd_sample_timer, s->sample);
+		if (mode == AVR_VCD_SAMPLE_NONE) {
+			free(s->sample);
+			s->sample = NULL;
+			continue;
+		}
+		if (!s->sample && !(s->sample = calloc(1, sizeof(*s->sample))))
+			return -1;
+		s->sample->vcd = vcd;
+		s->sample->index = i;
+		s->sample->mode = mode;
+		s->sample->period = period;
+		// already started, it's sampled from its next change
+		if (vcd->output)
+			_avr_vcd_sample_start(s->sample);
+	}
+	return count;
+}
+
 
 int
 avr_vcd_start(
@@ -519,31 +1575,66 @@ avr_vcd_start(
 	}
 	if (vcd->output)
 		avr_vcd_stop(vcd);
-	vcd->output = fopen(vcd->filename, "w");
+	size_t len = strlen(vcd->filename);
+	if (len > 3 && !strcmp(vcd->filename + len - 3, ".gz") && !vcd->block) {
+		avr_vcd_block_t * b = calloc(1, sizeof(*b));
+		if (!b || deflateInit2(&b->z, Z_BEST_SPEED, Z_DEFLATED, -15, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(b);
+			AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: can't compress %s\n",
+					__func__, vcd->filename);
+			return -1;
+		}
+		b->out_size = deflateBound(&b->z, sizeof(b->text)) +
+				AVR_VCD_BLOCK_HEAD + AVR_VCD_BLOCK_TAIL;
+		b->out = malloc(b->out_size);
+		if (!b->out) {
+			deflateEnd(&b->z);
+			free(b);
+			return -1;
+		}
+		vcd->block = b;
+	}
+	if (vcd->block) {
+		vcd->block->len = 0;
+		vcd->block->when = 0;
+		vcd->block->error = 0;
+	}
+	vcd->output = avr_aio_fopen(vcd->filename, vcd->block ? "wb" : "w");
 	if (vcd->output == NULL) {
 		perror(vcd->filename);
 		return -1;
 	}
 
-	fprintf(vcd->output, "$timescale 10ns $end\n");	// 10ns base, aka 100MHz
-	fprintf(vcd->output, "$scope module logic $end\n");
+	_avr_vcd_printf(vcd, "$timescale 10ns $end\n");	// 10ns base, aka 100MHz
+	_avr_vcd_printf(vcd, "$scope module logic $end\n");
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		fprintf(vcd->output, "$var wire %d %c %s $end\n",
-			vcd->signal[i].size, vcd->signal[i].alias, vcd->signal[i].name);
+		_avr_vcd_printf(vcd, "$var wire %d %s %s $end\n",
+			vcd->signal[i]->size, vcd->signal[i]->alias, vcd->signal[i]->name);
 	}
 
-	fprintf(vcd->output, "$upscope $end\n");
-	fprintf(vcd->output, "$enddefinitions $end\n");
+	_avr_vcd_printf(vcd, "$upscope $end\n");
+	_avr_vcd_printf(vcd, "$enddefinitions $end\n");
 
-	fprintf(vcd->output, "$dumpvars\n");
+	_avr_vcd_printf(vcd, "$dumpvars\n");
 	for (int i = 0; i < vcd->signal_count; i++) {
-		avr_vcd_signal_t * s = &vcd->signal[i];
-		char out[48];
-		fprintf(vcd->output, "%s\n",
-				_avr_vcd_get_float_signal_text(s, out));
+		avr_vcd_signal_t * s = vcd->signal[i];
+		char out[AVR_VCD_LINE_MAX];
+		_avr_vcd_write(vcd, out, _avr_vcd_put_signal_text(s, out, 0, 1) - out);
 	}
-	fprintf(vcd->output, "$end\n");
+	_avr_vcd_printf(vcd, "$end\n");
+	_avr_vcd_attach(vcd, 1);
+	if (vcd->capture) {
+		vcd->capture->tail = vcd->capture->count = 0;
+		vcd->capture->triggered = 0;
+		vcd->capture->windows = 0;
+		for (int i = 0; i < vcd->signal_count; i++)
+			vcd->signal[i]->last_state = 0;
+		return 0;
+	}
+	if (vcd->writer && _avr_vcd_writer_start(vcd) == 0)
+		return 0;
 	avr_cycle_timer_register(vcd->avr, vcd->period, _avr_vcd_timer, vcd);
 	return 0;
 }
@@ -552,19 +1643,42 @@ int
 avr_vcd_stop(
 		avr_vcd_t * vcd)
 {
+	// what the sampled signals did since their last window
+	for (int i = 0; vcd->output && i < vcd->signal_count; i++) {
+		avr_vcd_sample_t * p = vcd->signal[i]->sample;
+		if (!p)
+			continue;
+		if (p->pending)
+			_avr_vcd_sample_write(p, p->second, 0);
+		p->pending = 0;
+		_avr_vcd_sample_window(p);
+		if (p->pending)
+			_avr_vcd_sample_write(p, p->second, 0);
+		p->pending = 0;
+	}
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_timer, vcd);
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_input_timer, vcd);
 
+	_avr_vcd_writer_stop(vcd);
 	avr_vcd_flush_log(vcd);
+	if (vcd->capture && vcd->capture->triggered && vcd->output) {
+		_avr_vcd_capture_write(vcd);
+		vcd->capture->triggered = 0;
+	}
 
-	if (vcd->input_line)
-		free(vcd->input_line);
-	vcd->input_line = NULL;
-	if (vcd->input)
-		fclose(vcd->input);
+	free(vcd->input);
 	vcd->input = NULL;
-	if (vcd->output)
+	vcd->input_count = vcd->input_pos = 0;
+	if (vcd->output) {
+		if (vcd->block) {
+			_avr_vcd_block_flush(vcd);
+			if (vcd->block->error)
+				AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: error writing %s\n",
+						__func__, vcd->filename);
+		}
 		fclose(vcd->output);
+		_avr_vcd_attach(vcd, 0);
+	}
 	vcd->output = NULL;
 	return 0;
 }
@@ -44,10 +44,22 @@ extern "C" {
  * sigrock signal analyzer, and 'replay' digital input with the proper
  * timing.
  *
- * TODO: Add support for 'looping' a VCD input.
+ * When the output filename ends with .gz, the file is compressed, in
+ * blocks that start at a timestamp; see sim_vcd_file.c
+ *
+ * An input file is parsed once, when it's loaded, into a table of its
+ * changes; it can be played several times in a row, see
+ * avr_vcd_input_repeat(). Its 1 bit signals that go to the pins of a port
+ * ("iog<port>_<pin>") are grouped by port: the changes of a timestamp are
+ * set on the port at once, one PIN update and one pin change check, after
+ * the other signals of that timestamp were raised.
  */
 
-#define AVR_VCD_MAX_SIGNALS 64
+// the ports the input pins can be grouped on
+#define AVR_VCD_PORTS	16
+
+// the signals are allocated as they are added, up to that many
+#define AVR_VCD_MAX_SIGNALS (1 << 20)
 
 typedef struct avr_vcd_signal_t {
 	/*
@@ -55,21 +67,31 @@ typedef struct avr_vcd_signal_t {
 	 * For VCD input, this is the IRQ we broadcast the values to
 	 */
 	avr_irq_t 		irq;
-	char 			alias;			// vcd one character alias
+	avr_irq_t *		source;			// output, connected to 'irq' while started
+	struct avr_vcd_sample_t * sample;	// see avr_vcd_set_sampling(), or NULL
+	char 			alias[16];		// vcd identifier
 	uint8_t			size;			// in bits
 	char 			name[32];		// full human name
+	uint32_t		seen;			// timestamp it last changed at, see flush
+	// trigger mode, the last value that left the ring
+	uint32_t		last;
+	uint8_t			last_state;		// 0: none yet, 1: 'last', 2: floating
+	// input, the port pin it's grouped on, 1 + its index in 'port'
+	uint8_t			port, bit;
 } avr_vcd_signal_t, *avr_vcd_signal_p;
 
 typedef struct avr_vcd_log_t {
 	uint64_t 		when;
-	uint64_t			sigindex : 8,			// index in signal table
+	uint64_t			sigindex : 20,			// index in signal table
 					floating : 1,
 					value : 32;
 } avr_vcd_log_t, *avr_vcd_log_p;
 
 DECLARE_FIFO(avr_vcd_log_t, avr_vcd_fifo, 256);
 
-struct argv_t;
+struct avr_vcd_writer_t;
+struct avr_vcd_block_t;
+struct avr_vcd_capture_t;
 
 typedef struct avr_vcd_t {
 	struct avr_t *	avr;	// AVR we are attaching timers to..
@@ -77,17 +99,30 @@ typedef struct avr_vcd_t {
 	char *			filename;		// .vcd filename
 	/* can be input OR output, not both */
 	FILE * 			output;
-	FILE * 			input;
-	struct argv_t	* input_line;
-
-	int 				signal_count;
-	avr_vcd_signal_t	signal[AVR_VCD_MAX_SIGNALS];
+	avr_vcd_log_t *	input;			// the changes of the input file
+	uint32_t		input_count, input_pos;
+	uint64_t		input_end;		// its last timestamp, the length of a loop
+	uint32_t		input_repeat, input_loops;
+	struct {						// the pins of a port, see the top
+		char		name;
+		uint8_t		mask, value;	// changed at this timestamp
+	} port[AVR_VCD_PORTS];
+	int				port_count;
+
+	int 				signal_count, signal_alloc;
+	avr_vcd_signal_t **	signal;
+	uint32_t			seen;	// current timestamp of the writer
 
 	uint64_t 		start;
 	uint64_t 		period;		// for output cycles
 	uint64_t 		vcd_to_us;	// for input unit mapping
+	uint64_t		vcd_per_us;	// and its divisor, for the sub-usec units
 
 	avr_vcd_fifo_t	log;
+	struct avr_vcd_writer_t * writer;	// see avr_vcd_set_writer_thread()
+	struct avr_vcd_block_t * block;		// compressed output, for .gz files
+	struct avr_vcd_capture_t * capture;	// see avr_vcd_set_trigger()
+	uint64_t		written;	// bytes of text, before any compression
 } avr_vcd_t;
 
 // initializes a new VCD trace file, and returns zero if all is well
@@ -102,9 +137,23 @@ avr_vcd_init_input(
 		struct avr_t * avr,
 		const char * filename, 	// filename to read
 		avr_vcd_t * vcd );		// vcd struct to initialize
+/*
+ * Plays the input 'count' times in a row, 0 to loop forever; the default
+ * is once. Each loop starts at the last timestamp of the file, so a file
+ * ending with a timestamp after its last change has a pause before the
+ * next loop.
+ */
+void
+avr_vcd_input_repeat(
+		avr_vcd_t * vcd,
+		uint32_t count );
 void
 avr_vcd_close(
 		avr_vcd_t * vcd );
+// the bytes it allocated, signals, buffers and writer thread ring included
+size_t
+avr_vcd_memory(
+		avr_vcd_t * vcd );
 
 // Add a trace signal to the vcd file. Must be called before avr_vcd_start()
 int
@@ -114,10 +163,77 @@ avr_vcd_add_signal(
 		int signal_bit_size,
 		const char * name );
 
+/*
+ * Sampling, for the signals that change too fast for every change to be
+ * worth a line (a PWM pin, a data bus, an ADC value):
+ * + AVR_VCD_SAMPLE_HOLD writes the value the signal has every 'usec',
+ *   if it changed since the last one written;
+ * + AVR_VCD_SAMPLE_MINMAX writes the lowest and highest values it had in
+ *   each window of 'usec', in the order they came, during the next window.
+ * AVR_VCD_SAMPLE_NONE goes back to writing every change.
+ */
+enum {
+	AVR_VCD_SAMPLE_NONE = 0,
+	AVR_VCD_SAMPLE_HOLD,
+	AVR_VCD_SAMPLE_MINMAX,
+};
+/*
+ * Samples the signal called 'name', and the ones called 'name.<bit>' made
+ * from the same trace (see sim_elf.c). Once started, the signals go on
+ * from an unknown value, as they would from avr_vcd_start().
+ * Returns the number of signals it applies to, or -1.
+ */
+int
+avr_vcd_set_sampling(
+		avr_vcd_t * vcd,
+		const char * name,
+		uint32_t usec,
+		int mode );
+
 // Starts recording the signal value into the file
 int
 avr_vcd_start(
 		avr_vcd_t * vcd);
+/*
+ * Makes the changes go to a thread that formats and writes them, through
+ * a ring of 'size' changes (0 for 64K of them), instead of being written
+ * by a cycle timer on the core's thread. Can be called before or after
+ * avr_vcd_start(). Returns 0, or -1.
+ */
+int
+avr_vcd_set_writer_thread(
+		avr_vcd_t * vcd,
+		uint32_t size );
+/*
+ * Trigger mode: the changes are kept in a ring of 'size' changes (0 for
+ * 64K of them) instead of being written. When avr_vcd_trigger() is
+ * called, the changes of the 'pre' cycles before it and of the 'post'
+ * cycles after it are written, starting with the value every signal had;
+ * then the ring fills again, for the next trigger. Can't be used with a
+ * writer thread. Returns 0, or -1.
+ */
+int
+avr_vcd_set_trigger(
+		avr_vcd_t * vcd,
+		uint64_t pre,
+		uint64_t post,
+		uint32_t size );
+/*
+ * Writes the window around now, or extends it if one is being written.
+ * It's what SIMAVR_CMD_VCD_START_TRACE does in trigger mode.
+ */
+void
+avr_vcd_trigger(
+		avr_vcd_t * vcd );
+/*
+ * Triggers when 'irq' is raised with 'value'. The watchdog's
+ * WATCHDOG_IRQ_RESET for example is pulsed to 1 when it resets the core
+ */
+int
+avr_vcd_trigger_on_irq(
+		avr_vcd_t * vcd,
+		avr_irq_t * irq,
+		uint32_t value );
 // stops recording signal values into the file
 int
 avr_vcd_stop(
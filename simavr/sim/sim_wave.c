@@ -0,0 +1,278 @@
+/*
+	sim_wave.c
+
+	Analog waveforms given once, for the comparator, the ADC, and pins,
+	with the times they cross a level computed rather than sampled.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "sim_wave.h"
+
+#define NSEC_PER_SEC	1000000000ULL
+
+// the sample 'nsec' is in, before looping
+static uint64_t
+_avr_wave_sample_index(
+		const avr_wave_t * w,
+		uint64_t nsec )
+{
+	return (nsec / NSEC_PER_SEC) * w->rate +
+			(nsec % NSEC_PER_SEC) * w->rate / NSEC_PER_SEC;
+}
+
+// when sample 'index' starts
+static uint64_t
+_avr_wave_sample_nsec(
+		const avr_wave_t * w,
+		uint64_t index )
+{
+	return (index / w->rate) * NSEC_PER_SEC +
+			((index % w->rate) * NSEC_PER_SEC + w->rate - 1) / w->rate;
+}
+
+// how long before it repeats, AVR_WAVE_NEVER if it doesn't
+static uint64_t
+_avr_wave_period(
+		const avr_wave_t * w )
+{
+	switch (w->kind) {
+		case AVR_WAVE_PWL:
+		case AVR_WAVE_SINE:
+			return w->period ? w->period : AVR_WAVE_NEVER;
+		case AVR_WAVE_SAMPLED:
+			return w->loop ? _avr_wave_sample_nsec(w, w->count) : AVR_WAVE_NEVER;
+	}
+	return AVR_WAVE_NEVER;
+}
+
+// first point after 'nsec', or 'count'
+static uint32_t
+_avr_wave_pwl_next(
+		const avr_wave_t * w,
+		uint64_t nsec )
+{
+	uint32_t lo = 0, hi = w->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (w->point[mid].nsec > nsec)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static double
+_avr_wave_sine_angle(
+		const avr_wave_t * w,
+		uint64_t nsec )
+{
+	return 2 * M_PI * (double)(nsec % w->period) / (double)w->period +
+			w->phase * M_PI / 180;
+}
+
+int32_t
+avr_wave_value(
+		const avr_wave_t * w,
+		uint64_t nsec )
+{
+	switch (w->kind) {
+		case AVR_WAVE_PWL: {
+			if (!w->count)
+				return 0;
+			if (w->period)
+				nsec %= w->period;
+			uint32_t i = _avr_wave_pwl_next(w, nsec);
+			if (i == 0)
+				return w->point[0].mv;
+			if (i == w->count)
+				return w->point[i - 1].mv;
+			const avr_wave_point_t * a = &w->point[i - 1], * b = &w->point[i];
+			return a->mv + (int64_t)(b->mv - a->mv) *
+					(int64_t)(nsec - a->nsec) / (int64_t)(b->nsec - a->nsec);
+		}
+		case AVR_WAVE_SINE:
+			if (!w->period)
+				return w->offset;
+			return lround(w->offset + w->amplitude *
+					sin(_avr_wave_sine_angle(w, nsec)));
+		case AVR_WAVE_SAMPLED: {
+			if (!w->count || !w->rate)
+				return 0;
+			uint64_t i = _avr_wave_sample_index(w, nsec);
+			if (i >= w->count)
+				i = w->loop ? i % w->count : w->count - 1;
+			return w->samples[i];
+		}
+	}
+	return 0;
+}
+
+uint64_t
+avr_wave_knee(
+		const avr_wave_t * w,
+		uint64_t nsec )
+{
+	switch (w->kind) {
+		case AVR_WAVE_PWL: {
+			uint64_t base = w->period ? nsec - nsec % w->period : 0;
+			uint32_t i = _avr_wave_pwl_next(w, nsec - base);
+			if (i < w->count && (!w->period || w->point[i].nsec < w->period))
+				return base + w->point[i].nsec;
+			return w->period ? base + w->period : AVR_WAVE_NEVER;
+		}
+		case AVR_WAVE_SINE: {
+			if (!w->period)
+				return AVR_WAVE_NEVER;
+			// the peaks are half a period apart, the first one is at 'q'
+			double half = (double)w->period / 2;
+			double q = fmod((double)w->period * (0.25 - w->phase / 360.0), half);
+			if (q < 0)
+				q += half;
+			uint64_t base = nsec - nsec % w->period;
+			for (int j = 0; ; j++) {
+				uint64_t k = base + (uint64_t)floor(q + j * half);
+				if (k > nsec)
+					return k;
+			}
+		}
+		case AVR_WAVE_SAMPLED: {
+			if (!w->count || !w->rate)
+				return AVR_WAVE_NEVER;
+			uint64_t i = _avr_wave_sample_index(w, nsec) + 1;
+			if (i >= w->count && !w->loop)
+				return i == w->count ? _avr_wave_sample_nsec(w, i) : AVR_WAVE_NEVER;
+			return _avr_wave_sample_nsec(w, i);
+		}
+	}
+	return AVR_WAVE_NEVER;
+}
+
+uint64_t
+avr_wave_crossing(
+		const avr_wave_t * w,
+		uint64_t nsec,
+		int32_t level,
+		uint64_t limit )
+{
+	int side = avr_wave_value(w, nsec) > level;
+	// if it doesn't cross in a period, it never will
+	uint64_t period = _avr_wave_period(w);
+	if (period != AVR_WAVE_NEVER && nsec + period + 1 < limit)
+		limit = nsec + period + 1;
+
+	uint64_t cur = nsec;
+	while (cur < limit) {
+		uint64_t b = avr_wave_knee(w, cur);
+		if (b == AVR_WAVE_NEVER || b > limit) {
+			if (limit == AVR_WAVE_NEVER)
+				return AVR_WAVE_NEVER;
+			b = limit;
+		}
+		/*
+		 * It's monotonic up to just before 'b', and 'b' itself can be a
+		 * step, from a sample, or points at the same time
+		 */
+		if (b - 1 > cur && (avr_wave_value(w, b - 1) > level) != side) {
+			uint64_t lo = cur + 1, hi = b - 1;
+			while (lo < hi) {
+				uint64_t mid = lo + (hi - lo) / 2;
+				if ((avr_wave_value(w, mid) > level) != side)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			return lo;
+		}
+		if ((avr_wave_value(w, b) > level) != side)
+			return b;
+		cur = b;
+	}
+	return AVR_WAVE_NEVER;
+}
+
+avr_cycle_count_t
+avr_wave_cycle(
+		struct avr_t * avr,
+		avr_cycle_count_t start,
+		uint64_t nsec )
+{
+	uint64_t f = avr->frequency;
+	return start + (nsec / NSEC_PER_SEC) * f +
+			((nsec % NSEC_PER_SEC) * f + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+uint64_t
+avr_wave_nsec(
+		struct avr_t * avr,
+		avr_cycle_count_t start,
+		avr_cycle_count_t cycle )
+{
+	uint64_t f = avr->frequency;
+	if (cycle <= start || !f)
+		return 0;
+	cycle -= start;
+	return (cycle / f) * NSEC_PER_SEC + (cycle % f) * NSEC_PER_SEC / f;
+}
+
+static avr_cycle_count_t
+_avr_wave_drive_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param )
+{
+	avr_wave_drive_t * d = (avr_wave_drive_t *)param;
+	uint64_t nsec = avr_wave_nsec(avr, d->start, when);
+
+	avr_raise_irq(d->irq, avr_wave_value(&d->wave, nsec) > d->threshold);
+	uint64_t next = avr_wave_crossing(&d->wave, nsec, d->threshold,
+						AVR_WAVE_NEVER);
+	if (next == AVR_WAVE_NEVER)
+		return 0;
+	avr_cycle_count_t c = avr_wave_cycle(avr, d->start, next);
+	return c > when ? c : when + 1;
+}
+
+void
+avr_wave_drive(
+		struct avr_t * avr,
+		avr_wave_drive_t * d,
+		const avr_wave_t * w,
+		int32_t threshold,
+		avr_irq_t * irq )
+{
+	d->avr = avr;
+	d->wave = *w;
+	d->start = avr->cycle;
+	d->threshold = threshold;
+	d->irq = irq;
+	avr_cycle_count_t next = _avr_wave_drive_timer(avr, avr->cycle, d);
+	if (next)
+		avr_cycle_timer_register(avr, next - avr->cycle, _avr_wave_drive_timer, d);
+}
+
+void
+avr_wave_drive_stop(
+		avr_wave_drive_t * d )
+{
+	if (!d->avr)
+		return;
+	avr_cycle_timer_cancel(d->avr, _avr_wave_drive_timer, d);
+	d->avr = NULL;
+}
@@ -0,0 +1,148 @@
+/*
+	sim_wave.h
+
+	Analog waveforms given once, for the comparator, the ADC, and pins,
+	with the times they cross a level computed rather than sampled.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_WAVE_H__
+#define __SIM_WAVE_H__
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A wave is in millivolts, and its time is in nanoseconds from the cycle
+ * it was given to a module at. It is one of:
+ * + AVR_WAVE_PWL, 'count' points, in increasing time, joined by straight
+ *   lines. It holds the first value before the first point, and the last
+ *   after the last one, unless 'period' is set: then it starts again
+ *   from time zero every 'period' nanoseconds.
+ * + AVR_WAVE_SINE, 'offset' + 'amplitude' * sin(2 pi t / 'period' + 'phase'),
+ *   the phase in degrees.
+ * + AVR_WAVE_SAMPLED, the 'count' 'samples', 'rate' per second, each held
+ *   until the next. It keeps the last sample, or loops if 'loop' is set.
+ * The points and samples are not copied, they must stay valid while the
+ * wave is used.
+ *
+ * The wave is cut into pieces where it is monotonic (between two points,
+ * samples, or peaks of the sine), so the first time it crosses a level
+ * is found with a search in the first piece that ends on the other side,
+ * to the nanosecond; the modules then only need a cycle timer for that.
+ */
+enum {
+	AVR_WAVE_NONE = 0,
+	AVR_WAVE_PWL,
+	AVR_WAVE_SINE,
+	AVR_WAVE_SAMPLED,
+};
+
+#define AVR_WAVE_NEVER		(~0ULL)
+
+typedef struct avr_wave_point_t {
+	uint64_t		nsec;
+	int32_t			mv;
+} avr_wave_point_t;
+
+typedef struct avr_wave_t {
+	int				kind;		// AVR_WAVE_*
+	uint64_t		period;		// nanoseconds, PWL and SINE
+	// AVR_WAVE_PWL
+	const avr_wave_point_t * point;
+	uint32_t		count;		// of points, or samples
+	// AVR_WAVE_SINE
+	int32_t			offset, amplitude;
+	int16_t			phase;
+	// AVR_WAVE_SAMPLED
+	const int16_t *	samples;
+	uint32_t		rate;
+	uint8_t			loop;
+} avr_wave_t;
+
+// the value of 'w' at 'nsec'
+int32_t
+avr_wave_value(
+		const avr_wave_t * w,
+		uint64_t nsec );
+/*
+ * The first time after 'nsec', and no later than 'limit', at which
+ * the wave goes to the other side of 'level': from above it (strictly)
+ * to below or at it, or the other way around. AVR_WAVE_NEVER if it
+ * doesn't.
+ */
+uint64_t
+avr_wave_crossing(
+		const avr_wave_t * w,
+		uint64_t nsec,
+		int32_t level,
+		uint64_t limit );
+// the end of the monotonic piece 'nsec' is in, AVR_WAVE_NEVER past the last one
+uint64_t
+avr_wave_knee(
+		const avr_wave_t * w,
+		uint64_t nsec );
+
+/*
+ * The cycle at which wave time 'nsec' is reached, for a wave started
+ * at cycle 'start', and the other way around
+ */
+avr_cycle_count_t
+avr_wave_cycle(
+		struct avr_t * avr,
+		avr_cycle_count_t start,
+		uint64_t nsec );
+uint64_t
+avr_wave_nsec(
+		struct avr_t * avr,
+		avr_cycle_count_t start,
+		avr_cycle_count_t cycle );
+
+/*
+ * Drives 'irq' as a digital signal from a wave: 1 while it's above
+ * 'threshold', 0 otherwise, with one cycle timer per edge. This is how
+ * a wave goes to a pin, or to a timer input capture (TIMER_IRQ_IN_ICP).
+ */
+typedef struct avr_wave_drive_t {
+	struct avr_t *		avr;
+	avr_wave_t			wave;
+	avr_cycle_count_t	start;
+	int32_t				threshold;
+	avr_irq_t *			irq;
+} avr_wave_drive_t;
+
+// starts now, with a copy of 'w'. Stop it before starting it again
+void
+avr_wave_drive(
+		struct avr_t * avr,
+		avr_wave_drive_t * d,
+		const avr_wave_t * w,
+		int32_t threshold,
+		avr_irq_t * irq );
+void
+avr_wave_drive_stop(
+		avr_wave_drive_t * d );
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_WAVE_H__ */
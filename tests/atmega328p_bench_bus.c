@@ -0,0 +1,83 @@
+/*
+	atmega328p_bench_bus.c
+
+	SPI and TWI master traffic, for bench.c: a burst of bytes on the SPI at
+	clk/2, then a TWI write at 400kHz to a device that isn't there, which is
+	NACKed, over and over.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <util/twi.h>
+#include <stdint.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega328p");
+
+static void
+twi_wait(void)
+{
+	loop_until_bit_is_set(TWCR, TWINT);
+}
+
+static uint8_t
+twi_write(
+		uint8_t addr,
+		const uint8_t * b,
+		uint8_t len)
+{
+	TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN);
+	twi_wait();
+	TWDR = addr << 1;
+	TWCR = (1 << TWINT) | (1 << TWEN);
+	twi_wait();
+	uint8_t sent = 0;
+	if (TW_STATUS == TW_MT_SLA_ACK)
+		for (; sent < len; sent++) {
+			TWDR = b[sent];
+			TWCR = (1 << TWINT) | (1 << TWEN);
+			twi_wait();
+			if (TW_STATUS != TW_MT_DATA_ACK)
+				break;
+		}
+	TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN);
+	return sent;
+}
+
+int main()
+{
+	uint8_t buf[16];
+
+	// SS as an output, or the SPI drops out of master mode
+	DDRB = (1 << PB2) | (1 << PB3) | (1 << PB5);
+	SPCR = (1 << SPE) | (1 << MSTR);
+	SPSR = (1 << SPI2X);
+
+	TWSR = 0;
+	TWBR = (F_CPU / 400000 - 16) / 2;
+
+	for (uint8_t n = 0; ; n++) {
+		PORTB &= ~(1 << PB2);
+		for (uint8_t i = 0; i < sizeof(buf); i++) {
+			SPDR = n + i;
+			loop_until_bit_is_set(SPSR, SPIF);
+			buf[i] = SPDR;
+		}
+		PORTB |= (1 << PB2);
+		GPIOR1 = twi_write(0x50, buf, sizeof(buf));
+	}
+}
@@ -0,0 +1,182 @@
+/*
+	atmega328p_bench_cpu.c
+
+	A CoreMark like integer load, for bench.c: list walking, a small matrix
+	product, a state machine reading a string, and a CRC16 over all their
+	results. It never stops, the result of each pass goes in GPIOR1.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <stdint.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega328p");
+
+#define LIST_SIZE	32
+#define MATRIX_SIZE	8
+
+typedef struct item_t {
+	struct item_t * next;
+	int16_t data;
+	uint8_t index;
+} item_t;
+
+static item_t items[LIST_SIZE];
+static int16_t ma[MATRIX_SIZE][MATRIX_SIZE], mb[MATRIX_SIZE][MATRIX_SIZE];
+static int32_t mc[MATRIX_SIZE][MATRIX_SIZE];
+
+static const char input[] = "5012,-3.14e2,0x7f,+12.5,abc,1e-3,77,-0.5,ff,9";
+
+static uint16_t
+crc16(
+		uint16_t crc,
+		uint16_t v)
+{
+	for (uint8_t i = 0; i < 16; i++, v >>= 1) {
+		uint8_t x = (crc ^ v) & 1;
+		crc >>= 1;
+		if (x)
+			crc ^= 0xa001;
+	}
+	return crc;
+}
+
+static item_t *
+list_reverse(
+		item_t * l)
+{
+	item_t * r = 0;
+	while (l) {
+		item_t * next = l->next;
+		l->next = r;
+		r = l;
+		l = next;
+	}
+	return r;
+}
+
+static uint16_t
+list_bench(
+		uint16_t seed)
+{
+	item_t * l = 0;
+	for (uint8_t i = 0; i < LIST_SIZE; i++) {
+		items[i].data = (seed ^ (i * 0x3b)) & 0x7fff;
+		items[i].index = i;
+		items[i].next = l;
+		l = &items[i];
+	}
+	uint16_t crc = 0;
+	for (uint8_t pass = 0; pass < 4; pass++) {
+		int16_t want = items[(seed + pass) % LIST_SIZE].data;
+		for (item_t * p = l; p; p = p->next)
+			if (p->data == want) {
+				crc = crc16(crc, p->index);
+				break;
+			}
+		l = list_reverse(l);
+	}
+	return crc;
+}
+
+static uint16_t
+matrix_bench(
+		uint16_t seed)
+{
+	for (uint8_t i = 0; i < MATRIX_SIZE; i++)
+		for (uint8_t j = 0; j < MATRIX_SIZE; j++) {
+			ma[i][j] = seed + i * j;
+			mb[i][j] = seed - i - j;
+		}
+	for (uint8_t i = 0; i < MATRIX_SIZE; i++)
+		for (uint8_t j = 0; j < MATRIX_SIZE; j++) {
+			int32_t s = 0;
+			for (uint8_t k = 0; k < MATRIX_SIZE; k++)
+				s += (int32_t)ma[i][k] * mb[k][j];
+			mc[i][j] = s;
+		}
+	uint16_t crc = 0;
+	for (uint8_t i = 0; i < MATRIX_SIZE; i++)
+		crc = crc16(crc, mc[i][i] >> 4);
+	return crc;
+}
+
+enum { S_START, S_INT, S_FLOAT, S_EXP, S_HEX, S_INVALID };
+
+static uint16_t
+state_bench(void)
+{
+	uint8_t count[S_INVALID + 1] = { 0 };
+	uint8_t state = S_START;
+	for (const char * p = input; ; p++) {
+		char c = *p;
+		if (c == ',' || !c) {
+			count[state]++;
+			state = S_START;
+			if (!c)
+				break;
+			continue;
+		}
+		switch (state) {
+			case S_START:
+				if (c >= '0' && c <= '9')
+					state = p[1] == 'x' ? S_HEX : S_INT;
+				else if (c != '+' && c != '-')
+					state = S_INVALID;
+				break;
+			case S_INT:
+				if (c == '.')
+					state = S_FLOAT;
+				else if (c == 'e')
+					state = S_EXP;
+				else if (c < '0' || c > '9')
+					state = S_INVALID;
+				break;
+			case S_FLOAT:
+				if (c == 'e')
+					state = S_EXP;
+				else if (c < '0' || c > '9')
+					state = S_INVALID;
+				break;
+			case S_EXP:
+				if ((c < '0' || c > '9') && c != '-' && c != '+')
+					state = S_INVALID;
+				break;
+			case S_HEX:
+				if (c != 'x' && !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+					state = S_INVALID;
+				break;
+		}
+	}
+	uint16_t crc = 0;
+	for (uint8_t i = 0; i <= S_INVALID; i++)
+		crc = crc16(crc, count[i]);
+	return crc;
+}
+
+int main()
+{
+	uint16_t seed = 0x66;
+	for (;;) {
+		uint16_t crc = list_bench(seed);
+		crc = crc16(crc, matrix_bench(seed));
+		crc = crc16(crc, state_bench());
+		GPIOR1 = crc;
+		seed = crc;
+	}
+}
@@ -0,0 +1,71 @@
+/*
+	atmega328p_bench_pwm.c
+
+	The three timers in PWM modes, with their outputs on, and interrupts
+	moving the duty cycles every period; the cpu idles in between. For
+	bench.c.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <stdint.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega328p");
+
+ISR(TIMER0_OVF_vect)
+{
+	OCR0A++;
+	OCR0B = 255 - OCR0A;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	OCR1B = (OCR1B + 3) & 0x3ff;
+}
+
+ISR(TIMER2_OVF_vect)
+{
+	OCR2A += 7;
+}
+
+int main()
+{
+	DDRB = (1 << PB1) | (1 << PB2) | (1 << PB3);
+	DDRD = (1 << PD5) | (1 << PD6);
+
+	// fast PWM, clk/1
+	TCCR0A = (1 << COM0A1) | (1 << COM0B1) | (1 << WGM01) | (1 << WGM00);
+	TCCR0B = (1 << CS00);
+	TIMSK0 = (1 << TOIE0);
+	// phase correct 10 bits, clk/1
+	OCR1A = 0x200;
+	TCCR1A = (1 << COM1A1) | (1 << COM1B1) | (1 << WGM11) | (1 << WGM10);
+	TCCR1B = (1 << CS10);
+	TIMSK1 = (1 << OCIE1A);
+	// fast PWM, clk/8
+	TCCR2A = (1 << COM2A1) | (1 << WGM21) | (1 << WGM20);
+	TCCR2B = (1 << CS21);
+	TIMSK2 = (1 << TOIE2);
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sei();
+	for (;;)
+		sleep_mode();
+}
@@ -0,0 +1,58 @@
+/*
+	atmega328p_bench_sleep.c
+
+	A low power firmware, for bench.c: the unused modules are powered down,
+	and the cpu sleeps in power save mode but for a short interrupt of
+	timer 2, about every 10ms.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <stdint.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega328p");
+
+volatile uint16_t ticks;
+
+ISR(TIMER2_COMPA_vect)
+{
+	ticks++;
+	PINB = (1 << PB0);
+}
+
+int main()
+{
+	DDRB = (1 << PB0);
+	PRR = (1 << PRTWI) | (1 << PRTIM0) | (1 << PRTIM1) | (1 << PRSPI) |
+			(1 << PRUSART0) | (1 << PRADC);
+
+	// CTC, clk/1024
+	OCR2A = F_CPU / 1024 / 100 - 1;
+	TCCR2A = (1 << WGM21);
+	TCCR2B = (1 << CS22) | (1 << CS21) | (1 << CS20);
+	TIMSK2 = (1 << OCIE2A);
+
+	set_sleep_mode(SLEEP_MODE_PWR_SAVE);
+	sei();
+	for (;;) {
+		sleep_mode();
+		GPIOR1 = ticks;
+	}
+}
@@ -0,0 +1,58 @@
+/*
+	atmega328p_bench_uart.c
+
+	A flood of bytes through the UART, looped back by simavr: the main loop
+	sends as fast as UDRE allows, at 250000 baud, and the RX interrupt
+	checks that they come back in order. For bench.c.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega328p");
+AVR_MCU_SIMAVR_COMMAND(&GPIOR0);
+
+volatile uint8_t expect;
+volatile uint16_t errors;
+
+ISR(USART_RX_vect)
+{
+	uint8_t b = UDR0;
+	if (b != expect)
+		errors++;
+	expect = b + 1;
+}
+
+int main()
+{
+	GPIOR0 = SIMAVR_CMD_UART_LOOPBACK;
+
+	UBRR0 = F_CPU / 8 / 250000 - 1;
+	UCSR0A = (1 << U2X0);
+	UCSR0C = (3 << UCSZ00);
+	UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
+	sei();
+
+	for (uint8_t b = 0; ; b++) {
+		loop_until_bit_is_set(UCSR0A, UDRE0);
+		UDR0 = b;
+		GPIOR1 = errors;
+	}
+}
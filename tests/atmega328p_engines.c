@@ -0,0 +1,124 @@
+/*
+	atmega328p_engines.c
+
+	What the predecoded engines take shortcuts for, for
+	test_atmega328p_engines.c: arithmetic setting all the SREG flags, busy
+	loops waiting on an interrupt or on an io flag, the avr-libc delay
+	loops, memset() and memcpy(). Each pass also hashes the timer counts,
+	so a cycle lost or gained anywhere shows. It ends asleep with the
+	interrupts off, the hash in 'result'.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega328p");
+
+#define PASSES		8
+#define BUF_SIZE	200
+
+static volatile uint8_t ticks;
+static uint8_t src[BUF_SIZE], dst[BUF_SIZE];
+volatile uint16_t result;
+
+ISR(TIMER0_OVF_vect)
+{
+	ticks++;
+}
+
+static uint16_t
+crc16(
+		uint16_t crc,
+		uint8_t v)
+{
+	crc ^= v;
+	for (uint8_t i = 0; i < 8; i++)
+		crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+	return crc;
+}
+
+// signed and unsigned compares, carries, overflows and 32 bits shifts
+static uint16_t
+arith(
+		uint16_t crc,
+		uint8_t seed)
+{
+	int16_t a = seed * 37 - 2000;
+	uint32_t b = 0x12345678UL ^ seed;
+
+	for (uint8_t i = 0; i < 50; i++) {
+		a = a * 3 + (a >> 2) - i;
+		b = (b << 3) + (b >> 29) + a;
+		if (a < 0)
+			crc = crc16(crc, i);
+		if ((int8_t)b > (int8_t)a)
+			crc = crc16(crc, b >> 8);
+		crc = crc16(crc, (uint8_t)a ^ (uint8_t)b);
+	}
+	return crc;
+}
+
+int main(void)
+{
+	uint16_t crc = 0xffff;
+
+	// timer0 overflows every 2048 cycles, its interrupt counts them
+	TCCR0B = (1 << CS01);
+	TIMSK0 = (1 << TOIE0);
+	// timer2 matches every 800 cycles, only polled
+	TCCR2A = (1 << WGM21);
+	OCR2A = 99;
+	TCCR2B = (1 << CS21);
+	sei();
+
+	for (uint8_t pass = 0; pass < PASSES; pass++) {
+		crc = arith(crc, pass);
+
+		// an idle loop, on a variable the interrupt changes
+		uint8_t t = ticks;
+		while (ticks == t)
+			;
+		// and one on an io flag
+		TIFR2 = (1 << OCF2A);
+		while (!(TIFR2 & (1 << OCF2A)))
+			;
+		crc = crc16(crc, TCNT0);
+
+		_delay_us(100);
+		_delay_ms(1);
+		crc = crc16(crc, TCNT2);
+
+		memset(dst, pass, sizeof(dst));
+		for (uint8_t i = 0; i < BUF_SIZE; i++)
+			src[i] = crc16(crc, i);
+		memcpy(dst + pass, src, sizeof(src) - pass);
+		for (uint8_t i = 0; i < BUF_SIZE; i++)
+			crc = crc16(crc, dst[i]);
+		crc = crc16(crc, ticks);
+	}
+	result = crc;
+
+	cli();
+	sleep_enable();
+	sleep_cpu();
+}
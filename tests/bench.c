@@ -0,0 +1,386 @@
+/*
+	bench.c
+
+	Runs the atmega328p_bench_*.axf firmwares, each in a process of its own,
+	and prints how fast simavr went with them, one line of JSON each:
+
+	{"workload":"cpu","mcu":"atmega328p","frequency":8000000,
+	 "cycles":8000000,"ipc":0.7712,"host_sec":0.0412,"mips":149.75,
+	 "ns_per_cycle":5.15,"peak_rss_kb":4376}
+
+	Counting the instructions slows the core down, so they are only counted
+	for the first part of the run, which also warms it up; the rest is the
+	one that's timed, and the MIPS are its cycles times that ratio.
+
+	With -r, each workload is run that many times, and the line is of the
+	medians, with the median absolute deviations of the MIPS and ns/cycle.
+
+	With -c, the results are compared to a baseline, a file of these lines
+	from an earlier run, and bench fails if the MIPS or the ns/cycle of a
+	workload got worse by more than -p percent of the baseline, or than
+	three times the deviation of either, whichever is more:
+
+	bench -r 5 > baseline.json
+	bench -r 5 -c baseline.json
+
+	bench [-t <simulated msec>] [-r <runs>] [-c <baseline> [-p <percent>]]
+		[workload...]
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_time.h"
+#include "sim_stats.h"
+#include "avr_uart.h"
+
+static const struct {
+	const char *	name;
+	uint32_t		msec;		// simulated, by default
+} workloads[] = {
+	{ "cpu", 1000 },
+	{ "crypto", 1000 },
+	{ "uart", 1000 },
+	{ "pwm", 1000 },
+	{ "bus", 1000 },
+	{ "sleep", 60000 },
+};
+
+static double
+bench_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+typedef struct bench_result_t {
+	char				mmcu[64];
+	uint32_t			frequency;
+	avr_cycle_count_t	cycles;
+	double				ipc, host_sec, mips, ns_per_cycle;
+	long				peak_rss_kb;
+} bench_result_t;
+
+static int
+bench_run(
+		const char * name,
+		uint32_t msec,
+		bench_result_t * r)
+{
+	char elf[64];
+	elf_firmware_t fw = {{0}};
+
+	snprintf(elf, sizeof(elf), "atmega328p_bench_%s.axf", name);
+	if (elf_read_firmware(elf, &fw)) {
+		fprintf(stderr, "%s: can't read %s\n", __func__, elf);
+		return 1;
+	}
+	avr_t * avr = avr_make_mcu_by_name(fw.mmcu);
+	if (!avr) {
+		fprintf(stderr, "%s: unknown mcu '%s'\n", __func__, fw.mmcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &fw);
+	// no console, no waiting for the host clock
+	avr->sleep = avr_callback_sleep_virtual;
+	for (char u = '0'; u <= '9'; u++) {
+		uint32_t flags = 0;
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(u), &flags);
+	}
+
+	avr_cycle_count_t total = avr_usec_to_cycles(avr, msec * 1000ull);
+	avr_cycle_count_t warm = total / 20;
+	avr_stats_t stats;
+	if (avr_stats_init(avr, &stats)) {
+		fprintf(stderr, "%s: can't count the instructions\n", __func__);
+		return 1;
+	}
+	avr_run_cycles(avr, warm);
+	avr_stats_stop(&stats);
+	avr_cycle_count_t counted = avr->cycle - stats.start;
+	double ipc = counted ? (double)stats.instructions / counted : 0;
+
+	avr_cycle_count_t start = avr->cycle;
+	double t = bench_now();
+	int state = avr_run_cycles(avr, total - warm);
+	t = bench_now() - t;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	snprintf(r->mmcu, sizeof(r->mmcu), "%s", fw.mmcu);
+	r->frequency = avr->frequency;
+	r->cycles = avr->cycle - start;
+	r->ipc = ipc;
+	r->host_sec = t;
+	r->mips = t > 0 ? r->cycles * ipc / t / 1e6 : 0;
+	r->ns_per_cycle = r->cycles ? t * 1e9 / r->cycles : 0;
+	r->peak_rss_kb = ru.ru_maxrss;
+	if (state != cpu_Running && state != cpu_Sleeping) {
+		fprintf(stderr, "%s: %s: the cpu stopped\n", __func__, name);
+		return 1;
+	}
+	return 0;
+}
+
+// a process each, so that the peak RSS is theirs
+static int
+bench_fork(
+		const char * name,
+		uint32_t msec,
+		bench_result_t * r)
+{
+	int fd[2];
+	if (pipe(fd)) {
+		perror("pipe");
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fd[0]);
+		int res = bench_run(name, msec, r);
+		if (!res && write(fd[1], r, sizeof(*r)) != sizeof(*r))
+			res = 1;
+		_exit(res);
+	}
+	close(fd[1]);
+	int got = pid != -1 && read(fd[0], r, sizeof(*r)) == sizeof(*r);
+	close(fd[0]);
+	int status = 0;
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+			!WIFEXITED(status) || WEXITSTATUS(status))
+		got = 0;
+	return !got;
+}
+
+static int
+bench_cmp_double(
+		const void * a,
+		const void * b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+// sorts 'v' in place
+static double
+bench_median(
+		double * v,
+		int count)
+{
+	qsort(v, count, sizeof(v[0]), bench_cmp_double);
+	return count & 1 ? v[count / 2] : (v[count / 2 - 1] + v[count / 2]) / 2;
+}
+
+static double
+bench_mad(
+		double * v,
+		int count,
+		double median)
+{
+	for (int i = 0; i < count; i++)
+		v[i] = fabs(v[i] - median);
+	return bench_median(v, count);
+}
+
+typedef struct bench_stat_t {
+	double	mips, mips_mad;
+	double	ns_per_cycle, ns_per_cycle_mad;
+} bench_stat_t;
+
+static double
+bench_field(
+		const char * line,
+		const char * field)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "\"%s\":", field);
+	const char * f = strstr(line, key);
+	return f ? strtod(f + strlen(key), NULL) : 0;
+}
+
+// the line of 'name' in the baseline file, 0 if it's not there
+static int
+bench_baseline(
+		const char * path,
+		const char * name,
+		bench_stat_t * b)
+{
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	char line[512], key[64];
+	int found = 0;
+	snprintf(key, sizeof(key), "\"workload\":\"%s\"", name);
+	while (!found && fgets(line, sizeof(line), f)) {
+		if (!strstr(line, key))
+			continue;
+		b->mips = bench_field(line, "mips");
+		b->mips_mad = bench_field(line, "mips_mad");
+		b->ns_per_cycle = bench_field(line, "ns_per_cycle");
+		b->ns_per_cycle_mad = bench_field(line, "ns_per_cycle_mad");
+		found = 1;
+	}
+	fclose(f);
+	return found;
+}
+
+/*
+ * A change is noise unless it's more than 'percent' of the baseline and
+ * more than three scaled MADs, about three sigmas, of either set of runs
+ */
+static double
+bench_margin(
+		double base,
+		double base_mad,
+		double mad,
+		double percent)
+{
+	double noise = 3 * 1.4826 * (base_mad > mad ? base_mad : mad);
+	double margin = base * percent / 100;
+	return noise > margin ? noise : margin;
+}
+
+static int
+bench_compare(
+		const char * path,
+		const char * name,
+		const bench_stat_t * s,
+		double percent)
+{
+	bench_stat_t b;
+	int found = bench_baseline(path, name, &b);
+	if (found <= 0) {
+		if (!found)
+			fprintf(stderr, "bench: %s isn't in %s\n", name, path);
+		return found;
+	}
+	int regressed = 0;
+	double m = bench_margin(b.mips, b.mips_mad, s->mips_mad, percent);
+	if (s->mips < b.mips - m) {
+		fprintf(stderr, "bench: %s: %.2f MIPS, the baseline is %.2f +/- %.2f\n",
+				name, s->mips, b.mips, m);
+		regressed++;
+	}
+	m = bench_margin(b.ns_per_cycle, b.ns_per_cycle_mad,
+			s->ns_per_cycle_mad, percent);
+	if (s->ns_per_cycle > b.ns_per_cycle + m) {
+		fprintf(stderr, "bench: %s: %.3f ns/cycle, the baseline is %.3f +/- %.3f\n",
+				name, s->ns_per_cycle, b.ns_per_cycle, m);
+		regressed++;
+	}
+	return regressed ? -1 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+	uint32_t msec = 0;
+	int runs = 1;
+	const char * baseline = NULL;
+	double percent = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:c:p:")) != -1) {
+		switch (opt) {
+			case 't':
+				msec = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'c':
+				baseline = optarg;
+				break;
+			case 'p':
+				percent = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t <simulated msec>] [-r <runs>] "
+						"[-c <baseline> [-p <percent>]] [workload...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (runs < 1 || runs > 100) {
+		fprintf(stderr, "%s: -r is 1 to 100 runs\n", argv[0]);
+		exit(1);
+	}
+	int failed = 0, ran = 0;
+	for (int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		const char * name = workloads[i].name;
+		int wanted = optind == argc;
+		for (int a = optind; a < argc; a++)
+			wanted |= !strcmp(argv[a], name);
+		if (!wanted)
+			continue;
+		ran++;
+		bench_result_t r[runs];
+		int ok = 1;
+		for (int n = 0; n < runs && ok; n++)
+			ok = !bench_fork(name, msec ? msec : workloads[i].msec, &r[n]);
+		if (!ok) {
+			fprintf(stderr, "%s: workload %s failed\n", argv[0], name);
+			failed++;
+			continue;
+		}
+		double v[runs];
+		bench_stat_t s;
+		for (int n = 0; n < runs; n++) v[n] = r[n].mips;
+		s.mips = bench_median(v, runs);
+		s.mips_mad = bench_mad(v, runs, s.mips);
+		for (int n = 0; n < runs; n++) v[n] = r[n].ns_per_cycle;
+		s.ns_per_cycle = bench_median(v, runs);
+		s.ns_per_cycle_mad = bench_mad(v, runs, s.ns_per_cycle);
+		for (int n = 0; n < runs; n++) v[n] = r[n].ipc;
+		double ipc = bench_median(v, runs);
+		for (int n = 0; n < runs; n++) v[n] = r[n].host_sec;
+		double host_sec = bench_median(v, runs);
+		long rss = 0;
+		for (int n = 0; n < runs; n++)
+			if (r[n].peak_rss_kb > rss)
+				rss = r[n].peak_rss_kb;
+
+		printf("{\"workload\":\"%s\",\"mcu\":\"%s\",\"frequency\":%u,"
+				"\"cycles\":%"PRI_avr_cycle_count",\"ipc\":%.4f,\"host_sec\":%.4f,"
+				"\"mips\":%.2f,\"ns_per_cycle\":%.3f,\"peak_rss_kb\":%ld",
+				name, r[0].mmcu, (unsigned)r[0].frequency, r[0].cycles, ipc,
+				host_sec, s.mips, s.ns_per_cycle, rss);
+		if (runs > 1)
+			printf(",\"runs\":%d,\"mips_mad\":%.2f,\"ns_per_cycle_mad\":%.3f",
+					runs, s.mips_mad, s.ns_per_cycle_mad);
+		printf("}\n");
+		fflush(stdout);
+		if (baseline && bench_compare(baseline, name, &s, percent) < 0)
+			failed++;
+	}
+	if (!ran) {
+		fprintf(stderr, "%s: no such workload\n", argv[0]);
+		exit(1);
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,284 @@
+/*
+	lifecycle.c
+
+	Times what an instance costs besides running it, the part that counts
+	when a farm runs many short jobs:
+
+	make		avr_make_mcu_by_name(), avr_init() and avr_load_firmware(),
+				each timed on its own, then avr_terminate(), for each core
+	reset		avr_reset() of an instance that ran a little, for each core
+	rss			the resident memory of 'n' instances of a core, made and
+				loaded side by side, in a process of their own
+
+	Each prints a line of JSON:
+
+	{"bench":"make","mcu":"atmega328p","ops":200,"make_us":4.10,
+	 "init_us":21.50,"load_us":0.80,"terminate_us":9.20}
+	{"bench":"reset","mcu":"atmega328p","ops":2000,"us_per_op":1.90}
+	{"bench":"rss","mcu":"atmega2560","n":100,"rss_kb":51200,
+	 "kb_per_instance":512.00,"make_us":35.00}
+
+	The rss is that of the process after making them, less the one before,
+	from /proc/self/statm; the firmware is a 1KB one, so that's what the
+	instances themselves take, not a firmware.
+
+	lifecycle [-s <scale>] [-m <mcu>]... [-n <max instances>] [bench...]
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+
+// the cores built in, see sim_core_decl.h
+extern avr_kind_t * avr_kind[];
+
+#define LIFE_FLASH	1024
+
+static uint8_t flash[LIFE_FLASH];
+
+static double
+life_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// in KB, 0 if it can't be read
+static long
+life_rss(void)
+{
+	long size = 0, resident = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// a loop of 'inc r16' and a rjmp back, the rest of it nops
+static void
+life_firmware(
+		elf_firmware_t * fw,
+		const char * mmcu)
+{
+	memset(fw, 0, sizeof(*fw));
+	snprintf(fw->mmcu, sizeof(fw->mmcu), "%s", mmcu);
+	fw->frequency = 8000000;
+	fw->flash = flash;
+	fw->flashsize = sizeof(flash);
+	memset(flash, 0, sizeof(flash));
+	for (int i = 0; i < 8; i++) {
+		flash[i * 2] = 0x03;	// inc r16
+		flash[i * 2 + 1] = 0x95;
+	}
+	flash[16] = 0xf7;			// rjmp .-18
+	flash[17] = 0xcf;
+}
+
+static avr_t *
+life_make(
+		elf_firmware_t * fw,
+		double * t)
+{
+	double s = life_now();
+	avr_t * avr = avr_make_mcu_by_name(fw->mmcu);
+	if (!avr)
+		return NULL;
+	double m = life_now();
+	avr_init(avr);
+	double i = life_now();
+	avr->log = LOG_NONE;
+	avr->sleep = avr_callback_sleep_virtual;
+	avr_load_firmware(avr, fw);
+	double l = life_now();
+	if (t) {
+		t[0] += m - s;
+		t[1] += i - m;
+		t[2] += l - i;
+	}
+	return avr;
+}
+
+static void
+bench_make(
+		const char * mmcu,
+		uint64_t ops)
+{
+	elf_firmware_t fw;
+	double t[4] = { 0 };
+
+	life_firmware(&fw, mmcu);
+	for (uint64_t n = 0; n < ops; n++) {
+		avr_t * avr = life_make(&fw, t);
+		if (!avr) {
+			fprintf(stderr, "lifecycle: no %s core\n", mmcu);
+			return;
+		}
+		double s = life_now();
+		avr_terminate(avr);
+		free(avr);
+		t[3] += life_now() - s;
+	}
+	printf("{\"bench\":\"make\",\"mcu\":\"%s\",\"ops\":%llu,\"make_us\":%.2f,"
+			"\"init_us\":%.2f,\"load_us\":%.2f,\"terminate_us\":%.2f}\n",
+			mmcu, (unsigned long long)ops, t[0] * 1e6 / ops, t[1] * 1e6 / ops,
+			t[2] * 1e6 / ops, t[3] * 1e6 / ops);
+	fflush(stdout);
+}
+
+static void
+bench_reset(
+		const char * mmcu,
+		uint64_t ops)
+{
+	elf_firmware_t fw;
+
+	life_firmware(&fw, mmcu);
+	avr_t * avr = life_make(&fw, NULL);
+	if (!avr) {
+		fprintf(stderr, "lifecycle: no %s core\n", mmcu);
+		return;
+	}
+	double t = 0;
+	for (uint64_t n = 0; n < ops; n++) {
+		avr_run_cycles(avr, 100);
+		double s = life_now();
+		avr_reset(avr);
+		t += life_now() - s;
+	}
+	printf("{\"bench\":\"reset\",\"mcu\":\"%s\",\"ops\":%llu,"
+			"\"us_per_op\":%.2f}\n", mmcu, (unsigned long long)ops,
+			t * 1e6 / ops);
+	fflush(stdout);
+	avr_terminate(avr);
+	free(avr);
+}
+
+static int
+life_rss_run(
+		const char * mmcu,
+		int count)
+{
+	elf_firmware_t fw;
+	avr_t ** avr = calloc(count, sizeof(*avr));
+	double t[3] = { 0 };
+
+	life_firmware(&fw, mmcu);
+	if (!avr)
+		return 1;
+	long before = life_rss();
+	for (int i = 0; i < count; i++)
+		if (!(avr[i] = life_make(&fw, t))) {
+			fprintf(stderr, "lifecycle: no %s core, or out of memory\n", mmcu);
+			return 1;
+		}
+	long rss = life_rss() - before;
+	printf("{\"bench\":\"rss\",\"mcu\":\"%s\",\"n\":%d,\"rss_kb\":%ld,"
+			"\"kb_per_instance\":%.2f,\"make_us\":%.2f}\n",
+			mmcu, count, rss, (double)rss / count,
+			(t[0] + t[1] + t[2]) * 1e6 / count);
+	fflush(stdout);
+	return 0;
+}
+
+// a process each, so that the memory is only theirs
+static void
+bench_rss(
+		const char * mmcu,
+		int count)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+		_exit(life_rss_run(mmcu, count));
+	int status = 0;
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+			!WIFEXITED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "lifecycle: %d %s failed\n", count, mmcu);
+}
+
+static int
+life_wanted(
+		int argc,
+		char ** argv,
+		const char * name)
+{
+	if (optind == argc)
+		return 1;
+	for (int a = optind; a < argc; a++)
+		if (!strcmp(argv[a], name))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	uint64_t scale = 200;
+	const char * mmcu[16];
+	int mcount = 0, max = 10000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:m:n:")) != -1) {
+		switch (opt) {
+			case 's':
+				scale = strtoull(optarg, NULL, 0);
+				break;
+			case 'm':
+				if (mcount < 16)
+					mmcu[mcount++] = optarg;
+				break;
+			case 'n':
+				max = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s <scale>] [-m <mcu>]... "
+						"[-n <max instances>] [bench...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!scale)
+		scale = 1;
+	// every core by default, by its first name
+	for (int k = 0; avr_kind[k]; k++) {
+		const char * name = avr_kind[k]->names[0];
+		int wanted = !mcount;
+		for (int i = 0; i < mcount; i++)
+			for (int j = 0; j < 4 && avr_kind[k]->names[j]; j++)
+				wanted |= !strcmp(mmcu[i], avr_kind[k]->names[j]);
+		if (wanted && life_wanted(argc, argv, "make"))
+			bench_make(name, scale);
+		if (wanted && life_wanted(argc, argv, "reset"))
+			bench_reset(name, scale * 10);
+	}
+	static const char * rss_mmcu[] = { "attiny85", "atmega2560" };
+	static const int rss_count[] = { 1, 100, 10000 };
+	for (int m = 0; m < (mcount ? mcount : 2); m++)
+		for (int i = 0; i < 3; i++)
+			if (rss_count[i] <= max && life_wanted(argc, argv, "rss"))
+				bench_rss(mcount ? mmcu[m] : rss_mmcu[m], rss_count[i]);
+	return 0;
+}
@@ -0,0 +1,348 @@
+/*
+	microbench.c
+
+	Times the simulator internals on their own, with no firmware to speak
+	of, so that a regression in one of them doesn't get lost in the others:
+
+	irq_chain	avr_raise_irq() at the head of 'n' connected irqs
+	irq_hooks	avr_raise_irq() on an irq with 'n' notify hooks
+	timer		a cycle timer registered and cancelled, 'n' others pending
+	timer_handle	the same, with a handle
+	io_plain	'out' to a register nothing hooks
+	io_hooked	'out' to PORTB, which the io port hooks
+	io_watched	'out' to a register an avr_iomem_getirq() irq watches
+	interrupts	'n' vectors raised, then serviced by a 'reti'
+	vcd		changes of 'n' signals logged to a VCD file
+	vcd_thread	the same, written by the writer thread
+
+	Each prints a line of JSON, with the time per operation:
+
+	{"bench":"irq_chain","n":4,"ops":2000000,"ns_per_op":11.52}
+
+	microbench [-s <scale>] [bench...]
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_vcd_file.h"
+
+static double
+micro_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+micro_report(
+		const char * name,
+		int n,
+		uint64_t ops,
+		double t)
+{
+	printf("{\"bench\":\"%s\",\"n\":%d,\"ops\":%llu,\"ns_per_op\":%.2f}\n",
+			name, n, (unsigned long long)ops, ops ? t * 1e9 / ops : 0);
+	fflush(stdout);
+}
+
+static avr_t *
+micro_avr(void)
+{
+	avr_t * avr = avr_make_mcu_by_name("atmega328p");
+	if (!avr) {
+		fprintf(stderr, "microbench: no atmega328p core\n");
+		exit(1);
+	}
+	avr_init(avr);
+	avr->frequency = 8000000;
+	avr->sleep = avr_callback_sleep_virtual;
+	avr->log = LOG_NONE;
+	return avr;
+}
+
+static void
+micro_flash(
+		avr_t * avr,
+		const uint16_t * op,
+		int count)
+{
+	for (int i = 0; i < count; i++) {
+		avr->flash[i * 2] = op[i];
+		avr->flash[i * 2 + 1] = op[i] >> 8;
+	}
+}
+
+// irqs of their own, with names, or the pool complains
+static avr_irq_t *
+micro_irqs(
+		avr_t * avr,
+		int n)
+{
+	static char name[64][8];
+	static const char * names[64];
+	for (int i = 0; i < n; i++) {
+		sprintf(name[i], "s%d", i);
+		names[i] = name[i];
+	}
+	return avr_alloc_irq(&avr->irq_pool, 0, n, names);
+}
+
+static void
+micro_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	(*(uint32_t *)param)++;
+}
+
+static void
+bench_irq(
+		int hooks,
+		int n,
+		uint64_t ops)
+{
+	avr_t * avr = micro_avr();
+	uint32_t count = 0;
+	avr_irq_t * irq = micro_irqs(avr, n);
+	if (hooks) {
+		for (int i = 0; i < n; i++)
+			avr_irq_register_notify(irq, micro_notify, &count);
+	} else {
+		for (int i = 0; i + 1 < n; i++)
+			avr_connect_irq(irq + i, irq + i + 1);
+		avr_irq_register_notify(irq + n - 1, micro_notify, &count);
+	}
+	double t = micro_now();
+	for (uint64_t i = 0; i < ops; i++)
+		avr_raise_irq(irq, i & 1);
+	t = micro_now() - t;
+	micro_report(hooks ? "irq_hooks" : "irq_chain", n, ops, t);
+	avr_free_irq(irq, n);
+	avr_terminate(avr);
+}
+
+static avr_cycle_count_t
+micro_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return 0;
+}
+
+static void
+bench_timer(
+		int handles,
+		int n,
+		uint64_t ops)
+{
+	avr_t * avr = micro_avr();
+	char other[64];
+	avr_cycle_timer_handle_t handle = {0};
+
+	// the ones pending, all later than the one being moved around
+	for (int i = 0; i < n; i++)
+		avr_cycle_timer_register(avr, 1000000 + i * 100, micro_timer, other + i);
+	double t = micro_now();
+	for (uint64_t i = 0; i < ops; i++) {
+		avr_cycle_count_t when = 1000 + (i & 0xff) * 4000;
+		if (handles) {
+			avr_cycle_timer_register_handle(avr, &handle, when, micro_timer, NULL);
+			avr_cycle_timer_cancel_handle(avr, &handle);
+		} else {
+			avr_cycle_timer_register(avr, when, micro_timer, NULL);
+			avr_cycle_timer_cancel(avr, micro_timer, NULL);
+		}
+	}
+	t = micro_now() - t;
+	micro_report(handles ? "timer_handle" : "timer", n, ops, t);
+	avr_terminate(avr);
+}
+
+// 16 'out' of r16 to io register 'io', then rjmp back; the ops are the outs
+static void
+bench_io(
+		const char * name,
+		uint8_t io,
+		int watch,
+		uint64_t ops)
+{
+	avr_t * avr = micro_avr();
+	uint16_t op[18];
+	uint32_t count = 0;
+
+	op[0] = 0xef0f;		// ldi r16, 0xff
+	for (int i = 1; i <= 16; i++)
+		op[i] = 0xb800 | ((io & 0x30) << 5) | (16 << 4) | (io & 0xf);
+	op[17] = 0xcfef;	// rjmp to the first out
+	micro_flash(avr, op, 18);
+	if (watch)
+		avr_irq_register_notify(avr_iomem_getirq(avr, io + 32, NULL, AVR_IOMEM_IRQ_ALL),
+				micro_notify, &count);
+	avr->data[0x24] = 0xff;		// DDRB, so the port pins are driven
+	avr_run_cycles(avr, 1000);
+	avr_cycle_count_t start = avr->cycle;
+	double t = micro_now();
+	avr_run_cycles(avr, ops / 16 * 18);
+	t = micro_now() - t;
+	micro_report(name, 16, (avr->cycle - start) * 16 / 18, t);
+	avr_terminate(avr);
+}
+
+/*
+ * The vectors are ours, enabled by the GPIOR bits, and all point to a
+ * 'reti'; what's timed is raising and servicing them all, 'rounds' times
+ */
+static void
+bench_interrupts(
+		int n,
+		uint64_t rounds)
+{
+	avr_t * avr = micro_avr();
+	avr_int_vector_t vector[24];
+	static const uint8_t gpior[3] = { 0x3e, 0x4a, 0x4b };
+
+	memset(vector, 0, sizeof(vector));
+	uint16_t op[2 + 24 * 2] = {
+		0x9478,		// sei
+		0xcfff,		// rjmp .-2
+	};
+	for (int i = 1; i <= n; i++) {
+		op[i * 2] = 0x9518;		// reti
+		op[i * 2 + 1] = 0;
+		vector[i - 1].vector = i;
+		vector[i - 1].enable = (avr_regbit_t)
+				AVR_IO_REGBIT(gpior[(i - 1) / 8], (i - 1) % 8);
+		avr->data[gpior[(i - 1) / 8]] |= 1 << ((i - 1) % 8);
+		avr_register_vector(avr, &vector[i - 1]);
+	}
+	micro_flash(avr, op, 2 + n * 2);
+	avr_run_cycles(avr, 100);
+	double t = micro_now();
+	for (uint64_t r = 0; r < rounds; r++) {
+		for (int i = 0; i < n; i++)
+			avr_raise_interrupt(avr, &vector[i]);
+		while (avr->interrupts.pending || avr->interrupts.running_ptr)
+			avr_run_cycles(avr, 1);
+	}
+	t = micro_now() - t;
+	micro_report("interrupts", n, rounds * n, t);
+	avr_terminate(avr);
+}
+
+static void
+bench_vcd(
+		int thread,
+		int n,
+		uint64_t ops)
+{
+	avr_t * avr = micro_avr();
+	avr_vcd_t vcd;
+
+	if (avr_vcd_init(avr, "/dev/null", &vcd, 1000)) {
+		fprintf(stderr, "microbench: can't open the VCD file\n");
+		exit(1);
+	}
+	avr_irq_t * irq = micro_irqs(avr, n);
+	for (int i = 0; i < n; i++)
+		avr_vcd_add_signal(&vcd, irq + i, 1, irq[i].name);
+	if (thread)
+		avr_vcd_set_writer_thread(&vcd, 0);
+	avr_vcd_start(&vcd);
+	double t = micro_now();
+	for (uint64_t i = 0; i < ops; i++) {
+		avr->cycle += 4;
+		avr_raise_irq(irq + i % n, (i / n) & 1);
+		if ((i & 0xff) == 0)
+			avr_cycle_timer_process(avr);
+	}
+	avr_vcd_stop(&vcd);
+	t = micro_now() - t;
+	micro_report(thread ? "vcd_thread" : "vcd", n, ops, t);
+	avr_vcd_close(&vcd);
+	avr_free_irq(irq, n);
+	avr_terminate(avr);
+}
+
+static int
+micro_wanted(
+		int argc,
+		char ** argv,
+		const char * name)
+{
+	if (optind == argc)
+		return 1;
+	for (int a = optind; a < argc; a++)
+		if (!strcmp(argv[a], name))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	uint64_t scale = 1000000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt != 's') {
+			fprintf(stderr, "Usage: %s [-s <scale>] [bench...]\n", argv[0]);
+			exit(1);
+		}
+		scale = strtoull(optarg, NULL, 0);
+	}
+	static const int depth[] = { 1, 4, 16 };
+	static const int timers[] = { 8, 32, 64 };
+	static const int vectors[] = { 1, 4, 16 };
+	static const int signals[] = { 1, 8, 64 };
+
+	for (int i = 0; i < 3; i++) {
+		if (micro_wanted(argc, argv, "irq_chain"))
+			bench_irq(0, depth[i], scale * 4);
+		if (micro_wanted(argc, argv, "irq_hooks"))
+			bench_irq(1, depth[i], scale * 4);
+	}
+	for (int i = 0; i < 3; i++) {
+		if (micro_wanted(argc, argv, "timer"))
+			bench_timer(0, timers[i], scale * 2);
+		if (micro_wanted(argc, argv, "timer_handle"))
+			bench_timer(1, timers[i], scale * 2);
+	}
+	if (micro_wanted(argc, argv, "io_plain"))
+		bench_io("io_plain", 0x1e, 0, scale * 16);
+	if (micro_wanted(argc, argv, "io_hooked"))
+		bench_io("io_hooked", 0x05, 0, scale * 16);
+	if (micro_wanted(argc, argv, "io_watched"))
+		bench_io("io_watched", 0x2a, 1, scale * 16);
+	for (int i = 0; i < 3; i++)
+		if (micro_wanted(argc, argv, "interrupts"))
+			bench_interrupts(vectors[i], scale / vectors[i]);
+	for (int i = 0; i < 3; i++) {
+		if (micro_wanted(argc, argv, "vcd"))
+			bench_vcd(0, signals[i], scale * 2);
+		if (micro_wanted(argc, argv, "vcd_thread"))
+			bench_vcd(1, signals[i], scale * 2);
+	}
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+	runner.c
+
+	Runs the test programs side by side, each in a process of its own, as
+	many at a time as there are cores, and kills those that take too long.
+	Each prints a line once it's done, with what it printed if it failed,
+	then there's the summary the serial "make run_tests" prints:
+
+	PASS  obj-x86_64-linux-gnu/test_atmega88_example.tst 0.04s 71341 cycles
+	Tests run: 9  Successes: 9  Failures: 0
+
+	The tests are the arguments, or the lines of a file with -f, which can
+	have arguments of their own, for test matrices:
+
+	runner [-j <jobs>] [-t <timeout sec>] [-f <list>] [test...]
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define RUNNER_MAX_ARGS	32
+
+typedef struct runner_test_t {
+	char *		line;		// as given, for the report
+	char *		argv[RUNNER_MAX_ARGS + 1];
+	pid_t		pid;
+	int			fd;			// its stdout and stderr
+	double		start;
+	char *		out;
+	size_t		len, size;
+} runner_test_t;
+
+static double
+runner_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static runner_test_t * tests;
+static int tests_count, tests_size;
+
+static void
+runner_add(
+		const char * line)
+{
+	if (tests_count == tests_size) {
+		tests_size = tests_size ? tests_size * 2 : 64;
+		tests = realloc(tests, tests_size * sizeof(tests[0]));
+	}
+	runner_test_t * t = &tests[tests_count];
+	memset(t, 0, sizeof(*t));
+	t->line = strdup(line);
+	char * args = strdup(line);
+	int argc = 0;
+	for (char * a = strtok(args, " \t\n"); a && argc < RUNNER_MAX_ARGS;
+			a = strtok(NULL, " \t\n"))
+		t->argv[argc++] = a;
+	if (!argc) {
+		free(args);
+		free(t->line);
+		return;
+	}
+	t->fd = -1;
+	tests_count++;
+}
+
+static int
+runner_add_list(
+		const char * path)
+{
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = 0;
+		if (line[0] != '#')
+			runner_add(line);
+	}
+	fclose(f);
+	return 0;
+}
+
+static int
+runner_start(
+		runner_test_t * t)
+{
+	int fd[2];
+	if (pipe(fd)) {
+		perror("pipe");
+		return -1;
+	}
+	t->start = runner_now();
+	t->pid = fork();
+	if (t->pid == 0) {
+		close(fd[0]);
+		dup2(fd[1], 1);
+		dup2(fd[1], 2);
+		close(fd[1]);
+		execv(t->argv[0], t->argv);
+		fprintf(stderr, "%s: %s\n", t->argv[0], strerror(errno));
+		_exit(127);
+	}
+	close(fd[1]);
+	if (t->pid == -1) {
+		perror("fork");
+		close(fd[0]);
+		return -1;
+	}
+	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	t->fd = fd[0];
+	return 0;
+}
+
+static void
+runner_read(
+		runner_test_t * t)
+{
+	if (t->size - t->len < 512) {
+		t->size = t->size ? t->size * 2 : 1024;
+		t->out = realloc(t->out, t->size);
+	}
+	ssize_t r = read(t->fd, t->out + t->len, t->size - t->len - 1);
+	if (r <= 0 && !(r == -1 && errno == EINTR)) {
+		close(t->fd);
+		t->fd = -1;
+		return;
+	}
+	if (r > 0)
+		t->len += r;
+	t->out[t->len] = 0;
+}
+
+static int
+runner_finish(
+		runner_test_t * t,
+		int status,
+		int timed_out)
+{
+	double took = runner_now() - t->start;
+	int ok = !timed_out && WIFEXITED(status) && !WEXITSTATUS(status);
+
+	// tests_success() prints the cycles the last run took
+	unsigned long long cycles = 0;
+	const char * c = t->out ? strstr(t->out, "OK: ") : NULL;
+	if (c && (c = strchr(c, '(')))
+		cycles = strtoull(c + 1, NULL, 10);
+	printf("%s  %s %.2fs", ok ? "PASS" : "FAIL", t->line, took);
+	if (cycles)
+		printf(" %llu cycles", cycles);
+	if (timed_out)
+		printf(" timed out");
+	else if (WIFSIGNALED(status))
+		printf(" killed by signal %d", WTERMSIG(status));
+	else if (!ok)
+		printf(" exit value %d", WEXITSTATUS(status));
+	printf("\n");
+	if (!ok && t->len)
+		printf("%s%s", t->out, t->out[t->len - 1] == '\n' ? "" : "\n");
+	fflush(stdout);
+	free(t->out);
+	t->out = NULL;
+	t->pid = 0;
+	return ok;
+}
+
+int main(int argc, char ** argv)
+{
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	double timeout = 60;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:t:f:")) != -1) {
+		switch (opt) {
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 't':
+				timeout = atof(optarg);
+				break;
+			case 'f':
+				if (runner_add_list(optarg))
+					exit(1);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-j <jobs>] [-t <timeout sec>] "
+						"[-f <list>] [test...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	for (int a = optind; a < argc; a++)
+		runner_add(argv[a]);
+	if (jobs < 1)
+		jobs = 1;
+	if (!tests_count) {
+		fprintf(stderr, "%s: no tests to run\n", argv[0]);
+		exit(1);
+	}
+	runner_test_t * running[jobs];
+	struct pollfd fds[jobs];
+	int next = 0, active = 0, failed = 0;
+
+	while (next < tests_count || active) {
+		while (active < jobs && next < tests_count) {
+			runner_test_t * t = &tests[next++];
+			if (runner_start(t)) {
+				failed++;
+				continue;
+			}
+			running[active++] = t;
+		}
+		double now = runner_now(), wait = timeout;
+		for (int i = 0; i < active; i++) {
+			fds[i].fd = running[i]->fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			double left = running[i]->start + timeout - now;
+			// it closed its output, but it might not be done yet
+			if (running[i]->fd == -1 && left > 0.01)
+				left = 0.01;
+			if (left < wait)
+				wait = left;
+		}
+		if (poll(fds, active, wait > 0 ? wait * 1000 + 1 : 0) < 0 &&
+				errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+		now = runner_now();
+		for (int i = 0; i < active; ) {
+			runner_test_t * t = running[i];
+			int status = 0, timed_out = 0;
+			if (fds[i].revents)
+				runner_read(t);
+			pid_t done = t->fd == -1 ? waitpid(t->pid, &status, WNOHANG) : 0;
+			if (!done && now - t->start >= timeout) {
+				kill(t->pid, SIGKILL);
+				done = waitpid(t->pid, &status, 0);
+				timed_out = 1;
+			}
+			if (!done) {
+				i++;
+				continue;
+			}
+			if (t->fd != -1) {
+				close(t->fd);
+				t->fd = -1;
+			}
+			if (!runner_finish(t, status, timed_out))
+				failed++;
+			active--;
+			running[i] = running[active];
+			fds[i] = fds[active];
+		}
+	}
+	printf("Tests run: %d  Successes: %d  Failures: %d\n",
+			tests_count, tests_count - failed, failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_tier.h"
+#include "sim_snapshot.h"
+
+/*
+ * Runs atmega328p_engines.axf to its end with each of the engines, and
+ * checks they all leave the core in the same state, at the same cycle, as
+ * the plain decoder. Then the same from a snapshot taken half way, run to
+ * the end, restored and run again, twice.
+ */
+#define ENGINES_FIRMWARE	"atmega328p_engines.axf"
+#define ENGINES_MAX_CYCLES	20000000
+#define ENGINES_BUDGET		10000	// for avr_run_cycles()
+
+enum {
+	ENGINE_RAW = 0,		// avr_run(), the decoder
+	ENGINE_PREDECODED,	// avr_run(), the predecoded cache
+	ENGINE_THREADED,	// avr_callback_run_threaded()
+	ENGINE_TIERED,		// avr_callback_run_tiered()
+	ENGINE_CYCLES,		// avr_run_cycles(), the decoder
+	ENGINE_CYCLES_PREDECODED,
+	ENGINE_COUNT,
+};
+
+static const char * engine_name[ENGINE_COUNT] = {
+	[ENGINE_RAW] = "raw",
+	[ENGINE_PREDECODED] = "predecoded",
+	[ENGINE_THREADED] = "threaded",
+	[ENGINE_TIERED] = "tiered",
+	[ENGINE_CYCLES] = "run_cycles",
+	[ENGINE_CYCLES_PREDECODED] = "run_cycles predecoded",
+};
+
+typedef struct engines_state_t {
+	avr_cycle_count_t	cycle;
+	avr_flashaddr_t		pc;
+	uint8_t				sreg[8];
+	uint8_t *			data;	// registers, io and sram
+	uint32_t			size;
+} engines_state_t;
+
+// it has to outlive the instance, until it's released
+static avr_tier_t tier;
+
+static void
+engines_setup(
+		avr_t * avr,
+		int engine)
+{
+	switch (engine) {
+		case ENGINE_PREDECODED:
+		case ENGINE_CYCLES_PREDECODED:
+			if (avr_predecode_init(avr))
+				fail("%s: can't predecode", engine_name[engine]);
+			break;
+		case ENGINE_THREADED:
+			avr->run = avr_callback_run_threaded;
+			break;
+		case ENGINE_TIERED:
+			// low enough for the loops to go to the threaded engine
+			if (avr_tier_init(avr, &tier, 16, 0))
+				fail("%s: can't tier the engines", engine_name[engine]);
+			break;
+	}
+}
+
+// runs to the end, the firmware sleeps with the interrupts off
+static void
+engines_finish(
+		avr_t * avr,
+		int engine)
+{
+	int state = avr->state;
+
+	while ((state == cpu_Running || state == cpu_Sleeping) &&
+			avr->cycle < ENGINES_MAX_CYCLES) {
+		if (engine == ENGINE_CYCLES || engine == ENGINE_CYCLES_PREDECODED)
+			state = avr_run_cycles(avr, ENGINES_BUDGET);
+		else
+			state = avr_run(avr);
+	}
+	if (state != cpu_Done)
+		fail("%s: the firmware didn't finish; state=%d, cycles=%"
+				PRI_avr_cycle_count, engine_name[engine], state, avr->cycle);
+	tests_cycle_count = avr->cycle;
+}
+
+static void
+engines_save(
+		avr_t * avr,
+		engines_state_t * s)
+{
+	avr_sreg_materialize(avr);
+	s->cycle = avr->cycle;
+	s->pc = avr->pc;
+	memcpy(s->sreg, avr->sreg, sizeof(s->sreg));
+	s->size = avr->ramend + 1;
+	s->data = realloc(s->data, s->size);
+	if (!s->data)
+		fail("out of memory");
+	memcpy(s->data, avr->data, s->size);
+}
+
+static void
+engines_compare(
+		const char * what,
+		engines_state_t * ref,
+		engines_state_t * s)
+{
+	if (s->cycle != ref->cycle)
+		fail("%s: finished at cycle %" PRI_avr_cycle_count ", not %"
+				PRI_avr_cycle_count, what, s->cycle, ref->cycle);
+	if (s->pc != ref->pc)
+		fail("%s: pc %04x, not %04x", what, s->pc, ref->pc);
+	for (int i = 0; i < 8; i++)
+		if (!!s->sreg[i] != !!ref->sreg[i])
+			fail("%s: SREG bit %d is %d", what, i, s->sreg[i]);
+	// the io registers are only up to date once read, skip them
+	for (uint32_t i = 0; i < ref->size; i++) {
+		if (i >= 0x20 && i < 0x100 && i != R_SPL && i != R_SPH)
+			continue;
+		if (s->data[i] != ref->data[i])
+			fail("%s: data[%04x] is %02x, not %02x", what, i,
+					s->data[i], ref->data[i]);
+	}
+}
+
+/*
+ * The first restore copies all the pages back, the second only the ones
+ * written since the first; the predecoded cache has to see them all.
+ */
+static void
+engines_snapshot(
+		engines_state_t * ref,
+		engines_state_t * s)
+{
+	static const char * pass[] = {
+		"snapshot, run", "snapshot, restored", "snapshot, restored again" };
+	avr_t * avr = tests_init_avr(ENGINES_FIRMWARE);
+
+	engines_setup(avr, ENGINE_CYCLES_PREDECODED);
+	while (avr->cycle < ref->cycle / 2) {
+		int state = avr_run_cycles(avr, ENGINES_BUDGET);
+		if (state != cpu_Running && state != cpu_Sleeping)
+			fail("snapshot: the firmware finished early; state=%d", state);
+	}
+	avr_cycle_count_t half = avr->cycle;
+	avr_snapshot_t * snap = avr_snapshot_save(avr);
+	if (!snap)
+		fail("snapshot: can't take one");
+	for (int i = 0; i < 3; i++) {
+		if (i && avr_snapshot_restore(avr, snap))
+			fail("%s: can't restore it", pass[i]);
+		if (avr->cycle != half || avr->state == cpu_Done)
+			fail("%s: not back half way", pass[i]);
+		engines_finish(avr, ENGINE_CYCLES_PREDECODED);
+		engines_save(avr, s);
+		engines_compare(pass[i], ref, s);
+	}
+	avr_snapshot_free(snap);
+	tests_release_avr(avr);
+}
+
+int main(int argc, char **argv) {
+	avr_t * avr[ENGINE_COUNT];
+	engines_state_t ref = {0}, s = {0};
+
+	tests_init(argc, argv);
+
+	// all at once, so none gets an instance another engine has set up
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		avr[e] = tests_init_avr(ENGINES_FIRMWARE);
+		engines_setup(avr[e], e);
+	}
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		engines_finish(avr[e], e);
+		engines_save(avr[e], e == ENGINE_RAW ? &ref : &s);
+		if (e != ENGINE_RAW)
+			engines_compare(engine_name[e], &ref, &s);
+	}
+	for (int e = 0; e < ENGINE_COUNT; e++)
+		tests_release_avr(avr[e]);
+
+	engines_snapshot(&ref, &s);
+
+	free(ref.data);
+	free(s.data);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_gdb.h"
+#ifndef __MINGW32__
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+/*
+ * Steps atmega328p_engines.axf from reset through the gdb stub, then goes
+ * back with reverse continue to a breakpoint, and reverse step to the
+ * start, checking the core is in the state it was in at each of these
+ * steps. One more reverse step is the start of the history. The core runs
+ * in its own thread, as with run_avr, and is looked at while stopped.
+ */
+#define GDB_FIRMWARE	"atmega328p_engines.axf"
+#define GDB_PORT		4321	// and the next ones, if taken
+#define GDB_STEPS		3000	// past a timer interrupt or two
+
+typedef struct gdb_state_t {
+	avr_cycle_count_t	cycle;
+	avr_flashaddr_t		pc;
+	uint8_t				sreg[8];
+	uint8_t *			data;	// registers, io and sram
+} gdb_state_t;
+
+#ifndef __MINGW32__
+static gdb_state_t state[GDB_STEPS + 1];
+static int client = -1;
+static volatile int done;
+
+static void
+gdb_save(
+		avr_t * avr,
+		gdb_state_t * s)
+{
+	avr_sreg_materialize(avr);
+	s->cycle = avr->cycle;
+	s->pc = avr->pc;
+	memcpy(s->sreg, avr->sreg, sizeof(s->sreg));
+	s->data = malloc(avr->ramend + 1);
+	if (!s->data)
+		fail("out of memory");
+	memcpy(s->data, avr->data, avr->ramend + 1);
+}
+
+static void
+gdb_compare(
+		avr_t * avr,
+		int step)
+{
+	gdb_state_t * s = &state[step];
+
+	avr_sreg_materialize(avr);
+	if (avr->cycle != s->cycle || avr->pc != s->pc)
+		fail("step %d: at cycle %" PRI_avr_cycle_count " pc %04x, not %"
+				PRI_avr_cycle_count " pc %04x", step, avr->cycle, avr->pc,
+				s->cycle, s->pc);
+	for (int i = 0; i < 8; i++)
+		if (!!avr->sreg[i] != !!s->sreg[i])
+			fail("step %d: SREG bit %d is %d", step, i, avr->sreg[i]);
+	// the io registers are only up to date once read, skip them
+	for (uint32_t i = 0; i <= avr->ramend; i++) {
+		if (i >= 0x20 && i < 0x100 && i != R_SPL && i != R_SPH)
+			continue;
+		if (avr->data[i] != s->data[i])
+			fail("step %d: data[%04x] is %02x, not %02x", step, i,
+					avr->data[i], s->data[i]);
+	}
+}
+
+/*
+ * Sends 'cmd', and waits for the stub to reply something else than an
+ * ack; the reply is returned in 'reply'.
+ */
+static void
+gdb_command(
+		const char * cmd,
+		char * reply,
+		size_t size)
+{
+	char packet[256];
+	uint8_t check = 0;
+
+	for (const char * c = cmd; *c; c++)
+		check += *c;
+	int len = snprintf(packet, sizeof(packet), "$%s#%02x", cmd, check);
+	if (send(client, packet, len, 0) != len)
+		fail("'%s': can't send it", cmd);
+
+	size_t got = 0;
+	for (;;) {
+		ssize_t r = recv(client, reply + got, size - got - 1, 0);
+		if (r <= 0)
+			fail("'%s': no reply", cmd);
+		got += r;
+		reply[got] = 0;
+		// drop the acks
+		char * start = strchr(reply, '$');
+		char * end = start ? strchr(start, '#') : NULL;
+		if (!start)
+			got = 0;
+		else if (end && strlen(end) >= 3) {
+			*end = 0;
+			memmove(reply, start + 1, end - start);
+			return;
+		}
+	}
+}
+
+static void *
+gdb_core_thread(
+		void * param)
+{
+	avr_t * avr = param;
+
+	while (!done)
+		avr_run(avr);
+	return NULL;
+}
+
+static void
+gdb_connect(
+		avr_t * avr)
+{
+	int port;
+
+	for (port = GDB_PORT; port < GDB_PORT + 16; port++) {
+		avr->gdb_port = port;
+		if (avr_gdb_init(avr) == 0)
+			break;
+	}
+	if (!avr->gdb)
+		fail("can't start the gdb stub");
+	client = socket(PF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address = { 0 };
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (client < 0 ||
+			connect(client, (struct sockaddr *)&address, sizeof(address)))
+		fail("can't connect to the gdb stub on port %d", port);
+	struct timeval timeout = { .tv_sec = 10 };
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+int main(int argc, char **argv) {
+	char reply[1024], cmd[32];
+	pthread_t core;
+
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr(GDB_FIRMWARE);
+	avr->state = cpu_Stopped;
+	gdb_connect(avr);
+	if (pthread_create(&core, NULL, gdb_core_thread, avr))
+		fail("can't start the core thread");
+
+	gdb_command("?", reply, sizeof(reply));
+	gdb_save(avr, &state[0]);
+	for (int i = 1; i <= GDB_STEPS; i++) {
+		gdb_command("s", reply, sizeof(reply));
+		if (reply[0] != 'T')
+			fail("step %d: reply '%s'", i, reply);
+		gdb_save(avr, &state[i]);
+	}
+
+	// back to the last time it was where it was a third of the way
+	int bp = GDB_STEPS / 3, back = GDB_STEPS - 1;
+	while (state[back].pc != state[bp].pc)
+		back--;
+	sprintf(cmd, "Z0,%x,2", state[bp].pc);
+	gdb_command(cmd, reply, sizeof(reply));
+	if (strcmp(reply, "OK"))
+		fail("'%s': reply '%s'", cmd, reply);
+	gdb_command("bc", reply, sizeof(reply));
+	if (reply[0] != 'T')
+		fail("reverse continue: reply '%s'", reply);
+	gdb_compare(avr, back);
+	cmd[0] = 'z';
+	gdb_command(cmd, reply, sizeof(reply));
+	if (strcmp(reply, "OK"))
+		fail("'%s': reply '%s'", cmd, reply);
+
+	for (int i = back - 1; i >= 0; i--) {
+		gdb_command("bs", reply, sizeof(reply));
+		if (reply[0] != 'T' || strstr(reply, "replaylog"))
+			fail("reverse step to %d: reply '%s'", i, reply);
+		gdb_compare(avr, i);
+	}
+	gdb_command("bs", reply, sizeof(reply));
+	if (!strstr(reply, "replaylog:begin"))
+		fail("reverse step past the start: reply '%s'", reply);
+	gdb_compare(avr, 0);
+
+	// and forward again, replaying
+	for (int i = 1; i <= GDB_STEPS; i++) {
+		gdb_command("s", reply, sizeof(reply));
+		gdb_compare(avr, i);
+	}
+	tests_cycle_count = avr->cycle;
+
+	done = 1;
+	pthread_join(core, NULL);
+	close(client);
+	tests_release_avr(avr);
+	for (int i = 0; i <= GDB_STEPS; i++)
+		free(state[i].data);
+	tests_success();
+	return 0;
+}
+#else
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+	tests_success();
+	return 0;
+}
+#endif
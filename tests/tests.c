@@ -2,6 +2,8 @@
 #include "sim_avr.h"
 #include "sim_elf.h"
 #include "sim_core.h"
+#include "sim_pool.h"
+#include "sim_forkserver.h"
 #include "avr_uart.h"
 #include <stdio.h>
 #include <setjmp.h>
@@ -9,6 +11,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
 
 avr_cycle_count_t tests_cycle_count = 0;
 int tests_disable_stdout = 1;
@@ -22,7 +29,8 @@ static int finished = 0;
 #else
 static FILE *orig_stderr = NULL;
 #define restore_stderr()	{ if (orig_stderr) stderr = orig_stderr; }
-#define map_stderr()		{ if (tests_disable_stdout) { \
+// once, tests_init_avr() can be called for more than one instance
+#define map_stderr()		{ if (tests_disable_stdout && !orig_stderr) { \
 								orig_stderr = stderr;	\
 								fclose(stdout);			\
 								stderr = stdout;		\
@@ -36,7 +44,8 @@ static void atexit_handler(void) {
 
 void tests_success(void) {
 	restore_stderr();
-	fprintf(stderr, "OK: %s\n", test_name);
+	fprintf(stderr, "OK: %s (%" PRI_avr_cycle_count " cycles)\n",
+			test_name, tests_cycle_count);
 	finished = 1;
 }
 
@@ -99,18 +108,43 @@ static int my_avr_run(avr_t * avr)
 	return avr->state;
 }
 
+// instances of the last firmware, ready to go again
+static avr_pool_t *tests_pool = NULL;
+static char *tests_pool_elf = NULL;
+
 avr_t *tests_init_avr(const char *elfname) {
 	tests_cycle_count = 0;
 	map_stderr();
 
-	elf_firmware_t fw;
-	if (elf_read_firmware(elfname, &fw))
-		fail("Failed to read ELF firmware \"%s\"", elfname);
-	avr_t *avr = avr_make_mcu_by_name(fw.mmcu);
+	if (!tests_pool || strcmp(tests_pool_elf, elfname)) {
+		elf_firmware_t fw;
+		if (elf_read_firmware(elfname, &fw))
+			fail("Failed to read ELF firmware \"%s\"", elfname);
+		avr_pool_free(tests_pool);
+		free(tests_pool_elf);
+		tests_pool = avr_pool_new(&fw);
+		tests_pool_elf = strdup(elfname);
+		if (!tests_pool)
+			fail("Creating AVR pool failed.");
+	}
+	avr_t *avr = avr_pool_get(tests_pool);
 	if (!avr)
 		fail("Creating AVR failed.");
-	avr_init(avr);
-	avr_load_firmware(avr, &fw);
+	return avr;
+}
+
+void tests_release_avr(avr_t *avr) {
+	if (tests_pool)
+		avr_pool_release(tests_pool, avr);
+}
+
+avr_t *tests_fork_server(const char *elfname) {
+	avr_t *avr = tests_init_avr(elfname);
+	if (avr_fork_server(avr, AVR_FORKSRV_FD, AVR_FORKSRV_FD + 1) == 0) {
+		// the runs said how they went
+		finished = 1;
+		exit(0);
+	}
 	return avr;
 }
 
@@ -136,6 +170,9 @@ int tests_run_test(avr_t *avr, unsigned long run_usec) {
 	} else if (reason == 2) {
 		// returned from special deinit, avr stopped
 		return reason;
+	} else if (reason == LJR_UART_MATCH || reason == LJR_UART_MISMATCH) {
+		// the uart matcher stopped it
+		return reason;
 	}
 	fail("Error in test case: Should never reach this.");
 	return 0;
@@ -146,59 +183,124 @@ int tests_init_and_run_test(const char *elfname, unsigned long run_usec) {
 	return tests_run_test(avr, run_usec);
 }
 
-struct output_buffer {
-	char *str;
-	int currlen;
-	int alloclen;
-	int maxlen;
+/*
+ * The UART output is checked byte by byte as it comes, so the first
+ * difference stops the simulation right there. 'stop' also stops it when
+ * all of it has been received, rather than waiting for the firmware to
+ * finish; otherwise, anything more is a difference.
+ */
+struct uart_matcher {
+	const char *expected;
+	size_t len;
+	size_t pos;		// bytes that matched
+	int stop;
+	uint8_t got;	// the byte that didn't
 };
 
-/* static void buf_output_cb(avr_t *avr, avr_io_addr_t addr, uint8_t v, */
-/* 			  void *param) { */
-static void buf_output_cb(struct avr_irq_t *irq, uint32_t value, void *param) {
-	struct output_buffer *buf = param;
-	if (!buf)
-		fail("Internal error: buf == NULL in buf_output_cb()");
-	if (buf->currlen > buf->alloclen-1)
-		fail("Internal error");
-	if (buf->alloclen == 0)
-		fail("Internal error");
-	if (buf->currlen == buf->alloclen-1) {
-		buf->alloclen *= 2;
-		buf->str = realloc(buf->str, buf->alloclen);
+static void uart_match_cb(struct avr_irq_t *irq, uint32_t value, void *param) {
+	struct uart_matcher *m = param;
+	if (m->pos == m->len || (uint8_t)m->expected[m->pos] != (uint8_t)value) {
+		m->got = value;
+		if (special_deinit_jmpbuf)
+			longjmp(*special_deinit_jmpbuf, LJR_UART_MISMATCH);
+		return;
 	}
-	buf->str[buf->currlen++] = value;
-	buf->str[buf->currlen] = 0;
+	m->pos++;
+	if (m->pos == m->len && m->stop && special_deinit_jmpbuf)
+		longjmp(*special_deinit_jmpbuf, LJR_UART_MATCH);
 }
 
-static void init_output_buffer(struct output_buffer *buf) {
-	buf->str = malloc(128);
-	buf->str[0] = 0;
-	buf->currlen = 0;
-	buf->alloclen = 128;
-	buf->maxlen = 4096;
+// the expected bytes before the one at 'pos', for the messages
+static int uart_context(const struct uart_matcher *m, const char **start) {
+	size_t n = m->pos < 40 ? m->pos : 40;
+	*start = m->expected + m->pos - n;
+	return n;
 }
 
-void tests_assert_uart_receive_avr(avr_t *avr,
-			       unsigned long run_usec,
-			       const char *expected,
-			       char uart) {
-	struct output_buffer buf;
-	init_output_buffer(&buf);
-
-	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUTPUT),
-				buf_output_cb, &buf);
+static void uart_match(avr_t *avr,
+		       unsigned long run_usec,
+		       struct uart_matcher *m,
+		       char uart) {
+	avr_irq_t *irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart),
+				       UART_IRQ_OUTPUT);
+	if (!irq)
+		fail("No UART '%c' on this core", uart);
+	avr_irq_register_notify(irq, uart_match_cb, m);
 	enum tests_finish_reason reason = tests_run_test(avr, run_usec);
+	avr_irq_unregister_notify(irq, uart_match_cb, m);
+
+	const char *ctx;
+	int ctxlen = uart_context(m, &ctx);
+	if (reason == LJR_UART_MISMATCH) {
+		if (m->pos == m->len)
+			_fail(NULL, 0, "UART outputs differ: got 0x%02x after the "
+			      "%zu bytes expected, which end with \"%.*s\"",
+			      m->got, m->len, ctxlen, ctx);
+		_fail(NULL, 0, "UART outputs differ at byte %zu: expected 0x%02x, "
+		      "got 0x%02x, after \"%.*s\"", m->pos,
+		      (uint8_t)m->expected[m->pos], m->got, ctxlen, ctx);
+	}
+	if (reason == LJR_UART_MATCH)
+		return;
 	if (reason == LJR_CYCLE_TIMER) {
-		if (strcmp(buf.str, expected) == 0) {
+		if (m->pos == m->len)
 			_fail(NULL, 0, "Simulation did not finish within %lu simulated usec. "
 			     "UART output is correct and complete.", run_usec);
-		}
 		_fail(NULL, 0, "Simulation did not finish within %lu simulated usec. "
-		     "UART output so far: \"%s\"", run_usec, buf.str);
+		     "UART output correct for %zu bytes of %zu, up to \"%.*s\"",
+		     run_usec, m->pos, m->len, ctxlen, ctx);
+	}
+	if (m->pos != m->len)
+		_fail(NULL, 0, "UART output stopped after %zu bytes of %zu, "
+		      "at \"%.*s\"", m->pos, m->len, ctxlen, ctx);
+}
+
+void tests_assert_uart_receive_avr(avr_t *avr,
+			       unsigned long run_usec,
+			       const char *expected,
+			       char uart) {
+	struct uart_matcher m = { .expected = expected, .len = strlen(expected) };
+	uart_match(avr, run_usec, &m, uart);
+}
+
+void tests_assert_uart_stream_avr(avr_t *avr,
+			       unsigned long run_usec,
+			       const char *expected,
+			       size_t len,
+			       char uart) {
+	struct uart_matcher m = { .expected = expected, .len = len, .stop = 1 };
+	uart_match(avr, run_usec, &m, uart);
+}
+
+void tests_assert_uart_file_avr(avr_t *avr,
+			       unsigned long run_usec,
+			       const char *filename,
+			       char uart) {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st))
+		fail("Can't open the expected UART output \"%s\"", filename);
+	size_t len = st.st_size;
+	char *expected = NULL;
+	if (len) {
+#ifdef __MINGW32__
+		expected = malloc(len);
+		if (!expected || read(fd, expected, len) != len)
+			fail("Can't read the expected UART output \"%s\"", filename);
+#else
+		expected = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (expected == MAP_FAILED)
+			fail("Can't map the expected UART output \"%s\"", filename);
+#endif
 	}
-	if (strcmp(buf.str, expected) != 0)
-		_fail(NULL, 0, "UART outputs differ: expected \"%s\", got \"%s\"", expected, buf.str);
+	close(fd);
+	tests_assert_uart_stream_avr(avr, run_usec, expected, len, uart);
+#ifdef __MINGW32__
+	free(expected);
+#else
+	if (len)
+		munmap(expected, len);
+#endif
 }
 
 void tests_assert_uart_receive(const char *elfname,
@@ -6,6 +6,8 @@
 enum tests_finish_reason {
 	LJR_CYCLE_TIMER = 1,
 	LJR_SPECIAL_DEINIT = 2,
+	LJR_UART_MATCH = 3,		// all the expected output was received
+	LJR_UART_MISMATCH = 4,	// a byte differs from the expected output
 	// LJR_SLEEP_WITH_INT_OFF - LJR_SPECIAL_DEINIT happens...
 };
 
@@ -19,6 +21,15 @@ void __attribute__ ((noreturn,format (printf, 3, 4)))
 _fail(const char *filename, int linenum, const char *fmt, ...);
 
 avr_t *tests_init_avr(const char *elfname);
+// gives it back for the next tests_init_avr() of the same firmware
+void tests_release_avr(avr_t *avr);
+/*
+ * Sets the core up once, then serves runs of it on the fork server fds,
+ * see sim_forkserver.h: the process of each run gets it, as set up, and
+ * the server exits once there are no more. Without a server to talk to,
+ * it's returned as is, for one run.
+ */
+avr_t *tests_fork_server(const char *elfname);
 void tests_init(int argc, char **argv);
 void tests_success(void);
 
@@ -32,6 +43,20 @@ void tests_assert_uart_receive_avr(avr_t *avr,
 			       unsigned long run_usec,
 			       const char *expected,
 			       char uart);				   
+/*
+ * These check the output as it comes, and stop the simulation as soon as
+ * it differs, or is all there: it needn't finish. The file is mapped, it
+ * can be as large as needed.
+ */
+void tests_assert_uart_stream_avr(avr_t *avr,
+			       unsigned long run_usec,
+			       const char *expected,
+			       size_t len,
+			       char uart);
+void tests_assert_uart_file_avr(avr_t *avr,
+			       unsigned long run_usec,
+			       const char *filename,	// the expected output
+			       char uart);
 
 void tests_assert_cycles_at_least(unsigned long n);
 void tests_assert_cycles_at_most(unsigned long n);